@@ -0,0 +1,354 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/bitops.h"
+
+#include <absl/numeric/bits.h>
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+struct Kernels {
+  BitKernels id;
+  uint64_t (*count)(const uint8_t* data, size_t len);
+  void (*bit_and)(uint8_t* dest, const uint8_t* src, size_t len);
+  void (*bit_or)(uint8_t* dest, const uint8_t* src, size_t len);
+  void (*bit_xor)(uint8_t* dest, const uint8_t* src, size_t len);
+  void (*bit_not)(uint8_t* data, size_t len);
+
+  // Returns the index of the first byte that differs from skip, which is 0 or 0xff, or len.
+  size_t (*find)(const uint8_t* data, size_t len, uint8_t skip);
+};
+
+inline uint64_t Load64(const uint8_t* ptr) {
+  uint64_t res;
+  memcpy(&res, ptr, sizeof(res));
+  return res;
+}
+
+inline void Store64(uint8_t* ptr, uint64_t val) {
+  memcpy(ptr, &val, sizeof(val));
+}
+
+uint64_t CountGeneric(const uint8_t* data, size_t len) {
+  uint64_t res = 0;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8)
+    res += absl::popcount(Load64(data + i));
+  for (; i < len; ++i)
+    res += absl::popcount(data[i]);
+  return res;
+}
+
+template <typename Op> void ApplyGeneric(uint8_t* dest, const uint8_t* src, size_t len, Op op) {
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8)
+    Store64(dest + i, op(Load64(dest + i), Load64(src + i)));
+  for (; i < len; ++i)
+    dest[i] = op(dest[i], src[i]);
+}
+
+void AndGeneric(uint8_t* dest, const uint8_t* src, size_t len) {
+  ApplyGeneric(dest, src, len, [](auto l, auto r) { return l & r; });
+}
+
+void OrGeneric(uint8_t* dest, const uint8_t* src, size_t len) {
+  ApplyGeneric(dest, src, len, [](auto l, auto r) { return l | r; });
+}
+
+void XorGeneric(uint8_t* dest, const uint8_t* src, size_t len) {
+  ApplyGeneric(dest, src, len, [](auto l, auto r) { return l ^ r; });
+}
+
+void NotGeneric(uint8_t* data, size_t len) {
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8)
+    Store64(data + i, ~Load64(data + i));
+  for (; i < len; ++i)
+    data[i] = ~data[i];
+}
+
+size_t FindGeneric(const uint8_t* data, size_t len, uint8_t skip) {
+  const uint64_t skip64 = skip ? ~0ULL : 0;
+  size_t i = 0;
+  while (i + 8 <= len && Load64(data + i) == skip64)
+    i += 8;
+  while (i < len && data[i] == skip)
+    ++i;
+  return i;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("popcnt"))) uint64_t CountPopcnt(const uint8_t* data, size_t len) {
+  uint64_t res = 0;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8)
+    res += __builtin_popcountll(Load64(data + i));
+  for (; i < len; ++i)
+    res += __builtin_popcount(data[i]);
+  return res;
+}
+
+#define AVX2 __attribute__((target("avx2,popcnt")))
+
+// The counts of the bits of every 8 bytes, by looking up the counts of their nibbles.
+AVX2 inline __m256i Popcount256(__m256i v) {
+  const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1,
+                                          2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  __m256i lo = _mm256_and_si256(v, low_mask);
+  __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+  __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+  return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+}
+
+// Carry-save adder: h:l is the sum of the bits of a, b and c.
+AVX2 inline void CSA(__m256i* h, __m256i* l, __m256i a, __m256i b, __m256i c) {
+  __m256i u = _mm256_xor_si256(a, b);
+  *h = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+  *l = _mm256_xor_si256(u, c);
+}
+
+AVX2 inline __m256i Load256(const uint8_t* ptr) {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr));
+}
+
+AVX2 inline void Store256(uint8_t* ptr, __m256i val) {
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(ptr), val);
+}
+
+// Harley-Seal: a tree of carry-save adders reduces every 16 vectors to one vector of the bits
+// with weight 16, so only one in 16 vectors is counted with lookups.
+AVX2 uint64_t CountAvx2(const uint8_t* data, size_t len) {
+  __m256i total = _mm256_setzero_si256();
+  __m256i ones = _mm256_setzero_si256(), twos = _mm256_setzero_si256();
+  __m256i fours = _mm256_setzero_si256(), eights = _mm256_setzero_si256();
+  __m256i sixteens, twos_a, twos_b, fours_a, fours_b, eights_a, eights_b;
+
+  size_t i = 0;
+  for (; i + 16 * 32 <= len; i += 16 * 32) {
+    const uint8_t* p = data + i;
+    CSA(&twos_a, &ones, ones, Load256(p), Load256(p + 32));
+    CSA(&twos_b, &ones, ones, Load256(p + 64), Load256(p + 96));
+    CSA(&fours_a, &twos, twos, twos_a, twos_b);
+    CSA(&twos_a, &ones, ones, Load256(p + 128), Load256(p + 160));
+    CSA(&twos_b, &ones, ones, Load256(p + 192), Load256(p + 224));
+    CSA(&fours_b, &twos, twos, twos_a, twos_b);
+    CSA(&eights_a, &fours, fours, fours_a, fours_b);
+    CSA(&twos_a, &ones, ones, Load256(p + 256), Load256(p + 288));
+    CSA(&twos_b, &ones, ones, Load256(p + 320), Load256(p + 352));
+    CSA(&fours_a, &twos, twos, twos_a, twos_b);
+    CSA(&twos_a, &ones, ones, Load256(p + 384), Load256(p + 416));
+    CSA(&twos_b, &ones, ones, Load256(p + 448), Load256(p + 480));
+    CSA(&fours_b, &twos, twos, twos_a, twos_b);
+    CSA(&eights_b, &fours, fours, fours_a, fours_b);
+    CSA(&sixteens, &eights, eights, eights_a, eights_b);
+    total = _mm256_add_epi64(total, Popcount256(sixteens));
+  }
+
+  total = _mm256_slli_epi64(total, 4);
+  total = _mm256_add_epi64(total, _mm256_slli_epi64(Popcount256(eights), 3));
+  total = _mm256_add_epi64(total, _mm256_slli_epi64(Popcount256(fours), 2));
+  total = _mm256_add_epi64(total, _mm256_slli_epi64(Popcount256(twos), 1));
+  total = _mm256_add_epi64(total, Popcount256(ones));
+  for (; i + 32 <= len; i += 32)
+    total = _mm256_add_epi64(total, Popcount256(Load256(data + i)));
+
+  uint64_t res = _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+                 _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+  return res + CountPopcnt(data + i, len - i);
+}
+
+AVX2 void AndAvx2(uint8_t* dest, const uint8_t* src, size_t len) {
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32)
+    Store256(dest + i, _mm256_and_si256(Load256(dest + i), Load256(src + i)));
+  AndGeneric(dest + i, src + i, len - i);
+}
+
+AVX2 void OrAvx2(uint8_t* dest, const uint8_t* src, size_t len) {
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32)
+    Store256(dest + i, _mm256_or_si256(Load256(dest + i), Load256(src + i)));
+  OrGeneric(dest + i, src + i, len - i);
+}
+
+AVX2 void XorAvx2(uint8_t* dest, const uint8_t* src, size_t len) {
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32)
+    Store256(dest + i, _mm256_xor_si256(Load256(dest + i), Load256(src + i)));
+  XorGeneric(dest + i, src + i, len - i);
+}
+
+AVX2 void NotAvx2(uint8_t* data, size_t len) {
+  const __m256i all = _mm256_set1_epi8(-1);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32)
+    Store256(data + i, _mm256_xor_si256(Load256(data + i), all));
+  NotGeneric(data + i, len - i);
+}
+
+AVX2 size_t FindAvx2(const uint8_t* data, size_t len, uint8_t skip) {
+  const __m256i skip256 = _mm256_set1_epi8(skip);
+  size_t i = 0;
+
+  // Compares 128 bytes at a time and locates the byte once some of them differ.
+  for (; i + 128 <= len; i += 128) {
+    __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(Load256(data + i), skip256),
+                                  _mm256_cmpeq_epi8(Load256(data + i + 32), skip256));
+    eq = _mm256_and_si256(eq, _mm256_cmpeq_epi8(Load256(data + i + 64), skip256));
+    eq = _mm256_and_si256(eq, _mm256_cmpeq_epi8(Load256(data + i + 96), skip256));
+    if (uint32_t(_mm256_movemask_epi8(eq)) != 0xffffffff)
+      break;
+  }
+
+  for (; i + 32 <= len; i += 32) {
+    uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(Load256(data + i), skip256));
+    if (eq != 0xffffffff)
+      return i + __builtin_ctz(~eq);
+  }
+  return i + FindGeneric(data + i, len - i, skip);
+}
+
+#undef AVX2
+
+bool HasPopcnt() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("popcnt");
+}
+
+bool HasAvx2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+}
+
+const Kernels kAvx2Kernels{BitKernels::AVX2, CountAvx2, AndAvx2, OrAvx2,
+                           XorAvx2,          NotAvx2,   FindAvx2};
+
+#elif defined(__aarch64__)
+
+uint64_t CountNeon(const uint8_t* data, size_t len) {
+  uint64x2_t total = vdupq_n_u64(0);
+  size_t i = 0;
+  while (i + 16 <= len) {
+    // The byte counters do not overflow within 31 vectors of at most 8 bits per byte.
+    size_t end = i + min<size_t>((len - i) / 16, 31) * 16;
+    uint8x16_t acc = vdupq_n_u8(0);
+    for (; i < end; i += 16)
+      acc = vaddq_u8(acc, vcntq_u8(vld1q_u8(data + i)));
+    total = vpadalq_u32(total, vpaddlq_u16(vpaddlq_u8(acc)));
+  }
+  return vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1) + CountGeneric(data + i, len - i);
+}
+
+const Kernels kNeonKernels{BitKernels::NEON, CountNeon,  AndGeneric, OrGeneric,
+                           XorGeneric,       NotGeneric, FindGeneric};
+
+#endif
+
+const Kernels* GenericKernels() {
+#if defined(__x86_64__)
+  // Counting words needs the popcnt instruction, which is not part of the x86-64 baseline.
+  static const Kernels kernels{BitKernels::GENERIC,
+                               HasPopcnt() ? CountPopcnt : CountGeneric,
+                               AndGeneric,
+                               OrGeneric,
+                               XorGeneric,
+                               NotGeneric,
+                               FindGeneric};
+#else
+  static const Kernels kernels{BitKernels::GENERIC, CountGeneric, AndGeneric, OrGeneric,
+                               XorGeneric,          NotGeneric,   FindGeneric};
+#endif
+  return &kernels;
+}
+
+const Kernels* KernelsFor(BitKernels id) {
+  switch (id) {
+    case BitKernels::GENERIC:
+      return GenericKernels();
+    case BitKernels::AVX2:
+#if defined(__x86_64__)
+      return HasAvx2() ? &kAvx2Kernels : nullptr;
+#else
+      return nullptr;
+#endif
+    case BitKernels::NEON:
+#if defined(__aarch64__)
+      return &kNeonKernels;
+#else
+      return nullptr;
+#endif
+  }
+  return nullptr;
+}
+
+const Kernels* DefaultKernels() {
+  for (BitKernels id : {BitKernels::AVX2, BitKernels::NEON}) {
+    if (const Kernels* res = KernelsFor(id))
+      return res;
+  }
+  return GenericKernels();
+}
+
+const Kernels* active = DefaultKernels();
+
+}  // namespace
+
+uint64_t CountBits(const uint8_t* data, size_t len) {
+  return active->count(data, len);
+}
+
+void BitAnd(uint8_t* dest, const uint8_t* src, size_t len) {
+  active->bit_and(dest, src, len);
+}
+
+void BitOr(uint8_t* dest, const uint8_t* src, size_t len) {
+  active->bit_or(dest, src, len);
+}
+
+void BitXor(uint8_t* dest, const uint8_t* src, size_t len) {
+  active->bit_xor(dest, src, len);
+}
+
+void BitNot(uint8_t* data, size_t len) {
+  active->bit_not(data, len);
+}
+
+int64_t FindFirstBit(const uint8_t* data, size_t len, bool value) {
+  // The bytes without the value are all zeros when looking for a set bit, and all ones otherwise.
+  uint8_t skip = value ? 0 : 0xff;
+  size_t index = active->find(data, len, skip);
+  if (index == len)
+    return -1;
+
+  uint8_t byte = value ? data[index] : ~data[index];
+  return index * 8 + absl::countl_zero(byte);
+}
+
+BitKernels ActiveBitKernels() {
+  return active->id;
+}
+
+bool SelectBitKernels(BitKernels kernels) {
+  const Kernels* res = KernelsFor(kernels);
+  if (res)
+    active = res;
+  return res != nullptr;
+}
+
+}  // namespace dfly
@@ -0,0 +1,37 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace dfly {
+
+// Kernels for bitmaps, used by the BIT* commands. They process 64-bit words, or 256-bit vectors
+// when the CPU supports AVX2, which is detected at runtime. On arm, counting uses NEON.
+// Bits are numbered from the most significant bit of the first byte, as redis does.
+
+// Returns the number of bits that are set.
+uint64_t CountBits(const uint8_t* data, size_t len);
+
+// dest[i] = dest[i] op src[i] for every i < len.
+void BitAnd(uint8_t* dest, const uint8_t* src, size_t len);
+void BitOr(uint8_t* dest, const uint8_t* src, size_t len);
+void BitXor(uint8_t* dest, const uint8_t* src, size_t len);
+
+void BitNot(uint8_t* data, size_t len);
+
+// Returns the index of the first bit that equals value, or -1 if there is none.
+int64_t FindFirstBit(const uint8_t* data, size_t len, bool value);
+
+enum class BitKernels : uint8_t { GENERIC, AVX2, NEON };
+
+BitKernels ActiveBitKernels();
+
+// Switches all the kernels to an implementation, for tests and benchmarks. Returns false if the
+// CPU does not support it.
+bool SelectBitKernels(BitKernels kernels);
+
+}  // namespace dfly
@@ -0,0 +1,120 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/bitops.h"
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+class BitOpsTest : public ::testing::TestWithParam<BitKernels> {
+ protected:
+  void SetUp() override {
+    default_ = ActiveBitKernels();
+    if (!SelectBitKernels(GetParam()))
+      GTEST_SKIP() << "The CPU does not support the kernels";
+  }
+
+  void TearDown() override {
+    SelectBitKernels(default_);
+  }
+
+  static vector<uint8_t> RandomBytes(size_t len, mt19937* gen) {
+    vector<uint8_t> res(len);
+    for (auto& b : res)
+      b = (*gen)();
+    return res;
+  }
+
+  BitKernels default_;
+};
+
+INSTANTIATE_TEST_SUITE_P(Kernels, BitOpsTest,
+                         ::testing::Values(BitKernels::GENERIC, BitKernels::AVX2,
+                                           BitKernels::NEON));
+
+TEST_P(BitOpsTest, Count) {
+  mt19937 gen(GetParam() == BitKernels::GENERIC ? 1 : 2);
+
+  // Covers the tails of the vector loops and unaligned starts.
+  for (size_t len : {0, 1, 7, 8, 31, 32, 33, 511, 512, 513, 1000, 4096, 10001}) {
+    vector<uint8_t> data = RandomBytes(len + 3, &gen);
+    for (size_t offset : {0, 1, 3}) {
+      uint64_t expected = 0;
+      for (size_t i = 0; i < len; ++i)
+        expected += __builtin_popcount(data[offset + i]);
+      ASSERT_EQ(expected, CountBits(data.data() + offset, len)) << len << " " << offset;
+    }
+  }
+
+  vector<uint8_t> ones(100000, 0xff);
+  EXPECT_EQ(800000, CountBits(ones.data(), ones.size()));
+}
+
+TEST_P(BitOpsTest, Logical) {
+  mt19937 gen(3);
+  for (size_t len : {0, 5, 32, 77, 1024, 5000}) {
+    vector<uint8_t> left = RandomBytes(len, &gen), right = RandomBytes(len, &gen);
+
+    vector<uint8_t> res_and = left, res_or = left, res_xor = left, res_not = left;
+    BitAnd(res_and.data(), right.data(), len);
+    BitOr(res_or.data(), right.data(), len);
+    BitXor(res_xor.data(), right.data(), len);
+    BitNot(res_not.data(), len);
+
+    for (size_t i = 0; i < len; ++i) {
+      ASSERT_EQ(uint8_t(left[i] & right[i]), res_and[i]);
+      ASSERT_EQ(uint8_t(left[i] | right[i]), res_or[i]);
+      ASSERT_EQ(uint8_t(left[i] ^ right[i]), res_xor[i]);
+      ASSERT_EQ(uint8_t(~left[i]), res_not[i]);
+    }
+  }
+}
+
+TEST_P(BitOpsTest, FindFirst) {
+  vector<uint8_t> zeros(3000, 0), ones(3000, 0xff);
+  EXPECT_EQ(-1, FindFirstBit(zeros.data(), zeros.size(), true));
+  EXPECT_EQ(-1, FindFirstBit(ones.data(), ones.size(), false));
+  EXPECT_EQ(0, FindFirstBit(zeros.data(), zeros.size(), false));
+  EXPECT_EQ(-1, FindFirstBit(zeros.data(), 0, false));
+
+  for (size_t pos = 0; pos < 3000 * 8; pos += 37) {
+    zeros[pos / 8] = 0x80 >> (pos % 8);
+    ones[pos / 8] = ~zeros[pos / 8];
+    ASSERT_EQ(pos, FindFirstBit(zeros.data(), zeros.size(), true));
+    ASSERT_EQ(pos, FindFirstBit(ones.data(), ones.size(), false));
+    zeros[pos / 8] = 0;
+    ones[pos / 8] = 0xff;
+  }
+}
+
+// Benchmarks
+static void BM_CountBits(benchmark::State& state, BitKernels kernels) {
+  BitKernels prev = ActiveBitKernels();
+  if (!SelectBitKernels(kernels)) {
+    state.SkipWithError("not supported");
+    return;
+  }
+
+  vector<uint8_t> data(state.range(0), 0x5a);
+  uint64_t count = 0;
+  while (state.KeepRunning()) {
+    count += CountBits(data.data(), data.size());
+  }
+  CHECK_GT(count, 0u);
+  state.SetBytesProcessed(state.iterations() * data.size());
+  SelectBitKernels(prev);
+}
+BENCHMARK_CAPTURE(BM_CountBits, generic, BitKernels::GENERIC)->Arg(1 << 20);
+BENCHMARK_CAPTURE(BM_CountBits, avx2, BitKernels::AVX2)->Arg(1 << 20);
+BENCHMARK_CAPTURE(BM_CountBits, neon, BitKernels::NEON)->Arg(1 << 20);
+
+}  // namespace dfly
@@ -0,0 +1,243 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/bloom.h"
+
+#include <xxhash.h>
+
+#include <cmath>
+#include <cstring>
+#include <utility>
+
+#include "base/logging.h"
+
+using namespace std;
+
+namespace dfly {
+
+namespace {
+
+constexpr unsigned kBlockBits = Bloom::kBlockBytes * 8;
+constexpr unsigned kMaxHashes = 32;
+constexpr XXH64_hash_t kSeed = 0xc6a4a7935bd1e995ULL;
+
+// The false positive rate of a blocked filter with the given number of bits per entry once it
+// is full. The entries of a block follow a poisson distribution, and the rate is the sum of the
+// rates of the blocks weighted by their probability.
+double BlockedFpRate(double bits_per_entry, unsigned hash_cnt) {
+  double lambda = kBlockBits / bits_per_entry;
+  double log_lambda = log(lambda);
+  unsigned last = lambda + 12 * sqrt(lambda) + 32;
+  double res = 0;
+  for (unsigned i = 0; i <= last; ++i) {
+    double prob = exp(i * log_lambda - lambda - lgamma(i + 1.0));
+    double fill = 1 - exp(-double(hash_cnt) * i / kBlockBits);
+    res += prob * pow(fill, hash_cnt);
+  }
+  return res;
+}
+
+// The bits of an element in its block are drawn from a generator seeded by its hash.
+inline uint32_t NextBitIndex(uint64_t* state) {
+  *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return *state >> (64 - 9);
+}
+
+static_assert(kBlockBits == 1 << 9);
+
+}  // namespace
+
+Bloom::~Bloom() {
+  DCHECK(bitmap_ == nullptr) << "Destroy was not called";
+}
+
+Bloom::Bloom(Bloom&& other) noexcept
+    : bitmap_(exchange(other.bitmap_, nullptr)),
+      num_blocks_(exchange(other.num_blocks_, 0)),
+      hash_cnt_(other.hash_cnt_) {
+}
+
+Bloom& Bloom::operator=(Bloom&& other) noexcept {
+  DCHECK(bitmap_ == nullptr);
+  bitmap_ = exchange(other.bitmap_, nullptr);
+  num_blocks_ = exchange(other.num_blocks_, 0);
+  hash_cnt_ = other.hash_cnt_;
+  return *this;
+}
+
+void Bloom::Init(uint64_t entries, double fp_prob, pmr::memory_resource* mr) {
+  DCHECK_GT(entries, 0u);
+  DCHECK(fp_prob > 0 && fp_prob < 1);
+
+  hash_cnt_ = min<unsigned>(kMaxHashes, max(1.0, round(-log2(fp_prob))));
+
+  // Starts with the bits per entry of a classic filter and adds bits until the blocked layout
+  // reaches the rate.
+  double bits_per_entry = hash_cnt_ / M_LN2;
+  for (unsigned i = 0; i < 256 && BlockedFpRate(bits_per_entry, hash_cnt_) > fp_prob; ++i) {
+    bits_per_entry *= 1.02;
+  }
+
+  double bits = ceil(entries * bits_per_entry);
+  Allocate((uint64_t(bits) + kBlockBits - 1) / kBlockBits, mr);
+  memset(bitmap_, 0, num_blocks_ * kBlockBytes);
+}
+
+bool Bloom::Init(string_view bits, unsigned hash_cnt, pmr::memory_resource* mr) {
+  if (bits.empty() || bits.size() % kBlockBytes != 0 || hash_cnt == 0 || hash_cnt > kMaxHashes)
+    return false;
+
+  hash_cnt_ = hash_cnt;
+  Allocate(bits.size() / kBlockBytes, mr);
+  memcpy(bitmap_, bits.data(), bits.size());
+  return true;
+}
+
+void Bloom::Allocate(uint64_t num_blocks, pmr::memory_resource* mr) {
+  DCHECK(bitmap_ == nullptr);
+  num_blocks_ = num_blocks;
+  bitmap_ = reinterpret_cast<uint8_t*>(mr->allocate(num_blocks * kBlockBytes, kBlockBytes));
+}
+
+void Bloom::Destroy(pmr::memory_resource* mr) {
+  if (bitmap_) {
+    mr->deallocate(bitmap_, num_blocks_ * kBlockBytes, kBlockBytes);
+    bitmap_ = nullptr;
+    num_blocks_ = 0;
+  }
+}
+
+bool Bloom::Exists(const uint64_t hash[2]) const {
+  uint64_t block = (static_cast<unsigned __int128>(hash[0]) * num_blocks_) >> 64;
+  const uint8_t* ptr = bitmap_ + block * kBlockBytes;
+
+  uint64_t state = hash[1];
+  for (unsigned i = 0; i < hash_cnt_; ++i) {
+    uint32_t index = NextBitIndex(&state);
+    if ((ptr[index / 8] & (1 << (index % 8))) == 0)
+      return false;
+  }
+  return true;
+}
+
+bool Bloom::Add(const uint64_t hash[2]) {
+  uint64_t block = (static_cast<unsigned __int128>(hash[0]) * num_blocks_) >> 64;
+  uint8_t* ptr = bitmap_ + block * kBlockBytes;
+
+  uint8_t changed = 0;
+  uint64_t state = hash[1];
+  for (unsigned i = 0; i < hash_cnt_; ++i) {
+    uint32_t index = NextBitIndex(&state);
+    uint8_t mask = 1 << (index % 8);
+    changed |= ~ptr[index / 8] & mask;
+    ptr[index / 8] |= mask;
+  }
+  return changed != 0;
+}
+
+void Bloom::Hash(string_view element, uint64_t dest[2]) {
+  XXH128_hash_t hash = XXH3_128bits_withSeed(element.data(), element.size(), kSeed);
+  dest[0] = hash.low64;
+  dest[1] = hash.high64;
+}
+
+SBF::SBF(uint64_t initial_capacity, double fp_prob, double grow_factor, pmr::memory_resource* mr)
+    : filters_(mr), grow_factor_(grow_factor), fp_prob_(fp_prob), max_capacity_(initial_capacity) {
+  DCHECK_GE(grow_factor, 1);
+  filters_.emplace_back().Init(initial_capacity, fp_prob, mr);
+}
+
+SBF::SBF(double grow_factor, double fp_prob, uint64_t max_capacity, uint64_t prev_size,
+         uint64_t current_size, pmr::memory_resource* mr)
+    : filters_(mr),
+      grow_factor_(grow_factor),
+      fp_prob_(fp_prob),
+      prev_size_(prev_size),
+      current_size_(current_size),
+      max_capacity_(max_capacity) {
+}
+
+SBF::~SBF() {
+  Clear();
+}
+
+SBF::SBF(SBF&& other) noexcept
+    : filters_(std::move(other.filters_)),
+      grow_factor_(other.grow_factor_),
+      fp_prob_(other.fp_prob_),
+      prev_size_(other.prev_size_),
+      current_size_(other.current_size_),
+      max_capacity_(other.max_capacity_) {
+}
+
+SBF& SBF::operator=(SBF&& other) noexcept {
+  Clear();
+  filters_ = std::move(other.filters_);
+  other.filters_.clear();
+  grow_factor_ = other.grow_factor_;
+  fp_prob_ = other.fp_prob_;
+  prev_size_ = other.prev_size_;
+  current_size_ = other.current_size_;
+  max_capacity_ = other.max_capacity_;
+  return *this;
+}
+
+void SBF::Clear() {
+  pmr::memory_resource* mr = filters_.get_allocator().resource();
+  for (Bloom& filter : filters_) {
+    filter.Destroy(mr);
+  }
+  filters_.clear();
+}
+
+bool SBF::Add(string_view element) {
+  uint64_t hash[2];
+  Bloom::Hash(element, hash);
+
+  for (const Bloom& filter : filters_) {
+    if (filter.Exists(hash))
+      return false;
+  }
+
+  if (current_size_ >= max_capacity_) {
+    fp_prob_ /= 2;
+    max_capacity_ = max<uint64_t>(max_capacity_ + 1, max_capacity_ * grow_factor_);
+    filters_.emplace_back().Init(max_capacity_, fp_prob_, filters_.get_allocator().resource());
+    prev_size_ += current_size_;
+    current_size_ = 0;
+  }
+
+  filters_.back().Add(hash);
+  ++current_size_;
+  return true;
+}
+
+bool SBF::Exists(string_view element) const {
+  uint64_t hash[2];
+  Bloom::Hash(element, hash);
+
+  for (const Bloom& filter : filters_) {
+    if (filter.Exists(hash))
+      return true;
+  }
+  return false;
+}
+
+bool SBF::AddFilter(string_view bits, unsigned hash_cnt) {
+  Bloom filter;
+  if (!filter.Init(bits, hash_cnt, filters_.get_allocator().resource()))
+    return false;
+  filters_.push_back(std::move(filter));
+  return true;
+}
+
+size_t SBF::MallocUsed() const {
+  size_t res = filters_.capacity() * sizeof(Bloom);
+  for (const Bloom& filter : filters_) {
+    res += filter.bitlen() / 8;
+  }
+  return res;
+}
+
+}  // namespace dfly
@@ -0,0 +1,152 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <string_view>
+#include <vector>
+
+// The object type of scalable bloom filters, following OBJ_JSON.
+constexpr unsigned OBJ_SBF = 16;
+
+namespace dfly {
+
+// Bloom filter whose bits are split into blocks of a cache line. An element sets, and is looked
+// up by, bits of a single block, so that a lookup misses the cache at most once. Blocked filters
+// need more bits than classic ones for the same false positive rate, since the elements are not
+// evenly spread over the blocks. The filter is sized for the rate of its blocked layout.
+class Bloom {
+ public:
+  static constexpr unsigned kBlockBytes = 64;
+
+  Bloom() = default;
+  ~Bloom();
+
+  Bloom(Bloom&& other) noexcept;
+  Bloom& operator=(Bloom&& other) noexcept;
+
+  Bloom(const Bloom&) = delete;
+  Bloom& operator=(const Bloom&) = delete;
+
+  // Allocates a filter for the given number of entries so that once they are added, the rate of
+  // false positives is at most fp_prob. Requires: entries > 0, 0 < fp_prob < 1.
+  void Init(uint64_t entries, double fp_prob, std::pmr::memory_resource* mr);
+
+  // Allocates a filter with the bits of a filter that was serialized as data(). Returns false if
+  // the bits or the number of hash functions are not valid.
+  bool Init(std::string_view bits, unsigned hash_cnt, std::pmr::memory_resource* mr);
+
+  void Destroy(std::pmr::memory_resource* mr);
+
+  // hash is the 128 bit hash of the element, see Bloom::Hash.
+  bool Exists(const uint64_t hash[2]) const;
+
+  // Returns true if a bit was set, i.e. the element was not already in the filter.
+  bool Add(const uint64_t hash[2]);
+
+  unsigned hash_cnt() const {
+    return hash_cnt_;
+  }
+
+  size_t bitlen() const {
+    return num_blocks_ * kBlockBytes * 8;
+  }
+
+  std::string_view data() const {
+    return std::string_view{reinterpret_cast<const char*>(bitmap_), num_blocks_ * kBlockBytes};
+  }
+
+  static void Hash(std::string_view element, uint64_t dest[2]);
+
+ private:
+  void Allocate(uint64_t num_blocks, std::pmr::memory_resource* mr);
+
+  uint8_t* bitmap_ = nullptr;
+  uint64_t num_blocks_ = 0;
+  unsigned hash_cnt_ = 0;
+};
+
+// Scalable bloom filter: a chain of bloom filters that grows once the last filter is full.
+// Every new filter is grow_factor times larger than the previous one and has half of its false
+// positive rate, so that the rate of the chain stays close to the rate it was created with.
+class SBF {
+ public:
+  static constexpr double kDefaultFpProb = 0.01;
+  static constexpr uint64_t kDefaultCapacity = 100;
+  static constexpr double kDefaultGrowFactor = 2;
+
+  // Requires: initial_capacity > 0, 0 < fp_prob < 1, grow_factor >= 1.
+  SBF(uint64_t initial_capacity, double fp_prob, double grow_factor,
+      std::pmr::memory_resource* mr);
+
+  // Creates an empty chain for loading a serialized one with AddFilter. fp_prob is the rate of the
+  // last filter that is added and current_size the number of elements that were added to it.
+  SBF(double grow_factor, double fp_prob, uint64_t max_capacity, uint64_t prev_size,
+      uint64_t current_size, std::pmr::memory_resource* mr);
+
+  ~SBF();
+
+  SBF(SBF&& other) noexcept;
+  SBF& operator=(SBF&& other) noexcept;
+
+  // Returns true if the element was added, false if it is probably in the filter already.
+  bool Add(std::string_view element);
+
+  bool Exists(std::string_view element) const;
+
+  // Appends a filter from its serialized bits. Returns false if they are not valid.
+  bool AddFilter(std::string_view bits, unsigned hash_cnt);
+
+  size_t num_filters() const {
+    return filters_.size();
+  }
+
+  const Bloom& filter(size_t i) const {
+    return filters_[i];
+  }
+
+  // The number of elements that were added to the chain.
+  uint64_t Size() const {
+    return prev_size_ + current_size_;
+  }
+
+  double grow_factor() const {
+    return grow_factor_;
+  }
+
+  // The false positive rate of the last filter.
+  double fp_probability() const {
+    return fp_prob_;
+  }
+
+  uint64_t prev_size() const {
+    return prev_size_;
+  }
+
+  uint64_t current_size() const {
+    return current_size_;
+  }
+
+  // The capacity of the last filter.
+  uint64_t max_capacity() const {
+    return max_capacity_;
+  }
+
+  size_t MallocUsed() const;
+
+ private:
+  void Clear();
+
+  std::pmr::vector<Bloom> filters_;
+  double grow_factor_;
+  double fp_prob_;
+  uint64_t prev_size_ = 0;     // elements in all the filters but the last.
+  uint64_t current_size_ = 0;  // elements in the last filter.
+  uint64_t max_capacity_;
+};
+
+}  // namespace dfly
@@ -0,0 +1,141 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/bloom.h"
+
+#include <absl/strings/str_cat.h>
+
+#include <string>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+class BloomTest : public ::testing::Test {
+ protected:
+  // Returns the rate of false positives of the elements prefix0 .. prefix{n - 1}, which were
+  // not added to sbf.
+  static double FpRate(const SBF& sbf, const char* prefix, unsigned n) {
+    unsigned positives = 0;
+    for (unsigned i = 0; i < n; ++i) {
+      positives += sbf.Exists(absl::StrCat(prefix, i));
+    }
+    return double(positives) / n;
+  }
+
+  pmr::memory_resource* mr_ = pmr::get_default_resource();
+};
+
+TEST_F(BloomTest, Basic) {
+  SBF sbf(100, 0.01, 2, mr_);
+  EXPECT_FALSE(sbf.Exists("a"));
+  EXPECT_TRUE(sbf.Add("a"));
+  EXPECT_FALSE(sbf.Add("a"));
+  EXPECT_TRUE(sbf.Exists("a"));
+  EXPECT_FALSE(sbf.Exists("b"));
+  EXPECT_EQ(1, sbf.Size());
+  EXPECT_EQ(1, sbf.num_filters());
+
+  const Bloom& filter = sbf.filter(0);
+  EXPECT_EQ(7, filter.hash_cnt());
+  EXPECT_EQ(0, filter.bitlen() % (Bloom::kBlockBytes * 8));
+  EXPECT_GE(filter.bitlen(), 100 * 7 / M_LN2);
+  EXPECT_GT(sbf.MallocUsed(), filter.bitlen() / 8);
+}
+
+TEST_F(BloomTest, FpRate) {
+  for (double fp_prob : {0.1, 0.01, 0.001, 0.0001}) {
+    SBF sbf(100000, fp_prob, 2, mr_);
+    for (unsigned i = 0; i < 100000; ++i) {
+      sbf.Add(absl::StrCat("x", i));
+    }
+    EXPECT_EQ(1, sbf.num_filters());
+
+    // Every added element exists, some of them were false positives upon Add.
+    EXPECT_EQ(0, FpRate(sbf, "x", 100000) - 1);
+    double rate = FpRate(sbf, "y", 200000);
+    EXPECT_LT(rate, fp_prob * 1.1) << fp_prob;
+    EXPECT_GT(rate, fp_prob / 3) << fp_prob;
+  }
+}
+
+TEST_F(BloomTest, Scale) {
+  SBF sbf(100, 0.01, 2, mr_);
+  for (unsigned i = 0; i < 10000; ++i) {
+    sbf.Add(absl::StrCat("x", i));
+  }
+
+  // 100 + 200 + ... + 6400 elements.
+  EXPECT_EQ(7, sbf.num_filters());
+  EXPECT_EQ(0.01 / 64, sbf.fp_probability());
+  EXPECT_EQ(6400, sbf.max_capacity());
+  EXPECT_LE(sbf.Size(), 10000);
+  EXPECT_EQ(sbf.Size(), sbf.prev_size() + sbf.current_size());
+
+  EXPECT_EQ(1, FpRate(sbf, "x", 10000));
+  EXPECT_LT(FpRate(sbf, "y", 100000), 0.02);
+}
+
+TEST_F(BloomTest, Load) {
+  SBF sbf(100, 0.01, 3, mr_);
+  for (unsigned i = 0; i < 1000; ++i) {
+    sbf.Add(absl::StrCat("x", i));
+  }
+
+  SBF loaded(sbf.grow_factor(), sbf.fp_probability(), sbf.max_capacity(), sbf.prev_size(),
+             sbf.current_size(), mr_);
+  for (size_t i = 0; i < sbf.num_filters(); ++i) {
+    const Bloom& filter = sbf.filter(i);
+    ASSERT_TRUE(loaded.AddFilter(filter.data(), filter.hash_cnt()));
+  }
+  EXPECT_EQ(sbf.Size(), loaded.Size());
+  EXPECT_EQ(1, FpRate(loaded, "x", 1000));
+
+  // Both grow the same way.
+  for (unsigned i = 1000; i < 2000; ++i) {
+    EXPECT_EQ(sbf.Add(absl::StrCat("x", i)), loaded.Add(absl::StrCat("x", i)));
+  }
+  EXPECT_EQ(sbf.num_filters(), loaded.num_filters());
+
+  EXPECT_FALSE(loaded.AddFilter("", 7));
+  EXPECT_FALSE(loaded.AddFilter(string(100, 0), 7));
+  EXPECT_FALSE(loaded.AddFilter(string(64, 0), 0));
+  EXPECT_FALSE(loaded.AddFilter(string(64, 0), 33));
+}
+
+TEST_F(BloomTest, Move) {
+  SBF sbf(100, 0.01, 2, mr_);
+  sbf.Add("a");
+  SBF other(std::move(sbf));
+  EXPECT_TRUE(other.Exists("a"));
+
+  SBF third(10, 0.1, 2, mr_);
+  third = std::move(other);
+  EXPECT_TRUE(third.Exists("a"));
+  EXPECT_EQ(1, third.Size());
+}
+
+// Benchmarks
+static void BM_Exists(benchmark::State& state) {
+  SBF sbf(state.range(0), 0.01, 2, pmr::get_default_resource());
+  for (int64_t i = 0; i < state.range(0); ++i) {
+    sbf.Add(absl::StrCat(i));
+  }
+
+  vector<string> elements;
+  for (unsigned i = 0; i < 1024; ++i) {
+    elements.push_back(absl::StrCat(i * 7919));
+  }
+
+  unsigned i = 0;
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(sbf.Exists(elements[i++ % elements.size()]));
+  }
+}
+BENCHMARK(BM_Exists)->Arg(1 << 10)->Arg(1 << 24);
+
+}  // namespace dfly
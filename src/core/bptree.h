@@ -0,0 +1,662 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "base/logging.h"
+
+namespace dfly {
+
+template <typename T> struct BPTreePolicy {
+  static bool Less(const T& a, const T& b) {
+    return a < b;
+  }
+};
+
+// B+tree of unique keys ordered by Policy::Less. Besides the keys, inner nodes keep the
+// number of keys in each of their subtrees, so finding the rank of a key or the key
+// at a given rank takes O(log n) as well.
+// Nodes are kNodeSize bytes long and hold tens of keys each, hence a lookup touches a few
+// cache lines per level instead of a pointer per key. Leaves are linked in both directions
+// so range iteration is sequential.
+// T must be trivially copyable since keys are moved around with memcpy. The tree does not own
+// anything that T points to.
+// Iterators are invalidated by any modification of the tree.
+template <typename T, typename Policy = BPTreePolicy<T>> class BPTree {
+  static_assert(std::is_trivially_copyable_v<T>, "BPTree keys are copied with memcpy");
+
+  BPTree(const BPTree&) = delete;
+  BPTree& operator=(const BPTree&) = delete;
+
+  struct Node {
+    uint16_t num;  // number of keys.
+    bool leaf;
+  };
+
+ public:
+  static constexpr size_t kNodeSize = 512;
+  static constexpr unsigned kLeafCap = (kNodeSize - 3 * sizeof(void*)) / sizeof(T);
+  static constexpr unsigned kInnerCap = (kNodeSize - 2 * sizeof(void*) - sizeof(uint32_t)) /
+                                        (sizeof(T) + sizeof(void*) + sizeof(uint32_t));
+  static_assert(kLeafCap >= 4 && kInnerCap >= 4, "key type is too large");
+
+ private:
+  struct Leaf : public Node {
+    Leaf* prev;
+    Leaf* next;
+    T keys[kLeafCap];
+  };
+
+  // keys[i] is the minimal key of the subtree children[i + 1].
+  // counts[i] is the number of keys in the subtree children[i].
+  struct Inner : public Node {
+    T keys[kInnerCap];
+    Node* children[kInnerCap + 1];
+    uint32_t counts[kInnerCap + 1];
+  };
+
+ public:
+  class Iterator {
+    friend class BPTree;
+
+   public:
+    Iterator() = default;
+
+    bool IsEnd() const {
+      return leaf_ == nullptr;
+    }
+
+    const T& operator*() const {
+      return leaf_->keys[pos_];
+    }
+
+    const T* operator->() const {
+      return leaf_->keys + pos_;
+    }
+
+    Iterator& operator++() {
+      if (++pos_ == leaf_->num) {
+        leaf_ = leaf_->next;
+        pos_ = 0;
+      }
+      return *this;
+    }
+
+    // Decrementing an iterator that points to the first key turns it to the end iterator.
+    Iterator& operator--() {
+      if (pos_ == 0) {
+        leaf_ = leaf_->prev;
+        pos_ = leaf_ ? leaf_->num - 1 : 0;
+      } else {
+        --pos_;
+      }
+      return *this;
+    }
+
+    bool operator==(const Iterator& o) const {
+      return leaf_ == o.leaf_ && pos_ == o.pos_;
+    }
+
+    bool operator!=(const Iterator& o) const {
+      return !(*this == o);
+    }
+
+   private:
+    Iterator(Leaf* leaf, unsigned pos) : leaf_(leaf), pos_(pos) {
+    }
+
+    Leaf* leaf_ = nullptr;
+    unsigned pos_ = 0;
+  };
+
+  explicit BPTree(std::pmr::memory_resource* mr = std::pmr::get_default_resource()) : mr_(mr) {
+  }
+
+  ~BPTree() {
+    Clear();
+  }
+
+  // Returns false if an equal key already exists.
+  bool Insert(const T& key);
+
+  // Returns false if the key was not found.
+  bool Delete(const T& key);
+
+  bool Contains(const T& key) const {
+    return GetRank(key).has_value();
+  }
+
+  // Returns the 0-based rank of the key or nullopt if it does not exist.
+  std::optional<size_t> GetRank(const T& key) const;
+
+  // Returns the end iterator if rank >= Size().
+  Iterator AtRank(size_t rank) const;
+
+  // The tree is partitioned by is_before: is_before(key) is true for the keys that precede
+  // some bound and false for the rest. Returns the first key for which is_before is false,
+  // together with its rank. Returns {end, Size()} if there is no such key.
+  template <typename Pred> std::pair<Iterator, size_t> LowerBound(Pred&& is_before) const;
+
+  Iterator begin() const {
+    return AtRank(0);
+  }
+
+  Iterator end() const {
+    return Iterator{};
+  }
+
+  Iterator Last() const;
+
+  void Clear();
+
+  size_t Size() const {
+    return count_;
+  }
+
+  bool Empty() const {
+    return count_ == 0;
+  }
+
+  unsigned Height() const {
+    return height_;
+  }
+
+  size_t MallocUsed() const {
+    return num_leaves_ * sizeof(Leaf) + num_inners_ * sizeof(Inner);
+  }
+
+ private:
+  enum InsertResult { kExists, kInserted, kSplit };
+
+  struct SplitInfo {
+    T sep;
+    Node* right;
+    uint32_t right_count;
+  };
+
+  static Leaf* AsLeaf(Node* n) {
+    return static_cast<Leaf*>(n);
+  }
+
+  static Inner* AsInner(Node* n) {
+    return static_cast<Inner*>(n);
+  }
+
+  static unsigned MinKeys(const Node* n) {
+    return n->leaf ? kLeafCap / 2 : kInnerCap / 2;
+  }
+
+  // Index of the first key that is not less than key.
+  static unsigned LeafPos(const Leaf* leaf, const T& key) {
+    return std::lower_bound(leaf->keys, leaf->keys + leaf->num, key, &Policy::Less) - leaf->keys;
+  }
+
+  // Index of the child whose subtree should contain key.
+  static unsigned ChildIndex(const Inner* inner, const T& key) {
+    return std::upper_bound(inner->keys, inner->keys + inner->num, key, &Policy::Less) -
+           inner->keys;
+  }
+
+  template <typename U> static void InsertAt(U* arr, unsigned len, unsigned pos, const U& val) {
+    memmove(arr + pos + 1, arr + pos, (len - pos) * sizeof(U));
+    arr[pos] = val;
+  }
+
+  template <typename U> static void EraseAt(U* arr, unsigned len, unsigned pos) {
+    memmove(arr + pos, arr + pos + 1, (len - pos - 1) * sizeof(U));
+  }
+
+  Leaf* NewLeaf();
+  Inner* NewInner();
+  void FreeNode(Node* n);
+  void FreeTree(Node* n);
+
+  InsertResult InsertRec(Node* node, const T& key, SplitInfo* split);
+  void SplitInner(Inner* inner, unsigned i, const SplitInfo& child_split, SplitInfo* split);
+
+  bool DeleteRec(Node* node, const T& key, bool* min_changed, T* new_min);
+  void Rebalance(Inner* parent, unsigned i);
+  void BorrowFromLeft(Inner* parent, unsigned i);
+  void BorrowFromRight(Inner* parent, unsigned i);
+
+  // Merges children[i + 1] into children[i].
+  void Merge(Inner* parent, unsigned i);
+
+  std::pmr::memory_resource* mr_;
+  Node* root_ = nullptr;
+  size_t count_ = 0;
+  size_t num_leaves_ = 0;
+  size_t num_inners_ = 0;
+  unsigned height_ = 0;
+};
+
+template <typename T, typename Policy> bool BPTree<T, Policy>::Insert(const T& key) {
+  if (!root_) {
+    root_ = NewLeaf();
+    height_ = 1;
+  }
+
+  SplitInfo split;
+  InsertResult res = InsertRec(root_, key, &split);
+  if (res == kExists)
+    return false;
+
+  ++count_;
+  if (res == kSplit) {
+    Inner* root = NewInner();
+    root->num = 1;
+    root->keys[0] = split.sep;
+    root->children[0] = root_;
+    root->children[1] = split.right;
+    root->counts[0] = count_ - split.right_count;
+    root->counts[1] = split.right_count;
+    root_ = root;
+    ++height_;
+  }
+
+  return true;
+}
+
+template <typename T, typename Policy> bool BPTree<T, Policy>::Delete(const T& key) {
+  bool min_changed = false;
+  T new_min{};
+
+  if (!root_ || !DeleteRec(root_, key, &min_changed, &new_min))
+    return false;
+
+  --count_;
+  if (root_->num == 0) {
+    Node* child = root_->leaf ? nullptr : AsInner(root_)->children[0];
+    FreeNode(root_);
+    root_ = child;
+    --height_;
+  }
+
+  return true;
+}
+
+template <typename T, typename Policy>
+std::optional<size_t> BPTree<T, Policy>::GetRank(const T& key) const {
+  if (!root_)
+    return std::nullopt;
+
+  size_t rank = 0;
+  Node* n = root_;
+  while (!n->leaf) {
+    Inner* inner = AsInner(n);
+    unsigned i = ChildIndex(inner, key);
+    for (unsigned j = 0; j < i; ++j)
+      rank += inner->counts[j];
+    n = inner->children[i];
+  }
+
+  Leaf* leaf = AsLeaf(n);
+  unsigned pos = LeafPos(leaf, key);
+  if (pos == leaf->num || Policy::Less(key, leaf->keys[pos]))
+    return std::nullopt;
+
+  return rank + pos;
+}
+
+template <typename T, typename Policy>
+auto BPTree<T, Policy>::AtRank(size_t rank) const -> Iterator {
+  if (rank >= count_)
+    return Iterator{};
+
+  Node* n = root_;
+  while (!n->leaf) {
+    Inner* inner = AsInner(n);
+    unsigned i = 0;
+    while (rank >= inner->counts[i]) {
+      rank -= inner->counts[i];
+      ++i;
+    }
+    n = inner->children[i];
+  }
+
+  return Iterator{AsLeaf(n), unsigned(rank)};
+}
+
+template <typename T, typename Policy>
+template <typename Pred>
+auto BPTree<T, Policy>::LowerBound(Pred&& is_before) const -> std::pair<Iterator, size_t> {
+  if (!root_)
+    return {Iterator{}, 0};
+
+  size_t rank = 0;
+  Node* n = root_;
+  while (!n->leaf) {
+    Inner* inner = AsInner(n);
+
+    // If is_before(keys[i]) holds then it holds for the whole subtree children[i].
+    unsigned i = std::partition_point(inner->keys, inner->keys + inner->num, is_before) -
+                 inner->keys;
+    for (unsigned j = 0; j < i; ++j)
+      rank += inner->counts[j];
+    n = inner->children[i];
+  }
+
+  Leaf* leaf = AsLeaf(n);
+  unsigned pos = std::partition_point(leaf->keys, leaf->keys + leaf->num, is_before) - leaf->keys;
+  rank += pos;
+
+  // The bound is the first key of the next leaf.
+  if (pos == leaf->num)
+    return {Iterator{leaf->next, 0}, rank};
+
+  return {Iterator{leaf, pos}, rank};
+}
+
+template <typename T, typename Policy> auto BPTree<T, Policy>::Last() const -> Iterator {
+  if (!root_)
+    return Iterator{};
+
+  Node* n = root_;
+  while (!n->leaf) {
+    n = AsInner(n)->children[n->num];
+  }
+
+  return Iterator{AsLeaf(n), n->num - 1u};
+}
+
+template <typename T, typename Policy> void BPTree<T, Policy>::Clear() {
+  if (root_) {
+    FreeTree(root_);
+    root_ = nullptr;
+  }
+  count_ = 0;
+  height_ = 0;
+}
+
+template <typename T, typename Policy> auto BPTree<T, Policy>::NewLeaf() -> Leaf* {
+  void* ptr = mr_->allocate(sizeof(Leaf), alignof(Leaf));
+  Leaf* leaf = new (ptr) Leaf;
+  leaf->num = 0;
+  leaf->leaf = true;
+  leaf->prev = leaf->next = nullptr;
+  ++num_leaves_;
+
+  return leaf;
+}
+
+template <typename T, typename Policy> auto BPTree<T, Policy>::NewInner() -> Inner* {
+  void* ptr = mr_->allocate(sizeof(Inner), alignof(Inner));
+  Inner* inner = new (ptr) Inner;
+  inner->num = 0;
+  inner->leaf = false;
+  ++num_inners_;
+
+  return inner;
+}
+
+template <typename T, typename Policy> void BPTree<T, Policy>::FreeNode(Node* n) {
+  if (n->leaf) {
+    mr_->deallocate(n, sizeof(Leaf), alignof(Leaf));
+    --num_leaves_;
+  } else {
+    mr_->deallocate(n, sizeof(Inner), alignof(Inner));
+    --num_inners_;
+  }
+}
+
+template <typename T, typename Policy> void BPTree<T, Policy>::FreeTree(Node* n) {
+  if (!n->leaf) {
+    Inner* inner = AsInner(n);
+    for (unsigned i = 0; i <= inner->num; ++i) {
+      FreeTree(inner->children[i]);
+    }
+  }
+  FreeNode(n);
+}
+
+template <typename T, typename Policy>
+auto BPTree<T, Policy>::InsertRec(Node* node, const T& key, SplitInfo* split) -> InsertResult {
+  if (node->leaf) {
+    Leaf* leaf = AsLeaf(node);
+    unsigned pos = LeafPos(leaf, key);
+    if (pos < leaf->num && !Policy::Less(key, leaf->keys[pos]))
+      return kExists;
+
+    if (leaf->num < kLeafCap) {
+      InsertAt(leaf->keys, leaf->num, pos, key);
+      ++leaf->num;
+      return kInserted;
+    }
+
+    constexpr unsigned kMid = kLeafCap / 2;
+    Leaf* right = NewLeaf();
+    right->num = kLeafCap - kMid;
+    memcpy(right->keys, leaf->keys + kMid, right->num * sizeof(T));
+    leaf->num = kMid;
+
+    if (pos < kMid) {
+      InsertAt(leaf->keys, leaf->num, pos, key);
+      ++leaf->num;
+    } else {
+      InsertAt(right->keys, right->num, pos - kMid, key);
+      ++right->num;
+    }
+
+    right->next = leaf->next;
+    if (right->next)
+      right->next->prev = right;
+    right->prev = leaf;
+    leaf->next = right;
+
+    split->sep = right->keys[0];
+    split->right = right;
+    split->right_count = right->num;
+    return kSplit;
+  }
+
+  Inner* inner = AsInner(node);
+  unsigned i = ChildIndex(inner, key);
+  SplitInfo child_split;
+  InsertResult res = InsertRec(inner->children[i], key, &child_split);
+  if (res == kExists)
+    return kExists;
+
+  ++inner->counts[i];
+  if (res == kInserted)
+    return kInserted;
+
+  inner->counts[i] -= child_split.right_count;
+  if (inner->num < kInnerCap) {
+    InsertAt(inner->keys, inner->num, i, child_split.sep);
+    InsertAt(inner->children, inner->num + 1, i + 1, child_split.right);
+    InsertAt(inner->counts, inner->num + 1, i + 1, child_split.right_count);
+    ++inner->num;
+    return kInserted;
+  }
+
+  SplitInner(inner, i, child_split, split);
+  return kSplit;
+}
+
+template <typename T, typename Policy>
+void BPTree<T, Policy>::SplitInner(Inner* inner, unsigned i, const SplitInfo& child_split,
+                                   SplitInfo* split) {
+  constexpr unsigned kTotal = kInnerCap + 1;  // keys after the insertion.
+  constexpr unsigned kMid = kTotal / 2;
+
+  T keys[kTotal];
+  Node* children[kTotal + 1];
+  uint32_t counts[kTotal + 1];
+
+  memcpy(keys, inner->keys, kInnerCap * sizeof(T));
+  memcpy(children, inner->children, kTotal * sizeof(Node*));
+  memcpy(counts, inner->counts, kTotal * sizeof(uint32_t));
+  InsertAt(keys, kInnerCap, i, child_split.sep);
+  InsertAt(children, kTotal, i + 1, child_split.right);
+  InsertAt(counts, kTotal, i + 1, child_split.right_count);
+
+  Inner* right = NewInner();
+  inner->num = kMid;
+  right->num = kTotal - kMid - 1;
+
+  memcpy(inner->keys, keys, kMid * sizeof(T));
+  memcpy(inner->children, children, (kMid + 1) * sizeof(Node*));
+  memcpy(inner->counts, counts, (kMid + 1) * sizeof(uint32_t));
+
+  memcpy(right->keys, keys + kMid + 1, right->num * sizeof(T));
+  memcpy(right->children, children + kMid + 1, (right->num + 1) * sizeof(Node*));
+  memcpy(right->counts, counts + kMid + 1, (right->num + 1) * sizeof(uint32_t));
+
+  split->sep = keys[kMid];
+  split->right = right;
+  split->right_count = 0;
+  for (unsigned j = 0; j <= right->num; ++j)
+    split->right_count += right->counts[j];
+}
+
+template <typename T, typename Policy>
+bool BPTree<T, Policy>::DeleteRec(Node* node, const T& key, bool* min_changed, T* new_min) {
+  if (node->leaf) {
+    Leaf* leaf = AsLeaf(node);
+    unsigned pos = LeafPos(leaf, key);
+    if (pos == leaf->num || Policy::Less(key, leaf->keys[pos]))
+      return false;
+
+    EraseAt(leaf->keys, leaf->num, pos);
+    --leaf->num;
+
+    // Separators must reference existing keys, so the ancestor that holds the deleted key
+    // as a separator should be updated.
+    if (pos == 0 && leaf->num > 0) {
+      *min_changed = true;
+      *new_min = leaf->keys[0];
+    }
+    return true;
+  }
+
+  Inner* inner = AsInner(node);
+  unsigned i = ChildIndex(inner, key);
+  Node* child = inner->children[i];
+  if (!DeleteRec(child, key, min_changed, new_min))
+    return false;
+
+  --inner->counts[i];
+  if (*min_changed && i > 0) {
+    inner->keys[i - 1] = *new_min;
+    *min_changed = false;
+  }
+
+  if (child->num < MinKeys(child))
+    Rebalance(inner, i);
+
+  return true;
+}
+
+template <typename T, typename Policy> void BPTree<T, Policy>::Rebalance(Inner* parent, unsigned i) {
+  DCHECK_GT(parent->num, 0u);
+
+  if (i > 0 && parent->children[i - 1]->num > MinKeys(parent->children[i - 1])) {
+    BorrowFromLeft(parent, i);
+  } else if (i < parent->num && parent->children[i + 1]->num > MinKeys(parent->children[i + 1])) {
+    BorrowFromRight(parent, i);
+  } else if (i > 0) {
+    Merge(parent, i - 1);
+  } else {
+    Merge(parent, i);
+  }
+}
+
+template <typename T, typename Policy>
+void BPTree<T, Policy>::BorrowFromLeft(Inner* parent, unsigned i) {
+  Node* child = parent->children[i];
+  Node* left = parent->children[i - 1];
+  uint32_t moved;
+
+  if (child->leaf) {
+    Leaf* c = AsLeaf(child);
+    Leaf* l = AsLeaf(left);
+    InsertAt(c->keys, c->num, 0, l->keys[l->num - 1]);
+    parent->keys[i - 1] = c->keys[0];
+    moved = 1;
+  } else {
+    Inner* c = AsInner(child);
+    Inner* l = AsInner(left);
+    InsertAt(c->keys, c->num, 0, parent->keys[i - 1]);
+    InsertAt(c->children, c->num + 1, 0, l->children[l->num]);
+    InsertAt(c->counts, c->num + 1, 0, l->counts[l->num]);
+    parent->keys[i - 1] = l->keys[l->num - 1];
+    moved = c->counts[0];
+  }
+
+  ++child->num;
+  --left->num;
+  parent->counts[i - 1] -= moved;
+  parent->counts[i] += moved;
+}
+
+template <typename T, typename Policy>
+void BPTree<T, Policy>::BorrowFromRight(Inner* parent, unsigned i) {
+  Node* child = parent->children[i];
+  Node* right = parent->children[i + 1];
+  uint32_t moved;
+
+  if (child->leaf) {
+    Leaf* c = AsLeaf(child);
+    Leaf* r = AsLeaf(right);
+    c->keys[c->num] = r->keys[0];
+    EraseAt(r->keys, r->num, 0);
+    parent->keys[i] = r->keys[0];
+    moved = 1;
+  } else {
+    Inner* c = AsInner(child);
+    Inner* r = AsInner(right);
+    c->keys[c->num] = parent->keys[i];
+    c->children[c->num + 1] = r->children[0];
+    c->counts[c->num + 1] = r->counts[0];
+    parent->keys[i] = r->keys[0];
+    moved = r->counts[0];
+    EraseAt(r->keys, r->num, 0);
+    EraseAt(r->children, r->num + 1, 0);
+    EraseAt(r->counts, r->num + 1, 0);
+  }
+
+  ++child->num;
+  --right->num;
+  parent->counts[i] += moved;
+  parent->counts[i + 1] -= moved;
+}
+
+template <typename T, typename Policy> void BPTree<T, Policy>::Merge(Inner* parent, unsigned i) {
+  Node* left = parent->children[i];
+  Node* right = parent->children[i + 1];
+
+  if (left->leaf) {
+    Leaf* l = AsLeaf(left);
+    Leaf* r = AsLeaf(right);
+    memcpy(l->keys + l->num, r->keys, r->num * sizeof(T));
+    l->num += r->num;
+    l->next = r->next;
+    if (l->next)
+      l->next->prev = l;
+  } else {
+    Inner* l = AsInner(left);
+    Inner* r = AsInner(right);
+    l->keys[l->num] = parent->keys[i];
+    memcpy(l->keys + l->num + 1, r->keys, r->num * sizeof(T));
+    memcpy(l->children + l->num + 1, r->children, (r->num + 1) * sizeof(Node*));
+    memcpy(l->counts + l->num + 1, r->counts, (r->num + 1) * sizeof(uint32_t));
+    l->num += r->num + 1;
+  }
+  FreeNode(right);
+
+  parent->counts[i] += parent->counts[i + 1];
+  EraseAt(parent->keys, parent->num, i);
+  EraseAt(parent->children, parent->num + 1, i + 1);
+  EraseAt(parent->counts, parent->num + 1, i + 1);
+  --parent->num;
+}
+
+}  // namespace dfly
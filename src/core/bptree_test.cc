@@ -0,0 +1,146 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/bptree.h"
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <set>
+#include <vector>
+
+namespace dfly {
+
+using namespace std;
+
+using Tree = BPTree<uint64_t>;
+
+class BPTreeTest : public ::testing::Test {
+ protected:
+  // Verifies that the tree holds exactly the keys of the reference set in the same order,
+  // and that ranks and iteration in both directions agree with it.
+  void Check(const Tree& tree, const set<uint64_t>& ref) {
+    ASSERT_EQ(ref.size(), tree.Size());
+
+    auto it = tree.begin();
+    size_t rank = 0;
+    for (uint64_t val : ref) {
+      ASSERT_FALSE(it.IsEnd());
+      ASSERT_EQ(val, *it);
+      ASSERT_EQ(rank, tree.GetRank(val));
+      ++rank;
+      ++it;
+    }
+    ASSERT_TRUE(it.IsEnd());
+
+    it = tree.Last();
+    for (auto rit = ref.rbegin(); rit != ref.rend(); ++rit) {
+      ASSERT_FALSE(it.IsEnd());
+      ASSERT_EQ(*rit, *it);
+      --it;
+    }
+    ASSERT_TRUE(it.IsEnd());
+  }
+};
+
+TEST_F(BPTreeTest, Basic) {
+  Tree tree;
+  EXPECT_TRUE(tree.Empty());
+  EXPECT_TRUE(tree.begin().IsEnd());
+  EXPECT_TRUE(tree.Last().IsEnd());
+  EXPECT_FALSE(tree.Delete(1));
+
+  EXPECT_TRUE(tree.Insert(10));
+  EXPECT_TRUE(tree.Insert(5));
+  EXPECT_FALSE(tree.Insert(10));
+  EXPECT_EQ(2, tree.Size());
+  EXPECT_TRUE(tree.Contains(5));
+  EXPECT_FALSE(tree.Contains(7));
+  EXPECT_EQ(1, tree.GetRank(10));
+  EXPECT_EQ(5, *tree.AtRank(0));
+  EXPECT_TRUE(tree.AtRank(2).IsEnd());
+
+  EXPECT_TRUE(tree.Delete(5));
+  EXPECT_FALSE(tree.Delete(5));
+  EXPECT_TRUE(tree.Delete(10));
+  EXPECT_TRUE(tree.Empty());
+  EXPECT_EQ(0, tree.Height());
+  EXPECT_EQ(0, tree.MallocUsed());
+}
+
+TEST_F(BPTreeTest, Sequential) {
+  Tree tree;
+  set<uint64_t> ref;
+  constexpr unsigned kNum = 20000;
+
+  for (unsigned i = 0; i < kNum; ++i) {
+    ASSERT_TRUE(tree.Insert(i));
+    ref.insert(i);
+  }
+  Check(tree, ref);
+  EXPECT_GT(tree.Height(), 2u);
+
+  for (unsigned i = 0; i < kNum; ++i) {
+    ASSERT_EQ(i, *tree.AtRank(i));
+  }
+
+  // Deletes from the front, which keeps replacing the separators of the leftmost leaves.
+  for (unsigned i = 0; i < kNum / 2; ++i) {
+    ASSERT_TRUE(tree.Delete(i));
+    ref.erase(i);
+  }
+  Check(tree, ref);
+
+  for (unsigned i = kNum - 1; i >= kNum / 2; --i) {
+    ASSERT_TRUE(tree.Delete(i));
+  }
+  EXPECT_TRUE(tree.Empty());
+  EXPECT_EQ(0, tree.MallocUsed());
+}
+
+TEST_F(BPTreeTest, Random) {
+  Tree tree;
+  set<uint64_t> ref;
+  mt19937_64 gen(1);
+  uniform_int_distribution<uint64_t> dist(0, 50000);
+
+  for (unsigned i = 0; i < 200000; ++i) {
+    uint64_t val = dist(gen);
+    if (gen() % 3 == 0) {
+      ASSERT_EQ(ref.erase(val) > 0, tree.Delete(val));
+    } else {
+      ASSERT_EQ(ref.insert(val).second, tree.Insert(val));
+    }
+  }
+  Check(tree, ref);
+
+  for (uint64_t val : vector<uint64_t>(ref.begin(), ref.end())) {
+    if (val % 2) {
+      ASSERT_TRUE(tree.Delete(val));
+      ref.erase(val);
+    }
+  }
+  Check(tree, ref);
+}
+
+TEST_F(BPTreeTest, LowerBound) {
+  Tree tree;
+  for (uint64_t i = 0; i < 5000; ++i) {
+    tree.Insert(i * 10);
+  }
+
+  for (uint64_t bound : {0ul, 1ul, 10ul, 15ul, 12345ul, 49990ul}) {
+    auto [it, rank] = tree.LowerBound([bound](uint64_t val) { return val < bound; });
+    uint64_t expected = (bound + 9) / 10;
+    ASSERT_FALSE(it.IsEnd()) << bound;
+    EXPECT_EQ(expected * 10, *it) << bound;
+    EXPECT_EQ(expected, rank) << bound;
+  }
+
+  auto [it, rank] = tree.LowerBound([](uint64_t val) { return val < 49991; });
+  EXPECT_TRUE(it.IsEnd());
+  EXPECT_EQ(5000, rank);
+}
+
+}  // namespace dfly
@@ -0,0 +1,763 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/chunked_list.h"
+
+#include <absl/strings/str_cat.h>
+#include <lz4.h>
+
+#include <cstring>
+
+#include "base/logging.h"
+
+extern "C" {
+#include "redis/listpack.h"
+#include "redis/util.h"
+#include "redis/zmalloc.h"
+}
+
+using namespace std;
+
+namespace dfly {
+
+namespace {
+
+// The chunk size limits for a negative fill, as for quicklist.
+constexpr size_t kSizeLimits[] = {4096, 8192, 16384, 32768, 65536};
+
+// The size limit of a chunk for a positive fill.
+constexpr size_t kSafetyLimit = 8192;
+
+// A chunk is not worth compressing below this size.
+constexpr size_t kMinCompressSize = 48;
+
+// The largest header of a listpack entry, which bounds its size with the value.
+constexpr size_t kMaxEntryOverhead = 11;
+
+constexpr unsigned kFanout = 16;
+
+}  // namespace
+
+struct ChunkedList::Chunk {
+  Inner* parent;
+  Chunk* prev;
+  Chunk* next;
+
+  uint8_t* data;  // the listpack, or its LZ4 compression if compressed_len > 0.
+  uint32_t count;
+  uint32_t lp_len;
+  uint32_t compressed_len;
+  bool pinned;
+
+  size_t BlobLen() const {
+    return compressed_len ? compressed_len : lp_len;
+  }
+};
+
+// The children are chunks if bottom, inner nodes otherwise. counts[i] is the number of entries
+// under children[i].
+struct ChunkedList::Inner {
+  Inner* parent;
+  unsigned num;
+  bool bottom;
+  void* children[kFanout];
+  size_t counts[kFanout];
+
+  unsigned IndexOf(const void* child) const {
+    for (unsigned i = 0; i < num; ++i) {
+      if (children[i] == child)
+        return i;
+    }
+    LOG(FATAL) << "Child not found";
+    return 0;
+  }
+
+  size_t Total() const {
+    size_t res = 0;
+    for (unsigned i = 0; i < num; ++i)
+      res += counts[i];
+    return res;
+  }
+
+  void SetParent(unsigned i) {
+    if (bottom)
+      static_cast<Chunk*>(children[i])->parent = this;
+    else
+      static_cast<Inner*>(children[i])->parent = this;
+  }
+};
+
+namespace {
+
+ChunkedList::Entry ReadEntry(uint8_t* pos) {
+  ChunkedList::Entry res;
+  unsigned slen;
+  unsigned char* val = lpGetValue(pos, &slen, &res.lval);
+  if (val) {
+    res.value = reinterpret_cast<const char*>(val);
+    res.len = slen;
+  }
+  return res;
+}
+
+uint8_t* LpInsert(uint8_t* lp, uint32_t offset, string_view value) {
+  unsigned char* s = (unsigned char*)value.data();
+  if (offset == lpLength(lp))
+    return lpAppend(lp, s, value.size());
+
+  uint8_t* pos = lpSeek(lp, offset);
+  return lpInsertString(lp, s, value.size(), pos, LP_BEFORE, NULL);
+}
+
+}  // namespace
+
+string ChunkedList::Entry::ToString() const {
+  if (value)
+    return string(value, len);
+  return absl::StrCat(lval);
+}
+
+bool ChunkedList::Entry::operator==(string_view str) const {
+  if (value)
+    return str == string_view(value, len);
+  absl::AlphaNum an(lval);
+  return str == an.Piece();
+}
+
+// listpack stores as integers the strings that string2ll accepts, so only a pattern that
+// string2ll accepts can match an integer entry.
+ChunkedList::Pattern::Pattern(string_view value) : value_(value) {
+  is_int_ = string2ll(value.data(), value.size(), &lval_);
+}
+
+bool ChunkedList::Pattern::Matches(uint8_t* pos) const {
+  unsigned slen;
+  long long lval;
+  unsigned char* val = lpGetValue(pos, &slen, &lval);
+  if (!val)
+    return is_int_ && lval == lval_;
+
+  return slen == value_.size() && (slen == 0 || memcmp(val, value_.data(), slen) == 0);
+}
+
+ChunkedList::Iterator::Iterator(Iterator&& other) noexcept
+    : list_(other.list_), chunk_(other.chunk_), pos_(other.pos_), reverse_(other.reverse_) {
+  other.chunk_ = nullptr;
+}
+
+ChunkedList::Iterator::~Iterator() {
+  if (chunk_)
+    list_->Unpin(chunk_);
+}
+
+ChunkedList::Entry ChunkedList::Iterator::Get() const {
+  DCHECK(chunk_);
+  return ReadEntry(pos_);
+}
+
+void ChunkedList::Iterator::Next() {
+  DCHECK(chunk_);
+  pos_ = reverse_ ? lpPrev(chunk_->data, pos_) : lpNext(chunk_->data, pos_);
+  if (!pos_)
+    Enter(reverse_ ? chunk_->prev : chunk_->next);
+}
+
+size_t ChunkedList::Iterator::Seek(const Pattern& pattern, size_t limit) {
+  size_t skipped = 0;
+  while (chunk_ && skipped < limit) {
+    // A string entry keeps its bytes verbatim, so a chunk can hold a string pattern only if it
+    // contains its bytes. memmem rejects most chunks much faster than decoding their entries.
+    uint8_t* first = reverse_ ? lpLast(chunk_->data) : lpFirst(chunk_->data);
+    if (!pattern.is_int_ && pos_ == first && chunk_->count <= limit - skipped &&
+        !memmem(chunk_->data, chunk_->lp_len, pattern.value_.data(), pattern.value_.size())) {
+      skipped += chunk_->count;
+      Enter(reverse_ ? chunk_->prev : chunk_->next);
+      continue;
+    }
+
+    for (Chunk* chunk = chunk_; chunk_ == chunk && skipped < limit; ++skipped) {
+      if (pattern.Matches(pos_))
+        return skipped;
+      Next();
+    }
+  }
+  return skipped;
+}
+
+void ChunkedList::Iterator::Enter(Chunk* chunk) {
+  if (chunk_)
+    list_->Unpin(chunk_);
+
+  chunk_ = chunk;
+  pos_ = nullptr;
+  if (chunk) {
+    list_->Pin(chunk);
+    pos_ = reverse_ ? lpLast(chunk->data) : lpFirst(chunk->data);
+  }
+}
+
+ChunkedList::ChunkedList(int fill, unsigned compress_depth)
+    : fill_(fill), compress_depth_(compress_depth) {
+}
+
+ChunkedList::~ChunkedList() {
+  for (Chunk* chunk = head_; chunk;) {
+    Chunk* next = chunk->next;
+    zfree(chunk->data);
+    zfree(chunk);
+    chunk = next;
+  }
+
+  // Collects the inner nodes breadth first.
+  vector<Inner*> nodes;
+  if (root_)
+    nodes.push_back(root_);
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    Inner* node = nodes[i];
+    if (!node->bottom) {
+      for (unsigned j = 0; j < node->num; ++j)
+        nodes.push_back(static_cast<Inner*>(node->children[j]));
+    }
+  }
+  for (Inner* node : nodes)
+    zfree(node);
+}
+
+size_t ChunkedList::MallocUsed() const {
+  return sizeof(ChunkedList) + data_bytes_ + num_chunks_ * sizeof(Chunk) +
+         num_inner_ * sizeof(Inner);
+}
+
+void ChunkedList::Push(string_view value, Where where) {
+  if (where == HEAD)
+    InsertAt(head_, 0, value);
+  else
+    InsertAt(tail_, tail_ ? tail_->count : 0, value);
+}
+
+string ChunkedList::Pop(Where where) {
+  DCHECK(count_);
+  Chunk* chunk = where == HEAD ? head_ : tail_;
+  Pin(chunk);
+
+  uint8_t* pos = where == HEAD ? lpFirst(chunk->data) : lpLast(chunk->data);
+  string res = ReadEntry(pos).ToString();
+  SetListpack(chunk, lpDelete(chunk->data, pos, NULL));
+  AddCount(chunk, -1);
+  Unpin(chunk);
+
+  if (chunk->count == 0) {
+    UnlinkChunk(chunk);
+    FreeChunk(chunk);
+    UpdateCompression();
+  }
+  return res;
+}
+
+optional<string> ChunkedList::At(long index) {
+  if (index < 0)
+    index += count_;
+  if (index < 0 || size_t(index) >= count_)
+    return nullopt;
+
+  uint32_t offset;
+  Chunk* chunk = FindChunk(index, &offset);
+  Pin(chunk);
+  string res = ReadEntry(lpSeek(chunk->data, offset)).ToString();
+  Unpin(chunk);
+  return res;
+}
+
+bool ChunkedList::Replace(long index, string_view value) {
+  if (index < 0)
+    index += count_;
+  if (index < 0 || size_t(index) >= count_)
+    return false;
+
+  uint32_t offset;
+  Chunk* chunk = FindChunk(index, &offset);
+  Pin(chunk);
+  uint8_t* pos = lpSeek(chunk->data, offset);
+
+  // A value that does not fit replaces the entry through the insertion path, which may split
+  // the chunk.
+  if (chunk->count == 1 || Fits(chunk, value.size())) {
+    unsigned char* s = (unsigned char*)value.data();
+    SetListpack(chunk, lpReplace(chunk->data, &pos, s, value.size()));
+    Unpin(chunk);
+  } else {
+    SetListpack(chunk, lpDelete(chunk->data, pos, NULL));
+    AddCount(chunk, -1);
+    Unpin(chunk);
+    InsertAt(chunk, offset, value);
+  }
+  return true;
+}
+
+void ChunkedList::Erase(long start, size_t count) {
+  if (start < 0)
+    start += count_;
+  if (start < 0)
+    return;
+
+  bool unlinked = false;
+  while (count > 0 && size_t(start) < count_) {
+    uint32_t offset;
+    Chunk* chunk = FindChunk(start, &offset);
+    uint32_t num = min<size_t>(count, chunk->count - offset);
+    count -= num;
+
+    if (num == chunk->count) {
+      UnlinkChunk(chunk);
+      FreeChunk(chunk);
+      unlinked = true;
+      continue;
+    }
+
+    Pin(chunk);
+    SetListpack(chunk, lpDeleteRange(chunk->data, offset, num));
+    AddCount(chunk, -long(num));
+    Unpin(chunk);
+  }
+
+  if (unlinked)
+    UpdateCompression();
+}
+
+auto ChunkedList::GetIterator(long index, bool reverse) -> Iterator {
+  if (index < 0)
+    index += count_;
+  if (index < 0 || size_t(index) >= count_)
+    return Iterator(this, nullptr, nullptr, reverse);
+
+  uint32_t offset;
+  Chunk* chunk = FindChunk(index, &offset);
+  Pin(chunk);
+  return Iterator(this, chunk, lpSeek(chunk->data, offset), reverse);
+}
+
+void ChunkedList::Erase(Iterator* it) {
+  Chunk* chunk = it->chunk_;
+  DCHECK(chunk);
+
+  uint8_t* next = nullptr;
+  SetListpack(chunk, lpDelete(chunk->data, it->pos_, &next));
+  AddCount(chunk, -1);
+
+  if (chunk->count == 0) {
+    Chunk* dest = it->reverse_ ? chunk->prev : chunk->next;
+    chunk->pinned = false;
+    it->chunk_ = nullptr;
+    UnlinkChunk(chunk);
+    FreeChunk(chunk);
+    it->Enter(dest);
+    UpdateCompression();
+    return;
+  }
+
+  // next is the entry that followed the deleted one, or null if it was the last one.
+  if (it->reverse_)
+    it->pos_ = next ? lpPrev(chunk->data, next) : lpLast(chunk->data);
+  else
+    it->pos_ = next;
+
+  if (!it->pos_)
+    it->Enter(it->reverse_ ? chunk->prev : chunk->next);
+}
+
+void ChunkedList::Insert(Iterator&& it, string_view value, Where where) {
+  Chunk* chunk = it.chunk_;
+  DCHECK(chunk);
+
+  uint32_t offset = 0;
+  for (uint8_t* pos = lpFirst(chunk->data); pos != it.pos_; pos = lpNext(chunk->data, pos))
+    ++offset;
+  if (where == TAIL)
+    ++offset;
+
+  it.chunk_ = nullptr;
+  Unpin(chunk);
+  InsertAt(chunk, offset, value);
+}
+
+void ChunkedList::AppendListpack(uint8_t* lp) {
+  if (lpLength(lp) == 0) {
+    lpFree(lp);
+    return;
+  }
+
+  Chunk* chunk = NewChunk(lp);
+  uint32_t count = chunk->count;
+  chunk->count = 0;
+  LinkChunk(chunk, tail_);
+  AddCount(chunk, count);
+  UpdateCompression();
+}
+
+bool ChunkedList::ForEachListpack(const function<bool(const uint8_t* lp)>& cb) const {
+  string buf;
+  for (const Chunk* chunk = head_; chunk; chunk = chunk->next) {
+    const uint8_t* lp = chunk->data;
+    if (chunk->compressed_len) {
+      buf.resize(chunk->lp_len);
+      int res = LZ4_decompress_safe((const char*)chunk->data, buf.data(), chunk->compressed_len,
+                                    chunk->lp_len);
+      CHECK_EQ(res, int(chunk->lp_len));
+      lp = (const uint8_t*)buf.data();
+    }
+    if (!cb(lp))
+      return false;
+  }
+  return true;
+}
+
+size_t ChunkedList::ListpackBytes() const {
+  size_t res = 0;
+  for (const Chunk* chunk = head_; chunk; chunk = chunk->next)
+    res += chunk->lp_len;
+  return res;
+}
+
+size_t ChunkedList::Defrag(float ratio) {
+  size_t moved = 0;
+  for (Chunk* chunk = head_; chunk; chunk = chunk->next) {
+    if (chunk->pinned || !zmalloc_page_is_underutilized(chunk->data, ratio))
+      continue;
+
+    size_t len = chunk->BlobLen();
+    uint8_t* data = (uint8_t*)zmalloc(len);
+    memcpy(data, chunk->data, len);
+    zfree(chunk->data);
+    chunk->data = data;
+    moved += len;
+  }
+  return moved;
+}
+
+auto ChunkedList::FindChunk(size_t index, uint32_t* offset) const -> Chunk* {
+  DCHECK_LT(index, count_);
+  const Inner* node = root_;
+  while (true) {
+    unsigned i = 0;
+    while (index >= node->counts[i]) {
+      index -= node->counts[i];
+      ++i;
+      DCHECK_LT(i, node->num);
+    }
+
+    if (node->bottom) {
+      *offset = index;
+      return static_cast<Chunk*>(node->children[i]);
+    }
+    node = static_cast<const Inner*>(node->children[i]);
+  }
+}
+
+void ChunkedList::AddCount(Chunk* chunk, long delta) {
+  chunk->count += delta;
+  count_ += delta;
+
+  Propagate(chunk, chunk->parent, delta);
+}
+
+void ChunkedList::Propagate(const void* child, Inner* parent, long delta) {
+  for (Inner* node = parent; node; child = node, node = node->parent)
+    node->counts[node->IndexOf(child)] += delta;
+}
+
+// The chunk is linked with a zero count, which the caller then adds with AddCount.
+void ChunkedList::LinkChunk(Chunk* chunk, Chunk* prev) {
+  DCHECK_EQ(chunk->count, 0u);
+  Chunk* next = prev ? prev->next : head_;
+  chunk->prev = prev;
+  chunk->next = next;
+  (prev ? prev->next : head_) = chunk;
+  (next ? next->prev : tail_) = chunk;
+
+  if (!root_) {
+    root_ = (Inner*)zmalloc(sizeof(Inner));
+    root_->parent = nullptr;
+    root_->num = 0;
+    root_->bottom = true;
+    ++num_inner_;
+    InsertChild(root_, 0, chunk);
+  } else if (prev) {
+    InsertChild(prev->parent, prev->parent->IndexOf(prev) + 1, chunk);
+  } else {
+    InsertChild(next->parent, 0, chunk);
+  }
+}
+
+void ChunkedList::UnlinkChunk(Chunk* chunk) {
+  if (chunk->count)
+    AddCount(chunk, -long(chunk->count));
+
+  (chunk->prev ? chunk->prev->next : head_) = chunk->next;
+  (chunk->next ? chunk->next->prev : tail_) = chunk->prev;
+
+  Inner* parent = chunk->parent;
+  RemoveChild(parent, parent->IndexOf(chunk));
+}
+
+// Inserts child with a zero count, splitting the nodes that are full. Returns the node that
+// holds child.
+auto ChunkedList::InsertChild(Inner* node, unsigned pos, void* child) -> Inner* {
+  if (node->num == kFanout) {
+    constexpr unsigned kHalf = kFanout / 2;
+    Inner* right = (Inner*)zmalloc(sizeof(Inner));
+    ++num_inner_;
+    right->bottom = node->bottom;
+    right->num = kFanout - kHalf;
+    memcpy(right->children, node->children + kHalf, right->num * sizeof(void*));
+    memcpy(right->counts, node->counts + kHalf, right->num * sizeof(size_t));
+    for (unsigned i = 0; i < right->num; ++i)
+      right->SetParent(i);
+    node->num = kHalf;
+
+    // The entries of right leave the ancestors of node and join them again through right.
+    size_t right_count = right->Total();
+    Inner* parent = node->parent;
+    if (parent) {
+      Propagate(node, parent, -long(right_count));
+    } else {
+      parent = (Inner*)zmalloc(sizeof(Inner));
+      ++num_inner_;
+      parent->parent = nullptr;
+      parent->bottom = false;
+      parent->num = 1;
+      parent->children[0] = node;
+      parent->counts[0] = node->Total();
+      node->parent = parent;
+      root_ = parent;
+    }
+
+    InsertChild(parent, parent->IndexOf(node) + 1, right);
+    Propagate(right, right->parent, right_count);
+
+    if (pos > kHalf) {
+      node = right;
+      pos -= kHalf;
+    }
+  }
+
+  memmove(node->children + pos + 1, node->children + pos, (node->num - pos) * sizeof(void*));
+  memmove(node->counts + pos + 1, node->counts + pos, (node->num - pos) * sizeof(size_t));
+  node->children[pos] = child;
+  node->counts[pos] = 0;
+  ++node->num;
+  node->SetParent(pos);
+  return node;
+}
+
+// The child must have a zero count. Removes the nodes that become empty and collapses the root
+// while it has a single inner child.
+void ChunkedList::RemoveChild(Inner* node, unsigned pos) {
+  DCHECK_EQ(node->counts[pos], 0u);
+  --node->num;
+  memmove(node->children + pos, node->children + pos + 1, (node->num - pos) * sizeof(void*));
+  memmove(node->counts + pos, node->counts + pos + 1, (node->num - pos) * sizeof(size_t));
+
+  if (node->num == 0) {
+    Inner* parent = node->parent;
+    if (parent)
+      RemoveChild(parent, parent->IndexOf(node));
+    else
+      root_ = nullptr;
+    zfree(node);
+    --num_inner_;
+    return;
+  }
+
+  while (root_ && !root_->bottom && root_->num == 1) {
+    Inner* child = static_cast<Inner*>(root_->children[0]);
+    zfree(root_);
+    --num_inner_;
+    child->parent = nullptr;
+    root_ = child;
+  }
+}
+
+auto ChunkedList::NewChunk(uint8_t* lp) -> Chunk* {
+  Chunk* chunk = (Chunk*)zmalloc(sizeof(Chunk));
+  chunk->parent = nullptr;
+  chunk->prev = chunk->next = nullptr;
+  chunk->data = lp;
+  chunk->count = lpLength(lp);
+  chunk->lp_len = lpBytes(lp);
+  chunk->compressed_len = 0;
+  chunk->pinned = false;
+
+  ++num_chunks_;
+  data_bytes_ += chunk->lp_len;
+  return chunk;
+}
+
+void ChunkedList::FreeChunk(Chunk* chunk) {
+  data_bytes_ -= chunk->BlobLen();
+  --num_chunks_;
+  zfree(chunk->data);
+  zfree(chunk);
+}
+
+void ChunkedList::SetListpack(Chunk* chunk, uint8_t* lp) {
+  DCHECK_EQ(chunk->compressed_len, 0u);
+  size_t len = lpBytes(lp);
+  data_bytes_ = data_bytes_ + len - chunk->lp_len;
+  chunk->lp_len = len;
+  chunk->data = lp;
+}
+
+bool ChunkedList::Fits(const Chunk* chunk, size_t len) const {
+  size_t new_len = chunk->lp_len + len + kMaxEntryOverhead;
+  if (fill_ >= 0)
+    return chunk->count < size_t(max(fill_, 1)) && new_len <= kSafetyLimit;
+
+  size_t limit = kSizeLimits[min<size_t>(-fill_, size(kSizeLimits)) - 1];
+  return new_len <= limit;
+}
+
+// Inserts value at offset of chunk, or of a neighbour or a new chunk if it does not fit.
+// Inserting into an empty list passes a null chunk.
+void ChunkedList::InsertAt(Chunk* chunk, uint32_t offset, string_view value) {
+  bool linked = false;
+  if (!chunk) {
+    LinkChunk(NewChunk(lpNew(0)), nullptr);
+    chunk = head_;
+    linked = true;
+  } else if (!Fits(chunk, value.size())) {
+    linked = true;
+    if (offset == 0 && chunk->prev && Fits(chunk->prev, value.size())) {
+      chunk = chunk->prev;
+      offset = chunk->count;
+    } else if (offset == chunk->count && chunk->next && Fits(chunk->next, value.size())) {
+      chunk = chunk->next;
+      offset = 0;
+    } else if (offset == 0 || offset == chunk->count) {
+      Chunk* prev = offset == 0 ? chunk->prev : chunk;
+      LinkChunk(NewChunk(lpNew(0)), prev);
+      chunk = prev ? prev->next : head_;
+      offset = 0;
+    } else {
+      Chunk* right = Split(chunk, offset);
+      if (!Fits(chunk, value.size())) {
+        chunk = right;
+        offset = 0;
+        if (!Fits(right, value.size())) {
+          LinkChunk(NewChunk(lpNew(0)), right->prev);
+          chunk = right->prev;
+        }
+      }
+    }
+  }
+
+  Pin(chunk);
+  SetListpack(chunk, LpInsert(chunk->data, offset, value));
+  AddCount(chunk, 1);
+  Unpin(chunk);
+
+  if (linked)
+    UpdateCompression();
+}
+
+// Moves the entries of chunk from offset on into a new chunk that follows it.
+auto ChunkedList::Split(Chunk* chunk, uint32_t offset) -> Chunk* {
+  Pin(chunk);
+  uint8_t* copy = (uint8_t*)zmalloc(chunk->lp_len);
+  memcpy(copy, chunk->data, chunk->lp_len);
+
+  uint32_t moved = chunk->count - offset;
+  SetListpack(chunk, lpDeleteRange(chunk->data, offset, moved));
+  AddCount(chunk, -long(moved));
+
+  Chunk* right = NewChunk(lpDeleteRange(copy, 0, offset));
+  right->count = 0;
+  LinkChunk(right, chunk);
+  AddCount(right, moved);
+
+  Unpin(chunk);
+  Unpin(right);
+  return right;
+}
+
+void ChunkedList::Pin(Chunk* chunk) {
+  Decompress(chunk);
+  chunk->pinned = true;
+}
+
+void ChunkedList::Unpin(Chunk* chunk) {
+  chunk->pinned = false;
+  if (IsInterior(chunk))
+    Compress(chunk);
+}
+
+void ChunkedList::Compress(Chunk* chunk) {
+  if (chunk->pinned || chunk->compressed_len || chunk->lp_len < kMinCompressSize)
+    return;
+
+  thread_local string buf;
+  buf.resize(LZ4_compressBound(chunk->lp_len));
+  int res = LZ4_compress_default((const char*)chunk->data, buf.data(), chunk->lp_len, buf.size());
+
+  // Keeps the chunk as is unless compression saves at least a few bytes.
+  if (res <= 0 || size_t(res) + 8 >= chunk->lp_len)
+    return;
+
+  uint8_t* data = (uint8_t*)zmalloc(res);
+  memcpy(data, buf.data(), res);
+  zfree(chunk->data);
+  chunk->data = data;
+  chunk->compressed_len = res;
+  data_bytes_ = data_bytes_ + res - chunk->lp_len;
+}
+
+void ChunkedList::Decompress(Chunk* chunk) {
+  if (!chunk->compressed_len)
+    return;
+
+  uint8_t* lp = (uint8_t*)zmalloc(chunk->lp_len);
+  int res = LZ4_decompress_safe((const char*)chunk->data, (char*)lp, chunk->compressed_len,
+                                chunk->lp_len);
+  CHECK_EQ(res, int(chunk->lp_len));
+
+  zfree(chunk->data);
+  chunk->data = lp;
+  data_bytes_ = data_bytes_ + chunk->lp_len - chunk->compressed_len;
+  chunk->compressed_len = 0;
+}
+
+bool ChunkedList::IsInterior(const Chunk* chunk) const {
+  if (compress_depth_ == 0)
+    return false;
+
+  const Chunk* prev = chunk->prev;
+  const Chunk* next = chunk->next;
+  for (unsigned i = 0; i < compress_depth_; ++i) {
+    if (!prev || !next)
+      return false;
+    prev = prev->prev;
+    next = next->next;
+  }
+  return true;
+}
+
+void ChunkedList::UpdateCompression() {
+  if (compress_depth_ == 0)
+    return;
+
+  Chunk* fwd = head_;
+  Chunk* back = tail_;
+  for (unsigned i = 0; i < compress_depth_ && fwd; ++i) {
+    Decompress(fwd);
+    Decompress(back);
+    fwd = fwd->next;
+    back = back->prev;
+  }
+
+  if (fwd && IsInterior(fwd))
+    Compress(fwd);
+  if (back && IsInterior(back))
+    Compress(back);
+}
+
+}  // namespace dfly
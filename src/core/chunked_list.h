@@ -0,0 +1,192 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace dfly {
+
+// List of strings, used for the list type instead of the redis quicklist. The entries are kept
+// in chunks, each a listpack of up to a fill limit. The chunks are linked in both directions and
+// are the leaves of a B-tree whose inner nodes count the entries in each of their subtrees, so
+// the entry at an index is found in O(log n) rather than by walking the chunks. Pushes and pops
+// touch only the chunks at the ends.
+// With compress_depth > 0, the chunks farther than compress_depth chunks from both ends are kept
+// LZ4 compressed, and are decompressed in place for the duration of an access.
+class ChunkedList {
+  struct Chunk;
+  struct Inner;
+
+ public:
+  enum Where : uint8_t { HEAD, TAIL };
+
+  // An entry as listpack stores it: a string, or an integer if value is null.
+  struct Entry {
+    const char* value = nullptr;
+    size_t len = 0;
+    long long lval = 0;
+
+    std::string ToString() const;
+    bool operator==(std::string_view str) const;
+  };
+
+  // A value prepared for scanning the list with Iterator::Seek. It refers to the memory of the
+  // value. The value matches the entries that are equal to it, whether they are stored
+  // as strings or integers.
+  class Pattern {
+    friend class ChunkedList;
+
+   public:
+    explicit Pattern(std::string_view value);
+
+    bool Matches(uint8_t* pos) const;
+
+   private:
+    std::string_view value_;
+    long long lval_ = 0;
+    bool is_int_ = false;
+  };
+
+  // Iterates over the entries towards the tail, or towards the head if reverse. The entry it
+  // returns is valid until it moves. It keeps its chunk decompressed, so it must be destroyed
+  // before the list is modified other than through it.
+  class Iterator {
+    friend class ChunkedList;
+
+   public:
+    Iterator(Iterator&& other) noexcept;
+    ~Iterator();
+
+    Iterator& operator=(Iterator&&) = delete;
+
+    bool Done() const {
+      return chunk_ == nullptr;
+    }
+
+    Entry Get() const;
+    void Next();
+
+    // Moves to the first entry that matches pattern, starting at the current entry and skipping
+    // at most limit entries. Returns the number of entries skipped. The iterator is then at a
+    // matching entry, unless it is Done or limit entries were skipped. The chunks whose bytes do
+    // not contain a string pattern are skipped as a whole, without decoding their entries.
+    size_t Seek(const Pattern& pattern, size_t limit = std::numeric_limits<size_t>::max());
+
+   private:
+    Iterator(ChunkedList* list, Chunk* chunk, uint8_t* pos, bool reverse)
+        : list_(list), chunk_(chunk), pos_(pos), reverse_(reverse) {
+    }
+
+    // Moves to the first entry of chunk in the direction of the iterator.
+    void Enter(Chunk* chunk);
+
+    ChunkedList* list_;
+    Chunk* chunk_;
+    uint8_t* pos_;
+    bool reverse_;
+  };
+
+  // fill and compress_depth have the semantics of --list_max_listpack_size and
+  // --list_compress_depth.
+  explicit ChunkedList(int fill = -2, unsigned compress_depth = 0);
+  ~ChunkedList();
+
+  ChunkedList(const ChunkedList&) = delete;
+  ChunkedList& operator=(const ChunkedList&) = delete;
+
+  size_t Size() const {
+    return count_;
+  }
+
+  size_t NumChunks() const {
+    return num_chunks_;
+  }
+
+  size_t MallocUsed() const;
+
+  void Push(std::string_view value, Where where);
+
+  // The list must not be empty.
+  std::string Pop(Where where);
+
+  // Negative indices count from the tail, -1 being the last entry.
+  std::optional<std::string> At(long index);
+
+  // Returns false if the index is out of range.
+  bool Replace(long index, std::string_view value);
+
+  // Deletes up to count entries starting at the index start.
+  void Erase(long start, size_t count);
+
+  // Returns an iterator at the entry at index, which is Done if the index is out of range.
+  Iterator GetIterator(long index, bool reverse = false);
+
+  // Deletes the entry of it, which moves to the next entry.
+  void Erase(Iterator* it);
+
+  // Inserts value before (HEAD) or after (TAIL) the entry of it, which is consumed.
+  void Insert(Iterator&& it, std::string_view value, Where where);
+
+  // Appends lp as the last chunk and takes its ownership. The chunk is not bound by the fill.
+  void AppendListpack(uint8_t* lp);
+
+  // Calls cb with the decompressed listpack of every chunk from head to tail. Stops as soon as
+  // cb returns false and returns false then.
+  bool ForEachListpack(const std::function<bool(const uint8_t* lp)>& cb) const;
+
+  // The total size of the decompressed listpacks.
+  size_t ListpackBytes() const;
+
+  // Reallocates the chunks that reside on memory pages whose utilization is below ratio.
+  // Returns the number of bytes that were moved.
+  size_t Defrag(float ratio);
+
+ private:
+  // Tree maintenance.
+  Chunk* FindChunk(size_t index, uint32_t* offset) const;
+  void AddCount(Chunk* chunk, long delta);
+  static void Propagate(const void* child, Inner* parent, long delta);
+  void LinkChunk(Chunk* chunk, Chunk* prev);  // at the head if prev is null.
+  void UnlinkChunk(Chunk* chunk);
+  Inner* InsertChild(Inner* node, unsigned pos, void* child);
+  void RemoveChild(Inner* node, unsigned pos);
+
+  // Chunk maintenance.
+  Chunk* NewChunk(uint8_t* lp);
+  void FreeChunk(Chunk* chunk);
+  void SetListpack(Chunk* chunk, uint8_t* lp);
+  bool Fits(const Chunk* chunk, size_t len) const;
+  void InsertAt(Chunk* chunk, uint32_t offset, std::string_view value);
+  Chunk* Split(Chunk* chunk, uint32_t offset);
+
+  // A pinned chunk stays decompressed until it is unpinned.
+  void Pin(Chunk* chunk);
+  void Unpin(Chunk* chunk);
+  void Compress(Chunk* chunk);
+  void Decompress(Chunk* chunk);
+  bool IsInterior(const Chunk* chunk) const;
+
+  // Decompresses the chunks within the compress depth and compresses the ones right past it,
+  // after the chunks at the ends changed.
+  void UpdateCompression();
+
+  Inner* root_ = nullptr;
+  Chunk* head_ = nullptr;
+  Chunk* tail_ = nullptr;
+
+  size_t count_ = 0;
+  size_t num_chunks_ = 0, num_inner_ = 0;
+  size_t data_bytes_ = 0;  // of the chunk blobs, compressed or not.
+
+  int fill_;
+  unsigned compress_depth_;
+};
+
+}  // namespace dfly
@@ -0,0 +1,317 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/chunked_list.h"
+
+#include <absl/strings/str_cat.h>
+#include <mimalloc.h>
+
+#include <deque>
+#include <random>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+extern "C" {
+#include "redis/listpack.h"
+#include "redis/zmalloc.h"
+}
+
+namespace dfly {
+
+using namespace std;
+using absl::StrCat;
+
+class ChunkedListTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    auto* tlh = mi_heap_get_backing();
+    init_zmalloc_threadlocal(tlh);
+  }
+
+  void TearDown() override {
+    // ensure there are no memory leaks after every test
+    EXPECT_EQ(zmalloc_used_memory_tl, 0);
+  }
+
+  static vector<string> Entries(ChunkedList* list, bool reverse = false) {
+    vector<string> res;
+    for (auto it = list->GetIterator(reverse ? -1 : 0, reverse); !it.Done(); it.Next())
+      res.push_back(it.Get().ToString());
+    return res;
+  }
+
+  static vector<string> Entries(const deque<string>& expected) {
+    return vector<string>(expected.begin(), expected.end());
+  }
+};
+
+TEST_F(ChunkedListTest, Basic) {
+  ChunkedList list;
+  list.Push("b", ChunkedList::TAIL);
+  list.Push("a", ChunkedList::HEAD);
+  list.Push("123", ChunkedList::TAIL);
+  EXPECT_EQ(3, list.Size());
+  EXPECT_EQ((vector<string>{"a", "b", "123"}), Entries(&list));
+  EXPECT_EQ((vector<string>{"123", "b", "a"}), Entries(&list, true));
+
+  EXPECT_EQ("123", list.At(-1));
+  EXPECT_EQ("a", list.At(0));
+  EXPECT_FALSE(list.At(3));
+  EXPECT_FALSE(list.At(-4));
+
+  {
+    auto it = list.GetIterator(2);
+    EXPECT_TRUE(it.Get() == "123");
+    EXPECT_EQ(nullptr, it.Get().value);
+  }
+
+  EXPECT_TRUE(list.Replace(1, "c"));
+  EXPECT_FALSE(list.Replace(5, "c"));
+  EXPECT_EQ("a", list.Pop(ChunkedList::HEAD));
+  EXPECT_EQ("123", list.Pop(ChunkedList::TAIL));
+  EXPECT_EQ("c", list.Pop(ChunkedList::TAIL));
+  EXPECT_EQ(0, list.Size());
+  EXPECT_TRUE(list.GetIterator(0).Done());
+}
+
+TEST_F(ChunkedListTest, Index) {
+  ChunkedList list(8);
+  for (unsigned i = 0; i < 10000; ++i)
+    list.Push(StrCat("v", i), ChunkedList::TAIL);
+
+  for (unsigned i = 0; i < 10000; i += 7) {
+    ASSERT_EQ(StrCat("v", i), list.At(i));
+    ASSERT_EQ(StrCat("v", i), list.At(long(i) - 10000));
+  }
+
+  // Deletes whole chunks as well as parts of chunks.
+  list.Erase(5, 9000);
+  EXPECT_EQ(1000, list.Size());
+  EXPECT_EQ("v4", list.At(4));
+  EXPECT_EQ("v9005", list.At(5));
+
+  list.Erase(-10, 100);
+  EXPECT_EQ(990, list.Size());
+  EXPECT_EQ("v9989", list.At(-1));
+}
+
+TEST_F(ChunkedListTest, IteratorErase) {
+  ChunkedList list(4);
+  for (unsigned i = 0; i < 100; ++i)
+    list.Push(StrCat(i % 3), ChunkedList::TAIL);
+
+  for (auto it = list.GetIterator(0); !it.Done();) {
+    if (it.Get() == "1")
+      list.Erase(&it);
+    else
+      it.Next();
+  }
+  EXPECT_EQ(67, list.Size());
+
+  for (auto it = list.GetIterator(-1, true); !it.Done();) {
+    if (it.Get() == "0")
+      list.Erase(&it);
+    else
+      it.Next();
+  }
+  EXPECT_EQ(33, list.Size());
+  EXPECT_EQ(vector<string>(33, "2"), Entries(&list));
+}
+
+TEST_F(ChunkedListTest, Insert) {
+  ChunkedList list(-1);
+  list.Push("a", ChunkedList::TAIL);
+  list.Push("c", ChunkedList::TAIL);
+  list.Insert(list.GetIterator(1), "b", ChunkedList::HEAD);
+  list.Insert(list.GetIterator(2), "d", ChunkedList::TAIL);
+  EXPECT_EQ((vector<string>{"a", "b", "c", "d"}), Entries(&list));
+
+  // Values that do not fit next to their neighbours split the chunk.
+  string big(3000, 'x');
+  list.Insert(list.GetIterator(1), big, ChunkedList::TAIL);
+  list.Insert(list.GetIterator(1), big, ChunkedList::TAIL);
+  EXPECT_EQ((vector<string>{"a", "b", big, big, "c", "d"}), Entries(&list));
+  EXPECT_TRUE(list.Replace(0, string(5000, 'y')));
+  EXPECT_EQ(string(5000, 'y'), list.At(0));
+  EXPECT_EQ(6, list.Size());
+}
+
+TEST_F(ChunkedListTest, Listpacks) {
+  ChunkedList list;
+  for (unsigned i = 0; i < 3; ++i) {
+    uint8_t* lp = lpNew(0);
+    for (unsigned j = 0; j < 10; ++j) {
+      string val = StrCat(i * 10 + j);
+      lp = lpAppend(lp, (const unsigned char*)val.data(), val.size());
+    }
+    list.AppendListpack(lp);
+  }
+  EXPECT_EQ(30, list.Size());
+  EXPECT_EQ("29", list.At(29));
+
+  size_t count = 0;
+  list.ForEachListpack([&](const uint8_t* lp) {
+    count += lpLength(const_cast<uint8_t*>(lp));
+    return true;
+  });
+  EXPECT_EQ(30, count);
+}
+
+TEST_F(ChunkedListTest, Compression) {
+  ChunkedList list(-2, 1);
+  for (unsigned i = 0; i < 20000; ++i)
+    list.Push(StrCat("compressible value ", i % 10), ChunkedList::TAIL);
+
+  EXPECT_LT(list.MallocUsed(), list.ListpackBytes() / 2);
+  EXPECT_EQ("compressible value 3", list.At(10003));
+  EXPECT_TRUE(list.Replace(10003, "x"));
+  EXPECT_EQ("x", list.At(10003));
+
+  size_t count = 0;
+  list.ForEachListpack([&](const uint8_t* lp) {
+    count += lpLength(const_cast<uint8_t*>(lp));
+    return true;
+  });
+  EXPECT_EQ(20000, count);
+
+  while (list.Size() > 0)
+    list.Pop(ChunkedList::HEAD);
+}
+
+TEST_F(ChunkedListTest, Seek) {
+  ChunkedList list(8, 1);
+  for (unsigned i = 0; i < 1000; ++i) {
+    list.Push(i % 100 == 7 ? "needle" : StrCat("v", i), ChunkedList::TAIL);
+    list.Push(StrCat(i % 50), ChunkedList::TAIL);
+  }
+
+  auto positions = [&](string_view value, bool reverse, size_t limit) {
+    ChunkedList::Pattern pattern(value);
+    vector<size_t> res;
+    size_t index = 0;
+    for (auto it = list.GetIterator(reverse ? -1 : 0, reverse); index < limit; it.Next(), ++index) {
+      index += it.Seek(pattern, limit - index);
+      if (it.Done() || index >= limit)
+        break;
+      EXPECT_TRUE(it.Get() == value);
+      res.push_back(reverse ? list.Size() - index - 1 : index);
+    }
+    return res;
+  };
+
+  auto expected = [&](string_view value, bool reverse, size_t limit) {
+    vector<size_t> res;
+    size_t index = 0;
+    for (auto it = list.GetIterator(reverse ? -1 : 0, reverse); !it.Done() && index < limit;
+         it.Next(), ++index) {
+      if (it.Get() == value)
+        res.push_back(reverse ? list.Size() - index - 1 : index);
+    }
+    return res;
+  };
+
+  for (string_view value : {"needle", "7", "49", "v8", "v998", "missing", "123456"}) {
+    for (bool reverse : {false, true}) {
+      for (size_t limit : {size_t(5), size_t(100), size_t(1001), SIZE_MAX}) {
+        EXPECT_EQ(expected(value, reverse, limit), positions(value, reverse, limit))
+            << value << " " << reverse << " " << limit;
+      }
+    }
+  }
+  EXPECT_EQ(10, positions("needle", false, SIZE_MAX).size());
+  EXPECT_EQ(20, positions("7", false, SIZE_MAX).size());
+}
+
+// Compares the list with a deque under random operations.
+TEST_F(ChunkedListTest, Random) {
+  ChunkedList list(5, 1);
+  deque<string> expected;
+  mt19937 gen(42);
+
+  for (unsigned i = 0; i < 20000; ++i) {
+    string val = StrCat(gen() % 1000, "_", string(gen() % 20, 'v'));
+    size_t size = expected.size();
+    size_t index = size ? gen() % size : 0;
+
+    switch (gen() % 8) {
+      case 0:
+        list.Push(val, ChunkedList::HEAD);
+        expected.push_front(val);
+        break;
+      case 1:
+      case 2:
+        list.Push(val, ChunkedList::TAIL);
+        expected.push_back(val);
+        break;
+      case 3:
+        if (size) {
+          ASSERT_EQ(expected.front(), list.Pop(ChunkedList::HEAD));
+          expected.pop_front();
+        }
+        break;
+      case 4:
+        if (size) {
+          list.Replace(index, val);
+          expected[index] = val;
+        }
+        break;
+      case 5:
+        if (size) {
+          list.Insert(list.GetIterator(index), val, ChunkedList::TAIL);
+          expected.insert(expected.begin() + index + 1, val);
+        }
+        break;
+      case 6:
+        if (size) {
+          auto it = list.GetIterator(index);
+          list.Erase(&it);
+          expected.erase(expected.begin() + index);
+        }
+        break;
+      case 7:
+        if (size && gen() % 20 == 0) {
+          size_t num = gen() % 30;
+          list.Erase(index, num);
+          expected.erase(expected.begin() + index,
+                         expected.begin() + min(size, index + num));
+        }
+        break;
+    }
+
+    ASSERT_EQ(expected.size(), list.Size());
+    if (!expected.empty()) {
+      index = gen() % expected.size();
+      ASSERT_EQ(expected[index], list.At(index)) << i;
+    }
+  }
+
+  EXPECT_EQ(Entries(expected), Entries(&list));
+}
+
+// Benchmarks
+static void BM_ListScan(benchmark::State& state, bool seek) {
+  init_zmalloc_threadlocal(mi_heap_get_backing());
+  ChunkedList list;
+  for (unsigned i = 0; i < 100000; ++i)
+    list.Push(StrCat("value:", i), ChunkedList::TAIL);
+
+  size_t found = 0;
+  ChunkedList::Pattern pattern("missing");
+  while (state.KeepRunning()) {
+    auto it = list.GetIterator(0);
+    if (seek) {
+      it.Seek(pattern);
+      found += !it.Done();
+    } else {
+      for (; !it.Done(); it.Next())
+        found += it.Get() == "missing";
+    }
+  }
+  CHECK_EQ(0u, found);
+}
+BENCHMARK_CAPTURE(BM_ListScan, decode, false);
+BENCHMARK_CAPTURE(BM_ListScan, seek, true);
+
+}  // namespace dfly
@@ -0,0 +1,231 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/chunked_string.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "base/logging.h"
+
+extern "C" {
+#include "redis/zmalloc.h"
+}
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+// The position of the first byte when the string is created, so that prepending never wraps.
+constexpr uint64_t kOrigin = 1ULL << 62;
+
+// The chunks start at least that large, the last one then doubles on demand.
+constexpr size_t kMinChunkSize = 1 << 12;
+
+}  // namespace
+
+// The bytes of a chunk are data[start, start + len). The first chunk is filled towards the
+// beginning of its buffer, the last one towards its end.
+struct ChunkedString::Chunk {
+  char* data;
+  uint64_t pos;  // of the first byte, the string starts at the pos of its first chunk.
+  uint32_t start;
+  uint32_t len;
+
+  size_t Capacity() const {
+    return zmalloc_size(data);
+  }
+};
+
+ChunkedString::ChunkedString(string_view str) {
+  Append(str);
+}
+
+ChunkedString::~ChunkedString() {
+  Clear();
+}
+
+ChunkedString::ChunkedString(ChunkedString&& other) noexcept {
+  *this = std::move(other);
+}
+
+ChunkedString& ChunkedString::operator=(ChunkedString&& other) noexcept {
+  if (this != &other) {
+    Clear();
+    chunks_ = exchange(other.chunks_, nullptr);
+    num_chunks_ = exchange(other.num_chunks_, 0);
+    capacity_ = exchange(other.capacity_, 0);
+    size_ = exchange(other.size_, 0);
+    malloc_used_ = exchange(other.malloc_used_, 0);
+  }
+  return *this;
+}
+
+void ChunkedString::Append(string_view str) {
+  AppendBytes(str.data(), str.size());
+}
+
+void ChunkedString::Prepend(string_view str) {
+  while (!str.empty()) {
+    Chunk* first = num_chunks_ ? chunks_ : nullptr;
+    if (!first || first->start == 0) {
+      // The data of a new first chunk ends with its buffer, so it can not be grown in place
+      // as the last chunk is. Its size follows the size of the string instead.
+      size_t capacity = min(kChunkSize, max({kMinChunkSize, str.size(), size_}));
+      uint64_t pos = first ? first->pos : kOrigin;
+      first = InsertChunk(0, capacity);
+      first->pos = pos;
+      first->start = capacity;
+    }
+
+    size_t n = min<size_t>(first->start, str.size());
+    first->start -= n;
+    first->pos -= n;
+    first->len += n;
+    memcpy(first->data + first->start, str.end() - n, n);
+    size_ += n;
+    str.remove_suffix(n);
+  }
+}
+
+void ChunkedString::Write(size_t pos, string_view str) {
+  if (pos + str.size() > size_)
+    AppendBytes(nullptr, pos + str.size() - size_);
+  if (str.empty())
+    return;
+
+  for (size_t i = FindChunk(pos); !str.empty(); ++i) {
+    Chunk& c = chunks_[i];
+    size_t offset = chunks_[0].pos + pos - c.pos;
+    size_t n = min<size_t>(c.len - offset, str.size());
+    memcpy(c.data + c.start + offset, str.data(), n);
+    pos += n;
+    str.remove_prefix(n);
+  }
+}
+
+void ChunkedString::Read(size_t pos, size_t len, char* dest) const {
+  DCHECK_LE(pos + len, size_);
+  if (len == 0)
+    return;
+
+  for (size_t i = FindChunk(pos); len > 0; ++i) {
+    const Chunk& c = chunks_[i];
+    size_t offset = chunks_[0].pos + pos - c.pos;
+    size_t n = min<size_t>(c.len - offset, len);
+    memcpy(dest, c.data + c.start + offset, n);
+    dest += n;
+    pos += n;
+    len -= n;
+  }
+}
+
+string_view ChunkedString::GetChunk(size_t i) const {
+  DCHECK_LT(i, num_chunks_);
+  return string_view{chunks_[i].data + chunks_[i].start, chunks_[i].len};
+}
+
+size_t ChunkedString::Defrag(float ratio) {
+  size_t moved = 0;
+  for (size_t i = 0; i < num_chunks_; ++i) {
+    Chunk& c = chunks_[i];
+    if (!zmalloc_page_is_underutilized(c.data, ratio))
+      continue;
+
+    char* data = (char*)Allocate(c.Capacity());
+    memcpy(data + c.start, c.data + c.start, c.len);
+    Deallocate(c.data);
+    c.data = data;
+    moved += c.len;
+  }
+  return moved;
+}
+
+void ChunkedString::Clear() {
+  for (size_t i = 0; i < num_chunks_; ++i)
+    Deallocate(chunks_[i].data);
+  if (chunks_)
+    Deallocate(chunks_);
+
+  chunks_ = nullptr;
+  num_chunks_ = capacity_ = size_ = 0;
+  DCHECK_EQ(0u, malloc_used_);
+}
+
+void ChunkedString::AppendBytes(const char* data, size_t len) {
+  while (len > 0) {
+    Chunk* last = num_chunks_ ? chunks_ + num_chunks_ - 1 : nullptr;
+    size_t room = last ? last->Capacity() - last->start - last->len : 0;
+    if (last && room == 0 && last->Capacity() < kChunkSize) {
+      size_t used = last->start + last->len;
+      last->data = (char*)Reallocate(last->data, min(kChunkSize, max(2 * used, used + len)));
+      room = last->Capacity() - used;
+    }
+
+    if (room == 0) {
+      uint64_t pos = last ? last->pos + last->len : kOrigin;
+      size_t capacity = min(kChunkSize, max(kMinChunkSize, len));
+      last = InsertChunk(num_chunks_, capacity);
+      last->pos = pos;
+      room = last->Capacity();
+    }
+
+    size_t n = min(room, len);
+    char* dest = last->data + last->start + last->len;
+    if (data) {
+      memcpy(dest, data, n);
+      data += n;
+    } else {
+      memset(dest, 0, n);
+    }
+    last->len += n;
+    size_ += n;
+    len -= n;
+  }
+}
+
+size_t ChunkedString::FindChunk(size_t offset) const {
+  DCHECK_LT(offset, size_);
+  uint64_t pos = chunks_[0].pos + offset;
+  const Chunk* it = upper_bound(chunks_, chunks_ + num_chunks_, pos,
+                                [](uint64_t p, const Chunk& c) { return p < c.pos; });
+  return it - chunks_ - 1;
+}
+
+auto ChunkedString::InsertChunk(size_t index, size_t capacity) -> Chunk* {
+  if (num_chunks_ == capacity_) {
+    capacity_ = max<size_t>(4, capacity_ * 2);
+    chunks_ = (Chunk*)(chunks_ ? Reallocate(chunks_, capacity_ * sizeof(Chunk))
+                               : Allocate(capacity_ * sizeof(Chunk)));
+  }
+  memmove(chunks_ + index + 1, chunks_ + index, (num_chunks_ - index) * sizeof(Chunk));
+  ++num_chunks_;
+
+  Chunk* res = chunks_ + index;
+  *res = Chunk{.data = (char*)Allocate(capacity), .pos = 0, .start = 0, .len = 0};
+  return res;
+}
+
+void* ChunkedString::Allocate(size_t size) {
+  void* res = zmalloc(size);
+  malloc_used_ += zmalloc_size(res);
+  return res;
+}
+
+void* ChunkedString::Reallocate(void* ptr, size_t size) {
+  malloc_used_ -= zmalloc_size(ptr);
+  void* res = zrealloc(ptr, size);
+  malloc_used_ += zmalloc_size(res);
+  return res;
+}
+
+void ChunkedString::Deallocate(void* ptr) {
+  malloc_used_ -= zmalloc_size(ptr);
+  zfree(ptr);
+}
+
+}  // namespace dfly
@@ -0,0 +1,92 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace dfly {
+
+// A large string value that grows at its ends, as by APPEND and PREPEND. The bytes are kept in
+// chunks of up to kChunkSize bytes, so that a change moves at most a chunk instead of the whole
+// value. The last chunk grows by doubling and the first one is filled from its end, hence both
+// appending and prepending take amortized O(1) per byte. A byte range is found by a binary
+// search over the positions of the chunks.
+class ChunkedString {
+  struct Chunk;
+
+ public:
+  static constexpr size_t kChunkSize = 1 << 16;
+
+  ChunkedString() = default;
+  explicit ChunkedString(std::string_view str);
+  ~ChunkedString();
+
+  ChunkedString(ChunkedString&& other) noexcept;
+  ChunkedString& operator=(ChunkedString&& other) noexcept;
+
+  ChunkedString(const ChunkedString&) = delete;
+  ChunkedString& operator=(const ChunkedString&) = delete;
+
+  size_t Size() const {
+    return size_;
+  }
+
+  // The heap memory of the chunks and of their array.
+  size_t MallocUsed() const {
+    return malloc_used_;
+  }
+
+  void Append(std::string_view str);
+  void Prepend(std::string_view str);
+
+  // Overwrites the bytes at pos with str. As SETRANGE does, pads the string with zero bytes
+  // if it is shorter than pos.
+  void Write(size_t pos, std::string_view str);
+
+  // Copies len bytes at pos into dest. Requires: pos + len <= Size().
+  void Read(size_t pos, size_t len, char* dest) const;
+
+  // Writes the Size() bytes of the string into dest.
+  void ToBytes(char* dest) const {
+    Read(0, size_, dest);
+  }
+
+  // The chunks in order, so that the string could be written out without flattening it.
+  size_t NumChunks() const {
+    return num_chunks_;
+  }
+
+  std::string_view GetChunk(size_t i) const;
+
+  // Reallocates the chunks that reside on memory pages whose utilization is below ratio.
+  // Returns the number of bytes that were reallocated.
+  size_t Defrag(float ratio);
+
+ private:
+  void Clear();
+
+  // Appends len bytes of data, or len zero bytes if data is null.
+  void AppendBytes(const char* data, size_t len);
+
+  // Returns the chunk that holds the byte at offset. Requires: offset < Size().
+  size_t FindChunk(size_t offset) const;
+
+  // Inserts a chunk with capacity bytes of which none is used, at index.
+  Chunk* InsertChunk(size_t index, size_t capacity);
+
+  void* Allocate(size_t size);
+  void* Reallocate(void* ptr, size_t size);
+  void Deallocate(void* ptr);
+
+  Chunk* chunks_ = nullptr;
+  size_t num_chunks_ = 0;
+  size_t capacity_ = 0;  // of chunks_.
+  size_t size_ = 0;
+  size_t malloc_used_ = 0;
+};
+
+}  // namespace dfly
@@ -0,0 +1,105 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/chunked_string.h"
+
+#include <mimalloc.h>
+
+#include <random>
+#include <string>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+extern "C" {
+#include "redis/zmalloc.h"
+}
+
+namespace dfly {
+
+using namespace std;
+
+class ChunkedStringTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    auto* tlh = mi_heap_get_backing();
+    init_zmalloc_threadlocal(tlh);
+  }
+
+  void TearDown() override {
+    EXPECT_EQ(zmalloc_used_memory_tl, 0);
+  }
+
+  static string ToString(const ChunkedString& cs) {
+    string res(cs.Size(), 0);
+    cs.ToBytes(res.data());
+    return res;
+  }
+};
+
+TEST_F(ChunkedStringTest, AppendPrepend) {
+  ChunkedString cs("b");
+  cs.Append("c");
+  cs.Prepend("a");
+  EXPECT_EQ("abc", ToString(cs));
+  EXPECT_EQ(2u, cs.NumChunks());
+  EXPECT_EQ("a", cs.GetChunk(0));
+
+  string expected = "abc";
+  mt19937 gen(1);
+  for (unsigned i = 0; i < 5000; ++i) {
+    string part(gen() % 100, 'a' + i % 26);
+    if (i % 3 == 0) {
+      cs.Prepend(part);
+      expected = part + expected;
+    } else {
+      cs.Append(part);
+      expected += part;
+    }
+  }
+
+  ASSERT_EQ(expected.size(), cs.Size());
+  EXPECT_EQ(expected, ToString(cs));
+  EXPECT_GE(cs.MallocUsed(), cs.Size());
+
+  string joined;
+  for (size_t i = 0; i < cs.NumChunks(); ++i) {
+    EXPECT_LE(cs.GetChunk(i).size(), ChunkedString::kChunkSize);
+    joined.append(cs.GetChunk(i));
+  }
+  EXPECT_EQ(expected, joined);
+
+  for (unsigned i = 0; i < 1000; ++i) {
+    size_t pos = gen() % expected.size();
+    size_t len = min<size_t>(gen() % 200000, expected.size() - pos);
+    string range(len, 0);
+    cs.Read(pos, len, range.data());
+    ASSERT_EQ(expected.substr(pos, len), range) << pos << " " << len;
+  }
+}
+
+TEST_F(ChunkedStringTest, Write) {
+  ChunkedString cs(string(200000, 'x'));
+  cs.Write(ChunkedString::kChunkSize - 2, "abcd");
+  string range(6, 0);
+  cs.Read(ChunkedString::kChunkSize - 3, 6, range.data());
+  EXPECT_EQ("xabcdx", range);
+
+  cs.Write(200005, "yz");
+  EXPECT_EQ(200007u, cs.Size());
+  string tail(8, 0);
+  cs.Read(199999, 8, tail.data());
+  EXPECT_EQ(string("x\0\0\0\0\0yz", 8), tail);
+
+  cs.Defrag(0.8);
+  cs.Read(ChunkedString::kChunkSize - 3, 6, range.data());
+  EXPECT_EQ("xabcdx", range);
+
+  ChunkedString moved = std::move(cs);
+  EXPECT_EQ(0u, cs.Size());
+  EXPECT_EQ(0u, cs.MallocUsed());
+  EXPECT_EQ(200007u, moved.Size());
+}
+
+}  // namespace dfly
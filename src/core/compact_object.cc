@@ -5,7 +5,9 @@
 #include "core/compact_object.h"
 
 // #define XXH_INLINE_ALL
+#include <lz4.h>
 #include <xxhash.h>
+#include <zstd.h>
 
 extern "C" {
 #include "redis/intset.h"
@@ -16,14 +18,23 @@ extern "C" {
 #include "redis/zmalloc.h"  // for non-string objects.
 #include "redis/zset.h"
 }
+#include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
+#include <double-conversion/double-to-string.h>
 
 #include <jsoncons/json.hpp>
 
 #include "base/flags.h"
 #include "base/logging.h"
 #include "base/pod_array.h"
+#include "core/chunked_list.h"
+#include "core/chunked_string.h"
+#include "core/key_prefix_table.h"
+#include "core/roaring_bitmap.h"
+#include "core/sorted_map.h"
+#include "core/string_map.h"
 #include "core/string_set.h"
+#include "core/zstd_dict.h"
 
 #if defined(__aarch64__)
 #include "base/sse2neon.h"
@@ -42,10 +53,23 @@ namespace {
 constexpr XXH64_hash_t kHashSeed = 24061983;
 constexpr size_t kAlignSize = 8u;
 
-// Approximation since does not account for listpacks.
-size_t QlMAllocSize(quicklist* ql) {
-  size_t res = ql->len * sizeof(quicklistNode) + znallocx(sizeof(quicklist));
-  return res + ql->count * 16;  // we account for each member 16 bytes.
+// Must format as RedisReplyBuilder::FormatDouble, since the stored doubles read as strings.
+constexpr int kDoubleConvFlags =
+    double_conversion::DoubleToStringConverter::UNIQUE_ZERO |
+    double_conversion::DoubleToStringConverter::EMIT_POSITIVE_EXPONENT_SIGN;
+
+const double_conversion::DoubleToStringConverter double_conv(kDoubleConvFlags, "inf", "nan", 'e',
+                                                             -6, 21, 6, 0);
+
+// Large enough for the shortest representation of any double.
+constexpr unsigned kDoubleBufLen = 32;
+
+string_view FormatDouble(double val, char* dest) {
+  double_conversion::StringBuilder sb(dest, kDoubleBufLen);
+  CHECK(double_conv.ToShortest(val, &sb));
+  size_t len = sb.position();
+  sb.Finalize();
+  return string_view{dest, len};
 }
 
 // Approximated dictionary size.
@@ -97,6 +121,10 @@ size_t MallocUsedHSet(unsigned encoding, void* ptr) {
       return lpBytes(reinterpret_cast<uint8_t*>(ptr));
     case kEncodingStrMap:
       return DictMallocSize((dict*)ptr);
+    case kEncodingStrMap2: {
+      StringMap* sm = (StringMap*)ptr;
+      return sm->ObjMallocUsed() + sm->SetMallocUsed();
+    }
   }
   LOG(DFATAL) << "Unknown set encoding type " << encoding;
   return 0;
@@ -110,6 +138,8 @@ size_t MallocUsedZSet(unsigned encoding, void* ptr) {
       zset* zs = (zset*)ptr;
       return DictMallocSize(zs->dict);
     }
+    case kEncodingSortedMap:
+      return ((SortedMap*)ptr)->MallocUsed();
   }
   LOG(DFATAL) << "Unknown set encoding type " << encoding;
   return 0;
@@ -125,6 +155,9 @@ inline void FreeObjHash(unsigned encoding, void* ptr) {
     case kEncodingStrMap:
       dictRelease((dict*)ptr);
       break;
+    case kEncodingStrMap2:
+      delete (StringMap*)ptr;
+      break;
     case kEncodingListPack:
       lpFree((uint8_t*)ptr);
       break;
@@ -145,6 +178,9 @@ inline void FreeObjZset(unsigned encoding, void* ptr) {
     case OBJ_ENCODING_LISTPACK:
       zfree(ptr);
       break;
+    case kEncodingSortedMap:
+      delete (SortedMap*)ptr;
+      break;
     default:
       LOG(FATAL) << "Unknown sorted set encoding" << encoding;
   }
@@ -154,6 +190,74 @@ inline void FreeObjStream(void* ptr) {
   freeStream((stream*)ptr);
 }
 
+// Moves a blob of size bytes to a new allocation if it resides on an underutilized page.
+// Returns the number of bytes moved.
+size_t DefragBlob(void** ptr, size_t size, float ratio) {
+  if (!zmalloc_page_is_underutilized(*ptr, ratio))
+    return 0;
+
+  void* res = zmalloc(size);
+  memcpy(res, *ptr, size);
+  zfree(*ptr);
+  *ptr = res;
+
+  return size;
+}
+
+size_t DefragSet(unsigned encoding, void** ptr, float ratio) {
+  switch (encoding) {
+    case kEncodingIntSet:
+      return DefragBlob(ptr, intsetBlobLen((intset*)*ptr), ratio);
+    case kEncodingStrMap2:
+      return ((StringSet*)*ptr)->Defrag(ratio);
+  }
+
+  // redis dict is not supported.
+  return 0;
+}
+
+size_t DefragZSet(unsigned encoding, void** ptr, float ratio) {
+  switch (encoding) {
+    case OBJ_ENCODING_LISTPACK:
+      return DefragBlob(ptr, lpBytes((uint8_t*)*ptr), ratio);
+    case kEncodingSortedMap:
+      return ((SortedMap*)*ptr)->Defrag(ratio);
+  }
+  return 0;
+}
+
+size_t DefragHash(unsigned encoding, void** ptr, float ratio) {
+  switch (encoding) {
+    case kEncodingListPack:
+      return DefragBlob(ptr, lpBytes((uint8_t*)*ptr), ratio);
+    case kEncodingStrMap2:
+      return ((StringMap*)*ptr)->Defrag(ratio);
+  }
+
+  // redis dict is not supported.
+  return 0;
+}
+
+// Moves the listpacks of the stream entries. Consumer groups are not moved.
+size_t DefragStream(stream* s, float ratio) {
+  size_t moved = 0;
+  raxIterator ri;
+  raxStart(&ri, s->rax_tree);
+  raxSeek(&ri, "^", NULL, 0);
+
+  while (raxNext(&ri)) {
+    void* lp = ri.data;
+    size_t lp_moved = DefragBlob(&lp, lpBytes((uint8_t*)lp), ratio);
+    if (lp_moved) {
+      raxSetData(ri.node, lp);
+      moved += lp_moved;
+    }
+  }
+  raxStop(&ri);
+
+  return moved;
+}
+
 // Daniel Lemire's function validate_ascii_fast() - under Apache/MIT license.
 // See https://github.com/lemire/fastvalidate-utf-8/
 // The function returns true (1) if all chars passed in src are
@@ -215,6 +319,17 @@ struct TL {
   size_t small_str_bytes;
   base::PODArray<uint8_t> tmp_buf;
   string tmp_str;
+
+  unique_ptr<KeyPrefixTable> key_prefixes;  // see CompactObj::EnableKeyPrefixes.
+
+  // Lazily created on first use of zstd compressed strings.
+  ZSTD_CCtx* zstd_cctx = nullptr;
+  ZSTD_DCtx* zstd_dctx = nullptr;
+
+  ~TL() {
+    ZSTD_freeCCtx(zstd_cctx);
+    ZSTD_freeDCtx(zstd_dctx);
+  }
 };
 
 thread_local TL tl;
@@ -225,6 +340,74 @@ constexpr bool kUseSmallStrings = true;
 /// file and implement with SIMD instructions.
 constexpr bool kUseAsciiEncoding = true;
 
+constexpr int kZstdLevel = 1;
+constexpr size_t kMaxCompressedLen = 1u << 28;
+
+// Returns the compressed length or 0 if the compression failed.
+size_t CompressString(CompressCodec codec, string_view src, base::PODArray<uint8_t>* dest) {
+  switch (codec) {
+    case CompressCodec::LZ4: {
+      int bound = LZ4_compressBound(src.size());
+      dest->resize(bound);
+      int res = LZ4_compress_default(src.data(), reinterpret_cast<char*>(dest->data()),
+                                     src.size(), bound);
+      return res > 0 ? res : 0;
+    }
+    case CompressCodec::ZSTD: {
+      if (!tl.zstd_cctx)
+        tl.zstd_cctx = ZSTD_createCCtx();
+      size_t bound = ZSTD_compressBound(src.size());
+      dest->resize(bound);
+      size_t res =
+          ZSTD_compressCCtx(tl.zstd_cctx, dest->data(), bound, src.data(), src.size(), kZstdLevel);
+      return ZSTD_isError(res) ? 0 : res;
+    }
+    case CompressCodec::ZSTD_DICT: {
+      const ZstdDictRegistry::Entry* dict = ZstdDictRegistry::ThreadDict();
+      if (!dict)
+        return 0;
+      if (!tl.zstd_cctx)
+        tl.zstd_cctx = ZSTD_createCCtx();
+      size_t bound = ZSTD_compressBound(src.size());
+      dest->resize(bound);
+      size_t res = ZSTD_compress_usingCDict(tl.zstd_cctx, dest->data(), bound, src.data(),
+                                            src.size(), dict->cdict);
+      return ZSTD_isError(res) ? 0 : res;
+    }
+    case CompressCodec::NONE:
+      break;
+  }
+  return 0;
+}
+
+bool DecompressString(CompressCodec codec, string_view src, char* dest, size_t raw_size) {
+  switch (codec) {
+    case CompressCodec::LZ4:
+      return LZ4_decompress_safe(src.data(), dest, src.size(), raw_size) == int(raw_size);
+    case CompressCodec::ZSTD: {
+      if (!tl.zstd_dctx)
+        tl.zstd_dctx = ZSTD_createDCtx();
+      size_t res = ZSTD_decompressDCtx(tl.zstd_dctx, dest, raw_size, src.data(), src.size());
+      return !ZSTD_isError(res) && res == raw_size;
+    }
+    case CompressCodec::ZSTD_DICT: {
+      // The frame references its dictionary by id, see ZstdDictRegistry.
+      const ZstdDictRegistry::Entry* dict =
+          ZstdDictRegistry::Find(ZSTD_getDictID_fromFrame(src.data(), src.size()));
+      if (!dict)
+        return false;
+      if (!tl.zstd_dctx)
+        tl.zstd_dctx = ZSTD_createDCtx();
+      size_t res = ZSTD_decompress_usingDDict(tl.zstd_dctx, dest, raw_size, src.data(), src.size(),
+                                              dict->ddict);
+      return !ZSTD_isError(res) && res == raw_size;
+    }
+    case CompressCodec::NONE:
+      break;
+  }
+  return false;
+}
+
 }  // namespace
 
 static_assert(sizeof(CompactObj) == 18);
@@ -241,8 +424,8 @@ size_t RobjWrapper::MallocUsed() const {
       CHECK_EQ(OBJ_ENCODING_RAW, encoding_);
       return InnerObjMallocUsed();
     case OBJ_LIST:
-      DCHECK_EQ(encoding_, OBJ_ENCODING_QUICKLIST);
-      return QlMAllocSize((quicklist*)inner_obj_);
+      DCHECK_EQ(encoding_, kEncodingChunkedList);
+      return ((ChunkedList*)inner_obj_)->MallocUsed();
     case OBJ_SET:
       return MallocUsedSet(encoding_, inner_obj_);
     case OBJ_HASH:
@@ -265,8 +448,11 @@ size_t RobjWrapper::Size() const {
       DCHECK_EQ(OBJ_ENCODING_RAW, encoding_);
       return sz_;
     case OBJ_LIST:
-      return quicklistCount((quicklist*)inner_obj_);
+      return ((ChunkedList*)inner_obj_)->Size();
     case OBJ_ZSET: {
+      if (encoding_ == kEncodingSortedMap)
+        return ((SortedMap*)inner_obj_)->Size();
+
       robj self{.type = type_,
                 .encoding = encoding_,
                 .lru = 0,
@@ -291,6 +477,17 @@ size_t RobjWrapper::Size() const {
         default:
           LOG(FATAL) << "Unexpected encoding " << encoding_;
       };
+    case OBJ_HASH:
+      switch (encoding_) {
+        case kEncodingListPack:
+          return lpLength((uint8_t*)inner_obj_) / 2;
+        case kEncodingStrMap:
+          return dictSize((dict*)inner_obj_);
+        case kEncodingStrMap2:
+          return ((StringMap*)inner_obj_)->Size();
+        default:
+          LOG(FATAL) << "Unexpected encoding " << encoding_;
+      };
     default:;
   }
   return 0;
@@ -308,8 +505,8 @@ void RobjWrapper::Free(pmr::memory_resource* mr) {
       mr->deallocate(inner_obj_, 0, 8);  // we do not keep the allocated size.
       break;
     case OBJ_LIST:
-      CHECK_EQ(encoding_, OBJ_ENCODING_QUICKLIST);
-      quicklistRelease((quicklist*)inner_obj_);
+      CHECK_EQ(encoding_, kEncodingChunkedList);
+      delete (ChunkedList*)inner_obj_;
       break;
     case OBJ_SET:
       FreeObjSet(encoding_, inner_obj_, mr);
@@ -382,13 +579,27 @@ void RobjWrapper::SetString(string_view s, pmr::memory_resource* mr) {
   }
 }
 
-bool RobjWrapper::DefragIfNeeded(float ratio) {
-  if (type() == OBJ_STRING) {  // only applicable to strings
-    if (zmalloc_page_is_underutilized(inner_obj(), ratio)) {
-      return Reallocate(tl.local_mr);
-    }
+size_t RobjWrapper::DefragIfNeeded(float ratio) {
+  switch (type()) {
+    case OBJ_STRING:
+      if (zmalloc_page_is_underutilized(inner_obj(), ratio)) {
+        Reallocate(tl.local_mr);
+        return sz_;
+      }
+      return 0;
+    case OBJ_LIST:
+      DCHECK_EQ(kEncodingChunkedList, encoding_);
+      return ((ChunkedList*)inner_obj_)->Defrag(ratio);
+    case OBJ_SET:
+      return DefragSet(encoding_, &inner_obj_, ratio);
+    case OBJ_ZSET:
+      return DefragZSet(encoding_, &inner_obj_, ratio);
+    case OBJ_HASH:
+      return DefragHash(encoding_, &inner_obj_, ratio);
+    case OBJ_STREAM:
+      return DefragStream((stream*)inner_obj_, ratio);
   }
-  return false;
+  return 0;
 }
 
 bool RobjWrapper::Reallocate(std::pmr::memory_resource* mr) {
@@ -520,6 +731,10 @@ using namespace std;
 auto CompactObj::GetStats() -> Stats {
   Stats res;
   res.small_string_bytes = tl.small_str_bytes;
+  if (tl.key_prefixes) {
+    res.key_prefixes = tl.key_prefixes->size();
+    res.key_prefix_bytes = tl.key_prefixes->MallocUsed();
+  }
 
   return res;
 }
@@ -529,6 +744,14 @@ void CompactObj::InitThreadLocal(pmr::memory_resource* mr) {
   tl.tmp_buf = base::PODArray<uint8_t>{mr};
 }
 
+void CompactObj::EnableKeyPrefixes(string_view delimiters) {
+  DCHECK(!tl.key_prefixes || tl.key_prefixes->size() == 0);
+  if (delimiters.empty())
+    tl.key_prefixes.reset();
+  else
+    tl.key_prefixes = make_unique<KeyPrefixTable>(delimiters);
+}
+
 CompactObj::~CompactObj() {
   if (HasAllocated()) {
     Free();
@@ -569,6 +792,29 @@ size_t CompactObj::Size() const {
       case ROBJ_TAG:
         raw_size = u_.r_obj.Size();
         break;
+      case TINY_HASH_TAG:
+        raw_size = lpLength((uint8_t*)RObjPtr()) / 2;
+        break;
+      case TINY_SET_TAG:
+        raw_size = intsetLen((intset*)RObjPtr());
+        break;
+      case COMPRESSED_TAG:
+        raw_size = u_.compressed.raw_size;
+        break;
+      case BITMAP_TAG:
+        raw_size = u_.bitmap_obj.bitmap->ByteLen();
+        break;
+      case CHUNKED_STR_TAG:
+        raw_size = u_.chunked_obj.str->Size();
+        break;
+      case PREFIXED_TAG:
+        raw_size = tl.key_prefixes->Get(u_.prefixed.prefix_id).size() + u_.prefixed.suffix_len;
+        break;
+      case DOUBLE_TAG: {
+        char buf[kDoubleBufLen];
+        raw_size = FormatDouble(u_.dval, buf).size();
+        break;
+      }
       default:
         LOG(DFATAL) << "Should not reach " << int(taglen_);
     }
@@ -578,7 +824,8 @@ size_t CompactObj::Size() const {
 }
 
 uint64_t CompactObj::HashCode() const {
-  DCHECK(taglen_ != JSON_TAG) << "JSON type cannot be used for keys!";
+  DCHECK(taglen_ != JSON_TAG && taglen_ != PACKED_JSON_TAG)
+      << "JSON type cannot be used for keys!";
 
   uint8_t encoded = (mask_ & kEncMask);
   if (IsInline()) {
@@ -601,10 +848,21 @@ uint64_t CompactObj::HashCode() const {
       return u_.small_str.HashCode();
     case ROBJ_TAG:
       return u_.r_obj.HashCode();
+    case COMPRESSED_TAG:
+    case BITMAP_TAG:
+    case CHUNKED_STR_TAG:
+    case PREFIXED_TAG:
+      GetString(&tl.tmp_str);
+      return XXH3_64bits_withSeed(tl.tmp_str.data(), tl.tmp_str.size(), kHashSeed);
     case INT_TAG: {
       absl::AlphaNum an(u_.ival);
       return XXH3_64bits_withSeed(an.data(), an.size(), kHashSeed);
     }
+    case DOUBLE_TAG: {
+      char buf[kDoubleBufLen];
+      string_view str = FormatDouble(u_.dval, buf);
+      return XXH3_64bits_withSeed(str.data(), str.size(), kHashSeed);
+    }
   }
   // We need hash only for keys.
   LOG(DFATAL) << "Should not reach " << int(taglen_);
@@ -617,16 +875,33 @@ uint64_t CompactObj::HashCode(string_view str) {
 }
 
 unsigned CompactObj::ObjType() const {
-  if (IsInline() || taglen_ == INT_TAG || taglen_ == SMALL_TAG || taglen_ == EXTERNAL_TAG)
+  if (IsInline() || taglen_ == INT_TAG || taglen_ == SMALL_TAG || taglen_ == COMPRESSED_TAG ||
+      taglen_ == BITMAP_TAG || taglen_ == CHUNKED_STR_TAG || taglen_ == PREFIXED_TAG ||
+      taglen_ == DOUBLE_TAG)
     return OBJ_STRING;
 
+  if (taglen_ == EXTERNAL_TAG)
+    return u_.ext_ptr.type;
+
   if (taglen_ == ROBJ_TAG)
     return u_.r_obj.type();
 
-  if (taglen_ == JSON_TAG) {
+  if (taglen_ == JSON_TAG || taglen_ == PACKED_JSON_TAG) {
     return OBJ_JSON;
   }
 
+  if (taglen_ == SBF_TAG)
+    return OBJ_SBF;
+
+  if (taglen_ == TS_TAG)
+    return OBJ_TS;
+
+  if (taglen_ == TINY_HASH_TAG)
+    return OBJ_HASH;
+
+  if (taglen_ == TINY_SET_TAG)
+    return OBJ_SET;
+
   LOG(FATAL) << "TBD " << int(taglen_);
   return 0;
 }
@@ -637,6 +912,12 @@ unsigned CompactObj::Encoding() const {
       return u_.r_obj.encoding();
     case INT_TAG:
       return OBJ_ENCODING_INT;
+    case EXTERNAL_TAG:
+      return u_.ext_ptr.encoding;
+    case TINY_HASH_TAG:
+      return kEncodingListPack;
+    case TINY_SET_TAG:
+      return kEncodingIntSet;
     default:
       return OBJ_ENCODING_RAW;
   }
@@ -676,23 +957,24 @@ void CompactObj::ImportRObj(robj* o) {
 }
 
 robj* CompactObj::AsRObj() const {
-  CHECK_EQ(ROBJ_TAG, taglen_);
+  CHECK(taglen_ == ROBJ_TAG || taglen_ == TINY_HASH_TAG) << int(taglen_);
 
   robj* res = &tl.tmp_robj;
-  unsigned enc = u_.r_obj.encoding();
-  res->type = u_.r_obj.type();
+  unsigned enc = Encoding();
+  res->type = ObjType();
 
   if (res->type == OBJ_SET) {
     LOG(FATAL) << "Should not call AsRObj for type " << res->type;
   }
 
   if (res->type == OBJ_HASH) {
+    CHECK_NE(enc, kEncodingStrMap2) << "Should not call AsRObj for StringMap hashes";
     res->encoding = (enc == kEncodingListPack) ? OBJ_ENCODING_LISTPACK : OBJ_ENCODING_HT;
   } else {
     res->encoding = enc;
   }
   res->lru = 0;  // u_.r_obj.unneeded;
-  res->ptr = u_.r_obj.inner_obj();
+  res->ptr = RObjPtr();
 
   return res;
 }
@@ -717,6 +999,47 @@ void CompactObj::SyncRObj() {
   u_.r_obj.Init(obj->type, enc, obj->ptr);
 }
 
+bool CompactObj::PackTiny() {
+  if (taglen_ != ROBJ_TAG || IsRef() || u_.r_obj.inner_obj() == nullptr)
+    return false;
+
+  uint8_t tag;
+  size_t len;
+  void* inner = u_.r_obj.inner_obj();
+  if (u_.r_obj.type() == OBJ_HASH && u_.r_obj.encoding() == kEncodingListPack) {
+    tag = TINY_HASH_TAG;
+    len = lpBytes((uint8_t*)inner);
+  } else if (u_.r_obj.type() == OBJ_SET && u_.r_obj.encoding() == kEncodingIntSet) {
+    tag = TINY_SET_TAG;
+    len = intsetBlobLen((intset*)inner);
+  } else {
+    return false;
+  }
+
+  if (len > kInlineLen)
+    return false;
+
+  char blob[kInlineLen];
+  memcpy(blob, inner, len);
+  SetMeta(tag, mask_);  // frees inner.
+  memcpy(u_.inline_str, blob, len);
+  return true;
+}
+
+void CompactObj::UnpackTiny() {
+  DCHECK(IsTiny());
+
+  bool is_hash = taglen_ == TINY_HASH_TAG;
+  size_t len = is_hash ? lpBytes((uint8_t*)u_.inline_str) : intsetBlobLen((intset*)u_.inline_str);
+
+  // Both the listpacks and the intsets are allocated with zmalloc.
+  void* inner = zmalloc(len);
+  memcpy(inner, u_.inline_str, len);
+  taglen_ = ROBJ_TAG;
+  u_.r_obj.Init(is_hash ? OBJ_HASH : OBJ_SET, is_hash ? kEncodingListPack : kEncodingIntSet,
+                inner);
+}
+
 void CompactObj::SetInt(int64_t val) {
   if (INT_TAG != taglen_) {
     SetMeta(INT_TAG, mask_ & ~kEncMask);
@@ -732,8 +1055,23 @@ std::optional<int64_t> CompactObj::TryGetInt() const {
   return val;
 }
 
+void CompactObj::SetDouble(double val) {
+  if (DOUBLE_TAG != taglen_) {
+    SetMeta(DOUBLE_TAG, mask_ & ~kEncMask);
+  }
+
+  u_.dval = val;
+}
+
+std::optional<double> CompactObj::TryGetDouble() const {
+  if (taglen_ != DOUBLE_TAG)
+    return std::nullopt;
+  double val = u_.dval;
+  return val;
+}
+
 auto CompactObj::GetJson() const -> JsonType* {
-  if (ObjType() == OBJ_JSON) {
+  if (taglen_ == JSON_TAG) {
     return u_.json_obj.json_ptr;
   }
   return nullptr;
@@ -750,6 +1088,34 @@ void CompactObj::SetJson(JsonType&& j) {
   }
 }
 
+void CompactObj::SetPackedJson(string_view blob) {
+  // The blob may be a part of the current one.
+  uint8_t* ptr = (uint8_t*)tl.local_mr->allocate(blob.size(), kAlignSize);
+  memcpy(ptr, blob.data(), blob.size());
+
+  SetMeta(PACKED_JSON_TAG, mask_ & ~kEncMask);
+  u_.packed_json.blob = ptr;
+  u_.packed_json.blob_size = blob.size();
+}
+
+void CompactObj::PatchPackedJson(size_t offset, string_view bytes) {
+  DCHECK_EQ(PACKED_JSON_TAG, taglen_);
+  DCHECK_LE(offset + bytes.size(), u_.packed_json.blob_size);
+  memcpy(u_.packed_json.blob + offset, bytes.data(), bytes.size());
+}
+
+void CompactObj::SetSBF(SBF&& sbf) {
+  SetMeta(SBF_TAG, mask_ & ~kEncMask);
+  void* ptr = tl.local_mr->allocate(sizeof(SBF), kAlignSize);
+  u_.sbf_obj.sbf = new (ptr) SBF(std::move(sbf));
+}
+
+void CompactObj::SetTimeSeries(TimeSeries&& ts) {
+  SetMeta(TS_TAG, mask_ & ~kEncMask);
+  void* ptr = tl.local_mr->allocate(sizeof(TimeSeries), kAlignSize);
+  u_.ts_obj.ts = new (ptr) TimeSeries(std::move(ts));
+}
+
 void CompactObj::SetString(std::string_view str) {
   uint8_t mask = mask_ & ~kEncMask;
 
@@ -822,6 +1188,101 @@ void CompactObj::SetString(std::string_view str) {
   u_.r_obj.SetString(encoded, tl.local_mr);
 }
 
+void CompactObj::SetKey(string_view str) {
+  constexpr size_t kMinPrefixLen = 4;
+
+  // Keys that are inline anyway or whose suffix does not fit are stored as usual.
+  KeyPrefixTable* table = tl.key_prefixes.get();
+  size_t prefix_len = 0;
+  if (table && str.size() > ascii_len(kInlineLen))
+    prefix_len = table->PrefixLen(str);
+
+  size_t suffix_len = str.size() - prefix_len;
+  if (prefix_len < kMinPrefixLen || suffix_len > sizeof(u_.prefixed.suffix)) {
+    SetString(str);
+    return;
+  }
+
+  uint16_t id = table->Acquire(str.substr(0, prefix_len));
+  if (id == KeyPrefixTable::kInvalidId) {
+    SetString(str);
+    return;
+  }
+
+  SetMeta(PREFIXED_TAG, mask_ & ~kEncMask);
+  u_.prefixed.prefix_id = id;
+  u_.prefixed.suffix_len = suffix_len;
+  memcpy(u_.prefixed.suffix, str.data() + prefix_len, suffix_len);
+}
+
+void CompactObj::SetCompressedString(string_view str, CompressCodec codec) {
+  size_t compressed_len = 0;
+  if (str.size() > kInlineLen && str.size() < kMaxCompressedLen) {
+    compressed_len = CompressString(codec, str, &tl.tmp_buf);
+  }
+
+  // We require at least 1/8 reduction, otherwise decompressing on reads is not worth it.
+  if (compressed_len == 0 || compressed_len > str.size() - str.size() / 8) {
+    SetString(str);
+    return;
+  }
+
+  SetMeta(COMPRESSED_TAG, mask_ & ~kEncMask);
+  u_.compressed.blob = (uint8_t*)tl.local_mr->allocate(compressed_len, kAlignSize);
+  memcpy(u_.compressed.blob, tl.tmp_buf.data(), compressed_len);
+  u_.compressed.blob_size = compressed_len;
+  u_.compressed.raw_size = str.size();
+  u_.compressed.codec = unsigned(codec);
+}
+
+auto CompactObj::GetCompressed() const -> CompressedBlob {
+  DCHECK_EQ(COMPRESSED_TAG, taglen_);
+
+  return CompressedBlob{
+      .codec = CompressCodec(u_.compressed.codec),
+      .raw_size = u_.compressed.raw_size,
+      .blob = string_view{reinterpret_cast<char*>(u_.compressed.blob), u_.compressed.blob_size}};
+}
+
+bool CompactObj::ImportCompressed(const CompressedBlob& cb) {
+  if (cb.raw_size >= kMaxCompressedLen)
+    return false;
+
+  // Verify the blob upfront so that reads could assume it is valid.
+  tl.tmp_str.resize(cb.raw_size);
+  if (!DecompressString(cb.codec, cb.blob, tl.tmp_str.data(), cb.raw_size))
+    return false;
+
+  SetMeta(COMPRESSED_TAG, mask_ & ~kEncMask);
+  u_.compressed.blob = (uint8_t*)tl.local_mr->allocate(cb.blob.size(), kAlignSize);
+  memcpy(u_.compressed.blob, cb.blob.data(), cb.blob.size());
+  u_.compressed.blob_size = cb.blob.size();
+  u_.compressed.raw_size = cb.raw_size;
+  u_.compressed.codec = unsigned(cb.codec);
+
+  return true;
+}
+
+void CompactObj::SetBitmap(RoaringBitmap&& bitmap) {
+  SetMeta(BITMAP_TAG, mask_ & ~kEncMask);
+  void* ptr = tl.local_mr->allocate(sizeof(RoaringBitmap), kAlignSize);
+  u_.bitmap_obj.bitmap = new (ptr) RoaringBitmap(std::move(bitmap));
+}
+
+void CompactObj::SetChunkedString(ChunkedString&& str) {
+  SetMeta(CHUNKED_STR_TAG, mask_ & ~kEncMask);
+  void* ptr = tl.local_mr->allocate(sizeof(ChunkedString), kAlignSize);
+  u_.chunked_obj.str = new (ptr) ChunkedString(std::move(str));
+}
+
+void CompactObj::Decompress(char* dest) const {
+  DCHECK_EQ(COMPRESSED_TAG, taglen_);
+  string_view blob{reinterpret_cast<char*>(u_.compressed.blob), u_.compressed.blob_size};
+  bool res =
+      DecompressString(CompressCodec(u_.compressed.codec), blob, dest, u_.compressed.raw_size);
+  CHECK(res) << "Corrupted compressed string";
+}
+
 string_view CompactObj::GetSlice(string* scratch) const {
   uint8_t is_encoded = mask_ & kEncMask;
 
@@ -848,6 +1309,35 @@ string_view CompactObj::GetSlice(string* scratch) const {
     return *scratch;
   }
 
+  if (taglen_ == DOUBLE_TAG) {
+    char buf[kDoubleBufLen];
+    scratch->assign(FormatDouble(u_.dval, buf));
+    return *scratch;
+  }
+
+  if (taglen_ == COMPRESSED_TAG) {
+    scratch->resize(u_.compressed.raw_size);
+    Decompress(scratch->data());
+    return *scratch;
+  }
+
+  if (taglen_ == BITMAP_TAG) {
+    scratch->resize(u_.bitmap_obj.bitmap->ByteLen());
+    u_.bitmap_obj.bitmap->ToBytes(scratch->data());
+    return *scratch;
+  }
+
+  if (taglen_ == CHUNKED_STR_TAG) {
+    scratch->resize(u_.chunked_obj.str->Size());
+    u_.chunked_obj.str->ToBytes(scratch->data());
+    return *scratch;
+  }
+
+  if (taglen_ == PREFIXED_TAG) {
+    GetString(scratch);
+    return *scratch;
+  }
+
   if (is_encoded) {
     if (taglen_ == ROBJ_TAG) {
       CHECK_EQ(OBJ_STRING, u_.r_obj.type());
@@ -892,33 +1382,55 @@ string_view CompactObj::GetSlice(string* scratch) const {
   return string_view{};
 }
 
-bool CompactObj::DefragIfNeeded(float ratio) {
+size_t CompactObj::DefragIfNeeded(float ratio) {
   switch (taglen_) {
     case ROBJ_TAG:
-      // currently only these objet types are supported for this operation
       if (u_.r_obj.inner_obj() != nullptr) {
         return u_.r_obj.DefragIfNeeded(ratio);
       }
-      return false;
+      return 0;
     case SMALL_TAG:
-      return u_.small_str.DefragIfNeeded(ratio);
+      return u_.small_str.DefragIfNeeded(ratio) ? u_.small_str.MallocUsed() : 0;
+    case COMPRESSED_TAG: {
+      uint8_t* old_blob = u_.compressed.blob;
+      if (!zmalloc_page_is_underutilized(old_blob, ratio))
+        return 0;
+      u_.compressed.blob = (uint8_t*)tl.local_mr->allocate(u_.compressed.blob_size, kAlignSize);
+      memcpy(u_.compressed.blob, old_blob, u_.compressed.blob_size);
+      tl.local_mr->deallocate(old_blob, 0, kAlignSize);
+      return u_.compressed.blob_size;
+    }
+    case CHUNKED_STR_TAG:
+      return u_.chunked_obj.str->Defrag(ratio);
+    case PACKED_JSON_TAG: {
+      uint8_t* old_blob = u_.packed_json.blob;
+      if (!zmalloc_page_is_underutilized(old_blob, ratio))
+        return 0;
+      u_.packed_json.blob = (uint8_t*)tl.local_mr->allocate(u_.packed_json.blob_size, kAlignSize);
+      memcpy(u_.packed_json.blob, old_blob, u_.packed_json.blob_size);
+      tl.local_mr->deallocate(old_blob, 0, kAlignSize);
+      return u_.packed_json.blob_size;
+    }
     case INT_TAG:
       // this is not relevant in this case
-      return false;
+      return 0;
     case EXTERNAL_TAG:
-      return false;
+      return 0;
     default:
       // This is the case when the object is at inline_str
-      return false;
+      return 0;
   }
 }
 
 bool CompactObj::HasAllocated() const {
-  if (IsRef() || taglen_ == INT_TAG || IsInline() || taglen_ == EXTERNAL_TAG ||
-      (taglen_ == ROBJ_TAG && u_.r_obj.inner_obj() == nullptr))
+  if (IsRef() || taglen_ == INT_TAG || taglen_ == DOUBLE_TAG || IsInline() || IsTiny() ||
+      taglen_ == EXTERNAL_TAG || (taglen_ == ROBJ_TAG && u_.r_obj.inner_obj() == nullptr))
     return false;
 
-  DCHECK(taglen_ == ROBJ_TAG || taglen_ == SMALL_TAG || taglen_ == JSON_TAG);
+  DCHECK(taglen_ == ROBJ_TAG || taglen_ == SMALL_TAG || taglen_ == JSON_TAG ||
+         taglen_ == COMPRESSED_TAG || taglen_ == BITMAP_TAG || taglen_ == SBF_TAG ||
+         taglen_ == PACKED_JSON_TAG || taglen_ == CHUNKED_STR_TAG || taglen_ == PREFIXED_TAG ||
+         taglen_ == TS_TAG);
   return true;
 }
 
@@ -952,6 +1464,35 @@ void CompactObj::GetString(char* dest) const {
     return;
   }
 
+  if (taglen_ == DOUBLE_TAG) {
+    char buf[kDoubleBufLen];
+    string_view str = FormatDouble(u_.dval, buf);
+    memcpy(dest, str.data(), str.size());
+    return;
+  }
+
+  if (taglen_ == COMPRESSED_TAG) {
+    Decompress(dest);
+    return;
+  }
+
+  if (taglen_ == BITMAP_TAG) {
+    u_.bitmap_obj.bitmap->ToBytes(dest);
+    return;
+  }
+
+  if (taglen_ == CHUNKED_STR_TAG) {
+    u_.chunked_obj.str->ToBytes(dest);
+    return;
+  }
+
+  if (taglen_ == PREFIXED_TAG) {
+    string_view prefix = tl.key_prefixes->Get(u_.prefixed.prefix_id);
+    memcpy(dest, prefix.data(), prefix.size());
+    memcpy(dest + prefix.size(), u_.prefixed.suffix, u_.prefixed.suffix_len);
+    return;
+  }
+
   if (is_encoded) {
     if (taglen_ == ROBJ_TAG) {
       CHECK_EQ(OBJ_STRING, u_.r_obj.type());
@@ -1000,10 +1541,16 @@ void CompactObj::GetString(char* dest) const {
 }
 
 void CompactObj::SetExternal(size_t offset, size_t sz) {
+  SetExternal(offset, sz, OBJ_STRING, OBJ_ENCODING_RAW);
+}
+
+void CompactObj::SetExternal(size_t offset, size_t sz, unsigned type, unsigned encoding) {
   SetMeta(EXTERNAL_TAG, mask_ & ~kEncMask);
 
   u_.ext_ptr.offset = offset;
   u_.ext_ptr.size = sz;
+  u_.ext_ptr.type = type;
+  u_.ext_ptr.encoding = encoding;
 }
 
 std::pair<size_t, size_t> CompactObj::GetExternalPtr() const {
@@ -1019,6 +1566,39 @@ void CompactObj::Reset() {
   mask_ = 0;
 }
 
+bool CompactObj::FreeStep(size_t count) {
+  if (taglen_ != ROBJ_TAG || IsRef() || count == 0)
+    return true;
+
+  void* inner = u_.r_obj.inner_obj();
+  switch (u_.r_obj.type()) {
+    case OBJ_LIST: {
+      ChunkedList* cl = (ChunkedList*)inner;
+      cl->Erase(0, count);
+      return cl->Size() == 0;
+    }
+    case OBJ_SET:
+      if (u_.r_obj.encoding() == kEncodingStrMap2)
+        return ((StringSet*)inner)->ClearStep(count);
+      break;
+    case OBJ_HASH:
+      if (u_.r_obj.encoding() == kEncodingStrMap2)
+        return ((StringMap*)inner)->ClearStep(count);
+      break;
+    case OBJ_ZSET:
+      if (u_.r_obj.encoding() == kEncodingSortedMap) {
+        SortedMap* sm = (SortedMap*)inner;
+        if (sm->Size() > 0)
+          sm->DeleteRangeByRank(0, std::min(count, sm->Size()) - 1);
+        return sm->Size() == 0;
+      }
+      break;
+  }
+
+  // The other encodings are either compact blobs or are freed at once.
+  return true;
+}
+
 // Frees all resources if owns.
 void CompactObj::Free() {
   DCHECK(HasAllocated());
@@ -1032,6 +1612,24 @@ void CompactObj::Free() {
     VLOG(1) << "Freeing JSON object";
     u_.json_obj.json_ptr->~JsonType();
     tl.local_mr->deallocate(u_.json_obj.json_ptr, kAlignSize);
+  } else if (taglen_ == COMPRESSED_TAG) {
+    tl.local_mr->deallocate(u_.compressed.blob, 0, kAlignSize);
+  } else if (taglen_ == PACKED_JSON_TAG) {
+    tl.local_mr->deallocate(u_.packed_json.blob, 0, kAlignSize);
+  } else if (taglen_ == BITMAP_TAG) {
+    u_.bitmap_obj.bitmap->~RoaringBitmap();
+    tl.local_mr->deallocate(u_.bitmap_obj.bitmap, sizeof(RoaringBitmap), kAlignSize);
+  } else if (taglen_ == CHUNKED_STR_TAG) {
+    u_.chunked_obj.str->~ChunkedString();
+    tl.local_mr->deallocate(u_.chunked_obj.str, sizeof(ChunkedString), kAlignSize);
+  } else if (taglen_ == SBF_TAG) {
+    u_.sbf_obj.sbf->~SBF();
+    tl.local_mr->deallocate(u_.sbf_obj.sbf, sizeof(SBF), kAlignSize);
+  } else if (taglen_ == TS_TAG) {
+    u_.ts_obj.ts->~TimeSeries();
+    tl.local_mr->deallocate(u_.ts_obj.ts, sizeof(TimeSeries), kAlignSize);
+  } else if (taglen_ == PREFIXED_TAG) {
+    tl.key_prefixes->Release(u_.prefixed.prefix_id);
   } else {
     LOG(FATAL) << "Unsupported tag " << int(taglen_);
   }
@@ -1056,12 +1654,56 @@ size_t CompactObj::MallocUsed() const {
     return u_.small_str.MallocUsed();
   }
 
+  if (taglen_ == COMPRESSED_TAG) {
+    return zmalloc_size(u_.compressed.blob);
+  }
+
+  if (taglen_ == PACKED_JSON_TAG) {
+    return zmalloc_size(u_.packed_json.blob);
+  }
+
+  if (taglen_ == BITMAP_TAG) {
+    return zmalloc_size(u_.bitmap_obj.bitmap) + u_.bitmap_obj.bitmap->MallocUsed();
+  }
+
+  if (taglen_ == CHUNKED_STR_TAG) {
+    return zmalloc_size(u_.chunked_obj.str) + u_.chunked_obj.str->MallocUsed();
+  }
+
+  if (taglen_ == SBF_TAG) {
+    return zmalloc_size(u_.sbf_obj.sbf) + u_.sbf_obj.sbf->MallocUsed();
+  }
+
+  if (taglen_ == TS_TAG) {
+    return zmalloc_size(u_.ts_obj.ts) + u_.ts_obj.ts->MallocUsed();
+  }
+
+  if (taglen_ == PREFIXED_TAG) {
+    return 0;  // the prefix is shared and accounted by CompactObj::Stats.
+  }
+
   LOG(DFATAL) << "should not reach";
   return 0;
 }
 
 bool CompactObj::operator==(const CompactObj& o) const {
-  DCHECK(taglen_ != JSON_TAG && o.taglen_ != JSON_TAG) << "cannot use JSON type to check equal";
+  DCHECK(ObjType() != OBJ_JSON && o.ObjType() != OBJ_JSON) << "cannot use JSON type to check equal";
+
+  if (taglen_ == COMPRESSED_TAG || o.taglen_ == COMPRESSED_TAG || taglen_ == BITMAP_TAG ||
+      o.taglen_ == BITMAP_TAG || taglen_ == CHUNKED_STR_TAG || o.taglen_ == CHUNKED_STR_TAG) {
+    return Size() == o.Size() && ToString() == o.ToString();
+  }
+
+  if (taglen_ == PREFIXED_TAG && o.taglen_ == PREFIXED_TAG) {
+    return u_.prefixed.prefix_id == o.u_.prefixed.prefix_id &&
+           u_.prefixed.suffix_len == o.u_.prefixed.suffix_len &&
+           memcmp(u_.prefixed.suffix, o.u_.prefixed.suffix, u_.prefixed.suffix_len) == 0;
+  }
+
+  if (taglen_ == PREFIXED_TAG || o.taglen_ == PREFIXED_TAG ||
+      (taglen_ == DOUBLE_TAG) != (o.taglen_ == DOUBLE_TAG)) {
+    return Size() == o.Size() && ToString() == o.ToString();
+  }
 
   uint8_t m1 = mask_ & kEncMask;
   uint8_t m2 = mask_ & kEncMask;
@@ -1080,6 +1722,9 @@ bool CompactObj::operator==(const CompactObj& o) const {
   if (taglen_ == INT_TAG)
     return u_.ival == o.u_.ival;
 
+  if (taglen_ == DOUBLE_TAG)
+    return u_.dval == o.u_.dval;
+
   if (taglen_ == SMALL_TAG)
     return u_.small_str.Equal(o.u_.small_str);
 
@@ -1094,11 +1739,35 @@ bool CompactObj::EqualNonInline(std::string_view sv) const {
       absl::AlphaNum an(u_.ival);
       return sv == an.Piece();
     }
+    case DOUBLE_TAG: {
+      char buf[kDoubleBufLen];
+      return sv == FormatDouble(u_.dval, buf);
+    }
 
     case ROBJ_TAG:
       return u_.r_obj.Equal(sv);
     case SMALL_TAG:
       return u_.small_str.Equal(sv);
+    case COMPRESSED_TAG:
+      if (sv.size() != u_.compressed.raw_size)
+        return false;
+      GetString(&tl.tmp_str);
+      return tl.tmp_str == sv;
+    case BITMAP_TAG:
+      if (sv.size() != u_.bitmap_obj.bitmap->ByteLen())
+        return false;
+      GetString(&tl.tmp_str);
+      return tl.tmp_str == sv;
+    case CHUNKED_STR_TAG:
+      if (sv.size() != u_.chunked_obj.str->Size())
+        return false;
+      GetString(&tl.tmp_str);
+      return tl.tmp_str == sv;
+    case PREFIXED_TAG: {
+      string_view prefix = tl.key_prefixes->Get(u_.prefixed.prefix_id);
+      return sv.size() == prefix.size() + u_.prefixed.suffix_len && absl::StartsWith(sv, prefix) &&
+             sv.substr(prefix.size()) == string_view{u_.prefixed.suffix, u_.prefixed.suffix_len};
+    }
     default:
       break;
   }
@@ -1131,7 +1800,7 @@ bool CompactObj::CmpEncoded(string_view sv) const {
     return detail::compare_packed(to_byte(u_.r_obj.inner_obj()), sv.data(), sv.size());
   }
 
-  if (taglen_ == JSON_TAG) {
+  if (taglen_ == JSON_TAG || taglen_ == PACKED_JSON_TAG) {
     return false;  // cannot compare json with string
   }
 
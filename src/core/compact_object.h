@@ -9,18 +9,34 @@
 #include <memory_resource>
 #include <optional>
 
+#include "core/bloom.h"
 #include "core/json_object.h"
 #include "core/small_string.h"
+#include "core/time_series.h"
 
 typedef struct redisObject robj;
 
 namespace dfly {
 
+class ChunkedString;
+class RoaringBitmap;
+
 constexpr unsigned kEncodingIntSet = 0;
 constexpr unsigned kEncodingStrMap = 1;   // for set/map encodings of strings
 constexpr unsigned kEncodingStrMap2 = 2;  // for set/map encodings of strings using DenseSet
 constexpr unsigned kEncodingListPack = 3;
 
+// Sorted sets keep the redis OBJ_ENCODING_LISTPACK encoding for small sets. Large sets
+// are stored in SortedMap, with an encoding that does not clash with OBJ_ENCODING_* values.
+constexpr unsigned kEncodingSortedMap = 12;
+
+// Lists are stored in ChunkedList instead of the redis quicklist.
+constexpr unsigned kEncodingChunkedList = 13;
+
+// Codecs of compressed string values.
+// ZSTD_DICT compresses with the dictionary of the calling thread, see ZstdDictRegistry.
+enum class CompressCodec : uint8_t { NONE = 0, LZ4 = 1, ZSTD = 2, ZSTD_DICT = 3 };
+
 namespace detail {
 
 // redis objects or blobs of upto 4GB size.
@@ -53,7 +69,9 @@ class RobjWrapper {
     return std::string_view{reinterpret_cast<char*>(inner_obj_), sz_};
   }
 
-  bool DefragIfNeeded(float ratio);
+  // Reallocates the parts of the object that reside on memory pages whose utilization is
+  // below ratio. Returns the number of bytes that were reallocated.
+  size_t DefragIfNeeded(float ratio);
 
  private:
   bool Reallocate(std::pmr::memory_resource* mr);
@@ -95,7 +113,23 @@ class CompactObj {
   CompactObj(const CompactObj&) = delete;
 
   // 0-16 is reserved for inline lengths of string type.
-  enum TagEnum { INT_TAG = 17, SMALL_TAG = 18, ROBJ_TAG = 19, EXTERNAL_TAG = 20, JSON_TAG = 21 };
+  enum TagEnum {
+    INT_TAG = 17,
+    SMALL_TAG = 18,
+    ROBJ_TAG = 19,
+    EXTERNAL_TAG = 20,
+    JSON_TAG = 21,
+    COMPRESSED_TAG = 22,
+    BITMAP_TAG = 23,
+    SBF_TAG = 24,
+    PACKED_JSON_TAG = 25,
+    CHUNKED_STR_TAG = 26,
+    PREFIXED_TAG = 27,  // a key whose prefix is in the thread KeyPrefixTable.
+    DOUBLE_TAG = 28,
+    TS_TAG = 29,
+    TINY_HASH_TAG = 30,  // a listpack hash of at most kInlineLen bytes, stored in u_.
+    TINY_SET_TAG = 31,   // an intset of at most kInlineLen bytes, stored in u_.
+  };
 
   enum MaskBit {
     REF_BIT = 1,
@@ -110,6 +144,7 @@ class CompactObj {
     ASCII2_ENC_BIT = 0x10,
     IO_PENDING = 0x20,
     STICKY = 0x40,
+    TOUCHED = 0x80,
   };
 
   static constexpr uint8_t kEncMask = ASCII1_ENC_BIT | ASCII2_ENC_BIT;
@@ -207,7 +242,8 @@ class CompactObj {
     return mask_ & IO_PENDING;
   }
 
-  bool DefragIfNeeded(float ratio);
+  // Returns the number of bytes that were reallocated, see RobjWrapper::DefragIfNeeded.
+  size_t DefragIfNeeded(float ratio);
 
   void SetIoPending(bool b) {
     if (b) {
@@ -217,6 +253,20 @@ class CompactObj {
     }
   }
 
+  // Set on every lookup of the value and cleared by the tiered storage sweep
+  // that looks for cold values.
+  bool IsTouched() const {
+    return mask_ & TOUCHED;
+  }
+
+  void SetTouched(bool t) {
+    if (t) {
+      mask_ |= TOUCHED;
+    } else {
+      mask_ &= ~TOUCHED;
+    }
+  }
+
   bool IsSticky() const {
     return mask_ & STICKY;
   }
@@ -232,10 +282,15 @@ class CompactObj {
   unsigned Encoding() const;
   unsigned ObjType() const;
 
+  // For a tiny container points into the object itself, therefore the pointer is valid only
+  // until the object is moved or changed.
   void* RObjPtr() const {
+    if (IsTiny())
+      return const_cast<char*>(u_.inline_str);
     return u_.r_obj.inner_obj();
   }
 
+  // Requires: !IsTiny().
   void SetRObjPtr(void* ptr) {
     u_.r_obj.Init(u_.r_obj.type(), u_.r_obj.encoding(), ptr);
   }
@@ -253,14 +308,85 @@ class CompactObj {
   // Requires: AsRObj() has been called before in the same thread in fiber-atomic section.
   void SyncRObj();
 
+  // Moves a listpack hash or an intset whose blob fits into kInlineLen bytes into the object
+  // and frees its allocation. Returns true if it did. A tiny container reads like the blob it
+  // holds, but must be unpacked before it is changed in place.
+  bool PackTiny();
+
+  // Moves a tiny container back into an allocation of its own, keeping the flags.
+  void UnpackTiny();
+
+  bool IsTiny() const {
+    return taglen_ == TINY_HASH_TAG || taglen_ == TINY_SET_TAG;
+  }
+
   // For STR object.
   void SetInt(int64_t val);
   std::optional<int64_t> TryGetInt() const;
 
+  // For STR object. Stores val that reads as its shortest representation, the same as
+  // RedisReplyBuilder::FormatDouble, so that INCRBYFLOAT does not parse it again.
+  void SetDouble(double val);
+  std::optional<double> TryGetDouble() const;
+
   // For STR object.
   void SetString(std::string_view str);
   void GetString(std::string* res) const;
 
+  // Same as SetString but for keys: keeps the prefix of str that ends with one of the delimiters
+  // of EnableKeyPrefixes as an id in the thread prefix table if the rest of it fits inline.
+  // Such a key must be destroyed by the thread that created it.
+  void SetKey(std::string_view str);
+
+  // Same as SetString but stores str compressed with codec if it reduces its size enough.
+  // Compressed strings are decompressed upon each read, therefore should be used only for
+  // large values and never for keys.
+  void SetCompressedString(std::string_view str, CompressCodec codec);
+
+  bool IsCompressed() const {
+    return taglen_ == COMPRESSED_TAG;
+  }
+
+  struct CompressedBlob {
+    CompressCodec codec;
+    uint32_t raw_size;
+    std::string_view blob;
+  };
+
+  // Requires: IsCompressed() - true.
+  CompressedBlob GetCompressed() const;
+
+  // Takes a blob previously returned by GetCompressed, for example during snapshot loading.
+  // Returns false if the blob is corrupted, in which case the object is not changed.
+  bool ImportCompressed(const CompressedBlob& cb);
+
+  // Stores a string value that is used as a bitmap as a RoaringBitmap. As for compressed
+  // strings, its bytes are rebuilt upon each read of the string.
+  void SetBitmap(RoaringBitmap&& bitmap);
+
+  bool IsBitmap() const {
+    return taglen_ == BITMAP_TAG;
+  }
+
+  // Requires: IsBitmap() - true. The bitmap may be changed in place.
+  RoaringBitmap* GetBitmap() const {
+    return u_.bitmap_obj.bitmap;
+  }
+
+  // Stores a large string that grows by APPEND and PREPEND as a ChunkedString, which changes
+  // at its ends without copying the whole value. Its bytes are joined upon reads that need
+  // a flat view of the string.
+  void SetChunkedString(ChunkedString&& str);
+
+  bool IsChunked() const {
+    return taglen_ == CHUNKED_STR_TAG;
+  }
+
+  // Requires: IsChunked() - true. The string may be changed in place.
+  ChunkedString* GetChunked() const {
+    return u_.chunked_obj.str;
+  }
+
   // Will set this to hold OBJ_JSON, after that it is safe to call GetJson
   // NOTE: in order to avid copy which can be expensive in this case,
   // you need to move an object that created with the function JsonFromString
@@ -270,6 +396,40 @@ class CompactObj {
   // pre condition - the type here is OBJ_JSON and was set with SetJson
   JsonType* GetJson() const;
 
+  // Sets this to hold OBJ_JSON in the packed form of json_pack.h, copying blob.
+  void SetPackedJson(std::string_view blob);
+
+  bool IsPackedJson() const {
+    return taglen_ == PACKED_JSON_TAG;
+  }
+
+  // Requires: IsPackedJson().
+  std::string_view GetPackedJson() const {
+    return std::string_view(reinterpret_cast<const char*>(u_.packed_json.blob),
+                            u_.packed_json.blob_size);
+  }
+
+  // Requires: IsPackedJson(). Overwrites bytes of the blob at offset, keeping its size.
+  void PatchPackedJson(size_t offset, std::string_view bytes);
+
+  // Sets this to hold a scalable bloom filter of type OBJ_SBF. sbf must allocate its filters
+  // from memory_resource().
+  void SetSBF(SBF&& sbf);
+
+  // Requires: ObjType() == OBJ_SBF. The filter may be changed in place.
+  SBF* GetSBF() const {
+    return u_.sbf_obj.sbf;
+  }
+
+  // Sets this to hold a time series of type OBJ_TS. ts must allocate its chunks from
+  // memory_resource().
+  void SetTimeSeries(TimeSeries&& ts);
+
+  // Requires: ObjType() == OBJ_TS. The series may be changed in place.
+  TimeSeries* GetTimeSeries() const {
+    return u_.ts_obj.ts;
+  }
+
   // dest must have at least Size() bytes available
   void GetString(char* dest) const;
 
@@ -277,6 +437,10 @@ class CompactObj {
     return taglen_ == EXTERNAL_TAG;
   }
   void SetExternal(size_t offset, size_t sz);
+
+  // Marks a container object as unloaded into the external storage. ObjType() and Encoding()
+  // keep returning its type and encoding until it is loaded back.
+  void SetExternal(size_t offset, size_t sz, unsigned type, unsigned encoding);
   std::pair<size_t, size_t> GetExternalPtr() const;
 
   // In case this object a single blob, returns number of bytes allocated on heap
@@ -286,6 +450,11 @@ class CompactObj {
   // Resets the object to empty state.
   void Reset();
 
+  // Deletes up to about count elements of a large container, so that it can be freed in steps.
+  // Returns true once the rest of the object is cheap to free with Reset. The object must not
+  // be used for anything else until then.
+  bool FreeStep(size_t count);
+
   bool IsInline() const {
     return taglen_ <= kInlineLen;
   }
@@ -296,11 +465,17 @@ class CompactObj {
 
   struct Stats {
     size_t small_string_bytes = 0;
+    size_t key_prefixes = 0;
+    size_t key_prefix_bytes = 0;
   };
 
   static Stats GetStats();
 
   static void InitThreadLocal(std::pmr::memory_resource* mr);
+
+  // Enables the prefix table of SetKey for the calling thread, disables it if delimiters is
+  // empty. Must be called before the thread creates keys with SetKey or after it freed them.
+  static void EnableKeyPrefixes(std::string_view delimiters);
   static std::pmr::memory_resource* memory_resource();  // thread-local.
 
  private:
@@ -315,6 +490,9 @@ class CompactObj {
 
   bool CmpEncoded(std::string_view sv) const;
 
+  // Decompresses COMPRESSED_TAG string into dest that must have room for raw_size bytes.
+  void Decompress(char* dest) const;
+
   void SetMeta(uint8_t taglen, uint8_t mask = 0) {
     if (HasAllocated()) {
       Free();
@@ -328,7 +506,9 @@ class CompactObj {
   struct ExternalPtr {
     size_t offset;
     uint32_t size;
-    uint32_t unneeded;
+    uint8_t type;  // type and encoding of the unloaded object.
+    uint8_t encoding;
+    uint16_t unneeded;
   } __attribute__((packed));
 
   struct JsonWrapper {
@@ -336,6 +516,45 @@ class CompactObj {
     size_t unneeded = 0;
   } __attribute__((packed));
 
+  struct BitmapWrapper {
+    RoaringBitmap* bitmap = nullptr;
+    size_t unneeded = 0;
+  } __attribute__((packed));
+
+  struct ChunkedWrapper {
+    ChunkedString* str = nullptr;
+    size_t unneeded = 0;
+  } __attribute__((packed));
+
+  struct SbfWrapper {
+    SBF* sbf = nullptr;
+    size_t unneeded = 0;
+  } __attribute__((packed));
+
+  struct TimeSeriesWrapper {
+    TimeSeries* ts = nullptr;
+    size_t unneeded = 0;
+  } __attribute__((packed));
+
+  struct PackedJsonBlob {
+    uint8_t* blob;
+    uint32_t blob_size;
+    uint32_t unneeded;
+  } __attribute__((packed));
+
+  struct PrefixedKey {
+    uint16_t prefix_id;
+    uint8_t suffix_len;
+    char suffix[13];
+  } __attribute__((packed));
+
+  struct CompressedStr {
+    uint8_t* blob;
+    uint32_t blob_size;
+    uint32_t raw_size : 28;  // strings are limited to 256MB.
+    uint32_t codec : 4;
+  } __attribute__((packed));
+
   // My main data structure. Union of representations.
   // RobjWrapper is kInlineLen=16 bytes, so we employ SSO of that size via inline_str.
   // In case of int values, we waste 8 bytes. I am assuming it's ok and it's not the data type
@@ -347,7 +566,15 @@ class CompactObj {
     detail::RobjWrapper r_obj;
     JsonWrapper json_obj;
     int64_t ival __attribute__((packed));
+    double dval __attribute__((packed));
     ExternalPtr ext_ptr;
+    CompressedStr compressed;
+    PackedJsonBlob packed_json;
+    BitmapWrapper bitmap_obj;
+    ChunkedWrapper chunked_obj;
+    SbfWrapper sbf_obj;
+    TimeSeriesWrapper ts_obj;
+    PrefixedKey prefixed;
 
     U() : r_obj() {
     }
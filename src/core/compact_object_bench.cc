@@ -0,0 +1,196 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include <benchmark/benchmark.h>
+#include <mimalloc.h>
+
+#include <absl/strings/str_cat.h>
+
+#include <random>
+
+#include "base/init.h"
+#include "base/logging.h"
+#include "core/compact_object.h"
+#include "core/mi_memory_resource.h"
+
+extern "C" {
+#include "redis/zmalloc.h"
+}
+
+// Runs google benchmarks for the string encodings of CompactObj. For example:
+//   ./compact_object_bench --benchmark_filter=BM_SetString --benchmark_counters_tabular=true
+// Use --benchmark_format=json or --benchmark_out=<file> to get results that can be diffed.
+// All the allocations of CompactObj are served by the backing mimalloc heap, from whose areas
+// "heap_blocks_per_obj" and "heap_bytes_per_obj" are computed.
+
+using namespace std;
+
+namespace dfly {
+
+namespace {
+
+// Value kinds that take different paths of SetString and GetString.
+enum ValueKind : unsigned {
+  kAsciiValue = 0,   // printable, packed by the ASCII encodings.
+  kBinaryValue = 1,  // has bytes above 127, hence stored as is.
+  kIntValue = 2,     // decimal integer, stored as int64 if it fits.
+};
+
+constexpr size_t kNumObjs = 1024;
+
+string MakeValue(ValueKind kind, size_t len, mt19937_64* gen) {
+  string res;
+  switch (kind) {
+    case kAsciiValue:
+      res = absl::StrCat("user:", (*gen)() % 100000, ":session:");
+      while (res.size() < len)
+        res.push_back('a' + (*gen)() % 26);
+      break;
+    case kBinaryValue:
+      res.resize(len);
+      for (char& c : res)
+        c = char((*gen)() % 256);
+      res[0] = char(0xF0);  // never ascii.
+      break;
+    case kIntValue:
+      res = absl::StrCat(1 + (*gen)() % 9);
+      while (res.size() < min<size_t>(len, 18))
+        res.push_back('0' + (*gen)() % 10);
+      break;
+  }
+  res.resize(len);
+  return res;
+}
+
+// Values for state args {ValueKind, length}.
+vector<string> MakeValues(const benchmark::State& state, size_t num) {
+  mt19937_64 gen(42);
+  vector<string> res(num);
+  for (auto& v : res)
+    v = MakeValue(ValueKind(state.range(0)), state.range(1), &gen);
+  return res;
+}
+
+struct HeapUsage {
+  size_t blocks = 0;
+  size_t bytes = 0;
+};
+
+// Sums over the areas of the heap, which is cheaper than visiting every block.
+HeapUsage GetHeapUsage() {
+  HeapUsage res;
+  auto cb = [](const mi_heap_t* heap, const mi_heap_area_t* area, void* block, size_t block_size,
+               void* arg) {
+    auto* usage = reinterpret_cast<HeapUsage*>(arg);
+    usage->blocks += area->used;
+    usage->bytes += area->used * area->block_size;
+    return true;
+  };
+  mi_heap_visit_blocks(mi_heap_get_backing(), false, cb, &res);
+  return res;
+}
+
+void SetHeapCounters(const HeapUsage& before, size_t num_objs, benchmark::State* state) {
+  HeapUsage after = GetHeapUsage();
+  state->counters["heap_blocks_per_obj"] = double(after.blocks - before.blocks) / num_objs;
+  state->counters["heap_bytes_per_obj"] = double(after.bytes - before.bytes) / num_objs;
+}
+
+}  // namespace
+
+/*
+  Args: {ValueKind, value length}. Lengths up to 16 are inlined, lengths above it are packed
+  into SmallString or RobjWrapper allocations.
+*/
+
+// Overwrites the values of live objects, as SET of existing keys does.
+static void BM_SetString(benchmark::State& state) {
+  vector<string> values = MakeValues(state, kNumObjs * 2);
+  HeapUsage before = GetHeapUsage();
+  vector<CompactObj> objs(kNumObjs);
+
+  size_t i = 0;
+  for (auto _ : state) {
+    objs[i % kNumObjs].SetString(values[i % values.size()]);
+    ++i;
+  }
+
+  state.SetBytesProcessed(state.iterations() * state.range(1));
+  SetHeapCounters(before, kNumObjs, &state);
+}
+BENCHMARK(BM_SetString)->ArgsProduct({{kAsciiValue, kBinaryValue}, {8, 16, 32, 128, 1024}});
+BENCHMARK(BM_SetString)->ArgsProduct({{kIntValue}, {8, 18}});
+
+// Reads values into a reused buffer, which decodes the ASCII packed ones.
+static void BM_GetString(benchmark::State& state) {
+  vector<string> values = MakeValues(state, kNumObjs);
+  vector<CompactObj> objs(kNumObjs);
+  for (size_t i = 0; i < kNumObjs; ++i)
+    objs[i].SetString(values[i]);
+
+  string scratch;
+  size_t i = 0;
+  for (auto _ : state) {
+    objs[i++ % kNumObjs].GetString(&scratch);
+    benchmark::DoNotOptimize(scratch.data());
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(1));
+}
+BENCHMARK(BM_GetString)->ArgsProduct({{kAsciiValue, kBinaryValue}, {8, 16, 32, 128, 1024}});
+BENCHMARK(BM_GetString)->ArgsProduct({{kIntValue}, {8, 18}});
+
+// GetSlice avoids the copy for values that are stored as is.
+static void BM_GetSlice(benchmark::State& state) {
+  vector<string> values = MakeValues(state, kNumObjs);
+  vector<CompactObj> objs(kNumObjs);
+  for (size_t i = 0; i < kNumObjs; ++i)
+    objs[i].SetString(values[i]);
+
+  string scratch;
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(objs[i++ % kNumObjs].GetSlice(&scratch));
+  }
+}
+BENCHMARK(BM_GetSlice)->ArgsProduct({{kAsciiValue, kBinaryValue}, {32, 1024}});
+
+// Compares objects with strings as key lookups do. Every 2nd comparison differs at the end.
+static void BM_CompareString(benchmark::State& state) {
+  vector<string> values = MakeValues(state, kNumObjs);
+  vector<CompactObj> objs(kNumObjs);
+  for (size_t i = 0; i < kNumObjs; ++i)
+    objs[i].SetString(values[i]);
+
+  vector<string> probes = values;
+  for (size_t i = 0; i < probes.size(); i += 2)
+    probes[i].back() ^= 1;
+
+  size_t i = 0, equal = 0;
+  for (auto _ : state) {
+    equal += (objs[i % kNumObjs] == string_view{probes[i % kNumObjs]});
+    ++i;
+  }
+  CHECK_EQ(equal, state.iterations() / 2);
+}
+BENCHMARK(BM_CompareString)->ArgsProduct({{kAsciiValue, kBinaryValue}, {16, 32, 128}});
+
+}  // namespace dfly
+
+using namespace dfly;
+
+int main(int argc, char* argv[]) {
+  // Consumes --benchmark_xxx flags before absl flags are parsed.
+  benchmark::Initialize(&argc, argv);
+  MainInitGuard guard(&argc, &argv);
+
+  mi_heap_t* tlh = mi_heap_get_backing();
+  MiMemoryResource mi_resource(tlh);
+  init_zmalloc_threadlocal(tlh);
+  SmallString::InitThreadLocal(tlh);
+  CompactObj::InitThreadLocal(&mi_resource);
+
+  benchmark::RunSpecifiedBenchmarks();
+
+  return 0;
+}
@@ -7,18 +7,29 @@
 #include <mimalloc.h>
 #include <xxhash.h>
 
+#include <random>
+
 #include <jsoncons/json.hpp>
 #include <jsoncons_ext/jsonpath/jsonpath.hpp>
 
 #include "base/gtest.h"
 #include "base/logging.h"
+#include "core/chunked_list.h"
+#include "core/chunked_string.h"
 #include "core/flat_set.h"
 #include "core/json_object.h"
+#include "core/json_pack.h"
 #include "core/mi_memory_resource.h"
+#include "core/roaring_bitmap.h"
+#include "core/sorted_map.h"
+#include "core/string_map.h"
+#include "core/string_set.h"
+#include "core/zstd_dict.h"
 
 extern "C" {
 #include "redis/dict.h"
 #include "redis/intset.h"
+#include "redis/listpack.h"
 #include "redis/object.h"
 #include "redis/redis_aux.h"
 #include "redis/stream.h"
@@ -170,6 +181,24 @@ TEST_F(CompactObjectTest, Int) {
   EXPECT_TRUE(cobj_.HasExpire());
 }
 
+TEST_F(CompactObjectTest, Double) {
+  cobj_.SetDouble(3.25);
+  EXPECT_EQ(3.25, cobj_.TryGetDouble());
+  EXPECT_EQ(OBJ_STRING, cobj_.ObjType());
+  EXPECT_EQ(0u, cobj_.MallocUsed());
+  EXPECT_EQ(4, cobj_.Size());
+  EXPECT_EQ(cobj_, "3.25");
+  EXPECT_EQ("3.25", cobj_.GetSlice(&tmp_));
+  EXPECT_EQ(CompactObj::HashCode("3.25"), cobj_.HashCode());
+  EXPECT_TRUE(cobj_ == CompactObj{"3.25"});
+
+  cobj_.SetDouble(-1e-7);
+  EXPECT_EQ("-1e-7", cobj_.ToString());
+  EXPECT_FALSE(cobj_.TryGetInt());
+  cobj_.SetString("3.25");
+  EXPECT_FALSE(cobj_.TryGetDouble());
+}
+
 TEST_F(CompactObjectTest, MediumString) {
   string tmp(511, 'b');
 
@@ -185,6 +214,211 @@ TEST_F(CompactObjectTest, MediumString) {
   EXPECT_EQ(27463, cobj_.Size());
 }
 
+TEST_F(CompactObjectTest, SmallStringSegments) {
+  vector<CompactObj> objs(1000);
+  for (size_t i = 0; i < objs.size(); ++i)
+    objs[i].SetString(absl::StrCat(string(20 + i % 200, 'x'), i));
+
+  string res;
+  for (size_t i = 0; i < objs.size(); ++i) {
+    objs[i].GetString(&res);
+    ASSERT_EQ(absl::StrCat(string(20 + i % 200, 'x'), i), res);
+  }
+  EXPECT_GT(SmallString::SegmentsThreadLocal(), 0u);
+  EXPECT_LE(SmallString::SegmentsThreadLocal(), SmallString::MaxSegments());
+
+  for (auto& obj : objs)
+    obj.Reset();
+}
+
+TEST_F(CompactObjectTest, KeyPrefixes) {
+  CompactObj::EnableKeyPrefixes(":");
+
+  string prefix = "svc:eu-west:tenant17:order:";
+  vector<CompactObj> keys(100);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    keys[i].SetKey(absl::StrCat(prefix, i));
+    EXPECT_EQ(0u, keys[i].MallocUsed());
+  }
+  EXPECT_EQ(1u, CompactObj::GetStats().key_prefixes);
+
+  for (size_t i = 0; i < keys.size(); ++i) {
+    string key = absl::StrCat(prefix, i);
+    EXPECT_EQ(key.size(), keys[i].Size());
+    EXPECT_EQ(key, keys[i].ToString());
+    EXPECT_EQ(CompactObj::HashCode(key), keys[i].HashCode());
+    EXPECT_TRUE(keys[i] == key);
+    EXPECT_FALSE(keys[i] == absl::StrCat(prefix, i + 1000));
+    EXPECT_TRUE(CompactObj{key} == keys[i]);
+  }
+  EXPECT_FALSE(keys[0] == keys[1]);
+
+  // The suffix does not fit, or the key is short enough to be inline anyway.
+  cobj_.SetKey(prefix + string(20, 's'));
+  EXPECT_EQ(prefix.size() + 20, cobj_.Size());
+  EXPECT_GT(cobj_.MallocUsed(), 0u);
+  cobj_.SetKey("abc:def");
+  EXPECT_TRUE(cobj_.IsInline());
+  cobj_.Reset();
+
+  for (auto& key : keys)
+    key.Reset();
+  EXPECT_EQ(0u, CompactObj::GetStats().key_prefixes);
+  CompactObj::EnableKeyPrefixes("");
+}
+
+TEST_F(CompactObjectTest, CompressedString) {
+  string val;
+  for (unsigned i = 0; i < 200; ++i) {
+    absl::StrAppend(&val, "{\"id\":", i, ",\"name\":\"session\",\"active\":true}");
+  }
+
+  for (CompressCodec codec : {CompressCodec::LZ4, CompressCodec::ZSTD}) {
+    cobj_.SetCompressedString(val, codec);
+    ASSERT_TRUE(cobj_.IsCompressed());
+    EXPECT_EQ(OBJ_STRING, cobj_.ObjType());
+    EXPECT_EQ(val.size(), cobj_.Size());
+    EXPECT_LT(cobj_.GetCompressed().blob.size(), val.size() / 2);
+    EXPECT_EQ(val, cobj_.GetSlice(&tmp_));
+    EXPECT_EQ(val, cobj_.ToString());
+    EXPECT_EQ(cobj_, val);
+
+    CompactObj imported;
+    ASSERT_TRUE(imported.ImportCompressed(cobj_.GetCompressed()));
+    EXPECT_EQ(val, imported.ToString());
+  }
+
+  // Overriding a compressed string with a regular one.
+  cobj_.SetString("foo");
+  EXPECT_FALSE(cobj_.IsCompressed());
+  EXPECT_EQ("foo", cobj_.ToString());
+
+  // Strings that do not compress well are stored as is.
+  std::mt19937 rand_gen;
+  string random_val;
+  for (unsigned i = 0; i < 4096; ++i) {
+    random_val.push_back(char(rand_gen()));
+  }
+  cobj_.SetCompressedString(random_val, CompressCodec::LZ4);
+  EXPECT_FALSE(cobj_.IsCompressed());
+  EXPECT_EQ(random_val, cobj_.ToString());
+
+  CompactObj::CompressedBlob bad{.codec = CompressCodec::LZ4, .raw_size = 100, .blob = "garbage"};
+  EXPECT_FALSE(cobj_.ImportCompressed(bad));
+  EXPECT_EQ(random_val, cobj_.ToString());
+}
+
+TEST_F(CompactObjectTest, Bitmap) {
+  string val(100000, 0);
+  val[500] = '\x01';
+  val[99999] = '\x80';
+
+  cobj_.SetBitmap(RoaringBitmap::FromBytes(val));
+  ASSERT_TRUE(cobj_.IsBitmap());
+  EXPECT_EQ(OBJ_STRING, cobj_.ObjType());
+  EXPECT_EQ(val.size(), cobj_.Size());
+  EXPECT_LT(cobj_.MallocUsed(), 256);
+  EXPECT_EQ(val, cobj_.GetSlice(&tmp_));
+  EXPECT_EQ(val, cobj_.ToString());
+  EXPECT_EQ(cobj_, val);
+
+  // The bitmap is changed in place.
+  cobj_.GetBitmap()->Set(0, true);
+  val[0] = '\x80';
+  EXPECT_EQ(val, cobj_.ToString());
+
+  cobj_.SetString("foo");
+  EXPECT_FALSE(cobj_.IsBitmap());
+  EXPECT_EQ("foo", cobj_.ToString());
+}
+
+TEST_F(CompactObjectTest, ChunkedString) {
+  string val(200000, 'a');
+  cobj_.SetChunkedString(ChunkedString(val));
+  ASSERT_TRUE(cobj_.IsChunked());
+  EXPECT_EQ(OBJ_STRING, cobj_.ObjType());
+  EXPECT_EQ(val.size(), cobj_.Size());
+  EXPECT_GE(cobj_.MallocUsed(), val.size());
+
+  // The string is changed in place.
+  cobj_.GetChunked()->Append("bc");
+  cobj_.GetChunked()->Prepend("z");
+  val = "z" + val + "bc";
+  EXPECT_EQ(val.size(), cobj_.Size());
+  EXPECT_EQ(val, cobj_.GetSlice(&tmp_));
+  EXPECT_EQ(val, cobj_.ToString());
+  EXPECT_EQ(cobj_, val);
+  EXPECT_FALSE(cobj_ == string_view{val}.substr(1));
+
+  cobj_.SetString("foo");
+  EXPECT_FALSE(cobj_.IsChunked());
+  EXPECT_EQ("foo", cobj_.ToString());
+}
+
+TEST_F(CompactObjectTest, SBF) {
+  cobj_.SetSBF(SBF(1000, 0.01, 2, CompactObj::memory_resource()));
+  EXPECT_EQ(OBJ_SBF, cobj_.ObjType());
+  EXPECT_TRUE(cobj_.GetSBF()->Add("a"));
+  EXPECT_TRUE(cobj_.GetSBF()->Exists("a"));
+  EXPECT_GT(cobj_.MallocUsed(), 1000);
+
+  cobj_.SetString("foo");
+  EXPECT_EQ(OBJ_STRING, cobj_.ObjType());
+}
+
+TEST_F(CompactObjectTest, TimeSeries) {
+  cobj_.SetTimeSeries(TimeSeries(0, CompactObj::memory_resource()));
+  EXPECT_EQ(OBJ_TS, cobj_.ObjType());
+  for (unsigned i = 1; i <= 1000; ++i) {
+    EXPECT_TRUE(cobj_.GetTimeSeries()->Add(i * 1000, i));
+  }
+  EXPECT_EQ(1000, cobj_.GetTimeSeries()->Size());
+  EXPECT_GT(cobj_.MallocUsed(), 0);
+
+  cobj_.SetString("foo");
+  EXPECT_EQ(OBJ_STRING, cobj_.ObjType());
+}
+
+TEST_F(CompactObjectTest, DictCompressedString) {
+  auto make_val = [](unsigned i) {
+    return absl::StrCat("{\"id\":", i, ",\"name\":\"user", i * 7, "\",\"email\":\"user", i,
+                        "@example.com\",\"active\":", i % 2 ? "true" : "false",
+                        ",\"roles\":[\"reader\",\"writer\"]}");
+  };
+
+  string samples;
+  vector<size_t> sample_sizes;
+  for (unsigned i = 0; i < 2000; ++i) {
+    string val = make_val(i);
+    samples.append(val);
+    sample_sizes.push_back(val.size());
+  }
+
+  string dict = ZstdDictRegistry::Train(samples, sample_sizes, 4096);
+  ASSERT_FALSE(dict.empty());
+  const ZstdDictRegistry::Entry* entry = ZstdDictRegistry::Register(dict);
+  ASSERT_TRUE(entry);
+  EXPECT_EQ(entry, ZstdDictRegistry::Register(dict));
+  EXPECT_EQ(entry, ZstdDictRegistry::Find(entry->id));
+  EXPECT_FALSE(ZstdDictRegistry::Register("not a dictionary"));
+
+  string val = absl::StrCat(make_val(5000), make_val(5001));
+
+  // Without a dictionary the value is stored as is.
+  cobj_.SetCompressedString(val, CompressCodec::ZSTD_DICT);
+  EXPECT_FALSE(cobj_.IsCompressed());
+
+  ZstdDictRegistry::SetThreadDict(entry);
+  cobj_.SetCompressedString(val, CompressCodec::ZSTD_DICT);
+  ASSERT_TRUE(cobj_.IsCompressed());
+  EXPECT_EQ(val, cobj_.ToString());
+
+  CompactObj imported;
+  ASSERT_TRUE(imported.ImportCompressed(cobj_.GetCompressed()));
+  EXPECT_EQ(val, imported.ToString());
+  ZstdDictRegistry::SetThreadDict(nullptr);
+}
+
 TEST_F(CompactObjectTest, AsciiUtil) {
   std::string_view data{"aaaaaabb"};
   uint8_t buf[32];
@@ -234,6 +468,55 @@ TEST_F(CompactObjectTest, HSet) {
   cobj_.SyncRObj();
 }
 
+TEST_F(CompactObjectTest, TinyContainers) {
+  uint8_t* lp = lpNew(0);
+  lp = lpAppend(lp, (const uint8_t*)"a", 1);
+  lp = lpAppend(lp, (const uint8_t*)"1", 1);
+  cobj_.InitRobj(OBJ_HASH, kEncodingListPack, lp);
+  cobj_.SetFlag(true);
+
+  ASSERT_TRUE(cobj_.PackTiny());
+  EXPECT_TRUE(cobj_.IsTiny());
+  EXPECT_TRUE(cobj_.HasFlag());
+  EXPECT_EQ(OBJ_HASH, cobj_.ObjType());
+  EXPECT_EQ(kEncodingListPack, cobj_.Encoding());
+  EXPECT_EQ(1, cobj_.Size());
+  EXPECT_EQ(0, cobj_.MallocUsed());
+  sds field = sdsnew("a");
+  EXPECT_TRUE(hashTypeExists(cobj_.AsRObj(), field));
+  sdsfree(field);
+
+  // Grows beyond the inline budget once unpacked.
+  cobj_.UnpackTiny();
+  EXPECT_FALSE(cobj_.IsTiny());
+  EXPECT_TRUE(cobj_.HasFlag());
+  lp = (uint8_t*)cobj_.RObjPtr();
+  lp = lpAppend(lp, (const uint8_t*)"bb", 2);
+  lp = lpAppend(lp, (const uint8_t*)"22", 2);
+  cobj_.SetRObjPtr(lp);
+  EXPECT_FALSE(cobj_.PackTiny());
+  EXPECT_EQ(2, cobj_.Size());
+  EXPECT_GT(cobj_.MallocUsed(), 0);
+
+  intset* is = intsetNew();
+  uint8_t success = 0;
+  for (int64_t val : {1, 2, 3})
+    is = intsetAdd(is, val, &success);
+  cobj_.InitRobj(OBJ_SET, kEncodingIntSet, is);
+  ASSERT_TRUE(cobj_.PackTiny());
+  EXPECT_EQ(OBJ_SET, cobj_.ObjType());
+  EXPECT_EQ(kEncodingIntSet, cobj_.Encoding());
+  EXPECT_EQ(3, cobj_.Size());
+  EXPECT_TRUE(intsetFind((intset*)cobj_.RObjPtr(), 2));
+
+  // An int64 member does not fit with the others.
+  cobj_.UnpackTiny();
+  is = intsetAdd((intset*)cobj_.RObjPtr(), INT64_MAX, &success);
+  cobj_.SetRObjPtr(is);
+  EXPECT_FALSE(cobj_.PackTiny());
+  EXPECT_EQ(4, cobj_.Size());
+}
+
 TEST_F(CompactObjectTest, ZSet) {
   // unrelated, checking that sds static encoding works.
   // it is used in zset special strings.
@@ -249,6 +532,62 @@ TEST_F(CompactObjectTest, ZSet) {
   EXPECT_EQ(OBJ_ENCODING_LISTPACK, cobj_.Encoding());
 }
 
+TEST_F(CompactObjectTest, FreeStep) {
+  constexpr size_t kNum = 10000;
+  auto free_steps = [this] {
+    unsigned steps = 1;
+    while (!cobj_.FreeStep(1000))
+      ++steps;
+    cobj_.Reset();
+    return steps;
+  };
+
+  StringSet* ss = new StringSet;
+  for (size_t i = 0; i < kNum; ++i)
+    ss->Add(absl::StrCat("member", i));
+  cobj_.InitRobj(OBJ_SET, kEncodingStrMap2, ss);
+  EXPECT_GT(free_steps(), 5);
+
+  StringMap* sm = new StringMap;
+  for (size_t i = 0; i < kNum; ++i)
+    sm->AddOrUpdate(absl::StrCat("field", i), "value");
+  cobj_.InitRobj(OBJ_HASH, kEncodingStrMap2, sm);
+  EXPECT_GT(free_steps(), 5);
+
+  ChunkedList* cl = new ChunkedList;
+  for (size_t i = 0; i < kNum; ++i)
+    cl->Push(absl::StrCat("element", i), ChunkedList::TAIL);
+  cobj_.InitRobj(OBJ_LIST, kEncodingChunkedList, cl);
+  EXPECT_EQ(kNum / 1000, free_steps());
+
+  SortedMap* zs = new SortedMap;
+  for (size_t i = 0; i < kNum; ++i)
+    zs->Insert(i, absl::StrCat("member", i));
+  cobj_.InitRobj(OBJ_ZSET, kEncodingSortedMap, zs);
+  EXPECT_EQ(kNum / 1000, free_steps());
+
+  cobj_.SetString("small");
+  EXPECT_TRUE(cobj_.FreeStep(1000));
+}
+
+TEST_F(CompactObjectTest, External) {
+  cobj_.SetString(string(100, 'x'));
+  cobj_.SetExpire(true);
+  cobj_.SetExternal(4096, 100);
+  EXPECT_TRUE(cobj_.IsExternal());
+  EXPECT_TRUE(cobj_.HasExpire());
+  EXPECT_EQ(OBJ_STRING, cobj_.ObjType());
+  EXPECT_EQ(make_pair<size_t, size_t>(4096, 100), cobj_.GetExternalPtr());
+
+  cobj_.ImportRObj(createHashObject());
+  cobj_.SetExternal(8192, 200, OBJ_HASH, kEncodingListPack);
+  EXPECT_TRUE(cobj_.IsExternal());
+  EXPECT_EQ(OBJ_HASH, cobj_.ObjType());
+  EXPECT_EQ(kEncodingListPack, cobj_.Encoding());
+  EXPECT_EQ(0, cobj_.MallocUsed());
+  EXPECT_EQ(make_pair<size_t, size_t>(8192, 200), cobj_.GetExternalPtr());
+}
+
 TEST_F(CompactObjectTest, FlatSet) {
   size_t allocated1, resident1, active1;
   size_t allocated2, resident2, active2;
@@ -406,6 +745,38 @@ TEST_F(CompactObjectTest, JsonTypeTest) {
   ASSERT_TRUE(failed_json == nullptr);
 }
 
+TEST_F(CompactObjectTest, PackedJson) {
+  string_view json_str =
+      R"({"b":[1,-2,3.5,true,null],"a":{"x":"y\n"},"n":123456789012345678901234567890})";
+  std::optional<JsonType> json = JsonFromString(json_str);
+  ASSERT_TRUE(json.has_value());
+
+  string blob;
+  PackJson(*json, &blob);
+  cobj_.SetPackedJson(blob);
+  ASSERT_EQ(OBJ_JSON, cobj_.ObjType());
+  ASSERT_TRUE(cobj_.IsPackedJson());
+  EXPECT_EQ(nullptr, cobj_.GetJson());
+  EXPECT_GE(cobj_.MallocUsed(), blob.size());
+
+  PackedJson packed(cobj_.GetPackedJson());
+  EXPECT_EQ(*json, UnpackJson(packed));
+  string text;
+  PackedJsonToString(packed, &text);
+  EXPECT_EQ(json->to_string(), text);
+
+  // Replace -2 with 7 in place.
+  PackedJson elem = packed.Find("b")->At(1);
+  string num;
+  PackJson(JsonType(int64_t(7)), &num);
+  ASSERT_EQ(num.size(), elem.ByteSize());
+  cobj_.PatchPackedJson(elem.data() - cobj_.GetPackedJson().data(), num);
+  EXPECT_EQ(7, PackedJson(cobj_.GetPackedJson()).Find("b")->At(1).AsInt());
+
+  cobj_.SetString("foo");
+  EXPECT_EQ(OBJ_STRING, cobj_.ObjType());
+}
+
 TEST_F(CompactObjectTest, JsonTypeWithPathTest) {
   std::string_view books_json =
       R"({"books":[{
@@ -0,0 +1,206 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/crc64.h"
+
+#include <initializer_list>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#endif
+
+extern "C" {
+#include "redis/crc64.h"
+}
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+// The CRC is reflected: bit i of a 64-bit word is the coefficient of x^(63 - i), so the first
+// bytes of a 16-byte block, which load into its low word, hold the higher degrees. Folding moves
+// a block d bits ahead by multiplying its two words with x^(d + 64) and x^d modulo the
+// polynomial P. The reflected carry-less product of two words comes out multiplied by x, hence
+// the constants are kXd = x^(d - 1) mod P, reflected.
+constexpr uint64_t kX127 = 0x381d0015c96f4444;
+constexpr uint64_t kX191 = 0xd9d7be7d505da32c;
+constexpr uint64_t kX511 = 0xf49784a634f014e4;
+constexpr uint64_t kX575 = 0xaf86efb16d9ab4fb;
+
+// The inputs below it are not worth the setup of the folding.
+constexpr size_t kMinFoldLen = 64;
+
+// The remaining 128-bit block R is reduced with the tables: crc64(0, R) = R * x^64 mod P.
+uint64_t FinishFold(const uint8_t block[16], const uint8_t* data, size_t len) {
+  uint64_t crc = crc64(0, block, 16);
+  return crc64(crc, data, len);
+}
+
+uint64_t Crc64Generic(uint64_t crc, const uint8_t* data, size_t len) {
+  return crc64(crc, data, len);
+}
+
+#if defined(__x86_64__)
+
+#define CLMUL __attribute__((target("pclmul,sse4.1")))
+
+CLMUL inline __m128i Load128(const uint8_t* data) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+}
+
+// k holds the constant of the low word of x in its low word, and of the high word in its high.
+CLMUL inline __m128i Fold(__m128i x, __m128i k) {
+  return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+CLMUL uint64_t Crc64Pclmul(uint64_t crc, const uint8_t* data, size_t len) {
+  if (len < kMinFoldLen)
+    return crc64(crc, data, len);
+
+  const __m128i k512 = _mm_set_epi64x(kX511, kX575);
+  const __m128i k128 = _mm_set_epi64x(kX127, kX191);
+
+  // Starting from crc is the same as xoring it into the first 8 bytes.
+  __m128i x0 = _mm_xor_si128(Load128(data), _mm_cvtsi64_si128(crc));
+  __m128i x1 = Load128(data + 16), x2 = Load128(data + 32), x3 = Load128(data + 48);
+  data += 64;
+  len -= 64;
+
+  // Four independent blocks, 512 bits apart, hide the latency of the multiplications.
+  for (; len >= 64; data += 64, len -= 64) {
+    x0 = _mm_xor_si128(Fold(x0, k512), Load128(data));
+    x1 = _mm_xor_si128(Fold(x1, k512), Load128(data + 16));
+    x2 = _mm_xor_si128(Fold(x2, k512), Load128(data + 32));
+    x3 = _mm_xor_si128(Fold(x3, k512), Load128(data + 48));
+  }
+
+  x1 = _mm_xor_si128(Fold(x0, k128), x1);
+  x2 = _mm_xor_si128(Fold(x1, k128), x2);
+  x3 = _mm_xor_si128(Fold(x2, k128), x3);
+  for (; len >= 16; data += 16, len -= 16)
+    x3 = _mm_xor_si128(Fold(x3, k128), Load128(data));
+
+  uint8_t block[16];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(block), x3);
+  return FinishFold(block, data, len);
+}
+
+#undef CLMUL
+
+bool HasPclmul() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+
+#elif defined(__aarch64__)
+
+#define PMULL __attribute__((target("+crypto")))
+
+PMULL inline uint64x2_t Mul(uint64_t a, uint64_t b) {
+  return vreinterpretq_u64_p128(vmull_p64(poly64_t(a), poly64_t(b)));
+}
+
+// See Fold of PCLMUL, k_lo and k_hi are the constants of the low and the high word of x.
+PMULL inline uint64x2_t Fold(uint64x2_t x, uint64_t k_lo, uint64_t k_hi) {
+  return veorq_u64(Mul(vgetq_lane_u64(x, 0), k_lo), Mul(vgetq_lane_u64(x, 1), k_hi));
+}
+
+PMULL uint64_t Crc64Pmull(uint64_t crc, const uint8_t* data, size_t len) {
+  if (len < kMinFoldLen)
+    return crc64(crc, data, len);
+
+  uint64x2_t x0 = veorq_u64(vld1q_u64(reinterpret_cast<const uint64_t*>(data)),
+                            vsetq_lane_u64(crc, vdupq_n_u64(0), 0));
+  uint64x2_t x1 = vld1q_u64(reinterpret_cast<const uint64_t*>(data + 16));
+  uint64x2_t x2 = vld1q_u64(reinterpret_cast<const uint64_t*>(data + 32));
+  uint64x2_t x3 = vld1q_u64(reinterpret_cast<const uint64_t*>(data + 48));
+  data += 64;
+  len -= 64;
+
+  auto load = [](const uint8_t* p) { return vld1q_u64(reinterpret_cast<const uint64_t*>(p)); };
+  for (; len >= 64; data += 64, len -= 64) {
+    x0 = veorq_u64(Fold(x0, kX575, kX511), load(data));
+    x1 = veorq_u64(Fold(x1, kX575, kX511), load(data + 16));
+    x2 = veorq_u64(Fold(x2, kX575, kX511), load(data + 32));
+    x3 = veorq_u64(Fold(x3, kX575, kX511), load(data + 48));
+  }
+
+  x1 = veorq_u64(Fold(x0, kX191, kX127), x1);
+  x2 = veorq_u64(Fold(x1, kX191, kX127), x2);
+  x3 = veorq_u64(Fold(x2, kX191, kX127), x3);
+  for (; len >= 16; data += 16, len -= 16)
+    x3 = veorq_u64(Fold(x3, kX191, kX127), load(data));
+
+  uint8_t block[16];
+  vst1q_u64(reinterpret_cast<uint64_t*>(block), x3);
+  return FinishFold(block, data, len);
+}
+
+#undef PMULL
+
+bool HasPmull() {
+  return getauxval(AT_HWCAP) & HWCAP_PMULL;
+}
+
+#endif
+
+using Crc64Fn = uint64_t (*)(uint64_t crc, const uint8_t* data, size_t len);
+
+Crc64Fn KernelFor(Crc64Kernel kernel) {
+  switch (kernel) {
+    case Crc64Kernel::GENERIC:
+      return Crc64Generic;
+    case Crc64Kernel::PCLMUL:
+#if defined(__x86_64__)
+      return HasPclmul() ? Crc64Pclmul : nullptr;
+#else
+      return nullptr;
+#endif
+    case Crc64Kernel::PMULL:
+#if defined(__aarch64__)
+      return HasPmull() ? Crc64Pmull : nullptr;
+#else
+      return nullptr;
+#endif
+  }
+  return nullptr;
+}
+
+Crc64Kernel DefaultKernel() {
+  for (Crc64Kernel kernel : {Crc64Kernel::PCLMUL, Crc64Kernel::PMULL}) {
+    if (KernelFor(kernel))
+      return kernel;
+  }
+  return Crc64Kernel::GENERIC;
+}
+
+Crc64Kernel active_kernel = DefaultKernel();
+Crc64Fn active_fn = KernelFor(active_kernel);
+
+}  // namespace
+
+uint64_t Crc64(uint64_t crc, const void* data, size_t len) {
+  return active_fn(crc, reinterpret_cast<const uint8_t*>(data), len);
+}
+
+Crc64Kernel ActiveCrc64Kernel() {
+  return active_kernel;
+}
+
+bool SelectCrc64Kernel(Crc64Kernel kernel) {
+  Crc64Fn fn = KernelFor(kernel);
+  if (!fn)
+    return false;
+
+  active_kernel = kernel;
+  active_fn = fn;
+  return true;
+}
+
+}  // namespace dfly
@@ -0,0 +1,27 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace dfly {
+
+// The CRC-64 of redis (crc64 of redis/crc64.h), which checksums the DUMP payloads and the RDB
+// files. Large inputs are folded 64 bytes at a time with carry-less multiplications, using
+// PCLMULQDQ on x86 and PMULL on arm when the CPU supports them, which is detected at runtime.
+// The smaller inputs and the remainders use the lookup tables of redis, InitRedisTables has to
+// run before.
+uint64_t Crc64(uint64_t crc, const void* data, size_t len);
+
+enum class Crc64Kernel : uint8_t { GENERIC, PCLMUL, PMULL };
+
+Crc64Kernel ActiveCrc64Kernel();
+
+// Switches Crc64 to an implementation, for tests and benchmarks. Returns false if the CPU does
+// not support it.
+bool SelectCrc64Kernel(Crc64Kernel kernel);
+
+}  // namespace dfly
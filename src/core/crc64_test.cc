@@ -0,0 +1,69 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/crc64.h"
+
+#include <random>
+#include <string_view>
+#include <vector>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+extern "C" {
+#include "redis/crc64.h"
+}
+
+namespace dfly {
+
+using namespace std;
+
+class Crc64Test : public ::testing::TestWithParam<Crc64Kernel> {
+ protected:
+  static void SetUpTestSuite() {
+    crc64_init();
+  }
+
+  void SetUp() override {
+    default_ = ActiveCrc64Kernel();
+    if (!SelectCrc64Kernel(GetParam()))
+      GTEST_SKIP() << "The CPU does not support the kernel";
+  }
+
+  void TearDown() override {
+    SelectCrc64Kernel(default_);
+  }
+
+  Crc64Kernel default_;
+};
+
+INSTANTIATE_TEST_SUITE_P(Kernels, Crc64Test,
+                         ::testing::Values(Crc64Kernel::GENERIC, Crc64Kernel::PCLMUL,
+                                           Crc64Kernel::PMULL));
+
+TEST_P(Crc64Test, Check) {
+  string_view s = "123456789";
+  EXPECT_EQ(0xe9c6d914c4b8d9ca, Crc64(0, s.data(), s.size()));
+}
+
+TEST_P(Crc64Test, SameAsRedis) {
+  mt19937_64 gen(GetParam() == Crc64Kernel::GENERIC ? 1 : 2);
+  vector<uint8_t> data(20000);
+  for (auto& b : data)
+    b = gen();
+
+  // Covers the tails of the folding loops, unaligned starts and the crc of a previous part.
+  for (size_t len : {0, 1, 15, 16, 63, 64, 65, 79, 80, 127, 128, 129, 1000, 4096, 19990}) {
+    for (size_t offset : {0, 1, 7}) {
+      uint64_t crc = gen();
+      ASSERT_EQ(crc64(crc, data.data() + offset, len), Crc64(crc, data.data() + offset, len))
+          << len << " " << offset;
+    }
+  }
+
+  uint64_t crc = Crc64(0, data.data(), 5000);
+  EXPECT_EQ(crc64(0, data.data(), data.size()), Crc64(crc, data.data() + 5000, data.size() - 5000));
+}
+
+}  // namespace dfly
@@ -17,6 +17,12 @@ namespace dfly {
 struct BasicDashPolicy {
   enum { kSlotNum = 12, kBucketNum = 64, kStashBucketNum = 2 };
   static constexpr bool kUseVersion = false;
+  static constexpr bool kUseExpiry = false;
+  static constexpr bool kUseAux = false;
+
+  // The number of the overflow buckets that a full segment gets before it splits, see
+  // DashTable::overflow_splits().
+  static constexpr unsigned kOverflowBucketNum = 0;
 
   template <typename U> static void DestroyValue(const U&) {
   }
@@ -28,18 +34,47 @@ struct BasicDashPolicy {
   }
 };
 
+namespace detail {
+
+// The segment geometry of a table policy, with its slot number overridden by kSlots.
+template <typename Policy, unsigned kSlots = Policy::kSlotNum> struct DashSegmentPolicy {
+  static constexpr unsigned NUM_SLOTS = kSlots;
+  static constexpr unsigned BUCKET_CNT = Policy::kBucketNum;
+  static constexpr unsigned STASH_BUCKET_NUM = Policy::kStashBucketNum;
+  static constexpr bool USE_VERSION = Policy::kUseVersion;
+  static constexpr bool USE_EXPIRY = Policy::kUseExpiry;
+  static constexpr bool USE_AUX = Policy::kUseAux;
+  static constexpr unsigned OVERFLOW_BUCKET_NUM = Policy::kOverflowBucketNum;
+};
+
+// The most slots, at most 28, of a bucket of the policy that takes at most kBytes.
+template <typename Key, typename Value, typename Policy, size_t kBytes, unsigned kSlots = 28>
+constexpr unsigned FitSlotNum() {
+  using SegmentType = Segment<Key, Value, DashSegmentPolicy<Policy, kSlots>>;
+  if constexpr (kSlots == 1 || SegmentType::kBucketSz <= kBytes) {
+    return kSlots;
+  } else {
+    return FitSlotNum<Key, Value, Policy, kBytes, kSlots - 1>();
+  }
+}
+
+}  // namespace detail
+
+// Derives the slot number of Base from the entry size instead of fixing it: a bucket holds as
+// many slots as fit into kCacheLines * 64 bytes. Tables of small keys and values get wider
+// buckets than the 12 slots of BasicDashPolicy for the same cache lines per probe, and a lookup
+// probes 2 buckets besides the stash. See BM_Geometry* in dash_bench.cc for the trade-offs.
+template <typename Key, typename Value, unsigned kCacheLines, typename Base = BasicDashPolicy>
+struct CacheLineDashPolicy : public Base {
+  enum { kSlotNum = detail::FitSlotNum<Key, Value, Base, kCacheLines * 64>() };
+};
+
 template <typename _Key, typename _Value, typename Policy>
 class DashTable : public detail::DashTableBase {
   DashTable(const DashTable&) = delete;
   DashTable& operator=(const DashTable&) = delete;
 
-  struct SegmentPolicy {
-    static constexpr unsigned NUM_SLOTS = Policy::kSlotNum;
-    static constexpr unsigned BUCKET_CNT = Policy::kBucketNum;
-    static constexpr unsigned STASH_BUCKET_NUM = Policy::kStashBucketNum;
-    static constexpr bool USE_VERSION = Policy::kUseVersion;
-  };
-
+  using SegmentPolicy = detail::DashSegmentPolicy<Policy>;
   using Base = detail::DashTableBase;
   using SegmentType = detail::Segment<_Key, _Value, SegmentPolicy>;
   using SegmentIterator = typename SegmentType::Iterator;
@@ -58,8 +93,12 @@ class DashTable : public detail::DashTableBase {
   static constexpr unsigned kBucketWidth = Policy::kSlotNum;
   static constexpr double kTaxAmount = SegmentType::kTaxSize;
   static constexpr size_t kSegBytes = sizeof(SegmentType);
+  static constexpr size_t kBucketBytes = SegmentType::kBucketSz;
   static constexpr size_t kSegCapacity = SegmentType::capacity();
   static constexpr bool kUseVersion = Policy::kUseVersion;
+  static constexpr bool kUseExpiry = Policy::kUseExpiry;
+  static constexpr bool kUseAux = Policy::kUseAux;
+  static constexpr unsigned kOverflowBucketNum = Policy::kOverflowBucketNum;
 
   // if IsSingleBucket is true - iterates only over a single bucket.
   template <bool IsConst, bool IsSingleBucket = false> class Iterator;
@@ -146,6 +185,19 @@ class DashTable : public detail::DashTableBase {
   template <typename U> const_iterator Find(U&& key) const;
   template <typename U> iterator Find(U&& key);
 
+  // Same as Find but with precomputed key_hash that must be equal to DoHash(key).
+  template <typename U> iterator Find(U&& key, uint64_t key_hash);
+
+  // Returns the first entry among the ones that a lookup of key_hash probes, whose key
+  // satisfies pred(key). Allows resolving references that store only the hash of a key.
+  template <typename Pred> iterator FindByHash(uint64_t key_hash, Pred&& pred);
+
+  // Prefetches the buckets that a lookup of key_hash is going to access. Used for batched
+  // lookups where we first issue prefetches for all the keys and then resolve them.
+  void Prefetch(uint64_t key_hash) const {
+    segment_[SegmentId(key_hash)]->Prefetch(key_hash);
+  }
+
   // it must be valid.
   void Erase(iterator it);
 
@@ -186,7 +238,8 @@ class DashTable : public detail::DashTableBase {
   // Flat memory usage (allocated) of the table, not including the the memory allocated
   // by the hosted objects.
   size_t mem_usage() const {
-    return segment_.capacity() * sizeof(void*) + sizeof(SegmentType) * unique_segments_;
+    return segment_.capacity() * sizeof(void*) + sizeof(SegmentType) * unique_segments_ +
+           kAuxBytes * aux_segments_ + SegmentType::kOverflowBytes * overflow_segments_;
   }
 
   size_t bucket_count() const {
@@ -213,6 +266,17 @@ class DashTable : public detail::DashTableBase {
   // Returns: cursor that is guaranteed to be less than 2^40.
   template <typename Cb> Cursor Traverse(Cursor curs, Cb&& cb);
 
+  // Returns curs if it points to the start of a segment, otherwise the cursor of the next segment
+  // or 0 if there is none. The cursors of tables of different depths are positions in the same
+  // order, so a cursor that was reached by one table can be aligned in another one to continue
+  // from the same position without revisiting a segment.
+  Cursor AlignCursor(Cursor curs) const;
+
+  // Traverses the logical bucket at the aligned cursor curs and returns the cursor of the next
+  // bucket, or 0 at the end. Unlike Traverse, it does not skip empty buckets, so every entry
+  // is reached at the bucket of curs.
+  template <typename Cb> Cursor TraverseStep(Cursor curs, Cb&& cb);
+
   // Takes an iterator pointing to an entry in a dash bucket and traverses all bucket's entries by
   // calling cb(iterator) for every non-empty slot. The iteration goes over a physical bucket.
   template <typename Cb> void TraverseBucket(const_iterator it, Cb&& cb);
@@ -252,6 +316,19 @@ class DashTable : public detail::DashTableBase {
 
   void Clear();
 
+  // Folds buddy segments back together so that the table shrinks after mass deletions.
+  // Works incrementally: examines at most `count` distinct segments starting from the directory
+  // index seg_cursor and returns the index to continue from, or 0 when it wrapped around.
+  // A pair of buddies is merged if their joint size is at most max_load * kSegCapacity.
+  // cb(bucket_iterator) is called for each non-empty bucket of a segment pair before its entries
+  // move, similarly to CVCUponInsert. The global depth decreases once all the segments allow it.
+  // Merging invalidates iterators but preserves cursors, i.e. Traverse() still reaches all the
+  // entries that stay in the table.
+  // Returns the number of merged segment pairs in *merged if it's not null.
+  template <typename Cb>
+  uint32_t MergeStep(uint32_t seg_cursor, unsigned count, double max_load, Cb&& cb,
+                     unsigned* merged = nullptr);
+
   // Returns true if an element was deleted i.e the rightmost slot was busy.
   bool ShiftRight(bucket_iterator it);
 
@@ -270,6 +347,21 @@ class DashTable : public detail::DashTableBase {
     return stash_unloaded_;
   }
 
+  // The number of segment splits, and how many of them happened once the overflow buckets of
+  // the segment filled up as well. The rest split full segments without the overflow buckets.
+  uint64_t splits() const {
+    return splits_;
+  }
+
+  uint64_t overflow_splits() const {
+    return overflow_splits_;
+  }
+
+  // The number of segments that have the overflow buckets.
+  size_t overflow_segments() const {
+    return overflow_segments_;
+  }
+
  private:
   template <typename U, typename V, typename EvictionPolicy>
   std::pair<iterator, bool> InsertInternal(U&& key, V&& value, EvictionPolicy& policy);
@@ -277,13 +369,34 @@ class DashTable : public detail::DashTableBase {
   void IncreaseDepth(unsigned new_depth);
   void Split(uint32_t seg_id);
 
+  // Merges segment at seg_id with its buddy. Returns true if succeeded.
+  bool Merge(uint32_t seg_id);
+
+  // Allocates the side array of auxiliary values of seg if it has none.
+  void EnsureAux(SegmentType* seg);
+
+  // Frees the side array of seg, if any. Must be called before the segment is destroyed.
+  void FreeAux(SegmentType* seg);
+
+  // Allocates the overflow buckets of seg if it has none.
+  void EnsureOverflow(SegmentType* seg);
+
+  // Frees the overflow buckets of seg, if any. They must be empty.
+  void FreeOverflow(SegmentType* seg);
+
+  // Halves the directory while all the segments have local depth smaller than the global one.
+  void TryDecreaseDepth();
+
   // Segment directory contains multiple segment pointers, some of them pointing to
   // the same object. IterateDistinct goes over all distinct segments in the table.
   template <typename Cb> void IterateDistinct(Cb&& cb);
 
+  // Returns the directory index of the next distinct segment. sid may point to the middle of
+  // the index range of its segment, for example, when coming from a cursor that was created
+  // before the segment was merged.
   size_t NextSeg(size_t sid) const {
     size_t delta = (1u << (global_depth_ - segment_[sid]->local_depth()));
-    return sid + delta;
+    return (sid & ~(delta - 1)) + delta;
   }
 
   auto EqPred() const {
@@ -295,6 +408,12 @@ class DashTable : public detail::DashTableBase {
 
   uint64_t garbage_collected_ = 0;
   uint64_t stash_unloaded_ = 0;
+  uint64_t splits_ = 0;
+  uint64_t overflow_splits_ = 0;
+  size_t aux_segments_ = 0;       // the number of segments with the side array.
+  size_t overflow_segments_ = 0;  // the number of segments with the overflow buckets.
+
+  static constexpr size_t kAuxBytes = kUseAux ? SegmentType::kAuxLen * sizeof(uint32_t) : 0;
 };  // DashTable
 
 template <typename _Key, typename _Value, typename Policy>
@@ -396,6 +515,35 @@ class DashTable<_Key, _Value, Policy>::Iterator {
     return owner_->segment_[seg_id_]->SetVersion(bucket_id_, v);
   }
 
+  // The expiry value of the entry, stays with it when the entry moves inside the table.
+  // 0 for the new entries.
+  template <bool B = Policy::kUseExpiry> std::enable_if_t<B, uint32_t> GetExpiry() const {
+    assert(owner_ && seg_id_ < owner_->segment_.size());
+    return owner_->segment_[seg_id_]->GetExpiry(bucket_id_, slot_id_);
+  }
+
+  template <bool B = Policy::kUseExpiry> std::enable_if_t<B> SetExpiry(uint32_t v) {
+    owner_->segment_[seg_id_]->SetExpiry(bucket_id_, slot_id_, v);
+  }
+
+  // The auxiliary value of the entry, 0 for the new entries. Unlike the expiry, its storage is
+  // allocated on the first SetAux of a segment, so the tables where only few entries set it
+  // do not pay for it.
+  template <bool B = Policy::kUseAux> std::enable_if_t<B, uint32_t> GetAux() const {
+    assert(owner_ && seg_id_ < owner_->segment_.size());
+    return owner_->segment_[seg_id_]->GetAux(bucket_id_, slot_id_);
+  }
+
+  template <bool B = Policy::kUseAux> std::enable_if_t<B> SetAux(uint32_t v) {
+    auto* seg = owner_->segment_[seg_id_];
+    if (!seg->HasAux()) {
+      if (v == 0)
+        return;
+      owner_->EnsureAux(seg);
+    }
+    seg->SetAux(bucket_id_, slot_id_, v);
+  }
+
   friend bool operator==(const Iterator& lhs, const Iterator& rhs) {
     if (lhs.owner_ == nullptr && rhs.owner_ == nullptr)
       return true;
@@ -494,6 +642,8 @@ DashTable<_Key, _Value, Policy>::~DashTable() {
   using alloc_traits = std::allocator_traits<decltype(pa)>;
 
   IterateDistinct([&](SegmentType* seg) {
+    FreeAux(seg);
+    FreeOverflow(seg);
     alloc_traits::destroy(pa, seg);
     alloc_traits::deallocate(pa, seg, 1);
     return false;
@@ -521,7 +671,7 @@ void DashTable<_Key, _Value, Policy>::CVCUponInsert(uint64_t ver_threshold, cons
 
   // Segment is full, we need to return the whole segment, because it can be split
   // and its entries can be reshuffled into different buckets.
-  for (uint8_t i = 0; i < kPhysicalBucketNum; ++i) {
+  for (uint8_t i = 0; i < target->num_buckets(); ++i) {
     if (target->GetVersion(i) < ver_threshold && !target->GetBucket(i).IsEmpty()) {
       cb(bucket_iterator{this, seg_id, i});
     }
@@ -554,6 +704,7 @@ void DashTable<_Key, _Value, Policy>::Clear() {
       policy_.DestroyValue(seg->Value(it.index, it.slot));
     });
     seg->Clear();
+    FreeOverflow(seg);
     return false;
   };
 
@@ -587,6 +738,7 @@ void DashTable<_Key, _Value, Policy>::Clear() {
         seg->set_local_depth(initial_depth_);
         segment_[dest++] = seg;
       } else {
+        FreeAux(seg);
         alloc_traits::destroy(pa, seg);
         alloc_traits::deallocate(pa, seg, 1);
       }
@@ -655,7 +807,13 @@ auto DashTable<_Key, _Value, Policy>::Find(U&& key) const -> const_iterator {
 template <typename _Key, typename _Value, typename Policy>
 template <typename U>
 auto DashTable<_Key, _Value, Policy>::Find(U&& key) -> iterator {
-  uint64_t key_hash = DoHash(key);
+  return Find(std::forward<U>(key), DoHash(key));
+}
+
+template <typename _Key, typename _Value, typename Policy>
+template <typename U>
+auto DashTable<_Key, _Value, Policy>::Find(U&& key, uint64_t key_hash) -> iterator {
+  assert(key_hash == DoHash(key));
   uint32_t segid = SegmentId(key_hash);
   const auto* target = segment_[segid];
 
@@ -666,6 +824,20 @@ auto DashTable<_Key, _Value, Policy>::Find(U&& key) -> iterator {
   return iterator{};
 }
 
+template <typename _Key, typename _Value, typename Policy>
+template <typename Pred>
+auto DashTable<_Key, _Value, Policy>::FindByHash(uint64_t key_hash, Pred&& pred) -> iterator {
+  uint32_t segid = SegmentId(key_hash);
+  const auto* target = segment_[segid];
+
+  auto cf = [&](const Key_t& key, uint64_t) { return pred(key); };
+  auto seg_it = target->FindIt(key_hash, key_hash, cf);
+  if (seg_it.found()) {
+    return iterator{this, segid, seg_it.index, seg_it.slot};
+  }
+  return iterator{};
+}
+
 template <typename _Key, typename _Value, typename Policy>
 size_t DashTable<_Key, _Value, Policy>::Erase(const Key_t& key) {
   uint64_t key_hash = DoHash(key);
@@ -800,6 +972,15 @@ auto DashTable<_Key, _Value, Policy>::InsertInternal(U&& key, V&& value, Evictio
       throw std::bad_alloc{};
     }
 
+    // Rather than splitting a full segment right away, give it a few overflow buckets that
+    // absorb the next inserts, which raises the load factor the segments split at.
+    if constexpr (kOverflowBucketNum > 0) {
+      if (!target->HasOverflow()) {
+        EnsureOverflow(target);
+        continue;
+      }
+    }
+
     // Split the segment.
     if (target->local_depth() == global_depth_) {
       IncreaseDepth(global_depth_ + 1);
@@ -809,6 +990,8 @@ auto DashTable<_Key, _Value, Policy>::InsertInternal(U&& key, V&& value, Evictio
     }
 
     ev.RecordSplit(target);
+    ++splits_;
+    overflow_splits_ += target->HasOverflow();
     Split(target_seg_id);
   }
 
@@ -840,17 +1023,187 @@ void DashTable<_Key, _Value, Policy>::Split(uint32_t seg_id) {
   std::pmr::polymorphic_allocator<SegmentType> alloc(segment_.get_allocator().resource());
   SegmentType* target = alloc.allocate(1);
   alloc.construct(target, source->local_depth() + 1);
+  if constexpr (kUseAux) {
+    if (source->HasAux())
+      EnsureAux(target);
+  }
 
   auto hash_fn = [this](const auto& k) { return policy_.HashFn(k); };
 
   source->Split(std::move(hash_fn), target);  // increases the depth.
   ++unique_segments_;
 
+  // The overflow buckets are released once the split has moved all their entries out.
+  if (source->HasOverflow() && source->OverflowSize() == 0)
+    FreeOverflow(source);
+
   for (size_t i = start_idx + chunk_size / 2; i < start_idx + chunk_size; ++i) {
     segment_[i] = target;
   }
 }
 
+template <typename _Key, typename _Value, typename Policy>
+bool DashTable<_Key, _Value, Policy>::Merge(uint32_t seg_id) {
+  SegmentType* source = segment_[seg_id];
+  size_t chunk_size = 1u << (global_depth_ - source->local_depth());
+  size_t start_idx = seg_id & (~(chunk_size - 1));
+  size_t buddy_idx = start_idx ^ chunk_size;
+  size_t left_idx = std::min(start_idx, buddy_idx);
+  SegmentType* left = segment_[left_idx];
+  SegmentType* right = segment_[left_idx + chunk_size];
+
+  auto hash_fn = [this](const auto& k) { return policy_.HashFn(k); };
+  for (SegmentType* seg : {left, right}) {
+    if (seg->HasOverflow()) {
+      if (!seg->UnloadOverflow(hash_fn))
+        return false;
+      FreeOverflow(seg);
+    }
+  }
+
+  if constexpr (kUseAux) {
+    if (right->HasAux())
+      EnsureAux(left);
+  }
+
+  if (!left->Merge(std::move(hash_fn), right))
+    return false;
+
+  for (size_t i = left_idx + chunk_size; i < left_idx + chunk_size * 2; ++i) {
+    segment_[i] = left;
+  }
+
+  std::pmr::polymorphic_allocator<SegmentType> pa(segment_.get_allocator().resource());
+  using alloc_traits = std::allocator_traits<decltype(pa)>;
+  FreeAux(right);
+  alloc_traits::destroy(pa, right);
+  alloc_traits::deallocate(pa, right, 1);
+  --unique_segments_;
+
+  return true;
+}
+
+template <typename _Key, typename _Value, typename Policy>
+void DashTable<_Key, _Value, Policy>::EnsureAux(SegmentType* seg) {
+  if constexpr (kUseAux) {
+    if (seg->HasAux())
+      return;
+    auto* resource = segment_.get_allocator().resource();
+    void* arr = resource->allocate(kAuxBytes, alignof(uint32_t));
+    seg->ResetAux(reinterpret_cast<uint32_t*>(arr));
+    ++aux_segments_;
+  }
+}
+
+template <typename _Key, typename _Value, typename Policy>
+void DashTable<_Key, _Value, Policy>::FreeAux(SegmentType* seg) {
+  if constexpr (kUseAux) {
+    uint32_t* arr = seg->ResetAux(nullptr);
+    if (arr) {
+      segment_.get_allocator().resource()->deallocate(arr, kAuxBytes, alignof(uint32_t));
+      --aux_segments_;
+    }
+  }
+}
+
+template <typename _Key, typename _Value, typename Policy>
+void DashTable<_Key, _Value, Policy>::EnsureOverflow(SegmentType* seg) {
+  if constexpr (kOverflowBucketNum > 0) {
+    if (seg->HasOverflow())
+      return;
+    auto* resource = segment_.get_allocator().resource();
+    seg->AttachOverflow(resource->allocate(SegmentType::kOverflowBytes, alignof(SegmentType)));
+    ++overflow_segments_;
+  }
+}
+
+template <typename _Key, typename _Value, typename Policy>
+void DashTable<_Key, _Value, Policy>::FreeOverflow(SegmentType* seg) {
+  if constexpr (kOverflowBucketNum > 0) {
+    void* mem = seg->DetachOverflow();
+    if (mem) {
+      segment_.get_allocator().resource()->deallocate(mem, SegmentType::kOverflowBytes,
+                                                      alignof(SegmentType));
+      --overflow_segments_;
+    }
+  }
+}
+
+template <typename _Key, typename _Value, typename Policy>
+void DashTable<_Key, _Value, Policy>::TryDecreaseDepth() {
+  unsigned max_depth = initial_depth_;
+  IterateDistinct([&](SegmentType* seg) {
+    max_depth = std::max<unsigned>(max_depth, seg->local_depth());
+    return max_depth == global_depth_;
+  });
+
+  if (max_depth == global_depth_)
+    return;
+
+  // Every segment spans at least 2^(global_depth_ - max_depth) consecutive entries,
+  // hence we can keep each such representative.
+  unsigned shift = global_depth_ - max_depth;
+  size_t new_size = segment_.size() >> shift;
+  for (size_t i = 0; i < new_size; ++i) {
+    segment_[i] = segment_[i << shift];
+  }
+  segment_.resize(new_size);
+  segment_.shrink_to_fit();
+  global_depth_ = max_depth;
+}
+
+template <typename _Key, typename _Value, typename Policy>
+template <typename Cb>
+uint32_t DashTable<_Key, _Value, Policy>::MergeStep(uint32_t seg_cursor, unsigned count,
+                                                    double max_load, Cb&& cb, unsigned* merged) {
+  const size_t max_size = max_load * SegmentType::capacity();
+  size_t sid = seg_cursor;
+  unsigned num_merged = 0;
+
+  for (unsigned i = 0; i < count && sid < segment_.size(); ++i) {
+    SegmentType* seg = segment_[sid];
+
+    // Segments never become shallower than the initial depth of the table.
+    if (seg->local_depth() > initial_depth_) {
+      size_t chunk_size = 1u << (global_depth_ - seg->local_depth());
+      size_t buddy_idx = (sid & ~(chunk_size - 1)) ^ chunk_size;
+      SegmentType* buddy = segment_[buddy_idx];
+
+      if (buddy->local_depth() == seg->local_depth() &&
+          seg->SlowSize() + buddy->SlowSize() <= max_size) {
+        for (size_t idx : {sid, buddy_idx}) {
+          for (uint8_t bid = 0; bid < segment_[idx]->num_buckets(); ++bid) {
+            if (!segment_[idx]->GetBucket(bid).IsEmpty()) {
+              cb(bucket_iterator{this, uint32_t(idx), bid});
+            }
+          }
+        }
+
+        num_merged += Merge(sid);
+      }
+    }
+
+    sid = NextSeg(sid);
+  }
+
+  if (merged)
+    *merged = num_merged;
+
+  if (sid >= segment_.size())
+    sid = 0;
+
+  if (num_merged) {
+    unsigned prev_depth = global_depth_;
+    TryDecreaseDepth();
+
+    // The directory could have shrunk, so we translate the index to the new depth
+    // in the same way cursors do.
+    sid >>= (prev_depth - global_depth_);
+  }
+
+  return sid;
+}
+
 template <typename _Key, typename _Value, typename Policy>
 template <typename Cb>
 auto DashTable<_Key, _Value, Policy>::Traverse(Cursor curs, Cb&& cb) -> Cursor {
@@ -885,6 +1238,48 @@ auto DashTable<_Key, _Value, Policy>::Traverse(Cursor curs, Cb&& cb) -> Cursor {
   return Cursor{global_depth_, sid, bid};
 }
 
+template <typename _Key, typename _Value, typename Policy>
+auto DashTable<_Key, _Value, Policy>::AlignCursor(Cursor curs) const -> Cursor {
+  if (curs.bucket_id() >= kLogicalBucketNum)
+    return 0;
+
+  uint32_t sid = curs.segment_id(global_depth_);
+  uint8_t bid = curs.bucket_id();
+  size_t delta = 1u << (global_depth_ - segment_[sid]->local_depth());
+  size_t start = sid & ~(delta - 1);
+  if (Cursor{global_depth_, uint32_t(start), bid}.value() == curs.value())
+    return curs;
+
+  sid = start + delta;
+  if (sid >= segment_.size()) {
+    sid = 0;
+    if (++bid >= kLogicalBucketNum)
+      return 0;
+  }
+  return Cursor{global_depth_, sid, bid};
+}
+
+template <typename _Key, typename _Value, typename Policy>
+template <typename Cb>
+auto DashTable<_Key, _Value, Policy>::TraverseStep(Cursor curs, Cb&& cb) -> Cursor {
+  if (curs.bucket_id() >= kLogicalBucketNum)  // sanity.
+    return 0;
+
+  const uint32_t sid = curs.segment_id(global_depth_);
+  uint8_t bid = curs.bucket_id();
+  auto hash_fun = [this](const auto& k) { return policy_.HashFn(k); };
+  auto dt_cb = [&](const SegmentIterator& it) { cb(iterator{this, sid, it.index, it.slot}); };
+  segment_[sid]->TraverseLogicalBucket(bid, hash_fun, std::move(dt_cb));
+
+  uint32_t next = NextSeg(sid);
+  if (next >= segment_.size()) {
+    next = 0;
+    if (++bid >= kLogicalBucketNum)
+      return 0;
+  }
+  return Cursor{global_depth_, next, bid};
+}
+
 template <typename _Key, typename _Value, typename Policy>
 template <typename Cb>
 void DashTable<_Key, _Value, Policy>::TraverseBucket(const_iterator it, Cb&& cb) {
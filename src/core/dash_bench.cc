@@ -2,15 +2,22 @@
 // See LICENSE for licensing terms.
 //
 
+#include <benchmark/benchmark.h>
 #include <mimalloc.h>
 
-#include <absl/base/internal/cycleclock.h>
 #include <absl/container/flat_hash_map.h>
+#include <absl/strings/str_cat.h>
+
+#include <random>
 
 #include "base/hash.h"
-#include "base/histogram.h"
 #include "base/init.h"
+#include "base/logging.h"
+#include "base/zipf_gen.h"
+#include "core/compact_object.h"
 #include "core/dash.h"
+#include "core/expire_period.h"
+#include "server/detail/table.h"
 
 extern "C" {
 #include "redis/dict.h"
@@ -18,38 +25,21 @@ extern "C" {
 #include "redis/zmalloc.h"
 }
 
-using namespace std;
+// Runs google benchmarks for DashTable. For example:
+//   ./dash_bench --benchmark_filter=BM_Prime --benchmark_counters_tabular=true
+// ns/op is reported as the iteration time and "bytes_per_entry" as a counter.
+// BM_Geometry* compare the segment geometries of the same entries, labeled with their bucket
+// width and size, e.g. --benchmark_filter=BM_GeometryFind.
 
-ABSL_FLAG(uint32_t, n, 100000, "num items");
-ABSL_FLAG(string, type, "dash", "");
-ABSL_FLAG(bool, sds, false, "If true, uses sds as primary key");
+using namespace std;
 
 namespace dfly {
 
-static uint64_t dictSdsHash(const void* key) {
-  return dictGenHashFunction((unsigned char*)key, sdslen((char*)key));
-}
-
-static int dictSdsKeyCompare(dict*, const void* key1, const void* key2) {
-  int l1, l2;
+using detail::PrimeKey;
+using detail::PrimeValue;
+using PrimeTable = DashTable<PrimeKey, PrimeValue, detail::PrimeTablePolicy>;
 
-  l1 = sdslen((sds)key1);
-  l2 = sdslen((sds)key2);
-  if (l1 != l2)
-    return 0;
-  return memcmp(key1, key2, l1) == 0;
-}
-
-static dictType SdsDict = {
-    dictSdsHash,       /* hash function */
-    NULL,              /* key dup */
-    NULL,              /* val dup */
-    dictSdsKeyCompare, /* key compare */
-    NULL,
-    // dictSdsDestructor, /* key destructor */
-    NULL, /* val destructor */
-    NULL,
-};
+namespace {
 
 struct UInt64Policy : public BasicDashPolicy {
   static uint64_t HashFn(uint64_t v) {
@@ -57,175 +47,422 @@ struct UInt64Policy : public BasicDashPolicy {
   }
 };
 
-struct SdsDashPolicy {
-  enum { kSlotNum = 14, kBucketNum = 56, kStashBucketNum = 4 };
-  static constexpr bool kUseVersion = false;
+using Dash64 = DashTable<uint64_t, uint64_t, UInt64Policy>;
 
-  static uint64_t HashFn(sds u) {
-    return XXH3_64bits(reinterpret_cast<const uint8_t*>(u), sdslen(u));
+static uint64_t callbackHash(const void* key) {
+  return XXH64(&key, sizeof(key), 0);
+}
+
+static dictType IntDict = {callbackHash, NULL, NULL, NULL, NULL, NULL, NULL};
+
+// Key encodings of CompactObj that we want to cover.
+enum KeyKind : unsigned {
+  kInlineKey = 0,  // fits into 16 bytes of CompactObj.
+  kSmallKey = 1,   // backed by SmallString.
+  kHeapKey = 2,    // too long for SmallString, hence allocated via RobjWrapper.
+};
+
+constexpr size_t kHeapKeyLen = 1 << 15;
+constexpr double kZipfParam = 0.99;
+
+string MakeKey(KeyKind kind, uint64_t index) {
+  switch (kind) {
+    case kInlineKey:
+      return absl::StrCat("k:", index);
+    case kSmallKey:
+      return absl::StrCat("user:session:", index, ":", string(24, 'x'));
+    case kHeapKey: {
+      string res = absl::StrCat("blob:", index, ":");
+      res.resize(kHeapKeyLen, 'h');
+      return res;
+    }
   }
+  return string{};
+}
+
+// Heap keys are large, hence we use fewer of them.
+size_t NumKeys(const benchmark::State& state) {
+  return state.range(0) == kHeapKey ? 1024 : state.range(1);
+}
 
-  static uint64_t HashFn(std::string_view u) {
-    return XXH3_64bits(u.data(), u.size());
+vector<string> MakeKeys(KeyKind kind, size_t num) {
+  vector<string> keys(num);
+  for (size_t i = 0; i < num; ++i) {
+    keys[i] = MakeKey(kind, i);
   }
+  return keys;
+}
+
+void FillTable(const vector<string>& keys, PrimeTable* table) {
+  for (const auto& k : keys) {
+    table->Insert(PrimeKey{k}, PrimeValue{"value"});
+  }
+}
+
+// Memory usage of the table and the objects it hosts per entry.
+double BytesPerEntry(const PrimeTable& table, size_t obj_bytes) {
+  return table.size() ? double(table.mem_usage() + obj_bytes) / table.size() : 0;
+}
+
+size_t ObjMemory(const PrimeTable& table) {
+  size_t res = 0;
+  for (auto it = table.cbegin(); !it.is_done(); ++it) {
+    res += it->first.MallocUsed() + it->second.MallocUsed();
+  }
+  return res;
+}
+
+// Cache mode eviction policy that is similar to the one used by DbSlice:
+// evicts the last slot of a stash bucket once the table reached its capacity limit.
+struct CappedEvictionPolicy {
+  static constexpr bool can_gc = false;
+  static constexpr bool can_evict = true;
 
-  static void DestroyKey(sds s) {
-    sdsfree(s);
+  bool CanGrow(const PrimeTable& tbl) const {
+    return tbl.bucket_count() + PrimeTable::kSegCapacity <= max_capacity;
   }
 
-  static void DestroyValue(uint64_t) {
+  void RecordSplit(PrimeTable::Segment_t* segment) {
   }
 
-  static bool Equal(sds u1, sds u2) {
-    return dictSdsKeyCompare(nullptr, u1, u2) == 0;
+  unsigned Evict(const PrimeTable::HotspotBuckets& hotb, PrimeTable* me) {
+    constexpr unsigned kNumStashBuckets = ABSL_ARRAYSIZE(hotb.probes.by_type.stash_buckets);
+
+    auto stash_it = hotb.probes.by_type.stash_buckets[hotb.key_hash % kNumStashBuckets];
+    evicted += me->ShiftRight(stash_it);
+    return 1;
   }
 
-  static bool Equal(sds u1, std::string_view u2) {
-    return u2 == std::string_view{u1, sdslen(u1)};
+  size_t max_capacity = SIZE_MAX;
+  size_t evicted = 0;
+};
+
+struct PrimeBumpPolicy {
+  bool CanBumpDown(const CompactObj& key) const {
+    return !key.IsSticky();
   }
 };
 
-using Dash64 = DashTable<uint64_t, uint64_t, UInt64Policy>;
-using DashSds = DashTable<sds, uint64_t, SdsDashPolicy>;
+}  // namespace
+
+/*
+  Raw DashTable vs other tables. Arg: number of items.
+*/
 
-using absl::GetFlag;
+static void BM_InsertDash64(benchmark::State& state) {
+  for (auto _ : state) {
+    Dash64 dt;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+      dt.Insert(i, 0);
+    }
+    state.counters["bytes_per_entry"] = double(dt.mem_usage()) / dt.size();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_InsertDash64)->Arg(1 << 16)->Arg(1 << 20);
 
-inline void Sample(int64_t start, int64_t end, base::Histogram* hist) {
-  hist->Add((end - start) / 100);
+static void BM_InsertFlatMap(benchmark::State& state) {
+  for (auto _ : state) {
+    absl::flat_hash_map<uint64_t, uint64_t> mymap;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+      mymap.emplace(i, 0);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
 }
+BENCHMARK(BM_InsertFlatMap)->Arg(1 << 16)->Arg(1 << 20);
 
-Dash64 udt;
-DashSds sds_dt;
-base::Histogram hist;
+static void BM_InsertDict(benchmark::State& state) {
+  for (auto _ : state) {
+    dict* redis_dict = dictCreate(&IntDict);
+    for (int64_t i = 0; i < state.range(0); ++i) {
+      dictAdd(redis_dict, (void*)i, nullptr);
+    }
+    dictRelease(redis_dict);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_InsertDict)->Arg(1 << 16)->Arg(1 << 20);
 
-#define USE_TIME 1
+static void BM_FindDash64(benchmark::State& state) {
+  Dash64 dt;
+  for (int64_t i = 0; i < state.range(0); ++i) {
+    dt.Insert(i, 0);
+  }
 
-int64_t GetNow() {
-  #if USE_TIME
-    return absl::GetCurrentTimeNanos();
-#else
-    return absl::base_internal::CycleClock::Now();
-#endif
+  // Half of lookups miss in order to exercise neighbour and stash probing.
+  uint64_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(dt.Find(i++ % (state.range(0) * 2)));
+  }
 }
+BENCHMARK(BM_FindDash64)->Arg(1 << 16)->Arg(1 << 20);
 
-#if defined(__i386__) || defined(__amd64__)
-  #define LFENCE __asm__ __volatile__("lfence")
-#else
-  #define LFENCE __asm__ __volatile__("ISB")
-#endif
+/*
+  Segment geometries of the same entries. Arg: number of items.
+*/
 
-absl::flat_hash_map<uint64_t, uint64_t> mymap;
+template <unsigned kSlots, unsigned kStash, typename Base>
+struct GeometryPolicy : public Base {
+  enum { kSlotNum = kSlots, kBucketNum = 64, kStashBucketNum = kStash };
+};
 
-void BenchFlat(uint64_t num) {
-  for (uint64_t i = 0; i < num; ++i) {
-    time_t start = GetNow();
-    mymap.emplace(i, 0);
-    LFENCE;
+using Dash64Slots12 = DashTable<uint64_t, uint64_t, GeometryPolicy<12, 2, UInt64Policy>>;
+using Dash64Slots14 = DashTable<uint64_t, uint64_t, GeometryPolicy<14, 4, UInt64Policy>>;
+template <unsigned kLines>
+using Dash64Lines =
+    DashTable<uint64_t, uint64_t, CacheLineDashPolicy<uint64_t, uint64_t, kLines, UInt64Policy>>;
+using Dash64Lines2 = Dash64Lines<2>;
+using Dash64Lines4 = Dash64Lines<4>;
+template <unsigned kSlots>
+using PrimeSlots =
+    DashTable<PrimeKey, PrimeValue, GeometryPolicy<kSlots, 4, detail::PrimeTablePolicy>>;
+using PrimeSlots12 = PrimeSlots<12>;
+using PrimeSlots16 = PrimeSlots<16>;
+
+template <typename Table> void SetGeometryCounters(const Table& table, benchmark::State* state) {
+  state->SetLabel(absl::StrCat(Table::kBucketWidth, " slots, ", Table::kBucketBytes, " bytes"));
+  state->counters["bytes_per_entry"] = double(table.mem_usage()) / table.size();
+  state->counters["load_factor"] = double(table.size()) / table.bucket_count();
+}
 
-    time_t end = GetNow();
-    Sample(start, end, &hist);
+template <typename Table> void FillGeometry(size_t num, Table* table) {
+  for (size_t i = 0; i < num; ++i) {
+    if constexpr (std::is_same_v<typename Table::Key_t, PrimeKey>) {
+      table->Insert(PrimeKey{MakeKey(kInlineKey, i)}, PrimeValue{"value"});
+    } else {
+      table->Insert(i, 0);
+    }
   }
 }
 
-void BenchDash(uint64_t num) {
-  for (uint64_t i = 0; i < num; ++i) {
-    time_t start = GetNow();
-    udt.Insert(i, 0);
-    LFENCE;
+template <typename Table> static void BM_GeometryInsert(benchmark::State& state) {
+  for (auto _ : state) {
+    Table table;
+    FillGeometry(state.range(0), &table);
 
-    time_t end = GetNow();
-    Sample(start, end, &hist);
+    state.PauseTiming();
+    SetGeometryCounters(table, &state);
+    table.Clear();
+    state.ResumeTiming();
   }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
 }
 
-inline sds Prefix() {
-  return sdsnew("xxxxxxxxxxxxxxxxxxxxxxx");
-}
+// Half of the lookups miss, hence probe the neighbour and the stash buckets.
+template <typename Table> static void BM_GeometryFind(benchmark::State& state) {
+  Table table;
+  FillGeometry(state.range(0), &table);
 
-void BenchDashSds(uint64_t num) {
-  sds key = sdscatsds(Prefix(), sdsfromlonglong(0));
-  for (uint64_t i = 0; i < num; ++i) {
-    time_t start = GetNow();
-    sds_dt.Insert(key, 0);
-    time_t end = GetNow();
-    Sample(start, end, &hist);
+  vector<string> keys;
+  if constexpr (std::is_same_v<typename Table::Key_t, PrimeKey>)
+    keys = MakeKeys(kInlineKey, state.range(0) * 2);
 
-    key = sdscatsds(Prefix(), sdsfromlonglong(i + 1));
+  uint64_t i = 0;
+  for (auto _ : state) {
+    uint64_t index = (i++ * 7919) % (state.range(0) * 2);
+    if constexpr (std::is_same_v<typename Table::Key_t, PrimeKey>) {
+      benchmark::DoNotOptimize(table.Find(string_view{keys[index]}));
+    } else {
+      benchmark::DoNotOptimize(table.Find(index));
+    }
   }
+  SetGeometryCounters(table, &state);
 }
 
-static uint64_t callbackHash(const void* key) {
-  return XXH64(&key, sizeof(key), 0);
+#define GEOMETRY_BENCHMARKS(Table)                                                         \
+  BENCHMARK_TEMPLATE(BM_GeometryInsert, Table)->Arg(1 << 20)->Unit(benchmark::kMillisecond); \
+  BENCHMARK_TEMPLATE(BM_GeometryFind, Table)->Arg(1 << 16)->Arg(1 << 20)
+
+GEOMETRY_BENCHMARKS(Dash64Slots12);
+GEOMETRY_BENCHMARKS(Dash64Slots14);
+GEOMETRY_BENCHMARKS(Dash64Lines2);
+GEOMETRY_BENCHMARKS(Dash64Lines4);
+GEOMETRY_BENCHMARKS(PrimeSlots12);
+GEOMETRY_BENCHMARKS(PrimeTable);
+GEOMETRY_BENCHMARKS(PrimeSlots16);
+
+/*
+  PrimeTable with CompactObj keys. Args: {KeyKind, number of keys}.
+*/
+
+static void BM_PrimeInsert(benchmark::State& state) {
+  vector<string> keys = MakeKeys(KeyKind(state.range(0)), NumKeys(state));
+
+  for (auto _ : state) {
+    PrimeTable table;
+    FillTable(keys, &table);
+
+    state.PauseTiming();
+    state.counters["bytes_per_entry"] = BytesPerEntry(table, ObjMemory(table));
+    table.Clear();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
 }
+BENCHMARK(BM_PrimeInsert)
+    ->ArgsProduct({{kInlineKey, kSmallKey, kHeapKey}, {1 << 16, 1 << 20}})
+    ->Unit(benchmark::kMillisecond);
+
+// Inserts keys with expiry like DbSlice::AddNew does. The deadline is stored in the slot of
+// the entry, so it costs no additional memory.
+static void BM_PrimeInsertWithExpire(benchmark::State& state) {
+  vector<string> keys = MakeKeys(KeyKind(state.range(0)), NumKeys(state));
+
+  for (auto _ : state) {
+    PrimeTable table;
+    for (const auto& k : keys) {
+      auto [it, inserted] = table.Insert(PrimeKey{k}, PrimeValue{"value"});
+      it->second.SetExpire(true);
+      it.SetExpiry(ExpirePeriod(3600 * 1000).value());
+    }
 
-static dictType IntDict = {callbackHash, NULL, NULL, NULL, NULL, NULL, NULL};
+    state.PauseTiming();
+    state.counters["bytes_per_entry"] = BytesPerEntry(table, ObjMemory(table));
+    table.Clear();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_PrimeInsertWithExpire)
+    ->ArgsProduct({{kInlineKey, kSmallKey}, {1 << 16, 1 << 20}})
+    ->Unit(benchmark::kMillisecond);
+
+// Zipf-distributed lookups of existing keys.
+static void BM_PrimeFindZipf(benchmark::State& state) {
+  vector<string> keys = MakeKeys(KeyKind(state.range(0)), NumKeys(state));
+  PrimeTable table;
+  FillTable(keys, &table);
+
+  base::ZipfianGenerator zipf(0, keys.size() - 1, kZipfParam);
+  default_random_engine rand_eng{42};
+
+  for (auto _ : state) {
+    auto it = table.Find(string_view{keys[zipf.Next(rand_eng)]});
+    benchmark::DoNotOptimize(it);
+  }
+  state.counters["bytes_per_entry"] = BytesPerEntry(table, ObjMemory(table));
+}
+BENCHMARK(BM_PrimeFindZipf)->ArgsProduct({{kInlineKey, kSmallKey, kHeapKey}, {1 << 16, 1 << 20}});
 
-dict* redis_dict = nullptr;
+// Lookups of missing keys - always probe neighbour and possibly stash buckets.
+static void BM_PrimeFindMiss(benchmark::State& state) {
+  vector<string> keys = MakeKeys(KeyKind(state.range(0)), NumKeys(state));
+  PrimeTable table;
+  FillTable(keys, &table);
 
-void BenchDict(uint64_t num) {
-  redis_dict = dictCreate(&IntDict);
+  vector<string> missing = keys;
+  for (auto& k : missing) {
+    k.front() = '!';
+  }
+
+  size_t i = 0;
+  for (auto _ : state) {
+    auto it = table.Find(string_view{missing[i++ % missing.size()]});
+    benchmark::DoNotOptimize(it);
+  }
+}
+BENCHMARK(BM_PrimeFindMiss)->ArgsProduct({{kInlineKey, kSmallKey}, {1 << 16, 1 << 20}});
+
+// Cache mode: zipf lookups followed by a bump-up, like DbSlice::FindExt does.
+static void BM_PrimeBumpUpZipf(benchmark::State& state) {
+  vector<string> keys = MakeKeys(KeyKind(state.range(0)), NumKeys(state));
+  PrimeTable table;
+  FillTable(keys, &table);
 
-  for (uint64_t i = 0; i < num; ++i) {
-    time_t start = GetNow();
-    dictAdd(redis_dict, (void*)i, nullptr);
-    LFENCE;
-    time_t end = GetNow();
-    Sample(start, end, &hist);
+  base::ZipfianGenerator zipf(0, keys.size() - 1, kZipfParam);
+  default_random_engine rand_eng{42};
+
+  for (auto _ : state) {
+    auto it = table.Find(string_view{keys[zipf.Next(rand_eng)]});
+    benchmark::DoNotOptimize(table.BumpUp(it, PrimeBumpPolicy{}));
   }
 }
+BENCHMARK(BM_PrimeBumpUpZipf)->ArgsProduct({{kInlineKey, kSmallKey}, {1 << 16, 1 << 20}});
+
+// Cache mode: zipf inserts into a capped table, evicting items upon reaching the capacity.
+static void BM_PrimeInsertEvictZipf(benchmark::State& state) {
+  KeyKind kind = KeyKind(state.range(0));
+  size_t num_keys = NumKeys(state);
+  vector<string> keys = MakeKeys(kind, num_keys * 4);
+
+  PrimeTable table;
+  CappedEvictionPolicy ev_policy;
+  ev_policy.max_capacity = num_keys;
+
+  base::ZipfianGenerator zipf(0, keys.size() - 1, kZipfParam);
+  default_random_engine rand_eng{42};
+  size_t hits = 0;
+
+  for (auto _ : state) {
+    const string& k = keys[zipf.Next(rand_eng)];
+    auto [it, inserted] = table.Insert(PrimeKey{k}, PrimeValue{"value"}, ev_policy);
+    if (!inserted) {
+      ++hits;
+      table.BumpUp(it, PrimeBumpPolicy{});
+    }
+  }
 
-void BenchDictSds() {
-  uint64_t num = GetFlag(FLAGS_n);
+  state.counters["hit_rate"] = double(hits) / state.iterations();
+  state.counters["evicted"] = ev_policy.evicted;
+}
+BENCHMARK(BM_PrimeInsertEvictZipf)->ArgsProduct({{kInlineKey, kSmallKey}, {1 << 16}});
 
-  sds key = sdscat(Prefix(), sdsfromlonglong(0));
-  redis_dict = dictCreate(&SdsDict);
+static void BM_PrimeErase(benchmark::State& state) {
+  vector<string> keys = MakeKeys(KeyKind(state.range(0)), NumKeys(state));
 
-  for (uint64_t i = 0; i < num; ++i) {
-    time_t start = GetNow();
-    dictAdd(redis_dict, key, nullptr);
-    time_t end = GetNow();
-    Sample(start, end, &hist);
+  for (auto _ : state) {
+    state.PauseTiming();
+    PrimeTable table;
+    FillTable(keys, &table);
+    state.ResumeTiming();
 
-    key = sdscatsds(Prefix(), sdsfromlonglong(i + 1));
+    for (const auto& k : keys) {
+      auto it = table.Find(string_view{k});
+      table.Erase(it);
+    }
   }
+  state.SetItemsProcessed(state.iterations() * keys.size());
 }
+BENCHMARK(BM_PrimeErase)
+    ->ArgsProduct({{kInlineKey, kSmallKey}, {1 << 16, 1 << 20}})
+    ->Unit(benchmark::kMillisecond);
+
+// Full cursor traversal, as done by SCAN, snapshotting and expiry.
+static void BM_PrimeTraverse(benchmark::State& state) {
+  vector<string> keys = MakeKeys(KeyKind(state.range(0)), NumKeys(state));
+  PrimeTable table;
+  FillTable(keys, &table);
+
+  for (auto _ : state) {
+    PrimeTable::Cursor cursor;
+    size_t visited = 0;
+    do {
+      cursor = table.Traverse(cursor, [&](PrimeTable::iterator it) { ++visited; });
+    } while (cursor);
+    CHECK_EQ(visited, keys.size());
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_PrimeTraverse)
+    ->ArgsProduct({{kInlineKey, kSmallKey}, {1 << 16, 1 << 20}})
+    ->Unit(benchmark::kMillisecond);
 
 }  // namespace dfly
 
 using namespace dfly;
 
 int main(int argc, char* argv[]) {
+  // Consumes --benchmark_xxx flags before absl flags are parsed.
+  benchmark::Initialize(&argc, argv);
   MainInitGuard guard(&argc, &argv);
 
-  init_zmalloc_threadlocal(mi_heap_get_backing());
-
-  string table_type = GetFlag(FLAGS_type);
-
-  bool is_sds = GetFlag(FLAGS_sds);
-  uint64_t start = absl::GetCurrentTimeNanos();
-  uint64_t num = GetFlag(FLAGS_n);
-
-  if (table_type == "dash") {
-    if (is_sds) {
-      BenchDashSds(num);
-    } else {
-      BenchDash(num);
-    }
-  } else if (table_type == "dict") {
-    if (is_sds) {
-      BenchDictSds();
-    } else {
-      BenchDict(num);
-    }
-  } else if (table_type == "flat") {
-    BenchFlat(num);
-  } else {
-    LOG(FATAL) << "Unknown type " << table_type;
-  }
+  mi_heap_t* tlh = mi_heap_get_backing();
+  init_zmalloc_threadlocal(tlh);
+  SmallString::InitThreadLocal(tlh);
+  CompactObj::InitThreadLocal(pmr::get_default_resource());
 
-  CONSOLE_INFO << "latencies histogram (jiffies, 100ns):\n" << hist.ToString();
-  uint64_t delta = (absl::GetCurrentTimeNanos() - start) / 1000000;
-  CONSOLE_INFO << "Took " << delta << " ms";
+  benchmark::RunSpecifiedBenchmarks();
 
   return 0;
 }
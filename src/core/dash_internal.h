@@ -6,12 +6,14 @@
 
 #include <absl/base/internal/endian.h>
 
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <functional>
+#include <memory>
 
 #if defined(__aarch64__)
 #include "base/sse2neon.h"
@@ -152,6 +154,23 @@ template <unsigned NUM_SLOTS, unsigned NUM_STASH_FPS> class BucketBase {
     return mask & GetProbe(probe);
   }
 
+  // Vectorized probe that compares fp_hash against both the slot fingerprints and the stash
+  // fingerprints of the bucket in one step.
+  // Returns a mask of matching busy slots in [0, NUM_SLOTS) bits and writes into stash_mask
+  // the mask of matching stash fps [0, kStashFpLen) with the given probing type.
+  unsigned FindWithStash(uint8_t fp_hash, bool probe, unsigned* stash_mask) const;
+
+  // Returns a mask of stash fp indices [0, kStashFpLen) that are busy, match fp_hash and
+  // belong to the requested probing type.
+  unsigned FindStash(uint8_t fp_hash, bool probe) const {
+    return StashMask(CompareStashFP(fp_hash), probe);
+  }
+
+  // Returns stash bucket position [0, 4) that the stash fp at index fp_index points to.
+  unsigned StashPos(unsigned fp_index) const {
+    return (stash_pos_ >> (fp_index * 2)) & 3;
+  }
+
   uint8_t Fp(unsigned i) const {
     assert(i < finger_arr_.size());
     return finger_arr_[i];
@@ -197,6 +216,20 @@ template <unsigned NUM_SLOTS, unsigned NUM_STASH_FPS> class BucketBase {
     return overflow_count_ > 0;
   }
 
+  // Accounts for an entry of this bucket that resides in the overflow buckets of the segment.
+  // Such entries have no fps, similarly to the overflowed stash entries, hence the lookups
+  // that miss the bucket go over all the stash buckets and then over the overflow ones.
+  void SetOverflowPtr() {
+    overflow_count_++;
+    stash_busy_ |= kStashPresentBit;
+  }
+
+  void UnsetOverflowPtr(BucketBase* next) {
+    assert(overflow_count_ > 0);
+    overflow_count_--;
+    UpdateStashPresent(*next);
+  }
+
   // func accepts an fp_index in range [0, kStashFpLen) and
   // stash position [0, STASH_BUCKET_NUM) that with fingerprint=fp. func must return
   // a slot id if it found whatever it searched for when iterating or kNanSlot to continue.
@@ -226,8 +259,18 @@ template <unsigned NUM_SLOTS, unsigned NUM_STASH_FPS> class BucketBase {
 
  protected:
   uint32_t CompareFP(uint8_t fp) const;
+  uint32_t CompareStashFP(uint8_t fp) const;
+
+  unsigned StashMask(uint32_t fp_eq_mask, bool probe) const {
+    unsigned om = probe ? stash_probe_mask_ : ~stash_probe_mask_;
+    return fp_eq_mask & stash_busy_ & om & ((1u << kStashFpLen) - 1);
+  }
+
   bool ShiftRight();
 
+  // Resets kStashPresentBit if neither this bucket nor next point to the stash on its behalf.
+  void UpdateStashPresent(const BucketBase& next);
+
   // Returns true if stash_pos was stored, false overwise
   bool SetStash(uint8_t fp, unsigned stash_pos, bool probe);
   bool ClearStash(uint8_t fp, unsigned stash_pos, bool probe);
@@ -314,27 +357,82 @@ static_assert(alignof(VersionedBB<14, 4>) == 1, "");
 static_assert(sizeof(VersionedBB<12, 4>) == 12 * 2 + 8, "");
 static_assert(sizeof(VersionedBB<14, 4>) <= 14 * 2 + 8, "");
 
+// Optional expiry support as part of DashTable. Every slot has an opaque 32-bit expiry value
+// that moves together with its entry. The values are stored byte-wise so that they do not
+// change the alignment of the bucket.
+template <unsigned NUM_SLOTS, bool USE_EXPIRY> class BucketExpiry {
+ public:
+  uint32_t GetExpiry(unsigned slot) const {
+    return absl::little_endian::Load32(expiry_ + slot * 4);
+  }
+
+  void SetExpiry(unsigned slot, uint32_t val) {
+    absl::little_endian::Store32(expiry_ + slot * 4, val);
+  }
+
+  void SwapExpiry(unsigned slot_a, unsigned slot_b) {
+    uint32_t a = GetExpiry(slot_a);
+    SetExpiry(slot_a, GetExpiry(slot_b));
+    SetExpiry(slot_b, a);
+  }
+
+ private:
+  uint8_t expiry_[NUM_SLOTS * 4] = {0};
+};
+
+template <unsigned NUM_SLOTS> class BucketExpiry<NUM_SLOTS, false> {};
+
+static_assert(sizeof(BucketExpiry<14, true>) == 14 * 4, "");
+
+// Optional auxiliary 32-bit value per slot, for the data that only few tables fill. Unlike
+// the expiry, it is kept in a side array of the segment that the table allocates when the
+// segment gets the first value, so the segments that have none pay for a pointer only.
+template <bool USE_AUX> class SegmentAux {
+ protected:
+  uint32_t* aux_ = nullptr;
+};
+
+template <> class SegmentAux<false> {};
+
+// Optional overflow buckets of a segment that the table allocates once the segment is full.
+// They absorb the last inserts before the segment splits, so the segments reach a higher load
+// factor. Holds a Bucket array of the segment.
+template <unsigned OVERFLOW_BUCKET_NUM> class SegmentOverflow {
+ protected:
+  void* overflow_ = nullptr;
+};
+
+template <> class SegmentOverflow<0> {};
+
 // Segment - static-hashtable of size NUM_SLOTS*(BUCKET_CNT + STASH_BUCKET_NUM).
 struct DefaultSegmentPolicy {
   static constexpr unsigned NUM_SLOTS = 12;
   static constexpr unsigned BUCKET_CNT = 64;
   static constexpr unsigned STASH_BUCKET_NUM = 2;
   static constexpr bool USE_VERSION = true;
+  static constexpr bool USE_EXPIRY = false;
+  static constexpr bool USE_AUX = false;
+  static constexpr unsigned OVERFLOW_BUCKET_NUM = 0;
 };
 
-template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy> class Segment {
+template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy>
+class Segment : private SegmentAux<Policy::USE_AUX>,
+                private SegmentOverflow<Policy::OVERFLOW_BUCKET_NUM> {
   static constexpr unsigned BUCKET_CNT = Policy::BUCKET_CNT;
   static constexpr unsigned STASH_BUCKET_NUM = Policy::STASH_BUCKET_NUM;
   static constexpr unsigned NUM_SLOTS = Policy::NUM_SLOTS;
   static constexpr bool USE_VERSION = Policy::USE_VERSION;
+  static constexpr bool USE_EXPIRY = Policy::USE_EXPIRY;
+  static constexpr bool USE_AUX = Policy::USE_AUX;
+  static constexpr unsigned OVERFLOW_BUCKET_NUM = Policy::OVERFLOW_BUCKET_NUM;
 
-  static_assert(BUCKET_CNT + STASH_BUCKET_NUM < 255);
+  static_assert(BUCKET_CNT + STASH_BUCKET_NUM + OVERFLOW_BUCKET_NUM < 255);
   static constexpr unsigned kFingerBits = 8;
 
   using BucketType =
       std::conditional_t<USE_VERSION, VersionedBB<NUM_SLOTS, 4>, BucketBase<NUM_SLOTS, 4>>;
 
-  struct Bucket : public BucketType {
+  struct Bucket : public BucketType, public BucketExpiry<NUM_SLOTS, USE_EXPIRY> {
     using BucketType::kNanSlot;
     using typename BucketType::SlotId;
 
@@ -347,12 +445,19 @@ template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy
 
       key[slot] = std::forward<U>(u);
       value[slot] = std::forward<V>(v);
+      if constexpr (USE_EXPIRY)
+        this->SetExpiry(slot, 0);
 
       this->SetHash(slot, meta_hash, probe);
     }
 
     template <typename U, typename Pred>
-    SlotId FindByFp(uint8_t fp_hash, bool probe, U&& k, Pred&& pred) const;
+    SlotId FindByFp(uint8_t fp_hash, bool probe, U&& k, Pred&& pred) const {
+      return FindByMask(this->Find(fp_hash, probe), std::forward<U>(k), std::forward<Pred>(pred));
+    }
+
+    // Compares keys of the slots in mask with k. Returns the first slot that matches.
+    template <typename U, typename Pred> SlotId FindByMask(unsigned mask, U&& k, Pred&& pred) const;
 
     bool ShiftRight();
 
@@ -360,6 +465,8 @@ template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy
       BucketType::Swap(slot_a, slot_b);
       std::swap(key[slot_a], key[slot_b]);
       std::swap(value[slot_a], value[slot_b]);
+      if constexpr (USE_EXPIRY)
+        this->SwapExpiry(slot_a, slot_b);
     }
   };  // class Bucket
 
@@ -391,6 +498,9 @@ template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy
   /* number of normal buckets in one segment*/
   static constexpr uint8_t kNumBuckets = BUCKET_CNT;
   static constexpr uint8_t kTotalBuckets = kNumBuckets + STASH_BUCKET_NUM;
+
+  // The overflow buckets have ids [kTotalBuckets, kTotalBuckets + kNumOverflowBuckets).
+  static constexpr uint8_t kNumOverflowBuckets = OVERFLOW_BUCKET_NUM;
   static constexpr size_t kFpMask = (1 << kFingerBits) - 1;
   static constexpr size_t kNumSlots = NUM_SLOTS;
 
@@ -408,6 +518,13 @@ template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy
 
   template <typename HashFn> void Split(HashFn&& hfunc, Segment* dest);
 
+  // The opposite of Split. Moves all the entries of the buddy segment src into this segment
+  // and decreases the local depth. Both segments must have the same local depth and this
+  // segment must be the left buddy, i.e. its entries have 0 at local_depth bit of the hash.
+  // Returns false if src entries do not fit, in which case both segments are restored to their
+  // original (split) state. src is left empty upon success.
+  template <typename HashFn> bool Merge(HashFn&& hfunc, Segment* src);
+
   void Delete(const Iterator& it, Hash_t key_hash);
 
   void Clear();  // clears the segment.
@@ -428,12 +545,95 @@ template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy
 
   template <bool UV = Policy::USE_VERSION>
   std::enable_if_t<UV, uint64_t> GetVersion(uint8_t bid) const {
-    return bucket_[bid].GetVersion();
+    return BucketAt(bid).GetVersion();
   }
 
   template <bool UV = Policy::USE_VERSION>
   std::enable_if_t<UV> SetVersion(uint8_t bid, uint64_t v) {
-    return bucket_[bid].SetVersion(v);
+    return BucketAt(bid).SetVersion(v);
+  }
+
+  template <bool UE = Policy::USE_EXPIRY>
+  std::enable_if_t<UE, uint32_t> GetExpiry(uint8_t bid, uint8_t slot) const {
+    return BucketAt(bid).GetExpiry(slot);
+  }
+
+  template <bool UE = Policy::USE_EXPIRY>
+  std::enable_if_t<UE> SetExpiry(uint8_t bid, uint8_t slot, uint32_t v) {
+    BucketAt(bid).SetExpiry(slot, v);
+  }
+
+  // The auxiliary value of the slot, 0 for the new entries and in the segments without the
+  // side array. Moves together with the entry, also to the other segments, provided that
+  // they have the array as well.
+  template <bool UA = Policy::USE_AUX>
+  std::enable_if_t<UA, uint32_t> GetAux(uint8_t bid, uint8_t slot) const {
+    return this->aux_ ? this->aux_[bid * kNumSlots + slot] : 0;
+  }
+
+  // Requires: HasAux().
+  template <bool UA = Policy::USE_AUX>
+  std::enable_if_t<UA> SetAux(uint8_t bid, uint8_t slot, uint32_t v) {
+    assert(this->aux_);
+    this->aux_[bid * kNumSlots + slot] = v;
+  }
+
+  template <bool UA = Policy::USE_AUX> std::enable_if_t<UA, bool> HasAux() const {
+    return this->aux_ != nullptr;
+  }
+
+  // Attaches a side array of kAuxLen values, or detaches the current one if arr is null.
+  // Returns the previous array. The segment does not own the array.
+  template <bool UA = Policy::USE_AUX> std::enable_if_t<UA, uint32_t*> ResetAux(uint32_t* arr) {
+    if (arr)
+      std::fill(arr, arr + kAuxLen, 0);
+    std::swap(arr, this->aux_);
+    return arr;
+  }
+
+  bool HasOverflow() const {
+    if constexpr (OVERFLOW_BUCKET_NUM > 0)
+      return this->overflow_ != nullptr;
+    return false;
+  }
+
+  // The number of the buckets that the segment has currently, including the overflow ones.
+  unsigned num_buckets() const {
+    return kTotalBuckets + (HasOverflow() ? kNumOverflowBuckets : 0);
+  }
+
+  // Attaches the overflow buckets, constructed in mem of kOverflowBytes.
+  // Requires: !HasOverflow(). The segment does not own the memory.
+  template <unsigned N = OVERFLOW_BUCKET_NUM> std::enable_if_t<(N > 0)> AttachOverflow(void* mem) {
+    assert(!this->overflow_);
+    std::uninitialized_value_construct_n(static_cast<Bucket*>(mem), N);
+    this->overflow_ = mem;
+  }
+
+  // Detaches the overflow buckets and returns their memory, or nullptr if there are none.
+  // Requires: the overflow buckets are empty.
+  template <unsigned N = OVERFLOW_BUCKET_NUM> std::enable_if_t<(N > 0), void*> DetachOverflow() {
+    Bucket* ovf = Overflow();
+    if (ovf) {
+      assert(OverflowSize() == 0);
+      std::destroy_n(ovf, N);
+    }
+    this->overflow_ = nullptr;
+    return ovf;
+  }
+
+  // The number of entries in the overflow buckets.
+  size_t OverflowSize() const {
+    size_t res = 0;
+    for (unsigned i = kTotalBuckets; i < num_buckets(); ++i)
+      res += BucketAt(i).Size();
+    return res;
+  }
+
+  // Moves the entries of the overflow buckets back to the regular and stash buckets.
+  // Returns true if the overflow buckets are empty afterwards.
+  template <typename HFunc> bool UnloadOverflow(HFunc&& hfunc) {
+    return MoveOverflow(std::forward<HFunc>(hfunc), [](Hash_t) { return true; }, nullptr);
   }
 
   // Traverses over Segment's bucket bid and calls cb(const Iterator& it) 0 or more times
@@ -456,27 +656,27 @@ template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy
   };
 
   const BucketType& GetBucket(size_t i) const {
-    return bucket_[i];
+    return BucketAt(i);
   }
 
   Key_t& Key(unsigned bid, unsigned slot) {
-    assert(bucket_[bid].GetBusy() & (1U << slot));
-    return bucket_[bid].key[slot];
+    assert(BucketAt(bid).GetBusy() & (1U << slot));
+    return BucketAt(bid).key[slot];
   }
 
   const Key_t& Key(unsigned bid, unsigned slot) const {
-    assert(bucket_[bid].GetBusy() & (1U << slot));
-    return bucket_[bid].key[slot];
+    assert(BucketAt(bid).GetBusy() & (1U << slot));
+    return BucketAt(bid).key[slot];
   }
 
   Value_t& Value(unsigned bid, unsigned slot) {
-    assert(bucket_[bid].GetBusy() & (1U << slot));
-    return bucket_[bid].value[slot];
+    assert(BucketAt(bid).GetBusy() & (1U << slot));
+    return BucketAt(bid).value[slot];
   }
 
   const Value_t& Value(unsigned bid, unsigned slot) const {
-    assert(bucket_[bid].GetBusy() & (1U << slot));
-    return bucket_[bid].value[slot];
+    assert(BucketAt(bid).GetBusy() & (1U << slot));
+    return BucketAt(bid).value[slot];
   }
 
   // fill bucket ids that may be used probing for this key_hash.
@@ -490,6 +690,13 @@ template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy
 
   template <typename U, typename Pred> Iterator FindIt(U&& key, Hash_t key_hash, Pred&& cf) const;
 
+  // Prefetches the home and the neighbour buckets of key_hash.
+  void Prefetch(Hash_t key_hash) const {
+    uint8_t bidx = BucketIndex(key_hash);
+    __builtin_prefetch(&bucket_[bidx]);
+    __builtin_prefetch(&bucket_[NextBid(bidx)]);
+  }
+
   // Returns valid iterator if succeeded or invalid if not (it's full).
   // Requires: key should be not present in the segment.
   // if spread is true, tries to spread the load between neighbour and home buckets,
@@ -521,13 +728,19 @@ template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy
   // Shifts all slots in the bucket right.
   // Returns true if the last slot was busy and the entry has been deleted.
   bool ShiftRight(unsigned bid, Hash_t right_hashval) {
-    if (bid >= kNumBuckets) {  // Stash
+    if (bid >= kNumBuckets) {  // Stash or overflow
       constexpr auto kLastSlotMask = 1u << (kNumSlots - 1);
-      if (bucket_[bid].GetBusy() & kLastSlotMask)
-        RemoveStashReference(bid - kNumBuckets, right_hashval);
+      if (BucketAt(bid).GetBusy() & kLastSlotMask) {
+        if (bid < kTotalBuckets)
+          RemoveStashReference(bid - kNumBuckets, right_hashval);
+        else
+          RemoveOverflowReference(right_hashval);
+      }
     }
 
-    return bucket_[bid].ShiftRight();
+    for (int i = kNumSlots - 1; i > 0; i--)
+      SwapAux(bid, i, bid, i - 1);
+    return BucketAt(bid).ShiftRight();
   }
 
   // Bumps up this entry making it more "important" for the eviction policy.
@@ -555,6 +768,27 @@ template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy
     return bid ? bid - 1 : kNumBuckets - 1;
   }
 
+  Bucket* Overflow() const {
+    if constexpr (OVERFLOW_BUCKET_NUM > 0)
+      return static_cast<Bucket*>(this->overflow_);
+    return nullptr;
+  }
+
+  // Resolves the bucket ids of the overflow buckets as well.
+  Bucket& BucketAt(unsigned bid) {
+    if constexpr (OVERFLOW_BUCKET_NUM > 0) {
+      if (bid >= kTotalBuckets) {
+        assert(bid < num_buckets());
+        return Overflow()[bid - kTotalBuckets];
+      }
+    }
+    return bucket_[bid];
+  }
+
+  const Bucket& BucketAt(unsigned bid) const {
+    return const_cast<Segment*>(this)->BucketAt(bid);
+  }
+
   // if own_items is true it means we try to move owned item to probing bucket.
   // if own_items false it means we try to move non-owned item from probing bucket back to its host.
   int MoveToOther(bool own_items, unsigned from, unsigned to);
@@ -565,10 +799,35 @@ template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy
   /*both clear this bucket and its neighbor bucket*/
   void RemoveStashReference(unsigned stash_pos, Hash_t key_hash);
 
+  // Removes the reference of an entry in the overflow buckets from its home bucket.
+  void RemoveOverflowReference(Hash_t key_hash) {
+    unsigned y = BucketIndex(key_hash);
+    bucket_[y].UnsetOverflowPtr(&bucket_[NextBid(y)]);
+  }
+
+  // Looks for key in the overflow buckets.
+  template <typename U, typename Pred>
+  Iterator FindInOverflow(uint8_t fp_hash, U&& key, Pred&& cf) const {
+    if (const Bucket* ovf = Overflow()) {
+      for (unsigned i = 0; i < kNumOverflowBuckets; ++i) {
+        SlotId sid = ovf[i].FindByFp(fp_hash, false, key, cf);
+        if (sid != BucketType::kNanSlot)
+          return Iterator{uint8_t(kTotalBuckets + i), sid};
+      }
+    }
+    return Iterator{};
+  }
+
+  // Moves the entries of the overflow buckets for which keep(hash) holds into the regular and
+  // stash buckets of this segment and the rest into dest. The entries that do not fit stay.
+  // Returns true if the overflow buckets are empty afterwards.
+  template <typename HFunc, typename Pred>
+  bool MoveOverflow(HFunc&& hfn, Pred&& keep, Segment* dest);
+
   // Returns slot id if insertion is successful, -1 if no free slots are found.
   template <typename U, typename V>
   int TryInsertToBucket(unsigned bidx, U&& key, V&& value, uint8_t meta_hash, bool probe) {
-    auto& b = bucket_[bidx];
+    auto& b = BucketAt(bidx);
     auto slot = b.FindEmptySlot();
     assert(slot < int(kNumSlots));
     if (slot < 0) {
@@ -583,12 +842,37 @@ template <typename _Key, typename _Value, typename Policy = DefaultSegmentPolicy
   // returns a valid iterator if succeeded.
   Iterator TryMoveFromStash(unsigned stash_id, unsigned stash_slot_id, Hash_t key_hash);
 
+  // Carries the expiry of an entry that moved from src to dest. Bucket::Insert resets it.
+  static void MoveExpiry(const Bucket& src, unsigned src_slot, Bucket* dest, unsigned dest_slot) {
+    if constexpr (USE_EXPIRY)
+      dest->SetExpiry(dest_slot, src.GetExpiry(src_slot));
+  }
+
+  // Carries the auxiliary value of an entry that moved to dest_seg.
+  void MoveAux(unsigned src_bid, unsigned src_slot, Segment* dest_seg, unsigned dest_bid,
+               unsigned dest_slot) const {
+    if constexpr (USE_AUX) {
+      assert(dest_seg->aux_ || !this->aux_);
+      if (dest_seg->aux_)
+        dest_seg->aux_[dest_bid * kNumSlots + dest_slot] = GetAux(src_bid, src_slot);
+    }
+  }
+
+  void SwapAux(unsigned bid_a, unsigned slot_a, unsigned bid_b, unsigned slot_b) {
+    if constexpr (USE_AUX) {
+      if (this->aux_)
+        std::swap(this->aux_[bid_a * kNumSlots + slot_a], this->aux_[bid_b * kNumSlots + slot_b]);
+    }
+  }
+
   Bucket bucket_[kTotalBuckets];
   size_t local_depth_;
 
  public:
   static constexpr size_t kBucketSz = sizeof(Bucket);
   static constexpr size_t kMaxSize = kTotalBuckets * kNumSlots;
+  static constexpr size_t kAuxLen = (kTotalBuckets + kNumOverflowBuckets) * kNumSlots;
+  static constexpr size_t kOverflowBytes = sizeof(Bucket) * kNumOverflowBuckets;
   static constexpr double kTaxSize =
       (double(sizeof(Segment)) / kMaxSize) - sizeof(Key_t) - sizeof(Value_t);
 
@@ -868,19 +1152,23 @@ unsigned BucketBase<NUM_SLOTS, NUM_OVR>::UnsetStashPtr(uint8_t fp_hash, unsigned
     overflow_count_--;
   }
 
+  UpdateStashPresent(*next);
+  return res;
+}
+
+template <unsigned NUM_SLOTS, unsigned NUM_OVR>
+void BucketBase<NUM_SLOTS, NUM_OVR>::UpdateStashPresent(const BucketBase& next) {
   // kStashPresentBit helps with summarizing all the stash states into a single binary flag.
   // We need it because of the next, though if we make sure to move stash pointers upon split/delete
   // towards the owner we should not reach the state where mask1 == 0 but mask2 &
   // next->stash_probe_mask_ != 0.
   unsigned mask1 = stash_busy_ & (kStashPresentBit - 1);
-  unsigned mask2 = next->stash_busy_ & (kStashPresentBit - 1);
+  unsigned mask2 = next.stash_busy_ & (kStashPresentBit - 1);
 
   if (((mask1 & (~stash_probe_mask_)) == 0) && (overflow_count_ == 0) &&
-      ((mask2 & next->stash_probe_mask_) == 0)) {
+      ((mask2 & next.stash_probe_mask_) == 0)) {
     stash_busy_ &= ~kStashPresentBit;
   }
-
-  return res;
 }
 
 template <unsigned NUM_SLOTS, unsigned NUM_OVR>
@@ -903,6 +1191,39 @@ uint32_t BucketBase<NUM_SLOTS, NUM_OVR>::CompareFP(uint8_t fp) const {
   return mask;
 }
 
+template <unsigned NUM_SLOTS, unsigned NUM_OVR>
+uint32_t BucketBase<NUM_SLOTS, NUM_OVR>::CompareStashFP(uint8_t fp) const {
+  // Stash fps are packed into 4 bytes, hence we load them as a single 32 bit word.
+  uint32_t packed = 0;
+  memcpy(&packed, stash_arr_.data(), kStashFpLen);
+
+  const __m128i key_data = _mm_set1_epi8(fp);
+  __m128i stash_data = _mm_cvtsi32_si128(packed);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(stash_data, key_data)) & ((1u << kStashFpLen) - 1);
+}
+
+template <unsigned NUM_SLOTS, unsigned NUM_OVR>
+unsigned BucketBase<NUM_SLOTS, NUM_OVR>::FindWithStash(uint8_t fp_hash, bool probe,
+                                                      unsigned* stash_mask) const {
+  constexpr uint32_t kSlotMask = (1u << NUM_SLOTS) - 1;
+  uint32_t mask;
+
+  if constexpr (NUM_SLOTS + kStashFpLen <= 16) {
+    // stash_arr_ directly follows finger_arr_, therefore they both fit into the same 16 byte
+    // register and a single comparison covers all the fingerprints of the bucket.
+    static_assert(sizeof(FpArray) == NUM_SLOTS);
+    assert(stash_arr_.data() == finger_arr_.data() + NUM_SLOTS);
+
+    mask = CompareFP(fp_hash);
+    *stash_mask = StashMask(mask >> NUM_SLOTS, probe);
+  } else {
+    mask = CompareFP(fp_hash);
+    *stash_mask = FindStash(fp_hash, probe);
+  }
+
+  return mask & kSlotMask & GetBusy() & GetProbe(probe);
+}
+
 // Bucket slot array goes from left to right: [x, x, ...]
 // Shift right vacates the first slot on the left by shifting all the elements right and
 // possibly deleting the last one on the right.
@@ -922,19 +1243,16 @@ template <unsigned NUM_SLOTS, unsigned NUM_OVR>
 template <typename F>
 auto BucketBase<NUM_SLOTS, NUM_OVR>::IterateStash(uint8_t fp, bool is_probe, F&& func) const
     -> ::std::pair<unsigned, SlotId> {
-  unsigned om = is_probe ? stash_probe_mask_ : ~stash_probe_mask_;
-  unsigned ob = stash_busy_;
-
-  for (unsigned i = 0; i < kStashFpLen; ++i) {
-    if ((ob & 1) && (stash_arr_[i] == fp) && (om & 1)) {
-      unsigned pos = (stash_pos_ >> (i * 2)) & 3;
-      auto sid = func(i, pos);
-      if (sid != BucketBase::kNanSlot) {
-        return std::pair<unsigned, SlotId>(pos, sid);
-      }
+  unsigned mask = FindStash(fp, is_probe);
+
+  while (mask) {
+    unsigned i = __builtin_ctz(mask);
+    unsigned pos = StashPos(i);
+    auto sid = func(i, pos);
+    if (sid != BucketBase::kNanSlot) {
+      return std::pair<unsigned, SlotId>(pos, sid);
     }
-    ob >>= 1;
-    om >>= 1;
+    mask &= (mask - 1);
   }
   return std::pair<unsigned, SlotId>(0, BucketBase::kNanSlot);
 }
@@ -972,19 +1290,14 @@ ___] |___ |__] |  | |___ | \|  |
 
 template <typename Key, typename Value, typename Policy>
 template <typename U, typename Pred>
-auto Segment<Key, Value, Policy>::Bucket::FindByFp(uint8_t fp_hash, bool probe, U&& k,
-                                                   Pred&& pred) const -> SlotId {
-  unsigned mask = this->Find(fp_hash, probe);
-  if (!mask)
-    return kNanSlot;
-
-  unsigned delta = __builtin_ctz(mask);
-  mask >>= delta;
-  for (unsigned i = delta; i < NUM_SLOTS; ++i) {
-    if ((mask & 1) && pred(key[i], k)) {
+auto Segment<Key, Value, Policy>::Bucket::FindByMask(unsigned mask, U&& k, Pred&& pred) const
+    -> SlotId {
+  while (mask) {
+    unsigned i = __builtin_ctz(mask);
+    if (pred(key[i], k)) {
       return i;
     }
-    mask >>= 1;
+    mask &= (mask - 1);
   };
 
   return kNanSlot;
@@ -996,6 +1309,8 @@ bool Segment<Key, Value, Policy>::Bucket::ShiftRight() {
   for (int i = NUM_SLOTS - 1; i > 0; i--) {
     std::swap(key[i], key[i - 1]);
     std::swap(value[i], value[i - 1]);
+    if constexpr (USE_EXPIRY)
+      this->SwapExpiry(i, i - 1);
   }
   return res;
 }
@@ -1029,6 +1344,9 @@ auto Segment<Key, Value, Policy>::TryMoveFromStash(unsigned stash_id, unsigned s
   }
 
   if (reg_slot >= 0) {
+    MoveExpiry(bucket_[stash_bid], stash_slot_id, &bucket_[bid], reg_slot);
+    MoveAux(stash_bid, stash_slot_id, this, bid, reg_slot);
+
     if constexpr (USE_VERSION) {
       // We maintain the invariant for the physical bucket by updating the version when
       // the entries move between buckets.
@@ -1055,6 +1373,10 @@ auto Segment<Key, Value, Policy>::Insert(U&& key, V&& value, Hash_t key_hash, Pr
   }
 
   it = InsertUniq(std::forward<U>(key), std::forward<V>(value), key_hash, true);
+  if constexpr (USE_AUX) {
+    if (this->aux_ && it.found())
+      SetAux(it.index, it.slot, 0);
+  }
 
   return std::make_pair(it, it.found());
 }
@@ -1069,16 +1391,24 @@ auto Segment<Key, Value, Policy>::FindIt(U&& key, Hash_t key_hash, Pred&& cf) co
   // since we are going to access this memory in a bit.
   __builtin_prefetch(&target);
 
+  uint8_t nid = NextBid(bidx);
+  const Bucket& probe = bucket_[nid];
+  __builtin_prefetch(&probe);
+
   uint8_t fp_hash = key_hash & kFpMask;
-  SlotId sid = target.FindByFp(fp_hash, false, key, cf);
+
+  // Both fingerprint arrays of the home bucket (slots and stash) are compared at once,
+  // so the stash lookup below does not need to touch the fps again.
+  unsigned target_stash_mask = 0;
+  unsigned slot_mask = target.FindWithStash(fp_hash, false, &target_stash_mask);
+  SlotId sid = target.FindByMask(slot_mask, key, cf);
   if (sid != BucketType::kNanSlot) {
     return Iterator{bidx, sid};
   }
 
-  uint8_t nid = NextBid(bidx);
-  const Bucket& probe = bucket_[nid];
-
-  sid = probe.FindByFp(fp_hash, true, key, cf);
+  unsigned probe_stash_mask = 0;
+  slot_mask = probe.FindWithStash(fp_hash, true, &probe_stash_mask);
+  sid = probe.FindByMask(slot_mask, key, cf);
 
 #ifdef ENABLE_DASH_STATS
   stats.neighbour_probes++;
@@ -1092,11 +1422,9 @@ auto Segment<Key, Value, Policy>::FindIt(U&& key, Hash_t key_hash, Pred&& cf) co
     return Iterator{};
   }
 
-  auto stash_cb = [&](unsigned overflow_index, unsigned pos) -> SlotId {
+  auto stash_find = [&](unsigned pos) -> SlotId {
     assert(pos < STASH_BUCKET_NUM);
-
-    pos += kNumBuckets;
-    const Bucket& bucket = bucket_[pos];
+    const Bucket& bucket = bucket_[kNumBuckets + pos];
     return bucket.FindByFp(fp_hash, false, key, cf);
   };
 
@@ -1106,43 +1434,52 @@ auto Segment<Key, Value, Policy>::FindIt(U&& key, Hash_t key_hash, Pred&& cf) co
 #endif
 
     for (unsigned i = 0; i < STASH_BUCKET_NUM; ++i) {
-      auto sid = stash_cb(0, i);
+      auto sid = stash_find(i);
       if (sid != BucketType::kNanSlot) {
         return Iterator{uint8_t(kNumBuckets + i), sid};
       }
     }
 
     // We exit because we searched through all stash buckets anyway, no need to use overflow fps.
-    return Iterator{};
+    // The entries of the overflow buckets are accounted as the stash overflow of their bucket.
+    return FindInOverflow(fp_hash, key, cf);
   }
 
 #ifdef ENABLE_DASH_STATS
   stats.stash_probes++;
 #endif
 
-  auto stash_res = target.IterateStash(fp_hash, false, stash_cb);
-  if (stash_res.second != BucketType::kNanSlot) {
-    return Iterator{uint8_t(kNumBuckets + stash_res.first), stash_res.second};
-  }
+  // Go over the stash fps that matched in the home bucket and then in its neighbour.
+  auto find_by_stash_mask = [&](const Bucket& b, unsigned mask) -> Iterator {
+    while (mask) {
+      unsigned pos = b.StashPos(__builtin_ctz(mask));
+      SlotId sid = stash_find(pos);
+      if (sid != BucketType::kNanSlot) {
+        return Iterator{uint8_t(kNumBuckets + pos), sid};
+      }
+      mask &= (mask - 1);
+    }
+    return Iterator{};
+  };
 
-  stash_res = probe.IterateStash(fp_hash, true, stash_cb);
-  if (stash_res.second != BucketType::kNanSlot) {
-    return Iterator{uint8_t(kNumBuckets + stash_res.first), stash_res.second};
-  }
-  return Iterator{};
+  Iterator res = find_by_stash_mask(target, target_stash_mask);
+  if (res.found())
+    return res;
+
+  return find_by_stash_mask(probe, probe_stash_mask);
 }
 
 template <typename Key, typename Value, typename Policy>
 template <typename Cb>
 void Segment<Key, Value, Policy>::TraverseAll(Cb&& cb) const {
-  for (uint8_t i = 0; i < kTotalBuckets; ++i) {
-    bucket_[i].ForEachSlot([&](SlotId slot, bool) { cb(Iterator{i, slot}); });
+  for (uint8_t i = 0; i < num_buckets(); ++i) {
+    BucketAt(i).ForEachSlot([&](SlotId slot, bool) { cb(Iterator{i, slot}); });
   }
 }
 
 template <typename Key, typename Value, typename Policy> void Segment<Key, Value, Policy>::Clear() {
-  for (unsigned i = 0; i < kTotalBuckets; ++i) {
-    bucket_[i].Clear();
+  for (unsigned i = 0; i < num_buckets(); ++i) {
+    BucketAt(i).Clear();
   }
 }
 
@@ -1150,9 +1487,11 @@ template <typename Key, typename Value, typename Policy>
 void Segment<Key, Value, Policy>::Delete(const Iterator& it, Hash_t key_hash) {
   assert(it.found());
 
-  auto& b = bucket_[it.index];
+  auto& b = BucketAt(it.index);
 
-  if (it.index >= kNumBuckets) {
+  if (it.index >= kTotalBuckets) {
+    RemoveOverflowReference(key_hash);
+  } else if (it.index >= kNumBuckets) {
     RemoveStashReference(it.index - kNumBuckets, key_hash);
   }
 
@@ -1192,7 +1531,8 @@ void Segment<Key, Value, Policy>::Split(HFunc&& hfn, Segment* dest_right) {
       // we move items residing in a regular bucket to a new segment.
       // I do not see a reason why it might overflow to a stash bucket.
       assert(it.index < kNumBuckets);
-      (void)it;
+      MoveExpiry(bucket_[i], slot, &dest_right->bucket_[it.index], it.slot);
+      MoveAux(i, slot, dest_right, it.index, it.slot);
 
       if constexpr (USE_VERSION) {
         // Maintaining consistent versioning.
@@ -1230,8 +1570,9 @@ void Segment<Key, Value, Policy>::Split(HFunc&& hfn, Segment* dest_right) {
       invalid_mask |= (1u << slot);
       auto it = dest_right->InsertUniq(std::forward<Key_t>(Key(bid, slot)),
                                        std::forward<Value_t>(Value(bid, slot)), hash, false);
-      (void)it;
       assert(it.index != kNanBid);
+      MoveExpiry(stash, slot, &dest_right->bucket_[it.index], it.slot);
+      MoveAux(bid, slot, dest_right, it.index, it.slot);
 
       if constexpr (USE_VERSION) {
         // Update the version in the destination bucket.
@@ -1249,6 +1590,137 @@ void Segment<Key, Value, Policy>::Split(HFunc&& hfn, Segment* dest_right) {
     stash.ForEachSlot(std::move(cb));
     stash.ClearSlots(invalid_mask);
   }
+
+  // The overflow entries that stay move back to the buckets that the split has vacated.
+  if (HasOverflow())
+    MoveOverflow(hfn, is_mine, dest_right);
+}
+
+template <typename Key, typename Value, typename Policy>
+template <typename HFunc, typename Pred>
+bool Segment<Key, Value, Policy>::MoveOverflow(HFunc&& hfn, Pred&& keep, Segment* dest) {
+  Bucket* ovf = Overflow();
+  if (!ovf)
+    return true;
+
+  // Detach the overflow buckets so that the entries that stay do not return into them.
+  if constexpr (OVERFLOW_BUCKET_NUM > 0)
+    this->overflow_ = nullptr;
+
+  bool empty = true;
+  for (unsigned i = 0; i < kNumOverflowBuckets; ++i) {
+    unsigned bid = kTotalBuckets + i;
+    Bucket& bucket = ovf[i];
+    uint32_t moved_mask = 0;
+
+    auto cb = [&](unsigned slot, bool probe) {
+      Hash_t hash = hfn(bucket.key[slot]);
+      Segment* to = keep(hash) ? this : dest;
+      auto it = to->InsertUniq(std::forward<Key_t>(bucket.key[slot]),
+                               std::forward<Value_t>(bucket.value[slot]), hash, false);
+      if (!it.found()) {
+        empty = false;
+        return;
+      }
+
+      assert(it.index < kTotalBuckets);
+      MoveExpiry(bucket, slot, &to->bucket_[it.index], it.slot);
+      MoveAux(bid, slot, to, it.index, it.slot);
+
+      if constexpr (USE_VERSION) {
+        // Entries never decrease their version when moving between buckets.
+        uint64_t ver = bucket.GetVersion();
+        if (to->bucket_[it.index].GetVersion() < ver) {
+          to->bucket_[it.index].SetVersion(ver);
+        }
+      }
+
+      RemoveOverflowReference(hash);
+      moved_mask |= (1u << slot);
+    };
+
+    bucket.ForEachSlot(std::move(cb));
+    bucket.ClearSlots(moved_mask);
+  }
+
+  if constexpr (OVERFLOW_BUCKET_NUM > 0)
+    this->overflow_ = ovf;
+  return empty;
+}
+
+template <typename Key, typename Value, typename Policy>
+template <typename HFunc>
+bool Segment<Key, Value, Policy>::Merge(HFunc&& hfn, Segment* src) {
+  assert(local_depth_ == src->local_depth_ && local_depth_ > 0);
+
+  // The table unloads and detaches the overflow buckets of both segments before merging them.
+  assert(!HasOverflow() && !src->HasOverflow());
+
+  // Moves the entries of a bucket for which pred(hash) holds into dest segment.
+  // Returns false if dest is full.
+  auto move_bucket = [&hfn](Segment* from, unsigned bid, Segment* dest, auto&& pred) {
+    Bucket& bucket = from->bucket_[bid];
+    uint32_t moved_mask = 0;
+    bool dest_full = false;
+
+    auto cb = [&](unsigned slot, bool probe) {
+      if (dest_full)
+        return;
+
+      Hash_t hash = hfn(bucket.key[slot]);
+      if (!pred(hash))
+        return;
+
+      auto it = dest->InsertUniq(std::forward<Key_t>(bucket.key[slot]),
+                                 std::forward<Value_t>(bucket.value[slot]), hash, false);
+      if (!it.found()) {
+        dest_full = true;
+        return;
+      }
+      MoveExpiry(bucket, slot, &dest->bucket_[it.index], it.slot);
+      from->MoveAux(bid, slot, dest, it.index, it.slot);
+
+      if constexpr (USE_VERSION) {
+        // Entries never decrease their version when moving between buckets.
+        uint64_t ver = bucket.GetVersion();
+        if (dest->bucket_[it.index].GetVersion() < ver) {
+          dest->bucket_[it.index].SetVersion(ver);
+        }
+      }
+
+      if (bid >= kNumBuckets) {
+        from->RemoveStashReference(bid - kNumBuckets, hash);
+      }
+      moved_mask |= (1u << slot);
+    };
+
+    bucket.ForEachSlot(std::move(cb));
+    bucket.ClearSlots(moved_mask);
+    return !dest_full;
+  };
+
+  auto any_entry = [](Hash_t) { return true; };
+  bool success = true;
+  for (unsigned i = 0; i < kTotalBuckets && success; ++i) {
+    success = move_bucket(src, i, this, any_entry);
+  }
+
+  if (success) {
+    --local_depth_;
+    src->local_depth_ = local_depth_;
+    return true;
+  }
+
+  // Roll back: move the entries that originate from src back. They are identified the same way
+  // Split identifies them - by having 1 at local_depth bit of their hash.
+  auto is_src = [this](Hash_t hash) { return (hash >> (64 - local_depth_) & 1) == 1; };
+  for (unsigned i = 0; i < kTotalBuckets; ++i) {
+    bool res = move_bucket(this, i, src, is_src);
+    assert(res);  // src held all these entries before.
+    (void)res;
+  }
+
+  return false;
 }
 
 template <typename Key, typename Value, typename Policy>
@@ -1266,6 +1738,9 @@ int Segment<Key, Value, Policy>::MoveToOther(bool own_items, unsigned from_bid,
   if (dst_slot < 0)
     return -1;
 
+  MoveExpiry(src, src_slot, &bucket_[to_bid], dst_slot);
+  MoveAux(from_bid, src_slot, this, to_bid, dst_slot);
+
   // We never decrease the version of the entry.
   if constexpr (USE_VERSION) {
     auto& dst = bucket_[to_bid];
@@ -1349,6 +1824,17 @@ auto Segment<Key, Value, Policy>::InsertUniq(U&& key, V&& value, Hash_t key_hash
     }
   }
 
+  if (HasOverflow()) {
+    for (unsigned i = 0; i < kNumOverflowBuckets; ++i) {
+      int slot = TryInsertToBucket(kTotalBuckets + i, std::forward<U>(key), std::forward<V>(value),
+                                   meta_hash, false);
+      if (slot >= 0) {
+        target.SetOverflowPtr();
+        return Iterator{uint8_t(kTotalBuckets + i), uint8_t(slot)};
+      }
+    }
+  }
+
   return Iterator{};
 }
 
@@ -1412,6 +1898,16 @@ std::enable_if_t<UV, unsigned> Segment<Key, Value, Policy>::CVCOnInsert(uint64_t
     }
   }
 
+  for (unsigned ovf_bid = kTotalBuckets; ovf_bid < num_buckets(); ++ovf_bid) {
+    const Bucket& ovf = BucketAt(ovf_bid);
+    if (!ovf.IsFull()) {
+      if (!ovf.IsEmpty() && ovf.GetVersion() < ver_threshold)
+        bid_res[cnt++] = ovf_bid;
+
+      return cnt;
+    }
+  }
+
   return UINT16_MAX;
 }
 
@@ -1421,8 +1917,9 @@ std::enable_if_t<UV, unsigned> Segment<Key, Value, Policy>::CVCOnBump(uint64_t v
                                                                       unsigned bid, unsigned slot,
                                                                       Hash_t hash,
                                                                       uint8_t result_bid[2]) const {
-  if (bid < kNumBuckets) {
+  if (bid < kNumBuckets || bid >= kTotalBuckets) {
     // right now we do not migrate entries from nid to bid, only from stash to normal buckets.
+    // BumpUp does not move the entries of the overflow buckets either.
     return 0;
   }
 
@@ -1522,11 +2019,11 @@ bool Segment<Key, Value, Policy>::TraverseLogicalBucket(uint8_t bid, HashFn&& hf
     });
   }
 
-  // Finally go over stash buckets and find those entries that belong to b.
+  // Finally go over stash and overflow buckets and find those entries that belong to b.
   if (b.HasStash()) {
     // do not bother with overflow fps. Just go over all the stash buckets.
-    for (uint8_t j = kNumBuckets; j < kTotalBuckets; ++j) {
-      const auto& stashb = bucket_[j];
+    for (uint8_t j = kNumBuckets; j < num_buckets(); ++j) {
+      const auto& stashb = BucketAt(j);
       stashb.ForEachSlot([&](SlotId slot, bool probe) {
         if (BucketIndex(hfun(stashb.key[slot])) == bid) {
           found = true;
@@ -1542,8 +2039,8 @@ bool Segment<Key, Value, Policy>::TraverseLogicalBucket(uint8_t bid, HashFn&& hf
 template <typename Key, typename Value, typename Policy>
 size_t Segment<Key, Value, Policy>::SlowSize() const {
   size_t res = 0;
-  for (unsigned i = 0; i < kTotalBuckets; ++i) {
-    res += bucket_[i].Size();
+  for (unsigned i = 0; i < num_buckets(); ++i) {
+    res += BucketAt(i).Size();
   }
   return res;
 }
@@ -1551,14 +2048,14 @@ size_t Segment<Key, Value, Policy>::SlowSize() const {
 template <typename Key, typename Value, typename Policy>
 auto Segment<Key, Value, Policy>::FindValidStartingFrom(unsigned bid, unsigned slot) const
     -> Iterator {
-  uint32_t mask = bucket_[bid].GetBusy();
+  uint32_t mask = BucketAt(bid).GetBusy();
   mask >>= slot;
   if (mask)
     return Iterator(bid, slot + __builtin_ctz(mask));
 
   ++bid;
-  while (bid < kTotalBuckets) {
-    uint32_t mask = bucket_[bid].GetBusy();
+  while (bid < num_buckets()) {
+    uint32_t mask = BucketAt(bid).GetBusy();
     if (mask) {
       return Iterator(bid, __builtin_ctz(mask));
     }
@@ -1571,6 +2068,10 @@ template <typename Key, typename Value, typename Policy>
 template <typename BumpPolicy>
 auto Segment<Key, Value, Policy>::BumpUp(uint8_t bid, SlotId slot, Hash_t key_hash,
                                          const BumpPolicy& bp) -> Iterator {
+  // The entries of the overflow buckets are not ranked, they leave when the segment splits.
+  if (bid >= kTotalBuckets)
+    return Iterator{bid, slot};
+
   auto& from = bucket_[bid];
 
   uint8_t target_bid = BucketIndex(key_hash);
@@ -1582,6 +2083,7 @@ auto Segment<Key, Value, Policy>::BumpUp(uint8_t bid, SlotId slot, Hash_t key_ha
     // non stash case.
     if (slot > 0 && bp.CanBumpDown(from.key[slot - 1])) {
       from.Swap(slot - 1, slot);
+      SwapAux(bid, slot - 1, bid, slot);
       return Iterator{bid, uint8_t(slot - 1)};
     }
     // TODO: We could promote further, by swapping probing bucket with its previous one.
@@ -1629,6 +2131,12 @@ auto Segment<Key, Value, Policy>::BumpUp(uint8_t bid, SlotId slot, Hash_t key_ha
   // swap keys, values and fps. update slots meta.
   std::swap(from.key[slot], swapb.key[kLastSlot]);
   std::swap(from.value[slot], swapb.value[kLastSlot]);
+  if constexpr (USE_EXPIRY) {
+    uint32_t from_expiry = from.GetExpiry(slot);
+    from.SetExpiry(slot, swapb.GetExpiry(kLastSlot));
+    swapb.SetExpiry(kLastSlot, from_expiry);
+  }
+  SwapAux(bid, slot, swap_bid, kLastSlot);
   from.Delete(slot);
   from.SetHash(slot, swap_fp, false);
 
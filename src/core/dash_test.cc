@@ -269,6 +269,35 @@ TEST_F(DashTest, Segment) {
   ASSERT_FALSE(Contains(arr.front()));
 }
 
+TEST_F(DashTest, FindWithStash) {
+  set<Segment::Key_t> keys = FillSegment(0);
+  ASSERT_TRUE(segment_.GetBucket(0).HasStash());
+
+  auto hfun = &UInt64Policy::HashFn;
+  const auto& home = segment_.GetBucket(0);
+  const auto& next = segment_.GetBucket(1);
+
+  for (uint8_t fp = 0; fp < 4; ++fp) {
+    unsigned home_stash = 0, next_stash = 0;
+    unsigned home_slots = home.FindWithStash(fp, false, &home_stash);
+    unsigned next_slots = next.FindWithStash(fp, true, &next_stash);
+
+    // The combined probe must agree with the scalar per-array probes.
+    EXPECT_EQ(home.Find(fp, false), home_slots);
+    EXPECT_EQ(next.Find(fp, true), next_slots);
+    EXPECT_EQ(home.FindStash(fp, false), home_stash);
+    EXPECT_EQ(next.FindStash(fp, true), next_stash);
+    if (fp > 2) {
+      EXPECT_EQ(0, home_slots | home_stash);
+    }
+  }
+
+  std::equal_to<Segment::Key_t> eq;
+  for (auto k : keys) {
+    ASSERT_TRUE(segment_.FindIt(k, hfun(k), eq).found()) << k;
+  }
+}
+
 TEST_F(DashTest, SegmentFull) {
   std::equal_to<Segment::Key_t> eq;
 
@@ -508,6 +537,47 @@ TEST_F(DashTest, Insert) {
   ASSERT_TRUE(dt_.Find(some_val).is_done());
 }
 
+TEST_F(DashTest, CacheLinePolicy) {
+  using Policy = CacheLineDashPolicy<uint64_t, uint64_t, 4, UInt64Policy>;
+  using Table = DashTable<uint64_t, uint64_t, Policy>;
+  using Wider = detail::Segment<uint64_t, uint64_t,
+                                detail::DashSegmentPolicy<UInt64Policy, Policy::kSlotNum + 1>>;
+
+  // The widest bucket that fits into 4 cache lines.
+  EXPECT_LE(Table::kBucketBytes, 256u);
+  EXPECT_GT(Wider::kBucketSz, 256u);
+  EXPECT_GT(Table::kBucketWidth, Dash64::kBucketWidth);
+
+  Table table;
+  for (uint64_t i = 0; i < 10000; ++i)
+    table.Insert(i, i * 2);
+  EXPECT_EQ(10000u, table.size());
+  for (uint64_t i = 0; i < 10000; ++i) {
+    auto it = table.Find(i);
+    ASSERT_FALSE(it.is_done());
+    ASSERT_EQ(i * 2, it->second);
+  }
+  EXPECT_TRUE(table.Find(10000).is_done());
+}
+
+TEST_F(DashTest, FindByHash) {
+  constexpr size_t kNumItems = 1000;
+  for (size_t i = 0; i < kNumItems; ++i) {
+    dt_.Insert(i, i * 2);
+  }
+
+  for (size_t i = 0; i < kNumItems; ++i) {
+    uint64_t hash = dt_.DoHash(i);
+    auto it = dt_.FindByHash(hash, [&](uint64_t key) { return dt_.DoHash(key) == hash; });
+    ASSERT_FALSE(it.is_done());
+    ASSERT_EQ(i, it->first);
+    ASSERT_EQ(i * 2, it->second);
+
+    it = dt_.FindByHash(hash, [](uint64_t key) { return false; });
+    ASSERT_TRUE(it.is_done());
+  }
+}
+
 TEST_F(DashTest, Traverse) {
   constexpr auto kNumItems = 50;
   for (size_t i = 0; i < kNumItems; ++i) {
@@ -531,6 +601,111 @@ TEST_F(DashTest, Traverse) {
   EXPECT_EQ(kNumItems - 1, nums.back());
 }
 
+TEST_F(DashTest, TraverseStep) {
+  // A deep and a shallow table, traversed together up to common positions, as SCAN does with
+  // the tables of the shards.
+  Dash64 tables[2];
+  for (size_t i = 0; i < 20000; ++i) {
+    tables[i % 100 == 0].Insert(i, i);
+  }
+  ASSERT_GT(tables[0].depth(), tables[1].depth() + 2);
+
+  // The position of a cursor in the traversal order: its bucket and then its segment.
+  auto pos = [](Dash64::Cursor cur) {
+    return (uint64_t(cur.bucket_id()) << 32) | cur.value() >> 8;
+  };
+  auto to_cursor = [](uint64_t pos) {
+    return Dash64::Cursor{(pos & 0xFFFFFFFF) << 8 | pos >> 32};
+  };
+  constexpr uint64_t kEnd = UINT64_MAX;
+
+  vector<unsigned> visits(20000);
+  uint64_t common = 0;
+  for (unsigned step = 1; common != kEnd; ++step) {
+    uint64_t reached[2];
+    vector<pair<uint64_t, uint64_t>> found[2];
+
+    for (unsigned t = 0; t < 2; ++t) {
+      Dash64::Cursor cur = common ? tables[t].AlignCursor(to_cursor(common)) : 0;
+      reached[t] = common && !cur ? kEnd : pos(cur);
+      for (unsigned i = 0; i < step % 7 + 1 && reached[t] != kEnd; ++i) {
+        cur = tables[t].TraverseStep(
+            cur, [&](Dash64::iterator it) { found[t].emplace_back(reached[t], it->first); });
+        reached[t] = cur ? pos(cur) : kEnd;
+      }
+    }
+
+    // Entries past the common position are visited again by the next step.
+    common = min(reached[0], reached[1]);
+    for (unsigned t = 0; t < 2; ++t) {
+      for (const auto& [p, key] : found[t]) {
+        if (p < common)
+          ++visits[key];
+      }
+    }
+  }
+
+  for (size_t i = 0; i < visits.size(); ++i) {
+    ASSERT_EQ(1, visits[i]) << i;
+  }
+}
+
+TEST_F(DashTest, Merge) {
+  constexpr size_t kNumItems = 100000;
+  for (size_t i = 0; i < kNumItems; ++i) {
+    dt_.Insert(i, i);
+  }
+  const size_t peak_mem = dt_.mem_usage();
+  const unsigned peak_depth = dt_.depth();
+
+  // Start a traversal before the deletions and continue it while the table shrinks.
+  Dash64::Cursor cursor;
+  set<uint64_t> traversed;
+  auto tr_cb = [&](Dash64::iterator it) { traversed.insert(it->first); };
+  for (unsigned i = 0; i < 100; ++i) {
+    cursor = dt_.Traverse(cursor, tr_cb);
+  }
+
+  for (size_t i = 0; i < kNumItems; ++i) {
+    if (i % 64)
+      dt_.Erase(i);
+  }
+
+  uint32_t seg_cursor = 0;
+  unsigned total_merged = 0;
+  for (unsigned i = 0; i < 1000; ++i) {
+    unsigned merged = 0;
+    seg_cursor = dt_.MergeStep(seg_cursor, 8, 0.5, [](Dash64::bucket_iterator) {}, &merged);
+    total_merged += merged;
+    if (cursor && i % 4 == 0)
+      cursor = dt_.Traverse(cursor, tr_cb);
+  }
+  while (cursor) {
+    cursor = dt_.Traverse(cursor, tr_cb);
+  }
+
+  EXPECT_GT(total_merged, 0u);
+  EXPECT_LT(dt_.depth(), peak_depth);
+  EXPECT_LT(dt_.mem_usage(), peak_mem / 4);
+  EXPECT_EQ(kNumItems / 64 + 1, dt_.size());
+
+  for (size_t i = 0; i < kNumItems; i += 64) {
+    ASSERT_FALSE(dt_.Find(i).is_done()) << i;
+    ASSERT_EQ(1, traversed.count(i)) << i;
+  }
+
+  size_t cnt = 0;
+  for (auto it = dt_.begin(); it != dt_.end(); ++it)
+    ++cnt;
+  EXPECT_EQ(dt_.size(), cnt);
+
+  // The table can grow again.
+  for (size_t i = 0; i < kNumItems; ++i) {
+    dt_.Insert(i, i);
+  }
+  EXPECT_EQ(kNumItems, dt_.size());
+}
+
 TEST_F(DashTest, Bucket) {
   constexpr auto kNumItems = 250;
   for (size_t i = 0; i < kNumItems; ++i) {
@@ -721,6 +896,207 @@ TEST_F(DashTest, CVCUponInsert) {
   dt.CVCUponInsert(1, i, cb);
 }
 
+struct ExpiryPolicy : public BasicDashPolicy {
+  static constexpr bool kUseExpiry = true;
+
+  static uint64_t HashFn(int v) {
+    return XXH3_64bits(&v, sizeof(v));
+  }
+};
+
+using ExpiryDT = DashTable<int, int, ExpiryPolicy>;
+TEST_F(DashTest, Expiry) {
+  ExpiryDT dt;
+  constexpr int kNum = 100000;
+  for (int i = 0; i < kNum; ++i) {
+    auto [it, inserted] = dt.Insert(i, i);
+    ASSERT_TRUE(inserted);
+    ASSERT_EQ(0, it.GetExpiry());
+    it.SetExpiry(i + 1);
+  }
+
+  // Bumping up swaps the entries with their neighbours and unloads the stash buckets.
+  for (int i = 0; i < kNum; i += 7) {
+    dt.BumpUp(dt.Find(i), RelaxedBumpPolicy{});
+  }
+
+  auto check = [&] {
+    size_t items = 0;
+    for (auto it = dt.begin(); it != dt.end(); ++it) {
+      ASSERT_EQ(uint32_t(it->first + 1), it.GetExpiry()) << it->first;
+      ++items;
+    }
+    ASSERT_EQ(dt.size(), items);
+  };
+  check();
+
+  for (int i = 0; i < kNum; ++i) {
+    if (i % 16)
+      dt.Erase(i);
+  }
+
+  uint32_t seg_cursor = 0;
+  unsigned total_merged = 0;
+  for (unsigned i = 0; i < 1000; ++i) {
+    unsigned merged = 0;
+    seg_cursor = dt.MergeStep(seg_cursor, 8, 0.5, [](ExpiryDT::bucket_iterator) {}, &merged);
+    total_merged += merged;
+  }
+  EXPECT_GT(total_merged, 0u);
+  check();
+}
+
+struct AuxPolicy : public BasicDashPolicy {
+  static constexpr bool kUseAux = true;
+
+  static uint64_t HashFn(int v) {
+    return XXH3_64bits(&v, sizeof(v));
+  }
+};
+
+using AuxDT = DashTable<int, int, AuxPolicy>;
+TEST_F(DashTest, Aux) {
+  AuxDT dt;
+  auto it = dt.Insert(0, 0).first;
+  size_t mem_usage = dt.mem_usage();
+  it.SetAux(0);
+  EXPECT_EQ(mem_usage, dt.mem_usage());
+  it.SetAux(1);
+  EXPECT_EQ(1, it.GetAux());
+  EXPECT_LT(mem_usage, dt.mem_usage());
+
+  // A new entry in the same slot does not inherit the value.
+  dt.Erase(0);
+  it = dt.Insert(0, 0).first;
+  EXPECT_EQ(0, it.GetAux());
+
+  constexpr int kNum = 100000;
+  auto aux_of = [](int i) { return i % 3 ? 0 : uint32_t(i + 1); };
+  it.SetAux(aux_of(0));
+  for (int i = 1; i < kNum; ++i) {
+    auto [it, inserted] = dt.Insert(i, i);
+    ASSERT_TRUE(inserted);
+    ASSERT_EQ(0, it.GetAux());
+    it.SetAux(aux_of(i));
+  }
+
+  for (int i = 0; i < kNum; i += 7) {
+    dt.BumpUp(dt.Find(i), RelaxedBumpPolicy{});
+  }
+
+  auto check = [&] {
+    size_t items = 0;
+    for (auto it = dt.begin(); it != dt.end(); ++it) {
+      ASSERT_EQ(aux_of(it->first), it.GetAux()) << it->first;
+      ++items;
+    }
+    ASSERT_EQ(dt.size(), items);
+  };
+  check();
+
+  for (int i = 0; i < kNum; ++i) {
+    if (i % 16)
+      dt.Erase(i);
+  }
+
+  uint32_t seg_cursor = 0;
+  for (unsigned i = 0; i < 1000; ++i) {
+    seg_cursor = dt.MergeStep(seg_cursor, 8, 0.5, [](AuxDT::bucket_iterator) {});
+  }
+  check();
+
+  dt.Clear();
+  EXPECT_EQ(0, dt.Insert(1, 1).first.GetAux());
+}
+
+struct OverflowPolicy : public AuxPolicy {
+  static constexpr unsigned kOverflowBucketNum = 2;
+};
+
+using OverflowDT = DashTable<int, int, OverflowPolicy>;
+TEST_F(DashTest, Overflow) {
+  OverflowDT dt;
+  size_t mem_usage = dt.mem_usage();
+
+  // The insert that finds a segment full lands in its new overflow buckets.
+  int num = 0;
+  while (dt.overflow_segments() == 0) {
+    ASSERT_TRUE(dt.Insert(num++, 0).second);
+  }
+  EXPECT_EQ(1, dt.overflow_segments());
+  EXPECT_EQ(mem_usage + OverflowDT::Segment_t::kOverflowBytes, dt.mem_usage());
+  EXPECT_EQ(0, dt.splits());
+
+  // The segment splits only once its overflow buckets are full as well.
+  size_t unique_segments = dt.unique_segments();
+  size_t size_at_overflow = dt.size();
+  while (dt.unique_segments() == unique_segments) {
+    ASSERT_TRUE(dt.Insert(num++, 0).second);
+  }
+  EXPECT_GT(dt.size() - 1, size_at_overflow);
+  EXPECT_EQ(1, dt.splits());
+  EXPECT_EQ(1, dt.overflow_splits());
+
+  constexpr int kNum = 50000;
+  auto aux_of = [](int i) { return i % 3 ? 0 : uint32_t(i + 1); };
+  for (int i = num; i < kNum; ++i) {
+    ASSERT_TRUE(dt.Insert(i, 0).second);
+  }
+  for (int i = 0; i < kNum; ++i) {
+    auto it = dt.Find(i);
+    it->second = i;
+    it.SetAux(aux_of(i));
+  }
+  EXPECT_GT(dt.overflow_segments(), 0u);
+  EXPECT_EQ(dt.overflow_splits(), dt.splits());
+
+  size_t in_overflow = 0;
+  auto check = [&](int step) {
+    size_t items = 0;
+    for (auto it = dt.begin(); it != dt.end(); ++it) {
+      ASSERT_EQ(aux_of(it->first), it.GetAux()) << it->first;
+      in_overflow += it.bucket_id() >= OverflowDT::kPhysicalBucketNum;
+      ++items;
+    }
+    ASSERT_EQ(dt.size(), items);
+    for (int i = 0; i < kNum; i += step) {
+      auto it = dt.Find(i);
+      ASSERT_FALSE(it.is_done()) << i;
+      ASSERT_EQ(i, it->second);
+    }
+  };
+  check(1);
+  EXPECT_GT(in_overflow, 0u);
+
+  // Traverse reaches the entries of the overflow buckets as well.
+  size_t traversed = 0;
+  OverflowDT::Cursor cursor;
+  do {
+    cursor = dt.Traverse(cursor, [&](OverflowDT::iterator) { ++traversed; });
+  } while (cursor);
+  EXPECT_EQ(dt.size(), traversed);
+
+  for (int i = 0; i < kNum; ++i) {
+    if (i % 16)
+      dt.Erase(i);
+  }
+  EXPECT_TRUE(dt.Find(1).is_done());
+
+  // Merging unloads the overflow buckets of both segments.
+  unique_segments = dt.unique_segments();
+  uint32_t seg_cursor = 0;
+  for (unsigned i = 0; i < 1000; ++i) {
+    seg_cursor = dt.MergeStep(seg_cursor, 8, 0.5, [](OverflowDT::bucket_iterator) {});
+  }
+  EXPECT_LT(dt.unique_segments(), unique_segments);
+  EXPECT_LT(dt.overflow_segments(), dt.unique_segments());
+  check(16);
+
+  dt.Clear();
+  EXPECT_EQ(0, dt.overflow_segments());
+  EXPECT_TRUE(dt.Insert(1, 1).second);
+}
+
 struct A {
   int a = 0;
   unsigned moved = 0;
@@ -766,6 +1142,9 @@ TEST_F(DashTest, Moveable) {
 struct SdsDashPolicy {
   enum { kSlotNum = 12, kBucketNum = 64, kStashBucketNum = 2 };
   static constexpr bool kUseVersion = false;
+  static constexpr bool kUseExpiry = false;
+  static constexpr bool kUseAux = false;
+  static constexpr unsigned kOverflowBucketNum = 0;
 
   static uint64_t HashFn(sds u) {
     return XXH3_64bits(reinterpret_cast<const uint8_t*>(u), sdslen(u));
@@ -852,6 +1231,9 @@ string PrintParams(const testing::TestParamInfo<EvictParams>& info) {
 struct U64DashPolicy {
   enum { kSlotNum = 14, kBucketNum = 64, kStashBucketNum = 4 };
   static constexpr bool kUseVersion = false;
+  static constexpr bool kUseExpiry = false;
+  static constexpr bool kUseAux = false;
+  static constexpr unsigned kOverflowBucketNum = 0;
 
   static void DestroyValue(uint64_t) {
   }
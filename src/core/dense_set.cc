@@ -4,10 +4,12 @@
 
 #include "core/dense_set.h"
 
+#include <absl/container/flat_hash_set.h>
 #include <absl/numeric/bits.h>
 
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <stack>
 #include <type_traits>
 #include <vector>
@@ -15,6 +17,7 @@
 #include "glog/logging.h"
 
 extern "C" {
+#include "redis/sds.h"
 #include "redis/zmalloc.h"
 }
 
@@ -25,9 +28,41 @@ constexpr size_t kMinSizeShift = 2;
 constexpr size_t kMinSize = 1 << kMinSizeShift;
 constexpr bool kAllowDisplacements = true;
 
+// Tables with fewer buckets are rehashed at once when they grow.
+constexpr size_t kMinIncrementalRehash = 4096;
+
+// How many buckets of the previous table are migrated per mutation during incremental rehashing.
+// It must be at least 1 so that the migration completes before the table needs to grow again.
+constexpr size_t kRehashBatch = 4;
+
+// RandomInternal takes a chain with probability min(length, kChainWeight) / kChainWeight and
+// then a random object of it, and gives up after kRandomProbes rejections. At full utilization
+// most chains hold a single object, hence an object is found in about kChainWeight probes.
+constexpr unsigned kChainWeight = 4;
+constexpr unsigned kRandomProbes = 64;
+
+// Samples of up to size / kDrawFraction objects are drawn one by one.
+constexpr size_t kDrawFraction = 4;
+
+namespace {
+
+uint64_t SplitMix64(uint64_t* state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+}  // namespace
+
 DenseSet::IteratorBase::IteratorBase(const DenseSet* owner, bool is_end)
     : owner_(const_cast<DenseSet&>(*owner)), curr_entry_(nullptr) {
-  curr_list_ = is_end ? owner_.entries_.end() : owner_.entries_.begin();
+  // During rehashing we first iterate over the entries that were not migrated yet.
+  if (is_end) {
+    curr_list_ = owner_.entries_.end();
+  } else {
+    curr_list_ = owner_.IsRehashing() ? owner_.old_entries_.begin() : owner_.entries_.begin();
+  }
   if (curr_list_ != owner->entries_.end()) {
     curr_entry_ = &(*curr_list_);
     owner->ExpireIfNeeded(nullptr, curr_entry_);
@@ -55,6 +90,10 @@ void DenseSet::IteratorBase::Advance() {
     DCHECK(curr_list_ != owner_.entries_.end());
     do {
       ++curr_list_;
+      if (owner_.IsRehashing() && curr_list_ == owner_.old_entries_.end()) {
+        curr_list_ = owner_.entries_.begin();
+      }
+
       if (curr_list_ == owner_.entries_.end()) {
         curr_entry_ = nullptr;
         return;
@@ -67,7 +106,7 @@ void DenseSet::IteratorBase::Advance() {
   DCHECK(!curr_entry_->IsEmpty());
 }
 
-DenseSet::DenseSet(pmr::memory_resource* mr) : entries_(mr) {
+DenseSet::DenseSet(pmr::memory_resource* mr) : entries_(mr), old_entries_(mr) {
 }
 
 DenseSet::~DenseSet() {
@@ -153,15 +192,42 @@ void* DenseSet::PopDataFront(DenseSet::ChainVectorIterator it) {
 }
 
 void DenseSet::ClearInternal() {
-  for (auto it = entries_.begin(); it != entries_.end(); ++it) {
-    while (!it->IsEmpty()) {
-      bool has_ttl = it->HasTtl();
-      void* obj = PopDataFront(it);
-      ObjDelete(obj, has_ttl);
+  for (auto* table : {&old_entries_, &entries_}) {
+    for (auto it = table->begin(); it != table->end(); ++it) {
+      while (!it->IsEmpty()) {
+        bool has_ttl = it->HasTtl();
+        void* obj = PopDataFront(it);
+        ObjDelete(obj, has_ttl);
+      }
     }
   }
 
   entries_.clear();
+  FinishRehash();
+}
+
+bool DenseSet::ClearStep(size_t count) {
+  for (auto* table : {&old_entries_, &entries_}) {
+    for (; count > 0 && !table->empty(); --count) {
+      auto it = std::prev(table->end());
+      while (!it->IsEmpty()) {
+        bool has_ttl = it->HasTtl();
+        void* obj = PopDataFront(it);
+        ObjDelete(obj, has_ttl);
+      }
+      table->pop_back();
+    }
+  }
+
+  if (!entries_.empty() || !old_entries_.empty())
+    return false;
+
+  FinishRehash();
+  size_ = 0;
+  num_used_buckets_ = 0;
+  num_chain_entries_ = 0;
+  obj_malloc_used_ = 0;
+  return true;
 }
 
 bool DenseSet::Equal(DensePtr dptr, const void* ptr, uint32_t cookie) const {
@@ -172,15 +238,15 @@ bool DenseSet::Equal(DensePtr dptr, const void* ptr, uint32_t cookie) const {
   return ObjEqual(dptr.GetObject(), ptr, cookie);
 }
 
-bool DenseSet::NoItemBelongsBucket(uint32_t bid) const {
-  auto& entries = const_cast<DenseSet*>(this)->entries_;
+bool DenseSet::NoItemBelongsBucket(const Table& table, uint32_t bid) const {
+  auto& entries = const_cast<Table&>(table);
   DensePtr* curr = &entries[bid];
   ExpireIfNeeded(nullptr, curr);
   if (!curr->IsEmpty() && !curr->IsDisplaced()) {
     return false;
   }
 
-  if (bid + 1 < entries_.size()) {
+  if (bid + 1 < entries.size()) {
     DensePtr* right_bucket = &entries[bid + 1];
     ExpireIfNeeded(nullptr, right_bucket);
     if (!right_bucket->IsEmpty() && right_bucket->IsDisplaced() &&
@@ -235,80 +301,53 @@ void DenseSet::Reserve(size_t sz) {
 }
 
 void DenseSet::Grow() {
+  DCHECK(!IsRehashing());
+
   size_t prev_size = entries_.size();
+  old_entries_.swap(entries_);
   entries_.resize(prev_size * 2);
   ++capacity_log_;
+  rehash_pos_ = 0;
 
-  // perform rehashing of items in the set
-  for (long i = prev_size - 1; i >= 0; --i) {
-    DensePtr* curr = &entries_[i];
-    DensePtr* prev = nullptr;
-
-    while (true) {
-      if (ExpireIfNeeded(prev, curr)) {
-        // if curr has disappeared due to expiry and prev was converted from Link to a
-        // regular DensePtr
-        if (prev && !prev->IsLink())
-          break;
-      }
+  // Rehashing a large table at once would stall the thread, so it is migrated gradually
+  // by the following mutations, see RehashStep.
+  if (prev_size < kMinIncrementalRehash) {
+    RehashStep(prev_size);
+  }
+}
 
-      if (curr->IsEmpty())
-        break;
-      void* ptr = curr->GetObject();
+void DenseSet::RehashStep(size_t count) {
+  DCHECK(IsRehashing());
 
-      DCHECK(ptr != nullptr && ObjectAllocSize(ptr));
+  for (; count > 0 && rehash_pos_ < old_entries_.size(); --count, ++rehash_pos_) {
+    ChainVectorIterator it = old_entries_.begin() + rehash_pos_;
 
-      uint32_t bid = BucketId(ptr, 0);
+    while (true) {
+      ExpireIfNeeded(nullptr, &(*it));
+      if (it->IsEmpty())
+        break;
 
-      // if the item does not move from the current chain, ensure
-      // it is not marked as displaced and move to the next item in the chain
-      if (bid == i) {
-        curr->ClearDisplaced();
-        prev = curr;
-        curr = curr->Next();
-        if (curr == nullptr)
-          break;
+      if (it->IsLink()) {
+        --num_chain_entries_;
       } else {
-        // if the entry is in the wrong chain remove it and
-        // add it to the correct chain. This will also correct
-        // displaced entries
-        auto dest = entries_.begin() + bid;
-        DensePtr dptr = *curr;
-
-        if (curr->IsObject()) {
-          curr->Reset();  // reset the original placeholder (.next or root)
-
-          if (prev) {
-            DCHECK(prev->IsLink());
-
-            DenseLinkKey* plink = prev->AsLink();
-            DCHECK(&plink->next == curr);
-
-            // we want to make *prev a DensePtr instead of DenseLink and we
-            // want to deallocate the link.
-            DensePtr tmp = DensePtr::From(plink);
-            DCHECK(ObjectAllocSize(tmp.GetObject()));
-
-            FreeLink(plink);
-            *prev = tmp;
-          }
-
-          DVLOG(2) << " Pushing to " << bid << " " << dptr.GetObject();
-          PushFront(dest, dptr);
-
-          dest->ClearDisplaced();
-
-          break;
-        }  // if IsObject
-
-        *curr = *dptr.Next();
-        DCHECK(!curr->IsEmpty());
-
-        PushFront(dest, dptr);
-        dest->ClearDisplaced();
+        --num_used_buckets_;
       }
+
+      bool has_ttl = it->HasTtl();
+      void* obj = PopDataFront(it);
+      InsertUnique(obj, has_ttl, Hash(obj, 0));
     }
   }
+
+  if (rehash_pos_ == old_entries_.size()) {
+    FinishRehash();
+  }
+}
+
+void DenseSet::FinishRehash() {
+  old_entries_.clear();
+  old_entries_.shrink_to_fit();
+  rehash_pos_ = 0;
 }
 
 bool DenseSet::AddInternal(void* ptr, bool has_ttl) {
@@ -317,21 +356,27 @@ bool DenseSet::AddInternal(void* ptr, bool has_ttl) {
   if (entries_.empty()) {
     capacity_log_ = kMinSizeShift;
     entries_.resize(kMinSize);
-    uint32_t bucket_id = BucketId(hc);
-    auto e = entries_.begin() + bucket_id;
-    obj_malloc_used_ += PushFront(e, ptr, has_ttl);
-    ++size_;
-    ++num_used_buckets_;
-
-    return true;
+  } else if (Find(ptr, BucketId(hc), 0).second != nullptr) {
+    // if the value is already in the set exit early
+    return false;
   }
 
-  // if the value is already in the set exit early
-  uint32_t bucket_id = BucketId(hc);
-  if (Find(ptr, bucket_id, 0).second != nullptr) {
-    return false;
+  if (IsRehashing()) {
+    // The table must not grow again before the migration completes, which is guaranteed
+    // by kRehashBatch unless items were deleted in the meantime. In that case we finish it now.
+    RehashStep(size_ + 1 < entries_.size() ? kRehashBatch : old_entries_.size());
   }
 
+  InsertUnique(ptr, has_ttl, hc);
+  obj_malloc_used_ += ObjectAllocSize(ptr);
+  ++size_;
+  expiration_used_ |= has_ttl;
+
+  return true;
+}
+
+void DenseSet::InsertUnique(void* ptr, bool has_ttl, uint64_t hc) {
+  uint32_t bucket_id = BucketId(hc);
   DCHECK_LT(bucket_id, entries_.size());
 
   // Try insert into flat surface first. Also handle the grow case
@@ -339,13 +384,12 @@ bool DenseSet::AddInternal(void* ptr, bool has_ttl) {
   for (unsigned j = 0; j < 2; ++j) {
     ChainVectorIterator list = FindEmptyAround(bucket_id);
     if (list != entries_.end()) {
-      obj_malloc_used_ += PushFront(list, ptr, has_ttl);
+      PushFront(list, ptr, has_ttl);
       if (std::distance(entries_.begin(), list) != bucket_id) {
         list->SetDisplaced(std::distance(entries_.begin() + bucket_id, list));
       }
       ++num_used_buckets_;
-      ++size_;
-      return true;
+      return;
     }
 
     if (size_ < entries_.size()) {
@@ -386,23 +430,32 @@ bool DenseSet::AddInternal(void* ptr, bool has_ttl) {
 
   ChainVectorIterator list = entries_.begin() + bucket_id;
   PushFront(list, to_insert);
-  obj_malloc_used_ += ObjectAllocSize(ptr);
   DCHECK(!entries_[bucket_id].IsDisplaced());
-
-  ++size_;
-  return true;
 }
 
 auto DenseSet::Find(const void* ptr, uint32_t bid, uint32_t cookie) -> pair<DensePtr*, DensePtr*> {
+  // The item may still reside in the previous table, around the bucket that bid was split from,
+  // unless that bucket and both its neighbours were already migrated.
+  if (IsRehashing() && (bid >> 1) + 1 >= rehash_pos_) {
+    auto res = FindInTable(&old_entries_, ptr, bid >> 1, cookie);
+    if (res.second)
+      return res;
+  }
+
+  return FindInTable(&entries_, ptr, bid, cookie);
+}
+
+auto DenseSet::FindInTable(Table* table, const void* ptr, uint32_t bid, uint32_t cookie)
+    -> pair<DensePtr*, DensePtr*> {
   // could do it with zigzag decoding but this is clearer.
   int offset[] = {0, -1, 1};
 
   // first look for displaced nodes since this is quicker than iterating a potential long chain
   for (int j = 0; j < 3; ++j) {
-    if ((bid == 0 && j == 1) || (bid + 1 == entries_.size() && j == 2))
+    if ((bid == 0 && j == 1) || (bid + 1 == table->size() && j == 2))
       continue;
 
-    DensePtr* curr = &entries_[bid + offset[j]];
+    DensePtr* curr = &(*table)[bid + offset[j]];
 
     ExpireIfNeeded(nullptr, curr);
     if (Equal(*curr, ptr, cookie)) {
@@ -411,7 +464,7 @@ auto DenseSet::Find(const void* ptr, uint32_t bid, uint32_t cookie) -> pair<Dens
   }
 
   // if the node is not displaced, search the correct chain
-  DensePtr* prev = &entries_[bid];
+  DensePtr* prev = &(*table)[bid];
   DensePtr* curr = prev->Next();
   while (curr != nullptr) {
     ExpireIfNeeded(prev, curr);
@@ -427,6 +480,74 @@ auto DenseSet::Find(const void* ptr, uint32_t bid, uint32_t cookie) -> pair<Dens
   return make_pair(nullptr, nullptr);
 }
 
+void* DenseSet::FindInternal(const void* obj, uint32_t cookie) const {
+  if (entries_.empty())
+    return nullptr;
+
+  DensePtr* ptr = const_cast<DenseSet*>(this)->Find(obj, BucketId(obj, cookie), cookie).second;
+  return ptr ? ptr->GetObject() : nullptr;
+}
+
+void DenseSet::ContainsBatchInternal(const void* const* objs, uint32_t cookie, unsigned count,
+                                     bool* res) const {
+  if (entries_.empty()) {
+    fill(res, res + count, false);
+    return;
+  }
+
+  constexpr unsigned kBatch = 16;
+  uint32_t bids[kBatch];
+  DenseSet* me = const_cast<DenseSet*>(this);
+
+  for (unsigned start = 0; start < count; start += kBatch) {
+    unsigned len = min(kBatch, count - start);
+
+    for (unsigned i = 0; i < len; ++i) {
+      bids[i] = BucketId(objs[start + i], cookie);
+      __builtin_prefetch(&entries_[bids[i]], 0, 1);
+    }
+
+    // The buckets are likely in cache by now, so prefetch the objects or links they point to,
+    // which is what the comparisons below dereference.
+    for (unsigned i = 0; i < len; ++i) {
+      const DensePtr& dptr = entries_[bids[i]];
+      if (!dptr.IsEmpty())
+        __builtin_prefetch(dptr.Raw(), 0, 1);
+    }
+
+    for (unsigned i = 0; i < len; ++i) {
+      res[start + i] = me->Find(objs[start + i], bids[i], cookie).second != nullptr;
+    }
+  }
+}
+
+void* DenseSet::ReplaceInternal(void* new_obj, bool has_ttl) {
+  if (entries_.empty())
+    return nullptr;
+
+  DensePtr* ptr = Find(new_obj, BucketId(new_obj, 0), 0).second;
+  if (!ptr)
+    return nullptr;
+
+  // ptr can be a link, in which case the object is stored inside it.
+  DensePtr* obj_ptr = ptr->IsLink() ? ptr->AsLink() : ptr;
+  void* prev = obj_ptr->Raw();
+  obj_ptr->SetObject(new_obj);
+
+  // The ttl bit of an object is kept by the pointer that leads to it.
+  if (has_ttl) {
+    ptr->SetTtl();
+    expiration_used_ = true;
+  } else {
+    ptr->ClearTtl();
+  }
+
+  obj_malloc_used_ += ObjectAllocSize(new_obj);
+  obj_malloc_used_ -= ObjectAllocSize(prev);
+
+  return prev;
+}
+
 void DenseSet::Delete(DensePtr* prev, DensePtr* ptr) {
   void* obj = nullptr;
 
@@ -443,6 +564,10 @@ void DenseSet::Delete(DensePtr* prev, DensePtr* ptr) {
       DensePtr tmp = DensePtr::From(plink);
       DCHECK(ObjectAllocSize(tmp.GetObject()));
 
+      // The ttl bit of the remaining object is kept by the link pointer.
+      if (prev->HasTtl())
+        tmp.SetTtl();
+
       FreeLink(plink);
       *prev = tmp;
       DCHECK(!prev->IsLink());
@@ -463,16 +588,95 @@ void DenseSet::Delete(DensePtr* prev, DensePtr* ptr) {
 }
 
 void* DenseSet::PopInternal() {
-  std::pmr::vector<DenseSet::DensePtr>::iterator bucket_iter = entries_.begin();
+  if (IsRehashing()) {
+    RehashStep(kRehashBatch);
+
+    // Entries that were not migrated yet are popped first.
+    if (IsRehashing()) {
+      if (void* res = PopFromTable(&old_entries_))
+        return res;
+    }
+  }
+
+  return PopFromTable(&entries_);
+}
+
+void* DenseSet::RandomInternal(uint64_t seed) const {
+  if (size_ == 0)
+    return nullptr;
+
+  size_t num_buckets = entries_.size() + old_entries_.size();
+  for (unsigned i = 0; i < kRandomProbes; ++i) {
+    uint64_t rnd = SplitMix64(&seed);
+    const DensePtr* ptr = BucketAt(rnd % num_buckets);
+
+    unsigned len = 0;
+    for (const DensePtr* curr = ptr; curr && !curr->IsEmpty(); curr = curr->Next())
+      ++len;
+    if ((rnd >> 32) % kChainWeight >= len)
+      continue;
+
+    for (unsigned pos = SplitMix64(&seed) % len; pos > 0; --pos)
+      ptr = ptr->Next();
+    if (!IsExpired(*ptr))
+      return ptr->GetObject();
+  }
+
+  size_t start = SplitMix64(&seed) % num_buckets;
+  for (size_t i = 0; i < num_buckets; ++i) {
+    for (const DensePtr* ptr = BucketAt((start + i) % num_buckets); ptr && !ptr->IsEmpty();
+         ptr = ptr->Next()) {
+      if (!IsExpired(*ptr))
+        return ptr->GetObject();
+    }
+  }
+
+  return nullptr;
+}
+
+void DenseSet::SampleInternal(uint64_t seed, size_t count, const ItemCb& cb) const {
+  if (count == 0 || size_ == 0)
+    return;
+
+  if (count <= size_ / kDrawFraction) {
+    absl::flat_hash_set<const void*> sampled;
+    sampled.reserve(count);
+
+    // The duplicates are rare, the limit only guards against sets of mostly expired objects.
+    for (size_t i = 0; i < count * 2 + kRandomProbes && sampled.size() < count; ++i) {
+      const void* obj = RandomInternal(SplitMix64(&seed));
+      if (!obj)
+        return;
+      if (sampled.insert(obj).second)
+        cb(obj);
+    }
+    return;
+  }
+
+  size_t num_buckets = entries_.size() + old_entries_.size();
+  size_t start = SplitMix64(&seed) % num_buckets;
+  for (size_t i = 0; i < num_buckets && count > 0; ++i) {
+    for (const DensePtr* ptr = BucketAt((start + i) % num_buckets);
+         ptr && !ptr->IsEmpty() && count > 0; ptr = ptr->Next()) {
+      if (!IsExpired(*ptr)) {
+        cb(ptr->GetObject());
+        --count;
+      }
+    }
+  }
+}
+
+void* DenseSet::PopFromTable(Table* table) {
+  ChainVectorIterator bucket_iter = table->begin();
 
   // find the first non-empty chain
   do {
-    while (bucket_iter != entries_.end() && bucket_iter->IsEmpty()) {
+    while (bucket_iter != table->end() && bucket_iter->IsEmpty()) {
       ++bucket_iter;
     }
 
-    // empty set
-    if (bucket_iter == entries_.end()) {
+    // empty table
+    if (bucket_iter == table->end()) {
       return nullptr;
     }
 
@@ -517,20 +721,71 @@ uint32_t DenseSet::Scan(uint32_t cursor, const ItemCb& cb) const {
 
   uint32_t entries_idx = cursor >> (32 - capacity_log_);
 
+  // First find the bucket to scan, skip empty buckets.
+  while (entries_idx < entries_.size() && !ScanEntry(entries_idx, cb)) {
+    ++entries_idx;
+  }
+
+  // move to the next index for the next scan and check if we are done
+  ++entries_idx;
+  if (entries_idx >= entries_.size()) {
+    return 0;
+  }
+
+  return entries_idx << (32 - capacity_log_);
+}
+
+uint32_t DenseSet::Scan(uint32_t cursor, size_t count, const ItemCb& cb) const {
+  if (capacity_log_ == 0) {
+    return 0;
+  }
+
+  size_t items = 0;
+  ItemCb counting_cb = [&](const void* obj) {
+    ++items;
+    cb(obj);
+  };
+
+  uint32_t entries_idx = cursor >> (32 - capacity_log_);
+  size_t max_buckets = count * kScanEmptyFactor;
+  for (size_t visited = 0; entries_idx < entries_.size() && items < count && visited < max_buckets;
+       ++visited) {
+    ScanEntry(entries_idx++, counting_cb);
+  }
+
+  if (entries_idx >= entries_.size()) {
+    return 0;
+  }
+
+  return entries_idx << (32 - capacity_log_);
+}
+
+bool DenseSet::ScanEntry(uint32_t idx, const ItemCb& cb) const {
   auto& entries = const_cast<DenseSet*>(this)->entries_;
+  auto& old_entries = const_cast<DenseSet*>(this)->old_entries_;
+
+  // During rehashing, the entries that were not migrated yet from the previous table bucket i
+  // belong to buckets 2i and 2i+1. We report them together with bucket 2i. This preserves the
+  // guarantees above since they can only move to buckets 2i or 2i+1.
+  bool scan_old = IsRehashing() && (idx & 1) == 0 && !NoItemBelongsBucket(old_entries, idx >> 1);
 
-  // First find the bucket to scan, skip empty buckets.
   // A bucket is empty if the current index is empty and the data is not displaced
   // to the right or to the left.
-  while (entries_idx < entries_.size() && NoItemBelongsBucket(entries_idx)) {
-    ++entries_idx;
+  if (NoItemBelongsBucket(entries, idx) && !scan_old) {
+    return false;
   }
 
-  if (entries_idx == entries_.size()) {
-    return 0;
+  ScanBucket(&entries, idx, cb);
+  if (scan_old) {
+    ScanBucket(&old_entries, idx >> 1, cb);
   }
+  return true;
+}
 
-  DensePtr* curr = &entries[entries_idx];
+void DenseSet::ScanBucket(Table* table, uint32_t bid, const ItemCb& cb) const {
+  auto& entries = *table;
+  DensePtr* curr = &entries[bid];
+  ExpireIfNeeded(nullptr, curr);
 
   // Check home bucket
   if (!curr->IsEmpty() && !curr->IsDisplaced()) {
@@ -550,8 +805,8 @@ uint32_t DenseSet::Scan(uint32_t cursor, const ItemCb& cb) const {
   }
 
   // Check if the bucket on the left belongs to the home bucket.
-  if (entries_idx > 0) {
-    DensePtr* left_bucket = &entries[entries_idx - 1];
+  if (bid > 0) {
+    DensePtr* left_bucket = &entries[bid - 1];
     ExpireIfNeeded(nullptr, left_bucket);
 
     if (left_bucket->IsDisplaced() &&
@@ -560,22 +815,87 @@ uint32_t DenseSet::Scan(uint32_t cursor, const ItemCb& cb) const {
     }
   }
 
-  // move to the next index for the next scan and check if we are done
-  ++entries_idx;
-  if (entries_idx >= entries_.size()) {
-    return 0;
+  // Check if the bucket on the right belongs to the home bucket.
+  if (bid + 1 < entries.size()) {
+    DensePtr* right_bucket = &entries[bid + 1];
+    ExpireIfNeeded(nullptr, right_bucket);
+
+    if (right_bucket->IsDisplaced() &&
+        right_bucket->GetDisplacedDirection() == 1) {  // right of the home bucket
+      cb(right_bucket->GetObject());
+    }
   }
+}
 
-  // Check if the bucket on the right belongs to the home bucket.
-  DensePtr* right_bucket = &entries[entries_idx];
-  ExpireIfNeeded(nullptr, right_bucket);
+size_t DenseSet::Defrag(float ratio) {
+  size_t moved = 0;
+
+  for (Table* table : {&old_entries_, &entries_}) {
+    if (table->empty())
+      continue;
+
+    if (zmalloc_page_is_underutilized(table->data(), ratio)) {
+      Table tmp(table->begin(), table->end(), table->get_allocator());
+      table->swap(tmp);
+      moved += table->size() * sizeof(DensePtr);
+    }
+
+    for (DensePtr& bucket : *table) {
+      DensePtr* curr = &bucket;
+
+      while (!curr->IsEmpty()) {
+        if (curr->IsObject()) {
+          if (void* new_obj = DefragObject(curr->Raw(), ratio, &moved)) {
+            curr->SetObject(new_obj);  // preserves the tags.
+          }
+          break;
+        }
+
+        DenseLinkKey* link = curr->AsLink();
+        if (zmalloc_page_is_underutilized(link, ratio)) {
+          DenseLinkKey* new_link = NewLink(link->Raw(), link->next);
+          *new_link = *link;
+          FreeLink(link);
+          link = new_link;
+          curr->SetObject(link);  // replaces the link address, preserving the tags.
+          moved += sizeof(DenseLinkKey);
+        }
+
+        if (void* new_obj = DefragObject(link->Raw(), ratio, &moved)) {
+          link->SetObject(new_obj);
+        }
+
+        curr = &link->next;
+      }
+    }
+  }
 
-  if (right_bucket->IsDisplaced() &&
-      right_bucket->GetDisplacedDirection() == 1) {  // right of the home bucket
-    cb(right_bucket->GetObject());
+  return moved;
+}
+
+void* DenseSet::DefragObject(void* obj, float ratio, size_t* moved) {
+  size_t old_size = ObjectAllocSize(obj);
+  void* new_obj = ObjDefrag(obj, ratio);
+  if (new_obj) {
+    size_t new_size = ObjectAllocSize(new_obj);
+    obj_malloc_used_ += new_size;
+    obj_malloc_used_ -= old_size;
+    *moved += new_size;
   }
+  return new_obj;
+}
 
-  return entries_idx << (32 - capacity_log_);
+void* DenseSet::DefragSds(void* obj, float ratio) {
+  void* alloc_ptr = sdsAllocPtr((sds)obj);
+  if (!zmalloc_page_is_underutilized(alloc_ptr, ratio))
+    return nullptr;
+
+  size_t size = zmalloc_usable_size(alloc_ptr);
+  char* new_ptr = (char*)zmalloc(size);
+  memcpy(new_ptr, alloc_ptr, size);
+  zfree(alloc_ptr);
+
+  return new_ptr + ((char*)obj - (char*)alloc_ptr);
 }
 
 auto DenseSet::NewLink(void* data, DensePtr next) -> DenseLinkKey* {
@@ -111,6 +111,10 @@ class DenseSet {
       ptr_ = (void*)(uptr() | kTtlBit);
     }
 
+    void ClearTtl() {
+      ptr_ = (void*)(uptr() & ~kTtlBit);
+    }
+
     void Reset() {
       ptr_ = nullptr;
     }
@@ -164,6 +168,7 @@ class DenseSet {
   static_assert(sizeof(DenseLinkKey) == 2 * sizeof(uintptr_t));
 
   using LinkAllocator = std::pmr::polymorphic_allocator<DenseLinkKey>;
+  using Table = std::pmr::vector<DensePtr>;
   using ChainVectorIterator = std::pmr::vector<DensePtr>::iterator;
   using ChainVectorConstIterator = std::pmr::vector<DensePtr>::const_iterator;
 
@@ -208,7 +213,7 @@ class DenseSet {
   }
 
   size_t SetMallocUsed() const {
-    return (num_chain_entries_ + entries_.capacity()) * sizeof(DensePtr);
+    return (num_chain_entries_ + entries_.capacity() + old_entries_.capacity()) * sizeof(DensePtr);
   }
 
   template <typename T> class iterator : private IteratorBase {
@@ -298,8 +303,26 @@ class DenseSet {
   using ItemCb = std::function<void(const void*)>;
 
   uint32_t Scan(uint32_t cursor, const ItemCb& cb) const;
+
+  // Like Scan, but goes on to the following buckets until it reports at least count items or
+  // visits kScanEmptyFactor * count buckets, so that the work of a call is bounded however
+  // sparse the table is.
+  uint32_t Scan(uint32_t cursor, size_t count, const ItemCb& cb) const;
+
+  static constexpr size_t kScanEmptyFactor = 10;
+
   void Reserve(size_t sz);
 
+  // Moves the bucket array, the links and the objects that reside on memory pages whose
+  // utilization is below ratio. Objects are moved only if the derived class supports it,
+  // see ObjDefrag. Returns the number of bytes that were moved.
+  size_t Defrag(float ratio);
+
+  // Deletes the objects of up to count buckets and drops these buckets, so that a large set is
+  // freed in steps. Returns true once the set is empty. The set must not be used for anything
+  // else until then.
+  bool ClearStep(size_t count);
+
   // set an abstract time that allows expiry.
   void set_time(uint32_t val) {
     time_now_ = val;
@@ -309,6 +332,12 @@ class DenseSet {
     return time_now_;
   }
 
+  // Whether an object with an expiry was ever added. Otherwise Size() is exact, since no object
+  // expires while the set is read.
+  bool ExpirationUsed() const {
+    return expiration_used_;
+  }
+
  protected:
   // Virtual functions to be implemented for generic data
   virtual uint64_t Hash(const void* obj, uint32_t cookie) const = 0;
@@ -317,7 +346,21 @@ class DenseSet {
   virtual uint32_t ObjExpireTime(const void* obj) const = 0;
   virtual void ObjDelete(void* obj, bool has_ttl) const = 0;
 
+  // Returns the reallocated copy of obj if it should move due to low page utilization,
+  // or nullptr if it stays. The default implementation never moves objects, which is required
+  // when they are referenced from outside of the set.
+  virtual void* ObjDefrag(void* obj, float ratio) const {
+    return nullptr;
+  }
+
+  // ObjDefrag implementation for objects that are single zmalloc allocations holding an sds,
+  // possibly followed by a trailer. Copies the whole allocation.
+  static void* DefragSds(void* obj, float ratio);
+
   bool EraseInternal(void* obj, uint32_t cookie) {
+    if (IsRehashing())
+      RehashStep(1);
+
     auto [prev, found] = Find(obj, BucketId(obj, cookie), cookie);
     if (found) {
       Delete(prev, found);
@@ -334,6 +377,33 @@ class DenseSet {
 
   void* PopInternal();
 
+  // Returns a random object, or nullptr if the set has none that is not expired. seed is the
+  // randomness of the call. Random buckets of both tables are probed and a chain is taken with
+  // a probability proportional to its length, so that every object is equally likely unless
+  // its chain is longer than kChainWeight. Falls back to the first object after a random
+  // bucket if the set is too sparse for the probes to hit an object.
+  void* RandomInternal(uint64_t seed) const;
+
+  // Calls cb for count distinct random objects, or for all the objects if there are fewer.
+  // A small sample is drawn by RandomInternal, a large one is taken from the consecutive
+  // buckets after a random one. Either way its cost is proportional to count rather than to
+  // the size of the set. Expired objects are skipped and not deleted.
+  void SampleInternal(uint64_t seed, size_t count, const ItemCb& cb) const;
+
+  // Returns the object equal to obj or nullptr if there is none.
+  void* FindInternal(const void* obj, uint32_t cookie) const;
+
+  // Checks the membership of objs[0..count) and sets res[i] accordingly.
+  // All the objects are hashed and their buckets prefetched before any of them is probed,
+  // so that the cache misses of independent lookups overlap instead of being serialized.
+  void ContainsBatchInternal(const void* const* objs, uint32_t cookie, unsigned count,
+                             bool* res) const;
+
+  // Replaces the object equal to new_obj with new_obj, keeping its position in the set, and sets
+  // whether it has a ttl. Returns the replaced object that should be released by the caller or
+  // nullptr, in which case new_obj was not added.
+  void* ReplaceInternal(void* new_obj, bool has_ttl);
+
   // Note this does not free any dynamic allocations done by derived classes, that a DensePtr
   // in the set may point to. This function only frees the allocated DenseLinkKeys created by
   // DenseSet. All data allocated by a derived class should be freed before calling this
@@ -361,9 +431,42 @@ class DenseSet {
   ChainVectorIterator FindEmptyAround(uint32_t bid);
   // return if bucket has no item which is not displaced and right/left bucket has no displaced item
   // belong to given bid
-  bool NoItemBelongsBucket(uint32_t bid) const;
+  bool NoItemBelongsBucket(const Table& table, uint32_t bid) const;
+
+  // Calls cb for every item of table whose home bucket is bid.
+  void ScanBucket(Table* table, uint32_t bid, const ItemCb& cb) const;
+
+  // Reports the items of bucket idx of entries_ and, while rehashing, those of old_entries_ that
+  // will move into it. Returns false if there are none.
+  bool ScanEntry(uint32_t idx, const ItemCb& cb) const;
+
+  // Doubles the bucket array. The items are migrated from old_entries_ incrementally,
+  // a few buckets per mutation, unless the table is small.
   void Grow();
 
+  bool IsRehashing() const {
+    return !old_entries_.empty();
+  }
+
+  // Migrates up to count buckets of old_entries_ into entries_.
+  void RehashStep(size_t count);
+  void FinishRehash();
+
+  // Inserts ptr into entries_, assuming it is not in the set. Does not update size_ and
+  // obj_malloc_used_.
+  void InsertUnique(void* ptr, bool has_ttl, uint64_t hc);
+
+  void* PopFromTable(Table* table);
+
+  // The bucket i of the concatenation of entries_ and old_entries_.
+  const DensePtr* BucketAt(size_t i) const {
+    return i < entries_.size() ? &entries_[i] : &old_entries_[i - entries_.size()];
+  }
+
+  bool IsExpired(const DensePtr& ptr) const {
+    return ptr.HasTtl() && ObjExpireTime(ptr.GetObject()) <= time_now_;
+  }
+
   // ============ Pseudo Linked List Functions for interacting with Chains ==================
   size_t PushFront(ChainVectorIterator, void* obj, bool has_ttl);
   void PushFront(ChainVectorIterator, DensePtr);
@@ -374,10 +477,16 @@ class DenseSet {
   // ============ Pseudo Linked List in DenseSet end ==================
 
   // returns (prev, item) pair. If item is root, then prev is null.
+  // bid is the bucket id in entries_. During rehashing, looks also in old_entries_.
   std::pair<DensePtr*, DensePtr*> Find(const void* ptr, uint32_t bid, uint32_t cookie);
+  std::pair<DensePtr*, DensePtr*> FindInTable(Table* table, const void* ptr, uint32_t bid,
+                                              uint32_t cookie);
 
   DenseLinkKey* NewLink(void* data, DensePtr next);
 
+  // Relocates obj via ObjDefrag and updates the accounting. Returns the new address or nullptr.
+  void* DefragObject(void* obj, float ratio, size_t* moved);
+
   inline void FreeLink(DenseLinkKey* plink) {
     // deallocate the link if it is no longer a link as it is now in an empty list
     mr()->deallocate(plink, sizeof(DenseLinkKey), alignof(DenseLinkKey));
@@ -392,13 +501,19 @@ class DenseSet {
 
   std::pmr::vector<DensePtr> entries_;
 
+  // The previous bucket array while it is being migrated into entries_. Buckets below
+  // rehash_pos_ were already migrated and are empty.
+  std::pmr::vector<DensePtr> old_entries_;
+
   mutable size_t obj_malloc_used_ = 0;
   mutable uint32_t size_ = 0;
   mutable uint32_t num_chain_entries_ = 0;
   mutable uint32_t num_used_buckets_ = 0;
   unsigned capacity_log_ = 0;
+  uint32_t rehash_pos_ = 0;
 
   uint32_t time_now_ = 0;
+  bool expiration_used_ = false;
 };
 
 }  // namespace dfly
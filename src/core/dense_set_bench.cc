@@ -0,0 +1,207 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include <benchmark/benchmark.h>
+#include <mimalloc.h>
+
+#include <absl/strings/str_cat.h>
+
+#include <random>
+
+#include "base/init.h"
+#include "base/logging.h"
+#include "core/mi_memory_resource.h"
+#include "core/string_set.h"
+
+extern "C" {
+#include "redis/zmalloc.h"
+}
+
+// Runs google benchmarks for DenseSet via StringSet. For example:
+//   ./dense_set_bench --benchmark_filter=BM_Add --benchmark_counters_tabular=true
+// Use --benchmark_format=json or --benchmark_out=<file> to get results that can be diffed.
+// The members and the buckets are allocated from the backing mimalloc heap, from whose areas
+// "heap_blocks_per_entry" is computed. "bytes_per_entry" is the accounting of the set itself.
+
+using namespace std;
+
+namespace dfly {
+
+namespace {
+
+// Members like the ids and tags that SADD usually gets, with some variance in length.
+vector<string> MakeMembers(size_t num, size_t len) {
+  mt19937_64 gen(42);
+  vector<string> res(num);
+  for (size_t i = 0; i < num; ++i) {
+    res[i] = absl::StrCat("member:", i, ":");
+    size_t target = len / 2 + gen() % (len + 1);
+    while (res[i].size() < target)
+      res[i].push_back('a' + gen() % 26);
+  }
+  return res;
+}
+
+size_t HeapBlocks() {
+  size_t res = 0;
+  auto cb = [](const mi_heap_t* heap, const mi_heap_area_t* area, void* block, size_t block_size,
+               void* arg) {
+    *reinterpret_cast<size_t*>(arg) += area->used;
+    return true;
+  };
+  mi_heap_visit_blocks(mi_heap_get_backing(), false, cb, &res);
+  return res;
+}
+
+void FillSet(const vector<string>& members, StringSet* ss) {
+  for (const auto& m : members)
+    ss->Add(m);
+}
+
+void SetMemoryCounters(const StringSet& ss, size_t blocks_before, benchmark::State* state) {
+  size_t bytes = ss.ObjMallocUsed() + ss.SetMallocUsed();
+  state->counters["bytes_per_entry"] = double(bytes) / ss.Size();
+  state->counters["heap_blocks_per_entry"] = double(HeapBlocks() - blocks_before) / ss.Size();
+}
+
+}  // namespace
+
+/*
+  Args: {number of members, average member length}.
+*/
+
+static void BM_Add(benchmark::State& state) {
+  vector<string> members = MakeMembers(state.range(0), state.range(1));
+  size_t blocks_before = HeapBlocks();
+
+  for (auto _ : state) {
+    StringSet ss;
+    FillSet(members, &ss);
+
+    state.PauseTiming();
+    SetMemoryCounters(ss, blocks_before, &state);
+    ss.Clear();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * members.size());
+}
+BENCHMARK(BM_Add)->ArgsProduct({{1 << 10, 1 << 20}, {8, 32}})->Unit(benchmark::kMillisecond);
+
+// Members with expiry, as SADDEX adds them, take an additional word each.
+static void BM_AddWithTtl(benchmark::State& state) {
+  vector<string> members = MakeMembers(state.range(0), state.range(1));
+  size_t blocks_before = HeapBlocks();
+
+  for (auto _ : state) {
+    StringSet ss;
+    for (const auto& m : members)
+      ss.Add(m, 3600);
+
+    state.PauseTiming();
+    SetMemoryCounters(ss, blocks_before, &state);
+    ss.Clear();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * members.size());
+}
+BENCHMARK(BM_AddWithTtl)->ArgsProduct({{1 << 20}, {8, 32}})->Unit(benchmark::kMillisecond);
+
+// Half of the lookups miss in order to exercise the chains of the buckets.
+static void BM_Contains(benchmark::State& state) {
+  vector<string> members = MakeMembers(state.range(0), state.range(1));
+  vector<string> probes = MakeMembers(state.range(0) * 2, state.range(1));
+  StringSet ss;
+  FillSet(members, &ss);
+
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ss.Contains(probes[i++ % probes.size()]));
+  }
+}
+BENCHMARK(BM_Contains)->ArgsProduct({{1 << 10, 1 << 20}, {8, 32}});
+
+// SMISMEMBER prefetches the buckets of a batch before comparing the members.
+static void BM_ContainsBatch(benchmark::State& state) {
+  constexpr unsigned kBatch = 16;
+  vector<string> members = MakeMembers(state.range(0), state.range(1));
+  StringSet ss;
+  FillSet(members, &ss);
+
+  vector<string> probes = MakeMembers(state.range(0) * 2, state.range(1));
+  vector<string_view> views(probes.begin(), probes.end());
+  bool res[kBatch];
+
+  size_t i = 0;
+  for (auto _ : state) {
+    ss.ContainsBatch(views.data() + i, kBatch, res);
+    benchmark::DoNotOptimize(res);
+    i = (i + kBatch) % (views.size() - kBatch);
+  }
+  state.SetItemsProcessed(state.iterations() * kBatch);
+}
+BENCHMARK(BM_ContainsBatch)->ArgsProduct({{1 << 10, 1 << 20}, {8, 32}});
+
+static void BM_Erase(benchmark::State& state) {
+  vector<string> members = MakeMembers(state.range(0), state.range(1));
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    StringSet ss;
+    FillSet(members, &ss);
+    state.ResumeTiming();
+
+    for (const auto& m : members)
+      ss.Erase(m);
+  }
+  state.SetItemsProcessed(state.iterations() * members.size());
+}
+BENCHMARK(BM_Erase)->ArgsProduct({{1 << 10, 1 << 20}, {8}})->Unit(benchmark::kMillisecond);
+
+// Random member as SRANDMEMBER without count returns it.
+static void BM_Random(benchmark::State& state) {
+  vector<string> members = MakeMembers(state.range(0), state.range(1));
+  StringSet ss;
+  FillSet(members, &ss);
+
+  uint64_t seed = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ss.Random(seed++));
+  }
+}
+BENCHMARK(BM_Random)->ArgsProduct({{1 << 10, 1 << 20}, {8}});
+
+// Full traversal, as done by SMEMBERS and SSCAN.
+static void BM_Iterate(benchmark::State& state) {
+  vector<string> members = MakeMembers(state.range(0), state.range(1));
+  StringSet ss;
+  FillSet(members, &ss);
+
+  for (auto _ : state) {
+    size_t len = 0;
+    for (sds s : ss)
+      len += sdslen(s);
+    benchmark::DoNotOptimize(len);
+  }
+  state.SetItemsProcessed(state.iterations() * members.size());
+}
+BENCHMARK(BM_Iterate)->ArgsProduct({{1 << 10, 1 << 20}, {8}});
+
+}  // namespace dfly
+
+using namespace dfly;
+
+int main(int argc, char* argv[]) {
+  // Consumes --benchmark_xxx flags before absl flags are parsed.
+  benchmark::Initialize(&argc, argv);
+  MainInitGuard guard(&argc, &argv);
+
+  mi_heap_t* tlh = mi_heap_get_backing();
+  MiMemoryResource mi_resource(tlh);
+  init_zmalloc_threadlocal(tlh);
+  pmr::set_default_resource(&mi_resource);
+
+  benchmark::RunSpecifiedBenchmarks();
+
+  return 0;
+}
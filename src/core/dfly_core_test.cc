@@ -40,6 +40,18 @@ TEST_F(TxQueueTest, Basic) {
   ASSERT_EQ(10, Pop());
 }
 
+TEST_F(TxQueueTest, MaxSize) {
+  pq_.Insert(1);
+  pq_.Insert(2);
+  Pop();
+  EXPECT_EQ(2, pq_.max_size());
+
+  pq_.ResetMaxSize();
+  EXPECT_EQ(1, pq_.max_size());
+  Pop();
+  EXPECT_EQ(1, pq_.max_size());
+}
+
 class IntentLockTest : public ::testing::Test {
  protected:
   IntentLock lk_;
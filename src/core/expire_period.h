@@ -8,55 +8,56 @@
 
 namespace dfly {
 
+// A deadline relative to the expire base of the shard, packed into 32 bits so it can be stored
+// inline in the PrimeTable slots. Periods below 2^31ms (~24 days) keep millisecond precision,
+// the longer ones are rounded to seconds and reach ~68 years.
 class ExpirePeriod {
  public:
-  static constexpr size_t kMaxGenId = 15;
-
-  ExpirePeriod() : val_(0), gen_(0), precision_(0) {
-    static_assert(sizeof(ExpirePeriod) == 8);  // TODO
+  ExpirePeriod() : val_(0) {
+    static_assert(sizeof(ExpirePeriod) == 4);
   }
 
-  explicit ExpirePeriod(uint64_t ms, unsigned gen = 0) : ExpirePeriod() {
+  explicit ExpirePeriod(uint64_t ms) : ExpirePeriod() {
     Set(ms);
   }
 
   // always returns milliseconds value.
   uint64_t duration_ms() const {
-    return precision_ ? uint64_t(val_) * 1000 : val_;
+    return is_second_precision() ? uint64_t(val_ & kValMask) * 1000 : val_;
   }
 
-  // generation id for the base of this duration.
-  // when we update the generation, we need to update the value as well according to this
-  // logic:
-  // new_val = (old_val + old_base) - new_base.
-  unsigned generation_id() const {
-    return gen_;
+  void Set(uint64_t ms);
+
+  bool is_second_precision() const {
+    return val_ & kSecBit;
   }
 
-  void Set(uint64_t ms);
+  // The packed representation.
+  uint32_t value() const {
+    return val_;
+  }
 
-  bool is_second_precision() { return precision_ == 1;}
+  static ExpirePeriod FromValue(uint32_t val) {
+    ExpirePeriod res;
+    res.val_ = val;
+    return res;
+  }
 
  private:
-  uint64_t val_ : 59;
-  uint64_t gen_ : 4;
-  uint64_t precision_ : 1;  // 0 - ms, 1 - sec.
+  static constexpr uint32_t kSecBit = 1u << 31;
+  static constexpr uint32_t kValMask = kSecBit - 1;
+
+  uint32_t val_;
 };
 
 inline void ExpirePeriod::Set(uint64_t ms) {
-  constexpr uint64_t kBarrier = (1ULL << 48);
-
-  if (ms < kBarrier) {
+  if (ms <= kValMask) {
     val_ = ms;
-    precision_ = 0;   // ms
     return;
   }
 
-  precision_ = 1;
-  if (ms < kBarrier << 10) {
-    ms = (ms + 500) / 1000;   // seconds
-  }
-  val_ = ms >= kBarrier ? kBarrier - 1 : ms;
+  uint64_t sec = ms / 1000 + (ms % 1000 >= 500);
+  val_ = kSecBit | (sec < kValMask ? uint32_t(sec) : kValMask);
 }
 
 }  // namespace dfly
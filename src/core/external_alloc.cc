@@ -51,6 +51,9 @@ constexpr unsigned kLargeSizeBin = kNumBins - 1;
 constexpr unsigned kMaxPagesInSegment = kSegmentSize / kSmallPageSize;
 constexpr unsigned kSegDescrAlignment = 16_KB;
 
+// Bounds the released pages that were not taken by the owner.
+constexpr size_t kMaxReleasedPages = 4096;
+
 constexpr size_t kBinWordLens[kNumBins] = {
     512,   512 * 2, 512 * 3, 2048,  2560,  3072,  3584,   4096,   5120,      6144,
     7168,  8192,    10240,   12288, 14336, 16384, 20480,  24576,  28672,     32768,
@@ -390,6 +393,62 @@ size_t ExternalAllocator::GoodSize(size_t sz) {
   return alignup(sz, 4_KB);
 }
 
+vector<pair<size_t, size_t>> ExternalAllocator::TakeReleasedPages(size_t limit) {
+  vector<pair<size_t, size_t>> res;
+  while (!released_pages_.empty() && res.size() < limit) {
+    size_t offset = released_pages_.front();
+    released_pages_.pop_front();
+
+    SegmentDescr* seg = nullptr;
+    Page* page = GetPage(offset, &seg);
+    if (!page->segment_inuse) {
+      res.emplace_back(offset, 1UL << seg->page_shift());
+    }
+  }
+
+  return res;
+}
+
+int64_t ExternalAllocator::FindSparsePage(double max_usage) {
+  // The cursor enumerates the pages of all the segments, kMaxPagesInSegment per segment.
+  size_t num_slots = segments_.size() * kMaxPagesInSegment;
+  for (size_t i = 0; i < num_slots; ++i) {
+    size_t slot = sparse_cursor_++ % num_slots;
+    SegmentDescr* seg = segments_[slot / kMaxPagesInSegment];
+    unsigned page_id = slot % kMaxPagesInSegment;
+    if (!seg || page_id >= seg->capacity())
+      continue;
+
+    Page* page = seg->GetPage(page_id);
+    if (!page->segment_inuse || free_pages_[page->block_size_bin] == page)
+      continue;
+
+    unsigned blocks_num = (1UL << seg->page_shift()) / ToBlockSize(page->block_size_bin);
+    unsigned used = blocks_num - page->available;
+    if (used > 0 && used < blocks_num * max_usage) {
+      return seg->BlockOffset(page, 0);
+    }
+  }
+
+  return -1;
+}
+
+vector<size_t> ExternalAllocator::AllocatedBlocks(size_t page_offset) {
+  SegmentDescr* seg = nullptr;
+  Page* page = GetPage(page_offset, &seg);
+  vector<size_t> res;
+  if (!page->segment_inuse)
+    return res;
+
+  unsigned blocks_num = (1UL << seg->page_shift()) / ToBlockSize(page->block_size_bin);
+  for (unsigned i = 0; i < blocks_num; ++i) {
+    if (!page->free_blocks[i])
+      res.push_back(seg->BlockOffset(page, i));
+  }
+
+  return res;
+}
+
 /**
  *
   _____      _            _          __                  _   _
@@ -472,6 +531,10 @@ void ExternalAllocator::FreePage(Page* page, SegmentDescr* owner, size_t block_s
   page->segment_inuse = 0;
   page->available = 0;
 
+  if (released_pages_.size() == kMaxReleasedPages)
+    released_pages_.pop_front();
+  released_pages_.push_back(owner->BlockOffset(page, 0));
+
   if (!owner->HasFreePages()) {
     // Segment was fully booked but now it has a free page.
     // Add it to the tail of segment queue.
@@ -487,6 +550,19 @@ void ExternalAllocator::FreePage(Page* page, SegmentDescr* owner, size_t block_s
   --owner->page_info_.used;
 }
 
+auto ExternalAllocator::GetPage(size_t offset, SegmentDescr** owner) -> Page* {
+  size_t idx = offset / kSegmentSize;
+  CHECK_LT(idx, segments_.size());
+  SegmentDescr* seg = segments_[idx];
+  CHECK(seg);
+
+  unsigned page_id = (offset % kSegmentSize) >> seg->page_shift();
+  CHECK_LT(page_id, seg->capacity());
+  *owner = seg;
+
+  return seg->GetPage(page_id);
+}
+
 inline auto ExternalAllocator::ToSegDescr(Page* page) -> SegmentDescr* {
   uintptr_t ptr = (uintptr_t)page;
 
@@ -5,6 +5,8 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <deque>
+#include <utility>
 #include <vector>
 
 #include "core/extent_tree.h"
@@ -80,6 +82,19 @@ class ExternalAllocator {
   // No allocation is done.
   static size_t GoodSize(size_t sz);
 
+  // Returns up to limit (offset, length) ranges of the pages that became fully free since
+  // the previous call and were not reused meanwhile. Their backing storage can be released.
+  std::vector<std::pair<size_t, size_t>> TakeReleasedPages(size_t limit);
+
+  // Returns the offset of the next page, in round robin order, whose allocated blocks take
+  // less than max_usage of it. The pages that are being filled are skipped since their
+  // free blocks are reused anyway. The other pages are reused only after all their blocks
+  // are freed. Returns -1 if there is no such page.
+  int64_t FindSparsePage(double max_usage);
+
+  // Returns the offsets of the allocated blocks of the page at page_offset.
+  std::vector<size_t> AllocatedBlocks(size_t page_offset);
+
   size_t capacity() const {
     return capacity_;
   }
@@ -102,6 +117,9 @@ class ExternalAllocator {
 
   static SegmentDescr* ToSegDescr(Page*);
 
+  // Returns the page that hosts offset.
+  Page* GetPage(size_t offset, SegmentDescr** owner);
+
   SegmentDescr* sq_[2];  // map: PageClass -> free Segment.
   Page* free_pages_[detail::kNumFreePages];
 
@@ -110,6 +128,12 @@ class ExternalAllocator {
 
   ExtentTree extent_tree_;
 
+  // Offsets of the pages freed by FreePage, see TakeReleasedPages.
+  std::deque<size_t> released_pages_;
+
+  // Where FindSparsePage continues.
+  size_t sparse_cursor_ = 0;
+
   size_t capacity_ = 0;  // in bytes.
   size_t allocated_bytes_ = 0;
 };
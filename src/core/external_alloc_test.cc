@@ -117,4 +117,43 @@ TEST_F(ExternalAllocatorTest, Classes) {
   EXPECT_EQ(1_MB + 4_KB, ExternalAllocator::GoodSize(1_MB + 1));
 }
 
+TEST_F(ExternalAllocatorTest, SparsePages) {
+  ext_alloc_.AddStorage(0, kSegSize);
+  constexpr unsigned kBlocksInPage = 1_MB / kMinBlockSize;
+
+  vector<size_t> offsets;
+  for (unsigned i = 0; i <= kBlocksInPage; ++i) {
+    offsets.push_back(ext_alloc_.Malloc(kMinBlockSize));
+  }
+  EXPECT_EQ(1_MB, offsets.back());  // the first page is full.
+  EXPECT_EQ(-1, ext_alloc_.FindSparsePage(0.25));
+
+  for (unsigned i = 0; i < kBlocksInPage - 6; ++i) {
+    ext_alloc_.Free(offsets[i], kMinBlockSize);
+  }
+
+  // The second page is being filled, hence it is not reported.
+  EXPECT_EQ(0, ext_alloc_.FindSparsePage(0.25));
+  EXPECT_EQ(6u, ext_alloc_.AllocatedBlocks(0).size());
+  EXPECT_EQ(offsets[kBlocksInPage - 6], ext_alloc_.AllocatedBlocks(0).front());
+  EXPECT_TRUE(ext_alloc_.TakeReleasedPages(8).empty());
+
+  for (unsigned i = kBlocksInPage - 6; i < kBlocksInPage; ++i) {
+    ext_alloc_.Free(offsets[i], kMinBlockSize);
+  }
+  EXPECT_EQ(-1, ext_alloc_.FindSparsePage(0.25));
+
+  auto released = ext_alloc_.TakeReleasedPages(8);
+  ASSERT_EQ(1u, released.size());
+  EXPECT_EQ(0u, released[0].first);
+  EXPECT_EQ(1_MB, released[0].second);
+  EXPECT_TRUE(ext_alloc_.TakeReleasedPages(8).empty());
+
+  // Reused pages are not reported.
+  ext_alloc_.Free(offsets.back(), kMinBlockSize);
+  ext_alloc_.Malloc(kMinBlockSize * 2);
+  ext_alloc_.Malloc(kMinBlockSize * 3);
+  EXPECT_TRUE(ext_alloc_.TakeReleasedPages(8).empty());
+}
+
 }  // namespace dfly
@@ -0,0 +1,101 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/frequency_sketch.h"
+
+#include <absl/numeric/bits.h>
+
+#include <algorithm>
+
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+constexpr size_t kMinWidth = 1024;
+constexpr unsigned kCountersPerWord = 16;
+
+// Per-row seeds, so that colliding hashes in one row are unlikely to collide in the others.
+constexpr uint64_t kSeeds[FrequencySketch::kDepth] = {0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+                                                      0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL};
+
+// murmur3 finalizer.
+inline uint64_t Mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+}  // namespace
+
+FrequencySketch::FrequencySketch(size_t capacity) {
+  EnsureCapacity(capacity);
+}
+
+void FrequencySketch::EnsureCapacity(size_t capacity) {
+  size_t width = absl::bit_ceil(std::max(capacity, kMinWidth));
+  if (width <= width_)
+    return;
+
+  width_ = width;
+  sample_size_ = width * 10;
+  additions_ = 0;
+  table_.assign(kDepth * width / kCountersPerWord, 0);
+}
+
+size_t FrequencySketch::CounterIndex(uint64_t hash, unsigned row) const {
+  return Mix(hash ^ kSeeds[row]) & (width_ - 1);
+}
+
+void FrequencySketch::Increment(uint64_t hash) {
+  size_t row_words = width_ / kCountersPerWord;
+  bool added = false;
+
+  for (unsigned row = 0; row < kDepth; ++row) {
+    size_t index = CounterIndex(hash, row);
+    uint64_t& word = table_[row * row_words + index / kCountersPerWord];
+    unsigned shift = (index % kCountersPerWord) * 4;
+    if (((word >> shift) & kMaxCount) < kMaxCount) {
+      word += 1ULL << shift;
+      added = true;
+    }
+  }
+
+  if (added && ++additions_ >= sample_size_) {
+    Reset();
+  }
+}
+
+unsigned FrequencySketch::Estimate(uint64_t hash) const {
+  size_t row_words = width_ / kCountersPerWord;
+  unsigned res = kMaxCount;
+
+  for (unsigned row = 0; row < kDepth; ++row) {
+    size_t index = CounterIndex(hash, row);
+    uint64_t word = table_[row * row_words + index / kCountersPerWord];
+    unsigned shift = (index % kCountersPerWord) * 4;
+    res = std::min<unsigned>(res, (word >> shift) & kMaxCount);
+  }
+
+  return res;
+}
+
+void FrequencySketch::Reset() {
+  // Halves all 16 counters of a word at once: the shift moves the low bit of every counter
+  // into its neighbour, the mask clears those bits.
+  for (uint64_t& word : table_) {
+    word = (word >> 1) & 0x7777777777777777ULL;
+  }
+  additions_ /= 2;
+  ++resets_;
+  DVLOG(1) << "Aged frequency sketch of width " << width_;
+}
+
+}  // namespace dfly
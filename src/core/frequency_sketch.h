@@ -0,0 +1,61 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace dfly {
+
+// Count-min sketch of 4-bit counters that estimates how often a key hash has been seen,
+// as used by TinyLFU. Each of the kDepth rows maps a hash to one counter and the estimate
+// is the minimum among them. Once the number of increments reaches the sample size
+// (10 times the width), all the counters are halved so that the estimates favour
+// recent history.
+class FrequencySketch {
+ public:
+  static constexpr unsigned kDepth = 4;
+  static constexpr unsigned kMaxCount = 15;
+
+  // capacity is the expected number of distinct items, the width is rounded up from it.
+  explicit FrequencySketch(size_t capacity);
+
+  // Grows the sketch if capacity is larger than its width. Growing resets the counters.
+  void EnsureCapacity(size_t capacity);
+
+  void Increment(uint64_t hash);
+
+  // Returns the estimated frequency of hash, in the range [0, kMaxCount].
+  unsigned Estimate(uint64_t hash) const;
+
+  size_t width() const {
+    return width_;
+  }
+
+  size_t MallocUsed() const {
+    return table_.capacity() * sizeof(uint64_t);
+  }
+
+  // Number of times the counters were halved.
+  size_t resets() const {
+    return resets_;
+  }
+
+ private:
+  // Returns the index of the counter of hash in row.
+  size_t CounterIndex(uint64_t hash, unsigned row) const;
+
+  void Reset();
+
+  // Each word packs 16 counters. Row i occupies words [i * width_ / 16, (i + 1) * width_ / 16).
+  std::vector<uint64_t> table_;
+  size_t width_ = 0;
+  size_t sample_size_ = 0;
+  size_t additions_ = 0;
+  size_t resets_ = 0;
+};
+
+}  // namespace dfly
@@ -0,0 +1,83 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/frequency_sketch.h"
+
+#include <gtest/gtest.h>
+
+#include <random>
+
+namespace dfly {
+
+using namespace std;
+
+class FrequencySketchTest : public ::testing::Test {};
+
+TEST_F(FrequencySketchTest, Basic) {
+  FrequencySketch sketch(100);
+  EXPECT_EQ(1024, sketch.width());
+  EXPECT_EQ(0, sketch.Estimate(1));
+
+  for (unsigned i = 0; i < 5; ++i) {
+    sketch.Increment(1);
+  }
+  EXPECT_EQ(5, sketch.Estimate(1));
+  EXPECT_EQ(0, sketch.Estimate(2));
+
+  // Counters saturate.
+  for (unsigned i = 0; i < 100; ++i) {
+    sketch.Increment(1);
+  }
+  EXPECT_EQ(FrequencySketch::kMaxCount, sketch.Estimate(1));
+
+  sketch.EnsureCapacity(1000);
+  EXPECT_EQ(1024, sketch.width());
+  EXPECT_EQ(FrequencySketch::kMaxCount, sketch.Estimate(1));
+
+  sketch.EnsureCapacity(2000);
+  EXPECT_EQ(2048, sketch.width());
+  EXPECT_EQ(0, sketch.Estimate(1));
+}
+
+TEST_F(FrequencySketchTest, HotKeysSurviveScan) {
+  FrequencySketch sketch(16384);
+  mt19937_64 gen(1);
+
+  // A few hot keys accessed repeatedly, interleaved with a scan over many distinct keys.
+  constexpr unsigned kHot = 32;
+  for (unsigned i = 0; i < 5000; ++i) {
+    sketch.Increment(i % kHot);
+    sketch.Increment(gen() | (1ULL << 63));
+  }
+
+  for (unsigned i = 0; i < kHot; ++i) {
+    EXPECT_EQ(FrequencySketch::kMaxCount, sketch.Estimate(i)) << i;
+  }
+
+  unsigned cold_total = 0;
+  for (unsigned i = 0; i < 1000; ++i) {
+    cold_total += sketch.Estimate(gen() | (1ULL << 63));
+  }
+  EXPECT_LT(cold_total, 1000u);
+}
+
+TEST_F(FrequencySketchTest, Aging) {
+  FrequencySketch sketch(1024);
+  for (unsigned i = 0; i < 8; ++i) {
+    sketch.Increment(7);
+  }
+  EXPECT_EQ(8, sketch.Estimate(7));
+
+  // Other keys collide with the counters of 7 as well, so we only check that the aging
+  // halves whatever the estimate was right before it.
+  unsigned before = 0;
+  for (uint64_t i = 0; sketch.resets() == 0; ++i) {
+    before = sketch.Estimate(7);
+    sketch.Increment(1000 + i);
+  }
+  EXPECT_LE(sketch.Estimate(7), (before + 1) / 2);
+  EXPECT_GE(sketch.Estimate(7), before / 2);
+}
+
+}  // namespace dfly
@@ -0,0 +1,310 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/geohash.h"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+constexpr unsigned kHashBits = kGeoStepMax * 2;
+constexpr double kLatMaxStd = 90;
+
+inline double DegRad(double deg) {
+  return deg * (M_PI / 180.0);
+}
+
+inline double RadDeg(double rad) {
+  return rad * (180.0 / M_PI);
+}
+
+// Spreads the 32 bits of v to the even bits of the result.
+uint64_t Spread(uint32_t v) {
+  uint64_t x = v;
+  x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+  x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+  x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+  x = (x | (x << 2)) & 0x3333333333333333ULL;
+  x = (x | (x << 1)) & 0x5555555555555555ULL;
+  return x;
+}
+
+// The inverse of Spread: gathers the even bits of x.
+uint32_t Squash(uint64_t x) {
+  x &= 0x5555555555555555ULL;
+  x = (x | (x >> 1)) & 0x3333333333333333ULL;
+  x = (x | (x >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+  x = (x | (x >> 4)) & 0x00FF00FF00FF00FFULL;
+  x = (x | (x >> 8)) & 0x0000FFFF0000FFFFULL;
+  x = (x | (x >> 16)) & 0x00000000FFFFFFFFULL;
+  return x;
+}
+
+uint32_t Quantize(double val, double lo, double hi) {
+  constexpr uint32_t kCells = 1u << kGeoStepMax;
+  double offset = (val - lo) / (hi - lo) * kCells;
+  return min(uint32_t(max(offset, 0.0)), kCells - 1);
+}
+
+uint64_t Encode(const GeoPoint& point, double lat_min, double lat_max) {
+  uint32_t lat = Quantize(point.lat, lat_min, lat_max);
+  uint32_t lon = Quantize(point.lon, kGeoLonMin, kGeoLonMax);
+  return Spread(lat) | (Spread(lon) << 1);
+}
+
+double LatDistance(double lat1, double lat2) {
+  return kEarthRadiusMeters * fabs(DegRad(lat2) - DegRad(lat1));
+}
+
+}  // namespace
+
+bool GeoValid(const GeoPoint& point) {
+  return point.lon >= kGeoLonMin && point.lon <= kGeoLonMax && point.lat >= kGeoLatMin &&
+         point.lat <= kGeoLatMax;
+}
+
+uint64_t GeoEncode(const GeoPoint& point) {
+  DCHECK(GeoValid(point));
+  return Encode(point, kGeoLatMin, kGeoLatMax);
+}
+
+GeoPoint GeoDecode(uint64_t hash) {
+  constexpr double kCells = 1u << kGeoStepMax;
+  double lat = Squash(hash), lon = Squash(hash >> 1);
+
+  // The center of the cell, computed from its edges as redis does, so that the coordinates
+  // match the ones that redis replies with.
+  double lat_min = kGeoLatMin + (lat / kCells) * (kGeoLatMax - kGeoLatMin);
+  double lat_max = kGeoLatMin + ((lat + 1) / kCells) * (kGeoLatMax - kGeoLatMin);
+  double lon_min = kGeoLonMin + (lon / kCells) * (kGeoLonMax - kGeoLonMin);
+  double lon_max = kGeoLonMin + ((lon + 1) / kCells) * (kGeoLonMax - kGeoLonMin);
+
+  GeoPoint res;
+  res.lon = clamp((lon_min + lon_max) / 2, kGeoLonMin, kGeoLonMax);
+  res.lat = clamp((lat_min + lat_max) / 2, kGeoLatMin, kGeoLatMax);
+  return res;
+}
+
+double GeoDistance(const GeoPoint& a, const GeoPoint& b) {
+  double v = sin((DegRad(b.lon) - DegRad(a.lon)) / 2);
+  // The haversine formula loses precision along a meridian.
+  if (v == 0)
+    return LatDistance(a.lat, b.lat);
+
+  double u = sin((DegRad(b.lat) - DegRad(a.lat)) / 2);
+  double h = u * u + cos(DegRad(a.lat)) * cos(DegRad(b.lat)) * v * v;
+  return 2.0 * kEarthRadiusMeters * asin(sqrt(h));
+}
+
+string GeoHashString(const GeoPoint& point) {
+  constexpr char kAlphabet[] = "0123456789bcdefghjkmnpqrstuvwxyz";
+
+  uint64_t bits = Encode(point, -kLatMaxStd, kLatMaxStd);
+  string res(11, '0');
+
+  // 52 bits are enough for 10 characters, the last one is always 0, as it is in redis.
+  for (unsigned i = 0; i < 10; ++i) {
+    res[i] = kAlphabet[(bits >> (kHashBits - (i + 1) * 5)) & 0x1f];
+  }
+  return res;
+}
+
+GeoShape GeoShape::Radius(const GeoPoint& center, double radius) {
+  GeoShape shape(center);
+  shape.radius_ = radius;
+
+  // The exact extent of the spherical cap: its latitudes span radius / R in each direction and
+  // its longitudes asin(sin(radius / R) / cos(lat)), unless it contains a pole.
+  double delta = radius / kEarthRadiusMeters;
+  double lat = DegRad(center.lat);
+  Rect& bounds = shape.bounds_;
+  bounds.lat_min = max(center.lat - RadDeg(delta), kGeoLatMin);
+  bounds.lat_max = min(center.lat + RadDeg(delta), kGeoLatMax);
+
+  if (fabs(lat) + delta >= M_PI / 2) {
+    bounds.lon_min = kGeoLonMin;
+    bounds.lon_max = kGeoLonMax;
+  } else {
+    double dlon = RadDeg(asin(min(sin(delta) / cos(lat), 1.0)));
+    bounds.lon_min = center.lon - dlon;
+    bounds.lon_max = center.lon + dlon;
+  }
+  return shape;
+}
+
+GeoShape GeoShape::Box(const GeoPoint& center, double width, double height) {
+  GeoShape shape(center);
+  shape.is_box_ = true;
+  shape.radius_ = width / 2;
+  shape.half_height_ = height / 2;
+
+  Rect& bounds = shape.bounds_;
+  double dlat = RadDeg(shape.half_height_ / kEarthRadiusMeters);
+  bounds.lat_min = max(center.lat - dlat, kGeoLatMin);
+  bounds.lat_max = min(center.lat + dlat, kGeoLatMax);
+
+  // As in redis, the width of the box is measured along the parallel of each point, so the box
+  // is widest in longitude at the latitude that is farthest from the equator.
+  double far_lat = DegRad(max(fabs(bounds.lat_min), fabs(bounds.lat_max)));
+  double sin_half = sin(shape.radius_ / (2 * kEarthRadiusMeters)) / cos(far_lat);
+  if (sin_half >= 1 || shape.radius_ / kEarthRadiusMeters >= M_PI) {
+    bounds.lon_min = kGeoLonMin;
+    bounds.lon_max = kGeoLonMax;
+  } else {
+    double dlon = RadDeg(2 * asin(sin_half));
+    bounds.lon_min = center.lon - dlon;
+    bounds.lon_max = center.lon + dlon;
+  }
+  return shape;
+}
+
+optional<double> GeoShape::Distance(const GeoPoint& point) const {
+  if (is_box_) {
+    if (LatDistance(point.lat, center_.lat) > half_height_)
+      return nullopt;
+    if (GeoDistance(point, {center_.lon, point.lat}) > radius_)
+      return nullopt;
+    return GeoDistance(center_, point);
+  }
+
+  double dist = GeoDistance(center_, point);
+  if (dist > radius_)
+    return nullopt;
+  return dist;
+}
+
+bool GeoShape::Intersects(const Rect& rect) const {
+  if (rect.lat_min > bounds_.lat_max || rect.lat_max < bounds_.lat_min)
+    return false;
+
+  for (double shift : {-360.0, 0.0, 360.0}) {
+    if (rect.lon_min <= bounds_.lon_max + shift && rect.lon_max >= bounds_.lon_min + shift)
+      return true;
+  }
+  return false;
+}
+
+double GeoShape::MinDistance(const Rect& rect) const {
+  // Any path to the rect crosses the parallels of its latitudes, if the center is outside of
+  // them, and one of its meridians, if the center is outside of those. The distance to a
+  // parallel is its latitude difference and the distance to the great circle of a meridian is
+  // asin(cos(lat) * |sin(dlon)|).
+  double lat_gap = 0;
+  if (center_.lat < rect.lat_min)
+    lat_gap = rect.lat_min - center_.lat;
+  else if (center_.lat > rect.lat_max)
+    lat_gap = center_.lat - rect.lat_max;
+  double res = kEarthRadiusMeters * DegRad(lat_gap);
+
+  bool inside_lon = false;
+  for (double shift : {-360.0, 0.0, 360.0}) {
+    double lon = center_.lon + shift;
+    inside_lon |= lon >= rect.lon_min && lon <= rect.lon_max;
+  }
+
+  if (!inside_lon) {
+    double cos_lat = cos(DegRad(center_.lat));
+    double d1 = asin(min(cos_lat * fabs(sin(DegRad(rect.lon_min - center_.lon))), 1.0));
+    double d2 = asin(min(cos_lat * fabs(sin(DegRad(rect.lon_max - center_.lon))), 1.0));
+    res = max(res, kEarthRadiusMeters * min(d1, d2));
+  }
+  return res;
+}
+
+vector<GeoShape::Cell> GeoShape::Cover(unsigned max_cells) const {
+  struct Node {
+    uint64_t hash;
+    unsigned step;
+    Rect rect;
+  };
+
+  // A cell is within the shape if its corners are: the points of a parallel within the shape
+  // are a single range of longitudes and the distance along a meridian peaks at its ends.
+  auto inside = [this](const Rect& r) {
+    for (double lon : {r.lon_min, r.lon_max}) {
+      for (double lat : {r.lat_min, r.lat_max}) {
+        if (!Distance({lon, lat}))
+          return false;
+      }
+    }
+    return true;
+  };
+
+  auto keep = [this](const Rect& r) {
+    return Intersects(r) && (is_box_ || MinDistance(r) <= radius_);
+  };
+
+  vector<Cell> res;
+  auto emit = [&](const Node& node) {
+    unsigned shift = kHashBits - node.step * 2;
+    res.push_back({node.hash << shift, (node.hash + 1) << shift, MinDistance(node.rect)});
+  };
+
+  // Refines the cells breadth first, so that the cells that are left unsplit when the budget
+  // runs out are about the same size.
+  deque<Node> queue;
+  queue.push_back({0, 0, {kGeoLonMin, kGeoLonMax, kGeoLatMin, kGeoLatMax}});
+  max_cells = max(max_cells, 1u);
+
+  while (!queue.empty()) {
+    Node node = queue.front();
+    queue.pop_front();
+
+    if (node.step == kGeoStepMax || inside(node.rect)) {
+      emit(node);
+      continue;
+    }
+
+    const Rect& r = node.rect;
+    double lon_mid = (r.lon_min + r.lon_max) / 2, lat_mid = (r.lat_min + r.lat_max) / 2;
+    Node children[4];
+    unsigned num_children = 0;
+
+    // The lower bit of a child is its latitude half and the upper bit its longitude half.
+    for (unsigned c = 0; c < 4; ++c) {
+      Rect child = r;
+      (c & 2 ? child.lon_min : child.lon_max) = lon_mid;
+      (c & 1 ? child.lat_min : child.lat_max) = lat_mid;
+      if (keep(child))
+        children[num_children++] = {node.hash << 2 | c, node.step + 1, child};
+    }
+
+    if (res.size() + queue.size() + num_children > max_cells) {
+      emit(node);
+      continue;
+    }
+    queue.insert(queue.end(), children, children + num_children);
+  }
+
+  sort(res.begin(), res.end(), [](const Cell& a, const Cell& b) { return a.min < b.min; });
+  return res;
+}
+
+void GeoShape::MergeAdjacent(vector<Cell>* cells) {
+  if (cells->empty())
+    return;
+
+  size_t last = 0;
+  for (size_t i = 1; i < cells->size(); ++i) {
+    Cell& prev = (*cells)[last];
+    const Cell& cur = (*cells)[i];
+    if (cur.min <= prev.max) {
+      prev.max = max(prev.max, cur.max);
+      prev.min_dist = min(prev.min_dist, cur.min_dist);
+    } else {
+      (*cells)[++last] = cur;
+    }
+  }
+  cells->resize(last + 1);
+}
+
+}  // namespace dfly
@@ -0,0 +1,100 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace dfly {
+
+// Geo points are kept in sorted sets, as redis does, with the 52 bit geohash of the point as
+// the score: 26 bits of longitude and of latitude, interleaved so that the longitude bits are
+// the odd ones. A prefix of 2 * s bits of a hash is a cell of the grid of step s, and the points
+// of a cell are a single range of scores.
+
+constexpr unsigned kGeoStepMax = 26;
+constexpr double kGeoLonMin = -180;
+constexpr double kGeoLonMax = 180;
+constexpr double kGeoLatMin = -85.05112878;
+constexpr double kGeoLatMax = 85.05112878;
+constexpr double kEarthRadiusMeters = 6372797.560856;
+
+struct GeoPoint {
+  double lon;
+  double lat;
+};
+
+bool GeoValid(const GeoPoint& point);
+
+// Requires: GeoValid(point).
+uint64_t GeoEncode(const GeoPoint& point);
+
+// Returns the center of the cell of the hash.
+GeoPoint GeoDecode(uint64_t hash);
+
+// The great circle distance in meters.
+double GeoDistance(const GeoPoint& a, const GeoPoint& b);
+
+// Returns the standard 11 character geohash of the point, that is encoded for latitudes of
+// [-90, 90] rather than the range of the scores.
+std::string GeoHashString(const GeoPoint& point);
+
+// The area of a GEOSEARCH: the points that are within a radius of a center or within a box
+// around it whose sides are given in meters.
+class GeoShape {
+ public:
+  // A cell of the grid that covers part of the shape, and its scores [min, max).
+  struct Cell {
+    uint64_t min;
+    uint64_t max;
+    double min_dist;  // a lower bound of the distance of the cell points from the center.
+  };
+
+  static GeoShape Radius(const GeoPoint& center, double radius);
+  static GeoShape Box(const GeoPoint& center, double width, double height);
+
+  // Returns the distance of the point from the center if it is within the shape.
+  std::optional<double> Distance(const GeoPoint& point) const;
+
+  // Covers the shape with up to max_cells cells of the grid, as small as the number of cells
+  // allows. Cells are split for as long as the cells that intersect the shape fit, so that the
+  // points of the cells are mostly within the shape. Unlike the 9 cells of the step that is
+  // about the size of the shape which redis scans, the cells are of different steps: large in
+  // the middle of the shape, small along its edges. The cells are sorted by min.
+  std::vector<Cell> Cover(unsigned max_cells) const;
+
+  // Merges the adjacent cells of a cover, so that each range of scores is scanned once.
+  static void MergeAdjacent(std::vector<Cell>* cells);
+
+  const GeoPoint& center() const {
+    return center_;
+  }
+
+ private:
+  struct Rect {
+    double lon_min, lon_max, lat_min, lat_max;
+  };
+
+  GeoShape(const GeoPoint& center) : center_(center) {
+  }
+
+  // Returns a lower bound of the distance from the center to the points of rect.
+  double MinDistance(const Rect& rect) const;
+
+  bool Intersects(const Rect& rect) const;
+
+  GeoPoint center_;
+  bool is_box_ = false;
+  double radius_ = 0;    // radius or half the width.
+  double half_height_ = 0;
+
+  // The bounding box of the shape in degrees. The longitudes may go past [-180, 180] to wrap
+  // around.
+  Rect bounds_;
+};
+
+}  // namespace dfly
@@ -0,0 +1,142 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/geohash.h"
+
+#include <algorithm>
+#include <random>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+class GeoHashTest : public ::testing::Test {
+ protected:
+  GeoPoint RandomPoint(const GeoPoint& center, double spread) {
+    uniform_real_distribution<double> d(-spread, spread);
+    return GeoPoint{clamp(center.lon + d(gen_), kGeoLonMin, kGeoLonMax),
+                    clamp(center.lat + d(gen_), kGeoLatMin, kGeoLatMax)};
+  }
+
+  // Checks that the cover includes every point of the shape and that min_dist bounds the
+  // distances of the cell points.
+  void CheckCover(const GeoShape& shape, double spread, unsigned max_cells) {
+    vector<GeoShape::Cell> cells = shape.Cover(max_cells);
+    ASSERT_FALSE(cells.empty());
+    EXPECT_LE(cells.size(), max_cells);
+    GeoShape::MergeAdjacent(&cells);
+
+    for (unsigned i = 0; i < 20000; ++i) {
+      uint64_t hash = GeoEncode(RandomPoint(shape.center(), spread));
+      GeoPoint point = GeoDecode(hash);
+      double dist = GeoDistance(shape.center(), point);
+
+      auto it = upper_bound(cells.begin(), cells.end(), hash,
+                            [](uint64_t h, const GeoShape::Cell& c) { return h < c.min; });
+      bool covered = it != cells.begin() && hash < prev(it)->max;
+      if (shape.Distance(point)) {
+        ASSERT_TRUE(covered) << point.lon << " " << point.lat;
+      }
+      if (covered) {
+        ASSERT_LE(prev(it)->min_dist, dist + 1e-6) << point.lon << " " << point.lat;
+      }
+    }
+  }
+
+  mt19937_64 gen_{7};
+};
+
+TEST_F(GeoHashTest, EncodeDecode) {
+  GeoPoint palermo{13.361389, 38.115556};
+  uint64_t hash = GeoEncode(palermo);
+  EXPECT_EQ(3479099956230698, hash);
+
+  GeoPoint decoded = GeoDecode(hash);
+  EXPECT_NEAR(13.36138933897018433, decoded.lon, 1e-12);
+  EXPECT_NEAR(38.11555639549629859, decoded.lat, 1e-12);
+
+  for (unsigned i = 0; i < 1000; ++i) {
+    GeoPoint point = RandomPoint({0, 0}, 180);
+    EXPECT_LT(GeoDistance(point, GeoDecode(GeoEncode(point))), 0.6);
+  }
+
+  EXPECT_TRUE(GeoValid({kGeoLonMax, kGeoLatMax}));
+  EXPECT_FALSE(GeoValid({0, 86}));
+  EXPECT_FALSE(GeoValid({-181, 0}));
+  decoded = GeoDecode(GeoEncode({kGeoLonMax, kGeoLatMax}));
+  EXPECT_NEAR(kGeoLonMax, decoded.lon, 1e-5);
+  EXPECT_NEAR(kGeoLatMax, decoded.lat, 1e-5);
+}
+
+TEST_F(GeoHashTest, Distance) {
+  GeoPoint palermo{13.361389, 38.115556}, catania{15.087269, 37.502669};
+  EXPECT_NEAR(166274.1516, GeoDistance(GeoDecode(GeoEncode(palermo)),
+                                       GeoDecode(GeoEncode(catania))), 1e-3);
+  EXPECT_EQ(0, GeoDistance(palermo, palermo));
+  EXPECT_NEAR(kEarthRadiusMeters * M_PI / 180, GeoDistance({10, 20}, {10, 21}), 1e-6);
+}
+
+TEST_F(GeoHashTest, HashString) {
+  EXPECT_EQ("sqc8b49rny0", GeoHashString(GeoDecode(GeoEncode({13.361389, 38.115556}))));
+  EXPECT_EQ("sqdtr74hyu0", GeoHashString(GeoDecode(GeoEncode({15.087269, 37.502669}))));
+}
+
+TEST_F(GeoHashTest, Shape) {
+  GeoPoint center{15, 37};
+  GeoShape radius = GeoShape::Radius(center, 100000);
+  EXPECT_TRUE(radius.Distance({15, 37.5}));
+  EXPECT_FALSE(radius.Distance({15, 38}));
+
+  // The sides of the box are measured along the parallels of the points.
+  GeoShape box = GeoShape::Box(center, 400000, 400000);
+  EXPECT_TRUE(box.Distance({16.5, 38.5}));
+  EXPECT_FALSE(box.Distance({15, 39}));
+  EXPECT_NEAR(GeoDistance(center, {16.5, 38.5}), *box.Distance({16.5, 38.5}), 1e-9);
+}
+
+TEST_F(GeoHashTest, Cover) {
+  for (unsigned max_cells : {1, 4, 32}) {
+    CheckCover(GeoShape::Radius({15, 37}, 100000), 3, max_cells);
+    CheckCover(GeoShape::Box({15, 37}, 400000, 100000), 4, max_cells);
+  }
+
+  // Around the antimeridian and close to the poles.
+  CheckCover(GeoShape::Radius({179.9, 0}, 50000), 1, 32);
+  CheckCover(GeoShape::Box({-179.9, 10}, 100000, 50000), 1, 32);
+  CheckCover(GeoShape::Radius({0, 84}, 500000), 20, 32);
+  CheckCover(GeoShape::Radius({0, 0}, 20000000), 180, 32);
+  CheckCover(GeoShape::Radius({10, 10}, 1), 0.001, 32);
+  CheckCover(GeoShape::Radius({10, 10}, 0), 0.001, 32);
+}
+
+TEST_F(GeoHashTest, CoverSize) {
+  // Most of the covered area is within the shape.
+  GeoShape shape = GeoShape::Radius({15, 37}, 10000);
+  vector<GeoShape::Cell> cells = shape.Cover(32);
+  unsigned covered = 0, inside = 0;
+  for (unsigned i = 0; i < 20000; ++i) {
+    uint64_t hash = GeoEncode(RandomPoint(shape.center(), 0.5));
+    for (const auto& cell : cells) {
+      if (hash >= cell.min && hash < cell.max) {
+        ++covered;
+        inside += bool(shape.Distance(GeoDecode(hash)));
+      }
+    }
+  }
+  EXPECT_GT(inside, covered / 2);
+}
+
+// Benchmarks
+static void BM_Cover(benchmark::State& state) {
+  GeoShape shape = GeoShape::Radius({15, 37}, state.range(0));
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(shape.Cover(32));
+  }
+}
+BENCHMARK(BM_Cover)->Arg(100)->Arg(100000);
+
+}  // namespace dfly
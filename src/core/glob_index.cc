@@ -0,0 +1,232 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/glob_index.h"
+
+#include <algorithm>
+
+namespace dfly {
+
+using namespace std;
+
+GlobIndex::GlobIndex() {
+}
+
+GlobIndex::~GlobIndex() {
+}
+
+bool GlobIndex::Add(string_view pattern) {
+  Node* node = &root_;
+  for (const Token& token : Parse(pattern)) {
+    node = Child(node, token, true)->get();
+  }
+
+  if (find(node->patterns.begin(), node->patterns.end(), pattern) != node->patterns.end())
+    return false;
+
+  node->patterns.emplace_back(pattern);
+  ++size_;
+  return true;
+}
+
+bool GlobIndex::Remove(string_view pattern) {
+  bool removed = false;
+  Remove(&root_, Parse(pattern), 0, pattern, &removed);
+  size_ -= removed;
+  return removed;
+}
+
+// Follows stringmatchlen token by token, including its handling of the malformed patterns:
+// a trailing backslash is a literal and an unterminated class runs up to the end.
+auto GlobIndex::Parse(string_view pattern) -> vector<Token> {
+  vector<Token> res;
+  size_t i = 0, len = pattern.size();
+  while (i < len) {
+    Token token;
+    switch (pattern[i]) {
+      case '*':
+        // Consecutive stars match as one.
+        if (res.empty() || res.back().kind != Token::STAR) {
+          token.kind = Token::STAR;
+          res.push_back(token);
+        }
+        break;
+      case '?':
+        token.kind = Token::ANY;
+        res.push_back(token);
+        break;
+      case '[': {
+        token.kind = Token::CLASS;
+        ++i;
+        bool negate = i < len && pattern[i] == '^';
+        i += negate;
+        while (true) {
+          size_t left = len - i;
+          if (left >= 2 && pattern[i] == '\\') {
+            ++i;
+            token.set.set(uint8_t(pattern[i]));
+          } else if (left == 0) {
+            --i;
+            break;
+          } else if (pattern[i] == ']') {
+            break;
+          } else if (left >= 3 && pattern[i + 1] == '-') {
+            // The bounds of the ranges compare as signed chars.
+            int start = pattern[i], end = pattern[i + 2];
+            if (start > end)
+              swap(start, end);
+            for (unsigned c = 0; c < 256; ++c) {
+              int val = static_cast<signed char>(c);
+              if (val >= start && val <= end)
+                token.set.set(c);
+            }
+            i += 2;
+          } else {
+            token.set.set(uint8_t(pattern[i]));
+          }
+          ++i;
+        }
+        if (negate)
+          token.set.flip();
+        res.push_back(token);
+        break;
+      }
+      case '\\':
+        if (len - i >= 2)
+          ++i;
+        [[fallthrough]];
+      default:
+        token.kind = Token::LITERAL;
+        token.ch = pattern[i];
+        res.push_back(token);
+    }
+    ++i;
+  }
+
+  return res;
+}
+
+auto GlobIndex::Child(Node* node, const Token& token, bool create) -> unique_ptr<Node>* {
+  unique_ptr<Node>* res = nullptr;
+  switch (token.kind) {
+    case Token::LITERAL:
+      if (auto it = node->literals.find(token.ch); it != node->literals.end())
+        return &it->second;
+      if (create)
+        res = &node->literals[token.ch];
+      break;
+    case Token::ANY:
+      res = &node->any;
+      break;
+    case Token::STAR:
+      res = &node->star;
+      break;
+    case Token::CLASS:
+      for (auto& [set, child] : node->classes) {
+        if (set == token.set)
+          return &child;
+      }
+      if (create)
+        res = &node->classes.emplace_back(token.set, nullptr).second;
+      break;
+  }
+
+  if (res && !*res) {
+    if (!create)
+      return nullptr;
+    res->reset(new Node);
+    (*res)->is_star = token.kind == Token::STAR;
+  }
+
+  return res;
+}
+
+bool GlobIndex::Remove(Node* node, const vector<Token>& tokens, size_t index,
+                       string_view pattern, bool* removed) {
+  if (index == tokens.size()) {
+    auto it = find(node->patterns.begin(), node->patterns.end(), pattern);
+    if (it != node->patterns.end()) {
+      node->patterns.erase(it);
+      *removed = true;
+    }
+    return node->empty();
+  }
+
+  const Token& token = tokens[index];
+  unique_ptr<Node>* child = Child(node, token, false);
+  if (!child || !Remove(child->get(), tokens, index + 1, pattern, removed))
+    return false;
+
+  // Prunes the empty child.
+  switch (token.kind) {
+    case Token::LITERAL:
+      node->literals.erase(token.ch);
+      break;
+    case Token::CLASS:
+      node->classes.erase(find_if(node->classes.begin(), node->classes.end(),
+                                  [&](const auto& k_v) { return &k_v.second == child; }));
+      break;
+    default:
+      child->reset();
+  }
+
+  return node->empty();
+}
+
+void GlobIndex::Reach(Node* node, vector<Node*>* dest) {
+  if (node->mark == step_)
+    return;
+
+  node->mark = step_;
+  dest->push_back(node);
+  if (node->star)
+    Reach(node->star.get(), dest);
+}
+
+auto GlobIndex::MatchNodes(string_view str) -> const vector<Node*>& {
+  current_.clear();
+
+  // stringmatchlen matches an empty string only with an empty pattern, even with "*".
+  if (str.empty()) {
+    if (!root_.patterns.empty())
+      current_.push_back(&root_);
+    return current_;
+  }
+
+  ++step_;
+  Reach(&root_, &current_);
+  for (char c : str) {
+    ++step_;
+    next_.clear();
+    for (Node* node : current_) {
+      if (node->is_star)
+        Reach(node, &next_);
+
+      if (auto it = node->literals.find(c); it != node->literals.end())
+        Reach(it->second.get(), &next_);
+
+      if (node->any)
+        Reach(node->any.get(), &next_);
+
+      for (const auto& [set, child] : node->classes) {
+        if (set[uint8_t(c)])
+          Reach(child.get(), &next_);
+      }
+    }
+
+    current_.swap(next_);
+    if (current_.empty())
+      break;
+  }
+
+  next_.clear();
+  for (Node* node : current_) {
+    if (!node->patterns.empty())
+      next_.push_back(node);
+  }
+
+  return next_;
+}
+
+}  // namespace dfly
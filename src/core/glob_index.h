@@ -0,0 +1,96 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <bitset>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// Index of glob patterns that finds the patterns matching a string, with the semantics of
+// stringmatchlen with nocase 0. The patterns are compiled into a trie of their tokens: literal
+// characters, '?', '*' and character classes. Patterns with a common prefix share its nodes,
+// so "prefix*" patterns form a regular prefix trie that ends with '*' nodes.
+// Matching simulates the trie as an automaton over the string: it keeps the set of nodes the
+// prefix of the string can reach, where a '*' node stays reached by every following character.
+// Its cost grows with the length of the string and the number of the reached nodes, rather than
+// with the number of the patterns.
+class GlobIndex {
+ public:
+  GlobIndex();
+  ~GlobIndex();
+
+  // Returns false if the pattern is already in the index.
+  bool Add(std::string_view pattern);
+
+  // Returns false if the pattern is not in the index.
+  bool Remove(std::string_view pattern);
+
+  // Calls cb(const std::string& pattern) for every pattern that matches str.
+  template <typename Cb> void Match(std::string_view str, Cb&& cb);
+
+  size_t size() const {
+    return size_;
+  }
+
+ private:
+  using CharSet = std::bitset<256>;
+
+  struct Token {
+    enum Kind : uint8_t { LITERAL, ANY, STAR, CLASS } kind;
+    char ch = 0;
+    CharSet set;
+  };
+
+  struct Node {
+    absl::flat_hash_map<char, std::unique_ptr<Node>> literals;
+    std::vector<std::pair<CharSet, std::unique_ptr<Node>>> classes;
+    std::unique_ptr<Node> any;
+    std::unique_ptr<Node> star;
+
+    std::vector<std::string> patterns;  // that end at this node.
+    bool is_star = false;
+    uint64_t mark = 0;  // the step of the match that reached the node last.
+
+    bool empty() const {
+      return literals.empty() && classes.empty() && !any && !star && patterns.empty();
+    }
+  };
+
+  static std::vector<Token> Parse(std::string_view pattern);
+
+  // Returns the child of node for the token, creating it if create is true.
+  static std::unique_ptr<Node>* Child(Node* node, const Token& token, bool create);
+
+  // Returns whether the node of the pattern at tokens[index..] is empty after the removal.
+  static bool Remove(Node* node, const std::vector<Token>& tokens, size_t index,
+                     std::string_view pattern, bool* removed);
+
+  // Reaches the node and its '*' child, which matches an empty string, in the current step.
+  void Reach(Node* node, std::vector<Node*>* dest);
+
+  // Returns the nodes that str reaches and that have patterns.
+  const std::vector<Node*>& MatchNodes(std::string_view str);
+
+  Node root_;
+  size_t size_ = 0;
+  uint64_t step_ = 0;
+  std::vector<Node*> current_, next_;
+};
+
+template <typename Cb> void GlobIndex::Match(std::string_view str, Cb&& cb) {
+  for (const Node* node : MatchNodes(str)) {
+    for (const std::string& pattern : node->patterns) {
+      cb(pattern);
+    }
+  }
+}
+
+}  // namespace dfly
@@ -0,0 +1,115 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/glob_index.h"
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <set>
+
+extern "C" {
+#include "redis/util.h"
+}
+
+namespace dfly {
+
+using namespace std;
+
+class GlobIndexTest : public ::testing::Test {
+ protected:
+  set<string> Match(string_view str) {
+    set<string> res;
+    index_.Match(str, [&](const string& pattern) { EXPECT_TRUE(res.insert(pattern).second); });
+    return res;
+  }
+
+  GlobIndex index_;
+};
+
+TEST_F(GlobIndexTest, Basic) {
+  EXPECT_TRUE(index_.Add("news.*"));
+  EXPECT_TRUE(index_.Add("news.sport"));
+  EXPECT_TRUE(index_.Add("*"));
+  EXPECT_TRUE(index_.Add("n?ws.[st]*"));
+  EXPECT_TRUE(index_.Add("*.weather"));
+  EXPECT_FALSE(index_.Add("news.*"));
+  EXPECT_EQ(5, index_.size());
+
+  EXPECT_EQ((set<string>{"news.*", "news.sport", "*", "n?ws.[st]*"}), Match("news.sport"));
+  EXPECT_EQ((set<string>{"news.*", "*", "*.weather"}), Match("news.weather"));
+  EXPECT_EQ((set<string>{"*"}), Match("blog"));
+
+  // As with stringmatchlen, only an empty pattern matches an empty string.
+  EXPECT_TRUE(Match("").empty());
+  index_.Add("");
+  EXPECT_EQ((set<string>{""}), Match(""));
+
+  EXPECT_TRUE(index_.Remove("*"));
+  EXPECT_FALSE(index_.Remove("*"));
+  EXPECT_FALSE(index_.Remove("news.sp*"));
+  EXPECT_EQ((set<string>{"news.*", "news.sport", "n?ws.[st]*"}), Match("news.sport"));
+  EXPECT_TRUE(Match("blog").empty());
+  EXPECT_EQ(5, index_.size());
+}
+
+TEST_F(GlobIndexTest, Escapes) {
+  index_.Add("a\\*b");
+  index_.Add("a*b");
+  index_.Add("[^a-c]x");
+  index_.Add("[\\]]");
+  index_.Add("tail\\");
+
+  EXPECT_EQ((set<string>{"a\\*b", "a*b"}), Match("a*b"));
+  EXPECT_EQ((set<string>{"a*b"}), Match("axxb"));
+  EXPECT_EQ((set<string>{"[^a-c]x"}), Match("dx"));
+  EXPECT_TRUE(Match("bx").empty());
+  EXPECT_EQ((set<string>{"[\\]]"}), Match("]"));
+  EXPECT_EQ((set<string>{"tail\\"}), Match("tail\\"));
+}
+
+// Compares the index with stringmatchlen on random patterns, malformed ones included.
+TEST_F(GlobIndexTest, Random) {
+  constexpr string_view kChars = "ab*?[]^-\\";
+  mt19937 gen(42);
+  auto random_str = [&](string_view chars, unsigned max_len) {
+    string res(gen() % (max_len + 1), ' ');
+    for (char& c : res) {
+      c = chars[gen() % chars.size()];
+    }
+    return res;
+  };
+
+  vector<string> patterns;
+  for (unsigned i = 0; i < 2000; ++i) {
+    string pattern = random_str(kChars, 6);
+    if (index_.Add(pattern))
+      patterns.push_back(pattern);
+  }
+
+  for (unsigned i = 0; i < 2000; ++i) {
+    // Removes a part of the patterns half way through.
+    if (i == 1000) {
+      vector<string> kept;
+      for (size_t j = 0; j < patterns.size(); ++j) {
+        if (j % 2)
+          kept.push_back(patterns[j]);
+        else
+          ASSERT_TRUE(index_.Remove(patterns[j]));
+      }
+      patterns.swap(kept);
+      ASSERT_EQ(patterns.size(), index_.size());
+    }
+
+    string str = random_str("ab*?[]^-\\c", 8);
+    set<string> expected;
+    for (const string& pattern : patterns) {
+      if (stringmatchlen(pattern.data(), pattern.size(), str.data(), str.size(), 0) == 1)
+        expected.insert(pattern);
+    }
+    ASSERT_EQ(expected, Match(str)) << str;
+  }
+}
+
+}  // namespace dfly
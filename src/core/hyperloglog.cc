@@ -0,0 +1,372 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/hyperloglog.h"
+
+#include <absl/base/internal/endian.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+// The layout of the header, which matches the one of redis.
+constexpr char kMagic[] = "HYLL";
+constexpr size_t kEncodingPos = 4;
+constexpr size_t kCardPos = 8;
+constexpr size_t kHeaderSize = 16;
+
+constexpr uint8_t kDense = 0;
+constexpr uint8_t kSparse = 1;
+
+constexpr unsigned kP = 14;  // The number of bits of the hash that select the register.
+constexpr unsigned kQ = 64 - kP;
+constexpr size_t kDenseSize = kHeaderSize + kHllRegisters * 6 / 8;
+
+// The sparse opcodes: ZERO 00xxxxxx covers 1-64 zero registers, XZERO 01xxxxxx yyyyyyyy covers
+// 1-16384 zero registers and VAL 1vvvvvxx covers 1-4 registers set to 1-32.
+constexpr uint8_t kSparseXZeroBit = 0x40;
+constexpr uint8_t kSparseValBit = 0x80;
+constexpr unsigned kSparseZeroMaxLen = 64;
+constexpr unsigned kSparseXZeroMaxLen = 16384;
+constexpr unsigned kSparseValMaxValue = 32;
+constexpr unsigned kSparseValMaxLen = 4;
+
+// MurmurHash64A, as redis uses for its HyperLogLogs.
+uint64_t Hash(string_view element) {
+  constexpr uint64_t m = 0xc6a4a7935bd1e995ULL;
+  constexpr int r = 47;
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(element.data());
+  const size_t len = element.size();
+  uint64_t h = 0xadc83b19ULL ^ (len * m);
+
+  const uint8_t* end = data + (len - (len & 7));
+  for (; data != end; data += 8) {
+    uint64_t k = absl::little_endian::Load64(data);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+
+  switch (len & 7) {
+    case 7:
+      h ^= uint64_t(data[6]) << 48;
+      [[fallthrough]];
+    case 6:
+      h ^= uint64_t(data[5]) << 40;
+      [[fallthrough]];
+    case 5:
+      h ^= uint64_t(data[4]) << 32;
+      [[fallthrough]];
+    case 4:
+      h ^= uint64_t(data[3]) << 24;
+      [[fallthrough]];
+    case 3:
+      h ^= uint64_t(data[2]) << 16;
+      [[fallthrough]];
+    case 2:
+      h ^= uint64_t(data[1]) << 8;
+      [[fallthrough]];
+    case 1:
+      h ^= uint64_t(data[0]);
+      h *= m;
+  }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+// Returns the register of the element and the value it sets: the position of the first set bit
+// in the rest of the hash.
+pair<unsigned, uint8_t> RegisterOf(string_view element) {
+  uint64_t hash = Hash(element);
+  unsigned index = hash & (kHllRegisters - 1);
+  hash >>= kP;
+  hash |= 1ULL << kQ;  // Bounds the value by kQ + 1.
+  return {index, __builtin_ctzll(hash) + 1};
+}
+
+// Dense registers are packed least significant bits first, 4 registers in every 3 bytes.
+void UnpackGroup(const uint8_t* src, uint8_t* dest) {
+  dest[0] = src[0] & 63;
+  dest[1] = (src[0] >> 6) | ((src[1] & 15) << 2);
+  dest[2] = (src[1] >> 4) | ((src[2] & 3) << 4);
+  dest[3] = src[2] >> 2;
+}
+
+void PackGroup(const uint8_t* src, uint8_t* dest) {
+  dest[0] = src[0] | (src[1] << 6);
+  dest[1] = (src[1] >> 2) | (src[2] << 4);
+  dest[2] = (src[2] >> 4) | (src[3] << 2);
+}
+
+uint8_t* Registers(std::string* hll) {
+  return reinterpret_cast<uint8_t*>(hll->data()) + kHeaderSize;
+}
+
+const uint8_t* Registers(string_view hll) {
+  return reinterpret_cast<const uint8_t*>(hll.data()) + kHeaderSize;
+}
+
+void InvalidateCachedCount(std::string* hll) {
+  (*hll)[kCardPos + 7] |= 0x80;
+}
+
+// Calls cb(index, len, value) for every run of registers of hll, whose value is 0 for zero
+// runs. Returns false if the opcodes are corrupted, in which case cb may have been called.
+template <typename F> bool ForEachSparseRun(string_view hll, F&& cb) {
+  const uint8_t* p = Registers(hll);
+  const uint8_t* end = reinterpret_cast<const uint8_t*>(hll.data()) + hll.size();
+  unsigned index = 0;
+
+  while (p < end) {
+    unsigned len;
+    uint8_t value = 0;
+    if (*p & kSparseValBit) {
+      value = ((*p >> 2) & 31) + 1;
+      len = (*p & 3) + 1;
+      ++p;
+    } else if (*p & kSparseXZeroBit) {
+      if (p + 1 == end)
+        return false;
+      len = (((*p & 63) << 8) | p[1]) + 1;
+      p += 2;
+    } else {
+      len = (*p & 63) + 1;
+      ++p;
+    }
+
+    if (index + len > kHllRegisters)
+      return false;
+    if (value)
+      cb(index, len, value);
+    index += len;
+  }
+  return index == kHllRegisters;
+}
+
+// dest[i] = max(dest[i], src[i]) for every register.
+void MaxMerge(const uint8_t* src, uint8_t* dest) {
+  static_assert(kHllRegisters % 16 == 0);
+#if defined(__x86_64__)
+  for (unsigned i = 0; i < kHllRegisters; i += 16) {
+    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dest + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), _mm_max_epu8(s, d));
+  }
+#elif defined(__aarch64__)
+  for (unsigned i = 0; i < kHllRegisters; i += 16) {
+    vst1q_u8(dest + i, vmaxq_u8(vld1q_u8(src + i), vld1q_u8(dest + i)));
+  }
+#else
+  for (unsigned i = 0; i < kHllRegisters; ++i) {
+    dest[i] = std::max(dest[i], src[i]);
+  }
+#endif
+}
+
+// The helpers of the estimator of Ertl, "New cardinality estimation algorithms for
+// HyperLogLog sketches", which redis uses.
+double Sigma(double x) {
+  if (x == 1.)
+    return INFINITY;
+  double z_prime;
+  double y = 1;
+  double z = x;
+  do {
+    x *= x;
+    z_prime = z;
+    z += x * y;
+    y += y;
+  } while (z_prime != z);
+  return z;
+}
+
+double Tau(double x) {
+  if (x == 0. || x == 1.)
+    return 0.;
+  double z_prime;
+  double y = 1.0;
+  double z = 1 - x;
+  do {
+    x = sqrt(x);
+    z_prime = z;
+    y *= 0.5;
+    z -= pow(1 - x, 2) * y;
+  } while (z_prime != z);
+  return z / 3;
+}
+
+}  // namespace
+
+bool IsHll(string_view value) {
+  if (value.size() < kHeaderSize || value.substr(0, 4) != kMagic)
+    return false;
+  uint8_t encoding = value[kEncodingPos];
+  return (encoding == kDense && value.size() == kDenseSize) || encoding == kSparse;
+}
+
+bool IsSparseHll(string_view hll) {
+  return hll[kEncodingPos] == kSparse;
+}
+
+std::string MakeHll() {
+  std::string res(kHeaderSize + 2, 0);
+  memcpy(res.data(), kMagic, 4);
+  res[kEncodingPos] = kSparse;
+  uint8_t* p = Registers(&res);
+  p[0] = kSparseXZeroBit | ((kHllRegisters - 1) >> 8);
+  p[1] = (kHllRegisters - 1) & 0xff;
+  return res;
+}
+
+int HllAdd(absl::Span<const std::string_view> elements, size_t sparse_max_bytes,
+           std::string* hll) {
+  bool changed = false;
+
+  if ((*hll)[kEncodingPos] == kDense) {
+    uint8_t* regs = Registers(hll);
+    for (string_view element : elements) {
+      auto [index, value] = RegisterOf(element);
+      uint8_t* group = regs + index / 4 * 3;
+      uint8_t unpacked[4];
+      UnpackGroup(group, unpacked);
+      if (unpacked[index % 4] < value) {
+        unpacked[index % 4] = value;
+        PackGroup(unpacked, group);
+        changed = true;
+      }
+    }
+    if (changed)
+      InvalidateCachedCount(hll);
+    return changed;
+  }
+
+  // Sparse values are rebuilt from their registers.
+  HllRegisters regs;
+  if (!regs.Merge(*hll))
+    return -1;
+  for (string_view element : elements) {
+    auto [index, value] = RegisterOf(element);
+    if (regs.data()[index] < value) {
+      regs.data()[index] = value;
+      changed = true;
+    }
+  }
+  if (changed)
+    *hll = regs.ToHll(true, sparse_max_bytes);
+  return changed;
+}
+
+optional<uint64_t> HllCachedCount(string_view hll) {
+  if (hll[kCardPos + 7] & 0x80)
+    return nullopt;
+  return absl::little_endian::Load64(hll.data() + kCardPos);
+}
+
+void HllSetCachedCount(uint64_t count, std::string* hll) {
+  absl::little_endian::Store64(hll->data() + kCardPos, count);
+}
+
+bool HllRegisters::Merge(string_view hll) {
+  uint8_t* regs = regs_.data();
+  if (hll[kEncodingPos] == kDense) {
+    const uint8_t* src = Registers(hll);
+    for (unsigned i = 0; i < kHllRegisters; i += 4, src += 3) {
+      uint8_t unpacked[4];
+      UnpackGroup(src, unpacked);
+      for (unsigned j = 0; j < 4; ++j)
+        regs[i + j] = std::max(regs[i + j], unpacked[j]);
+    }
+    return true;
+  }
+
+  return ForEachSparseRun(hll, [regs](unsigned index, unsigned len, uint8_t value) {
+    for (unsigned i = index; i < index + len; ++i)
+      regs[i] = std::max(regs[i], value);
+  });
+}
+
+void HllRegisters::Merge(const HllRegisters& other) {
+  MaxMerge(other.regs_.data(), regs_.data());
+}
+
+uint64_t HllRegisters::Count() const {
+  unsigned histogram[64] = {0};
+  for (uint8_t reg : regs_)
+    ++histogram[reg & 63];
+
+  // Values past kQ + 1 are impossible, unless the value was crafted.
+  constexpr double m = kHllRegisters;
+  double z = m * Tau((m - histogram[kQ + 1]) / m);
+  for (int j = kQ; j >= 1; --j) {
+    z += histogram[j];
+    z *= 0.5;
+  }
+  z += m * Sigma(histogram[0] / m);
+
+  constexpr double kAlphaInf = 0.721347520444481703680;  // 1 / (2 * ln(2))
+  return llroundl(kAlphaInf * m * m / z);
+}
+
+std::string HllRegisters::ToHll(bool sparse, size_t sparse_max_bytes) const {
+  std::string res(kHeaderSize, 0);
+  memcpy(res.data(), kMagic, 4);
+  InvalidateCachedCount(&res);
+
+  const uint8_t* regs = regs_.data();
+  for (unsigned i = 0; sparse && i < kHllRegisters;) {
+    const uint8_t value = regs[i];
+    unsigned len = 1;
+    while (i + len < kHllRegisters && regs[i + len] == value)
+      ++len;
+    i += len;
+
+    if (value == 0) {
+      for (; len > kSparseZeroMaxLen; len -= std::min(len, kSparseXZeroMaxLen)) {
+        unsigned xzero = std::min(len, kSparseXZeroMaxLen) - 1;
+        res.push_back(kSparseXZeroBit | (xzero >> 8));
+        res.push_back(xzero & 0xff);
+      }
+      if (len > 0)
+        res.push_back(len - 1);
+    } else if (value > kSparseValMaxValue) {
+      sparse = false;
+    } else {
+      for (; len > 0; len -= std::min(len, kSparseValMaxLen)) {
+        res.push_back(kSparseValBit | ((value - 1) << 2) | (std::min(len, kSparseValMaxLen) - 1));
+      }
+    }
+    sparse &= res.size() <= sparse_max_bytes;
+  }
+
+  if (sparse) {
+    res[kEncodingPos] = kSparse;
+    return res;
+  }
+
+  res.resize(kDenseSize);
+  res[kEncodingPos] = kDense;
+  uint8_t* dest = Registers(&res);
+  for (unsigned i = 0; i < kHllRegisters; i += 4, dest += 3)
+    PackGroup(regs + i, dest);
+  return res;
+}
+
+}  // namespace dfly
@@ -0,0 +1,78 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/types/span.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// HyperLogLog values are strings in the format redis uses, so they can be read, dumped and
+// restored as any other string: a 16 byte header with the encoding and the cached cardinality,
+// followed by 2^14 registers of 6 bits. The registers are either packed (dense) or run length
+// encoded (sparse). Sparse values hold registers of up to 32 and become dense once they grow
+// past a size limit, and never go back.
+
+constexpr unsigned kHllRegisters = 1 << 14;
+
+// Returns true if value has a valid HyperLogLog header. The sparse registers are validated
+// only once they are read.
+bool IsHll(std::string_view value);
+
+// Requires: IsHll(hll).
+bool IsSparseHll(std::string_view hll);
+
+// Returns the value of an empty HyperLogLog.
+std::string MakeHll();
+
+// Adds the elements to hll, which must be a valid HyperLogLog. A sparse hll becomes dense if it
+// grows beyond sparse_max_bytes. Returns 1 if a register changed, in which case the cached
+// cardinality is invalidated, 0 otherwise and -1 if the sparse registers are corrupted.
+int HllAdd(absl::Span<const std::string_view> elements, size_t sparse_max_bytes,
+           std::string* hll);
+
+// Returns the cardinality cached in the header of a valid hll, unless it was invalidated.
+std::optional<uint64_t> HllCachedCount(std::string_view hll);
+void HllSetCachedCount(uint64_t count, std::string* hll);
+
+// The registers of HyperLogLogs, a byte for each, in which they are merged and counted.
+class HllRegisters {
+ public:
+  HllRegisters() : regs_(kHllRegisters, 0) {
+  }
+
+  // Sets every register to the maximum of its value and its value in hll, which must be a
+  // valid HyperLogLog. Returns false if the sparse registers of hll are corrupted.
+  bool Merge(std::string_view hll);
+
+  // Same, for other registers.
+  void Merge(const HllRegisters& other);
+
+  // Estimates the cardinality of the registers, as redis does.
+  uint64_t Count() const;
+
+  // Returns the HyperLogLog of the registers. It is sparse if sparse is true and its registers
+  // fit in sparse_max_bytes.
+  std::string ToHll(bool sparse, size_t sparse_max_bytes) const;
+
+  const uint8_t* data() const {
+    return regs_.data();
+  }
+
+  uint8_t* data() {
+    return regs_.data();
+  }
+
+ private:
+  std::vector<uint8_t> regs_;
+};
+
+}  // namespace dfly
@@ -0,0 +1,154 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/hyperloglog.h"
+
+#include <absl/strings/str_cat.h>
+
+#include <string>
+#include <vector>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+class HyperLogLogTest : public ::testing::Test {
+ protected:
+  // Adds the elements prefix0 .. prefix{n - 1} to hll, in batches.
+  static void AddRange(const char* prefix, unsigned n, size_t sparse_max_bytes, string* hll) {
+    vector<string> batch;
+    for (unsigned i = 0; i < n; ++i) {
+      batch.push_back(absl::StrCat(prefix, i));
+      if (batch.size() == 100 || i + 1 == n) {
+        vector<string_view> elements(batch.begin(), batch.end());
+        ASSERT_GE(HllAdd(elements, sparse_max_bytes, hll), 0);
+        batch.clear();
+      }
+    }
+  }
+
+  static uint64_t Count(string_view hll) {
+    HllRegisters regs;
+    CHECK(regs.Merge(hll));
+    return regs.Count();
+  }
+
+  static bool IsDense(string_view hll) {
+    return hll[4] == 0;
+  }
+};
+
+TEST_F(HyperLogLogTest, Empty) {
+  string hll = MakeHll();
+  EXPECT_TRUE(IsHll(hll));
+  EXPECT_FALSE(IsDense(hll));
+  EXPECT_EQ(0, HllCachedCount(hll));
+  EXPECT_EQ(0, Count(hll));
+
+  EXPECT_FALSE(IsHll("HYLL"));
+  EXPECT_FALSE(IsHll("not a hyperloglog"));
+  EXPECT_FALSE(IsHll(string("HYLL\0\0\0\0\0\0\0\0\0\0\0\0", 16)));  // dense without registers
+}
+
+TEST_F(HyperLogLogTest, Add) {
+  string hll = MakeHll();
+  vector<string_view> elements = {"a", "b", "c"};
+  EXPECT_EQ(1, HllAdd(elements, 3000, &hll));
+  EXPECT_EQ(0, HllAdd(elements, 3000, &hll));
+  EXPECT_FALSE(HllCachedCount(hll));
+  EXPECT_EQ(3, Count(hll));
+
+  HllSetCachedCount(3, &hll);
+  EXPECT_EQ(3, HllCachedCount(hll));
+  EXPECT_EQ(0, HllAdd(elements, 3000, &hll));
+  EXPECT_EQ(3, HllCachedCount(hll));
+
+  AddRange("x", 1000, 3000, &hll);
+  EXPECT_FALSE(HllCachedCount(hll));
+  EXPECT_FALSE(IsDense(hll));
+  EXPECT_NEAR(1003, Count(hll), 20);
+}
+
+TEST_F(HyperLogLogTest, Dense) {
+  string hll = MakeHll();
+  AddRange("x", 100000, 3000, &hll);
+  EXPECT_TRUE(IsDense(hll));
+  EXPECT_TRUE(IsHll(hll));
+  EXPECT_NEAR(100000, Count(hll), 2000);
+
+  string before = hll;
+  vector<string_view> elements = {"x0", "x1"};
+  EXPECT_EQ(0, HllAdd(elements, 3000, &hll));
+  EXPECT_EQ(before, hll);
+
+  // Small values turn dense only when allowed no sparse bytes.
+  string small = MakeHll();
+  AddRange("y", 10, 0, &small);
+  EXPECT_TRUE(IsDense(small));
+  EXPECT_EQ(10, Count(small));
+}
+
+TEST_F(HyperLogLogTest, Merge) {
+  string left = MakeHll(), right = MakeHll();
+  AddRange("x", 50000, 3000, &left);
+  AddRange("x", 100, 3000, &right);
+  AddRange("y", 20000, 3000, &right);
+
+  HllRegisters regs;
+  ASSERT_TRUE(regs.Merge(left));
+  HllRegisters other;
+  ASSERT_TRUE(other.Merge(right));
+  regs.Merge(other);
+  EXPECT_NEAR(70000, regs.Count(), 1400);
+
+  // A sparse value merged into empty registers is rebuilt as it was.
+  string sparse = MakeHll();
+  AddRange("z", 300, 3000, &sparse);
+  HllRegisters sparse_regs;
+  ASSERT_TRUE(sparse_regs.Merge(sparse));
+  EXPECT_EQ(sparse, sparse_regs.ToHll(true, 3000));
+
+  string dense = sparse_regs.ToHll(false, 3000);
+  EXPECT_TRUE(IsDense(dense));
+  EXPECT_EQ(Count(sparse), Count(dense));
+}
+
+TEST_F(HyperLogLogTest, Corrupted) {
+  string hll = MakeHll();
+  hll.pop_back();  // the XZERO opcode is cut.
+  ASSERT_TRUE(IsHll(hll));
+
+  HllRegisters regs;
+  EXPECT_FALSE(regs.Merge(hll));
+  vector<string_view> elements = {"a"};
+  EXPECT_EQ(-1, HllAdd(elements, 3000, &hll));
+
+  hll = MakeHll();
+  hll.push_back('\x01');  // covers registers past the last one
+  EXPECT_FALSE(regs.Merge(hll));
+}
+
+// Benchmarks
+static void BM_MergeDense(benchmark::State& state) {
+  string hll = MakeHll();
+  vector<string> batch;
+  for (unsigned i = 0; i < 100000; ++i)
+    batch.push_back(absl::StrCat(i));
+  vector<string_view> elements(batch.begin(), batch.end());
+  CHECK_EQ(1, HllAdd(elements, 3000, &hll));
+
+  HllRegisters regs, other;
+  CHECK(other.Merge(hll));
+  while (state.KeepRunning()) {
+    CHECK(regs.Merge(hll));
+    regs.Merge(other);
+  }
+  CHECK_GT(regs.Count(), 0u);
+}
+BENCHMARK(BM_MergeDense);
+
+}  // namespace dfly
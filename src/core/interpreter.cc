@@ -5,6 +5,7 @@
 #include "core/interpreter.h"
 
 #include <absl/strings/str_cat.h>
+#include <mimalloc.h>
 #include <openssl/evp.h>
 
 #include <cstring>
@@ -30,6 +31,12 @@ using namespace std;
 
 namespace {
 
+int LuaPanic(lua_State* lua) {
+  const char* msg = lua_tostring(lua, -1);
+  LOG(FATAL) << "Unprotected lua error: " << (msg ? msg : "unknown");
+  return 0;
+}
+
 // EVP_Q_digest is not present in the older versions of OpenSSL.
 int EVPDigest(const void* data, size_t datalen, unsigned char* md, size_t* mdlen) {
   unsigned int temp = 0;
@@ -40,6 +47,14 @@ int EVPDigest(const void* data, size_t datalen, unsigned char* md, size_t* mdlen
   return ret;
 }
 
+// fname must point to a buffer with at least 43 chars.
+void FuncName(string_view sha, char* fname) {
+  fname[0] = 'f';
+  fname[1] = '_';
+  memcpy(fname + 2, sha.data(), 40);
+  fname[42] = '\0';
+}
+
 class RedisTranslator : public ObjectExplorer {
  public:
   RedisTranslator(lua_State* lua) : lua_(lua) {
@@ -336,7 +351,9 @@ int RedisStatusReplyCommand(lua_State* lua) {
 }  // namespace
 
 Interpreter::Interpreter() {
-  lua_ = luaL_newstate();
+  lua_ = lua_newstate(LuaAlloc, this);
+  CHECK(lua_);
+  lua_atpanic(lua_, LuaPanic);
   InitLua(lua_);
   void** ptr = static_cast<void**>(lua_getextraspace(lua_));
   *ptr = this;
@@ -406,10 +423,7 @@ bool Interpreter::Exists(string_view sha) const {
     return false;
 
   char fname[43];
-  fname[0] = 'f';
-  fname[1] = '_';
-  fname[42] = '\0';
-  memcpy(fname + 2, sha.data(), 40);
+  FuncName(sha, fname);
 
   int type = lua_getglobal(lua_, fname);
   lua_pop(lua_, 1);
@@ -417,6 +431,71 @@ bool Interpreter::Exists(string_view sha) const {
   return type == LUA_TFUNCTION;
 }
 
+bool Interpreter::DumpFunction(string_view sha, string* bytecode) {
+  if (sha.size() != 40)
+    return false;
+
+  char fname[43];
+  FuncName(sha, fname);
+
+  auto writer = [](lua_State*, const void* p, size_t sz, void* ud) {
+    static_cast<string*>(ud)->append(static_cast<const char*>(p), sz);
+    return 0;
+  };
+
+  bool res = false;
+  if (lua_getglobal(lua_, fname) == LUA_TFUNCTION) {
+    bytecode->clear();
+    res = lua_dump(lua_, writer, bytecode, 0) == 0;  // keep the debug info for error messages.
+  }
+  lua_pop(lua_, 1);
+
+  return res;
+}
+
+bool Interpreter::AddBytecode(string_view sha, string_view bytecode, string* error) {
+  CHECK_EQ(40u, sha.size());
+
+  char fname[43];
+  FuncName(sha, fname);
+
+  // The function has no upvalues besides _ENV, which lua sets to the globals table.
+  int res = luaL_loadbufferx(lua_, bytecode.data(), bytecode.size(), "@user_script", "b");
+  if (res) {
+    error->assign(lua_tostring(lua_, -1));
+    lua_pop(lua_, 1);  // Remove the error.
+    return false;
+  }
+
+  lua_setglobal(lua_, fname);
+  return true;
+}
+
+void* Interpreter::LuaAlloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+  Interpreter* me = static_cast<Interpreter*>(ud);
+
+  // For new blocks osize encodes the type of the allocated object.
+  size_t old_size = ptr ? osize : 0;
+
+  if (nsize == 0) {
+    mi_free(ptr);
+    me->used_bytes_ -= old_size;
+    return nullptr;
+  }
+
+  // Lua expects that shrinking can not fail.
+  if (me->enforce_limit_ && nsize > old_size &&
+      me->used_bytes_ + (nsize - old_size) > me->run_start_bytes_ + me->memory_limit_) {
+    return nullptr;
+  }
+
+  void* res = mi_realloc(ptr, nsize);
+  if (res) {
+    me->used_bytes_ = me->used_bytes_ - old_size + nsize;
+  }
+  return res;
+}
+
 auto Interpreter::RunFunction(string_view sha, std::string* error) -> RunResult {
   DVLOG(1) << "RunFunction " << sha << " " << lua_gettop(lua_);
 
@@ -440,9 +519,20 @@ auto Interpreter::RunFunction(string_view sha, std::string* error) -> RunResult
 
   /* We have zero arguments and expect
    * a single return value. */
+  enforce_limit_ = memory_limit_ > 0;
+  run_start_bytes_ = used_bytes_;
+  if (interrupt_func_)
+    lua_sethook(lua_, InterruptHook, LUA_MASKCOUNT, kInterruptPeriod);
   int err = lua_pcall(lua_, 0, 1, -2);
+  lua_sethook(lua_, nullptr, 0, 0);
+  enforce_limit_ = false;
 
-  if (err) {
+  if (err == LUA_ERRMEM) {
+    *error = absl::StrCat("script exceeded the memory limit of ", memory_limit_, " bytes");
+
+    // Reclaim the garbage of the aborted script right away.
+    lua_gc(lua_, LUA_GCCOLLECT, 0);
+  } else if (err) {
     *error = lua_tostring(lua_, -1);
   }
 
@@ -654,10 +744,11 @@ int Interpreter::RedisGenericCommand(bool raise_error) {
     }
   }
 
-  // backing storage.
-  unique_ptr<char[]> blob(new char[blob_len + 8]);  // 8 safety.
-  vector<absl::Span<char>> cmdargs;
-  char* cur = blob.get();
+  // Backing storage. It is reused by the calls, so that the arguments are passed as views
+  // without allocating per call.
+  cmd_buf_.resize(blob_len + 8);  // 8 safety.
+  cmd_args_.clear();
+  char* cur = cmd_buf_.data();
   char* end = cur + blob_len;
 
   for (int j = 0; j < argc; j++) {
@@ -675,7 +766,7 @@ int Interpreter::RedisGenericCommand(bool raise_error) {
       memcpy(cur, lua_tostring(lua_, idx), len);  // copy \0 as well.
     }
 
-    cmdargs.emplace_back(cur, len);
+    cmd_args_.emplace_back(cur, len);
     cur += len;
   }
 
@@ -683,7 +774,7 @@ int Interpreter::RedisGenericCommand(bool raise_error) {
    * and this way we guaranty we will have room on the stack for the result. */
   lua_pop(lua_, argc);
   RedisTranslator translator(lua_);
-  redis_func_(MutSliceSpan{cmdargs}, &translator);
+  redis_func_(MutSliceSpan{cmd_args_}, &translator);
   DCHECK_EQ(1, lua_gettop(lua_));
 
   cmd_depth_--;
@@ -701,4 +792,15 @@ int Interpreter::RedisPCallCommand(lua_State* lua) {
   return reinterpret_cast<Interpreter*>(*ptr)->RedisGenericCommand(false);
 }
 
+void Interpreter::InterruptHook(lua_State* lua, lua_Debug* ar) {
+  void** ptr = static_cast<void**>(lua_getextraspace(lua));
+  Interpreter* me = reinterpret_cast<Interpreter*>(*ptr);
+
+  if (!me->interrupt_func_()) {
+    // Fails at every instruction from now on, so that pcall in the script does not catch it.
+    lua_sethook(lua, InterruptHook, LUA_MASKCOUNT, 1);
+    luaL_error(lua, "script was killed");
+  }
+}
+
 }  // namespace dfly
@@ -4,13 +4,15 @@
 
 #pragma once
 
-#include <boost/fiber/mutex.hpp>
 #include <functional>
+#include <string>
 #include <string_view>
+#include <vector>
 
 #include "core/core_types.h"
 
 typedef struct lua_State lua_State;
+typedef struct lua_Debug lua_Debug;
 
 namespace dfly {
 
@@ -34,6 +36,11 @@ class Interpreter {
  public:
   using RedisFunc = std::function<void(MutSliceSpan, ObjectExplorer*)>;
 
+  // Called every kInterruptPeriod instructions of a running function, it may yield the fiber.
+  // The function fails once it returns false.
+  using InterruptFunc = std::function<bool()>;
+  static constexpr int kInterruptPeriod = 100000;
+
   Interpreter();
   ~Interpreter();
 
@@ -59,6 +66,14 @@ class Interpreter {
 
   bool Exists(std::string_view sha) const;
 
+  // Dumps the precompiled bytecode of function sha into bytecode, so that other interpreters
+  // can add it via AddBytecode without compiling it. Returns false if sha does not exist.
+  bool DumpFunction(std::string_view sha, std::string* bytecode);
+
+  // Adds function sha from the bytecode produced by DumpFunction. Returns false and sets
+  // the error if the bytecode can not be loaded.
+  bool AddBytecode(std::string_view sha, std::string_view bytecode, std::string* error);
+
   enum RunResult {
     RUN_OK = 0,
     NOT_EXISTS = 1,
@@ -86,17 +101,26 @@ class Interpreter {
   // fp[40] will be set to '\0'.
   static void FuncSha1(std::string_view body, char* fp);
 
+  // Returns the number of bytes allocated by the lua state.
+  size_t MemoryUsage() const {
+    return used_bytes_;
+  }
+
+  // Functions that grow the lua state by more than limit bytes from its size when they started
+  // fail with an out of memory error, so that the scripts and the data that earlier ones left
+  // do not count. 0 means unlimited. The limit does not apply outside of RunFunction since lua
+  // can not handle allocation failures outside of protected calls.
+  void SetMemoryLimit(size_t limit) {
+    memory_limit_ = limit;
+  }
+
   template <typename U> void SetRedisFunc(U&& u) {
     redis_func_ = std::forward<U>(u);
   }
 
-  // We have interpreter per thread, not per connection.
-  // Since we might preempt into different fibers when operating on interpreter
-  // we must lock it until we finish using it per request.
-  // Only RunFunction with companions require locking since other functions perform atomically
-  // without preemptions.
-  std::lock_guard<::boost::fibers::mutex> Lock() {
-    return std::lock_guard<::boost::fibers::mutex>{mu_};
+  // Functions run without the instruction hook unless it is set.
+  template <typename U> void SetInterruptFunc(U&& u) {
+    interrupt_func_ = std::forward<U>(u);
   }
 
  private:
@@ -110,14 +134,24 @@ class Interpreter {
   static int RedisCallCommand(lua_State* lua);
   static int RedisPCallCommand(lua_State* lua);
 
+  // The instruction count hook of RunFunction.
+  static void InterruptHook(lua_State* lua, lua_Debug* ar);
+
+  // lua_Alloc function that allocates from the mimalloc heap of the thread.
+  static void* LuaAlloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
   lua_State* lua_;
+  size_t used_bytes_ = 0;
+  size_t memory_limit_ = 0;
+  size_t run_start_bytes_ = 0;  // used_bytes_ when RunFunction started.
+  bool enforce_limit_ = false;
   unsigned cmd_depth_ = 0;
   RedisFunc redis_func_;
+  InterruptFunc interrupt_func_;
 
-  // We have interpreter per thread, not per connection.
-  // Since we might preempt into different fibers when operating on interpreter
-  // we must lock it until we finish using it per request.
-  ::boost::fibers::mutex mu_;
+  // Arguments of the current redis.call. RedisGenericCommand is not reentrant.
+  std::string cmd_buf_;
+  std::vector<MutableSlice> cmd_args_;
 };
 
 }  // namespace dfly
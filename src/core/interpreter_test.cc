@@ -321,4 +321,92 @@ TEST_F(InterpreterTest, Modules) {
   EXPECT_EQ("str(\x1\x2test)", ser_.res);
 }
 
+TEST_F(InterpreterTest, MemoryLimit) {
+  EXPECT_GT(intptr_.MemoryUsage(), 0u);
+
+  // The globals that an earlier script left do not count.
+  EXPECT_TRUE(Execute("big = {} for i = 1, 200000 do big[i] = i end return #big"));
+  ASSERT_GT(intptr_.MemoryUsage(), 1u << 20);
+
+  intptr_.SetMemoryLimit(1 << 20);
+  EXPECT_TRUE(Execute("local t = {} for i = 1, 1000 do t[i] = tostring(i) end return #t"));
+  EXPECT_EQ("i(1000)", ser_.res);
+
+  EXPECT_FALSE(Execute("local t = {} for i = 1, 1000000 do t[i] = tostring(i) end return #t"));
+  EXPECT_THAT(error_, testing::HasSubstr("exceeded the memory limit"));
+  intptr_.ResetStack();
+
+  size_t used = intptr_.MemoryUsage();
+  EXPECT_TRUE(Execute("return 5"));
+  EXPECT_EQ("i(5)", ser_.res);
+  EXPECT_LT(intptr_.MemoryUsage(), used + (1 << 20));
+}
+
+TEST_F(InterpreterTest, Interrupt) {
+  unsigned calls = 0;
+  intptr_.SetInterruptFunc([&] { return ++calls < 3; });
+
+  // The script is stopped even though it catches the error.
+  EXPECT_FALSE(Execute("while true do pcall(function() while true do end end) end"));
+  EXPECT_THAT(error_, testing::HasSubstr("script was killed"));
+  EXPECT_GE(calls, 3u);
+  intptr_.ResetStack();
+
+  calls = 0;
+  EXPECT_TRUE(Execute("local s = 0 for i = 1, 300000 do s = s + i end return s"));
+  EXPECT_EQ("i(45000150000)", ser_.res);
+  EXPECT_GT(calls, 0u);
+}
+
+TEST_F(InterpreterTest, Bytecode) {
+  string sha;
+  ASSERT_EQ(Interpreter::ADD_OK, intptr_.AddFunction("return {ARGV[1], 2}", &sha));
+
+  string bytecode;
+  ASSERT_TRUE(intptr_.DumpFunction(sha, &bytecode));
+  EXPECT_FALSE(intptr_.DumpFunction(string(40, '0'), &bytecode));
+
+  Interpreter other;
+  EXPECT_FALSE(other.Exists(sha));
+  ASSERT_TRUE(other.AddBytecode(sha, bytecode, &error_));
+  EXPECT_TRUE(other.Exists(sha));
+
+  vector<string> argv{"foo"};
+  vector<MutableSlice> slices{MutableSlice{argv[0]}};
+  other.SetGlobalArray("ARGV", MutSliceSpan{slices});
+  ASSERT_EQ(Interpreter::RUN_OK, other.RunFunction(sha, &error_));
+  other.SerializeResult(&ser_);
+  EXPECT_EQ("[str(foo) i(2)]", ser_.res);
+
+  EXPECT_FALSE(other.AddBytecode(sha, "return 1", &error_));
+}
+
+// Measures redis.call invocations per second with a trivial redis function.
+static void BM_RedisCall(benchmark::State& state) {
+  constexpr unsigned kCallsPerRun = 1000;
+
+  Interpreter interpreter;
+  interpreter.SetRedisFunc([](MutSliceSpan span, ObjectExplorer* reply) {
+    reply->OnInt(span.size());
+  });
+
+  string sha;
+  CHECK_EQ(Interpreter::ADD_OK,
+           interpreter.AddFunction(absl::StrCat("for i = 1, ", kCallsPerRun,
+                                                " do redis.call('incrby', KEYS[1], i) end"),
+                                   &sha));
+
+  vector<string> keys{"rate"};
+  vector<MutableSlice> slices{MutableSlice{keys[0]}};
+  interpreter.SetGlobalArray("KEYS", MutSliceSpan{slices});
+
+  string error;
+  while (state.KeepRunning()) {
+    CHECK_EQ(Interpreter::RUN_OK, interpreter.RunFunction(sha, &error));
+    interpreter.ResetStack();
+  }
+  state.SetItemsProcessed(state.iterations() * kCallsPerRun);
+}
+BENCHMARK(BM_RedisCall);
+
 }  // namespace dfly
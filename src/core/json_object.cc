@@ -10,9 +10,67 @@ extern "C" {
 #include <jsoncons/json.hpp>
 
 #include "base/logging.h"
+#include "core/json_pack.h"
 
 namespace dfly {
 
+namespace {
+
+void Pack(const JsonType& j, PackedJsonBuilder* builder) {
+  using namespace jsoncons;
+
+  switch (j.type()) {
+    case json_type::null_value:
+      builder->Null();
+      break;
+    case json_type::bool_value:
+      builder->Bool(j.as_bool());
+      break;
+    case json_type::int64_value:
+      builder->Int(j.as<int64_t>());
+      break;
+    case json_type::uint64_value:
+      builder->Uint(j.as<uint64_t>());
+      break;
+    case json_type::half_value:
+    case json_type::double_value:
+      builder->Double(j.as_double());
+      break;
+    case json_type::string_value:
+      // The parser keeps the integers that do not fit 64 bits as their text.
+      if (j.tag() == semantic_tag::bigint || j.tag() == semantic_tag::bigdec) {
+        builder->NumberText(j.as_string_view());
+      } else {
+        builder->String(j.as_string_view());
+      }
+      break;
+    case json_type::array_value:
+      builder->StartArray(j.size());
+      for (const auto& item : j.array_range()) {
+        Pack(item, builder);
+      }
+      builder->End();
+      break;
+    case json_type::object_value:
+      builder->StartObject(j.size());
+      for (const auto& item : j.object_range()) {
+        builder->Key(item.key());
+        Pack(item.value(), builder);
+      }
+      builder->End();
+      break;
+    default:
+      // Byte strings do not come from JSON text, they are packed as the text they print as.
+      builder->String(j.as_string());
+  }
+}
+
+void FormatDouble(double val, std::string* dest) {
+  dest->append(JsonType(val).to_string());
+}
+
+}  // namespace
+
 std::optional<JsonType> JsonFromString(std::string_view input) {
   using namespace jsoncons;
 
@@ -34,4 +92,59 @@ std::optional<JsonType> JsonFromString(std::string_view input) {
   return {};
 }
 
+void PackJson(const JsonType& j, std::string* dest) {
+  PackedJsonBuilder builder(dest);
+  Pack(j, &builder);
+  DCHECK(builder.done());
+}
+
+JsonType UnpackJson(const PackedJson& packed) {
+  using namespace jsoncons;
+
+  switch (packed.type()) {
+    case PackedJson::NIL:
+      return JsonType::null();
+    case PackedJson::FALSE_VAL:
+    case PackedJson::TRUE_VAL:
+      return JsonType(packed.AsBool());
+    case PackedJson::INT64:
+      return JsonType(packed.AsInt());
+    case PackedJson::UINT64:
+      return JsonType(packed.AsUint());
+    case PackedJson::DOUBLE:
+      return JsonType(packed.AsDouble());
+    case PackedJson::STRING: {
+      std::string_view str = packed.AsString();
+      return JsonType(str.data(), str.size());
+    }
+    case PackedJson::NUMBER_TEXT: {
+      std::string_view str = packed.AsString();
+      return JsonType(str.data(), str.size(), semantic_tag::bigint);
+    }
+    case PackedJson::ARRAY: {
+      JsonType res(json_array_arg);
+      res.reserve(packed.size());
+      for (uint32_t i = 0; i < packed.size(); ++i) {
+        res.push_back(UnpackJson(packed.At(i)));
+      }
+      return res;
+    }
+    case PackedJson::OBJECT: {
+      // The members come in the order of the keys, so they are appended to the object.
+      JsonType res(json_object_arg);
+      res.reserve(packed.size());
+      for (uint32_t i = 0; i < packed.size(); ++i) {
+        res.try_emplace(packed.KeyAt(i), UnpackJson(packed.At(i)));
+      }
+      return res;
+    }
+  }
+  LOG(DFATAL) << "Unknown packed type " << int(packed.type());
+  return JsonType::null();
+}
+
+void PackedJsonToString(const PackedJson& packed, std::string* dest) {
+  packed.ToJson(dest, FormatDouble);
+}
+
 }  // namespace dfly
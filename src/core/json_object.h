@@ -7,6 +7,7 @@
 #include <memory>
 #include <memory_resource>
 #include <optional>
+#include <string>
 #include <string_view>
 
 // Note about this file - once we have the issue with jsonpath in jsoncons resolved
@@ -25,6 +26,8 @@ constexpr unsigned OBJ_JSON = 15;
 
 namespace dfly {
 
+class PackedJson;
+
 // This is temporary, there is an issue right now with jsoncons about using jsonpath
 // with custom allocator. once it would resolved, we would change this to use custom allocator
 // that allocate memory from mimalloc
@@ -33,4 +36,14 @@ using JsonType = jsoncons::basic_json<char, jsoncons::sorted_policy, std::alloca
 // Build a json object from string. If the string is not legal json, will return nullopt
 std::optional<JsonType> JsonFromString(std::string_view input);
 
+// Appends the packed form of j, see json_pack.h.
+void PackJson(const JsonType& j, std::string* dest);
+
+// Builds the document of a packed value.
+JsonType UnpackJson(const PackedJson& packed);
+
+// Appends the JSON text of a packed value, the same text that JsonType::to_string() returns
+// for its document.
+void PackedJsonToString(const PackedJson& packed, std::string* dest);
+
 }  // namespace dfly
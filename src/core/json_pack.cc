@@ -0,0 +1,482 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/json_pack.h"
+
+#include <absl/base/internal/endian.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+void AppendVarint(uint64_t val, string* dest) {
+  while (val >= 0x80) {
+    dest->push_back(char(val | 0x80));
+    val >>= 7;
+  }
+  dest->push_back(char(val));
+}
+
+// Returns the value and advances *src past it.
+uint64_t ReadVarint(const char** src) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(*src);
+  uint64_t res = 0;
+  for (unsigned shift = 0;; shift += 7) {
+    uint8_t b = *p++;
+    res |= uint64_t(b & 0x7f) << shift;
+    if (b < 0x80)
+      break;
+  }
+  *src = reinterpret_cast<const char*>(p);
+  return res;
+}
+
+string_view ReadString(const char* src) {
+  size_t len = ReadVarint(&src);
+  return string_view(src, len);
+}
+
+void AppendEscaped(string_view str, string* dest) {
+  static constexpr char kHex[] = "0123456789ABCDEF";
+
+  dest->push_back('"');
+  for (char c : str) {
+    switch (c) {
+      case '"':
+        dest->append("\\\"");
+        break;
+      case '\\':
+        dest->append("\\\\");
+        break;
+      case '\b':
+        dest->append("\\b");
+        break;
+      case '\f':
+        dest->append("\\f");
+        break;
+      case '\n':
+        dest->append("\\n");
+        break;
+      case '\r':
+        dest->append("\\r");
+        break;
+      case '\t':
+        dest->append("\\t");
+        break;
+      default:
+        if (uint8_t(c) < 0x20) {
+          dest->append("\\u00");
+          dest->push_back(kHex[uint8_t(c) >> 4]);
+          dest->push_back(kHex[c & 0xf]);
+        } else {
+          dest->push_back(c);
+        }
+    }
+  }
+  dest->push_back('"');
+}
+
+// Nesting deeper than jsoncons parses is rejected as well.
+constexpr unsigned kMaxDepth = 1024;
+
+bool ReadVarint(const char** src, const char* end, uint64_t* val) {
+  *val = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    if (*src == end)
+      return false;
+    uint8_t b = *(*src)++;
+    *val |= uint64_t(b & 0x7f) << shift;
+    if (b < 0x80)
+      return true;
+  }
+  return false;
+}
+
+// Returns the end of the value that starts at p, or nullptr if it is malformed. The values
+// of a container must follow each other in the order of their offsets.
+const char* ValidateValue(const char* p, const char* end, unsigned depth) {
+  if (p == end)
+    return nullptr;
+
+  uint8_t type = *p++;
+  uint64_t len;
+  switch (type) {
+    case PackedJson::NIL:
+    case PackedJson::FALSE_VAL:
+    case PackedJson::TRUE_VAL:
+      return p;
+    case PackedJson::INT64:
+    case PackedJson::UINT64:
+    case PackedJson::DOUBLE:
+      return end - p >= 8 ? p + 8 : nullptr;
+    case PackedJson::STRING:
+    case PackedJson::NUMBER_TEXT:
+      if (!ReadVarint(&p, end, &len) || len > uint64_t(end - p))
+        return nullptr;
+      return p + len;
+    case PackedJson::ARRAY:
+    case PackedJson::OBJECT:
+      break;
+    default:
+      return nullptr;
+  }
+
+  uint64_t count;
+  if (depth >= kMaxDepth || !ReadVarint(&p, end, &count) || count > UINT32_MAX ||
+      4 + 4 * count > uint64_t(end - p)) {
+    return nullptr;
+  }
+
+  const char* offsets = p + 4;
+  const char* payload = offsets + 4 * count;
+  uint32_t payload_len = absl::little_endian::Load32(p);
+  if (payload_len > end - payload)
+    return nullptr;
+
+  const char* payload_end = payload + payload_len;
+  const char* cur = payload;
+  string_view prev_key;
+  for (uint64_t i = 0; i < count; ++i) {
+    if (absl::little_endian::Load32(offsets + 4 * i) != cur - payload)
+      return nullptr;
+
+    if (type == PackedJson::OBJECT) {
+      if (!ReadVarint(&cur, payload_end, &len) || len > uint64_t(payload_end - cur))
+        return nullptr;
+      string_view key(cur, len);
+      if (i > 0 && !(prev_key < key))
+        return nullptr;
+      prev_key = key;
+      cur += len;
+    }
+
+    cur = ValidateValue(cur, payload_end, depth + 1);
+    if (!cur)
+      return nullptr;
+  }
+
+  return cur == payload_end ? cur : nullptr;
+}
+
+// The shortest text that reads back as val, with a fraction so that it reads back as a double.
+void FormatDouble(double val, string* dest) {
+  char buf[32];
+  int len = 0;
+  for (int precision = 1; precision <= 17; ++precision) {
+    len = snprintf(buf, sizeof(buf), "%.*g", precision, val);
+    if (strtod(buf, nullptr) == val)
+      break;
+  }
+
+  string_view res(buf, len);
+  dest->append(res);
+  if (res.find_first_of(".en") == string_view::npos)
+    dest->append(".0");
+}
+
+}  // namespace
+
+bool PackedJson::Validate(string_view data) {
+  const char* end = data.data() + data.size();
+  return ValidateValue(data.data(), end, 0) == end;
+}
+
+int64_t PackedJson::AsInt() const {
+  switch (type()) {
+    case INT64:
+      return absl::little_endian::Load64(ptr_ + 1);
+    case UINT64:
+      return int64_t(AsUint());
+    case DOUBLE:
+      return int64_t(AsDouble());
+    default:
+      return 0;
+  }
+}
+
+uint64_t PackedJson::AsUint() const {
+  switch (type()) {
+    case INT64:
+      return uint64_t(AsInt());
+    case UINT64:
+      return absl::little_endian::Load64(ptr_ + 1);
+    case DOUBLE:
+      return uint64_t(AsDouble());
+    default:
+      return 0;
+  }
+}
+
+double PackedJson::AsDouble() const {
+  switch (type()) {
+    case INT64:
+      return double(AsInt());
+    case UINT64:
+      return double(AsUint());
+    case DOUBLE: {
+      uint64_t bits = absl::little_endian::Load64(ptr_ + 1);
+      double res;
+      memcpy(&res, &bits, sizeof(res));
+      return res;
+    }
+    default:
+      return 0;
+  }
+}
+
+string_view PackedJson::AsString() const {
+  DCHECK(type() == STRING || type() == NUMBER_TEXT);
+  return ReadString(ptr_ + 1);
+}
+
+auto PackedJson::ParseContainer() const -> Container {
+  DCHECK(type() == ARRAY || type() == OBJECT);
+
+  Container res;
+  const char* p = ptr_ + 1;
+  res.count = ReadVarint(&p);
+  res.payload_len = absl::little_endian::Load32(p);
+  res.offsets = p + 4;
+  res.payload = res.offsets + 4 * size_t(res.count);
+  return res;
+}
+
+uint32_t PackedJson::size() const {
+  if (IsScalar())
+    return 0;
+  const char* p = ptr_ + 1;
+  return ReadVarint(&p);
+}
+
+PackedJson PackedJson::At(uint32_t i) const {
+  Container c = ParseContainer();
+  DCHECK_LT(i, c.count);
+
+  const char* p = c.payload + absl::little_endian::Load32(c.offsets + 4 * i);
+  if (type() == OBJECT) {
+    size_t key_len = ReadVarint(&p);
+    p += key_len;
+  }
+  return PackedJson(string_view(p, 0));
+}
+
+string_view PackedJson::KeyAt(uint32_t i) const {
+  DCHECK_EQ(OBJECT, type());
+  Container c = ParseContainer();
+  DCHECK_LT(i, c.count);
+
+  return ReadString(c.payload + absl::little_endian::Load32(c.offsets + 4 * i));
+}
+
+optional<PackedJson> PackedJson::Find(string_view key) const {
+  DCHECK_EQ(OBJECT, type());
+  Container c = ParseContainer();
+
+  uint32_t lo = 0, hi = c.count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    const char* p = c.payload + absl::little_endian::Load32(c.offsets + 4 * mid);
+    size_t key_len = ReadVarint(&p);
+    int cmp = string_view(p, key_len).compare(key);
+    if (cmp == 0)
+      return PackedJson(string_view(p + key_len, 0));
+    if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return nullopt;
+}
+
+size_t PackedJson::ByteSize() const {
+  switch (type()) {
+    case NIL:
+    case FALSE_VAL:
+    case TRUE_VAL:
+      return 1;
+    case INT64:
+    case UINT64:
+    case DOUBLE:
+      return 9;
+    case STRING:
+    case NUMBER_TEXT: {
+      string_view str = AsString();
+      return str.data() + str.size() - ptr_;
+    }
+    case ARRAY:
+    case OBJECT: {
+      Container c = ParseContainer();
+      return c.payload + c.payload_len - ptr_;
+    }
+  }
+  LOG(DFATAL) << "Unknown type " << int(type());
+  return 1;
+}
+
+void PackedJson::ToJson(string* dest, DoubleFormatter fmt) const {
+  switch (type()) {
+    case NIL:
+      dest->append("null");
+      break;
+    case FALSE_VAL:
+      dest->append("false");
+      break;
+    case TRUE_VAL:
+      dest->append("true");
+      break;
+    case INT64:
+      dest->append(to_string(AsInt()));
+      break;
+    case UINT64:
+      dest->append(to_string(AsUint()));
+      break;
+    case DOUBLE:
+      (fmt ? fmt : FormatDouble)(AsDouble(), dest);
+      break;
+    case STRING:
+      AppendEscaped(AsString(), dest);
+      break;
+    case NUMBER_TEXT:
+      dest->append(AsString());
+      break;
+    case ARRAY:
+    case OBJECT: {
+      bool is_object = type() == OBJECT;
+      uint32_t count = size();
+      dest->push_back(is_object ? '{' : '[');
+      for (uint32_t i = 0; i < count; ++i) {
+        if (i > 0)
+          dest->push_back(',');
+        if (is_object) {
+          AppendEscaped(KeyAt(i), dest);
+          dest->push_back(':');
+        }
+        At(i).ToJson(dest, fmt);
+      }
+      dest->push_back(is_object ? '}' : ']');
+      break;
+    }
+  }
+}
+
+void PackedJsonBuilder::Null() {
+  StartValue(PackedJson::NIL);
+}
+
+void PackedJsonBuilder::Bool(bool val) {
+  StartValue(val ? PackedJson::TRUE_VAL : PackedJson::FALSE_VAL);
+}
+
+void PackedJsonBuilder::Int(int64_t val) {
+  StartValue(PackedJson::INT64);
+  char buf[8];
+  absl::little_endian::Store64(buf, val);
+  dest_->append(buf, 8);
+}
+
+void PackedJsonBuilder::Uint(uint64_t val) {
+  StartValue(PackedJson::UINT64);
+  char buf[8];
+  absl::little_endian::Store64(buf, val);
+  dest_->append(buf, 8);
+}
+
+void PackedJsonBuilder::Double(double val) {
+  StartValue(PackedJson::DOUBLE);
+  uint64_t bits;
+  memcpy(&bits, &val, sizeof(bits));
+  char buf[8];
+  absl::little_endian::Store64(buf, bits);
+  dest_->append(buf, 8);
+}
+
+void PackedJsonBuilder::String(string_view val) {
+  StartValue(PackedJson::STRING);
+  AppendVarint(val.size(), dest_);
+  dest_->append(val);
+}
+
+void PackedJsonBuilder::NumberText(string_view val) {
+  StartValue(PackedJson::NUMBER_TEXT);
+  AppendVarint(val.size(), dest_);
+  dest_->append(val);
+}
+
+void PackedJsonBuilder::StartArray(uint32_t size) {
+  StartContainer(PackedJson::ARRAY, size);
+}
+
+void PackedJsonBuilder::StartObject(uint32_t size) {
+  StartContainer(PackedJson::OBJECT, size);
+}
+
+void PackedJsonBuilder::Key(string_view key) {
+  DCHECK(!stack_.empty() && stack_.back().is_object);
+#ifndef NDEBUG
+  if (const Frame& f = stack_.back(); f.next > 0) {
+    const char* offsets = dest_->data() + f.len_pos + 4;
+    const char* payload = offsets + 4 * size_t(f.count);
+    string_view prev =
+        ReadString(payload + absl::little_endian::Load32(offsets + 4 * (f.next - 1)));
+    DCHECK_LT(prev, key) << "the keys must be added in ascending order";
+  }
+#endif
+
+  AddOffset();
+  AppendVarint(key.size(), dest_);
+  dest_->append(key);
+}
+
+void PackedJsonBuilder::End() {
+  DCHECK(!stack_.empty());
+  const Frame& f = stack_.back();
+  DCHECK_EQ(f.next, f.count) << "the container is not full";
+
+  size_t payload_pos = f.len_pos + 4 + 4 * size_t(f.count);
+  size_t payload_len = dest_->size() - payload_pos;
+  CHECK_LE(payload_len, UINT32_MAX);
+  absl::little_endian::Store32(dest_->data() + f.len_pos, payload_len);
+  stack_.pop_back();
+}
+
+void PackedJsonBuilder::StartValue(PackedJson::Type type) {
+  if (!stack_.empty() && !stack_.back().is_object)
+    AddOffset();
+  dest_->push_back(char(type));
+}
+
+void PackedJsonBuilder::StartContainer(PackedJson::Type type, uint32_t size) {
+  StartValue(type);
+  AppendVarint(size, dest_);
+
+  Frame f;
+  f.len_pos = dest_->size();
+  f.count = size;
+  f.is_object = type == PackedJson::OBJECT;
+  stack_.push_back(f);
+
+  // The length and the offsets are filled as the container grows.
+  dest_->resize(dest_->size() + 4 + 4 * size_t(size));
+}
+
+void PackedJsonBuilder::AddOffset() {
+  Frame& f = stack_.back();
+  DCHECK_LT(f.next, f.count) << "the container is full";
+
+  char* offsets = dest_->data() + f.len_pos + 4;
+  size_t payload_pos = f.len_pos + 4 + 4 * size_t(f.count);
+  absl::little_endian::Store32(offsets + 4 * f.next, dest_->size() - payload_pos);
+  ++f.next;
+}
+
+}  // namespace dfly
@@ -0,0 +1,156 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// A read-only view of a JSON value in the packed binary form, which takes about as much memory
+// as the JSON text and is read without parsing. A value starts with its type byte:
+//
+//   NIL, FALSE_VAL, TRUE_VAL: no payload.
+//   INT64, UINT64, DOUBLE: 8 bytes, little endian.
+//   STRING, NUMBER_TEXT: varint length, the bytes.
+//   ARRAY, OBJECT: varint count, 4 bytes payload length, count offsets of 4 bytes, the payload,
+//     i.e. the elements, or the members of the object ordered by their keys. A member is
+//     the varint length of the key, the key and the value.
+//
+// The offsets are relative to the payload, so an element is found in O(1) and a member
+// by a binary search over the keys. The numbers have a fixed width, hence a number can be
+// replaced in place by another one without moving the rest of the document.
+class PackedJson {
+ public:
+  enum Type : uint8_t {
+    NIL = 0,
+    FALSE_VAL = 1,
+    TRUE_VAL = 2,
+    INT64 = 3,
+    UINT64 = 4,
+    DOUBLE = 5,
+    STRING = 6,
+    NUMBER_TEXT = 7,  // a number that does not fit 64 bits, kept as its text.
+    ARRAY = 8,
+    OBJECT = 9,
+  };
+
+  // Formats a double for ToJson(), appending it to dest.
+  using DoubleFormatter = void (*)(double, std::string* dest);
+
+  // data must start with a value that was packed by PackedJsonBuilder.
+  explicit PackedJson(std::string_view data) : ptr_(data.data()) {
+  }
+
+  // Returns true if data is exactly one well-formed packed value, as PackedJsonBuilder packs
+  // it. The accessors do not check the bounds, so the untrusted inputs must be validated.
+  static bool Validate(std::string_view data);
+
+  Type type() const {
+    return Type(*ptr_);
+  }
+
+  bool IsScalar() const {
+    return type() < ARRAY;
+  }
+
+  bool AsBool() const {
+    return type() == TRUE_VAL;
+  }
+
+  int64_t AsInt() const;
+  uint64_t AsUint() const;
+  double AsDouble() const;
+
+  // Requires: STRING or NUMBER_TEXT.
+  std::string_view AsString() const;
+
+  // The number of the elements of an array or of the members of an object, 0 for scalars.
+  uint32_t size() const;
+
+  // Requires: ARRAY or OBJECT, i < size(). Returns the element or the value of the member.
+  PackedJson At(uint32_t i) const;
+
+  // Requires: OBJECT, i < size().
+  std::string_view KeyAt(uint32_t i) const;
+
+  // Requires: OBJECT. Returns the value of the member with the key, if there is one.
+  std::optional<PackedJson> Find(std::string_view key) const;
+
+  // The size of the packed value, including the nested ones.
+  size_t ByteSize() const;
+
+  // Points to the type byte, used to locate the value in the document.
+  const char* data() const {
+    return ptr_;
+  }
+
+  // Appends the compact JSON text of the value to dest. fmt formats the doubles, by default
+  // with the shortest text that reads back exactly.
+  void ToJson(std::string* dest, DoubleFormatter fmt = nullptr) const;
+
+ private:
+  struct Container {
+    uint32_t count;
+    uint32_t payload_len;
+    const char* offsets;
+    const char* payload;
+  };
+
+  Container ParseContainer() const;
+
+  const char* ptr_;
+};
+
+// Packs a value into dest, appending it. The containers are written in one pass: their sizes
+// must be known when they are started, and the keys of an object must be added in ascending
+// order.
+class PackedJsonBuilder {
+ public:
+  explicit PackedJsonBuilder(std::string* dest) : dest_(dest) {
+  }
+
+  void Null();
+  void Bool(bool val);
+  void Int(int64_t val);
+  void Uint(uint64_t val);
+  void Double(double val);
+  void String(std::string_view val);
+  void NumberText(std::string_view val);
+
+  // Start a container of size values, fill it and call End().
+  void StartArray(uint32_t size);
+  void StartObject(uint32_t size);
+
+  // Adds the key of the next member of the current object, which is followed by its value.
+  void Key(std::string_view key);
+
+  void End();
+
+  // True when all the started containers are finished.
+  bool done() const {
+    return stack_.empty();
+  }
+
+ private:
+  struct Frame {
+    size_t len_pos;  // of the payload length, which is followed by the offsets.
+    uint32_t count;
+    uint32_t next = 0;
+    bool is_object;
+  };
+
+  void StartValue(PackedJson::Type type);
+  void StartContainer(PackedJson::Type type, uint32_t size);
+  void AddOffset();
+
+  std::string* dest_;
+  std::vector<Frame> stack_;
+};
+
+}  // namespace dfly
@@ -0,0 +1,118 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/json_pack.h"
+
+#include <gtest/gtest.h>
+
+namespace dfly {
+
+using namespace std;
+
+class JsonPackTest : public ::testing::Test {};
+
+TEST_F(JsonPackTest, Scalars) {
+  string blob;
+  PackedJsonBuilder builder(&blob);
+  builder.StartArray(8);
+  builder.Null();
+  builder.Bool(true);
+  builder.Int(-5);
+  builder.Uint(UINT64_MAX);
+  builder.Double(2.5);
+  builder.Double(3);
+  builder.String("a\"b\n");
+  builder.NumberText("123456789012345678901234567890");
+  builder.End();
+  ASSERT_TRUE(builder.done());
+
+  PackedJson arr(blob);
+  ASSERT_EQ(PackedJson::ARRAY, arr.type());
+  ASSERT_EQ(8, arr.size());
+  EXPECT_EQ(blob.size(), arr.ByteSize());
+  EXPECT_EQ(PackedJson::NIL, arr.At(0).type());
+  EXPECT_TRUE(arr.At(1).AsBool());
+  EXPECT_EQ(-5, arr.At(2).AsInt());
+  EXPECT_EQ(UINT64_MAX, arr.At(3).AsUint());
+  EXPECT_EQ(2.5, arr.At(4).AsDouble());
+  EXPECT_EQ("a\"b\n", arr.At(6).AsString());
+
+  string text;
+  arr.ToJson(&text);
+  EXPECT_EQ(
+      R"([null,true,-5,18446744073709551615,2.5,3.0,"a\"b\n",123456789012345678901234567890])",
+      text);
+}
+
+TEST_F(JsonPackTest, Nested) {
+  string blob;
+  PackedJsonBuilder builder(&blob);
+  builder.StartObject(3);
+  builder.Key("a");
+  builder.StartArray(2);
+  builder.Int(1);
+  builder.StartObject(0);
+  builder.End();
+  builder.End();
+  builder.Key("b");
+  builder.String("x");
+  builder.Key("c");
+  builder.Double(0.1);
+  builder.End();
+  ASSERT_TRUE(builder.done());
+
+  ASSERT_TRUE(PackedJson::Validate(blob));
+  for (size_t len = 0; len < blob.size(); ++len) {
+    EXPECT_FALSE(PackedJson::Validate(blob.substr(0, len))) << len;
+  }
+  string corrupted = blob;
+  corrupted[0] = 10;
+  EXPECT_FALSE(PackedJson::Validate(corrupted));
+
+  PackedJson obj(blob);
+  ASSERT_EQ(3, obj.size());
+  EXPECT_EQ(blob.size(), obj.ByteSize());
+  EXPECT_EQ("b", obj.KeyAt(1));
+  EXPECT_FALSE(obj.Find("d"));
+  EXPECT_FALSE(obj.Find(""));
+
+  auto a = obj.Find("a");
+  ASSERT_TRUE(a);
+  EXPECT_EQ(2, a->size());
+  EXPECT_EQ(PackedJson::OBJECT, a->At(1).type());
+  EXPECT_EQ(0, a->At(1).size());
+  EXPECT_EQ("x", obj.Find("b")->AsString());
+  EXPECT_EQ(0.1, obj.Find("c")->AsDouble());
+
+  string text;
+  obj.ToJson(&text);
+  EXPECT_EQ(R"({"a":[1,{}],"b":"x","c":0.1})", text);
+}
+
+TEST_F(JsonPackTest, LargeObject) {
+  constexpr unsigned kNum = 1000;
+  string blob;
+  PackedJsonBuilder builder(&blob);
+  builder.StartObject(kNum);
+  for (unsigned i = 0; i < kNum; ++i) {
+    char key[8];
+    snprintf(key, sizeof(key), "k%04u", i);
+    builder.Key(key);
+    builder.Uint(i);
+  }
+  builder.End();
+
+  PackedJson obj(blob);
+  for (unsigned i = 0; i < kNum; ++i) {
+    char key[8];
+    snprintf(key, sizeof(key), "k%04u", i);
+    auto val = obj.Find(key);
+    ASSERT_TRUE(val) << key;
+    EXPECT_EQ(i, val->AsUint());
+  }
+  EXPECT_FALSE(obj.Find("k1000"));
+  EXPECT_FALSE(obj.Find("a"));
+}
+
+}  // namespace dfly
@@ -0,0 +1,67 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/key_prefix_table.h"
+
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+KeyPrefixTable::KeyPrefixTable(string_view delimiters) : delimiters_(delimiters) {
+}
+
+size_t KeyPrefixTable::PrefixLen(string_view key) const {
+  size_t pos = key.find_last_of(delimiters_);
+  return pos == string_view::npos ? 0 : pos + 1;
+}
+
+uint16_t KeyPrefixTable::Acquire(string_view prefix) {
+  auto it = ids_.find(prefix);
+  if (it != ids_.end()) {
+    ++entries_[it->second].refs;
+    return it->second;
+  }
+
+  uint16_t id;
+  if (!free_ids_.empty()) {
+    id = free_ids_.back();
+    free_ids_.pop_back();
+  } else {
+    if (entries_.size() == kInvalidId)
+      return kInvalidId;
+    id = entries_.size();
+    entries_.emplace_back();
+  }
+
+  Entry& entry = entries_[id];
+  entry.str.assign(prefix);
+  entry.refs = 1;
+  ids_.emplace(entry.str, id);
+  bytes_ += entry.str.capacity() > 15 ? entry.str.capacity() : 0;
+
+  return id;
+}
+
+void KeyPrefixTable::Release(uint16_t id) {
+  DCHECK_LT(id, entries_.size());
+  Entry& entry = entries_[id];
+  DCHECK_GT(entry.refs, 0u);
+
+  if (--entry.refs > 0)
+    return;
+
+  ids_.erase(entry.str);
+  bytes_ -= entry.str.capacity() > 15 ? entry.str.capacity() : 0;
+  string{}.swap(entry.str);
+  free_ids_.push_back(id);
+}
+
+size_t KeyPrefixTable::MallocUsed() const {
+  return bytes_ + entries_.size() * sizeof(Entry) + free_ids_.capacity() * sizeof(uint16_t) +
+         ids_.capacity() * (sizeof(pair<string_view, uint16_t>) + 1);
+}
+
+}  // namespace dfly
@@ -0,0 +1,65 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// Reference counted dictionary of the key prefixes that end with a delimiter, e.g.
+// "svc:eu:tenant7:" of "svc:eu:tenant7:order:81". The keys of a thread that share a prefix keep
+// its 16 bit id instead of its bytes, so that their suffixes fit inline in CompactObj.
+// Not thread safe, every shard thread has its own table.
+class KeyPrefixTable {
+ public:
+  static constexpr uint16_t kInvalidId = UINT16_MAX;
+
+  explicit KeyPrefixTable(std::string_view delimiters);
+
+  KeyPrefixTable(const KeyPrefixTable&) = delete;
+  KeyPrefixTable& operator=(const KeyPrefixTable&) = delete;
+
+  // The length of the longest prefix of key that ends with a delimiter, 0 if it has none.
+  size_t PrefixLen(std::string_view key) const;
+
+  // Returns the id of prefix and increments its refcount. Returns kInvalidId if prefix is new
+  // and the table is full.
+  uint16_t Acquire(std::string_view prefix);
+
+  // Decrements the refcount of id, the prefix is removed once it drops to 0.
+  void Release(uint16_t id);
+
+  std::string_view Get(uint16_t id) const {
+    return entries_[id].str;
+  }
+
+  // The number of distinct prefixes.
+  size_t size() const {
+    return ids_.size();
+  }
+
+  // An estimate of the memory that the table allocated.
+  size_t MallocUsed() const;
+
+ private:
+  struct Entry {
+    std::string str;
+    uint32_t refs = 0;
+  };
+
+  std::string delimiters_;
+  std::deque<Entry> entries_;  // indexed by id, stable addresses for the keys of ids_.
+  std::vector<uint16_t> free_ids_;
+  absl::flat_hash_map<std::string_view, uint16_t> ids_;
+  size_t bytes_ = 0;
+};
+
+}  // namespace dfly
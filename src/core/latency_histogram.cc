@@ -0,0 +1,83 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/latency_histogram.h"
+
+#include <absl/numeric/bits.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+unsigned LatencyHistogram::BucketIndex(uint64_t usec) {
+  usec = std::min<uint64_t>(usec, (1ULL << kMaxBits) - 1);
+  if (usec < kSubBuckets)
+    return usec;
+
+  // The range [2^msb, 2^(msb + 1)) is split into kSubBuckets buckets of 2^shift values.
+  unsigned msb = 63 - absl::countl_zero(usec);
+  unsigned shift = msb - kSubBucketBits;
+  return ((shift + 1) << kSubBucketBits) + ((usec >> shift) & (kSubBuckets - 1));
+}
+
+uint64_t LatencyHistogram::BucketUpperBound(unsigned index) {
+  if (index < kSubBuckets)
+    return index;
+
+  unsigned shift = (index >> kSubBucketBits) - 1;
+  uint64_t lower = uint64_t(kSubBuckets + (index & (kSubBuckets - 1))) << shift;
+  return lower + (1ULL << shift) - 1;
+}
+
+void LatencyHistogram::Add(uint64_t usec) {
+  ++buckets_[BucketIndex(usec)];
+  ++count_;
+  sum_ += usec;
+  max_ = std::max(max_, usec);
+}
+
+LatencyHistogram& LatencyHistogram::operator+=(const LatencyHistogram& o) {
+  for (unsigned i = 0; i < kNumBuckets; ++i) {
+    buckets_[i] += o.buckets_[i];
+  }
+  count_ += o.count_;
+  sum_ += o.sum_;
+  max_ = std::max(max_, o.max_);
+  return *this;
+}
+
+uint64_t LatencyHistogram::Percentile(double p) const {
+  if (count_ == 0)
+    return 0;
+
+  uint64_t rank = std::max<uint64_t>(1, ceil(count_ * std::clamp(p, 0.0, 100.0) / 100));
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < kNumBuckets; ++i) {
+    seen += buckets_[i];
+    if (seen >= rank)
+      return std::min(BucketUpperBound(i), max_);
+  }
+
+  return max_;
+}
+
+uint64_t LatencyHistogram::CountBelowPow2(unsigned exp) const {
+  DCHECK_LE(exp, kMaxBits);
+  if (exp == kMaxBits)
+    return count_;
+
+  uint64_t res = 0;
+  uint64_t bound = (1ULL << exp) - 1;
+  for (unsigned i = 0; i < kNumBuckets && BucketUpperBound(i) <= bound; ++i) {
+    res += buckets_[i];
+  }
+  return res;
+}
+
+}  // namespace dfly
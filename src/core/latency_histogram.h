@@ -0,0 +1,56 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace dfly {
+
+// Histogram of latencies in microseconds with HDR-style log-linear buckets. Every power of two
+// range is split into kSubBuckets linear buckets, hence the percentiles are reported with
+// a relative error below 1 / kSubBuckets. Values above 2^kMaxBits fall into the last bucket.
+// Histograms of different threads are combined with operator+=.
+class LatencyHistogram {
+ public:
+  static constexpr unsigned kSubBucketBits = 3;
+  static constexpr unsigned kSubBuckets = 1u << kSubBucketBits;
+  static constexpr unsigned kMaxBits = 32;  // a bit over an hour.
+  static constexpr unsigned kNumBuckets = (kMaxBits - kSubBucketBits + 1) << kSubBucketBits;
+
+  void Add(uint64_t usec);
+
+  LatencyHistogram& operator+=(const LatencyHistogram& o);
+
+  uint64_t count() const {
+    return count_;
+  }
+
+  uint64_t sum() const {
+    return sum_;
+  }
+
+  uint64_t max() const {
+    return max_;
+  }
+
+  // Returns the upper bound of the bucket that holds the p-th percentile, p in [0, 100].
+  // Returns 0 for an empty histogram.
+  uint64_t Percentile(double p) const;
+
+  // Returns the number of values that are not greater than 2^exp - 1. Exact, since
+  // the powers of two are bucket boundaries.
+  uint64_t CountBelowPow2(unsigned exp) const;
+
+ private:
+  static unsigned BucketIndex(uint64_t usec);
+  static uint64_t BucketUpperBound(unsigned index);
+
+  uint64_t buckets_[kNumBuckets] = {0};
+  uint64_t count_ = 0;
+  uint64_t sum_ = 0;
+  uint64_t max_ = 0;
+};
+
+}  // namespace dfly
@@ -0,0 +1,54 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/latency_histogram.h"
+
+#include <gtest/gtest.h>
+
+namespace dfly {
+
+using namespace std;
+
+class LatencyHistogramTest : public ::testing::Test {};
+
+TEST_F(LatencyHistogramTest, Basic) {
+  LatencyHistogram hist;
+  EXPECT_EQ(0, hist.Percentile(50));
+
+  for (unsigned i = 1; i <= 100; ++i) {
+    hist.Add(i);
+  }
+  EXPECT_EQ(100, hist.count());
+  EXPECT_EQ(5050, hist.sum());
+  EXPECT_EQ(100, hist.max());
+
+  // Within the relative error of the buckets.
+  EXPECT_GE(hist.Percentile(50), 50);
+  EXPECT_LE(hist.Percentile(50), 50 + 50 / LatencyHistogram::kSubBuckets);
+  EXPECT_GE(hist.Percentile(99), 99);
+  EXPECT_EQ(100, hist.Percentile(100));
+  EXPECT_EQ(1, hist.Percentile(0));
+
+  // Small values are exact.
+  EXPECT_EQ(7, hist.CountBelowPow2(3));
+  EXPECT_EQ(63, hist.CountBelowPow2(6));
+  EXPECT_EQ(100, hist.CountBelowPow2(7));
+  EXPECT_EQ(100, hist.CountBelowPow2(LatencyHistogram::kMaxBits));
+}
+
+TEST_F(LatencyHistogramTest, Merge) {
+  LatencyHistogram a, b;
+  a.Add(10);
+  b.Add(1000);
+  b.Add(1ULL << 40);  // clamped into the last bucket.
+
+  a += b;
+  EXPECT_EQ(3, a.count());
+  EXPECT_EQ(1ULL << 40, a.max());
+  EXPECT_LE(a.Percentile(50), 1000 + 1000 / LatencyHistogram::kSubBuckets);
+  EXPECT_GE(a.Percentile(50), 1000);
+  EXPECT_EQ(2, a.CountBelowPow2(LatencyHistogram::kMaxBits - 1));
+}
+
+}  // namespace dfly
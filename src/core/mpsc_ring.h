@@ -0,0 +1,93 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+
+namespace dfly {
+
+// Bounded lock-free queue with multiple producers and a single consumer, based on the array
+// queue of D. Vyukov. Every cell holds a sequence number that tells whether it is free for
+// the producer of a position (seq == pos) or holds the value of that position (seq == pos + 1).
+// Producers claim positions with a CAS on tail_ and the consumer pops in order without any
+// atomic read-modify-write. T must be trivially copyable.
+template <typename T> class MPSCRing {
+ public:
+  // capacity must be a power of 2.
+  explicit MPSCRing(unsigned capacity);
+
+  // Thread-safe. Returns false if the ring is full.
+  bool TryPush(const T& val);
+
+  // Must be called only from the consumer thread. Returns false if the ring is empty or if
+  // the producer of the next position has not finished its push yet.
+  bool TryPop(T* dest);
+
+  unsigned capacity() const {
+    return mask_ + 1;
+  }
+
+  // Must be called only from the consumer thread. Includes the pushes that are in progress.
+  size_t ApproxSize() const {
+    return tail_.load(std::memory_order_relaxed) - head_;
+  }
+
+ private:
+  struct Cell {
+    std::atomic_uint64_t seq;
+    T val;
+  };
+
+  std::unique_ptr<Cell[]> cells_;
+  uint64_t mask_;
+
+  // Producers and the consumer write different cache lines.
+  alignas(64) std::atomic_uint64_t tail_{0};
+  alignas(64) uint64_t head_ = 0;
+};
+
+template <typename T>
+MPSCRing<T>::MPSCRing(unsigned capacity) : cells_(new Cell[capacity]), mask_(capacity - 1) {
+  assert(capacity > 0 && (capacity & mask_) == 0);
+  for (unsigned i = 0; i < capacity; ++i) {
+    cells_[i].seq.store(i, std::memory_order_relaxed);
+  }
+}
+
+template <typename T> bool MPSCRing<T>::TryPush(const T& val) {
+  uint64_t pos = tail_.load(std::memory_order_relaxed);
+  while (true) {
+    Cell& cell = cells_[pos & mask_];
+    uint64_t seq = cell.seq.load(std::memory_order_acquire);
+    int64_t diff = int64_t(seq - pos);
+    if (diff == 0) {
+      if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        cell.val = val;
+        cell.seq.store(pos + 1, std::memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {  // the cell still holds the value of pos - capacity.
+      return false;
+    } else {
+      pos = tail_.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+template <typename T> bool MPSCRing<T>::TryPop(T* dest) {
+  Cell& cell = cells_[head_ & mask_];
+  if (cell.seq.load(std::memory_order_acquire) != head_ + 1)
+    return false;
+
+  *dest = cell.val;
+  cell.seq.store(head_ + mask_ + 1, std::memory_order_release);
+  ++head_;
+  return true;
+}
+
+}  // namespace dfly
@@ -0,0 +1,82 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/mpsc_ring.h"
+
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+namespace dfly {
+
+using namespace std;
+
+class MPSCRingTest : public ::testing::Test {};
+
+TEST_F(MPSCRingTest, Basic) {
+  MPSCRing<uint64_t> ring(4);
+  EXPECT_EQ(4, ring.capacity());
+
+  uint64_t val = 0;
+  EXPECT_FALSE(ring.TryPop(&val));
+
+  for (uint64_t i = 0; i < 4; ++i) {
+    EXPECT_TRUE(ring.TryPush(i));
+  }
+  EXPECT_FALSE(ring.TryPush(4));
+  EXPECT_EQ(4, ring.ApproxSize());
+
+  ASSERT_TRUE(ring.TryPop(&val));
+  EXPECT_EQ(0, val);
+  EXPECT_TRUE(ring.TryPush(4));
+
+  for (uint64_t i = 1; i < 5; ++i) {
+    ASSERT_TRUE(ring.TryPop(&val));
+    EXPECT_EQ(i, val);
+  }
+  EXPECT_FALSE(ring.TryPop(&val));
+  EXPECT_EQ(0, ring.ApproxSize());
+}
+
+TEST_F(MPSCRingTest, Producers) {
+  constexpr unsigned kProducers = 4;
+  constexpr uint64_t kItems = 100000;
+
+  MPSCRing<uint64_t> ring(64);
+  vector<thread> producers;
+  for (unsigned p = 0; p < kProducers; ++p) {
+    producers.emplace_back([&ring, p] {
+      for (uint64_t i = 0; i < kItems; ++i) {
+        while (!ring.TryPush((uint64_t(p) << 32) | i)) {
+          this_thread::yield();
+        }
+      }
+    });
+  }
+
+  // Values of every producer arrive in the order they were pushed.
+  vector<uint64_t> next(kProducers, 0);
+  for (uint64_t popped = 0; popped < kProducers * kItems;) {
+    uint64_t val;
+    if (!ring.TryPop(&val)) {
+      this_thread::yield();
+      continue;
+    }
+    unsigned p = val >> 32;
+    ASSERT_LT(p, kProducers);
+    ASSERT_EQ(next[p], val & 0xFFFFFFFF);
+    ++next[p];
+    ++popped;
+  }
+
+  for (auto& t : producers) {
+    t.join();
+  }
+
+  uint64_t val;
+  EXPECT_FALSE(ring.TryPop(&val));
+}
+
+}  // namespace dfly
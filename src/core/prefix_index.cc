@@ -0,0 +1,173 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/prefix_index.h"
+
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+// The glob characters of stringmatchlen.
+bool IsGlobChar(char c) {
+  return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+size_t HeapBytes(const string& s) {
+  return s.capacity() > 15 ? s.capacity() : 0;
+}
+
+}  // namespace
+
+PrefixIndex::PrefixIndex(string_view delimiters) {
+  for (char c : delimiters) {
+    is_delim_[uint8_t(c)] = true;
+  }
+  bytes_ = NodeBytes(root_);
+}
+
+PrefixIndex::~PrefixIndex() {
+}
+
+size_t PrefixIndex::PrefixLen(string_view str) const {
+  for (size_t i = str.size(); i > 0; --i) {
+    if (is_delim_[uint8_t(str[i - 1])])
+      return i;
+  }
+  return 0;
+}
+
+bool PrefixIndex::Add(string_view key, uint64_t pos) {
+  size_t len = PrefixLen(key);
+  if (len == 0)
+    return false;
+
+  Node* node = &root_;
+  size_t start = 0;
+  for (size_t i = 0; i < len; ++i) {
+    if (!is_delim_[uint8_t(key[i])])
+      continue;
+
+    auto [it, inserted] = node->children.try_emplace(key.substr(start, i + 1 - start));
+    if (inserted) {
+      it->second.reset(new Node);
+      it->second->prefix = key.substr(0, i + 1);
+      bytes_ += NodeBytes(*it->second) + HeapBytes(it->first);
+    }
+    node = it->second.get();
+    start = i + 1;
+  }
+
+  Entry entry{pos, string{key.substr(len)}};
+  size_t entry_bytes = EntryBytes(entry);
+  if (!node->entries.insert(std::move(entry)).second)
+    return false;
+
+  bytes_ += entry_bytes;
+  ++size_;
+  return true;
+}
+
+bool PrefixIndex::Remove(string_view key, uint64_t pos) {
+  size_t len = PrefixLen(key);
+  if (len == 0)
+    return false;
+
+  // The nodes of the path, so that the nodes that are left empty are removed bottom up.
+  vector<pair<Node*, string_view>> path;
+  Node* node = &root_;
+  size_t start = 0;
+  for (size_t i = 0; i < len; ++i) {
+    if (!is_delim_[uint8_t(key[i])])
+      continue;
+
+    string_view segment = key.substr(start, i + 1 - start);
+    auto it = node->children.find(segment);
+    if (it == node->children.end())
+      return false;
+    path.emplace_back(node, segment);
+    node = it->second.get();
+    start = i + 1;
+  }
+
+  auto it = node->entries.find(Entry{pos, string{key.substr(len)}});
+  if (it == node->entries.end())
+    return false;
+
+  bytes_ -= EntryBytes(*it);
+  node->entries.erase(it);
+  --size_;
+
+  while (!path.empty() && node->entries.empty() && node->children.empty()) {
+    auto [parent, segment] = path.back();
+    path.pop_back();
+
+    auto child_it = parent->children.find(segment);
+    DCHECK(child_it != parent->children.end());
+    bytes_ -= NodeBytes(*node) + HeapBytes(child_it->first);
+    parent->children.erase(child_it);
+    node = parent;
+  }
+  return true;
+}
+
+string_view PrefixIndex::IndexedPrefix(string_view pattern) const {
+  size_t literal = 0;
+  while (literal < pattern.size() && !IsGlobChar(pattern[literal]))
+    ++literal;
+
+  return pattern.substr(0, PrefixLen(pattern.substr(0, literal)));
+}
+
+auto PrefixIndex::FindNode(string_view prefix) const -> const Node* {
+  DCHECK_EQ(prefix.size(), PrefixLen(prefix));
+  if (prefix.empty())
+    return nullptr;
+
+  const Node* node = &root_;
+  size_t start = 0;
+  for (size_t i = 0; i < prefix.size(); ++i) {
+    if (!is_delim_[uint8_t(prefix[i])])
+      continue;
+
+    auto it = node->children.find(prefix.substr(start, i + 1 - start));
+    if (it == node->children.end())
+      return nullptr;
+    node = it->second.get();
+    start = i + 1;
+  }
+  return node;
+}
+
+void PrefixIndex::Collect(const Node* node, vector<const Node*>* dest) {
+  size_t index = dest->size();
+  dest->push_back(node);
+  for (; index < dest->size(); ++index) {
+    for (const auto& [segment, child] : (*dest)[index]->children) {
+      dest->push_back(child.get());
+    }
+  }
+}
+
+void PrefixIndex::Clear() {
+  root_.children.clear();
+  root_.entries.clear();
+  size_ = 0;
+  bytes_ = NodeBytes(root_);
+}
+
+size_t PrefixIndex::EntryBytes(const Entry& e) {
+  // The nodes of btree_set are about 3/4 full.
+  return sizeof(Entry) * 4 / 3 + HeapBytes(e.suffix);
+}
+
+size_t PrefixIndex::NodeBytes(const Node& n) {
+  // The node, its slot in the children map of its parent and its prefix.
+  return sizeof(Node) + sizeof(pair<string, unique_ptr<Node>>) + 1 + HeapBytes(n.prefix);
+}
+
+}  // namespace dfly
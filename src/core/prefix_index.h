@@ -0,0 +1,134 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/btree_set.h>
+#include <absl/container/flat_hash_map.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// Index of keys by their prefixes that end with a delimiter, so that SCAN MATCH "tenant:1:*"
+// visits only the keys under "tenant:1:" instead of the whole table. The prefixes form a radix
+// tree whose edges are the segments of the keys up to and including a delimiter: the key
+// "tenant:1:a" is kept in the node "tenant:" -> "1:" as its suffix "a", hence the common prefixes
+// of the keys are stored once. Keys without a delimiter are not indexed.
+// The keys of a node are ordered by a 64 bit position that the owner derives from the key hash,
+// so that a scan resumes from a position regardless of the keys added and removed since.
+class PrefixIndex {
+ public:
+  explicit PrefixIndex(std::string_view delimiters);
+  ~PrefixIndex();
+
+  PrefixIndex(const PrefixIndex&) = delete;
+  PrefixIndex& operator=(const PrefixIndex&) = delete;
+
+  // Returns false if the key has no delimiter or is already in the index.
+  bool Add(std::string_view key, uint64_t pos);
+
+  // Returns false if the key is not in the index.
+  bool Remove(std::string_view key, uint64_t pos);
+
+  // Returns the longest prefix of the literal part of the glob pattern that ends with a
+  // delimiter. All the keys that match the pattern start with it and are in the index.
+  // Returns an empty string if there is no such prefix.
+  std::string_view IndexedPrefix(std::string_view pattern) const;
+
+  // Calls cb(uint64_t pos, std::string_view key) for the keys that start with prefix, which
+  // must end with a delimiter, and whose positions are at least from, in the order of their
+  // positions, for as long as cb returns true. cb must not modify the index.
+  template <typename Cb> void Scan(std::string_view prefix, uint64_t from, Cb&& cb) const;
+
+  void Clear();
+
+  size_t size() const {
+    return size_;
+  }
+
+  // An estimate of the memory that the index allocated.
+  size_t MallocUsed() const {
+    return bytes_;
+  }
+
+ private:
+  struct Entry {
+    uint64_t pos;
+    std::string suffix;
+
+    bool operator<(const Entry& o) const {
+      return pos != o.pos ? pos < o.pos : suffix < o.suffix;
+    }
+  };
+
+  struct Node {
+    std::string prefix;  // the segments from the root.
+    absl::flat_hash_map<std::string, std::unique_ptr<Node>> children;
+    absl::btree_set<Entry> entries;
+  };
+
+  // The length of the longest prefix of str that ends with a delimiter, 0 if it has none.
+  size_t PrefixLen(std::string_view str) const;
+
+  // Returns the node of prefix, which ends with a delimiter, or null if it has none.
+  const Node* FindNode(std::string_view prefix) const;
+
+  // Returns the nodes of the subtree of node.
+  static void Collect(const Node* node, std::vector<const Node*>* dest);
+
+  static size_t EntryBytes(const Entry& e);
+  static size_t NodeBytes(const Node& n);
+
+  bool is_delim_[256] = {};
+  Node root_;
+  size_t size_ = 0;
+  size_t bytes_ = 0;
+};
+
+template <typename Cb>
+void PrefixIndex::Scan(std::string_view prefix, uint64_t from, Cb&& cb) const {
+  const Node* node = FindNode(prefix);
+  if (!node)
+    return;
+
+  // Merges the entries of the subtree by their position.
+  using EntryIt = absl::btree_set<Entry>::const_iterator;
+  struct Cursor {
+    const Node* node;
+    EntryIt it;
+  };
+  auto later = [](const Cursor& a, const Cursor& b) { return b.it->pos < a.it->pos; };
+  std::vector<Cursor> heap;
+
+  std::vector<const Node*> nodes;
+  Collect(node, &nodes);
+  for (const Node* n : nodes) {
+    EntryIt it = n->entries.lower_bound(Entry{from, {}});
+    if (it != n->entries.end())
+      heap.push_back({n, it});
+  }
+  std::make_heap(heap.begin(), heap.end(), later);
+
+  std::string key;
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), later);
+    Cursor& cur = heap.back();
+    key.assign(cur.node->prefix).append(cur.it->suffix);
+    if (!cb(cur.it->pos, std::string_view{key}))
+      return;
+
+    if (++cur.it == cur.node->entries.end()) {
+      heap.pop_back();
+    } else {
+      std::push_heap(heap.begin(), heap.end(), later);
+    }
+  }
+}
+
+}  // namespace dfly
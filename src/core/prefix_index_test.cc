@@ -0,0 +1,126 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/prefix_index.h"
+
+#include <absl/strings/str_cat.h>
+
+#include <map>
+#include <random>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+class PrefixIndexTest : public ::testing::Test {
+ protected:
+  vector<pair<uint64_t, string>> Scan(string_view prefix, uint64_t from = 0,
+                                      size_t limit = SIZE_MAX) {
+    vector<pair<uint64_t, string>> res;
+    index_.Scan(prefix, from, [&](uint64_t pos, string_view key) {
+      res.emplace_back(pos, key);
+      return res.size() < limit;
+    });
+    return res;
+  }
+
+  PrefixIndex index_{":/"};
+};
+
+TEST_F(PrefixIndexTest, Basic) {
+  size_t empty_bytes = index_.MallocUsed();
+  EXPECT_TRUE(index_.Add("t:1:a", 5));
+  EXPECT_TRUE(index_.Add("t:1:b", 3));
+  EXPECT_TRUE(index_.Add("t:2:a", 4));
+  EXPECT_TRUE(index_.Add("t/1:", 1));
+  EXPECT_FALSE(index_.Add("t:1:a", 5));
+  EXPECT_FALSE(index_.Add("plain", 2));
+  EXPECT_EQ(4, index_.size());
+  EXPECT_GT(index_.MallocUsed(), empty_bytes);
+
+  using Res = vector<pair<uint64_t, string>>;
+  EXPECT_EQ((Res{{3, "t:1:b"}, {5, "t:1:a"}}), Scan("t:1:"));
+  EXPECT_EQ((Res{{3, "t:1:b"}, {4, "t:2:a"}, {5, "t:1:a"}}), Scan("t:"));
+  EXPECT_EQ((Res{{4, "t:2:a"}, {5, "t:1:a"}}), Scan("t:", 4));
+  EXPECT_EQ((Res{{3, "t:1:b"}}), Scan("t:", 0, 1));
+  EXPECT_EQ((Res{{1, "t/1:"}}), Scan("t/"));
+  EXPECT_TRUE(Scan("x:").empty());
+
+  EXPECT_FALSE(index_.Remove("t:1:a", 4));
+  EXPECT_FALSE(index_.Remove("t:3:a", 5));
+  EXPECT_TRUE(index_.Remove("t:1:a", 5));
+  EXPECT_TRUE(index_.Remove("t:1:b", 3));
+  EXPECT_TRUE(Scan("t:1:").empty());
+  EXPECT_TRUE(index_.Remove("t:2:a", 4));
+  EXPECT_TRUE(index_.Remove("t/1:", 1));
+  EXPECT_EQ(0, index_.size());
+  EXPECT_EQ(empty_bytes, index_.MallocUsed());
+}
+
+TEST_F(PrefixIndexTest, IndexedPrefix) {
+  EXPECT_EQ("tenant:1:", index_.IndexedPrefix("tenant:1:*"));
+  EXPECT_EQ("tenant:", index_.IndexedPrefix("tenant:1*"));
+  EXPECT_EQ("a/b:", index_.IndexedPrefix("a/b:c"));
+  EXPECT_EQ("a:", index_.IndexedPrefix("a:b?:*"));
+  EXPECT_EQ("a:", index_.IndexedPrefix("a:\\*:*"));
+  EXPECT_EQ("", index_.IndexedPrefix("a[:]b:*"));
+  EXPECT_EQ("", index_.IndexedPrefix("*:a"));
+  EXPECT_EQ("", index_.IndexedPrefix("tenant"));
+  EXPECT_EQ("", index_.IndexedPrefix(""));
+}
+
+TEST_F(PrefixIndexTest, Random) {
+  mt19937_64 gen(1);
+  map<string, uint64_t> keys;
+  for (unsigned i = 0; i < 20000; ++i) {
+    string key = absl::StrCat("t:", gen() % 20, ":", gen() % 5, ":", gen() % 50);
+    uint64_t pos = gen() % 1000;
+    if (keys.count(key)) {
+      ASSERT_TRUE(index_.Remove(key, keys[key]));
+      keys.erase(key);
+    } else {
+      ASSERT_TRUE(index_.Add(key, pos));
+      keys[key] = pos;
+    }
+  }
+  ASSERT_EQ(keys.size(), index_.size());
+
+  for (string_view prefix : {"t:", "t:3:", "t:3:1:", "t:30:"}) {
+    vector<pair<uint64_t, string>> expected;
+    for (const auto& [key, pos] : keys) {
+      if (key.substr(0, prefix.size()) == prefix && pos >= 500)
+        expected.emplace_back(pos, key);
+    }
+    sort(expected.begin(), expected.end());
+    auto res = Scan(prefix, 500);
+    EXPECT_EQ(expected.size(), res.size());
+
+    // Keys of the same position are ordered by node, not by key.
+    sort(res.begin(), res.end());
+    EXPECT_EQ(expected, res);
+  }
+}
+
+// Benchmarks
+static void BM_ScanPrefix(benchmark::State& state) {
+  PrefixIndex index(":");
+  for (unsigned i = 0; i < 1000000; ++i) {
+    index.Add(absl::StrCat("tenant:", i % 1000, ":", i), i * 2654435761u);
+  }
+
+  size_t found = 0;
+  while (state.KeepRunning()) {
+    index.Scan("tenant:42:", 0, [&](uint64_t, std::string_view) {
+      ++found;
+      return true;
+    });
+  }
+  CHECK_GT(found, 0u);
+}
+BENCHMARK(BM_ScanPrefix);
+
+}  // namespace dfly
@@ -0,0 +1,749 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/roaring_bitmap.h"
+
+#include <absl/base/internal/endian.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "base/logging.h"
+#include "core/bitops.h"
+
+extern "C" {
+#include "redis/zmalloc.h"
+}
+
+using namespace std;
+
+namespace dfly {
+
+namespace {
+
+constexpr uint32_t kChunkBits = 1 << 16;
+constexpr uint32_t kChunkBytes = kChunkBits / 8;
+constexpr uint32_t kChunkWords = kChunkBits / 64;
+
+// Arrays of more values would take more memory than the chunk bytes.
+constexpr uint32_t kMaxArraySize = kChunkBytes / sizeof(uint16_t);
+
+// An inclusive range of set positions.
+struct Run {
+  uint16_t start;
+  uint16_t last;
+};
+
+// The words of a chunk are loaded big-endian, so that the bit of position p is the bit
+// 63 - p % 64 of word p / 64, as it is in the string.
+inline uint64_t LoadWord(const uint8_t* chunk, uint32_t index) {
+  return absl::big_endian::Load64(chunk + index * 8);
+}
+
+inline bool ChunkGet(const uint8_t* chunk, uint32_t pos) {
+  return chunk[pos / 8] & (0x80 >> (pos % 8));
+}
+
+inline void ChunkSet(uint8_t* chunk, uint32_t pos) {
+  chunk[pos / 8] |= 0x80 >> (pos % 8);
+}
+
+inline void ChunkClear(uint8_t* chunk, uint32_t pos) {
+  chunk[pos / 8] &= ~(0x80 >> (pos % 8));
+}
+
+// Sets the bits at the positions [from, to).
+void ChunkSetRange(uint8_t* chunk, uint32_t from, uint32_t to) {
+  for (; from < to && from % 8 != 0; ++from)
+    ChunkSet(chunk, from);
+
+  uint32_t bytes_end = to - to % 8;
+  if (from < bytes_end) {
+    memset(chunk + from / 8, 0xff, (bytes_end - from) / 8);
+    from = bytes_end;
+  }
+
+  for (; from < to; ++from)
+    ChunkSet(chunk, from);
+}
+
+// Returns the first position from from on whose bit equals value, or kChunkBits.
+uint32_t ChunkFind(const uint8_t* chunk, uint32_t from, bool value) {
+  if (from >= kChunkBits)
+    return kChunkBits;
+
+  uint32_t index = from / 64;
+  uint64_t word = LoadWord(chunk, index) ^ (value ? 0 : ~0ULL);
+  word &= ~0ULL >> (from % 64);
+  while (word == 0) {
+    if (++index == kChunkWords)
+      return kChunkBits;
+    word = LoadWord(chunk, index) ^ (value ? 0 : ~0ULL);
+  }
+  return index * 64 + __builtin_clzll(word);
+}
+
+// Returns the number of set bits at the positions [from, to).
+uint32_t ChunkCount(const uint8_t* chunk, uint32_t from, uint32_t to) {
+  if (from >= to)
+    return 0;
+
+  uint32_t first = from / 64, last = (to - 1) / 64;
+  uint64_t head_mask = ~0ULL >> (from % 64);
+  uint64_t tail_mask = ~0ULL << (63 - (to - 1) % 64);
+  if (first == last)
+    return __builtin_popcountll(LoadWord(chunk, first) & head_mask & tail_mask);
+
+  uint32_t res = __builtin_popcountll(LoadWord(chunk, first) & head_mask) +
+                 __builtin_popcountll(LoadWord(chunk, last) & tail_mask);
+  return res + CountBits(chunk + (first + 1) * 8, (last - first - 1) * 8);
+}
+
+uint32_t ChunkRuns(const uint8_t* chunk) {
+  uint32_t runs = 0;
+  uint64_t prev = 0;
+  for (uint32_t i = 0; i < kChunkWords; ++i) {
+    uint64_t word = LoadWord(chunk, i);
+
+    // A run starts at every set bit whose preceding bit is clear.
+    runs += __builtin_popcountll(word & ~((word >> 1) | (prev << 63)));
+    prev = word & 1;
+  }
+  return runs;
+}
+
+// The container memory needed for a chunk with card bits set in runs runs.
+size_t ContainerBytes(uint32_t card, uint32_t runs) {
+  size_t res = min<size_t>(kChunkBytes, runs * sizeof(Run));
+  if (card <= kMaxArraySize)
+    res = min<size_t>(res, card * sizeof(uint16_t));
+  return res;
+}
+
+}  // namespace
+
+struct RoaringBitmap::Container {
+  enum Type : uint8_t { ARRAY, CHUNK, RUNS };
+
+  uint16_t key;  // the chunk index, that is the high 16 bits of its positions.
+  Type type;
+  uint32_t card;  // the number of set bits.
+  uint32_t size;  // the number of the values of ARRAY or of the runs of RUNS.
+  void* data;
+
+  uint16_t* values() const {
+    return reinterpret_cast<uint16_t*>(data);
+  }
+
+  Run* runs() const {
+    return reinterpret_cast<Run*>(data);
+  }
+
+  uint8_t* chunk() const {
+    return reinterpret_cast<uint8_t*>(data);
+  }
+
+  size_t DataBytes() const {
+    switch (type) {
+      case ARRAY:
+        return size * sizeof(uint16_t);
+      case CHUNK:
+        return kChunkBytes;
+      case RUNS:
+        return size * sizeof(Run);
+    }
+    return 0;
+  }
+
+  bool Contains(uint16_t pos) const;
+
+  // Returns the number of set bits at the positions [from, to).
+  uint32_t Count(uint32_t from, uint32_t to) const;
+
+  // Returns the first position in [from, to) whose bit equals value, or kChunkBits.
+  uint32_t Find(bool value, uint32_t from, uint32_t to) const;
+
+  // Writes the chunk into len bytes at dest that are zero.
+  void Render(uint8_t* dest, size_t len) const;
+};
+
+bool RoaringBitmap::Container::Contains(uint16_t pos) const {
+  switch (type) {
+    case ARRAY:
+      return binary_search(values(), values() + size, pos);
+    case CHUNK:
+      return ChunkGet(chunk(), pos);
+    case RUNS: {
+      const Run* it = upper_bound(runs(), runs() + size, pos,
+                                  [](uint16_t pos, const Run& run) { return pos < run.start; });
+      return it != runs() && pos <= (it - 1)->last;
+    }
+  }
+  return false;
+}
+
+uint32_t RoaringBitmap::Container::Count(uint32_t from, uint32_t to) const {
+  if (from == 0 && to == kChunkBits)
+    return card;
+
+  switch (type) {
+    case ARRAY:
+      return lower_bound(values(), values() + size, to) -
+             lower_bound(values(), values() + size, from);
+    case CHUNK:
+      return ChunkCount(chunk(), from, to);
+    case RUNS: {
+      uint32_t res = 0;
+      for (const Run* run = runs(); run != runs() + size && run->start < to; ++run) {
+        uint32_t start = max<uint32_t>(run->start, from), end = min<uint32_t>(run->last + 1, to);
+        res += start < end ? end - start : 0;
+      }
+      return res;
+    }
+  }
+  return 0;
+}
+
+uint32_t RoaringBitmap::Container::Find(bool value, uint32_t from, uint32_t to) const {
+  uint32_t res = kChunkBits;
+  switch (type) {
+    case ARRAY: {
+      const uint16_t* it = lower_bound(values(), values() + size, from);
+      if (value) {
+        if (it != values() + size)
+          res = *it;
+      } else {
+        for (res = from; it != values() + size && *it == res; ++it)
+          ++res;
+      }
+      break;
+    }
+    case CHUNK:
+      res = ChunkFind(chunk(), from, value);
+      break;
+    case RUNS: {
+      const Run* it = lower_bound(runs(), runs() + size, from,
+                                  [](const Run& run, uint32_t pos) { return run.last < pos; });
+      if (value) {
+        if (it != runs() + size)
+          res = max<uint32_t>(it->start, from);
+      } else {
+        for (res = from; it != runs() + size && it->start <= res; ++it)
+          res = it->last + 1;
+      }
+      break;
+    }
+  }
+  return res < to ? res : kChunkBits;
+}
+
+void RoaringBitmap::Container::Render(uint8_t* dest, size_t len) const {
+  switch (type) {
+    case ARRAY:
+      for (uint32_t i = 0; i < size; ++i)
+        ChunkSet(dest, values()[i]);
+      break;
+    case CHUNK:
+      memcpy(dest, chunk(), min<size_t>(len, kChunkBytes));
+      break;
+    case RUNS:
+      for (uint32_t i = 0; i < size; ++i)
+        ChunkSetRange(dest, runs()[i].start, runs()[i].last + 1u);
+      break;
+  }
+}
+
+RoaringBitmap::~RoaringBitmap() {
+  Clear();
+}
+
+RoaringBitmap::RoaringBitmap(RoaringBitmap&& other) noexcept {
+  *this = std::move(other);
+}
+
+RoaringBitmap& RoaringBitmap::operator=(RoaringBitmap&& other) noexcept {
+  if (this != &other) {
+    Clear();
+    containers_ = exchange(other.containers_, nullptr);
+    size_ = exchange(other.size_, 0);
+    capacity_ = exchange(other.capacity_, 0);
+    byte_len_ = exchange(other.byte_len_, 0);
+    malloc_used_ = exchange(other.malloc_used_, 0);
+  }
+  return *this;
+}
+
+void* RoaringBitmap::Allocate(size_t size) {
+  void* res = zmalloc(size);
+  malloc_used_ += zmalloc_size(res);
+  return res;
+}
+
+void* RoaringBitmap::Reallocate(void* ptr, size_t size) {
+  malloc_used_ -= zmalloc_size(ptr);
+  void* res = zrealloc(ptr, size);
+  malloc_used_ += zmalloc_size(res);
+  return res;
+}
+
+void RoaringBitmap::Deallocate(void* ptr) {
+  malloc_used_ -= zmalloc_size(ptr);
+  zfree(ptr);
+}
+
+void RoaringBitmap::Clear() {
+  for (uint32_t i = 0; i < size_; ++i)
+    Deallocate(containers_[i].data);
+  if (containers_)
+    Deallocate(containers_);
+
+  containers_ = nullptr;
+  size_ = capacity_ = 0;
+  byte_len_ = 0;
+  DCHECK_EQ(0u, malloc_used_);
+}
+
+uint32_t RoaringBitmap::LowerBound(uint16_t key) const {
+  return lower_bound(containers_, containers_ + size_, key,
+                     [](const Container& c, uint16_t k) { return c.key < k; }) -
+         containers_;
+}
+
+auto RoaringBitmap::InsertContainer(uint32_t index, uint16_t key) -> Container* {
+  if (size_ == capacity_) {
+    capacity_ = max(4u, capacity_ * 2);
+    containers_ = (Container*)(containers_ ? Reallocate(containers_, capacity_ * sizeof(Container))
+                                           : Allocate(capacity_ * sizeof(Container)));
+  }
+  memmove(containers_ + index + 1, containers_ + index, (size_ - index) * sizeof(Container));
+  ++size_;
+
+  Container* res = containers_ + index;
+  *res = Container{.key = key, .type = Container::ARRAY, .card = 0, .size = 0, .data = nullptr};
+  return res;
+}
+
+void RoaringBitmap::RemoveContainer(uint32_t index) {
+  Deallocate(containers_[index].data);
+  memmove(containers_ + index, containers_ + index + 1, (size_ - index - 1) * sizeof(Container));
+  --size_;
+}
+
+bool RoaringBitmap::MakeContainer(uint16_t key, const uint8_t* chunk, Container* dest) {
+  uint32_t card = CountBits(chunk, kChunkBytes);
+  if (card == 0)
+    return false;
+  uint32_t runs = ChunkRuns(chunk);
+  size_t bytes = ContainerBytes(card, runs);
+
+  *dest = Container{.key = key, .type = Container::CHUNK, .card = card, .size = 0, .data = nullptr};
+  if (card <= kMaxArraySize && bytes == card * sizeof(uint16_t)) {
+    dest->type = Container::ARRAY;
+    dest->data = Allocate(bytes);
+    for (uint32_t pos = ChunkFind(chunk, 0, true); pos < kChunkBits;
+         pos = ChunkFind(chunk, pos + 1, true)) {
+      dest->values()[dest->size++] = pos;
+    }
+  } else if (bytes == runs * sizeof(Run)) {
+    dest->type = Container::RUNS;
+    dest->data = Allocate(bytes);
+    for (uint32_t pos = ChunkFind(chunk, 0, true); pos < kChunkBits;) {
+      uint32_t end = ChunkFind(chunk, pos, false);
+      dest->runs()[dest->size++] = Run{uint16_t(pos), uint16_t(end - 1)};
+      pos = ChunkFind(chunk, end, true);
+    }
+  } else {
+    dest->data = Allocate(kChunkBytes);
+    memcpy(dest->data, chunk, kChunkBytes);
+  }
+  return true;
+}
+
+void RoaringBitmap::AppendChunk(uint16_t key, const uint8_t* chunk) {
+  Container c;
+  if (MakeContainer(key, chunk, &c))
+    *InsertContainer(size_, key) = c;
+}
+
+auto RoaringBitmap::CopyContainer(const Container& src) -> Container {
+  Container res = src;
+  size_t bytes = src.DataBytes();
+  res.data = Allocate(max<size_t>(bytes, 1));
+  memcpy(res.data, src.data, bytes);
+  return res;
+}
+
+void RoaringBitmap::ToChunk(Container* c) {
+  uint8_t* chunk = (uint8_t*)Allocate(kChunkBytes);
+  memset(chunk, 0, kChunkBytes);
+  c->Render(chunk, kChunkBytes);
+  Deallocate(c->data);
+  c->data = chunk;
+  c->type = Container::CHUNK;
+  c->size = 0;
+}
+
+void RoaringBitmap::ToArray(Container* c) {
+  DCHECK_LE(c->card, kMaxArraySize);
+  uint16_t* values = (uint16_t*)Allocate(max(c->card, 4u) * sizeof(uint16_t));
+  uint32_t size = 0;
+  for (uint32_t pos = c->Find(true, 0, kChunkBits); pos < kChunkBits;
+       pos = c->Find(true, pos + 1, kChunkBits)) {
+    values[size++] = pos;
+  }
+  DCHECK_EQ(size, c->card);
+
+  Deallocate(c->data);
+  c->data = values;
+  c->type = Container::ARRAY;
+  c->size = size;
+}
+
+void RoaringBitmap::Add(Container* c, uint16_t pos) {
+  if (c->type == Container::RUNS) {
+    if (c->card < kMaxArraySize)
+      ToArray(c);
+    else
+      ToChunk(c);
+  }
+
+  if (c->type == Container::ARRAY && c->size == kMaxArraySize)
+    ToChunk(c);
+
+  if (c->type == Container::CHUNK) {
+    ChunkSet(c->chunk(), pos);
+  } else {
+    size_t capacity = c->data ? zmalloc_size(c->data) / sizeof(uint16_t) : 0;
+    if (c->size == capacity) {
+      capacity = min<size_t>(max<size_t>(4, capacity * 2), kMaxArraySize);
+      c->data = c->data ? Reallocate(c->data, capacity * sizeof(uint16_t))
+                        : Allocate(capacity * sizeof(uint16_t));
+    }
+    uint16_t* it = lower_bound(c->values(), c->values() + c->size, pos);
+    memmove(it + 1, it, (c->values() + c->size - it) * sizeof(uint16_t));
+    *it = pos;
+    ++c->size;
+  }
+  ++c->card;
+}
+
+void RoaringBitmap::Remove(Container* c, uint16_t pos) {
+  if (c->type == Container::RUNS) {
+    if (c->card <= kMaxArraySize)
+      ToArray(c);
+    else
+      ToChunk(c);
+  }
+
+  --c->card;
+  if (c->type == Container::CHUNK) {
+    ChunkClear(c->chunk(), pos);
+
+    // Half the array limit, so that the container does not flip back and forth around it.
+    if (c->card > 0 && c->card <= kMaxArraySize / 2)
+      ToArray(c);
+    return;
+  }
+
+  uint16_t* it = lower_bound(c->values(), c->values() + c->size, pos);
+  DCHECK(it != c->values() + c->size && *it == pos);
+  memmove(it, it + 1, (c->values() + c->size - it - 1) * sizeof(uint16_t));
+  --c->size;
+
+  size_t capacity = zmalloc_size(c->data) / sizeof(uint16_t);
+  if (c->size > 0 && c->size * 4 < capacity && capacity > 16)
+    c->data = Reallocate(c->data, c->size * 2 * sizeof(uint16_t));
+}
+
+RoaringBitmap RoaringBitmap::FromBytes(string_view bytes) {
+  DCHECK_LE(bytes.size(), kMaxBits / 8);
+
+  RoaringBitmap res;
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(bytes.data());
+  size_t full = bytes.size() / kChunkBytes;
+  for (size_t i = 0; i < full; ++i)
+    res.AppendChunk(i, data + i * kChunkBytes);
+
+  if (size_t tail = bytes.size() % kChunkBytes; tail > 0) {
+    vector<uint8_t> chunk(kChunkBytes, 0);
+    memcpy(chunk.data(), data + full * kChunkBytes, tail);
+    res.AppendChunk(full, chunk.data());
+  }
+  res.byte_len_ = bytes.size();
+  return res;
+}
+
+size_t RoaringBitmap::EstimateMallocUsed(string_view bytes) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(bytes.data());
+  size_t res = 0, containers = 0;
+  for (size_t offset = 0; offset < bytes.size(); offset += kChunkBytes) {
+    size_t len = min<size_t>(kChunkBytes, bytes.size() - offset);
+    uint32_t card = CountBits(data + offset, len);
+    if (card == 0)
+      continue;
+
+    uint32_t runs;
+    if (len == kChunkBytes) {
+      runs = ChunkRuns(data + offset);
+    } else {
+      vector<uint8_t> chunk(kChunkBytes, 0);
+      memcpy(chunk.data(), data + offset, len);
+      runs = ChunkRuns(chunk.data());
+    }
+    res += ContainerBytes(card, runs);
+    ++containers;
+  }
+  return res + containers * sizeof(Container);
+}
+
+void RoaringBitmap::ToBytes(char* dest) const {
+  memset(dest, 0, byte_len_);
+  for (uint32_t i = 0; i < size_; ++i) {
+    size_t offset = size_t(containers_[i].key) * kChunkBytes;
+    DCHECK_LT(offset, byte_len_);
+    containers_[i].Render(reinterpret_cast<uint8_t*>(dest) + offset, byte_len_ - offset);
+  }
+}
+
+bool RoaringBitmap::Get(uint64_t bit) const {
+  uint32_t index = LowerBound(bit >> 16);
+  return index < size_ && containers_[index].key == (bit >> 16) &&
+         containers_[index].Contains(bit & 0xffff);
+}
+
+bool RoaringBitmap::Set(uint64_t bit, bool value) {
+  DCHECK_LT(bit, kMaxBits);
+  byte_len_ = max<size_t>(byte_len_, bit / 8 + 1);
+
+  uint16_t key = bit >> 16, pos = bit & 0xffff;
+  uint32_t index = LowerBound(key);
+  if (index == size_ || containers_[index].key != key) {
+    if (value)
+      Add(InsertContainer(index, key), pos);
+    return false;
+  }
+
+  Container* c = containers_ + index;
+  bool prev = c->Contains(pos);
+  if (prev == value)
+    return prev;
+
+  if (value) {
+    Add(c, pos);
+  } else {
+    Remove(c, pos);
+    if (c->card == 0)
+      RemoveContainer(index);
+  }
+  return prev;
+}
+
+uint64_t RoaringBitmap::Count() const {
+  uint64_t res = 0;
+  for (uint32_t i = 0; i < size_; ++i)
+    res += containers_[i].card;
+  return res;
+}
+
+uint64_t RoaringBitmap::Count(uint64_t from, uint64_t to) const {
+  uint64_t res = 0;
+  for (uint32_t i = LowerBound(min(from, kMaxBits - 1) >> 16); i < size_; ++i) {
+    uint64_t base = uint64_t(containers_[i].key) << 16;
+    if (base >= to)
+      break;
+    uint64_t start = max(from, base) - base, end = min(to - base, uint64_t(kChunkBits));
+    res += containers_[i].Count(start, end);
+  }
+  return res;
+}
+
+int64_t RoaringBitmap::FindFirst(bool value, uint64_t from, uint64_t to) const {
+  to = min(to, kMaxBits);
+  if (from >= to)
+    return -1;
+
+  uint32_t index = LowerBound(from >> 16);
+  if (value) {
+    for (; index < size_; ++index) {
+      uint64_t base = uint64_t(containers_[index].key) << 16;
+      if (base >= to)
+        break;
+      uint32_t start = from > base ? from - base : 0;
+      uint32_t pos = containers_[index].Find(true, start, min(to - base, uint64_t(kChunkBits)));
+      if (pos < kChunkBits)
+        return base + pos;
+    }
+    return -1;
+  }
+
+  // The chunks without a container have no bits set.
+  for (uint64_t bit = from; bit < to; ++index) {
+    uint64_t base = bit & ~uint64_t(0xffff);
+    if (index == size_ || (uint64_t(containers_[index].key) << 16) != base)
+      return bit;
+
+    uint32_t pos = containers_[index].Find(false, bit - base, min(to - base, uint64_t(kChunkBits)));
+    if (pos < kChunkBits)
+      return base + pos;
+    bit = base + kChunkBits;
+  }
+  return -1;
+}
+
+bool RoaringBitmap::Combine(Op op, const Container& left, const Container& right,
+                            vector<uint8_t>* scratch, Container* dest) {
+  // Sparse chunks are combined as sorted arrays, others by their bytes.
+  if (left.type == Container::ARRAY && right.type == Container::ARRAY) {
+    vector<uint16_t> values;
+    values.reserve(op == AND ? min(left.size, right.size) : left.size + right.size);
+    const uint16_t *lb = left.values(), *rb = right.values();
+    switch (op) {
+      case AND:
+        set_intersection(lb, lb + left.size, rb, rb + right.size, back_inserter(values));
+        break;
+      case OR:
+        set_union(lb, lb + left.size, rb, rb + right.size, back_inserter(values));
+        break;
+      case XOR:
+        set_symmetric_difference(lb, lb + left.size, rb, rb + right.size, back_inserter(values));
+        break;
+    }
+
+    if (values.empty())
+      return false;
+
+    if (values.size() <= kMaxArraySize) {
+      *dest = Container{.key = left.key,
+                        .type = Container::ARRAY,
+                        .card = uint32_t(values.size()),
+                        .size = uint32_t(values.size()),
+                        .data = Allocate(values.size() * sizeof(uint16_t))};
+      memcpy(dest->data, values.data(), values.size() * sizeof(uint16_t));
+      return true;
+    }
+  }
+
+  // The chunks are too large for the fiber stacks.
+  scratch->assign(kChunkBytes * 2, 0);
+  uint8_t *chunk = scratch->data(), *other = chunk + kChunkBytes;
+  left.Render(chunk, kChunkBytes);
+  right.Render(other, kChunkBytes);
+  switch (op) {
+    case AND:
+      BitAnd(chunk, other, kChunkBytes);
+      break;
+    case OR:
+      BitOr(chunk, other, kChunkBytes);
+      break;
+    case XOR:
+      BitXor(chunk, other, kChunkBytes);
+      break;
+  }
+  return MakeContainer(left.key, chunk, dest);
+}
+
+void RoaringBitmap::Apply(Op op, const RoaringBitmap& other) {
+  uint32_t capacity = op == AND ? min(size_, other.size_) : size_ + other.size_;
+  Container* res = capacity ? (Container*)Allocate(capacity * sizeof(Container)) : nullptr;
+  uint32_t size = 0, i = 0, j = 0;
+  vector<uint8_t> scratch;
+
+  while (i < size_ || j < other.size_) {
+    if (j == other.size_ || (i < size_ && containers_[i].key < other.containers_[j].key)) {
+      if (op == AND)
+        Deallocate(containers_[i].data);
+      else
+        res[size++] = containers_[i];
+      ++i;
+    } else if (i == size_ || other.containers_[j].key < containers_[i].key) {
+      if (op != AND)
+        res[size++] = CopyContainer(other.containers_[j]);
+      ++j;
+    } else {
+      if (Combine(op, containers_[i], other.containers_[j], &scratch, res + size))
+        ++size;
+      Deallocate(containers_[i].data);
+      ++i;
+      ++j;
+    }
+  }
+
+  if (containers_)
+    Deallocate(containers_);
+  containers_ = res;
+  size_ = size;
+  capacity_ = capacity;
+  byte_len_ = max(byte_len_, other.byte_len_);
+}
+
+RoaringBitmap RoaringBitmap::Copy() const {
+  RoaringBitmap res;
+  if (size_ > 0) {
+    res.containers_ = (Container*)res.Allocate(size_ * sizeof(Container));
+    res.capacity_ = size_;
+    for (; res.size_ < size_; ++res.size_)
+      res.containers_[res.size_] = res.CopyContainer(containers_[res.size_]);
+  }
+  res.byte_len_ = byte_len_;
+  return res;
+}
+
+// The blob is the length and the number of the containers, followed by every container's
+// key, type, card, size and data.
+void RoaringBitmap::Serialize(string* dest) const {
+  constexpr size_t kHeaderLen = 11;
+  size_t len = 12;
+  for (uint32_t i = 0; i < size_; ++i)
+    len += kHeaderLen + containers_[i].DataBytes();
+
+  dest->resize(len);
+  char* next = dest->data();
+  absl::little_endian::Store64(next, byte_len_);
+  absl::little_endian::Store32(next + 8, size_);
+  next += 12;
+  for (uint32_t i = 0; i < size_; ++i) {
+    const Container& c = containers_[i];
+    absl::little_endian::Store16(next, c.key);
+    next[2] = c.type;
+    absl::little_endian::Store32(next + 3, c.card);
+    absl::little_endian::Store32(next + 7, c.size);
+    memcpy(next + kHeaderLen, c.data, c.DataBytes());
+    next += kHeaderLen + c.DataBytes();
+  }
+  DCHECK_EQ(next, dest->data() + len);
+}
+
+RoaringBitmap RoaringBitmap::Deserialize(string_view blob) {
+  constexpr size_t kHeaderLen = 11;
+  CHECK_GE(blob.size(), 12u);
+
+  RoaringBitmap res;
+  const char* next = blob.data();
+  res.byte_len_ = absl::little_endian::Load64(next);
+  uint32_t size = absl::little_endian::Load32(next + 8);
+  next += 12;
+  if (size > 0) {
+    res.containers_ = (Container*)res.Allocate(size * sizeof(Container));
+    res.capacity_ = size;
+  }
+
+  for (; res.size_ < size; ++res.size_) {
+    CHECK_LE(next + kHeaderLen, blob.data() + blob.size());
+    Container& c = res.containers_[res.size_];
+    c.key = absl::little_endian::Load16(next);
+    c.type = Container::Type(next[2]);
+    c.card = absl::little_endian::Load32(next + 3);
+    c.size = absl::little_endian::Load32(next + 7);
+    size_t bytes = c.DataBytes();
+    CHECK_LE(next + kHeaderLen + bytes, blob.data() + blob.size());
+
+    c.data = res.Allocate(max<size_t>(bytes, 1));
+    memcpy(c.data, next + kHeaderLen, bytes);
+    next += kHeaderLen + bytes;
+  }
+  return res;
+}
+
+}  // namespace dfly
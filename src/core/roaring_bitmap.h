@@ -0,0 +1,116 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// Bitmap of up to 2^32 bits whose memory grows with the bits it holds rather than with its
+// length. It stands for a string value used as a bitmap: bit i is the bit 0x80 >> i % 8 of
+// byte i / 8 of the string, and the bitmap has the length of that string in bytes.
+// The bits are split into chunks of 2^16 bits. Every chunk with bits set is kept in a container
+// that is the smallest of: a sorted array of the set positions, the 8KB of the chunk as they
+// are in the string, or a sorted array of the runs of set bits.
+class RoaringBitmap {
+  struct Container;
+
+ public:
+  enum Op : uint8_t { AND, OR, XOR };
+
+  static constexpr uint64_t kMaxBits = 1ULL << 32;
+
+  RoaringBitmap() = default;
+  ~RoaringBitmap();
+
+  RoaringBitmap(RoaringBitmap&& other) noexcept;
+  RoaringBitmap& operator=(RoaringBitmap&& other) noexcept;
+
+  RoaringBitmap(const RoaringBitmap&) = delete;
+  RoaringBitmap& operator=(const RoaringBitmap&) = delete;
+
+  // Requires: bytes.size() <= kMaxBits / 8.
+  static RoaringBitmap FromBytes(std::string_view bytes);
+
+  // Returns the MallocUsed() of FromBytes(bytes) without building it.
+  static size_t EstimateMallocUsed(std::string_view bytes);
+
+  // Writes the ByteLen() bytes of the string into dest.
+  void ToBytes(char* dest) const;
+
+  size_t ByteLen() const {
+    return byte_len_;
+  }
+
+  size_t NumContainers() const {
+    return size_;
+  }
+
+  // The heap memory of the containers.
+  size_t MallocUsed() const {
+    return malloc_used_;
+  }
+
+  bool Get(uint64_t bit) const;
+
+  // Sets the bit to value and returns its previous value. As SETBIT does, extends the length to
+  // cover the bit even if value is false. Requires: bit < kMaxBits.
+  bool Set(uint64_t bit, bool value);
+
+  // Returns the number of set bits.
+  uint64_t Count() const;
+
+  // Returns the number of set bits in [from, to).
+  uint64_t Count(uint64_t from, uint64_t to) const;
+
+  // Returns the first bit in [from, to) that equals value, or -1 if there is none.
+  int64_t FindFirst(bool value, uint64_t from, uint64_t to) const;
+
+  // Combines other into the bitmap. As BITOP does, the length becomes the larger of the two.
+  void Apply(Op op, const RoaringBitmap& other);
+
+  RoaringBitmap Copy() const;
+
+  // Serializes the bitmap so that it could be rebuilt in another thread. The format is not
+  // meant to be persisted.
+  void Serialize(std::string* dest) const;
+
+  // Requires: blob was created by Serialize.
+  static RoaringBitmap Deserialize(std::string_view blob);
+
+ private:
+  void* Allocate(size_t size);
+  void* Reallocate(void* ptr, size_t size);
+  void Deallocate(void* ptr);
+  void Clear();
+
+  // The index of the first container whose key is not less than key.
+  uint32_t LowerBound(uint16_t key) const;
+  Container* InsertContainer(uint32_t index, uint16_t key);
+  void RemoveContainer(uint32_t index);
+
+  // Appends the container of the chunk bytes unless the chunk is empty.
+  void AppendChunk(uint16_t key, const uint8_t* chunk);
+  bool MakeContainer(uint16_t key, const uint8_t* chunk, Container* dest);
+  Container CopyContainer(const Container& src);
+  bool Combine(Op op, const Container& left, const Container& right,
+               std::vector<uint8_t>* scratch, Container* dest);
+
+  void Add(Container* c, uint16_t pos);
+  void Remove(Container* c, uint16_t pos);
+  void ToArray(Container* c);
+  void ToChunk(Container* c);
+
+  Container* containers_ = nullptr;
+  uint32_t size_ = 0, capacity_ = 0;
+  size_t byte_len_ = 0;
+  size_t malloc_used_ = 0;
+};
+
+}  // namespace dfly
@@ -0,0 +1,259 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/roaring_bitmap.h"
+
+#include <mimalloc.h>
+
+#include <random>
+#include <string>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+extern "C" {
+#include "redis/zmalloc.h"
+}
+
+namespace dfly {
+
+using namespace std;
+
+class RoaringBitmapTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    auto* tlh = mi_heap_get_backing();
+    init_zmalloc_threadlocal(tlh);
+  }
+
+  void TearDown() override {
+    // ensure there are no memory leaks after every test
+    EXPECT_EQ(zmalloc_used_memory_tl, 0);
+  }
+
+  static string Bytes(const RoaringBitmap& bitmap) {
+    string res(bitmap.ByteLen(), 'x');
+    bitmap.ToBytes(res.data());
+    return res;
+  }
+
+  static bool GetBit(const string& str, uint64_t bit) {
+    return bit / 8 < str.size() && (uint8_t(str[bit / 8]) & (0x80 >> bit % 8));
+  }
+
+  static void SetBit(uint64_t bit, bool value, string* str) {
+    if (bit / 8 >= str->size())
+      str->resize(bit / 8 + 1, 0);
+    uint8_t mask = 0x80 >> bit % 8;
+    (*str)[bit / 8] = value ? (*str)[bit / 8] | mask : (*str)[bit / 8] & ~mask;
+  }
+
+  static uint64_t Count(const string& str, uint64_t from, uint64_t to) {
+    uint64_t res = 0;
+    for (uint64_t bit = from; bit < to; ++bit)
+      res += GetBit(str, bit);
+    return res;
+  }
+
+  static int64_t Find(const string& str, bool value, uint64_t from, uint64_t to) {
+    for (uint64_t bit = from; bit < to; ++bit) {
+      if (GetBit(str, bit) == value)
+        return bit;
+    }
+    return -1;
+  }
+
+  // A value of len bytes whose chunks are sparse, dense or made of runs.
+  static string RandomBytes(size_t len, mt19937* gen) {
+    string res(len, 0);
+    for (size_t start = 0; start < len; start += 8192) {
+      size_t end = min(len, start + 8192);
+      switch ((*gen)() % 4) {
+        case 0:
+          break;
+        case 1:
+          for (unsigned i = 0; i < 100; ++i)
+            res[start + (*gen)() % (end - start)] = 1 << (*gen)() % 8;
+          break;
+        case 2:
+          for (size_t i = start; i < end; ++i)
+            res[i] = (*gen)();
+          break;
+        case 3:
+          for (size_t i = start + (*gen)() % 100; i < end; i += 700)
+            memset(res.data() + i, 0xff, min<size_t>(end - i, 300));
+          break;
+      }
+    }
+    return res;
+  }
+};
+
+TEST_F(RoaringBitmapTest, Basic) {
+  RoaringBitmap bitmap;
+  EXPECT_EQ(0, bitmap.ByteLen());
+  EXPECT_FALSE(bitmap.Set(10, true));
+  EXPECT_TRUE(bitmap.Set(10, true));
+  EXPECT_FALSE(bitmap.Set(100, false));
+  EXPECT_EQ(13, bitmap.ByteLen());
+  EXPECT_TRUE(bitmap.Get(10));
+  EXPECT_FALSE(bitmap.Get(11));
+  EXPECT_EQ(1, bitmap.Count());
+  EXPECT_EQ(string("\x00\x20", 2) + string(11, 0), Bytes(bitmap));
+
+  EXPECT_EQ(10, bitmap.FindFirst(true, 0, 104));
+  EXPECT_EQ(-1, bitmap.FindFirst(true, 11, 104));
+  EXPECT_EQ(11, bitmap.FindFirst(false, 10, 104));
+  EXPECT_TRUE(bitmap.Set(10, false));
+  EXPECT_EQ(0, bitmap.NumContainers());
+  EXPECT_EQ(13, bitmap.ByteLen());
+}
+
+TEST_F(RoaringBitmapTest, Sparse) {
+  RoaringBitmap bitmap;
+  bitmap.Set(4000000000, true);
+  bitmap.Set(7, true);
+  EXPECT_EQ(500000001, bitmap.ByteLen());
+  EXPECT_EQ(2, bitmap.NumContainers());
+  EXPECT_LT(bitmap.MallocUsed(), 128);
+
+  EXPECT_EQ(2, bitmap.Count());
+  EXPECT_EQ(1, bitmap.Count(8, bitmap.ByteLen() * 8));
+  EXPECT_EQ(4000000000, bitmap.FindFirst(true, 8, bitmap.ByteLen() * 8));
+  EXPECT_EQ(0, bitmap.FindFirst(false, 0, bitmap.ByteLen() * 8));
+  EXPECT_EQ(8, bitmap.FindFirst(false, 7, bitmap.ByteLen() * 8));
+  EXPECT_EQ(4000000001, bitmap.FindFirst(false, 4000000000, bitmap.ByteLen() * 8));
+
+  RoaringBitmap other;
+  other.Set(4000000000, true);
+  bitmap.Apply(RoaringBitmap::AND, other);
+  EXPECT_EQ(1, bitmap.Count());
+  EXPECT_EQ(1, bitmap.NumContainers());
+}
+
+TEST_F(RoaringBitmapTest, Containers) {
+  // Dense chunks are kept as their bytes.
+  RoaringBitmap bitmap;
+  for (unsigned i = 0; i < 10000; ++i)
+    bitmap.Set(i * 5, true);
+  EXPECT_EQ(10000, bitmap.Count());
+  EXPECT_GE(bitmap.MallocUsed(), 8192);
+  EXPECT_LT(bitmap.MallocUsed(), 8192 + 256);
+
+  for (unsigned i = 0; i < 9000; ++i)
+    bitmap.Set(i * 5, false);
+  EXPECT_EQ(1000, bitmap.Count());
+  EXPECT_LT(bitmap.MallocUsed(), 8192);
+  EXPECT_EQ(45000, bitmap.FindFirst(true, 0, bitmap.ByteLen() * 8));
+
+  // Runs of set bits take a few bytes.
+  string ones(1 << 20, '\xff');
+  RoaringBitmap runs = RoaringBitmap::FromBytes(ones);
+  EXPECT_EQ(ones.size() * 8, runs.Count());
+  EXPECT_LT(runs.MallocUsed(), 4096);
+  EXPECT_LE(RoaringBitmap::EstimateMallocUsed(ones), runs.MallocUsed());
+  EXPECT_EQ(ones, Bytes(runs));
+  EXPECT_EQ(-1, runs.FindFirst(false, 0, ones.size() * 8));
+  EXPECT_EQ(ones.size() * 4, runs.Count(ones.size() * 2, ones.size() * 6));
+
+  runs.Set(100, false);
+  ones[12] = '\xf7';
+  EXPECT_EQ(100, runs.FindFirst(false, 0, ones.size() * 8));
+  EXPECT_EQ(ones, Bytes(runs));
+}
+
+// Compares the bitmap with a string under random operations.
+TEST_F(RoaringBitmapTest, Random) {
+  mt19937 gen(42);
+  string expected = RandomBytes(100000, &gen);
+  RoaringBitmap bitmap = RoaringBitmap::FromBytes(expected);
+  ASSERT_EQ(expected, Bytes(bitmap));
+
+  for (unsigned i = 0; i < 20000; ++i) {
+    uint64_t bit = gen() % (expected.size() * 8 + 1000);
+    bool value = gen() % 3 != 0;
+    ASSERT_EQ(GetBit(expected, bit), bitmap.Set(bit, value)) << i;
+    SetBit(bit, value, &expected);
+
+    uint64_t len = expected.size() * 8;
+    if (i % 100 == 0) {
+      uint64_t from = gen() % len, to = from + gen() % (len - from + 1);
+      ASSERT_EQ(Count(expected, from, to), bitmap.Count(from, to)) << from << " " << to;
+      ASSERT_EQ(Find(expected, true, from, to), bitmap.FindFirst(true, from, to));
+      ASSERT_EQ(Find(expected, false, from, to), bitmap.FindFirst(false, from, to));
+    }
+  }
+
+  EXPECT_EQ(expected.size(), bitmap.ByteLen());
+  EXPECT_EQ(expected, Bytes(bitmap));
+  EXPECT_EQ(Count(expected, 0, expected.size() * 8), bitmap.Count());
+}
+
+TEST_F(RoaringBitmapTest, Apply) {
+  mt19937 gen(7);
+  for (unsigned i = 0; i < 20; ++i) {
+    string left = RandomBytes(30000 + gen() % 70000, &gen);
+    string right = RandomBytes(30000 + gen() % 70000, &gen);
+    size_t len = max(left.size(), right.size());
+    string padded_left = left, padded_right = right;
+    padded_left.resize(len, 0);
+    padded_right.resize(len, 0);
+
+    for (auto op : {RoaringBitmap::AND, RoaringBitmap::OR, RoaringBitmap::XOR}) {
+      RoaringBitmap bitmap = RoaringBitmap::FromBytes(left);
+      bitmap.Apply(op, RoaringBitmap::FromBytes(right));
+
+      string expected(len, 0);
+      for (size_t j = 0; j < len; ++j) {
+        uint8_t l = padded_left[j], r = padded_right[j];
+        expected[j] = op == RoaringBitmap::AND ? l & r : op == RoaringBitmap::OR ? l | r : l ^ r;
+      }
+      ASSERT_EQ(expected, Bytes(bitmap)) << i << " " << op;
+      ASSERT_LE(RoaringBitmap::EstimateMallocUsed(expected),
+                RoaringBitmap::FromBytes(expected).MallocUsed());
+    }
+  }
+}
+
+TEST_F(RoaringBitmapTest, Serialize) {
+  mt19937 gen(11);
+  string bytes = RandomBytes(200000, &gen);
+  RoaringBitmap bitmap = RoaringBitmap::FromBytes(bytes);
+
+  string blob;
+  bitmap.Serialize(&blob);
+  RoaringBitmap copy = RoaringBitmap::Deserialize(blob);
+  EXPECT_EQ(bytes, Bytes(copy));
+  EXPECT_EQ(bitmap.NumContainers(), copy.NumContainers());
+
+  RoaringBitmap other = bitmap.Copy();
+  bitmap.Set(5, !bitmap.Get(5));
+  EXPECT_EQ(bytes, Bytes(other));
+
+  RoaringBitmap empty;
+  empty.Serialize(&blob);
+  EXPECT_EQ(0, RoaringBitmap::Deserialize(blob).ByteLen());
+}
+
+// Benchmarks
+static void BM_SparseAnd(benchmark::State& state) {
+  init_zmalloc_threadlocal(mi_heap_get_backing());
+  mt19937 gen(1);
+  RoaringBitmap left, right;
+  for (unsigned i = 0; i < 100000; ++i) {
+    left.Set(gen() % 1000000000, true);
+    right.Set(gen() % 1000000000, true);
+  }
+
+  uint64_t count = 0;
+  while (state.KeepRunning()) {
+    RoaringBitmap res = left.Copy();
+    res.Apply(RoaringBitmap::AND, right);
+    count += res.Count();
+  }
+  CHECK_GT(count, 0u);
+}
+BENCHMARK(BM_SparseAnd);
+
+}  // namespace dfly
@@ -7,12 +7,19 @@
 
 namespace dfly {
 
-SegmentAllocator::SegmentAllocator(mi_heap_t* heap) : heap_(heap) {
+// The table is not initialized, hence its pages are committed only as the segments are added.
+// It takes 8MB of address space per thread with DFLY_WIDE_SMALL_PTR.
+SegmentAllocator::SegmentAllocator(mi_heap_t* heap)
+    : address_table_(new uint8_t*[kMaxSegments]), heap_(heap) {
 }
 
 void SegmentAllocator::ValidateMapSize() {
-  CHECK_LT(address_table_.size(), 1u << 12)
-      << "TODO: to monitor address_table_ map, it should not grow to such sizes";
+  CHECK_LE(rev_indx_.size(), kMaxSegments)
+      << "The small strings of the thread span more than " << (kMaxSegments >> 7)
+      << "GB, see DF_WIDE_SMALL_PTR";
+  LOG_IF(WARNING, rev_indx_.size() == kMaxSegments / 4 * 3)
+      << "The small strings of the thread use 3/4 of their " << (kMaxSegments >> 7)
+      << "GB address range";
 
   // TODO: we should learn how large this maps can grow for very large databases.
   // We should learn if mimalloc drops (deallocates) segments and we need to perform GC
@@ -6,10 +6,14 @@
 #include <absl/container/flat_hash_map.h>
 #include <mimalloc.h>
 
+#include <memory>
+#include <type_traits>
+
 /***
  * This class is tightly coupled with mimalloc segment allocation logic and is designed to provide
  * a compact pointer representation (4bytes ptr) over 64bit address space that gives you
- * 32GB of allocations with option to extend it to 32*256GB if needed.
+ * 32GB of allocations per thread heap. With DFLY_WIDE_SMALL_PTR (cmake -DDF_WIDE_SMALL_PTR=ON)
+ * the pointer takes 5 bytes and addresses 32*256GB.
  *
  */
 
@@ -19,18 +23,31 @@ namespace dfly {
  * @brief Tightly coupled with mi_malloc 2.x implementation.
  *        Fetches 8MB segment pointers from the allocated pointers.
  *        Provides own indexing of small pointers to real address space using the segment ptrs/
+ *        A pointer holds the segment index in its low kSegmentIdBits bits and the offset in the
+ *        segment with 8 byte granularity in the next kOffsetBits bits.
  */
 
 class SegmentAllocator {
+  static constexpr uint32_t kOffsetBits = 20;  // 8MB segments with 8 byte granularity.
+#ifdef DFLY_WIDE_SMALL_PTR
+  static constexpr uint32_t kSegmentIdBits = 20;
+#else
   static constexpr uint32_t kSegmentIdBits = 12;
+#endif
   static constexpr uint32_t kSegmentIdMask = (1 << kSegmentIdBits) - 1;
   static constexpr uint64_t kSegmentAlignMask = ~((1 << 23) - 1);
 
  public:
-  using Ptr = uint32_t;
+  static constexpr uint32_t kPtrBits = kSegmentIdBits + kOffsetBits;
+  static constexpr uint32_t kMaxSegments = 1u << kSegmentIdBits;
+
+  using Ptr = std::conditional_t<(kPtrBits > 32), uint64_t, uint32_t>;
 
   SegmentAllocator(mi_heap_t* heap);
 
+  // Translate is safe to call from any thread: the address table has a fixed capacity and
+  // its entries never change once published. The caller must make sure that p has been
+  // transferred to it via a synchronizing operation, i.e. a transaction hop.
   uint8_t* Translate(Ptr p) const {
     return address_table_[p & kSegmentIdMask] + Offset(p);
   }
@@ -49,15 +66,20 @@ class SegmentAllocator {
 
   size_t used() const { return used_; }
 
+  // The number of the segments in the address table, which can not grow beyond kMaxSegments.
+  size_t num_segments() const {
+    return rev_indx_.size();
+  }
+
  private:
-  static uint32_t Offset(Ptr p) {
-    return (p >> kSegmentIdBits) * 8;
+  static uint64_t Offset(Ptr p) {
+    return uint64_t(p >> kSegmentIdBits) * 8;
   }
 
   void ValidateMapSize();
 
-  std::vector<uint8_t*> address_table_;
-  absl::flat_hash_map<uint64_t, uint16_t> rev_indx_;
+  std::unique_ptr<uint8_t*[]> address_table_;
+  absl::flat_hash_map<uint64_t, uint32_t> rev_indx_;
   mi_heap_t* heap_;
   size_t used_ = 0;
 };
@@ -71,13 +93,13 @@ inline auto SegmentAllocator::Allocate(uint32_t size) -> std::pair<Ptr, uint8_t*
   uint64_t seg_ptr = iptr & kSegmentAlignMask;
 
   // could be speed up using last used seg_ptr.
-  auto [it, inserted] = rev_indx_.emplace(seg_ptr, address_table_.size());
+  auto [it, inserted] = rev_indx_.emplace(seg_ptr, rev_indx_.size());
   if (inserted) {
     ValidateMapSize();
-    address_table_.push_back((uint8_t*)seg_ptr);
+    address_table_[it->second] = (uint8_t*)seg_ptr;
   }
 
-  Ptr res = (((iptr - seg_ptr) / 8) << kSegmentIdBits) | it->second;
+  Ptr res = (Ptr((iptr - seg_ptr) / 8) << kSegmentIdBits) | it->second;
   used_ += mi_good_size(size);
 
   return std::make_pair(res, (uint8_t*)ptr);
@@ -26,7 +26,10 @@ class XXH3_Deleter {
 
 struct TL {
   unique_ptr<XXH3_state_t, XXH3_Deleter> xxh_state;
-  unique_ptr<SegmentAllocator> seg_alloc;
+  unique_ptr<SegmentAllocator> own_alloc;
+
+  // Usually points to own_alloc, overridden by ForeignReadScope.
+  SegmentAllocator* seg_alloc = nullptr;
 };
 
 thread_local TL tl;
@@ -38,7 +41,8 @@ constexpr XXH64_hash_t kHashSeed = 24061983;  // same as in compact_object.cc
 void SmallString::InitThreadLocal(void* heap) {
   SegmentAllocator* ns = new SegmentAllocator((mi_heap_t*)heap);
 
-  tl.seg_alloc.reset(ns);
+  tl.own_alloc.reset(ns);
+  tl.seg_alloc = ns;
   tl.xxh_state.reset(XXH3_createState());
   XXH3_64bits_reset_withSeed(tl.xxh_state.get(), kHashSeed);
 }
@@ -47,8 +51,46 @@ size_t SmallString::UsedThreadLocal() {
   return tl.seg_alloc ? tl.seg_alloc->used() : 0;
 }
 
+size_t SmallString::SegmentsThreadLocal() {
+  return tl.seg_alloc ? tl.seg_alloc->num_segments() : 0;
+}
+
+size_t SmallString::MaxSegments() {
+  return SegmentAllocator::kMaxSegments;
+}
+
+SegmentAllocator* SmallString::ThreadAllocator() {
+  return tl.own_alloc.get();
+}
+
+SmallString::ForeignReadScope::ForeignReadScope(SegmentAllocator* owner) : prev_(tl.seg_alloc) {
+  tl.seg_alloc = owner;
+}
+
+SmallString::ForeignReadScope::~ForeignReadScope() {
+  tl.seg_alloc = prev_;
+}
+
 static_assert(sizeof(SmallString) == 16);
 
+uint64_t SmallString::small_ptr() const {
+#ifdef DFLY_WIDE_SMALL_PTR
+  return small_ptr_ | (uint64_t(small_ptr_hi_) << 32);
+#else
+  return small_ptr_;
+#endif
+}
+
+void SmallString::set_small_ptr(uint64_t ptr) {
+  // The prefix gives up the bytes of the pointer beyond 32 bits.
+  static_assert(SegmentAllocator::kPtrBits <= 8 * (sizeof(SmallString) - kPrefLen - sizeof(size_)));
+
+  small_ptr_ = uint32_t(ptr);
+#ifdef DFLY_WIDE_SMALL_PTR
+  small_ptr_hi_ = uint8_t(ptr >> 32);
+#endif
+}
+
 // we should use only for sizes greater than kPrefLen
 size_t SmallString::Assign(std::string_view s) {
   DCHECK_GT(s.size(), kPrefLen);
@@ -58,18 +100,18 @@ size_t SmallString::Assign(std::string_view s) {
   if (size_ == 0) {
     // packed structs can not be tied here.
     auto [sp, rp] = tl.seg_alloc->Allocate(s.size() - kPrefLen);
-    small_ptr_ = sp;
+    set_small_ptr(sp);
     realptr = rp;
     size_ = s.size();
   } else if (s.size() <= size_) {
-    realptr = tl.seg_alloc->Translate(small_ptr_);
+    realptr = tl.seg_alloc->Translate(small_ptr());
 
     if (s.size() < size_) {
       size_t capacity = mi_usable_size(realptr);
       if (s.size() * 2 < capacity) {
-        tl.seg_alloc->Free(small_ptr_);
+        tl.seg_alloc->Free(small_ptr());
         auto [sp, rp] = tl.seg_alloc->Allocate(s.size() - kPrefLen);
-        small_ptr_ = sp;
+        set_small_ptr(sp);
         realptr = rp;
       }
       size_ = s.size();
@@ -88,14 +130,14 @@ void SmallString::Free() {
   if (size_ <= kPrefLen)
     return;
 
-  tl.seg_alloc->Free(small_ptr_);
+  tl.seg_alloc->Free(small_ptr());
   size_ = 0;
 }
 
 uint16_t SmallString::MallocUsed() const {
   if (size_ <= kPrefLen)
     return 0;
-  auto* realptr = tl.seg_alloc->Translate(small_ptr_);
+  auto* realptr = tl.seg_alloc->Translate(small_ptr());
 
   return mi_malloc_usable_size(realptr);
 }
@@ -112,7 +154,7 @@ bool SmallString::Equal(std::string_view o) const {
   if (memcmp(prefix_, o.data(), kPrefLen) != 0)
     return false;
 
-  uint8_t* realp = tl.seg_alloc->Translate(small_ptr_);
+  uint8_t* realp = tl.seg_alloc->Translate(small_ptr());
 
   return memcmp(realp, o.data() + kPrefLen, size_ - kPrefLen) == 0;
 }
@@ -150,7 +192,7 @@ void SmallString::Get(std::string* dest) const {
   if (size_) {
     DCHECK_GT(size_, kPrefLen);
     memcpy(dest->data(), prefix_, kPrefLen);
-    uint8_t* ptr = tl.seg_alloc->Translate(small_ptr_);
+    uint8_t* ptr = tl.seg_alloc->Translate(small_ptr());
     memcpy(dest->data() + kPrefLen, ptr, size_ - kPrefLen);
   }
 }
@@ -163,7 +205,7 @@ unsigned SmallString::GetV(string_view dest[2]) const {
   }
 
   dest[0] = string_view{prefix_, kPrefLen};
-  uint8_t* ptr = tl.seg_alloc->Translate(small_ptr_);
+  uint8_t* ptr = tl.seg_alloc->Translate(small_ptr());
   dest[1] = string_view{reinterpret_cast<char*>(ptr), size_ - kPrefLen};
   return 2;
 }
@@ -174,15 +216,15 @@ bool SmallString::DefragIfNeeded(float ratio) {
     return false;
   }
 
-  uint8_t* cur_real_ptr = tl.seg_alloc->Translate(small_ptr_);
+  uint8_t* cur_real_ptr = tl.seg_alloc->Translate(small_ptr());
   if (!mi_heap_page_is_underutilized(tl.seg_alloc->heap(), cur_real_ptr, ratio))
     return false;
 
   auto [sp, rp] = tl.seg_alloc->Allocate(size_ - kPrefLen);
 
   memcpy(rp, cur_real_ptr, size_ - kPrefLen);
-  tl.seg_alloc->Free(small_ptr_);
-  small_ptr_ = sp;
+  tl.seg_alloc->Free(small_ptr());
+  set_small_ptr(sp);
 
   return true;
 }
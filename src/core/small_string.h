@@ -9,17 +9,42 @@
 
 namespace dfly {
 
+class SegmentAllocator;
+
 // blob strings of upto ~64KB. Small sizes are probably predominant
 // for in-memory workloads, especially for keys.
 // Please note that this class does not have automatic constructors and destructors, therefore
 // it requires explicit management.
 class SmallString {
+#ifdef DFLY_WIDE_SMALL_PTR
+  static constexpr unsigned kPrefLen = 9;  // a byte of the prefix extends small_ptr_.
+#else
   static constexpr unsigned kPrefLen = 10;
+#endif
 
  public:
   static void InitThreadLocal(void* heap);
   static size_t UsedThreadLocal();
 
+  // The mimalloc segments that the small strings of the calling thread span, and their limit.
+  static size_t SegmentsThreadLocal();
+  static size_t MaxSegments();
+
+  // Returns the allocator that owns small strings created by the calling thread.
+  static SegmentAllocator* ThreadAllocator();
+
+  // Lets the calling thread read small strings owned by another thread via that thread's
+  // allocator. Only const accessors may be used within the scope and it must not span
+  // preemption points, because the calling thread may own small strings of its own.
+  class ForeignReadScope {
+   public:
+    explicit ForeignReadScope(SegmentAllocator* owner);
+    ~ForeignReadScope();
+
+   private:
+    SegmentAllocator* prev_;
+  };
+
   void Reset() {
     size_ = 0;
   }
@@ -50,11 +75,17 @@ class SmallString {
   bool DefragIfNeeded(float ratio);
 
  private:
+  uint64_t small_ptr() const;
+  void set_small_ptr(uint64_t ptr);
+
   // prefix of the string that is broken down into 2 parts.
   char prefix_[kPrefLen];
 
   uint32_t small_ptr_;  // 32GB capacity because we ignore 3 lsb bits (i.e. x8).
-  uint16_t size_;       // uint16_t - total size (including prefix)
+#ifdef DFLY_WIDE_SMALL_PTR
+  uint8_t small_ptr_hi_;  // the bits 32-39 of the pointer, 8TB capacity.
+#endif
+  uint16_t size_;  // uint16_t - total size (including prefix)
 
 } __attribute__((packed));
 
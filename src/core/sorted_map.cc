@@ -0,0 +1,364 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/sorted_map.h"
+
+#include <cmath>
+#include <vector>
+
+#include "base/logging.h"
+#include "core/compact_object.h"
+
+extern "C" {
+#include "redis/listpack.h"
+#include "redis/util.h"
+#include "redis/zmalloc.h"
+}
+
+using namespace std;
+
+namespace dfly {
+
+namespace {
+
+inline char* ScorePtr(sds member) {
+  return member + sdslen(member) + 1;
+}
+
+void SetScore(sds member, double score) {
+  memcpy(ScorePtr(member), &score, sizeof(score));
+}
+
+sds MakeMember(string_view member, double score) {
+  sds res = sdsnewlen(SDS_NOINIT, member.size() + 1 + sizeof(double));
+  sdssetlen(res, member.size());
+  if (!member.empty()) {
+    memcpy(res, member.data(), member.size());
+  }
+  res[member.size()] = '\0';
+  SetScore(res, score);
+
+  return res;
+}
+
+inline string_view ToSV(sds member) {
+  return string_view{member, sdslen(member)};
+}
+
+}  // namespace
+
+SortedMap::SortedMap(pmr::memory_resource* mr) : members_(mr), score_tree_(mr) {
+}
+
+SortedMap::~SortedMap() {
+  // The tree references the members, so release it first.
+  score_tree_.Clear();
+}
+
+double SortedMap::MemberScore(sds member) {
+  double score;
+  memcpy(&score, ScorePtr(member), sizeof(score));
+  return score;
+}
+
+int SortedMap::Add(double score, string_view member, int in_flags, int* out_flags,
+                   double* newscore) {
+  bool incr = (in_flags & ZADD_IN_INCR) != 0;
+  bool nx = (in_flags & ZADD_IN_NX) != 0;
+  bool xx = (in_flags & ZADD_IN_XX) != 0;
+  bool gt = (in_flags & ZADD_IN_GT) != 0;
+  bool lt = (in_flags & ZADD_IN_LT) != 0;
+  *out_flags = 0;
+
+  if (isnan(score)) {
+    *out_flags = ZADD_OUT_NAN;
+    return 0;
+  }
+
+  sds obj = members_.Find(member);
+  if (obj) {
+    if (nx) {
+      *out_flags |= ZADD_OUT_NOP;
+      return 1;
+    }
+
+    double curscore = MemberScore(obj);
+    if (incr) {
+      score += curscore;
+      if (isnan(score)) {
+        *out_flags |= ZADD_OUT_NAN;
+        return 0;
+      }
+    }
+
+    if ((lt && score >= curscore) || (gt && score <= curscore)) {
+      *out_flags |= ZADD_OUT_NOP;
+      return 1;
+    }
+
+    if (newscore)
+      *newscore = score;
+
+    if (score != curscore) {
+      CHECK(score_tree_.Delete(ScoredMember{curscore, obj}));
+      SetScore(obj, score);
+      score_tree_.Insert(ScoredMember{score, obj});
+      *out_flags |= ZADD_OUT_UPDATED;
+    }
+    return 1;
+  }
+
+  if (xx) {
+    *out_flags |= ZADD_OUT_NOP;
+    return 1;
+  }
+
+  obj = MakeMember(member, score);
+  members_.Add(obj);
+  score_tree_.Insert(ScoredMember{score, obj});
+  *out_flags |= ZADD_OUT_ADDED;
+  if (newscore)
+    *newscore = score;
+
+  return 1;
+}
+
+bool SortedMap::Insert(double score, string_view member) {
+  if (members_.Find(member))
+    return false;
+
+  sds obj = MakeMember(member, score);
+  members_.Add(obj);
+  score_tree_.Insert(ScoredMember{score, obj});
+  return true;
+}
+
+bool SortedMap::Delete(string_view member) {
+  sds obj = members_.Find(member);
+  if (!obj)
+    return false;
+
+  CHECK(score_tree_.Delete(ScoredMember{MemberScore(obj), obj}));
+  members_.Erase(member);  // frees obj.
+
+  return true;
+}
+
+optional<double> SortedMap::GetScore(string_view member) const {
+  sds obj = members_.Find(member);
+  if (!obj)
+    return nullopt;
+
+  return MemberScore(obj);
+}
+
+optional<size_t> SortedMap::GetRank(string_view member, bool reverse) const {
+  sds obj = members_.Find(member);
+  if (!obj)
+    return nullopt;
+
+  optional<size_t> rank = score_tree_.GetRank(ScoredMember{MemberScore(obj), obj});
+  DCHECK(rank);
+
+  return reverse ? Size() - 1 - *rank : *rank;
+}
+
+size_t SortedMap::MallocUsed() const {
+  return members_.ObjMallocUsed() + members_.SetMallocUsed() + score_tree_.MallocUsed();
+}
+
+auto SortedMap::FirstInRange(const zrangespec& range) const -> pair<Iterator, size_t> {
+  auto res = score_tree_.LowerBound(
+      [&range](const ScoredMember& sm) { return !zslValueGteMin(sm.score, &range); });
+
+  if (res.first.IsEnd() || !zslValueLteMax(res.first->score, &range))
+    return {Iterator{}, 0};
+
+  return res;
+}
+
+auto SortedMap::LastInRange(const zrangespec& range) const -> pair<Iterator, size_t> {
+  // Find the first member above the range and step back.
+  auto [it, rank] = score_tree_.LowerBound(
+      [&range](const ScoredMember& sm) { return zslValueLteMax(sm.score, &range); });
+
+  if (rank == 0)
+    return {Iterator{}, 0};
+
+  if (it.IsEnd()) {
+    it = score_tree_.Last();
+  } else {
+    --it;
+  }
+  --rank;
+
+  if (!zslValueGteMin(it->score, &range))
+    return {Iterator{}, 0};
+
+  return {it, rank};
+}
+
+auto SortedMap::FirstInLexRange(const zlexrangespec& range) const -> pair<Iterator, size_t> {
+  auto res = score_tree_.LowerBound(
+      [&range](const ScoredMember& sm) { return !zslLexValueGteMin(sm.member, &range); });
+
+  if (res.first.IsEnd() || !zslLexValueLteMax(res.first->member, &range))
+    return {Iterator{}, 0};
+
+  return res;
+}
+
+auto SortedMap::LastInLexRange(const zlexrangespec& range) const -> pair<Iterator, size_t> {
+  auto [it, rank] = score_tree_.LowerBound(
+      [&range](const ScoredMember& sm) { return zslLexValueLteMax(sm.member, &range); });
+
+  if (rank == 0)
+    return {Iterator{}, 0};
+
+  if (it.IsEnd()) {
+    it = score_tree_.Last();
+  } else {
+    --it;
+  }
+  --rank;
+
+  if (!zslLexValueGteMin(it->member, &range))
+    return {Iterator{}, 0};
+
+  return {it, rank};
+}
+
+unsigned SortedMap::DeleteRangeByRank(unsigned start, unsigned end) {
+  DCHECK_LE(start, end);
+  return DeleteRange(start, end - start + 1);
+}
+
+unsigned SortedMap::DeleteRangeByScore(const zrangespec& range) {
+  auto first = FirstInRange(range);
+  if (first.first.IsEnd())
+    return 0;
+
+  auto last = LastInRange(range);
+  DCHECK(!last.first.IsEnd());
+
+  return DeleteRange(first.second, last.second - first.second + 1);
+}
+
+unsigned SortedMap::DeleteRangeByLex(const zlexrangespec& range) {
+  auto first = FirstInLexRange(range);
+  if (first.first.IsEnd())
+    return 0;
+
+  auto last = LastInLexRange(range);
+  DCHECK(!last.first.IsEnd());
+
+  return DeleteRange(first.second, last.second - first.second + 1);
+}
+
+unsigned SortedMap::DeleteRange(size_t first, size_t count) {
+  vector<ScoredMember> victims;
+  victims.reserve(count);
+
+  for (auto it = score_tree_.AtRank(first); count > 0 && !it.IsEnd(); ++it, --count) {
+    victims.push_back(*it);
+  }
+
+  // The tree compares members, hence each member is released after its removal from the tree.
+  for (const ScoredMember& sm : victims) {
+    CHECK(score_tree_.Delete(sm));
+    members_.Erase(ToSV(sm.member));
+  }
+
+  return victims.size();
+}
+
+uint32_t SortedMap::Scan(uint32_t cursor, const function<void(sds, double)>& cb) const {
+  return members_.Scan(cursor, [&cb](const void* obj) {
+    sds member = (sds)obj;
+    cb(member, MemberScore(member));
+  });
+}
+
+uint32_t SortedMap::Scan(uint32_t cursor, size_t count,
+                         const function<void(sds, double)>& cb) const {
+  return members_.Scan(cursor, count, [&cb](const void* obj) {
+    sds member = (sds)obj;
+    cb(member, MemberScore(member));
+  });
+}
+
+uint8_t* SortedMap::ToListPack() const {
+  uint8_t* lp = lpNew(0);
+  char buf[128];
+
+  for (auto it = score_tree_.begin(); !it.IsEnd(); ++it) {
+    lp = lpAppend(lp, (const uint8_t*)it->member, sdslen(it->member));
+    int len = d2string(buf, sizeof(buf), it->score);
+    lp = lpAppend(lp, (const uint8_t*)buf, len);
+  }
+
+  return lp;
+}
+
+SortedMap* SortedMap::FromListPack(pmr::memory_resource* mr, const uint8_t* lp) {
+  uint8_t* zl = const_cast<uint8_t*>(lp);
+  SortedMap* res = new SortedMap(mr);
+  char intbuf[LP_INTBUF_SIZE];
+
+  for (uint8_t* eptr = lpFirst(zl); eptr;) {
+    uint8_t* sptr = lpNext(zl, eptr);
+    DCHECK(sptr);
+
+    unsigned vlen = 0;
+    long long vlong = 0;
+    uint8_t* vstr = lpGetValue(eptr, &vlen, &vlong);
+
+    string_view member;
+    if (vstr) {
+      member = string_view{reinterpret_cast<const char*>(vstr), vlen};
+    } else {
+      member = string_view{intbuf, size_t(ll2string(intbuf, sizeof(intbuf), vlong))};
+    }
+
+    res->Insert(zzlGetScore(sptr), member);
+    eptr = lpNext(zl, sptr);
+  }
+
+  return res;
+}
+
+uint64_t SortedMap::MemberSet::Hash(const void* obj, uint32_t cookie) const {
+  DCHECK_LT(cookie, 2u);
+
+  if (cookie == 0)
+    return CompactObj::HashCode(ToSV((sds)obj));
+
+  return CompactObj::HashCode(*(const string_view*)obj);
+}
+
+bool SortedMap::MemberSet::ObjEqual(const void* left, const void* right,
+                                    uint32_t right_cookie) const {
+  DCHECK_LT(right_cookie, 2u);
+
+  string_view left_sv = ToSV((sds)left);
+  if (right_cookie == 0)
+    return left_sv == ToSV((sds)right);
+
+  return left_sv == *(const string_view*)right;
+}
+
+size_t SortedMap::MemberSet::ObjectAllocSize(const void* obj) const {
+  return zmalloc_usable_size(sdsAllocPtr((sds)obj));
+}
+
+uint32_t SortedMap::MemberSet::ObjExpireTime(const void* obj) const {
+  // Members do not expire.
+  return UINT32_MAX;
+}
+
+void SortedMap::MemberSet::ObjDelete(void* obj, bool has_ttl) const {
+  sdsfree((sds)obj);
+}
+
+}  // namespace dfly
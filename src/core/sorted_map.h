@@ -0,0 +1,159 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <functional>
+#include <optional>
+#include <string_view>
+
+#include "core/bptree.h"
+#include "core/dense_set.h"
+
+extern "C" {
+#include "redis/sds.h"
+#include "redis/zset.h"
+}
+
+namespace dfly {
+
+// Sorted set of members with scores, used for sorted sets that outgrow listpack.
+// Each member is a single sds allocation that also holds its score:
+// [sds header][member]['\0'][score: 8 bytes]
+// Members are referenced by a hash index that serves lookups by member and by a B+tree,
+// ordered by (score, member), that serves rank and range queries. Unlike the redis skiplist,
+// the tree keeps scores next to the member pointers in its nodes, so descending the tree
+// dereferences members only to break ties between equal scores.
+class SortedMap {
+ public:
+  struct ScoredMember {
+    double score;
+    sds member;
+  };
+
+  struct ScoredMemberPolicy {
+    static bool Less(const ScoredMember& a, const ScoredMember& b) {
+      if (a.score != b.score)
+        return a.score < b.score;
+      return sdscmp(a.member, b.member) < 0;
+    }
+  };
+
+  using ScoreTree = BPTree<ScoredMember, ScoredMemberPolicy>;
+  using Iterator = ScoreTree::Iterator;
+
+  explicit SortedMap(std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+  ~SortedMap();
+
+  SortedMap(const SortedMap&) = delete;
+  SortedMap& operator=(const SortedMap&) = delete;
+
+  // Same contract as redis zsetAdd: in_flags is a mask of ZADD_IN_* flags, out_flags is set
+  // to a mask of ZADD_OUT_* flags. Returns 0 if the resulting score is NaN, 1 otherwise.
+  int Add(double score, std::string_view member, int in_flags, int* out_flags,
+          double* newscore);
+
+  // Inserts a member that does not exist yet. Returns false if it already exists.
+  bool Insert(double score, std::string_view member);
+
+  bool Delete(std::string_view member);
+
+  std::optional<double> GetScore(std::string_view member) const;
+
+  // Returns the 0-based rank of the member.
+  std::optional<size_t> GetRank(std::string_view member, bool reverse) const;
+
+  size_t Size() const {
+    return score_tree_.Size();
+  }
+
+  size_t MallocUsed() const;
+
+  // Moves the hash index off underutilized pages, see DenseSet::Defrag. The members themselves
+  // stay in place since the tree references them. Returns the number of bytes moved.
+  size_t Defrag(float ratio) {
+    return members_.Defrag(ratio);
+  }
+
+  Iterator begin() const {
+    return score_tree_.begin();
+  }
+
+  Iterator Last() const {
+    return score_tree_.Last();
+  }
+
+  Iterator AtRank(size_t rank) const {
+    return score_tree_.AtRank(rank);
+  }
+
+  // Return the first (last) member with a score in range together with its rank,
+  // or the end iterator if there is none.
+  std::pair<Iterator, size_t> FirstInRange(const zrangespec& range) const;
+  std::pair<Iterator, size_t> LastInRange(const zrangespec& range) const;
+
+  // Same for lexicographical ranges. Assumes that all the members have the same score.
+  std::pair<Iterator, size_t> FirstInLexRange(const zlexrangespec& range) const;
+  std::pair<Iterator, size_t> LastInLexRange(const zlexrangespec& range) const;
+
+  // start and end are 0-based inclusive ranks. Return the number of deleted members.
+  unsigned DeleteRangeByRank(unsigned start, unsigned end);
+  unsigned DeleteRangeByScore(const zrangespec& range);
+  unsigned DeleteRangeByLex(const zlexrangespec& range);
+
+  // Scans the members in hash order, see DenseSet::Scan.
+  uint32_t Scan(uint32_t cursor, const std::function<void(sds member, double score)>& cb) const;
+
+  // Reports about count members, see DenseSet::Scan.
+  uint32_t Scan(uint32_t cursor, size_t count,
+                const std::function<void(sds member, double score)>& cb) const;
+
+  // Returns a listpack in zset layout with all the members ordered by score.
+  uint8_t* ToListPack() const;
+
+  // Builds a map from a zset listpack. Does not take ownership of lp.
+  static SortedMap* FromListPack(std::pmr::memory_resource* mr, const uint8_t* lp);
+
+  // Returns the score of a member referenced by an iterator or passed to the Scan callback.
+  static double MemberScore(sds member);
+
+ private:
+  // Hash index of the member allocations. Owns them.
+  class MemberSet : public DenseSet {
+   public:
+    explicit MemberSet(std::pmr::memory_resource* mr) : DenseSet(mr) {
+    }
+
+    ~MemberSet() {
+      ClearInternal();
+    }
+
+    sds Find(std::string_view member) const {
+      return (sds)FindInternal(&member, 1);
+    }
+
+    bool Add(sds member) {
+      return AddInternal(member, false);
+    }
+
+    bool Erase(std::string_view member) {
+      return EraseInternal(&member, 1);
+    }
+
+   protected:
+    uint64_t Hash(const void* obj, uint32_t cookie) const override;
+    bool ObjEqual(const void* left, const void* right, uint32_t right_cookie) const override;
+    size_t ObjectAllocSize(const void* obj) const override;
+    uint32_t ObjExpireTime(const void* obj) const override;
+    void ObjDelete(void* obj, bool has_ttl) const override;
+  };
+
+  // Deletes the members of the tree range [first rank, first rank + count).
+  unsigned DeleteRange(size_t first, size_t count);
+
+  MemberSet members_;
+  ScoreTree score_tree_;
+};
+
+}  // namespace dfly
@@ -0,0 +1,218 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/sorted_map.h"
+
+#include <gtest/gtest.h>
+#include <mimalloc.h>
+
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+
+#include <absl/strings/str_cat.h>
+
+#include "glog/logging.h"
+
+extern "C" {
+#include "redis/listpack.h"
+#include "redis/zmalloc.h"
+}
+
+namespace dfly {
+
+using namespace std;
+using absl::StrCat;
+
+class SortedMapTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    auto* tlh = mi_heap_get_backing();
+    init_zmalloc_threadlocal(tlh);
+  }
+
+  void SetUp() override {
+    sm_.reset(new SortedMap);
+  }
+
+  void TearDown() override {
+    sm_.reset();
+
+    // ensure there are no memory leaks after every test
+    EXPECT_EQ(zmalloc_used_memory_tl, 0);
+  }
+
+  vector<string> Members() const {
+    vector<string> res;
+    for (auto it = sm_->begin(); !it.IsEnd(); ++it) {
+      res.emplace_back(it->member, sdslen(it->member));
+    }
+    return res;
+  }
+
+  unique_ptr<SortedMap> sm_;
+};
+
+TEST_F(SortedMapTest, Add) {
+  int out_flags = 0;
+  double new_score = 0;
+
+  EXPECT_EQ(1, sm_->Add(2, "b", 0, &out_flags, &new_score));
+  EXPECT_EQ(ZADD_OUT_ADDED, out_flags);
+  EXPECT_EQ(1, sm_->Add(1, "a", 0, &out_flags, nullptr));
+  EXPECT_EQ(1, sm_->Add(1, "c", 0, &out_flags, nullptr));
+  EXPECT_EQ(3, sm_->Size());
+  EXPECT_EQ(vector<string>({"a", "c", "b"}), Members());
+
+  EXPECT_EQ(1, sm_->Add(5, "a", ZADD_IN_INCR, &out_flags, &new_score));
+  EXPECT_EQ(ZADD_OUT_UPDATED, out_flags);
+  EXPECT_EQ(6, new_score);
+  EXPECT_EQ(6, sm_->GetScore("a"));
+  EXPECT_EQ(vector<string>({"c", "b", "a"}), Members());
+
+  EXPECT_EQ(1, sm_->Add(0, "a", ZADD_IN_GT, &out_flags, nullptr));
+  EXPECT_EQ(ZADD_OUT_NOP, out_flags);
+  EXPECT_EQ(1, sm_->Add(0, "a", ZADD_IN_NX, &out_flags, nullptr));
+  EXPECT_EQ(ZADD_OUT_NOP, out_flags);
+  EXPECT_EQ(1, sm_->Add(0, "d", ZADD_IN_XX, &out_flags, nullptr));
+  EXPECT_EQ(ZADD_OUT_NOP, out_flags);
+  EXPECT_FALSE(sm_->GetScore("d"));
+
+  EXPECT_EQ(0, sm_->Add(NAN, "a", 0, &out_flags, nullptr));
+  EXPECT_EQ(ZADD_OUT_NAN, out_flags);
+  EXPECT_EQ(1, sm_->Add(INFINITY, "inf", 0, &out_flags, nullptr));
+  EXPECT_EQ(0, sm_->Add(-INFINITY, "inf", ZADD_IN_INCR, &out_flags, nullptr));
+
+  EXPECT_EQ(0, sm_->GetRank("c", false));
+  EXPECT_EQ(3, sm_->GetRank("c", true));
+  EXPECT_FALSE(sm_->GetRank("d", false));
+
+  EXPECT_TRUE(sm_->Delete("c"));
+  EXPECT_FALSE(sm_->Delete("c"));
+  EXPECT_EQ(vector<string>({"b", "a", "inf"}), Members());
+}
+
+TEST_F(SortedMapTest, Ranges) {
+  constexpr unsigned kNum = 1000;
+  int out_flags = 0;
+  for (unsigned i = 0; i < kNum; ++i) {
+    sm_->Add(i / 2, StrCat("m", 10000 + i), 0, &out_flags, nullptr);
+  }
+
+  zrangespec range{.min = 10, .max = 20, .minex = 0, .maxex = 1};
+  auto [first, first_rank] = sm_->FirstInRange(range);
+  ASSERT_FALSE(first.IsEnd());
+  EXPECT_EQ(10, first->score);
+  EXPECT_EQ(20, first_rank);
+
+  auto [last, last_rank] = sm_->LastInRange(range);
+  ASSERT_FALSE(last.IsEnd());
+  EXPECT_EQ(19, last->score);
+  EXPECT_EQ(39, last_rank);
+
+  range = zrangespec{.min = 1000, .max = 2000, .minex = 0, .maxex = 0};
+  EXPECT_TRUE(sm_->FirstInRange(range).first.IsEnd());
+  EXPECT_TRUE(sm_->LastInRange(range).first.IsEnd());
+
+  range = zrangespec{.min = 100, .max = 110, .minex = 1, .maxex = 1};
+  EXPECT_EQ(18, sm_->DeleteRangeByScore(range));
+  EXPECT_EQ(kNum - 18, sm_->Size());
+  EXPECT_FALSE(sm_->GetScore("m10210"));
+
+  EXPECT_EQ(100, sm_->DeleteRangeByRank(0, 99));
+  EXPECT_EQ(50, sm_->begin()->score);
+  EXPECT_EQ(0, sm_->GetRank("m10100", false));
+}
+
+TEST_F(SortedMapTest, LexRanges) {
+  int out_flags = 0;
+  for (char c = 'a'; c <= 'z'; ++c) {
+    sm_->Add(0, string(1, c), 0, &out_flags, nullptr);
+  }
+
+  zlexrangespec range;
+  range.min = sdsnew("c");
+  range.max = sdsnew("f");
+  range.minex = 1;
+  range.maxex = 0;
+
+  auto [first, first_rank] = sm_->FirstInLexRange(range);
+  ASSERT_FALSE(first.IsEnd());
+  EXPECT_STREQ("d", first->member);
+  EXPECT_EQ(3, first_rank);
+
+  auto [last, last_rank] = sm_->LastInLexRange(range);
+  ASSERT_FALSE(last.IsEnd());
+  EXPECT_STREQ("f", last->member);
+  EXPECT_EQ(5, last_rank);
+
+  EXPECT_EQ(3, sm_->DeleteRangeByLex(range));
+  EXPECT_EQ(23, sm_->Size());
+  zslFreeLexRange(&range);
+}
+
+TEST_F(SortedMapTest, Random) {
+  mt19937 gen(1);
+  map<string, double> ref;
+  int out_flags = 0;
+
+  for (unsigned i = 0; i < 50000; ++i) {
+    string member = StrCat("member:", gen() % 5000);
+    double score = gen() % 100;
+    if (gen() % 4 == 0) {
+      ASSERT_EQ(ref.erase(member) > 0, sm_->Delete(member));
+    } else {
+      ref[member] = score;
+      sm_->Add(score, member, 0, &out_flags, nullptr);
+    }
+  }
+
+  ASSERT_EQ(ref.size(), sm_->Size());
+  set<pair<double, string>> ordered;
+  for (const auto& [member, score] : ref) {
+    ASSERT_EQ(score, sm_->GetScore(member));
+    ordered.emplace(score, member);
+  }
+
+  size_t rank = 0;
+  auto it = sm_->begin();
+  for (const auto& [score, member] : ordered) {
+    ASSERT_FALSE(it.IsEnd());
+    ASSERT_EQ(score, it->score);
+    ASSERT_EQ(member, it->member);
+    ASSERT_EQ(rank++, sm_->GetRank(member, false));
+    ++it;
+  }
+
+  size_t scanned = 0;
+  uint32_t cursor = 0;
+  do {
+    cursor = sm_->Scan(cursor, [&](sds member, double score) {
+      ++scanned;
+      ASSERT_EQ(ref[string(member, sdslen(member))], score);
+    });
+  } while (cursor);
+  EXPECT_EQ(ref.size(), scanned);
+}
+
+TEST_F(SortedMapTest, ListPack) {
+  int out_flags = 0;
+  sm_->Add(1.5, "x", 0, &out_flags, nullptr);
+  sm_->Add(-3, "123", 0, &out_flags, nullptr);
+  sm_->Add(7, "y", 0, &out_flags, nullptr);
+
+  uint8_t* lp = sm_->ToListPack();
+  EXPECT_EQ(6, lpLength(lp));
+
+  unique_ptr<SortedMap> copy{SortedMap::FromListPack(pmr::get_default_resource(), lp)};
+  lpFree(lp);
+
+  EXPECT_EQ(3, copy->Size());
+  EXPECT_EQ(-3, copy->GetScore("123"));
+  EXPECT_EQ(1.5, copy->GetScore("x"));
+  EXPECT_EQ(2, copy->GetRank("y", false));
+}
+
+}  // namespace dfly
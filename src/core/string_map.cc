@@ -0,0 +1,189 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/string_map.h"
+
+#include "base/endian.h"
+#include "base/logging.h"
+#include "core/compact_object.h"
+
+extern "C" {
+#include "redis/zmalloc.h"
+}
+
+using namespace std;
+
+namespace dfly {
+
+namespace {
+
+constexpr size_t kValueLenSize = 4;
+constexpr size_t kExpireTimeSize = 4;
+
+// Marks the value length of the entries that are followed by their expire time.
+constexpr uint32_t kTtlFlag = 1u << 31;
+
+// sds allocates the header according to the total length, so the value lives in
+// the free space of the field string. expire_at is UINT32_MAX for an entry without a ttl.
+sds MakeEntry(string_view field, string_view value, uint32_t expire_at) {
+  DCHECK_LT(value.size(), kTtlFlag);
+
+  bool has_ttl = expire_at != UINT32_MAX;
+  size_t total = field.size() + 1 + kValueLenSize + value.size();
+  sds entry = sdsnewlen(SDS_NOINIT, total + (has_ttl ? kExpireTimeSize : 0));
+  sdssetlen(entry, field.size());
+
+  char* next = entry;
+  if (!field.empty()) {
+    memcpy(next, field.data(), field.size());
+  }
+  next += field.size();
+  *next++ = '\0';
+
+  absl::little_endian::Store32(next, value.size() | (has_ttl ? kTtlFlag : 0));
+  next += kValueLenSize;
+  if (!value.empty()) {
+    memcpy(next, value.data(), value.size());
+  }
+  if (has_ttl) {
+    absl::little_endian::Store32(entry + total, expire_at);
+    total += kExpireTimeSize;
+  }
+  entry[total] = '\0';
+
+  return entry;
+}
+
+}  // namespace
+
+bool StringMap::AddOrUpdate(string_view field, string_view value, uint32_t ttl_sec) {
+  DCHECK_GT(ttl_sec, 0u);  // ttl_sec == 0 would mean find and delete immediately
+
+  uint32_t at = ttl_sec == UINT32_MAX ? UINT32_MAX : time_now() + ttl_sec;
+  sds entry = MakeEntry(field, value, at);
+  if (AddInternal(entry, at != UINT32_MAX))
+    return true;
+
+  sds prev = (sds)ReplaceInternal(entry, at != UINT32_MAX);
+  DCHECK(prev);
+  sdsfree(prev);
+  return false;
+}
+
+bool StringMap::AddOrSkip(string_view field, string_view value, uint32_t ttl_sec) {
+  DCHECK_GT(ttl_sec, 0u);
+
+  uint32_t at = ttl_sec == UINT32_MAX ? UINT32_MAX : time_now() + ttl_sec;
+  sds entry = MakeEntry(field, value, at);
+  if (AddInternal(entry, at != UINT32_MAX))
+    return true;
+
+  sdsfree(entry);
+  return false;
+}
+
+bool StringMap::SetExpire(string_view field, uint32_t ttl_sec) {
+  DCHECK_GT(ttl_sec, 0u);
+
+  sds entry = FindEntry(field);
+  if (!entry)
+    return false;
+
+  uint32_t at = ttl_sec == UINT32_MAX ? UINT32_MAX : time_now() + ttl_sec;
+  if (at == ExpireTime(entry))
+    return true;
+
+  sds prev = (sds)ReplaceInternal(MakeEntry(field, Value(entry), at), at != UINT32_MAX);
+  DCHECK_EQ(prev, entry);
+  sdsfree(prev);
+  return true;
+}
+
+bool StringMap::Erase(string_view field) {
+  return EraseInternal(&field, 1);
+}
+
+bool StringMap::Contains(string_view field) const {
+  return FindInternal(&field, 1) != nullptr;
+}
+
+optional<string_view> StringMap::Find(string_view field) const {
+  sds entry = (sds)FindInternal(&field, 1);
+  if (!entry)
+    return nullopt;
+
+  return Value(entry);
+}
+
+void StringMap::Clear() {
+  ClearInternal();
+}
+
+void StringMap::SampleEntries(uint64_t seed, size_t count,
+                              const function<void(sds)>& cb) const {
+  SampleInternal(seed, count, [&cb](const void* obj) { cb((sds)obj); });
+}
+
+string_view StringMap::Value(sds entry) {
+  const char* len_ptr = entry + sdslen(entry) + 1;
+  uint32_t len = absl::little_endian::Load32(len_ptr) & ~kTtlFlag;
+  return string_view{len_ptr + kValueLenSize, len};
+}
+
+uint32_t StringMap::ExpireTime(sds entry) {
+  const char* len_ptr = entry + sdslen(entry) + 1;
+  uint32_t len = absl::little_endian::Load32(len_ptr);
+  if ((len & kTtlFlag) == 0)
+    return UINT32_MAX;
+
+  return absl::little_endian::Load32(len_ptr + kValueLenSize + (len & ~kTtlFlag));
+}
+
+uint32_t StringMap::Scan(uint32_t cursor, const function<void(sds)>& cb) const {
+  return DenseSet::Scan(cursor, [&cb](const void* obj) { cb((sds)obj); });
+}
+
+uint32_t StringMap::Scan(uint32_t cursor, size_t count, const function<void(sds)>& cb) const {
+  return DenseSet::Scan(cursor, count, [&cb](const void* obj) { cb((sds)obj); });
+}
+
+uint64_t StringMap::Hash(const void* ptr, uint32_t cookie) const {
+  DCHECK_LT(cookie, 2u);
+
+  if (cookie == 0) {
+    return CompactObj::HashCode(Field((sds)ptr));
+  }
+
+  const string_view* sv = (const string_view*)ptr;
+  return CompactObj::HashCode(*sv);
+}
+
+bool StringMap::ObjEqual(const void* left, const void* right, uint32_t right_cookie) const {
+  DCHECK_LT(right_cookie, 2u);
+
+  string_view left_sv = Field((sds)left);
+  if (right_cookie == 0) {
+    return left_sv == Field((sds)right);
+  }
+
+  return left_sv == *(const string_view*)right;
+}
+
+size_t StringMap::ObjectAllocSize(const void* obj) const {
+  return zmalloc_usable_size(sdsAllocPtr((sds)obj));
+}
+
+uint32_t StringMap::ObjExpireTime(const void* obj) const {
+  return ExpireTime((sds)obj);
+}
+
+void StringMap::ObjDelete(void* obj, bool has_ttl) const {
+  sdsfree((sds)obj);
+}
+
+void* StringMap::ObjDefrag(void* obj, float ratio) const {
+  return DefragSds(obj, ratio);
+}
+
+}  // namespace dfly
@@ -0,0 +1,127 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <functional>
+#include <optional>
+#include <string_view>
+
+#include "core/dense_set.h"
+
+extern "C" {
+#include "redis/sds.h"
+}
+
+namespace dfly {
+
+// Map of string fields to string values, used for hashes.
+// Each entry is a single allocation that holds the field as sds followed by its value:
+// [sds header][field]['\0'][value length: 4 bytes][value][expire time: 4 bytes]
+// Hence, compared to redis dict, there is no dictEntry and no separate value allocation.
+// Only the fields with a ttl have the expire time, which the top bit of the value length marks.
+// Like the members of StringSet, they expire against time_now(), when they are looked up or
+// iterated over.
+class StringMap : public DenseSet {
+ public:
+  StringMap(std::pmr::memory_resource* res = std::pmr::get_default_resource()) : DenseSet(res) {
+  }
+
+  ~StringMap() {
+    Clear();
+  }
+
+  // Returns true if the field was added, false if it existed and its value was overridden.
+  // The field expires ttl_sec after time_now(), or never if it is UINT32_MAX. Overriding the
+  // value replaces the ttl of the field.
+  bool AddOrUpdate(std::string_view field, std::string_view value,
+                   uint32_t ttl_sec = UINT32_MAX);
+
+  // Returns true if the field was added, false if it existed, in which case its value
+  // and its ttl are not changed.
+  bool AddOrSkip(std::string_view field, std::string_view value, uint32_t ttl_sec = UINT32_MAX);
+
+  // Sets the ttl of an existing field, see AddOrUpdate. Returns false if there is no such field.
+  bool SetExpire(std::string_view field, uint32_t ttl_sec);
+
+  bool Erase(std::string_view field);
+
+  bool Contains(std::string_view field) const;
+
+  // Returns the value of the field or nullopt if it does not exist.
+  // The view is valid until the map is modified.
+  std::optional<std::string_view> Find(std::string_view field) const;
+
+  // Returns the entry of the field or nullptr if it does not exist.
+  sds FindEntry(std::string_view field) const {
+    return (sds)FindInternal(&field, 1);
+  }
+
+  void Clear();
+
+  // Returns a random entry of a non-empty map, see DenseSet::RandomInternal.
+  sds RandomEntry(uint64_t seed) const {
+    return (sds)RandomInternal(seed);
+  }
+
+  // Calls cb for count distinct random entries, see DenseSet::SampleInternal.
+  void SampleEntries(uint64_t seed, size_t count, const std::function<void(sds)>& cb) const;
+
+  // Both accept entries returned by the iterators, Scan, RandomEntry or SampleEntries.
+  static std::string_view Field(sds entry) {
+    return std::string_view{entry, sdslen(entry)};
+  }
+
+  static std::string_view Value(sds entry);
+
+  // The time at which the field of the entry expires, UINT32_MAX if it has no ttl.
+  static uint32_t ExpireTime(sds entry);
+
+  iterator<sds> begin() {
+    return DenseSet::begin<sds>();
+  }
+
+  iterator<sds> end() {
+    return DenseSet::end<sds>();
+  }
+
+  const_iterator<sds> cbegin() const {
+    return DenseSet::cbegin<sds>();
+  }
+
+  const_iterator<sds> cend() const {
+    return DenseSet::cend<sds>();
+  }
+
+  uint32_t Scan(uint32_t cursor, const std::function<void(sds)>& cb) const;
+
+  // Reports about count entries, see DenseSet::Scan.
+  uint32_t Scan(uint32_t cursor, size_t count, const std::function<void(sds)>& cb) const;
+
+  // The time of the next pass of the owner over the fields with a ttl, which deletes these that
+  // expired, or 0 if it scheduled none. It is kept with the map, so that the owner schedules a
+  // single pass however many fields get a ttl until then.
+  uint32_t expire_pass_at() const {
+    return expire_pass_at_;
+  }
+
+  void set_expire_pass_at(uint32_t at) {
+    expire_pass_at_ = at;
+  }
+
+ protected:
+  uint64_t Hash(const void* ptr, uint32_t cookie) const override;
+
+  bool ObjEqual(const void* left, const void* right, uint32_t right_cookie) const override;
+
+  size_t ObjectAllocSize(const void* obj) const override;
+  uint32_t ObjExpireTime(const void* obj) const override;
+  void ObjDelete(void* obj, bool has_ttl) const override;
+  void* ObjDefrag(void* obj, float ratio) const override;
+
+ private:
+  uint32_t expire_pass_at_ = 0;
+};
+
+}  // namespace dfly
@@ -0,0 +1,174 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/string_map.h"
+
+#include <gtest/gtest.h>
+#include <mimalloc.h>
+
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include <absl/strings/str_cat.h>
+
+#include "core/mi_memory_resource.h"
+#include "glog/logging.h"
+
+extern "C" {
+#include "redis/zmalloc.h"
+}
+
+namespace dfly {
+
+using namespace std;
+using absl::StrCat;
+
+class StringMapTest : public ::testing::Test {
+ protected:
+  static void SetUpTestSuite() {
+    auto* tlh = mi_heap_get_backing();
+    init_zmalloc_threadlocal(tlh);
+  }
+
+  void SetUp() override {
+    sm_.reset(new StringMap);
+  }
+
+  void TearDown() override {
+    sm_.reset();
+
+    // ensure there are no memory leaks after every test
+    EXPECT_EQ(zmalloc_used_memory_tl, 0);
+  }
+
+  unique_ptr<StringMap> sm_;
+};
+
+TEST_F(StringMapTest, Basic) {
+  EXPECT_TRUE(sm_->AddOrUpdate("foo", "bar"));
+  EXPECT_TRUE(sm_->AddOrUpdate("empty", ""));
+  EXPECT_TRUE(sm_->AddOrUpdate("", "empty field"));
+  EXPECT_EQ(3, sm_->Size());
+
+  EXPECT_EQ("bar", sm_->Find("foo"));
+  EXPECT_EQ("", sm_->Find("empty"));
+  EXPECT_EQ("empty field", sm_->Find(""));
+  EXPECT_FALSE(sm_->Find("bar"));
+
+  EXPECT_FALSE(sm_->AddOrUpdate("foo", string(100, 'x')));
+  EXPECT_EQ(string(100, 'x'), sm_->Find("foo"));
+  EXPECT_FALSE(sm_->AddOrUpdate("foo", "baz"));
+  EXPECT_EQ("baz", sm_->Find("foo"));
+
+  EXPECT_FALSE(sm_->AddOrSkip("foo", "skipped"));
+  EXPECT_EQ("baz", sm_->Find("foo"));
+  EXPECT_TRUE(sm_->AddOrSkip("bar", "val"));
+  EXPECT_EQ(4, sm_->Size());
+
+  EXPECT_TRUE(sm_->Contains("bar"));
+  EXPECT_TRUE(sm_->Erase("bar"));
+  EXPECT_FALSE(sm_->Erase("bar"));
+  EXPECT_FALSE(sm_->Contains("bar"));
+  EXPECT_EQ(3, sm_->Size());
+
+  size_t used = sm_->ObjMallocUsed();
+  sm_->Clear();
+  EXPECT_GT(used, 0u);
+  EXPECT_EQ(0, sm_->Size());
+  EXPECT_EQ(0, sm_->ObjMallocUsed());
+}
+
+TEST_F(StringMapTest, Iterate) {
+  mt19937 rand(0);
+  unordered_map<string, string> expected;
+  for (unsigned i = 0; i < 2000; ++i) {
+    string field = StrCat("field", i);
+    string value(rand() % 100, 'a' + i % 26);
+    EXPECT_TRUE(sm_->AddOrUpdate(field, value));
+    expected[field] = value;
+  }
+
+  // Rewrite some of the values to make sure the replaced entries keep their place.
+  for (unsigned i = 0; i < 2000; i += 3) {
+    string field = StrCat("field", i);
+    string value = StrCat("updated", i);
+    EXPECT_FALSE(sm_->AddOrUpdate(field, value));
+    expected[field] = value;
+  }
+
+  unordered_map<string, string> seen;
+  for (sds entry : *sm_) {
+    seen.emplace(StringMap::Field(entry), StringMap::Value(entry));
+  }
+  EXPECT_EQ(expected, seen);
+
+  seen.clear();
+  uint32_t cursor = 0;
+  do {
+    cursor = sm_->Scan(cursor, [&](sds entry) {
+      seen.emplace(StringMap::Field(entry), StringMap::Value(entry));
+    });
+  } while (cursor != 0);
+  EXPECT_EQ(expected, seen);
+
+  for (uint32_t cursor : {0u, 1u << 20, UINT32_MAX}) {
+    sds entry = sm_->RandomEntry(cursor);
+    EXPECT_EQ(expected[string(StringMap::Field(entry))], StringMap::Value(entry));
+  }
+}
+
+TEST_F(StringMapTest, Ttl) {
+  EXPECT_TRUE(sm_->AddOrUpdate("foo", "bar"));
+  EXPECT_FALSE(sm_->ExpirationUsed());
+  EXPECT_TRUE(sm_->AddOrUpdate("bla", "val", 1));
+  EXPECT_TRUE(sm_->ExpirationUsed());
+  EXPECT_EQ(UINT32_MAX, StringMap::ExpireTime(sm_->FindEntry("foo")));
+  EXPECT_EQ(1u, StringMap::ExpireTime(sm_->FindEntry("bla")));
+  EXPECT_EQ("val", sm_->Find("bla"));
+
+  EXPECT_FALSE(sm_->AddOrSkip("bla", "skipped", 10));
+  EXPECT_EQ(1u, StringMap::ExpireTime(sm_->FindEntry("bla")));
+
+  sm_->set_time(1);
+  EXPECT_FALSE(sm_->Find("bla"));
+  EXPECT_EQ(1u, sm_->Size());
+
+  // Setting the value replaces the ttl.
+  EXPECT_TRUE(sm_->AddOrUpdate("bla", "val", 1));
+  EXPECT_FALSE(sm_->AddOrUpdate("bla", "other"));
+  EXPECT_EQ(UINT32_MAX, StringMap::ExpireTime(sm_->FindEntry("bla")));
+
+  EXPECT_TRUE(sm_->SetExpire("foo", 5));
+  EXPECT_EQ(6u, StringMap::ExpireTime(sm_->FindEntry("foo")));
+  EXPECT_EQ("bar", sm_->Find("foo"));
+  EXPECT_TRUE(sm_->SetExpire("foo", UINT32_MAX));
+  EXPECT_EQ(UINT32_MAX, StringMap::ExpireTime(sm_->FindEntry("foo")));
+  EXPECT_FALSE(sm_->SetExpire("missing", 5));
+
+  // The chained entries keep their ttl when their neighbours are deleted.
+  for (unsigned i = 0; i < 1000; ++i) {
+    EXPECT_TRUE(sm_->AddOrUpdate(StrCat("field", i), StrCat("value", i), i % 2 ? 1 : UINT32_MAX));
+  }
+  for (unsigned i = 0; i < 1000; i += 4) {
+    EXPECT_TRUE(sm_->Erase(StrCat("field", i)));
+  }
+
+  sm_->set_time(2);
+  size_t seen = 0;
+  uint32_t cursor = 0;
+  do {
+    cursor = sm_->Scan(cursor, [&](sds entry) {
+      EXPECT_EQ(UINT32_MAX, StringMap::ExpireTime(entry));
+      ++seen;
+    });
+  } while (cursor != 0);
+  EXPECT_EQ(252u, seen);
+  EXPECT_EQ(252u, sm_->Size());
+  EXPECT_FALSE(sm_->Find("field1"));
+  EXPECT_EQ("value2", sm_->Find("field2"));
+}
+
+}  // namespace dfly
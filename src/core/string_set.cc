@@ -141,6 +141,19 @@ bool StringSet::Contains(string_view s1) const {
   return ret;
 }
 
+void StringSet::ContainsBatch(const string_view* members, unsigned count, bool* res) const {
+  constexpr unsigned kBatch = 64;
+  const void* objs[kBatch];
+
+  for (unsigned start = 0; start < count; start += kBatch) {
+    unsigned len = min(kBatch, count - start);
+    for (unsigned i = 0; i < len; ++i) {
+      objs[i] = members + start + i;
+    }
+    ContainsBatchInternal(objs, 1, len, res + start);
+  }
+}
+
 void StringSet::Clear() {
   ClearInternal();
 }
@@ -162,10 +175,19 @@ sds StringSet::PopRaw() {
   return (sds)PopInternal();
 }
 
+void StringSet::Sample(uint64_t seed, size_t count, const std::function<void(sds)>& cb) const {
+  SampleInternal(seed, count, [&cb](const void* ptr) { cb((sds)ptr); });
+}
+
 uint32_t StringSet::Scan(uint32_t cursor, const std::function<void(const sds)>& func) const {
   return DenseSet::Scan(cursor, [func](const void* ptr) { func((sds)ptr); });
 }
 
+uint32_t StringSet::Scan(uint32_t cursor, size_t count,
+                         const std::function<void(const sds)>& func) const {
+  return DenseSet::Scan(cursor, count, [&func](const void* ptr) { func((sds)ptr); });
+}
+
 uint64_t StringSet::Hash(const void* ptr, uint32_t cookie) const {
   DCHECK_LT(cookie, 2u);
 
@@ -214,4 +236,8 @@ void StringSet::ObjDelete(void* obj, bool has_ttl) const {
   sdsfree((sds)obj);
 }
 
+void* StringSet::ObjDefrag(void* obj, float ratio) const {
+  return DefragSds(obj, ratio);
+}
+
 }  // namespace dfly
@@ -23,11 +23,22 @@ class StringSet : public DenseSet {
 
   bool Contains(std::string_view s1) const;
 
+  // Sets res[i] to Contains(members[i]) for each i < count, see DenseSet::ContainsBatchInternal.
+  void ContainsBatch(const std::string_view* members, unsigned count, bool* res) const;
+
   void Clear();
 
   std::optional<std::string> Pop();
   sds PopRaw();
 
+  // Returns a random member or nullptr, see DenseSet::RandomInternal.
+  sds Random(uint64_t seed) const {
+    return (sds)RandomInternal(seed);
+  }
+
+  // Calls cb for count distinct random members, see DenseSet::SampleInternal.
+  void Sample(uint64_t seed, size_t count, const std::function<void(sds)>& cb) const;
+
   ~StringSet() {
     Clear();
   }
@@ -53,6 +64,9 @@ class StringSet : public DenseSet {
 
   uint32_t Scan(uint32_t, const std::function<void(sds)>&) const;
 
+  // Reports about count members, see DenseSet::Scan.
+  uint32_t Scan(uint32_t cursor, size_t count, const std::function<void(sds)>& func) const;
+
  protected:
   uint64_t Hash(const void* ptr, uint32_t cookie) const override;
 
@@ -61,6 +75,7 @@ class StringSet : public DenseSet {
   size_t ObjectAllocSize(const void* s1) const override;
   uint32_t ObjExpireTime(const void* obj) const override;
   void ObjDelete(void* obj, bool has_ttl) const override;
+  void* ObjDefrag(void* obj, float ratio) const override;
 };
 
 }  // end namespace dfly
@@ -13,6 +13,7 @@
 #include <random>
 #include <string>
 #include <string_view>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
@@ -163,6 +164,52 @@ TEST_F(StringSetTest, Resizing) {
   }
 }
 
+TEST_F(StringSetTest, IncrementalRehash) {
+  // Large enough for the bucket array to be migrated incrementally when it grows.
+  constexpr unsigned kNum = 40000;
+  unordered_set<string> added;
+
+  for (unsigned i = 0; i < kNum; ++i) {
+    string str = StrCat("key", i);
+    ASSERT_TRUE(ss_->Add(str));
+    added.insert(str);
+
+    if (i % 2 == 1) {
+      string victim = StrCat("key", i / 2);
+      ASSERT_TRUE(ss_->Erase(victim));
+      added.erase(victim);
+    }
+
+    // Check the set at different points of migration.
+    if (i % 3331 != 0)
+      continue;
+
+    ASSERT_EQ(added.size(), ss_->Size());
+    for (const string& key : added) {
+      ASSERT_TRUE(ss_->Contains(key)) << key;
+    }
+
+    unordered_set<string> iterated;
+    for (sds ptr : *ss_) {
+      iterated.emplace(ptr, sdslen(ptr));
+    }
+    ASSERT_EQ(added, iterated);
+
+    unordered_set<string> scanned;
+    uint32_t cursor = 0;
+    do {
+      cursor = ss_->Scan(cursor, [&](const sds ptr) { scanned.emplace(ptr, sdslen(ptr)); });
+    } while (cursor);
+    ASSERT_EQ(added, scanned);
+  }
+
+  // Pop drains both tables.
+  while (!ss_->Empty()) {
+    ASSERT_TRUE(added.erase(ss_->Pop().value()));
+  }
+  EXPECT_TRUE(added.empty());
+}
+
 TEST_F(StringSetTest, SimpleScan) {
   unordered_set<string_view> info = {"foo", "bar"};
   unordered_set<string_view> seen;
@@ -184,6 +231,35 @@ TEST_F(StringSetTest, SimpleScan) {
   EXPECT_TRUE(seen.size() == info.size() && equal(seen.begin(), seen.end(), info.begin()));
 }
 
+TEST_F(StringSetTest, ScanCount) {
+  for (unsigned i = 0; i < 10000; ++i) {
+    ss_->Add(absl::StrCat("member:", i));
+  }
+
+  // A sparse table still costs at most kScanEmptyFactor * count buckets per call.
+  for (unsigned i = 100; i < 10000; ++i) {
+    ss_->Erase(absl::StrCat("member:", i));
+  }
+
+  unordered_set<string> scanned;
+  uint32_t cursor = 0;
+  unsigned calls = 0;
+  do {
+    size_t reported = 0;
+    cursor = ss_->Scan(cursor, 5, [&](const sds ptr) {
+      scanned.emplace(ptr, sdslen(ptr));
+      ++reported;
+    });
+    ++calls;
+
+    // Whole buckets are reported, so a chain may exceed count.
+    EXPECT_LT(reported, 10u);
+  } while (cursor);
+
+  EXPECT_EQ(100u, scanned.size());
+  EXPECT_GE(calls, ss_->BucketCount() / (5 * DenseSet::kScanEmptyFactor));
+}
+
 // Ensure REDIS scan guarantees are met
 TEST_F(StringSetTest, ScanGuarantees) {
   unordered_set<string_view> to_be_seen = {"foo", "bar"};
@@ -382,8 +458,55 @@ TEST_F(StringSetTest, Iteration) {
   EXPECT_EQ(to_insert.size(), 0);
 }
 
+TEST_F(StringSetTest, ContainsBatch) {
+  constexpr unsigned kNum = 1000;
+  for (unsigned i = 0; i < kNum; i += 2) {
+    EXPECT_TRUE(ss_->Add(StrCat("key", i)));
+  }
+
+  vector<string> keys;
+  for (unsigned i = 0; i < kNum; ++i) {
+    keys.push_back(StrCat("key", i));
+  }
+  vector<string_view> views(keys.begin(), keys.end());
+
+  unique_ptr<bool[]> found(new bool[kNum]);
+  ss_->ContainsBatch(views.data(), kNum, found.get());
+  for (unsigned i = 0; i < kNum; ++i) {
+    EXPECT_EQ(i % 2 == 0, found[i]) << i;
+  }
+
+  ss_->Clear();
+  ss_->ContainsBatch(views.data(), kNum, found.get());
+  EXPECT_EQ(found.get() + kNum, find(found.get(), found.get() + kNum, true));
+}
+
+TEST_F(StringSetTest, Defrag) {
+  constexpr unsigned kNum = 5000;
+  for (unsigned i = 0; i < kNum; ++i) {
+    EXPECT_TRUE(ss_->Add(StrCat("key", i)));
+  }
+
+  // Leave holes in the pages of the remaining entries.
+  for (unsigned i = 0; i < kNum; i += 3) {
+    EXPECT_TRUE(ss_->Erase(StrCat("key", i)));
+  }
+
+  size_t obj_used = ss_->ObjMallocUsed();
+  ss_->Defrag(1.0);
+  EXPECT_EQ(obj_used, ss_->ObjMallocUsed());
+
+  for (unsigned i = 0; i < kNum; ++i) {
+    EXPECT_EQ(i % 3 != 0, ss_->Contains(StrCat("key", i))) << i;
+  }
+}
+
 TEST_F(StringSetTest, Ttl) {
+  EXPECT_TRUE(ss_->Add("foo"sv));
+  EXPECT_FALSE(ss_->ExpirationUsed());
   EXPECT_TRUE(ss_->Add("bla"sv, 1));
+  EXPECT_TRUE(ss_->ExpirationUsed());
+  EXPECT_TRUE(ss_->Erase("foo"sv));
   EXPECT_FALSE(ss_->Add("bla"sv, 1));
   ss_->set_time(1);
   EXPECT_TRUE(ss_->Add("bla"sv, 1));
@@ -406,4 +529,49 @@ TEST_F(StringSetTest, Ttl) {
   }
 }
 
+TEST_F(StringSetTest, Sample) {
+  EXPECT_EQ(nullptr, ss_->Random(1));
+
+  for (unsigned i = 0; i < 1000; ++i) {
+    ss_->Add(StrCat("m", i));
+  }
+
+  // Every member is about equally likely.
+  mt19937_64 gen(1);
+  unordered_map<string, unsigned> counts;
+  for (unsigned i = 0; i < 100000; ++i) {
+    sds member = ss_->Random(gen());
+    ASSERT_TRUE(member);
+    counts[string{member, sdslen(member)}]++;
+  }
+  ASSERT_EQ(1000u, counts.size());
+  for (const auto& [member, count] : counts) {
+    EXPECT_LT(count, 300u) << member;
+  }
+
+  for (size_t count : {10u, 600u, 2000u}) {
+    unordered_set<string> sampled;
+    ss_->Sample(gen(), count, [&](sds member) {
+      EXPECT_TRUE(sampled.emplace(member, sdslen(member)).second);
+    });
+    EXPECT_EQ(min<size_t>(count, 1000u), sampled.size());
+  }
+
+  // Expired members are never sampled.
+  ss_->Clear();
+  ss_->set_time(1);
+  for (unsigned i = 0; i < 1000; ++i) {
+    ss_->Add(StrCat("m", i), i % 10 ? 1 : 100);
+  }
+  ss_->set_time(10);
+  for (unsigned i = 0; i < 1000; ++i) {
+    sds member = ss_->Random(gen());
+    ASSERT_TRUE(member);
+    ASSERT_EQ('0', member[sdslen(member) - 1]);
+  }
+  unsigned sampled = 0;
+  ss_->Sample(gen(), 500, [&](sds member) { ++sampled; });
+  EXPECT_EQ(100u, sampled);
+}
+
 }  // namespace dfly
@@ -0,0 +1,607 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/time_series.h"
+
+#include <absl/base/internal/endian.h>
+#include <absl/strings/match.h>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+// The first sample of a chunk takes 128 bits, the next ones at most 4 + 64 bits for the
+// timestamp and 2 + 5 + 6 + 64 for the value.
+constexpr uint32_t kMaxSampleBits = 145;
+constexpr uint32_t kMaxChunkWords = (TimeSeries::kMaxChunkBytes * 8 + kMaxSampleBits + 63) / 64;
+constexpr uint8_t kNoWindow = 0xFF;
+
+// The encodings of the delta of the timestamp deltas by range: the control bits, which are
+// read from the lowest bit, and the length of the value. 0 is a single 0 bit, and the deltas out
+// of these ranges are the control bits 1111 and 64 bits.
+struct DodClass {
+  int64_t min, max;
+  uint64_t ctrl;
+  unsigned ctrl_len, len;
+};
+
+constexpr DodClass kDodClasses[] = {
+    {-64, 63, 0b01, 2, 7}, {-256, 255, 0b011, 3, 9}, {-2048, 2047, 0b0111, 4, 12}};
+
+uint64_t DoubleBits(double val) {
+  uint64_t bits;
+  memcpy(&bits, &val, sizeof(bits));
+  return bits;
+}
+
+double BitsDouble(uint64_t bits) {
+  double val;
+  memcpy(&val, &bits, sizeof(val));
+  return val;
+}
+
+int64_t SignExtend(uint64_t val, unsigned len) {
+  return int64_t(val << (64 - len)) >> (64 - len);
+}
+
+struct RunStats {
+  double sum, min, max;
+};
+
+// Summarizes n > 0 values. The lanes are independent, so that the compiler keeps them in the
+// lanes of a vector register rather than in a chain of dependent additions.
+RunStats Summarize(const double* vals, size_t n) {
+  constexpr unsigned kLanes = 4;
+  double sum[kLanes] = {0, 0, 0, 0};
+  double min[kLanes] = {vals[0], vals[0], vals[0], vals[0]};
+  double max[kLanes] = {vals[0], vals[0], vals[0], vals[0]};
+
+  size_t i = 0;
+  for (; i + kLanes <= n; i += kLanes) {
+    for (unsigned k = 0; k < kLanes; ++k) {
+      double val = vals[i + k];
+      sum[k] += val;
+      min[k] = val < min[k] ? val : min[k];
+      max[k] = val > max[k] ? val : max[k];
+    }
+  }
+  for (; i < n; ++i) {
+    sum[0] += vals[i];
+    min[0] = vals[i] < min[0] ? vals[i] : min[0];
+    max[0] = vals[i] > max[0] ? vals[i] : max[0];
+  }
+
+  RunStats res{sum[0], min[0], max[0]};
+  for (unsigned k = 1; k < kLanes; ++k) {
+    res.sum += sum[k];
+    res.min = std::min(res.min, min[k]);
+    res.max = std::max(res.max, max[k]);
+  }
+  return res;
+}
+
+// The aggregation state of a bucket.
+struct Bucket {
+  uint64_t start = 0;
+  uint64_t count = 0;
+  double sum = 0, min = 0, max = 0, first = 0, last = 0;
+
+  void Merge(const double* vals, size_t n) {
+    RunStats run = Summarize(vals, n);
+    if (count == 0) {
+      first = vals[0];
+      min = run.min;
+      max = run.max;
+    } else {
+      min = std::min(min, run.min);
+      max = std::max(max, run.max);
+    }
+    sum += run.sum;
+    last = vals[n - 1];
+    count += n;
+  }
+
+  double Value(TimeSeries::Aggregation agg) const {
+    switch (agg) {
+      case TimeSeries::AVG:
+        return sum / count;
+      case TimeSeries::SUM:
+        return sum;
+      case TimeSeries::MIN:
+        return min;
+      case TimeSeries::MAX:
+        return max;
+      case TimeSeries::RANGE:
+        return max - min;
+      case TimeSeries::COUNT:
+        return count;
+      case TimeSeries::FIRST:
+        return first;
+      case TimeSeries::LAST:
+        return last;
+    }
+    return 0;
+  }
+};
+
+void PutLE(uint64_t val, unsigned bytes, string* dest) {
+  char buf[8];
+  absl::little_endian::Store64(buf, val);
+  dest->append(buf, bytes);
+}
+
+void PutString(string_view str, string* dest) {
+  PutLE(str.size(), 4, dest);
+  dest->append(str);
+}
+
+class ByteReader {
+ public:
+  explicit ByteReader(string_view src) : src_(src) {
+  }
+
+  bool Get(unsigned bytes, uint64_t* dest) {
+    if (src_.size() < bytes)
+      return false;
+    char buf[8] = {0};
+    memcpy(buf, src_.data(), bytes);
+    *dest = absl::little_endian::Load64(buf);
+    src_.remove_prefix(bytes);
+    return true;
+  }
+
+  bool GetString(string_view* dest) {
+    uint64_t len;
+    if (!Get(4, &len) || src_.size() < len)
+      return false;
+    *dest = src_.substr(0, len);
+    src_.remove_prefix(len);
+    return true;
+  }
+
+  bool empty() const {
+    return src_.empty();
+  }
+
+ private:
+  string_view src_;
+};
+
+}  // namespace
+
+// Reads the bit stream of a chunk. Reading past its end returns zeroes, so that a corrupted
+// chunk decodes to wrong samples rather than out of its bounds.
+class TimeSeries::Reader {
+ public:
+  explicit Reader(const Chunk& chunk) : chunk_(chunk) {
+  }
+
+  // Requires: 0 < len <= 64.
+  uint64_t Read(unsigned len) {
+    if (pos_ + len > chunk_.bit_len) {
+      pos_ = chunk_.bit_len;
+      return 0;
+    }
+
+    uint32_t word = pos_ / 64, offs = pos_ % 64;
+    uint64_t res = chunk_.words[word] >> offs;
+    if (offs + len > 64)
+      res |= chunk_.words[word + 1] << (64 - offs);
+    pos_ += len;
+    return len == 64 ? res : res & ((1ULL << len) - 1);
+  }
+
+ private:
+  const Chunk& chunk_;
+  uint32_t pos_ = 0;
+};
+
+TimeSeries::TimeSeries(uint64_t retention_ms, pmr::memory_resource* mr)
+    : mr_(mr), chunks_(mr), labels_(mr), retention_ms_(retention_ms) {
+}
+
+TimeSeries::~TimeSeries() {
+  Clear();
+}
+
+TimeSeries::TimeSeries(TimeSeries&& other) noexcept
+    : mr_(other.mr_), chunks_(std::move(other.chunks_)), labels_(std::move(other.labels_)),
+      retention_ms_(other.retention_ms_), size_(other.size_) {
+  other.chunks_.clear();
+  other.size_ = 0;
+}
+
+TimeSeries& TimeSeries::operator=(TimeSeries&& other) noexcept {
+  if (this != &other) {
+    Clear();
+    mr_ = other.mr_;
+    chunks_ = std::move(other.chunks_);
+    labels_ = std::move(other.labels_);
+    retention_ms_ = other.retention_ms_;
+    size_ = other.size_;
+    other.chunks_.clear();
+    other.size_ = 0;
+  }
+  return *this;
+}
+
+void TimeSeries::Clear() {
+  for (Chunk& chunk : chunks_)
+    FreeChunk(&chunk);
+  chunks_.clear();
+  size_ = 0;
+}
+
+void TimeSeries::FreeChunk(Chunk* chunk) {
+  if (chunk->words)
+    mr_->deallocate(chunk->words, chunk->capacity * 8, 8);
+  chunk->words = nullptr;
+  chunk->capacity = 0;
+}
+
+void TimeSeries::Reserve(Chunk* chunk, uint32_t words) {
+  DCHECK_GE(words * 64, chunk->bit_len);
+  uint64_t* next = static_cast<uint64_t*>(mr_->allocate(words * 8, 8));
+  memset(next, 0, words * 8);
+  if (chunk->words)
+    memcpy(next, chunk->words, (chunk->bit_len + 63) / 64 * 8);
+  FreeChunk(chunk);
+  chunk->words = next;
+  chunk->capacity = words;
+}
+
+void TimeSeries::AppendBits(Chunk* chunk, uint64_t bits, unsigned len) {
+  DCHECK(len > 0 && len <= 64);
+  DCHECK_LE(chunk->bit_len + len, chunk->capacity * 64);
+  if (len < 64)
+    bits &= (1ULL << len) - 1;
+
+  uint32_t word = chunk->bit_len / 64, offs = chunk->bit_len % 64;
+  chunk->words[word] |= bits << offs;
+  if (offs + len > 64)
+    chunk->words[word + 1] = bits >> (64 - offs);
+  chunk->bit_len += len;
+}
+
+bool TimeSeries::Add(uint64_t ts, double value) {
+  uint64_t bits = DoubleBits(value);
+
+  if (!chunks_.empty() && ts <= chunks_.back().last_ts)
+    return false;
+
+  if (!chunks_.empty() && chunks_.back().bit_len < kMaxChunkBytes * 8) {
+    Chunk& chunk = chunks_.back();
+    uint32_t needed = (chunk.bit_len + kMaxSampleBits + 63) / 64;
+    if (needed > chunk.capacity)
+      Reserve(&chunk, max(needed, min(chunk.capacity * 2, kMaxChunkWords)));
+
+    int64_t delta = ts - chunk.last_ts;
+    int64_t dod = delta - chunk.last_delta;
+    if (dod == 0) {
+      AppendBits(&chunk, 0, 1);
+    } else {
+      auto it = find_if(begin(kDodClasses), end(kDodClasses),
+                        [dod](const DodClass& c) { return dod >= c.min && dod <= c.max; });
+      if (it != end(kDodClasses)) {
+        AppendBits(&chunk, it->ctrl, it->ctrl_len);
+        AppendBits(&chunk, dod, it->len);
+      } else {
+        AppendBits(&chunk, 0b1111, 4);
+        AppendBits(&chunk, dod, 64);
+      }
+    }
+
+    uint64_t x = bits ^ chunk.last_value;
+    if (x == 0) {
+      AppendBits(&chunk, 0, 1);
+    } else {
+      unsigned leading = min(__builtin_clzll(x), 31), trailing = __builtin_ctzll(x);
+      if (chunk.leading != kNoWindow && leading >= chunk.leading && trailing >= chunk.trailing) {
+        // The meaningful bits fit the window of the previous value.
+        AppendBits(&chunk, 0b01, 2);
+        AppendBits(&chunk, x >> chunk.trailing, 64 - chunk.leading - chunk.trailing);
+      } else {
+        unsigned len = 64 - leading - trailing;
+        AppendBits(&chunk, 0b11, 2);
+        AppendBits(&chunk, leading, 5);
+        AppendBits(&chunk, len - 1, 6);
+        AppendBits(&chunk, x >> trailing, len);
+        chunk.leading = leading;
+        chunk.trailing = trailing;
+      }
+    }
+
+    chunk.last_ts = ts;
+    chunk.last_delta = delta;
+    chunk.last_value = bits;
+    ++chunk.count;
+    ++size_;
+    return true;
+  }
+
+  // The last chunk is full, its unused words are given back.
+  if (!chunks_.empty())
+    Reserve(&chunks_.back(), (chunks_.back().bit_len + 63) / 64);
+
+  Chunk& chunk = chunks_.emplace_back();
+  Reserve(&chunk, 4);
+  AppendBits(&chunk, ts, 64);
+  AppendBits(&chunk, bits, 64);
+  chunk.count = 1;
+  chunk.leading = kNoWindow;
+  chunk.first_ts = chunk.last_ts = ts;
+  chunk.last_value = bits;
+  ++size_;
+  return true;
+}
+
+optional<TimeSeries::Sample> TimeSeries::Last() const {
+  if (chunks_.empty())
+    return nullopt;
+  return Sample{chunks_.back().last_ts, BitsDouble(chunks_.back().last_value)};
+}
+
+void TimeSeries::Decode(const Chunk& chunk, uint64_t* ts, double* values) {
+  Reader reader(chunk);
+  uint64_t cur_ts = reader.Read(64);
+  uint64_t cur_val = reader.Read(64);
+  int64_t delta = 0;
+  unsigned leading = 0, trailing = 0;
+  ts[0] = cur_ts;
+  values[0] = BitsDouble(cur_val);
+
+  for (uint32_t i = 1; i < chunk.count; ++i) {
+    int64_t dod = 0;
+    if (reader.Read(1)) {
+      if (!reader.Read(1))
+        dod = SignExtend(reader.Read(7), 7);
+      else if (!reader.Read(1))
+        dod = SignExtend(reader.Read(9), 9);
+      else if (!reader.Read(1))
+        dod = SignExtend(reader.Read(12), 12);
+      else
+        dod = reader.Read(64);
+    }
+    delta += dod;
+    cur_ts += delta;
+
+    if (reader.Read(1)) {
+      if (reader.Read(1)) {
+        leading = reader.Read(5);
+        unsigned len = reader.Read(6) + 1;
+        trailing = 64 - leading - min(len, 64 - leading);
+      }
+      unsigned len = 64 - leading - trailing;
+      cur_val ^= reader.Read(len) << trailing;
+    }
+    ts[i] = cur_ts;
+    values[i] = BitsDouble(cur_val);
+  }
+}
+
+size_t TimeSeries::FirstChunk(uint64_t from) const {
+  auto it = partition_point(chunks_.begin(), chunks_.end(),
+                            [from](const Chunk& c) { return c.last_ts < from; });
+  return it - chunks_.begin();
+}
+
+void TimeSeries::Range(uint64_t from, uint64_t to, size_t count, vector<Sample>* dest) const {
+  vector<uint64_t> ts;
+  vector<double> values;
+  size_t limit = dest->size() + min(count, size_t(size_));
+
+  for (size_t i = FirstChunk(from); i < chunks_.size() && chunks_[i].first_ts <= to; ++i) {
+    const Chunk& chunk = chunks_[i];
+    ts.resize(chunk.count);
+    values.resize(chunk.count);
+    Decode(chunk, ts.data(), values.data());
+
+    size_t j = lower_bound(ts.begin(), ts.end(), from) - ts.begin();
+    for (; j < chunk.count && ts[j] <= to; ++j) {
+      if (dest->size() == limit)
+        return;
+      dest->push_back(Sample{ts[j], values[j]});
+    }
+  }
+}
+
+void TimeSeries::Aggregate(uint64_t from, uint64_t to, Aggregation agg, uint64_t bucket_ms,
+                           size_t count, vector<Sample>* dest) const {
+  DCHECK_GT(bucket_ms, 0u);
+  vector<uint64_t> ts;
+  vector<double> values;
+  size_t limit = dest->size() + min(count, size_t(size_));
+  Bucket bucket;
+
+  for (size_t i = FirstChunk(from); i < chunks_.size() && chunks_[i].first_ts <= to; ++i) {
+    const Chunk& chunk = chunks_[i];
+    ts.resize(chunk.count);
+    values.resize(chunk.count);
+    Decode(chunk, ts.data(), values.data());
+
+    size_t lo = lower_bound(ts.begin(), ts.end(), from) - ts.begin();
+    size_t hi = upper_bound(ts.begin() + lo, ts.end(), to) - ts.begin();
+    while (lo < hi) {
+      uint64_t start = ts[lo] - ts[lo] % bucket_ms;
+      uint64_t last = start + min(bucket_ms - 1, numeric_limits<uint64_t>::max() - start);
+      size_t end = upper_bound(ts.begin() + lo, ts.begin() + hi, last) - ts.begin();
+
+      if (bucket.count > 0 && bucket.start != start) {
+        if (dest->size() == limit)
+          return;
+        dest->push_back(Sample{bucket.start, bucket.Value(agg)});
+        bucket = Bucket{};
+      }
+      bucket.start = start;
+      bucket.Merge(values.data() + lo, end - lo);
+      lo = end;
+    }
+  }
+
+  if (bucket.count > 0 && dest->size() < limit)
+    dest->push_back(Sample{bucket.start, bucket.Value(agg)});
+}
+
+bool TimeSeries::NeedsTrim() const {
+  return retention_ms_ > 0 && chunks_.size() > 1 &&
+         chunks_.front().last_ts + retention_ms_ < chunks_.back().last_ts;
+}
+
+size_t TimeSeries::Trim() {
+  if (!NeedsTrim())
+    return 0;
+
+  size_t num = 0, deleted = 0;
+  uint64_t last_ts = chunks_.back().last_ts;
+  while (num + 1 < chunks_.size() && chunks_[num].last_ts + retention_ms_ < last_ts) {
+    deleted += chunks_[num].count;
+    FreeChunk(&chunks_[num]);
+    ++num;
+  }
+
+  chunks_.erase(chunks_.begin(), chunks_.begin() + num);
+  size_ -= deleted;
+  return deleted;
+}
+
+void TimeSeries::SetLabel(string_view name, string_view value) {
+  for (auto& [label, val] : labels_) {
+    if (label == name) {
+      val.assign(value);
+      return;
+    }
+  }
+  labels_.emplace_back(name, value);
+}
+
+optional<string_view> TimeSeries::GetLabel(string_view name) const {
+  for (const auto& [label, val] : labels_) {
+    if (label == name)
+      return val;
+  }
+  return nullopt;
+}
+
+size_t TimeSeries::MallocUsed() const {
+  size_t res = chunks_.capacity() * sizeof(Chunk) + labels_.capacity() * sizeof(labels_[0]);
+  for (const Chunk& chunk : chunks_)
+    res += chunk.capacity * 8;
+  for (const auto& [label, val] : labels_)
+    res += label.capacity() + val.capacity();
+  return res;
+}
+
+void TimeSeries::Serialize(string* dest) const {
+  PutLE(retention_ms_, 8, dest);
+  PutLE(labels_.size(), 4, dest);
+  for (const auto& [label, val] : labels_) {
+    PutString(label, dest);
+    PutString(val, dest);
+  }
+
+  PutLE(chunks_.size(), 4, dest);
+  for (const Chunk& chunk : chunks_) {
+    PutLE(chunk.first_ts, 8, dest);
+    PutLE(chunk.last_ts, 8, dest);
+    PutLE(chunk.last_delta, 8, dest);
+    PutLE(chunk.last_value, 8, dest);
+    PutLE(chunk.count, 4, dest);
+    PutLE(chunk.bit_len, 4, dest);
+    PutLE(chunk.leading, 1, dest);
+    PutLE(chunk.trailing, 1, dest);
+    for (uint32_t i = 0; i < (chunk.bit_len + 63) / 64; ++i)
+      PutLE(chunk.words[i], 8, dest);
+  }
+}
+
+bool TimeSeries::Parse(string_view src) {
+  Clear();
+  labels_.clear();
+
+  ByteReader reader(src);
+  uint64_t num;
+  if (!reader.Get(8, &retention_ms_) || !reader.Get(4, &num))
+    return false;
+
+  for (; num > 0; --num) {
+    string_view label, val;
+    if (!reader.GetString(&label) || !reader.GetString(&val))
+      return false;
+    SetLabel(label, val);
+  }
+
+  if (!reader.Get(4, &num))
+    return false;
+
+  auto parse_chunk = [&](Chunk* chunk) {
+    uint64_t vals[8];
+    constexpr unsigned kLens[] = {8, 8, 8, 8, 4, 4, 1, 1};
+    for (unsigned i = 0; i < 8; ++i) {
+      if (!reader.Get(kLens[i], &vals[i]))
+        return false;
+    }
+
+    chunk->first_ts = vals[0];
+    chunk->last_ts = vals[1];
+    chunk->last_delta = vals[2];
+    chunk->last_value = vals[3];
+    chunk->count = vals[4];
+    chunk->bit_len = vals[5];
+    chunk->leading = vals[6];
+    chunk->trailing = vals[7];
+
+    bool prev_ok = chunks_.size() == 1 || chunks_[chunks_.size() - 2].last_ts < chunk->first_ts;
+    if (!prev_ok || chunk->count == 0 || chunk->first_ts > chunk->last_ts ||
+        chunk->bit_len < 128 || chunk->bit_len > kMaxChunkWords * 64 ||
+        chunk->count > chunk->bit_len || (chunk->leading > 31 && chunk->leading != kNoWindow) ||
+        chunk->trailing > 63)
+      return false;
+
+    uint32_t words = (chunk->bit_len + 63) / 64;
+    chunk->bit_len = 0;
+    Reserve(chunk, words);
+    for (uint32_t i = 0; i < words; ++i) {
+      if (!reader.Get(8, &vals[0]))
+        return false;
+      chunk->words[i] = vals[0];
+    }
+    chunk->bit_len = vals[5];
+    size_ += chunk->count;
+    return true;
+  };
+
+  for (; num > 0; --num) {
+    if (!parse_chunk(&chunks_.emplace_back())) {
+      Clear();
+      return false;
+    }
+  }
+
+  if (!reader.empty()) {
+    Clear();
+    return false;
+  }
+  return true;
+}
+
+optional<TimeSeries::Aggregation> TimeSeries::ParseAggregation(string_view name) {
+  constexpr pair<const char*, Aggregation> kNames[] = {
+      {"avg", AVG},     {"sum", SUM},     {"min", MIN},     {"max", MAX},
+      {"range", RANGE}, {"count", COUNT}, {"first", FIRST}, {"last", LAST}};
+  for (const auto& [str, agg] : kNames) {
+    if (absl::EqualsIgnoreCase(name, str))
+      return agg;
+  }
+  return nullopt;
+}
+
+}  // namespace dfly
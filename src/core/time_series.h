@@ -0,0 +1,135 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// The object type of time series, following OBJ_SBF.
+constexpr unsigned OBJ_TS = 17;
+
+namespace dfly {
+
+// Series of samples with increasing millisecond timestamps, compressed as in Facebook's Gorilla:
+// the timestamps are encoded as the delta of their deltas and the values as the XOR with the
+// previous value, in bit streams of chunks of at most kMaxChunkBytes. Regular timestamps take a
+// bit per sample and slowly changing values a few bits. Only the last chunk is appended to, and
+// the retention period trims whole chunks once all their samples are older than it.
+class TimeSeries {
+ public:
+  struct Sample {
+    uint64_t ts;
+    double value;
+  };
+
+  enum Aggregation : uint8_t { AVG, SUM, MIN, MAX, RANGE, COUNT, FIRST, LAST };
+
+  using Labels = std::pmr::vector<std::pair<std::pmr::string, std::pmr::string>>;
+
+  static constexpr size_t kMaxChunkBytes = 1024;
+
+  // retention_ms of 0 keeps all the samples.
+  TimeSeries(uint64_t retention_ms, std::pmr::memory_resource* mr);
+  ~TimeSeries();
+
+  TimeSeries(TimeSeries&& other) noexcept;
+  TimeSeries& operator=(TimeSeries&& other) noexcept;
+
+  // Returns false if ts is not larger than the timestamp of the last sample.
+  bool Add(uint64_t ts, double value);
+
+  std::optional<Sample> Last() const;
+
+  // Appends the samples with timestamps in [from, to] to dest, at most count of them.
+  void Range(uint64_t from, uint64_t to, size_t count, std::vector<Sample>* dest) const;
+
+  // Appends an aggregation of the samples in [from, to] to dest for every bucket of bucket_ms
+  // that has samples, at most count of them. The buckets start at multiples of bucket_ms and a
+  // sample is reported with the start of its bucket. Requires: bucket_ms > 0.
+  void Aggregate(uint64_t from, uint64_t to, Aggregation agg, uint64_t bucket_ms, size_t count,
+                 std::vector<Sample>* dest) const;
+
+  // Deletes the chunks whose samples are all older than the retention period, which ends at the
+  // last sample. Returns the number of deleted samples.
+  size_t Trim();
+
+  // Whether Trim would delete a chunk.
+  bool NeedsTrim() const;
+
+  uint64_t retention_ms() const {
+    return retention_ms_;
+  }
+
+  void set_retention_ms(uint64_t retention_ms) {
+    retention_ms_ = retention_ms;
+  }
+
+  const Labels& labels() const {
+    return labels_;
+  }
+
+  void SetLabel(std::string_view name, std::string_view value);
+
+  std::optional<std::string_view> GetLabel(std::string_view name) const;
+
+  // The number of samples.
+  uint64_t Size() const {
+    return size_;
+  }
+
+  size_t num_chunks() const {
+    return chunks_.size();
+  }
+
+  size_t MallocUsed() const;
+
+  // Appends the series to dest with its chunks as they are encoded in memory.
+  void Serialize(std::string* dest) const;
+
+  // Parses a series from the output of Serialize. Returns false if it is not valid.
+  bool Parse(std::string_view src);
+
+  static std::optional<Aggregation> ParseAggregation(std::string_view name);
+
+ private:
+  struct Chunk {
+    uint64_t* words = nullptr;
+    uint32_t capacity = 0;  // of words.
+    uint32_t bit_len = 0;
+    uint32_t count = 0;
+    uint8_t leading = 0;   // the window of the meaningful bits of the last XOR.
+    uint8_t trailing = 0;
+    uint64_t first_ts = 0;
+    uint64_t last_ts = 0;
+    int64_t last_delta = 0;
+    uint64_t last_value = 0;  // the bits of the double.
+  };
+
+  class Reader;
+
+  void AppendBits(Chunk* chunk, uint64_t bits, unsigned len);
+  void Reserve(Chunk* chunk, uint32_t words);
+  void FreeChunk(Chunk* chunk);
+  void Clear();
+
+  // The index of the first chunk with samples at from or later.
+  size_t FirstChunk(uint64_t from) const;
+
+  // Decodes the samples of the chunk into ts and values.
+  static void Decode(const Chunk& chunk, uint64_t* ts, double* values);
+
+  std::pmr::memory_resource* mr_;
+  std::pmr::vector<Chunk> chunks_;
+  Labels labels_;
+  uint64_t retention_ms_;
+  uint64_t size_ = 0;
+};
+
+}  // namespace dfly
@@ -0,0 +1,183 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/time_series.h"
+
+#include <cmath>
+#include <cstring>
+#include <random>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+class TimeSeriesTest : public ::testing::Test {
+ protected:
+  static vector<TimeSeries::Sample> All(const TimeSeries& series) {
+    vector<TimeSeries::Sample> res;
+    series.Range(0, UINT64_MAX, SIZE_MAX, &res);
+    return res;
+  }
+
+  static bool SameBits(double a, double b) {
+    return memcmp(&a, &b, sizeof(a)) == 0;
+  }
+
+  pmr::memory_resource* mr_ = pmr::get_default_resource();
+};
+
+TEST_F(TimeSeriesTest, Basic) {
+  TimeSeries series(0, mr_);
+  EXPECT_FALSE(series.Last());
+  EXPECT_TRUE(series.Add(1000, 1.5));
+  EXPECT_TRUE(series.Add(2000, -2));
+  EXPECT_FALSE(series.Add(2000, 3));
+  EXPECT_FALSE(series.Add(1500, 3));
+  EXPECT_EQ(2, series.Size());
+  EXPECT_EQ(2000, series.Last()->ts);
+  EXPECT_EQ(-2, series.Last()->value);
+
+  vector<TimeSeries::Sample> samples = All(series);
+  ASSERT_EQ(2, samples.size());
+  EXPECT_EQ(1000, samples[0].ts);
+  EXPECT_EQ(1.5, samples[0].value);
+}
+
+TEST_F(TimeSeriesTest, Compression) {
+  TimeSeries series(0, mr_);
+  mt19937_64 rng(7);
+  vector<TimeSeries::Sample> expected;
+  uint64_t ts = 1'700'000'000'000;
+  double value = 20;
+
+  for (unsigned i = 0; i < 100'000; ++i) {
+    // Mostly regular timestamps with jitter and a few gaps, values of a random walk with
+    // repetitions and a few special values.
+    ts += 1000 + (rng() % 8 == 0 ? rng() % 64 : 0) + (i % 10'000 == 0 ? 1ULL << 40 : 0);
+    if (i % 3 != 0)
+      value = round((value + int(rng() % 100 - 50) * 0.01) * 100) / 100;
+    double sample = i % 5000 == 1 ? NAN : (i % 5000 == 2 ? -1e300 : value);
+    ASSERT_TRUE(series.Add(ts, sample));
+    expected.push_back({ts, sample});
+  }
+
+  vector<TimeSeries::Sample> samples = All(series);
+  ASSERT_EQ(expected.size(), samples.size());
+  for (size_t i = 0; i < samples.size(); ++i) {
+    ASSERT_EQ(expected[i].ts, samples[i].ts) << i;
+    ASSERT_TRUE(SameBits(expected[i].value, samples[i].value)) << i;
+  }
+
+  // A zset takes about 60 bytes per sample.
+  EXPECT_LT(series.MallocUsed(), 6 * samples.size());
+  EXPECT_GT(series.num_chunks(), 1);
+
+  samples.clear();
+  series.Range(expected[500].ts, expected[1499].ts, SIZE_MAX, &samples);
+  ASSERT_EQ(1000, samples.size());
+  EXPECT_EQ(expected[500].ts, samples.front().ts);
+  EXPECT_EQ(expected[1499].ts, samples.back().ts);
+
+  samples.clear();
+  series.Range(expected[500].ts + 1, UINT64_MAX, 10, &samples);
+  ASSERT_EQ(10, samples.size());
+  EXPECT_EQ(expected[501].ts, samples.front().ts);
+}
+
+TEST_F(TimeSeriesTest, Aggregate) {
+  TimeSeries series(0, mr_);
+  for (unsigned i = 0; i < 100'000; ++i)
+    series.Add(i * 10, i % 100);
+
+  vector<TimeSeries::Sample> res;
+  series.Aggregate(0, UINT64_MAX, TimeSeries::AVG, 1000, SIZE_MAX, &res);
+  ASSERT_EQ(1000, res.size());
+  EXPECT_EQ(0, res[0].ts);
+  EXPECT_EQ(49.5, res[0].value);
+  EXPECT_EQ(999'000, res.back().ts);
+
+  res.clear();
+  series.Aggregate(15, 3000, TimeSeries::COUNT, 1000, SIZE_MAX, &res);
+  ASSERT_EQ(4, res.size());
+  EXPECT_EQ(98, res[0].value);
+  EXPECT_EQ(100, res[1].value);
+  EXPECT_EQ(1, res[3].value);
+
+  auto aggregate = [&](TimeSeries::Aggregation agg) {
+    res.clear();
+    series.Aggregate(1000, 1999, agg, 1000, SIZE_MAX, &res);
+    return res.size() == 1 ? res[0].value : NAN;
+  };
+  EXPECT_EQ(99 * 50, aggregate(TimeSeries::SUM));
+  EXPECT_EQ(0, aggregate(TimeSeries::MIN));
+  EXPECT_EQ(99, aggregate(TimeSeries::MAX));
+  EXPECT_EQ(99, aggregate(TimeSeries::RANGE));
+  EXPECT_EQ(0, aggregate(TimeSeries::FIRST));
+  EXPECT_EQ(99, aggregate(TimeSeries::LAST));
+
+  res.clear();
+  series.Aggregate(0, UINT64_MAX, TimeSeries::MAX, 1000, 3, &res);
+  EXPECT_EQ(3, res.size());
+
+  EXPECT_EQ(TimeSeries::RANGE, TimeSeries::ParseAggregation("Range"));
+  EXPECT_FALSE(TimeSeries::ParseAggregation("foo"));
+}
+
+TEST_F(TimeSeriesTest, Trim) {
+  TimeSeries series(10'000, mr_);
+  for (unsigned i = 0; i < 100'000; ++i)
+    series.Add(i * 10, i % 17);
+
+  ASSERT_TRUE(series.NeedsTrim());
+  size_t chunks = series.num_chunks();
+  size_t deleted = series.Trim();
+  EXPECT_EQ(100'000 - deleted, series.Size());
+  EXPECT_LT(series.num_chunks(), chunks);
+  EXPECT_FALSE(series.NeedsTrim());
+
+  // Whole chunks are trimmed, the first one may start before the retention period.
+  vector<TimeSeries::Sample> samples = All(series);
+  ASSERT_EQ(series.Size(), samples.size());
+  EXPECT_LE(samples.front().ts, 999'990 - 10'000);
+  EXPECT_EQ(999'990, samples.back().ts);
+}
+
+TEST_F(TimeSeriesTest, Serialize) {
+  TimeSeries series(5000, mr_);
+  series.SetLabel("host", "a");
+  series.SetLabel("dc", "eu");
+  series.SetLabel("host", "b");
+  for (unsigned i = 0; i < 10'000; ++i)
+    series.Add(i * 1000 + i % 7, i * 0.25);
+
+  string blob;
+  series.Serialize(&blob);
+
+  TimeSeries loaded(0, mr_);
+  ASSERT_TRUE(loaded.Parse(blob));
+  EXPECT_EQ(5000, loaded.retention_ms());
+  EXPECT_EQ(series.Size(), loaded.Size());
+  EXPECT_EQ(series.num_chunks(), loaded.num_chunks());
+  EXPECT_EQ("b", loaded.GetLabel("host"));
+  EXPECT_EQ("eu", loaded.GetLabel("dc"));
+  EXPECT_FALSE(loaded.GetLabel("foo"));
+
+  vector<TimeSeries::Sample> samples = All(loaded);
+  ASSERT_EQ(10'000, samples.size());
+  EXPECT_EQ(9999 * 1000 + 9999 % 7, samples.back().ts);
+  EXPECT_EQ(9999 * 0.25, samples.back().value);
+
+  // The loaded series is appended to as the original one.
+  EXPECT_TRUE(loaded.Add(20'000'000, 1));
+  EXPECT_EQ(1, loaded.Last()->value);
+
+  EXPECT_FALSE(loaded.Parse(blob.substr(0, blob.size() - 1)));
+  EXPECT_FALSE(loaded.Parse(blob + "x"));
+  EXPECT_FALSE(loaded.Parse(""));
+}
+
+}  // namespace dfly
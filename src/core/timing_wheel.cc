@@ -0,0 +1,81 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/timing_wheel.h"
+
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+constexpr uint64_t kMaxDistance = (1ULL << (TimingWheel::kLevelBits * TimingWheel::kLevels)) - 1;
+
+}  // namespace
+
+TimingWheel::TimingWheel(uint32_t resolution_ms, uint64_t now_ms)
+    : resolution_ms_(resolution_ms), current_tick_(now_ms / resolution_ms) {
+  DCHECK_GT(resolution_ms, 0u);
+}
+
+void TimingWheel::Add(string_view key, uint64_t deadline_ms) {
+  Entry entry{string{key}, deadline_ms};
+  bytes_ += EntryBytes(entry);
+  Place(std::move(entry));
+}
+
+void TimingWheel::Place(Entry&& entry) {
+  uint64_t tick = entry.deadline_ms / resolution_ms_;
+  if (tick <= current_tick_) {
+    due_.push_back(std::move(entry));
+    return;
+  }
+
+  uint64_t distance = std::min(tick - current_tick_, kMaxDistance);
+  tick = current_tick_ + distance;
+
+  // The lowest level whose span covers the distance. Since distance >= kSlots^level, the wheel
+  // reaches this slot only after it has left its current slot at that level.
+  unsigned level = 0;
+  while (distance >> (kLevelBits * (level + 1))) {
+    ++level;
+  }
+
+  unsigned index = (tick >> (kLevelBits * level)) & (kSlots - 1);
+  levels_[level][index].push_back(std::move(entry));
+  ++pending_;
+}
+
+void TimingWheel::Tick() {
+  ++current_tick_;
+
+  // Cascade the upper slots that the wheel has reached, starting from the highest one,
+  // so that their entries are re-placed before the lower levels are drained.
+  unsigned top = 0;
+  while (top + 1 < kLevels && (current_tick_ & ((1ULL << (kLevelBits * (top + 1))) - 1)) == 0) {
+    ++top;
+  }
+
+  for (unsigned level = top; level > 0; --level) {
+    unsigned index = (current_tick_ >> (kLevelBits * level)) & (kSlots - 1);
+    Slot slot = std::move(levels_[level][index]);
+    levels_[level][index].clear();
+    pending_ -= slot.size();
+
+    for (Entry& entry : slot) {
+      Place(std::move(entry));
+    }
+  }
+
+  Slot& slot = levels_[0][current_tick_ & (kSlots - 1)];
+  pending_ -= slot.size();
+  for (Entry& entry : slot) {
+    due_.push_back(std::move(entry));
+  }
+  slot.clear();
+}
+
+}  // namespace dfly
@@ -0,0 +1,109 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// Hierarchical timing wheel that indexes keys by their deadline. Level l has kSlots slots,
+// each spanning resolution * kSlots^l milliseconds. A key is placed at the lowest level
+// whose span covers its distance from the current tick and is cascaded to the lower levels
+// when the wheel reaches its slot. Deadlines beyond the range of the top level are clamped
+// to its farthest slot and re-placed when cascaded.
+// Entries are never removed before they are due, so the owner must validate every
+// entry it receives against the actual state of the key.
+class TimingWheel {
+ public:
+  static constexpr unsigned kLevelBits = 6;
+  static constexpr unsigned kSlots = 1u << kLevelBits;
+  static constexpr unsigned kLevels = 4;
+
+  TimingWheel(uint32_t resolution_ms, uint64_t now_ms);
+
+  void Add(std::string_view key, uint64_t deadline_ms);
+
+  // Moves the wheel up to now_ms and passes to cb(key, deadline_ms) at most limit due entries,
+  // ordered by their deadline up to the resolution. Entries above the limit remain due and
+  // are passed first on the following calls. Returns the number of entries passed to cb.
+  template <typename Cb> unsigned Advance(uint64_t now_ms, unsigned limit, Cb&& cb);
+
+  // Number of entries, either due or not.
+  size_t size() const {
+    return pending_ + due_.size();
+  }
+
+  // Number of due entries that were not passed to the callback yet.
+  size_t backlog() const {
+    return due_.size();
+  }
+
+  // Deadline of the oldest due entry, 0 if there is none.
+  uint64_t OldestDue() const {
+    return due_.empty() ? 0 : due_.front().deadline_ms;
+  }
+
+  size_t MallocUsed() const {
+    return bytes_;
+  }
+
+ private:
+  struct Entry {
+    std::string key;
+    uint64_t deadline_ms;
+  };
+
+  using Slot = std::vector<Entry>;
+
+  void Place(Entry&& entry);
+
+  // Processes the next tick: cascades the upper levels when they wrap and moves the entries
+  // of the current level-0 slot into due_.
+  void Tick();
+
+  static size_t EntryBytes(const Entry& e) {
+    return sizeof(Entry) + (e.key.capacity() > 15 ? e.key.capacity() : 0);
+  }
+
+  uint32_t resolution_ms_;
+
+  // All the ticks up to and including current_tick_ have been processed.
+  uint64_t current_tick_;
+  size_t pending_ = 0;  // entries in the slots.
+  size_t bytes_ = 0;
+
+  std::array<std::array<Slot, kSlots>, kLevels> levels_;
+  std::deque<Entry> due_;
+};
+
+template <typename Cb> unsigned TimingWheel::Advance(uint64_t now_ms, unsigned limit, Cb&& cb) {
+  uint64_t now_tick = now_ms / resolution_ms_;
+  while (current_tick_ < now_tick) {
+    if (pending_ == 0) {  // nothing to cascade, jump straight to now.
+      current_tick_ = now_tick;
+      break;
+    }
+    Tick();
+  }
+
+  unsigned res = 0;
+  while (res < limit && !due_.empty()) {
+    Entry entry = std::move(due_.front());
+    due_.pop_front();
+    bytes_ -= EntryBytes(entry);
+    ++res;
+
+    cb(std::string_view{entry.key}, entry.deadline_ms);
+  }
+
+  return res;
+}
+
+}  // namespace dfly
@@ -0,0 +1,104 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/timing_wheel.h"
+
+#include <absl/strings/str_cat.h>
+#include <gtest/gtest.h>
+
+#include <map>
+#include <random>
+
+namespace dfly {
+
+using namespace std;
+using absl::StrCat;
+
+class TimingWheelTest : public ::testing::Test {
+ protected:
+  static constexpr uint32_t kResolution = 10;
+};
+
+TEST_F(TimingWheelTest, Basic) {
+  TimingWheel wheel(kResolution, 1000);
+  wheel.Add("a", 1500);
+  wheel.Add("b", 1015);
+  wheel.Add("past", 500);
+  EXPECT_EQ(3, wheel.size());
+  EXPECT_EQ(1, wheel.backlog());
+
+  vector<string> keys;
+  auto cb = [&](string_view key, uint64_t deadline) { keys.emplace_back(key); };
+
+  EXPECT_EQ(1, wheel.Advance(1009, 10, cb));
+  EXPECT_EQ(vector<string>({"past"}), keys);
+
+  EXPECT_EQ(1, wheel.Advance(1019, 10, cb));
+  EXPECT_EQ("b", keys.back());
+
+  EXPECT_EQ(0, wheel.Advance(1499, 10, cb));
+  EXPECT_EQ(1, wheel.Advance(1500, 10, cb));
+  EXPECT_EQ("a", keys.back());
+  EXPECT_EQ(0, wheel.size());
+  EXPECT_EQ(0, wheel.MallocUsed());
+}
+
+TEST_F(TimingWheelTest, Limit) {
+  TimingWheel wheel(kResolution, 0);
+  for (unsigned i = 0; i < 100; ++i) {
+    wheel.Add(StrCat("key", i), 50 + i % 10);
+  }
+
+  auto cb = [](string_view key, uint64_t deadline) { EXPECT_LE(deadline, 100u); };
+  EXPECT_EQ(30, wheel.Advance(100, 30, cb));
+  EXPECT_EQ(70, wheel.backlog());
+  EXPECT_EQ(50, wheel.OldestDue());
+  EXPECT_EQ(70, wheel.Advance(110, 100, cb));
+  EXPECT_EQ(0, wheel.size());
+}
+
+TEST_F(TimingWheelTest, Random) {
+  constexpr uint64_t kStart = 1000000;
+  TimingWheel wheel(kResolution, kStart);
+  mt19937_64 gen(1);
+
+  // Deadlines spread over all the levels and beyond the range of the wheel.
+  map<string, uint64_t> ref;
+  for (unsigned i = 0; i < 20000; ++i) {
+    uint64_t range = 1ULL << (gen() % 40);
+    uint64_t deadline = kStart + gen() % range;
+    string key = StrCat("k", i);
+    ref[key] = deadline;
+    wheel.Add(key, deadline);
+  }
+
+  // Advance in irregular steps through the first three levels.
+  uint64_t now = kStart;
+  size_t passed = 0;
+  auto cb = [&](string_view key, uint64_t deadline) {
+    auto it = ref.find(string{key});
+    ASSERT_TRUE(it != ref.end());
+    EXPECT_EQ(it->second, deadline);
+
+    // Due, and passed no later than one step after it became due.
+    EXPECT_LE(deadline / kResolution, now / kResolution);
+    EXPECT_GT(deadline + 1000, now) << key;
+    ref.erase(it);
+    ++passed;
+  };
+
+  while (now < kStart + (1ULL << 28)) {
+    now += 1 + gen() % 999;
+    wheel.Advance(now, UINT32_MAX, cb);
+  }
+
+  // Whatever is left is beyond the time we advanced to.
+  for (const auto& [key, deadline] : ref) {
+    EXPECT_GT(deadline / kResolution, now / kResolution) << key;
+  }
+  EXPECT_GT(passed, 0u);
+  EXPECT_EQ(ref.size(), wheel.size());
+}
+
+}  // namespace dfly
@@ -0,0 +1,74 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/top_keys.h"
+
+#include <algorithm>
+
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+TopKeys::TopKeys(size_t capacity) : capacity_(capacity) {
+  CHECK_GT(capacity, 0u);
+  entries_.reserve(capacity);
+  index_.reserve(capacity);
+}
+
+void TopKeys::Add(string_view key, uint64_t weight) {
+  total_ += weight;
+
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    entries_[it->second].count += weight;
+    return;
+  }
+
+  if (entries_.size() < capacity_) {
+    entries_.push_back(Entry{string(key), weight, 0});
+    index_.emplace(entries_.back().key, entries_.size() - 1);
+    return;
+  }
+
+  auto min_it = min_element(entries_.begin(), entries_.end(),
+                            [](const Entry& l, const Entry& r) { return l.count < r.count; });
+  uint32_t pos = min_it - entries_.begin();
+
+  index_.erase(min_it->key);
+  min_it->key.assign(key);
+  min_it->error = min_it->count;
+  min_it->count += weight;
+  index_.emplace(min_it->key, pos);
+}
+
+vector<TopKeys::Entry> TopKeys::Top(size_t n) const {
+  vector<Entry> res(entries_);
+  auto cmp = [](const Entry& l, const Entry& r) { return l.count > r.count; };
+
+  if (n < res.size()) {
+    partial_sort(res.begin(), res.begin() + n, res.end(), cmp);
+    res.resize(n);
+  } else {
+    sort(res.begin(), res.end(), cmp);
+  }
+  return res;
+}
+
+void TopKeys::Clear() {
+  index_.clear();
+  entries_.clear();
+  total_ = 0;
+}
+
+size_t TopKeys::MallocUsed() const {
+  size_t res = entries_.capacity() * sizeof(Entry) +
+               index_.capacity() * (sizeof(pair<string_view, uint32_t>) + 1);
+  for (const Entry& e : entries_)
+    res += e.key.capacity();
+  return res;
+}
+
+}  // namespace dfly
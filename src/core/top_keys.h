@@ -0,0 +1,63 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+// Space-Saving summary of the most frequent keys of a stream in a fixed number of counters.
+// A key that is not tracked replaces the one with the smallest count and inherits that count
+// as its error. Thus the count of a tracked key overestimates its frequency by at most its
+// error, and every key with a frequency above total() / capacity is tracked.
+class TopKeys {
+ public:
+  struct Entry {
+    std::string key;
+    uint64_t count = 0;
+    uint64_t error = 0;  // the part of count that may belong to the replaced keys.
+  };
+
+  explicit TopKeys(size_t capacity);
+
+  // The index points into the keys of the entries, which must not move.
+  TopKeys(const TopKeys&) = delete;
+  TopKeys& operator=(const TopKeys&) = delete;
+  TopKeys(TopKeys&&) = default;
+  TopKeys& operator=(TopKeys&&) = default;
+
+  // Replacing a key scans the entries for the smallest count, so the capacity should stay in
+  // the tens and the stream be sampled when it is hot.
+  void Add(std::string_view key, uint64_t weight = 1);
+
+  // Returns up to n entries with the largest counts first.
+  std::vector<Entry> Top(size_t n) const;
+
+  void Clear();
+
+  // The sum of the weights added since the last Clear.
+  uint64_t total() const {
+    return total_;
+  }
+
+  size_t size() const {
+    return entries_.size();
+  }
+
+  size_t MallocUsed() const;
+
+ private:
+  size_t capacity_;
+  uint64_t total_ = 0;
+  std::vector<Entry> entries_;
+  absl::flat_hash_map<std::string_view, uint32_t> index_;  // key -> position in entries_.
+};
+
+}  // namespace dfly
@@ -0,0 +1,71 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/top_keys.h"
+
+#include <absl/strings/str_cat.h>
+#include <gtest/gtest.h>
+
+#include <random>
+
+namespace dfly {
+
+using namespace std;
+
+class TopKeysTest : public ::testing::Test {};
+
+TEST_F(TopKeysTest, Basic) {
+  TopKeys top(3);
+  top.Add("a", 3);
+  top.Add("b");
+  top.Add("c", 2);
+  top.Add("a");
+
+  auto res = top.Top(10);
+  ASSERT_EQ(3, res.size());
+  EXPECT_EQ("a", res[0].key);
+  EXPECT_EQ(4, res[0].count);
+  EXPECT_EQ("c", res[1].key);
+  EXPECT_EQ(0, res[1].error);
+
+  // d replaces b, the key with the smallest count, and inherits its count as the error.
+  top.Add("d");
+  res = top.Top(3);
+  EXPECT_EQ("d", res[1].key);
+  EXPECT_EQ(2, res[1].count);
+  EXPECT_EQ(1, res[1].error);
+  EXPECT_EQ(8, top.total());
+  EXPECT_EQ(1, top.Top(1).size());
+
+  top.Clear();
+  EXPECT_EQ(0, top.size());
+  EXPECT_EQ(0, top.total());
+  top.Add("a");
+  EXPECT_EQ(1, top.Top(2).size());
+}
+
+TEST_F(TopKeysTest, HotKeysSurviveNoise) {
+  TopKeys top(32);
+  mt19937 gen(1);
+  uniform_int_distribution<int> noise(0, 100000);
+
+  // 5% of the stream are accesses to each of the hot keys, the rest are distinct keys.
+  for (unsigned i = 0; i < 100000; ++i) {
+    if (i % 20 < 3) {
+      top.Add(absl::StrCat("hot", i % 20));
+    } else {
+      top.Add(absl::StrCat("cold", noise(gen)));
+    }
+  }
+
+  auto res = top.Top(3);
+  ASSERT_EQ(3, res.size());
+  for (const auto& e : res) {
+    EXPECT_EQ("hot", e.key.substr(0, 3));
+    EXPECT_GE(e.count, 5000);
+    EXPECT_LE(e.count - e.error, 5000);
+  }
+}
+
+}  // namespace dfly
@@ -67,6 +67,7 @@ void TxQueue::LinkFree(uint64_t weight) {
     }
   }
   ++size_;
+  max_size_ = std::max(max_size_, size_);
 }
 
 void TxQueue::Grow() {
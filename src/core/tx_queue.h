@@ -61,6 +61,15 @@ class TxQueue {
     return size_ == 0;
   }
 
+  // The largest size since the queue was created or since ResetMaxSize.
+  size_t max_size() const {
+    return max_size_;
+  }
+
+  void ResetMaxSize() {
+    max_size_ = size_;
+  }
+
   //! returns the score of the tail record. Can be called only if !Empty().
   uint64_t TailScore() const {
     return Rank(vec_[vec_[head_].prev]);
@@ -108,6 +117,7 @@ class TxQueue {
   std::vector<QRecord> vec_;
   uint32_t next_free_ = 0, head_ = 0;
   size_t size_ = 0;
+  size_t max_size_ = 0;
 
   TxQueue(const TxQueue&) = delete;
 };
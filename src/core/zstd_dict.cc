@@ -0,0 +1,109 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "core/zstd_dict.h"
+
+#include <zdict.h>
+#include <zstd.h>
+
+#include <atomic>
+#include <mutex>
+
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+constexpr int kZstdDictLevel = 1;
+
+// Entries are appended under register_mu and published via num_entries, hence readers
+// do not need to lock.
+ZstdDictRegistry::Entry entries[ZstdDictRegistry::kMaxDicts];
+atomic_uint32_t num_entries{0};
+mutex register_mu;
+
+thread_local const ZstdDictRegistry::Entry* thread_dict = nullptr;
+
+}  // namespace
+
+auto ZstdDictRegistry::Register(string_view raw) -> const Entry* {
+  uint32_t id = ZDICT_getDictID(raw.data(), raw.size());
+  if (id == 0)
+    return nullptr;
+
+  lock_guard lk(register_mu);
+
+  unsigned sz = num_entries.load(memory_order_relaxed);
+  for (unsigned i = 0; i < sz; ++i) {
+    if (entries[i].id == id)
+      return &entries[i];
+  }
+
+  if (sz == kMaxDicts) {
+    LOG(WARNING) << "Reached the limit of " << kMaxDicts << " zstd dictionaries";
+    return nullptr;
+  }
+
+  Entry& entry = entries[sz];
+  entry.cdict = ZSTD_createCDict(raw.data(), raw.size(), kZstdDictLevel);
+  entry.ddict = ZSTD_createDDict(raw.data(), raw.size());
+  if (!entry.cdict || !entry.ddict) {
+    ZSTD_freeCDict(entry.cdict);
+    ZSTD_freeDDict(entry.ddict);
+    entry = Entry{};
+    return nullptr;
+  }
+
+  entry.id = id;
+  entry.raw.assign(raw);
+  num_entries.store(sz + 1, memory_order_release);
+
+  VLOG(1) << "Registered zstd dictionary " << id << " of " << raw.size() << " bytes";
+
+  return &entry;
+}
+
+auto ZstdDictRegistry::Find(uint32_t id) -> const Entry* {
+  unsigned sz = Size();
+  for (unsigned i = 0; i < sz; ++i) {
+    if (entries[i].id == id)
+      return &entries[i];
+  }
+  return nullptr;
+}
+
+string ZstdDictRegistry::Train(string_view buf, const vector<size_t>& sample_sizes,
+                               size_t dict_size) {
+  string dict(dict_size, '\0');
+  size_t res = ZDICT_trainFromBuffer(dict.data(), dict.size(), buf.data(), sample_sizes.data(),
+                                     sample_sizes.size());
+  if (ZDICT_isError(res)) {
+    VLOG(1) << "Could not train zstd dictionary: " << ZDICT_getErrorName(res);
+    return string{};
+  }
+
+  dict.resize(res);
+  return dict;
+}
+
+auto ZstdDictRegistry::ThreadDict() -> const Entry* {
+  return thread_dict;
+}
+
+void ZstdDictRegistry::SetThreadDict(const Entry* entry) {
+  thread_dict = entry;
+}
+
+unsigned ZstdDictRegistry::Size() {
+  return num_entries.load(memory_order_acquire);
+}
+
+auto ZstdDictRegistry::At(unsigned index) -> const Entry* {
+  return &entries[index];
+}
+
+}  // namespace dfly
@@ -0,0 +1,62 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+typedef struct ZSTD_CDict_s ZSTD_CDict;
+typedef struct ZSTD_DDict_s ZSTD_DDict;
+
+namespace dfly {
+
+// Process-wide registry of ZSTD dictionaries used for compression of small values.
+// Dictionaries are never released, so that values compressed with them stay readable from
+// any thread, as well as after a newer dictionary has been trained.
+class ZstdDictRegistry {
+ public:
+  static constexpr unsigned kMaxDicts = 64;
+
+  struct Entry {
+    uint32_t id = 0;
+    std::string raw;
+    ZSTD_CDict* cdict = nullptr;
+    ZSTD_DDict* ddict = nullptr;
+  };
+
+  // Registers a dictionary produced by Train. Registering the same dictionary twice returns
+  // the same entry. Returns nullptr if the dictionary is invalid or the registry is full.
+  static const Entry* Register(std::string_view raw);
+
+  // Returns nullptr if there is no dictionary with this id. Thread-safe.
+  static const Entry* Find(uint32_t id);
+
+  // Calls cb for each registered dictionary.
+  template <typename Cb> static void ForEach(Cb&& cb);
+
+  // Trains a dictionary of upto dict_size bytes from the samples concatenated into buf.
+  // Returns an empty string on failure, for example when there are not enough samples.
+  static std::string Train(std::string_view buf, const std::vector<size_t>& sample_sizes,
+                           size_t dict_size);
+
+  // The dictionary the calling thread compresses values with. Can be null.
+  static const Entry* ThreadDict();
+  static void SetThreadDict(const Entry* entry);
+
+ private:
+  static unsigned Size();
+  static const Entry* At(unsigned index);
+};
+
+template <typename Cb> void ZstdDictRegistry::ForEach(Cb&& cb) {
+  unsigned sz = Size();
+  for (unsigned i = 0; i < sz; ++i) {
+    cb(*At(i));
+  }
+}
+
+}  // namespace dfly
@@ -52,6 +52,25 @@ class ConnectionContext {
   bool authenticated : 1;
   bool force_dispatch : 1;  // whether we should route all requests to the dispatch fiber.
 
+  // The time the request that is dispatched waited in the dispatch queue, 0 for the requests
+  // that are dispatched directly and for the squashed pipelines.
+  uint32_t dispatch_wait_usec = 0;
+
+  // The CPU time the connection used, shown by CLIENT LIST. parse_ns is spent parsing its
+  // requests, dispatch_ns running its commands on the coordinator and shard_ns running their
+  // callbacks in the shards.
+  struct CpuTime {
+    uint64_t parse_ns = 0;
+    uint64_t dispatch_ns = 0;
+    uint64_t shard_ns = 0;
+
+    uint64_t total_ns() const {
+      return parse_ns + dispatch_ns + shard_ns;
+    }
+  };
+
+  CpuTime cpu_time;
+
  private:
   Connection* owner_;
   Protocol protocol_ = Protocol::REDIS;
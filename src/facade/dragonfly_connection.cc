@@ -5,7 +5,10 @@
 #include "facade/dragonfly_connection.h"
 
 #include <absl/container/flat_hash_map.h>
+#include <absl/strings/ascii.h>
 #include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_split.h>
 #include <mimalloc.h>
 
 #include <boost/fiber/operations.hpp>
@@ -16,16 +19,56 @@
 #include "facade/memcache_parser.h"
 #include "facade/redis_parser.h"
 #include "facade/service_interface.h"
+#include "facade/shm_socket.h"
 #include "util/fiber_sched_algo.h"
 #include "util/fibers/fiber.h"
 
 #ifdef DFLY_USE_SSL
+#include "facade/tls_offload.h"
 #include "util/tls/tls_socket.h"
 #endif
 
 ABSL_FLAG(bool, tcp_nodelay, false,
           "Configures dragonfly connections with socket option TCP_NODELAY");
 ABSL_FLAG(bool, http_admin_console, true, "If true allows accessing http console on main TCP port");
+ABSL_FLAG(uint32_t, request_cache_limit, 1U << 20,
+          "Amount of memory in bytes that each IO thread uses to cache released pipeline requests");
+ABSL_FLAG(uint32_t, read_buf_cache_limit, 1U << 20,
+          "Amount of memory in bytes that each IO thread uses to cache the read buffers released "
+          "by the connections that have no data in flight");
+ABSL_FLAG(uint32_t, pipeline_squash, 10,
+          "Number of queued pipelined commands from which they are dispatched together, so that "
+          "the commands on different shards can be executed in a single hop per shard. "
+          "0 disables squashing");
+ABSL_FLAG(uint32_t, reply_coalesce_usec, 50,
+          "Once a pipelined connection runs out of queued requests, its replies are held for up to "
+          "this many microseconds, so that they are written together with the replies of the "
+          "requests that are being read. 0 writes them right away");
+ABSL_FLAG(uint32_t, pipeline_queue_limit, 10000,
+          "Maximum number of pipelined requests queued by a connection. Above it the connection "
+          "stops reading from its socket until the queue drains. 0 means no limit");
+ABSL_FLAG(uint64_t, pipeline_buffer_limit, 128ULL << 20,
+          "Maximum memory in bytes used by the pipelined requests queued by a connection. Above it "
+          "the connection stops reading from its socket until the queue drains. 0 means no limit");
+ABSL_FLAG(uint64_t, pipeline_total_buffer_limit, 0,
+          "Maximum memory in bytes used by the pipelined requests queued by all the connections, "
+          "split evenly between the IO threads. Above it the connections with queued requests "
+          "stop reading from their sockets until their queues drain. 0 means no limit");
+
+ABSL_FLAG(string, client_output_buffer_limit,
+          "normal 0 0 0 replica 256mb 64mb 60 pubsub 32mb 8mb 60",
+          "Limits of the pub/sub and the monitor messages queued by a connection, by the class of "
+          "the connection: <class> <hard limit> <soft limit> <soft seconds>. A connection that "
+          "queues more than the hard limit, or more than the soft limit for longer than the soft "
+          "seconds, is closed and its messages are dropped. 0 disables a limit");
+
+ABSL_FLAG(bool, shm_transport, false,
+          "If true, the clients of the unix socket may switch to the shared-memory transport, "
+          "where the requests and the replies pass through rings in memory shared with the "
+          "server, see facade::ShmClient");
+ABSL_FLAG(uint32_t, shm_idle_polls, 64,
+          "Number of times a connection of the shared-memory transport polls its ring while the "
+          "thread is idle, before it waits for the client to wake it up");
 
 using namespace util;
 using namespace std;
@@ -71,19 +114,94 @@ bool MatchHttp11Line(string_view line) {
 constexpr size_t kMinReadSize = 256;
 constexpr size_t kMaxReadSize = 32_KB;
 
+// Limits the latency of the first reply of a squashed pipeline.
+constexpr size_t kMaxSquashedCommands = 128;
+
+// The output limits of the thread, parsed once by every connection so that the messages do not
+// read the flag.
+struct OutputLimitsCache {
+  string spec;
+  Connection::OutputLimits limits;
+};
+
+thread_local OutputLimitsCache output_limits_cache;
+
+void RefreshOutputLimits() {
+  string spec = absl::GetFlag(FLAGS_client_output_buffer_limit);
+  if (spec == output_limits_cache.spec)
+    return;
+
+  Connection::OutputLimits limits;
+  if (!Connection::ParseOutputLimits(spec, &limits)) {
+    LOG_FIRST_N(ERROR, 1) << "Invalid client_output_buffer_limit: " << spec;
+    return;
+  }
+  output_limits_cache = OutputLimitsCache{std::move(spec), limits};
+}
+
+// Parses bytes with an optional k, kb, m, mb, g or gb suffix, like redis.
+bool ParseMemory(string_view str, uint64_t* bytes) {
+  string lower = absl::AsciiStrToLower(str);
+  string_view num = lower;
+  uint64_t mul = 1;
+  for (auto [suffix, m] : {pair<string_view, uint64_t>{"kb", 1ULL << 10}, {"mb", 1ULL << 20},
+                           {"gb", 1ULL << 30}, {"k", 1000}, {"m", 1000000}, {"g", 1000000000}}) {
+    if (absl::ConsumeSuffix(&num, suffix)) {
+      mul = m;
+      break;
+    }
+  }
+
+  uint64_t val = 0;
+  if (!absl::SimpleAtoi(num, &val))
+    return false;
+  *bytes = val * mul;
+  return true;
+}
+
 struct PubMsgRecord {
   Connection::PubMessage pub_msg;
 
-  PubMsgRecord(const Connection::PubMessage& pmsg) : pub_msg(pmsg) {
+  PubMsgRecord(Connection::PubMessage pmsg) : pub_msg(std::move(pmsg)) {
   }
 };
 
 #ifdef ABSL_HAVE_ADDRESS_SANITIZER
-constexpr size_t kReqStorageSize = 88;
+constexpr size_t kReqStorageSize = 72;
 #else
-constexpr size_t kReqStorageSize = 120;
+constexpr size_t kReqStorageSize = 104;
 #endif
 
+// Memory blocks of released pipeline requests. Pipeline requests are allocated and released by
+// the connection thread, so the next requests of the thread reuse the blocks instead of going
+// through the allocator for every command. Arguments that do not fit into the inline storage are
+// allocated by mimalloc, which already keeps per-thread free lists for every size class.
+struct RequestCache {
+  std::vector<void*> blocks;
+  size_t capacity = 0;
+
+  RequestCache();
+  ~RequestCache();
+};
+
+thread_local RequestCache request_cache;
+
+// Read buffers of the connections that have no data in flight. An idle connection waits for its
+// next request with a small buffer on the stack of its fiber, and takes a read buffer from the
+// cache of its thread once the request arrives. Hence the memory of the read buffers depends on
+// the number of the active connections rather than on the number of the connections.
+struct ReadBufCache {
+  std::vector<std::unique_ptr<base::IoBuf>> bufs;
+  size_t bytes = 0;
+};
+
+thread_local ReadBufCache read_buf_cache;
+
+// Whether the argument is in the buffer rather than in the stash of the parser.
+bool IsInBuffer(RespExpr::Buffer arg, io::Bytes buf) {
+  return !arg.empty() && arg.data() >= buf.data() && arg.data() + arg.size() <= buf.end();
+}
+
 }  // namespace
 
 struct Connection::Shutdown {
@@ -105,6 +223,23 @@ struct Connection::RequestDeleter {
   void operator()(Request* req) const;
 };
 
+// A read buffer that queued requests reference after the connection continued with another one.
+// The last of them returns it to the cache of its thread, like ReleaseReadBuf.
+struct Connection::PinnedReadBuf {
+  std::unique_ptr<base::IoBuf> buf;
+
+  ~PinnedReadBuf() {
+    if (!buf)
+      return;
+    size_t capacity = buf->Capacity();
+    if (read_buf_cache.bytes + capacity <= absl::GetFlag(FLAGS_read_buf_cache_limit)) {
+      buf->ConsumeInput(buf->InputLen());
+      read_buf_cache.bytes += capacity;
+      read_buf_cache.bufs.push_back(std::move(buf));
+    }
+  }
+};
+
 // Please note: The call to the Dtor is mandatory for this!!
 // This class contain types that don't have trivial destructed objects
 struct Connection::Request {
@@ -117,8 +252,13 @@ struct Connection::Request {
     // of using the thread's heap.
     // The capacity is chosen so that we allocate a fully utilized (256 bytes) block.
     absl::FixedArray<char, kReqStorageSize, mi_stl_allocator<char>> storage;
+    uint64_t enqueue_ns;  // when the request was parsed.
+
+    // Set when some of the args reference the read buffer instead of the storage.
+    std::shared_ptr<PinnedReadBuf> pinned;
 
-    PipelineMsg(size_t nargs, size_t capacity) : args(nargs), storage(capacity) {
+    PipelineMsg(size_t nargs, size_t capacity)
+        : args(nargs), storage(capacity), enqueue_ns(ProactorBase::GetMonotonicTimeNs()) {
     }
   };
 
@@ -137,15 +277,24 @@ struct Connection::Request {
   Request(const Request&) = delete;
 
  public:
-  // Overload to create the a new pipeline message
-  static RequestPtr New(mi_heap_t* heap, RespVec args, size_t capacity);
+  // Overload to create the a new pipeline message. Reuses a cached block if possible. If pinned
+  // is set, the args that are in input are referenced in place and the rest are copied into the
+  // storage of capacity bytes. Otherwise all the args are copied.
+  static RequestPtr New(mi_heap_t* heap, RespVec args, size_t capacity, io::Bytes input,
+                        std::shared_ptr<PinnedReadBuf> pinned, ConnectionStats* stats);
 
   // Overload to create a new pubsub message
-  static RequestPtr New(const PubMessage& pub_msg);
+  static RequestPtr New(PubMessage pub_msg);
 
   // Overload to create a new the monitor message
   static RequestPtr New(MonitorMessage msg);
 
+  // Memory used by a pipeline request, accounted towards the pipeline limits.
+  size_t PipelineBytes() const;
+
+  // The bytes of a pub/sub or a monitor message, accounted towards the output limits.
+  size_t AsyncBytes() const;
+
   MessagePayload payload;
 };
 
@@ -155,9 +304,31 @@ Connection::RequestPtr Connection::Request::New(std::string msg) {
   return Connection::RequestPtr{req, Connection::RequestDeleter{}};
 }
 
-Connection::RequestPtr Connection::Request::New(mi_heap_t* heap, RespVec args, size_t capacity) {
+RequestCache::RequestCache() {
+  capacity = absl::GetFlag(FLAGS_request_cache_limit) / sizeof(Connection::Request);
+  blocks.reserve(capacity);
+}
+
+RequestCache::~RequestCache() {
+  for (void* ptr : blocks) {
+    mi_free(ptr);
+  }
+}
+
+Connection::RequestPtr Connection::Request::New(mi_heap_t* heap, RespVec args, size_t capacity,
+                                                io::Bytes input,
+                                                std::shared_ptr<PinnedReadBuf> pinned,
+                                                ConnectionStats* stats) {
   constexpr auto kReqSz = sizeof(Request);
-  void* ptr = mi_heap_malloc_small(heap, kReqSz);
+  void* ptr;
+  if (request_cache.blocks.empty()) {
+    ptr = mi_heap_malloc_small(heap, kReqSz);
+    ++stats->pipeline_cache_miss_cnt;
+  } else {
+    ptr = request_cache.blocks.back();
+    request_cache.blocks.pop_back();
+    ++stats->pipeline_cache_hit_cnt;
+  }
 
   // We must construct in place here, since there is a slice that uses memory locations
   Request* req = new (ptr) Request(args.size(), capacity);
@@ -167,34 +338,81 @@ Connection::RequestPtr Connection::Request::New(mi_heap_t* heap, RespVec args, s
   for (size_t i = 0; i < args.size(); ++i) {
     auto buf = args[i].GetBuf();
     size_t s = buf.size();
+    if (pinned && IsInBuffer(buf, input)) {
+      pipeline_msg.args[i] = MutableSlice(reinterpret_cast<char*>(buf.data()), s);
+      continue;
+    }
     memcpy(next, buf.data(), s);
     pipeline_msg.args[i] = MutableSlice(next, s);
     next += s;
   }
+  pipeline_msg.pinned = std::move(pinned);
 
   return Connection::RequestPtr{req, Connection::RequestDeleter{}};
 }
 
-Connection::RequestPtr Connection::Request::New(const PubMessage& pub_msg) {
-  // This will generate a new request for pubsub message
-  // Please note that unlike the above case, we don't need to "protect", the internals here
-  // since we are currently using a borrow token for it - i.e. the BlockingCounter will
-  // ensure that the message is not deleted until we are finish sending it at the other
-  // side of the queue
-  PubMsgRecord new_msg{pub_msg};
+Connection::RequestPtr Connection::Request::New(PubMessage pub_msg) {
+  // This will generate a new request for pubsub message.
+  // The request does not copy the channel and the message, it shares their buffer with the
+  // requests of the other subscribers.
+  PubMsgRecord new_msg{std::move(pub_msg)};
   void* ptr = mi_malloc(sizeof(Request));
   Request* req = new (ptr) Request(std::move(new_msg));
   return Connection::RequestPtr{req, Connection::RequestDeleter{}};
 }
 
+size_t Connection::Request::PipelineBytes() const {
+  const PipelineMsg& msg = get<PipelineMsg>(payload);
+  size_t res = sizeof(Request);
+
+  // Only the storage that does not fit into the inline capacity is allocated.
+  if (msg.storage.size() > kReqStorageSize)
+    res += msg.storage.size();
+  if (msg.args.size() > 6)
+    res += msg.args.size() * sizeof(MutableSlice);
+
+  // The args in the pinned read buffer count like the copied ones.
+  if (msg.pinned) {
+    for (MutableSlice arg : msg.args)
+      res += arg.size();
+    res -= msg.storage.size();
+  }
+  return res;
+}
+
+size_t Connection::Request::AsyncBytes() const {
+  size_t res = sizeof(Request);
+  if (const MonitorMessage* msg = get_if<MonitorMessage>(&payload))
+    return res + msg->size();
+
+  // The buffer is shared with the other subscribers, but every connection writes it.
+  const PubMessage& msg = get<PubMsgRecord>(payload).pub_msg;
+  if (msg.invalidated_keys) {
+    for (const string& key : *msg.invalidated_keys)
+      res += key.size();
+    return res;
+  }
+  return res + msg.pattern.size() + msg.buf->size();
+}
+
 void Connection::RequestDeleter::operator()(Request* req) const {
+  bool is_pipeline = std::holds_alternative<Request::PipelineMsg>(req->payload);
   req->~Request();
-  mi_free(req);
+
+  // Only pipeline requests are guaranteed to be released by the thread that allocated them.
+  if (is_pipeline && request_cache.blocks.size() < request_cache.capacity) {
+    request_cache.blocks.push_back(req);
+  } else {
+    mi_free(req);
+  }
 }
 
 Connection::Connection(Protocol protocol, util::HttpListenerBase* http_listener, SSL_CTX* ctx,
                        ServiceInterface* service)
-    : io_buf_(kMinReadSize), http_listener_(http_listener), ctx_(ctx), service_(service) {
+    : io_buf_(new base::IoBuf(kMinReadSize)),
+      http_listener_(http_listener),
+      ctx_(ctx),
+      service_(service) {
   static atomic_uint32_t next_id{1};
 
   protocol_ = protocol;
@@ -291,8 +509,21 @@ void Connection::HandleRequests() {
       return;
     }
     VLOG(1) << "TLS handshake succeeded";
+
+    // Once the kernel holds the keys, the connection uses the socket directly.
+    switch (OffloadTls(tls_sock->ssl_handle(), lsb->native_handle())) {
+      case TlsOffloadResult::OFFLOADED:
+        tls_offloaded_ = true;
+        ++service_->GetThreadLocalConnectionStats()->num_tls_offloaded;
+        break;
+      case TlsOffloadResult::NOT_SUPPORTED:
+        break;
+      case TlsOffloadResult::FAILED:
+        return;
+    }
   }
-  FiberSocketBase* peer = tls_sock ? (FiberSocketBase*)tls_sock.get() : socket_.get();
+  FiberSocketBase* peer =
+      tls_sock && !tls_offloaded_ ? (FiberSocketBase*)tls_sock.get() : socket_.get();
 #else
   FiberSocketBase* peer = socket_.get();
 #endif
@@ -306,13 +537,23 @@ void Connection::HandleRequests() {
       VLOG(1) << "HTTP1.1 identified";
       HttpConnection http_conn{http_listener_};
       http_conn.SetSocket(peer);
-      auto ec = http_conn.ParseFromBuffer(io_buf_.InputBuffer());
-      io_buf_.ConsumeInput(io_buf_.InputLen());
+      auto ec = http_conn.ParseFromBuffer(io_buf_->InputBuffer());
+      io_buf_->ConsumeInput(io_buf_->InputLen());
       if (!ec) {
         http_conn.HandleRequests();
       }
       http_conn.ReleaseSocket();
+    } else if (auto shm_res = CheckForShmProto(peer); !shm_res) {
+      VLOG(1) << "Error in the shared memory handshake " << shm_res.error().message();
     } else {
+      unique_ptr<ShmSocket> shm_sock = std::move(*shm_res);
+      if (shm_sock) {
+        VLOG(1) << "Shared memory transport identified";
+        shm_ = true;
+        ++service_->GetThreadLocalConnectionStats()->num_shm_clients;
+        peer = shm_sock.get();
+      }
+
       cc_.reset(service_->CreateContext(peer, this));
 
       auto* us = static_cast<LinuxSocketBase*>(socket_.get());
@@ -331,6 +572,11 @@ void Connection::HandleRequests() {
     }
   }
 
+  if (tls_offloaded_)
+    --service_->GetThreadLocalConnectionStats()->num_tls_offloaded;
+  if (shm_)
+    --service_->GetThreadLocalConnectionStats()->num_shm_clients;
+
   VLOG(1) << "Closed connection for peer " << remote_ep;
 }
 
@@ -338,17 +584,85 @@ void Connection::RegisterOnBreak(BreakerCb breaker_cb) {
   breaker_cb_ = breaker_cb;
 }
 
-void Connection::SendMsgVecAsync(const PubMessage& pub_msg) {
+void Connection::SendMsgVecAsync(PubMessage pub_msg) {
   DCHECK(cc_);
 
   if (cc_->conn_closing) {
     return;
   }
-  RequestPtr req = Request::New(pub_msg);  // new (ptr) Request(0, 0);
-  dispatch_q_.push_back(std::move(req));
-  if (dispatch_q_.size() == 1) {
-    evc_.notify();
+  if (!pub_msg.invalidated_keys)
+    pubsub_ = true;
+  QueueAsyncMessage(Request::New(std::move(pub_msg)));
+}
+
+void Connection::QueueAsyncMessage(RequestPtr req) {
+  size_t bytes = req->AsyncBytes();
+  if (!IsOutputOverLimit(async_queue_bytes_ + bytes)) {
+    ++async_queue_len_;
+    async_queue_bytes_ += bytes;
+    dispatch_q_.push_back(std::move(req));
+    if (dispatch_q_.size() == 1) {
+      evc_.notify();
+    }
+    return;
   }
+
+  // The publishers never wait for a slow connection, it is closed instead.
+  ConnectionStats* stats = service_->GetThreadLocalConnectionStats();
+  ++stats->output_limit_disconnects;
+  stats->output_limit_dropped_msgs += async_queue_len_ + 1;
+  LOG(WARNING) << "Closing the connection " << id_ << " " << name_
+               << " that exceeded its output buffer limit with " << async_queue_len_
+               << " messages of " << async_queue_bytes_ << " bytes";
+
+  cc_->conn_closing = true;
+  evc_.notify();
+  ShutdownSelf();
+}
+
+bool Connection::IsOutputOverLimit(size_t bytes) {
+  OutputClass cls = cc_->replica_conn ? REPLICA_OUTPUT : pubsub_ ? PUBSUB_OUTPUT : NORMAL_OUTPUT;
+  const OutputLimit& limit = output_limits_cache.limits[cls];
+  if (limit.hard > 0 && bytes > limit.hard)
+    return true;
+
+  if (limit.soft == 0 || bytes <= limit.soft) {
+    soft_limit_since_ = 0;
+    return false;
+  }
+
+  time_t now = time(nullptr);
+  if (soft_limit_since_ == 0)
+    soft_limit_since_ = now;
+  return now - soft_limit_since_ > time_t(limit.soft_sec);
+}
+
+bool Connection::ParseOutputLimits(string_view spec, OutputLimits* limits) {
+  vector<string_view> parts = absl::StrSplit(spec, ' ', absl::SkipEmpty());
+  if (parts.size() % 4 != 0)
+    return false;
+
+  for (size_t i = 0; i < parts.size(); i += 4) {
+    string cls = absl::AsciiStrToLower(parts[i]);
+    OutputClass index;
+    if (cls == "normal") {
+      index = NORMAL_OUTPUT;
+    } else if (cls == "pubsub") {
+      index = PUBSUB_OUTPUT;
+    } else if (cls == "replica" || cls == "slave") {
+      index = REPLICA_OUTPUT;
+    } else {
+      return false;
+    }
+
+    OutputLimit limit;
+    if (!ParseMemory(parts[i + 1], &limit.hard) || !ParseMemory(parts[i + 2], &limit.soft) ||
+        !absl::SimpleAtoi(parts[i + 3], &limit.soft_sec)) {
+      return false;
+    }
+    (*limits)[index] = limit;
+  }
+  return true;
 }
 
 string Connection::GetClientInfo() const {
@@ -363,8 +677,14 @@ string Connection::GetClientInfo() const {
   absl::StrAppend(&res, " laddr=", le.address().to_string(), ":", le.port());
   absl::StrAppend(&res, " fd=", lsb->native_handle(), " name=", name_);
   absl::StrAppend(&res, " age=", now - creation_time_, " idle=", now - last_interaction_);
+  absl::StrAppend(&res, " pipeline_queue=", pipeline_queue_len_,
+                  " pipeline_bytes=", pipeline_queue_bytes_);
+  absl::StrAppend(&res, " omem=", async_queue_bytes_);
   absl::StrAppend(&res, " phase=", phase_, " ");
   if (cc_) {
+    const ConnectionContext::CpuTime& cpu = cc_->cpu_time;
+    absl::StrAppend(&res, "cpu_parse=", cpu.parse_ns / 1000, " cpu_dispatch=",
+                    cpu.dispatch_ns / 1000, " cpu_shard=", cpu.shard_ns / 1000, " ");
     absl::StrAppend(&res, service_->GetContextInfo(cc_.get()));
   }
 
@@ -378,39 +698,82 @@ uint32 Connection::GetClientId() const {
 io::Result<bool> Connection::CheckForHttpProto(FiberSocketBase* peer) {
   size_t last_len = 0;
   do {
-    auto buf = io_buf_.AppendBuffer();
+    auto buf = io_buf_->AppendBuffer();
     ::io::Result<size_t> recv_sz = peer->Recv(buf);
     if (!recv_sz) {
       return make_unexpected(recv_sz.error());
     }
-    io_buf_.CommitWrite(*recv_sz);
-    string_view ib = ToSV(io_buf_.InputBuffer().subspan(last_len));
+    io_buf_->CommitWrite(*recv_sz);
+    string_view ib = ToSV(io_buf_->InputBuffer().subspan(last_len));
     size_t pos = ib.find('\n');
     if (pos != string_view::npos) {
-      ib = ToSV(io_buf_.InputBuffer().first(last_len + pos));
+      ib = ToSV(io_buf_->InputBuffer().first(last_len + pos));
       if (ib.size() < 10 || ib.back() != '\r')
         return false;
 
       ib.remove_suffix(1);
       return MatchHttp11Line(ib);
     }
-    last_len = io_buf_.InputLen();
+    last_len = io_buf_->InputLen();
   } while (last_len < 1024);
 
   return false;
 }
 
+auto Connection::CheckForShmProto(FiberSocketBase* peer) -> io::Result<unique_ptr<ShmSocket>> {
+  if (!absl::GetFlag(FLAGS_shm_transport) || !peer->IsUDS())
+    return nullptr;
+
+  // The first line may have been read already by CheckForHttpProto.
+  size_t pos = ToSV(io_buf_->InputBuffer()).find('\n');
+  while (pos == string_view::npos && io_buf_->InputLen() < 1024) {
+    size_t last_len = io_buf_->InputLen();
+    auto buf = io_buf_->AppendBuffer();
+    ::io::Result<size_t> recv_sz = peer->Recv(buf);
+    if (!recv_sz) {
+      return make_unexpected(recv_sz.error());
+    }
+    io_buf_->CommitWrite(*recv_sz);
+    pos = ToSV(io_buf_->InputBuffer().subspan(last_len)).find('\n');
+    if (pos != string_view::npos)
+      pos += last_len;
+  }
+
+  string_view line = ToSV(io_buf_->InputBuffer());
+  if (pos == string_view::npos || !absl::StartsWith(line, ShmRegion::kHandshake))
+    return nullptr;
+
+  line = line.substr(0, pos);
+  line.remove_prefix(ShmRegion::kHandshake.size());
+  if (!line.empty() && line.back() == '\r')
+    line.remove_suffix(1);
+
+  auto res = ShmSocket::Open(peer, line, absl::GetFlag(FLAGS_shm_idle_polls));
+
+  // The client waits for the reply before it uses the rings.
+  io_buf_->ConsumeInput(io_buf_->InputLen());
+  string reply = res ? "+OK\r\n" : absl::StrCat("-ERR ", res.error().message(), "\r\n");
+  if (error_code ec = peer->Write(io::Buffer(reply)); ec) {
+    return make_unexpected(ec);
+  }
+
+  if (!res)
+    return make_unexpected(res.error());
+  return std::move(*res);
+}
+
 void Connection::ConnectionFlow(FiberSocketBase* peer) {
-  auto dispatch_fb = fibers::fiber(fibers::launch::dispatch, [&] { DispatchFiber(peer); });
+  RefreshOutputLimits();
+  dispatch_fb_ = fibers::fiber(fibers::launch::dispatch, [this, peer] { DispatchFiber(peer); });
   ConnectionStats* stats = service_->GetThreadLocalConnectionStats();
   stats->num_conns++;
-  stats->read_buf_capacity += io_buf_.Capacity();
+  stats->read_buf_capacity += ReadBufCapacity();
 
   ParserStatus parse_status = OK;
 
   // At the start we read from the socket to determine the HTTP/Memstore protocol.
   // Therefore we may already have some data in the buffer.
-  if (io_buf_.InputLen() > 0) {
+  if (io_buf_->InputLen() > 0) {
     SetPhase("process");
     if (redis_parser_) {
       parse_status = ParseRedis();
@@ -431,17 +794,21 @@ void Connection::ConnectionFlow(FiberSocketBase* peer) {
     } else {
       parse_status = get<ParserStatus>(res);
     }
+
+    // The connection may have migrated to another thread.
+    stats = service_->GetThreadLocalConnectionStats();
   }
 
   // After the client disconnected.
   cc_->conn_closing = true;  // Signal dispatch to close.
   evc_.notify();
   VLOG(1) << "Before dispatch_fb.join()";
-  dispatch_fb.join();
+  if (dispatch_fb_.joinable())  // not restarted if the connection closed while migrating.
+    dispatch_fb_.join();
   VLOG(1) << "After dispatch_fb.join()";
   service_->OnClose(cc_.get());
 
-  stats->read_buf_capacity -= io_buf_.Capacity();
+  stats->read_buf_capacity -= ReadBufCapacity();
 
   // Update num_replicas if this was a replica connection.
   if (cc_->replica_conn) {
@@ -481,9 +848,13 @@ auto Connection::ParseRedis() -> ParserStatus {
   RedisParser::Result result = RedisParser::OK;
   SinkReplyBuilder* builder = cc_->reply_builder();
   mi_heap_t* tlh = mi_heap_get_backing();
+  ConnectionStats* stats = service_->GetThreadLocalConnectionStats();
+  shared_ptr<PinnedReadBuf> pinned;
 
   do {
-    result = redis_parser_->Parse(io_buf_.InputBuffer(), &consumed, &parse_args_);
+    uint64_t parse_start = ProactorBase::GetMonotonicTimeNs();
+    result = redis_parser_->Parse(io_buf_->InputBuffer(), &consumed, &parse_args_);
+    cc_->cpu_time.parse_ns += ProactorBase::GetMonotonicTimeNs() - parse_start;
 
     if (result == RedisParser::OK && !parse_args_.empty()) {
       RespExpr& first = parse_args_.front();
@@ -496,14 +867,22 @@ auto Connection::ParseRedis() -> ParserStatus {
       // dispatch fiber pulls the last record but is still processing the command and then this
       // fiber enters the condition below and executes out of order.
       bool is_sync_dispatch = !cc_->async_dispatch && !cc_->force_dispatch;
-      if (dispatch_q_.empty() && is_sync_dispatch && consumed >= io_buf_.InputLen()) {
+      if (dispatch_q_.empty() && is_sync_dispatch && consumed >= io_buf_->InputLen()) {
+        builder->SetBatchMode(false);  // writes the held replies of the pipeline as well.
         RespToArgList(parse_args_, &cmd_vec_);
         CmdArgList cmd_list{cmd_vec_.data(), cmd_vec_.size()};
         service_->DispatchCommand(cmd_list, cc_.get());
         last_interaction_ = time(nullptr);
       } else {
         // Dispatch via queue to speedup input reading.
-        RequestPtr req = FromArgs(std::move(parse_args_), tlh);
+        RequestPtr req =
+            FromArgs(std::move(parse_args_), io_buf_->InputBuffer(), tlh, stats, &pinned);
+
+        size_t bytes = req->PipelineBytes();
+        ++pipeline_queue_len_;
+        pipeline_queue_bytes_ += bytes;
+        ++stats->pipeline_queue_len;
+        stats->pipeline_queue_bytes += bytes;
 
         dispatch_q_.push_back(std::move(req));
         if (dispatch_q_.size() == 1) {
@@ -513,9 +892,14 @@ auto Connection::ParseRedis() -> ParserStatus {
         }
       }
     }
-    io_buf_.ConsumeInput(consumed);
+    io_buf_->ConsumeInput(consumed);
   } while (RedisParser::OK == result && !builder->GetError());
 
+  // Nothing is read into the buffer while it is parsed, hence the queued requests can reference
+  // it until here. It is not needed anymore if they are already dispatched.
+  if (pinned && pinned.use_count() > 1)
+    PinReadBuf(std::move(pinned), stats);
+
   parser_error_ = result;
   if (result == RedisParser::OK)
     return OK;
@@ -534,18 +918,18 @@ auto Connection::ParseMemcache() -> ParserStatus {
   MCReplyBuilder* builder = static_cast<MCReplyBuilder*>(cc_->reply_builder());
 
   do {
-    string_view str = ToSV(io_buf_.InputBuffer());
+    string_view str = ToSV(io_buf_->InputBuffer());
     result = memcache_parser_->Parse(str, &consumed, &cmd);
 
     if (result != MemcacheParser::OK) {
-      io_buf_.ConsumeInput(consumed);
+      io_buf_->ConsumeInput(consumed);
       break;
     }
 
     size_t total_len = consumed;
     if (MemcacheParser::IsStoreCmd(cmd.type)) {
       total_len += cmd.bytes_len + 2;
-      if (io_buf_.InputLen() >= total_len) {
+      if (io_buf_->InputLen() >= total_len) {
         value = str.substr(consumed, cmd.bytes_len);
         // TODO: dispatch.
       } else {
@@ -559,9 +943,10 @@ auto Connection::ParseMemcache() -> ParserStatus {
     // fiber enters the condition below and executes out of order.
     bool is_sync_dispatch = !cc_->async_dispatch;
     if (dispatch_q_.empty() && is_sync_dispatch) {
+      builder->SetBatchMode(false);
       service_->DispatchMC(cmd, value, cc_.get());
     }
-    io_buf_.ConsumeInput(total_len);
+    io_buf_->ConsumeInput(total_len);
   } while (!builder->GetError());
 
   parser_error_ = result;
@@ -592,6 +977,7 @@ void Connection::OnBreakCb(int32_t mask) {
 
   breaker_cb_(mask);
   evc_.notify();  // Notify dispatch fiber.
+  drain_ec_.notify();
 }
 
 auto Connection::IoLoop(util::FiberSocketBase* peer) -> variant<error_code, ParserStatus> {
@@ -603,7 +989,26 @@ auto Connection::IoLoop(util::FiberSocketBase* peer) -> variant<error_code, Pars
   do {
     FetchBuilderStats(stats, builder);
 
-    io::MutableBytes append_buf = io_buf_.AppendBuffer();
+    if (migration_request_) {
+      HandleMigrateRequest(peer);
+      if (cc_->conn_closing)
+        break;
+      stats = service_->GetThreadLocalConnectionStats();
+    }
+
+    // TCP backpressure: the client stops sending once the socket buffers fill up.
+    if (IsPipelineOverLimit(1)) {
+      ++stats->pipeline_throttle_cnt;
+      SetPhase("throttled");
+      throttled_ = true;
+      drain_ec_.await([this] { return cc_->conn_closing || !IsPipelineOverLimit(2); });
+      throttled_ = false;
+      if (cc_->conn_closing)
+        break;
+    }
+
+    uint8_t idle_buf[kMinReadSize];
+    io::MutableBytes append_buf = io_buf_ ? io_buf_->AppendBuffer() : io::MutableBytes{idle_buf};
     SetPhase("readsock");
 
     ::io::Result<size_t> recv_sz = peer->Recv(append_buf);
@@ -615,7 +1020,11 @@ auto Connection::IoLoop(util::FiberSocketBase* peer) -> variant<error_code, Pars
       break;
     }
 
-    io_buf_.CommitWrite(*recv_sz);
+    if (!io_buf_) {
+      AcquireReadBuf(stats);
+      memcpy(io_buf_->AppendBuffer().data(), idle_buf, *recv_sz);
+    }
+    io_buf_->CommitWrite(*recv_sz);
     stats->io_read_bytes += *recv_sz;
     ++stats->io_read_cnt;
     SetPhase("process");
@@ -630,26 +1039,30 @@ auto Connection::IoLoop(util::FiberSocketBase* peer) -> variant<error_code, Pars
     if (parse_status == NEED_MORE) {
       parse_status = OK;
 
-      size_t capacity = io_buf_.Capacity();
+      size_t capacity = io_buf_->Capacity();
       if (capacity < kMaxReadSize) {
         size_t parser_hint = 0;
         if (redis_parser_)
           parser_hint = redis_parser_->parselen_hint();  // Could be done for MC as well.
 
         if (parser_hint > capacity) {
-          io_buf_.Reserve(std::min(kMaxReadSize, parser_hint));
+          io_buf_->Reserve(std::min(kMaxReadSize, parser_hint));
         } else if (append_buf.size() == *recv_sz && append_buf.size() > capacity / 2) {
           // Last io used most of the io_buf to the end.
-          io_buf_.Reserve(capacity * 2);  // Valid growth range.
+          io_buf_->Reserve(capacity * 2);  // Valid growth range.
         }
 
-        if (capacity < io_buf_.Capacity()) {
-          VLOG(1) << "Growing io_buf to " << io_buf_.Capacity();
-          stats->read_buf_capacity += (io_buf_.Capacity() - capacity);
+        if (capacity < io_buf_->Capacity()) {
+          VLOG(1) << "Growing io_buf to " << io_buf_->Capacity();
+          stats->read_buf_capacity += (io_buf_->Capacity() - capacity);
         }
       }
     } else if (parse_status != OK) {
       break;
+    } else if (io_buf_->InputLen() == 0 && *recv_sz < kMinReadSize) {
+      // The request fitted into the idle buffer, so waiting for the next one with it does not
+      // take more reads.
+      ReleaseReadBuf(stats);
     }
     ec = builder->GetError();
   } while (peer->IsOpen() && !ec);
@@ -662,6 +1075,72 @@ auto Connection::IoLoop(util::FiberSocketBase* peer) -> variant<error_code, Pars
   return parse_status;
 }
 
+void Connection::AcquireReadBuf(ConnectionStats* stats) {
+  DCHECK(!io_buf_);
+  if (read_buf_cache.bufs.empty()) {
+    io_buf_.reset(new base::IoBuf(kMinReadSize));
+  } else {
+    io_buf_ = std::move(read_buf_cache.bufs.back());
+    read_buf_cache.bufs.pop_back();
+    read_buf_cache.bytes -= io_buf_->Capacity();
+  }
+  stats->read_buf_capacity += io_buf_->Capacity();
+}
+
+void Connection::ReleaseReadBuf(ConnectionStats* stats) {
+  DCHECK_EQ(0u, io_buf_->InputLen());
+  size_t capacity = io_buf_->Capacity();
+  stats->read_buf_capacity -= capacity;
+  if (read_buf_cache.bytes + capacity <= absl::GetFlag(FLAGS_read_buf_cache_limit)) {
+    read_buf_cache.bytes += capacity;
+    read_buf_cache.bufs.push_back(std::move(io_buf_));
+  } else {
+    io_buf_.reset();
+  }
+}
+
+void Connection::PinReadBuf(shared_ptr<PinnedReadBuf> pinned, ConnectionStats* stats) {
+  size_t capacity = io_buf_->Capacity();
+  stats->read_buf_capacity -= capacity;
+  pinned->buf = std::move(io_buf_);
+
+  // The next requests are likely as large, e.g. of a pipeline of big values.
+  AcquireReadBuf(stats);
+  if (io_buf_->Capacity() < capacity) {
+    stats->read_buf_capacity += capacity - io_buf_->Capacity();
+    io_buf_->Reserve(capacity);
+  }
+
+  io::Bytes tail = pinned->buf->InputBuffer();
+  if (!tail.empty()) {
+    memcpy(io_buf_->AppendBuffer().data(), tail.data(), tail.size());
+    io_buf_->CommitWrite(tail.size());
+  }
+}
+
+bool Connection::ReclaimIdleMemory() {
+  // The input loop waits for the next request and the dispatch fiber has nothing to dispatch.
+  if (strcmp(phase_, "readsock") != 0 || !dispatch_q_.empty() || cc_->conn_closing)
+    return false;
+  if (io_buf_ && io_buf_->InputLen() > 0)
+    return false;
+  if (redis_parser_ && !redis_parser_->ReleaseMemory())
+    return false;
+
+  decltype(parse_args_){}.swap(parse_args_);
+  decltype(cmd_vec_){}.swap(cmd_vec_);
+  cc_->reply_builder()->ReleaseBatch();
+  return true;
+}
+
+size_t Connection::MemoryUsage() const {
+  size_t res = sizeof(Connection) + ReadBufCapacity();
+  res += parse_args_.capacity() * sizeof(RespExpr) + cmd_vec_.capacity() * sizeof(MutableSlice);
+  if (cc_)
+    res += cc_->reply_builder()->batch_capacity();
+  return res;
+}
+
 struct Connection::DispatchOperations {
   DispatchOperations(SinkReplyBuilder* b, Connection* me)
       : stats{me->service_->GetThreadLocalConnectionStats()}, builder{b}, self(me) {
@@ -671,9 +1150,16 @@ struct Connection::DispatchOperations {
   void operator()(Request::PipelineMsg& msg);
   void operator()(const Request::MonitorMessage& msg);
 
+  // Dispatches the pipeline request together with the pipeline requests that follow it
+  // in the queue.
+  void Squash(RequestPtr first);
+
   ConnectionStats* stats = nullptr;
   SinkReplyBuilder* builder = nullptr;
   Connection* self = nullptr;
+
+  // If set, the replies are batched even when the queue is empty and DispatchFiber flushes them.
+  bool hold_replies = false;
 };
 
 void Connection::DispatchOperations::operator()(const Request::MonitorMessage& msg) {
@@ -685,29 +1171,65 @@ void Connection::DispatchOperations::operator()(const PubMsgRecord& msg) {
   RedisReplyBuilder* rbuilder = (RedisReplyBuilder*)builder;
   ++stats->async_writes_cnt;
   const PubMessage& pub_msg = msg.pub_msg;
+  if (pub_msg.invalidated_keys) {
+    rbuilder->StartCollection(2, RedisReplyBuilder::PUSH);
+    rbuilder->SendBulkString("invalidate");
+    if (pub_msg.invalidated_keys->empty())
+      rbuilder->SendNull();
+    else
+      rbuilder->SendStringArr(*pub_msg.invalidated_keys);
+    return;
+  }
+
   string_view arr[4];
   if (pub_msg.pattern.empty()) {
-    arr[0] = "message";
-    arr[1] = pub_msg.channel;
-    arr[2] = *pub_msg.message;
-    rbuilder->SendStringArr(absl::Span<string_view>{arr, 3});
+    arr[0] = pub_msg.sharded ? "smessage" : "message";
+    arr[1] = pub_msg.channel();
+    arr[2] = pub_msg.message();
+    rbuilder->SendStringCollection(absl::Span<string_view>{arr, 3}, RedisReplyBuilder::PUSH);
   } else {
     arr[0] = "pmessage";
     arr[1] = pub_msg.pattern;
-    arr[2] = pub_msg.channel;
-    arr[3] = *pub_msg.message;
-    rbuilder->SendStringArr(absl::Span<string_view>{arr, 4});
+    arr[2] = pub_msg.channel();
+    arr[3] = pub_msg.message();
+    rbuilder->SendStringCollection(absl::Span<string_view>{arr, 4}, RedisReplyBuilder::PUSH);
   }
 }
 
 void Connection::DispatchOperations::operator()(Request::PipelineMsg& msg) {
   ++stats->pipelined_cmd_cnt;
   bool empty = self->dispatch_q_.empty();
-  builder->SetBatchMode(!empty);
+  builder->SetBatchMode(!empty || hold_replies);
   self->cc_->async_dispatch = true;
+  self->cc_->dispatch_wait_usec = (ProactorBase::GetMonotonicTimeNs() - msg.enqueue_ns) / 1000;
   self->service_->DispatchCommand(CmdArgList{msg.args.data(), msg.args.size()}, self->cc_.get());
   self->last_interaction_ = time(nullptr);
   self->cc_->async_dispatch = false;
+  self->cc_->dispatch_wait_usec = 0;
+}
+
+void Connection::DispatchOperations::Squash(RequestPtr first) {
+  auto& dispatch_q = self->dispatch_q_;
+  vector<RequestPtr> reqs;
+  reqs.push_back(std::move(first));
+  while (!dispatch_q.empty() && reqs.size() < kMaxSquashedCommands &&
+         holds_alternative<Request::PipelineMsg>(dispatch_q.front()->payload)) {
+    reqs.push_back(self->PopRequest());
+  }
+
+  vector<CmdArgList> args_list;
+  args_list.reserve(reqs.size());
+  for (auto& req : reqs) {
+    Request::PipelineMsg& msg = get<Request::PipelineMsg>(req->payload);
+    args_list.emplace_back(msg.args.data(), msg.args.size());
+  }
+
+  stats->pipelined_cmd_cnt += reqs.size();
+  builder->SetBatchMode(!dispatch_q.empty() || hold_replies);
+  self->cc_->async_dispatch = true;
+  self->service_->DispatchManyCommands(absl::MakeSpan(args_list), self->cc_.get());
+  self->last_interaction_ = time(nullptr);
+  self->cc_->async_dispatch = false;
 }
 
 // DispatchFiber handles commands coming from the InputLoop.
@@ -720,29 +1242,167 @@ void Connection::DispatchFiber(util::FiberSocketBase* peer) {
 
   SinkReplyBuilder* builder = cc_->reply_builder();
   DispatchOperations dispatch_op{builder, this};
+  size_t squash_min = absl::GetFlag(FLAGS_pipeline_squash);
+  auto coalesce_time = chrono::microseconds(absl::GetFlag(FLAGS_reply_coalesce_usec));
+
+  // Set when the replies are held in the batch, the deadline bounds their latency.
+  chrono::steady_clock::time_point flush_deadline;
+
+  auto has_input = [this] { return cc_->conn_closing || migrating_ || !dispatch_q_.empty(); };
 
   while (!builder->GetError()) {
-    evc_.await([this] { return cc_->conn_closing || !dispatch_q_.empty(); });
-    if (cc_->conn_closing)
+    evc_.await(has_input);
+    if (cc_->conn_closing || dispatch_q_.empty())  // the queue is empty when migrating.
       break;
 
-    RequestPtr req{std::move(dispatch_q_.front())};
-    dispatch_q_.pop_front();
-    std::visit(dispatch_op, req->payload);
+    RequestPtr req = PopRequest();
+
+    // Replies are held only for connections that pipeline their requests, the replies of
+    // a connection that waits for each reply are written right away.
+    if (coalesce_time.count() > 0 && !dispatch_q_.empty())
+      dispatch_op.hold_replies = true;
+
+    if (squash_min > 0 && dispatch_q_.size() + 1 >= squash_min &&
+        holds_alternative<Request::PipelineMsg>(req->payload)) {
+      dispatch_op.Squash(std::move(req));
+    } else {
+      std::visit(dispatch_op, req->payload);
+    }
+
+    if (!dispatch_op.hold_replies || !dispatch_q_.empty())
+      continue;
+
+    // The queue is drained. Wait shortly for the next requests of the pipeline, so that their
+    // replies are written together with the pending ones. Meanwhile the input loop queues
+    // the requests instead of dispatching them, hence it does not write replies.
+    cc_->async_dispatch = true;
+    auto now = chrono::steady_clock::now();
+    if (builder->batch_len() > 0 && flush_deadline == chrono::steady_clock::time_point{})
+      flush_deadline = now + coalesce_time;
+
+    if (builder->batch_len() > 0 && now < flush_deadline)
+      evc_.await_until(has_input, flush_deadline);
+
+    if (dispatch_q_.empty() || chrono::steady_clock::now() >= flush_deadline) {
+      if (dispatch_q_.empty())
+        dispatch_op.hold_replies = false;  // the pipeline seems to be over.
+
+      builder->SetBatchMode(false);
+      builder->FlushBatch();
+      flush_deadline = {};
+    }
+    cc_->async_dispatch = false;
   }
 
+  builder->FlushBatch();
+  if (migrating_ && !cc_->conn_closing && !builder->GetError())
+    return;  // HandleMigrateRequest restarts the fiber in the new thread.
+
   cc_->conn_closing = true;
+  drain_ec_.notify();
 
   // make sure that we don't have any leftovers!
-  dispatch_q_.clear();
+  while (!dispatch_q_.empty()) {
+    PopRequest();
+  }
+}
+
+auto Connection::PopRequest() -> RequestPtr {
+  RequestPtr req{std::move(dispatch_q_.front())};
+  dispatch_q_.pop_front();
+  if (!holds_alternative<Request::PipelineMsg>(req->payload)) {
+    --async_queue_len_;
+    async_queue_bytes_ -= req->AsyncBytes();
+    return req;
+  }
+
+  size_t bytes = req->PipelineBytes();
+  ConnectionStats* stats = service_->GetThreadLocalConnectionStats();
+  --pipeline_queue_len_;
+  pipeline_queue_bytes_ -= bytes;
+  --stats->pipeline_queue_len;
+  stats->pipeline_queue_bytes -= bytes;
+
+  if (throttled_)
+    drain_ec_.notify();
+  return req;
+}
+
+bool Connection::IsPipelineOverLimit(size_t divisor) const {
+  if (pipeline_queue_len_ == 0)
+    return false;
+
+  size_t max_len = absl::GetFlag(FLAGS_pipeline_queue_limit) / divisor;
+  if (max_len > 0 && pipeline_queue_len_ >= max_len)
+    return true;
+
+  size_t max_bytes = absl::GetFlag(FLAGS_pipeline_buffer_limit) / divisor;
+  if (max_bytes > 0 && pipeline_queue_bytes_ >= max_bytes)
+    return true;
+
+  // The connections of a thread share its part of the server-wide limit, a connection without
+  // queued requests keeps reading.
+  size_t max_total = absl::GetFlag(FLAGS_pipeline_total_buffer_limit) / divisor;
+  if (max_total == 0)
+    return false;
+
+  max_total /= owner()->pool()->size();
+  return service_->GetThreadLocalConnectionStats()->pipeline_queue_bytes >= max_total;
 }
 
-auto Connection::FromArgs(RespVec args, mi_heap_t* heap) -> RequestPtr {
+void Connection::HandleMigrateRequest(util::FiberSocketBase* peer) {
+  ProactorBase* dest = migration_request_;
+  migration_request_ = nullptr;
+  if (dest == ProactorBase::me())
+    return;
+
+  // The queued requests are dispatched in this thread, their memory belongs to its heap.
+  migrating_ = true;
+  evc_.notify();
+  dispatch_fb_.join();
+  migrating_ = false;
+
+  if (cc_->conn_closing)
+    return;
+
+  ConnectionStats* stats = service_->GetThreadLocalConnectionStats();
+  --stats->num_conns;
+  stats->num_tls_offloaded -= tls_offloaded_;
+  stats->num_shm_clients -= shm_;
+  stats->read_buf_capacity -= ReadBufCapacity();
+
+  owner()->Migrate(this, dest);
+
+  stats = service_->GetThreadLocalConnectionStats();
+  ++stats->num_conns;
+  stats->num_tls_offloaded += tls_offloaded_;
+  stats->num_shm_clients += shm_;
+  stats->read_buf_capacity += ReadBufCapacity();
+  ++stats->num_migrations;
+
+  dispatch_fb_ = fibers::fiber(fibers::launch::dispatch, [this, peer] { DispatchFiber(peer); });
+}
+
+void Connection::RequestAsyncMigration(util::ProactorBase* dest) {
+  // The squashed pipeline commands run in the shard threads with a stub context that points
+  // to this connection.
+  if (socket_->proactor() == ProactorBase::me())
+    migration_request_ = dest;
+}
+
+// The args that are in the read buffer are referenced in place when copying them would not fit
+// into the inline storage of the request, e.g. big values. The request pins the buffer then.
+// The args that the parser stashed, of the bulk strings that were split between reads, are
+// always copied.
+auto Connection::FromArgs(RespVec args, io::Bytes input, mi_heap_t* heap, ConnectionStats* stats,
+                          shared_ptr<PinnedReadBuf>* pinned) -> RequestPtr {
   DCHECK(!args.empty());
-  size_t backed_sz = 0;
+  size_t backed_sz = 0, in_place_sz = 0;
   for (const auto& arg : args) {
     CHECK_EQ(RespExpr::STRING, arg.type);
     backed_sz += arg.GetBuf().size();
+    if (IsInBuffer(arg.GetBuf(), input))
+      in_place_sz += arg.GetBuf().size();
   }
   DCHECK(backed_sz);
 
@@ -750,9 +1410,12 @@ auto Connection::FromArgs(RespVec args, mi_heap_t* heap) -> RequestPtr {
   static_assert(kReqSz < MI_SMALL_SIZE_MAX);
   static_assert(alignof(Request) == 8);
 
-  RequestPtr req = Request::New(heap, args, backed_sz);
+  if (backed_sz <= kReqStorageSize || in_place_sz == 0)
+    return Request::New(heap, args, backed_sz, input, nullptr, stats);
 
-  return req;
+  if (!*pinned)
+    *pinned = make_shared<PinnedReadBuf>();
+  return Request::New(heap, args, backed_sz - in_place_sz, input, *pinned, stats);
 }
 void Connection::ShutdownSelf() {
   util::Connection::Shutdown();
@@ -771,15 +1434,14 @@ void Connection::SendMonitorMsg(std::string monitor_msg) {
   DCHECK(cc_);
 
   if (!cc_->conn_closing) {
-    RequestPtr req = Request::New(std::move(monitor_msg));
-    dispatch_q_.push_back(std::move(req));
-    if (dispatch_q_.size() == 1) {
-      evc_.notify();
-    }
+    QueueAsyncMessage(Request::New(std::move(monitor_msg)));
   }
 }
 
 std::string Connection::RemoteEndpointStr() const {
+  if (!socket_)  // the connections of the tests.
+    return {};
+
   LinuxSocketBase* lsb = static_cast<LinuxSocketBase*>(socket_.get());
   bool unix_socket = lsb->IsUDS();
   std::string connection_str = unix_socket ? "unix:" : std::string{};
@@ -789,4 +1451,12 @@ std::string Connection::RemoteEndpointStr() const {
   return connection_str;
 }
 
+std::string Connection::RemoteEndpointAddress() const {
+  if (!socket_)
+    return {};
+
+  LinuxSocketBase* lsb = static_cast<LinuxSocketBase*>(socket_.get());
+  return lsb->RemoteEndpoint().address().to_string();
+}
+
 }  // namespace facade
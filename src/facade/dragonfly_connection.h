@@ -6,8 +6,10 @@
 
 #include <absl/container/fixed_array.h>
 
+#include <array>
 #include <deque>
 #include <variant>
+#include <vector>
 
 #include "base/io_buf.h"
 #include "facade/facade_types.h"
@@ -25,6 +27,7 @@ class ConnectionContext;
 class RedisParser;
 class ServiceInterface;
 class MemcacheParser;
+class ShmSocket;
 
 class Connection : public util::Connection {
  public:
@@ -54,14 +57,46 @@ class Connection : public util::Connection {
 
   struct PubMessage {
     // if empty - means its a regular message, otherwise it's pmessage.
-    std::string_view pattern;
-    std::string_view channel;
-    std::shared_ptr<const std::string> message;  // ensure that this message would out live passing
-                                                 // between different threads/fibers
+    std::string pattern;
+    bool sharded = false;  // sent by SPUBLISH to a shard channel, it's smessage.
+
+    // The channel followed by the message. PUBLISH allocates it once and all the subscribers
+    // share it, across threads, until their connections send it.
+    std::shared_ptr<const std::string> buf;
+    uint32_t channel_len = 0;
+
+    // If set, it's a client tracking invalidation of the keys. An empty list means all the keys.
+    std::shared_ptr<const std::vector<std::string>> invalidated_keys;
+
+    std::string_view channel() const {
+      return std::string_view{*buf}.substr(0, channel_len);
+    }
+
+    std::string_view message() const {
+      return std::string_view{*buf}.substr(channel_len);
+    }
   };
 
   // this function is overriden at test_utils TestConnection
-  virtual void SendMsgVecAsync(const PubMessage& pub_msg);
+  virtual void SendMsgVecAsync(PubMessage pub_msg);
+
+  // The classes of --client_output_buffer_limit. A connection that received a pub/sub message
+  // is a pubsub one.
+  enum OutputClass : uint8_t { NORMAL_OUTPUT = 0, PUBSUB_OUTPUT = 1, REPLICA_OUTPUT = 2 };
+
+  // The messages queued by a connection are limited to hard bytes, and to soft bytes for longer
+  // than soft_sec seconds. 0 means no limit.
+  struct OutputLimit {
+    uint64_t hard = 0;
+    uint64_t soft = 0;
+    uint32_t soft_sec = 0;
+  };
+  using OutputLimits = std::array<OutputLimit, 3>;
+
+  // Parses groups of "<class> <hard> <soft> <soft seconds>" into limits, where the class is
+  // normal, pubsub or replica, and the sizes may have the k, kb, m, mb, g or gb suffixes.
+  // Returns false if the spec is malformed.
+  static bool ParseOutputLimits(std::string_view spec, OutputLimits* limits);
 
   // Please note, this accept the message by value, since we really want to
   // create a new copy here, so that we would not need to "worry" about memory
@@ -69,6 +104,11 @@ class Connection : public util::Connection {
   // we would not need in this way to sync on the lifetime of the message
   void SendMonitorMsg(std::string monitor_msg);
 
+  // Requests migrating the connection to the thread of dest. The connection migrates once its
+  // queued requests are dispatched. Ignored when called from another thread.
+  // virtual - to allow the testing code to override it.
+  virtual void RequestAsyncMigration(util::ProactorBase* dest);
+
   void SetName(std::string_view name) {
     CopyCharBuf(name, sizeof(name_), name_);
   }
@@ -83,8 +123,38 @@ class Connection : public util::Connection {
 
   std::string GetClientInfo() const;
   std::string RemoteEndpointStr() const;
+
+  // The context of the connection, may be null while the connection is being set up. Must run
+  // in the thread of the connection.
+  ConnectionContext* cntx() {
+    return cc_.get();
+  }
+
+
+  // The address of the peer without the port, empty for the connections of the tests.
+  std::string RemoteEndpointAddress() const;
   uint32 GetClientId() const;
 
+  // Seconds since the connection last read from its socket.
+  time_t IdleSec() const {
+    return time(nullptr) - last_interaction_;
+  }
+
+  // Frees the buffers that the connection keeps from its previous requests, they grow again
+  // with the next ones. Returns false if the connection is in the middle of a request.
+  // Must run in the thread of the connection. The read buffer is not freed while the
+  // connection waits in Recv on it, see ReleaseReadBuf.
+  bool ReclaimIdleMemory();
+
+  // The heap memory of the connection buffers, the fiber stacks are not counted.
+  size_t MemoryUsage() const;
+
+  // The requests and the messages that wait to be dispatched. Must run in the thread of the
+  // connection.
+  size_t dispatch_queue_len() const {
+    return dispatch_q_.size();
+  }
+
   void ShutdownSelf();
 
  protected:
@@ -95,6 +165,14 @@ class Connection : public util::Connection {
  private:
   enum ParserStatus { OK, NEED_MORE, ERROR };
 
+  struct Request;
+  struct DispatchOperations;
+  struct DispatchCleanup;
+  struct RequestDeleter;
+  struct PinnedReadBuf;
+
+  using RequestPtr = std::unique_ptr<Request, RequestDeleter>;
+
   void HandleRequests() final;
 
   static void CopyCharBuf(std::string_view src, unsigned dest_len, char* dest) {
@@ -107,16 +185,49 @@ class Connection : public util::Connection {
   //
   io::Result<bool> CheckForHttpProto(util::FiberSocketBase* peer);
 
+  // Returns the socket of the shared-memory transport if the client starts with its handshake,
+  // and null otherwise.
+  io::Result<std::unique_ptr<ShmSocket>> CheckForShmProto(util::FiberSocketBase* peer);
+
   void ConnectionFlow(util::FiberSocketBase* peer);
   std::variant<std::error_code, ParserStatus> IoLoop(util::FiberSocketBase* peer);
 
   void DispatchFiber(util::FiberSocketBase* peer);
 
+  // Stops the dispatch fiber, migrates the connection and restarts the fiber in the new thread.
+  void HandleMigrateRequest(util::FiberSocketBase* peer);
+
+  // Pops the front of dispatch_q_ and wakes up the input loop if it waits for the queue to drain.
+  RequestPtr PopRequest();
+
+  // Returns true if the queued pipeline requests exceed one of the limits divided by divisor.
+  bool IsPipelineOverLimit(size_t divisor) const;
+
+  // Queues the pub/sub or the monitor message, unless it exceeds the output limits, in which
+  // case the connection is closed and its queued messages are dropped.
+  void QueueAsyncMessage(RequestPtr req);
+  bool IsOutputOverLimit(size_t bytes);
+
   ParserStatus ParseRedis();
   ParserStatus ParseMemcache();
   void OnBreakCb(int32_t mask);
 
-  base::IoBuf io_buf_;
+  // Takes a read buffer from the cache of the thread, or allocates one.
+  void AcquireReadBuf(ConnectionStats* stats);
+
+  // Returns the empty read buffer to the cache of the thread.
+  void ReleaseReadBuf(ConnectionStats* stats);
+
+  // Hands the read buffer over to the queued requests that reference it and continues with
+  // another one, which starts with the input that was not parsed yet.
+  void PinReadBuf(std::shared_ptr<PinnedReadBuf> pinned, ConnectionStats* stats);
+
+  size_t ReadBufCapacity() const {
+    return io_buf_ ? io_buf_->Capacity() : 0;
+  }
+
+  // Null while the connection waits for a request without data in flight.
+  std::unique_ptr<base::IoBuf> io_buf_;
   std::unique_ptr<RedisParser> redis_parser_;
   std::unique_ptr<MemcacheParser> memcache_parser_;
   util::HttpListenerBase* http_listener_;
@@ -128,18 +239,29 @@ class Connection : public util::Connection {
 
   std::unique_ptr<ConnectionContext> cc_;
 
-  struct Request;
-  struct DispatchOperations;
-  struct DispatchCleanup;
-  struct RequestDeleter;
-
-  using RequestPtr = std::unique_ptr<Request, RequestDeleter>;
-
-  // args are passed deliberately by value - to pass the ownership.
-  static RequestPtr FromArgs(RespVec args, mi_heap_t* heap);
+  // args are passed deliberately by value - to pass the ownership. The arguments in input, the
+  // unparsed part of the read buffer, may be referenced in place, see Request::New.
+  static RequestPtr FromArgs(RespVec args, io::Bytes input, mi_heap_t* heap,
+                             ConnectionStats* stats, std::shared_ptr<PinnedReadBuf>* pinned);
 
   std::deque<RequestPtr> dispatch_q_;  // coordinated via evc_.
   util::fibers_ext::EventCount evc_;
+  ::boost::fibers::fiber dispatch_fb_;
+
+  util::ProactorBase* migration_request_ = nullptr;
+  bool migrating_ = false;  // signals the dispatch fiber to exit once the queue is drained.
+
+  // The pipeline requests in dispatch_q_, the input loop stops reading above the limits.
+  size_t pipeline_queue_len_ = 0;
+  size_t pipeline_queue_bytes_ = 0;
+  util::fibers_ext::EventCount drain_ec_;
+  bool throttled_ = false;
+
+  // The pub/sub and the monitor messages in dispatch_q_, see --client_output_buffer_limit.
+  size_t async_queue_len_ = 0;
+  size_t async_queue_bytes_ = 0;
+  time_t soft_limit_since_ = 0;  // when the messages exceeded the soft limit.
+  bool pubsub_ = false;
 
   RespVec parse_args_;
   CmdArgVec cmd_vec_;
@@ -149,6 +271,8 @@ class Connection : public util::Connection {
   uint32_t break_poll_id_ = UINT32_MAX;
 
   Protocol protocol_;
+  bool tls_offloaded_ = false;  // the kernel encrypts the TLS records, see --tls_offload.
+  bool shm_ = false;            // uses the shared-memory transport, see --shm_transport.
 
   struct Shutdown;
   std::unique_ptr<Shutdown> shutdown_;
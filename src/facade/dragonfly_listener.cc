@@ -11,7 +11,11 @@
 #include "base/flags.h"
 #include "base/logging.h"
 #include "facade/dragonfly_connection.h"
+#include "facade/numa.h"
 #include "facade/service_interface.h"
+#ifdef DFLY_USE_SSL
+#include "facade/tls_offload.h"
+#endif
 #include "util/proactor_pool.h"
 
 using namespace std;
@@ -24,6 +28,10 @@ ABSL_FLAG(bool, conn_use_incoming_cpu, false,
 
 ABSL_FLAG(string, tls_cert_file, "", "cert file for tls connections");
 ABSL_FLAG(string, tls_key_file, "", "key file for tls connections");
+ABSL_FLAG(bool, tls_offload, false,
+          "If true, the TLS 1.3 connections with AES-GCM ciphers are encrypted by the kernel "
+          "after the handshake (kernel TLS). The other connections and the kernels without "
+          "TLS support fall back to OpenSSL. Disables the session tickets");
 
 #if 0
 enum TlsClientAuth {
@@ -92,6 +100,9 @@ static SSL_CTX* CreateSslCntx() {
 
   CHECK_EQ(1, SSL_CTX_set_dh_auto(ctx, 1));
 
+  if (GetFlag(FLAGS_tls_offload))
+    PrepareTlsOffload(ctx);
+
   return ctx;
 }
 #endif
@@ -156,6 +167,10 @@ error_code Listener::ConfigureServerSocket(int fd) {
   if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) < 0) {
     LOG(WARNING) << "Could not set reuse addr on socket " << detail::SafeErrorMessage(errno);
   }
+  if (reuse_port_ && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0) {
+    LOG(WARNING) << "Could not set reuse port on socket " << detail::SafeErrorMessage(errno);
+  }
+  listen_fd_ = fd;
   bool success = ConfigureKeepAlive(fd, kInterval);
 
   if (!success) {
@@ -174,22 +189,28 @@ error_code Listener::ConfigureServerSocket(int fd) {
   return error_code{};
 }
 
+void Listener::StopAccepting() {
+  // Linux moves a listening socket that is shut down out of the LISTEN state, hence the
+  // successor that bound the same port gets all the new connections.
+  if (listen_fd_ >= 0 && shutdown(listen_fd_, SHUT_RDWR) != 0) {
+    LOG(WARNING) << "Could not stop listening " << detail::SafeErrorMessage(errno);
+  }
+}
+
 void Listener::PreShutdown() {
 }
 
 void Listener::PostShutdown() {
 }
 
-// We can limit number of threads handling dragonfly connections.
+// We can limit number of threads handling dragonfly connections, and keep them off the
+// shard threads, see ThreadRoles.
 ProactorBase* Listener::PickConnectionProactor(LinuxSocketBase* sock) {
   util::ProactorPool* pp = pool();
-  uint32_t total = GetFlag(FLAGS_conn_threads);
+  ThreadRoles roles = ThreadRoles::Get(pp->size());
+  uint32_t begin = roles.conn_begin, total = roles.conn_count;
   uint32_t id = kuint32max;
 
-  if (total == 0 || total > pp->size()) {
-    total = pp->size();
-  }
-
   if (GetFlag(FLAGS_conn_use_incoming_cpu)) {
     int fd = sock->native_handle();
 
@@ -200,9 +221,26 @@ ProactorBase* Listener::PickConnectionProactor(LinuxSocketBase* sock) {
     CHECK_EQ(0, getsockopt(fd, SOL_SOCKET, SO_INCOMING_NAPI_ID, &napi_id, &len));
     VLOG(1) << "CPU/NAPI for connection " << fd << " is " << cpu << "/" << napi_id;
 
-    vector<unsigned> ids = pool()->MapCpuToThreads(cpu);
-    if (!ids.empty()) {
-      id = ids.front();
+    vector<unsigned> ids;
+    if (NumaBindEnabled()) {
+      // The threads are pinned to whole nodes, so we pick one of the threads of the node of the
+      // incoming cpu.
+      const NumaTopology& topology = NumaTopology::Get();
+      unsigned node = topology.NodeOfCpu(cpu);
+      for (unsigned i = 0; i < total; ++i) {
+        if (topology.NodeOfThread(begin + i, pp->size()) == node)
+          ids.push_back(i);
+      }
+      if (!ids.empty()) {
+        id = ids[next_id_.fetch_add(1, std::memory_order_relaxed) % ids.size()];
+      }
+    } else {
+      for (unsigned thread : pool()->MapCpuToThreads(cpu)) {
+        if (thread >= begin && thread < begin + total) {
+          id = thread - begin;
+          break;
+        }
+      }
     }
   }
 
@@ -210,7 +248,7 @@ ProactorBase* Listener::PickConnectionProactor(LinuxSocketBase* sock) {
     id = next_id_.fetch_add(1, std::memory_order_relaxed);
   }
 
-  return pp->at(id % total);
+  return pp->at(begin + id % total);
 }
 
 }  // namespace facade
@@ -21,6 +21,16 @@ class Listener : public util::ListenerInterface {
 
   std::error_code ConfigureServerSocket(int fd) final;
 
+  // Opens the listening socket with SO_REUSEPORT, so that the successor of the process can
+  // bind it as well during a live handoff. Must be set before the socket is opened.
+  void set_reuse_port(bool reuse_port) {
+    reuse_port_ = reuse_port;
+  }
+
+  // Stops accepting new connections, the accepted ones stay open. The connections that wait
+  // in the backlog are reset.
+  void StopAccepting();
+
  private:
   util::Connection* NewConnection(util::ProactorBase* proactor) final;
   util::ProactorBase* PickConnectionProactor(util::LinuxSocketBase* sock) final;
@@ -36,6 +46,8 @@ class Listener : public util::ListenerInterface {
   std::atomic_uint32_t next_id_{0};
   Protocol protocol_;
   SSL_CTX* ctx_ = nullptr;
+  bool reuse_port_ = false;
+  int listen_fd_ = -1;
 };
 
 }  // namespace facade
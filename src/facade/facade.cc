@@ -21,7 +21,7 @@ constexpr size_t kSizeConnStats = sizeof(ConnectionStats);
 
 ConnectionStats& ConnectionStats::operator+=(const ConnectionStats& o) {
   // To break this code deliberately if we add/remove a field to this struct.
-  static_assert(kSizeConnStats == 168);
+  static_assert(kSizeConnStats == 280);
 
   ADD(read_buf_capacity);
   ADD(io_read_cnt);
@@ -30,12 +30,30 @@ ConnectionStats& ConnectionStats::operator+=(const ConnectionStats& o) {
   ADD(io_write_bytes);
   ADD(command_cnt);
   ADD(pipelined_cmd_cnt);
+  ADD(squashed_cmd_cnt);
+  ADD(coalesced_read_cnt);
+  ADD(coalesced_incr_cnt);
+  ADD(pipeline_cache_hit_cnt);
+  ADD(pipeline_cache_miss_cnt);
+  ADD(pipeline_queue_len);
+  ADD(pipeline_queue_bytes);
+  ADD(pipeline_throttle_cnt);
+  ADD(json_path_cache_hits);
+  ADD(json_path_cache_misses);
   ADD(parser_err_cnt);
+  ADD(shed_cmd_cnt);
+  ADD(throttled_cmd_cnt);
+  ADD(notify_dropped_cnt);
+  ADD(output_limit_disconnects);
+  ADD(output_limit_dropped_msgs);
   ADD(async_writes_cnt);
+  ADD(num_migrations);
 
   ADD(num_conns);
   ADD(num_replicas);
   ADD(num_blocked_clients);
+  ADD(num_tls_offloaded);
+  ADD(num_shm_clients);
 
   for (const auto& k_v : o.err_count_map) {
     err_count_map[k_v.first] += k_v.second;
@@ -95,6 +113,8 @@ const char* RespExpr::TypeName(Type t) {
       return "nil";
     case ERROR:
       return "error";
+    case DOUBLE:
+      return "double";
   }
   ABSL_INTERNAL_UNREACHABLE;
 }
@@ -168,6 +188,9 @@ ostream& operator<<(ostream& os, const facade::RespExpr& e) {
     case RespExpr::ERROR:
       os << "e(" << ToSV(get<RespExpr::Buffer>(e.u)) << ")";
       break;
+    case RespExpr::DOUBLE:
+      os << "d" << get<double>(e.u);
+      break;
   }
 
   return os;
@@ -35,14 +35,34 @@ struct ConnectionStats {
   size_t io_write_bytes = 0;
   size_t command_cnt = 0;
   size_t pipelined_cmd_cnt = 0;
+  size_t squashed_cmd_cnt = 0;  // pipelined commands that ran in a squashed hop.
+  size_t coalesced_read_cnt = 0;  // reads that shared the hop of a concurrent identical read.
+  size_t coalesced_incr_cnt = 0;  // increments applied in the hop of a concurrent one.
+  size_t pipeline_cache_hit_cnt = 0;
+  size_t pipeline_cache_miss_cnt = 0;
+  size_t pipeline_queue_len = 0;  // pipelined requests queued by the connections.
+  size_t pipeline_queue_bytes = 0;
+  size_t pipeline_throttle_cnt = 0;  // times a connection stopped reading due to its queue.
+  size_t json_path_cache_hits = 0;   // lookups of compiled JSONPath expressions.
+  size_t json_path_cache_misses = 0;
   size_t parser_err_cnt = 0;
+  size_t shed_cmd_cnt = 0;  // commands rejected under overload.
+  size_t throttled_cmd_cnt = 0;  // commands delayed by the budgets of their clients.
+  size_t notify_dropped_cnt = 0;         // keyspace notifications dropped for slow subscribers.
+  size_t output_limit_disconnects = 0;   // connections closed by client_output_buffer_limit.
+  size_t output_limit_dropped_msgs = 0;  // the messages that they had queued.
 
   // Writes count that happened via SendRawMessageAsync call.
   size_t async_writes_cnt = 0;
 
+  // Connections that migrated to the thread of the shard of their keys.
+  size_t num_migrations = 0;
+
   uint32_t num_conns = 0;
   uint32_t num_replicas = 0;
   uint32_t num_blocked_clients = 0;
+  uint32_t num_tls_offloaded = 0;  // TLS connections encrypted by the kernel.
+  uint32_t num_shm_clients = 0;    // connections of the shared-memory transport.
 
   ConnectionStats& operator+=(const ConnectionStats& o);
 };
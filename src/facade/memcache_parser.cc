@@ -22,7 +22,9 @@ MP::CmdType From(string_view token) {
       {"get", MP::GET},       {"gets", MP::GETS},       {"gat", MP::GAT},
       {"gats", MP::GATS},     {"stats", MP::STATS},     {"incr", MP::INCR},
       {"decr", MP::DECR},     {"delete", MP::DELETE},   {"flush_all", MP::FLUSHALL},
-      {"quit", MP::QUIT},     {"version", MP::VERSION},
+      {"quit", MP::QUIT},     {"version", MP::VERSION}, {"mg", MP::META_GET},
+      {"ms", MP::META_SET},   {"md", MP::META_DELETE},  {"ma", MP::META_ARITHM},
+      {"mn", MP::META_NOOP},
   };
 
   auto it = cmd_map.find(token);
@@ -99,6 +101,127 @@ MP::Result ParseValueless(const std::string_view* tokens, unsigned num_tokens, M
   return MP::OK;
 }
 
+// Parses the flags of a meta command and translates it into the classic command.
+// mg <key> <flags>*
+// ms <key> <datalen> <flags>*
+// md <key> <flags>*
+// ma <key> <flags>*
+MP::Result ParseMeta(const std::string_view* tokens, unsigned num_tokens, MP::Command* res) {
+  MP::CmdType meta_type = res->type;
+  res->meta = true;
+  res->key = tokens[0];
+  if (res->key.size() > 250)
+    return MP::PARSE_ERROR;
+
+  unsigned flag_pos = 1;
+  switch (meta_type) {
+    case MP::META_GET:
+      res->type = MP::GET;
+      break;
+    case MP::META_SET:
+      if (num_tokens < 2 || !absl::SimpleAtoi(tokens[1], &res->bytes_len))
+        return MP::BAD_INT;
+      res->type = MP::SET;
+      ++flag_pos;
+      break;
+    case MP::META_DELETE:
+      res->type = MP::DELETE;
+      break;
+    case MP::META_ARITHM:
+      res->type = MP::INCR;
+      res->delta = 1;
+      break;
+    default:
+      return MP::PARSE_ERROR;
+  }
+
+  for (; flag_pos < num_tokens; ++flag_pos) {
+    string_view flag = tokens[flag_pos];
+    string_view arg = flag.substr(1);
+    char c = flag[0];
+
+    // Flags common to all the commands.
+    if (c == 'O') {
+      res->opaque = arg;
+      continue;
+    }
+
+    if (c == 'q' || c == 'k') {
+      if (!arg.empty())
+        return MP::PARSE_ERROR;
+      res->meta_flags |= (c == 'q' ? MP::META_QUIET : MP::META_RETURN_KEY);
+      continue;
+    }
+
+    switch (meta_type) {
+      case MP::META_GET: {
+        static constexpr string_view kGetFlags = "vfsc";
+        size_t pos = kGetFlags.find(c);
+        if (pos == string_view::npos || !arg.empty())
+          return MP::PARSE_ERROR;
+        static constexpr uint8_t kMask[] = {MP::META_RETURN_VALUE, MP::META_RETURN_FLAGS,
+                                            MP::META_RETURN_SIZE, MP::META_RETURN_CAS};
+        res->meta_flags |= kMask[pos];
+        break;
+      }
+      case MP::META_SET:
+        if (c == 'F') {
+          if (!absl::SimpleAtoi(arg, &res->flags))
+            return MP::BAD_INT;
+        } else if (c == 'T') {
+          if (!absl::SimpleAtoi(arg, &res->expire_ts))
+            return MP::BAD_INT;
+        } else if (c == 'M' && arg.size() == 1) {
+          switch (absl::ascii_toupper(arg[0])) {
+            case 'E':
+              res->type = MP::ADD;
+              break;
+            case 'A':
+              res->type = MP::APPEND;
+              break;
+            case 'P':
+              res->type = MP::PREPEND;
+              break;
+            case 'R':
+              res->type = MP::REPLACE;
+              break;
+            case 'S':
+              res->type = MP::SET;
+              break;
+            default:
+              return MP::PARSE_ERROR;
+          }
+        } else {
+          return MP::PARSE_ERROR;
+        }
+        break;
+      case MP::META_ARITHM:
+        if (c == 'v' && arg.empty()) {
+          res->meta_flags |= MP::META_RETURN_VALUE;
+        } else if (c == 'D') {
+          if (!absl::SimpleAtoi(arg, &res->delta))
+            return MP::BAD_DELTA;
+        } else if (c == 'M' && arg.size() == 1) {
+          char mode = absl::ascii_toupper(arg[0]);
+          if (mode == 'I' || mode == '+') {
+            res->type = MP::INCR;
+          } else if (mode == 'D' || mode == '-') {
+            res->type = MP::DECR;
+          } else {
+            return MP::PARSE_ERROR;
+          }
+        } else {
+          return MP::PARSE_ERROR;
+        }
+        break;
+      default:  // md supports only the common flags.
+        return MP::PARSE_ERROR;
+    }
+  }
+
+  return MP::OK;
+}
+
 }  // namespace
 
 auto MP::Parse(string_view str, uint32_t* consumed, Command* cmd) -> Result {
@@ -114,10 +237,11 @@ auto MP::Parse(string_view str, uint32_t* consumed, Command* cmd) -> Result {
     return PARSE_ERROR;
   }
   *consumed = pos + 1;
+  *cmd = Command{};  // the caller reuses the command object.
 
   // cas <key> <flags> <exptime> <bytes> <cas unique> [noreply]\r\n
   // get <key>*\r\n
-  string_view tokens[8];
+  string_view tokens[16];
   unsigned num_tokens = 0;
   uint32_t cur = 0;
 
@@ -153,6 +277,15 @@ auto MP::Parse(string_view str, uint32_t* consumed, Command* cmd) -> Result {
     return UNKNOWN_CMD;
   }
 
+  if (cmd->type >= META_GET) {
+    if (cmd->type == META_NOOP)
+      return num_tokens == 1 ? MP::OK : MP::PARSE_ERROR;
+    if (num_tokens == 1)
+      return MP::PARSE_ERROR;
+
+    return ParseMeta(tokens + 1, num_tokens - 1, cmd);
+  }
+
   if (cmd->type <= CAS) {  // Store command
     if (num_tokens < 5 || tokens[1].size() > 250) {
       return MP::PARSE_ERROR;
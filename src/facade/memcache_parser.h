@@ -38,6 +38,25 @@ class MemcacheParser {
     INCR = 32,
     DECR = 33,
     FLUSHALL = 34,
+
+    // Meta commands, see https://github.com/memcached/memcached/wiki/MetaCommands
+    // The parser translates mg, ms, md and ma into their classic counterparts and sets
+    // Command::meta, hence only the no-op keeps its own type.
+    META_GET = 40,
+    META_SET = 41,
+    META_DELETE = 42,
+    META_ARITHM = 43,
+    META_NOOP = 44,
+  };
+
+  // Flags of the meta commands.
+  enum MetaFlag : uint8_t {
+    META_RETURN_VALUE = 1,   // v
+    META_RETURN_KEY = 2,     // k
+    META_RETURN_FLAGS = 4,   // f
+    META_RETURN_SIZE = 8,    // s
+    META_RETURN_CAS = 0x10,  // c
+    META_QUIET = 0x20,       // q - do not reply on success and misses.
   };
 
   // According to https://github.com/memcached/memcached/wiki/Commands#standard-protocol
@@ -55,6 +74,10 @@ class MemcacheParser {
     uint32_t bytes_len = 0;
     uint32_t flags = 0;
     bool no_reply = false;
+
+    bool meta = false;
+    uint8_t meta_flags = 0;   // mask of MetaFlag values.
+    std::string_view opaque;  // O flag, echoed back in the reply.
   };
 
   enum Result {
@@ -78,4 +78,41 @@ TEST_F(MCParserTest, Stats) {
   EXPECT_EQ(MemcacheParser::PARSE_ERROR, st);
 }
 
+TEST_F(MCParserTest, Meta) {
+  MemcacheParser::Result st = parser_.Parse("mg key v f k Oab q\r\n", &consumed_, &cmd_);
+  ASSERT_EQ(MemcacheParser::OK, st);
+  EXPECT_EQ(MemcacheParser::GET, cmd_.type);
+  EXPECT_TRUE(cmd_.meta);
+  EXPECT_EQ("key", cmd_.key);
+  EXPECT_EQ("ab", cmd_.opaque);
+  EXPECT_EQ(MemcacheParser::META_RETURN_VALUE | MemcacheParser::META_RETURN_FLAGS |
+                MemcacheParser::META_RETURN_KEY | MemcacheParser::META_QUIET,
+            cmd_.meta_flags);
+
+  st = parser_.Parse("ms key 3 F5 T10 MA\r\n", &consumed_, &cmd_);
+  ASSERT_EQ(MemcacheParser::OK, st);
+  EXPECT_EQ(MemcacheParser::APPEND, cmd_.type);
+  EXPECT_EQ(3, cmd_.bytes_len);
+  EXPECT_EQ(5, cmd_.flags);
+  EXPECT_EQ(10, cmd_.expire_ts);
+  EXPECT_TRUE(cmd_.opaque.empty());
+
+  st = parser_.Parse("ma key MD D7 v\r\n", &consumed_, &cmd_);
+  ASSERT_EQ(MemcacheParser::OK, st);
+  EXPECT_EQ(MemcacheParser::DECR, cmd_.type);
+  EXPECT_EQ(7, cmd_.delta);
+
+  st = parser_.Parse("md key q\r\n", &consumed_, &cmd_);
+  ASSERT_EQ(MemcacheParser::OK, st);
+  EXPECT_EQ(MemcacheParser::DELETE, cmd_.type);
+
+  st = parser_.Parse("mn\r\n", &consumed_, &cmd_);
+  ASSERT_EQ(MemcacheParser::OK, st);
+  EXPECT_EQ(MemcacheParser::META_NOOP, cmd_.type);
+
+  EXPECT_EQ(MemcacheParser::PARSE_ERROR, parser_.Parse("mg key t\r\n", &consumed_, &cmd_));
+  EXPECT_EQ(MemcacheParser::PARSE_ERROR, parser_.Parse("md key v\r\n", &consumed_, &cmd_));
+  EXPECT_EQ(MemcacheParser::BAD_INT, parser_.Parse("ms key\r\n", &consumed_, &cmd_));
+}
+
 }  // namespace facade
@@ -0,0 +1,269 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/numa.h"
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+
+#include "base/flags.h"
+#include "base/logging.h"
+
+ABSL_FLAG(bool, numa_bind, false,
+          "If true, pins the threads to the cpus of the NUMA nodes, in contiguous blocks of "
+          "threads per node, and makes them allocate their memory on their node. The "
+          "connections are accepted on a thread of the node of their incoming cpu when "
+          "--conn_use_incoming_cpu is set");
+ABSL_FLAG(uint32_t, shard_threads, 0,
+          "If positive and smaller than the number of threads, the shards run in this many "
+          "threads that serve no connections, and the connections are served by the other "
+          "threads. 0 runs the shards in all the threads but one, together with the connections");
+ABSL_FLAG(bool, pin_threads, false,
+          "If true, pins every thread to its own cpu, the shard threads to the first cpus of the "
+          "process and the connection threads to the next ones. Ignored with --numa_bind");
+
+ABSL_DECLARE_FLAG(uint32_t, conn_threads);
+
+namespace facade {
+
+using namespace std;
+
+namespace {
+
+constexpr char kNodeDir[] = "/sys/devices/system/node/";
+
+bool ReadLine(const string& path, string* line) {
+  ifstream is(path);
+  return bool(getline(is, *line));
+}
+
+vector<NumaTopology::Node> DetectNodes() {
+  vector<NumaTopology::Node> nodes;
+  string line;
+
+  if (ReadLine(string(kNodeDir) + "online", &line)) {
+    for (unsigned id : NumaTopology::ParseCpuList(line)) {
+      string cpulist;
+      if (!ReadLine(absl::StrCat(kNodeDir, "node", id, "/cpulist"), &cpulist))
+        continue;
+      nodes.push_back(NumaTopology::Node{id, NumaTopology::ParseCpuList(cpulist)});
+    }
+  }
+
+  if (nodes.empty()) {
+    NumaTopology::Node node{0, {}};
+    long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    for (long i = 0; i < num_cpus; ++i)
+      node.cpus.push_back(i);
+    nodes.push_back(move(node));
+  }
+
+  return nodes;
+}
+
+// Reads a counter of /sys/devices/system/node/node<id>/numastat.
+uint64_t ReadNumaStat(unsigned id, string_view name) {
+  ifstream is(absl::StrCat(kNodeDir, "node", id, "/numastat"));
+  string key;
+  uint64_t val;
+  while (is >> key >> val) {
+    if (key == name)
+      return val;
+  }
+  return 0;
+}
+
+}  // namespace
+
+NumaTopology::NumaTopology(vector<Node> nodes) : nodes_(move(nodes)) {
+  CHECK(!nodes_.empty());
+
+  for (unsigned i = 0; i < nodes_.size(); ++i) {
+    for (unsigned cpu : nodes_[i].cpus) {
+      if (cpu >= cpu_node_.size())
+        cpu_node_.resize(cpu + 1, 0);
+      cpu_node_[cpu] = i;
+    }
+  }
+}
+
+const NumaTopology& NumaTopology::Get() {
+  static NumaTopology topology(DetectNodes());
+  return topology;
+}
+
+unsigned NumaTopology::NodeOfCpu(unsigned cpu) const {
+  return cpu < cpu_node_.size() ? cpu_node_[cpu] : 0;
+}
+
+vector<unsigned> NumaTopology::ParseCpuList(string_view list) {
+  vector<unsigned> res;
+
+  for (string_view range : absl::StrSplit(list, ',', absl::SkipWhitespace())) {
+    range = absl::StripAsciiWhitespace(range);
+    pair<string_view, string_view> bounds = absl::StrSplit(range, absl::MaxSplits('-', 1));
+    unsigned start, end;
+    if (!absl::SimpleAtoi(bounds.first, &start))
+      continue;
+    if (bounds.second.empty()) {
+      end = start;
+    } else if (!absl::SimpleAtoi(bounds.second, &end) || end < start) {
+      continue;
+    }
+
+    for (unsigned i = start; i <= end; ++i)
+      res.push_back(i);
+  }
+
+  return res;
+}
+
+bool NumaBindEnabled() {
+  return absl::GetFlag(FLAGS_numa_bind) && NumaTopology::Get().num_nodes() > 1;
+}
+
+bool BindThreadToNode(unsigned node) {
+  const NumaTopology::Node& info = NumaTopology::Get().node(node);
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for (unsigned cpu : info.cpus)
+    CPU_SET(cpu, &cpus);
+
+  if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+    LOG(WARNING) << "Could not pin the thread to node " << info.id << ": " << strerror(errno);
+    return false;
+  }
+
+  // Preferred rather than bound, so that the allocations fall back to the other nodes when the
+  // local one is full instead of failing.
+  unsigned long mask[16] = {0};
+  constexpr unsigned kBits = sizeof(unsigned long) * 8;
+  if (info.id >= sizeof(mask) * 8)
+    return false;
+  mask[info.id / kBits] = 1UL << (info.id % kBits);
+
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8) != 0) {
+    LOG(WARNING) << "Could not set the memory policy of node " << info.id << ": "
+                 << strerror(errno);
+    return false;
+  }
+
+  return true;
+}
+
+void AddNumaMapsLine(string_view line, const NumaTopology& topology, vector<size_t>* node_bytes) {
+  size_t page_size = 4096;
+  vector<pair<unsigned, size_t>> pages;
+
+  for (string_view token : absl::StrSplit(line, ' ', absl::SkipEmpty())) {
+    pair<string_view, string_view> kv = absl::StrSplit(token, absl::MaxSplits('=', 1));
+    if (kv.first == "kernelpagesize_kB") {
+      size_t kb;
+      if (absl::SimpleAtoi(kv.second, &kb))
+        page_size = kb * 1024;
+      continue;
+    }
+
+    unsigned id;
+    size_t count;
+    if (kv.first.size() > 1 && kv.first[0] == 'N' && absl::SimpleAtoi(kv.first.substr(1), &id) &&
+        absl::SimpleAtoi(kv.second, &count)) {
+      pages.emplace_back(id, count);
+    }
+  }
+
+  node_bytes->resize(topology.num_nodes(), 0);
+  for (const auto& [id, count] : pages) {
+    for (unsigned i = 0; i < topology.num_nodes(); ++i) {
+      if (topology.node(i).id == id) {
+        (*node_bytes)[i] += count * page_size;
+        break;
+      }
+    }
+  }
+}
+
+ThreadRoles ThreadRoles::Get(unsigned num_threads) {
+  return Make(num_threads, absl::GetFlag(FLAGS_shard_threads), absl::GetFlag(FLAGS_conn_threads));
+}
+
+ThreadRoles ThreadRoles::Make(unsigned num_threads, unsigned shard_threads,
+                              unsigned conn_threads) {
+  ThreadRoles res;
+  if (shard_threads > 0 && shard_threads < num_threads) {
+    res.num_shards = shard_threads;
+    res.conn_begin = shard_threads;
+  } else {
+    res.num_shards = num_threads > 1 ? num_threads - 1 : num_threads;
+    res.conn_begin = 0;
+  }
+
+  unsigned avail = num_threads - res.conn_begin;
+  res.conn_count = (conn_threads == 0 || conn_threads > avail) ? avail : conn_threads;
+  return res;
+}
+
+bool PinThreadsEnabled() {
+  return absl::GetFlag(FLAGS_pin_threads) && !NumaBindEnabled();
+}
+
+bool PinThreadToCpu(unsigned index) {
+  // The cpus of the process, read before any thread pins itself.
+  static const vector<unsigned> cpus = [] {
+    vector<unsigned> res;
+    cpu_set_t mask;
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+      for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &mask))
+          res.push_back(cpu);
+      }
+    }
+    return res;
+  }();
+
+  if (cpus.empty())
+    return false;
+
+  unsigned cpu = cpus[index % cpus.size()];
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  CPU_SET(cpu, &mask);
+  if (sched_setaffinity(0, sizeof(mask), &mask) != 0) {
+    LOG(WARNING) << "Could not pin the thread to cpu " << cpu << ": " << strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+NumaStats GetNumaStats() {
+  const NumaTopology& topology = NumaTopology::Get();
+  NumaStats stats;
+  stats.node_bytes.resize(topology.num_nodes(), 0);
+
+  ifstream is("/proc/self/numa_maps");
+  string line;
+  while (getline(is, line)) {
+    AddNumaMapsLine(line, topology, &stats.node_bytes);
+  }
+
+  for (unsigned i = 0; i < topology.num_nodes(); ++i) {
+    unsigned id = topology.node(i).id;
+    stats.local_allocs += ReadNumaStat(id, "local_node");
+    stats.remote_allocs += ReadNumaStat(id, "other_node");
+  }
+
+  return stats;
+}
+
+}  // namespace facade
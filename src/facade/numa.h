@@ -0,0 +1,102 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace facade {
+
+// The NUMA nodes of the host and their cpus. The nodes are indexed from 0 in the order of their
+// ids, which are not necessarily contiguous.
+class NumaTopology {
+ public:
+  struct Node {
+    unsigned id;
+    std::vector<unsigned> cpus;
+  };
+
+  // Detected once from /sys/devices/system/node. A host without NUMA support has a single node
+  // with all the cpus.
+  static const NumaTopology& Get();
+
+  explicit NumaTopology(std::vector<Node> nodes);
+
+  unsigned num_nodes() const {
+    return nodes_.size();
+  }
+
+  const Node& node(unsigned index) const {
+    return nodes_[index];
+  }
+
+  // Returns the index of the node of the cpu, 0 for unknown cpus.
+  unsigned NodeOfCpu(unsigned cpu) const;
+
+  // The threads of a pool are assigned to the nodes in contiguous blocks of the same size, so
+  // that --numa_bind places them the same way on every start.
+  unsigned NodeOfThread(unsigned index, unsigned num_threads) const {
+    return uint64_t(index) * nodes_.size() / num_threads;
+  }
+
+  // Parses a cpulist of sysfs, i.e. "0-3,8-11".
+  static std::vector<unsigned> ParseCpuList(std::string_view list);
+
+ private:
+  std::vector<Node> nodes_;
+  std::vector<unsigned> cpu_node_;  // indexed by cpu.
+};
+
+// Whether --numa_bind is set and the host has more than one node.
+bool NumaBindEnabled();
+
+// Pins the calling thread to the cpus of the node, and makes the kernel place the pages that it
+// touches first, i.e. those of its mimalloc heap, on that node. Returns false on failure.
+bool BindThreadToNode(unsigned node);
+
+// The roles of the threads of the pool, from --shard_threads and --conn_threads. The shards run
+// in the threads [0, num_shards) and the connections in [conn_begin, conn_begin + conn_count).
+struct ThreadRoles {
+  unsigned num_shards;
+  unsigned conn_begin;
+  unsigned conn_count;
+
+  static ThreadRoles Get(unsigned num_threads);
+  static ThreadRoles Make(unsigned num_threads, unsigned shard_threads, unsigned conn_threads);
+
+  // Whether the shard threads run no connections.
+  bool dedicated() const {
+    return conn_begin > 0;
+  }
+};
+
+// Whether --pin_threads is set and --numa_bind is not.
+bool PinThreadsEnabled();
+
+// Pins the calling thread to the cpu of the index, in the order of the cpus the process may run
+// on. Hence the shard threads take the first cpus and the connection threads the next ones.
+bool PinThreadToCpu(unsigned index);
+
+struct NumaStats {
+  // The resident memory of this process on every node.
+  std::vector<size_t> node_bytes;
+
+  // The allocations of the whole host that were placed on the node of the allocating thread, or
+  // on another one, from numastat.
+  uint64_t local_allocs = 0;
+  uint64_t remote_allocs = 0;
+};
+
+// A bit heavy, it reads /proc/self/numa_maps.
+NumaStats GetNumaStats();
+
+// Adds the resident bytes of the nodes listed in a line of /proc/self/numa_maps, i.e.
+// "7f2c... default anon=12 dirty=12 N0=8 N1=4 kernelpagesize_kB=4".
+void AddNumaMapsLine(std::string_view line, const NumaTopology& topology,
+                     std::vector<size_t>* node_bytes);
+
+}  // namespace facade
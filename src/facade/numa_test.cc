@@ -0,0 +1,88 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/numa.h"
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace testing;
+using namespace std;
+
+namespace facade {
+
+class NumaTest : public testing::Test {
+ protected:
+  // Two nodes, with the ids 0 and 2 as on hosts with an offline node.
+  NumaTest() : topology_({{0, {0, 1, 4, 5}}, {2, {2, 3, 6, 7}}}) {
+  }
+
+  NumaTopology topology_;
+};
+
+TEST_F(NumaTest, ParseCpuList) {
+  EXPECT_THAT(NumaTopology::ParseCpuList("0-3,8-9"), ElementsAre(0, 1, 2, 3, 8, 9));
+  EXPECT_THAT(NumaTopology::ParseCpuList("5\n"), ElementsAre(5));
+  EXPECT_THAT(NumaTopology::ParseCpuList(""), IsEmpty());
+  EXPECT_THAT(NumaTopology::ParseCpuList("3-1,x,7"), ElementsAre(7));
+}
+
+TEST_F(NumaTest, Topology) {
+  ASSERT_EQ(2, topology_.num_nodes());
+  EXPECT_EQ(0, topology_.NodeOfCpu(4));
+  EXPECT_EQ(1, topology_.NodeOfCpu(6));
+  EXPECT_EQ(0, topology_.NodeOfCpu(100));
+
+  vector<unsigned> nodes;
+  for (unsigned i = 0; i < 5; ++i)
+    nodes.push_back(topology_.NodeOfThread(i, 5));
+  EXPECT_THAT(nodes, ElementsAre(0, 0, 0, 1, 1));
+
+  const NumaTopology& host = NumaTopology::Get();
+  ASSERT_GE(host.num_nodes(), 1);
+  EXPECT_FALSE(host.node(0).cpus.empty());
+  EXPECT_EQ(host.num_nodes(), GetNumaStats().node_bytes.size());
+}
+
+TEST_F(NumaTest, NumaMaps) {
+  vector<size_t> bytes;
+  AddNumaMapsLine("7f2c0000 default anon=12 dirty=12 N0=8 N2=4 kernelpagesize_kB=4", topology_,
+                  &bytes);
+  AddNumaMapsLine("7f2d0000 default file=/lib/libc.so mapped=1 N2=1 kernelpagesize_kB=2048",
+                  topology_, &bytes);
+  AddNumaMapsLine("7f2e0000 default", topology_, &bytes);
+  EXPECT_THAT(bytes, ElementsAre(8 * 4096, 4 * 4096 + (2048 << 10)));
+}
+
+TEST_F(NumaTest, ThreadRoles) {
+  ThreadRoles roles = ThreadRoles::Make(8, 0, 0);
+  EXPECT_FALSE(roles.dedicated());
+  EXPECT_EQ(7, roles.num_shards);
+  EXPECT_EQ(8, roles.conn_count);
+
+  roles = ThreadRoles::Make(8, 0, 2);
+  EXPECT_EQ(0, roles.conn_begin);
+  EXPECT_EQ(2, roles.conn_count);
+
+  roles = ThreadRoles::Make(8, 6, 0);
+  EXPECT_TRUE(roles.dedicated());
+  EXPECT_EQ(6, roles.num_shards);
+  EXPECT_EQ(6, roles.conn_begin);
+  EXPECT_EQ(2, roles.conn_count);
+
+  roles = ThreadRoles::Make(8, 5, 2);
+  EXPECT_EQ(5, roles.conn_begin);
+  EXPECT_EQ(2, roles.conn_count);
+
+  // No thread would be left for the connections.
+  roles = ThreadRoles::Make(4, 4, 0);
+  EXPECT_FALSE(roles.dedicated());
+  EXPECT_EQ(3, roles.num_shards);
+
+  roles = ThreadRoles::Make(1, 0, 0);
+  EXPECT_EQ(1, roles.num_shards);
+  EXPECT_EQ(1, roles.conn_count);
+}
+
+}  // namespace facade
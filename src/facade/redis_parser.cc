@@ -16,6 +16,16 @@ namespace {
 constexpr int kMaxArrayLen = 65536;
 constexpr int64_t kMaxBulkLen = 64 * (1ul << 20);  // 64MB.
 
+// RESP3 map, set and push types. Maps are parsed as flat arrays of their keys and values.
+bool IsResp3Aggregate(uint8_t c) {
+  return c == '%' || c == '~' || c == '>';
+}
+
+// RESP3 double, boolean, null and big number types.
+bool IsResp3Simple(uint8_t c) {
+  return c == ',' || c == '#' || c == '_' || c == '(';
+}
+
 }  // namespace
 
 auto RedisParser::Parse(Buffer str, uint32_t* consumed, RespExpr::Vec* res) -> Result {
@@ -44,7 +54,7 @@ auto RedisParser::Parse(Buffer str, uint32_t* consumed, RespExpr::Vec* res) -> R
         last_result_ = ConsumeArrayLen(str);
         break;
       case PARSE_ARG_S:
-        if (str.size() < 4) {
+        if (str.size() < 4 && (str.size() < 3 || str[0] != '_')) {  // RESP3 null is "_\r\n".
           last_result_ = INPUT_PENDING;
         } else {
           last_result_ = ParseArg(str);
@@ -86,6 +96,17 @@ auto RedisParser::Parse(Buffer str, uint32_t* consumed, RespExpr::Vec* res) -> R
   return last_result_;
 }
 
+bool RedisParser::ReleaseMemory() {
+  if (state_ != INIT_S && state_ != CMD_COMPLETE_S)
+    return false;
+
+  decltype(buf_stash_){}.swap(buf_stash_);
+  decltype(stash_){}.swap(stash_);
+  parse_stack_.clear();
+  cached_expr_ = nullptr;
+  return true;
+}
+
 void RedisParser::InitStart(uint8_t prefix_b, RespExpr::Vec* res) {
   buf_stash_.clear();
   stash_.clear();
@@ -106,7 +127,14 @@ void RedisParser::InitStart(uint8_t prefix_b, RespExpr::Vec* res) {
       state_ = ARRAY_LEN_S;
       break;
     default:
-      state_ = INLINE_S;
+      if (!server_mode_ && IsResp3Simple(prefix_b)) {
+        state_ = PARSE_ARG_S;
+        parse_stack_.emplace_back(1, cached_expr_);
+      } else if (!server_mode_ && IsResp3Aggregate(prefix_b)) {
+        state_ = ARRAY_LEN_S;
+      } else {
+        state_ = INLINE_S;
+      }
       break;
   }
 }
@@ -209,6 +237,23 @@ auto RedisParser::ParseNum(Buffer str, int64_t* res) -> Result {
     return INPUT_PENDING;
   }
 
+  // Fast path for the common case of a short non-negative length that is followed by CRLF:
+  // the digits are parsed on the way to the delimiter. Lengths of up to 18 digits can not
+  // overflow. Everything else goes through the generic path below.
+  const uint8_t* digits = str.data() + 1;
+  const uint8_t* digits_end = digits + std::min<size_t>(str.size() - 1, 18);
+  const uint8_t* p = digits;
+  uint64_t val = 0;
+  while (p != digits_end && unsigned(*p - '0') < 10) {
+    val = val * 10 + (*p - '0');
+    ++p;
+  }
+  if (p != digits && p + 1 < str.end() && p[0] == '\r' && p[1] == '\n') {
+    *res = val;
+    last_consumed_ = (p - str.data()) + 2;
+    return OK;
+  }
+
   char* s = reinterpret_cast<char*>(str.data() + 1);
   char* pos = reinterpret_cast<char*>(memchr(s, '\n', str.size() - 1));
   if (!pos) {
@@ -250,6 +295,9 @@ auto RedisParser::ConsumeArrayLen(Buffer str) -> Result {
   if (server_mode_ && (parse_stack_.size() > 0 || !cached_expr_->empty()))
     return BAD_STRING;
 
+  if (str[0] == '%' && len > 0)
+    len *= 2;
+
   if (len <= 0) {
     cached_expr_->emplace_back(len == -1 ? RespExpr::NIL_ARRAY : RespExpr::ARRAY);
     if (len < 0)
@@ -312,6 +360,16 @@ auto RedisParser::ParseArg(Buffer str) -> Result {
     }
     cached_expr_->back().u = Buffer{};
 
+    // If the whole bulk string is in the buffer, consume it right away instead of
+    // going through another iteration of the state machine.
+    if (state_ == BULK_STR_S && str.size() >= last_consumed_ + bulk_len_ + 2) {
+      DCHECK(!is_broken_token_);
+      uint32_t header_len = last_consumed_;
+      res = ConsumeBulk(str.subspan(header_len));
+      last_consumed_ += header_len;
+      return res;
+    }
+
     return OK;
   }
 
@@ -319,14 +377,14 @@ auto RedisParser::ParseArg(Buffer str) -> Result {
     return BAD_BULKLEN;
   }
 
-  if (c == '*') {
+  if (c == '*' || IsResp3Aggregate(c)) {
     return ConsumeArrayLen(str);
   }
 
   char* s = reinterpret_cast<char*>(str.data() + 1);
   char* eol = reinterpret_cast<char*>(memchr(s, '\n', str.size() - 1));
 
-  if (c == '+' || c == '-') {  // Simple string or error.
+  if (c == '+' || c == '-' || c == '(') {  // Simple string, error or big number.
     DCHECK(!server_mode_);
     if (!eol) {
       return str.size() < 256 ? INPUT_PENDING : BAD_STRING;
@@ -334,8 +392,33 @@ auto RedisParser::ParseArg(Buffer str) -> Result {
     if (eol[-1] != '\r')
       return BAD_STRING;
 
-    cached_expr_->emplace_back(c == '+' ? RespExpr::STRING : RespExpr::ERROR);
+    cached_expr_->emplace_back(c == '-' ? RespExpr::ERROR : RespExpr::STRING);
     cached_expr_->back().u = Buffer{reinterpret_cast<uint8_t*>(s), size_t((eol - 1) - s)};
+  } else if (c == ',' || c == '#' || c == '_') {
+    if (!eol) {
+      return str.size() < 64 ? INPUT_PENDING : BAD_STRING;
+    }
+    std::string_view tok{s, size_t((eol - s) - 1)};
+    if (eol[-1] != '\r')
+      return BAD_STRING;
+
+    if (c == ',') {
+      double dval;
+      if (!absl::SimpleAtod(tok, &dval))
+        return BAD_STRING;
+      cached_expr_->emplace_back(RespExpr::DOUBLE);
+      cached_expr_->back().u = dval;
+    } else if (c == '#') {
+      if (tok != "t" && tok != "f")
+        return BAD_STRING;
+      cached_expr_->emplace_back(RespExpr::INT64);
+      cached_expr_->back().u = int64_t(tok == "t");
+    } else {
+      if (!tok.empty())
+        return BAD_STRING;
+      cached_expr_->emplace_back(RespExpr::NIL);
+      cached_expr_->back().u = Buffer{};
+    }
   } else if (c == ':') {
     DCHECK(!server_mode_);
     if (!eol) {
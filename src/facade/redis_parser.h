@@ -54,6 +54,10 @@ class RedisParser {
     return stash_;
   }
 
+  // Frees the stash of the last request, which is otherwise kept until the next request starts.
+  // Returns false and keeps it if a request is partially parsed.
+  bool ReleaseMemory();
+
  private:
   void InitStart(uint8_t prefix_b, RespVec* res);
   void StashState(RespVec* res);
@@ -0,0 +1,181 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include <benchmark/benchmark.h>
+#include <mimalloc.h>
+
+#include <absl/strings/str_cat.h>
+
+#include <new>
+
+#include "base/init.h"
+#include "base/logging.h"
+#include "facade/redis_parser.h"
+
+// Runs google benchmarks for RedisParser. For example:
+//   ./redis_parser_bench --benchmark_filter=BM_ParseMixed --benchmark_counters_tabular=true
+// Use --benchmark_format=json or --benchmark_out=<file> to get results that can be diffed.
+// operator new is served by mimalloc, as in dragonfly, and counts the allocations for
+// "allocs_per_cmd".
+
+using namespace std;
+
+namespace {
+
+uint64_t num_allocs = 0;
+
+}  // namespace
+
+void* operator new(size_t size) {
+  ++num_allocs;
+  void* res = mi_malloc(size);
+  if (!res)
+    throw std::bad_alloc{};
+  return res;
+}
+
+void operator delete(void* ptr) noexcept {
+  mi_free(ptr);
+}
+
+void operator delete(void* ptr, size_t size) noexcept {
+  mi_free(ptr);
+}
+
+namespace facade {
+
+namespace {
+
+void AppendCommand(initializer_list<string_view> args, string* dest) {
+  absl::StrAppend(dest, "*", args.size(), "\r\n");
+  for (string_view arg : args)
+    absl::StrAppend(dest, "$", arg.size(), "\r\n", arg, "\r\n");
+}
+
+// Parses all the commands of buf, reading at most read_size bytes at a time as the connection
+// does. Returns the number of commands.
+size_t ParseAll(string_view buf, size_t read_size, RedisParser* parser, RespExpr::Vec* args) {
+  uint8_t* data = reinterpret_cast<uint8_t*>(const_cast<char*>(buf.data()));
+  size_t pos = 0, end = 0, cmds = 0;
+  uint32_t consumed;
+  bool pending = false;
+
+  while (pos < buf.size()) {
+    if (pending || pos == end) {
+      CHECK_LT(end, buf.size());
+      end = min(buf.size(), end + read_size);
+    }
+
+    RedisParser::Result res = parser->Parse({data + pos, end - pos}, &consumed, args);
+    pos += consumed;
+    pending = (res == RedisParser::INPUT_PENDING);
+    if (!pending) {
+      CHECK_EQ(RedisParser::OK, res);
+      ++cmds;
+    }
+  }
+  return cmds;
+}
+
+void SetAllocCounter(uint64_t start, size_t cmds, benchmark::State* state) {
+  state->counters["allocs_per_cmd"] = double(num_allocs - start) / (state->iterations() * cmds);
+}
+
+}  // namespace
+
+// Parses a pipeline of SET commands with values of the given size.
+static void BM_ParsePipeline(benchmark::State& state) {
+  string val(state.range(0), 'x');
+  string pipeline;
+  for (unsigned i = 0; i < 100; ++i) {
+    AppendCommand({"SET", absl::StrCat("key:", i), val}, &pipeline);
+  }
+
+  RedisParser parser;
+  RespExpr::Vec args;
+  uint64_t start = num_allocs;
+  for (auto _ : state) {
+    CHECK_EQ(100u, ParseAll(pipeline, pipeline.size(), &parser, &args));
+  }
+  state.SetBytesProcessed(state.iterations() * pipeline.size());
+  SetAllocCounter(start, 100, &state);
+}
+BENCHMARK(BM_ParsePipeline)->Arg(8)->Arg(64)->Arg(1024);
+
+// A pipeline of the commands a cache usually gets, read in 16KB as the connection does.
+static void BM_ParseMixedPipeline(benchmark::State& state) {
+  string val(64, 'v');
+  string pipeline;
+  size_t cmds = 0;
+  for (unsigned i = 0; i < 1000; ++i, ++cmds) {
+    string key = absl::StrCat("user:", 100000 + i * 7919 % 100000);
+    switch (i % 8) {
+      case 0:
+      case 1:
+      case 2:
+        AppendCommand({"GET", key}, &pipeline);
+        break;
+      case 3:
+        AppendCommand({"SET", key, val, "EX", "3600"}, &pipeline);
+        break;
+      case 4: {
+        vector<string> keys;
+        for (unsigned j = 0; j < 10; ++j)
+          keys.push_back(absl::StrCat(key, ":", j));
+        AppendCommand({"MGET", keys[0], keys[1], keys[2], keys[3], keys[4], keys[5], keys[6],
+                       keys[7], keys[8], keys[9]},
+                      &pipeline);
+        break;
+      }
+      case 5:
+        AppendCommand({"HSET", key, "name", "dragonfly", "visits", "17", "last", val}, &pipeline);
+        break;
+      case 6:
+        AppendCommand({"INCR", absl::StrCat("counter:", i % 16)}, &pipeline);
+        break;
+      case 7:
+        AppendCommand({"EXPIRE", key, "60"}, &pipeline);
+        break;
+    }
+  }
+
+  RedisParser parser;
+  RespExpr::Vec args;
+  uint64_t start = num_allocs;
+  for (auto _ : state) {
+    CHECK_EQ(cmds, ParseAll(pipeline, 1 << 14, &parser, &args));
+  }
+  state.SetBytesProcessed(state.iterations() * pipeline.size());
+  state.SetItemsProcessed(state.iterations() * cmds);
+  SetAllocCounter(start, cmds, &state);
+}
+BENCHMARK(BM_ParseMixedPipeline);
+
+// A value that spans many reads of 16KB, hence is accumulated by the parser between them.
+static void BM_ParseLargeBulk(benchmark::State& state) {
+  string request;
+  AppendCommand({"SET", "blob:1", string(state.range(0), 'b')}, &request);
+
+  RedisParser parser;
+  RespExpr::Vec args;
+  uint64_t start = num_allocs;
+  for (auto _ : state) {
+    CHECK_EQ(1u, ParseAll(request, 1 << 14, &parser, &args));
+  }
+  state.SetBytesProcessed(state.iterations() * request.size());
+  SetAllocCounter(start, 1, &state);
+}
+BENCHMARK(BM_ParseLargeBulk)->Arg(1 << 16)->Arg(1 << 20);
+
+}  // namespace facade
+
+int main(int argc, char* argv[]) {
+  // Consumes --benchmark_xxx flags before absl flags are parsed.
+  benchmark::Initialize(&argc, argv);
+  MainInitGuard guard(&argc, &argv);
+
+  benchmark::RunSpecifiedBenchmarks();
+
+  return 0;
+}
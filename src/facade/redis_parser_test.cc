@@ -146,6 +146,31 @@ TEST_F(RedisParserTest, ClientMode) {
   EXPECT_THAT(args_, ElementsAre(ErrArg("ERR foo")));
 }
 
+TEST_F(RedisParserTest, Resp3) {
+  parser_.SetClientMode();
+
+  ASSERT_EQ(RedisParser::OK, Parse("_\r\n"));
+  EXPECT_THAT(args_, ElementsAre(ArgType(RespExpr::NIL)));
+
+  ASSERT_EQ(RedisParser::OK, Parse(",1.5\r\n"));
+  ASSERT_THAT(args_, ElementsAre(ArgType(RespExpr::DOUBLE)));
+  EXPECT_EQ(1.5, get<double>(args_[0].u));
+
+  ASSERT_EQ(RedisParser::OK, Parse("#t\r\n"));
+  EXPECT_THAT(args_, ElementsAre(IntArg(1)));
+
+  ASSERT_EQ(RedisParser::OK, Parse("(12345678901234567890\r\n"));
+  EXPECT_THAT(args_, ElementsAre("12345678901234567890"));
+
+  // Maps are flattened into their keys and values.
+  ASSERT_EQ(RedisParser::OK, Parse("%2\r\n$1\r\na\r\n:1\r\n$1\r\nb\r\n~1\r\n#f\r\n"));
+  ASSERT_THAT(args_, ElementsAre("a", IntArg(1), "b", ArrLen(1)));
+  EXPECT_THAT(args_[3].GetVec(), ElementsAre(IntArg(0)));
+
+  ASSERT_EQ(RedisParser::OK, Parse(">3\r\n$7\r\nmessage\r\n$2\r\nch\r\n$3\r\nmsg\r\n"));
+  EXPECT_THAT(args_, ElementsAre("message", "ch", "msg"));
+}
+
 TEST_F(RedisParserTest, Hierarchy) {
   parser_.SetClientMode();
 
@@ -159,6 +184,22 @@ TEST_F(RedisParserTest, Hierarchy) {
   ASSERT_THAT(args_, ElementsAre(ArrLen(1), ArrLen(1)));
 }
 
+TEST_F(RedisParserTest, Pipeline) {
+  string_view kCmds = "*2\r\n$3\r\nGET\r\n$1\r\na\r\n*3\r\n$3\r\nSET\r\n$1\r\nb\r\n$0\r\n\r\n";
+  ASSERT_EQ(RedisParser::OK, Parse(kCmds));
+  EXPECT_EQ(20, consumed_);
+  EXPECT_THAT(args_, ElementsAre("GET", "a"));
+
+  ASSERT_EQ(RedisParser::OK, Parse(kCmds.substr(consumed_)));
+  EXPECT_EQ(kCmds.size() - 20, consumed_);
+  EXPECT_THAT(args_, ElementsAre("SET", "b", ""));
+
+  // Lengths that do not fit the fast path.
+  ASSERT_EQ(RedisParser::OK, Parse("*+1\r\n$0000000000000000003\r\nfoo\r\n"));
+  EXPECT_THAT(args_, ElementsAre("foo"));
+  ASSERT_EQ(RedisParser::BAD_ARRAYLEN, Parse("*1\r\n$99999999999999999999\r\n"));
+}
+
 TEST_F(RedisParserTest, InvalidMult1) {
   ASSERT_EQ(RedisParser::BAD_BULKLEN, Parse("*2\r\n$3\r\nFOO\r\nBAR\r\n"));
 }
@@ -191,4 +232,19 @@ TEST_F(RedisParserTest, LargeBulk) {
   ASSERT_EQ(RedisParser::OK, Parse("\r\n"));
 }
 
+TEST_F(RedisParserTest, ReleaseMemory) {
+  ASSERT_EQ(RedisParser::INPUT_PENDING, Parse("*2\r\n$3\r\nGET\r\n$3\r\n"));
+  EXPECT_FALSE(parser_.ReleaseMemory());
+  EXPECT_GT(parser_.stash_size(), 0u);
+
+  ASSERT_EQ(RedisParser::OK, Parse("key\r\n"));
+  EXPECT_THAT(args_, ElementsAre("GET", "key"));
+  EXPECT_TRUE(parser_.ReleaseMemory());
+  EXPECT_EQ(0u, parser_.stash_size());
+
+  ASSERT_EQ(RedisParser::OK, Parse("*1\r\n$4\r\nPING\r\n"));
+  EXPECT_THAT(args_, ElementsAre("PING"));
+  EXPECT_TRUE(parser_.ReleaseMemory());
+}
+
 }  // namespace facade
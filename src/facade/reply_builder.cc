@@ -4,6 +4,7 @@
 #include "facade/reply_builder.h"
 
 #include <absl/container/fixed_array.h>
+#include <absl/container/inlined_vector.h>
 #include <absl/strings/numbers.h>
 #include <absl/strings/str_cat.h>
 #include <double-conversion/double-to-string.h>
@@ -27,6 +28,16 @@ inline iovec constexpr IoVec(std::string_view s) {
 constexpr char kCRLF[] = "\r\n";
 constexpr char kErrPref[] = "-ERR ";
 constexpr char kSimplePref[] = "+";
+constexpr char kResp3Null[] = "_\r\n";
+
+// Indexed by RedisReplyBuilder::CollectionType.
+constexpr char kCollectionPrefix[] = "*~%>";
+
+// Replies of at least this size are not copied into the batch buffer.
+constexpr size_t kMaxBatchCopyLen = 4096;
+
+// The batch is flushed before it grows beyond this size.
+constexpr size_t kMaxBatchLen = 1 << 16;
 
 constexpr unsigned kConvFlags =
     DoubleToStringConverter::UNIQUE_ZERO | DoubleToStringConverter::EMIT_POSITIVE_EXPONENT_SIGN;
@@ -46,8 +57,14 @@ void SinkReplyBuilder::CloseConnection() {
 void SinkReplyBuilder::Send(const iovec* v, uint32_t len) {
   DCHECK(sink_);
 
-  if (should_batch_) {
-    // TODO: to introduce flushing when too much data is batched.
+  size_t total = 0;
+  for (unsigned i = 0; i < len; ++i) {
+    total += v[i].iov_len;
+  }
+
+  // Large payloads are not copied into the batch. They are written from the memory of the
+  // caller, together with the batched replies that precede them.
+  if (should_batch_ && total < kMaxBatchCopyLen && batch_.size() + total <= kMaxBatchLen) {
     for (unsigned i = 0; i < len; ++i) {
       std::string_view src((char*)v[i].iov_base, v[i].iov_len);
       DVLOG(2) << "Appending to stream " << sink_ << " " << src;
@@ -58,10 +75,7 @@ void SinkReplyBuilder::Send(const iovec* v, uint32_t len) {
 
   error_code ec;
   ++io_write_cnt_;
-
-  for (unsigned i = 0; i < len; ++i) {
-    io_write_bytes_ += v[i].iov_len;
-  }
+  io_write_bytes_ += total;
 
   if (batch_.empty()) {
     ec = sink_->Write(v, len);
@@ -83,6 +97,23 @@ void SinkReplyBuilder::Send(const iovec* v, uint32_t len) {
   }
 }
 
+void SinkReplyBuilder::FlushBatch() {
+  if (batch_.empty())
+    return;
+
+  DVLOG(1) << "Flushing batch to stream " << sink_ << "\n" << batch_;
+
+  ++io_write_cnt_;
+  io_write_bytes_ += batch_.size();
+  iovec v = {IoVec(batch_)};
+  error_code ec = sink_->Write(&v, 1);
+  batch_.clear();
+
+  if (ec) {
+    ec_ = ec;
+  }
+}
+
 void SinkReplyBuilder::SendRaw(std::string_view raw) {
   iovec v = {IoVec(raw)};
 
@@ -99,6 +130,32 @@ void SinkReplyBuilder::SendRawVec(absl::Span<const std::string_view> msg_vec) {
   Send(arr.data(), msg_vec.size());
 }
 
+void SinkReplyBuilder::AppendValue(std::string_view value, std::string* buf,
+                                   LargeValues* large) {
+  if (value.size() >= kMaxBatchCopyLen) {
+    large->emplace_back(buf->size(), value);
+  } else {
+    buf->append(value);
+  }
+}
+
+void SinkReplyBuilder::SendWithValues(std::string_view buf, const LargeValues& large) {
+  if (large.empty())
+    return SendRaw(buf);
+
+  absl::FixedArray<iovec, 16> v(large.size() * 2 + 1);
+  size_t start = 0;
+  unsigned index = 0;
+  for (const auto& [offset, val] : large) {
+    v[index++] = IoVec(buf.substr(start, offset - start));
+    v[index++] = IoVec(val);
+    start = offset;
+  }
+  v[index++] = IoVec(buf.substr(start));
+
+  Send(v.data(), index);
+}
+
 MCReplyBuilder::MCReplyBuilder(::io::Sink* sink) : SinkReplyBuilder(sink) {
 }
 
@@ -109,32 +166,60 @@ void MCReplyBuilder::SendSimpleString(std::string_view str) {
 }
 
 void MCReplyBuilder::SendStored() {
-  SendSimpleString("STORED");
+  if (!meta_cmd_)
+    return SendSimpleString("STORED");
+
+  if (!IsQuiet())
+    SendSimpleString(absl::StrCat("HD", MetaFlags(nullptr)));
 }
 
 void MCReplyBuilder::SendLong(long val) {
   char buf[32];
   char* next = absl::numbers_internal::FastIntToBuffer(val, buf);
-  SendSimpleString(string_view(buf, next - buf));
+  string_view str(buf, next - buf);
+  if (!meta_cmd_)
+    return SendSimpleString(str);
+
+  if (meta_cmd_->meta_flags & MemcacheParser::META_RETURN_VALUE) {
+    SendMetaValue(str, nullptr);
+  } else if (!IsQuiet()) {
+    SendSimpleString(absl::StrCat("HD", MetaFlags(nullptr)));
+  }
 }
 
 void MCReplyBuilder::SendMGetResponse(const OptResp* resp, uint32_t count) {
-  string header;
+  if (meta_cmd_) {
+    DCHECK_EQ(count, 1u);
+    if (!resp[0]) {
+      if (!IsQuiet())
+        SendSimpleString("EN");
+    } else if (meta_cmd_->meta_flags & MemcacheParser::META_RETURN_VALUE) {
+      SendMetaValue(resp[0]->value, &*resp[0]);
+    } else {
+      SendSimpleString(absl::StrCat("HD", MetaFlags(&*resp[0])));
+    }
+    return;
+  }
+
+  // All the hits and the END line go out in a single write, large values are sent in place.
+  string res;
+  LargeValues large;
   for (unsigned i = 0; i < count; ++i) {
     if (resp[i]) {
       const auto& src = *resp[i];
-      absl::StrAppend(&header, "VALUE ", src.key, " ", src.mc_flag, " ", src.value.size());
+      absl::StrAppend(&res, "VALUE ", src.key, " ", src.mc_flag, " ", src.value.size());
       if (src.mc_ver) {
-        absl::StrAppend(&header, " ", src.mc_ver);
+        absl::StrAppend(&res, " ", src.mc_ver);
       }
 
-      absl::StrAppend(&header, "\r\n");
-      iovec v[] = {IoVec(header), IoVec(src.value), IoVec(kCRLF)};
-      Send(v, ABSL_ARRAYSIZE(v));
-      header.clear();
+      res.append(kCRLF);
+      AppendValue(src.value, &res, &large);
+      res.append(kCRLF);
     }
   }
-  SendSimpleString("END");
+  res.append("END\r\n");
+
+  SendWithValues(res, large);
 }
 
 void MCReplyBuilder::SendError(string_view str, std::string_view type) {
@@ -147,11 +232,50 @@ void MCReplyBuilder::SendClientError(string_view str) {
 }
 
 void MCReplyBuilder::SendSetSkipped() {
+  if (meta_cmd_)
+    return SendSimpleString(absl::StrCat("NS", MetaFlags(nullptr)));
+
   SendSimpleString("NOT_STORED");
 }
 
 void MCReplyBuilder::SendNotFound() {
-  SendSimpleString("NOT_FOUND");
+  if (!meta_cmd_)
+    return SendSimpleString("NOT_FOUND");
+
+  if (!IsQuiet())
+    SendSimpleString(absl::StrCat("NF", MetaFlags(nullptr)));
+}
+
+void MCReplyBuilder::SendDeleted() {
+  if (meta_cmd_)
+    return SendStored();  // HD
+
+  SendSimpleString("DELETED");
+}
+
+string MCReplyBuilder::MetaFlags(const ResponseValue* val) const {
+  uint8_t mask = meta_cmd_->meta_flags;
+  string res;
+  if (val) {
+    if (mask & MemcacheParser::META_RETURN_FLAGS)
+      absl::StrAppend(&res, " f", val->mc_flag);
+    if (mask & MemcacheParser::META_RETURN_SIZE)
+      absl::StrAppend(&res, " s", val->value.size());
+    if (mask & MemcacheParser::META_RETURN_CAS)
+      absl::StrAppend(&res, " c", val->mc_ver);
+  }
+  if (mask & MemcacheParser::META_RETURN_KEY)
+    absl::StrAppend(&res, " k", meta_cmd_->key);
+  if (!meta_cmd_->opaque.empty())
+    absl::StrAppend(&res, " O", meta_cmd_->opaque);
+
+  return res;
+}
+
+void MCReplyBuilder::SendMetaValue(string_view value, const ResponseValue* val) {
+  string header = absl::StrCat("VA ", value.size(), MetaFlags(val), kCRLF);
+  iovec v[] = {IoVec(header), IoVec(value), IoVec(kCRLF)};
+  Send(v, ABSL_ARRAYSIZE(v));
 }
 
 char* RedisReplyBuilder::FormatDouble(double val, char* dest, unsigned dest_len) {
@@ -198,7 +322,7 @@ void RedisReplyBuilder::SendSetSkipped() {
 void RedisReplyBuilder::SendNull() {
   constexpr char kNullStr[] = "$-1\r\n";
 
-  iovec v[] = {IoVec(kNullStr)};
+  iovec v[] = {IoVec(is_resp3_ ? kResp3Null : kNullStr)};
 
   Send(v, ABSL_ARRAYSIZE(v));
 }
@@ -218,6 +342,34 @@ void RedisReplyBuilder::SendBulkString(std::string_view str) {
   return Send(v, ABSL_ARRAYSIZE(v));
 }
 
+void RedisReplyBuilder::SendBulkStringParts(absl::Span<const std::string_view> parts) {
+  // writev accepts a bounded number of buffers, hence many parts are sent in groups.
+  constexpr size_t kMaxIovecs = 256;
+
+  size_t len = 0;
+  for (string_view part : parts)
+    len += part.size();
+
+  char tmp[absl::numbers_internal::kFastToBufferSize + 3];
+  tmp[0] = '$';
+  char* next = absl::numbers_internal::FastIntToBuffer(uint32_t(len), tmp + 1);
+  *next++ = '\r';
+  *next++ = '\n';
+
+  absl::InlinedVector<iovec, 16> v;
+  v.push_back(IoVec(std::string_view{tmp, size_t(next - tmp)}));
+  for (string_view part : parts) {
+    if (v.size() == kMaxIovecs) {
+      Send(v.data(), v.size());
+      v.clear();
+    }
+    v.push_back(IoVec(part));
+  }
+  v.push_back(IoVec(kCRLF));
+
+  Send(v.data(), v.size());
+}
+
 void RedisReplyBuilder::SendError(OpStatus status) {
   switch (status) {
     case OpStatus::OK:
@@ -268,21 +420,47 @@ void RedisReplyBuilder::SendDouble(double val) {
   StringBuilder sb(buf, sizeof(buf));
   CHECK(dfly_conv.ToShortest(val, &sb));
 
-  SendBulkString(sb.Finalize());
+  if (is_resp3_) {
+    SendRaw(absl::StrCat(",", sb.Finalize(), kCRLF));
+  } else {
+    SendBulkString(sb.Finalize());
+  }
+}
+
+void RedisReplyBuilder::SendBool(bool val) {
+  if (is_resp3_) {
+    SendRaw(val ? "#t\r\n" : "#f\r\n");
+  } else {
+    SendLong(val ? 1 : 0);
+  }
+}
+
+void RedisReplyBuilder::SendBigNumber(string_view num) {
+  if (is_resp3_) {
+    iovec v[] = {IoVec("("), IoVec(num), IoVec(kCRLF)};
+    Send(v, ABSL_ARRAYSIZE(v));
+  } else {
+    SendBulkString(num);
+  }
 }
 
 void RedisReplyBuilder::SendMGetResponse(const OptResp* resp, uint32_t count) {
   string res = absl::StrCat("*", count, kCRLF);
+
+  // Large values are sent in place.
+  LargeValues large;
   for (size_t i = 0; i < count; ++i) {
     if (resp[i]) {
-      StrAppend(&res, "$", resp[i]->value.size(), kCRLF);
-      res.append(resp[i]->value).append(kCRLF);
+      const string& val = resp[i]->value;
+      StrAppend(&res, "$", val.size(), kCRLF);
+      AppendValue(val, &res, &large);
+      res.append(kCRLF);
     } else {
       res.append("$-1\r\n");
     }
   }
 
-  SendRaw(res);
+  SendWithValues(res, large);
 }
 
 void RedisReplyBuilder::SendSimpleStrArr(const std::string_view* arr, uint32_t count) {
@@ -296,7 +474,7 @@ void RedisReplyBuilder::SendSimpleStrArr(const std::string_view* arr, uint32_t c
 }
 
 void RedisReplyBuilder::SendNullArray() {
-  SendRaw("*-1\r\n");
+  SendRaw(is_resp3_ ? kResp3Null : "*-1\r\n");
 }
 
 void RedisReplyBuilder::SendEmptyArray() {
@@ -329,7 +507,36 @@ void RedisReplyBuilder::StartArray(unsigned len) {
   SendRaw(absl::StrCat("*", len, kCRLF));
 }
 
-void RedisReplyBuilder::SendStringArr(StrPtr str_ptr, uint32_t len) {
+void RedisReplyBuilder::StartCollection(unsigned len, CollectionType type) {
+  // StartArray is overridden by the builders of the scripts, which are never in RESP3 mode.
+  if (!is_resp3_ || type == ARRAY)
+    return StartArray(type == MAP ? len * 2 : len);
+
+  SendRaw(absl::StrCat(string_view{kCollectionPrefix + type, 1}, len, kCRLF));
+}
+
+void RedisReplyBuilder::SendStringCollection(absl::Span<const string_view> arr,
+                                             CollectionType type) {
+  if (!is_resp3_ || type == ARRAY)
+    return SendStringArr(arr);
+
+  if (arr.empty())
+    return StartCollection(0, type);
+
+  SendStringArr(arr.data(), arr.size(), type);
+}
+
+void RedisReplyBuilder::SendStringCollection(absl::Span<const string> arr, CollectionType type) {
+  if (!is_resp3_ || type == ARRAY)
+    return SendStringArr(arr);
+
+  if (arr.empty())
+    return StartCollection(0, type);
+
+  SendStringArr(arr.data(), arr.size(), type);
+}
+
+void RedisReplyBuilder::SendStringArr(StrPtr str_ptr, uint32_t len, CollectionType type) {
   // When vector length is too long, Send returns EMSGSIZE.
   size_t vec_len = std::min<size_t>(256u, len);
 
@@ -337,8 +544,9 @@ void RedisReplyBuilder::SendStringArr(StrPtr str_ptr, uint32_t len) {
   absl::FixedArray<char, 64> meta((vec_len + 1) * 16);
   char* next = meta.data();
 
-  *next++ = '*';
-  next = absl::numbers_internal::FastIntToBuffer(len, next);
+  DCHECK(type == ARRAY || is_resp3_);
+  *next++ = kCollectionPrefix[type];
+  next = absl::numbers_internal::FastIntToBuffer(type == MAP ? len / 2 : len, next);
   *next++ = '\r';
   *next++ = '\n';
   vec[0] = IoVec(string_view{meta.data(), size_t(next - meta.data())});
@@ -395,4 +603,12 @@ void ReqSerializer::SendCommand(std::string_view str) {
   ec_ = sink_->Write(v, ABSL_ARRAYSIZE(v));
 }
 
+void ReqSerializer::SendCommandArray(absl::Span<const std::string_view> args) {
+  string buf = absl::StrCat("*", args.size(), kCRLF);
+  for (string_view arg : args) {
+    StrAppend(&buf, "$", arg.size(), kCRLF, arg, kCRLF);
+  }
+  ec_ = sink_->Write(::io::Buffer(buf));
+}
+
 }  // namespace facade
@@ -2,10 +2,12 @@
 // See LICENSE for licensing terms.
 //
 #include <absl/container/flat_hash_map.h>
+#include <absl/container/inlined_vector.h>
 
 #include <optional>
 #include <string_view>
 
+#include "facade/memcache_parser.h"
 #include "facade/op_status.h"
 #include "io/io.h"
 
@@ -28,6 +30,23 @@ class SinkReplyBuilder {
     should_batch_ = batch;
   }
 
+  // Writes the batched replies.
+  void FlushBatch();
+
+  size_t batch_len() const {
+    return batch_.size();
+  }
+
+  size_t batch_capacity() const {
+    return batch_.capacity();
+  }
+
+  // Frees the memory of the batch once its replies were written. It grows again in batch mode.
+  void ReleaseBatch() {
+    if (batch_.empty())
+      std::string{}.swap(batch_);
+  }
+
   // Used for QUIT - > should move to conn_context?
   void CloseConnection();
 
@@ -85,6 +104,14 @@ class SinkReplyBuilder {
  protected:
   void Send(const iovec* v, uint32_t len);
 
+  // Appends the value to buf, or references it in large if it is too big to be copied.
+  // large holds the offsets in buf where the referenced values are inserted.
+  using LargeValues = absl::InlinedVector<std::pair<size_t, std::string_view>, 4>;
+  static void AppendValue(std::string_view value, std::string* buf, LargeValues* large);
+
+  // Sends buf with the values of large inserted at their offsets, in a single write.
+  void SendWithValues(std::string_view buf, const LargeValues& large);
+
   std::string batch_;
   ::io::Sink* sink_;
   std::error_code ec_;
@@ -111,13 +138,46 @@ class MCReplyBuilder : public SinkReplyBuilder {
 
   void SendClientError(std::string_view str);
   void SendNotFound();
+  void SendDeleted();
   void SendSimpleString(std::string_view str) final;
+
+  // Switches the replies to the format of the meta protocol while the meta command cmd runs.
+  // nullptr switches back to the classic format.
+  void SetMetaCommand(const MemcacheParser::Command* cmd) {
+    meta_cmd_ = cmd;
+  }
+
+ private:
+  bool IsQuiet() const {
+    return meta_cmd_->meta_flags & MemcacheParser::META_QUIET;
+  }
+
+  // Returns the return flags requested by the meta command, val is set for the found items.
+  std::string MetaFlags(const ResponseValue* val) const;
+
+  // Sends "VA <size> <flags>" followed by the value.
+  void SendMetaValue(std::string_view value, const ResponseValue* val);
+
+  const MemcacheParser::Command* meta_cmd_ = nullptr;
 };
 
 class RedisReplyBuilder : public SinkReplyBuilder {
  public:
+  enum CollectionType : uint8_t { ARRAY, SET, MAP, PUSH };
+
   RedisReplyBuilder(::io::Sink* stream);
 
+  // RESP3 is negotiated with HELLO 3. In RESP2 mode the RESP3 types degrade to the RESP2 ones:
+  // collections are sent as arrays, doubles and big numbers as bulk strings and booleans as
+  // integers.
+  void SetResp3(bool is_resp3) {
+    is_resp3_ = is_resp3;
+  }
+
+  bool IsResp3() const {
+    return is_resp3_;
+  }
+
   void SendError(std::string_view str, std::string_view type = std::string_view{}) override;
   void SendMGetResponse(const OptResp* resp, uint32_t count) override;
   void SendSimpleString(std::string_view str) override;
@@ -141,14 +201,29 @@ class RedisReplyBuilder : public SinkReplyBuilder {
 
   virtual void SendBulkString(std::string_view str);
 
+  // Sends the bulk string that is the concatenation of parts. The parts are not joined, so that
+  // large ones are written from their memory as SendBulkString does.
+  void SendBulkStringParts(absl::Span<const std::string_view> parts);
+
   virtual void StartArray(unsigned len);
 
+  void SendBool(bool val);
+  void SendBigNumber(std::string_view num);
+
+  // len is the number of entries of the collection, i.e. the number of pairs for maps.
+  void StartCollection(unsigned len, CollectionType type);
+
+  // Sends arr as a collection of bulk strings. Maps are passed as flat key-value sequences.
+  void SendStringCollection(absl::Span<const std::string_view> arr, CollectionType type);
+  void SendStringCollection(absl::Span<const std::string> arr, CollectionType type);
+
   static char* FormatDouble(double val, char* dest, unsigned dest_len);
 
  private:
-
   using StrPtr = std::variant<const std::string_view*, const std::string*>;
-  void SendStringArr(StrPtr str_ptr, uint32_t len);
+  void SendStringArr(StrPtr str_ptr, uint32_t len, CollectionType type = ARRAY);
+
+  bool is_resp3_ = false;
 };
 
 class ReqSerializer {
@@ -156,8 +231,12 @@ class ReqSerializer {
   explicit ReqSerializer(::io::Sink* stream) : sink_(stream) {
   }
 
+  // Sends str followed by CRLF, i.e. an inline command or a line of the memcache protocol.
   void SendCommand(std::string_view str);
 
+  // Sends the command as a RESP array of bulk strings, so that its arguments may hold any bytes.
+  void SendCommandArray(absl::Span<const std::string_view> args);
+
   std::error_code ec() const {
     return ec_;
   }
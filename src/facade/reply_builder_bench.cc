@@ -0,0 +1,186 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include <benchmark/benchmark.h>
+#include <mimalloc.h>
+
+#include <absl/strings/str_cat.h>
+
+#include <new>
+
+#include "base/init.h"
+#include "base/logging.h"
+#include "facade/reply_builder.h"
+
+// Runs google benchmarks for RedisReplyBuilder. For example:
+//   ./reply_builder_bench --benchmark_filter=BM_SendStringArr --benchmark_counters_tabular=true
+// Use --benchmark_format=json or --benchmark_out=<file> to get results that can be diffed.
+// operator new is served by mimalloc, as in dragonfly, and counts the allocations for
+// "allocs_per_reply". "writes_per_reply" is the number of socket writes the builder issued.
+
+using namespace std;
+
+namespace {
+
+uint64_t num_allocs = 0;
+
+}  // namespace
+
+void* operator new(size_t size) {
+  ++num_allocs;
+  void* res = mi_malloc(size);
+  if (!res)
+    throw std::bad_alloc{};
+  return res;
+}
+
+void operator delete(void* ptr) noexcept {
+  mi_free(ptr);
+}
+
+void operator delete(void* ptr, size_t size) noexcept {
+  mi_free(ptr);
+}
+
+namespace facade {
+
+namespace {
+
+// Discards the replies, so that only their serialization is measured.
+class NullSink : public io::Sink {
+ public:
+  io::Result<size_t> WriteSome(const iovec* v, uint32_t len) final {
+    size_t res = 0;
+    for (uint32_t i = 0; i < len; ++i)
+      res += v[i].iov_len;
+    return res;
+  }
+};
+
+vector<string> MakeValues(size_t num, size_t len) {
+  vector<string> res(num);
+  for (size_t i = 0; i < num; ++i) {
+    res[i] = absl::StrCat("member:", i, ":");
+    res[i].resize(max(len, res[i].size()), 'x');
+  }
+  return res;
+}
+
+void SetCounters(const RedisReplyBuilder& rb, uint64_t start, size_t replies_per_iter,
+                 benchmark::State* state) {
+  double replies = double(state->iterations()) * replies_per_iter;
+  state->counters["allocs_per_reply"] = double(num_allocs - start) / replies;
+  state->counters["writes_per_reply"] = double(rb.io_write_cnt()) / replies;
+  state->SetBytesProcessed(rb.io_write_bytes());
+}
+
+}  // namespace
+
+// The reply of SMEMBERS or LRANGE. Args: {number of elements, element length}.
+static void BM_SendStringArr(benchmark::State& state) {
+  vector<string> values = MakeValues(state.range(0), state.range(1));
+  vector<string_view> views(values.begin(), values.end());
+
+  NullSink sink;
+  RedisReplyBuilder rb(&sink);
+  uint64_t start = num_allocs;
+  for (auto _ : state) {
+    rb.SendStringArr(views);
+  }
+  SetCounters(rb, start, 1, &state);
+}
+BENCHMARK(BM_SendStringArr)->ArgsProduct({{1, 16, 1024}, {8, 64, 1024}});
+
+// The reply of HGETALL, as a RESP3 map or a flat RESP2 array. Args: {number of pairs, resp3}.
+static void BM_SendMap(benchmark::State& state) {
+  vector<string> values = MakeValues(state.range(0) * 2, 16);
+  vector<string_view> views(values.begin(), values.end());
+
+  NullSink sink;
+  RedisReplyBuilder rb(&sink);
+  rb.SetResp3(state.range(1));
+  uint64_t start = num_allocs;
+  for (auto _ : state) {
+    rb.SendStringCollection(views, RedisReplyBuilder::MAP);
+  }
+  SetCounters(rb, start, 1, &state);
+}
+BENCHMARK(BM_SendMap)->ArgsProduct({{16, 1024}, {0, 1}});
+
+// The reply of GET. Args: value length.
+static void BM_SendBulkString(benchmark::State& state) {
+  string value(state.range(0), 'v');
+
+  NullSink sink;
+  RedisReplyBuilder rb(&sink);
+  uint64_t start = num_allocs;
+  for (auto _ : state) {
+    rb.SendBulkString(value);
+  }
+  SetCounters(rb, start, 1, &state);
+}
+BENCHMARK(BM_SendBulkString)->Arg(16)->Arg(1 << 10)->Arg(1 << 16);
+
+// The reply of MGET of which every 4th key is missing. Args: number of keys.
+static void BM_SendMGetResponse(benchmark::State& state) {
+  size_t num = state.range(0);
+  vector<SinkReplyBuilder::OptResp> resp(num);
+  for (size_t i = 0; i < num; ++i) {
+    if (i % 4 != 3)
+      resp[i].emplace().value = string(64, 'v');
+  }
+
+  NullSink sink;
+  RedisReplyBuilder rb(&sink);
+  uint64_t start = num_allocs;
+  for (auto _ : state) {
+    rb.SendMGetResponse(resp.data(), num);
+  }
+  SetCounters(rb, start, 1, &state);
+}
+BENCHMARK(BM_SendMGetResponse)->Arg(10)->Arg(100);
+
+// Replies to a pipeline of small commands, which are batched into a single write.
+static void BM_SendPipelineBatch(benchmark::State& state) {
+  constexpr unsigned kPipelineLen = 100;
+  string value(32, 'v');
+
+  NullSink sink;
+  RedisReplyBuilder rb(&sink);
+  uint64_t start = num_allocs;
+  rb.SetBatchMode(true);
+  for (auto _ : state) {
+    for (unsigned i = 0; i < kPipelineLen; ++i) {
+      switch (i % 4) {
+        case 0:
+          rb.SendOk();
+          break;
+        case 1:
+          rb.SendLong(i);
+          break;
+        case 2:
+          rb.SendBulkString(value);
+          break;
+        case 3:
+          rb.SendNull();
+          break;
+      }
+    }
+    rb.FlushBatch();
+  }
+  SetCounters(rb, start, kPipelineLen, &state);
+}
+BENCHMARK(BM_SendPipelineBatch);
+
+}  // namespace facade
+
+int main(int argc, char* argv[]) {
+  // Consumes --benchmark_xxx flags before absl flags are parsed.
+  benchmark::Initialize(&argc, argv);
+  MainInitGuard guard(&argc, &argv);
+
+  benchmark::RunSpecifiedBenchmarks();
+
+  return 0;
+}
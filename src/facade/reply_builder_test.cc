@@ -0,0 +1,146 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/reply_builder.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace testing;
+using namespace std;
+
+namespace facade {
+
+class RedisReplyBuilderTest : public testing::Test {
+ protected:
+  RedisReplyBuilderTest() : builder_(&sink_) {
+  }
+
+  ::io::StringSink sink_;
+  RedisReplyBuilder builder_;
+};
+
+TEST_F(RedisReplyBuilderTest, BatchSmall) {
+  builder_.SetBatchMode(true);
+  builder_.SendBulkString("foo");
+  builder_.SendBulkString("bar");
+  EXPECT_EQ(0, builder_.io_write_cnt());
+  EXPECT_EQ("", sink_.str());
+
+  builder_.SetBatchMode(false);
+  builder_.SendOk();
+  EXPECT_EQ(1, builder_.io_write_cnt());
+  EXPECT_EQ("$3\r\nfoo\r\n$3\r\nbar\r\n+OK\r\n", sink_.str());
+}
+
+TEST_F(RedisReplyBuilderTest, FlushBatch) {
+  builder_.SetBatchMode(true);
+  builder_.SendOk();
+  builder_.SendLong(1);
+  EXPECT_EQ(9, builder_.batch_len());
+
+  builder_.FlushBatch();
+  EXPECT_EQ(1, builder_.io_write_cnt());
+  EXPECT_EQ(0, builder_.batch_len());
+  EXPECT_EQ("+OK\r\n:1\r\n", sink_.str());
+
+  builder_.FlushBatch();
+  EXPECT_EQ(1, builder_.io_write_cnt());
+}
+
+TEST_F(RedisReplyBuilderTest, BatchLarge) {
+  string large(100000, 'a');
+
+  builder_.SetBatchMode(true);
+  builder_.SendBulkString("foo");
+  builder_.SendBulkString(large);
+
+  // The large value is written together with the batched reply that precedes it.
+  EXPECT_EQ(1, builder_.io_write_cnt());
+  EXPECT_EQ(absl::StrCat("$3\r\nfoo\r\n$100000\r\n", large, "\r\n"), sink_.str());
+
+  builder_.SendBulkString("bar");
+  EXPECT_EQ(1, builder_.io_write_cnt());
+}
+
+TEST_F(RedisReplyBuilderTest, BulkStringParts) {
+  string large(100000, 'a');
+  vector<string_view> parts(300, "bc");
+  parts.push_back(large);
+
+  builder_.SendBulkStringParts(parts);
+  string expected = "$100600\r\n";
+  for (unsigned i = 0; i < 300; ++i)
+    expected += "bc";
+  EXPECT_EQ(absl::StrCat(expected, large, "\r\n"), sink_.str());
+}
+
+TEST_F(RedisReplyBuilderTest, MGetLarge) {
+  string large(10000, 'b');
+  SinkReplyBuilder::OptResp resp[4];
+  resp[0].emplace().value = "foo";
+  resp[1].emplace().value = large;
+  resp[3].emplace().value = large;
+
+  builder_.SendMGetResponse(resp, 4);
+  EXPECT_EQ(absl::StrCat("*4\r\n$3\r\nfoo\r\n$10000\r\n", large, "\r\n$-1\r\n$10000\r\n", large,
+                         "\r\n"),
+            sink_.str());
+}
+
+TEST_F(RedisReplyBuilderTest, Resp3) {
+  string_view arr[] = {"f1", "v1", "f2", "v2"};
+
+  builder_.SendStringCollection(arr, RedisReplyBuilder::MAP);
+  builder_.SendDouble(1.5);
+  builder_.SendBool(true);
+  builder_.SendNull();
+  EXPECT_EQ("*4\r\n$2\r\nf1\r\n$2\r\nv1\r\n$2\r\nf2\r\n$2\r\nv2\r\n"
+            "$3\r\n1.5\r\n:1\r\n$-1\r\n",
+            sink_.str());
+  sink_.Clear();
+
+  builder_.SetResp3(true);
+  builder_.SendStringCollection(arr, RedisReplyBuilder::MAP);
+  builder_.SendStringCollection(absl::Span<const string_view>{arr, 2}, RedisReplyBuilder::SET);
+  builder_.SendStringCollection(absl::Span<const string_view>{}, RedisReplyBuilder::PUSH);
+  builder_.SendDouble(1.5);
+  builder_.SendBool(true);
+  builder_.SendBigNumber("12345678901234567890");
+  builder_.SendNull();
+  EXPECT_EQ("%2\r\n$2\r\nf1\r\n$2\r\nv1\r\n$2\r\nf2\r\n$2\r\nv2\r\n"
+            "~2\r\n$2\r\nf1\r\n$2\r\nv1\r\n>0\r\n,1.5\r\n#t\r\n(12345678901234567890\r\n_\r\n",
+            sink_.str());
+}
+
+TEST(MCReplyBuilderTest, MGet) {
+  ::io::StringSink sink;
+  MCReplyBuilder builder(&sink);
+
+  string large(10000, 'b');
+  SinkReplyBuilder::OptResp resp[3];
+  resp[0].emplace() = {"k1", "foo", 0, 1};
+  resp[2].emplace() = {"k3", large, 0, 2};
+
+  // All the hits are written at once.
+  builder.SendMGetResponse(resp, 3);
+  EXPECT_EQ(1, builder.io_write_cnt());
+  EXPECT_EQ(absl::StrCat("VALUE k1 1 3\r\nfoo\r\nVALUE k3 2 10000\r\n", large, "\r\nEND\r\n"),
+            sink.str());
+}
+
+TEST(ReqSerializerTest, Commands) {
+  ::io::StringSink sink;
+  ReqSerializer serializer{&sink};
+  serializer.SendCommand("PING");
+
+  string_view args[] = {"SET", "a b", ""};
+  serializer.SendCommandArray(args);
+  EXPECT_FALSE(serializer.ec());
+  EXPECT_EQ("PING\r\n*3\r\n$3\r\nSET\r\n$3\r\na b\r\n$0\r\n\r\n", sink.str());
+}
+
+}  // namespace facade
@@ -24,6 +24,14 @@ class ServiceInterface {
   }
 
   virtual void DispatchCommand(CmdArgList args, ConnectionContext* cntx) = 0;
+
+  // Dispatches pipelined commands and sends their replies in the order of the commands.
+  // The service may execute commands on different keys concurrently.
+  virtual void DispatchManyCommands(absl::Span<CmdArgList> args_list, ConnectionContext* cntx) {
+    for (CmdArgList args : args_list) {
+      DispatchCommand(args, cntx);
+    }
+  }
   virtual void DispatchMC(const MemcacheParser::Command& cmd, std::string_view value,
                           ConnectionContext* cntx) = 0;
 
@@ -0,0 +1,188 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/shm_client.h"
+
+#include <absl/strings/str_cat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+
+namespace facade {
+
+using namespace std;
+using nonstd::make_unexpected;
+
+namespace {
+
+// The server may die while the client sleeps on a futex.
+constexpr uint32_t kWaitTimeoutMs = 100;
+
+error_code LastError() {
+  return error_code{errno, system_category()};
+}
+
+bool WriteAll(int fd, string_view data) {
+  while (!data.empty()) {
+    ssize_t res = write(fd, data.data(), data.size());
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      return false;
+    data.remove_prefix(res);
+  }
+  return true;
+}
+
+}  // namespace
+
+ShmClient::~ShmClient() {
+  Close();
+}
+
+error_code ShmClient::Connect(const string& unix_path, size_t capacity) {
+  if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+    return make_error_code(errc::invalid_argument);
+
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (unix_path.size() >= sizeof(addr.sun_path))
+    return make_error_code(errc::filename_too_long);
+  memcpy(addr.sun_path, unix_path.data(), unix_path.size());
+
+  Close();
+  fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd_ < 0 || connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    error_code ec = LastError();
+    Close();
+    return ec;
+  }
+
+  static atomic_uint32_t next_id{0};
+  string name = absl::StrCat("/dfly-shm-", getpid(), "-", next_id.fetch_add(1));
+  int shm_fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (shm_fd < 0) {
+    error_code ec = LastError();
+    Close();
+    return ec;
+  }
+
+  region_size_ = ShmRegion::Size(capacity);
+  void* ptr = MAP_FAILED;
+  if (ftruncate(shm_fd, region_size_) == 0) {
+    ptr = mmap(nullptr, region_size_, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  }
+  error_code ec = ptr == MAP_FAILED ? LastError() : error_code{};
+  close(shm_fd);
+
+  if (!ec) {
+    region_ = static_cast<ShmRegion*>(ptr);
+    region_->capacity = capacity;
+    region_->requests(true);
+    region_->replies(true);
+    region_->magic = ShmRegion::kMagic;
+
+    string line = absl::StrCat(ShmRegion::kHandshake, name, "\r\n");
+    if (!WriteAll(fd_, line))
+      ec = LastError();
+  }
+
+  // The server replies with a single line.
+  string reply;
+  while (!ec && (reply.empty() || reply.back() != '\n')) {
+    char c;
+    ssize_t res = read(fd_, &c, 1);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      ec = res < 0 ? LastError() : make_error_code(errc::connection_refused);
+    else
+      reply.push_back(c);
+  }
+
+  if (!ec && reply != "+OK\r\n")
+    ec = make_error_code(errc::connection_refused);
+
+  // The server unlinks the name once it maps the region.
+  if (ec) {
+    shm_unlink(name.c_str());
+    Close();
+  }
+
+  return ec;
+}
+
+error_code ShmClient::Send(string_view data) {
+  if (!region_)
+    return make_error_code(errc::not_connected);
+
+  ShmRing ring = region_->requests(false);
+  while (!data.empty()) {
+    size_t written = ring.Write(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+    data.remove_prefix(written);
+    if (written > 0) {
+      // Rings the doorbell of the sleeping server.
+      if (ring.TakeReader() && !WriteAll(fd_, "\n"))
+        return LastError();
+      continue;
+    }
+
+    if (ring.ArmWriter()) {
+      ring.FutexWaitWriter(kWaitTimeoutMs);
+      if (!IsAlive())
+        return make_error_code(errc::connection_aborted);
+    } else {
+      ring.TakeWriter();
+    }
+  }
+
+  return {};
+}
+
+io::Result<size_t> ShmClient::Recv(io::MutableBytes dest) {
+  if (!region_)
+    return make_unexpected(make_error_code(errc::not_connected));
+
+  ShmRing ring = region_->replies(false);
+  while (true) {
+    size_t read = ring.Read(dest.data(), dest.size());
+    if (read > 0 || dest.empty())
+      return read;
+
+    if (ring.ArmReader()) {
+      ring.FutexWaitReader(kWaitTimeoutMs);
+      if (ring.empty() && !IsAlive())
+        return make_unexpected(make_error_code(errc::connection_aborted));
+    } else {
+      ring.TakeReader();
+    }
+  }
+}
+
+void ShmClient::Close() {
+  if (region_) {
+    munmap(region_, region_size_);
+    region_ = nullptr;
+  }
+
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool ShmClient::IsAlive() const {
+  // The server does not write into the socket after the handshake.
+  pollfd pfd{fd_, POLLIN | POLLRDHUP, 0};
+  return poll(&pfd, 1, 0) == 0;
+}
+
+}  // namespace facade
@@ -0,0 +1,46 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <system_error>
+
+#include "facade/shm_ring.h"
+#include "io/io.h"
+
+namespace facade {
+
+// Client side of the shared-memory transport, for services that run on the same host as the
+// server. It writes RESP requests and reads the replies with the calls of a regular socket,
+// but blocks its thread instead of a fiber. Not thread-safe.
+class ShmClient {
+ public:
+  ShmClient() = default;
+  ShmClient(const ShmClient&) = delete;
+  ~ShmClient();
+
+  // Connects to the unix socket of the server, which must run with --shm_transport.
+  // capacity is the size of each ring, a power of 2.
+  std::error_code Connect(const std::string& unix_path, size_t capacity = 1 << 20);
+
+  // Blocks until all of data is written into the ring of the requests.
+  std::error_code Send(std::string_view data);
+
+  // Blocks until some replies arrive and copies up to dest.size() bytes of them.
+  io::Result<size_t> Recv(io::MutableBytes dest);
+
+  void Close();
+
+ private:
+  // Returns false once the server closed the connection.
+  bool IsAlive() const;
+
+  int fd_ = -1;
+  ShmRegion* region_ = nullptr;
+  size_t region_size_ = 0;
+};
+
+}  // namespace facade
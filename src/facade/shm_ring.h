@@ -0,0 +1,193 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string_view>
+
+namespace facade {
+
+// Bounded byte queue with a single writer and a single reader that live in different processes
+// and share its memory. The positions grow forever and wrap around the data array.
+// A side that runs out of data or of space may sleep. It arms its waiting flag, checks the ring
+// once more and sleeps only if nothing changed, while the other side clears the flag after each
+// change and wakes it up if it was set. The flags are futex words, but every side chooses how it
+// sleeps: the server does not block its threads in futex calls, see ShmSocket.
+class ShmRing {
+ public:
+  // The shared memory of the ring: the header followed by the data.
+  struct Header {
+    alignas(64) std::atomic_uint64_t tail;  // written by the writer.
+    std::atomic_uint32_t writer_waiting;    // the writer waits for space.
+
+    alignas(64) std::atomic_uint64_t head;  // written by the reader.
+    std::atomic_uint32_t reader_waiting;    // the reader waits for data.
+  };
+
+  static size_t RegionSize(size_t capacity) {
+    return sizeof(Header) + capacity;
+  }
+
+  // region holds RegionSize(capacity) bytes, capacity must be a power of 2.
+  // Exactly one of the sides initializes the region.
+  ShmRing(void* region, size_t capacity, bool init);
+
+  size_t capacity() const {
+    return mask_ + 1;
+  }
+
+  // Writer side. Copies as many bytes as fit and returns their number.
+  size_t Write(const uint8_t* src, size_t len);
+
+  // Reader side. Copies up to len bytes and returns their number.
+  size_t Read(uint8_t* dest, size_t len);
+
+  bool empty() const {
+    uint64_t tail = hdr_->tail.load(std::memory_order_seq_cst);
+    return tail == hdr_->head.load(std::memory_order_relaxed);
+  }
+
+  bool full() const {
+    uint64_t head = hdr_->head.load(std::memory_order_seq_cst);
+    return hdr_->tail.load(std::memory_order_relaxed) - head == capacity();
+  }
+
+  // Called by the reader before it sleeps. Returns false if data arrived meanwhile.
+  bool ArmReader() {
+    hdr_->reader_waiting.store(1, std::memory_order_seq_cst);
+    return empty();
+  }
+
+  // Called by the writer after Write(). Returns true if the reader sleeps and must be woken up.
+  bool TakeReader() {
+    return hdr_->reader_waiting.load(std::memory_order_seq_cst) &&
+           hdr_->reader_waiting.exchange(0, std::memory_order_seq_cst);
+  }
+
+  // Called by the writer before it sleeps. Returns false if space was freed meanwhile.
+  bool ArmWriter() {
+    hdr_->writer_waiting.store(1, std::memory_order_seq_cst);
+    return full();
+  }
+
+  // Called by the reader after Read(). Returns true if the writer sleeps and must be woken up.
+  bool TakeWriter() {
+    return hdr_->writer_waiting.load(std::memory_order_seq_cst) &&
+           hdr_->writer_waiting.exchange(0, std::memory_order_seq_cst);
+  }
+
+  // Futex based sleeping for the sides that may block their thread. The waits return once the
+  // other side clears the flag or after timeout_ms.
+  void FutexWaitReader(uint32_t timeout_ms) {
+    FutexWait(&hdr_->reader_waiting, timeout_ms);
+  }
+
+  void FutexWaitWriter(uint32_t timeout_ms) {
+    FutexWait(&hdr_->writer_waiting, timeout_ms);
+  }
+
+  void FutexWakeReader() {
+    FutexWake(&hdr_->reader_waiting);
+  }
+
+  void FutexWakeWriter() {
+    FutexWake(&hdr_->writer_waiting);
+  }
+
+ private:
+  // The futex words are shared between processes, hence no FUTEX_PRIVATE_FLAG.
+  static void FutexWait(std::atomic_uint32_t* word, uint32_t timeout_ms) {
+    timespec ts{timeout_ms / 1000, long(timeout_ms % 1000) * 1000000};
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, 1, &ts, nullptr, 0);
+  }
+
+  static void FutexWake(std::atomic_uint32_t* word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+  }
+
+  Header* hdr_;
+  uint8_t* data_;
+  uint64_t mask_;
+};
+
+inline ShmRing::ShmRing(void* region, size_t capacity, bool init)
+    : hdr_(static_cast<Header*>(region)),
+      data_(static_cast<uint8_t*>(region) + sizeof(Header)),
+      mask_(capacity - 1) {
+  assert(capacity > 0 && (capacity & mask_) == 0);
+  if (init) {
+    hdr_->tail.store(0, std::memory_order_relaxed);
+    hdr_->head.store(0, std::memory_order_relaxed);
+    hdr_->writer_waiting.store(0, std::memory_order_relaxed);
+    hdr_->reader_waiting.store(0, std::memory_order_relaxed);
+  }
+}
+
+inline size_t ShmRing::Write(const uint8_t* src, size_t len) {
+  uint64_t tail = hdr_->tail.load(std::memory_order_relaxed);
+  uint64_t head = hdr_->head.load(std::memory_order_acquire);
+  len = std::min<size_t>(len, capacity() - (tail - head));
+
+  size_t offs = tail & mask_;
+  size_t first = std::min(len, capacity() - offs);
+  memcpy(data_ + offs, src, first);
+  memcpy(data_, src + first, len - first);
+
+  hdr_->tail.store(tail + len, std::memory_order_seq_cst);
+  return len;
+}
+
+inline size_t ShmRing::Read(uint8_t* dest, size_t len) {
+  uint64_t head = hdr_->head.load(std::memory_order_relaxed);
+  uint64_t tail = hdr_->tail.load(std::memory_order_acquire);
+  len = std::min<size_t>(len, tail - head);
+
+  size_t offs = head & mask_;
+  size_t first = std::min(len, capacity() - offs);
+  memcpy(dest, data_ + offs, first);
+  memcpy(dest + first, data_, len - first);
+
+  hdr_->head.store(head + len, std::memory_order_seq_cst);
+  return len;
+}
+
+// The shared memory of a connection of the shared-memory transport. The client creates it and
+// the server maps it during the handshake, see ShmSocket and ShmClient.
+struct alignas(64) ShmRegion {
+  static constexpr uint64_t kMagic = 0x314d4853594c4644;  // "DFLYSHM1"
+
+  // The first line of a shared memory connection: the prefix followed by the shm_open name of the
+  // region and "\r\n". The server replies "+OK\r\n" or an error on the unix socket.
+  static constexpr std::string_view kHandshake = "DFLYSHM ";
+
+  uint64_t magic;
+  uint64_t capacity;  // of each ring.
+
+  static size_t Size(size_t capacity) {
+    return sizeof(ShmRegion) + 2 * ShmRing::RegionSize(capacity);
+  }
+
+  // The client writes the requests into the first ring and the server the replies into the second.
+  ShmRing requests(bool init) {
+    return ShmRing{reinterpret_cast<uint8_t*>(this) + sizeof(ShmRegion), capacity, init};
+  }
+
+  ShmRing replies(bool init) {
+    return ShmRing{reinterpret_cast<uint8_t*>(this) + sizeof(ShmRegion) +
+                       ShmRing::RegionSize(capacity),
+                   capacity, init};
+  }
+};
+
+}  // namespace facade
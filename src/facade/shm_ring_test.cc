@@ -0,0 +1,117 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/shm_ring.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace testing;
+using namespace std;
+
+namespace facade {
+
+class ShmRingTest : public testing::Test {
+ protected:
+  void* Region(size_t capacity) {
+    mem_.resize(ShmRing::RegionSize(capacity) / 64 + 1);
+    return mem_.data();
+  }
+
+  struct alignas(64) Line {
+    uint8_t bytes[64];
+  };
+  vector<Line> mem_;
+};
+
+TEST_F(ShmRingTest, Basic) {
+  ShmRing ring(Region(8), 8, true);
+  EXPECT_TRUE(ring.empty());
+
+  EXPECT_EQ(5, ring.Write(reinterpret_cast<const uint8_t*>("hello"), 5));
+  EXPECT_EQ(3, ring.Write(reinterpret_cast<const uint8_t*>("world"), 5));
+  EXPECT_TRUE(ring.full());
+
+  uint8_t buf[16];
+  ASSERT_EQ(6, ring.Read(buf, 6));
+  EXPECT_EQ("hellow", string(reinterpret_cast<char*>(buf), 6));
+
+  // Wraps around the end of the data.
+  EXPECT_EQ(5, ring.Write(reinterpret_cast<const uint8_t*>("12345"), 5));
+  ASSERT_EQ(7, ring.Read(buf, sizeof(buf)));
+  EXPECT_EQ("or12345", string(reinterpret_cast<char*>(buf), 7));
+  EXPECT_TRUE(ring.empty());
+  EXPECT_EQ(0, ring.Read(buf, sizeof(buf)));
+}
+
+TEST_F(ShmRingTest, Wakeups) {
+  ShmRing ring(Region(8), 8, true);
+  EXPECT_FALSE(ring.TakeReader());
+
+  EXPECT_TRUE(ring.ArmReader());
+  EXPECT_EQ(1, ring.Write(reinterpret_cast<const uint8_t*>("a"), 1));
+  EXPECT_TRUE(ring.TakeReader());
+  EXPECT_FALSE(ring.TakeReader());
+
+  // The reader does not sleep once there is data.
+  EXPECT_FALSE(ring.ArmReader());
+
+  EXPECT_EQ(7, ring.Write(reinterpret_cast<const uint8_t*>("bcdefgh"), 7));
+  EXPECT_TRUE(ring.ArmWriter());
+  uint8_t buf[8];
+  EXPECT_EQ(8, ring.Read(buf, sizeof(buf)));
+  EXPECT_TRUE(ring.TakeWriter());
+}
+
+TEST_F(ShmRingTest, Threads) {
+  constexpr size_t kLen = 1 << 20;
+  ShmRing writer(Region(64), 64, true);
+  ShmRing reader(mem_.data(), 64, false);
+
+  string src(kLen, '\0');
+  for (size_t i = 0; i < kLen; ++i) {
+    src[i] = char(i * 7);
+  }
+
+  thread th([&] {
+    size_t offs = 0;
+    while (offs < kLen) {
+      size_t len = writer.Write(reinterpret_cast<const uint8_t*>(src.data()) + offs,
+                                min<size_t>(37, kLen - offs));
+      offs += len;
+      if (len > 0) {
+        if (writer.TakeReader())
+          writer.FutexWakeReader();
+      } else if (writer.ArmWriter()) {
+        writer.FutexWaitWriter(100);
+      } else {
+        writer.TakeWriter();
+      }
+    }
+  });
+
+  string dest;
+  uint8_t buf[50];
+  while (dest.size() < kLen) {
+    size_t len = reader.Read(buf, sizeof(buf));
+    dest.append(reinterpret_cast<char*>(buf), len);
+    if (len > 0) {
+      if (reader.TakeWriter())
+        reader.FutexWakeWriter();
+    } else if (reader.ArmReader()) {
+      reader.FutexWaitReader(100);
+    } else {
+      reader.TakeReader();
+    }
+  }
+  th.join();
+
+  EXPECT_TRUE(dest == src);
+}
+
+}  // namespace facade
@@ -0,0 +1,202 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/shm_socket.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/fiber/operations.hpp>
+#include <string>
+
+#include "base/logging.h"
+#include "util/fibers/fibers_ext.h"
+
+namespace facade {
+
+using namespace std;
+using namespace util;
+using nonstd::make_unexpected;
+
+namespace {
+
+constexpr uint32_t kMaxReplyWaitUsec = 1000;
+
+}  // namespace
+
+auto ShmSocket::Open(FiberSocketBase* next, string_view name, uint32_t idle_polls)
+    -> io::Result<unique_ptr<ShmSocket>> {
+  string shm_name{name};
+  int fd = shm_open(shm_name.c_str(), O_RDWR, 0);
+  if (fd < 0)
+    return make_unexpected(error_code{errno, system_category()});
+
+  // The name is used once, so that it does not outlive the connection.
+  shm_unlink(shm_name.c_str());
+
+  struct stat st;
+  void* ptr = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(ShmRegion)) {
+    ptr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+
+  if (ptr == MAP_FAILED)
+    return make_unexpected(make_error_code(errc::invalid_argument));
+
+  auto* region = static_cast<ShmRegion*>(ptr);
+  size_t capacity = region->capacity;
+  if (region->magic != ShmRegion::kMagic || capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+      ShmRegion::Size(capacity) > size_t(st.st_size)) {
+    munmap(ptr, st.st_size);
+    return make_unexpected(make_error_code(errc::invalid_argument));
+  }
+
+  return unique_ptr<ShmSocket>{new ShmSocket{next, region, size_t(st.st_size), idle_polls}};
+}
+
+ShmSocket::ShmSocket(FiberSocketBase* next, ShmRegion* region, size_t region_size,
+                     uint32_t idle_polls)
+    : FiberSocketBase(next->proactor()),
+      next_(next),
+      region_(region),
+      region_size_(region_size),
+      requests_(region->requests(false)),
+      replies_(region->replies(false)),
+      idle_polls_(idle_polls) {
+}
+
+ShmSocket::~ShmSocket() {
+  munmap(region_, region_size_);
+}
+
+auto ShmSocket::Shutdown(int how) -> error_code {
+  closed_ = true;
+  return next_->Shutdown(how);
+}
+
+auto ShmSocket::Accept() -> AcceptResult {
+  LOG(DFATAL) << "Accept is not supported";
+  return make_unexpected(make_error_code(errc::operation_not_supported));
+}
+
+auto ShmSocket::Connect(const endpoint_type& ep) -> error_code {
+  LOG(DFATAL) << "Connect is not supported";
+  return make_error_code(errc::operation_not_supported);
+}
+
+auto ShmSocket::Close() -> error_code {
+  closed_ = true;
+  return next_->Close();
+}
+
+io::Result<size_t> ShmSocket::RecvMsg(const msghdr& msg, int flags) {
+  while (true) {
+    size_t res = 0;
+    for (size_t i = 0; i < msg.msg_iovlen; ++i) {
+      const iovec& iov = msg.msg_iov[i];
+      size_t read = requests_.Read(static_cast<uint8_t*>(iov.iov_base), iov.iov_len);
+      res += read;
+      if (read < iov.iov_len)
+        break;
+    }
+
+    if (res > 0) {
+      if (requests_.TakeWriter())
+        requests_.FutexWakeWriter();
+      return res;
+    }
+
+    if (closed_)
+      return make_unexpected(make_error_code(errc::connection_aborted));
+
+    if (error_code ec = WaitForRequests(); ec)
+      return make_unexpected(ec);
+  }
+}
+
+error_code ShmSocket::WaitForRequests() {
+  // Pipelining clients write the next requests while the server runs the current ones,
+  // so the ring is polled while the thread has nothing else to run.
+  for (uint32_t i = 0; i < idle_polls_; ++i) {
+    boost::this_fiber::yield();
+    if (!requests_.empty())
+      return {};
+  }
+
+  if (!requests_.ArmReader()) {
+    requests_.TakeReader();
+    return {};
+  }
+
+  // The client rings the doorbell with a byte once it writes into the ring of a sleeping server.
+  uint8_t buf[64];
+  io::Result<size_t> res = next_->Recv(buf);
+  if (!res || *res == 0) {
+    closed_ = true;
+    return res ? make_error_code(errc::connection_aborted) : res.error();
+  }
+  requests_.TakeReader();
+
+  return {};
+}
+
+io::Result<size_t> ShmSocket::WriteSome(const iovec* v, uint32_t len) {
+  uint32_t wait_usec = 10;
+  while (true) {
+    size_t res = 0, total = 0;
+    for (uint32_t i = 0; i < len; ++i) {
+      size_t written = replies_.Write(static_cast<const uint8_t*>(v[i].iov_base), v[i].iov_len);
+      res += written;
+      total += v[i].iov_len;
+      if (written < v[i].iov_len)
+        break;
+    }
+
+    if (res > 0 || total == 0) {
+      if (replies_.TakeReader())
+        replies_.FutexWakeReader();
+      return res;
+    }
+
+    if (!IsOpen())
+      return make_unexpected(make_error_code(errc::connection_aborted));
+
+    // The client reads the replies in its own thread and does not wake up the server,
+    // hence the server polls until the client frees some space.
+    fibers_ext::SleepFor(chrono::microseconds(wait_usec));
+    wait_usec = min(wait_usec * 2, kMaxReplyWaitUsec);
+  }
+}
+
+void ShmSocket::AsyncWriteSome(const iovec* v, uint32_t len, AsyncWriteCb cb) {
+  cb(WriteSome(v, len));
+}
+
+auto ShmSocket::LocalEndpoint() const -> endpoint_type {
+  return next_->LocalEndpoint();
+}
+
+auto ShmSocket::RemoteEndpoint() const -> endpoint_type {
+  return next_->RemoteEndpoint();
+}
+
+uint32_t ShmSocket::PollEvent(uint32_t event_mask, std::function<void(uint32_t)> cb) {
+  return next_->PollEvent(event_mask, std::move(cb));
+}
+
+uint32_t ShmSocket::CancelPoll(uint32_t id) {
+  return next_->CancelPoll(id);
+}
+
+bool ShmSocket::IsUDS() const {
+  return true;
+}
+
+auto ShmSocket::native_handle() const -> native_handle_type {
+  return next_->native_handle();
+}
+
+}  // namespace facade
@@ -0,0 +1,67 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <memory>
+#include <string_view>
+
+#include "facade/shm_ring.h"
+#include "util/fiber_socket_base.h"
+
+namespace facade {
+
+// Server side of the shared-memory transport for clients on the same host, see --shm_transport.
+// The client connects to the unix socket, creates a ShmRegion and sends its name in the handshake
+// line, see ShmRegion::kHandshake. From then on the requests and the replies pass through the
+// rings of the region, and the socket serves only to wake up the server and to tell that the
+// client is gone.
+// The socket wraps the unix socket the same way the TLS socket does, so the connection parses and
+// dispatches the requests as usual.
+class ShmSocket : public util::FiberSocketBase {
+ public:
+  // Maps the region and unlinks its name. next is the unix socket of the handshake.
+  // The reading fiber yields up to idle_polls times before it sleeps on the socket.
+  static io::Result<std::unique_ptr<ShmSocket>> Open(util::FiberSocketBase* next,
+                                                      std::string_view name, uint32_t idle_polls);
+
+  ~ShmSocket();
+
+  error_code Shutdown(int how) override;
+  AcceptResult Accept() override;
+  error_code Connect(const endpoint_type& ep) override;
+  error_code Close() override;
+
+  bool IsOpen() const override {
+    return !closed_ && next_->IsOpen();
+  }
+
+  io::Result<size_t> RecvMsg(const msghdr& msg, int flags) override;
+  io::Result<size_t> WriteSome(const iovec* v, uint32_t len) override;
+  void AsyncWriteSome(const iovec* v, uint32_t len, AsyncWriteCb cb) override;
+
+  endpoint_type LocalEndpoint() const override;
+  endpoint_type RemoteEndpoint() const override;
+  uint32_t PollEvent(uint32_t event_mask, std::function<void(uint32_t)> cb) override;
+  uint32_t CancelPoll(uint32_t id) override;
+  bool IsUDS() const override;
+  native_handle_type native_handle() const override;
+
+ private:
+  ShmSocket(util::FiberSocketBase* next, ShmRegion* region, size_t region_size,
+            uint32_t idle_polls);
+
+  // Returns once there are requests in the ring or the client is gone.
+  std::error_code WaitForRequests();
+
+  util::FiberSocketBase* next_;
+  ShmRegion* region_;
+  size_t region_size_;
+  ShmRing requests_;
+  ShmRing replies_;
+  uint32_t idle_polls_;
+  bool closed_ = false;
+};
+
+}  // namespace facade
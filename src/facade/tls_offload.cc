@@ -0,0 +1,183 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/tls_offload.h"
+
+#include <absl/strings/escaping.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <linux/tls.h>
+#include <netinet/tcp.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/ssl.h>
+#include <sys/socket.h>
+
+#include <cstring>
+#include <string>
+
+#include "base/logging.h"
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+namespace facade {
+
+using namespace std;
+
+namespace {
+
+// The application traffic secrets of a connection, reported by the keylog callback.
+struct TrafficSecrets {
+  string client;
+  string server;
+
+  ~TrafficSecrets() {
+    OPENSSL_cleanse(client.data(), client.size());
+    OPENSSL_cleanse(server.data(), server.size());
+  }
+};
+
+void FreeSecrets(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp) {
+  delete static_cast<TrafficSecrets*>(ptr);
+}
+
+int SecretsIndex() {
+  static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, FreeSecrets);
+  return index;
+}
+
+// The line has the NSS key log format: "<label> <client random> <secret>" in hex.
+void KeylogCb(const SSL* ssl, const char* line) {
+  vector<string_view> parts = absl::StrSplit(line, ' ');
+  if (parts.size() != 3 ||
+      (parts[0] != "CLIENT_TRAFFIC_SECRET_0" && parts[0] != "SERVER_TRAFFIC_SECRET_0")) {
+    return;
+  }
+
+  auto* secrets = static_cast<TrafficSecrets*>(SSL_get_ex_data(ssl, SecretsIndex()));
+  if (!secrets) {
+    secrets = new TrafficSecrets;
+    SSL_set_ex_data(const_cast<SSL*>(ssl), SecretsIndex(), secrets);
+  }
+
+  string& dest = parts[0][0] == 'C' ? secrets->client : secrets->server;
+  dest = absl::HexStringToBytes(parts[2]);
+}
+
+// HKDF-Expand-Label of RFC 8446 with an empty context.
+bool ExpandLabel(const EVP_MD* md, const string& secret, string_view label, uint8_t* out,
+                 size_t len) {
+  string full_label = absl::StrCat("tls13 ", label);
+  string info;
+  info.push_back(char(len >> 8));
+  info.push_back(char(len & 0xFF));
+  info.push_back(char(full_label.size()));
+  info.append(full_label);
+  info.push_back(0);
+
+  EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+  bool res =
+      pctx && EVP_PKEY_derive_init(pctx) > 0 &&
+      EVP_PKEY_CTX_hkdf_mode(pctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+      EVP_PKEY_CTX_set_hkdf_md(pctx, md) > 0 &&
+      EVP_PKEY_CTX_set1_hkdf_key(pctx, reinterpret_cast<const uint8_t*>(secret.data()),
+                                 secret.size()) > 0 &&
+      EVP_PKEY_CTX_add1_hkdf_info(pctx, reinterpret_cast<const uint8_t*>(info.data()),
+                                  info.size()) > 0 &&
+      EVP_PKEY_derive(pctx, out, &len) > 0;
+  EVP_PKEY_CTX_free(pctx);
+
+  return res;
+}
+
+// Derives the key and the iv from the traffic secret and installs them for the direction,
+// TLS_TX or TLS_RX. CryptoInfo is one of the tls12_crypto_info_aes_gcm_xxx structs.
+template <typename CryptoInfo>
+bool InstallKeys(int fd, int direction, uint16_t cipher_type, const EVP_MD* md,
+                 const string& secret) {
+  CryptoInfo info;
+  memset(&info, 0, sizeof(info));
+  info.info.version = TLS_1_3_VERSION;
+  info.info.cipher_type = cipher_type;
+
+  // The kernel splits the iv into the salt and the explicit part of the nonce.
+  uint8_t iv[sizeof(info.salt) + sizeof(info.iv)];
+  bool res = ExpandLabel(md, secret, "key", info.key, sizeof(info.key)) &&
+             ExpandLabel(md, secret, "iv", iv, sizeof(iv));
+  if (res) {
+    memcpy(info.salt, iv, sizeof(info.salt));
+    memcpy(info.iv, iv + sizeof(info.salt), sizeof(info.iv));
+
+    // The sequence numbers of the records start from 0 with the application keys.
+    res = setsockopt(fd, SOL_TLS, direction, &info, sizeof(info)) == 0;
+  }
+
+  OPENSSL_cleanse(&info, sizeof(info));
+  OPENSSL_cleanse(iv, sizeof(iv));
+
+  return res;
+}
+
+template <typename CryptoInfo>
+TlsOffloadResult Install(int fd, uint16_t cipher_type, const EVP_MD* md,
+                         const TrafficSecrets& secrets) {
+  // The socket keeps working with OpenSSL as long as no keys were installed.
+  if (!InstallKeys<CryptoInfo>(fd, TLS_RX, cipher_type, md, secrets.client)) {
+    VLOG(1) << "Could not install the TLS RX keys " << errno;
+    return TlsOffloadResult::NOT_SUPPORTED;
+  }
+
+  if (!InstallKeys<CryptoInfo>(fd, TLS_TX, cipher_type, md, secrets.server)) {
+    LOG(WARNING) << "Could not install the TLS TX keys " << errno;
+    return TlsOffloadResult::FAILED;
+  }
+
+  return TlsOffloadResult::OFFLOADED;
+}
+
+}  // namespace
+
+void PrepareTlsOffload(SSL_CTX* ctx) {
+  SSL_CTX_set_keylog_callback(ctx, KeylogCb);
+  SSL_CTX_set_num_tickets(ctx, 0);
+}
+
+TlsOffloadResult OffloadTls(SSL* ssl, int fd) {
+  auto* secrets = static_cast<TrafficSecrets*>(SSL_get_ex_data(ssl, SecretsIndex()));
+  if (!secrets || secrets->client.empty() || secrets->server.empty() ||
+      SSL_version(ssl) != TLS1_3_VERSION) {
+    return TlsOffloadResult::NOT_SUPPORTED;
+  }
+
+  // The records that OpenSSL has already read would be lost.
+  if (SSL_pending(ssl) > 0 || BIO_ctrl_pending(SSL_get_rbio(ssl)) > 0)
+    return TlsOffloadResult::NOT_SUPPORTED;
+
+  uint16_t cipher = SSL_CIPHER_get_protocol_id(SSL_get_current_cipher(ssl));
+  if (cipher != 0x1301 && cipher != 0x1302)  // TLS_AES_128_GCM_SHA256, TLS_AES_256_GCM_SHA384
+    return TlsOffloadResult::NOT_SUPPORTED;
+
+  if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0) {
+    VLOG(1) << "Kernel TLS is not available " << errno;
+    return TlsOffloadResult::NOT_SUPPORTED;
+  }
+
+  TlsOffloadResult res;
+  if (cipher == 0x1301) {
+    res = Install<tls12_crypto_info_aes_gcm_128>(fd, TLS_CIPHER_AES_GCM_128, EVP_sha256(),
+                                                 *secrets);
+  } else {
+    res = Install<tls12_crypto_info_aes_gcm_256>(fd, TLS_CIPHER_AES_GCM_256, EVP_sha384(),
+                                                 *secrets);
+  }
+
+  SSL_set_ex_data(ssl, SecretsIndex(), nullptr);
+  delete secrets;
+
+  return res;
+}
+
+}  // namespace facade
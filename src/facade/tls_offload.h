@@ -0,0 +1,30 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+typedef struct ssl_ctx_st SSL_CTX;
+typedef struct ssl_st SSL;
+
+namespace facade {
+
+// Kernel TLS offload, see --tls_offload. The handshake runs in user space with OpenSSL, then the
+// application traffic keys are installed into the socket and the kernel encrypts and decrypts
+// the records, so that the connection reads and writes plaintext directly from the socket.
+// Only TLS 1.3 with the AES-GCM ciphers is offloaded, other connections keep using OpenSSL.
+
+// Captures the traffic secrets of the handshakes of ctx. Disables the session tickets, since
+// they are sent with the application keys before the keys could be installed.
+void PrepareTlsOffload(SSL_CTX* ctx);
+
+enum class TlsOffloadResult {
+  OFFLOADED,
+  NOT_SUPPORTED,  // the connection keeps using OpenSSL.
+  FAILED,         // the socket accepted only a part of the keys and can not be used anymore.
+};
+
+// Called right after the handshake of ssl on the socket fd completed.
+TlsOffloadResult OffloadTls(SSL* ssl, int fd);
+
+}  // namespace facade
@@ -0,0 +1,158 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "facade/tls_offload.h"
+
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace testing;
+using namespace std;
+
+namespace facade {
+
+// The connections that can not be offloaded keep using OpenSSL. The sockets of the tests are
+// unix sockets, which have no kernel TLS, hence even the connections that qualify fall back.
+class TlsOffloadTest : public Test {
+ protected:
+  void SetUp() override;
+  void TearDown() override;
+
+  // Runs the handshake of a client and a server that are connected by a BIO pair.
+  bool Handshake(SSL_CTX* server_ctx, int max_version = TLS1_3_VERSION,
+                 const char* ciphersuites = nullptr);
+
+  SSL_CTX* server_ctx_ = nullptr;  // with PrepareTlsOffload.
+  SSL_CTX* plain_ctx_ = nullptr;
+  SSL_CTX* client_ctx_ = nullptr;
+  SSL* server_ = nullptr;
+  SSL* client_ = nullptr;
+  int fds_[2] = {-1, -1};
+};
+
+void TlsOffloadTest::SetUp() {
+  EVP_PKEY* pkey = nullptr;
+  EVP_PKEY_CTX* kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+  ASSERT_GT(EVP_PKEY_keygen_init(kctx), 0);
+  ASSERT_GT(EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx, NID_X9_62_prime256v1), 0);
+  ASSERT_GT(EVP_PKEY_keygen(kctx, &pkey), 0);
+  EVP_PKEY_CTX_free(kctx);
+
+  // A self-signed certificate, the client does not verify it.
+  X509* cert = X509_new();
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+  X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+  X509_set_pubkey(cert, pkey);
+  X509_NAME* name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                             reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  ASSERT_GT(X509_sign(cert, pkey, EVP_sha256()), 0);
+
+  for (SSL_CTX** ctx : {&server_ctx_, &plain_ctx_}) {
+    *ctx = SSL_CTX_new(TLS_server_method());
+    ASSERT_EQ(1, SSL_CTX_use_certificate(*ctx, cert));
+    ASSERT_EQ(1, SSL_CTX_use_PrivateKey(*ctx, pkey));
+  }
+  PrepareTlsOffload(server_ctx_);
+  X509_free(cert);
+  EVP_PKEY_free(pkey);
+
+  client_ctx_ = SSL_CTX_new(TLS_client_method());
+  SSL_CTX_set_verify(client_ctx_, SSL_VERIFY_NONE, nullptr);
+
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds_));
+}
+
+void TlsOffloadTest::TearDown() {
+  SSL_free(server_);
+  SSL_free(client_);
+  SSL_CTX_free(server_ctx_);
+  SSL_CTX_free(plain_ctx_);
+  SSL_CTX_free(client_ctx_);
+  for (int fd : fds_) {
+    if (fd >= 0)
+      close(fd);
+  }
+}
+
+bool TlsOffloadTest::Handshake(SSL_CTX* server_ctx, int max_version, const char* ciphersuites) {
+  SSL_CTX_set_max_proto_version(client_ctx_, max_version);
+  if (ciphersuites)
+    SSL_CTX_set_ciphersuites(client_ctx_, ciphersuites);
+
+  server_ = SSL_new(server_ctx);
+  client_ = SSL_new(client_ctx_);
+  BIO *server_bio, *client_bio;
+  if (BIO_new_bio_pair(&server_bio, 0, &client_bio, 0) != 1)
+    return false;
+  SSL_set_bio(server_, server_bio, server_bio);
+  SSL_set_bio(client_, client_bio, client_bio);
+  SSL_set_accept_state(server_);
+  SSL_set_connect_state(client_);
+
+  for (unsigned i = 0; i < 10; ++i) {
+    int client_res = SSL_do_handshake(client_);
+    int server_res = SSL_do_handshake(server_);
+    if (client_res == 1 && server_res == 1)
+      return true;
+  }
+  return false;
+}
+
+TEST_F(TlsOffloadTest, NoSessionTickets) {
+  EXPECT_EQ(0u, SSL_CTX_get_num_tickets(server_ctx_));
+  EXPECT_GT(SSL_CTX_get_num_tickets(plain_ctx_), 0u);
+}
+
+TEST_F(TlsOffloadTest, NotPrepared) {
+  ASSERT_TRUE(Handshake(plain_ctx_));
+  EXPECT_EQ(TlsOffloadResult::NOT_SUPPORTED, OffloadTls(server_, fds_[0]));
+}
+
+TEST_F(TlsOffloadTest, Tls12) {
+  ASSERT_TRUE(Handshake(server_ctx_, TLS1_2_VERSION));
+  EXPECT_EQ(TLS1_2_VERSION, SSL_version(server_));
+  EXPECT_EQ(TlsOffloadResult::NOT_SUPPORTED, OffloadTls(server_, fds_[0]));
+}
+
+TEST_F(TlsOffloadTest, ChaCha20) {
+  ASSERT_TRUE(Handshake(server_ctx_, TLS1_3_VERSION, "TLS_CHACHA20_POLY1305_SHA256"));
+  EXPECT_EQ(TlsOffloadResult::NOT_SUPPORTED, OffloadTls(server_, fds_[0]));
+}
+
+// The records that the client sent right after the handshake are buffered by OpenSSL.
+TEST_F(TlsOffloadTest, PendingRecords) {
+  ASSERT_TRUE(Handshake(server_ctx_));
+  ASSERT_EQ(4, SSL_write(client_, "ping", 4));
+  EXPECT_EQ(TlsOffloadResult::NOT_SUPPORTED, OffloadTls(server_, fds_[0]));
+
+  char buf[4];
+  ASSERT_EQ(4, SSL_read(server_, buf, sizeof(buf)));
+  EXPECT_EQ("ping", string_view(buf, sizeof(buf)));
+}
+
+TEST_F(TlsOffloadTest, NoKernelTls) {
+  for (const char* suite : {"TLS_AES_128_GCM_SHA256", "TLS_AES_256_GCM_SHA384"}) {
+    SSL_free(server_);
+    SSL_free(client_);
+    ASSERT_TRUE(Handshake(server_ctx_, TLS1_3_VERSION, suite)) << suite;
+    EXPECT_EQ(TlsOffloadResult::NOT_SUPPORTED, OffloadTls(server_, fds_[0])) << suite;
+
+    // The connection keeps working with OpenSSL.
+    char buf[4];
+    ASSERT_EQ(4, SSL_write(server_, "pong", 4));
+    ASSERT_EQ(4, SSL_read(client_, buf, sizeof(buf)));
+    EXPECT_EQ("pong", string_view(buf, sizeof(buf)));
+  }
+}
+
+}  // namespace facade
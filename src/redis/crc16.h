@@ -0,0 +1,8 @@
+#ifndef CRC16_H
+#define CRC16_H
+
+#include <stdint.h>
+
+uint16_t crc16(const char *buf, int len);
+
+#endif
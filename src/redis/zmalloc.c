@@ -98,6 +98,10 @@ static void (*zmalloc_oom_handler)(size_t) = zmalloc_default_oom;
 void init_zmalloc_threadlocal() {
 }
 
+void zmalloc_set_sample_hooks(size_t sample_bytes, void (*on_alloc)(void*, size_t),
+                              int (*on_free)(void*)) {
+}
+
 /* Try allocating memory, and return NULL if failed.
  * '*usable' is set to the usable size if non NULL. */
 void *ztrymalloc_usable(size_t size, size_t *usable) {
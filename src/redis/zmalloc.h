@@ -122,6 +122,13 @@ int zmalloc_page_is_underutilized(void *ptr, float ratio);
 void init_zmalloc_threadlocal(void* heap);
 extern __thread ssize_t zmalloc_used_memory_tl;
 
+/* Heap profiling. Every sample_bytes of the allocations of a thread, the allocation that crosses
+ * the boundary is passed to on_alloc. While the thread has sampled blocks, its frees are passed
+ * to on_free which returns nonzero if the block was sampled. sample_bytes = 0 disables it.
+ * Must be called before the threads start allocating. */
+void zmalloc_set_sample_hooks(size_t sample_bytes, void (*on_alloc)(void* ptr, size_t usable),
+                              int (*on_free)(void* ptr));
+
 #undef __zm_str
 #undef __xstr
 
@@ -12,6 +12,31 @@
 __thread ssize_t zmalloc_used_memory_tl = 0;
 __thread mi_heap_t* zmalloc_heap = NULL;
 
+/* Heap profiling, see zmalloc_set_sample_hooks. */
+static size_t sample_bytes = 0;
+static void (*sample_alloc_cb)(void*, size_t) = NULL;
+static int (*sample_free_cb)(void*) = NULL;
+static __thread ssize_t sample_countdown_tl = 0;
+static __thread size_t sampled_blocks_tl = 0;
+
+static inline void sample_alloc(void* ptr, size_t usable) {
+  if (sample_bytes == 0)
+    return;
+  sample_countdown_tl -= usable;
+  if (sample_countdown_tl < 0) {
+    sample_countdown_tl += sample_bytes;
+    if (sample_countdown_tl < 0)  // a block larger than sample_bytes.
+      sample_countdown_tl = sample_bytes;
+    ++sampled_blocks_tl;
+    sample_alloc_cb(ptr, usable);
+  }
+}
+
+static inline void sample_free(void* ptr) {
+  if (sampled_blocks_tl && sample_free_cb(ptr))
+    --sampled_blocks_tl;
+}
+
 /* Allocate memory or panic */
 void* zmalloc(size_t size) {
   assert(zmalloc_heap);
@@ -22,6 +47,7 @@ void* zmalloc(size_t size) {
   // doing accounting.
   // assert(usable == mi_good_size(size));
   zmalloc_used_memory_tl += usable;
+  sample_alloc(res, usable);
 
   return res;
 }
@@ -39,6 +65,7 @@ void zfree(void* ptr) {
 
   // assert(zmalloc_used_memory_tl >= (ssize_t)usable);
   zmalloc_used_memory_tl -= usable;
+  sample_free(ptr);
 
   mi_free_size(ptr, usable);
 }
@@ -54,6 +81,7 @@ void* zcalloc(size_t size) {
   void* res = mi_heap_calloc(zmalloc_heap, 1, size);
   size_t usable = mi_usable_size(res);
   zmalloc_used_memory_tl += usable;
+  sample_alloc(res, usable);
 
   return res;
 }
@@ -65,17 +93,20 @@ void* zmalloc_usable(size_t size, size_t* usable) {
   *usable = uss;
 
   zmalloc_used_memory_tl += uss;
+  sample_alloc(res, uss);
 
   return res;
 }
 
 void* zrealloc_usable(void* ptr, size_t size, size_t* usable) {
   ssize_t prev = mi_usable_size(ptr);
+  sample_free(ptr);
 
   void* res = mi_heap_realloc(zmalloc_heap, ptr, size);
   ssize_t uss = mi_usable_size(res);
   *usable = uss;
   zmalloc_used_memory_tl += (uss - prev);
+  sample_alloc(res, uss);
 
   return res;
 }
@@ -87,6 +118,7 @@ size_t znallocx(size_t size) {
 void zfree_size(void* ptr, size_t size) {
   ssize_t uss = mi_usable_size(ptr);
   zmalloc_used_memory_tl -= uss;
+  sample_free(ptr);
   mi_free_size(ptr, uss);
 }
 
@@ -100,6 +132,7 @@ void* ztrycalloc(size_t size) {
   zmalloc_used_memory_tl += g;
   void* ptr = mi_heap_calloc(zmalloc_heap, 1, size);
   assert(mi_usable_size(ptr) == g);
+  sample_alloc(ptr, g);
   return ptr;
 }
 
@@ -138,6 +171,13 @@ void init_zmalloc_threadlocal(void* heap) {
   zmalloc_heap = heap;
 }
 
+void zmalloc_set_sample_hooks(size_t bytes, void (*on_alloc)(void*, size_t),
+                              int (*on_free)(void*)) {
+  sample_alloc_cb = on_alloc;
+  sample_free_cb = on_free;
+  sample_bytes = bytes;
+}
+
 int zmalloc_page_is_underutilized(void* ptr, float ratio) {
   return mi_heap_page_is_underutilized(zmalloc_heap, ptr, ratio);
 }
@@ -0,0 +1,123 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/big_keys.h"
+
+#include <absl/numeric/bits.h>
+
+#include <algorithm>
+
+#include "base/logging.h"
+#include "server/db_slice.h"
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+// Orders the keys by their size, the largest first. As the comparator of a heap, keeps the
+// smallest key at its front.
+bool Larger(const BigKeys::Key& l, const BigKeys::Key& r) {
+  return l.bytes > r.bytes;
+}
+
+}  // namespace
+
+void BigKeys::Report::Merge(const Report& o, size_t max_keys) {
+  for (unsigned type = 0; type < kObjTypeMax; ++type) {
+    TypeStats& dest = types[type];
+    const TypeStats& src = o.types[type];
+    dest.keys += src.keys;
+    dest.bytes += src.bytes;
+    for (unsigned i = 0; i < kHistBuckets; ++i)
+      dest.histogram[i] += src.histogram[i];
+
+    dest.largest.insert(dest.largest.end(), src.largest.begin(), src.largest.end());
+    sort(dest.largest.begin(), dest.largest.end(), Larger);
+    if (dest.largest.size() > max_keys)
+      dest.largest.resize(max_keys);
+  }
+
+  // The merged report is as old as its oldest part.
+  finished_ms = min(finished_ms, o.finished_ms);
+  duration_ms = max(duration_ms, o.duration_ms);
+}
+
+unsigned BigKeys::HistBucket(size_t bytes) {
+  if (bytes == 0)
+    return 0;
+  return min<unsigned>(absl::bit_width(bytes) - 1, kHistBuckets - 1);
+}
+
+bool BigKeys::Step(DbSlice* slice, uint64_t now_ms) {
+  // Every traverse visits a logical bucket, i.e. few dozens of entries at most.
+  constexpr unsigned kMaxTraverses = 50;
+
+  if (!running_) {
+    running_ = true;
+    db_ = 0;
+    cursor_ = 0;
+    start_ms_ = now_ms;
+    current_ = Report{};
+  }
+
+  unsigned traverses = 0;
+  while (traverses < kMaxTraverses && db_ < slice->db_array_size()) {
+    if (!slice->IsDbValid(db_)) {
+      ++db_;
+      cursor_ = 0;
+      continue;
+    }
+
+    PrimeTable* prime = slice->GetPrimeTable(db_);
+    PrimeTable::Cursor cur = cursor_;
+    cur = prime->Traverse(cur, [&](PrimeIterator it) { Add(db_, it->first, it->second); });
+    ++traverses;
+
+    cursor_ = cur.value();
+    if (cursor_ == 0)
+      ++db_;
+  }
+
+  if (db_ < slice->db_array_size())
+    return false;
+
+  for (TypeStats& ts : current_.types) {
+    sort(ts.largest.begin(), ts.largest.end(), Larger);
+  }
+  current_.finished_ms = now_ms;
+  current_.duration_ms = now_ms - start_ms_;
+  last_ = std::move(current_);
+  running_ = false;
+
+  VLOG(1) << "shard " << slice->shard_id() << ": finished the big keys pass in "
+          << last_.duration_ms << "ms";
+  return true;
+}
+
+void BigKeys::Add(DbIndex db, const PrimeKey& pk, const PrimeValue& pv) {
+  unsigned type = pv.ObjType();
+  if (type >= kObjTypeMax)
+    return;
+
+  size_t bytes = pk.MallocUsed() + pv.MallocUsed();
+  TypeStats& ts = current_.types[type];
+  ++ts.keys;
+  ts.bytes += bytes;
+  ++ts.histogram[HistBucket(bytes)];
+
+  // The keys are copied only when they enter the heap of the largest ones.
+  vector<Key>& largest = ts.largest;
+  if (largest.size() < kTopKeys) {
+    largest.push_back(Key{string(pk.GetSlice(&scratch_)), db, bytes});
+    push_heap(largest.begin(), largest.end(), Larger);
+  } else if (bytes > largest.front().bytes) {
+    pop_heap(largest.begin(), largest.end(), Larger);
+    largest.back() = Key{string(pk.GetSlice(&scratch_)), db, bytes};
+    push_heap(largest.begin(), largest.end(), Larger);
+  }
+}
+
+}  // namespace dfly
@@ -0,0 +1,77 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+
+#include "server/table.h"
+
+namespace dfly {
+
+class DbSlice;
+
+// Finds the largest keys of a shard and the distribution of the value sizes by type, in passes
+// over all its databases that run in small steps when the shard is idle. MEMORY BIGKEYS reads
+// the result of the last finished pass, so it does not traverse anything. The tables change
+// during a pass, hence a key may be missed or visited twice, as with SCAN.
+class BigKeys {
+ public:
+  static constexpr size_t kTopKeys = 16;  // per type.
+  static constexpr unsigned kHistBuckets = 40;
+
+  struct Key {
+    std::string key;
+    DbIndex db = 0;
+    size_t bytes = 0;  // of the key and the value.
+  };
+
+  struct TypeStats {
+    size_t keys = 0;
+    size_t bytes = 0;
+
+    // Entry i counts the keys of [2^i, 2^(i+1)) bytes, the first one also these below.
+    std::array<size_t, kHistBuckets> histogram = {};
+
+    // The largest keys first.
+    std::vector<Key> largest;
+  };
+
+  struct Report {
+    std::array<TypeStats, kObjTypeMax> types;
+    uint64_t finished_ms = 0;  // when the pass finished, 0 if none did.
+    uint64_t duration_ms = 0;
+
+    // Accumulates the report of another shard, keeping up to max_keys of the largest keys.
+    void Merge(const Report& o, size_t max_keys);
+  };
+
+  static unsigned HistBucket(size_t bytes);
+
+  // Visits a bounded number of buckets, starting a new pass if none is running. Returns true
+  // if it finished the pass.
+  bool Step(DbSlice* slice, uint64_t now_ms);
+
+  bool running() const {
+    return running_;
+  }
+
+  const Report& last() const {
+    return last_;
+  }
+
+ private:
+  void Add(DbIndex db, const PrimeKey& pk, const PrimeValue& pv);
+
+  Report current_, last_;
+  bool running_ = false;
+  DbIndex db_ = 0;
+  uint64_t cursor_ = 0;
+  uint64_t start_ms_ = 0;
+  std::string scratch_;
+};
+
+}  // namespace dfly
@@ -5,12 +5,16 @@
 #include "server/bitops_family.h"
 
 #include <bitset>
+#include <cstring>
 
 extern "C" {
 #include "redis/object.h"
 }
 
+#include "base/flags.h"
 #include "base/logging.h"
+#include "core/bitops.h"
+#include "core/roaring_bitmap.h"
 #include "server/command_registry.h"
 #include "server/common.h"
 #include "server/conn_context.h"
@@ -20,12 +24,23 @@ extern "C" {
 #include "server/transaction.h"
 #include "util/varz.h"
 
+ABSL_FLAG(uint32_t, bitmap_roaring_min_len, 8192,
+          "String values of at least this length that are modified as bitmaps are stored as "
+          "roaring bitmaps when that takes at least 4 times less memory. 0 disables them.");
+
 namespace dfly {
 using namespace facade;
 
 namespace {
 
-using ShardStringResults = std::vector<OpResult<std::string>>;
+// A source or a result of BITOP: the bytes of a string, or a serialized roaring bitmap. Bitmaps
+// travel between the threads serialized, so that each thread allocates its own.
+struct BitOpValue {
+  std::string data;
+  bool is_bitmap = false;
+};
+
+using ShardBitOpResults = std::vector<OpResult<BitOpValue>>;
 const int32_t OFFSET_FACTOR = 8;  // number of bits in byte
 const char* OR_OP_NAME = "OR";
 const char* XOR_OP_NAME = "XOR";
@@ -44,80 +59,31 @@ void BitOp(CmdArgList args, ConnectionContext* cntx);
 void GetBit(CmdArgList args, ConnectionContext* cntx);
 void SetBit(CmdArgList args, ConnectionContext* cntx);
 
-OpResult<std::string> ReadValue(const DbContext& context, std::string_view key, EngineShard* shard);
 OpResult<bool> ReadValueBitsetAt(const OpArgs& op_args, std::string_view key, uint32_t offset);
 OpResult<std::size_t> CountBitsForValue(const OpArgs& op_args, std::string_view key, int64_t start,
                                         int64_t end, bool bit_value);
+OpResult<int64_t> FindFirstBitWithValue(const OpArgs& op_args, std::string_view key, bool value,
+                                        int64_t start, int64_t end, bool as_bit);
 std::string GetString(const PrimeValue& pv, EngineShard* shard);
+std::string ReadExternalRange(const PrimeValue& pv, EngineShard* shard, std::size_t start,
+                              std::size_t end);
+std::string_view GetStringSlice(const PrimeValue& pv, EngineShard* shard, std::string* scratch);
 bool SetBitValue(uint32_t offset, bool bit_value, std::string* entry);
 std::size_t CountBitSetByByteIndices(std::string_view at, std::size_t start, std::size_t end);
 std::size_t CountBitSet(std::string_view str, int64_t start, int64_t end, bool bits);
 std::size_t CountBitSetByBitIndices(std::string_view at, std::size_t start, std::size_t end);
-OpResult<std::string> RunBitOpOnShard(std::string_view op, const OpArgs& op_args, ArgSlice keys);
+OpResult<BitOpValue> RunBitOpOnShard(std::string_view op, const OpArgs& op_args, ArgSlice keys);
 std::string RunBitOperationOnValues(std::string_view op, const BitsStrVec& values);
+BitOpValue RunBitOperationOnValues(std::string_view op, std::vector<BitOpValue> values);
 
 // ------------------------------------------------------------------------- //
 
-// This function can be used for any case where we allowing out of bound
-// access where the default in this case would be 0 -such as bitop
-uint8_t GetByteAt(std::string_view s, std::size_t at) {
-  return at >= s.size() ? 0 : s[at];
-}
-
-// For XOR, OR, AND operations on a collection of bytes
-template <typename BitOp, typename SkipOp>
-std::string BitOpString(BitOp operation_f, SkipOp skip_f, const BitsStrVec& values,
-                        std::string new_value) {
-  // at this point, values are not empty
-  std::size_t max_size = new_value.size();
-
-  if (values.size() > 1) {
-    for (std::size_t i = 0; i < max_size; i++) {
-      std::uint8_t new_entry = operation_f(GetByteAt(values[0], i), GetByteAt(values[1], i));
-      for (std::size_t j = 2; j < values.size(); ++j) {
-        new_entry = operation_f(new_entry, GetByteAt(values[j], i));
-        if (skip_f(new_entry)) {
-          break;
-        }
-      }
-      new_value[i] = new_entry;
-    }
-    return new_value;
-  } else {
-    return values[0];
-  }
-}
-
-// Helper functions to support operations
-// so we would not need to check which
-// operations to run in the look (unlike
-// https://github.com/redis/redis/blob/c2b0c13d5c0fab49131f6f5e844f80bfa43f6219/src/bitops.c#L607)
-constexpr bool SkipAnd(uint8_t byte) {
-  return byte == 0x0;
-}
-
-constexpr bool SkipOr(uint8_t byte) {
-  return byte == 0xff;
-}
-
-constexpr bool SkipXor(uint8_t) {
-  return false;
-}
-
-constexpr uint8_t AndOp(uint8_t left, uint8_t right) {
-  return left & right;
-}
-
-constexpr uint8_t OrOp(uint8_t left, uint8_t right) {
-  return left | right;
-}
-
-constexpr uint8_t XorOp(uint8_t left, uint8_t right) {
-  return left ^ right;
-}
+// The result of BITOP is computed in blocks of this size, which stay in the L1 cache while all
+// the values are applied to them.
+constexpr std::size_t kBitOpBlockSize = 16 * 1024;
 
 std::string BitOpNotString(std::string from) {
-  std::transform(from.begin(), from.end(), from.begin(), [](auto c) { return ~c; });
+  BitNot(reinterpret_cast<uint8_t*>(from.data()), from.size());
   return from;
 }
 
@@ -142,94 +108,158 @@ constexpr bool CheckBitStatus(uint8_t byte, uint32_t offset) {
   return byte & (0x1 << offset);
 }
 
-constexpr std::uint8_t CountBitsRange(std::uint8_t byte, std::uint8_t from, uint8_t to) {
-  int count = 0;
-  for (int i = from; i < to; i++) {
-    count += CheckBitStatus(byte, GetNormalizedBitIndex(i));
-  }
-  return count;
-}
-
 // Count the number of bits that are on, on bytes boundaries: i.e. Start and end are the indices for
 // bytes locations inside str CountBitSetByByteIndices
 std::size_t CountBitSetByByteIndices(std::string_view at, std::size_t start, std::size_t end) {
+  end = std::min(end, at.size());  // don't overflow
   if (start >= end) {
     return 0;
   }
-  end = std::min(end, at.size());  // don't overflow
-  std::uint32_t count =
-      std::accumulate(std::next(at.begin(), start), std::next(at.begin(), end), 0,
-                      [](auto counter, uint8_t ch) { return counter + absl::popcount(ch); });
-  return count;
+  return CountBits(reinterpret_cast<const uint8_t*>(at.data()) + start, end - start);
 }
 
 // Count the number of bits that are on, on bits boundaries: i.e. Start and end are the indices for
 // bits locations inside str
 std::size_t CountBitSetByBitIndices(std::string_view at, std::size_t start, std::size_t end) {
-  auto first_byte_index = GetByteIndex(start);
-  auto last_byte_index = GetByteIndex(end);
-  if (start % OFFSET_FACTOR == 0 && end % OFFSET_FACTOR == 0) {
-    return CountBitSetByByteIndices(at, first_byte_index, last_byte_index);
-  }
-  const auto last_bit_first_byte =
-      first_byte_index != last_byte_index ? OFFSET_FACTOR : GetBitIndex(end);
-  const auto first_byte = GetByteValue(at, start);
-  std::uint32_t count = CountBitsRange(first_byte, GetBitIndex(start), last_bit_first_byte);
-  if (first_byte_index < last_byte_index) {
-    first_byte_index++;
-    const auto last_byte = GetByteValue(at, end);
-    count += CountBitsRange(last_byte, 0, GetBitIndex(end));
-    count += CountBitSetByByteIndices(at, first_byte_index, last_byte_index);
+  auto bit_at = [at](std::size_t index) {
+    return CheckBitStatus(GetByteValue(at, index), GetNormalizedBitIndex(index));
+  };
+
+  std::size_t count = 0;
+  for (; start < end && start % OFFSET_FACTOR != 0; ++start) {
+    count += bit_at(start);
+  }
+  const std::size_t bytes_end = end - end % OFFSET_FACTOR;
+  if (start < bytes_end) {
+    count += CountBitSetByByteIndices(at, start / OFFSET_FACTOR, bytes_end / OFFSET_FACTOR);
+    start = bytes_end;
+  }
+  for (; start < end; ++start) {
+    count += bit_at(start);
   }
   return count;
 }
 
+// Normalizes the inclusive range of BITCOUNT over size bytes or bits to [start, end).
+// Returns false if the range is empty.
+bool NormalizeCountRange(int64_t size, int64_t* start, int64_t* end) {
+  auto NormalizedOffset = [size](int64_t orig) {
+    if (orig < 0) {
+      orig = size + orig;
+    }
+    return orig;
+  };
+
+  if (*start > 0 && *end > 0 && *end < *start) {
+    return false;  // for illegal range with positive we just return 0
+  }
+
+  if (*start < 0 && *end < 0 && *start > *end) {
+    return false;  // for illegal range with negative we just return 0
+  }
+
+  *start = NormalizedOffset(*start);
+  if (*end > 0 && *end < *start) {
+    return false;
+  }
+  *end = NormalizedOffset(*end);
+  if (*start > *end) {
+    std::swap(*start, *end);  // we're going backward
+  }
+  *start = std::max<int64_t>(*start, 0);
+  *end = std::min(*end + 1, size);  // don't overflow
+  return *start < *end;
+}
+
 // General purpose function to count the number of bits that are on.
 // The parameters for start, end and bits are defaulted to the start of the string,
 // end of the string and bits are false.
 // Note that when bits is false, it means that we are looking on byte boundaries.
 std::size_t CountBitSet(std::string_view str, int64_t start, int64_t end, bool bits) {
-  const int32_t size = bits ? str.size() * OFFSET_FACTOR : str.size();
+  if (!NormalizeCountRange(bits ? str.size() * OFFSET_FACTOR : str.size(), &start, &end)) {
+    return 0;
+  }
+  return bits ? CountBitSetByBitIndices(str, start, end)
+              : CountBitSetByByteIndices(str, start, end);
+}
 
-  auto NormalizedOffset = [size](int32_t orig) {
-    if (orig < 0) {
-      orig = size + orig;
-    }
-    return orig;
+std::size_t CountBitSet(const RoaringBitmap& bitmap, int64_t start, int64_t end, bool bits) {
+  const std::size_t len = bitmap.ByteLen();
+  if (!NormalizeCountRange(bits ? len * OFFSET_FACTOR : len, &start, &end)) {
+    return 0;
+  }
+  return bits ? bitmap.Count(start, end) : bitmap.Count(start * OFFSET_FACTOR, end * OFFSET_FACTOR);
+}
+
+// Returns the index of the first bit in the range [from, to) of bits that equals value, or -1.
+int64_t FindBitInRange(std::string_view at, int64_t from, int64_t to, bool value) {
+  auto bit_at = [at](int64_t index) {
+    return CheckBitStatus(GetByteValue(at, index), GetNormalizedBitIndex(index));
   };
 
-  if (start > 0 && end > 0 && end < start) {
-    return 0;  // for illegal range with positive we just return 0
+  for (; from < to && from % OFFSET_FACTOR != 0; ++from) {
+    if (bit_at(from) == value) {
+      return from;
+    }
   }
 
-  if (start < 0 && end < 0 && start > end) {
-    return 0;  // for illegal range with negative we just return 0
+  // The whole bytes in between are searched by the kernel.
+  const int64_t bytes_end = to - to % OFFSET_FACTOR;
+  if (from < bytes_end) {
+    const auto* data = reinterpret_cast<const uint8_t*>(at.data()) + from / OFFSET_FACTOR;
+    int64_t pos = FindFirstBit(data, (bytes_end - from) / OFFSET_FACTOR, value);
+    if (pos >= 0) {
+      return from + pos;
+    }
+    from = bytes_end;
   }
 
-  start = NormalizedOffset(start);
-  if (end > 0 && end < start) {
-    return 0;
+  for (; from < to; ++from) {
+    if (bit_at(from) == value) {
+      return from;
+    }
   }
-  end = NormalizedOffset(end);
+  return -1;
+}
+
+// Implements BITPOS on a value of len bytes, following redis: start and end are inclusive, in
+// bytes unless as_bit, and negative values count from the end. When searching for a clear bit
+// without an explicit end, the string is considered to be padded with zeros.
+// find(from, to) returns the first bit in [from, to) that equals value, or -1.
+template <typename F>
+int64_t FindBitPosition(std::size_t len, bool value, int64_t start, int64_t end, bool as_bit,
+                        F&& find) {
+  const bool end_given = end != std::numeric_limits<int64_t>::max();
+  const int64_t size = as_bit ? len * OFFSET_FACTOR : len;
+
+  if (start < 0) {
+    start = std::max<int64_t>(size + start, 0);
+  }
+  if (end < 0) {
+    end = std::max<int64_t>(size + end, 0);
+  }
+  end = std::min(end, size - 1);
   if (start > end) {
-    std::swap(start, end);  // we're going backward
+    return -1;
   }
-  if (end > size) {
-    end = size;  // don't overflow
+
+  const int64_t first_bit = as_bit ? start : start * OFFSET_FACTOR;
+  const int64_t last_bit = as_bit ? end : end * OFFSET_FACTOR + OFFSET_FACTOR - 1;
+  int64_t pos = find(first_bit, last_bit + 1);
+  if (pos < 0 && !value && !end_given) {
+    return len * OFFSET_FACTOR;
   }
-  ++end;
-  return bits ? CountBitSetByBitIndices(str, start, end)
-              : CountBitSetByByteIndices(str, start, end);
+  return pos;
 }
 
 // return true if bit is on
-bool GetBitValue(const std::string& entry, uint32_t offset) {
+bool GetBitValue(std::string_view entry, uint32_t offset) {
   const auto byte_val{GetByteValue(entry, offset)};
   const auto index{GetNormalizedBitIndex(offset)};
   return CheckBitStatus(byte_val, index);
 }
 
-bool GetBitValueSafe(const std::string& entry, uint32_t offset) {
+bool GetBitValueSafe(std::string_view entry, uint32_t offset) {
   return ((entry.size() * OFFSET_FACTOR) > offset) ? GetBitValue(entry, offset) : false;
 }
 
@@ -252,6 +282,38 @@ bool SetBitValue(uint32_t offset, bool bit_value, std::string* entry) {
   return old_value;
 }
 
+// Values are stored as roaring bitmaps if that takes at least 4 times less memory, and are
+// flattened back once it takes more than half of their length, so that a value does not flip
+// between the two on every change.
+bool FitsRoaring(std::string_view bytes) {
+  const uint32_t min_len = absl::GetFlag(FLAGS_bitmap_roaring_min_len);
+  return min_len > 0 && bytes.size() >= min_len &&
+         RoaringBitmap::EstimateMallocUsed(bytes) * 4 <= bytes.size();
+}
+
+bool FitsRoaring(const RoaringBitmap& bitmap) {
+  const uint32_t min_len = absl::GetFlag(FLAGS_bitmap_roaring_min_len);
+  return min_len > 0 && bitmap.ByteLen() >= min_len && bitmap.MallocUsed() * 2 <= bitmap.ByteLen();
+}
+
+void SetBitmapValue(std::string_view bytes, PrimeValue* pv) {
+  if (FitsRoaring(bytes)) {
+    pv->SetBitmap(RoaringBitmap::FromBytes(bytes));
+  } else {
+    pv->SetString(bytes);
+  }
+}
+
+void SetBitmapValue(RoaringBitmap&& bitmap, PrimeValue* pv) {
+  if (FitsRoaring(bitmap)) {
+    pv->SetBitmap(std::move(bitmap));
+  } else {
+    std::string bytes(bitmap.ByteLen(), 0);
+    bitmap.ToBytes(bytes.data());
+    pv->SetString(bytes);
+  }
+}
+
 // ------------------------------------------------------------------------- //
 
 class ElementAccess {
@@ -278,7 +340,22 @@ class ElementAccess {
 
   std::string Value() const;
 
+  // Returns the bitmap the existing value is stored as, or null.
+  RoaringBitmap* Bitmap() const;
+
   void Commit(std::string_view new_value) const;
+
+  // Like Commit, but stores the value as a roaring bitmap if it fits one.
+  void CommitBitmap(std::string_view new_value) const;
+  void CommitBitmap(RoaringBitmap&& bitmap) const;
+
+  // Changes the existing value in place with cb(PrimeValue*).
+  template <typename F> void Update(F&& cb) const {
+    auto& db_slice = shard_->db_slice();
+    db_slice.PreUpdate(Index(), element_iter_);
+    cb(&element_iter_->second);
+    db_slice.PostUpdate(Index(), element_iter_, key_, !added_);
+  }
 };
 
 OpStatus ElementAccess::Find(EngineShard* shard) {
@@ -307,12 +384,26 @@ std::string ElementAccess::Value() const {
   }
 }
 
+RoaringBitmap* ElementAccess::Bitmap() const {
+  CHECK_NOTNULL(shard_);
+  return added_ || !element_iter_->second.IsBitmap() ? nullptr : element_iter_->second.GetBitmap();
+}
+
 void ElementAccess::Commit(std::string_view new_value) const {
   if (shard_) {
-    auto& db_slice = shard_->db_slice();
-    db_slice.PreUpdate(Index(), element_iter_);
-    element_iter_->second.SetString(new_value);
-    db_slice.PostUpdate(Index(), element_iter_, key_, !added_);
+    Update([new_value](PrimeValue* pv) { pv->SetString(new_value); });
+  }
+}
+
+void ElementAccess::CommitBitmap(std::string_view new_value) const {
+  if (shard_) {
+    Update([new_value](PrimeValue* pv) { SetBitmapValue(new_value, pv); });
+  }
+}
+
+void ElementAccess::CommitBitmap(RoaringBitmap&& bitmap) const {
+  if (shard_) {
+    Update([&bitmap](PrimeValue* pv) { SetBitmapValue(std::move(bitmap), pv); });
   }
 }
 
@@ -334,9 +425,21 @@ OpResult<bool> BitNewValue(const OpArgs& args, std::string_view key, uint32_t of
   }
 
   if (element_access.IsNewEntry()) {
-    std::string new_entry(GetByteIndex(offset) + 1, 0);
-    old_value = SetBitValue(offset, bit_value, &new_entry);
-    element_access.Commit(new_entry);
+    RoaringBitmap bitmap;
+    bitmap.Set(offset, bit_value);
+    element_access.CommitBitmap(std::move(bitmap));
+  } else if (RoaringBitmap* bitmap = element_access.Bitmap(); bitmap) {
+    old_value = bitmap->Get(offset);
+    if (old_value != bit_value || GetByteIndex(offset) >= bitmap->ByteLen()) {
+      element_access.Update([&](PrimeValue* pv) {
+        bitmap->Set(offset, bit_value);
+        if (!FitsRoaring(*bitmap)) {
+          std::string bytes(bitmap->ByteLen(), 0);
+          bitmap->ToBytes(bytes.data());
+          pv->SetString(bytes);
+        }
+      });
+    }
   } else {
     bool reset = false;
     std::string existing_entry{element_access.Value()};
@@ -345,7 +448,9 @@ OpResult<bool> BitNewValue(const OpArgs& args, std::string_view key, uint32_t of
       reset = true;
     }
     old_value = SetBitValue(offset, bit_value, &existing_entry);
-    if (reset || old_value != bit_value) {  // we made a "real" change to the entry, save it
+    if (reset) {  // the value may fit a roaring bitmap only once it is extended
+      element_access.CommitBitmap(existing_entry);
+    } else if (old_value != bit_value) {  // we made a "real" change to the entry, save it
       element_access.Commit(existing_entry);
     }
   }
@@ -359,89 +464,126 @@ std::string RunBitOperationOnValues(std::string_view op, const BitsStrVec& value
   // on all the values we got from the database. Note that in case that one of the values
   // is shorter than the other it would return a 0 and the operation would continue
   // until we ran the longest value. The function will return the resulting new value
-  std::size_t max_len = 0;
-  std::size_t max_len_index = 0;
-
-  const auto BitOperation = [&]() {
-    if (op == OR_OP_NAME) {
-      std::string default_str{values[max_len_index]};
-      return BitOpString(OrOp, SkipOr, std::move(values), std::move(default_str));
-    } else if (op == XOR_OP_NAME) {
-      return BitOpString(XorOp, SkipXor, std::move(values), std::string(max_len, 0));
-    } else if (op == AND_OP_NAME) {
-      return BitOpString(AndOp, SkipAnd, std::move(values), std::string(max_len, 0));
-    } else if (op == NOT_OP_NAME) {
-      return BitOpNotString(values[0]);
-    } else {
-      LOG(FATAL) << "Operation not supported '" << op << "'";
-      return std::string{};  // otherwise we will have warning of not returning value
-    }
-  };
-
   if (values.empty()) {  // this is ok in case we don't have the src keys
     return std::string{};
   }
+
+  if (op == NOT_OP_NAME) {
+    return BitOpNotString(values[0]);
+  }
+  if (values.size() == 1) {
+    return values[0];
+  }
+
+  void (*bit_op)(uint8_t* dest, const uint8_t* src, std::size_t len) = nullptr;
+  if (op == OR_OP_NAME) {
+    bit_op = BitOr;
+  } else if (op == XOR_OP_NAME) {
+    bit_op = BitXor;
+  } else if (op == AND_OP_NAME) {
+    bit_op = BitAnd;
+  } else {
+    LOG(FATAL) << "Operation not supported '" << op << "'";
+  }
+
   // The new result is the max length input
-  max_len = values[0].size();
-  for (std::size_t i = 1; i < values.size(); ++i) {
-    if (values[i].size() > max_len) {
-      max_len = values[i].size();
-      max_len_index = i;
+  std::size_t max_len = 0;
+  for (const auto& value : values) {
+    max_len = std::max(max_len, value.size());
+  }
+
+  std::string result(max_len, 0);
+  uint8_t* dest = reinterpret_cast<uint8_t*>(result.data());
+  for (std::size_t start = 0; start < max_len; start += kBitOpBlockSize) {
+    const std::size_t block_len = std::min(kBitOpBlockSize, max_len - start);
+
+    // The bytes past the end of a value are zeros.
+    auto value_len = [&](const std::string& value) {
+      return value.size() > start ? std::min(block_len, value.size() - start) : 0;
+    };
+
+    std::size_t len = value_len(values[0]);
+    if (len > 0) {
+      memcpy(dest + start, values[0].data() + start, len);
+    }
+    for (std::size_t i = 1; i < values.size(); ++i) {
+      len = value_len(values[i]);
+      if (len > 0) {
+        bit_op(dest + start, reinterpret_cast<const uint8_t*>(values[i].data()) + start, len);
+      }
+      if (bit_op == BitAnd && len < block_len) {
+        memset(dest + start + len, 0, block_len - len);
+      }
     }
   }
-  return BitOperation();
+  return result;
 }
 
-OpResult<std::string> CombineResultOp(ShardStringResults result, std::string_view op) {
-  // take valid result for each shard
-  BitsStrVec values;
-  for (auto&& res : result) {
-    if (res) {
-      auto v = res.value();
-      values.emplace_back(std::move(v));
-    } else {
-      if (res.status() != OpStatus::KEY_NOTFOUND) {
-        // something went wrong, just bale out
-        return res;
-      }
+// Combines values that are all bitmaps as such, otherwise flattens the bitmaps among them.
+BitOpValue RunBitOperationOnValues(std::string_view op, std::vector<BitOpValue> values) {
+  if (values.size() == 1 && op != NOT_OP_NAME) {
+    return std::move(values[0]);
+  }
+
+  bool all_bitmaps = op != NOT_OP_NAME && !values.empty();
+  for (const auto& value : values) {
+    all_bitmaps &= value.is_bitmap;
+  }
+
+  if (all_bitmaps) {
+    const RoaringBitmap::Op bitmap_op = op == AND_OP_NAME  ? RoaringBitmap::AND
+                                        : op == OR_OP_NAME ? RoaringBitmap::OR
+                                                           : RoaringBitmap::XOR;
+    RoaringBitmap bitmap = RoaringBitmap::Deserialize(values[0].data);
+    for (std::size_t i = 1; i < values.size(); ++i) {
+      bitmap.Apply(bitmap_op, RoaringBitmap::Deserialize(values[i].data));
     }
+
+    BitOpValue res{.is_bitmap = true};
+    bitmap.Serialize(&res.data);
+    return res;
   }
 
-  // and combine them to single result
-  return RunBitOperationOnValues(op, values);
+  BitsStrVec strings;
+  strings.reserve(values.size());
+  for (auto& value : values) {
+    if (value.is_bitmap) {
+      RoaringBitmap bitmap = RoaringBitmap::Deserialize(value.data);
+      value.data.assign(bitmap.ByteLen(), 0);
+      bitmap.ToBytes(value.data.data());
+    }
+    strings.emplace_back(std::move(value.data));
+  }
+  return BitOpValue{.data = RunBitOperationOnValues(op, strings)};
 }
 
-// For bitop not - we cannot accumulate
-OpResult<std::string> RunBitOpNot(const OpArgs& op_args, ArgSlice keys) {
-  DCHECK(keys.size() == 1);
-
-  EngineShard* es = op_args.shard;
-  // if we found the value, just return, if not found then skip, otherwise report an error
-  auto key = keys.front();
-  OpResult<PrimeIterator> find_res = es->db_slice().Find(op_args.db_cntx, key, OBJ_STRING);
-  if (find_res) {
-    return GetString(find_res.value()->second, es);
+// Returns the value of BITOP for pv, which is a bitmap unless op is NOT.
+BitOpValue GetBitOpValue(std::string_view op, const PrimeValue& pv, EngineShard* shard) {
+  BitOpValue res;
+  if (pv.IsBitmap() && op != NOT_OP_NAME) {
+    pv.GetBitmap()->Serialize(&res.data);
+    res.is_bitmap = true;
   } else {
-    return find_res.status();
+    res.data = GetString(pv, shard);
   }
+  return res;
 }
 
 // Read only operation where we are running the bit operation on all the
 // values that belong to same shard.
-OpResult<std::string> RunBitOpOnShard(std::string_view op, const OpArgs& op_args, ArgSlice keys) {
+OpResult<BitOpValue> RunBitOpOnShard(std::string_view op, const OpArgs& op_args, ArgSlice keys) {
   DCHECK(!keys.empty());
-  if (op == NOT_OP_NAME) {
-    return RunBitOpNot(op_args, keys);
-  }
+  DCHECK(op != NOT_OP_NAME || keys.size() == 1);
+
   EngineShard* es = op_args.shard;
-  BitsStrVec values;
+  std::vector<BitOpValue> values;
   values.reserve(keys.size());
 
   // collect all the value for this shard
   for (auto& key : keys) {
     OpResult<PrimeIterator> find_res = es->db_slice().Find(op_args.db_cntx, key, OBJ_STRING);
     if (find_res) {
-      values.emplace_back(GetString(find_res.value()->second, es));
+      values.emplace_back(GetBitOpValue(op, find_res.value()->second, es));
     } else {
       if (find_res.status() == OpStatus::KEY_NOTFOUND) {
         continue;  // this is allowed, just return empty string per Redis
@@ -450,9 +592,18 @@ OpResult<std::string> RunBitOpOnShard(std::string_view op, const OpArgs& op_args
       }
     }
   }
+
+  if (values.empty()) {
+    return OpStatus::KEY_NOTFOUND;
+  }
+
+  // For bitop not - we cannot accumulate, it runs once all the shards replied.
+  if (op == NOT_OP_NAME) {
+    return std::move(values[0]);
+  }
+
   // Run the operation on all the values that we found
-  std::string op_result = RunBitOperationOnValues(op, values);
-  return op_result;
+  return RunBitOperationOnValues(op, std::move(values));
 }
 
 template <typename T> void HandleOpValueResult(const OpResult<T>& result, ConnectionContext* cntx) {
@@ -483,7 +634,50 @@ OpStatus NoOpCb(Transaction* t, EngineShard* shard) {
 // ------------------------------------------------------------------------- //
 //  Impl for the command functions
 void BitPos(CmdArgList args, ConnectionContext* cntx) {
-  (*cntx)->SendLong(0);
+  // Support for the command BITPOS
+  // See details at https://redis.io/commands/bitpos/
+
+  if (args.size() > 6) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  std::string_view key = ArgS(args, 1);
+  int32_t value{0};
+  int64_t start = 0;
+  int64_t end = std::numeric_limits<int64_t>::max();
+  bool as_bit = false;
+
+  if (!absl::SimpleAtoi(ArgS(args, 2), &value)) {
+    return (*cntx)->SendError(kInvalidIntErr);
+  }
+  if (value != 0 && value != 1) {
+    return (*cntx)->SendError("The bit argument must be 1 or 0.");
+  }
+  if (args.size() >= 4 && !absl::SimpleAtoi(ArgS(args, 3), &start)) {
+    return (*cntx)->SendError(kInvalidIntErr);
+  }
+  if (args.size() >= 5 && !absl::SimpleAtoi(ArgS(args, 4), &end)) {
+    return (*cntx)->SendError(kInvalidIntErr);
+  }
+  if (args.size() == 6) {
+    ToUpper(&args[5]);
+    std::string_view unit = ArgS(args, 5);
+    if (unit != "BIT" && unit != "BYTE") {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+    as_bit = unit == "BIT";
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return FindFirstBitWithValue(t->GetOpArgs(shard), key, value != 0, start, end, as_bit);
+  };
+  Transaction* trans = cntx->transaction;
+  OpResult<int64_t> res = trans->ScheduleSingleHopT(std::move(cb));
+  if (res.status() == OpStatus::KEY_NOTFOUND) {
+    // A missing key is an empty string, hence all its bits are clear.
+    return (*cntx)->SendLong(value ? -1 : 0);
+  }
+  HandleOpValueResult(res, cntx);
 }
 
 void BitCount(CmdArgList args, ConnectionContext* cntx) {
@@ -539,7 +733,7 @@ void BitOp(CmdArgList args, ConnectionContext* cntx) {
   }
 
   // Multi shard access - read only
-  ShardStringResults result_set(shard_set->size(), OpStatus::KEY_NOTFOUND);
+  ShardBitOpResults result_set(shard_set->size(), OpStatus::KEY_NOTFOUND);
   ShardId dest_shard = Shard(dest_key, result_set.size());
 
   auto shard_bitop = [&](Transaction* t, EngineShard* shard) {
@@ -560,30 +754,47 @@ void BitOp(CmdArgList args, ConnectionContext* cntx) {
 
   cntx->transaction->Schedule();
   cntx->transaction->Execute(std::move(shard_bitop), false);  // we still have more work to do
-  // All result from each shard
-  const auto joined_results = CombineResultOp(result_set, op);
-  // Second phase - save to targe key if successful
-  if (!joined_results) {
-    cntx->transaction->Execute(NoOpCb, true);
-    (*cntx)->SendError(joined_results.status());
-    return;
-  } else {
-    auto op_result = joined_results.value();
-    auto store_cb = [&](Transaction* t, EngineShard* shard) {
-      if (shard->shard_id() == dest_shard) {
-        ElementAccess operation{dest_key, t->GetOpArgs(shard)};
-        auto find_res = operation.Find(shard);
 
+  // take valid result for each shard
+  std::vector<BitOpValue> values;
+  for (auto& res : result_set) {
+    if (res) {
+      values.emplace_back(std::move(res.value()));
+    } else if (res.status() != OpStatus::KEY_NOTFOUND) {
+      // something went wrong, just bale out
+      cntx->transaction->Execute(NoOpCb, true);
+      (*cntx)->SendError(res.status());
+      return;
+    }
+  }
+
+  // Second phase - combine the results and save them to the target key. This runs in the thread
+  // of the target shard, which allocates a bitmap result.
+  std::size_t result_len = 0;
+  auto store_cb = [&](Transaction* t, EngineShard* shard) {
+    if (shard->shard_id() == dest_shard) {
+      BitOpValue op_result = RunBitOperationOnValues(op, std::move(values));
+      ElementAccess operation{dest_key, t->GetOpArgs(shard)};
+      auto find_res = operation.Find(shard);
+
+      if (op_result.is_bitmap) {
+        RoaringBitmap bitmap = RoaringBitmap::Deserialize(op_result.data);
+        result_len = bitmap.ByteLen();
         if (find_res == OpStatus::OK) {
-          operation.Commit(op_result);
+          operation.CommitBitmap(std::move(bitmap));
+        }
+      } else {
+        result_len = op_result.data.size();
+        if (find_res == OpStatus::OK) {
+          operation.CommitBitmap(op_result.data);
         }
       }
-      return OpStatus::OK;
-    };
+    }
+    return OpStatus::OK;
+  };
 
-    cntx->transaction->Execute(std::move(store_cb), true);
-    (*cntx)->SendLong(op_result.size());
-  }
+  cntx->transaction->Execute(std::move(store_cb), true);
+  (*cntx)->SendLong(result_len);
 }
 
 void GetBit(CmdArgList args, ConnectionContext* cntx) {
@@ -643,42 +854,113 @@ std::string GetString(const PrimeValue& pv, EngineShard* shard) {
   return res;
 }
 
-OpResult<bool> ReadValueBitsetAt(const OpArgs& op_args, std::string_view key, uint32_t offset) {
-  OpResult<std::string> result = ReadValue(op_args.db_cntx, key, op_args.shard);
-  if (result) {
-    return GetBitValueSafe(result.value(), offset);
-  } else {
-    return result.status();
+// Reads the bytes [start, end) of the offloaded value pv, without loading the rest of it.
+std::string ReadExternalRange(const PrimeValue& pv, EngineShard* shard, std::size_t start,
+                              std::size_t end) {
+  DCHECK(pv.IsExternal());
+  DCHECK_LT(start, end);
+  std::string res(end - start, '\0');
+  std::error_code ec =
+      shard->tiered_storage()->ReadRange(pv.GetExternalPtr().first, start, res.size(), res.data());
+  CHECK(!ec) << "TBD: " << ec;
+  return res;
+}
+
+// Returns the value without copying it, unless it is encoded or external.
+std::string_view GetStringSlice(const PrimeValue& pv, EngineShard* shard, std::string* scratch) {
+  if (pv.IsExternal()) {
+    *scratch = GetString(pv, shard);
+    return *scratch;
   }
+  return pv.GetSlice(scratch);
 }
 
-OpResult<std::string> ReadValue(const DbContext& context, std::string_view key,
-                                EngineShard* shard) {
-  OpResult<PrimeIterator> it_res = shard->db_slice().Find(context, key, OBJ_STRING);
+OpResult<bool> ReadValueBitsetAt(const OpArgs& op_args, std::string_view key, uint32_t offset) {
+  OpResult<PrimeIterator> it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_STRING);
   if (!it_res.ok()) {
     return it_res.status();
   }
 
   const PrimeValue& pv = it_res.value()->second;
-
-  return GetString(pv, shard);
+  if (pv.IsBitmap()) {
+    return pv.GetBitmap()->Get(offset);
+  }
+  if (pv.IsExternal()) {
+    const std::size_t byte = GetByteIndex(offset);
+    if (byte >= pv.Size()) {
+      return false;
+    }
+    return GetBitValue(ReadExternalRange(pv, op_args.shard, byte, byte + 1), GetBitIndex(offset));
+  }
+  std::string scratch;
+  return GetBitValueSafe(GetStringSlice(pv, op_args.shard, &scratch), offset);
 }
 
 OpResult<std::size_t> CountBitsForValue(const OpArgs& op_args, std::string_view key, int64_t start,
                                         int64_t end, bool bit_value) {
-  OpResult<std::string> result = ReadValue(op_args.db_cntx, key, op_args.shard);
+  OpResult<PrimeIterator> it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_STRING);
+  if (!it_res.ok()) {  // if this is not found, just return 0 - per Redis
+    return it_res.status();
+  }
 
-  if (result) {  // if this is not found, just return 0 - per Redis
-    if (result.value().empty()) {
-      return 0;
+  const PrimeValue& pv = it_res.value()->second;
+  if (pv.IsBitmap()) {
+    const RoaringBitmap& bitmap = *pv.GetBitmap();
+    if (end == std::numeric_limits<int64_t>::max()) {
+      end = bitmap.ByteLen();
     }
+    return CountBitSet(bitmap, start, end, bit_value);
+  }
+
+  // Only the bytes that cover the range are read from the storage.
+  if (pv.IsExternal()) {
+    const int64_t len = pv.Size();
     if (end == std::numeric_limits<int64_t>::max()) {
-      end = result.value().size();
+      end = len;
     }
-    return CountBitSet(result.value(), start, end, bit_value);
-  } else {
-    return result.status();
+    if (!NormalizeCountRange(bit_value ? len * OFFSET_FACTOR : len, &start, &end)) {
+      return 0;
+    }
+    const int64_t first = bit_value ? start / OFFSET_FACTOR : start;
+    const int64_t last = bit_value ? (end + OFFSET_FACTOR - 1) / OFFSET_FACTOR : end;
+    std::string bytes = ReadExternalRange(pv, op_args.shard, first, last);
+    const int64_t base = bit_value ? first * OFFSET_FACTOR : first;
+    return bit_value ? CountBitSetByBitIndices(bytes, start - base, end - base)
+                     : CountBitSetByByteIndices(bytes, start - base, end - base);
+  }
+
+  std::string scratch;
+  std::string_view value = GetStringSlice(pv, op_args.shard, &scratch);
+  if (value.empty()) {
+    return 0;
+  }
+  if (end == std::numeric_limits<int64_t>::max()) {
+    end = value.size();
   }
+  return CountBitSet(value, start, end, bit_value);
+}
+
+OpResult<int64_t> FindFirstBitWithValue(const OpArgs& op_args, std::string_view key, bool value,
+                                        int64_t start, int64_t end, bool as_bit) {
+  OpResult<PrimeIterator> it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_STRING);
+  if (!it_res.ok()) {
+    return it_res.status();
+  }
+
+  const PrimeValue& pv = it_res.value()->second;
+  if (pv.IsBitmap()) {
+    const RoaringBitmap& bitmap = *pv.GetBitmap();
+    return FindBitPosition(bitmap.ByteLen(), value, start, end, as_bit,
+                           [&](int64_t from, int64_t to) {
+                             return bitmap.FindFirst(value, from, to);
+                           });
+  }
+
+  std::string scratch;
+  std::string_view str = GetStringSlice(pv, op_args.shard, &scratch);
+  return FindBitPosition(str.size(), value, start, end, as_bit, [&](int64_t from, int64_t to) {
+    return FindBitInRange(str, from, to, value);
+  });
 }
 
 }  // namespace
@@ -10,6 +10,10 @@
 #include <string>
 #include <string_view>
 
+extern "C" {
+#include "redis/object.h"
+}
+
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "facade/facade_test.h"
@@ -159,8 +163,19 @@ class BitOpsFamilyTest : public BaseFamilyTest {
  protected:
   // only for bitop XOR, OR, AND tests
   void BitOpSetKeys();
+
+  // Returns true if the string value of key is stored as a roaring bitmap.
+  bool IsBitmap(std::string_view key) const;
 };
 
+bool BitOpsFamilyTest::IsBitmap(std::string_view key) const {
+  ShardId sid = Shard(key, shard_set->size());
+  return shard_set->Await(sid, [key] {
+    auto it_res = EngineShard::tlocal()->db_slice().Find(DbContext{}, key, OBJ_STRING);
+    return it_res && it_res.value()->second.IsBitmap();
+  });
+}
+
 // for the bitop tests we need to test with multiple keys as the issue
 // is that we need to make sure that accessing multiple shards creates
 // the correct result
@@ -420,4 +435,117 @@ TEST_F(BitOpsFamilyTest, BitOpsNot) {
   EXPECT_EQ(res, NOT_RESULTS);
 }
 
+TEST_F(BitOpsFamilyTest, BitOpsLarge) {
+  // Values span several processing blocks and have different lengths.
+  Run({"set", "large1", string(40000, '\xff')});
+  Run({"set", "large2", string(20000, '\x0f')});
+
+  EXPECT_EQ(40000, CheckedInt({"bitop", "and", "large_and", "large1", "large2"}));
+  EXPECT_EQ(80000, CheckedInt({"bitcount", "large_and"}));
+  EXPECT_EQ(0, CheckedInt({"bitcount", "large_and", "20000", "-1"}));
+
+  EXPECT_EQ(40000, CheckedInt({"bitop", "or", "large_or", "large1", "large2"}));
+  EXPECT_EQ(320000, CheckedInt({"bitcount", "large_or"}));
+
+  EXPECT_EQ(40000, CheckedInt({"bitop", "xor", "large_xor", "large2", "large1"}));
+  EXPECT_EQ(240000, CheckedInt({"bitcount", "large_xor"}));
+  EXPECT_EQ(4, CheckedInt({"bitpos", "large_xor", "0"}));
+}
+
+TEST_F(BitOpsFamilyTest, BitPos) {
+  EXPECT_EQ(-1, CheckedInt({"bitpos", "empty", "1"}));
+  EXPECT_EQ(0, CheckedInt({"bitpos", "empty", "0"}));
+  ASSERT_THAT(Run({"bitpos", "empty", "2"}), ErrArg("The bit argument must be 1 or 0."));
+  ASSERT_THAT(Run({"bitpos", "empty", "1", "0", "1", "BOO"}), ErrArg("syntax error"));
+
+  Run({"set", "a", string("\xff\xf0\x00", 3)});
+  EXPECT_EQ(12, CheckedInt({"bitpos", "a", "0"}));
+  EXPECT_EQ(0, CheckedInt({"bitpos", "a", "1"}));
+  EXPECT_EQ(8, CheckedInt({"bitpos", "a", "1", "1"}));
+  EXPECT_EQ(16, CheckedInt({"bitpos", "a", "0", "2"}));
+  EXPECT_EQ(16, CheckedInt({"bitpos", "a", "0", "-1"}));
+  EXPECT_EQ(-1, CheckedInt({"bitpos", "a", "1", "2"}));
+  EXPECT_EQ(-1, CheckedInt({"bitpos", "a", "0", "0", "0"}));
+  EXPECT_EQ(-1, CheckedInt({"bitpos", "a", "0", "3"}));
+
+  EXPECT_EQ(7, CheckedInt({"bitpos", "a", "1", "7", "15", "BIT"}));
+  EXPECT_EQ(-1, CheckedInt({"bitpos", "a", "0", "8", "11", "bit"}));
+  EXPECT_EQ(12, CheckedInt({"bitpos", "a", "0", "8", "-1", "BIT"}));
+  EXPECT_EQ(12, CheckedInt({"bitpos", "a", "0", "1", "1", "BYTE"}));
+
+  // A clear bit is assumed past the end of the value unless the range is explicit.
+  Run({"set", "b", string(3000, '\xff')});
+  EXPECT_EQ(24000, CheckedInt({"bitpos", "b", "0"}));
+  EXPECT_EQ(-1, CheckedInt({"bitpos", "b", "0", "0", "-1"}));
+  EXPECT_EQ(23999, CheckedInt({"bitpos", "b", "1", "-1", "-1", "BIT"}));
+}
+
+TEST_F(BitOpsFamilyTest, SparseBitmap) {
+  // A single bit far into the value does not allocate its whole length.
+  EXPECT_EQ(0, CheckedInt({"setbit", "sparse", "4000000000", "1"}));
+  EXPECT_TRUE(IsBitmap("sparse"));
+  EXPECT_EQ(500000001, CheckedInt({"strlen", "sparse"}));
+  EXPECT_EQ(1, CheckedInt({"getbit", "sparse", "4000000000"}));
+  EXPECT_EQ(0, CheckedInt({"getbit", "sparse", "3999999999"}));
+  EXPECT_EQ(1, CheckedInt({"bitcount", "sparse"}));
+  EXPECT_EQ(0, CheckedInt({"bitcount", "sparse", "0", "-2"}));
+  EXPECT_EQ(1, CheckedInt({"bitcount", "sparse", "3999999990", "-1", "BIT"}));
+  EXPECT_EQ(4000000000, CheckedInt({"bitpos", "sparse", "1"}));
+  EXPECT_EQ(0, CheckedInt({"bitpos", "sparse", "0"}));
+  EXPECT_EQ(4000000001, CheckedInt({"bitpos", "sparse", "0", "-1"}));
+
+  EXPECT_EQ(0, CheckedInt({"setbit", "sparse", "7", "1"}));
+  EXPECT_EQ(1, CheckedInt({"setbit", "sparse", "4000000000", "0"}));
+  EXPECT_EQ(7, CheckedInt({"bitpos", "sparse", "1"}));
+  EXPECT_TRUE(IsBitmap("sparse"));
+}
+
+TEST_F(BitOpsFamilyTest, BitmapOps) {
+  Run({"setbit", "bm1", "100000", "1"});
+  Run({"setbit", "bm1", "200000", "1"});
+  Run({"setbit", "bm2", "200000", "1"});
+  Run({"setbit", "bm2", "300000", "1"});
+  ASSERT_TRUE(IsBitmap("bm1"));
+  ASSERT_TRUE(IsBitmap("bm2"));
+
+  // The value reads as its bytes.
+  string expected(25001, 0);
+  expected[12500] = expected[25000] = '\x80';
+  EXPECT_EQ(expected, ToSV(Run({"get", "bm1"}).GetBuf()));
+
+  EXPECT_EQ(37501, CheckedInt({"bitop", "and", "bm_and", "bm1", "bm2"}));
+  EXPECT_TRUE(IsBitmap("bm_and"));
+  EXPECT_EQ(1, CheckedInt({"bitcount", "bm_and"}));
+  EXPECT_EQ(200000, CheckedInt({"bitpos", "bm_and", "1"}));
+
+  EXPECT_EQ(37501, CheckedInt({"bitop", "or", "bm_or", "bm1", "bm2"}));
+  EXPECT_EQ(3, CheckedInt({"bitcount", "bm_or"}));
+  EXPECT_EQ(37501, CheckedInt({"bitop", "xor", "bm_xor", "bm1", "bm2"}));
+  EXPECT_EQ(2, CheckedInt({"bitcount", "bm_xor"}));
+
+  // Combined with a plain string, the bitmap is flattened.
+  Run({"set", "str", string(10, '\xff')});
+  EXPECT_EQ(37501, CheckedInt({"bitop", "or", "bm_str", "bm2", "str"}));
+  EXPECT_EQ(82, CheckedInt({"bitcount", "bm_str"}));
+  EXPECT_EQ(37501, CheckedInt({"bitop", "not", "bm_not", "bm2"}));
+  EXPECT_EQ(37501 * 8 - 2, CheckedInt({"bitcount", "bm_not"}));
+
+  // Appending to the value works on its bytes.
+  EXPECT_EQ(25002, CheckedInt({"append", "bm1", "x"}));
+  EXPECT_EQ(4, CheckedInt({"bitcount", "bm1", "-1", "-1"}));
+}
+
+TEST_F(BitOpsFamilyTest, BitmapFlattens) {
+  Run({"setbit", "dense", "100000", "1"});
+  ASSERT_TRUE(IsBitmap("dense"));
+
+  // Once most bits are set in a random order, the bytes take less memory.
+  for (unsigned i = 0; i < 5000; ++i) {
+    Run({"setbit", "dense", absl::StrCat((i * 7919) % 100000), "1"});
+  }
+  EXPECT_FALSE(IsBitmap("dense"));
+  EXPECT_EQ(5001, CheckedInt({"bitcount", "dense"}));
+  EXPECT_EQ(0, CheckedInt({"bitpos", "dense", "1"}));
+}
+
 }  // end of namespace dfly
@@ -4,6 +4,7 @@
 
 #include "server/blocking_controller.h"
 
+#include <boost/intrusive/list.hpp>
 #include <boost/smart_ptr/intrusive_ptr.hpp>
 
 extern "C" {
@@ -18,27 +19,25 @@ namespace dfly {
 
 using namespace std;
 
-struct WatchItem {
-  Transaction* trans;
-
-  Transaction* get() {
-    return trans;
-  }
-
-  WatchItem(Transaction* t) : trans(t) {
-  }
+// Links a transaction into the queue of a key it waits for. Items are owned by watched_trans_,
+// so that a transaction is unlinked from all its queues in O(1) per key.
+struct BlockingController::WatchItem
+    : public boost::intrusive::list_base_hook<
+          boost::intrusive::link_mode<boost::intrusive::safe_link>> {
+  Transaction* trans = nullptr;
+  WatchQueue* queue = nullptr;
 };
 
 struct BlockingController::WatchQueue {
-  deque<WatchItem> items;
-  TxId notify_txid = UINT64_MAX;
+  boost::intrusive::list<WatchItem> items;  // FIFO of the suspended transactions.
+  std::string_view key;                     // points to the key of WatchQueueMap.
 
-  // Updated  by both coordinator and shard threads but at different times.
-  enum State { SUSPENDED, ACTIVE } state = SUSPENDED;
+  // Transactions that were woken by this queue and did not finish yet. They are about to pop
+  // that many items of the list.
+  size_t awakened = 0;
 
-  void Suspend() {
-    state = SUSPENDED;
-    notify_txid = UINT64_MAX;
+  bool IsUnused() const {
+    return items.empty() && awakened == 0;
   }
 };
 
@@ -50,11 +49,11 @@ struct BlockingController::DbWatchTable {
   // they reference key objects in queue_map.
   absl::flat_hash_set<base::string_view_sso> awakened_keys;
 
-  void RemoveEntry(WatchQueueMap::iterator it);
+  void RemoveIfUnused(WatchQueue* wq);
 
   // returns true if awake event was added.
-  // Requires that the key queue be in the required state.
-  bool AddAwakeEvent(WatchQueue::State cur_state, string_view key);
+  // Requires that somebody waits for the key.
+  bool AddAwakeEvent(string_view key);
 };
 
 BlockingController::BlockingController(EngineShard* owner) : owner_(owner) {
@@ -63,18 +62,23 @@ BlockingController::BlockingController(EngineShard* owner) : owner_(owner) {
 BlockingController::~BlockingController() {
 }
 
-void BlockingController::DbWatchTable::RemoveEntry(WatchQueueMap::iterator it) {
-  DVLOG(1) << "Erasing watchqueue key " << it->first;
+void BlockingController::DbWatchTable::RemoveIfUnused(WatchQueue* wq) {
+  if (!wq->IsUnused())
+    return;
+
+  DVLOG(1) << "Erasing watchqueue key " << wq->key;
 
+  auto it = queue_map.find(wq->key);
+  DCHECK(it != queue_map.end());
   awakened_keys.erase(it->first);
   queue_map.erase(it);
 }
 
-bool BlockingController::DbWatchTable::AddAwakeEvent(WatchQueue::State cur_state, string_view key) {
+bool BlockingController::DbWatchTable::AddAwakeEvent(string_view key) {
   auto it = queue_map.find(key);
 
-  if (it == queue_map.end() || it->second->state != cur_state)
-    return false;  /// nobody watches this key or state does not match.
+  if (it == queue_map.end() || it->second.items.empty())
+    return false;  /// nobody watches this key.
 
   string_view dbkey = it->first;
 
@@ -83,27 +87,28 @@ bool BlockingController::DbWatchTable::AddAwakeEvent(WatchQueue::State cur_state
 
 // Processes potentially awakened keys and verifies that these are indeed
 // awakened to eliminate false positives.
-// In addition, optionally removes completed_t from the front of the watch queues.
+// In addition, optionally re-examines the keys of completed_t, whose items might have been
+// left unpopped.
 void BlockingController::RunStep(Transaction* completed_t) {
   VLOG(1) << "RunStep [" << owner_->shard_id() << "] " << completed_t;
 
   if (completed_t) {
-    awakened_transactions_.erase(completed_t);
-
     auto dbit = watched_dbs_.find(completed_t->db_index());
     if (dbit != watched_dbs_.end()) {
       DbWatchTable& wt = *dbit->second;
+      FinishAwakened(completed_t, &wt);
 
       ShardId sid = owner_->shard_id();
       KeyLockArgs lock_args = completed_t->GetLockArgs(sid);
 
       for (size_t i = 0; i < lock_args.args.size(); i += lock_args.key_step) {
         string_view key = lock_args.args[i];
-        if (wt.AddAwakeEvent(WatchQueue::ACTIVE, key)) {
+        if (wt.AddAwakeEvent(key)) {
           awakened_indices_.emplace(completed_t->db_index());
         }
       }
     }
+    awakened_transactions_.erase(completed_t);
   }
 
   DbContext context;
@@ -122,10 +127,10 @@ void BlockingController::RunStep(Transaction* completed_t) {
 
       // Double verify we still got the item.
       auto [it, exp_it] = owner_->db_slice().FindExt(context, sv_key);
-      if (!IsValid(it) || it->second.ObjType() != OBJ_LIST)  // Only LIST is allowed to block.
+      if (!IsValid(it))
         continue;
 
-      NotifyWatchQueue(sv_key, &wt.queue_map);
+      NotifyWatchQueue(sv_key, it->second, &wt.queue_map);
     }
     wt.awakened_keys.clear();
 
@@ -147,61 +152,80 @@ void BlockingController::AddWatched(Transaction* trans) {
   DbWatchTable& wt = *dbit->second;
 
   auto args = trans->ShardArgsInShard(owner_->shard_id());
+  WatchedTrans& watched = watched_trans_[trans];
+  DCHECK(!watched.items);
+  watched.items.reset(new WatchItem[args.size()]);
+
   for (auto key : args) {
-    auto [res, inserted] = wt.queue_map.emplace(key, nullptr);
+    auto [res, inserted] = wt.queue_map.try_emplace(key);
+    WatchQueue& wq = res->second;
     if (inserted) {
-      res->second.reset(new WatchQueue);
+      wq.key = res->first;
     }
 
-    if (!res->second->items.empty()) {
-      Transaction* last = res->second->items.back().get();
-      DCHECK_GT(last->use_count(), 0u);
+    // Duplicate keys case. We push only once per key.
+    if (!wq.items.empty() && wq.items.back().trans == trans)
+      continue;
 
-      // Duplicate keys case. We push only once per key.
-      if (last == trans)
-        continue;
-    }
     DVLOG(2) << "Emplace " << trans << " " << trans->DebugId() << " to watch " << key;
-    res->second->items.emplace_back(trans);
+    WatchItem& item = watched.items[watched.size++];
+    item.trans = trans;
+    item.queue = &wq;
+    wq.items.push_back(item);
   }
 }
 
-// Runs in O(N) complexity in the worst case.
+// Runs in O(1) per watched key.
 void BlockingController::RemoveWatched(Transaction* trans) {
   VLOG(1) << "RemoveWatched [" << owner_->shard_id() << "] " << trans->DebugId();
 
-  auto dbit = watched_dbs_.find(trans->db_index());
-  if (dbit == watched_dbs_.end())
+  auto watched_it = watched_trans_.find(trans);
+  if (watched_it == watched_trans_.end())
     return;
 
-  DbWatchTable& wt = *dbit->second;
-  auto args = trans->ShardArgsInShard(owner_->shard_id());
-  for (auto key : args) {
-    auto watch_it = wt.queue_map.find(key);
-    if (watch_it == wt.queue_map.end())
-      continue;  // that can happen in case of duplicate keys
-
-    WatchQueue& wq = *watch_it->second;
-    for (auto items_it = wq.items.begin(); items_it != wq.items.end(); ++items_it) {
-      if (items_it->trans == trans) {
-        wq.items.erase(items_it);
-        break;
-      }
-    }
-    // again, we may not find trans if we searched for the same key several times.
+  auto dbit = watched_dbs_.find(trans->db_index());
+  if (dbit != watched_dbs_.end()) {
+    DbWatchTable& wt = *dbit->second;
+    FinishAwakened(trans, &wt);
 
-    if (wq.items.empty()) {
-      wt.RemoveEntry(watch_it);
+    WatchedTrans& watched = watched_it->second;
+    for (unsigned i = 0; i < watched.size; ++i) {
+      WatchItem& item = watched.items[i];
+      if (!item.is_linked())
+        continue;  // this queue has already popped the transaction.
+
+      item.queue->items.erase(item.queue->items.iterator_to(item));
+      wt.RemoveIfUnused(item.queue);
     }
-  }
 
-  if (wt.queue_map.empty()) {
-    watched_dbs_.erase(dbit);
+    if (wt.queue_map.empty()) {
+      watched_dbs_.erase(dbit);
+    }
   }
 
+  watched_trans_.erase(watched_it);
   awakened_transactions_.erase(trans);
 }
 
+void BlockingController::FinishAwakened(Transaction* trans, DbWatchTable* wt) {
+  auto it = awakened_transactions_.find(trans);
+  if (it == awakened_transactions_.end())
+    return;
+
+  WatchQueue* wq = it->second;
+  awakened_transactions_.erase(it);
+
+  DCHECK_GT(wq->awakened, 0u);
+  --wq->awakened;
+
+  // The transaction may have expired or popped another key, hence its item is still available
+  // for the next waiter.
+  if (wt->AddAwakeEvent(wq->key)) {
+    awakened_indices_.insert(trans->db_index());
+  }
+  wt->RemoveIfUnused(wq);
+}
+
 // Called from commands like lpush.
 void BlockingController::AwakeWatched(DbIndex db_index, string_view db_key) {
   auto it = watched_dbs_.find(db_index);
@@ -213,7 +237,7 @@ void BlockingController::AwakeWatched(DbIndex db_index, string_view db_key) {
   DbWatchTable& wt = *it->second;
   DCHECK(!wt.queue_map.empty());
 
-  if (wt.AddAwakeEvent(WatchQueue::SUSPENDED, db_key)) {
+  if (wt.AddAwakeEvent(db_key)) {
     awakened_indices_.insert(db_index);
   } else {
     DVLOG(1) << "Skipped awakening " << db_index;
@@ -221,33 +245,51 @@ void BlockingController::AwakeWatched(DbIndex db_index, string_view db_key) {
 }
 
 // Internal function called from RunStep().
-// Marks the queue as active and notifies the first transaction in the queue.
-void BlockingController::NotifyWatchQueue(std::string_view key, WatchQueueMap* wqm) {
+void BlockingController::NotifyWatchQueue(std::string_view key, const PrimeValue& pv,
+                                          WatchQueueMap* wqm) {
   auto w_it = wqm->find(key);
   CHECK(w_it != wqm->end());
   DVLOG(1) << "Notify WQ: [" << owner_->shard_id() << "] " << key;
-  WatchQueue* wq = w_it->second.get();
-
-  wq->state = WatchQueue::ACTIVE;
+  WatchQueue* wq = &w_it->second;
 
   auto& queue = wq->items;
   ShardId sid = owner_->shard_id();
 
-  do {
-    WatchItem& wi = queue.front();
-    Transaction* head = wi.get();
-    DVLOG(2) << "Pop " << head << " from key " << key;
+  // Only LIST wakes the waiters without a checker.
+  bool is_list = pv.ObjType() == OBJ_LIST;
+  size_t list_size = is_list ? pv.Size() : 0;
+
+  auto item_it = queue.begin();
+  while (item_it != queue.end()) {
+    Transaction* head = item_it->trans;
+    const Transaction::KeyReadyChecker& checker = head->key_ready_checker();
+
+    bool ready;
+    if (checker) {
+      ready = checker(pv, key, wq->awakened);
+    } else {
+      if (is_list && wq->awakened >= list_size)
+        break;  // the rest of the list waiters would find nothing to pop.
+      ready = is_list;
+    }
 
-    queue.pop_front();
+    if (!ready) {
+      ++item_it;
+      continue;
+    }
 
+    DVLOG(2) << "Pop " << head << " from key " << key;
+    item_it = queue.erase(item_it);
+
+    // Expired transactions and the ones that were woken by another key are skipped.
     if (head->NotifySuspended(owner_->committed_txid(), sid)) {
-      wq->notify_txid = owner_->committed_txid();
-      awakened_transactions_.insert(head);
-      break;
+      ++wq->awakened;
+      awakened_transactions_.emplace(head, wq);
     }
-  } while (!queue.empty());
+  }
 
-  if (wq->items.empty()) {
+  // awakened_keys is cleared by the caller.
+  if (wq->IsUnused()) {
     wqm->erase(w_it);
   }
 }
@@ -7,9 +7,11 @@
 #include <absl/container/btree_map.h>
 #include <absl/container/flat_hash_map.h>
 #include <absl/container/flat_hash_set.h>
+#include <absl/container/node_hash_map.h>
 
 #include "base/string_view_sso.h"
 #include "server/common.h"
+#include "server/table.h"
 
 namespace dfly {
 
@@ -41,7 +43,8 @@ class BlockingController {
   void AddWatched(Transaction* me);
   void RemoveWatched(Transaction* me);
 
-  // Called from operations that create keys like lpush, rename etc.
+  // Called from operations that create keys like lpush, rename etc, or that add entries to
+  // streams.
   void AwakeWatched(DbIndex db_index, std::string_view db_key);
 
   // Used in tests and debugging functions.
@@ -49,27 +52,42 @@ class BlockingController {
   std::vector<std::string> GetWatchedKeys(DbIndex db_indx) const;
 
  private:
+  struct WatchItem;
   struct WatchQueue;
   struct DbWatchTable;
 
-  using WatchQueueMap = absl::flat_hash_map<std::string, std::unique_ptr<WatchQueue>>;
+  // The watch items of a transaction, one per key it waits for in this shard.
+  struct WatchedTrans {
+    std::unique_ptr<WatchItem[]> items;
+    unsigned size = 0;
+  };
 
-  void NotifyWatchQueue(std::string_view key, WatchQueueMap* wqm);
+  // Node based, since the queues are linked with the items of the transactions.
+  using WatchQueueMap = absl::node_hash_map<std::string, WatchQueue>;
 
-  // void NotifyConvergence(Transaction* tx);
+  // Wakes the waiters of the key in FIFO order. A list wakes as many as the items it holds
+  // besides the ones that the transactions woken before are about to pop. The waiters with
+  // a KeyReadyChecker, like the stream readers, are woken if their checker accepts the value.
+  void NotifyWatchQueue(std::string_view key, const PrimeValue& pv, WatchQueueMap* wqm);
+
+  // Called when an awakened transaction finished or expired. Re-examines the key that woke it.
+  void FinishAwakened(Transaction* trans, DbWatchTable* wt);
 
   EngineShard* owner_;
 
+  // Declared before watched_dbs_, so that the queues unlink the items before they are destroyed.
+  absl::flat_hash_map<Transaction*, WatchedTrans> watched_trans_;
   absl::flat_hash_map<DbIndex, std::unique_ptr<DbWatchTable>> watched_dbs_;
 
   // serves as a temporary queue that aggregates all the possible awakened dbs.
   // flushed by RunStep().
   absl::flat_hash_set<DbIndex> awakened_indices_;
 
-  // tracks currently notified and awaked transactions.
+  // tracks currently notified and awaked transactions and the queues that woke them.
   // There can be multiple transactions like this because a transaction
-  // could awaken arbitrary number of keys.
-  absl::flat_hash_set<Transaction*> awakened_transactions_;
+  // could awaken arbitrary number of keys, and a key wakes as many transactions as
+  // its list holds items.
+  absl::flat_hash_map<Transaction*, WatchQueue*> awakened_transactions_;
 
   // absl::btree_multimap<TxId, Transaction*> waiting_convergence_;
 };
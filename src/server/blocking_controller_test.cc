@@ -6,6 +6,7 @@
 
 #include <gmock/gmock.h>
 
+#include "base/gtest.h"
 #include "base/logging.h"
 #include "server/command_registry.h"
 #include "server/engine_shard_set.h"
@@ -90,4 +91,74 @@ TEST_F(BlockingControllerTest, Timeout) {
   trans_.reset();
 }
 
+TEST_F(BlockingControllerTest, ManyWaiters) {
+  constexpr unsigned kWaiters = 100;
+  vector<boost::intrusive_ptr<Transaction>> waiters;
+  for (unsigned i = 0; i < kWaiters; ++i) {
+    waiters.emplace_back(new Transaction{&cid_});
+    waiters.back()->InitByArgs(0, {arg_vec_.data(), arg_vec_.size()});
+  }
+
+  shard_set->Await(0, [&] {
+    BlockingController bc(EngineShard::tlocal());
+    for (auto& t : waiters) {
+      bc.AddWatched(t.get());
+    }
+    EXPECT_EQ(1, bc.NumWatched(0));
+
+    for (unsigned i = 0; i < kWaiters; i += 2) {
+      bc.RemoveWatched(waiters[i].get());
+    }
+    EXPECT_EQ(1, bc.NumWatched(0));
+
+    for (unsigned i = 1; i < kWaiters; i += 2) {
+      bc.RemoveWatched(waiters[i].get());
+    }
+    EXPECT_EQ(0, bc.NumWatched(0));
+  });
+}
+
+// Measures adding and removing many waiters of the same key, for example when they time out.
+// They leave in the reverse order, which is the worst case for a queue that is scanned linearly.
+static void BM_RemoveWatched(benchmark::State& state) {
+  unsigned num_waiters = state.range(0);
+
+  unique_ptr<ProactorPool> pp(new uring::UringPool(16, kNumThreads));
+  pp->Run();
+  shard_set = new EngineShardSet(pp.get());
+  shard_set->Init(kNumThreads, false);
+
+  CommandId cid("blpop", 0, -3, 1, -2, 1);
+  StringVec str_vec{"blpop", "x", "0"};
+  CmdArgVec arg_vec;
+  for (auto& s : str_vec) {
+    arg_vec.emplace_back(s);
+  }
+
+  vector<boost::intrusive_ptr<Transaction>> waiters;
+  for (unsigned i = 0; i < num_waiters; ++i) {
+    waiters.emplace_back(new Transaction{&cid});
+    waiters.back()->InitByArgs(0, {arg_vec.data(), arg_vec.size()});
+  }
+
+  shard_set->Await(0, [&] {
+    BlockingController bc(EngineShard::tlocal());
+    for (auto _ : state) {
+      for (auto& t : waiters) {
+        bc.AddWatched(t.get());
+      }
+      for (auto it = waiters.rbegin(); it != waiters.rend(); ++it) {
+        bc.RemoveWatched(it->get());
+      }
+    }
+  });
+  state.SetItemsProcessed(state.iterations() * num_waiters);
+
+  waiters.clear();
+  shard_set->Shutdown();
+  delete shard_set;
+  pp->Stop();
+}
+BENCHMARK(BM_RemoveWatched)->Arg(1000)->Arg(10000);
+
 }  // namespace dfly
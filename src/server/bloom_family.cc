@@ -0,0 +1,206 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/bloom_family.h"
+
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+
+#include "base/logging.h"
+#include "core/bloom.h"
+#include "server/command_registry.h"
+#include "server/conn_context.h"
+#include "server/engine_shard_set.h"
+#include "server/error.h"
+#include "server/transaction.h"
+
+namespace dfly {
+
+using namespace std;
+using namespace facade;
+
+namespace {
+
+// Limits the memory that a single BF.RESERVE allocates.
+constexpr uint64_t kMaxCapacity = 1ULL << 32;
+
+struct ReserveParams {
+  double fp_prob;
+  uint64_t capacity;
+  uint32_t grow_factor = SBF::kDefaultGrowFactor;
+};
+
+OpStatus OpReserve(const OpArgs& op_args, string_view key, const ReserveParams& params) {
+  auto& db_slice = op_args.shard->db_slice();
+  auto [it, added] = db_slice.AddOrFind(op_args.db_cntx, key);
+  if (!added)
+    return OpStatus::KEY_EXISTS;
+
+  it->second.SetSBF(
+      SBF(params.capacity, params.fp_prob, params.grow_factor, CompactObj::memory_resource()));
+  db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, false);
+  return OpStatus::OK;
+}
+
+// Adds the items, creating the filter with the default parameters, as RedisBloom does.
+OpResult<vector<bool>> OpAdd(const OpArgs& op_args, string_view key, ArgSlice items) {
+  auto& db_slice = op_args.shard->db_slice();
+  auto [it, added] = db_slice.AddOrFind(op_args.db_cntx, key);
+  if (added) {
+    it->second.SetSBF(SBF(SBF::kDefaultCapacity, SBF::kDefaultFpProb, SBF::kDefaultGrowFactor,
+                          CompactObj::memory_resource()));
+  } else {
+    if (it->second.ObjType() != OBJ_SBF)
+      return OpStatus::WRONG_TYPE;
+    db_slice.PreUpdate(op_args.db_cntx.db_index, it);
+  }
+
+  SBF* sbf = it->second.GetSBF();
+  vector<bool> res(items.size());
+  for (size_t i = 0; i < items.size(); ++i) {
+    res[i] = sbf->Add(items[i]);
+  }
+  db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, !added);
+  return res;
+}
+
+OpResult<vector<bool>> OpExists(const OpArgs& op_args, string_view key, ArgSlice items) {
+  OpResult<PrimeIterator> it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_SBF);
+  if (it_res.status() == OpStatus::KEY_NOTFOUND)
+    return vector<bool>(items.size(), false);
+  if (!it_res)
+    return it_res.status();
+
+  const SBF* sbf = it_res.value()->second.GetSBF();
+  vector<bool> res(items.size());
+  for (size_t i = 0; i < items.size(); ++i) {
+    res[i] = sbf->Exists(items[i]);
+  }
+  return res;
+}
+
+vector<string_view> ItemArgs(CmdArgList args) {
+  vector<string_view> items(args.size() - 2);
+  for (size_t i = 2; i < args.size(); ++i) {
+    items[i - 2] = ArgS(args, i);
+  }
+  return items;
+}
+
+void SendResults(const OpResult<vector<bool>>& result, bool as_array, ConnectionContext* cntx) {
+  if (!result) {
+    return (*cntx)->SendError(result.status());
+  }
+
+  if (!as_array) {
+    DCHECK_EQ(1u, result->size());
+    return (*cntx)->SendLong(result->front());
+  }
+
+  (*cntx)->StartArray(result->size());
+  for (bool val : *result) {
+    (*cntx)->SendLong(val);
+  }
+}
+
+void BFReserve(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  ReserveParams params;
+
+  if (!absl::SimpleAtod(ArgS(args, 2), &params.fp_prob)) {
+    return (*cntx)->SendError("bad error rate");
+  }
+  if (!(params.fp_prob > 0 && params.fp_prob < 1)) {
+    return (*cntx)->SendError("(0 < error rate range < 1)");
+  }
+  if (!absl::SimpleAtoi(ArgS(args, 3), &params.capacity)) {
+    return (*cntx)->SendError("bad capacity");
+  }
+  if (params.capacity == 0 || params.capacity > kMaxCapacity) {
+    return (*cntx)->SendError(absl::StrCat("capacity should be in range [1, ", kMaxCapacity, "]"));
+  }
+
+  for (size_t i = 4; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view arg = ArgS(args, i);
+    if (arg == "EXPANSION" && i + 1 < args.size()) {
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &params.grow_factor) || params.grow_factor == 0) {
+        return (*cntx)->SendError("bad expansion");
+      }
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpReserve(t->GetOpArgs(shard), key, params);
+  };
+
+  OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
+  if (status == OpStatus::OK) {
+    return (*cntx)->SendOk();
+  }
+  if (status == OpStatus::KEY_EXISTS) {
+    return (*cntx)->SendError("item exists");
+  }
+  (*cntx)->SendError(status);
+}
+
+void BFAddGeneric(CmdArgList args, bool as_array, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  vector<string_view> items = ItemArgs(args);
+  ArgSlice item_slice{items.data(), items.size()};
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpAdd(t->GetOpArgs(shard), key, item_slice);
+  };
+
+  OpResult<vector<bool>> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  SendResults(result, as_array, cntx);
+}
+
+void BFExistsGeneric(CmdArgList args, bool as_array, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  vector<string_view> items = ItemArgs(args);
+  ArgSlice item_slice{items.data(), items.size()};
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpExists(t->GetOpArgs(shard), key, item_slice);
+  };
+
+  OpResult<vector<bool>> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  SendResults(result, as_array, cntx);
+}
+
+void BFAdd(CmdArgList args, ConnectionContext* cntx) {
+  BFAddGeneric(args, false, cntx);
+}
+
+void BFMAdd(CmdArgList args, ConnectionContext* cntx) {
+  BFAddGeneric(args, true, cntx);
+}
+
+void BFExists(CmdArgList args, ConnectionContext* cntx) {
+  BFExistsGeneric(args, false, cntx);
+}
+
+void BFMExists(CmdArgList args, ConnectionContext* cntx) {
+  BFExistsGeneric(args, true, cntx);
+}
+
+}  // namespace
+
+using CI = CommandId;
+
+#define HFUNC(x) SetHandler(&x)
+
+void BloomFamily::Register(CommandRegistry* registry) {
+  *registry << CI{"BF.RESERVE", CO::WRITE | CO::DENYOOM | CO::FAST, -4, 1, 1, 1}.HFUNC(BFReserve)
+            << CI{"BF.ADD", CO::WRITE | CO::DENYOOM | CO::FAST, 3, 1, 1, 1}.HFUNC(BFAdd)
+            << CI{"BF.MADD", CO::WRITE | CO::DENYOOM | CO::FAST, -3, 1, 1, 1}.HFUNC(BFMAdd)
+            << CI{"BF.EXISTS", CO::READONLY | CO::FAST, 3, 1, 1, 1}.HFUNC(BFExists)
+            << CI{"BF.MEXISTS", CO::READONLY | CO::FAST, -3, 1, 1, 1}.HFUNC(BFMExists);
+}
+
+}  // namespace dfly
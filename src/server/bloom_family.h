@@ -0,0 +1,22 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+/// @brief Implements the scalable bloom filter commands of RedisBloom: BF.RESERVE, BF.ADD,
+/// BF.MADD, BF.EXISTS and BF.MEXISTS. The filters are values of type OBJ_SBF, see core/bloom.h.
+///     BF.RESERVE: https://redis.io/commands/bf.reserve/
+///     BF.ADD: https://redis.io/commands/bf.add/
+///     BF.MADD: https://redis.io/commands/bf.madd/
+///     BF.EXISTS: https://redis.io/commands/bf.exists/
+///     BF.MEXISTS: https://redis.io/commands/bf.mexists/
+namespace dfly {
+class CommandRegistry;
+
+class BloomFamily {
+ public:
+  static void Register(CommandRegistry* registry);
+};
+
+}  // namespace dfly
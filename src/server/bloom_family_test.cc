@@ -0,0 +1,72 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/bloom_family.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "facade/facade_test.h"
+#include "server/command_registry.h"
+#include "server/test_utils.h"
+
+using namespace testing;
+using namespace std;
+using namespace util;
+
+namespace dfly {
+
+class BloomFamilyTest : public BaseFamilyTest {};
+
+TEST_F(BloomFamilyTest, Reserve) {
+  EXPECT_EQ("OK", Run({"bf.reserve", "bf", "0.01", "1000"}));
+  EXPECT_THAT(Run({"bf.reserve", "bf", "0.01", "1000"}), ErrArg("item exists"));
+  EXPECT_EQ("MBbloom--", Run({"type", "bf"}));
+
+  EXPECT_THAT(Run({"bf.reserve", "bf2", "foo", "1000"}), ErrArg("bad error rate"));
+  EXPECT_THAT(Run({"bf.reserve", "bf2", "1", "1000"}), ErrArg("error rate range"));
+  EXPECT_THAT(Run({"bf.reserve", "bf2", "0.01", "foo"}), ErrArg("bad capacity"));
+  EXPECT_THAT(Run({"bf.reserve", "bf2", "0.01", "0"}), ErrArg("capacity should be"));
+  EXPECT_THAT(Run({"bf.reserve", "bf2", "0.01", "10", "expansion", "0"}), ErrArg("expansion"));
+  EXPECT_THAT(Run({"bf.reserve", "bf2", "0.01", "10", "foo"}), ErrArg("syntax error"));
+  EXPECT_EQ("OK", Run({"bf.reserve", "bf2", "0.01", "10", "expansion", "4"}));
+  EXPECT_EQ(0, CheckedInt({"exists", "bf3"}));
+}
+
+TEST_F(BloomFamilyTest, AddExists) {
+  EXPECT_EQ(1, CheckedInt({"bf.add", "bf", "a"}));
+  EXPECT_EQ(0, CheckedInt({"bf.add", "bf", "a"}));
+  EXPECT_EQ(1, CheckedInt({"bf.exists", "bf", "a"}));
+  EXPECT_EQ(0, CheckedInt({"bf.exists", "bf", "b"}));
+  EXPECT_EQ(0, CheckedInt({"bf.exists", "missing", "a"}));
+
+  auto resp = Run({"bf.madd", "bf", "a", "b", "c"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(0), IntArg(1), IntArg(1)));
+  resp = Run({"bf.mexists", "bf", "a", "d", "c"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), IntArg(0), IntArg(1)));
+  resp = Run({"bf.mexists", "missing", "a", "b"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(0), IntArg(0)));
+
+  Run({"set", "str", "foo"});
+  EXPECT_THAT(Run({"bf.add", "str", "a"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"bf.exists", "str", "a"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"get", "bf"}), ErrArg("WRONGTYPE"));
+}
+
+TEST_F(BloomFamilyTest, Scale) {
+  EXPECT_EQ("OK", Run({"bf.reserve", "bf", "0.01", "100"}));
+  for (unsigned i = 0; i < 5000; ++i) {
+    Run({"bf.add", "bf", absl::StrCat("x", i)});
+  }
+
+  unsigned positives = 0;
+  for (unsigned i = 0; i < 5000; ++i) {
+    EXPECT_EQ(1, CheckedInt({"bf.exists", "bf", absl::StrCat("x", i)}));
+    positives += CheckedInt({"bf.exists", "bf", absl::StrCat("y", i)});
+  }
+  EXPECT_LT(positives, 100);
+}
+
+}  // namespace dfly
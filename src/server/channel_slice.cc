@@ -18,19 +18,37 @@ ChannelSlice::Subscriber::Subscriber(ConnectionContext* cntx, uint32_t tid)
 }
 
 void ChannelSlice::AddSubscription(string_view channel, ConnectionContext* me, uint32_t thread_id) {
-  auto [it, added] = channels_.emplace(channel, nullptr);
+  Add(channel, me, thread_id, &channels_);
+}
+
+void ChannelSlice::RemoveSubscription(string_view channel, ConnectionContext* me) {
+  Remove(channel, me, &channels_);
+}
+
+void ChannelSlice::AddShardSubscription(string_view channel, ConnectionContext* me,
+                                        uint32_t thread_id) {
+  Add(channel, me, thread_id, &shard_channels_);
+}
+
+void ChannelSlice::RemoveShardSubscription(string_view channel, ConnectionContext* me) {
+  Remove(channel, me, &shard_channels_);
+}
+
+void ChannelSlice::Add(string_view channel, ConnectionContext* me, uint32_t thread_id,
+                       ChannelMap* dest) {
+  auto [it, added] = dest->emplace(channel, nullptr);
   if (added) {
     it->second.reset(new Channel);
   }
   it->second->subscribers.emplace(me, SubscriberInternal{thread_id});
 }
 
-void ChannelSlice::RemoveSubscription(string_view channel, ConnectionContext* me) {
-  auto it = channels_.find(channel);
-  if (it != channels_.end()) {
+void ChannelSlice::Remove(string_view channel, ConnectionContext* me, ChannelMap* dest) {
+  auto it = dest->find(channel);
+  if (it != dest->end()) {
     it->second->subscribers.erase(me);
     if (it->second->subscribers.empty())
-      channels_.erase(it);
+      dest->erase(it);
   }
 }
 
@@ -38,6 +56,7 @@ void ChannelSlice::AddGlobPattern(string_view pattern, ConnectionContext* me, ui
   auto [it, added] = patterns_.emplace(pattern, nullptr);
   if (added) {
     it->second.reset(new Channel);
+    pattern_index_.Add(pattern);
   }
   it->second->subscribers.emplace(me, SubscriberInternal{thread_id});
 }
@@ -46,8 +65,10 @@ void ChannelSlice::RemoveGlobPattern(string_view pattern, ConnectionContext* me)
   auto it = patterns_.find(pattern);
   if (it != patterns_.end()) {
     it->second->subscribers.erase(me);
-    if (it->second->subscribers.empty())
+    if (it->second->subscribers.empty()) {
+      pattern_index_.Remove(pattern);
       patterns_.erase(it);
+    }
   }
 }
 
@@ -60,12 +81,22 @@ auto ChannelSlice::FetchSubscribers(string_view channel) -> vector<Subscriber> {
     CopySubscribers(it->second->subscribers, string{}, &res);
   }
 
-  for (const auto& k_v : patterns_) {
-    const string& pat = k_v.first;
-    // 1 - match
-    if (stringmatchlen(pat.data(), pat.size(), channel.data(), channel.size(), 0) == 1) {
-      CopySubscribers(k_v.second->subscribers, pat, &res);
-    }
+  pattern_index_.Match(channel, [&](const string& pat) {
+    auto it = patterns_.find(pat);
+    DCHECK(it != patterns_.end());
+    CopySubscribers(it->second->subscribers, pat, &res);
+  });
+
+  return res;
+}
+
+auto ChannelSlice::FetchShardSubscribers(string_view channel) -> vector<Subscriber> {
+  vector<Subscriber> res;
+
+  auto it = shard_channels_.find(channel);
+  if (it != shard_channels_.end()) {
+    res.reserve(it->second->subscribers.size());
+    CopySubscribers(it->second->subscribers, string{}, &res);
   }
 
   return res;
@@ -86,8 +117,16 @@ void ChannelSlice::CopySubscribers(const SubscribeMap& src, const std::string& p
 }
 
 vector<string> ChannelSlice::ListChannels(const string_view pattern) const {
+  return List(channels_, pattern);
+}
+
+vector<string> ChannelSlice::ListShardChannels(const string_view pattern) const {
+  return List(shard_channels_, pattern);
+}
+
+vector<string> ChannelSlice::List(const ChannelMap& src, string_view pattern) {
   vector<string> res;
-  for (const auto& k_v : channels_) {
+  for (const auto& k_v : src) {
     const string& channel = k_v.first;
 
     if (pattern.empty() || stringmatchlen(pattern.data(), pattern.size(), channel.data(), channel.size(), 0) == 1) {
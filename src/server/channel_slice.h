@@ -7,6 +7,7 @@
 
 #include <string_view>
 
+#include "core/glob_index.h"
 #include "server/conn_context.h"
 
 namespace dfly {
@@ -43,6 +44,15 @@ class ChannelSlice {
   std::vector<std::string> ListChannels(const std::string_view pattern) const;
   size_t PatternCount() const;
 
+  // Shard channels of SSUBSCRIBE/SPUBLISH. They are a namespace of their own that the patterns
+  // do not match, so a channel lives only in the slice of its shard, like a key.
+  std::vector<Subscriber> FetchShardSubscribers(std::string_view channel);
+
+  void AddShardSubscription(std::string_view channel, ConnectionContext* me, uint32_t thread_id);
+  void RemoveShardSubscription(std::string_view channel, ConnectionContext* me);
+
+  std::vector<std::string> ListShardChannels(const std::string_view pattern) const;
+
  private:
   struct SubscriberInternal {
     uint32_t thread_id;  // proactor thread id.
@@ -60,8 +70,17 @@ class ChannelSlice {
     SubscribeMap subscribers;
   };
 
-  absl::flat_hash_map<std::string, std::unique_ptr<Channel>> channels_;
-  absl::flat_hash_map<std::string, std::unique_ptr<Channel>> patterns_;
+  using ChannelMap = absl::flat_hash_map<std::string, std::unique_ptr<Channel>>;
+
+  static void Add(std::string_view channel, ConnectionContext* me, uint32_t thread_id,
+                  ChannelMap* dest);
+  static void Remove(std::string_view channel, ConnectionContext* me, ChannelMap* dest);
+  static std::vector<std::string> List(const ChannelMap& src, std::string_view pattern);
+
+  ChannelMap channels_;
+  ChannelMap shard_channels_;
+  ChannelMap patterns_;
+  GlobIndex pattern_index_;  // the keys of patterns_, compiled for matching the channels.
 };
 
 }  // namespace dfly
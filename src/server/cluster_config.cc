@@ -0,0 +1,135 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/cluster_config.h"
+
+extern "C" {
+#include "redis/crc16.h"
+}
+
+#include "base/flags.h"
+#include "base/logging.h"
+
+ABSL_FLAG(bool, cluster_mode, false,
+          "If true, the server runs as a node of a redis compatible cluster: the keys are "
+          "assigned to 16384 hash slots and the commands on slots that other nodes own are "
+          "redirected with MOVED or ASK. The topology is set with DFLYCLUSTER CONFIG");
+
+namespace dfly {
+
+using namespace std;
+
+void ClusterConfig::Initialize() {
+  enabled_ = absl::GetFlag(FLAGS_cluster_mode);
+}
+
+SlotId ClusterConfig::KeySlot(string_view key) {
+  string_view tag = KeyTag(key);
+  return crc16(tag.data(), tag.size()) & kMaxSlotNum;
+}
+
+ClusterConfig::ClusterConfig(string my_id)
+    : my_id_(std::move(my_id)), slot_shard_(kMaxSlotNum + 1, kUnassigned) {
+}
+
+shared_ptr<ClusterConfig> ClusterConfig::Create(string my_id, ClusterShards shards) {
+  if (shards.size() >= kUnassigned)
+    return nullptr;
+
+  shared_ptr<ClusterConfig> res(new ClusterConfig(std::move(my_id)));
+  for (size_t i = 0; i < shards.size(); ++i) {
+    if (shards[i].master.id.empty())
+      return nullptr;
+
+    for (const SlotRange& range : shards[i].slot_ranges) {
+      if (range.start > range.end || range.end > kMaxSlotNum)
+        return nullptr;
+
+      for (unsigned slot = range.start; slot <= range.end; ++slot) {
+        if (res->slot_shard_[slot] != kUnassigned)
+          return nullptr;
+        res->slot_shard_[slot] = i;
+      }
+    }
+  }
+
+  res->shards_ = std::move(shards);
+  res->UpdateSlotRanges();
+  return res;
+}
+
+auto ClusterConfig::SlotOwner(SlotId id) const -> const Node* {
+  DCHECK_LE(id, kMaxSlotNum);
+  uint16_t index = slot_shard_[id];
+  return index == kUnassigned ? nullptr : &shards_[index].master;
+}
+
+bool ClusterConfig::IsMySlot(SlotId id) const {
+  const Node* owner = SlotOwner(id);
+  return owner && owner->id == my_id_;
+}
+
+auto ClusterConfig::FindNode(string_view id) const -> const Node* {
+  for (const ClusterShard& shard : shards_) {
+    if (shard.master.id == id)
+      return &shard.master;
+    for (const Node& replica : shard.replicas) {
+      if (replica.id == id)
+        return &replica;
+    }
+  }
+  return nullptr;
+}
+
+auto ClusterConfig::GetSlotState(SlotId id, const Node** node) const -> SlotState {
+  auto it = migrations_.find(id);
+  if (it == migrations_.end())
+    return SlotState::kStable;
+
+  *node = &it->second.second;
+  return it->second.first;
+}
+
+bool ClusterConfig::SetSlotOwner(SlotId id, string_view master_id) {
+  DCHECK_LE(id, kMaxSlotNum);
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    if (shards_[i].master.id == master_id) {
+      slot_shard_[id] = i;
+      migrations_.erase(id);
+      UpdateSlotRanges();
+      return true;
+    }
+  }
+  return false;
+}
+
+void ClusterConfig::SetSlotState(SlotId id, SlotState state, const Node& node) {
+  DCHECK_LE(id, kMaxSlotNum);
+  if (state == SlotState::kStable) {
+    migrations_.erase(id);
+  } else {
+    migrations_[id] = {state, node};
+  }
+}
+
+void ClusterConfig::UpdateSlotRanges() {
+  for (ClusterShard& shard : shards_) {
+    shard.slot_ranges.clear();
+  }
+
+  for (unsigned slot = 0; slot <= kMaxSlotNum; ++slot) {
+    uint16_t index = slot_shard_[slot];
+    if (index == kUnassigned)
+      continue;
+
+    auto& ranges = shards_[index].slot_ranges;
+    if (!ranges.empty() && ranges.back().end + 1u == slot) {
+      ranges.back().end = slot;
+    } else {
+      ranges.push_back(SlotRange{SlotId(slot), SlotId(slot)});
+    }
+  }
+}
+
+}  // namespace dfly
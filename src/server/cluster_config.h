@@ -0,0 +1,118 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dfly {
+
+using SlotId = uint16_t;
+
+// Returns the hashtag of the key, with the redis cluster rules: the part between the first '{'
+// and the first '}' after it, if it is not empty, and the whole key otherwise.
+inline std::string_view KeyTag(std::string_view key) {
+  size_t start = key.find('{');
+  if (start == std::string_view::npos)
+    return key;
+
+  size_t end = key.find('}', start + 1);
+  if (end == std::string_view::npos || end == start + 1)
+    return key;
+
+  return key.substr(start + 1, end - start - 1);
+}
+
+// The topology of a redis compatible cluster: the 16384 hash slots and the nodes that own them,
+// as configured by the cluster manager with DFLYCLUSTER CONFIG. The published config is not
+// modified, every change is applied to a copy that is then published to all the threads, see
+// ClusterFamily.
+class ClusterConfig {
+ public:
+  static constexpr SlotId kMaxSlotNum = 0x3FFF;
+
+  struct Node {
+    std::string id;
+    std::string ip;
+    uint16_t port = 0;
+  };
+
+  struct SlotRange {
+    SlotId start = 0;
+    SlotId end = 0;
+  };
+
+  struct ClusterShard {
+    std::vector<SlotRange> slot_ranges;
+    Node master;
+    std::vector<Node> replicas;
+  };
+
+  using ClusterShards = std::vector<ClusterShard>;
+
+  // The state of a slot during its migration, see CLUSTER SETSLOT.
+  enum class SlotState : uint8_t { kStable, kMigrating, kImporting };
+
+  // Reads --cluster_mode, before the shards start.
+  static void Initialize();
+
+  static bool IsEnabled() {
+    return enabled_;
+  }
+
+  // The slot of the key, hashed with crc16 over its hashtag, as in redis cluster.
+  static SlotId KeySlot(std::string_view key);
+
+  // Returns null if the slot ranges of the shards overlap or are invalid, or if a shard has no
+  // master id.
+  static std::shared_ptr<ClusterConfig> Create(std::string my_id, ClusterShards shards);
+
+  // Returns the master that owns the slot, or null if it is not assigned.
+  const Node* SlotOwner(SlotId id) const;
+
+  bool IsMySlot(SlotId id) const;
+
+  // Returns the node that is either a master or a replica with this id, or null.
+  const Node* FindNode(std::string_view id) const;
+
+  // Returns the target of the slot if it is migrating, or its source if it is importing.
+  SlotState GetSlotState(SlotId id, const Node** node) const;
+
+  // Moves the slot to the shard of the master with this id, and makes it stable. Returns false
+  // if there is no such master.
+  bool SetSlotOwner(SlotId id, std::string_view master_id);
+
+  void SetSlotState(SlotId id, SlotState state, const Node& node);
+
+  const std::string& my_id() const {
+    return my_id_;
+  }
+
+  // The shards with their slot ranges.
+  const ClusterShards& shards() const {
+    return shards_;
+  }
+
+ private:
+  static constexpr uint16_t kUnassigned = UINT16_MAX;
+
+  explicit ClusterConfig(std::string my_id);
+
+  // Recomputes the slot ranges of the shards from slot_shard_.
+  void UpdateSlotRanges();
+
+  std::string my_id_;
+  ClusterShards shards_;
+  std::vector<uint16_t> slot_shard_;  // the index in shards_ of the owner of every slot.
+  absl::flat_hash_map<SlotId, std::pair<SlotState, Node>> migrations_;
+
+  static inline bool enabled_ = false;
+};
+
+}  // namespace dfly
@@ -0,0 +1,509 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/cluster_family.h"
+
+#include <absl/random/random.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+
+#include <jsoncons/json.hpp>
+
+#include "base/logging.h"
+#include "core/json_object.h"
+#include "server/command_registry.h"
+#include "server/conn_context.h"
+#include "server/engine_shard_set.h"
+#include "server/error.h"
+#include "server/server_state.h"
+#include "server/transaction.h"
+
+namespace dfly {
+
+using namespace std;
+using namespace facade;
+using namespace util;
+
+namespace fibers = ::boost::fibers;
+
+using Node = ClusterConfig::Node;
+using SlotState = ClusterConfig::SlotState;
+
+namespace {
+
+constexpr size_t kNodeIdLen = 40;
+constexpr char kClusterDisabled[] = "Cluster mode is not enabled";
+constexpr char kClusterNotConfigured[] = "-CLUSTERDOWN Hash slot not served";
+constexpr char kInvalidSlot[] = "Invalid or out of range slot";
+
+ProactorPool* pool = nullptr;
+string my_id;
+
+// Guards the config that the next change is applied to.
+fibers::mutex config_mu;
+shared_ptr<const ClusterConfig> config;
+
+void PublishConfig(shared_ptr<const ClusterConfig> new_config) {
+  config = new_config;
+  pool->AwaitFiberOnAll(
+      [&](ProactorBase*) { ServerState::tlocal()->cluster_config = new_config; });
+}
+
+bool ParseSlot(string_view str, SlotId* slot) {
+  uint32_t val;
+  if (!absl::SimpleAtoi(str, &val) || val > ClusterConfig::kMaxSlotNum)
+    return false;
+  *slot = val;
+  return true;
+}
+
+optional<Node> ParseNode(const JsonType& json) {
+  if (!json.is_object() || !json.contains("id") || !json.contains("ip") ||
+      !json.contains("port"))
+    return nullopt;
+
+  const JsonType& id = json.at("id");
+  const JsonType& ip = json.at("ip");
+  const JsonType& port = json.at("port");
+  if (!id.is_string() || !ip.is_string() || !port.is_uint64() || port.as<uint64_t>() > UINT16_MAX)
+    return nullopt;
+
+  return Node{id.as<string>(), ip.as<string>(), port.as<uint16_t>()};
+}
+
+// Parses the shards of DFLYCLUSTER CONFIG, i.e.
+// [{"slot_ranges": [{"start": 0, "end": 8191}],
+//   "master": {"id": "...", "ip": "10.0.0.1", "port": 6379},
+//   "replicas": [{"id": "...", "ip": "10.0.0.2", "port": 6379}]}, ...]
+optional<ClusterConfig::ClusterShards> ParseShards(const JsonType& json) {
+  if (!json.is_array())
+    return nullopt;
+
+  ClusterConfig::ClusterShards shards;
+  for (const auto& item : json.array_range()) {
+    if (!item.is_object() || !item.contains("slot_ranges") || !item.contains("master"))
+      return nullopt;
+
+    ClusterConfig::ClusterShard shard;
+    const JsonType& ranges = item.at("slot_ranges");
+    if (!ranges.is_array())
+      return nullopt;
+
+    for (const auto& range : ranges.array_range()) {
+      if (!range.is_object() || !range.contains("start") || !range.contains("end") ||
+          !range.at("start").is_uint64() || !range.at("end").is_uint64())
+        return nullopt;
+
+      uint64_t start = range.at("start").as<uint64_t>(), end = range.at("end").as<uint64_t>();
+      if (end > ClusterConfig::kMaxSlotNum)
+        return nullopt;
+      shard.slot_ranges.push_back({SlotId(start), SlotId(end)});
+    }
+
+    optional<Node> master = ParseNode(item.at("master"));
+    if (!master)
+      return nullopt;
+    shard.master = std::move(*master);
+
+    if (item.contains("replicas")) {
+      const JsonType& replicas = item.at("replicas");
+      if (!replicas.is_array())
+        return nullopt;
+      for (const auto& replica : replicas.array_range()) {
+        optional<Node> node = ParseNode(replica);
+        if (!node)
+          return nullopt;
+        shard.replicas.push_back(std::move(*node));
+      }
+    }
+    shards.push_back(std::move(shard));
+  }
+  return shards;
+}
+
+// Returns the number of the keys that exist, all of them belong to the same slot.
+unsigned CountExisting(const vector<string_view>& keys, DbIndex db_index) {
+  ShardId sid = Shard(keys.front(), shard_set->size());
+  return shard_set->Await(sid, [&] {
+    auto& db_slice = EngineShard::tlocal()->db_slice();
+    DbContext db_cntx{db_index, GetCurrentTimeMs()};
+    unsigned res = 0;
+    for (string_view key : keys) {
+      res += IsValid(db_slice.FindExt(db_cntx, key).first);
+    }
+    return res;
+  });
+}
+
+void SendNode(const Node& node, RedisReplyBuilder* rb) {
+  rb->StartArray(3);
+  rb->SendBulkString(node.ip);
+  rb->SendLong(node.port);
+  rb->SendBulkString(node.id);
+}
+
+}  // namespace
+
+void ClusterFamily::Init(ProactorPool* pp) {
+  pool = pp;
+
+  absl::InsecureBitGen gen;
+  my_id = GetRandomHex(gen, kNodeIdLen);
+}
+
+void ClusterFamily::Shutdown() {
+  lock_guard lk(config_mu);
+  config.reset();
+}
+
+bool ClusterFamily::CheckKeySlots(const CommandId* cid, CmdArgList args,
+                                  ConnectionContext* cntx) {
+  bool asking = cntx->conn_state.asking;
+  if (string_view{cid->name()} != "ASKING")
+    cntx->conn_state.asking = false;
+
+  // The commands of the master are applied as they are.
+  bool has_keys = cid->first_key_pos() > 0 || (cid->opt_mask() & CO::VARIADIC_KEYS);
+  if (cntx->is_replicating || !has_keys)
+    return true;
+
+  OpResult<KeyIndex> key_index = DetermineKeys(cid, args);
+  if (!key_index)
+    return true;  // the command replies with the error.
+
+  vector<string_view> keys;
+  for (unsigned i = key_index->start; i < key_index->end; i += key_index->step) {
+    keys.push_back(ArgS(args, i));
+  }
+  if (key_index->bonus)
+    keys.push_back(ArgS(args, key_index->bonus));
+  if (keys.empty())
+    return true;
+
+  SlotId slot = ClusterConfig::KeySlot(keys.front());
+  for (string_view key : keys) {
+    if (ClusterConfig::KeySlot(key) != slot) {
+      (*cntx)->SendError("-CROSSSLOT Keys in request don't hash to the same slot", "CROSSSLOT");
+      return false;
+    }
+  }
+
+  const ClusterConfig* cluster_config = ServerState::tlocal()->cluster_config.get();
+  if (!cluster_config) {
+    (*cntx)->SendError(kClusterNotConfigured, "CLUSTERDOWN");
+    return false;
+  }
+
+  const Node* node = nullptr;
+  SlotState state = cluster_config->GetSlotState(slot, &node);
+  if (cluster_config->IsMySlot(slot)) {
+    if (state != SlotState::kMigrating)
+      return true;
+
+    // The keys that were already moved to the target are accessed there.
+    unsigned existing = CountExisting(keys, cntx->db_index());
+    if (existing == keys.size())
+      return true;
+    if (existing > 0) {
+      (*cntx)->SendError("-TRYAGAIN Multiple keys request during rehashing of slot", "TRYAGAIN");
+      return false;
+    }
+    (*cntx)->SendError(absl::StrCat("-ASK ", slot, " ", node->ip, ":", node->port), "ASK");
+    return false;
+  }
+
+  if (state == SlotState::kImporting && asking)
+    return true;
+
+  const Node* owner = cluster_config->SlotOwner(slot);
+  if (!owner) {
+    (*cntx)->SendError(kClusterNotConfigured, "CLUSTERDOWN");
+    return false;
+  }
+  (*cntx)->SendError(absl::StrCat("-MOVED ", slot, " ", owner->ip, ":", owner->port), "MOVED");
+  return false;
+}
+
+void ClusterFamily::Cluster(CmdArgList args, ConnectionContext* cntx) {
+  if (!ClusterConfig::IsEnabled())
+    return (*cntx)->SendError(kClusterDisabled);
+
+  ToUpper(&args[1]);
+  string_view sub_cmd = ArgS(args, 1);
+
+  if (sub_cmd == "KEYSLOT" && args.size() == 3)
+    return (*cntx)->SendLong(ClusterConfig::KeySlot(ArgS(args, 2)));
+  if (sub_cmd == "MYID" && args.size() == 2)
+    return (*cntx)->SendBulkString(my_id);
+  if (sub_cmd == "SLOTS" && args.size() == 2)
+    return ClusterSlots(cntx);
+  if (sub_cmd == "SHARDS" && args.size() == 2)
+    return ClusterShards(cntx);
+  if (sub_cmd == "NODES" && args.size() == 2)
+    return ClusterNodes(cntx);
+  if (sub_cmd == "INFO" && args.size() == 2)
+    return ClusterInfo(cntx);
+  if (sub_cmd == "COUNTKEYSINSLOT" && args.size() == 3)
+    return KeysInSlot(args, true, cntx);
+  if (sub_cmd == "GETKEYSINSLOT" && args.size() == 4)
+    return KeysInSlot(args, false, cntx);
+  if (sub_cmd == "SETSLOT" && args.size() >= 4)
+    return SetSlot(args, cntx);
+
+  (*cntx)->SendError(UnknownSubCmd(sub_cmd, "CLUSTER"), kSyntaxErrType);
+}
+
+void ClusterFamily::ClusterSlots(ConnectionContext* cntx) {
+  const ClusterConfig* cluster_config = ServerState::tlocal()->cluster_config.get();
+  if (!cluster_config)
+    return (*cntx)->SendEmptyArray();
+
+  unsigned num_ranges = 0;
+  for (const auto& shard : cluster_config->shards()) {
+    num_ranges += shard.slot_ranges.size();
+  }
+
+  (*cntx)->StartArray(num_ranges);
+  for (const auto& shard : cluster_config->shards()) {
+    for (const auto& range : shard.slot_ranges) {
+      (*cntx)->StartArray(3 + shard.replicas.size());
+      (*cntx)->SendLong(range.start);
+      (*cntx)->SendLong(range.end);
+      SendNode(shard.master, cntx->operator->());
+      for (const Node& replica : shard.replicas) {
+        SendNode(replica, cntx->operator->());
+      }
+    }
+  }
+}
+
+void ClusterFamily::ClusterShards(ConnectionContext* cntx) {
+  const ClusterConfig* cluster_config = ServerState::tlocal()->cluster_config.get();
+  if (!cluster_config)
+    return (*cntx)->SendEmptyArray();
+
+  RedisReplyBuilder* rb = cntx->operator->();
+  auto send_node = [rb](const Node& node, bool is_master) {
+    rb->StartCollection(7, RedisReplyBuilder::MAP);
+    rb->SendBulkString("id");
+    rb->SendBulkString(node.id);
+    rb->SendBulkString("endpoint");
+    rb->SendBulkString(node.ip);
+    rb->SendBulkString("ip");
+    rb->SendBulkString(node.ip);
+    rb->SendBulkString("port");
+    rb->SendLong(node.port);
+    rb->SendBulkString("role");
+    rb->SendBulkString(is_master ? "master" : "replica");
+    rb->SendBulkString("replication-offset");
+    rb->SendLong(0);
+    rb->SendBulkString("health");
+    rb->SendBulkString("online");
+  };
+
+  rb->StartArray(cluster_config->shards().size());
+  for (const auto& shard : cluster_config->shards()) {
+    rb->StartCollection(2, RedisReplyBuilder::MAP);
+    rb->SendBulkString("slots");
+    rb->StartArray(shard.slot_ranges.size() * 2);
+    for (const auto& range : shard.slot_ranges) {
+      rb->SendLong(range.start);
+      rb->SendLong(range.end);
+    }
+
+    rb->SendBulkString("nodes");
+    rb->StartArray(1 + shard.replicas.size());
+    send_node(shard.master, true);
+    for (const Node& replica : shard.replicas) {
+      send_node(replica, false);
+    }
+  }
+}
+
+void ClusterFamily::ClusterNodes(ConnectionContext* cntx) {
+  const ClusterConfig* cluster_config = ServerState::tlocal()->cluster_config.get();
+  if (!cluster_config)
+    return (*cntx)->SendBulkString("");
+
+  string res;
+  auto append_node = [&](const Node& node, string_view master_id) {
+    absl::StrAppend(&res, node.id, " ", node.ip, ":", node.port, "@", node.port, " ");
+    if (node.id == my_id)
+      res.append("myself,");
+    absl::StrAppend(&res, master_id.empty() ? "master - " : "slave ",
+                    master_id.empty() ? "" : absl::StrCat(master_id, " "), "0 0 0 connected");
+  };
+
+  for (const auto& shard : cluster_config->shards()) {
+    append_node(shard.master, "");
+    for (const auto& range : shard.slot_ranges) {
+      if (range.start == range.end)
+        absl::StrAppend(&res, " ", range.start);
+      else
+        absl::StrAppend(&res, " ", range.start, "-", range.end);
+    }
+    res.append("\n");
+
+    for (const Node& replica : shard.replicas) {
+      append_node(replica, shard.master.id);
+      res.append("\n");
+    }
+  }
+  (*cntx)->SendBulkString(res);
+}
+
+void ClusterFamily::ClusterInfo(ConnectionContext* cntx) {
+  const ClusterConfig* cluster_config = ServerState::tlocal()->cluster_config.get();
+
+  size_t assigned = 0, known_nodes = 0, size = 0;
+  if (cluster_config) {
+    for (const auto& shard : cluster_config->shards()) {
+      for (const auto& range : shard.slot_ranges) {
+        assigned += range.end - range.start + 1;
+      }
+      known_nodes += 1 + shard.replicas.size();
+      size += !shard.slot_ranges.empty();
+    }
+  }
+
+  bool ok = assigned == ClusterConfig::kMaxSlotNum + 1u;
+  string res = absl::StrCat("cluster_state:", ok ? "ok" : "fail", "\r\n");
+  absl::StrAppend(&res, "cluster_slots_assigned:", assigned, "\r\n");
+  absl::StrAppend(&res, "cluster_slots_ok:", assigned, "\r\n");
+  absl::StrAppend(&res, "cluster_slots_pfail:0\r\n", "cluster_slots_fail:0\r\n");
+  absl::StrAppend(&res, "cluster_known_nodes:", known_nodes, "\r\n");
+  absl::StrAppend(&res, "cluster_size:", size, "\r\n");
+  (*cntx)->SendBulkString(res);
+}
+
+// The keys of a slot are all kept in one shard, which is scanned for them.
+void ClusterFamily::KeysInSlot(CmdArgList args, bool count_only, ConnectionContext* cntx) {
+  SlotId slot;
+  if (!ParseSlot(ArgS(args, 2), &slot))
+    return (*cntx)->SendError(kInvalidSlot);
+
+  size_t limit = SIZE_MAX;
+  if (!count_only && !absl::SimpleAtoi(ArgS(args, 3), &limit))
+    return (*cntx)->SendError(kInvalidIntErr);
+
+  DbIndex db_index = cntx->db_index();
+  vector<string> keys;
+  size_t count = 0;
+  shard_set->Await(slot % shard_set->size(), [&] {
+    auto& db_slice = EngineShard::tlocal()->db_slice();
+    if (!db_slice.IsDbValid(db_index))
+      return;
+
+    PrimeTable* prime = db_slice.GetPrimeTable(db_index);
+    PrimeTable::Cursor cursor;
+    string scratch;
+    auto cb = [&](PrimeIterator it) {
+      string_view key = it->first.GetSlice(&scratch);
+      if (count < limit && ClusterConfig::KeySlot(key) == slot) {
+        ++count;
+        if (!count_only)
+          keys.emplace_back(key);
+      }
+    };
+
+    do {
+      cursor = prime->Traverse(cursor, cb);
+    } while (cursor && count < limit);
+  });
+
+  if (count_only)
+    return (*cntx)->SendLong(count);
+  (*cntx)->SendStringArr(keys);
+}
+
+// CLUSTER SETSLOT <slot> MIGRATING <node-id> | IMPORTING <node-id> | STABLE | NODE <node-id>
+void ClusterFamily::SetSlot(CmdArgList args, ConnectionContext* cntx) {
+  SlotId slot;
+  if (!ParseSlot(ArgS(args, 2), &slot))
+    return (*cntx)->SendError(kInvalidSlot);
+
+  ToUpper(&args[3]);
+  string_view action = ArgS(args, 3);
+  bool is_stable = action == "STABLE";
+  if ((is_stable && args.size() != 4) || (!is_stable && args.size() != 5))
+    return (*cntx)->SendError(kSyntaxErr);
+
+  lock_guard lk(config_mu);
+  if (!config)
+    return (*cntx)->SendError(kClusterNotConfigured);
+
+  auto new_config = make_shared<ClusterConfig>(*config);
+  if (is_stable) {
+    new_config->SetSlotState(slot, SlotState::kStable, Node{});
+  } else {
+    string_view node_id = ArgS(args, 4);
+    const Node* node = new_config->FindNode(node_id);
+    if (!node)
+      return (*cntx)->SendError(absl::StrCat("Unknown node ", node_id));
+
+    if (action == "MIGRATING") {
+      if (!new_config->IsMySlot(slot))
+        return (*cntx)->SendError(absl::StrCat("I'm not the owner of hash slot ", slot));
+      new_config->SetSlotState(slot, SlotState::kMigrating, *node);
+    } else if (action == "IMPORTING") {
+      if (new_config->IsMySlot(slot))
+        return (*cntx)->SendError(absl::StrCat("I'm already the owner of hash slot ", slot));
+      new_config->SetSlotState(slot, SlotState::kImporting, *node);
+    } else if (action == "NODE") {
+      if (!new_config->SetSlotOwner(slot, node_id))
+        return (*cntx)->SendError("Can only assign the slot to a master node");
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
+  PublishConfig(std::move(new_config));
+  (*cntx)->SendOk();
+}
+
+// DFLYCLUSTER CONFIG <json> sets the topology, see ParseShards.
+void ClusterFamily::DflyCluster(CmdArgList args, ConnectionContext* cntx) {
+  if (!ClusterConfig::IsEnabled())
+    return (*cntx)->SendError(kClusterDisabled);
+
+  ToUpper(&args[1]);
+  string_view sub_cmd = ArgS(args, 1);
+  if (sub_cmd != "CONFIG" || args.size() != 3)
+    return (*cntx)->SendError(UnknownSubCmd(sub_cmd, "DFLYCLUSTER"), kSyntaxErrType);
+
+  optional<JsonType> json = JsonFromString(ArgS(args, 2));
+  if (!json)
+    return (*cntx)->SendError("Invalid JSON cluster config");
+
+  optional<ClusterConfig::ClusterShards> shards = ParseShards(*json);
+  shared_ptr<ClusterConfig> new_config;
+  if (shards)
+    new_config = ClusterConfig::Create(my_id, std::move(*shards));
+  if (!new_config)
+    return (*cntx)->SendError("Invalid cluster config");
+
+  lock_guard lk(config_mu);
+  PublishConfig(std::move(new_config));
+  (*cntx)->SendOk();
+}
+
+void ClusterFamily::Asking(CmdArgList args, ConnectionContext* cntx) {
+  if (!ClusterConfig::IsEnabled())
+    return (*cntx)->SendError(kClusterDisabled);
+
+  cntx->conn_state.asking = true;
+  (*cntx)->SendOk();
+}
+
+using CI = CommandId;
+
+#define HFUNC(x) SetHandler(&ClusterFamily::x)
+
+void ClusterFamily::Register(CommandRegistry* registry) {
+  *registry << CI{"CLUSTER", CO::READONLY | CO::LOADING, -2, 0, 0, 0}.HFUNC(Cluster)
+            << CI{"DFLYCLUSTER", CO::ADMIN | CO::LOADING, -2, 0, 0, 0}.HFUNC(DflyCluster)
+            << CI{"ASKING", CO::FAST | CO::LOADING, 1, 0, 0, 0}.HFUNC(Asking);
+}
+
+}  // namespace dfly
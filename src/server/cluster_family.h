@@ -0,0 +1,50 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include "facade/facade_types.h"
+
+namespace util {
+class ProactorPool;
+}  // namespace util
+
+namespace dfly {
+
+class CommandId;
+class CommandRegistry;
+class ConnectionContext;
+
+/// @brief Implements the redis cluster commands of a node in --cluster_mode, see
+/// https://redis.io/docs/reference/cluster-spec/. The cluster manager sets the topology with
+/// DFLYCLUSTER CONFIG and moves slots with CLUSTER SETSLOT, CLUSTER GETKEYSINSLOT and
+/// DUMP/RESTORE, while the clients follow the MOVED and ASK redirections.
+///     CLUSTER: https://redis.io/commands/cluster/
+///     ASKING: https://redis.io/commands/asking/
+class ClusterFamily {
+ public:
+  static void Init(util::ProactorPool* pp);
+  static void Shutdown();
+
+  static void Register(CommandRegistry* registry);
+
+  // Replies with a redirection and returns false if the command accesses keys of more than one
+  // slot, or of a slot that this node does not serve.
+  static bool CheckKeySlots(const CommandId* cid, facade::CmdArgList args,
+                            ConnectionContext* cntx);
+
+ private:
+  static void Cluster(facade::CmdArgList args, ConnectionContext* cntx);
+  static void DflyCluster(facade::CmdArgList args, ConnectionContext* cntx);
+  static void Asking(facade::CmdArgList args, ConnectionContext* cntx);
+
+  static void ClusterSlots(ConnectionContext* cntx);
+  static void ClusterShards(ConnectionContext* cntx);
+  static void ClusterNodes(ConnectionContext* cntx);
+  static void ClusterInfo(ConnectionContext* cntx);
+  static void KeysInSlot(facade::CmdArgList args, bool count_only, ConnectionContext* cntx);
+  static void SetSlot(facade::CmdArgList args, ConnectionContext* cntx);
+};
+
+}  // namespace dfly
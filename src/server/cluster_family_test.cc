@@ -0,0 +1,128 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/cluster_family.h"
+
+#include <absl/flags/declare.h>
+#include <absl/flags/flag.h>
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "facade/facade_test.h"
+#include "server/test_utils.h"
+
+ABSL_DECLARE_FLAG(bool, cluster_mode);
+
+using namespace testing;
+using namespace std;
+using namespace util;
+using absl::StrCat;
+
+namespace dfly {
+
+class ClusterFamilyTest : public BaseFamilyTest {
+ protected:
+  void SetUp() override {
+    absl::SetFlag(&FLAGS_cluster_mode, true);
+    BaseFamilyTest::SetUp();
+  }
+
+  void TearDown() override {
+    BaseFamilyTest::TearDown();
+    absl::SetFlag(&FLAGS_cluster_mode, false);
+  }
+
+  // This node owns the slots 0-8191 and the other node 8192-16383.
+  void SetConfig() {
+    string my_id = Run({"cluster", "myid"}).GetString();
+    string config = StrCat(R"([{"slot_ranges": [{"start": 0, "end": 8191}],
+                                "master": {"id": ")",
+                           my_id, R"(", "ip": "10.0.0.1", "port": 7000}},
+                               {"slot_ranges": [{"start": 8192, "end": 16383}],
+                                "master": {"id": "other", "ip": "10.0.0.2", "port": 7001},
+                                "replicas": [{"id": "replica", "ip": "10.0.0.3",
+                                              "port": 7002}]}])");
+    ASSERT_EQ(Run({"dflycluster", "config", config}), "OK");
+  }
+};
+
+TEST_F(ClusterFamilyTest, KeySlot) {
+  EXPECT_EQ(12182, CheckedInt({"cluster", "keyslot", "foo"}));
+  EXPECT_EQ(5061, CheckedInt({"cluster", "keyslot", "bar"}));
+  EXPECT_EQ(3443, CheckedInt({"cluster", "keyslot", "{user1000}.following"}));
+  EXPECT_EQ(3443, CheckedInt({"cluster", "keyslot", "{user1000}.followers"}));
+  EXPECT_EQ(40, Run({"cluster", "myid"}).GetString().size());
+}
+
+TEST_F(ClusterFamilyTest, Config) {
+  EXPECT_THAT(Run({"get", "bar"}), ErrArg("CLUSTERDOWN"));
+  EXPECT_THAT(Run({"cluster", "slots"}), ArrLen(0));
+  EXPECT_THAT(Run({"dflycluster", "config", "[{}]"}), ErrArg("Invalid cluster config"));
+  EXPECT_THAT(Run({"dflycluster", "config", "{"}), ErrArg("Invalid JSON"));
+
+  // Overlapping slots.
+  string overlap = R"([{"slot_ranges": [{"start": 0, "end": 10}],
+                        "master": {"id": "a", "ip": "10.0.0.1", "port": 7000}},
+                       {"slot_ranges": [{"start": 10, "end": 20}],
+                        "master": {"id": "b", "ip": "10.0.0.2", "port": 7000}}])";
+  EXPECT_THAT(Run({"dflycluster", "config", overlap}), ErrArg("Invalid cluster config"));
+
+  SetConfig();
+  auto resp = Run({"cluster", "slots"});
+  ASSERT_THAT(resp, ArrLen(2));
+  const auto& slots = resp.GetVec();
+  ASSERT_THAT(slots[1], ArrLen(4));
+  EXPECT_THAT(slots[1].GetVec()[0], IntArg(8192));
+  EXPECT_THAT(slots[1].GetVec()[1], IntArg(16383));
+  EXPECT_THAT(slots[1].GetVec()[2].GetVec(), ElementsAre("10.0.0.2", IntArg(7001), "other"));
+
+  EXPECT_THAT(Run({"cluster", "shards"}), ArrLen(2));
+  EXPECT_THAT(Run({"cluster", "info"}).GetString(), HasSubstr("cluster_state:ok"));
+  EXPECT_THAT(Run({"cluster", "info"}).GetString(), HasSubstr("cluster_known_nodes:3"));
+  string nodes = Run({"cluster", "nodes"}).GetString();
+  EXPECT_THAT(nodes, HasSubstr("myself,master - 0 0 0 connected 0-8191"));
+  EXPECT_THAT(nodes, HasSubstr("replica 10.0.0.3:7002@7002 slave other"));
+
+  EXPECT_EQ(Run({"set", "bar", "1"}), "OK");
+  EXPECT_THAT(Run({"set", "foo", "1"}), ErrArg("MOVED 12182 10.0.0.2:7001"));
+  EXPECT_THAT(Run({"mget", "bar", "key2"}), ErrArg("CROSSSLOT"));
+  EXPECT_THAT(Run({"select", "1"}), ErrArg("not allowed in cluster mode"));
+}
+
+TEST_F(ClusterFamilyTest, Migration) {
+  SetConfig();
+  Run({"set", "bar", "1"});
+  Run({"set", "{bar}2", "1"});
+  EXPECT_EQ(2, CheckedInt({"cluster", "countkeysinslot", "5061"}));
+  EXPECT_THAT(Run({"cluster", "getkeysinslot", "5061", "1"}).GetString(), AnyOf("bar", "{bar}2"));
+  EXPECT_THAT(Run({"cluster", "getkeysinslot", "5061", "10"}), ArrLen(2));
+  EXPECT_EQ(0, CheckedInt({"cluster", "countkeysinslot", "5062"}));
+  EXPECT_THAT(Run({"cluster", "countkeysinslot", "16384"}), ErrArg("Invalid"));
+
+  // The keys that are still here are served, the moved ones are redirected with ASK.
+  EXPECT_EQ(Run({"cluster", "setslot", "5061", "migrating", "other"}), "OK");
+  EXPECT_EQ(Run({"get", "bar"}), "1");
+  Run({"del", "bar"});
+  EXPECT_THAT(Run({"get", "bar"}), ErrArg("ASK 5061 10.0.0.2:7001"));
+  EXPECT_THAT(Run({"mget", "bar", "{bar}2"}), ErrArg("TRYAGAIN"));
+  EXPECT_EQ(Run({"cluster", "setslot", "5061", "node", "other"}), "OK");
+  EXPECT_THAT(Run({"get", "{bar}2"}), ErrArg("MOVED 5061 10.0.0.2:7001"));
+
+  // An importing slot is served only after ASKING.
+  EXPECT_THAT(Run({"cluster", "setslot", "12182", "migrating", "other"}), ErrArg("not the owner"));
+  EXPECT_EQ(Run({"cluster", "setslot", "12182", "importing", "other"}), "OK");
+  EXPECT_THAT(Run({"set", "foo", "1"}), ErrArg("MOVED 12182"));
+  EXPECT_EQ(Run({"asking"}), "OK");
+  EXPECT_EQ(Run({"set", "foo", "1"}), "OK");
+  EXPECT_THAT(Run({"get", "foo"}), ErrArg("MOVED 12182"));
+
+  EXPECT_EQ(Run({"cluster", "setslot", "12182", "node", Run({"cluster", "myid"}).GetString()}),
+            "OK");
+  EXPECT_EQ(Run({"get", "foo"}), "1");
+  EXPECT_THAT(Run({"cluster", "setslot", "1", "node", "replica"}), ErrArg("master"));
+  EXPECT_THAT(Run({"cluster", "setslot", "1", "node", "unknown"}), ErrArg("Unknown node"));
+}
+
+}  // namespace dfly
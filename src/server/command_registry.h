@@ -33,6 +33,10 @@ enum CommandOpt : uint32_t {
   NOSCRIPT = 0x100,
   BLOCKING = 0x200,  // implies REVERSE_MAPPING
   GLOBAL_TRANS = 0x1000,
+
+  // A control command, e.g. a health check or replication control. It is never shed under
+  // overload, see --shed_queue_len, and its hops run ahead of the queued hops of the shards.
+  PRIORITY = 0x2000,
 };
 
 const char* OptName(CommandOpt fl);
@@ -6,9 +6,11 @@
 
 #include <absl/strings/charconv.h>
 #include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
 #include <absl/strings/str_cat.h>
 #include <mimalloc.h>
 
+#include <algorithm>
 #include <system_error>
 
 extern "C" {
@@ -17,10 +19,19 @@ extern "C" {
 #include "redis/util.h"
 #include "redis/zmalloc.h"
 }
+#include "base/flags.h"
 #include "base/logging.h"
 #include "core/compact_object.h"
 #include "server/error.h"
 #include "server/server_state.h"
+#include "util/proactor_base.h"
+
+ABSL_FLAG(uint64_t, lua_memory_limit, 0,
+          "Maximal memory in bytes that a script may add to the lua interpreter that runs it. "
+          "Scripts that exceed it are aborted with an error. 0 means unlimited");
+ABSL_FLAG(uint32_t, interpreter_per_thread, 10,
+          "Maximal number of lua interpreters per thread. Scripts of the connections of a thread "
+          "run concurrently on different interpreters while they wait for the shards");
 
 namespace dfly {
 
@@ -44,21 +55,184 @@ ServerState::ServerState() {
 ServerState::~ServerState() {
 }
 
+namespace {
+
+constexpr unsigned kPublishPeriodMs = 100;
+
+// Sums of ServerState::PublishedStats over the threads. Gauges are published as deltas as well,
+// so the unsigned sums wrap back when they drop.
+struct PublishedSums {
+  atomic_uint64_t num_conns{0};
+  atomic_uint64_t num_replicas{0};
+  atomic_uint64_t num_blocked_clients{0};
+  atomic_uint64_t read_buf_capacity{0};
+  atomic_uint64_t command_cnt{0};
+  atomic_uint64_t io_read_bytes{0};
+  atomic_uint64_t io_write_bytes{0};
+} published_sums;
+
+void PublishDelta(uint64_t current, uint64_t* prev, atomic_uint64_t* sum) {
+  if (current != *prev) {
+    sum->fetch_add(current - *prev, memory_order_relaxed);
+    *prev = current;
+  }
+}
+
+}  // namespace
+
 void ServerState::Init() {
   gstate_ = GlobalState::ACTIVE;
+  publish_task_ = util::ProactorBase::me()->AddPeriodic(kPublishPeriodMs, [this] {
+    PublishStats();
+  });
 }
 
 void ServerState::Shutdown() {
   gstate_ = GlobalState::SHUTTING_DOWN;
-  interpreter_.reset();
+  interpreter_mgr_.reset();
+  if (publish_task_) {
+    util::ProactorBase::me()->CancelPeriodic(publish_task_);
+    publish_task_ = 0;
+  }
+
+  // Withdraws the counters of this thread from the sums.
+  Publish(PublishedStats{});
+}
+
+void ServerState::PublishStats() {
+  const facade::ConnectionStats& cs = connection_stats;
+  PublishedStats current;
+  current.num_conns = cs.num_conns;
+  current.num_replicas = cs.num_replicas;
+  current.num_blocked_clients = cs.num_blocked_clients;
+  current.read_buf_capacity = cs.read_buf_capacity;
+  current.command_cnt = cs.command_cnt;
+  current.io_read_bytes = cs.io_read_bytes;
+  current.io_write_bytes = cs.io_write_bytes;
+  Publish(current);
+}
+
+void ServerState::Publish(const PublishedStats& current) {
+  PublishDelta(current.num_conns, &published_.num_conns, &published_sums.num_conns);
+  PublishDelta(current.num_replicas, &published_.num_replicas, &published_sums.num_replicas);
+  PublishDelta(current.num_blocked_clients, &published_.num_blocked_clients,
+               &published_sums.num_blocked_clients);
+  PublishDelta(current.read_buf_capacity, &published_.read_buf_capacity,
+               &published_sums.read_buf_capacity);
+  PublishDelta(current.command_cnt, &published_.command_cnt, &published_sums.command_cnt);
+  PublishDelta(current.io_read_bytes, &published_.io_read_bytes, &published_sums.io_read_bytes);
+  PublishDelta(current.io_write_bytes, &published_.io_write_bytes,
+               &published_sums.io_write_bytes);
+}
+
+auto ServerState::GetPublishedStats() -> PublishedStats {
+  PublishedStats res;
+  res.num_conns = published_sums.num_conns.load(memory_order_relaxed);
+  res.num_replicas = published_sums.num_replicas.load(memory_order_relaxed);
+  res.num_blocked_clients = published_sums.num_blocked_clients.load(memory_order_relaxed);
+  res.read_buf_capacity = published_sums.read_buf_capacity.load(memory_order_relaxed);
+  res.command_cnt = published_sums.command_cnt.load(memory_order_relaxed);
+  res.io_read_bytes = published_sums.io_read_bytes.load(memory_order_relaxed);
+  res.io_write_bytes = published_sums.io_write_bytes.load(memory_order_relaxed);
+
+  return res;
+}
+
+InterpreterManager& ServerState::interpreter_mgr() {
+  if (!interpreter_mgr_) {
+    interpreter_mgr_.emplace(std::max(1u, absl::GetFlag(FLAGS_interpreter_per_thread)));
+  }
+
+  return interpreter_mgr_.value();
+}
+
+InterpreterManager::InterpreterManager(unsigned max_size) : max_size_(max_size) {
+  Interpreter& interpreter = storage_.emplace_back();
+  interpreter.SetMemoryLimit(absl::GetFlag(FLAGS_lua_memory_limit));
+  available_.push_back(&interpreter);
+}
+
+Interpreter* InterpreterManager::Get() {
+  if (available_.empty() && storage_.size() < max_size_) {
+    Interpreter& interpreter = storage_.emplace_back();
+    interpreter.SetMemoryLimit(absl::GetFlag(FLAGS_lua_memory_limit));
+    return &interpreter;
+  }
+
+  if (available_.empty()) {
+    ++waits_;
+    available_ec_.await([this] { return !available_.empty(); });
+  }
+
+  Interpreter* res = available_.back();
+  available_.pop_back();
+  return res;
+}
+
+void InterpreterManager::Return(Interpreter* interpreter) {
+  available_.push_back(interpreter);
+  available_ec_.notify();
+}
+
+auto InterpreterManager::Stats::operator+=(const Stats& o) -> Stats& {
+  interpreters += o.interpreters;
+  borrowed += o.borrowed;
+  waits += o.waits;
+  return *this;
+}
+
+auto InterpreterManager::GetStats() const -> Stats {
+  Stats res;
+  res.interpreters = storage_.size();
+  res.borrowed = storage_.size() - available_.size();
+  res.waits = waits_;
+  return res;
+}
+
+size_t InterpreterManager::MemoryUsage() const {
+  size_t res = 0;
+  for (const Interpreter& interpreter : storage_) {
+    res += interpreter.MemoryUsage();
+  }
+  return res;
+}
+
+void ServerState::AddSlowTx(string descr) {
+  if (slow_txs_.size() == kMaxSlowTxs)
+    slow_txs_.pop_front();
+  slow_txs_.push_back(std::move(descr));
+}
+
+void ServerState::AddSlowLogEntry(SlowLogEntry entry, size_t max_len) {
+  while (!slowlog_.empty() && slowlog_.size() >= max_len)
+    slowlog_.pop_front();
+  if (max_len > 0)
+    slowlog_.push_back(std::move(entry));
 }
 
-Interpreter& ServerState::GetInterpreter() {
-  if (!interpreter_) {
-    interpreter_.emplace();
+const char* TxLatency::PhaseName(Phase phase) {
+  switch (phase) {
+    case SCHEDULE:
+      return "schedule";
+    case QUEUE:
+      return "queue";
+    case EXEC:
+      return "exec";
+    case REPLY:
+      return "reply";
+    case TOTAL:
+      return "total";
+    case NUM_PHASES:
+      break;
   }
+  ABSL_INTERNAL_UNREACHABLE;
+}
 
-  return interpreter_.value();
+TxLatency& TxLatency::operator+=(const TxLatency& o) {
+  for (unsigned i = 0; i < NUM_PHASES; ++i) {
+    phases[i] += o.phases[i];
+  }
+  return *this;
 }
 
 const char* GlobalStateName(GlobalState s) {
@@ -91,6 +265,10 @@ const char* ObjTypeName(int type) {
       return "stream";
     case OBJ_JSON:
       return "ReJSON-RL";
+    case OBJ_SBF:
+      return "MBbloom--";
+    case OBJ_TS:
+      return "TSDB-TYPE";
     default:
       LOG(ERROR) << "Unsupported type " << type;
   }
@@ -193,12 +371,33 @@ bool ParseDouble(string_view src, double* value) {
 #define ADD(x) (x) += o.x
 
 TieredStats& TieredStats::operator+=(const TieredStats& o) {
-  static_assert(sizeof(TieredStats) == 32);
+  static_assert(sizeof(TieredStats) ==
+                104 + TieredStats::kMaxDevices * 24 + 4 * sizeof(LatencyHistogram));
 
   ADD(external_reads);
+  ADD(coalesced_reads);
+  ADD(range_reads);
   ADD(external_writes);
+  ADD(external_loads);
+  ADD(compacted_pages);
+  ADD(promotions);
+  ADD(demotions);
+  ADD(relocated_blocks);
+  ADD(released_bytes);
   ADD(storage_capacity);
   ADD(storage_reserved);
+
+  num_devices = std::max(num_devices, o.num_devices);
+  for (unsigned i = 0; i < kMaxDevices; ++i) {
+    ADD(devices[i].ios);
+    ADD(devices[i].latency_usec);
+    ADD(devices[i].queue_depth);
+  }
+
+  ADD(read_latency);
+  ADD(write_latency);
+  ADD(pending_wait_latency);
+  ADD(grow_latency);
   return *this;
 }
 
@@ -244,6 +443,49 @@ bool ScanOpts::Matches(std::string_view val_name) const {
   return stringmatchlen(pattern.data(), pattern.size(), val_name.data(), val_name.size(), 0) == 1;
 }
 
+OpResult<MonitorFilter> MonitorFilter::TryFrom(CmdArgList args) {
+  MonitorFilter filter;
+
+  for (unsigned i = 0; i < args.size(); i += 2) {
+    ToUpper(&args[i]);
+    string_view opt = ArgS(args, i);
+    if (i + 1 == args.size()) {
+      return facade::OpStatus::SYNTAX_ERR;
+    }
+
+    string_view val = ArgS(args, i + 1);
+    if (opt == "CMD") {
+      filter.cmd = absl::AsciiStrToUpper(val);
+    } else if (opt == "MATCH") {
+      filter.key_pattern = val == "*" ? string{} : string{val};
+    } else if (opt == "DB") {
+      uint32_t db;
+      if (!absl::SimpleAtoi(val, &db) || db >= kInvalidDbId) {
+        return facade::OpStatus::INVALID_INT;
+      }
+      filter.db = db;
+    } else if (opt == "CLIENT") {
+      uint32_t client_id;
+      if (!absl::SimpleAtoi(val, &client_id)) {
+        return facade::OpStatus::INVALID_INT;
+      }
+      filter.client_id = client_id;
+    } else if (opt == "SAMPLE") {
+      if (!absl::SimpleAtod(val, &filter.sample_rate) || !(filter.sample_rate > 0) ||
+          filter.sample_rate > 1) {
+        return facade::OpStatus::INVALID_FLOAT;
+      }
+    } else {
+      return facade::OpStatus::SYNTAX_ERR;
+    }
+  }
+  return filter;
+}
+
+bool MonitorFilter::MatchesKey(std::string_view key) const {
+  return stringmatchlen(key_pattern.data(), key_pattern.size(), key.data(), key.size(), 0) == 1;
+}
+
 GenericError::operator std::error_code() const {
   return ec_;
 }
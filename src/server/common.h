@@ -10,9 +10,12 @@
 
 #include <atomic>
 #include <boost/fiber/mutex.hpp>
+#include <optional>
+#include <string>
 #include <string_view>
 #include <vector>
 
+#include "core/latency_histogram.h"
 #include "facade/facade_types.h"
 #include "facade/op_status.h"
 
@@ -91,14 +94,38 @@ struct OpArgs {
 };
 
 struct TieredStats {
+  static constexpr unsigned kMaxDevices = 8;
+
+  struct DeviceStats {
+    size_t ios = 0;
+    size_t latency_usec = 0;  // total over the ios.
+    size_t queue_depth = 0;
+  };
+
   size_t external_reads = 0;
+  size_t coalesced_reads = 0;  // reads that joined an in-flight read of the same value.
+  size_t range_reads = 0;      // partial reads of values, i.e. by GETRANGE or BITCOUNT.
   size_t external_writes = 0;
+  size_t external_loads = 0;  // containers loaded back into memory.
+  size_t compacted_pages = 0;
+  size_t promotions = 0;  // hot strings read back into memory.
+  size_t demotions = 0;   // cold values offloaded by the sweep.
+  size_t relocated_blocks = 0;
+  size_t released_bytes = 0;  // storage of free pages returned to the file system.
 
   size_t storage_capacity = 0;
 
   // how much was reserved by actively stored items.
   size_t storage_reserved = 0;
 
+  size_t num_devices = 0;
+  DeviceStats devices[kMaxDevices];
+
+  LatencyHistogram read_latency;
+  LatencyHistogram write_latency;
+  LatencyHistogram pending_wait_latency;  // writes waiting for tiered_storage_max_pending_writes.
+  LatencyHistogram grow_latency;
+
   TieredStats& operator+=(const TieredStats&);
 };
 
@@ -309,4 +336,17 @@ struct ScanOpts {
   static OpResult<ScanOpts> TryFrom(CmdArgList args);
 };
 
+// The server-side filter of a monitoring connection, e.g.
+// MONITOR CMD SET MATCH user:* SAMPLE 0.001. The default filter passes all the commands.
+struct MonitorFilter {
+  std::string cmd;          // the upper-case name of the command, or empty for all the commands.
+  std::string key_pattern;  // glob-style pattern that at least one of the keys must match.
+  std::optional<DbIndex> db;
+  std::optional<uint32_t> client_id;
+  double sample_rate = 1;  // the probability to send a command that passed the filter.
+
+  bool MatchesKey(std::string_view key) const;
+  static OpResult<MonitorFilter> TryFrom(CmdArgList args);
+};
+
 }  // namespace dfly
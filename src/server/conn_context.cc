@@ -21,26 +21,83 @@ void ConnectionContext::SendMonitorMsg(std::string msg) {
   owner()->SendMonitorMsg(std::move(msg));
 }
 
-void ConnectionContext::ChangeMonitor(bool start) {
+void ConnectionContext::ChangeMonitor(bool start, MonitorFilter filter) {
   // This will either remove or register a new connection
   // at the "top level" thread --> ServerState context
   // note that we are registering/removing this connection to the thread at which at run
-  // then notify all other threads that there is a change in the number of monitors
+  // then notify all other threads that there is a change in the monitors
   auto& my_monitors = ServerState::tlocal()->Monitors();
+  uint32_t client_id = owner()->GetClientId();
   if (start) {
     my_monitors.Add(this);
+    MonitorsRepo::Monitor monitor{client_id, util::ProactorBase::GetIndex(), std::move(filter)};
+    shard_set->pool()->Await(
+        [&monitor](auto*) { ServerState::tlocal()->Monitors().NotifyAdded(monitor); });
   } else {
     VLOG(1) << "connection " << owner()->GetClientInfo()
             << " no longer needs to be monitored - removing 0x" << std::hex << (const void*)this;
     my_monitors.Remove(this);
+    // Tell other threads that about the change in the connections that we monitor
+    shard_set->pool()->Await(
+        [client_id](auto*) { ServerState::tlocal()->Monitors().NotifyRemoved(client_id); });
   }
-  // Tell other threads that about the change in the number of connection that we monitor
-  shard_set->pool()->Await(
-      [start](auto*) { ServerState::tlocal()->Monitors().NotifyChangeCount(start); });
   EnableMonitoring(start);
 }
 
+void ConnectionContext::EnableTracking(bool bcast, vector<string> prefixes) {
+  DisableTracking();
+
+  conn_state.tracking_info.reset(new ConnectionState::TrackingInfo);
+  ConnectionState::TrackingInfo* info = conn_state.tracking_info.get();
+  info->bcast = bcast;
+  info->prefixes = std::move(prefixes);
+
+  // The default mode tracks the keys that the connection reads, and without prefixes the broadcast
+  // mode reports all the keys.
+  vector<string> bcast_prefixes;
+  if (bcast)
+    bcast_prefixes = info->prefixes.empty() ? vector<string>{""} : info->prefixes;
+
+  int32_t tid = util::ProactorBase::GetIndex();
+  DCHECK_GE(tid, 0);
+
+  uint32_t client_id = owner()->GetClientId();
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    shard->db_slice().tracking_table().AddClient(client_id, this, tid, info->borrow_token,
+                                                 bcast_prefixes);
+  });
+
+  // to be able to read input and still write the invalidation messages.
+  force_dispatch = true;
+}
+
+void ConnectionContext::DisableTracking() {
+  if (!conn_state.tracking_info)
+    return;
+
+  uint32_t client_id = owner()->GetClientId();
+  shard_set->RunBriefInParallel([client_id](EngineShard* shard) {
+    shard->db_slice().tracking_table().RemoveClient(client_id);
+  });
+
+  // Wait for the messages that are still in flight.
+  auto token = conn_state.tracking_info->borrow_token;
+  token.Wait();
+
+  conn_state.tracking_info.reset();
+  force_dispatch = bool(conn_state.subscribe_info) || monitor;
+}
+
 void ConnectionContext::ChangeSubscription(bool to_add, bool to_reply, CmdArgList args) {
+  ChangeChannels(false, to_add, to_reply, args);
+}
+
+void ConnectionContext::ChangeShardSubscription(bool to_add, bool to_reply, CmdArgList args) {
+  ChangeChannels(true, to_add, to_reply, args);
+}
+
+void ConnectionContext::ChangeChannels(bool sharded, bool to_add, bool to_reply,
+                                       CmdArgList args) {
   vector<unsigned> result(to_reply ? args.size() : 0, 0);
 
   if (to_add || conn_state.subscribe_info) {
@@ -55,20 +112,27 @@ void ConnectionContext::ChangeSubscription(bool to_add, bool to_reply, CmdArgLis
       this->force_dispatch = true;
     }
 
+    ConnectionState::SubscribeInfo* info = conn_state.subscribe_info.get();
+    auto& my_channels = sharded ? info->shard_channels : info->channels;
+
     // Gather all the channels we need to subscribe to / remove.
     for (size_t i = 0; i < args.size(); ++i) {
       bool res = false;
       string_view channel = ArgS(args, i);
       if (to_add) {
-        res = conn_state.subscribe_info->channels.emplace(channel).second;
+        res = my_channels.emplace(channel).second;
       } else {
-        res = conn_state.subscribe_info->channels.erase(channel) > 0;
+        res = my_channels.erase(channel) > 0;
       }
 
       if (to_reply)
-        result[i] = conn_state.subscribe_info->SubscriptionCount();
+        result[i] = sharded ? info->shard_channels.size() : info->SubscriptionCount();
 
-      if (res) {
+      if (res && !sharded && KeyspaceNotifier::IsNotificationChannel(channel)) {
+        // Every shard publishes the notifications of its keys to the subscribers it knows.
+        for (ShardId sid = 0; sid < shard_set->size(); ++sid)
+          channels.emplace_back(sid, channel);
+      } else if (res) {
         ShardId sid = Shard(channel, shard_set->size());
         channels.emplace_back(sid, channel);
       }
@@ -102,7 +166,11 @@ void ConnectionContext::ChangeSubscription(bool to_add, bool to_reply, CmdArgLis
 
       DCHECK_LT(start, end);
       for (unsigned i = start; i < end; ++i) {
-        if (to_add) {
+        if (sharded && to_add) {
+          cs.AddShardSubscription(channels[i].second, this, tid);
+        } else if (sharded) {
+          cs.RemoveShardSubscription(channels[i].second, this);
+        } else if (to_add) {
           cs.AddSubscription(channels[i].second, this, tid);
         } else {
           cs.RemoveSubscription(channels[i].second, this);
@@ -117,12 +185,16 @@ void ConnectionContext::ChangeSubscription(bool to_add, bool to_reply, CmdArgLis
     // It's important to reset
     if (!to_add && conn_state.subscribe_info->IsEmpty()) {
       conn_state.subscribe_info.reset();
-      force_dispatch = false;
+      force_dispatch = monitor || bool(conn_state.tracking_info);
     }
   }
 
   if (to_reply) {
     const char* action[2] = {"unsubscribe", "subscribe"};
+    if (sharded) {
+      action[0] = "sunsubscribe";
+      action[1] = "ssubscribe";
+    }
 
     for (size_t i = 0; i < result.size(); ++i) {
       (*this)->StartArray(3);
@@ -190,7 +262,7 @@ void ConnectionContext::ChangePSub(bool to_add, bool to_reply, CmdArgList args)
     // removed from channel slices.
     if (!to_add && conn_state.subscribe_info->IsEmpty()) {
       conn_state.subscribe_info.reset();
-      force_dispatch = false;
+      force_dispatch = monitor || bool(conn_state.tracking_info);
     }
   }
 
@@ -216,6 +288,18 @@ void ConnectionContext::UnsubscribeAll(bool to_reply) {
   ChangeSubscription(false, to_reply, CmdArgList{arg_vec});
 }
 
+void ConnectionContext::SUnsubscribeAll(bool to_reply) {
+  if (to_reply &&
+      (!conn_state.subscribe_info || conn_state.subscribe_info->shard_channels.empty())) {
+    return SendSubscriptionChangedResponse("sunsubscribe", std::nullopt, 0);
+  }
+  StringVec channels(conn_state.subscribe_info->shard_channels.begin(),
+                     conn_state.subscribe_info->shard_channels.end());
+  CmdArgVec arg_vec(channels.begin(), channels.end());
+
+  ChangeShardSubscription(false, to_reply, CmdArgList{arg_vec});
+}
+
 void ConnectionContext::PUnsubscribeAll(bool to_reply) {
   if (to_reply && (!conn_state.subscribe_info || conn_state.subscribe_info->patterns.empty())) {
     return SendSubscriptionChangedResponse("punsubscribe", std::nullopt, 0);
@@ -230,7 +314,7 @@ void ConnectionContext::PUnsubscribeAll(bool to_reply) {
 void ConnectionContext::SendSubscriptionChangedResponse(string_view action,
                                                         std::optional<string_view> topic,
                                                         unsigned count) {
-  (*this)->StartArray(3);
+  (*this)->StartCollection(3, facade::RedisReplyBuilder::PUSH);
   (*this)->SendBulkString(action);
   if (topic.has_value())
     (*this)->SendBulkString(topic.value());
@@ -247,8 +331,6 @@ void ConnectionState::ExecInfo::Clear() {
 
 void ConnectionState::ExecInfo::ClearWatched() {
   watched_keys.clear();
-  watched_dirty.store(false, memory_order_relaxed);
-  watched_existed = 0;
 }
 
 }  // namespace dfly
@@ -13,6 +13,7 @@
 namespace dfly {
 
 class EngineShardSet;
+struct ScriptRun;
 
 struct StoredCmd {
   const CommandId* descr;
@@ -27,8 +28,18 @@ struct ConnectionState {
   struct ExecInfo {
     enum ExecState { EXEC_INACTIVE, EXEC_COLLECT, EXEC_ERROR };
 
+    // A key registered with WATCH and the state of its shard at that time. EXEC fails if the
+    // bucket of the key changed since then, or if the key does not exist and a key with the same
+    // deletion slot was deleted.
+    struct WatchedKey {
+      DbIndex db;
+      std::string key;
+      uint64_t version = 0;    // DbSlice::version of the shard.
+      uint32_t deletions = 0;  // DbTable::DeletionCount of the key.
+    };
+
     ExecInfo() = default;
-    // ExecInfo is immovable due to being referenced from DbSlice.
+    // ExecInfo is immovable due to being referenced from the shard callbacks of WATCH and EXEC.
     ExecInfo(ExecInfo&&) = delete;
 
     // Return true if ExecInfo is active (after MULTI)
@@ -39,29 +50,25 @@ struct ConnectionState {
     // Resets to blank state after EXEC or DISCARD
     void Clear();
 
-    // Resets local watched keys info. Does not unregister the keys from DbSlices.
     void ClearWatched();
 
     ExecState state = EXEC_INACTIVE;
     std::vector<StoredCmd> body;
     // List of keys registered with WATCH
-    std::vector<std::pair<DbIndex, std::string>> watched_keys;
-    // Set if a watched key was changed before EXEC
-    std::atomic_bool watched_dirty = false;
-    // Number of times watch was called on an existing key.
-    uint32_t watched_existed = 0;
+    std::vector<WatchedKey> watched_keys;
   };
 
   // Lua-script related data.
   struct ScriptInfo {
     bool is_write = true;
     absl::flat_hash_set<std::string_view> keys;
+    ScriptRun* run = nullptr;
   };
 
   // PUB-SUB messaging related data.
   struct SubscribeInfo {
     bool IsEmpty() const {
-      return channels.empty() && patterns.empty();
+      return channels.empty() && patterns.empty() && shard_channels.empty();
     }
 
     unsigned SubscriptionCount() const {
@@ -72,9 +79,48 @@ struct ConnectionState {
     absl::flat_hash_set<std::string> channels;
     absl::flat_hash_set<std::string> patterns;
 
+    // SSUBSCRIBE channels, counted separately from the channels and the patterns.
+    absl::flat_hash_set<std::string> shard_channels;
+
     util::fibers_ext::BlockingCounter borrow_token{0};
   };
 
+  // CLIENT TRACKING related data.
+  struct TrackingInfo {
+    bool bcast = false;
+    std::vector<std::string> prefixes;
+
+    // Increased by the shards while they send the invalidation messages.
+    util::fibers_ext::BlockingCounter borrow_token{0};
+  };
+
+  // Set by CLIENT READAFTER on a replica. The reads wait until the replica applied the writes of
+  // the LSN token of the master, see ServerFamily::AwaitAppliedLsns.
+  struct ReadAfter {
+    std::string master_id;
+    std::vector<LSN> lsns;  // by the shard of the master.
+    uint32_t timeout_ms = 0;
+  };
+
+  // Majority vote over the shards of the single shard commands, see --migrate_connections.
+  struct ShardAffinity {
+    ShardId shard = kInvalidSid;
+    uint32_t votes = 0;
+  };
+
+  // The budgets of the connection, token buckets in the manner of IoRateLimiter, see
+  // Service::ThrottleClient. The buckets are empty while their time is ahead of now.
+  struct Throttle {
+    uint64_t ops_tat_ns = 0;      // the time at which the ops bucket would be full again.
+    uint64_t cpu_tat_ns = 0;      // ditto for the CPU time bucket.
+    uint64_t throttled_ns = 0;    // the time the connection was delayed for.
+    uint32_t ops_limit = 0;       // set by CLIENT THROTTLE, 0 for --client_ops_limit.
+    uint32_t cpu_limit_usec = 0;  // set by CLIENT THROTTLE, 0 for --client_cpu_limit.
+
+    // The stub contexts of PipelineSquasher, their connection is throttled instead.
+    bool exempt = false;
+  };
+
   enum MCGetMask {
     FETCH_CAS_VER = 1,
   };
@@ -91,9 +137,25 @@ struct ConnectionState {
   uint32_t repl_session_id = 0;
   uint32_t repl_flow_id = kuint32max;
 
+  // Set by ASKING, allows the next command to access a slot that is being imported.
+  bool asking = false;
+
+  // Set by CLIENT READMODE RELAXED, runs the multi-shard reads as relaxed reads.
+  bool relaxed_reads = false;
+
+  // The journal LSN that follows the last write of the connection in every shard, 0 if it did
+  // not write there. WAIT waits for the replicas to acknowledge them, CLIENT LSNTOKEN returns
+  // them as the LSN token of the connection.
+  std::vector<LSN> write_lsns;
+
+  std::unique_ptr<ReadAfter> read_after;
+
   ExecInfo exec_info;
   std::optional<ScriptInfo> script_info;
   std::unique_ptr<SubscribeInfo> subscribe_info;
+  std::unique_ptr<TrackingInfo> tracking_info;
+  ShardAffinity shard_affinity;
+  Throttle throttle;
 };
 
 class ConnectionContext : public facade::ConnectionContext {
@@ -126,10 +188,17 @@ class ConnectionContext : public facade::ConnectionContext {
   void SendMonitorMsg(std::string msg);
 
   void ChangeSubscription(bool to_add, bool to_reply, CmdArgList args);
+  void ChangeShardSubscription(bool to_add, bool to_reply, CmdArgList args);
   void ChangePSub(bool to_add, bool to_reply, CmdArgList args);
   void UnsubscribeAll(bool to_reply);
+  void SUnsubscribeAll(bool to_reply);
   void PUnsubscribeAll(bool to_reply);
-  void ChangeMonitor(bool start);  // either start or stop monitor on a given connection
+  // either start or stop monitor on a given connection, the filter applies when starting.
+  void ChangeMonitor(bool start, MonitorFilter filter = {});
+
+  // Registers the connection for the invalidation messages in all the shards.
+  void EnableTracking(bool bcast, std::vector<std::string> prefixes);
+  void DisableTracking();
 
   bool is_replicating = false;
   bool monitor = false;  // when a monitor command is sent over a given connection, we need to aware
@@ -140,6 +209,9 @@ class ConnectionContext : public facade::ConnectionContext {
     force_dispatch = enable;  // required to support the monitoring
     monitor = enable;
   }
+  // Subscribes to / unsubscribes from the channels, calls the shard of every channel.
+  void ChangeChannels(bool sharded, bool to_add, bool to_reply, CmdArgList args);
+
   void SendSubscriptionChangedResponse(std::string_view action,
                                        std::optional<std::string_view> topic, unsigned count);
 };
@@ -3,7 +3,13 @@
 //
 #include "server/container_utils.h"
 
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/inlined_vector.h>
+#include <absl/strings/numbers.h>
+
 #include "base/logging.h"
+#include "core/chunked_list.h"
+#include "core/sorted_map.h"
 
 extern "C" {
 #include "redis/intset.h"
@@ -16,36 +22,23 @@ extern "C" {
 
 namespace dfly::container_utils {
 
-quicklistEntry QLEntry() {
-  quicklistEntry res{.quicklist = NULL,
-                     .node = NULL,
-                     .zi = NULL,
-                     .value = NULL,
-                     .longval = 0,
-                     .sz = 0,
-                     .offset = 0};
-  return res;
-}
-
 bool IterateList(const PrimeValue& pv, const IterateFunc& func, long start, long end) {
-  quicklist* ql = static_cast<quicklist*>(pv.RObjPtr());
-  long llen = quicklistCount(ql);
+  ChunkedList* list = static_cast<ChunkedList*>(pv.RObjPtr());
+  long llen = list->Size();
   if (end < 0 || end >= llen)
     end = llen - 1;
 
-  quicklistIter* qiter = quicklistGetIteratorAtIdx(ql, AL_START_HEAD, start);
-  quicklistEntry entry = QLEntry();
   long lrange = end - start + 1;
 
   bool success = true;
-  while (success && quicklistNext(qiter, &entry) && lrange-- > 0) {
+  for (auto it = list->GetIterator(start); success && !it.Done() && lrange-- > 0; it.Next()) {
+    ChunkedList::Entry entry = it.Get();
     if (entry.value) {
-      success = func(ContainerEntry{reinterpret_cast<char*>(entry.value), entry.sz});
+      success = func(ContainerEntry{entry.value, entry.len});
     } else {
-      success = func(ContainerEntry{entry.longval});
+      success = func(ContainerEntry{entry.lval});
     }
   }
-  quicklistReleaseIterator(qiter);
   return success;
 }
 
@@ -84,7 +77,9 @@ bool IterateSet(const PrimeValue& pv, const IterateFunc& func) {
 
 bool IterateSortedSet(robj* zobj, const IterateSortedFunc& func, int32_t start, int32_t end,
                       bool reverse, bool use_score) {
-  unsigned long llen = zsetLength(zobj);
+  unsigned long llen = zobj->encoding == kEncodingSortedMap
+                           ? static_cast<SortedMap*>(zobj->ptr)->Size()
+                           : zsetLength(zobj);
   if (end < 0 || unsigned(end) >= llen)
     end = llen - 1;
 
@@ -130,32 +125,219 @@ bool IterateSortedSet(robj* zobj, const IterateSortedFunc& func, int32_t start,
     }
     return success;
   } else {
-    CHECK_EQ(zobj->encoding, OBJ_ENCODING_SKIPLIST);
-    zset* zs = static_cast<zset*>(zobj->ptr);
-    zskiplist* zsl = zs->zsl;
-    zskiplistNode* ln;
-
-    /* Check if starting point is trivial, before doing log(N) lookup. */
-    if (reverse) {
-      ln = zsl->tail;
-      unsigned long llen = zsetLength(zobj);
-      if (start > 0)
-        ln = zslGetElementByRank(zsl, llen - start);
-    } else {
-      ln = zsl->header->level[0].forward;
-      if (start > 0)
-        ln = zslGetElementByRank(zsl, start + 1);
-    }
+    CHECK_EQ(zobj->encoding, kEncodingSortedMap);
+    SortedMap* zs = static_cast<SortedMap*>(zobj->ptr);
+    SortedMap::Iterator it = zs->AtRank(reverse ? llen - 1 - start : start);
 
     bool success = true;
     while (success && rangelen--) {
-      DCHECK(ln != NULL);
-      success = func(ContainerEntry{ln->ele, sdslen(ln->ele)}, ln->score);
-      ln = reverse ? ln->backward : ln->level[0].forward;
+      DCHECK(!it.IsEnd());
+      success = func(ContainerEntry{it->member, sdslen(it->member)}, it->score);
+      if (reverse) {
+        --it;
+      } else {
+        ++it;
+      }
     }
     return success;
   }
   return false;
 }
 
+namespace {
+
+// The encodings of listpack.c that the lookups below depend on.
+constexpr uint8_t kLp6BitStr = 0x80;
+constexpr uint8_t kLp12BitStr = 0xE0;
+constexpr uint8_t kLp32BitStr = 0xF0;
+constexpr uint8_t kLpEof = 0xFF;
+
+// Up to this number of keys, every key entry is compared with the unresolved keys. More keys are
+// looked up in a hash map by the decoded entries.
+constexpr size_t kMaxComparedKeys = 16;
+
+bool IsLpString(uint8_t enc) {
+  return (enc & 0xC0) == kLp6BitStr || (enc & 0xF0) == kLp12BitStr || enc == kLp32BitStr;
+}
+
+// A key encoded as listpack encodes it, so that matching an entry is a comparison of bytes.
+// listpack encodes every string that parses as an integer as an integer entry.
+class LpNeedle {
+ public:
+  explicit LpNeedle(std::string_view key);
+
+  bool Matches(const uint8_t* entry) const;
+
+ private:
+  std::string_view key_;
+  int64_t ival_ = 0;
+  uint8_t hdr_[5];
+  uint8_t hdr_len_ = 0;  // 0 for an integer key.
+};
+
+LpNeedle::LpNeedle(std::string_view key) : key_(key) {
+  if (lpStringToInt64(key.data(), key.size(), &ival_))
+    return;
+
+  size_t len = key.size();
+  if (len < 64) {
+    hdr_[0] = kLp6BitStr | len;
+    hdr_len_ = 1;
+  } else if (len < 4096) {
+    hdr_[0] = kLp12BitStr | (len >> 8);
+    hdr_[1] = len & 0xFF;
+    hdr_len_ = 2;
+  } else {
+    hdr_[0] = kLp32BitStr;
+    for (unsigned i = 0; i < 4; ++i)
+      hdr_[i + 1] = (len >> (i * 8)) & 0xFF;
+    hdr_len_ = 5;
+  }
+}
+
+bool LpNeedle::Matches(const uint8_t* entry) const {
+  if (hdr_len_ == 0) {
+    if (IsLpString(entry[0]))
+      return false;
+    int64_t val;
+    lpGet(const_cast<uint8_t*>(entry), &val, NULL);
+    return val == ival_;
+  }
+
+  // The first byte determines the encoding, so the rest of the header and the bytes of the
+  // string can be read once it matches.
+  return entry[0] == hdr_[0] && memcmp(entry + 1, hdr_ + 1, hdr_len_ - 1) == 0 &&
+         (key_.empty() || memcmp(entry + hdr_len_, key_.data(), key_.size()) == 0);
+}
+
+void LpMapKeys(uint8_t* lp, ArgSlice keys, uint8_t** res) {
+  absl::flat_hash_map<std::string_view, unsigned> first_index;
+  first_index.reserve(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i)
+    first_index.emplace(keys[i], i);
+
+  uint8_t ibuf[LP_INTBUF_SIZE];
+  for (uint8_t* p = lpFirst(lp); p && *p != kLpEof; p = lpSkip(lpSkip(p))) {
+    int64_t len;
+    uint8_t* str = lpGet(p, &len, ibuf);
+    auto it = first_index.find(std::string_view{reinterpret_cast<char*>(str), size_t(len)});
+    if (it != first_index.end())
+      res[it->second] = p;
+  }
+
+  for (size_t i = 0; i < keys.size(); ++i)
+    res[i] = res[first_index[keys[i]]];
+}
+
+}  // namespace
+
+uint8_t* LpFindKey(uint8_t* lp, std::string_view key) {
+  LpNeedle needle(key);
+
+  // lpSkip does not validate the entries as lpNext does, the listpacks in memory are valid.
+  for (uint8_t* p = lpFirst(lp); p && *p != kLpEof; p = lpSkip(lpSkip(p))) {
+    if (needle.Matches(p))
+      return p;
+  }
+  return nullptr;
+}
+
+void LpFindKeys(uint8_t* lp, ArgSlice keys, uint8_t** res) {
+  std::fill(res, res + keys.size(), nullptr);
+  if (keys.size() > kMaxComparedKeys) {
+    LpMapKeys(lp, keys, res);
+    return;
+  }
+
+  absl::InlinedVector<LpNeedle, kMaxComparedKeys> needles;
+  absl::InlinedVector<unsigned, kMaxComparedKeys> pending;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    needles.emplace_back(keys[i]);
+    pending.push_back(i);
+  }
+
+  for (uint8_t* p = lpFirst(lp); p && *p != kLpEof && !pending.empty(); p = lpSkip(lpSkip(p))) {
+    for (size_t j = 0; j < pending.size();) {
+      unsigned i = pending[j];
+      if (needles[i].Matches(p)) {
+        res[i] = p;
+        pending[j] = pending.back();
+        pending.pop_back();
+      } else {
+        ++j;
+      }
+    }
+  }
+}
+
+namespace {
+
+// The top 32 bits of the hash of DenseSet, which its scan cursors are prefixes of.
+uint32_t ScanHash(std::string_view key) {
+  return CompactObj::HashCode(key) >> 32;
+}
+
+// Keeps in items the first count of them whose hashes do not precede the cursor, in the order of
+// the hashes, and returns the hash of the next one or 0. The keys with the same hash are reported
+// in the same call, so that the next cursor does not skip any of them.
+template <typename T>
+uint32_t SelectByHash(uint32_t cursor, size_t count, std::vector<std::pair<uint32_t, T>>* items) {
+  auto& v = *items;
+  v.erase(std::remove_if(v.begin(), v.end(), [cursor](const auto& e) { return e.first < cursor; }),
+          v.end());
+  std::sort(v.begin(), v.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+  if (v.size() <= count)
+    return 0;
+
+  size_t end = std::max<size_t>(count, 1);
+  while (end < v.size() && v[end].first == v[end - 1].first)
+    ++end;
+  if (end == v.size())
+    return 0;
+
+  uint32_t next = v[end].first;
+  v.resize(end);
+  return next;
+}
+
+}  // namespace
+
+uint32_t ScanListpackPairs(uint8_t* lp, uint32_t cursor, size_t count,
+                           const std::function<void(uint8_t*)>& cb) {
+  std::vector<std::pair<uint32_t, uint8_t*>> items;
+  items.reserve(lpLength(lp) / 2);
+
+  uint8_t ibuf[LP_INTBUF_SIZE];
+  for (uint8_t* p = lpFirst(lp); p; p = lpNext(lp, lpNext(lp, p))) {
+    int64_t len;
+    uint8_t* str = lpGet(p, &len, ibuf);
+    items.emplace_back(ScanHash({reinterpret_cast<char*>(str), size_t(len)}), p);
+  }
+
+  uint32_t next = SelectByHash(cursor, count, &items);
+  for (const auto& item : items)
+    cb(item.second);
+  return next;
+}
+
+uint32_t ScanIntSet(const intset* is, uint32_t cursor, size_t count,
+                    const std::function<void(int64_t)>& cb) {
+  uint32_t len = intsetLen(is);
+  std::vector<std::pair<uint32_t, int64_t>> items;
+  items.reserve(len);
+
+  char buf[32];
+  for (uint32_t i = 0; i < len; ++i) {
+    int64_t val;
+    intsetGet(const_cast<intset*>(is), i, &val);
+    char* end = absl::numbers_internal::FastIntToBuffer(val, buf);
+    items.emplace_back(ScanHash({buf, size_t(end - buf)}), val);
+  }
+
+  uint32_t next = SelectByHash(cursor, count, &items);
+  for (const auto& item : items)
+    cb(item.second);
+  return next;
+}
+
 }  // namespace dfly::container_utils
@@ -5,11 +5,12 @@
 
 #include "core/compact_object.h"
 #include "core/string_set.h"
+#include "server/common.h"
 #include "server/table.h"
 
 extern "C" {
+#include "redis/intset.h"
 #include "redis/object.h"
-#include "redis/quicklist.h"
 }
 
 #include <functional>
@@ -24,9 +25,6 @@ inline bool IsContainer(const PrimeValue& pv) {
   return (type == OBJ_LIST || type == OBJ_SET || type == OBJ_ZSET);
 }
 
-// Create empty quicklistEntry
-quicklistEntry QLEntry();
-
 // Stores either:
 // - A single long long value (longval) when value = nullptr
 // - A single char* (value) when value != nullptr
@@ -69,6 +67,41 @@ bool IterateSet(const PrimeValue& pv, const IterateFunc& func);
 bool IterateSortedSet(robj* zobj, const IterateSortedFunc& func, int32_t start = 0,
                       int32_t end = -1, bool reverse = false, bool use_score = false);
 
+// Finds the key among the even entries of a listpack of key/value pairs, as the hashes and the
+// sorted sets keep them, and returns its entry or nullptr. Unlike lpFind, the entries are not
+// decoded on the way: a string key is matched by comparing the encoded length header and the
+// bytes, and only a key that parses as an integer is compared with the integer entries.
+uint8_t* LpFindKey(uint8_t* lp, std::string_view key);
+
+// Resolves all the keys in a single pass over the listpack of key/value pairs. Sets res[i] to the
+// entry of keys[i] or to nullptr, duplicate keys resolve to the same entry.
+void LpFindKeys(uint8_t* lp, ArgSlice keys, uint8_t** res);
+
+// The compact containers, the listpacks and the intsets, are scanned in the order of the top
+// 32 bits of the hashes of their keys, which is the order of the buckets of a DenseSet, so that
+// a scan goes on correctly when the container turns into one meanwhile. The calls report about
+// count keys whose hashes follow the cursor and return the next cursor or 0 at the end. A call
+// passes over the whole container, which the listpack and intset limits keep small.
+
+// Calls cb with the key entries of the listpack of key/value pairs.
+uint32_t ScanListpackPairs(uint8_t* lp, uint32_t cursor, size_t count,
+                           const std::function<void(uint8_t*)>& cb);
+
+uint32_t ScanIntSet(const intset* is, uint32_t cursor, size_t count,
+                    const std::function<void(int64_t)>& cb);
+
+// The time of the members of StringSet and the fields of StringMap that expire, in seconds
+// since Oct 1, 2022, see DenseSet::set_time.
+constexpr uint64_t kNowBase = 1664582400ULL;
+
+inline uint32_t TimeNowSecRel(uint64_t now_ms) {
+  return (now_ms / 1000) - kNowBase;
+}
+
+inline uint64_t TimeSecRelToMs(uint32_t sec) {
+  return (sec + kNowBase) * 1000;
+}
+
 };  // namespace container_utils
 
 }  // namespace dfly
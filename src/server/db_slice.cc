@@ -8,13 +8,19 @@ extern "C" {
 #include "redis/object.h"
 }
 
+#include <absl/strings/match.h>
+
 #include <boost/fiber/fiber.hpp>
 #include <boost/fiber/operations.hpp>
 
 #include "base/logging.h"
+#include "core/string_map.h"
+#include "server/container_utils.h"
+#include "server/doc_index.h"
 #include "server/engine_shard_set.h"
 #include "server/server_state.h"
 #include "server/tiered_storage.h"
+#include "server/tracepoints.h"
 #include "util/fiber_sched_algo.h"
 #include "util/proactor_base.h"
 
@@ -27,27 +33,69 @@ using facade::OpStatus;
 namespace {
 
 constexpr auto kPrimeSegmentSize = PrimeTable::kSegBytes;
-constexpr auto kExpireSegmentSize = ExpireTable::kSegBytes;
 constexpr auto kTaxSize = PrimeTable::kTaxAmount;
 
-// mi_malloc good size is 32768. i.e. we have malloc waste of 1.5%.
-static_assert(kPrimeSegmentSize == 32288);
+// Buddy segments are merged only if the merged segment is at most 30% full,
+// so that it won't split right away upon the next inserts.
+constexpr double kMergeLoadFactor = 0.3;
+
+// Number of segments examined by each MergeSegmentsStep per table.
+constexpr unsigned kMergeStepSegments = 8;
+
+// Number of buckets examined by each TrimTimeSeriesStep.
+constexpr unsigned kTrimStepBuckets = 32;
 
-// 20480 is the next goodsize so we are loosing ~300 bytes or 1.5%.
-// 24576
-static_assert(kExpireSegmentSize == 23528);
+// Slot width of the expiry wheel. It spans 10ms * 64^4 ~ 46 hours, farther deadlines are
+// re-placed once the wheel gets closer to them.
+constexpr uint32_t kExpireWheelResolutionMs = 10;
+
+// The fields of hashes expire in seconds.
+constexpr uint32_t kFieldExpireWheelResolutionMs = 1000;
+
+// mi_malloc good size is 40960. i.e. we have malloc waste of 1.3%.
+static_assert(kPrimeSegmentSize == 40408);
 
 void UpdateStatsOnDeletion(PrimeIterator it, DbTableStats* stats) {
   size_t value_heap_size = it->second.MallocUsed();
   stats->inline_keys -= it->first.IsInline();
   stats->obj_memory_usage -= (it->first.MallocUsed() + value_heap_size);
+  stats->AddTypeMemoryUsage(it->second.ObjType(), -value_heap_size);
   if (it->second.ObjType() == OBJ_STRING)
     stats->strval_memory_usage -= value_heap_size;
+
+  if (it->second.IsExternal()) {
+    auto [offset, size] = it->second.GetExternalPtr();
+    EngineShard::tlocal()->tiered_storage()->Free(offset, size);
+    stats->AddExternal(it->second.ObjType(), -1, -ssize_t(size));
+  }
 }
 
-void EvictItemFun(PrimeIterator del_it, DbTable* table) {
+// Notifies the tracking connections about the change of the key.
+void InvalidateTracked(const PrimeKey& key, TrackingTable* tracking) {
+  if (!tracking->empty()) {
+    string tmp;
+    tracking->Invalidate(key.GetSlice(&tmp));
+  }
+}
+
+// Buffers the keyspace notification about the key if its class is enabled.
+void NotifyKeyEvent(KeyspaceNotifier* notifier, KeyspaceNotifier::Class cls, string_view event,
+                    DbIndex db_ind, const PrimeKey& key) {
+  if (notifier->Enabled(cls)) {
+    string tmp;
+    notifier->Notify(event, db_ind, key.GetSlice(&tmp));
+  }
+}
+
+void EvictItemFun(PrimeIterator del_it, DbIndex db_ind, DbSlice* db_slice) {
+  DbTable* table = db_slice->GetDBTable(db_ind);
+  InvalidateTracked(del_it->first, &db_slice->tracking_table());
+  NotifyKeyEvent(&db_slice->keyspace_notifier(), KeyspaceNotifier::EVICTED, "evicted", db_ind,
+                 del_it->first);
+  table->RecordDeletion(del_it->first);
+  table->UnindexKey(del_it->first);
   if (del_it->second.HasExpire()) {
-    CHECK_EQ(1u, table->expire.Erase(del_it->first));
+    --table->expire_count;
   }
 
   UpdateStatsOnDeletion(del_it, &table->stats);
@@ -55,6 +103,7 @@ void EvictItemFun(PrimeIterator del_it, DbTable* table) {
   DVLOG(2) << "Evicted from bucket " << del_it.bucket_id() << " " << del_it->first.ToString();
 
   table->prime.Erase(del_it);
+  db_slice->PublishDbSize(db_ind);
 };
 
 class PrimeEvictionPolicy {
@@ -91,6 +140,10 @@ class PrimeEvictionPolicy {
     return checked_;
   }
 
+  unsigned rejected() const {
+    return rejected_;
+  }
+
  private:
   DbSlice* db_slice_;
   ssize_t mem_budget_;
@@ -99,6 +152,7 @@ class PrimeEvictionPolicy {
 
   unsigned evicted_ = 0;
   unsigned checked_ = 0;
+  unsigned rejected_ = 0;
 
   // unlike static constexpr can_evict, this parameter tells whether we can evict
   // items in runtime.
@@ -157,7 +211,42 @@ unsigned PrimeEvictionPolicy::Evict(const PrimeTable::HotspotBuckets& eb, PrimeT
   constexpr size_t kNumStashBuckets = ABSL_ARRAYSIZE(eb.probes.by_type.stash_buckets);
 
   // choose "randomly" a stash bucket to evict an item.
-  auto bucket_it = eb.probes.by_type.stash_buckets[eb.key_hash % kNumStashBuckets];
+  unsigned stash_index = eb.key_hash % kNumStashBuckets;
+  const FrequencySketch* sketch = db_slice_->freq_sketch();
+
+  if (db_slice_->freq_admission()) {
+    // TinyLFU: choose the least frequently used among the last slots of the stash buckets,
+    // and admit the new key only if it is used at least as often as the victim.
+    unsigned victim_freq = UINT_MAX;
+    for (unsigned i = 0; i < kNumStashBuckets; ++i) {
+      auto slot_it = eb.probes.by_type.stash_buckets[i];
+      slot_it += (PrimeTable::kBucketWidth - 1);
+      if (slot_it.is_done()) {  // free slot, nothing to evict.
+        stash_index = i;
+        victim_freq = 0;
+        break;
+      }
+
+      if (slot_it->first.IsSticky())
+        continue;
+
+      unsigned freq = sketch->Estimate(me->DoHash(slot_it->first));
+      if (freq < victim_freq) {
+        stash_index = i;
+        victim_freq = freq;
+      }
+    }
+
+    if (victim_freq == UINT_MAX)  // all the candidates are sticky.
+      return 0;
+
+    if (sketch->Estimate(eb.key_hash) < victim_freq) {
+      ++rejected_;
+      return 0;
+    }
+  }
+
+  auto bucket_it = eb.probes.by_type.stash_buckets[stash_index];
   auto last_slot_it = bucket_it;
   last_slot_it += (PrimeTable::kBucketWidth - 1);
   if (!last_slot_it.is_done()) {
@@ -166,8 +255,7 @@ unsigned PrimeEvictionPolicy::Evict(const PrimeTable::HotspotBuckets& eb, PrimeT
       return 0;
     }
 
-    DbTable* table = db_slice_->GetDBTable(cntx_.db_index);
-    EvictItemFun(last_slot_it, table);
+    EvictItemFun(last_slot_it, cntx_.db_index, db_slice_);
     ++evicted_;
   }
   me->ShiftRight(bucket_it);
@@ -181,7 +269,7 @@ unsigned PrimeEvictionPolicy::Evict(const PrimeTable::HotspotBuckets& eb, PrimeT
 
 DbStats& DbStats::operator+=(const DbStats& o) {
   constexpr size_t kDbSz = sizeof(DbStats);
-  static_assert(kDbSz == 96);
+  static_assert(kDbSz == 120 + kObjTypeMax * 8 * 3);
 
   DbTableStats::operator+=(o);
 
@@ -189,26 +277,72 @@ DbStats& DbStats::operator+=(const DbStats& o) {
   ADD(expire_count);
   ADD(bucket_count);
   ADD(table_mem_usage);
+  ADD(expire_backlog);
+  ADD(prefix_index_mem_usage);
+  ADD(overflow_segments);
 
   return *this;
 }
 
 SliceEvents& SliceEvents::operator+=(const SliceEvents& o) {
-  static_assert(sizeof(SliceEvents) == 56, "You should update this function with new fields");
+  static_assert(sizeof(SliceEvents) == 168, "You should update this function with new fields");
 
   ADD(evicted_keys);
   ADD(hard_evictions);
   ADD(expired_keys);
   ADD(garbage_collected);
   ADD(stash_unloaded);
+  ADD(segment_splits);
+  ADD(overflow_splits);
   ADD(bumpups);
   ADD(garbage_checked);
+  ADD(segments_merged);
+  ADD(proactive_evictions);
+  ADD(quota_evictions);
+  ADD(hits);
+  ADD(misses);
+  ADD(admission_rejected);
+  ADD(wheel_expired_keys);
+  ADD(expire_lag_ms);
+  ADD(expired_hash_fields);
+
+  for (unsigned i = 0; i < kNumEvictionPolicies; ++i)
+    ADD(policy_evictions[i]);
 
   return *this;
 }
 
 #undef ADD
 
+constexpr const char* kEvictionPolicyNames[kNumEvictionPolicies] = {
+    "allkeys-lru", "volatile-ttl", "volatile-lfu", "allkeys-lfu"};
+
+optional<EvictionPolicy> ParseEvictionPolicy(string_view name) {
+  for (unsigned i = 0; i < kNumEvictionPolicies; ++i) {
+    if (absl::EqualsIgnoreCase(name, kEvictionPolicyNames[i]))
+      return EvictionPolicy(i);
+  }
+  return nullopt;
+}
+
+const char* EvictionPolicyName(EvictionPolicy policy) {
+  return kEvictionPolicyNames[unsigned(policy)];
+}
+
+bool AbslParseFlag(string_view in, EvictionPolicy* policy, string* err) {
+  optional<EvictionPolicy> res = ParseEvictionPolicy(in);
+  if (!res) {
+    *err = absl::StrCat("unknown eviction policy ", in);
+    return false;
+  }
+  *policy = *res;
+  return true;
+}
+
+string AbslUnparseFlag(EvictionPolicy policy) {
+  return EvictionPolicyName(policy);
+}
+
 DbSlice::DbSlice(uint32_t index, bool caching_mode, EngineShard* owner)
     : shard_id_(index), caching_mode_(caching_mode), owner_(owner) {
   db_arr_.emplace_back();
@@ -241,10 +375,25 @@ auto DbSlice::GetStats() const -> Stats {
     stats = db_wrap.stats;
     stats.key_count = db_wrap.prime.size();
     stats.bucket_count = db_wrap.prime.bucket_count();
-    stats.expire_count = db_wrap.expire.size();
-    stats.table_mem_usage = (db_wrap.prime.mem_usage() + db_wrap.expire.mem_usage());
+    stats.expire_count = db_wrap.expire_count;
+    stats.table_mem_usage = db_wrap.prime.mem_usage();
+    stats.overflow_segments = db_wrap.prime.overflow_segments();
+    if (db_wrap.field_expire_wheel) {
+      stats.table_mem_usage += db_wrap.field_expire_wheel->MallocUsed();
+    }
+    if (db_wrap.expire_wheel) {
+      stats.table_mem_usage += db_wrap.expire_wheel->MallocUsed();
+      stats.expire_backlog = db_wrap.expire_wheel->backlog();
+    }
+    if (db_wrap.prefix_index)
+      stats.prefix_index_mem_usage = db_wrap.prefix_index->MallocUsed();
   }
-  s.small_string_bytes = CompactObj::GetStats().small_string_bytes;
+  CompactObj::Stats co_stats = CompactObj::GetStats();
+  s.small_string_bytes = co_stats.small_string_bytes;
+  s.key_prefixes = co_stats.key_prefixes;
+  s.key_prefix_bytes = co_stats.key_prefix_bytes;
+  s.small_string_segments = SmallString::SegmentsThreadLocal();
+  s.lazy_free = lazy_free_.GetStats();
 
   return s;
 }
@@ -273,15 +422,30 @@ auto DbSlice::Find(const Context& cntx, string_view key, unsigned req_obj_type)
 }
 
 pair<PrimeIterator, ExpireIterator> DbSlice::FindExt(const Context& cntx, string_view key) const {
-  pair<PrimeIterator, ExpireIterator> res;
-
   if (!IsDbValid(cntx.db_index))
-    return res;
+    return {};
+
+  return FindExt(cntx, key, db_arr_[cntx.db_index]->prime.DoHash(key));
+}
+
+pair<PrimeIterator, ExpireIterator> DbSlice::FindExt(const Context& cntx, string_view key,
+                                                     uint64_t key_hash) const {
+  pair<PrimeIterator, ExpireIterator> res;
+  DCHECK(IsDbValid(cntx.db_index));
 
   auto& db = *db_arr_[cntx.db_index];
-  res.first = db.prime.Find(key);
+  res.first = db.prime.Find(key, key_hash);
+
+  if (freq_sketch_) {
+    freq_sketch_->Increment(key_hash);
+  }
+
+  if (hot_keys_) {
+    hot_keys_->Touch(cntx.db_index, key, cntx.time_now_ms);
+  }
 
   if (!IsValid(res.first)) {
+    ++events_.misses;
     return res;
   }
 
@@ -305,6 +469,15 @@ pair<PrimeIterator, ExpireIterator> DbSlice::FindExt(const Context& cntx, string
     ++events_.bumpups;
   }
 
+  if (owner_->tiered_storage() && IsValid(res.first)) {
+    res = TouchExternal(cntx.db_index, res.first, res.second);
+  }
+
+  events_.hits += IsValid(res.first);
+  events_.misses += !IsValid(res.first);
+
+  // Bumping up moves the entry, so the expiry is taken from where it ends up.
+  res.second = ExpireIterator::Of(res.first);
   return res;
 }
 
@@ -347,9 +520,16 @@ tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(const Context& cn
     for (const auto& ccb : change_cb_) {
       ccb.second(cntx.db_index, key);
     }
+  } else {
+    // FindExt has not recorded this access.
+    if (freq_sketch_)
+      freq_sketch_->Increment(db.prime.DoHash(key));
+    if (hot_keys_)
+      hot_keys_->Touch(cntx.db_index, key, cntx.time_now_ms);
   }
 
-  PrimeEvictionPolicy evp{cntx, bool(caching_mode_), int64_t(memory_budget_ - key.size()),
+  PrimeEvictionPolicy evp{cntx, caching_mode_ && !HasPinnedReads(),
+                          int64_t(memory_budget_ - key.size()),
                           ssize_t(soft_budget_limit_), this};
 
   // If we are over limit in non-cache scenario, just be conservative and throw.
@@ -357,9 +537,20 @@ tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(const Context& cn
     throw bad_alloc();
   }
 
+  // The database exceeds its quota. Evict from it, which does not touch the keys locked by
+  // the running transactions, or refuse the write.
+  if (size_t excess = QuotaExcess(cntx.db_index); excess > 0) {
+    if (!caching_mode_)
+      throw bad_alloc();
+
+    size_t freed = FreeMemWithEvictionStep(cntx.db_index, excess + key.size());
+    events_.quota_evictions += (freed > 0);
+  }
+
   // Fast-path if change_cb_ is empty so we Find or Add using
   // the insert operation: twice more efficient.
-  CompactObj co_key{key};
+  PrimeKey co_key;
+  co_key.SetKey(key);
   PrimeIterator it;
   bool inserted;
 
@@ -367,6 +558,7 @@ tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(const Context& cn
   try {
     tie(it, inserted) = db.prime.Insert(std::move(co_key), PrimeValue{}, evp);
   } catch (bad_alloc& e) {
+    events_.admission_rejected += evp.rejected();
     throw e;
   }
 
@@ -375,21 +567,32 @@ tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(const Context& cn
   // We may still reach the state when our memory usage is above the limit even if we
   // do not add new segments. For example, we have half full segments
   // and we add new objects or update the existing ones and our memory usage grows.
-  if (evp.mem_budget() < 0) {
-    evicted_obj_bytes = EvictObjects(-evp.mem_budget(), it, &db);
+  if (evp.mem_budget() < 0 && !HasPinnedReads()) {
+    evicted_obj_bytes = EvictObjects(-evp.mem_budget(), it, cntx.db_index);
   }
+  PublishDbSize(cntx.db_index);
 
   if (inserted) {  // new entry
+    if (freq_sketch_) {
+      freq_sketch_->EnsureCapacity(db.prime.size());
+    }
+
     db.stats.inline_keys += it->first.IsInline();
     db.stats.obj_memory_usage += it->first.MallocUsed();
 
     events_.garbage_collected = db.prime.garbage_collected();
     events_.stash_unloaded = db.prime.stash_unloaded();
+    events_.segment_splits = db.prime.splits();
+    events_.overflow_splits = db.prime.overflow_splits();
     events_.evicted_keys += evp.evicted();
     events_.garbage_checked += evp.checked();
 
+    db.ForgetDeletion(key);
+    db.IndexKey(key);
     it.SetVersion(NextVersion());
     memory_budget_ = evp.mem_budget() + evicted_obj_bytes;
+    if (notifier_.Enabled(KeyspaceNotifier::NEW))
+      notifier_.Notify("new", cntx.db_index, key);
 
     return make_tuple(it, ExpireIterator{}, true);
   }
@@ -400,33 +603,48 @@ tuple<PrimeIterator, ExpireIterator, bool> DbSlice::AddOrFind2(const Context& cn
 
   memory_budget_ += evicted_obj_bytes;
 
-  ExpireIterator expire_it;
-  if (existing->second.HasExpire()) {
-    expire_it = db.expire.Find(existing->first);
-    CHECK(IsValid(expire_it));
-
+  ExpireIterator expire_it = ExpireIterator::Of(existing);
+  if (IsValid(expire_it)) {
     // TODO: to implement the incremental update of expiry values using multi-generation
     // expire_base_ update. Right now we use only index 0.
     uint64_t delta_ms = cntx.time_now_ms - expire_base_[0];
 
-    if (expire_it->second.duration_ms() <= delta_ms) {
-      db.expire.Erase(expire_it);
-
-      if (existing->second.HasFlag()) {
-        db.mcflag.Erase(existing->first);
-      }
+    if (expire_it.period().duration_ms() <= delta_ms) {
+      --db.expire_count;
 
       // Keep the entry but reset the object.
       size_t value_heap_size = existing->second.MallocUsed();
       db.stats.obj_memory_usage -= value_heap_size;
+      db.stats.AddTypeMemoryUsage(existing->second.ObjType(), -value_heap_size);
+
+      if (existing->second.IsExternal()) {
+        auto [offset, size] = existing->second.GetExternalPtr();
+        owner_->tiered_storage()->Free(offset, size);
+        db.stats.AddExternal(existing->second.ObjType(), -1, -ssize_t(size));
+      }
 
       existing->second.Reset();
       events_.expired_keys++;
+      if (notifier_.active()) {
+        NotifyKeyEvent(&notifier_, KeyspaceNotifier::EXPIRED, "expired", cntx.db_index,
+                       existing->first);
+        NotifyKeyEvent(&notifier_, KeyspaceNotifier::NEW, "new", cntx.db_index, existing->first);
+      }
+
+      // The entry holds a new key now. change_cb_ is empty here, with callbacks FindExt above
+      // deletes the expired key, hence the version is set without notifying them.
+      existing.SetVersion(NextVersion());
 
       return make_tuple(existing, ExpireIterator{}, true);
     }
   }
 
+  if (owner_->tiered_storage()) {
+    tie(existing, expire_it) = TouchExternal(cntx.db_index, existing, expire_it);
+    if (!IsValid(existing))  // deleted while it was loaded.
+      return AddOrFind2(cntx, key);
+  }
+
   return make_tuple(existing, expire_it, false);
 }
 
@@ -436,86 +654,103 @@ void DbSlice::ActivateDb(DbIndex db_ind) {
   CreateDb(db_ind);
 }
 
-bool DbSlice::Del(DbIndex db_ind, PrimeIterator it) {
+bool DbSlice::Del(DbIndex db_ind, PrimeIterator it, bool lazy) {
   if (!IsValid(it)) {
     return false;
   }
 
+  InvalidateTracked(it->first, &tracking_table_);
+  NotifyKeyEvent(&notifier_, KeyspaceNotifier::GENERIC, "del", db_ind, it->first);
+
   auto& db = db_arr_[db_ind];
+  db->RecordDeletion(it->first);
+  db->UnindexKey(it->first);
   if (it->second.HasExpire()) {
-    CHECK_EQ(1u, db->expire.Erase(it->first));
-  }
-
-  if (it->second.HasFlag()) {
-    CHECK_EQ(1u, db->mcflag.Erase(it->first));
+    --db->expire_count;
   }
 
   UpdateStatsOnDeletion(it, &db->stats);
+  if (lazy && LazyFreeQueue::IsLarge(it->second))
+    lazy_free_.Add(&it->second);
   db->prime.Erase(it);
+  PublishDbSize(db_ind);
 
   return true;
 }
 
-void DbSlice::FlushDb(DbIndex db_ind) {
-  // TODO: to add preeemptiveness by yielding inside clear.
+void DbSlice::FlushDb(DbIndex db_ind, bool async) {
+  if (!tracking_table_.empty())
+    tracking_table_.InvalidateAll();
 
-  if (db_ind != kDbAll) {
-    auto& db = db_arr_[db_ind];
-    if (db) {
-      InvalidateDbWatches(db_ind);
+  if ((db_ind == 0 || db_ind == kDbAll) && doc_indices_) {
+    doc_indices_->OnFlush();
+    if (!db_arr_.empty() && db_arr_[0])
+      db_arr_[0]->doc_indices = nullptr;  // the keys of the flushed table are freed lazily.
+  }
+
+  if (delta_version_) {
+    for (DbIndex i = 0; i < db_arr_.size(); ++i) {
+      if ((db_ind == kDbAll || db_ind == i) && db_arr_[i])
+        delta_flushed_dbs_.push_back(i);
     }
+  }
 
+  if (db_ind != kDbAll) {
+    auto& db = db_arr_[db_ind];
     auto db_ptr = std::move(db);
     DCHECK(!db);
     CreateDb(db_ind);
-    db_arr_[db_ind]->trans_locks.swap(db_ptr->trans_locks);
+    if (db_ptr) {
+      db_arr_[db_ind]->trans_locks.swap(db_ptr->trans_locks);
+      db_arr_[db_ind]->InheritDeletions(*db_ptr);
+    }
 
-    auto cb = [db_ptr = std::move(db_ptr)]() mutable {
+    if (async) {
+      lazy_free_.Add(std::move(db_ptr));
+    } else {
       db_ptr.reset();
       mi_heap_collect(ServerState::tlocal()->data_heap(), true);
-    };
-
-    boost::fibers::fiber(std::move(cb)).detach();
+    }
 
     return;
   }
 
-  for (size_t i = 0; i < db_arr_.size(); i++) {
-    if (db_arr_[i]) {
-      InvalidateDbWatches(i);
-    }
-  }
-
   auto all_dbs = std::move(db_arr_);
   db_arr_.resize(all_dbs.size());
   for (size_t i = 0; i < db_arr_.size(); ++i) {
     if (all_dbs[i]) {
       CreateDb(i);
       db_arr_[i]->trans_locks.swap(all_dbs[i]->trans_locks);
+      db_arr_[i]->InheritDeletions(*all_dbs[i]);
     }
   }
 
-  boost::fibers::fiber([all_dbs = std::move(all_dbs)]() mutable {
-    for (auto& db : all_dbs) {
-      db.reset();
-    }
-  }).detach();
+  for (auto& db : all_dbs) {
+    if (db && async)
+      lazy_free_.Add(std::move(db));
+    db.reset();
+  }
+  if (!async)
+    mi_heap_collect(ServerState::tlocal()->data_heap(), true);
 }
 
 // Returns true if a state has changed, false otherwise.
 bool DbSlice::UpdateExpire(DbIndex db_ind, PrimeIterator it, uint64_t at) {
   auto& db = *db_arr_[db_ind];
   if (at == 0 && it->second.HasExpire()) {
-    CHECK_EQ(1u, db.expire.Erase(it->first));
+    BumpVersion(db_ind, it);
+    --db.expire_count;
     it->second.SetExpire(false);
 
     return true;
   }
 
   if (!it->second.HasExpire() && at) {
-    uint64_t delta = at - expire_base_[0];  // TODO: employ multigen expire updates.
-    CHECK(db.expire.Insert(it->first.AsRef(), ExpirePeriod(delta)).second);
+    BumpVersion(db_ind, it);
+    it.SetExpiry(FromAbsoluteTime(at).value());  // TODO: employ multigen expire updates.
+    ++db.expire_count;
     it->second.SetExpire(true);
+    IndexExpiry(&db, it->first, at);
 
     return true;
   }
@@ -523,21 +758,29 @@ bool DbSlice::UpdateExpire(DbIndex db_ind, PrimeIterator it, uint64_t at) {
   return false;
 }
 
-void DbSlice::SetMCFlag(DbIndex db_ind, PrimeKey key, uint32_t flag) {
-  auto& db = *db_arr_[db_ind];
-  if (flag == 0) {
-    db.mcflag.Erase(key);
-  } else {
-    auto [it, inserted] = db.mcflag.Insert(std::move(key), flag);
-    if (!inserted)
-      it->second = flag;
-  }
+void DbSlice::SetExpireTime(DbIndex db_ind, PrimeIterator it, ExpireIterator exp_it,
+                            uint64_t at_ms) {
+  DCHECK(IsValid(exp_it));
+  BumpVersion(db_ind, it);
+  it.SetExpiry(FromAbsoluteTime(at_ms).value());
+  IndexExpiry(db_arr_[db_ind].get(), it->first, at_ms);
 }
 
-uint32_t DbSlice::GetMCFlag(DbIndex db_ind, const PrimeKey& key) const {
-  auto& db = *db_arr_[db_ind];
-  auto it = db.mcflag.Find(key);
-  return it.is_done() ? 0 : it->second;
+void DbSlice::IndexExpiry(DbTable* db, const PrimeKey& key, uint64_t at_ms) {
+  if (!db->expire_wheel)
+    return;
+
+  string tmp;
+  db->expire_wheel->Add(key.GetSlice(&tmp), at_ms);
+}
+
+void DbSlice::SetMCFlag(PrimeIterator it, uint32_t flag) {
+  it->second.SetFlag(flag != 0);
+  it.SetAux(flag);
+}
+
+uint32_t DbSlice::GetMCFlag(PrimeIterator it) {
+  return it->second.HasFlag() ? it.GetAux() : 0;
 }
 
 PrimeIterator DbSlice::AddNew(const Context& cntx, string_view key, PrimeValue obj,
@@ -563,7 +806,7 @@ OpStatus DbSlice::UpdateExpire(const Context& cntx, PrimeIterator prime_it,
   if (rel_msec <= 0 && !params.persist) {
     CHECK(Del(cntx.db_index, prime_it));
   } else if (IsValid(expire_it)) {
-    expire_it->second = FromAbsoluteTime(now_msec + rel_msec);
+    SetExpireTime(cntx.db_index, prime_it, expire_it, now_msec + rel_msec);
   } else {
     UpdateExpire(cntx.db_index, prime_it, params.persist ? 0 : rel_msec + now_msec);
   }
@@ -584,17 +827,21 @@ std::pair<PrimeIterator, bool> DbSlice::AddOrUpdateInternal(const Context& cntx,
   auto& db = *db_arr_[cntx.db_index];
   auto& it = res.first;
 
+  bool had_expire = it->second.HasExpire();
   it->second = std::move(obj);
   PostUpdate(cntx.db_index, it, key, false);
 
+  // The entry expires only if the caller sets a deadline, whatever the flags of obj are.
+  it->second.SetExpire(expire_at_ms != 0);
   if (expire_at_ms) {
-    it->second.SetExpire(true);
-    uint64_t delta = expire_at_ms - expire_base_[0];
-    auto [eit, inserted] = db.expire.Insert(it->first.AsRef(), ExpirePeriod(delta));
-    CHECK(inserted || force_update);
-    if (!inserted) {
-      eit->second = ExpirePeriod(delta);
-    }
+    it.SetExpiry(FromAbsoluteTime(expire_at_ms).value());
+    IndexExpiry(&db, it->first, expire_at_ms);
+  }
+
+  if (had_expire && !expire_at_ms) {
+    --db.expire_count;
+  } else if (!had_expire && expire_at_ms) {
+    ++db.expire_count;
   }
 
   return res;
@@ -627,14 +874,14 @@ bool DbSlice::Acquire(IntentLock::Mode mode, const KeyLockArgs& lock_args) {
   bool lock_acquired = true;
 
   if (lock_args.args.size() == 1) {
-    lock_acquired = lt[lock_args.args.front()].Acquire(mode);
+    lock_acquired = lt.Acquire(mode, LockTable::Fingerprint(lock_args.args.front()));
   } else {
-    uniq_keys_.clear();
+    uniq_fps_.clear();
 
     for (size_t i = 0; i < lock_args.args.size(); i += lock_args.key_step) {
-      auto s = lock_args.args[i];
-      if (uniq_keys_.insert(s).second) {
-        bool res = lt[s].Acquire(mode);
+      uint64_t fp = LockTable::Fingerprint(lock_args.args[i]);
+      if (uniq_fps_.insert(fp).second) {
+        bool res = lt.Acquire(mode, fp);
         lock_acquired &= res;
       }
     }
@@ -654,16 +901,11 @@ void DbSlice::Release(IntentLock::Mode mode, const KeyLockArgs& lock_args) {
     Release(mode, lock_args.db_index, lock_args.args.front(), 1);
   } else {
     auto& lt = db_arr_[lock_args.db_index]->trans_locks;
-    uniq_keys_.clear();
+    uniq_fps_.clear();
     for (size_t i = 0; i < lock_args.args.size(); i += lock_args.key_step) {
-      auto s = lock_args.args[i];
-      if (uniq_keys_.insert(s).second) {
-        auto it = lt.find(s);
-        CHECK(it != lt.end());
-        it->second.Release(mode);
-        if (it->second.IsFree()) {
-          lt.erase(it);
-        }
+      uint64_t fp = LockTable::Fingerprint(lock_args.args[i]);
+      if (uniq_fps_.insert(fp).second) {
+        lt.Release(mode, fp);
       }
     }
   }
@@ -674,9 +916,7 @@ bool DbSlice::CheckLock(IntentLock::Mode mode, const KeyLockArgs& lock_args) con
 
   const auto& lt = db_arr_[lock_args.db_index]->trans_locks;
   for (size_t i = 0; i < lock_args.args.size(); i += lock_args.key_step) {
-    auto s = lock_args.args[i];
-    auto it = lt.find(s);
-    if (it != lt.end() && !it->second.Check(mode)) {
+    if (!lt.Check(mode, LockTable::Fingerprint(lock_args.args[i]))) {
       return false;
     }
   }
@@ -691,21 +931,27 @@ void DbSlice::PreUpdate(DbIndex db_ind, PrimeIterator it) {
   auto* stats = MutableStats(db_ind);
   stats->obj_memory_usage -= value_heap_size;
   stats->update_value_amount -= value_heap_size;
+  stats->AddTypeMemoryUsage(it->second.ObjType(), -value_heap_size);
 
   if (it->second.ObjType() == OBJ_STRING) {
     stats->strval_memory_usage -= value_heap_size;
-    if (it->second.IsExternal()) {
-      // We assume here that the operation code either loaded the entry into memory
-      // before calling to PreUpdate or it does not need to read it at all.
-      // After this code executes, the external blob is lost.
-      TieredStorage* tiered = shard_owner()->tiered_storage();
-      auto [offset, size] = it->second.GetExternalPtr();
-      tiered->Free(offset, size);
-      it->second.Reset();
+  }
 
-      stats->external_entries -= 1;
-      stats->external_size -= size;
-    }
+  // The tiny containers are changed in allocations of their own, PostUpdate packs them again.
+  if (it->second.IsTiny())
+    it->second.UnpackTiny();
+
+  if (it->second.IsExternal()) {
+    // We assume here that the operation code either loaded the entry into memory
+    // before calling to PreUpdate or it does not need to read it at all.
+    // After this code executes, the external blob is lost. Containers are always loaded
+    // by the lookup, so only strings can reach here.
+    DCHECK_EQ(OBJ_STRING, it->second.ObjType());
+    TieredStorage* tiered = shard_owner()->tiered_storage();
+    auto [offset, size] = it->second.GetExternalPtr();
+    tiered->Free(offset, size);
+    stats->AddExternal(it->second.ObjType(), -1, -ssize_t(size));
+    it->second.Reset();
   }
 
   it.SetVersion(NextVersion());
@@ -714,34 +960,38 @@ void DbSlice::PreUpdate(DbIndex db_ind, PrimeIterator it) {
 void DbSlice::PostUpdate(DbIndex db_ind, PrimeIterator it, std::string_view key, bool existing) {
   DbTableStats* stats = MutableStats(db_ind);
 
+  // Most hashes and sets of a few small elements fit into the value itself. The lookups of the
+  // cache mode bump up the entries, which would move the tiny containers under the readers that
+  // hold the pointers of several of them, e.g. SINTER.
+  if (!caching_mode_)
+    it->second.PackTiny();
+
   size_t value_heap_size = it->second.MallocUsed();
   stats->obj_memory_usage += value_heap_size;
+  stats->AddTypeMemoryUsage(it->second.ObjType(), value_heap_size);
   if (it->second.ObjType() == OBJ_STRING)
     stats->strval_memory_usage += value_heap_size;
   if (existing)
     stats->update_value_amount += value_heap_size;
 
-  auto& watched_keys = db_arr_[db_ind]->watched_keys;
-  if (!watched_keys.empty()) {
-    // Check if the key is watched.
-    if (auto wit = watched_keys.find(key); wit != watched_keys.end()) {
-      for (auto conn_ptr : wit->second) {
-        conn_ptr->watched_dirty.store(true, memory_order_relaxed);
-      }
-      // No connections need to watch it anymore.
-      watched_keys.erase(wit);
-    }
+  if (!tracking_table_.empty())
+    tracking_table_.Invalidate(key);
+
+  // The writes outside of the commands, e.g. of the heartbeat, are not notified.
+  if (notifier_.active() && !notifier_.command().empty() &&
+      notifier_.Enabled(KeyspaceNotifier::TypeClass(it->second.ObjType()))) {
+    notifier_.Notify(notifier_.command(), db_ind, key);
   }
+
+  if (db_ind == 0 && doc_indices_ && !doc_indices_->empty())
+    doc_indices_->OnWrite(key, it->second);
 }
 
 pair<PrimeIterator, ExpireIterator> DbSlice::ExpireIfNeeded(const Context& cntx,
                                                             PrimeIterator it) const {
   DCHECK(it->second.HasExpire());
   auto& db = db_arr_[cntx.db_index];
-
-  auto expire_it = db->expire.Find(it->first);
-
-  CHECK(IsValid(expire_it));
+  ExpireIterator expire_it{it};
 
   // TODO: to employ multi-generation update of expire-base and the underlying values.
   time_t expire_time = ExpireTime(expire_it);
@@ -749,9 +999,14 @@ pair<PrimeIterator, ExpireIterator> DbSlice::ExpireIfNeeded(const Context& cntx,
   if (time_t(cntx.time_now_ms) < expire_time)
     return make_pair(it, expire_it);
 
-  db->expire.Erase(expire_it);
+  InvalidateTracked(it->first, &tracking_table_);
+  NotifyKeyEvent(&notifier_, KeyspaceNotifier::EXPIRED, "expired", cntx.db_index, it->first);
+  db->RecordDeletion(it->first);
+  db->UnindexKey(it->first);
+  --db->expire_count;
   UpdateStatsOnDeletion(it, &db->stats);
   db->prime.Erase(it);
+  PublishDbSize(cntx.db_index);
   ++events_.expired_keys;
 
   return make_pair(PrimeIterator{}, ExpireIterator{});
@@ -763,18 +1018,15 @@ void DbSlice::ExpireAllIfNeeded() {
       continue;
     auto& db = *db_arr_[db_index];
 
-    auto cb = [&](ExpireTable::iterator exp_it) {
-      auto prime_it = db.prime.Find(exp_it->first);
-      if (!IsValid(prime_it)) {
-        LOG(ERROR) << "Expire entry " << exp_it->first.ToString() << " not found in prime table";
-        return;
-      }
-      ExpireIfNeeded(DbSlice::Context{db_index, GetCurrentTimeMs()}, prime_it);
+    // Deletions do not move other entries in the table so it's safe to delete while traversing.
+    auto cb = [&](PrimeIterator it) {
+      if (it->second.HasExpire())
+        ExpireIfNeeded(DbSlice::Context{db_index, GetCurrentTimeMs()}, it);
     };
 
-    ExpireTable::Cursor cursor;
+    PrimeTable::Cursor cursor;
     do {
-      cursor = db.expire.Traverse(cursor, cb);
+      cursor = db.prime.Traverse(cursor, cb);
     } while (cursor);
   }
 }
@@ -796,17 +1048,53 @@ void DbSlice::UnregisterOnChange(uint64_t id) {
   LOG(DFATAL) << "Could not find " << id << " to unregister";
 }
 
+auto DbSlice::StartDeltaEpoch(uint64_t version) -> DeltaEpoch {
+  DeltaEpoch res;
+  res.version = delta_version_;
+  res.flushed_dbs.swap(delta_flushed_dbs_);
+  res.deleted_keys.resize(db_arr_.size());
+  for (DbIndex i = 0; i < db_arr_.size(); ++i) {
+    if (!db_arr_[i])
+      continue;
+    auto& deleted_keys = db_arr_[i]->deleted_keys;
+    if (deleted_keys)
+      res.deleted_keys[i].swap(*deleted_keys);
+    deleted_keys.emplace();
+  }
+
+  delta_version_ = version;
+  return res;
+}
+
+void DbSlice::StopDeltaEpochs() {
+  delta_version_ = 0;
+  delta_flushed_dbs_.clear();
+  for (auto& db : db_arr_) {
+    if (db)
+      db->deleted_keys.reset();
+  }
+}
+
+void DbSlice::BumpVersion(DbIndex db_ind, PrimeIterator it) {
+  for (const auto& ccb : change_cb_) {
+    ccb.second(db_ind, ChangeReq{it});
+  }
+  it.SetVersion(NextVersion());
+}
+
 auto DbSlice::DeleteExpiredStep(const Context& cntx, unsigned count) -> DeleteExpiredStats {
   auto& db = *db_arr_[cntx.db_index];
   DeleteExpiredStats result;
 
-  auto cb = [&](ExpireIterator it) {
+  // The expiring entries are traversed in the prime table itself, where their deadlines are.
+  auto cb = [&](PrimeIterator it) {
+    if (!it->second.HasExpire())
+      return;
+
     result.traversed++;
-    time_t ttl = ExpireTime(it) - cntx.time_now_ms;
+    time_t ttl = ExpireTime(ExpireIterator{it}) - cntx.time_now_ms;
     if (ttl <= 0) {
-      auto prime_it = db.prime.Find(it->first);
-      CHECK(!prime_it.is_done());
-      ExpireIfNeeded(cntx, prime_it);
+      ExpireIfNeeded(cntx, it);
       ++result.deleted;
     } else {
       result.survivor_ttl_sum += ttl;
@@ -815,35 +1103,472 @@ auto DbSlice::DeleteExpiredStep(const Context& cntx, unsigned count) -> DeleteEx
 
   unsigned i = 0;
   for (; i < count / 3; ++i) {
-    db.expire_cursor = db.expire.Traverse(db.expire_cursor, cb);
+    db.expire_cursor = db.prime.Traverse(db.expire_cursor, cb);
   }
 
   // continue traversing only if we had strong deletion rate based on the first sample.
   if (result.deleted * 4 > result.traversed) {
     for (; i < count; ++i) {
-      db.expire_cursor = db.expire.Traverse(db.expire_cursor, cb);
+      db.expire_cursor = db.prime.Traverse(db.expire_cursor, cb);
     }
   }
 
   return result;
 }
 
+void DbSlice::EnableExpireWheel() {
+  expire_wheel_ = true;
+
+  uint64_t now_ms = GetCurrentTimeMs();
+  for (auto& db : db_arr_) {
+    if (!db || db->expire_wheel)
+      continue;
+
+    db->expire_wheel.reset(new TimingWheel(kExpireWheelResolutionMs, now_ms));
+    auto cb = [&](PrimeIterator it) {
+      if (it->second.HasExpire())
+        IndexExpiry(db.get(), it->first, ExpireTime(ExpireIterator{it}));
+    };
+
+    PrimeTable::Cursor cursor;
+    do {
+      cursor = db->prime.Traverse(cursor, cb);
+    } while (cursor);
+  }
+}
+
+void DbSlice::EnablePrefixIndex(string_view delimiters) {
+  DCHECK(!delimiters.empty());
+  prefix_delimiters_ = delimiters;
+
+  for (auto& db : db_arr_) {
+    if (!db || db->prefix_index)
+      continue;
+
+    db->prefix_index.reset(new PrefixIndex(delimiters));
+    string tmp;
+    auto cb = [&](PrimeIterator it) { db->IndexKey(it->first.GetSlice(&tmp)); };
+
+    PrimeTable::Cursor cursor;
+    do {
+      cursor = db->prime.Traverse(cursor, cb);
+    } while (cursor);
+  }
+}
+
+void DbSlice::SetDocIndices(ShardDocIndices* indices) {
+  doc_indices_ = indices;
+  if (!db_arr_.empty() && db_arr_[0])
+    db_arr_[0]->doc_indices = indices;
+}
+
+auto DbSlice::DeleteDueStep(const Context& cntx, unsigned limit) -> DeleteExpiredStats {
+  auto& db = *db_arr_[cntx.db_index];
+  DeleteExpiredStats result;
+  DCHECK(db.expire_wheel);
+
+  // The wheel is not updated when a key is deleted, persisted or gets a later deadline,
+  // hence we delete only the keys that are actually expired.
+  auto cb = [&](string_view key, uint64_t deadline_ms) {
+    result.traversed++;
+    auto prime_it = db.prime.Find(key);
+    if (!IsValid(prime_it) || !prime_it->second.HasExpire())
+      return;
+
+    if (IsValid(ExpireIfNeeded(cntx, prime_it).first))
+      return;
+
+    ++result.deleted;
+    ++events_.wheel_expired_keys;
+    events_.expire_lag_ms += cntx.time_now_ms - deadline_ms;
+  };
+
+  db.expire_wheel->Advance(cntx.time_now_ms, limit, cb);
+
+  return result;
+}
+
+void DbSlice::IndexFieldExpiry(const Context& cntx, string_view key, StringMap* sm, uint32_t at) {
+  // A pass that is overdue was lost, e.g. since the hash was renamed.
+  uint32_t pass_at = sm->expire_pass_at();
+  if (pass_at != 0 && pass_at <= at &&
+      pass_at > container_utils::TimeNowSecRel(cntx.time_now_ms)) {
+    return;
+  }
+
+  auto& db = *db_arr_[cntx.db_index];
+  if (!db.field_expire_wheel) {
+    db.field_expire_wheel.reset(
+        new TimingWheel(kFieldExpireWheelResolutionMs, cntx.time_now_ms));
+  }
+  db.field_expire_wheel->Add(key, container_utils::TimeSecRelToMs(at));
+  sm->set_expire_pass_at(at);
+}
+
+auto DbSlice::DeleteDueFieldsStep(const Context& cntx, unsigned limit) -> DeleteExpiredStats {
+  auto& db = *db_arr_[cntx.db_index];
+  DeleteExpiredStats result;
+  if (!db.field_expire_wheel)
+    return result;
+
+  uint32_t now = container_utils::TimeNowSecRel(cntx.time_now_ms);
+
+  // The wheel is not updated when a hash is deleted or gets another pass, hence only the hashes
+  // whose pass is due are traversed. The next passes are added once the wheel is advanced.
+  vector<pair<string, uint64_t>> next_passes;
+  auto cb = [&](string_view key, uint64_t deadline_ms) {
+    auto it = db.prime.Find(key);
+    if (!IsValid(it) || it->second.ObjType() != OBJ_HASH ||
+        it->second.Encoding() != kEncodingStrMap2) {
+      return;
+    }
+    if (it->second.HasExpire() && !IsValid(ExpireIfNeeded(cntx, it).first))
+      return;
+
+    StringMap* sm = (StringMap*)it->second.RObjPtr();
+    uint32_t pass_at = sm->expire_pass_at();
+    if (pass_at == 0 || pass_at > now)
+      return;
+
+    // The hash is retried on the next tick while a transaction holds it.
+    if (!CheckLock(IntentLock::EXCLUSIVE, KeyLockArgs{cntx.db_index, ArgSlice{&key, 1}, 1})) {
+      next_passes.emplace_back(key, cntx.time_now_ms + kFieldExpireWheelResolutionMs);
+      return;
+    }
+
+    PreUpdate(cntx.db_index, it);
+    sm->set_time(now);
+    size_t size = sm->Size();
+    uint32_t next_at = UINT32_MAX;
+
+    // The scan deletes the expired fields that it visits.
+    uint32_t cursor = 0;
+    do {
+      cursor = sm->Scan(cursor, [&](sds entry) {
+        next_at = std::min(next_at, StringMap::ExpireTime(entry));
+      });
+    } while (cursor);
+
+    size_t deleted = size - sm->Size();
+    result.traversed += size;
+    result.deleted += deleted;
+    events_.expired_hash_fields += deleted;
+
+    sm->set_expire_pass_at(next_at == UINT32_MAX ? 0 : next_at);
+    PostUpdate(cntx.db_index, it, key);
+
+    if (sm->Empty()) {
+      Del(cntx.db_index, it);
+    } else if (next_at != UINT32_MAX) {
+      next_passes.emplace_back(key, container_utils::TimeSecRelToMs(next_at));
+    }
+  };
+
+  db.field_expire_wheel->Advance(cntx.time_now_ms, limit, cb);
+
+  for (const auto& [key, at_ms] : next_passes)
+    db.field_expire_wheel->Add(key, at_ms);
+
+  return result;
+}
+
+void DbSlice::EnableFrequencySketch() {
+  size_t num_keys = 0;
+  for (const auto& db : db_arr_) {
+    if (db)
+      num_keys += db->prime.size();
+  }
+  freq_sketch_.reset(new FrequencySketch(num_keys));
+  freq_admission_ = true;
+}
+
+void DbSlice::SetEvictionPolicy(EvictionPolicy policy) {
+  bool lfu = policy == EvictionPolicy::VOLATILE_LFU || policy == EvictionPolicy::ALLKEYS_LFU;
+  if (lfu && !freq_sketch_) {
+    size_t num_keys = 0;
+    for (const auto& db : db_arr_) {
+      if (db)
+        num_keys += db->prime.size();
+    }
+    freq_sketch_.reset(new FrequencySketch(num_keys));
+  }
+  eviction_policy_ = policy;
+}
+
+void DbSlice::EnableHotKeys(uint32_t sample_rate) {
+  hot_keys_.reset(new HotKeys(sample_rate));
+}
+
 // TODO: Design a better background evicting heuristic.
-void DbSlice::FreeMemWithEvictionStep(DbIndex db_ind, size_t increase_goal_bytes) {
-  if (!caching_mode_)
+
+size_t DbSlice::FreeMemWithEvictionStep(DbIndex db_ind, size_t increase_goal_bytes) {
+  // Snapshots must see the buckets before they change, we do not evict under them.
+  if (!caching_mode_ || HasPinnedReads() || !change_cb_.empty())
+    return 0;
+
+  DbTable& db = *db_arr_[db_ind];
+  if (db.prime.size() == 0)
+    return 0;
+
+  size_t used_memory_start = owner_->UsedMemory();
+  auto freed_memory_fun = [&] {
+    size_t current = owner_->UsedMemory();
+    return current < used_memory_start ? used_memory_start - current : 0;
+  };
+
+  // Evicts a key unless it may be referenced by a running transaction.
+  auto try_evict = [&](PrimeIterator evict_it) {
+    if (evict_it->first.IsSticky())
+      return false;
+
+    if (!db.trans_locks.empty() && db.trans_locks.Contains(evict_it->first.HashCode()))
+      return false;
+
+    EvictItemFun(evict_it, db_ind, this);
+    return true;
+  };
+
+  constexpr unsigned kMaxSegmentsPerStep = 8;
+  constexpr unsigned kNumSlots = PrimeTable::Segment_t::kNumSlots;
+  unsigned evicted = 0;
+  size_t freed = 0;
+
+  // Ranks the items of a segment by the policy, the lowest ranked are evicted first.
+  bool volatile_only = eviction_policy_ == EvictionPolicy::VOLATILE_TTL ||
+                       eviction_policy_ == EvictionPolicy::VOLATILE_LFU;
+  vector<pair<uint64_t, PrimeIterator>> ranked;
+  auto rank_segment = [&](uint32_t sid, PrimeTable::Segment_t* segment) {
+    ranked.clear();
+    for (unsigned bid = 0; bid < segment->num_buckets(); ++bid) {
+      for (unsigned slot_id = 0; slot_id < kNumSlots; ++slot_id) {
+        if (!segment->GetBucket(bid).IsBusy(slot_id))
+          continue;
+
+        PrimeIterator it = db.prime.GetIterator(sid, bid, slot_id);
+        if (volatile_only && !it->second.HasExpire())
+          continue;
+
+        uint64_t rank = eviction_policy_ == EvictionPolicy::VOLATILE_TTL
+                            ? ExpireTime(ExpireIterator{it})
+                            : freq_sketch_->Estimate(db.prime.DoHash(it->first));
+        ranked.emplace_back(rank, it);
+      }
+    }
+    sort(ranked.begin(), ranked.end(),
+         [](const auto& a, const auto& b) { return a.first < b.first; });
+  };
+
+  for (unsigned n = 0; n < kMaxSegmentsPerStep && freed < increase_goal_bytes; ++n) {
+    unsigned depth = db.prime.depth();
+    uint32_t sid = db.evict_cursor & ((1u << depth) - 1);
+    PrimeTable::Segment_t* segment = db.prime.GetSegment(sid);
+
+    // A segment occupies a range of the directory, we visit it once per pass.
+    uint32_t span = 1u << (depth - segment->local_depth());
+    sid &= ~(span - 1);
+    db.evict_cursor = sid + span;
+
+    if (eviction_policy_ != EvictionPolicy::ALLKEYS_LRU) {
+      rank_segment(sid, segment);
+      for (size_t i = 0; i < ranked.size() && freed < increase_goal_bytes; ++i) {
+        if (try_evict(ranked[i].second)) {
+          ++evicted;
+          freed = freed_memory_fun();
+        }
+      }
+      continue;
+    }
+
+    // Stash and overflow buckets hold the items that did not fit into their home buckets and
+    // the last slots hold the items that were not bumped up recently. Both are evicted first.
+    for (unsigned bid = segment->num_buckets(); bid-- > 0;) {
+      bool is_stash = bid >= PrimeTable::Segment_t::kNumBuckets;
+      unsigned min_slot = is_stash ? 0 : kNumSlots - 1;
+
+      for (unsigned slot_id = kNumSlots; slot_id-- > min_slot && freed < increase_goal_bytes;) {
+        if (!segment->GetBucket(bid).IsBusy(slot_id))
+          continue;
+
+        if (try_evict(db.prime.GetIterator(sid, bid, slot_id))) {
+          ++evicted;
+          freed = freed_memory_fun();
+        }
+      }
+    }
+  }
+
+  if (evicted) {
+    DVLOG(1) << "Evicted " << evicted << " items ahead of demand, freed " << freed << " bytes";
+    DFLY_TRACE(evict__step, shard_id(), db_ind, evicted, freed);
+    events_.evicted_keys += evicted;
+    events_.proactive_evictions += evicted;
+    events_.policy_evictions[unsigned(eviction_policy_)] += evicted;
+    memory_budget_ += freed;
+  }
+
+  return freed;
+}
+
+size_t DbSlice::FreeMemWithEviction(size_t goal_bytes) {
+  size_t freed = 0;
+
+  if (!memory_quota_.empty()) {
+    vector<pair<size_t, DbIndex>> over_quota;
+    for (DbIndex i = 0; i < db_arr_.size(); ++i) {
+      if (size_t excess = QuotaExcess(i); excess > 0)
+        over_quota.emplace_back(excess, i);
+    }
+    sort(over_quota.rbegin(), over_quota.rend());
+
+    for (const auto& [excess, db_ind] : over_quota) {
+      size_t res = FreeMemWithEvictionStep(db_ind, excess);
+      events_.quota_evictions += (res > 0);
+      freed += res;
+    }
+  }
+
+  if (freed >= goal_bytes)
+    return freed;
+
+  size_t total_usage = 0;
+  for (DbIndex i = 0; i < db_arr_.size(); ++i) {
+    if (IsDbValid(i))
+      total_usage += DbMemoryUsage(i);
+  }
+
+  // Every database gives up memory in proportion to its share of the usage.
+  size_t remaining = goal_bytes - freed;
+  for (DbIndex i = 0; i < db_arr_.size() && total_usage > 0; ++i) {
+    if (!IsDbValid(i))
+      continue;
+    size_t db_goal = double(remaining) * DbMemoryUsage(i) / total_usage;
+    if (db_goal > 0)
+      freed += FreeMemWithEvictionStep(i, db_goal);
+  }
+
+  return freed;
+}
+
+void DbSlice::SetMemoryQuota(DbIndex db_ind, size_t bytes) {
+  if (memory_quota_.size() <= db_ind)
+    memory_quota_.resize(db_ind + 1, 0);
+  memory_quota_[db_ind] = bytes;
+
+  while (!memory_quota_.empty() && memory_quota_.back() == 0)
+    memory_quota_.pop_back();
+}
+
+size_t DbSlice::DbMemoryUsage(DbIndex db_ind) const {
+  if (!IsDbValid(db_ind))
+    return 0;
+
+  const DbTable& db = *db_arr_[db_ind];
+  return db.stats.obj_memory_usage + db.prime.mem_usage();
+}
+
+size_t DbSlice::QuotaExcess(DbIndex db_ind) const {
+  size_t quota = memory_quota(db_ind);
+  if (quota == 0)
+    return 0;
+
+  size_t shard_quota = quota / shard_set->size();
+  size_t usage = DbMemoryUsage(db_ind);
+  return usage > shard_quota ? usage - shard_quota : 0;
+}
+
+void DbSlice::MergeSegmentsStep(DbIndex db_ind) {
+  DbTable& db = *db_arr_[db_ind];
+
+  // Fast path - nothing to merge if the table is reasonably loaded.
+  if (db.prime.load_factor() >= kMergeLoadFactor)
+    return;
+
+  // Entries of merged segments move between buckets, hence we must let the snapshot
+  // save them first, in the same way we do before a segment split.
+  auto on_merge = [&](PrimeTable::bucket_iterator bit) {
+    for (const auto& ccb : change_cb_) {
+      ccb.second(db_ind, bit);
+    }
+  };
+
+  unsigned merged = 0;
+  db.prime_merge_cursor = db.prime.MergeStep(db.prime_merge_cursor, kMergeStepSegments,
+                                             kMergeLoadFactor, on_merge, &merged);
+  events_.segments_merged += merged;
+
+  // Symmetrical to PrimeEvictionPolicy::RecordSplit.
+  memory_budget_ += ssize_t(merged) * PrimeTable::kSegBytes;
+}
+
+void DbSlice::TrimTimeSeriesStep(DbIndex db_ind) {
+  DbTable& db = *db_arr_[db_ind];
+  if (db.stats.memory_usage_by_type[OBJ_TS] == 0)
     return;
+
+  string tmp;
+  auto cb = [&](PrimeIterator it) {
+    if (it->second.ObjType() != OBJ_TS || !it->second.GetTimeSeries()->NeedsTrim())
+      return;
+
+    PreUpdate(db_ind, it);
+    it->second.GetTimeSeries()->Trim();
+    PostUpdate(db_ind, it, it->first.GetSlice(&tmp));
+  };
+
+  for (unsigned i = 0; i < kTrimStepBuckets; ++i) {
+    db.ts_trim_cursor = db.prime.Traverse(db.ts_trim_cursor, cb);
+    if (!db.ts_trim_cursor)
+      break;
+  }
+}
+
+void DbSlice::PublishDbSize(DbIndex db_ind) const {
+  EngineShardSet::PublishDbSize(shard_id_, db_ind, db_arr_[db_ind]->prime.size());
 }
 
 void DbSlice::CreateDb(DbIndex db_ind) {
   auto& db = db_arr_[db_ind];
   if (!db) {
     db.reset(new DbTable{owner_->memory_resource()});
+    if (delta_version_)
+      db->deleted_keys.emplace();
+    if (expire_wheel_) {
+      db->expire_wheel.reset(new TimingWheel(kExpireWheelResolutionMs, GetCurrentTimeMs()));
+    }
+    if (!prefix_delimiters_.empty()) {
+      db->prefix_index.reset(new PrefixIndex(prefix_delimiters_));
+    }
+    if (db_ind == 0)
+      db->doc_indices = doc_indices_;
+    PublishDbSize(db_ind);
+  }
+}
+
+pair<PrimeIterator, ExpireIterator> DbSlice::TouchExternal(DbIndex db_ind, PrimeIterator it,
+                                                           ExpireIterator exp_it) const {
+  it->second.SetTouched(true);
+  if (it->second.ObjType() == OBJ_STRING) {
+    if (it->second.Size() >= TieredStorage::kMinBlobLen)
+      owner_->tiered_storage()->RecordAccess(db_ind, it);
+    return {it, exp_it};
   }
+
+  if (!it->second.IsExternal())
+    return {it, exp_it};
+
+  // Strings are read on demand by their families, but the container families work on the
+  // in-memory objects directly.
+  it = owner_->tiered_storage()->Load(db_ind, it);
+  if (!IsValid(it))
+    return {};
+
+  return {it, ExpireIterator::Of(it)};
 }
 
 // "it" is the iterator that we just added/updated and it should not be deleted.
 // "table" is the instance where we should delete the objects from.
-size_t DbSlice::EvictObjects(size_t memory_to_free, PrimeIterator it, DbTable* table) {
+size_t DbSlice::EvictObjects(size_t memory_to_free, PrimeIterator it, DbIndex db_ind) {
+  DbTable* table = db_arr_[db_ind].get();
   PrimeTable::Segment_t* segment = table->prime.GetSegment(it.segment_id());
   DCHECK(segment);
 
@@ -877,7 +1602,7 @@ size_t DbSlice::EvictObjects(size_t memory_to_free, PrimeIterator it, DbTable* t
       if (evict_it == it || evict_it->first.IsSticky())
         continue;
 
-      EvictItemFun(evict_it, table);
+      EvictItemFun(evict_it, db_ind, this);
       ++evicted;
       if (freed_memory_fun() > memory_to_free) {
         evict_succeeded = true;
@@ -903,7 +1628,7 @@ size_t DbSlice::EvictObjects(size_t memory_to_free, PrimeIterator it, DbTable* t
       if (evict_it == it || evict_it->first.IsSticky())
         continue;
 
-      EvictItemFun(evict_it, table);
+      EvictItemFun(evict_it, db_ind, this);
       ++evicted;
 
       if (freed_memory_fun() > memory_to_free) {
@@ -924,29 +1649,4 @@ size_t DbSlice::EvictObjects(size_t memory_to_free, PrimeIterator it, DbTable* t
   return freed_memory_fun();
 };
 
-void DbSlice::RegisterWatchedKey(DbIndex db_indx, std::string_view key,
-                                 ConnectionState::ExecInfo* exec_info) {
-  db_arr_[db_indx]->watched_keys[key].push_back(exec_info);
-}
-
-void DbSlice::UnregisterConnectionWatches(ConnectionState::ExecInfo* exec_info) {
-  for (const auto& [db_indx, key] : exec_info->watched_keys) {
-    auto& watched_keys = db_arr_[db_indx]->watched_keys;
-    if (auto it = watched_keys.find(key); it != watched_keys.end()) {
-      it->second.erase(std::remove(it->second.begin(), it->second.end(), exec_info),
-                       it->second.end());
-      if (it->second.empty())
-        watched_keys.erase(it);
-    }
-  }
-}
-
-void DbSlice::InvalidateDbWatches(DbIndex db_indx) {
-  for (const auto& [key, conn_list] : db_arr_[db_indx]->watched_keys) {
-    for (auto conn_ptr : conn_list) {
-      conn_ptr->watched_dirty.store(true, memory_order_relaxed);
-    }
-  }
-}
-
 }  // namespace dfly
@@ -6,10 +6,15 @@
 
 #include <absl/container/flat_hash_set.h>
 
+#include "core/frequency_sketch.h"
 #include "facade/op_status.h"
 #include "server/common.h"
 #include "server/conn_context.h"
+#include "server/hot_keys.h"
+#include "server/keyspace_notifier.h"
+#include "server/lazy_free.h"
 #include "server/table.h"
+#include "server/tracking_table.h"
 
 namespace util {
 class ProactorBase;
@@ -19,6 +24,8 @@ namespace dfly {
 
 using facade::OpResult;
 
+class StringMap;
+
 struct DbStats : public DbTableStats {
   // number of active keys.
   size_t key_count = 0;
@@ -32,12 +39,38 @@ struct DbStats : public DbTableStats {
   // Memory used by dictionaries.
   size_t table_mem_usage = 0;
 
+  // number of due keys that the expiry wheel has not processed yet.
+  size_t expire_backlog = 0;
+
+  // Memory used by the prefix index, which is not part of table_mem_usage.
+  size_t prefix_index_mem_usage = 0;
+
+  // number of table segments with the overflow buckets, see PrimeTable::overflow_segments().
+  size_t overflow_segments = 0;
+
   using DbTableStats::operator+=;
   using DbTableStats::operator=;
 
   DbStats& operator+=(const DbStats& o);
 };
 
+// Chooses the items that the eviction ahead of demand frees, see FreeMemWithEvictionStep.
+enum class EvictionPolicy : uint8_t {
+  ALLKEYS_LRU,   // the items of the stash buckets and the last slots, that were not bumped up.
+  VOLATILE_TTL,  // the items with expiry that are closest to their deadlines.
+  VOLATILE_LFU,  // the least frequently used items with expiry.
+  ALLKEYS_LFU,   // the least frequently used items.
+};
+
+constexpr unsigned kNumEvictionPolicies = 4;
+
+// Parses the names of maxmemory-policy, e.g. "volatile-ttl".
+std::optional<EvictionPolicy> ParseEvictionPolicy(std::string_view name);
+const char* EvictionPolicyName(EvictionPolicy policy);
+
+bool AbslParseFlag(std::string_view in, EvictionPolicy* policy, std::string* err);
+std::string AbslUnparseFlag(EvictionPolicy policy);
+
 struct SliceEvents {
   // Number of eviction events.
   size_t evicted_keys = 0;
@@ -48,7 +81,31 @@ struct SliceEvents {
   size_t garbage_checked = 0;
   size_t garbage_collected = 0;
   size_t stash_unloaded = 0;
+
+  // table segment splits and those of them that happened once the overflow buckets were full.
+  size_t segment_splits = 0;
+  size_t overflow_splits = 0;
   size_t bumpups = 0;  // how many bump-upds we did.
+  size_t segments_merged = 0;  // how many table segments were folded back after deletions.
+  size_t proactive_evictions = 0;  // evictions ahead of demand, see FreeMemWithEvictionStep.
+  size_t quota_evictions = 0;      // evictions from databases that exceeded their quota.
+
+  // evictions ahead of demand by the policy that chose them, indexed by EvictionPolicy.
+  size_t policy_evictions[kNumEvictionPolicies] = {};
+
+  // keyspace lookups that found (did not find) the key.
+  size_t hits = 0;
+  size_t misses = 0;
+
+  // inserts refused by the frequency based admission, see DbSlice::EnableFrequencySketch.
+  size_t admission_rejected = 0;
+
+  // keys deleted by the expiry wheel and the sum of their delays past the deadline.
+  size_t wheel_expired_keys = 0;
+  size_t expire_lag_ms = 0;
+
+  // fields of hashes deleted by their passes, see DbSlice::DeleteDueFieldsStep.
+  size_t expired_hash_fields = 0;
 
   SliceEvents& operator+=(const SliceEvents& o);
 };
@@ -63,6 +120,10 @@ class DbSlice {
     std::vector<DbStats> db_stats;
     SliceEvents events;
     size_t small_string_bytes = 0;
+    size_t small_string_segments = 0;  // see SmallString::SegmentsThreadLocal.
+    size_t key_prefixes = 0;
+    size_t key_prefix_bytes = 0;
+    LazyFreeQueue::Stats lazy_free;
   };
 
   using Context = DbContext;
@@ -104,6 +165,10 @@ class DbSlice {
   // Returns statistics for the whole db slice. A bit heavy operation.
   Stats GetStats() const;
 
+  const SliceEvents& events() const {
+    return events_;
+  }
+
   void UpdateExpireBase(uint64_t now, unsigned generation) {
     expire_base_[generation & 1] = now;
   }
@@ -123,21 +188,48 @@ class DbSlice {
     return bytes_per_object_;
   }
 
+  // Pinned reads are values of locked keys that are being read by other threads.
+  // While there are pinned reads the slice does not reallocate or evict values, so that their
+  // memory stays valid until the reader unpins them.
+  void PinRead() {
+    ++pinned_reads_;
+  }
+
+  void UnpinRead() {
+    --pinned_reads_;
+  }
+
+  bool HasPinnedReads() const {
+    return pinned_reads_ > 0;
+  }
+
   // returns absolute time of the expiration.
   time_t ExpireTime(ExpireIterator it) const {
-    return it.is_done() ? 0 : expire_base_[0] + it->second.duration_ms();
+    return it.is_done() ? 0 : expire_base_[0] + it.period().duration_ms();
   }
 
+  // Deadlines before the expire base are stored as the base itself.
   ExpirePeriod FromAbsoluteTime(uint64_t time_ms) const {
-    return ExpirePeriod{time_ms - expire_base_[0]};
+    uint64_t base = expire_base_[0];
+    return ExpirePeriod{time_ms > base ? time_ms - base : 0};
   }
 
+  // Sets a new deadline for a key that already has one.
+  void SetExpireTime(DbIndex db_ind, PrimeIterator it, ExpireIterator exp_it, uint64_t at_ms);
+
   OpResult<PrimeIterator> Find(const Context& cntx, std::string_view key,
                                unsigned req_obj_type) const;
 
   // Returns (value, expire) dict entries if key exists, null if it does not exist or has expired.
   std::pair<PrimeIterator, ExpireIterator> FindExt(const Context& cntx, std::string_view key) const;
 
+  // Batched version of FindExt. Hashes all the keys and prefetches the buckets they map to
+  // before resolving them, so that the memory misses of different keys overlap.
+  // Calls cb(index, PrimeIterator, ExpireIterator) for each key in keys, in order.
+  // The iterators are valid only inside the callback because resolving the subsequent keys
+  // may bump up or expire other entries.
+  template <typename Cb> void FindMany(const Context& cntx, ArgSlice keys, Cb&& cb) const;
+
   // Returns (iterator, args-index) if found, KEY_NOTFOUND otherwise.
   // If multiple keys are found, returns the first index in the ArgSlice.
   OpResult<std::pair<PrimeIterator, unsigned>> FindFirst(const Context& cntx, ArgSlice args);
@@ -174,22 +266,29 @@ class DbSlice {
   // Does not change expiry if at != 0 and expiry already exists.
   bool UpdateExpire(DbIndex db_ind, PrimeIterator main_it, uint64_t at);
 
-  void SetMCFlag(DbIndex db_ind, PrimeKey key, uint32_t flag);
-  uint32_t GetMCFlag(DbIndex db_ind, const PrimeKey& key) const;
+  // The memcache flags are kept in the entry itself, they are valid if the value has FLAG_BIT.
+  static void SetMCFlag(PrimeIterator it, uint32_t flag);
+  static uint32_t GetMCFlag(PrimeIterator it);
 
   // Creates a database with index `db_ind`. If such database exists does nothing.
   void ActivateDb(DbIndex db_ind);
 
-  bool Del(DbIndex db_ind, PrimeIterator it);
+  // If lazy is set, a large value is handed to the lazy free queue instead of being freed in
+  // place.
+  bool Del(DbIndex db_ind, PrimeIterator it, bool lazy = false);
 
   constexpr static DbIndex kDbAll = 0xFFFF;
 
   /**
    * @brief Flushes the database of index db_ind. If kDbAll is passed then flushes all the
-   * databases.
-   *
+   * databases. If async is set, the flushed tables are freed in the background by the lazy
+   * free queue, otherwise they are freed before the call returns.
    */
-  void FlushDb(DbIndex db_ind);
+  void FlushDb(DbIndex db_ind, bool async = true);
+
+  LazyFreeQueue& lazy_free() {
+    return lazy_free_;
+  }
 
   EngineShard* shard_owner() {
     return owner_;
@@ -199,6 +298,9 @@ class DbSlice {
     return shard_id_;
   }
 
+  // Publishes the number of keys of the db after it changed, which DBSIZE reads from any thread.
+  void PublishDbSize(DbIndex db_ind) const;
+
   bool Acquire(IntentLock::Mode m, const KeyLockArgs& lock_args);
 
   void Release(IntentLock::Mode m, const KeyLockArgs& lock_args);
@@ -222,8 +324,8 @@ class DbSlice {
     return db_arr_[id].get();
   }
 
-  std::pair<PrimeTable*, ExpireTable*> GetTables(DbIndex id) {
-    return std::pair<PrimeTable*, ExpireTable*>(&db_arr_[id]->prime, &db_arr_[id]->expire);
+  PrimeTable* GetPrimeTable(DbIndex id) {
+    return &db_arr_[id]->prime;
   }
 
   // Returns existing keys count in the db.
@@ -239,11 +341,11 @@ class DbSlice {
   }
 
   // Check whether 'it' has not expired. Returns it if it's still valid. Otherwise, erases it
-  // from both tables and return PrimeIterator{}.
+  // and returns PrimeIterator{}.
   std::pair<PrimeIterator, ExpireIterator> ExpireIfNeeded(const Context& cntx,
                                                           PrimeIterator it) const;
 
-  // Iterate over all expire table entries and delete expired.
+  // Iterate over all the expiring entries and delete expired.
   void ExpireAllIfNeeded();
 
   // Current version of this slice.
@@ -262,6 +364,30 @@ class DbSlice {
   //! Unregisters the callback.
   void UnregisterOnChange(uint64_t id);
 
+  // A delta snapshot saves only what changed in a delta epoch: the buckets whose version is
+  // above the version of the epoch, and the keys that were deleted in it. An epoch starts with
+  // a snapshot and ends with the following one.
+  struct DeltaEpoch {
+    uint64_t version = 0;  // of the snapshot that started the epoch.
+    std::vector<absl::flat_hash_set<std::string>> deleted_keys;  // indexed by DbIndex.
+    std::vector<DbIndex> flushed_dbs;
+  };
+
+  // Starts a new epoch at version and returns the epoch that it ends.
+  DeltaEpoch StartDeltaEpoch(uint64_t version);
+
+  // Stops tracking the deltas. The next delta snapshot needs a new base snapshot.
+  void StopDeltaEpochs();
+
+  bool HasDeltaEpoch() const {
+    return delta_version_ != 0;
+  }
+
+  // The databases flushed in the current epoch.
+  const std::vector<DbIndex>& delta_flushed_dbs() const {
+    return delta_flushed_dbs_;
+  }
+
   struct DeleteExpiredStats {
     uint32_t deleted = 0;         // number of deleted items due to expiry (less than traversed).
     uint32_t traversed = 0;       // number of traversed items that have ttl bit
@@ -270,7 +396,67 @@ class DbSlice {
 
   // Deletes some amount of possible expired items.
   DeleteExpiredStats DeleteExpiredStep(const Context& cntx, unsigned count);
-  void FreeMemWithEvictionStep(DbIndex db_indx, size_t increase_goal_bytes);
+
+  // Indexes the keys with expiry in a timing wheel per db, so that DeleteDueStep deletes
+  // the keys that are due without sampling the prime table.
+  void EnableExpireWheel();
+
+  bool HasExpireWheel() const {
+    return expire_wheel_;
+  }
+
+  // Indexes the keys by their prefixes that end with one of the delimiters, so that SCAN
+  // MATCH of a pattern with a literal prefix visits only the keys under the prefix.
+  void EnablePrefixIndex(std::string_view delimiters);
+
+  // Keeps the search indices up to date with the writes to db 0 and its deletions.
+  void SetDocIndices(ShardDocIndices* indices);
+
+  // Deletes at most limit keys that are due according to the expiry wheel.
+  DeleteExpiredStats DeleteDueStep(const Context& cntx, unsigned limit);
+
+  // Schedules a pass over the fields of the hash sm, stored at key, at the time at which one of
+  // them expires, see container_utils::TimeNowSecRel. Does nothing if the pass of the hash is
+  // scheduled before at already.
+  void IndexFieldExpiry(const Context& cntx, std::string_view key, StringMap* sm, uint32_t at);
+
+  // Runs at most limit passes that are due, each of which deletes the expired fields of a hash,
+  // and the hash if none is left, and schedules its next pass. The expiry work is proportional
+  // to the hashes that have fields due rather than to all the hashes with expiring fields.
+  // Reports the fields traversed and deleted.
+  DeleteExpiredStats DeleteDueFieldsStep(const Context& cntx, unsigned limit);
+
+  // Evicts the coldest items of a few segments of the db, continuing from where the previous
+  // call stopped, until increase_goal_bytes are freed. The eviction policy defines which items
+  // are the coldest: the policies other than ALLKEYS_LRU rank all the items of a segment and
+  // evict the lowest ranked first. Keys that are locked by transactions and sticky keys are
+  // kept. Does nothing outside of cache mode. Returns the freed bytes.
+  size_t FreeMemWithEvictionStep(DbIndex db_indx, size_t increase_goal_bytes);
+
+  // Evicts from the databases that exceed their share of the memory quota first, the most
+  // exceeding one first, and then from all the databases in proportion to their memory usage
+  // until goal_bytes are freed. Returns the freed bytes.
+  size_t FreeMemWithEviction(size_t goal_bytes);
+
+  // Sets the memory quota of a database across all the shards, 0 removes it. Every shard
+  // enforces its share of the quota: in cache mode by evicting from the database, otherwise
+  // by failing the writes to it with an out of memory error.
+  void SetMemoryQuota(DbIndex db_ind, size_t bytes);
+
+  size_t memory_quota(DbIndex db_ind) const {
+    return db_ind < memory_quota_.size() ? memory_quota_[db_ind] : 0;
+  }
+
+  // Memory used by the entries and the tables of the database in this shard.
+  size_t DbMemoryUsage(DbIndex db_ind) const;
+
+  // Merges underloaded segments of the db tables in order to give memory back after
+  // mass deletions. Examines a bounded number of segments per call.
+  void MergeSegmentsStep(DbIndex db_ind);
+
+  // Trims the time series of the db to their retention periods. Examines a bounded number of
+  // buckets per call and returns immediately if the db has no time series.
+  void TrimTimeSeriesStep(DbIndex db_ind);
 
   const DbTableArray& databases() const {
     return db_arr_;
@@ -280,49 +466,139 @@ class DbSlice {
     caching_mode_ = 1;
   }
 
-  void RegisterWatchedKey(DbIndex db_indx, std::string_view key,
-                          ConnectionState::ExecInfo* exec_info);
+  // Tracks the access frequency of keys in a count-min sketch (TinyLFU). In caching mode,
+  // when the table can not grow, the eviction picks the least frequently used candidate and
+  // refuses to insert a key that is used less often than it.
+  void EnableFrequencySketch();
+
+  const FrequencySketch* freq_sketch() const {
+    return freq_sketch_.get();
+  }
+
+  // Whether the inserts go through the frequency based admission of EnableFrequencySketch.
+  bool freq_admission() const {
+    return freq_admission_;
+  }
+
+  // The LFU policies track the access frequency of keys as EnableFrequencySketch does, but
+  // without the admission.
+  void SetEvictionPolicy(EvictionPolicy policy);
+
+  EvictionPolicy eviction_policy() const {
+    return eviction_policy_;
+  }
+
+  // Samples the key accesses to find the hot keys, see HotKeys.
+  void EnableHotKeys(uint32_t sample_rate);
+
+  const HotKeys* hot_keys() const {
+    return hot_keys_.get();
+  }
 
-  // Unregisted all watched key entries for connection.
-  void UnregisterConnectionWatches(ConnectionState::ExecInfo* exec_info);
+  // Keys tracked for the client side caching of all the databases.
+  TrackingTable& tracking_table() {
+    return tracking_table_;
+  }
 
-  // Invalidate all watched keys in database. Used on FLUSH.
-  void InvalidateDbWatches(DbIndex db_indx);
+  KeyspaceNotifier& keyspace_notifier() {
+    return notifier_;
+  }
 
  private:
+
+  std::pair<PrimeIterator, ExpireIterator> FindExt(const Context& cntx, std::string_view key,
+                                                   uint64_t key_hash) const;
+
   std::pair<PrimeIterator, bool> AddOrUpdateInternal(const Context& cntx, std::string_view key,
                                                      PrimeValue obj, uint64_t expire_at_ms,
                                                      bool force_update) noexcept(false);
 
   void CreateDb(DbIndex index);
-  size_t EvictObjects(size_t memory_to_free, PrimeIterator it, DbTable* table);
+
+  // Marks the entry as accessed for the tiered storage and loads it back if it is an unloaded
+  // container. Loading preempts the calling fiber, so it returns the iterators that are
+  // valid afterwards.
+  std::pair<PrimeIterator, ExpireIterator> TouchExternal(DbIndex db_ind, PrimeIterator it,
+                                                         ExpireIterator exp_it) const;
+
+  // How much the database exceeds this shard's share of its quota.
+  size_t QuotaExcess(DbIndex db_ind) const;
+
+  // Adds the deadline of key to the expiry wheel of db, if there is one.
+  void IndexExpiry(DbTable* db, const PrimeKey& key, uint64_t at_ms);
+  size_t EvictObjects(size_t memory_to_free, PrimeIterator it, DbIndex db_ind);
 
   uint64_t NextVersion() {
     return version_++;
   }
 
+  // Notifies the change callbacks and bumps the version of the bucket, for changes that do not
+  // go through PreUpdate.
+  void BumpVersion(DbIndex db_ind, PrimeIterator it);
+
  private:
   ShardId shard_id_;
   uint8_t caching_mode_ : 1;
+  bool expire_wheel_ = false;
+  bool freq_admission_ = false;
+  EvictionPolicy eviction_policy_ = EvictionPolicy::ALLKEYS_LRU;
+  std::string prefix_delimiters_;  // the prefix index is enabled if not empty.
+  ShardDocIndices* doc_indices_ = nullptr;
 
   EngineShard* owner_;
 
   time_t expire_base_[2];  // Used for expire logic, represents a real clock.
 
   uint64_t version_ = 1;  // Used to version entries in the PrimeTable.
+  uint64_t delta_version_ = 0;  // of the current delta epoch, 0 if the deltas are not tracked.
+  std::vector<DbIndex> delta_flushed_dbs_;
   ssize_t memory_budget_ = SSIZE_MAX;
   size_t bytes_per_object_ = 0;
   size_t soft_budget_limit_ = 0;
+  uint32_t pinned_reads_ = 0;
 
   mutable SliceEvents events_;  // we may change this even for const operations.
+  std::vector<size_t> memory_quota_;  // indexed by DbIndex.
+  std::unique_ptr<FrequencySketch> freq_sketch_;
+  std::unique_ptr<HotKeys> hot_keys_;
+  mutable TrackingTable tracking_table_;  // also invalidated by the const ExpireIfNeeded.
+  mutable KeyspaceNotifier notifier_;
 
   DbTableArray db_arr_;
+  LazyFreeQueue lazy_free_;
 
   // Used in temporary computations in Acquire/Release.
-  absl::flat_hash_set<std::string_view> uniq_keys_;
+  absl::flat_hash_set<uint64_t> uniq_fps_;
 
   // ordered from the smallest to largest version.
   std::vector<std::pair<uint64_t, ChangeCallback>> change_cb_;
 };
 
+template <typename Cb> void DbSlice::FindMany(const Context& cntx, ArgSlice keys, Cb&& cb) const {
+  if (!IsDbValid(cntx.db_index)) {
+    for (unsigned i = 0; i < keys.size(); ++i) {
+      cb(i, PrimeIterator{}, ExpireIterator{});
+    }
+    return;
+  }
+
+  // Small enough to keep the prefetched buckets in L1.
+  constexpr unsigned kBatchSize = 16;
+  uint64_t hashes[kBatchSize];
+  const PrimeTable& prime = db_arr_[cntx.db_index]->prime;
+
+  for (unsigned start = 0; start < keys.size(); start += kBatchSize) {
+    unsigned len = std::min<unsigned>(kBatchSize, keys.size() - start);
+    for (unsigned j = 0; j < len; ++j) {
+      hashes[j] = prime.DoHash(keys[start + j]);
+      prime.Prefetch(hashes[j]);
+    }
+
+    for (unsigned j = 0; j < len; ++j) {
+      auto [it, exp_it] = FindExt(cntx, keys[start + j], hashes[j]);
+      cb(start + j, it, exp_it);
+    }
+  }
+}
+
 }  // namespace dfly
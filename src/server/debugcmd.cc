@@ -7,6 +7,8 @@
 #include <absl/random/random.h>
 #include <absl/strings/str_cat.h>
 
+#include <algorithm>
+#include <atomic>
 #include <boost/fiber/operations.hpp>
 #include <filesystem>
 
@@ -27,6 +29,7 @@ using namespace std;
 
 ABSL_DECLARE_FLAG(string, dir);
 ABSL_DECLARE_FLAG(string, dbfilename);
+ABSL_DECLARE_FLAG(bool, df_snapshot_format);
 
 namespace dfly {
 
@@ -38,13 +41,13 @@ namespace fs = std::filesystem;
 using absl::GetFlag;
 using absl::StrAppend;
 
-struct PopulateBatch {
-  DbIndex dbid;
-  uint64_t index[32];
-  uint64_t sz = 0;
-
-  PopulateBatch(DbIndex id) : dbid(id) {
-  }
+struct PopulateOptions {
+  uint64_t total_count = 0;
+  string_view prefix{"key"};
+  uint32_t val_size = 0;
+  bool random_value_str = false;
+  string_view type{"STRING"};
+  uint32_t elements = 1;
 };
 
 struct ObjInfo {
@@ -59,27 +62,52 @@ struct ObjInfo {
   bool found = false;
 };
 
-void DoPopulateBatch(std::string_view prefix, size_t val_size, bool random_value_str,
-                     const SetCmd::SetParams& params, const PopulateBatch& batch) {
-  DbContext db_cntx{batch.dbid, 0};
-  OpArgs op_args(EngineShard::tlocal(), 0, db_cntx);
-  SetCmd sg(op_args);
-
-  absl::InsecureBitGen gen;
-  for (unsigned i = 0; i < batch.sz; ++i) {
-    string key = absl::StrCat(prefix, ":", batch.index[i]);
-    string val;
+// Returns label<index> padded with 'x' to val_size bytes, or a random hex string of val_size
+// bytes. A unique value keeps its label<index> prefix and is padded with the random bytes.
+string PopulateValue(string_view label, uint64_t index, const PopulateOptions& opts, bool unique,
+                     absl::InsecureBitGen* gen) {
+  if (opts.random_value_str && !unique)
+    return GetRandomHex(*gen, opts.val_size);
+
+  string res = absl::StrCat(label, index);
+  if (res.size() < opts.val_size) {
+    if (opts.random_value_str)
+      res.append(GetRandomHex(*gen, opts.val_size - res.size()));
+    else
+      res.resize(opts.val_size, 'x');
+  }
+  return res;
+}
 
-    if (random_value_str) {
-      val = GetRandomHex(gen, val_size);
-    } else {
-      val = absl::StrCat("value:", batch.index[i]);
-      if (val.size() < val_size) {
-        val.resize(val_size, 'x');
-      }
+// Fills cmd with the command that creates the key of a non-string type with its elements.
+void BuildPopulateCmd(const PopulateOptions& opts, string_view key, absl::InsecureBitGen* gen,
+                      vector<string>* cmd) {
+  cmd->clear();
+  if (opts.type == "JSON") {
+    string obj = "{";
+    for (uint32_t i = 0; i < opts.elements; ++i) {
+      StrAppend(&obj, i ? "," : "", "\"field:", i, "\":\"",
+                PopulateValue("value:", i, opts, false, gen), "\"");
     }
+    obj.push_back('}');
+    *cmd = {"JSON.SET", string(key), "$", move(obj)};
+    return;
+  }
 
-    sg.Set(params, key, val);
+  const char* name = opts.type == "HASH"   ? "HSET"
+                     : opts.type == "SET"  ? "SADD"
+                     : opts.type == "ZSET" ? "ZADD"
+                                           : "RPUSH";
+  cmd->emplace_back(name);
+  cmd->emplace_back(key);
+  for (uint32_t i = 0; i < opts.elements; ++i) {
+    if (opts.type == "HASH") {
+      cmd->push_back(absl::StrCat("field:", i));
+    } else if (opts.type == "ZSET") {
+      cmd->push_back(absl::StrCat(i));
+    }
+    bool unique = opts.type == "SET" || opts.type == "ZSET";
+    cmd->push_back(PopulateValue(unique ? "member:" : "value:", i, opts, unique, gen));
   }
 }
 
@@ -104,12 +132,20 @@ void DebugCmd::Run(CmdArgList args) {
         "    Stops replica from reconnecting to master, or resumes",
         "WATCHED",
         "    Shows the watched keys as a result of BLPOP and similar operations.",
-        "POPULATE <count> [<prefix>] [<size>] [RAND]",
+        "TX",
+        "    Shows the tx queues and the locked keys of every shard and the latency breakdown",
+        "    of the last slow transactions.",
+        "HOTKEYS [<count>]",
+        "    Shows the <count> (default 10) hottest keys with their db, their estimated rate in",
+        "    ops/sec and its possible overestimation, from the sampled key accesses.",
+        "POPULATE <count> [<prefix>] [<size>] [RAND] [TYPE <type>] [ELEMENTS <num>]",
         "    Create <count> string keys named key:<num> with value value:<num>.",
         "    If <prefix> is specified then it is used instead of the 'key' prefix.",
         "    If <size> is specified then X character is concatenated multiple times to value:<num>",
         "    to meet value size.",
         "    If RAND is specified than value will be set to random hex string in specified size.",
+        "    TYPE creates keys of STRING (default), HASH, SET, ZSET, LIST or JSON type with",
+        "    ELEMENTS (default 1) elements of <size> bytes each. Every shard creates its own keys.",
         "HELP",
         "    Prints this help.",
     };
@@ -134,6 +170,14 @@ void DebugCmd::Run(CmdArgList args) {
     return Watched();
   }
 
+  if (subcmd == "TX") {
+    return TxAnalysis();
+  }
+
+  if (subcmd == "HOTKEYS" && args.size() <= 3) {
+    return HotKeysCmd(args);
+  }
+
   if (subcmd == "LOAD" && args.size() == 3) {
     return Load(ArgS(args, 2));
   }
@@ -170,7 +214,7 @@ void DebugCmd::Reload(CmdArgList args) {
     trans->InitByArgs(0, {});
     VLOG(1) << "Performing save";
 
-    GenericError ec = sf_.DoSave(false, trans.get());
+    GenericError ec = sf_.DoSave(GetFlag(FLAGS_df_snapshot_format), trans.get());
     if (ec) {
       return (*cntx_)->SendError(ec.Format());
     }
@@ -234,97 +278,104 @@ void DebugCmd::Load(string_view filename) {
 }
 
 void DebugCmd::Populate(CmdArgList args) {
-  if (args.size() < 3 || args.size() > 6) {
+  if (args.size() < 3) {
     return (*cntx_)->SendError(UnknownSubCmd("populate", "DEBUG"));
   }
 
-  uint64_t total_count = 0;
-  if (!absl::SimpleAtoi(ArgS(args, 2), &total_count))
+  PopulateOptions opts;
+  if (!absl::SimpleAtoi(ArgS(args, 2), &opts.total_count))
     return (*cntx_)->SendError(kUintErr);
-  std::string_view prefix{"key"};
 
   if (args.size() > 3) {
-    prefix = ArgS(args, 3);
+    opts.prefix = ArgS(args, 3);
   }
-  uint32_t val_size = 0;
   if (args.size() > 4) {
     std::string_view str = ArgS(args, 4);
-    if (!absl::SimpleAtoi(str, &val_size))
+    if (!absl::SimpleAtoi(str, &opts.val_size))
       return (*cntx_)->SendError(kUintErr);
   }
 
-  bool populate_random_values = false;
-  if (args.size() > 5) {
-    ToUpper(&args[5]);
-    std::string_view str = ArgS(args, 5);
-    if (str != "RAND") {
+  for (size_t i = 5; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    std::string_view str = ArgS(args, i);
+    if (str == "RAND") {
+      opts.random_value_str = true;
+    } else if (str == "TYPE" && i + 1 < args.size()) {
+      ToUpper(&args[++i]);
+      opts.type = ArgS(args, i);
+      string_view types[] = {"STRING", "HASH", "SET", "ZSET", "LIST", "JSON"};
+      if (find(begin(types), end(types), opts.type) == end(types))
+        return (*cntx_)->SendError(kSyntaxErr);
+    } else if (str == "ELEMENTS" && i + 1 < args.size()) {
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &opts.elements) || opts.elements == 0)
+        return (*cntx_)->SendError(kUintErr);
+    } else {
       return (*cntx_)->SendError(kSyntaxErr);
     }
-    populate_random_values = true;
   }
 
-  ProactorPool& pp = sf_.service().proactor_pool();
-  size_t runners_count = pp.size();
-  vector<pair<uint64_t, uint64_t>> ranges(runners_count - 1);
-  uint64_t batch_size = total_count / runners_count;
-  size_t from = 0;
-  for (size_t i = 0; i < ranges.size(); ++i) {
-    ranges[i].first = from;
-    ranges[i].second = batch_size;
-    from += batch_size;
-  }
-  ranges.emplace_back(from, total_count - from);
-
-  vector<fibers_ext::Fiber> fb_arr(ranges.size());
-  for (size_t i = 0; i < ranges.size(); ++i) {
-    auto range = ranges[i];
+  // Every shard goes over all the keys and creates those that belong to it, so that no key
+  // crosses the threads.
+  atomic_uint64_t errors{0};
+  shard_set->RunBlockingInParallel([&](EngineShard* shard) {
+    errors.fetch_add(PopulateShard(opts, shard), memory_order_relaxed);
+  });
 
-    // whatever we do, we should not capture i by reference.
-    fb_arr[i] = pp.at(i)->LaunchFiber([range, prefix, val_size, populate_random_values, this] {
-      this->PopulateRangeFiber(range.first, range.second, prefix, val_size, populate_random_values);
-    });
+  if (uint64_t num_errors = errors.load(memory_order_relaxed); num_errors > 0) {
+    return (*cntx_)->SendError(absl::StrCat(num_errors, " keys could not be populated"));
   }
-  for (auto& fb : fb_arr)
-    fb.Join();
-
   (*cntx_)->SendOk();
 }
 
-void DebugCmd::PopulateRangeFiber(uint64_t from, uint64_t len, std::string_view prefix,
-                                  unsigned value_len, bool populate_random_values) {
-  FiberProps::SetName("populate_range");
-  VLOG(1) << "PopulateRange: " << from << "-" << (from + len - 1);
+uint64_t DebugCmd::PopulateShard(const PopulateOptions& opts, EngineShard* shard) {
+  FiberProps::SetName("populate_shard");
+  VLOG(1) << "PopulateShard: " << shard->shard_id();
 
-  string key = absl::StrCat(prefix, ":");
-  size_t prefsize = key.size();
   DbIndex db_indx = cntx_->db_index();
-  EngineShardSet& ess = *shard_set;
-  std::vector<PopulateBatch> ps(ess.size(), PopulateBatch{db_indx});
+  OpArgs op_args(shard, 0, DbContext{db_indx, 0});
+  SetCmd sg(op_args);
   SetCmd::SetParams params;
 
-  for (uint64_t i = from; i < from + len; ++i) {
-    StrAppend(&key, i);
-    ShardId sid = Shard(key, ess.size());
+  // The keys of the other types are created by their commands, whose transactions run inline
+  // since the stub context is in the thread of their shard, as in PipelineSquasher.
+  io::NullSink null_sink;
+  ConnectionContext stub{&null_sink, cntx_->owner()};
+  stub.conn_state.db_index = db_indx;
+  stub.req_auth = cntx_->req_auth;
+  stub.authenticated = cntx_->authenticated;
+  stub.conn_state.throttle.exempt = true;
+  vector<string> cmd;
+  vector<MutableSlice> cmd_args;
+
+  string key = absl::StrCat(opts.prefix, ":");
+  size_t prefsize = key.size();
+  absl::InsecureBitGen gen;
+  for (uint64_t i = 0; i < opts.total_count; ++i) {
+    // Lets the shard serve the other requests meanwhile.
+    if (i % 1024 == 1023)
+      fibers_ext::Yield();
+
     key.resize(prefsize);  // shrink back
+    StrAppend(&key, i);
+    if (Shard(key, shard_set->size()) != shard->shard_id())
+      continue;
 
-    auto& shard_batch = ps[sid];
-    shard_batch.index[shard_batch.sz++] = i;
-    if (shard_batch.sz == 32) {  // TODO what is this 32?
-      ess.Add(sid, [=] {
-        DoPopulateBatch(prefix, value_len, populate_random_values, params, shard_batch);
-        if (i % 50 == 0) {
-          fibers_ext::Yield();
-        }
-      });
-
-      // we capture shard_batch by value so we can override it here.
-      shard_batch.sz = 0;
+    if (opts.type == "STRING") {
+      sg.Set(params, key, PopulateValue("value:", i, opts, false, &gen));
+      continue;
     }
+
+    BuildPopulateCmd(opts, key, &gen, &cmd);
+    cmd_args.resize(cmd.size());
+    for (size_t j = 0; j < cmd.size(); ++j)
+      cmd_args[j] = MutableSlice{cmd[j].data(), cmd[j].size()};
+    sf_.service().DispatchCommand(CmdArgList{cmd_args.data(), cmd_args.size()}, &stub);
   }
 
-  ess.RunBlockingInParallel([&](EngineShard* shard) {
-    DoPopulateBatch(prefix, value_len, populate_random_values, params, ps[shard->shard_id()]);
-  });
+  uint64_t errors = 0;
+  for (const auto& k_v : stub.reply_builder()->err_count())
+    errors += k_v.second;
+  return errors;
 }
 
 void DebugCmd::Inspect(string_view key) {
@@ -333,9 +384,7 @@ void DebugCmd::Inspect(string_view key) {
 
   auto cb = [&]() -> ObjInfo {
     auto& db_slice = EngineShard::tlocal()->db_slice();
-    auto [pt, exp_t] = db_slice.GetTables(cntx_->db_index());
-
-    PrimeIterator it = pt->Find(key);
+    PrimeIterator it = db_slice.GetPrimeTable(cntx_->db_index())->Find(key);
     ObjInfo oinfo;
     if (IsValid(it)) {
       oinfo.found = true;
@@ -343,12 +392,10 @@ void DebugCmd::Inspect(string_view key) {
       oinfo.bucket_id = it.bucket_id();
       oinfo.slot_id = it.slot_id();
       if (it->second.HasExpire()) {
-        ExpireIterator exp_it = exp_t->Find(it->first);
-        CHECK(!exp_it.is_done());
-
+        ExpireIterator exp_it{it};
         time_t exp_time = db_slice.ExpireTime(exp_it);
         oinfo.ttl = exp_time - GetCurrentTimeMs();
-        oinfo.has_sec_precision = exp_it->second.is_second_precision();
+        oinfo.has_sec_precision = exp_it.period().is_second_precision();
       }
     }
 
@@ -399,4 +446,77 @@ void DebugCmd::Watched() {
   (*cntx_)->SendStringArr(watched_keys);
 }
 
+void DebugCmd::HotKeysCmd(CmdArgList args) {
+  uint32_t count = 10;
+  if (args.size() == 3 && (!absl::SimpleAtoi(ArgS(args, 2), &count) || count == 0)) {
+    return (*cntx_)->SendError(kUintErr);
+  }
+
+  vector<HotKeys::Key> keys;
+  bool enabled = false;
+  boost::fibers::mutex mu;
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    const HotKeys* hot_keys = shard->db_slice().hot_keys();
+    if (!hot_keys)
+      return;
+
+    // The shards own disjoint keys, so their lists are merged without aggregation.
+    vector<HotKeys::Key> top = hot_keys->Top(count, GetCurrentTimeMs());
+    lock_guard lk(mu);
+    enabled = true;
+    move(top.begin(), top.end(), back_inserter(keys));
+  });
+
+  if (!enabled) {
+    return (*cntx_)->SendError("hot keys are not tracked, see --hotkeys_sample_rate");
+  }
+
+  sort(keys.begin(), keys.end(),
+       [](const auto& l, const auto& r) { return l.ops_per_sec > r.ops_per_sec; });
+  if (keys.size() > count)
+    keys.resize(count);
+
+  (*cntx_)->StartArray(keys.size());
+  for (const HotKeys::Key& k : keys) {
+    (*cntx_)->StartArray(4);
+    (*cntx_)->SendBulkString(k.key);
+    (*cntx_)->SendLong(k.db);
+    (*cntx_)->SendDouble(k.ops_per_sec);
+    (*cntx_)->SendDouble(k.error_per_sec);
+  }
+}
+
+void DebugCmd::TxAnalysis() {
+  vector<string> shard_info(shard_set->size());
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    TxQueue* txq = shard->txq();
+    DbSlice& db_slice = shard->db_slice();
+    size_t locks = 0;
+    for (DbIndex i = 0; i < db_slice.db_array_size(); ++i) {
+      if (db_slice.IsDbValid(i))
+        locks += db_slice.GetDBTable(i)->trans_locks.size();
+    }
+
+    string& info = shard_info[shard->shard_id()];
+    info = absl::StrCat("shard:", shard->shard_id(), " queue_len:", txq->size());
+    if (!txq->Empty())
+      StrAppend(&info, " head_score:", txq->HeadScore());
+    StrAppend(&info, " committed_txid:", shard->committed_txid(), " locked_keys:", locks);
+  });
+
+  vector<string> slow_txs;
+  boost::fibers::mutex mu;
+  shard_set->pool()->AwaitFiberOnAll([&](util::ProactorBase* pb) {
+    const auto& txs = ServerState::tlocal()->slow_txs();
+    lock_guard lk(mu);
+    slow_txs.insert(slow_txs.end(), txs.begin(), txs.end());
+  });
+
+  vector<string> res = std::move(shard_info);
+  for (string& tx : slow_txs) {
+    res.push_back(absl::StrCat("slow: ", tx));
+  }
+  (*cntx_)->SendStringArr(res);
+}
+
 }  // namespace dfly
@@ -8,8 +8,10 @@
 
 namespace dfly {
 
+class EngineShard;
 class EngineShardSet;
 class ServerFamily;
+struct PopulateOptions;
 
 class DebugCmd {
  public:
@@ -19,13 +21,15 @@ class DebugCmd {
 
  private:
   void Populate(CmdArgList args);
-  void PopulateRangeFiber(uint64_t from, uint64_t len, std::string_view prefix, unsigned value_len,
-                          bool populate_random_values);
+  // Creates the keys of the shard, returns the number of those that failed.
+  uint64_t PopulateShard(const PopulateOptions& opts, EngineShard* shard);
   void Reload(CmdArgList args);
   void Replica(CmdArgList args);
   void Load(std::string_view filename);
   void Inspect(std::string_view key);
   void Watched();
+  void HotKeysCmd(CmdArgList args);
+  void TxAnalysis();
 
   ServerFamily& sf_;
   ConnectionContext* cntx_;
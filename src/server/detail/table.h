@@ -6,7 +6,6 @@
 
 #include "core/compact_object.h"
 #include "core/dash.h"
-#include "core/expire_period.h"
 
 namespace dfly {
 
@@ -16,10 +15,21 @@ using PrimeKey = CompactObj;
 using PrimeValue = CompactObj;
 
 struct PrimeTablePolicy {
-  enum { kSlotNum = 14, kBucketNum = 56, kStashBucketNum = 4 };
+  // The buckets of 32 byte entries span several cache lines whatever the width, hence the
+  // width trades the load factor against the probe cost, see BM_GeometryFind in dash_bench.cc.
+  enum { kSlotNum = 14, kBucketNum = 64, kStashBucketNum = 4 };
 
   static constexpr bool kUseVersion = true;
 
+  // The expiry of an entry holds its ExpirePeriod, it is valid if the value has EXPIRE_BIT.
+  static constexpr bool kUseExpiry = true;
+
+  // The aux value of an entry holds its memcache flags, it is valid if the value has FLAG_BIT.
+  static constexpr bool kUseAux = true;
+
+  // A full segment absorbs up to 28 more entries, 3% of its capacity, before it splits.
+  static constexpr unsigned kOverflowBucketNum = 2;
+
   static uint64_t HashFn(const PrimeKey& s) {
     return s.HashCode();
   }
@@ -45,28 +55,5 @@ struct PrimeTablePolicy {
   }
 };
 
-struct ExpireTablePolicy {
-  enum { kSlotNum = 14, kBucketNum = 56, kStashBucketNum = 4 };
-  static constexpr bool kUseVersion = false;
-
-  static uint64_t HashFn(const PrimeKey& s) {
-    return s.HashCode();
-  }
-
-  static void DestroyKey(PrimeKey& cs) {
-    cs.Reset();
-  }
-
-  static void DestroyValue(ExpirePeriod e) {
-  }
-
-  static void DestroyValue(uint32_t val) {
-  }
-
-  static bool Equal(const PrimeKey& s1, const PrimeKey& s2) {
-    return s1 == s2;
-  }
-};
-
 }  // namespace detail
 }  // namespace dfly
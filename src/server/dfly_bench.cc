@@ -0,0 +1,669 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include <absl/random/discrete_distribution.h>
+#include <absl/random/random.h>
+#include <absl/random/zipf_distribution.h>
+#include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+#include <absl/strings/str_split.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/fiber/mutex.hpp>
+#include <cmath>
+#include <deque>
+#include <iostream>
+
+#include "base/flags.h"
+#include "base/init.h"
+#include "base/io_buf.h"
+#include "base/logging.h"
+#include "core/latency_histogram.h"
+#include "facade/redis_parser.h"
+#include "facade/reply_builder.h"
+#include "server/engine_shard_set.h"
+#include "util/fibers/event_count.h"
+#include "util/fibers/fiber.h"
+#include "util/uring/uring_pool.h"
+
+// A load generator for Dragonfly. Every thread runs --connections connections, each of which
+// issues the commands of --command_mix. For example, 1M requests per second of a Zipf
+// distributed GET/SET mix, 4 in flight per connection:
+//   ./dfly_bench --command_mix=get:9,set:1 --key_dist=zipf --pipeline=4 --qps=1000000
+//                --test_time=60
+
+ABSL_FLAG(std::string, host, "127.0.0.1", "The host of the server");
+ABSL_FLAG(uint32_t, connections, 20, "The number of connections per thread");
+ABSL_FLAG(uint64_t, requests, 10000,
+          "The number of requests per connection, ignored if --test_time is set");
+ABSL_FLAG(uint32_t, test_time, 0, "If positive, the run takes that many seconds");
+ABSL_FLAG(uint32_t, pipeline, 1, "The maximal number of requests in flight per connection");
+ABSL_FLAG(uint64_t, qps, 0,
+          "If positive, the total rate of the requests, which are issued whether or not the "
+          "replies of the previous ones arrived (open loop). Their latency counts from the time "
+          "they were due, so that the stalls of the server are not hidden by the requests that "
+          "were not issued meanwhile. 0 issues a request once a reply arrives (closed loop)");
+ABSL_FLAG(std::string, command_mix, "get:10,set:1",
+          "The weights of the commands: set, get, mget, incr, hset, hget, lpush, lpop, sadd, "
+          "zadd, evalsha over RESP and mc_set, mc_get over memcache. The connections are split "
+          "between the protocols by their weights, see --memcache_port");
+ABSL_FLAG(uint64_t, key_space, 1000000, "The number of distinct keys per data type");
+ABSL_FLAG(std::string, key_prefix, "key:", "");
+ABSL_FLAG(std::string, key_dist, "uniform",
+          "uniform, zipf (see --zipf_exp) or hotset (see --hot_set and --hot_ratio)");
+ABSL_FLAG(double, zipf_exp, 1.1, "The exponent of the Zipf distribution, above 1");
+ABSL_FLAG(double, hot_set, 0.01, "The fraction of the key space that is hot");
+ABSL_FLAG(double, hot_ratio, 0.9, "The fraction of the requests that access the hot set");
+ABSL_FLAG(uint32_t, value_size, 32, "The size of the values");
+ABSL_FLAG(uint32_t, value_size_max, 0,
+          "If above --value_size, the sizes are uniform between --value_size and this");
+ABSL_FLAG(uint32_t, mget_keys, 10, "The number of keys of MGET");
+ABSL_FLAG(std::string, lua_script, "return redis.call('GET', KEYS[1])",
+          "The script of evalsha, which gets --lua_keys keys and the value as its argument");
+ABSL_FLAG(uint32_t, lua_keys, 1, "The number of keys of evalsha");
+ABSL_FLAG(uint32_t, shards, 0,
+          "The number of shards of the server. If set, the keys of a command belong to a single "
+          "shard, as the keys of the real multi-key workloads often do");
+ABSL_FLAG(int32_t, target_shard, -1,
+          "If non-negative, all the keys belong to this shard, which requires --shards");
+ABSL_FLAG(uint64_t, seed, 0, "The seed of the random generators");
+
+ABSL_DECLARE_FLAG(uint32_t, port);
+ABSL_DECLARE_FLAG(uint32_t, memcache_port);
+ABSL_DECLARE_FLAG(bool, shard_by_hashtag);
+
+using namespace std;
+using namespace util;
+using absl::GetFlag;
+using absl::StrCat;
+using facade::RedisParser;
+using facade::RespExpr;
+
+namespace dfly {
+
+namespace {
+
+enum Op : uint8_t {
+  SET,
+  GET,
+  MGET,
+  INCR,
+  HSET,
+  HGET,
+  LPUSH,
+  LPOP,
+  SADD,
+  ZADD,
+  EVALSHA,
+  MC_SET,
+  MC_GET,
+  NUM_OPS
+};
+
+constexpr const char* kOpNames[NUM_OPS] = {
+    "set", "get", "mget", "incr", "hset", "hget", "lpush",
+    "lpop", "sadd", "zadd", "evalsha", "mc_set", "mc_get"};
+
+// The keys of every data type are distinct, so that the commands do not fail with WRONGTYPE.
+constexpr const char* kKeyTags[NUM_OPS] = {
+    "", "", "", "i:", "h:", "h:", "l:",
+    "l:", "s:", "z:", "", "", ""};
+
+bool IsMemcache(Op op) {
+  return op >= MC_SET;
+}
+
+// The settings of the run, which are shared by all the connections.
+struct Workload {
+  double weights[NUM_OPS] = {0};
+  double resp_weight = 0;
+  double mc_weight = 0;
+
+  boost::asio::ip::tcp::endpoint resp_ep, mc_ep;
+  uint64_t requests = 0;  // per connection.
+  uint64_t start_ns = 0;
+  uint64_t end_ns = UINT64_MAX;
+  uint64_t interval_ns = 0;  // between the requests of a connection in the open loop.
+};
+
+struct Stats {
+  LatencyHistogram hist[NUM_OPS];
+  uint64_t errors[NUM_OPS] = {0};
+  uint64_t failed_connections = 0;
+
+  Stats& operator+=(const Stats& o) {
+    for (unsigned i = 0; i < NUM_OPS; ++i) {
+      hist[i] += o.hist[i];
+      errors[i] += o.errors[i];
+    }
+    failed_connections += o.failed_connections;
+    return *this;
+  }
+};
+
+// Consumes a memcache reply at the beginning of buf. Returns the length of the reply or 0 if it
+// is incomplete.
+size_t ConsumeMcReply(string_view buf, bool* error) {
+  size_t pos = 0;
+  while (true) {
+    size_t eol = buf.find("\r\n", pos);
+    if (eol == string_view::npos)
+      return 0;
+
+    // VALUE <key> <flags> <bytes> [<cas>] is followed by the data, the values by END.
+    string_view line = buf.substr(pos, eol - pos);
+    if (absl::StartsWith(line, "VALUE ")) {
+      vector<string_view> parts = absl::StrSplit(line, ' ');
+      size_t len = 0;
+      if (parts.size() < 4 || !absl::SimpleAtoi(parts[3], &len)) {
+        *error = true;
+        return eol + 2;
+      }
+      if (eol + 2 + len + 2 > buf.size())
+        return 0;
+      pos = eol + 2 + len + 2;
+      continue;
+    }
+
+    *error = absl::StartsWith(line, "ERROR") || absl::StartsWith(line, "CLIENT_ERROR") ||
+             absl::StartsWith(line, "SERVER_ERROR");
+    return eol + 2;
+  }
+}
+
+class Client {
+ public:
+  Client(const Workload& wl, bool memcache, uint64_t seed);
+
+  // Runs in the fiber of the connection until its requests are done.
+  void Run();
+
+  const Stats& stats() const {
+    return stats_;
+  }
+
+ private:
+  struct Pending {
+    uint64_t due_ns;
+    Op op;
+  };
+
+  error_code Connect();
+  error_code LoadScript();
+
+  // Reads the replies until the socket is shut down.
+  void ReadLoop();
+
+  // Parses the replies in io_buf_. Returns false if the stream is broken.
+  bool ParseReplies();
+  bool OnReply(bool error);
+
+  Op PickOp();
+  uint64_t NextKeyIndex();
+  // Returns a key of the type of op that belongs to shard, if shard is not negative.
+  string NextKey(Op op, int32_t shard);
+  string_view NextValue();
+  void AddRequest(Op op);
+
+  const Workload& wl_;
+  bool memcache_;
+  absl::InsecureBitGen gen_;
+  absl::discrete_distribution<int> op_dist_;
+  absl::zipf_distribution<uint64_t> zipf_;
+  string value_buf_;
+  string script_sha_;
+
+  unique_ptr<FiberSocketBase> sock_;
+  ::io::StringSink sink_;
+  facade::ReqSerializer serializer_{&sink_};
+  base::IoBuf io_buf_{1 << 14};
+  RedisParser parser_{false};
+  facade::RespVec resp_args_;
+
+  deque<Pending> pending_;
+  fibers_ext::EventCount evc_;
+  bool broken_ = false;
+  Stats stats_;
+};
+
+Client::Client(const Workload& wl, bool memcache, uint64_t seed)
+    : wl_(wl),
+      memcache_(memcache),
+      gen_(absl::SeedSeq{uint32_t(seed), uint32_t(seed >> 32)}),
+      zipf_(GetFlag(FLAGS_key_space) - 1, GetFlag(FLAGS_zipf_exp)) {
+  // The connection issues only the commands of its protocol.
+  vector<double> weights(NUM_OPS);
+  for (unsigned i = 0; i < NUM_OPS; ++i) {
+    if (IsMemcache(Op(i)) == memcache_)
+      weights[i] = wl_.weights[i];
+  }
+  op_dist_ = absl::discrete_distribution<int>(weights.begin(), weights.end());
+
+  value_buf_.resize(max(GetFlag(FLAGS_value_size), GetFlag(FLAGS_value_size_max)));
+  for (char& c : value_buf_) {
+    c = 'a' + absl::Uniform(gen_, 0, 26);
+  }
+}
+
+error_code Client::Connect() {
+  sock_.reset(ProactorBase::me()->CreateSocket());
+  error_code ec = sock_->Connect(memcache_ ? wl_.mc_ep : wl_.resp_ep);
+  if (ec)
+    return ec;
+
+  int yes = 1;
+  setsockopt(sock_->native_handle(), IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  return ec;
+}
+
+error_code Client::LoadScript() {
+  string_view cmd[] = {"SCRIPT", "LOAD", GetFlag(FLAGS_lua_script)};
+  serializer_.SendCommandArray(cmd);
+  error_code ec = sock_->Write(::io::Buffer(sink_.str()));
+  sink_.Clear();
+
+  while (!ec) {
+    io_buf_.EnsureCapacity(1024);
+    ::io::Result<size_t> res = sock_->Recv(io_buf_.AppendBuffer());
+    if (!res)
+      return res.error();
+    io_buf_.CommitWrite(*res);
+
+    uint32_t consumed = 0;
+    RedisParser::Result parse_res = parser_.Parse(io_buf_.InputBuffer(), &consumed, &resp_args_);
+    if (parse_res == RedisParser::OK && !resp_args_.empty()) {
+      if (resp_args_[0].type != RespExpr::STRING) {
+        LOG(ERROR) << "Could not load the script: " << resp_args_[0];
+        return make_error_code(errc::invalid_argument);
+      }
+      script_sha_ = resp_args_[0].GetString();
+      io_buf_.ConsumeInput(consumed);
+      return ec;
+    }
+    if (parse_res != RedisParser::INPUT_PENDING)
+      return make_error_code(errc::bad_message);
+    io_buf_.ConsumeInput(consumed);
+  }
+  return ec;
+}
+
+void Client::Run() {
+  error_code ec = Connect();
+  if (!ec && !memcache_ && wl_.weights[EVALSHA] > 0)
+    ec = LoadScript();
+  if (ec) {
+    LOG(ERROR) << "Could not start the connection: " << ec.message();
+    stats_.failed_connections = 1;
+    sock_->Close();
+    return;
+  }
+
+  fibers_ext::Fiber reader = ProactorBase::me()->LaunchFiber([this] { ReadLoop(); });
+  uint32_t depth = max(1u, GetFlag(FLAGS_pipeline));
+  uint64_t sent = 0;
+  // The time the next request is due in the open loop. The connections start at random
+  // offsets, so that their requests do not arrive in bursts.
+  uint64_t next_ns = wl_.start_ns;
+  if (wl_.interval_ns)
+    next_ns += absl::Uniform<uint64_t>(gen_, 0, wl_.interval_ns);
+
+  while (!broken_ && sent < wl_.requests) {
+    evc_.await([&] { return broken_ || pending_.size() < depth; });
+    uint64_t now = ProactorBase::GetMonotonicTimeNs();
+    if (broken_ || now >= wl_.end_ns)
+      break;
+
+    uint64_t batch = min<uint64_t>(depth - pending_.size(), wl_.requests - sent);
+    if (wl_.interval_ns) {
+      if (now < next_ns) {
+        fibers_ext::SleepFor(chrono::nanoseconds(next_ns - now));
+        now = ProactorBase::GetMonotonicTimeNs();
+      }
+
+      // Issues all the requests that are due at once, including these that were postponed since
+      // the pipeline was full. Their latency still counts from the time they were due.
+      if (now >= next_ns)
+        batch = min(batch, (now - next_ns) / wl_.interval_ns + 1);
+      else
+        batch = 1;
+    }
+
+    for (uint64_t i = 0; i < batch; ++i) {
+      Op op = PickOp();
+      AddRequest(op);
+      pending_.push_back(Pending{wl_.interval_ns ? next_ns : now, op});
+      next_ns += wl_.interval_ns;
+    }
+    sent += batch;
+
+    ec = sock_->Write(::io::Buffer(sink_.str()));
+    sink_.Clear();
+    if (ec) {
+      LOG(ERROR) << "Could not send the requests: " << ec.message();
+      break;
+    }
+  }
+
+  evc_.await([this] { return broken_ || pending_.empty(); });
+  sock_->Shutdown(SHUT_RDWR);
+  reader.Join();
+  sock_->Close();
+}
+
+void Client::ReadLoop() {
+  while (true) {
+    io_buf_.EnsureCapacity(1 << 14);
+    ::io::Result<size_t> res = sock_->Recv(io_buf_.AppendBuffer());
+    if (!res || *res == 0)
+      break;
+
+    io_buf_.CommitWrite(*res);
+    bool ok = ParseReplies();
+    evc_.notify();
+    if (!ok)
+      break;
+  }
+
+  if (!pending_.empty())
+    LOG(ERROR) << "The connection broke with " << pending_.size() << " pending requests";
+  broken_ = true;
+  evc_.notify();
+}
+
+bool Client::ParseReplies() {
+  while (memcache_) {
+    bool error = false;
+    size_t len = ConsumeMcReply(facade::ToSV(io_buf_.InputBuffer()), &error);
+    if (len == 0)
+      return true;
+    io_buf_.ConsumeInput(len);
+    if (!OnReply(error))
+      return false;
+  }
+
+  while (io_buf_.InputLen() > 0) {
+    uint32_t consumed = 0;
+    RedisParser::Result res = parser_.Parse(io_buf_.InputBuffer(), &consumed, &resp_args_);
+    if (res == RedisParser::INPUT_PENDING) {
+      io_buf_.ConsumeInput(consumed);
+      return true;
+    }
+    if (res != RedisParser::OK) {
+      LOG(ERROR) << "Bad reply, parser status " << res;
+      return false;
+    }
+
+    bool error = !resp_args_.empty() && resp_args_[0].type == RespExpr::ERROR;
+    io_buf_.ConsumeInput(consumed);
+    if (!OnReply(error))
+      return false;
+  }
+  return true;
+}
+
+bool Client::OnReply(bool error) {
+  if (pending_.empty()) {
+    LOG(ERROR) << "A reply without a request";
+    return false;
+  }
+
+  Pending req = pending_.front();
+  pending_.pop_front();
+  uint64_t now = ProactorBase::GetMonotonicTimeNs();
+  stats_.hist[req.op].Add(now > req.due_ns ? (now - req.due_ns) / 1000 : 0);
+  stats_.errors[req.op] += error;
+  return true;
+}
+
+Op Client::PickOp() {
+  return Op(op_dist_(gen_));
+}
+
+uint64_t Client::NextKeyIndex() {
+  static const string dist = GetFlag(FLAGS_key_dist);
+  uint64_t key_space = GetFlag(FLAGS_key_space);
+  if (dist == "zipf")
+    return zipf_(gen_);
+
+  if (dist == "hotset") {
+    uint64_t hot = max<uint64_t>(1, key_space * GetFlag(FLAGS_hot_set));
+    if (hot >= key_space || absl::Bernoulli(gen_, GetFlag(FLAGS_hot_ratio)))
+      return absl::Uniform<uint64_t>(gen_, 0, min(hot, key_space));
+    return absl::Uniform<uint64_t>(gen_, hot, key_space);
+  }
+
+  return absl::Uniform<uint64_t>(gen_, 0, key_space);
+}
+
+string Client::NextKey(Op op, int32_t shard) {
+  static const string prefix = GetFlag(FLAGS_key_prefix);
+  uint32_t num_shards = GetFlag(FLAGS_shards);
+
+  // About num_shards draws are needed per key, a bound is kept for tiny key spaces.
+  for (unsigned i = 0;; ++i) {
+    string key = StrCat(prefix, kKeyTags[op], NextKeyIndex());
+    if (shard < 0 || num_shards == 0 || Shard(key, num_shards) == ShardId(shard))
+      return key;
+    CHECK_LT(i, 1000 * num_shards) << "No key of shard " << shard << " in the key space";
+  }
+}
+
+string_view Client::NextValue() {
+  uint32_t min_size = GetFlag(FLAGS_value_size);
+  uint32_t size = value_buf_.size() > min_size
+                      ? absl::Uniform<uint32_t>(absl::IntervalClosed, gen_, min_size,
+                                                value_buf_.size())
+                      : value_buf_.size();
+  return string_view{value_buf_.data(), size};
+}
+
+void Client::AddRequest(Op op) {
+  int32_t shard = GetFlag(FLAGS_target_shard);
+  string key = NextKey(op, shard);
+  if (shard < 0 && GetFlag(FLAGS_shards) > 0)
+    shard = Shard(key, GetFlag(FLAGS_shards));
+
+  auto send = [this](initializer_list<string_view> args) {
+    serializer_.SendCommandArray(absl::Span<const string_view>{args.begin(), args.size()});
+  };
+
+  string member = StrCat("m", absl::Uniform(gen_, 0, 1000));
+  switch (op) {
+    case SET:
+      return send({"SET", key, NextValue()});
+    case GET:
+      return send({"GET", key});
+    case INCR:
+      return send({"INCR", key});
+    case HSET:
+      return send({"HSET", key, member, NextValue()});
+    case HGET:
+      return send({"HGET", key, member});
+    case LPUSH:
+      return send({"LPUSH", key, NextValue()});
+    case LPOP:
+      return send({"LPOP", key});
+    case SADD:
+      return send({"SADD", key, member});
+    case ZADD:
+      return send({"ZADD", key, StrCat(absl::Uniform(gen_, 0, 1000000)), member});
+    case MC_SET: {
+      string_view value = NextValue();
+      serializer_.SendCommand(StrCat("set ", key, " 0 0 ", value.size()));
+      return serializer_.SendCommand(value);
+    }
+    case MC_GET:
+      return serializer_.SendCommand(StrCat("get ", key));
+    case MGET:
+    case EVALSHA:
+      break;
+    case NUM_OPS:
+      LOG(FATAL) << "Invalid op";
+  }
+
+  // The multi-key commands draw the rest of their keys from the shard of the first one.
+  vector<string> keys{std::move(key)};
+  unsigned num_keys = max(1u, GetFlag(op == MGET ? FLAGS_mget_keys : FLAGS_lua_keys));
+  while (keys.size() < num_keys) {
+    keys.push_back(NextKey(op, shard));
+  }
+
+  string num_keys_str = StrCat(keys.size());
+  vector<string_view> args;
+  if (op == MGET)
+    args = {"MGET"};
+  else
+    args = {"EVALSHA", script_sha_, num_keys_str};
+  args.insert(args.end(), keys.begin(), keys.end());
+  if (op == EVALSHA)
+    args.push_back(NextValue());
+  serializer_.SendCommandArray(args);
+}
+
+bool ParseWorkload(Workload* wl) {
+  for (string_view item : absl::StrSplit(GetFlag(FLAGS_command_mix), ',', absl::SkipEmpty())) {
+    vector<string_view> parts = absl::StrSplit(item, ':');
+    double weight = 0;
+    auto it = find(begin(kOpNames), end(kOpNames), parts[0]);
+    if (parts.size() != 2 || it == end(kOpNames) || !absl::SimpleAtod(parts[1], &weight) ||
+        weight < 0) {
+      LOG(ERROR) << "Bad command mix item " << item;
+      return false;
+    }
+
+    Op op = Op(it - begin(kOpNames));
+    wl->weights[op] = weight;
+    (IsMemcache(op) ? wl->mc_weight : wl->resp_weight) += weight;
+  }
+
+  if (wl->resp_weight + wl->mc_weight == 0) {
+    LOG(ERROR) << "The command mix is empty";
+    return false;
+  }
+  string dist = GetFlag(FLAGS_key_dist);
+  if (dist != "uniform" && dist != "zipf" && dist != "hotset") {
+    LOG(ERROR) << "Unknown key distribution " << dist;
+    return false;
+  }
+  if (GetFlag(FLAGS_key_space) < 2 || GetFlag(FLAGS_zipf_exp) <= 1) {
+    LOG(ERROR) << "--key_space must be at least 2 and --zipf_exp above 1";
+    return false;
+  }
+  if (GetFlag(FLAGS_target_shard) >= int32_t(GetFlag(FLAGS_shards)) &&
+      GetFlag(FLAGS_target_shard) >= 0) {
+    LOG(ERROR) << "--target_shard requires --shards above it";
+    return false;
+  }
+
+  string host = GetFlag(FLAGS_host);
+  addrinfo hints{}, *servinfo = nullptr;
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (int res = getaddrinfo(host.c_str(), nullptr, &hints, &servinfo); res != 0) {
+    LOG(ERROR) << "Could not resolve " << host << ": " << gai_strerror(res);
+    return false;
+  }
+  auto* addr = reinterpret_cast<sockaddr_in*>(servinfo->ai_addr);
+  boost::asio::ip::address_v4 ip{ntohl(addr->sin_addr.s_addr)};
+  freeaddrinfo(servinfo);
+
+  wl->resp_ep = {ip, uint16_t(GetFlag(FLAGS_port))};
+  wl->mc_ep = {ip, uint16_t(GetFlag(FLAGS_memcache_port))};
+  if (wl->mc_weight > 0 && GetFlag(FLAGS_memcache_port) == 0) {
+    LOG(ERROR) << "The memcache commands require --memcache_port";
+    return false;
+  }
+
+  wl->requests = GetFlag(FLAGS_test_time) ? UINT64_MAX : GetFlag(FLAGS_requests);
+  return true;
+}
+
+void PrintStats(const Stats& stats, double secs) {
+  cout << absl::StrFormat("%-8s %12s %8s %12s %8s %8s %8s %8s %8s\n", "command", "requests",
+                          "errors", "ops/sec", "p50", "p90", "p99", "p99.9", "max");
+
+  auto print = [&](string_view name, const LatencyHistogram& hist, uint64_t errors) {
+    cout << absl::StrFormat("%-8s %12u %8u %12.0f %8u %8u %8u %8u %8u\n", name, hist.count(),
+                            errors, hist.count() / secs, hist.Percentile(50), hist.Percentile(90),
+                            hist.Percentile(99), hist.Percentile(99.9), hist.max());
+  };
+
+  LatencyHistogram total;
+  uint64_t total_errors = 0;
+  for (unsigned i = 0; i < NUM_OPS; ++i) {
+    if (stats.hist[i].count() == 0)
+      continue;
+    print(kOpNames[i], stats.hist[i], stats.errors[i]);
+    total += stats.hist[i];
+    total_errors += stats.errors[i];
+  }
+  print("total", total, total_errors);
+  cout << "The latencies are in usec";
+  if (GetFlag(FLAGS_qps))
+    cout << ", since the requests were due";
+  cout << ". " << stats.failed_connections << " connections failed.\n";
+}
+
+}  // namespace
+
+}  // namespace dfly
+
+int main(int argc, char* argv[]) {
+  MainInitGuard guard(&argc, &argv);
+  using namespace dfly;
+
+  shard_by_hashtag = GetFlag(FLAGS_shard_by_hashtag);
+  Workload wl;
+  if (!ParseWorkload(&wl))
+    return 1;
+
+  unique_ptr<ProactorPool> pp(new uring::UringPool(1024));
+  pp->Run();
+
+  // The memcache connections are spread over the threads.
+  uint32_t conns_per_thread = max(1u, GetFlag(FLAGS_connections));
+  uint64_t num_conns = uint64_t(conns_per_thread) * pp->size();
+  uint64_t num_mc = llround(num_conns * wl.mc_weight / (wl.mc_weight + wl.resp_weight));
+  if (wl.mc_weight > 0) {
+    uint64_t max_mc = wl.resp_weight > 0 ? max<uint64_t>(1, num_conns - 1) : num_conns;
+    num_mc = clamp<uint64_t>(num_mc, 1, max_mc);
+  }
+
+  if (uint64_t qps = GetFlag(FLAGS_qps); qps > 0)
+    wl.interval_ns = max<uint64_t>(1, num_conns * 1000000000 / qps);
+  wl.start_ns = ProactorBase::GetMonotonicTimeNs();
+  if (uint32_t secs = GetFlag(FLAGS_test_time); secs > 0)
+    wl.end_ns = wl.start_ns + secs * 1000000000ULL;
+
+  Stats stats;
+  ::boost::fibers::mutex mu;
+  uint64_t seed = GetFlag(FLAGS_seed);
+  pp->AwaitFiberOnAll([&](unsigned index, ProactorBase* pb) {
+    vector<unique_ptr<Client>> clients;
+    vector<fibers_ext::Fiber> fibers;
+    for (uint32_t i = 0; i < conns_per_thread; ++i) {
+      uint64_t conn_id = uint64_t(i) * pp->size() + index;
+      clients.emplace_back(new Client(wl, conn_id < num_mc, seed * num_conns + conn_id));
+      fibers.push_back(pb->LaunchFiber([client = clients.back().get()] { client->Run(); }));
+    }
+
+    for (auto& fb : fibers)
+      fb.Join();
+
+    lock_guard lk(mu);
+    for (const auto& client : clients)
+      stats += client->stats();
+  });
+
+  double secs = (ProactorBase::GetMonotonicTimeNs() - wl.start_ns) / 1e9;
+  pp->Stop();
+
+  PrintStats(stats, secs);
+  return 0;
+}
@@ -77,6 +77,12 @@ ABSL_FLAG(string, pidfile, "", "If not empty - server writes its pid into the fi
 ABSL_FLAG(string, unixsocket, "",
           "If not empty - specifies path for the Unis socket that will "
           "be used for listening for incoming connections.");
+ABSL_FLAG(string, handoff_socket, "",
+          "If not empty - the unix socket on which a successor process started with --handoff "
+          "takes this process over. The processes share the port meanwhile.");
+ABSL_FLAG(bool, handoff, false,
+          "If true - takes over the data and the port of the process that serves "
+          "--handoff_socket, then serves the socket instead of it.");
 ABSL_FLAG(bool, force_epoll, false,
           "If true - uses linux epoll engine underneath."
           "Can fit for kernels older than 5.10.");
@@ -159,10 +165,26 @@ bool RunEngine(ProactorPool* pool, AcceptServer* acceptor) {
   Service service(pool);
 
   Listener* main_listener = new Listener{Protocol::REDIS, &service};
+  string handoff_sock = GetFlag(FLAGS_handoff_socket);
+  bool handoff = GetFlag(FLAGS_handoff);
+  if (handoff && handoff_sock.empty()) {
+    LOG(ERROR) << "--handoff requires --handoff_socket. Exiting...";
+    return false;
+  }
+  main_listener->set_reuse_port(!handoff_sock.empty());
 
   Service::InitOpts opts;
   opts.disable_time_update = false;
   service.Init(acceptor, main_listener, opts);
+
+  // The predecessor keeps serving until this process listens.
+  if (handoff) {
+    error_code ec = service.server_family().HandoffFrom(handoff_sock);
+    if (ec) {
+      LOG(ERROR) << "Could not take over " << handoff_sock << ", error: " << ec.message();
+      exit(1);
+    }
+  }
   const auto& bind = GetFlag(FLAGS_bind);
   const char* bind_addr = bind.empty() ? nullptr : bind.c_str();
   auto port = GetFlag(FLAGS_port);
@@ -184,6 +206,18 @@ bool RunEngine(ProactorPool* pool, AcceptServer* acceptor) {
     }
   }
 
+  // The predecessor does not unlink the socket on exit, the successor does before it binds.
+  if (!handoff_sock.empty()) {
+    unlink(handoff_sock.c_str());
+
+    Listener* handoff_listener = new Listener{Protocol::REDIS, &service};
+    error_code ec = acceptor->AddUDSListener(handoff_sock.c_str(), handoff_listener);
+    if (ec) {
+      LOG(WARNING) << "Could not open handoff socket " << handoff_sock << ", error " << ec;
+      delete handoff_listener;
+    }
+  }
+
   error_code ec = acceptor->AddListener(bind_addr, port, main_listener);
 
   if (ec) {
@@ -192,10 +226,13 @@ bool RunEngine(ProactorPool* pool, AcceptServer* acceptor) {
   }
 
   if (mc_port > 0) {
-    acceptor->AddListener(mc_port, new Listener{Protocol::MEMCACHE, &service});
+    Listener* mc_listener = new Listener{Protocol::MEMCACHE, &service};
+    mc_listener->set_reuse_port(!handoff_sock.empty());
+    acceptor->AddListener(mc_port, mc_listener);
   }
 
   acceptor->Run();
+  service.server_family().FinishHandoff();
   acceptor->Wait();
 
   service.Shutdown();
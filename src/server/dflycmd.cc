@@ -4,15 +4,23 @@
 #include "server/dflycmd.h"
 
 #include <absl/random/random.h>
+#include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
 #include <absl/strings/strip.h>
 
+#include <deque>
+
 #include "base/flags.h"
 #include "base/logging.h"
 #include "facade/dragonfly_connection.h"
 #include "server/engine_shard_set.h"
 #include "server/error.h"
+#include "server/journal/frame.h"
 #include "server/journal/journal.h"
+#include "server/journal_replay.h"
+#include "server/main_service.h"
+#include "server/rdb_load.h"
 #include "server/rdb_save.h"
 #include "server/script_mgr.h"
 #include "server/server_family.h"
@@ -23,6 +31,20 @@ using namespace std;
 
 ABSL_DECLARE_FLAG(string, dir);
 
+ABSL_FLAG(uint32_t, repl_frame_size, 64 << 10,
+          "The size in bytes at which the stable sync stream of a flow is written as a frame");
+ABSL_FLAG(uint32_t, repl_frame_delay_us, 500,
+          "The maximal time a journal entry waits for its frame to fill up before it is written");
+ABSL_FLAG(string, repl_compression, "lz4",
+          "The compression of the stable sync frames: \"none\", \"lz4\" or \"zstd\"");
+ABSL_FLAG(uint32_t, repl_shared_sync_window_ms, 0,
+          "The replicas whose full sync starts within this window share the snapshot of "
+          "the shards. The first of them waits for the others before its full sync starts. "
+          "0 gives every replica its own snapshot");
+ABSL_FLAG(uint64_t, repl_full_sync_bytes_per_sec, 0,
+          "If positive, caps the bandwidth of the full sync of every replica in bytes per "
+          "second. The traversal of the snapshot slows down to the cap. 0 means no limit");
+
 namespace dfly {
 
 using namespace facade;
@@ -30,11 +52,42 @@ using namespace std;
 using util::ProactorBase;
 
 namespace {
+
+// The flows sample the write time of at most one LSN per ms for the lag of the replica.
+constexpr size_t kMaxLagSamples = 4096;
+
+string_view SyncStateName(DflyCmd::SyncState state) {
+  switch (state) {
+    case DflyCmd::SyncState::PREPARATION:
+      return "preparation";
+    case DflyCmd::SyncState::FULL_SYNC:
+      return "full_sync";
+    case DflyCmd::SyncState::STABLE_SYNC:
+      return "stable_sync";
+    case DflyCmd::SyncState::CANCELLED:
+      return "cancelled";
+  }
+  return "";
+}
+
+unique_ptr<IoRateLimiter> FullSyncLimiter() {
+  uint64_t rate = absl::GetFlag(FLAGS_repl_full_sync_bytes_per_sec);
+  return rate ? make_unique<IoRateLimiter>(rate) : nullptr;
+}
 const char kBadMasterId[] = "bad master id";
 const char kIdNotFound[] = "syncid not found";
 const char kInvalidSyncId[] = "bad sync id";
 const char kInvalidState[] = "invalid state";
 
+constexpr size_t kFanoutQueueLimit = 4_MB;
+
+// The frames of the stable sync of a local replica, which costs no network round trips.
+constexpr uint32_t kLocalFrameSize = 1_MB;
+constexpr auto kFanoutStallTimeout = 10s;
+
+// The time the members of a shared full sync wait for each other to send STARTSTABLE.
+constexpr auto kSharedStableTimeout = 10s;
+
 bool ToSyncId(string_view str, uint32_t* num) {
   if (!absl::StartsWith(str, "SYNC"))
     return false;
@@ -43,6 +96,16 @@ bool ToSyncId(string_view str, uint32_t* num) {
   return absl::SimpleAtoi(str, num);
 }
 
+journal::FrameCodec FrameCodecFromFlag() {
+  string val = absl::GetFlag(FLAGS_repl_compression);
+  if (val == "zstd")
+    return journal::FrameCodec::ZSTD;
+  if (val == "lz4")
+    return journal::FrameCodec::LZ4;
+  LOG_IF(ERROR, val != "none") << "Invalid repl_compression " << val << ", not compressing";
+  return journal::FrameCodec::NONE;
+}
+
 struct TransactionGuard {
   constexpr static auto kEmptyCb = [](Transaction* t, EngineShard* shard) { return OpStatus::OK; };
 
@@ -60,8 +123,165 @@ struct TransactionGuard {
 
 }  // namespace
 
+// Writes the stream of a shared snapshot to the flows of several replicas. Every flow has its own
+// queue and writer fiber, so the writes wait only while a queue is above kFanoutQueueLimit and
+// a replica that is briefly slower than the rest does not hold them back. A flow that stays
+// above the limit for kFanoutStallTimeout is detached and reported to error_cb, which lets
+// the other replicas continue. Used in a single thread.
+class FanoutSink : public io::Sink {
+ public:
+  using ErrorCb = std::function<void(unsigned index, error_code ec)>;
+
+  FanoutSink(const vector<io::Sink*>& sinks, ErrorCb error_cb);
+  ~FanoutSink();
+
+  io::Result<size_t> WriteSome(const iovec* v, uint32_t len) final;
+
+  // Writes data only to the flow index.
+  void WriteTo(unsigned index, string_view data);
+
+  // Drops the queue of the flow. Returns the number of the flows that are still attached.
+  unsigned Detach(unsigned index);
+
+  // Waits for the queues to drain and stops the writers.
+  void Close();
+
+ private:
+  struct Flow {
+    io::Sink* sink;
+    deque<shared_ptr<const string>> queue;
+    size_t bytes = 0;  // queued and being written.
+    bool attached = true;
+    ::boost::fibers::fiber fb;
+  };
+
+  void Push(Flow* flow, shared_ptr<const string> buf);
+  void DetachLocked(Flow* flow);
+  void WriterFb(Flow* flow, unsigned index);
+
+  vector<Flow> flows_;
+  ErrorCb error_cb_;
+  unsigned attached_;
+  bool closing_ = false;
+
+  ::boost::fibers::mutex mu_;
+  ::boost::fibers::condition_variable_any cv_;
+};
+
+FanoutSink::FanoutSink(const vector<io::Sink*>& sinks, ErrorCb error_cb)
+    : flows_(sinks.size()), error_cb_(move(error_cb)), attached_(sinks.size()) {
+  for (unsigned i = 0; i < sinks.size(); ++i) {
+    flows_[i].sink = sinks[i];
+    flows_[i].fb = ::boost::fibers::fiber(&FanoutSink::WriterFb, this, &flows_[i], i);
+  }
+}
+
+FanoutSink::~FanoutSink() {
+  Close();
+}
+
+io::Result<size_t> FanoutSink::WriteSome(const iovec* v, uint32_t len) {
+  auto buf = make_shared<string>();
+  for (uint32_t i = 0; i < len; ++i) {
+    buf->append(reinterpret_cast<const char*>(v[i].iov_base), v[i].iov_len);
+  }
+
+  unique_lock lk(mu_);
+  for (Flow& flow : flows_) {
+    Push(&flow, buf);
+  }
+
+  auto deadline = chrono::steady_clock::now() + kFanoutStallTimeout;
+  for (unsigned i = 0; i < flows_.size(); ++i) {
+    Flow& flow = flows_[i];
+    auto drained = [&] { return !flow.attached || flow.bytes <= kFanoutQueueLimit; };
+    if (!cv_.wait_until(lk, deadline, drained)) {
+      DetachLocked(&flow);
+      lk.unlock();
+      error_cb_(i, make_error_code(errc::timed_out));
+      lk.lock();
+    }
+  }
+
+  return buf->size();
+}
+
+void FanoutSink::WriteTo(unsigned index, string_view data) {
+  lock_guard lk(mu_);
+  Push(&flows_[index], make_shared<string>(data));
+}
+
+unsigned FanoutSink::Detach(unsigned index) {
+  lock_guard lk(mu_);
+  DetachLocked(&flows_[index]);
+  return attached_;
+}
+
+void FanoutSink::Close() {
+  {
+    lock_guard lk(mu_);
+    closing_ = true;
+    cv_.notify_all();
+  }
+
+  for (Flow& flow : flows_) {
+    if (flow.fb.joinable())
+      flow.fb.join();
+  }
+}
+
+void FanoutSink::Push(Flow* flow, shared_ptr<const string> buf) {
+  if (!flow->attached)
+    return;
+
+  flow->bytes += buf->size();
+  flow->queue.push_back(move(buf));
+  cv_.notify_all();
+}
+
+void FanoutSink::DetachLocked(Flow* flow) {
+  if (!flow->attached)
+    return;
+
+  for (const auto& buf : flow->queue) {
+    flow->bytes -= buf->size();
+  }
+  flow->queue.clear();
+  flow->attached = false;
+  --attached_;
+  cv_.notify_all();
+}
+
+void FanoutSink::WriterFb(Flow* flow, unsigned index) {
+  unique_lock lk(mu_);
+  while (true) {
+    cv_.wait(lk, [&] { return closing_ || !flow->attached || !flow->queue.empty(); });
+    if (!flow->attached || flow->queue.empty())
+      break;
+
+    shared_ptr<const string> buf = move(flow->queue.front());
+    flow->queue.pop_front();
+
+    lk.unlock();
+    error_code ec = flow->sink->Write(io::Buffer(*buf));
+    lk.lock();
+
+    flow->bytes -= buf->size();
+    cv_.notify_all();
+    if (ec) {
+      if (flow->attached) {
+        DetachLocked(flow);
+        lk.unlock();
+        error_cb_(index, ec);
+      }
+      break;
+    }
+  }
+}
+
 DflyCmd::DflyCmd(util::ListenerInterface* listener, ServerFamily* server_family)
     : sf_(server_family), listener_(listener) {
+  ack_requests_.reset(new atomic_bool[shard_set->pool()->size()]{});
 }
 
 void DflyCmd::Run(CmdArgList args, ConnectionContext* cntx) {
@@ -79,7 +299,7 @@ void DflyCmd::Run(CmdArgList args, ConnectionContext* cntx) {
     return Thread(args, cntx);
   }
 
-  if (sub_cmd == "FLOW" && args.size() == 5) {
+  if (sub_cmd == "FLOW" && (args.size() == 5 || args.size() == 6)) {
     return Flow(args, cntx);
   }
 
@@ -95,6 +315,18 @@ void DflyCmd::Run(CmdArgList args, ConnectionContext* cntx) {
     return Expire(args, cntx);
   }
 
+  if (sub_cmd == "TAKEOVER" && args.size() >= 4) {
+    return Takeover(args, cntx);
+  }
+
+  if (sub_cmd == "LOAD" && args.size() == 3) {
+    return Load(args, cntx);
+  }
+
+  if (sub_cmd == "RESTORE" && (args.size() == 4 || args.size() == 6)) {
+    return Restore(args, cntx);
+  }
+
   rb->SendError(kSyntaxErr);
 }
 
@@ -207,6 +439,21 @@ void DflyCmd::Flow(CmdArgList args, ConnectionContext* cntx) {
     return rb->SendError(facade::kInvalidIntErr);
   }
 
+  // A replica that streamed from this master before passes the LSN to resume the flow from.
+  // The flow resumes if the backlog of its thread still holds the records that it missed.
+  LSN start_lsn = 0;
+  bool partial = false;
+  if (args.size() == 6) {
+    if (!absl::SimpleAtoi(ArgS(args, 5), &start_lsn))
+      return rb->SendError(facade::kInvalidIntErr);
+
+    partial = shard_set->pool()->at(flow_id)->AwaitBrief([start_lsn] {
+      // The flows of the threads without shards do not stream commands.
+      EngineShard* shard = EngineShard::tlocal();
+      return !shard || (shard->journal() && shard->journal()->HasBacklog(start_lsn));
+    });
+  }
+
   auto [sync_id, replica_ptr] = GetReplicaInfoOrReply(sync_id_str, rb);
   if (!sync_id)
     return;
@@ -223,11 +470,15 @@ void DflyCmd::Flow(CmdArgList args, ConnectionContext* cntx) {
   absl::InsecureBitGen gen;
   string eof_token = GetRandomHex(gen, 40);
 
-  replica_ptr->flows[flow_id] = FlowInfo{cntx->owner(), eof_token};
+  FlowInfo* flow = &replica_ptr->flows[flow_id];
+  *flow = FlowInfo{cntx->owner(), eof_token};
+  flow->local = replica_ptr->local;
+  flow->partial = partial;
+  flow->start_lsn = start_lsn;
   listener_->Migrate(cntx->owner(), shard_set->pool()->at(flow_id));
 
   rb->StartArray(2);
-  rb->SendSimpleString("FULL");
+  rb->SendSimpleString(partial ? "PARTIAL" : "FULL");
   rb->SendSimpleString(eof_token);
 }
 
@@ -245,7 +496,24 @@ void DflyCmd::Sync(CmdArgList args, ConnectionContext* cntx) {
   if (!CheckReplicaStateOrReply(*replica_ptr, SyncState::PREPARATION, rb))
     return;
 
+  // The replica syncs all the flows fully unless all of them resume.
+  for (FlowInfo& flow : replica_ptr->flows) {
+    flow.partial = false;
+  }
+
+  // A local replica does not wait for the others, which are compressed anyway.
+  auto shared_sync = replica_ptr->local ? nullptr : JoinSharedSync(replica_ptr.get(), cntx);
+  if (shared_sync) {
+    if (shared_sync->status != OpStatus::OK)
+      return rb->SendError(kInvalidState);
+
+    replica_ptr->state = SyncState::FULL_SYNC;
+    full_syncs_.fetch_add(1, memory_order_relaxed);
+    return rb->SendOk();
+  }
+
   // Start full sync.
+  replica_ptr->limiter = replica_ptr->local ? nullptr : FullSyncLimiter();
   {
     TransactionGuard tg{cntx->transaction};
     AggregateStatus status;
@@ -253,7 +521,7 @@ void DflyCmd::Sync(CmdArgList args, ConnectionContext* cntx) {
     // Use explicit assignment for replica_ptr, because capturing structured bindings is C++20.
     auto cb = [this, &status, replica_ptr = replica_ptr](unsigned index, auto*) {
       status = StartFullSyncInThread(&replica_ptr->flows[index], &replica_ptr->cntx,
-                                     EngineShard::tlocal());
+                                     replica_ptr->limiter.get(), EngineShard::tlocal());
     };
     shard_set->pool()->AwaitFiberOnAll(std::move(cb));
 
@@ -263,6 +531,7 @@ void DflyCmd::Sync(CmdArgList args, ConnectionContext* cntx) {
   }
 
   replica_ptr->state = SyncState::FULL_SYNC;
+  full_syncs_.fetch_add(1, memory_order_relaxed);
   return rb->SendOk();
 }
 
@@ -277,9 +546,22 @@ void DflyCmd::StartStable(CmdArgList args, ConnectionContext* cntx) {
     return;
 
   unique_lock lk(replica_ptr->mu);
-  if (!CheckReplicaStateOrReply(*replica_ptr, SyncState::FULL_SYNC, rb))
+
+  // A replica whose flows all resume from the backlog skips the full sync.
+  bool partial = all_of(replica_ptr->flows.begin(), replica_ptr->flows.end(),
+                        [](const FlowInfo& flow) { return flow.partial; });
+  SyncState expected = partial ? SyncState::PREPARATION : SyncState::FULL_SYNC;
+  if (!CheckReplicaStateOrReply(*replica_ptr, expected, rb))
     return;
 
+  if (replica_ptr->shared_sync) {
+    if (StartSharedStable(replica_ptr.get(), cntx) != OpStatus::OK)
+      return rb->SendError(kInvalidState);
+
+    replica_ptr->state = SyncState::STABLE_SYNC;
+    return rb->SendOk();
+  }
+
   {
     TransactionGuard tg{cntx->transaction};
     AggregateStatus status;
@@ -288,7 +570,8 @@ void DflyCmd::StartStable(CmdArgList args, ConnectionContext* cntx) {
       EngineShard* shard = EngineShard::tlocal();
       FlowInfo* flow = &replica_ptr->flows[index];
 
-      StopFullSyncInThread(flow, shard);
+      if (!flow->partial)
+        StopFullSyncInThread(flow, shard);
       status = StartStableSyncInThread(flow, shard);
       return OpStatus::OK;
     };
@@ -298,6 +581,8 @@ void DflyCmd::StartStable(CmdArgList args, ConnectionContext* cntx) {
       return rb->SendError(kInvalidState);
   }
 
+  if (partial)
+    partial_syncs_.fetch_add(1, memory_order_relaxed);
   replica_ptr->state = SyncState::STABLE_SYNC;
   return rb->SendOk();
 }
@@ -312,11 +597,102 @@ void DflyCmd::Expire(CmdArgList args, ConnectionContext* cntx) {
   return rb->SendOk();
 }
 
-OpStatus DflyCmd::StartFullSyncInThread(FlowInfo* flow, Context* cntx, EngineShard* shard) {
+void DflyCmd::Load(CmdArgList args, ConnectionContext* cntx) {
+  RedisReplyBuilder* rb = static_cast<RedisReplyBuilder*>(cntx->reply_builder());
+  if (!cntx->is_replicating && !ServerState::tlocal()->is_master)
+    return rb->SendError("-READONLY You can't write against a read only replica.");
+
+  string_view payload = ArgS(args, 2);
+  io::BytesSource src(io::Buffer(payload));
+  RdbLoader loader(sf_->script_mgr());
+  loader.set_journal_batches(true);
+
+  uint64_t start = ProactorBase::GetMonotonicTimeNs();
+  error_code ec = loader.Load(&src);
+  uint64_t usec = (ProactorBase::GetMonotonicTimeNs() - start) / 1000;
+  if (ec)
+    return rb->SendError(absl::StrCat("Could not load the payload: ", ec.message()));
+
+  VLOG(1) << "DFLY LOAD of " << loader.keys_loaded() << " keys took " << usec << "us";
+  rb->StartArray(6);
+  rb->SendBulkString("keys");
+  rb->SendLong(loader.keys_loaded());
+  rb->SendBulkString("bytes");
+  rb->SendLong(payload.size());
+  rb->SendBulkString("keys_per_sec");
+  rb->SendLong(loader.keys_loaded() * 1000000 / max<uint64_t>(usec, 1));
+}
+
+void DflyCmd::Restore(CmdArgList args, ConnectionContext* cntx) {
+  RedisReplyBuilder* rb = static_cast<RedisReplyBuilder*>(cntx->reply_builder());
+  if (!ServerState::tlocal()->is_master)
+    return rb->SendError("-READONLY You can't write against a read only replica.");
+
+  string snapshot{ArgS(args, 2)};
+  if (!absl::EndsWith(snapshot, ".rdb") && !absl::EndsWith(snapshot, "summary.dfs"))
+    return rb->SendError("The snapshot must be an .rdb or a summary.dfs file");
+
+  vector<LSN> until_lsns;
+  uint64_t until_ms = 0;
+  if (args.size() == 6) {
+    ToUpper(&args[4]);
+    string_view target = ArgS(args, 4), value = ArgS(args, 5);
+    if (target == "LSN") {
+      for (string_view lsn : absl::StrSplit(value, ',')) {
+        if (!absl::SimpleAtoi(lsn, &until_lsns.emplace_back()))
+          return rb->SendError(kInvalidIntErr);
+      }
+    } else if (target != "TIME" || !absl::SimpleAtoi(value, &until_ms) || until_ms == 0) {
+      return rb->SendError(kSyntaxErr);
+    }
+  }
+
+  const CommandId* cid = sf_->service().FindCmd("FLUSHALL");
+  intrusive_ptr<Transaction> flush_trans(new Transaction{cid});
+  flush_trans->InitByArgs(0, {});
+  if (error_code ec = sf_->Drakarys(flush_trans.get(), DbSlice::kDbAll, false); ec)
+    return rb->SendError(absl::StrCat("Could not flush the data: ", ec.message()));
+
+  auto load_res = sf_->Load(snapshot);
+  if (!load_res.valid())
+    return rb->SendError("-LOADING another load or save is in progress");
+  if (error_code ec = load_res.get(); ec)
+    return rb->SendError(absl::StrCat("Could not load the snapshot: ", ec.message()));
+
+  journal::Position pos = sf_->GetLoadedJournalPos();
+  if (pos.lsns.empty())
+    return rb->SendError("The snapshot was not saved with the file-based journal open");
+
+  JournalReplay replay(&sf_->service(), string{ArgS(args, 3)}, std::move(pos));
+  if (!until_lsns.empty())
+    replay.SetLsnTarget(std::move(until_lsns));
+  if (until_ms)
+    replay.SetTimeTarget(until_ms);
+  if (GenericError err = replay.Run(); err)
+    return rb->SendError(err.Format());
+
+  const JournalReplay::Stats& stats = replay.stats();
+  rb->StartArray(6);
+  rb->SendBulkString("segments");
+  rb->SendLong(stats.segments);
+  rb->SendBulkString("commands");
+  rb->SendLong(stats.commands);
+  rb->SendBulkString("cut_threads");
+  rb->SendLong(stats.cut_threads);
+}
+
+OpStatus DflyCmd::StartFullSyncInThread(FlowInfo* flow, Context* cntx, IoRateLimiter* limiter,
+                                        EngineShard* shard) {
   DCHECK(!flow->full_sync_fb.joinable());
 
+  io::Sink* sink = flow->conn->socket();
+  if (limiter) {
+    flow->limited_sink.reset(new RateLimitedSink(sink, limiter));
+    sink = flow->limited_sink.get();
+  }
+
   SaveMode save_mode = shard == nullptr ? SaveMode::SUMMARY : SaveMode::SINGLE_SHARD;
-  flow->saver.reset(new RdbSaver(flow->conn->socket(), save_mode, false));
+  flow->saver.reset(new RdbSaver(sink, save_mode, false, !flow->local));
 
   flow->cleanup = [flow]() {
     flow->saver->Cancel();
@@ -352,21 +728,64 @@ void DflyCmd::StopFullSyncInThread(FlowInfo* flow, EngineShard* shard) {
 OpStatus DflyCmd::StartStableSyncInThread(FlowInfo* flow, EngineShard* shard) {
   // Register journal listener and cleanup.
   uint32_t cb_id = 0;
+  OpStatus status = OpStatus::OK;
   if (shard != nullptr) {
-    cb_id = sf_->journal()->RegisterOnChange([flow](const journal::Entry& je) {
-      // TODO: Serialize event.
-      ReqSerializer serializer{flow->conn->socket()};
-      serializer.SendCommand(absl::StrCat("SET ", je.key, " ", je.pval_ptr->ToString()));
-    });
+    journal::Journal* journal = sf_->journal();
+    LSN start_lsn = flow->partial ? flow->start_lsn : journal->GetLsn();
+    journal::RespWriter writer{start_lsn};
+    journal::FrameCodec codec = flow->local ? journal::FrameCodec::NONE : FrameCodecFromFlag();
+    uint32_t frame_size = flow->local ? kLocalFrameSize : absl::GetFlag(FLAGS_repl_frame_size);
+    flow->frame_writer.reset(new journal::FrameWriter{flow->conn->socket(), codec, frame_size,
+                                                      absl::GetFlag(FLAGS_repl_frame_delay_us)});
+    journal::FrameWriter* frame_writer = flow->frame_writer.get();
+
+    string buf;
+    writer.AppendLsn(&buf);
+
+    // The transaction guard of STARTSTABLE blocks the shard, so no records are added before
+    // the callback is registered.
+    if (flow->partial && !journal->ReadBacklog(flow->start_lsn, &writer, &buf)) {
+      status = OpStatus::OUT_OF_RANGE;
+    } else {
+      frame_writer->Write(buf);
+      frame_writer->Flush();
+      flow->acked_lsn = start_lsn;
+      flow->written_bytes = buf.size();
+
+      auto journal_cb = [flow, journal, writer](const journal::Entry& je) mutable {
+        if (je.opcode != journal::Op::COMMAND || (je.cmd.empty() && je.barrier.shard_cnt <= 1))
+          return;
+
+        string cmd, buf;
+        if (!je.cmd.empty())
+          journal::RespWriter::AppendCommand(je.cmd, &cmd);
+
+        // The LSN of the entry is counted after the callbacks run.
+        LSN lsn = journal->GetLsn();
+        writer.Append(lsn, je.db_ind, je.txid, je.barrier, cmd, &buf);
+        flow->frame_writer->Write(buf);
+        flow->written_bytes += buf.size();
+
+        uint64_t now_ms = ProactorBase::GetMonotonicTimeNs() / 1000000;
+        auto& times = flow->lsn_times;
+        if (times.size() < kMaxLagSamples && (times.empty() || times.back().second < now_ms))
+          times.emplace_back(lsn, now_ms);
+      };
+      cb_id = journal->RegisterOnChange(move(journal_cb));
+    }
   }
 
   flow->cleanup = [flow, this, cb_id]() {
     if (cb_id)
       sf_->journal()->Unregister(cb_id);
     flow->TryShutdownSocket();
+
+    // Shutting down the socket unblocks the writes of the frame writer.
+    if (flow->frame_writer)
+      flow->frame_writer->Stop();
   };
 
-  return OpStatus::OK;
+  return status;
 }
 
 void DflyCmd::FullSyncFb(FlowInfo* flow, Context* cntx) {
@@ -397,6 +816,192 @@ void DflyCmd::FullSyncFb(FlowInfo* flow, Context* cntx) {
   }
 }
 
+auto DflyCmd::JoinSharedSync(ReplicaInfo* replica, ConnectionContext* cntx)
+    -> shared_ptr<SharedSync> {
+  uint32_t window_ms = absl::GetFlag(FLAGS_repl_shared_sync_window_ms);
+  if (window_ms == 0)
+    return nullptr;
+
+  shared_ptr<SharedSync> sync;
+  bool leader = false;
+  {
+    lock_guard lk(mu_);
+    if (!pending_sync_) {
+      pending_sync_ = make_shared<SharedSync>(shard_set->size() + 1);
+      leader = true;
+    }
+    sync = pending_sync_;
+    replica->member_index = sync->members.size();
+    sync->members.push_back({replica});
+  }
+
+  // The members hold their replica mutexes until the sync starts, so none of them is cancelled
+  // meanwhile.
+  if (leader) {
+    util::fibers_ext::SleepFor(chrono::milliseconds(window_ms));
+    {
+      lock_guard lk(mu_);
+      pending_sync_.reset();
+    }
+
+    if (sync->members.size() > 1) {
+      LOG(INFO) << "Starting a full sync shared by " << sync->members.size() << " replicas";
+
+      sync->limiter = FullSyncLimiter();
+      TransactionGuard tg{cntx->transaction};
+      AggregateStatus status;
+      auto cb = [this, &status, &sync](unsigned index, auto*) {
+        status = StartSharedSyncInThread(sync.get(), index, EngineShard::tlocal());
+      };
+      shard_set->pool()->AwaitFiberOnAll(std::move(cb));
+      sync->status = *status;
+      if (sync->status == OpStatus::OK)
+        shared_syncs_.fetch_add(1, memory_order_relaxed);
+    }
+    sync->started.Notify();
+  } else {
+    sync->started.Wait();
+  }
+
+  if (sync->members.size() == 1)
+    return nullptr;
+
+  replica->shared_sync = sync;
+  return sync;
+}
+
+OpStatus DflyCmd::StartSharedSyncInThread(SharedSync* sync, unsigned index, EngineShard* shard) {
+  SharedSync::Flow& shared_flow = sync->flows[index];
+
+  vector<io::Sink*> sinks;
+  for (unsigned i = 0; i < sync->members.size(); ++i) {
+    FlowInfo* flow = &sync->members[i].info->flows[index];
+    sinks.push_back(flow->conn->socket());
+    shared_flow.eof_tokens.push_back(flow->eof_token);
+
+    // The member leaves the snapshot, the last one cancels it.
+    flow->cleanup = [flow, &shared_flow, i]() {
+      flow->TryShutdownSocket();
+      if (shared_flow.sink && shared_flow.sink->Detach(i) == 0 && shared_flow.fb.joinable()) {
+        shared_flow.saver->Cancel();
+        shared_flow.fb.join();
+      }
+    };
+  }
+
+  // A member that falls behind fails its own replication.
+  auto error_cb = [sync, index](unsigned i, error_code ec) {
+    VLOG(1) << "Detaching flow " << index << " of a shared full sync: " << ec.message();
+    sync->members[i].info->flows[index].TryShutdownSocket();
+    sync->members[i].info->cntx.Error(ec);
+  };
+  shared_flow.sink.reset(new FanoutSink(sinks, move(error_cb)));
+
+  io::Sink* sink = shared_flow.sink.get();
+  if (sync->limiter) {
+    shared_flow.limited_sink.reset(new RateLimitedSink(sink, sync->limiter.get()));
+    sink = shared_flow.limited_sink.get();
+  }
+
+  SaveMode save_mode = shard == nullptr ? SaveMode::SUMMARY : SaveMode::SINGLE_SHARD;
+  shared_flow.saver.reset(new RdbSaver(sink, save_mode, false));
+
+  // Shard can be null for io thread.
+  if (shard != nullptr) {
+    CHECK(!sf_->journal()->OpenInThread(false, ""sv));  // can only happen in persistent mode.
+    shared_flow.saver->StartSnapshotInShard(true, sync->cntx.GetCancellation(), shard);
+  }
+
+  shared_flow.fb = ::boost::fibers::fiber(&DflyCmd::SharedSyncFb, this, sync, index);
+  return OpStatus::OK;
+}
+
+void DflyCmd::SharedSyncFb(SharedSync* sync, unsigned index) {
+  SharedSync::Flow& shared_flow = sync->flows[index];
+  RdbSaver* saver = shared_flow.saver.get();
+
+  // The sink does not fail, its flows fail separately.
+  if (saver->Mode() == SaveMode::SUMMARY) {
+    auto scripts = sf_->script_mgr()->GetLuaScripts();
+    saver->SaveHeader(scripts);
+  } else {
+    saver->SaveHeader({});
+  }
+  saver->SaveBody(sync->cntx.GetCancellation(), nullptr);
+
+  for (unsigned i = 0; i < shared_flow.eof_tokens.size(); ++i) {
+    shared_flow.sink->WriteTo(i, shared_flow.eof_tokens[i]);
+  }
+  shared_flow.sink->Close();
+}
+
+OpStatus DflyCmd::StartSharedStable(ReplicaInfo* replica, ConnectionContext* cntx) {
+  SharedSync* sync = replica->shared_sync.get();
+  unique_lock lk(sync->mu);
+  sync->members[replica->member_index].ready = true;
+  sync->cv.notify_all();
+
+  auto all_ready = [sync] {
+    return all_of(sync->members.begin(), sync->members.end(),
+                  [](const auto& member) { return member.ready || !member.attached; });
+  };
+
+  // Once a member stops the snapshot, the others wait until it is done.
+  auto done = [&] { return sync->stopped || (!sync->stopping && all_ready()); };
+  while (!done()) {
+    if (!sync->cv.wait_for(lk, kSharedStableTimeout, done) && !sync->stopping) {
+      // Fail the members that did not finish the full sync, they leave it when cancelled.
+      for (auto& member : sync->members) {
+        if (member.attached && !member.ready)
+          member.info->cntx.Error(make_error_code(errc::timed_out), "Shared full sync stalled");
+      }
+    }
+  }
+
+  if (sync->stopped)
+    return sync->status;
+
+  // The members that are ready wait in their STARTSTABLE, so none of them is cancelled meanwhile
+  // and their infos stay valid without sync->mu, which is not held across the hops.
+  sync->stopping = true;
+  vector<ReplicaInfo*> members;
+  for (const auto& member : sync->members) {
+    if (member.attached)
+      members.push_back(member.info);
+  }
+  lk.unlock();
+
+  TransactionGuard tg{cntx->transaction};
+  AggregateStatus status;
+  auto cb = [this, &status, &members, sync](unsigned index, auto*) {
+    EngineShard* shard = EngineShard::tlocal();
+    SharedSync::Flow& shared_flow = sync->flows[index];
+    if (shard != nullptr)
+      shared_flow.saver->StopSnapshotInShard(shard);
+    if (shared_flow.fb.joinable())
+      shared_flow.fb.join();
+
+    for (ReplicaInfo* info : members) {
+      status = StartStableSyncInThread(&info->flows[index], shard);
+    }
+    shared_flow.saver.reset();
+    shared_flow.sink.reset();
+  };
+  shard_set->pool()->AwaitFiberOnAll(std::move(cb));
+
+  lk.lock();
+  sync->status = *status;
+  sync->stopped = true;
+  sync->cv.notify_all();
+  return sync->status;
+}
+
+DflyCmd::SyncStats DflyCmd::GetSyncStats() const {
+  return SyncStats{full_syncs_.load(memory_order_relaxed),
+                   partial_syncs_.load(memory_order_relaxed),
+                   shared_syncs_.load(memory_order_relaxed)};
+}
+
 uint32_t DflyCmd::CreateSyncSession() {
   unique_lock lk(mu_);
   unsigned sync_id = next_sync_id_++;
@@ -418,6 +1023,267 @@ uint32_t DflyCmd::CreateSyncSession() {
   return sync_id;
 }
 
+void DflyCmd::Takeover(CmdArgList args, ConnectionContext* cntx) {
+  RedisReplyBuilder* rb = static_cast<RedisReplyBuilder*>(cntx->reply_builder());
+  auto [sync_id, replica_ptr] = GetReplicaInfoOrReply(ArgS(args, 2), rb);
+  if (!sync_id)
+    return;
+
+  ToUpper(&args[3]);
+  string_view op = ArgS(args, 3);
+  if (op == "ABORT") {
+    ResumeWrites();
+    return rb->SendOk();
+  }
+
+  if (op == "COMMIT") {
+    uint32_t port = 0;
+    vector<LSN> lsns(args.size() > 6 ? args.size() - 6 : 0);
+    bool valid = args.size() > 6 && absl::SimpleAtoi(ArgS(args, 4), &port) && port > 0 &&
+                 port <= 65535;
+    for (size_t i = 0; valid && i < lsns.size(); ++i)
+      valid = absl::SimpleAtoi(ArgS(args, 6 + i), &lsns[i]);
+    if (!valid)
+      return rb->SendError(kSyntaxErr);
+
+    // The paused writes fail with READONLY once they resume.
+    string host = cntx->owner()->RemoteEndpointAddress();
+    error_code ec = sf_->FollowTakeover(host, port, string(ArgS(args, 5)), move(lsns));
+    ResumeWrites();
+    if (ec) {
+      LOG(ERROR) << "Could not replicate " << host << ":" << port << " " << ec.message();
+      return rb->SendError(ec.message());
+    }
+    return rb->SendOk();
+  }
+
+  uint32_t timeout_ms = 0;
+  if (!absl::SimpleAtoi(op, &timeout_ms) || timeout_ms == 0)
+    return rb->SendError(kSyntaxErr);
+
+  auto* pool = shard_set->pool();
+  {
+    lock_guard tlk(takeover_mu_);
+    if (takeover_guard_.IsJoinable())
+      takeover_guard_.Join();
+
+    lock_guard lk(mu_);
+    if (writes_paused_)
+      return rb->SendError(kInvalidState);
+
+    writes_paused_ = true;
+    takeover_done_ = util::fibers_ext::Done{};
+    pool->AwaitFiberOnAll([](auto*) { ServerState::tlocal()->PauseWrites(true); });
+    auto guard = [this, done = takeover_done_, timeout_ms]() mutable {
+      if (!done.WaitFor(chrono::milliseconds(timeout_ms))) {
+        LOG(WARNING) << "The takeover timed out, resuming the writes";
+        ResumeWrites();
+      }
+    };
+    takeover_guard_ = ProactorBase::me()->LaunchFiber(std::move(guard));
+  }
+
+  // The global transaction runs after the writes that were scheduled before the pause.
+  vector<LSN> lsns = JournalLsns(cntx->transaction);
+  rb->StartArray(lsns.size());
+  for (LSN lsn : lsns)
+    rb->SendLong(lsn);
+}
+
+void DflyCmd::ResumeWrites() {
+  lock_guard lk(mu_);
+  if (!writes_paused_)
+    return;
+
+  writes_paused_ = false;
+  takeover_done_.Notify();
+  shard_set->pool()->AwaitFiberOnAll([](auto*) { ServerState::tlocal()->PauseWrites(false); });
+}
+
+vector<LSN> DflyCmd::JournalLsns(Transaction* trans) {
+  vector<LSN> lsns(shard_set->pool()->size(), 0);
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    if (shard->journal())
+      lsns[ProactorBase::GetIndex()] = shard->journal()->GetLsn();
+    return OpStatus::OK;
+  };
+  trans->ScheduleSingleHop(std::move(cb));
+  return lsns;
+}
+
+void DflyCmd::SetLocal(uint32_t sync_id) {
+  auto replica_ptr = GetReplicaInfo(sync_id);
+  if (!replica_ptr)
+    return;
+
+  lock_guard lk(replica_ptr->mu);
+  replica_ptr->local = true;
+}
+
+void DflyCmd::OnFlowAck(ConnectionContext* cntx, LSN lsn, uint64_t bytes) {
+  auto replica_ptr = GetReplicaInfo(cntx->conn_state.repl_session_id);
+  if (!replica_ptr)
+    return;
+
+  // The connection of the flow runs on its thread, like the journal callback.
+  lock_guard lk(replica_ptr->mu);
+  unsigned flow_id = cntx->conn_state.repl_flow_id;
+  if (replica_ptr->state != SyncState::STABLE_SYNC || flow_id >= replica_ptr->flows.size())
+    return;
+
+  FlowInfo* flow = &replica_ptr->flows[flow_id];
+  if (flow->conn != cntx->owner() || !flow->frame_writer)
+    return;
+
+  flow->acked_lsn = lsn;
+  flow->acked_bytes = bytes;
+  flow->ack_requested = false;
+  acks_epoch_.fetch_add(1, memory_order_release);
+  acks_ec_.notifyAll();
+  while (!flow->lsn_times.empty() && flow->lsn_times.front().first < lsn)
+    flow->lsn_times.pop_front();
+
+  FlowProgress progress = GetFlowProgress(*flow);
+  string lag_entries = absl::StrCat(progress.lag_entries);
+  string lag_bytes = absl::StrCat(progress.lag_bytes), lag_ms = absl::StrCat(progress.lag_ms);
+
+  string buf;
+  journal::RespWriter::AppendCommand({"DFLY", "LAG", lag_entries, lag_bytes, lag_ms}, &buf);
+  flow->frame_writer->Write(buf);
+  flow->written_bytes += buf.size();
+}
+
+unsigned DflyCmd::WaitForAcks(absl::Span<const LSN> lsns, unsigned numreplicas,
+                              uint32_t timeout_ms) {
+  auto tp = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+  while (true) {
+    // The epoch is read before the count, so that no acknowledgement after it is missed.
+    uint64_t epoch = acks_epoch_.load(memory_order_acquire);
+    unsigned count = CountAcks(lsns);
+    if (count >= numreplicas)
+      return count;
+
+    RequestAcks(lsns);
+    auto acked = [&] { return acks_epoch_.load(memory_order_acquire) != epoch; };
+    if (timeout_ms == 0) {
+      acks_ec_.await(acked);
+    } else if (acks_ec_.await_until(acked, tp) == cv_status::timeout) {
+      return CountAcks(lsns);
+    }
+  }
+}
+
+unsigned DflyCmd::CountAcks(absl::Span<const LSN> lsns) {
+  unsigned count = 0;
+  for (const auto& replica_ptr : GetReplicas()) {
+    lock_guard lk(replica_ptr->mu);
+    if (replica_ptr->state != SyncState::STABLE_SYNC)
+      continue;
+
+    // A flow acknowledges the LSN of the next record it applies.
+    bool acked = true;
+    for (size_t i = 0; i < lsns.size() && acked; ++i)
+      acked = lsns[i] == 0 || replica_ptr->flows[i].acked_lsn >= lsns[i];
+    count += acked;
+  }
+  return count;
+}
+
+void DflyCmd::RequestAcks(absl::Span<const LSN> lsns) {
+  for (unsigned i = 0; i < lsns.size(); ++i) {
+    if (lsns[i] == 0 || ack_requests_[i].exchange(true, memory_order_acq_rel))
+      continue;
+
+    shard_set->pool()->at(i)->Dispatch([this, i] {
+      ack_requests_[i].store(false, memory_order_release);
+      RequestAcksInThread(i);
+    });
+  }
+}
+
+void DflyCmd::RequestAcksInThread(unsigned index) {
+  LSN lsn = sf_->journal()->GetLsn();
+  string buf;
+  journal::RespWriter::AppendCommand({"DFLY", "GETACK", absl::StrCat(lsn)}, &buf);
+
+  for (const auto& replica_ptr : GetReplicas()) {
+    lock_guard lk(replica_ptr->mu);
+    if (replica_ptr->state != SyncState::STABLE_SYNC || index >= replica_ptr->flows.size())
+      continue;
+
+    FlowInfo* flow = &replica_ptr->flows[index];
+    if (!flow->frame_writer || flow->ack_requested || flow->acked_lsn >= lsn)
+      continue;
+
+    // The replica applies the records before it, then acknowledges them.
+    flow->frame_writer->Write(buf);
+    flow->written_bytes += buf.size();
+    flow->ack_requested = true;
+  }
+}
+
+auto DflyCmd::GetReplicas() -> vector<shared_ptr<ReplicaInfo>> {
+  vector<shared_ptr<ReplicaInfo>> res;
+  lock_guard lk(mu_);
+  for (const auto& [sync_id, replica_ptr] : replica_infos_)
+    res.push_back(replica_ptr);
+  return res;
+}
+
+auto DflyCmd::GetReplicasInfo() -> vector<ReplicaProgress> {
+  vector<pair<uint32_t, shared_ptr<ReplicaInfo>>> replicas;
+  {
+    lock_guard lk(mu_);
+    replicas.assign(replica_infos_.begin(), replica_infos_.end());
+  }
+
+  vector<ReplicaProgress> res;
+  for (const auto& [sync_id, replica_ptr] : replicas) {
+    // Holds off the state transitions, which replace the savers and the frame writers.
+    lock_guard lk(replica_ptr->mu);
+    SharedSync* sync = replica_ptr->shared_sync.get();
+    unique_lock<::boost::fibers::mutex> sync_lk;
+    if (sync)
+      sync_lk = unique_lock(sync->mu);
+
+    ReplicaProgress progress{sync_id, SyncStateName(replica_ptr->state)};
+    progress.flows.resize(shard_set->size());
+    shard_set->RunBriefInParallel([&](EngineShard* shard) {
+      unsigned index = shard->shard_id();
+      FlowInfo& flow = replica_ptr->flows[index];
+      FlowProgress& dest = progress.flows[index];
+      if (replica_ptr->state == SyncState::FULL_SYNC) {
+        RdbSaver* saver = sync ? sync->flows[index].saver.get() : flow.saver.get();
+        dest.full_sync_progress = saver ? saver->TraversalProgress(shard) : 100;
+      } else if (replica_ptr->state == SyncState::STABLE_SYNC) {
+        dest = GetFlowProgress(flow);
+      }
+    });
+    res.push_back(move(progress));
+  }
+  return res;
+}
+
+auto DflyCmd::GetFlowProgress(const FlowInfo& flow) -> FlowProgress {
+  FlowProgress res;
+  res.full_sync_progress = 100;
+  if (!flow.frame_writer)
+    return res;
+
+  res.cur_lsn = sf_->journal()->GetLsn();
+  res.acked_lsn = flow.acked_lsn;
+  res.lag_entries = res.cur_lsn > flow.acked_lsn ? res.cur_lsn - flow.acked_lsn : 0;
+  res.lag_bytes = flow.written_bytes > flow.acked_bytes ? flow.written_bytes - flow.acked_bytes : 0;
+
+  // The oldest sample that was not acknowledged was written at most 1ms after the first command
+  // that the replica did not apply.
+  if (!flow.lsn_times.empty()) {
+    uint64_t now_ms = ProactorBase::GetMonotonicTimeNs() / 1000000;
+    res.lag_ms = now_ms - min(now_ms, flow.lsn_times.front().second);
+  }
+  return res;
+}
+
 void DflyCmd::OnClose(ConnectionContext* cntx) {
   unsigned session_id = cntx->conn_state.repl_session_id;
   if (!session_id)
@@ -453,6 +1319,13 @@ void DflyCmd::CancelReplication(uint32_t sync_id, shared_ptr<ReplicaInfo> replic
   replica_ptr->state = SyncState::CANCELLED;
   replica_ptr->cntx.Cancel();
 
+  // Leave the shared full sync, so that its other members do not wait for the replica.
+  if (auto& sync = replica_ptr->shared_sync; sync) {
+    lock_guard lk(sync->mu);
+    sync->members[replica_ptr->member_index].attached = false;
+    sync->cv.notify_all();
+  }
+
   // Run cleanup for shard threads.
   shard_set->AwaitRunningOnShardQueue([replica_ptr](EngineShard* shard) {
     FlowInfo* flow = &replica_ptr->flows[shard->shard_id()];
@@ -537,6 +1410,13 @@ void DflyCmd::BreakOnShutdown() {
 }
 
 void DflyCmd::Shutdown() {
+  ResumeWrites();
+  {
+    lock_guard tlk(takeover_mu_);
+    if (takeover_guard_.IsJoinable())
+      takeover_guard_.Join();
+  }
+
   ReplicaInfoMap pending;
   {
     std::lock_guard lk(mu_);
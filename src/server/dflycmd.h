@@ -7,11 +7,14 @@
 #include <absl/container/btree_map.h>
 
 #include <atomic>
+#include <boost/fiber/condition_variable.hpp>
 #include <boost/fiber/fiber.hpp>
 #include <boost/fiber/mutex.hpp>
+#include <deque>
 #include <memory>
 
 #include "server/conn_context.h"
+#include "util/fibers/fiber.h"
 
 namespace facade {
 class RedisReplyBuilder;
@@ -24,11 +27,15 @@ class ListenerInterface;
 namespace dfly {
 
 class EngineShardSet;
+class FanoutSink;
+class IoRateLimiter;
+class RateLimitedSink;
 class ServerFamily;
 class RdbSaver;
 
 namespace journal {
 class Journal;
+class FrameWriter;
 }  // namespace journal
 
 // DflyCmd is responsible for managing replication. A master instance can be connected
@@ -57,9 +64,19 @@ class Journal;
 //  2. Full sync
 //    This phase is initiated by the SYNC command. It makes sure all flows are connected and the
 //    replica is in a valid state.
+//    The replicas whose SYNC arrives within --repl_shared_sync_window_ms share a single snapshot
+//    of every shard, its stream is fanned out to their flows by FanoutSink. The snapshot stops
+//    once all of them sent STARTSTABLE, and their stable syncs start together.
 //  3. Stable state sync
 //    After the replica has received confirmation, that each flow is ready to transition, it sends a
 //    STARTSTABLE command. This transitions the replica into streaming journal changes.
+//    The changes are batched into frames, optionally compressed, see journal/frame.h.
+//    Every flow acknowledges the LSN it applied with REPLCONF ACK, the master replies with the lag
+//    of the flow in its stream. WAIT asks the flows to acknowledge right away with DFLY GETACK,
+//    at most once per flow until the acknowledgement arrives, so the waiting clients share it.
+//    A replica that reconnects passes the LSNs it reached to FLOW. If the journal backlogs of
+//    all the flows still hold the records it missed, it skips the full sync and sends STARTSTABLE
+//    right away, which resumes streaming from these LSNs.
 //  4. Cancellation
 //    This can happed due to an error at any phase or through a normal abort. For properly releasing
 //    resources we need to run a multi-step cancellation procedure:
@@ -92,12 +109,66 @@ class DflyCmd {
     facade::Connection* conn;
 
     ::boost::fibers::fiber full_sync_fb;  // Full sync fiber.
+    std::unique_ptr<RateLimitedSink> limited_sink;  // Set if the full sync bandwidth is capped.
     std::unique_ptr<RdbSaver> saver;      // Saver used by the full sync phase.
     std::string eof_token;
 
+    // Whether the flow resumes the stable sync from the journal backlog at start_lsn.
+    bool partial = false;
+    LSN start_lsn = 0;
+
+    bool local = false;  // of a local replica, see SetLocal.
+
+    // Batches the stable sync stream into frames.
+    std::unique_ptr<journal::FrameWriter> frame_writer;
+
+    // The stable sync progress, accessed from the thread of the flow. The replica acknowledges
+    // the LSN and the stream bytes it applied, see OnFlowAck. lsn_times samples the write times
+    // of the LSNs the replica did not acknowledge yet, in ms.
+    LSN acked_lsn = 0;
+    uint64_t written_bytes = 0, acked_bytes = 0;
+    std::deque<std::pair<LSN, uint64_t>> lsn_times;
+    bool ack_requested = false;  // GETACK was sent after the last acknowledgement.
+
     std::function<void()> cleanup;  // Optional cleanup for cancellation.
   };
 
+  struct ReplicaInfo;
+
+  // A full sync shared by several replicas, see the header comment.
+  struct SharedSync {
+    struct Member {
+      ReplicaInfo* info;       // valid while attached.
+      bool attached = true;    // until the replica is cancelled.
+      bool ready = false;      // sent STARTSTABLE.
+    };
+
+    // The snapshot of a thread, written to the flows of all the members.
+    struct Flow {
+      std::unique_ptr<FanoutSink> sink;
+      std::unique_ptr<RateLimitedSink> limited_sink;  // writes into sink.
+      std::unique_ptr<RdbSaver> saver;
+      std::vector<std::string> eof_tokens;  // of the members.
+      ::boost::fibers::fiber fb;
+    };
+
+    explicit SharedSync(unsigned flow_count) : flows{flow_count} {
+    }
+
+    std::vector<Member> members;
+    std::vector<Flow> flows;
+    Context cntx;  // cancels the snapshots.
+    std::unique_ptr<IoRateLimiter> limiter;  // Caps the bandwidth of every member.
+
+    util::fibers_ext::Done started;
+    facade::OpStatus status = facade::OpStatus::OK;
+
+    ::boost::fibers::mutex mu;  // guards the members once started.
+    ::boost::fibers::condition_variable_any cv;
+    bool stopping = false;  // a member stops the snapshot.
+    bool stopped = false;
+  };
+
   // Stores information related to a single replica.
   struct ReplicaInfo {
     ReplicaInfo(unsigned flow_count, Context::ErrHandler err_handler)
@@ -109,9 +180,27 @@ class DflyCmd {
 
     std::vector<FlowInfo> flows;
     ::boost::fibers::mutex mu;  // See top of header for locking levels.
+
+    std::unique_ptr<IoRateLimiter> limiter;   // Caps the bandwidth of the full sync.
+    std::shared_ptr<SharedSync> shared_sync;  // Set if the full sync is shared.
+    unsigned member_index = 0;                // Of the replica in shared_sync.
+    bool local = false;                       // See SetLocal.
   };
 
  public:
+  // The replication progress of a flow, see GetReplicasInfo.
+  struct FlowProgress {
+    LSN cur_lsn = 0, acked_lsn = 0;
+    uint64_t lag_entries = 0, lag_bytes = 0, lag_ms = 0;
+    double full_sync_progress = 0;  // the share of the buckets that the full sync traversed.
+  };
+
+  struct ReplicaProgress {
+    uint32_t sync_id;
+    std::string_view state;
+    std::vector<FlowProgress> flows;  // of the threads with shards.
+  };
+
   DflyCmd(util::ListenerInterface* listener, ServerFamily* server_family);
 
   void Run(CmdArgList args, ConnectionContext* cntx);
@@ -126,6 +215,38 @@ class DflyCmd {
   // Create new sync session.
   uint32_t CreateSyncSession();
 
+  // The syncs that the replicas ran with this master.
+  struct SyncStats {
+    uint64_t full = 0;     // full syncs.
+    uint64_t partial = 0;  // syncs that resumed from the backlog.
+    uint64_t shared = 0;   // snapshots that were shared by several replicas.
+  };
+
+  SyncStats GetSyncStats() const;
+
+  // REPLCONF ACK <lsn> <bytes>, sent periodically by every flow in the stable sync.
+  // Records the LSN of the next command and the bytes of the stream that the flow applied,
+  // and sends back the lag of the flow as "DFLY LAG <entries> <bytes> <ms>".
+  void OnFlowAck(ConnectionContext* cntx, LSN lsn, uint64_t bytes);
+
+  // WAIT <numreplicas> <timeout>. Blocks the calling fiber until numreplicas replicas in the
+  // stable sync acknowledged lsns, the LSN that follows the last write of the client in every
+  // shard (0 for none), or until timeout_ms passes, 0 waits without a timeout.
+  // Returns the number of the replicas that acknowledged them.
+  unsigned WaitForAcks(absl::Span<const LSN> lsns, unsigned numreplicas, uint32_t timeout_ms);
+
+  // REPLCONF LOCAL 1, sent by a replica on the same host, e.g. the successor of a live handoff,
+  // before its flows connect. Its full sync and stable sync are not compressed nor capped,
+  // and the stable sync is batched into larger frames.
+  void SetLocal(uint32_t sync_id);
+
+  // Returns the progress of the flows of every replica.
+  std::vector<ReplicaProgress> GetReplicasInfo();
+
+  // Runs a global hop of trans and returns the LSN of the next journal record of every thread,
+  // hence of every flow. 0 for the threads without shards, which journal nothing.
+  static std::vector<LSN> JournalLsns(Transaction* trans);
+
  private:
   // JOURNAL [START/STOP]
   // Start or stop journaling.
@@ -135,8 +256,9 @@ class DflyCmd {
   // Return connection thread index or migrate to another thread.
   void Thread(CmdArgList args, ConnectionContext* cntx);
 
-  // FLOW <masterid> <syncid> <flowid>
-  // Register connection as flow for sync session.
+  // FLOW <masterid> <syncid> <flowid> [<lsn>]
+  // Register connection as flow for sync session. Replies PARTIAL if the flow can resume
+  // the stable sync from lsn, FULL otherwise.
   void Flow(CmdArgList args, ConnectionContext* cntx);
 
   // SYNC <syncid>
@@ -144,15 +266,43 @@ class DflyCmd {
   void Sync(CmdArgList args, ConnectionContext* cntx);
 
   // STARTSTABLE <syncid>
-  // Switch to stable state replication.
+  // Switch to stable state replication, right after FLOW if all the flows resume.
   void StartStable(CmdArgList args, ConnectionContext* cntx);
 
   // EXPIRE
   // Check all keys for expiry.
   void Expire(CmdArgList args, ConnectionContext* cntx);
 
+  // TAKEOVER <syncid> <timeout_ms>
+  // Pauses the writes for at most timeout_ms and replies with the JournalLsns, which the replica
+  // applied all the writes before once its flows reach them.
+  // TAKEOVER <syncid> COMMIT <port> <masterid> <lsn>...
+  // The replica took over, this instance becomes its replica and resumes from its LSNs.
+  // TAKEOVER <syncid> ABORT
+  // Resumes the writes.
+  void Takeover(CmdArgList args, ConnectionContext* cntx);
+
+  // LOAD <rdb>
+  // Loads the keys of an RDB payload directly into the shards, without a transaction per key.
+  // The entries are partitioned by the shards in the connection thread and inserted in batches,
+  // every batch is journaled as a single record. The keys must not be written by other clients
+  // meanwhile. Replies with the number of the loaded keys, the bytes and the keys per second.
+  void Load(CmdArgList args, ConnectionContext* cntx);
+
+  // RESTORE <snapshot> <journal dir> [LSN <lsn>,<lsn>... | TIME <unix ms>]
+  // Replaces the data with the snapshot and replays the segments of the file-based journal in
+  // the dir that follow it, up to the target: the LSNs of a CLIENT LSNTOKEN or the time of the
+  // last transaction to apply. The snapshot must be saved while the journal is open, and the
+  // archived segments fetched into the dir. The instance should not serve other clients while it
+  // restores. Replies with the number of the replayed segments and commands.
+  void Restore(CmdArgList args, ConnectionContext* cntx);
+
+  // Ends the pause of the writes of TAKEOVER, if any.
+  void ResumeWrites();
+
   // Start full sync in thread. Start FullSyncFb. Called for each flow.
-  facade::OpStatus StartFullSyncInThread(FlowInfo* flow, Context* cntx, EngineShard* shard);
+  facade::OpStatus StartFullSyncInThread(FlowInfo* flow, Context* cntx, IoRateLimiter* limiter,
+                                         EngineShard* shard);
 
   // Stop full sync in thread. Run state switch cleanup.
   void StopFullSyncInThread(FlowInfo* flow, EngineShard* shard);
@@ -163,12 +313,42 @@ class DflyCmd {
   // Fiber that runs full sync for each flow.
   void FullSyncFb(FlowInfo* flow, Context* cntx);
 
+  // Returns the full sync that the replica joined within the window of its SYNC, which was
+  // started already if it has other members.
+  std::shared_ptr<SharedSync> JoinSharedSync(ReplicaInfo* replica, ConnectionContext* cntx);
+
+  // Start the shared snapshot of the thread, written to the flows of all the members.
+  facade::OpStatus StartSharedSyncInThread(SharedSync* sync, unsigned index, EngineShard* shard);
+
+  // Fiber that runs the shared snapshot of a thread.
+  void SharedSyncFb(SharedSync* sync, unsigned index);
+
+  // Waits for all the members of the shared sync to send STARTSTABLE. The last one stops
+  // the snapshots and starts the stable syncs of all of them.
+  facade::OpStatus StartSharedStable(ReplicaInfo* replica, ConnectionContext* cntx);
+
   // Main entrypoint for stopping replication.
   void StopReplication(uint32_t sync_id);
 
   // Transition into cancelled state, run cleanup.
   void CancelReplication(uint32_t sync_id, std::shared_ptr<ReplicaInfo> replica_info_ptr);
 
+  // Returns the stable sync progress of the flow, called from its thread.
+  FlowProgress GetFlowProgress(const FlowInfo& flow);
+
+  // Returns the number of the replicas in the stable sync whose flows acknowledged lsns.
+  unsigned CountAcks(absl::Span<const LSN> lsns);
+
+  // Asks the flows of the threads with lsns to acknowledge what they applied.
+  void RequestAcks(absl::Span<const LSN> lsns);
+
+  // Sends GETACK to the flows of the thread that did not acknowledge all its records, called
+  // from the thread.
+  void RequestAcksInThread(unsigned index);
+
+  // Returns the replicas, without holding mu_.
+  std::vector<std::shared_ptr<ReplicaInfo>> GetReplicas();
+
   // Get ReplicaInfo by sync_id.
   std::shared_ptr<ReplicaInfo> GetReplicaInfo(uint32_t sync_id);
 
@@ -191,6 +371,23 @@ class DflyCmd {
   using ReplicaInfoMap = absl::btree_map<uint32_t, std::shared_ptr<ReplicaInfo>>;
   ReplicaInfoMap replica_infos_;
 
+  std::shared_ptr<SharedSync> pending_sync_;  // Collects the replicas of the sync window.
+
+  std::atomic_uint64_t full_syncs_{0}, partial_syncs_{0}, shared_syncs_{0};  // see SyncStats.
+
+  // WAIT: ack_requests_[i] is set while a request to the flows of the thread i is dispatched,
+  // the waiters share it. acks_epoch_ changes with every acknowledgement and wakes them.
+  std::unique_ptr<std::atomic_bool[]> ack_requests_;
+  std::atomic_uint64_t acks_epoch_{0};
+  util::fibers_ext::EventCount acks_ec_;
+
+  // The pause of TAKEOVER, which the guard ends after its timeout unless it is done before.
+  // takeover_mu_ serializes the takeovers, mu_ guards writes_paused_.
+  bool writes_paused_ = false;
+  util::fibers_ext::Done takeover_done_;
+  util::fibers_ext::Fiber takeover_guard_;
+  ::boost::fibers::mutex takeover_mu_;
+
   ::boost::fibers::mutex mu_;  // Guard global operations. See header top for locking levels.
 };
 
@@ -0,0 +1,546 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/doc_index.h"
+
+extern "C" {
+#include "redis/listpack.h"
+#include "redis/object.h"
+}
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+#include <absl/strings/str_split.h>
+
+#include <cmath>
+
+#include "base/logging.h"
+#include "core/json_object.h"
+#include "core/json_pack.h"
+#include "core/string_map.h"
+#include "server/common.h"
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+bool IsWordChar(char c) {
+  return absl::ascii_isalnum(c) || c == '_';
+}
+
+// Calls cb with the lower case words of a TEXT value.
+template <typename Cb> void SplitWords(string_view text, Cb&& cb) {
+  size_t pos = 0;
+  while (pos < text.size()) {
+    while (pos < text.size() && !IsWordChar(text[pos]))
+      ++pos;
+    size_t start = pos;
+    while (pos < text.size() && IsWordChar(text[pos]))
+      ++pos;
+    if (pos > start)
+      cb(absl::AsciiStrToLower(text.substr(start, pos - start)));
+  }
+}
+
+string NormalizeTag(string_view tag) {
+  return absl::AsciiStrToLower(absl::StripAsciiWhitespace(tag));
+}
+
+// Calls cb(field, value) for the fields of a hash.
+template <typename Cb> void VisitHash(const PrimeValue& pv, Cb&& cb) {
+  if (pv.Encoding() == kEncodingListPack) {
+    uint8_t* lp = (uint8_t*)pv.RObjPtr();
+    uint8_t intbuf[2][LP_INTBUF_SIZE];
+    for (uint8_t* elem = lpFirst(lp); elem; elem = lpNext(lp, elem)) {
+      int64_t flen, vlen;
+      uint8_t* field = lpGet(elem, &flen, intbuf[0]);
+      elem = lpNext(lp, elem);
+      DCHECK(elem);
+      uint8_t* value = lpGet(elem, &vlen, intbuf[1]);
+      cb(string_view{(char*)field, size_t(flen)}, string_view{(char*)value, size_t(vlen)});
+    }
+    return;
+  }
+
+  DCHECK_EQ(kEncodingStrMap2, pv.Encoding());
+  const StringMap* sm = (const StringMap*)pv.RObjPtr();
+  for (auto it = sm->cbegin(); it != sm->cend(); ++it) {
+    sds entry = *it;
+    cb(StringMap::Field(entry), StringMap::Value(entry));
+  }
+}
+
+// The members of a JSON path "$.a.b", empty for an invalid path.
+vector<string_view> JsonPathMembers(string_view path) {
+  if (!absl::ConsumePrefix(&path, "$.") || path.empty())
+    return {};
+  vector<string_view> res = absl::StrSplit(path, '.');
+  for (string_view member : res) {
+    if (member.empty())
+      return {};
+  }
+  return res;
+}
+
+// Calls cb with the text of the scalar at the path of a document tree; with every element if
+// it is an array of scalars.
+template <typename Cb> void VisitJsonPath(const JsonType& doc, string_view path, Cb&& cb) {
+  const JsonType* val = &doc;
+  for (string_view member : JsonPathMembers(path)) {
+    if (!val->is_object())
+      return;
+    auto it = val->find(member);
+    if (it == val->object_range().end())
+      return;
+    val = &it->value();
+  }
+  if (val == &doc)
+    return;
+
+  auto visit_scalar = [&](const JsonType& j) {
+    if (j.is_string())
+      cb(j.as_string_view());
+    else if (j.is_number() || j.is_bool())
+      cb(j.to_string());
+  };
+  if (val->is_array()) {
+    for (const auto& item : val->array_range())
+      visit_scalar(item);
+  } else {
+    visit_scalar(*val);
+  }
+}
+
+// Same for a packed document.
+template <typename Cb> void VisitJsonPath(PackedJson doc, string_view path, Cb&& cb) {
+  vector<string_view> members = JsonPathMembers(path);
+  if (members.empty())
+    return;
+
+  optional<PackedJson> val = doc;
+  for (string_view member : members) {
+    if (val->type() != PackedJson::OBJECT || !(val = val->Find(member)))
+      return;
+  }
+
+  auto visit_scalar = [&](PackedJson j) {
+    switch (j.type()) {
+      case PackedJson::STRING:
+      case PackedJson::NUMBER_TEXT:
+        cb(j.AsString());
+        break;
+      case PackedJson::INT64:
+        cb(absl::StrCat(j.AsInt()));
+        break;
+      case PackedJson::UINT64:
+        cb(absl::StrCat(j.AsUint()));
+        break;
+      case PackedJson::DOUBLE:
+        cb(absl::StrFormat("%.17g", j.AsDouble()));
+        break;
+      case PackedJson::TRUE_VAL:
+      case PackedJson::FALSE_VAL:
+        cb(j.AsBool() ? "true" : "false");
+        break;
+      default:
+        break;
+    }
+  };
+  if (val->type() == PackedJson::ARRAY) {
+    for (uint32_t i = 0; i < val->size(); ++i)
+      visit_scalar(val->At(i));
+  } else {
+    visit_scalar(*val);
+  }
+}
+
+bool ParseBound(string_view token, double* val, int* exclusive) {
+  *exclusive = absl::ConsumePrefix(&token, "(");
+  absl::ConsumePrefix(&token, "+");
+  return absl::SimpleAtod(token, val);
+}
+
+}  // namespace
+
+bool DocIndexSchema::MatchesKey(string_view key) const {
+  if (prefixes.empty())
+    return true;
+  for (const string& prefix : prefixes) {
+    if (absl::StartsWith(key, prefix))
+      return true;
+  }
+  return false;
+}
+
+int DocIndexSchema::FieldIndex(string_view alias) const {
+  for (size_t i = 0; i < fields.size(); ++i) {
+    if (fields[i].alias == alias)
+      return i;
+  }
+  return -1;
+}
+
+optional<string> DocQuery::Parse(string_view query, const DocIndexSchema& schema,
+                                 DocQuery* dest) {
+  dest->clauses.clear();
+  size_t pos = 0;
+  auto syntax_error = [&] { return absl::StrCat("Syntax error at offset ", pos); };
+
+  while (true) {
+    while (pos < query.size() && absl::ascii_isspace(query[pos]))
+      ++pos;
+    if (pos == query.size())
+      break;
+
+    DocQuery::Clause clause;
+    if (query[pos] == '-') {
+      clause.negated = true;
+      ++pos;
+    }
+    if (pos == query.size())
+      return syntax_error();
+
+    if (query[pos] == '*') {
+      ++pos;
+      dest->clauses.push_back(std::move(clause));
+      continue;
+    }
+
+    if (query[pos] != '@') {
+      size_t end = pos;
+      while (end < query.size() && !absl::ascii_isspace(query[end])) {
+        if (strchr("@{}[]()|", query[end]))
+          return syntax_error();
+        ++end;
+      }
+      clause.kind = Clause::TERMS;
+      SplitWords(query.substr(pos, end - pos),
+                 [&](string word) { clause.terms.push_back(std::move(word)); });
+      if (clause.terms.size() != 1)
+        return syntax_error();
+      pos = end;
+      dest->clauses.push_back(std::move(clause));
+      continue;
+    }
+
+    size_t colon = query.find(':', pos);
+    if (colon == string_view::npos || colon + 1 == query.size())
+      return syntax_error();
+    string_view alias = query.substr(pos + 1, colon - pos - 1);
+    clause.field = schema.FieldIndex(alias);
+    if (clause.field < 0)
+      return absl::StrCat("Unknown field `", alias, "`");
+    DocIndexSchema::FieldType type = schema.fields[clause.field].type;
+    pos = colon + 1;
+
+    if (query[pos] == '{' || query[pos] == '[') {
+      char close = query[pos] == '{' ? '}' : ']';
+      size_t end = query.find(close, pos);
+      if (end == string_view::npos)
+        return syntax_error();
+      string_view body = query.substr(pos + 1, end - pos - 1);
+
+      if (close == '}') {
+        if (type != DocIndexSchema::TAG)
+          return absl::StrCat("Field `", alias, "` is not a TAG field");
+        clause.kind = Clause::TERMS;
+        for (string_view tag : absl::StrSplit(body, '|')) {
+          if (string term = NormalizeTag(tag); !term.empty())
+            clause.terms.push_back(std::move(term));
+        }
+        if (clause.terms.empty())
+          return syntax_error();
+      } else {
+        if (type != DocIndexSchema::NUMERIC)
+          return absl::StrCat("Field `", alias, "` is not a NUMERIC field");
+        vector<string_view> bounds = absl::StrSplit(body, ' ', absl::SkipWhitespace());
+        clause.kind = Clause::RANGE;
+        if (bounds.size() != 2 ||
+            !ParseBound(bounds[0], &clause.range.min, &clause.range.minex) ||
+            !ParseBound(bounds[1], &clause.range.max, &clause.range.maxex))
+          return syntax_error();
+      }
+      pos = end + 1;
+    } else {
+      if (type != DocIndexSchema::TEXT)
+        return absl::StrCat("Field `", alias, "` is not a TEXT field");
+      size_t end = pos;
+      while (end < query.size() && !absl::ascii_isspace(query[end]))
+        ++end;
+      clause.kind = Clause::TERMS;
+      SplitWords(query.substr(pos, end - pos),
+                 [&](string word) { clause.terms.push_back(std::move(word)); });
+      if (clause.terms.size() != 1)
+        return syntax_error();
+      pos = end;
+    }
+    dest->clauses.push_back(std::move(clause));
+  }
+
+  if (dest->clauses.empty())
+    return string{"Empty query"};
+  return nullopt;
+}
+
+ShardDocIndex::ShardDocIndex(DocIndexSchema schema)
+    : schema_(std::move(schema)), fields_(schema_.fields.size()) {
+  for (size_t i = 0; i < fields_.size(); ++i) {
+    if (schema_.fields[i].type == DocIndexSchema::NUMERIC)
+      fields_[i].numbers = make_unique<SortedMap>();
+  }
+}
+
+bool ShardDocIndex::Matches(string_view key, const PrimeValue& pv) const {
+  if (!schema_.MatchesKey(key) || pv.IsExternal())
+    return false;
+  return pv.ObjType() == (schema_.type == DocIndexSchema::HASH ? OBJ_HASH : OBJ_JSON);
+}
+
+void ShardDocIndex::Add(string_view key, const PrimeValue& pv) {
+  DCHECK(Matches(key, pv));
+  Remove(key);
+
+  DocId id;
+  if (!free_ids_.empty()) {
+    id = free_ids_.back();
+    free_ids_.pop_back();
+  } else {
+    id = docs_.size();
+    docs_.emplace_back();
+  }
+  docs_[id].key.assign(key);
+  ids_.emplace(docs_[id].key, id);
+
+  if (schema_.type == DocIndexSchema::HASH) {
+    VisitHash(pv, [&](string_view field, string_view value) {
+      for (size_t i = 0; i < schema_.fields.size(); ++i) {
+        if (schema_.fields[i].identifier == field)
+          AddValue(id, i, value);
+      }
+    });
+    return;
+  }
+
+  for (size_t i = 0; i < schema_.fields.size(); ++i) {
+    auto cb = [&](string_view value) { AddValue(id, i, value); };
+    if (pv.IsPackedJson())
+      VisitJsonPath(PackedJson{pv.GetPackedJson()}, schema_.fields[i].identifier, cb);
+    else
+      VisitJsonPath(*pv.GetJson(), schema_.fields[i].identifier, cb);
+  }
+}
+
+void ShardDocIndex::AddValue(DocId id, uint16_t field, string_view value) {
+  const DocIndexSchema::Field& def = schema_.fields[field];
+  switch (def.type) {
+    case DocIndexSchema::TAG:
+      for (string_view tag : absl::StrSplit(value, def.separator)) {
+        if (string term = NormalizeTag(tag); !term.empty())
+          AddTerm(id, field, std::move(term));
+      }
+      break;
+    case DocIndexSchema::TEXT:
+      SplitWords(value, [&](string word) { AddTerm(id, field, std::move(word)); });
+      break;
+    case DocIndexSchema::NUMERIC: {
+      double num;
+      if (absl::SimpleAtod(value, &num) && !std::isnan(num))
+        fields_[field].numbers->Insert(num, docs_[id].key);
+      break;
+    }
+  }
+}
+
+void ShardDocIndex::AddTerm(DocId id, uint16_t field, string term) {
+  if (fields_[field].postings[term].insert(id).second)
+    docs_[id].terms.emplace_back(field, std::move(term));
+}
+
+void ShardDocIndex::Remove(string_view key) {
+  auto it = ids_.find(key);
+  if (it == ids_.end())
+    return;
+
+  DocId id = it->second;
+  ids_.erase(it);
+  Doc& doc = docs_[id];
+  for (const auto& [field, term] : doc.terms) {
+    auto& postings = fields_[field].postings;
+    auto pit = postings.find(term);
+    DCHECK(pit != postings.end());
+    pit->second.erase(id);
+    if (pit->second.empty())
+      postings.erase(pit);
+  }
+  for (FieldIndex& index : fields_) {
+    if (index.numbers)
+      index.numbers->Delete(doc.key);
+  }
+
+  doc = Doc{};
+  free_ids_.push_back(id);
+}
+
+void ShardDocIndex::Clear() {
+  ids_.clear();
+  docs_.clear();
+  free_ids_.clear();
+  for (size_t i = 0; i < fields_.size(); ++i) {
+    fields_[i].postings.clear();
+    if (fields_[i].numbers)
+      fields_[i].numbers = make_unique<SortedMap>();
+  }
+}
+
+auto ShardDocIndex::Eval(const DocQuery::Clause& clause) const -> DocSet {
+  DocSet res;
+  switch (clause.kind) {
+    case DocQuery::Clause::ALL:
+      for (const auto& [key, id] : ids_)
+        res.insert(id);
+      break;
+    case DocQuery::Clause::TERMS:
+      for (size_t i = 0; i < fields_.size(); ++i) {
+        bool matches = clause.field < 0 ? schema_.fields[i].type == DocIndexSchema::TEXT
+                                        : int(i) == clause.field;
+        if (!matches)
+          continue;
+        for (const string& term : clause.terms) {
+          if (auto it = fields_[i].postings.find(term); it != fields_[i].postings.end())
+            res.insert(it->second.begin(), it->second.end());
+        }
+      }
+      break;
+    case DocQuery::Clause::RANGE: {
+      const zrangespec& range = clause.range;
+      const SortedMap* numbers = fields_[clause.field].numbers.get();
+      for (auto it = numbers->FirstInRange(range).first; !it.IsEnd(); ++it) {
+        if (range.maxex ? it->score >= range.max : it->score > range.max)
+          break;
+        auto id_it = ids_.find(string_view{it->member, sdslen(it->member)});
+        DCHECK(id_it != ids_.end());
+        res.insert(id_it->second);
+      }
+      break;
+    }
+  }
+  return res;
+}
+
+vector<string_view> ShardDocIndex::Search(const DocQuery& query) const {
+  optional<DocSet> matches;
+  for (const DocQuery::Clause& clause : query.clauses) {
+    if (clause.negated)
+      continue;
+    DocSet docs = Eval(clause);
+    if (!matches) {
+      matches = std::move(docs);
+      continue;
+    }
+
+    const DocSet& smaller = docs.size() < matches->size() ? docs : *matches;
+    const DocSet& larger = &smaller == &docs ? *matches : docs;
+    DocSet both;
+    for (DocId id : smaller) {
+      if (larger.contains(id))
+        both.insert(id);
+    }
+    matches = std::move(both);
+  }
+
+  if (!matches)
+    matches = Eval(DocQuery::Clause{});
+  for (const DocQuery::Clause& clause : query.clauses) {
+    if (clause.negated) {
+      for (DocId id : Eval(clause))
+        matches->erase(id);
+    }
+  }
+
+  vector<string_view> res;
+  res.reserve(matches->size());
+  for (DocId id : *matches)
+    res.push_back(docs_[id].key);
+  return res;
+}
+
+bool ShardDocIndices::Create(string_view name, DocIndexSchema schema, PrimeTable* db0) {
+  auto [slot, inserted] = indices_.emplace(name, nullptr);
+  if (!inserted)
+    return false;
+
+  slot->second = make_unique<ShardDocIndex>(std::move(schema));
+  ShardDocIndex* index = slot->second.get();
+  string tmp;
+  auto cb = [&](PrimeIterator it) {
+    string_view key = it->first.GetSlice(&tmp);
+    if (index->Matches(key, it->second))
+      index->Add(key, it->second);
+  };
+
+  PrimeTable::Cursor cursor;
+  do {
+    cursor = db0->Traverse(cursor, cb);
+  } while (cursor);
+  return true;
+}
+
+bool ShardDocIndices::Drop(string_view name) {
+  return indices_.erase(name) > 0;
+}
+
+const ShardDocIndex* ShardDocIndices::Find(string_view name) const {
+  auto it = indices_.find(name);
+  return it == indices_.end() ? nullptr : it->second.get();
+}
+
+vector<string> ShardDocIndices::Names() const {
+  vector<string> res;
+  for (const auto& [name, index] : indices_)
+    res.push_back(name);
+  return res;
+}
+
+void ShardDocIndices::OnWrite(string_view key, const PrimeValue& pv) {
+  for (auto& [name, index] : indices_) {
+    if (index->Matches(key, pv))
+      index->Add(key, pv);
+    else if (index->schema().MatchesKey(key))
+      index->Remove(key);
+  }
+}
+
+void ShardDocIndices::OnDelete(string_view key) {
+  for (auto& [name, index] : indices_) {
+    if (index->schema().MatchesKey(key))
+      index->Remove(key);
+  }
+}
+
+void ShardDocIndices::OnFlush() {
+  for (auto& [name, index] : indices_)
+    index->Clear();
+}
+
+void VisitDocFields(const PrimeValue& pv, const function<void(string_view, string_view)>& cb) {
+  if (pv.ObjType() == OBJ_HASH) {
+    VisitHash(pv, cb);
+    return;
+  }
+
+  DCHECK_EQ(OBJ_JSON, pv.ObjType());
+  string text;
+  if (pv.IsPackedJson())
+    PackedJson{pv.GetPackedJson()}.ToJson(&text);
+  else
+    text = pv.GetJson()->to_string();
+  cb("$", text);
+}
+
+}  // namespace dfly
@@ -0,0 +1,164 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "core/sorted_map.h"
+#include "server/table.h"
+
+namespace dfly {
+
+// The definition of a search index of FT.CREATE: the documents are the hashes or the JSON
+// values whose keys start with one of the prefixes, and their fields are indexed by type.
+struct DocIndexSchema {
+  enum DocType : uint8_t { HASH, JSON };
+
+  // TAG: comma separated values matched exactly, ignoring case.
+  // TEXT: words matched ignoring case. NUMERIC: numbers matched by range.
+  enum FieldType : uint8_t { TAG, TEXT, NUMERIC };
+
+  struct Field {
+    std::string identifier;  // the hash field or the JSON path, "$.a.b".
+    std::string alias;       // the name in the queries, the identifier by default.
+    FieldType type;
+    char separator = ',';  // of TAG values.
+  };
+
+  DocType type = HASH;
+  std::vector<std::string> prefixes;  // all the keys if empty.
+  std::vector<Field> fields;
+
+  bool MatchesKey(std::string_view key) const;
+
+  // Returns -1 if there is no field with the alias.
+  int FieldIndex(std::string_view alias) const;
+};
+
+// A query of FT.SEARCH, a conjunction of clauses over the fields of a schema:
+//   *                 all the documents.
+//   word              the documents with the word in any TEXT field.
+//   @title:word       the word in the TEXT field title.
+//   @tags:{a | b}     the TAG field tags has a or b.
+//   @price:[10 (20]   the NUMERIC field price in [10, 20), -inf and +inf are allowed.
+// A clause that starts with '-' excludes the documents that match it.
+struct DocQuery {
+  struct Clause {
+    enum Kind : uint8_t { ALL, TERMS, RANGE };
+
+    Kind kind = ALL;
+    bool negated = false;
+    int field = -1;                  // -1 for a word over all the TEXT fields.
+    std::vector<std::string> terms;  // TERMS: matches if any of them does, lower case.
+    zrangespec range;                // RANGE.
+  };
+
+  std::vector<Clause> clauses;
+
+  // Returns the error message if the query is invalid for the schema.
+  static std::optional<std::string> Parse(std::string_view query, const DocIndexSchema& schema,
+                                          DocQuery* dest);
+};
+
+// The index of the documents of a shard for one schema. Every TAG and TEXT field has an
+// inverted index from its terms to the documents, a NUMERIC field keeps the keys ordered by
+// value in a SortedMap, the container of the sorted sets.
+class ShardDocIndex {
+ public:
+  explicit ShardDocIndex(DocIndexSchema schema);
+
+  const DocIndexSchema& schema() const {
+    return schema_;
+  }
+
+  // Whether the key and the value are a document of the schema.
+  bool Matches(std::string_view key, const PrimeValue& pv) const;
+
+  // Adds the document, replacing the previous one of the key. Requires: Matches(key, pv).
+  void Add(std::string_view key, const PrimeValue& pv);
+
+  void Remove(std::string_view key);
+
+  void Clear();
+
+  // Returns the keys of the documents that match the query, valid until the index changes.
+  std::vector<std::string_view> Search(const DocQuery& query) const;
+
+  size_t num_docs() const {
+    return ids_.size();
+  }
+
+ private:
+  using DocId = uint32_t;
+  using DocSet = absl::flat_hash_set<DocId>;
+
+  struct Doc {
+    std::string key;
+
+    // The terms of the TAG and TEXT fields by field index, removed with the document.
+    std::vector<std::pair<uint16_t, std::string>> terms;
+  };
+
+  struct FieldIndex {
+    absl::flat_hash_map<std::string, DocSet> postings;  // TAG and TEXT.
+    std::unique_ptr<SortedMap> numbers;                 // NUMERIC, the keys by value.
+  };
+
+  void AddTerm(DocId id, uint16_t field, std::string term);
+  void AddValue(DocId id, uint16_t field, std::string_view value);
+  DocSet Eval(const DocQuery::Clause& clause) const;
+
+  DocIndexSchema schema_;
+  std::vector<FieldIndex> fields_;
+  std::deque<Doc> docs_;  // by DocId, stable addresses for ids_.
+  std::vector<DocId> free_ids_;
+  absl::flat_hash_map<std::string_view, DocId> ids_;
+};
+
+// The search indices of a shard by name. DbSlice keeps them up to date with the writes to the
+// keys of db 0, the only indexed one as in RediSearch.
+class ShardDocIndices {
+ public:
+  // Returns false if there is an index with the name. Indexes the keys of db0.
+  bool Create(std::string_view name, DocIndexSchema schema, PrimeTable* db0);
+
+  bool Drop(std::string_view name);
+
+  const ShardDocIndex* Find(std::string_view name) const;
+
+  std::vector<std::string> Names() const;
+
+  bool empty() const {
+    return indices_.empty();
+  }
+
+  // Called after a write to the key, with its new value.
+  void OnWrite(std::string_view key, const PrimeValue& pv);
+
+  // Called before the key is deleted.
+  void OnDelete(std::string_view key);
+
+  // Called when db 0 is flushed.
+  void OnFlush();
+
+ private:
+  absl::flat_hash_map<std::string, std::unique_ptr<ShardDocIndex>> indices_;
+};
+
+// Calls cb(field, value) for the fields of a hash value, or once with "$" and the JSON text
+// of a JSON value, as FT.SEARCH returns the documents.
+void VisitDocFields(const PrimeValue& pv,
+                    const std::function<void(std::string_view, std::string_view)>& cb);
+
+}  // namespace dfly
@@ -7,18 +7,36 @@ extern "C" {
 #include "redis/zmalloc.h"
 }
 
+#include <absl/flags/reflection.h>
 #include <absl/strings/ascii.h>
 #include <absl/strings/str_join.h>
 #include <absl/strings/strip.h>
 #include <gmock/gmock.h>
+#include <unistd.h>
 
+#include <filesystem>
+
+#include "base/flags.h"
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "facade/facade_test.h"
 #include "server/conn_context.h"
 #include "server/main_service.h"
+#include "server/server_state.h"
 #include "server/test_utils.h"
 
+ABSL_DECLARE_FLAG(uint32_t, migrate_connections);
+ABSL_DECLARE_FLAG(std::string, loading_reads);
+ABSL_DECLARE_FLAG(uint32_t, shard_slice_usec);
+ABSL_DECLARE_FLAG(uint32_t, reply_chunk_kb);
+ABSL_DECLARE_FLAG(int32_t, slowlog_log_slower_than);
+ABSL_DECLARE_FLAG(uint32_t, shed_queue_len);
+ABSL_DECLARE_FLAG(uint32_t, client_ops_limit);
+ABSL_DECLARE_FLAG(uint32_t, lua_time_limit);
+ABSL_DECLARE_FLAG(std::vector<std::string>, backing_prefix);
+ABSL_DECLARE_FLAG(uint32_t, backing_file_fixed_buffers);
+ABSL_DECLARE_FLAG(uint32_t, tiered_promote_threshold);
+
 namespace dfly {
 
 using namespace std;
@@ -27,6 +45,8 @@ using absl::StrCat;
 using ::io::Result;
 using testing::ElementsAre;
 using testing::HasSubstr;
+using testing::Not;
+using testing::UnorderedElementsAre;
 
 namespace {
 
@@ -165,6 +185,36 @@ TEST_F(DflyEngineTest, MultiSeq) {
   ASSERT_THAT(arr[2].GetVec(), ElementsAre("1", ArgType(RespExpr::NIL)));
 }
 
+TEST_F(DflyEngineTest, MultiLockAhead) {
+  // Commands on single shards run grouped by shard, the replies keep the order of the commands.
+  Run({"multi"});
+  ASSERT_EQ(Run({"set", kKey1, "1"}), "QUEUED");
+  ASSERT_EQ(Run({"incr", kKey4}), "QUEUED");
+  ASSERT_EQ(Run({"incr", kKey1}), "QUEUED");
+  ASSERT_EQ(Run({"lpush", kKey4, "a"}), "QUEUED");
+  ASSERT_EQ(Run({"get", kKey4}), "QUEUED");
+  RespExpr resp = Run({"exec"});
+  ASSERT_THAT(resp, ArrLen(5));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("OK", IntArg(1), IntArg(2), ErrArg("WRONGTYPE"), "1"));
+
+  ASSERT_FALSE(service_->IsLocked(0, kKey1));
+  ASSERT_FALSE(service_->IsLocked(0, kKey4));
+  ASSERT_FALSE(service_->IsShardSetLocked());
+
+  // Watched keys are locked together with the keys of the commands.
+  Run({"watch", kKey2});
+  Run({"multi"});
+  ASSERT_EQ(Run({"get", kKey1}), "QUEUED");
+  ASSERT_EQ(Run({"mget", kKey1, kKey4}), "QUEUED");
+  resp = Run({"exec"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("2", ArrLen(2)));
+
+  ASSERT_FALSE(service_->IsLocked(0, kKey1));
+  ASSERT_FALSE(service_->IsLocked(0, kKey2));
+  ASSERT_FALSE(service_->IsShardSetLocked());
+}
+
 TEST_F(DflyEngineTest, MultiConsistent) {
   auto mset_fb = pp_->at(0)->LaunchFiber([&] {
     for (size_t i = 1; i < 10; ++i) {
@@ -274,6 +324,95 @@ TEST_F(DflyEngineTest, MultiHop) {
   p2_fb.Join();
 }
 
+// Transactions and their buffers are reused through a thread-local pool, the state of a
+// released transaction must not leak into the next one.
+TEST_F(DflyEngineTest, TransactionPool) {
+  // The buffers of multi-key transactions spill to the heap and are pooled.
+  vector<string> args{"mset"};
+  for (unsigned i = 0; i < 100; ++i) {
+    args.push_back(StrCat("key", i));
+    args.push_back(StrCat(i));
+  }
+  vector<string_view> sv_args(args.begin(), args.end());
+  ASSERT_EQ(Run(ArgSlice{sv_args}), "OK");
+
+  // The MULTI transactions reuse the Multi state, including that of a discarded one.
+  Run({"multi"});
+  ASSERT_EQ(Run({"mget", "key1", "key2", "key3"}), "QUEUED");
+  ASSERT_EQ(Run({"discard"}), "OK");
+
+  Run({"multi"});
+  ASSERT_EQ(Run({"set", kKey1, "1"}), "QUEUED");
+  ASSERT_EQ(Run({"incr", kKey4}), "QUEUED");
+  RespExpr resp = Run({"exec"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("OK", IntArg(1)));
+  EXPECT_FALSE(service_->IsLocked(0, "key1"));
+  EXPECT_FALSE(service_->IsLocked(0, kKey1));
+  EXPECT_FALSE(service_->IsLocked(0, kKey4));
+  EXPECT_FALSE(service_->IsShardSetLocked());
+
+  resp = Run({"eval", "return redis.call('mget', KEYS[1], KEYS[2])", "2", "key7", kKey1});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("7", "1"));
+
+  // More transactions than a pool keeps run at once and are released on every thread.
+  constexpr unsigned kFibers = 200;
+  vector<fibers_ext::Fiber> fibers;
+  for (unsigned i = 0; i < kFibers; ++i) {
+    fibers.push_back(pp_->at(i % pp_->size())->LaunchFiber([&, i] {
+      string id = StrCat("conn", i), k1 = StrCat("a", i), k2 = StrCat("b", i);
+      EXPECT_EQ(Run(id, {"mset", k1, "1", k2, "2"}), "OK");
+      RespExpr resp = Run(id, {"mget", k1, k2, "key0"});
+      ASSERT_THAT(resp, ArrLen(3));
+      EXPECT_THAT(resp.GetVec(), ElementsAre("1", "2", "0"));
+    }));
+  }
+  for (auto& fb : fibers)
+    fb.Join();
+
+  EXPECT_THAT(Run({"dbsize"}), IntArg(100 + 2 + 2 * kFibers));
+  EXPECT_FALSE(service_->IsShardSetLocked());
+}
+
+// The locks are keyed by the PrimeTable hash of the keys, whatever their encoding, so that the
+// eviction can check the lock of a PrimeKey.
+TEST_F(DflyEngineTest, LockTable) {
+  shard_set->RunBriefInParallel([](EngineShard* shard) {
+    for (string_view key : {"", "a", "12345", "-7", "short-ascii", string_view{"bin\0\xff", 5},
+                            "a-key-long-enough-to-be-allocated-outside-of-the-object"}) {
+      PrimeKey pk{key};
+      EXPECT_EQ(pk.HashCode(), LockTable::Fingerprint(key)) << key;
+    }
+  });
+
+  LockTable lt;
+  uint64_t fp = LockTable::Fingerprint("key");
+  EXPECT_TRUE(lt.Acquire(IntentLock::SHARED, fp));
+  EXPECT_TRUE(lt.Acquire(IntentLock::SHARED, fp));
+  EXPECT_FALSE(lt.Acquire(IntentLock::EXCLUSIVE, fp));  // the intent is recorded.
+  EXPECT_EQ(1u, lt.size());
+  EXPECT_TRUE(lt.Contains(fp));
+  EXPECT_FALSE(lt.Check(IntentLock::SHARED, fp));
+  EXPECT_TRUE(lt.Check(IntentLock::EXCLUSIVE, LockTable::Fingerprint("other")));
+
+  lt.Release(IntentLock::SHARED, fp, 2);
+  EXPECT_TRUE(lt.Contains(fp));
+  lt.Release(IntentLock::EXCLUSIVE, fp);
+  EXPECT_FALSE(lt.Contains(fp));
+  EXPECT_TRUE(lt.empty());
+
+  // A key repeated in a command is locked once.
+  EXPECT_EQ(Run({"mset", kKey1, "1", kKey4, "2", kKey1, "3"}), "OK");
+  EXPECT_FALSE(service_->IsLocked(0, kKey1));
+  EXPECT_FALSE(service_->IsLocked(0, kKey4));
+  EXPECT_EQ(Run({"get", kKey1}), "3");
+  RespExpr resp = Run({"mget", kKey1, kKey1, kKey4});
+  ASSERT_THAT(resp, ArrLen(3));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("3", "3", "2"));
+  EXPECT_FALSE(service_->IsLocked(0, kKey1));
+}
+
 TEST_F(DflyEngineTest, FlushDb) {
   Run({"mset", kKey1, "1", kKey4, "2"});
   auto resp = Run({"flushdb"});
@@ -333,6 +472,29 @@ TEST_F(DflyEngineTest, Eval) {
   EXPECT_THAT(resp, IntArg(0));
 }
 
+TEST_F(DflyEngineTest, EvalSingleShard) {
+  // The script runs in the thread of the shard of its key and redis.call does not hop.
+  const char kScript[] = R"(
+local cur = redis.call('incr', KEYS[1])
+redis.call('expire', KEYS[1], 100)
+return {cur, redis.call('ttl', KEYS[1])}
+)";
+  auto resp = Run({"eval", kScript, "1", "rate"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), IntArg(100)));
+
+  resp = Run({"eval", kScript, "1", "rate"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(2), IntArg(100)));
+
+  EXPECT_GE(service_->server_family().GetMetrics().shard_stats.inline_hops, 6u);
+  ASSERT_FALSE(service_->IsLocked(0, "rate"));
+
+  // Errors are captured in the shard thread as well.
+  resp = Run({"eval", "return redis.call('lpush', KEYS[1], 'a')", "1", "rate"});
+  EXPECT_THAT(resp, ErrArg("WRONGTYPE"));
+}
+
 TEST_F(DflyEngineTest, EvalResp) {
   auto resp = Run({"eval", "return 43", "0"});
   EXPECT_THAT(resp, IntArg(43));
@@ -401,6 +563,152 @@ TEST_F(DflyEngineTest, EvalSha) {
   EXPECT_THAT(resp, "c6459b95a0e81df97af6fdd49b1a9e0287a57363");
 }
 
+TEST_F(DflyEngineTest, ScriptBroadcast) {
+  auto resp = Run({"script", "load", "return ARGV[1]"});
+  ASSERT_THAT(resp, ArgType(RespExpr::STRING));
+  string sha{ToSV(resp.GetBuf())};
+
+  // Loaded scripts are precompiled in the interpreters of all the threads.
+  shard_set->pool()->AwaitFiberOnAll([&](unsigned index, ProactorBase* base) {
+    ServerState::tlocal()->interpreter_mgr().ForEach(
+        [&](Interpreter* interpreter) { EXPECT_TRUE(interpreter->Exists(sha)) << index; });
+  });
+
+  resp = pp_->at(1)->Await([&] { return Run({"evalsha", sha, "0", "bar"}); });
+  EXPECT_EQ(resp, "bar");
+}
+
+TEST_F(DflyEngineTest, ScriptKill) {
+  EXPECT_THAT(Run({"script", "kill"}), ErrArg("NOTBUSY"));
+  absl::SetFlag(&FLAGS_lua_time_limit, 10);
+
+  RespExpr eval_resp;
+  auto fb = pp_->at(1)->LaunchFiber([&] {
+    string_view args[] = {"eval", "redis.call('get', KEYS[1]) while true do end", "1", "x"};
+    eval_resp = Run("script", ArgSlice{args});
+  });
+
+  // The script yields, hence the other connections are served while it runs, except for the
+  // commands on its keys once it is busy.
+  fibers_ext::SleepFor(100ms);
+  EXPECT_EQ(Run({"ping"}), "PONG");
+  EXPECT_THAT(Run({"set", "x", "1"}), ErrArg("BUSY"));
+
+  RespExpr resp = Run({"script", "kill"});
+  for (unsigned i = 0; i < 1000 && resp != "OK"; ++i) {
+    EXPECT_EQ(Run({"ping"}), "PONG");
+    EXPECT_THAT(resp, ErrArg("NOTBUSY"));
+    fibers_ext::SleepFor(1ms);
+    resp = Run({"script", "kill"});
+  }
+  EXPECT_EQ(resp, "OK");
+
+  fb.join();
+  EXPECT_THAT(eval_resp, ErrArg("script was killed"));
+  EXPECT_EQ(Run({"set", "x", "1"}), "OK");
+  EXPECT_THAT(Run({"script", "kill"}), ErrArg("NOTBUSY"));
+  absl::SetFlag(&FLAGS_lua_time_limit, 5000);
+}
+
+TEST_F(DflyEngineTest, InterpreterPool) {
+  pp_->at(0)->Await([&] {
+    InterpreterManager mgr{2};
+    Interpreter* first = mgr.Get();
+    Interpreter* second = mgr.Get();
+    EXPECT_NE(first, second);
+    EXPECT_EQ(2u, mgr.GetStats().interpreters);
+    EXPECT_EQ(2u, mgr.GetStats().borrowed);
+
+    // The pool is exhausted, hence the third script waits for a returned interpreter.
+    Interpreter* third = nullptr;
+    auto fb = pp_->at(0)->LaunchFiber([&] { third = mgr.Get(); });
+    fibers_ext::SleepFor(1ms);
+    EXPECT_EQ(nullptr, third);
+
+    mgr.Return(first);
+    fb.join();
+    EXPECT_EQ(first, third);
+    EXPECT_EQ(1u, mgr.GetStats().waits);
+
+    mgr.Return(second);
+    mgr.Return(third);
+    EXPECT_EQ(0u, mgr.GetStats().borrowed);
+  });
+}
+
+TEST_F(DflyEngineTest, TxLatency) {
+  Run({"set", "foo", "bar"});
+  Run({"mget", "foo", "a", "b", "c"});
+  Run({"mget", "foo", "a", "b", "c"});
+
+  auto resp = Run({"latency", "histogram", "set", "mget"});
+  ASSERT_THAT(resp, ArrLen(4));
+  auto vec = resp.GetVec();
+  EXPECT_THAT(vec[0], "MGET");
+  EXPECT_THAT(vec[2], "SET");
+  ASSERT_THAT(vec[1], ArrLen(42));
+  EXPECT_THAT(vec[1].GetVec()[0], "calls");
+  EXPECT_THAT(vec[1].GetVec()[1], IntArg(2));
+  EXPECT_THAT(vec[3].GetVec()[1], IntArg(1));
+
+  resp = Run({"debug", "tx"});
+  ASSERT_THAT(resp, ArrLen(shard_set->size()));
+  EXPECT_THAT(ToSV(resp.GetVec()[0].GetBuf()), HasSubstr("shard:0 queue_len:0"));
+
+  // The commands without a transaction of their own record their total latency only.
+  Run({"ping"});
+  resp = Run({"latency", "histogram", "ping"});
+  ASSERT_THAT(resp, ArrLen(2));
+  vec = resp.GetVec()[1].GetVec();
+  EXPECT_THAT(vec[1], IntArg(1));
+  EXPECT_THAT(vec[2], "schedule_p50_usec");
+  EXPECT_THAT(vec[3], IntArg(0));
+
+  string info(Run({"info", "commandstats"}).GetString());
+  EXPECT_THAT(info, HasSubstr("cmdstat_mget:calls=2,usec="));
+  EXPECT_THAT(info, HasSubstr("cmdstat_ping:calls=1,"));
+  EXPECT_THAT(info, HasSubstr(",p999="));
+
+  // LATENCY RESET records itself once it ran.
+  EXPECT_THAT(Run({"latency", "reset"}), IntArg(0));
+  resp = Run({"latency", "histogram"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec()[0], "LATENCY");
+}
+
+TEST_F(DflyEngineTest, SlowLog) {
+  absl::FlagSaver saver;
+  absl::SetFlag(&FLAGS_slowlog_log_slower_than, 0);
+
+  EXPECT_EQ(Run({"slowlog", "reset"}), "OK");
+  Run({"set", "foo", string(200, 'x')});
+  Run({"mget", "foo", "bar"});
+  EXPECT_THAT(Run({"slowlog", "len"}), IntArg(3));
+
+  auto resp = Run({"slowlog", "get", "3"});
+  ASSERT_THAT(resp, ArrLen(3));
+  auto len_entry = resp.GetVec()[0].GetVec();
+  auto set_entry = resp.GetVec()[2].GetVec();
+  ASSERT_EQ(7u, set_entry.size());
+  ASSERT_THAT(set_entry[3], ArrLen(3));
+  ASSERT_THAT(set_entry[6], ArrLen(10));
+  EXPECT_GT(get<int64_t>(len_entry[0].u), get<int64_t>(set_entry[0].u));
+
+  auto args = set_entry[3].GetVec();
+  EXPECT_EQ(args[0], "set");
+  EXPECT_EQ(args[2], string(128, 'x') + "... (72 more bytes)");
+  EXPECT_EQ(set_entry[6].GetVec()[0], "dispatch_wait");
+  EXPECT_EQ(set_entry[6].GetVec()[4], "queue");
+
+  EXPECT_THAT(Run({"slowlog", "get", "-1"}), ArrLen(5));
+  EXPECT_THAT(Run({"slowlog", "get", "-2"}), ErrArg("not an integer"));
+  EXPECT_THAT(Run({"slowlog", "foo"}), ErrArg("syntax error"));
+
+  absl::SetFlag(&FLAGS_slowlog_log_slower_than, -1);
+  EXPECT_EQ(Run({"slowlog", "reset"}), "OK");
+  EXPECT_THAT(Run({"slowlog", "len"}), IntArg(0));
+}
+
 TEST_F(DflyEngineTest, Hello) {
   auto resp = Run({"hello"});
   ASSERT_THAT(resp, ArrLen(12));
@@ -411,10 +719,24 @@ TEST_F(DflyEngineTest, Hello) {
                                          "proto", IntArg(2), "id", ArgType(RespExpr::INT64), "mode",
                                          "standalone", "role", "master"));
 
+  // RESP3 maps are parsed as flat arrays.
+  resp = Run({"hello", "3"});
+  ASSERT_THAT(resp, ArrLen(12));
+  EXPECT_THAT(resp.GetVec()[5], IntArg(3));
+
+  Run({"hset", "h", "f", "v"});
+  EXPECT_THAT(Run({"hgetall", "h"}), ArrLen(2));
+  Run({"zadd", "z", "1.5", "m"});
+  EXPECT_THAT(Run({"zscore", "z", "m"}), ArgType(RespExpr::DOUBLE));
+  EXPECT_THAT(Run({"get", "missing"}), ArgType(RespExpr::NIL));
+
+  resp = Run({"hello", "2"});
+  ASSERT_THAT(resp, ArrLen(12));
+  EXPECT_THAT(resp.GetVec()[5], IntArg(2));
+  EXPECT_EQ(Run({"zscore", "z", "m"}), "1.5");
+
   // These are valid arguments to HELLO, however as they are not yet supported the implementation
   // is degraded to 'unknown command'.
-  EXPECT_THAT(Run({"hello", "3"}),
-              ErrArg("ERR unknown command 'HELLO' with args beginning with: `3`"));
   EXPECT_THAT(
       Run({"hello", "2", "AUTH", "uname", "pwd"}),
       ErrArg("ERR unknown command 'HELLO' with args beginning with: `2`, `AUTH`, `uname`, `pwd`"));
@@ -453,6 +775,58 @@ TEST_F(DflyEngineTest, Memcache) {
   EXPECT_THAT(resp, ElementsAre("END"));
 }
 
+TEST_F(DflyEngineTest, MemcacheFlags) {
+  using MP = MemcacheParser;
+
+  // Enough keys to split the tables, the flags move with the entries.
+  constexpr unsigned kNum = 5000;
+  for (unsigned i = 0; i < kNum; ++i) {
+    ASSERT_THAT(RunMC(MP::SET, StrCat("key", i), "v", i % 2 ? i : 0), ElementsAre("STORED"));
+  }
+
+  // Overwriting the value replaces its flags, also if both are non-zero.
+  EXPECT_THAT(RunMC(MP::SET, "key3", "v", 7), ElementsAre("STORED"));
+  EXPECT_THAT(RunMC(MP::SET, "key5", "v", 0), ElementsAre("STORED"));
+  EXPECT_THAT(RunMC(MP::SET, "key6", "v", 8), ElementsAre("STORED"));
+
+  for (unsigned i = 7; i < kNum; ++i) {
+    unsigned flags = i % 2 ? i : 0;
+    ASSERT_THAT(RunMC(MP::GET, StrCat("key", i)),
+                ElementsAre(StrCat("VALUE key", i, " ", flags, " 1"), "v", "END"));
+  }
+  EXPECT_THAT(GetMC(MP::GET, {"key3", "key5", "key6"}),
+              ElementsAre("VALUE key3 7 1", "v", "VALUE key5 0 1", "v", "VALUE key6 8 1", "v",
+                          "END"));
+
+  // A deleted key does not leave its flags to the next one in its slot.
+  EXPECT_THAT(RunMC(MP::DELETE, "key3"), ElementsAre("DELETED"));
+  EXPECT_THAT(RunMC(MP::ADD, "key3", "v", 0), ElementsAre("STORED"));
+  EXPECT_THAT(RunMC(MP::GET, "key3"), ElementsAre("VALUE key3 0 1", "v", "END"));
+}
+
+TEST_F(DflyEngineTest, MemcacheMeta) {
+  EXPECT_THAT(RunMCLine("ms key 3 F7 Oab", "bar"), ElementsAre("HD Oab"));
+  EXPECT_THAT(RunMCLine("mg key v f s k"), ElementsAre("VA 3 f7 s3 kkey", "bar"));
+  EXPECT_THAT(RunMCLine("mg key"), ElementsAre("HD"));
+  EXPECT_THAT(RunMCLine("mg unkn v"), ElementsAre("EN"));
+  EXPECT_THAT(RunMCLine("mg unkn v q"), ElementsAre());
+  EXPECT_THAT(RunMCLine("ms key 3 ME", "foo"), ElementsAre("NS"));
+  EXPECT_THAT(RunMCLine("ms key 3 q", "foo"), ElementsAre());
+  EXPECT_THAT(RunMCLine("mg key v"), ElementsAre("VA 3", "foo"));
+
+  EXPECT_THAT(RunMCLine("ms num 1", "5"), ElementsAre("HD"));
+  EXPECT_THAT(RunMCLine("ma num D3 v"), ElementsAre("VA 1", "8"));
+  EXPECT_THAT(RunMCLine("ma num MD"), ElementsAre("HD"));
+  EXPECT_THAT(RunMCLine("ma unkn"), ElementsAre("NF"));
+
+  EXPECT_THAT(RunMCLine("md key Oxy"), ElementsAre("HD Oxy"));
+  EXPECT_THAT(RunMCLine("md key"), ElementsAre("NF"));
+  EXPECT_THAT(RunMCLine("mn"), ElementsAre("MN"));
+
+  // The classic commands are not affected.
+  EXPECT_THAT(RunMC(MP::GET, "num"), ElementsAre("VALUE num 0 1", "7", "END"));
+}
+
 TEST_F(DflyEngineTest, LimitMemory) {
   mi_option_enable(mi_option_limit_os_alloc);
   string blob(128, 'a');
@@ -462,6 +836,101 @@ TEST_F(DflyEngineTest, LimitMemory) {
   }
 }
 
+TEST_F(DflyEngineTest, MemoryStats) {
+  string blob(128, 'a');
+  for (unsigned i = 0; i < 100; ++i) {
+    Run({"set", StrCat("user:", i), blob});
+    Run({"rpush", StrCat("queue:", i), blob});
+  }
+  Run({"set", "plain", blob});
+
+  auto resp = Run({"memory", "stats"});
+  ASSERT_THAT(resp, ArrLen(12));
+  const auto& arr = resp.GetVec();
+  EXPECT_EQ(arr[0], "keys.count");
+  EXPECT_THAT(arr[1], IntArg(201));
+
+  ASSERT_EQ(arr[8], "types");
+  const auto& types = arr[9].GetVec();
+  ASSERT_GE(types.size(), 4u);
+  EXPECT_EQ(types[0], "string");
+  EXPECT_GT(get<int64_t>(types[1].u), 0);
+  EXPECT_EQ(types[2], "list");
+  EXPECT_GT(get<int64_t>(types[3].u), 0);
+
+  ASSERT_EQ(arr[10], "prefixes");
+  const auto& prefixes = arr[11].GetVec();
+  ASSERT_EQ(6u, prefixes.size());
+  vector<string_view> names{ToSV(prefixes[0].GetBuf()), ToSV(prefixes[2].GetBuf()),
+                            ToSV(prefixes[4].GetBuf())};
+  EXPECT_THAT(names, testing::UnorderedElementsAre("user", "queue", ""));
+
+  Run({"del", "plain"});
+  for (unsigned i = 0; i < 100; ++i) {
+    Run({"del", StrCat("user:", i)});
+  }
+  resp = Run({"memory", "stats"});
+  ASSERT_THAT(resp, ArrLen(12));
+  EXPECT_THAT(resp.GetVec()[9].GetVec()[1], IntArg(0));
+}
+
+TEST_F(DflyEngineTest, MemoryDoctor) {
+  string blob(128, 'a');
+  for (unsigned i = 0; i < 1000; ++i) {
+    Run({"set", StrCat("key:", i), blob});
+  }
+  for (unsigned i = 0; i < 1000; i += 2) {
+    Run({"del", StrCat("key:", i)});
+  }
+
+  string doctor = Run({"memory", "doctor"}).GetString();
+  EXPECT_THAT(doctor, HasSubstr("shard 0: committed "));
+  EXPECT_THAT(doctor, HasSubstr("process: committed "));
+  EXPECT_THAT(doctor, HasSubstr("recommendations:"));
+
+  string stats = Run({"memory", "malloc-stats", "0"}).GetString();
+  EXPECT_THAT(stats, HasSubstr("Page utilization by block size"));
+  EXPECT_THAT(stats, HasSubstr("reclaimable by defrag: "));
+}
+
+TEST_F(DflyEngineTest, BigKeys) {
+  for (unsigned i = 0; i < 50; ++i) {
+    Run({"set", StrCat("key:", i), "small"});
+  }
+  Run({"set", "big", string(100000, 'x')});
+  Run({"rpush", "list", string(1000, 'a'), string(1000, 'b')});
+
+  // The shards start a new pass once the interval passed, and report when it finished.
+  AdvanceTime(601000);
+  RespExpr resp;
+  for (unsigned i = 0; i < 2000; ++i) {
+    resp = Run({"memory", "bigkeys", "2"});
+    ASSERT_THAT(resp, ArrLen(6));
+    if (get<int64_t>(resp.GetVec()[1].u) == 0)
+      break;
+    fibers_ext::SleepFor(1ms);
+  }
+
+  const auto& arr = resp.GetVec();
+  ASSERT_THAT(arr[1], IntArg(0));
+  ASSERT_EQ(arr[4], "types");
+  const auto& types = arr[5].GetVec();
+  ASSERT_EQ(4u, types.size());
+  EXPECT_EQ(types[0], "string");
+  EXPECT_EQ(types[2], "list");
+
+  const auto& strings = types[1].GetVec();
+  ASSERT_EQ(8u, strings.size());
+  EXPECT_THAT(strings[1], IntArg(51));
+  const auto& largest = strings[5].GetVec();
+  ASSERT_EQ(2u, largest.size());
+  EXPECT_EQ(largest[0].GetVec()[0], "big");
+  EXPECT_GE(get<int64_t>(largest[0].GetVec()[2].u), 100000);
+  EXPECT_FALSE(strings[7].GetVec().empty());
+
+  EXPECT_THAT(Run({"memory", "bigkeys", "x"}), ErrArg("not an integer"));
+}
+
 TEST_F(DflyEngineTest, FlushAll) {
   auto fb0 = pp_->at(0)->LaunchFiber([&] { Run({"flushall"}); });
 
@@ -570,6 +1039,86 @@ TEST_F(DflyEngineTest, StickyEviction) {
   }
 }
 
+TEST_F(DflyEngineTest, DbMemoryQuota) {
+  EXPECT_EQ(Run({"config", "set", "db-maxmemory", "1", "1"}), "OK");
+  EXPECT_THAT(Run({"config", "set", "db-maxmemory", "100000", "1"}),
+              ErrArg("DB index is out of range"));
+  EXPECT_THAT(Run({"config", "set", "db-maxmemory", "1"}), ErrArg("wrong number"));
+
+  auto resp = Run({"config", "get", "db-maxmemory"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_EQ(resp.GetVec()[1], "1 1");
+
+  // Database 1 is over its quota, the others are not affected.
+  EXPECT_EQ(Run({"set", "foo", "bar"}), "OK");
+  Run({"select", "1"});
+  EXPECT_THAT(Run({"set", "foo", "bar"}), ErrArg("Out of mem"));
+
+  EXPECT_EQ(Run({"config", "set", "db-maxmemory", "1", "0"}), "OK");
+  EXPECT_EQ(Run({"set", "foo", "bar"}), "OK");
+}
+
+TEST_F(DflyEngineTest, ProactiveEviction) {
+  shard_set->TEST_EnableCacheMode();
+
+  string tmp_val(100, '.');
+  for (unsigned i = 0; i < 2000; ++i) {
+    ASSERT_EQ("OK", Run({"set", StrCat("key", i), tmp_val}));
+  }
+
+  for (unsigned i = 0; i < 100; ++i) {
+    string key = StrCat("sticky", i);
+    ASSERT_EQ("OK", Run({"set", key, tmp_val}));
+    ASSERT_THAT(Run({"stick", key}), IntArg(1));
+  }
+
+  atomic_uint64_t evicted{0};
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    DbSlice& db_slice = shard->db_slice();
+    size_t before = db_slice.DbSize(0);
+    db_slice.FreeMemWithEvictionStep(0, 16 << 10);
+    evicted.fetch_add(before - db_slice.DbSize(0));
+  });
+  EXPECT_GT(evicted.load(), 0u);
+
+  for (unsigned i = 0; i < 100; ++i) {
+    ASSERT_THAT(Run({"exists", StrCat("sticky", i)}), IntArg(1));
+  }
+}
+
+TEST_F(DflyEngineTest, VolatileTtlEviction) {
+  shard_set->TEST_EnableCacheMode();
+  EXPECT_THAT(Run({"config", "set", "maxmemory-policy", "foo"}), ErrArg("unknown eviction"));
+  EXPECT_EQ(Run({"config", "set", "maxmemory-policy", "volatile-ttl"}), "OK");
+  EXPECT_THAT(Run({"config", "get", "maxmemory-policy"}).GetVec(),
+              ElementsAre("maxmemory-policy", "volatile-ttl"));
+
+  string tmp_val(100, '.');
+  for (unsigned i = 0; i < 1000; ++i) {
+    ASSERT_EQ("OK", Run({"set", StrCat("persist", i), tmp_val}));
+    ASSERT_EQ("OK", Run({"set", StrCat("far", i), tmp_val, "ex", "100000"}));
+  }
+  for (unsigned i = 0; i < 300; ++i) {
+    ASSERT_EQ("OK", Run({"set", StrCat("near", i), tmp_val, "ex", "10"}));
+  }
+
+  // The keys without expiry are kept and the ones closest to expiry are evicted first.
+  shard_set->RunBriefInParallel(
+      [&](EngineShard* shard) { shard->db_slice().FreeMemWithEvictionStep(0, 2 << 10); });
+
+  unsigned near = 0;
+  for (unsigned i = 0; i < 1000; ++i) {
+    ASSERT_THAT(Run({"exists", StrCat("persist", i)}), IntArg(1));
+    ASSERT_THAT(Run({"exists", StrCat("far", i)}), IntArg(1));
+    near += i < 300 && CheckedInt({"exists", StrCat("near", i)}) == 1;
+  }
+  EXPECT_LT(near, 300u);
+
+  SliceEvents events = service_->server_family().GetMetrics().events;
+  EXPECT_EQ(300 - near, events.policy_evictions[unsigned(EvictionPolicy::VOLATILE_TTL)]);
+  EXPECT_EQ(0u, events.policy_evictions[unsigned(EvictionPolicy::ALLKEYS_LRU)]);
+}
+
 TEST_F(DflyEngineTest, PSubscribe) {
   single_response_ = false;
   auto resp = pp_->at(1)->Await([&] { return Run({"psubscribe", "a*", "b*"}); });
@@ -580,11 +1129,184 @@ TEST_F(DflyEngineTest, PSubscribe) {
   ASSERT_EQ(1, SubscriberMessagesLen("IO1"));
 
   facade::Connection::PubMessage msg = GetPublishedMessage("IO1", 0);
-  EXPECT_EQ("foo", *msg.message);
-  EXPECT_EQ("ab", msg.channel);
+  EXPECT_EQ("foo", msg.message());
+  EXPECT_EQ("ab", msg.channel());
   EXPECT_EQ("a*", msg.pattern);
 }
 
+TEST_F(DflyEngineTest, PublishSharesPayload) {
+  single_response_ = false;
+  pp_->at(1)->Await([&] { return Run({"subscribe", "chan"}); });
+  pp_->at(2)->Await([&] { return Run({"psubscribe", "c*"}); });
+  EXPECT_THAT(Run({"publish", "chan", "payload"}), IntArg(2));
+
+  ASSERT_EQ(1, SubscriberMessagesLen("IO1"));
+  ASSERT_EQ(1, SubscriberMessagesLen("IO2"));
+  facade::Connection::PubMessage msg1 = GetPublishedMessage("IO1", 0);
+  facade::Connection::PubMessage msg2 = GetPublishedMessage("IO2", 0);
+  EXPECT_EQ("chan", msg1.channel());
+  EXPECT_EQ("payload", msg1.message());
+  EXPECT_EQ("", msg1.pattern);
+  EXPECT_EQ("c*", msg2.pattern);
+
+  // Both threads received the same buffer.
+  EXPECT_EQ(msg1.buf.get(), msg2.buf.get());
+}
+
+TEST_F(DflyEngineTest, ShardedPubSub) {
+  single_response_ = false;
+  auto resp = pp_->at(1)->Await([&] { return Run({"ssubscribe", "chan", "other"}); });
+  EXPECT_THAT(resp, ArrLen(6));
+  pp_->at(2)->Await([&] { return Run({"psubscribe", "*"}); });
+
+  // Shard channels are not regular channels and the patterns do not match them.
+  EXPECT_THAT(Run({"publish", "chan", "foo"}), IntArg(0));
+  EXPECT_THAT(Run({"spublish", "chan", "bar"}), IntArg(1));
+  EXPECT_EQ(0, SubscriberMessagesLen("IO2"));
+
+  ASSERT_EQ(1, SubscriberMessagesLen("IO1"));
+  facade::Connection::PubMessage msg = GetPublishedMessage("IO1", 0);
+  EXPECT_TRUE(msg.sharded);
+  EXPECT_EQ("chan", msg.channel());
+  EXPECT_EQ("bar", msg.message());
+
+  resp = Run({"pubsub", "shardchannels"});
+  EXPECT_THAT(resp.GetVec(), UnorderedElementsAre("chan", "other"));
+  EXPECT_THAT(Run({"pubsub", "channels"}), ArrLen(0));
+
+  pp_->at(1)->Await([&] { return Run({"sunsubscribe"}); });
+  EXPECT_THAT(Run({"spublish", "chan", "bar"}), IntArg(0));
+  EXPECT_THAT(Run({"pubsub", "shardchannels"}), ArrLen(0));
+}
+
+TEST_F(DflyEngineTest, ClientTracking) {
+  EXPECT_THAT(Run({"client", "tracking", "on"}), ErrArg("requires RESP3"));
+
+  pp_->at(1)->Await([&] {
+    Run({"hello", "3"});
+    EXPECT_EQ(Run({"client", "tracking", "on"}), "OK");
+    Run({"get", "foo"});
+  });
+
+  // Keys that were not read are not reported.
+  Run({"set", "bar", "1"});
+  Run({"set", "foo", "1"});
+  for (unsigned i = 0; i < 100 && SubscriberMessagesLen("IO1") == 0; ++i) {
+    fibers_ext::SleepFor(1ms);
+  }
+  ASSERT_EQ(1, SubscriberMessagesLen("IO1"));
+  facade::Connection::PubMessage msg = GetPublishedMessage("IO1", 0);
+  ASSERT_TRUE(msg.invalidated_keys);
+  EXPECT_THAT(*msg.invalidated_keys, ElementsAre("foo"));
+
+  // The key is forgotten after the invalidation.
+  Run({"set", "foo", "2"});
+  fibers_ext::SleepFor(10ms);
+  EXPECT_EQ(1, SubscriberMessagesLen("IO1"));
+
+  pp_->at(1)->Await([&] {
+    EXPECT_EQ(Run({"client", "tracking", "on", "bcast", "prefix", "f"}), "OK");
+  });
+  Run({"set", "bar", "2"});
+  Run({"del", "foo"});
+  for (unsigned i = 0; i < 100 && SubscriberMessagesLen("IO1") == 1; ++i) {
+    fibers_ext::SleepFor(1ms);
+  }
+  ASSERT_EQ(2, SubscriberMessagesLen("IO1"));
+  msg = GetPublishedMessage("IO1", 1);
+  EXPECT_THAT(*msg.invalidated_keys, ElementsAre("foo"));
+
+  auto resp = pp_->at(1)->Await([&] { return Run({"client", "tracking", "off"}); });
+  EXPECT_EQ(resp, "OK");
+  EXPECT_EQ(0u, service_->server_family().GetMetrics().tracking_stats.clients);
+}
+
+TEST_F(DflyEngineTest, KeyspaceNotifications) {
+  EXPECT_THAT(Run({"config", "set", "notify-keyspace-events", "Kq"}),
+              ErrArg("Invalid event class"));
+  EXPECT_EQ(Run({"config", "set", "notify-keyspace-events", "KEA"}), "OK");
+  EXPECT_THAT(Run({"config", "get", "notify-keyspace-events"}).GetVec(),
+              ElementsAre("notify-keyspace-events", "AKE"));
+
+  single_response_ = false;
+  pp_->at(1)->Await([&] { return Run({"subscribe", "__keyevent@0__:del"}); });
+  pp_->at(2)->Await([&] { return Run({"psubscribe", "__keyspace@0__:*"}); });
+
+  Run({"set", "foo", "1"});
+  Run({"hset", "h", "f", "v"});
+  Run({"del", "foo"});
+  auto wait_messages = [&](string_view conn_id, size_t len) {
+    for (unsigned i = 0; i < 100 && SubscriberMessagesLen(conn_id) < len; ++i) {
+      fibers_ext::SleepFor(1ms);
+    }
+    return SubscriberMessagesLen(conn_id);
+  };
+
+  ASSERT_EQ(1, wait_messages("IO1", 1));
+  facade::Connection::PubMessage msg = GetPublishedMessage("IO1", 0);
+  EXPECT_EQ("__keyevent@0__:del", msg.channel());
+  EXPECT_EQ("foo", msg.message());
+  EXPECT_EQ("", msg.pattern);
+
+  // The events of a key are ordered, the keys of different shards are not.
+  ASSERT_EQ(3, wait_messages("IO2", 3));
+  vector<pair<string, string>> events;
+  for (size_t i = 0; i < 3; ++i) {
+    msg = GetPublishedMessage("IO2", i);
+    EXPECT_EQ("__keyspace@0__:*", msg.pattern);
+    events.emplace_back(msg.channel(), msg.message());
+  }
+  EXPECT_THAT(events, UnorderedElementsAre(Pair("__keyspace@0__:foo", "set"),
+                                           Pair("__keyspace@0__:h", "hset"),
+                                           Pair("__keyspace@0__:foo", "del")));
+
+  EXPECT_EQ(Run({"config", "set", "notify-keyspace-events", ""}), "OK");
+  Run({"set", "foo", "2"});
+  fibers_ext::SleepFor(10ms);
+  EXPECT_EQ(3, SubscriberMessagesLen("IO2"));
+  EXPECT_EQ(3u, service_->server_family().GetMetrics().keyspace_events_stats.events);
+}
+
+TEST_F(DflyEngineTest, Wait) {
+  EXPECT_THAT(Run({"wait", "1", "x"}), ErrArg("not an integer"));
+
+  // Without replicas WAIT replies with 0, right away or once its timeout passes.
+  Run({"set", "foo", "bar"});
+  EXPECT_THAT(Run({"wait", "0", "0"}), IntArg(0));
+  EXPECT_THAT(Run({"wait", "1", "10"}), IntArg(0));
+
+  Run({"multi"});
+  Run({"wait", "1", "0"});
+  EXPECT_THAT(Run({"exec"}), IntArg(0));
+}
+
+TEST_F(DflyEngineTest, RelaxedReads) {
+  Run({"mset", "a", "1", "b", "2", "c", "3", "d", "4", "e", "5", "f", "6"});
+  auto relaxed_runs = [&] {
+    return service_->server_family().GetMetrics().shard_stats.relaxed_runs;
+  };
+
+  EXPECT_THAT(Run({"client", "readmode", "fast"}), ErrArg("syntax error"));
+  EXPECT_EQ(Run({"client", "readmode", "relaxed"}), "OK");
+
+  auto resp = Run({"mget", "a", "b", "c", "d", "e", "f", "g"});
+  ASSERT_THAT(resp, ArrLen(7));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("1", "2", "3", "4", "5", "6", ArgType(RespExpr::NIL)));
+  EXPECT_EQ(6, CheckedInt({"exists", "a", "b", "c", "d", "e", "f", "g"}));
+  uint64_t runs = relaxed_runs();
+  EXPECT_GT(runs, 0u);
+
+  // Writes and single shard reads are scheduled as usual.
+  Run({"mset", "a", "10", "f", "60"});
+  EXPECT_EQ(Run({"get", "a"}), "10");
+  EXPECT_EQ(runs, relaxed_runs());
+
+  EXPECT_EQ(Run({"client", "readmode", "strict"}), "OK");
+  resp = Run({"mget", "a", "b", "c", "d", "e", "f"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("10", "2", "3", "4", "5", "60"));
+  EXPECT_EQ(runs, relaxed_runs());
+}
+
 TEST_F(DflyEngineTest, Unsubscribe) {
   auto resp = Run({"unsubscribe", "a"});
   EXPECT_THAT(resp.GetVec(), ElementsAre("unsubscribe", "a", IntArg(0)));
@@ -708,6 +1430,18 @@ TEST_F(DflyEngineTest, Watch) {
   Run({"select", "0"});
   Run({"multi"});
   ASSERT_THAT(Run({"exec"}), kExecSuccess);
+
+  // Check a key that is added and deleted again after WATCH.
+  Run({"watch", "d"});
+  Run({"set", "d", "1"});
+  Run({"del", "d"});
+  Run({"multi"});
+  ASSERT_THAT(Run({"exec"}), kExecFail);
+
+  // Check a key that stayed missing.
+  Run({"watch", "d"});
+  Run({"multi"});
+  ASSERT_THAT(Run({"exec"}), kExecSuccess);
 }
 
 TEST_F(DflyEngineTest, Bug468) {
@@ -726,6 +1460,25 @@ TEST_F(DflyEngineTest, Bug468) {
   ASSERT_FALSE(service_->IsLocked(0, "foo"));
 }
 
+TEST_F(DflyEngineTest, PipelineSquash) {
+  StringVec lines = RunPipeline({{"set", "a", "1"},
+                                 {"set", "b", "2"},
+                                 {"get", "a"},
+                                 {"incr", "a"},
+                                 {"mget", "a", "b"},
+                                 {"select", "1"},
+                                 {"get", "a"},
+                                 {"set", "a", "3"},
+                                 {"select", "0"},
+                                 {"get", "a"}});
+  EXPECT_THAT(lines, ElementsAre("+OK", "+OK", "$1", "1", ":2", "*2", "$1", "2", "$1", "2", "+OK",
+                                 "$-1", "+OK", "+OK", "$1", "2"));
+
+  // Commands in MULTI are queued, hence they are not squashed.
+  lines = RunPipeline({{"multi"}, {"set", "a", "4"}, {"get", "a"}, {"exec"}});
+  EXPECT_THAT(lines, ElementsAre("+OK", "+QUEUED", "+QUEUED", "*2", "+OK", "$1", "4"));
+}
+
 TEST_F(DflyEngineTest, Bug496) {
   shard_set->pool()->AwaitFiberOnAll([&](unsigned index, ProactorBase* base) {
     EngineShard* shard = EngineShard::tlocal();
@@ -821,6 +1574,686 @@ TEST_F(DefragDflyEngineTest, TestDefragOption) {
   });
 }
 
+TEST_F(DflyEngineTest, MigrateConnections) {
+  absl::FlagSaver saver;
+  absl::SetFlag(&FLAGS_migrate_connections, 4);
+
+  string key1, other;
+  for (unsigned i = 0; key1.empty() || other.empty(); ++i) {
+    string key = StrCat("key", i);
+    ShardId sid = Shard(key, shard_set->size());
+    if (sid == 1 && key1.empty())
+      key1 = key;
+    else if (sid > 1 && other.empty())
+      other = key;
+  }
+
+  // A command on another shard outvotes one of the shard.
+  for (unsigned i = 0; i < 3; ++i) {
+    Run({"get", key1});
+  }
+  Run({"get", other});
+  Run({"get", key1});
+  EXPECT_EQ(nullptr, GetMigrationRequest("IO0"));
+
+  Run({"get", key1});
+  EXPECT_EQ(pp_->at(1), GetMigrationRequest("IO0"));
+
+  // In the thread of the shard the commands run without hopping.
+  uint64_t inline_hops = service_->server_family().GetMetrics().shard_stats.inline_hops;
+  pp_->at(1)->Await([&] {
+    for (unsigned i = 0; i < 4; ++i) {
+      EXPECT_EQ(Run({"set", key1, "1"}), "OK");
+    }
+  });
+  EXPECT_EQ(nullptr, GetMigrationRequest("IO1"));
+  EXPECT_EQ(inline_hops + 4, service_->server_family().GetMetrics().shard_stats.inline_hops);
+}
+
+TEST_F(DflyEngineTest, HashTags) {
+  EXPECT_EQ("user:42", KeyTag("{user:42}:profile"));
+  EXPECT_EQ("a", KeyTag("x{a}{b}"));
+  EXPECT_EQ("{}a", KeyTag("{}a"));
+  EXPECT_EQ("x{a", KeyTag("x{a"));
+
+  string key1, key2;
+  for (unsigned i = 0; key2.empty(); ++i) {
+    string key = StrCat("{user:42}:", i);
+    if (key1.empty())
+      key1 = key;
+    else if (Shard(key, shard_set->size()) != Shard(key1, shard_set->size()))
+      key2 = key;
+  }
+
+  shard_by_hashtag = true;
+  EXPECT_EQ(Shard(key1, shard_set->size()), Shard(key2, shard_set->size()));
+
+  Run({"sadd", key1, "a", "b"});
+  Run({"sadd", key2, "b", "c"});
+  EXPECT_EQ(1, CheckedInt({"sinterstore", "{user:42}:dest", key1, key2}));
+  EXPECT_EQ(Run({"rename", key1, "{user:42}:renamed"}), "OK");
+  EXPECT_EQ(2, CheckedInt({"scard", "{user:42}:renamed"}));
+  Run({"rpush", "{user:42}:list", "x"});
+  EXPECT_EQ(Run({"lmove", "{user:42}:list", "{user:42}:other", "LEFT", "RIGHT"}), "x");
+  shard_by_hashtag = false;
+}
+
+// The large values are read in many slices, and the keys stay consistent in between.
+TEST_F(DflyEngineTest, SlicedReads) {
+  absl::FlagSaver saver;
+  absl::SetFlag(&FLAGS_shard_slice_usec, 1);
+
+  vector<vector<string>> cmds{{"hset", "hash"}, {"rpush", "list"}, {"sadd", "s1"}, {"sadd", "s2"}};
+  for (unsigned i = 0; i < 5000; ++i) {
+    cmds[0].push_back(StrCat("f", i));
+    cmds[0].push_back(StrCat("v", i));
+    cmds[1].push_back(StrCat("e", i));
+    cmds[2 + i % 2].push_back(StrCat("m", i % 3000));
+  }
+  for (const auto& cmd : cmds) {
+    vector<string_view> sv_args(cmd.begin(), cmd.end());
+    Run(absl::MakeSpan(sv_args));
+  }
+
+  EXPECT_THAT(Run({"hgetall", "hash"}), ArrLen(10000));
+  EXPECT_THAT(Run({"hkeys", "hash"}), ArrLen(5000));
+  auto resp = Run({"lrange", "list", "0", "-1"});
+  ASSERT_THAT(resp, ArrLen(5000));
+  EXPECT_EQ("e0", resp.GetVec()[0].GetString());
+  EXPECT_EQ("e4999", resp.GetVec()[4999].GetString());
+  EXPECT_THAT(Run({"lrange", "list", "100", "-4001"}), ArrLen(900));
+  EXPECT_THAT(Run({"smembers", "s1"}), ArrLen(2500));
+  EXPECT_THAT(Run({"sunion", "s1", "s2", "missing"}), ArrLen(3000));
+  EXPECT_THAT(Run({"sunion", "s1", "hash"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"hgetall", "missing"}), ArrLen(0));
+
+  Metrics metrics = service_->server_family().GetMetrics();
+  EXPECT_GT(metrics.shard_stats.slice_yields, 0u);
+  EXPECT_GT(metrics.shard_stats.max_slice_usec, 0u);
+}
+
+// The large replies are serialized and sent in chunks of about --reply_chunk_kb.
+TEST_F(DflyEngineTest, StreamedReplies) {
+  absl::FlagSaver saver;
+  absl::SetFlag(&FLAGS_reply_chunk_kb, 1);
+
+  string value(100, 'v');
+  vector<vector<string>> cmds{{"hset", "hash"}, {"rpush", "list"}, {"sadd", "set"},
+                              {"saddex", "ttlset", "100"}};
+  for (unsigned i = 0; i < 3000; ++i) {
+    cmds[0].push_back(StrCat("f", i));
+    cmds[0].push_back(StrCat(value, i));
+    cmds[1].push_back(i % 2 ? StrCat(value, i) : StrCat(i));
+    cmds[2].push_back(StrCat(value, i));
+    cmds[3].push_back(StrCat("m", i));
+  }
+  for (const auto& cmd : cmds) {
+    vector<string_view> sv_args(cmd.begin(), cmd.end());
+    Run(absl::MakeSpan(sv_args));
+  }
+
+  auto resp = Run({"hgetall", "hash"});
+  ASSERT_THAT(resp, ArrLen(6000));
+  for (unsigned i = 0; i < 6000; i += 2) {
+    string field = resp.GetVec()[i].GetString();
+    ASSERT_EQ('f', field[0]);
+    ASSERT_EQ(StrCat(value, field.substr(1)), resp.GetVec()[i + 1].GetString());
+  }
+  EXPECT_THAT(Run({"hvals", "hash"}), ArrLen(3000));
+
+  resp = Run({"lrange", "list", "0", "-1"});
+  ASSERT_THAT(resp, ArrLen(3000));
+  EXPECT_EQ("0", resp.GetVec()[0].GetString());
+  EXPECT_EQ(StrCat(value, 2999), resp.GetVec()[2999].GetString());
+  resp = Run({"lrange", "list", "-1002", "-1001"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_EQ("1998", resp.GetVec()[0].GetString());
+
+  resp = Run({"smembers", "set"});
+  ASSERT_THAT(resp, ArrLen(3000));
+  vector<string> members;
+  for (const auto& member : resp.GetVec())
+    members.push_back(member.GetString());
+  sort(members.begin(), members.end());
+  EXPECT_EQ(members.end(), unique(members.begin(), members.end()));
+  EXPECT_THAT(Run({"smembers", "ttlset"}), ArrLen(3000));
+
+  Run({"expire", "hash", "100"});
+  EXPECT_THAT(Run({"hkeys", "hash"}), ArrLen(3000));
+  EXPECT_THAT(Run({"lrange", "missing", "0", "-1"}), ArrLen(0));
+  EXPECT_THAT(Run({"smembers", "hash"}), ErrArg("WRONGTYPE"));
+
+  Metrics metrics = service_->server_family().GetMetrics();
+  EXPECT_GT(metrics.shard_stats.slice_yields, 0u);
+}
+
+TEST_F(DflyEngineTest, HotKeys) {
+  // One access out of 100 is sampled by default.
+  Run({"set", "hot", "1"});
+  for (unsigned i = 0; i < 5000; ++i) {
+    string key = i % 50 ? "hot" : StrCat("cold", i);
+    Run({"get", key});
+  }
+
+  auto resp = Run({"debug", "hotkeys", "1"});
+  ASSERT_THAT(resp, ArrLen(1));
+  const auto& top = resp.GetVec()[0].GetVec();
+  ASSERT_EQ(4, top.size());
+  EXPECT_EQ("hot", top[0].GetString());
+  EXPECT_THAT(top[1], IntArg(0));
+  EXPECT_GT(stod(top[2].GetString()), 0);
+
+  EXPECT_THAT(Run({"debug", "hotkeys", "0"}), ErrArg("out of range"));
+}
+
+TEST_F(DflyEngineTest, PublishedStats) {
+  auto publish = [this] {
+    pp_->AwaitFiberOnAll([](ProactorBase* pb) { ServerState::tlocal()->PublishStats(); });
+    return ServerState::GetPublishedStats();
+  };
+  auto sum = [](atomic_uint64_t EngineShardSet::CachedStats::*field) {
+    uint64_t res = 0;
+    for (const auto& stats : EngineShardSet::GetCachedStats())
+      res += (stats.*field).load(memory_order_relaxed);
+    return res;
+  };
+
+  uint64_t command_cnt = publish().command_cnt;
+  shard_set->TEST_EnableHeartBeat();
+  for (unsigned i = 0; i < 10; ++i) {
+    Run({"set", StrCat("key", i), "bar"});
+  }
+  Run({"get", "missing"});
+
+  for (unsigned i = 0; i < 1000 && sum(&EngineShardSet::CachedStats::misses) == 0; ++i) {
+    fibers_ext::SleepFor(1ms);
+  }
+  EXPECT_EQ(10, sum(&EngineShardSet::CachedStats::keys));
+  EXPECT_EQ(1, sum(&EngineShardSet::CachedStats::misses));
+  EXPECT_GE(sum(&EngineShardSet::CachedStats::tx_runs), 11);
+  EXPECT_EQ(command_cnt + 11, publish().command_cnt);
+}
+
+TEST_F(DflyEngineTest, PublishedDbSize) {
+  for (unsigned i = 0; i < 100; ++i) {
+    Run({"set", StrCat("key", i), "bar"});
+  }
+  Run({"pexpire", "key0", "10"});
+  EXPECT_EQ(100, CheckedInt({"dbsize"}));
+  EXPECT_EQ(100, EngineShardSet::DbSize(0));
+
+  Run({"select", "1"});
+  Run({"set", "key", "bar"});
+  EXPECT_EQ(1, CheckedInt({"dbsize"}));
+  Run({"select", "0"});
+
+  Run({"del", "key1", "key2"});
+  AdvanceTime(20);
+  EXPECT_EQ(0, CheckedInt({"exists", "key0"}));
+  EXPECT_EQ(97, CheckedInt({"dbsize"}));
+
+  // The keys of INFO KEYSPACE are exact as well, without a heartbeat.
+  string info = Run({"info", "keyspace"}).GetString();
+  EXPECT_THAT(info, HasSubstr("db0:keys=97,"));
+  EXPECT_THAT(info, HasSubstr("db1:keys=1,"));
+
+  Run({"flushdb", "sync"});
+  EXPECT_EQ(0, CheckedInt({"dbsize"}));
+  EXPECT_EQ(1, EngineShardSet::DbSize(1));
+}
+
+TEST_F(DflyEngineTest, ShardSaturation) {
+  auto sum = [](atomic_uint64_t EngineShardSet::CachedStats::*field) {
+    uint64_t res = 0;
+    for (const auto& stats : EngineShardSet::GetCachedStats())
+      res += (stats.*field).load(memory_order_relaxed);
+    return res;
+  };
+
+  shard_set->TEST_EnableHeartBeat();
+  for (unsigned i = 0; i < 10; ++i) {
+    Run({"mset", StrCat("a", i), "1", StrCat("b", i), "2", StrCat("c", i), "3"});
+    Run({"set", StrCat("key", i), "bar"});
+  }
+
+  // Multi-shard transactions always pass through the transaction queues.
+  for (unsigned i = 0; i < 1000 && sum(&EngineShardSet::CachedStats::txq_max_len) == 0; ++i) {
+    fibers_ext::SleepFor(1ms);
+  }
+  EXPECT_GE(sum(&EngineShardSet::CachedStats::txq_max_len), 1);
+  EXPECT_GT(sum(&EngineShardSet::CachedStats::busy_usec), 0);
+
+  string info = Run({"info", "shards"}).GetString();
+  EXPECT_THAT(info, HasSubstr("# Shards"));
+  EXPECT_THAT(info, HasSubstr("shard0:txq_len="));
+  EXPECT_THAT(info, HasSubstr(",avg_hop_wait_usec="));
+  EXPECT_THAT(info, HasSubstr(",heartbeat="));
+  EXPECT_THAT(Run({"info"}).GetString(), Not(HasSubstr("# Shards")));
+}
+
+TEST_F(DflyEngineTest, ShedOverloaded) {
+  absl::FlagSaver saver;
+  shard_set->TEST_EnableHeartBeat();
+
+  vector<string> keys;
+  for (unsigned i = 0; keys.size() < 5; ++i) {
+    string key = StrCat("key", i);
+    if (Shard(key, shard_set->size()) == 0)
+      keys.push_back(key);
+  }
+
+  // Blocks the queue of shard 0, hence the hops into it pile up in its ring.
+  fibers_ext::Done release;
+  shard_set->Add(0, [&] { release.Wait(); });
+
+  vector<boost::fibers::fiber> fibers;
+  for (unsigned i = 0; i < 4; ++i) {
+    fibers.push_back(pp_->at(1)->LaunchFiber([&, i] {
+      string_view args[] = {"set", keys[i], "1"};
+      EXPECT_EQ(Run(StrCat("conn", i), ArgSlice{args}), "OK");
+    }));
+  }
+
+  const auto& shard0 = EngineShardSet::GetCachedStats()[0];
+  for (unsigned i = 0; i < 1000 && shard0.hop_backlog.load() < 3; ++i) {
+    fibers_ext::SleepFor(1ms);
+  }
+  EXPECT_GE(shard0.hop_backlog.load(), 3u);
+
+  absl::SetFlag(&FLAGS_shed_queue_len, 2);
+  EXPECT_THAT(Run({"set", keys[4], "2"}), ErrArg("LOADSHED"));
+  EXPECT_EQ(Run({"ping"}), "PONG");
+  EXPECT_THAT(Run({"info", "stats"}).GetString(), HasSubstr("total_shed_commands:1"));
+
+  release.Notify();
+  for (auto& fb : fibers)
+    fb.join();
+}
+
+TEST_F(DflyEngineTest, ThrottleClients) {
+  absl::FlagSaver saver;
+  absl::SetFlag(&FLAGS_client_ops_limit, 100);  // with bursts of 10 commands.
+
+  auto start = chrono::steady_clock::now();
+  for (unsigned i = 0; i < 30; ++i) {
+    EXPECT_EQ(Run({"set", "key", "val"}), "OK");
+  }
+  EXPECT_GE(chrono::steady_clock::now() - start, 150ms);
+
+  // INFO is a control command, which is never throttled.
+  string info = Run({"info", "stats"}).GetString();
+  EXPECT_THAT(info, HasSubstr("total_throttled_commands:"));
+  EXPECT_THAT(info, Not(HasSubstr("total_throttled_commands:0\r")));
+
+  // Another connection has a budget of its own.
+  string_view args[] = {"get", "key"};
+  start = chrono::steady_clock::now();
+  EXPECT_EQ(Run("other", ArgSlice{args}), "val");
+  EXPECT_LT(chrono::steady_clock::now() - start, 50ms);
+}
+
+TEST_F(DflyEngineTest, HandoffTakeoverAndAbort) {
+  EXPECT_THAT(Run({"handoff", "done"}), ErrArg("no handoff in progress"));
+  EXPECT_THAT(Run({"handoff", "start"}), IntArg(6379));
+
+  // No replica runs, hence no shard journal is open.
+  auto resp = Run({"handoff", "takeover"});
+  ASSERT_THAT(resp, ArrLen(shard_set->pool()->size()));
+  EXPECT_THAT(resp.GetVec()[0], IntArg(0));
+  EXPECT_THAT(Run({"set", "key", "val"}), ErrArg("READONLY"));
+  EXPECT_EQ(Run({"ping"}), "PONG");
+
+  EXPECT_EQ(Run({"handoff", "abort"}), "OK");
+  EXPECT_EQ(Run({"set", "key", "val"}), "OK");
+  EXPECT_THAT(Run({"handoff", "bogus"}), ErrArg("Unknown subcommand"));
+}
+
+TEST_F(DflyEngineTest, AdaptiveHeartbeatScale) {
+  using HB = EngineShard::HeartbeatSignals;
+  double scale = 1;
+
+  HB steady;
+  steady.busy_permille = 300;
+  steady.avg_hop_wait_usec = 10;
+  steady.tx_runs = 100;
+
+  // Debt with spare cpu boosts up to 8.
+  HB debt = steady;
+  debt.debt = true;
+  EXPECT_EQ(EngineShard::HB_BOOST, EngineShard::AdaptHeartbeatScale(debt, &scale));
+  EXPECT_EQ(2, scale);
+  for (unsigned i = 0; i < 5; ++i)
+    EngineShard::AdaptHeartbeatScale(debt, &scale);
+  EXPECT_EQ(8, scale);
+
+  // Latency pressure halves the scale, but not below 1 with debt.
+  HB slow = debt;
+  slow.avg_hop_wait_usec = 5000;
+  EXPECT_EQ(EngineShard::HB_LATENCY_BACKOFF, EngineShard::AdaptHeartbeatScale(slow, &scale));
+  EXPECT_EQ(4, scale);
+  for (unsigned i = 0; i < 5; ++i)
+    EngineShard::AdaptHeartbeatScale(slow, &scale);
+  EXPECT_EQ(1, scale);
+
+  // An idle shard backs off down to 1/4.
+  HB idle;
+  for (unsigned i = 0; i < 5; ++i)
+    EXPECT_EQ(EngineShard::HB_IDLE_BACKOFF, EngineShard::AdaptHeartbeatScale(idle, &scale));
+  EXPECT_EQ(0.25, scale);
+
+  // Otherwise the scale returns to 1.
+  EXPECT_EQ(EngineShard::HB_STEADY, EngineShard::AdaptHeartbeatScale(steady, &scale));
+  EXPECT_EQ(0.5, scale);
+  EngineShard::AdaptHeartbeatScale(steady, &scale);
+  EngineShard::AdaptHeartbeatScale(steady, &scale);
+  EXPECT_EQ(1, scale);
+}
+
+TEST_F(DflyEngineTest, ReadsWhileLoading) {
+  absl::FlagSaver saver;
+  string loaded, loading;
+  for (unsigned i = 0; loaded.empty() || loading.empty(); ++i) {
+    string key = StrCat("key", i);
+    if (Shard(key, shard_set->size()) == 0)
+      loaded = key;
+    else
+      loading = key;
+  }
+  Run({"mset", loaded, "1", loading, "2"});
+
+  for (ShardId sid = 1; sid < shard_set->size(); ++sid) {
+    EngineShardSet::SetLoading(sid, true);
+  }
+  service_->SwitchState(GlobalState::ACTIVE, GlobalState::LOADING);
+
+  EXPECT_THAT(Run({"get", loaded}), ErrArg("LOADING"));
+  absl::SetFlag(&FLAGS_loading_reads, "per_shard");
+  EXPECT_EQ(Run({"get", loaded}), "1");
+  EXPECT_THAT(Run({"get", loading}), ErrArg("LOADING"));
+  EXPECT_THAT(Run({"mget", loaded, loading}), ErrArg("LOADING"));
+  EXPECT_THAT(Run({"scan", "0"}), ErrArg("LOADING"));
+  EXPECT_THAT(Run({"set", loaded, "3"}), ErrArg("LOADING"));
+
+  absl::SetFlag(&FLAGS_loading_reads, "nil");
+  EXPECT_EQ(Run({"get", loading}), "2");
+  EXPECT_THAT(Run({"set", loaded, "3"}), ErrArg("LOADING"));
+
+  for (ShardId sid = 1; sid < shard_set->size(); ++sid) {
+    EngineShardSet::SetLoading(sid, false);
+  }
+  service_->SwitchState(GlobalState::LOADING, GlobalState::ACTIVE);
+}
+
+TEST_F(DflyEngineTest, MonitorFilterErrors) {
+  EXPECT_THAT(Run({"monitor", "cmd"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"monitor", "limit", "1"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"monitor", "db", "x"}), ErrArg("not an integer"));
+  EXPECT_THAT(Run({"monitor", "client", "-1"}), ErrArg("not an integer"));
+  EXPECT_THAT(Run({"monitor", "sample", "0"}), ErrArg("not a valid float"));
+  EXPECT_THAT(Run({"monitor", "match", "a*", "sample", "1.5"}), ErrArg("not a valid float"));
+}
+
+TEST_F(DflyEngineTest, PopulateTypes) {
+  EXPECT_EQ(Run({"debug", "populate", "100", "h", "10", "type", "hash", "elements", "5"}), "OK");
+  EXPECT_EQ(Run({"debug", "populate", "100", "s", "10", "rand", "type", "set", "elements", "3"}),
+            "OK");
+  EXPECT_EQ(Run({"debug", "populate", "100", "z", "0", "type", "zset", "elements", "4"}), "OK");
+  EXPECT_EQ(Run({"debug", "populate", "100", "l", "0", "type", "list", "elements", "2"}), "OK");
+  EXPECT_EQ(Run({"debug", "populate", "100", "j", "0", "type", "json", "elements", "2"}), "OK");
+  EXPECT_EQ(Run({"debug", "populate", "100"}), "OK");
+  EXPECT_EQ(600, CheckedInt({"dbsize"}));
+
+  EXPECT_EQ(5, CheckedInt({"hlen", "h:7"}));
+  EXPECT_EQ(Run({"hget", "h:7", "field:1"}), "value:1xxx");
+  EXPECT_EQ(3, CheckedInt({"scard", "s:99"}));
+  EXPECT_EQ(4, CheckedInt({"zcard", "z:0"}));
+  EXPECT_EQ(Run({"zscore", "z:0", "member:3"}), "3");
+  EXPECT_EQ(Run({"lindex", "l:50", "1"}), "value:1");
+  EXPECT_EQ(Run({"type", "j:3"}), "ReJSON-RL");
+  EXPECT_EQ(Run({"get", "key:42"}), "value:42");
+
+  EXPECT_THAT(Run({"debug", "populate", "10", "k", "0", "type", "stream"}), ErrArg("syntax"));
+  EXPECT_THAT(Run({"debug", "populate", "10", "k", "0", "elements", "0"}), ErrArg("out of range"));
+
+  // The keys exist with another type.
+  EXPECT_THAT(Run({"debug", "populate", "10", "h", "0", "type", "set"}),
+              ErrArg("10 keys could not be populated"));
+}
+
+class TieredStorageTest : public DflyEngineTest {
+ protected:
+  TieredStorageTest() : DflyEngineTest() {
+    num_threads_ = 1;
+  }
+
+  void SetUp() override {
+    string base = (filesystem::temp_directory_path() / StrCat("tiered_test_", getpid())).string();
+    prefixes_ = {base + "-a", base + "-b"};
+    absl::SetFlag(&FLAGS_backing_prefix, prefixes_);
+    DflyEngineTest::SetUp();
+  }
+
+  void TearDown() override {
+    DflyEngineTest::TearDown();
+    absl::SetFlag(&FLAGS_backing_prefix, vector<string>{});
+    for (const string& prefix : prefixes_)
+      filesystem::remove(prefix + "-0000.ssd");
+  }
+
+  // Large enough to be written by itself rather than in a shared page.
+  static string Value(unsigned i, size_t len = 4096) {
+    string res = StrCat(i, ":");
+    for (size_t j = res.size(); j < len; ++j)
+      res.push_back('a' + (i + j) % 26);
+    return res;
+  }
+
+  size_t ExternalEntries() {
+    return service_->server_family().GetMetrics().db[0].external_entries;
+  }
+
+  // The values are offloaded once their writes complete.
+  void WaitForOffload(size_t count) {
+    for (unsigned i = 0; i < 1000 && ExternalEntries() < count; ++i)
+      fibers_ext::SleepFor(1ms);
+    ASSERT_EQ(count, ExternalEntries());
+  }
+
+  TieredStats GetTieredStats() {
+    return service_->server_family().GetMetrics().tiered_stats;
+  }
+
+  vector<string> prefixes_;
+};
+
+// The shard callbacks only submit the reads of the offloaded values, the replies wait for them
+// after the hop.
+TEST_F(TieredStorageTest, ReadAsync) {
+  constexpr unsigned kKeys = 8;
+
+  vector<string> args{"mset"};
+  for (unsigned i = 0; i < kKeys; ++i) {
+    args.push_back(StrCat("key", i));
+    args.push_back(Value(i));
+  }
+  vector<string_view> sv_args(args.begin(), args.end());
+  ASSERT_EQ(Run(ArgSlice{sv_args}), "OK");
+  WaitForOffload(kKeys);
+
+  for (unsigned i = 0; i < kKeys; ++i)
+    EXPECT_EQ(Run({"get", StrCat("key", i)}), Value(i)) << i;
+  EXPECT_GE(GetTieredStats().external_reads, kKeys);
+
+  auto resp = Run({"mget", "key1", "missing", "key2"});
+  ASSERT_THAT(resp, ArrLen(3));
+  EXPECT_EQ(resp.GetVec()[0], Value(1));
+  EXPECT_THAT(resp.GetVec()[1], ArgType(RespExpr::NIL));
+  EXPECT_EQ(resp.GetVec()[2], Value(2));
+
+  // Concurrent reads of the same and of different values.
+  vector<RespExpr> replies(2 * kKeys);
+  vector<fibers_ext::Fiber> fibers;
+  for (unsigned i = 0; i < replies.size(); ++i) {
+    fibers.push_back(pp_->at(0)->LaunchFiber([&, i] {
+      replies[i] = Run(StrCat("conn", i), {"get", StrCat("key", i % kKeys)});
+    }));
+  }
+  for (auto& fb : fibers)
+    fb.Join();
+  for (unsigned i = 0; i < replies.size(); ++i)
+    EXPECT_EQ(replies[i], Value(i % kKeys)) << i;
+
+  // The values that are overridden or deleted right after their reads are submitted.
+  fibers.clear();
+  fibers.push_back(pp_->at(0)->LaunchFiber([&] { replies[0] = Run("reader", {"get", "key3"}); }));
+  EXPECT_EQ(Run({"set", "key3", "small"}), "OK");
+  EXPECT_THAT(Run({"del", "key4"}), IntArg(1));
+  fibers.back().Join();
+  EXPECT_THAT(replies[0], testing::AnyOf(Value(3), "small"));
+  EXPECT_EQ(Run({"get", "key3"}), "small");
+  EXPECT_THAT(Run({"get", "key4"}), ArgType(RespExpr::NIL));
+  EXPECT_EQ(kKeys - 2, ExternalEntries());
+}
+
+// The values read often enough are loaded back into memory by the heartbeat, the others stay
+// offloaded.
+TEST_F(TieredStorageTest, PromoteHotValues) {
+  absl::SetFlag(&FLAGS_tiered_promote_threshold, 2);
+  max_memory_limit = 1 << 30;
+
+  ASSERT_EQ(Run({"set", "hot", Value(0)}), "OK");
+  ASSERT_EQ(Run({"set", "cold", Value(1)}), "OK");
+  WaitForOffload(2);
+
+  for (unsigned i = 0; i < 3; ++i)
+    EXPECT_EQ(Run({"get", "hot"}), Value(0));
+  EXPECT_EQ(Run({"get", "cold"}), Value(1));
+
+  shard_set->TEST_EnableHeartBeat();
+  for (unsigned i = 0; i < 1000 && GetTieredStats().promotions == 0; ++i)
+    fibers_ext::SleepFor(1ms);
+  EXPECT_EQ(1u, GetTieredStats().promotions);
+  EXPECT_EQ(1u, ExternalEntries());
+
+  // The promoted value is served from memory.
+  size_t reads = GetTieredStats().external_reads;
+  EXPECT_EQ(Run({"get", "hot"}), Value(0));
+  EXPECT_EQ(reads, GetTieredStats().external_reads);
+
+  // A hot value is not offloaded again when it is overridden.
+  ASSERT_EQ(Run({"set", "hot", Value(2)}), "OK");
+  fibers_ext::SleepFor(10ms);
+  EXPECT_EQ(1u, ExternalEntries());
+  EXPECT_EQ(Run({"get", "hot"}), Value(2));
+  EXPECT_EQ(Run({"get", "cold"}), Value(1));
+
+  absl::SetFlag(&FLAGS_tiered_promote_threshold, 4);
+}
+
+// The values of a shard are spread across its backing files, one per prefix.
+TEST_F(TieredStorageTest, SpreadAcrossDevices) {
+  constexpr unsigned kKeys = 16;
+
+  // Every write goes to the device with the shortest queue, hence the writes of a single hop
+  // alternate between the devices.
+  vector<string> args{"mset"};
+  for (unsigned i = 0; i < kKeys; ++i) {
+    args.push_back(StrCat("key", i));
+    args.push_back(Value(i));
+  }
+  vector<string_view> sv_args(args.begin(), args.end());
+  ASSERT_EQ(Run(ArgSlice{sv_args}), "OK");
+  WaitForOffload(kKeys);
+
+  for (const string& prefix : prefixes_)
+    EXPECT_TRUE(filesystem::exists(prefix + "-0000.ssd")) << prefix;
+
+  TieredStats stats = GetTieredStats();
+  ASSERT_EQ(2u, stats.num_devices);
+  EXPECT_GT(stats.devices[0].ios, 0u);
+  EXPECT_GT(stats.devices[1].ios, 0u);
+  EXPECT_EQ(kKeys, stats.devices[0].ios + stats.devices[1].ios);
+
+  for (unsigned i = 0; i < kKeys; ++i)
+    EXPECT_EQ(Run({"get", StrCat("key", i)}), Value(i)) << i;
+  stats = GetTieredStats();
+  EXPECT_EQ(2 * kKeys, stats.devices[0].ios + stats.devices[1].ios);
+
+  string info = Run({"info", "tiered"}).GetString();
+  EXPECT_THAT(info, HasSubstr("external_dev0_ios:"));
+  EXPECT_THAT(info, HasSubstr("external_dev1_ios:"));
+  EXPECT_THAT(info, Not(HasSubstr("external_dev2_ios:")));
+}
+
+// GETRANGE and BITCOUNT read only the pages of their range and leave the value offloaded,
+// STRLEN does not read it at all.
+TEST_F(TieredStorageTest, PartialReads) {
+  const string val = Value(7, 10000);
+  ASSERT_EQ(Run({"set", "key", val}), "OK");
+  WaitForOffload(1);
+
+  TieredStats stats = GetTieredStats();
+  EXPECT_EQ(Run({"getrange", "key", "100", "199"}), val.substr(100, 100));
+  EXPECT_EQ(Run({"getrange", "key", "4000", "4200"}), val.substr(4000, 201));  // across pages.
+  EXPECT_EQ(Run({"getrange", "key", "-10", "-1"}), val.substr(val.size() - 10));
+  EXPECT_EQ(Run({"getrange", "key", "9990", "20000"}), val.substr(9990));
+  EXPECT_EQ(Run({"getrange", "key", "20000", "30000"}), "");
+  EXPECT_EQ(Run({"getrange", "key", "10", "5"}), "");
+
+  size_t bits = 0;
+  for (char c : val.substr(5000, 10))
+    bits += __builtin_popcount(uint8_t(c));
+  EXPECT_THAT(Run({"bitcount", "key", "5000", "5009"}), IntArg(bits));
+
+  EXPECT_THAT(Run({"strlen", "key"}), IntArg(val.size()));
+
+  TieredStats after = GetTieredStats();
+  EXPECT_EQ(stats.external_reads, after.external_reads);
+  EXPECT_EQ(stats.range_reads + 5, after.range_reads);
+  EXPECT_EQ(1u, ExternalEntries());
+
+  EXPECT_EQ(Run({"get", "key"}), val);
+}
+
+// With fewer registered buffers than writes in flight, or none at all, the IO falls back to the
+// regular buffers. The second device of a shard can not register with the ring at all.
+class TieredFixedBuffersTest : public TieredStorageTest,
+                               public testing::WithParamInterface<uint32_t> {
+ protected:
+  void SetUp() override {
+    absl::SetFlag(&FLAGS_backing_file_fixed_buffers, GetParam());
+    TieredStorageTest::SetUp();
+  }
+
+  void TearDown() override {
+    TieredStorageTest::TearDown();
+    absl::SetFlag(&FLAGS_backing_file_fixed_buffers, 64);
+  }
+};
+
+TEST_P(TieredFixedBuffersTest, ReadWrite) {
+  constexpr unsigned kKeys = 16;
+
+  // The values that exceed a registered buffer never use the pool.
+  auto value = [](unsigned i, unsigned round) { return Value(i + round, i % 2 ? 4096 : 10000); };
+  for (unsigned round = 0; round < 2; ++round) {
+    vector<string> args{"mset"};
+    for (unsigned i = 0; i < kKeys; ++i) {
+      args.push_back(StrCat("key", i));
+      args.push_back(value(i, round));
+    }
+    vector<string_view> sv_args(args.begin(), args.end());
+    ASSERT_EQ(Run(ArgSlice{sv_args}), "OK");
+    WaitForOffload(kKeys);
+
+    for (unsigned i = 0; i < kKeys; ++i)
+      EXPECT_EQ(Run({"get", StrCat("key", i)}), value(i, round)) << i;
+  }
+  EXPECT_EQ(Run({"getrange", "key0", "4090", "4100"}), value(0, 1).substr(4090, 11));
+}
+
+INSTANTIATE_TEST_SUITE_P(Buffers, TieredFixedBuffersTest, testing::Values(0u, 2u));
+
 // TODO: to test transactions with a single shard since then all transactions become local.
 // To consider having a parameter in dragonfly engine controlling number of shards
 // unconditionally from number of cpus. TO TEST BLPOP under multi for single/multi argument case.
@@ -0,0 +1,210 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include <absl/strings/str_cat.h>
+
+#include <iterator>
+
+#include "base/flags.h"
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "facade/facade_test.h"
+#include "server/engine_shard_set.h"
+#include "server/test_utils.h"
+
+// Benchmarks of the commands dispatched in process from many fibers, without connections and
+// without the parsing of the requests and of the replies. They measure the transaction
+// framework and the command implementations apart from the networking. For example:
+//   ./engine_bench_test --bench --benchmark_filter=BM_Scenario --benchmark_counters_tabular=true
+// "hops_per_cmd" counts the hops that went through the shard queues and "runs_per_cmd" the
+// callbacks that ran in the shards.
+
+ABSL_FLAG(uint32_t, bench_threads, 4, "Number of proactor threads, hence of shards, to bench");
+
+using namespace std;
+using namespace util;
+
+namespace dfly {
+
+namespace {
+
+enum Scenario : unsigned {
+  MGET_FANOUT,       // MGET of 16 keys, which span all the shards.
+  MSET_MULTI_SHARD,  // MSET of 8 keys.
+  EVAL_CALLS,        // EVAL of a script with 2 redis.call over 2 keys.
+  BLPOP_WAKEUP,      // pairs of fibers, one BLPOPs and the other LPUSHes. Needs even fibers.
+  ZSET_OPS,          // ZADD, ZINCRBY, ZRANGEBYSCORE and ZRANK on a sorted set per fiber.
+  NUM_SCENARIOS
+};
+
+const char* ScenarioName(Scenario scenario) {
+  constexpr const char* kNames[] = {"mget_fanout", "mset_multi_shard", "eval_calls",
+                                    "blpop_wakeup", "zset_ops"};
+  static_assert(std::size(kNames) == NUM_SCENARIOS);
+  return kNames[scenario];
+}
+
+constexpr unsigned kNumKeys = 1000;
+constexpr unsigned kZsetSize = 128;
+
+constexpr char kEvalScript[] =
+    "local v = redis.call('INCR', KEYS[1]) redis.call('HSET', KEYS[2], 'last', v) return v";
+
+}  // namespace
+
+class EngineBenchTest : public BaseFamilyTest {
+ public:
+  void TestBody() override {
+  }
+
+  // Sets up the service outside of a test, for the benchmarks.
+  void Start(unsigned num_threads) {
+    num_threads_ = num_threads;
+    SetUpTestSuite();
+    SetUp();
+  }
+
+  void Stop() {
+    TearDown();
+  }
+
+  void Prepare(Scenario scenario);
+
+  // Dispatches the i-th command of the fiber. Must run in a proactor thread.
+  void RunCmd(Scenario scenario, unsigned fiber, uint64_t i);
+
+  // Runs num_cmds commands of the scenario in each of num_fibers fibers.
+  void RunScenario(Scenario scenario, unsigned num_fibers, uint64_t num_cmds) {
+    RunInFibers(num_fibers, [&](unsigned fiber) {
+      for (uint64_t i = 0; i < num_cmds; ++i)
+        RunCmd(scenario, fiber, i);
+    });
+  }
+
+  // The sum of the stats of all the shards.
+  EngineShard::Stats ShardStats() const {
+    vector<EngineShard::Stats> shard_stats(shard_set->size());
+    shard_set->RunBriefInParallel(
+        [&](EngineShard* es) { shard_stats[es->shard_id()] = es->stats(); });
+
+    EngineShard::Stats res;
+    for (const auto& s : shard_stats)
+      res += s;
+    return res;
+  }
+};
+
+void EngineBenchTest::Prepare(Scenario scenario) {
+  if (scenario != MGET_FANOUT)
+    return;
+
+  vector<string> cmd{"MSET"};
+  for (unsigned i = 0; i < kNumKeys; ++i) {
+    cmd.push_back(absl::StrCat("key:", i));
+    cmd.push_back(string(32, 'v'));
+  }
+  vector<string_view> args(cmd.begin(), cmd.end());
+  Run(ArgSlice{args});
+}
+
+void EngineBenchTest::RunCmd(Scenario scenario, unsigned fiber, uint64_t i) {
+  string id = absl::StrCat("bench", fiber);
+  vector<string> cmd;
+
+  switch (scenario) {
+    case MGET_FANOUT:
+      cmd.push_back("MGET");
+      for (unsigned j = 0; j < 16; ++j)
+        cmd.push_back(absl::StrCat("key:", (i * 16 + j + fiber * 101) % kNumKeys));
+      break;
+    case MSET_MULTI_SHARD:
+      cmd.push_back("MSET");
+      for (unsigned j = 0; j < 8; ++j) {
+        cmd.push_back(absl::StrCat("mset:", fiber, ":", (i * 8 + j) % kNumKeys));
+        cmd.push_back("value");
+      }
+      break;
+    case EVAL_CALLS:
+      cmd = {"EVAL", kEvalScript, "2", absl::StrCat("counter:", fiber),
+             absl::StrCat("meta:", fiber)};
+      break;
+    case BLPOP_WAKEUP:
+      if (fiber % 2 == 0) {
+        cmd = {"BLPOP", absl::StrCat("queue:", fiber / 2), "0"};
+      } else {
+        cmd = {"LPUSH", absl::StrCat("queue:", fiber / 2), "item"};
+      }
+      break;
+    case ZSET_OPS: {
+      string key = absl::StrCat("zset:", fiber);
+      string member = absl::StrCat("m", i % kZsetSize);
+      switch (i % 4) {
+        case 0:
+          cmd = {"ZADD", key, absl::StrCat(i % kZsetSize), member};
+          break;
+        case 1:
+          cmd = {"ZINCRBY", key, "1", member};
+          break;
+        case 2:
+          cmd = {"ZRANGEBYSCORE", key, "10", "+inf", "LIMIT", "0", "10"};
+          break;
+        case 3:
+          cmd = {"ZRANK", key, member};
+          break;
+      }
+      break;
+    }
+    case NUM_SCENARIOS:
+      LOG(FATAL) << "Invalid scenario";
+  }
+
+  vector<string_view> args(cmd.begin(), cmd.end());
+  RunDiscardReply(id, ArgSlice{args});
+}
+
+TEST_F(EngineBenchTest, Scenarios) {
+  for (unsigned s = 0; s < NUM_SCENARIOS; ++s) {
+    Scenario scenario = Scenario(s);
+    Prepare(scenario);
+    RunScenario(scenario, 4, 100);
+  }
+
+  // The keys of MGET, 800 keys of MSET and 2 keys of EVAL per fiber, and the sorted sets. All
+  // the pushed items were popped.
+  EXPECT_EQ(kNumKeys + 4 * 800 + 4 * 2 + 4, CheckedInt({"dbsize"}));
+  EXPECT_EQ(100, CheckedInt({"get", "counter:3"}));
+  EXPECT_EQ(0, CheckedInt({"exists", "queue:0", "queue:1"}));
+  EXPECT_GT(CheckedInt({"zcard", "zset:0"}), 0);
+}
+
+static void BM_Scenario(benchmark::State& state) {
+  constexpr uint64_t kCmdsPerFiber = 1000;
+  Scenario scenario = Scenario(state.range(0));
+  unsigned num_fibers = state.range(1);
+
+  EngineBenchTest bench;
+  bench.Start(absl::GetFlag(FLAGS_bench_threads));
+  bench.Prepare(scenario);
+  EngineShard::Stats start = bench.ShardStats();
+
+  for (auto _ : state) {
+    bench.RunScenario(scenario, num_fibers, kCmdsPerFiber);
+  }
+
+  EngineShard::Stats end = bench.ShardStats();
+  double cmds = double(state.iterations()) * num_fibers * kCmdsPerFiber;
+  state.SetLabel(ScenarioName(scenario));
+  state.SetItemsProcessed(cmds);
+  state.counters["hops_per_cmd"] = (end.queued_hops - start.queued_hops) / cmds;
+  state.counters["runs_per_cmd"] = (end.tx_runs - start.tx_runs) / cmds;
+
+  bench.Stop();
+}
+BENCHMARK(BM_Scenario)
+    ->ArgNames({"scenario", "fibers"})
+    ->ArgsProduct({{MGET_FANOUT, MSET_MULTI_SHARD, EVAL_CALLS, BLPOP_WAKEUP, ZSET_OPS}, {4, 64}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+}  // namespace dfly
@@ -11,25 +11,85 @@ extern "C" {
 
 #include "base/flags.h"
 #include "base/logging.h"
+#include "core/zstd_dict.h"
 #include "server/blocking_controller.h"
+#include "server/journal/journal.h"
 #include "server/server_state.h"
 #include "server/tiered_storage.h"
+#include "server/tracepoints.h"
 #include "server/transaction.h"
 #include "util/fiber_sched_algo.h"
 #include "util/varz.h"
 
 using namespace std;
 
-ABSL_FLAG(string, backing_prefix, "", "");
+ABSL_DECLARE_FLAG(uint32_t, dbnum);
+
+ABSL_FLAG(vector<string>, backing_prefix, {},
+          "Comma separated prefixes of the tiered storage backing files. Every shard spreads "
+          "its storage across all of them, so they are best placed on different devices");
 
 ABSL_FLAG(uint32_t, hz, 100,
           "Base frequency at which the server performs other background tasks. "
           "Warning: not advised to decrease in production.");
 
+ABSL_FLAG(bool, adaptive_hz, true,
+          "If true, the heartbeat of a shard runs up to 8 times more often than --hz, with "
+          "a larger expiry budget, while expired keys or evictions pile up and the shard has "
+          "spare cpu. It runs less often while the shard is idle or its hops wait long.");
+
+ABSL_FLAG(uint32_t, heartbeat_max_hop_wait_usec, 500,
+          "The average hop wait above which the adaptive heartbeat backs off.");
+
 ABSL_FLAG(bool, cache_mode, false,
           "If true, the backend behaves like a cache, "
           "by evicting entries when getting close to maxmemory limit");
 
+ABSL_FLAG(bool, cache_tinylfu, false,
+          "In cache mode, tracks the access frequency of keys and, when evicting, keeps "
+          "frequently used keys and refuses to admit new keys that are used less often");
+
+ABSL_FLAG(uint32_t, hotkeys_sample_rate, 100,
+          "Samples one key access out of this many on average to find the hot keys of every "
+          "shard, which DEBUG HOTKEYS and the metrics list. 0 disables the sampling");
+
+ABSL_FLAG(uint32_t, bigkeys_interval_sec, 600,
+          "Every shard visits all its keys this often when it is idle, to find the largest keys "
+          "and the size histograms by type for MEMORY BIGKEYS. 0 disables the passes");
+
+ABSL_FLAG(dfly::EvictionPolicy, maxmemory_policy, dfly::EvictionPolicy::ALLKEYS_LRU,
+          "In cache mode, which items the eviction ahead of demand frees: allkeys-lru, "
+          "volatile-ttl, volatile-lfu or allkeys-lfu. CONFIG SET maxmemory-policy changes it");
+
+ABSL_FLAG(float, cache_headroom, 0.1,
+          "In cache mode, the fraction of maxmemory that a background fiber keeps free by "
+          "evicting ahead of demand. 0 disables the background eviction");
+
+ABSL_FLAG(bool, expire_wheel, false,
+          "If true, indexes the keys with expiry by their deadline and actively deletes "
+          "exactly the keys that are due instead of sampling the tables");
+
+ABSL_FLAG(uint32_t, expire_wheel_deletes_per_tick, 1000,
+          "Maximum number of due keys that the expiry wheel deletes per db on every heartbeat");
+
+ABSL_FLAG(string, notify_keyspace_events, "",
+          "The classes of the keyspace notifications, as the notify-keyspace-events option of "
+          "redis, e.g. \"Ex\" for the expired keys. Empty disables the notifications");
+
+ABSL_FLAG(string, scan_prefix_delimiters, "",
+          "If not empty, indexes the keys by their prefixes that end with one of these "
+          "characters, so that SCAN and KEYS with a pattern that starts with such a prefix "
+          "visit only the keys under it");
+
+ABSL_FLAG(string, key_prefix_delimiters, "",
+          "If not empty, the keys that share a prefix that ends with one of these characters "
+          "keep it once per shard and store only their suffix, so that more keys fit inline");
+
+ABSL_FLAG(bool, shard_by_hashtag, false,
+          "If true, keys with a hashtag, i.e. a non empty {...} section as in redis cluster, are "
+          "assigned to shards by their hashtag, so that multi-key commands over keys with the "
+          "same hashtag run on a single shard");
+
 // memory defragmented related flags
 ABSL_FLAG(float, mem_defrag_threshold,
           1,  // The default now is to disable the task from running! change this to 0.05!!
@@ -42,6 +102,10 @@ ABSL_FLAG(float, commit_use_threshold, 1.3,
 ABSL_FLAG(float, mem_utilization_threshold, 0.8,
           "memory page under utilization threshold. Ratio between used and commited size, below "
           "this, memory in this page will defragmented");
+
+ABSL_FLAG(uint32_t, value_dict_train_bytes, 1 << 20,
+          "How many bytes of string values each shard samples before training its zstd "
+          "dictionary. Relevant only with --value_compression_codec=3");
 namespace dfly {
 
 using namespace util;
@@ -53,15 +117,42 @@ namespace {
 constexpr DbIndex kDefaultDbIndex = 0;
 constexpr uint64_t kCursorDoneState = 0u;
 
+// Zstd recommends dictionaries of ~100KB, but ours serve values of few KB at most.
+constexpr size_t kValueDictSize = 16_KB;
+constexpr size_t kMaxValueSampleLen = 4_KB;
+
 vector<EngineShardSet::CachedStats> cached_stats;  // initialized in EngineShardSet::Init
+vector<atomic_bool> loading_shards;                 // initialized in EngineShardSet::Init
+
+// The window of the busy ratio and of the average hop wait in CachedStats.
+constexpr uint64_t kSaturationWindowNs = 1000000000;
+
+// The period of the heartbeat, which runs at most 1000 times a second and at least once.
+double HeartbeatPeriodMs(double scale) {
+  double base_ms = 1000.0 / std::max<uint32_t>(1, GetFlag(FLAGS_hz));
+  return std::clamp(base_ms / scale, 1.0, 1000.0);
+}
+
+// The CPU time of the calling thread. The proactor spins for a while before it sleeps, hence
+// an idle shard still shows some CPU usage.
+uint64_t ThreadCpuNs() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
 
 }  // namespace
 
 constexpr size_t kQueueLen = 64;
 
+// Hops of up to kHopRingLen in-flight transactions are dispatched without the shard queue.
+constexpr unsigned kHopRingLen = 1024;
+constexpr unsigned kPriorityHopRingLen = 64;
+
 thread_local EngineShard* EngineShard::shard_ = nullptr;
 EngineShardSet* shard_set = nullptr;
 uint64_t TEST_current_time_ms = 0;
+bool shard_by_hashtag = false;
 
 EngineShard::Stats& EngineShard::Stats::operator+=(const EngineShard::Stats& o) {
   ooo_runs += o.ooo_runs;
@@ -69,6 +160,23 @@ EngineShard::Stats& EngineShard::Stats::operator+=(const EngineShard::Stats& o)
   defrag_attempt_total += o.defrag_attempt_total;
   defrag_realloc_total += o.defrag_realloc_total;
   defrag_task_invocation_total += o.defrag_task_invocation_total;
+  defrag_string_bytes += o.defrag_string_bytes;
+  defrag_list_bytes += o.defrag_list_bytes;
+  defrag_set_bytes += o.defrag_set_bytes;
+  defrag_zset_bytes += o.defrag_zset_bytes;
+  defrag_hash_bytes += o.defrag_hash_bytes;
+  defrag_stream_bytes += o.defrag_stream_bytes;
+  zstd_dicts_trained += o.zstd_dicts_trained;
+  hop_batches += o.hop_batches;
+  batched_hops += o.batched_hops;
+  priority_hops += o.priority_hops;
+  relaxed_runs += o.relaxed_runs;
+  inline_hops += o.inline_hops;
+  tx_runs += o.tx_runs;
+  slice_yields += o.slice_yields;
+  max_slice_usec = std::max(max_slice_usec, o.max_slice_usec);
+  queued_hops += o.queued_hops;
+  hop_wait_ns += o.hop_wait_ns;
 
   return *this;
 }
@@ -102,6 +210,29 @@ bool EngineShard::DefragTaskState::IsRequired() const {
 }
 
 // for now this does nothing
+void EngineShard::AccountDefrag(unsigned obj_type, size_t bytes) {
+  switch (obj_type) {
+    case OBJ_STRING:
+      stats_.defrag_string_bytes += bytes;
+      break;
+    case OBJ_LIST:
+      stats_.defrag_list_bytes += bytes;
+      break;
+    case OBJ_SET:
+      stats_.defrag_set_bytes += bytes;
+      break;
+    case OBJ_ZSET:
+      stats_.defrag_zset_bytes += bytes;
+      break;
+    case OBJ_HASH:
+      stats_.defrag_hash_bytes += bytes;
+      break;
+    case OBJ_STREAM:
+      stats_.defrag_stream_bytes += bytes;
+      break;
+  }
+}
+
 bool EngineShard::DoDefrag() {
   // --------------------------------------------------------------------------
   // NOTE: This task is running with exclusive access to the shard.
@@ -111,28 +242,40 @@ bool EngineShard::DoDefrag() {
   // --------------------------------------------------------------------------
 
   constexpr size_t kMaxTraverses = 50;
+
+  // Bounds the work of a single run since moving a large container may copy many allocations.
+  constexpr size_t kMaxDefragBytes = 4 << 20;
   const float threshold = GetFlag(FLAGS_mem_utilization_threshold);
 
   auto& slice = db_slice();
+
+  // Values of pinned reads are accessed by other threads and must not be moved.
+  // We keep the cursor and retry on the next idle run.
+  if (slice.HasPinnedReads())
+    return false;
+
   DCHECK(slice.IsDbValid(kDefaultDbIndex));
-  auto [prime_table, expire_table] = slice.GetTables(kDefaultDbIndex);
+  PrimeTable* prime_table = slice.GetPrimeTable(kDefaultDbIndex);
   PrimeTable::Cursor cur = defrag_state_.cursor;
   uint64_t reallocations = 0;
   unsigned traverses_count = 0;
   uint64_t attempts = 0;
+  size_t moved_bytes = 0;
 
   do {
     cur = prime_table->Traverse(cur, [&](PrimeIterator it) {
       // for each value check whether we should move it because it
       // seats on underutilized page of memory, and if so, do it.
-      bool did = it->second.DefragIfNeeded(threshold);
+      size_t moved = it->second.DefragIfNeeded(threshold);
       attempts++;
-      if (did) {
+      if (moved) {
         reallocations++;
+        moved_bytes += moved;
+        AccountDefrag(it->second.ObjType(), moved);
       }
     });
     traverses_count++;
-  } while (traverses_count < kMaxTraverses && cur);
+  } while (traverses_count < kMaxTraverses && moved_bytes < kMaxDefragBytes && cur);
 
   defrag_state_.cursor = cur.value();
   if (reallocations > 0) {
@@ -174,20 +317,101 @@ uint32_t EngineShard::DefragTask() {
   return kRunAtLowPriority;
 }
 
+// Frees a bounded number of the elements detached by UNLINK and FLUSHDB ASYNC, and returns to
+// the high priority until the lazy free queue is empty.
+uint32_t EngineShard::LazyFreeTask() {
+  constexpr size_t kFreeBudget = 4096;
+
+  if (db_slice_.lazy_free().FreeStep(kFreeBudget))
+    return util::ProactorBase::kOnIdleMaxLevel;
+  return 0;
+}
+
+// The pass only reads the tables, and runs at the lowest priority so that it takes the cpu only
+// when the shard has nothing else to do.
+uint32_t EngineShard::BigKeysTask() {
+  constexpr uint32_t kRunAtLowPriority = 0u;
+  uint32_t interval_sec = GetFlag(FLAGS_bigkeys_interval_sec);
+  if (interval_sec == 0)
+    return kRunAtLowPriority;
+
+  uint64_t now_ms = GetCurrentTimeMs();
+  if (!big_keys_.running()) {
+    if (now_ms < big_keys_next_ms_)
+      return kRunAtLowPriority;
+    big_keys_next_ms_ = now_ms + interval_sec * 1000ULL;
+  }
+
+  big_keys_.Step(&db_slice_, now_ms);
+  return kRunAtLowPriority;
+}
+
+// Trims a bounded number of streams, and returns to the high priority until the queue is
+// empty. Every trim deletes up to its LIMIT, 10000 entries by default. Global transactions
+// lock the whole shard, hence the queue waits for them to finish. The journal may preempt on
+// the replication sockets, hence the trims that it records run in the fiber of the shard queue,
+// as the hops do.
+uint32_t EngineShard::StreamTrimTask() {
+  constexpr unsigned kTrimBudget = 16;
+
+  if (stream_trim_.empty() || stream_trim_queued_ || !shard_lock_.Check(IntentLock::EXCLUSIVE))
+    return 0;
+
+  if (journal_) {
+    stream_trim_queued_ = queue_.TryAdd([this] {
+      stream_trim_queued_ = false;
+      if (journal_ && shard_lock_.Check(IntentLock::EXCLUSIVE))
+        stream_trim_.TrimStep(&db_slice_, journal_, GetCurrentTimeMs(), kTrimBudget);
+    });
+    return util::ProactorBase::kOnIdleMaxLevel;
+  }
+
+  if (stream_trim_.TrimStep(&db_slice_, nullptr, GetCurrentTimeMs(), kTrimBudget))
+    return util::ProactorBase::kOnIdleMaxLevel;
+  return 0;
+}
+
 EngineShard::EngineShard(util::ProactorBase* pb, bool update_db_time, mi_heap_t* heap)
-    : queue_(kQueueLen), txq_([](const Transaction* t) { return t->txid(); }), mi_resource_(heap),
+    : queue_(kQueueLen), hop_ring_(kHopRingLen), priority_hop_ring_(kPriorityHopRingLen),
+      txq_([](const Transaction* t) { return t->txid(); }), mi_resource_(heap),
       db_slice_(pb->GetIndex(), GetFlag(FLAGS_cache_mode), this) {
+  if (GetFlag(FLAGS_cache_mode) && GetFlag(FLAGS_cache_tinylfu)) {
+    db_slice_.EnableFrequencySketch();
+  }
+  db_slice_.SetEvictionPolicy(GetFlag(FLAGS_maxmemory_policy));
+  if (string events = GetFlag(FLAGS_notify_keyspace_events); !events.empty()) {
+    optional<uint32_t> classes = KeyspaceNotifier::ParseClasses(events);
+    LOG_IF(ERROR, !classes) << "Invalid --notify_keyspace_events " << events;
+    db_slice_.keyspace_notifier().SetClasses(classes.value_or(0));
+  }
+  if (uint32_t rate = GetFlag(FLAGS_hotkeys_sample_rate); rate > 0) {
+    db_slice_.EnableHotKeys(rate);
+  }
+  if (GetFlag(FLAGS_expire_wheel)) {
+    db_slice_.EnableExpireWheel();
+  }
+  if (string delimiters = GetFlag(FLAGS_scan_prefix_delimiters); !delimiters.empty()) {
+    db_slice_.EnablePrefixIndex(delimiters);
+  }
+  db_slice_.SetDocIndices(&doc_indices_);
+
   fiber_q_ = fibers::fiber([this, index = pb->GetIndex()] {
     FiberProps::SetName(absl::StrCat("shard_queue", index));
     queue_.Run();
   });
 
-  if (update_db_time) {
-    uint32_t clock_cycle_ms = 1000 / std::max<uint32_t>(1, GetFlag(FLAGS_hz));
-    if (clock_cycle_ms == 0)
-      clock_cycle_ms = 1;
+  if (GetFlag(FLAGS_cache_mode) && GetFlag(FLAGS_cache_headroom) > 0) {
+    eviction_fiber_ = fibers::fiber([this, index = pb->GetIndex()] {
+      FiberProps::SetName(absl::StrCat("shard_evict", index));
+      RunEvictionLoop();
+    });
+  }
 
-    periodic_task_ = pb->AddPeriodic(clock_cycle_ms, [this] { Heartbeat(); });
+  if (update_db_time) {
+    heartbeat_fiber_ = fibers::fiber([this, index = pb->GetIndex()] {
+      FiberProps::SetName(absl::StrCat("shard_heartbeat", index));
+      RunHeartbeatLoop();
+    });
   }
 
   tmp_str1 = sdsempty();
@@ -195,16 +419,31 @@ EngineShard::EngineShard(util::ProactorBase* pb, bool update_db_time, mi_heap_t*
   db_slice_.UpdateExpireBase(absl::GetCurrentTimeNanos() / 1000000, 0);
   // start the defragmented task here
   defrag_task_ = pb->AddOnIdleTask([this]() { return this->DefragTask(); });
+  lazy_free_task_ = pb->AddOnIdleTask([this]() { return this->LazyFreeTask(); });
+  big_keys_task_ = pb->AddOnIdleTask([this]() { return this->BigKeysTask(); });
+  stream_trim_task_ = pb->AddOnIdleTask([this]() { return this->StreamTrimTask(); });
 }
 
 EngineShard::~EngineShard() {
   sdsfree(tmp_str1);
+  for (sds str : tmp_strs)
+    sdsfree(str);
 }
 
 void EngineShard::Shutdown() {
   queue_.Shutdown();
   fiber_q_.join();
 
+  eviction_done_.Notify();
+  if (eviction_fiber_.joinable()) {
+    eviction_fiber_.join();
+  }
+
+  heartbeat_done_.Notify();
+  if (heartbeat_fiber_.joinable()) {
+    heartbeat_fiber_.join();
+  }
+
   if (tiered_storage_) {
     tiered_storage_->Shutdown();
   }
@@ -214,19 +453,42 @@ void EngineShard::Shutdown() {
   }
 
   ProactorBase::me()->RemoveOnIdleTask(defrag_task_);
+  ProactorBase::me()->RemoveOnIdleTask(lazy_free_task_);
+  ProactorBase::me()->RemoveOnIdleTask(big_keys_task_);
+  ProactorBase::me()->RemoveOnIdleTask(stream_trim_task_);
+
+  if (dict_train_.trainer.joinable()) {
+    dict_train_.trainer.join();
+  }
 }
 
 void EngineShard::InitThreadLocal(ProactorBase* pb, bool update_db_time) {
   CHECK(shard_ == nullptr) << pb->GetIndex();
 
+  // The data heap moves into the huge page arena before the shard allocates anything. The
+  // transparent huge pages are reserved lazily, hence their arena can take whole maxmemory.
+  HugePageArena::Mode mode = HugePageArena::ConfiguredMode();
+  size_t arena_size = max_memory_limit;
+  if (mode == HugePageArena::HUGETLB)
+    arena_size /= shard_set->size();
+  HugePageArena arena = HugePageArena::Map(mode, arena_size);
+  if (mi_heap_t* heap = arena.NewHeap(); heap) {
+    ServerState::tlocal()->set_data_heap(heap);
+    init_zmalloc_threadlocal(heap);
+    LOG_FIRST_N(INFO, 1) << "The shards allocate their data on huge pages, "
+                         << HugePageArena::ModeName(arena.mode());
+  }
+  cached_stats[pb->GetIndex()].huge_pages = arena;
+
   mi_heap_t* data_heap = ServerState::tlocal()->data_heap();
   void* ptr = mi_heap_malloc_aligned(data_heap, sizeof(EngineShard), alignof(EngineShard));
   shard_ = new (ptr) EngineShard(pb, update_db_time, data_heap);
 
   CompactObj::InitThreadLocal(shard_->memory_resource());
+  CompactObj::EnableKeyPrefixes(GetFlag(FLAGS_key_prefix_delimiters));
   SmallString::InitThreadLocal(data_heap);
 
-  string backing_prefix = GetFlag(FLAGS_backing_prefix);
+  vector<string> backing_prefix = GetFlag(FLAGS_backing_prefix);
   if (!backing_prefix.empty()) {
     if (pb->GetKind() != ProactorBase::IOURING) {
       LOG(ERROR) << "Only ioring based backing storage is supported. Exiting...";
@@ -252,10 +514,57 @@ void EngineShard::DestroyThreadLocal() {
   mi_free(shard_);
   shard_ = nullptr;
   CompactObj::InitThreadLocal(nullptr);
+  CompactObj::EnableKeyPrefixes("");
   mi_heap_delete(tlh);
   VLOG(1) << "Shard reset " << index;
 }
 
+void EngineShard::AddHop(Transaction* trans, uint32_t seq) {
+  uint64_t now_ns = ProactorBase::GetMonotonicTimeNs();
+  DFLY_TRACE(hop__enqueue, trans->txid(), shard_id(), seq);
+  Hop hop{trans, seq, now_ns};
+  bool pushed = (trans->IsPriority() && priority_hop_ring_.TryPush(hop)) ||
+                hop_ring_.TryPush(hop);
+  if (!pushed) {
+    queue_.Add([this, trans, seq, now_ns] {
+      RecordHopWait(trans, now_ns);
+      trans->RunHop(seq);
+    });
+    return;
+  }
+
+  // The push above is visible to the drain that clears the flag after this exchange.
+  if (!hop_drain_pending_.exchange(true, memory_order_acq_rel)) {
+    queue_.Add([this] { DrainHops(); });
+  }
+}
+
+void EngineShard::DrainHops() {
+  // Cleared before popping so that the hops pushed from now on schedule another drain.
+  hop_drain_pending_.exchange(false, memory_order_acq_rel);
+
+  ++stats_.hop_batches;
+  Hop hop;
+  while (true) {
+    if (priority_hop_ring_.TryPop(&hop)) {
+      ++stats_.priority_hops;
+    } else if (!hop_ring_.TryPop(&hop)) {
+      break;
+    }
+    ++stats_.batched_hops;
+    RecordHopWait(hop.trans, hop.enqueue_ns);
+    hop.trans->RunHop(hop.seq);
+  }
+}
+
+void EngineShard::RecordHopWait(const Transaction* trans, uint64_t enqueue_ns) {
+  uint64_t now_ns = ProactorBase::GetMonotonicTimeNs();
+  uint64_t wait_ns = now_ns > enqueue_ns ? now_ns - enqueue_ns : 0;
+  ++stats_.queued_hops;
+  stats_.hop_wait_ns += wait_ns;
+  DFLY_TRACE(hop__dequeue, trans->txid(), shard_id(), wait_ns);
+}
+
 // Is called by Transaction::ExecuteAsync in order to run transaction tasks.
 // Only runs in its own thread.
 void EngineShard::PollExecution(const char* context, Transaction* trans) {
@@ -416,7 +725,6 @@ bool EngineShard::HasResultConverged(TxId notifyid) const {
 void EngineShard::Heartbeat() {
   CacheStats();
   constexpr double kTtlDeleteLimit = 200;
-  constexpr double kRedLimitFactor = 0.1;
 
   uint32_t traversed = GetMovingSum6(TTL_TRAVERSE);
   uint32_t deleted = GetMovingSum6(TTL_DELETE);
@@ -429,7 +737,15 @@ void EngineShard::Heartbeat() {
     ttl_delete_target = kTtlDeleteLimit * double(deleted) / (double(traversed) + 10);
   }
 
-  ssize_t redline = (max_memory_limit * kRedLimitFactor) / shard_set->size();
+  // A boosted heartbeat also deletes more per run.
+  double budget_scale = std::max(1.0, heartbeat_.scale);
+  ttl_delete_target *= budget_scale;
+  unsigned wheel_budget = GetFlag(FLAGS_expire_wheel_deletes_per_tick) * budget_scale;
+
+  // Every pass traverses all the fields of a hash.
+  constexpr unsigned kFieldPassesPerTick = 64;
+  unsigned field_pass_budget = kFieldPassesPerTick * budget_scale;
+
   DbContext db_cntx;
   db_cntx.time_now_ms = GetCurrentTimeMs();
 
@@ -438,19 +754,184 @@ void EngineShard::Heartbeat() {
       continue;
 
     db_cntx.db_index = i;
-    auto [pt, expt] = db_slice_.GetTables(i);
-    if (expt->size() > pt->size() / 4) {
+    const DbTable* table = db_slice_.GetDBTable(i);
+    if (db_slice_.HasExpireWheel()) {
+      DbSlice::DeleteExpiredStats stats = db_slice_.DeleteDueStep(db_cntx, wheel_budget);
+
+      counter_[TTL_TRAVERSE].IncBy(stats.traversed);
+      counter_[TTL_DELETE].IncBy(stats.deleted);
+      heartbeat_.debt |= stats.traversed >= wheel_budget;
+    } else if (table->expire_count > table->prime.size() / 4) {
       DbSlice::DeleteExpiredStats stats = db_slice_.DeleteExpiredStep(db_cntx, ttl_delete_target);
 
       counter_[TTL_TRAVERSE].IncBy(stats.traversed);
       counter_[TTL_DELETE].IncBy(stats.deleted);
+      // The same strong deletion rate on which DeleteExpiredStep continues its traversal.
+      heartbeat_.debt |= stats.deleted > 0 && stats.deleted * 4 > stats.traversed;
+    }
+
+    // Global transactions lock the whole shard, the passes wait for them to finish.
+    if (table->field_expire_wheel && shard_lock_.Check(IntentLock::EXCLUSIVE)) {
+      db_slice_.DeleteDueFieldsStep(db_cntx, field_pass_budget);
+      heartbeat_.debt |= table->field_expire_wheel->backlog() > 0;
     }
 
-    // if our budget is below the limit
-    if (db_slice_.memory_budget() < redline) {
-      db_slice_.FreeMemWithEvictionStep(i, redline - db_slice_.memory_budget());
+    db_slice_.MergeSegmentsStep(i);
+    db_slice_.TrimTimeSeriesStep(i);
+
+    if (tiered_storage_) {
+      tiered_storage_->UnloadColdStep(i);
     }
   }
+
+  if (tiered_storage_) {
+    tiered_storage_->CompactStep();
+    tiered_storage_->PromoteStep();
+    tiered_storage_->CompactFileStep();
+  }
+
+  if (dict_train_.done.load(memory_order_acquire)) {
+    AdoptTrainedDict();
+  }
+}
+
+void EngineShard::RunHeartbeatLoop() {
+  auto period = chrono::microseconds(uint64_t(HeartbeatPeriodMs(heartbeat_.scale) * 1000));
+
+  while (!heartbeat_done_.WaitFor(period)) {
+    Heartbeat();
+    period = chrono::microseconds(uint64_t(HeartbeatPeriodMs(heartbeat_.scale) * 1000));
+  }
+}
+
+auto EngineShard::AdaptHeartbeatScale(const HeartbeatSignals& signals, double* scale)
+    -> HeartbeatMode {
+  constexpr double kMinScale = 0.25;
+  constexpr double kMaxScale = 8;
+  constexpr uint64_t kBoostBusyPermille = 700;
+  constexpr uint64_t kBackoffBusyPermille = 900;
+
+  if (signals.avg_hop_wait_usec > GetFlag(FLAGS_heartbeat_max_hop_wait_usec) ||
+      signals.busy_permille > kBackoffBusyPermille) {
+    // The heartbeat competes with the hops, but it does not fall behind --hz with debt.
+    *scale = std::max(signals.debt ? 1.0 : kMinScale, *scale / 2);
+    return HB_LATENCY_BACKOFF;
+  }
+
+  if (signals.debt) {
+    if (signals.busy_permille >= kBoostBusyPermille)
+      return HB_STEADY;
+    *scale = std::min(kMaxScale, std::max(1.0, *scale) * 2);
+    return HB_BOOST;
+  }
+
+  if (signals.tx_runs == 0) {
+    *scale = std::max(kMinScale, *scale / 2);
+    return HB_IDLE_BACKOFF;
+  }
+
+  *scale = *scale > 1 ? std::max(1.0, *scale / 2) : std::min(1.0, *scale * 2);
+  return HB_STEADY;
+}
+
+const char* EngineShard::HeartbeatModeName(HeartbeatMode mode) {
+  switch (mode) {
+    case HB_STEADY:
+      return "steady";
+    case HB_BOOST:
+      return "boost";
+    case HB_LATENCY_BACKOFF:
+      return "latency_backoff";
+    case HB_IDLE_BACKOFF:
+      return "idle_backoff";
+  }
+  return "unknown";
+}
+
+void EngineShard::RunEvictionLoop() {
+  // While short of the headroom we evict every kActivePeriodMs, otherwise we only watch
+  // the inflow.
+  constexpr unsigned kActivePeriodMs = 1;
+  constexpr unsigned kIdlePeriodMs = 10;
+  constexpr size_t kMaxStepBytes = 4 << 20;
+
+  double headroom = GetFlag(FLAGS_cache_headroom) * max_memory_limit / shard_set->size();
+  double inflow_rate = 0;  // bytes per ms, exponentially smoothed.
+  ssize_t prev_budget = db_slice_.memory_budget();
+  uint64_t prev_ms = GetCurrentTimeMs();
+  unsigned period_ms = kIdlePeriodMs;
+
+  while (!eviction_done_.WaitFor(chrono::milliseconds(period_ms))) {
+    uint64_t now_ms = GetCurrentTimeMs();
+    double elapsed_ms = std::max<uint64_t>(1, now_ms - prev_ms);
+    ssize_t budget = db_slice_.memory_budget();
+
+    // The budget shrinks with the inflow since the previous step. CacheStats also resets it
+    // on every heartbeat, the smoothing absorbs those jumps.
+    double inflow = std::max<double>(0, prev_budget - budget);
+    inflow_rate = 0.8 * inflow_rate + 0.2 * inflow / elapsed_ms;
+
+    // Free the missing headroom plus what is going to flow in until the next step.
+    // The databases that exceed their quota are trimmed even when there is enough headroom.
+    double goal = headroom - double(budget) + inflow_rate * kActivePeriodMs;
+    size_t step_goal = goal > 0 ? std::min<size_t>(goal, kMaxStepBytes) : 0;
+    size_t freed = db_slice_.FreeMemWithEviction(step_goal);
+
+    period_ms = (goal > 0 || freed > 0) ? kActivePeriodMs : kIdlePeriodMs;
+    prev_budget = db_slice_.memory_budget();  // includes what we have just freed.
+    prev_ms = now_ms;
+  }
+}
+
+void EngineShard::SampleValue(string_view value) {
+  if (dict_train_.running)
+    return;
+
+  string_view sample = value.substr(0, kMaxValueSampleLen);
+  dict_train_.samples.append(sample);
+  dict_train_.sample_sizes.push_back(sample.size());
+
+  if (dict_train_.samples.size() < GetFlag(FLAGS_value_dict_train_bytes))
+    return;
+
+  // The training takes seconds of cpu, hence it runs on its own thread that owns the samples
+  // and the shard keeps serving meanwhile. Heartbeat installs the dictionary once the
+  // trainer is done. The training runs once per shard unless it fails.
+  dict_train_.running = true;
+  dict_train_.trainer = std::thread(
+      [this, samples = std::move(dict_train_.samples),
+       sample_sizes = std::move(dict_train_.sample_sizes)] {
+        dict_train_.result = ZstdDictRegistry::Train(samples, sample_sizes, kValueDictSize);
+        dict_train_.done.store(true, memory_order_release);
+      });
+}
+
+void EngineShard::AdoptTrainedDict() {
+  dict_train_.trainer.join();
+  dict_train_.done.store(false, memory_order_relaxed);
+  dict_train_.running = false;
+
+  string dict = std::move(dict_train_.result);
+  dict_train_.result.clear();
+
+  // On failure we start sampling from scratch.
+  dict_train_.samples.clear();
+  dict_train_.sample_sizes.clear();
+
+  if (dict.empty()) {
+    LOG(WARNING) << "Failed to train zstd dictionary in shard " << shard_id();
+    return;
+  }
+
+  const ZstdDictRegistry::Entry* entry = ZstdDictRegistry::Register(dict);
+  if (!entry) {
+    LOG(WARNING) << "Could not register zstd dictionary in shard " << shard_id();
+    return;
+  }
+
+  VLOG(1) << "Shard " << shard_id() << " compresses values with zstd dictionary " << entry->id;
+  ZstdDictRegistry::SetThreadDict(entry);
+  ++stats_.zstd_dicts_trained;
 }
 
 void EngineShard::CacheStats() {
@@ -459,18 +940,107 @@ void EngineShard::CacheStats() {
 
   // Used memory for this shard.
   size_t used_mem = UsedMemory();
-  cached_stats[db_slice_.shard_id()].used_memory.store(used_mem, memory_order_relaxed);
+  EngineShardSet::CachedStats& cached = cached_stats[db_slice_.shard_id()];
+  cached.used_memory.store(used_mem, memory_order_relaxed);
   ssize_t free_mem = max_memory_limit - used_mem_current.load(memory_order_relaxed);
 
   size_t entries = 0;
   size_t table_memory = 0;
+  vector<pair<size_t, size_t>> db_keys(db_slice_.db_array_size());
   for (size_t i = 0; i < db_slice_.db_array_size(); ++i) {
     DbTable* table = db_slice_.GetDBTable(i);
     if (table) {
       entries += table->prime.size();
-      table_memory += (table->prime.mem_usage() + table->expire.mem_usage());
+      table_memory += table->prime.mem_usage();
+      db_keys[i] = {table->prime.size(), table->expire_count};
     }
   }
+
+  const SliceEvents& events = db_slice_.events();
+  cached.keys.store(entries, memory_order_relaxed);
+  cached.tx_runs.store(stats_.tx_runs, memory_order_relaxed);
+  cached.hits.store(events.hits, memory_order_relaxed);
+  cached.misses.store(events.misses, memory_order_relaxed);
+  cached.evicted_keys.store(events.evicted_keys, memory_order_relaxed);
+  cached.expired_keys.store(events.expired_keys, memory_order_relaxed);
+  if (journal::Journal* journal = ServerState::tlocal()->journal(); journal)
+    cached.journal_lsn.store(journal->GetLsn(), memory_order_relaxed);
+
+  TieredStats tiered;
+  if (tiered_storage_) {
+    tiered = tiered_storage_->GetStats();
+    cached.tiered_reads.store(tiered.external_reads, memory_order_relaxed);
+    cached.tiered_writes.store(tiered.external_writes, memory_order_relaxed);
+    cached.tiered_reserved.store(tiered.storage_reserved, memory_order_relaxed);
+  }
+
+  uint64_t now_ns = ProactorBase::GetMonotonicTimeNs();
+  uint64_t cpu_ns = ThreadCpuNs();
+  cached.txq_len.store(txq_.size(), memory_order_relaxed);
+  cached.txq_max_len.store(txq_.max_size(), memory_order_relaxed);
+  cached.hop_backlog.store(hop_ring_.ApproxSize(), memory_order_relaxed);
+  cached.busy_usec.store(cpu_ns / 1000, memory_order_relaxed);
+  cached.queued_hops.store(stats_.queued_hops, memory_order_relaxed);
+  cached.hop_wait_usec.store(stats_.hop_wait_ns / 1000, memory_order_relaxed);
+  cached.ooo_runs.store(stats_.ooo_runs, memory_order_relaxed);
+  cached.quick_runs.store(stats_.quick_runs, memory_order_relaxed);
+
+  SaturationWindow& window = saturation_window_;
+  if (now_ns >= window.start_ns + kSaturationWindowNs) {
+    if (window.start_ns) {
+      uint64_t busy = (cpu_ns - window.cpu_ns) * 1000 / (now_ns - window.start_ns);
+      uint64_t hops = stats_.queued_hops - window.queued_hops;
+      uint64_t wait_usec = hops ? (stats_.hop_wait_ns - window.hop_wait_ns) / hops / 1000 : 0;
+      cached.busy_permille.store(std::min<uint64_t>(busy, 1000), memory_order_relaxed);
+      cached.avg_hop_wait_usec.store(wait_usec, memory_order_relaxed);
+
+      if (GetFlag(FLAGS_adaptive_hz)) {
+        HeartbeatSignals signals;
+        signals.debt = heartbeat_.debt || (GetFlag(FLAGS_cache_mode) && free_mem < 0);
+        signals.busy_permille = busy;
+        signals.avg_hop_wait_usec = wait_usec;
+        signals.tx_runs = stats_.tx_runs - window.tx_runs;
+
+        heartbeat_.mode = AdaptHeartbeatScale(signals, &heartbeat_.scale);
+        heartbeat_.boosts += (heartbeat_.mode == HB_BOOST);
+        heartbeat_.backoffs +=
+            (heartbeat_.mode == HB_LATENCY_BACKOFF || heartbeat_.mode == HB_IDLE_BACKOFF);
+      }
+    }
+    window = {now_ns, cpu_ns, stats_.queued_hops, stats_.hop_wait_ns, stats_.tx_runs};
+    heartbeat_.debt = false;
+  }
+
+  cached.heartbeat_hz.store(uint64_t(1000 / HeartbeatPeriodMs(heartbeat_.scale)),
+                            memory_order_relaxed);
+  cached.heartbeat_mode.store(heartbeat_.mode, memory_order_relaxed);
+  cached.heartbeat_boosts.store(heartbeat_.boosts, memory_order_relaxed);
+  cached.heartbeat_backoffs.store(heartbeat_.backoffs, memory_order_relaxed);
+
+  // Top allocates the keys, hence it is not computed on every heartbeat.
+  vector<HotKeys::Key> hot_keys;
+  uint64_t now_ms = GetCurrentTimeMs();
+  bool cache_hot_keys = db_slice_.hot_keys() && now_ms >= hot_keys_cached_ms_ + 1000;
+  if (cache_hot_keys) {
+    hot_keys = db_slice_.hot_keys()->Top(EngineShardSet::kCachedHotKeys, now_ms);
+    hot_keys_cached_ms_ = now_ms;
+  }
+
+  DbSlice::Stats slice = db_slice_.GetStats();
+  {
+    lock_guard lk(cached.mu);
+    cached.db_keys = std::move(db_keys);
+    cached.tiered = std::move(tiered);
+    if (cache_hot_keys)
+      cached.hot_keys = std::move(hot_keys);
+
+    cached.slice = std::move(slice);
+    cached.shard = stats_;
+    cached.tracking = db_slice_.tracking_table().GetStats();
+    cached.keyspace_events = db_slice_.keyspace_notifier().GetStats();
+    cached.traverse_ttl_per_sec = GetMovingSum6(TTL_TRAVERSE);
+    cached.delete_ttl_per_sec = GetMovingSum6(TTL_DELETE);
+  }
   size_t obj_memory = table_memory <= used_mem ? used_mem - table_memory : 0;
 
   size_t bytes_per_obj = entries > 0 ? obj_memory / entries : 0;
@@ -478,7 +1048,8 @@ void EngineShard::CacheStats() {
 }
 
 size_t EngineShard::UsedMemory() const {
-  return mi_resource_.used() + zmalloc_used_memory_tl + SmallString::UsedThreadLocal();
+  return mi_resource_.used() + zmalloc_used_memory_tl + SmallString::UsedThreadLocal() +
+         ServerState::tlocal()->GetInterpreterMemory();
 }
 
 void EngineShard::AddBlocked(Transaction* trans) {
@@ -507,8 +1078,14 @@ void EngineShard::TEST_EnableHeartbeat() {
 
 void EngineShardSet::Init(uint32_t sz, bool update_db_time) {
   CHECK_EQ(0u, size());
-  cached_stats.resize(sz);
+  shard_by_hashtag = GetFlag(FLAGS_shard_by_hashtag);
+  ClusterConfig::Initialize();
+  cached_stats = vector<CachedStats>(sz);
+  for (CachedStats& stats : cached_stats)
+    stats.db_sizes = vector<atomic_uint64_t>(GetFlag(FLAGS_dbnum));
+  loading_shards = vector<atomic_bool>(sz);
   shard_queue_.resize(sz);
+  shards_.resize(sz);
 
   pp_->AwaitFiberOnAll([&](uint32_t index, ProactorBase* pb) {
     if (index < shard_queue_.size()) {
@@ -525,12 +1102,36 @@ void EngineShardSet::InitThreadLocal(ProactorBase* pb, bool update_db_time) {
   EngineShard::InitThreadLocal(pb, update_db_time);
   EngineShard* es = EngineShard::tlocal();
   shard_queue_[es->shard_id()] = es->GetFiberQueue();
+  shards_[es->shard_id()] = es;
 }
 
 const vector<EngineShardSet::CachedStats>& EngineShardSet::GetCachedStats() {
   return cached_stats;
 }
 
+void EngineShardSet::PublishDbSize(ShardId sid, DbIndex db, size_t size) {
+  // The DbSlice of a test may run without the shard set.
+  if (sid < cached_stats.size() && db < cached_stats[sid].db_sizes.size())
+    cached_stats[sid].db_sizes[db].store(size, memory_order_relaxed);
+}
+
+size_t EngineShardSet::DbSize(DbIndex db) {
+  size_t res = 0;
+  for (const CachedStats& stats : cached_stats) {
+    if (db < stats.db_sizes.size())
+      res += stats.db_sizes[db].load(memory_order_relaxed);
+  }
+  return res;
+}
+
+void EngineShardSet::SetLoading(ShardId sid, bool loading) {
+  loading_shards[sid].store(loading, memory_order_relaxed);
+}
+
+bool EngineShardSet::IsLoading(ShardId sid) {
+  return loading_shards[sid].load(memory_order_relaxed);
+}
+
 void EngineShardSet::TEST_EnableHeartBeat() {
   RunBriefInParallel([](EngineShard* shard) { shard->TEST_EnableHeartbeat(); });
 }
@@ -12,12 +12,21 @@ extern "C" {
 #include <absl/container/flat_hash_map.h>
 #include <xxhash.h>
 
+#include <atomic>
+#include <thread>
+
 #include "base/string_view_sso.h"
 #include "core/external_alloc.h"
 #include "core/mi_memory_resource.h"
+#include "core/mpsc_ring.h"
 #include "core/tx_queue.h"
+#include "server/big_keys.h"
 #include "server/channel_slice.h"
+#include "server/cluster_config.h"
 #include "server/db_slice.h"
+#include "server/doc_index.h"
+#include "server/huge_pages.h"
+#include "server/stream_trim.h"
 #include "util/fibers/fiberqueue_threadpool.h"
 #include "util/fibers/fibers_ext.h"
 #include "util/proactor_pool.h"
@@ -41,6 +50,27 @@ class EngineShard {
     uint64_t defrag_realloc_total = 0;
     uint64_t defrag_task_invocation_total = 0;
 
+    // bytes moved by the defrag task per value type.
+    uint64_t defrag_string_bytes = 0;
+    uint64_t defrag_list_bytes = 0;
+    uint64_t defrag_set_bytes = 0;
+    uint64_t defrag_zset_bytes = 0;
+    uint64_t defrag_hash_bytes = 0;
+    uint64_t defrag_stream_bytes = 0;
+
+    uint64_t zstd_dicts_trained = 0;
+
+    uint64_t hop_batches = 0;  // how many times the hop ring was drained.
+    uint64_t batched_hops = 0;
+    uint64_t priority_hops = 0;  // hops of CO::PRIORITY commands that ran ahead of the others.
+    uint64_t relaxed_runs = 0;   // runs of relaxed reads, which bypass the TxQueue.
+    uint64_t inline_hops = 0;  // hops that ran in the coordinator fiber.
+    uint64_t tx_runs = 0;      // transaction callbacks that ran in the shard, quick runs included.
+    uint64_t slice_yields = 0;    // hops of sliced operations that yielded the shard.
+    uint64_t max_slice_usec = 0;  // the longest run of a transaction callback.
+    uint64_t queued_hops = 0;     // hops that went through the shard queue.
+    uint64_t hop_wait_ns = 0;     // the total time of queued hops from AddHop until they ran.
+
     Stats& operator+=(const Stats&);
   };
 
@@ -69,6 +99,10 @@ class EngineShard {
     return db_slice_;
   }
 
+  ShardDocIndices& doc_indices() {
+    return doc_indices_;
+  }
+
   ChannelSlice& channel_slice() {
     return channel_slice_;
   }
@@ -85,6 +119,13 @@ class EngineShard {
   // shard. Tries executing the passed transaction if possible (does not guarantee though).
   void PollExecution(const char* context, Transaction* trans);
 
+  // Thread-safe. Dispatches a hop of trans into this shard, see Transaction::RunHop.
+  // Hops are passed through a lock-free ring that the shard drains in batches, and the shard
+  // queue is notified only when no drain is pending. Falls back to the shard queue when
+  // the ring is full. The hops of priority transactions have their own ring, which every drain
+  // empties before it pops the next hop of the main ring.
+  void AddHop(Transaction* trans, uint32_t seq);
+
   // Returns transaction queue.
   TxQueue* txq() {
     return &txq_;
@@ -107,6 +148,32 @@ class EngineShard {
     stats_.quick_runs++;
   }
 
+  void IncTxRun() {
+    stats_.tx_runs++;
+  }
+
+  void IncRelaxedRun() {
+    stats_.relaxed_runs++;
+  }
+
+  void IncInlineHop() {
+    stats_.inline_hops++;
+  }
+
+  void IncSliceYield() {
+    stats_.slice_yields++;
+  }
+
+  void RecordSlice(uint64_t duration_ns) {
+    stats_.max_slice_usec = std::max(stats_.max_slice_usec, duration_ns / 1000);
+  }
+
+  // CONFIG RESETSTAT
+  void ResetMaxStats() {
+    stats_.max_slice_usec = 0;
+    txq_.ResetMaxSize();
+  }
+
   const Stats& stats() const {
     return stats_;
   }
@@ -118,6 +185,16 @@ class EngineShard {
     return tiered_storage_.get();
   }
 
+  // The result of the last background pass over the keys, see MEMORY BIGKEYS.
+  const BigKeys& big_keys() const {
+    return big_keys_;
+  }
+
+  // The approximate trims of XADD that run when the shard is idle.
+  StreamTrimQueue* stream_trim() {
+    return &stream_trim_;
+  }
+
   // Adds blocked transaction to the watch-list.
   void AddBlocked(Transaction* trans);
 
@@ -128,6 +205,9 @@ class EngineShard {
   // for everyone to use for string transformations during atomic cpu sequences.
   sds tmp_str1;
 
+  // The same for the calls that take several strings, it grows on demand.
+  std::vector<sds> tmp_strs;
+
   // Moving average counters.
   enum MovingCnt { TTL_TRAVERSE, TTL_DELETE, COUNTER_TOTAL };
 
@@ -144,6 +224,30 @@ class EngineShard {
     journal_ = j;
   }
 
+  // Collects a sample of a string value for training the shard's zstd dictionary.
+  // Once enough samples are collected, the dictionary is trained in background and
+  // adopted by the shard thread during Heartbeat. See --value_dict_train_bytes.
+  void SampleValue(std::string_view value);
+
+  // The heartbeat runs --hz times a second multiplied by its scale, which adapts once per
+  // second to the signals of the shard, see --adaptive_hz.
+  enum HeartbeatMode : uint8_t { HB_STEADY, HB_BOOST, HB_LATENCY_BACKOFF, HB_IDLE_BACKOFF };
+
+  struct HeartbeatSignals {
+    // Some heartbeat ran out of its expiry budget, or the shard is over its memory budget.
+    bool debt = false;
+    uint64_t busy_permille = 0;
+    uint64_t avg_hop_wait_usec = 0;
+    uint64_t tx_runs = 0;
+  };
+
+  // Updates the scale of the heartbeat in [1/4, 8] by the signals of the last second.
+  // Latency pressure halves the scale, debt on a shard with spare cpu doubles it and an idle
+  // shard halves it, otherwise it returns to 1.
+  static HeartbeatMode AdaptHeartbeatScale(const HeartbeatSignals& signals, double* scale);
+
+  static const char* HeartbeatModeName(HeartbeatMode mode);
+
   void TEST_EnableHeartbeat();
 
  private:
@@ -156,6 +260,17 @@ class EngineShard {
     bool IsRequired() const;
   };
 
+  struct DictTrainState {
+    std::string samples;
+    std::vector<size_t> sample_sizes;
+
+    // The trainer thread owns the samples and writes the result before it sets done.
+    std::thread trainer;
+    bool running = false;
+    std::atomic_bool done{false};
+    std::string result;
+  };
+
   EngineShard(util::ProactorBase* pb, bool update_db_time, mi_heap_t* heap);
 
   // blocks the calling fiber.
@@ -163,6 +278,13 @@ class EngineShard {
 
   void Heartbeat();
 
+  // Runs Heartbeat every 1000 / --hz ms, divided by the heartbeat scale.
+  void RunHeartbeatLoop();
+
+  // In cache mode, evicts ahead of demand in order to keep a headroom of free memory, so that
+  // inserts rarely need to evict themselves. Paces itself by the observed memory inflow.
+  void RunEvictionLoop();
+
   void CacheStats();
 
   // We are running a task that checks whether we need to
@@ -176,17 +298,53 @@ class EngineShard {
   // --------------------------------------------------------------------------
   uint32_t DefragTask();
 
+  // Frees values and tables of the lazy free queue of the db slice, at the idle time as well.
+  uint32_t LazyFreeTask();
+
+  // Runs a step of the big keys pass, and starts a new pass every --bigkeys_interval_sec.
+  uint32_t BigKeysTask();
+
+  // Runs the trims of the stream trim queue, at the idle time.
+  uint32_t StreamTrimTask();
+
   // scan the shard with the cursor and apply
   // de-fragmentation option for entries. This function will return the new cursor at the end of the
   // scan This function is called from context of StartDefragTask
   // return true if we did not complete the shard scan
   bool DoDefrag();
 
+  // Adds bytes moved by the defrag task to the per-type stats.
+  void AccountDefrag(unsigned obj_type, size_t bytes);
+
+  // Registers the dictionary trained by DictTrainState::trainer and uses it for compression
+  // of new values in this thread.
+  void AdoptTrainedDict();
+
+  // Runs in the shard queue. Runs the hops that were added to hop_ring_ so far.
+  void DrainHops();
+
+  // Accounts a hop of trans that was added at enqueue_ns and starts to run now.
+  void RecordHopWait(const Transaction* trans, uint64_t enqueue_ns);
+
+  struct Hop {
+    Transaction* trans;
+    uint32_t seq;
+    uint64_t enqueue_ns;
+  };
+
   ::util::fibers_ext::FiberQueue queue_;
+  MPSCRing<Hop> hop_ring_;
+  MPSCRing<Hop> priority_hop_ring_;
+  std::atomic_bool hop_drain_pending_{false};
   ::boost::fibers::fiber fiber_q_;
+  ::boost::fibers::fiber eviction_fiber_;
+  ::util::fibers_ext::Done eviction_done_;
+  ::boost::fibers::fiber heartbeat_fiber_;
+  ::util::fibers_ext::Done heartbeat_done_;
 
   TxQueue txq_;
   MiMemoryResource mi_resource_;
+  ShardDocIndices doc_indices_;  // outlives db_slice_ that refers to it.
   DbSlice db_slice_;
   ChannelSlice channel_slice_;
 
@@ -200,7 +358,35 @@ class EngineShard {
 
   uint32_t periodic_task_ = 0;
   uint32_t defrag_task_ = 0;
+  uint32_t lazy_free_task_ = 0;
+  uint32_t big_keys_task_ = 0;
+  uint32_t stream_trim_task_ = 0;
+  bool stream_trim_queued_ = false;  // a trim step waits in queue_.
+  uint64_t big_keys_next_ms_ = 0;
+  uint64_t hot_keys_cached_ms_ = 0;
+
+  // The counters at the start of the window over which CacheStats computes the busy ratio
+  // and the average hop wait.
+  struct SaturationWindow {
+    uint64_t start_ns = 0;
+    uint64_t cpu_ns = 0;
+    uint64_t queued_hops = 0;
+    uint64_t hop_wait_ns = 0;
+    uint64_t tx_runs = 0;
+  } saturation_window_;
+
+  // The state of the adaptive heartbeat, see AdaptHeartbeatScale.
+  struct HeartbeatState {
+    double scale = 1;
+    bool debt = false;  // in the current saturation window.
+    HeartbeatMode mode = HB_STEADY;
+    uint64_t boosts = 0;
+    uint64_t backoffs = 0;
+  } heartbeat_;
   DefragTaskState defrag_state_;
+  DictTrainState dict_train_;
+  BigKeys big_keys_;
+  StreamTrimQueue stream_trim_;
   std::unique_ptr<TieredStorage> tiered_storage_;
   std::unique_ptr<BlockingController> blocking_controller_;
 
@@ -214,16 +400,63 @@ class EngineShard {
 
 class EngineShardSet {
  public:
-  struct CachedStats {
-    std::atomic_uint64_t used_memory;
-
-    CachedStats() : used_memory(0) {
-    }
-
-    CachedStats(const CachedStats& o) : used_memory(o.used_memory.load()) {
-    }
+  // Published by every shard on its heartbeat, so that the stats can be read from any thread
+  // without hopping into the shards. The values lag by at most one heartbeat.
+  struct alignas(64) CachedStats {
+    std::atomic_uint64_t used_memory{0};
+    std::atomic_uint64_t keys{0};
+    std::atomic_uint64_t tx_runs{0};
+    std::atomic_uint64_t hits{0};
+    std::atomic_uint64_t misses{0};
+    std::atomic_uint64_t evicted_keys{0};
+    std::atomic_uint64_t expired_keys{0};
+    std::atomic_uint64_t journal_lsn{0};
+    std::atomic_uint64_t tiered_reads{0};
+    std::atomic_uint64_t tiered_writes{0};
+    std::atomic_uint64_t tiered_reserved{0};
+
+    // Saturation of the shard, see INFO SHARDS.
+    std::atomic_uint64_t txq_len{0};
+    std::atomic_uint64_t txq_max_len{0};  // since the start or CONFIG RESETSTAT.
+    std::atomic_uint64_t hop_backlog{0};  // hops that wait in the ring for the shard.
+    std::atomic_uint64_t busy_usec{0};    // CPU time of the shard thread.
+    std::atomic_uint64_t queued_hops{0};
+    std::atomic_uint64_t hop_wait_usec{0};
+    std::atomic_uint64_t ooo_runs{0};
+    std::atomic_uint64_t quick_runs{0};
+    std::atomic_uint64_t busy_permille{0};      // over the last second.
+    std::atomic_uint64_t avg_hop_wait_usec{0};  // over the last second.
+
+    // The adaptive heartbeat, see EngineShard::AdaptHeartbeatScale.
+    std::atomic_uint64_t heartbeat_hz{0};
+    std::atomic_uint64_t heartbeat_mode{0};  // EngineShard::HeartbeatMode
+    std::atomic_uint64_t heartbeat_boosts{0};
+    std::atomic_uint64_t heartbeat_backoffs{0};
+
+    // The number of keys by db index. Unlike the other stats, it is published by the DbSlice on
+    // every insertion and deletion, hence DBSIZE is exact without a hop.
+    std::vector<std::atomic_uint64_t> db_sizes;
+
+    // Guards the stats below that do not fit into atomics.
+    mutable ::boost::fibers::mutex mu;
+    std::vector<std::pair<size_t, size_t>> db_keys;  // (keys, expiring keys) by db index.
+    TieredStats tiered;                               // only with tiered storage.
+    std::vector<HotKeys::Key> hot_keys;  // refreshed every second, with --hotkeys_sample_rate.
+
+    // The snapshot of the shard that INFO reads, see ServerFamily::GetPublishedMetrics.
+    DbSlice::Stats slice;
+    EngineShard::Stats shard;
+    TrackingTable::Stats tracking;
+    KeyspaceNotifier::Stats keyspace_events;
+    uint32_t traverse_ttl_per_sec = 0;  // moving sums over 6 seconds.
+    uint32_t delete_ttl_per_sec = 0;
+
+    HugePageArena huge_pages;  // of the data heap, set once when the shard starts.
   };
 
+  // Number of the hottest keys of every shard in CachedStats.
+  static constexpr size_t kCachedHotKeys = 10;
+
   explicit EngineShardSet(util::ProactorPool* pp) : pp_(pp) {
   }
 
@@ -240,6 +473,16 @@ class EngineShardSet {
 
   static const std::vector<CachedStats>& GetCachedStats();
 
+  // Called by the DbSlice of the shard sid whenever the number of keys of db changes.
+  static void PublishDbSize(ShardId sid, DbIndex db, size_t size);
+
+  // The number of keys of db in all the shards. Can be called from any thread.
+  static size_t DbSize(DbIndex db);
+
+  // Whether the shard still loads its part of a snapshot. Can be called from any thread.
+  static void SetLoading(ShardId sid, bool loading);
+  static bool IsLoading(ShardId sid);
+
   // Uses a shard queue to dispatch. Callback runs in a dedicated fiber.
   template <typename F> auto Await(ShardId sid, F&& f) {
     return shard_queue_[sid]->Await(std::forward<F>(f));
@@ -251,6 +494,12 @@ class EngineShardSet {
     return shard_queue_[sid]->Add(std::forward<F>(f));
   }
 
+  // Dispatches a transaction hop to the shard, see EngineShard::AddHop.
+  void AddHop(ShardId sid, Transaction* trans, uint32_t seq) {
+    assert(sid < shards_.size());
+    shards_[sid]->AddHop(trans, seq);
+  }
+
   // Runs a brief function on all shards. Waits for it to complete.
   template <typename U> void RunBriefInParallel(U&& func) const {
     RunBriefInParallel(std::forward<U>(func), [](auto i) { return true; });
@@ -285,6 +534,7 @@ class EngineShardSet {
 
   util::ProactorPool* pp_;
   std::vector<util::fibers_ext::FiberQueue*> shard_queue_;
+  std::vector<EngineShard*> shards_;
 };
 
 template <typename U, typename P>
@@ -320,7 +570,15 @@ template <typename U> void EngineShardSet::RunBlockingInParallel(U&& func) {
   bc.Wait();
 }
 
+// Set from --shard_by_hashtag before the shards start.
+extern bool shard_by_hashtag;
+
+// In cluster mode the keys of a slot are kept in the same shard.
 inline ShardId Shard(std::string_view v, ShardId shard_num) {
+  if (ClusterConfig::IsEnabled())
+    return ClusterConfig::KeySlot(v) % shard_num;
+  if (shard_by_hashtag)
+    v = KeyTag(v);
   XXH64_hash_t hash = XXH64(v.data(), v.size(), 120577240643ULL);
   return hash % shard_num;
 }
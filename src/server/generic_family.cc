@@ -5,13 +5,18 @@
 #include "server/generic_family.h"
 
 extern "C" {
-#include "redis/crc64.h"
 #include "redis/object.h"
 #include "redis/util.h"
 }
 
+#include <absl/strings/match.h>
+
 #include "base/flags.h"
 #include "base/logging.h"
+#include "core/crc64.h"
+#include "core/sorted_map.h"
+#include "core/string_map.h"
+#include "core/string_set.h"
 #include "redis/rdb.h"
 #include "server/blocking_controller.h"
 #include "server/command_registry.h"
@@ -19,13 +24,24 @@ extern "C" {
 #include "server/container_utils.h"
 #include "server/engine_shard_set.h"
 #include "server/error.h"
+#include "server/migration.h"
+#include "server/rdb_extensions.h"
 #include "server/rdb_load.h"
 #include "server/rdb_save.h"
 #include "server/transaction.h"
 #include "util/varz.h"
 
 ABSL_FLAG(uint32_t, dbnum, 16, "Number of databases");
-ABSL_FLAG(uint32_t, keys_output_limit, 8192, "Maximum number of keys output by keys command");
+ABSL_FLAG(uint32_t, keys_output_limit, 0,
+          "Maximum number of keys output by keys command, 0 for no limit");
+ABSL_FLAG(uint32_t, scan_time_budget_usec, 1000,
+          "Time that every shard spends on a single SCAN or KEYS step, in microseconds");
+ABSL_FLAG(uint32_t, migrate_batch_bytes, 4 << 20,
+          "MIGRATE pipelines the keys of every shard to the target in batches of about this "
+          "many serialized bytes");
+ABSL_FLAG(uint64_t, migrate_chunk_bytes, 64 << 20,
+          "MIGRATE sends the lists, sets, hashes and sorted sets that use more memory in chunks "
+          "of members, which the target applies one by one, instead of a single RESTORE");
 ABSL_DECLARE_FLAG(int, compression_mode);
 
 namespace dfly {
@@ -52,7 +68,7 @@ VersionBuffer MakeRdbVersion() {
 }
 
 CrcBuffer MakeCheckSum(std::string_view dump_res) {
-  uint64_t chksum = crc64(0, reinterpret_cast<const uint8_t*>(dump_res.data()), dump_res.size());
+  uint64_t chksum = Crc64(0, dump_res.data(), dump_res.size());
   CrcBuffer buf;
   absl::little_endian::Store64(buf.data(), chksum);
   return buf;
@@ -84,8 +100,7 @@ bool VerifyFooter(std::string_view msg) {
                  << RDB_VERSION << " got version " << version;
     return false;
   }
-  uint64_t expected_cs =
-      crc64(0, reinterpret_cast<const uint8_t*>(msg.data()), msg.size() - sizeof(uint64_t));
+  uint64_t expected_cs = Crc64(0, msg.data(), msg.size() - sizeof(uint64_t));
   uint64_t actual_cs = absl::little_endian::Load64(footer + sizeof(version));
   if (actual_cs != expected_cs) {
     LOG(WARNING) << "CRC check failed for restore command, expecting: " << expected_cs << " got "
@@ -134,7 +149,9 @@ class RdbRestoreValue : protected RdbLoaderBase {
 std::optional<RdbLoaderBase::OpaqueObj> RdbRestoreValue::Parse(std::string_view payload) {
   InMemSource source(payload);
   src_ = &source;
-  if (auto type_id = FetchType(); type_id && rdbIsObjectType(type_id.value())) {
+  if (auto type_id = FetchType();
+      type_id && (rdbIsObjectType(type_id.value()) || type_id.value() == RDB_TYPE_SBF ||
+                  type_id.value() == RDB_TYPE_JSON || type_id.value() == RDB_TYPE_TS)) {
     io::Result<OpaqueObj> io_res = ReadObj(type_id.value());  // load the type from the input stream
     if (!io_res) {
       LOG(ERROR) << "failed to load data for type id " << (unsigned int)type_id.value();
@@ -423,35 +440,40 @@ OpStatus OpPersist(const OpArgs& op_args, string_view key) {
   }
 }
 
+// The payload of DUMP, which RESTORE reads.
+std::string DumpValue(const PrimeValue& pv) {
+  ::io::StringSink sink;
+  int compression_mode = absl::GetFlag(FLAGS_compression_mode);
+  CompressionMode serializer_compression_mode =
+      compression_mode == 0 ? CompressionMode::NONE : CompressionMode::SINGLE_ENTRY;
+  RdbSerializer serializer(serializer_compression_mode);
+
+  // According to Redis code we need to
+  // 1. Save the value itself - without the key
+  // 2. Save footer: this include the RDB version and the CRC value for the message
+  unsigned obj_type = pv.ObjType();
+  unsigned encoding = pv.Encoding();
+  auto type = RdbObjectType(obj_type, encoding);
+  DVLOG(1) << "We are going to dump object type: " << type;
+  std::error_code ec = serializer.WriteOpcode(type);
+  CHECK(!ec);
+  ec = serializer.SaveValue(pv);
+  CHECK(!ec);  // make sure that fully was successful
+  ec = serializer.FlushToSink(&sink);
+  CHECK(!ec);  // make sure that fully was successful
+  std::string dump_payload = std::move(sink).str();
+  AppendFooter(&dump_payload);  // version and crc
+  CHECK_GT(dump_payload.size(), 10u);
+  return dump_payload;
+}
+
 OpResult<std::string> OpDump(const OpArgs& op_args, string_view key) {
   auto& db_slice = op_args.shard->db_slice();
   auto [it, expire_it] = db_slice.FindExt(op_args.db_cntx, key);
 
   if (IsValid(it)) {
     DVLOG(1) << "Dump: key '" << key << "' successfully found, going to dump it";
-    std::unique_ptr<::io::StringSink> sink = std::make_unique<::io::StringSink>();
-    int compression_mode = absl::GetFlag(FLAGS_compression_mode);
-    CompressionMode serializer_compression_mode =
-        compression_mode == 0 ? CompressionMode::NONE : CompressionMode::SINGLE_ENTRY;
-    RdbSerializer serializer(serializer_compression_mode);
-
-    // According to Redis code we need to
-    // 1. Save the value itself - without the key
-    // 2. Save footer: this include the RDB version and the CRC value for the message
-    unsigned obj_type = it->second.ObjType();
-    unsigned encoding = it->second.Encoding();
-    auto type = RdbObjectType(obj_type, encoding);
-    DVLOG(1) << "We are going to dump object type: " << type;
-    std::error_code ec = serializer.WriteOpcode(type);
-    CHECK(!ec);
-    ec = serializer.SaveValue(it->second);
-    CHECK(!ec);  // make sure that fully was successful
-    ec = serializer.FlushToSink(sink.get());
-    CHECK(!ec);  // make sure that fully was successful
-    std::string dump_payload(sink->str());
-    AppendFooter(&dump_payload);  // version and crc
-    CHECK_GT(dump_payload.size(), 10u);
-    return dump_payload;
+    return DumpValue(it->second);
   }
   // fallback
   DVLOG(1) << "Dump: '" << key << "' Not found";
@@ -492,7 +514,35 @@ OpResult<bool> OnRestore(const OpArgs& op_args, std::string_view key, std::strin
                     restore_args.ExpirationTime());
 }
 
-bool ScanCb(const OpArgs& op_args, PrimeIterator it, const ScanOpts& opts, StringVec* res) {
+// SCAN traverses the tables of all the shards in parallel. Positions in a traversal are
+// ordered by the logical bucket and then by the segment, as a fraction of the table, so the
+// positions of tables of different depths are comparable, see DashTable::AlignCursor. The
+// cursor of SCAN is the position up to which every shard has been scanned.
+using ScanPos = uint64_t;
+
+constexpr ScanPos kScanEnd = UINT64_MAX;
+
+// The time is checked once per this many buckets.
+constexpr unsigned kScanClockStep = 16;
+
+ScanPos CursorPos(PrimeTable::Cursor cur) {
+  return (uint64_t(cur.bucket_id()) << 32) | (cur.value() >> 8);
+}
+
+PrimeTable::Cursor PosCursor(ScanPos pos) {
+  return PrimeTable::Cursor{((pos & 0xFFFFFFFF) << 8) | (pos >> 32)};
+}
+
+// The keys that a shard found and the positions of their buckets.
+struct ShardScan {
+  StringVec keys;
+  vector<ScanPos> positions;
+  ScanPos end = kScanEnd;  // the shard has been scanned up to end.
+};
+
+// Evaluates the filters on the key in place and copies it only if it passes them.
+bool ScanCb(const OpArgs& op_args, PrimeIterator it, const ScanOpts& opts, string* scratch,
+            StringVec* res) {
   auto& db_slice = op_args.shard->db_slice();
   if (it->second.HasExpire()) {
     it = db_slice.ExpireIfNeeded(op_args.db_cntx, it).first;
@@ -510,73 +560,214 @@ bool ScanCb(const OpArgs& op_args, PrimeIterator it, const ScanOpts& opts, Strin
     return false;
   }
 
-  string str = it->first.ToString();
-  if (!opts.Matches(str)) {
+  string_view key = it->first.GetSlice(scratch);
+  if (!opts.Matches(key)) {
     return false;
   }
-  res->push_back(std::move(str));
+  res->emplace_back(key);
 
   return true;
 }
 
-void OpScan(const OpArgs& op_args, const ScanOpts& scan_opts, uint64_t* cursor, StringVec* vec) {
+// Scans the keys under prefix in the prefix index. Positions in the index are derived from the
+// hashes of the keys rather than from the table, see DbTable::PrefixPos. The keys are copied
+// from the index in batches, since ScanCb deletes the expired keys from it.
+void OpIndexScan(const OpArgs& op_args, const ScanOpts& scan_opts, string_view prefix,
+                 ScanPos pos, uint64_t deadline, ShardScan* res) {
+  constexpr size_t kBatchSize = 128;
+
+  DbTable* table = op_args.shard->db_slice().GetDBTable(op_args.db_cntx.db_index);
+  vector<pair<ScanPos, string>> batch;
+  string scratch;
+  ScanPos last = kScanEnd;
+  unsigned steps = 0;
+
+  while (true) {
+    // The batch ends at a position boundary, hence the next one starts at next.
+    ScanPos next = kScanEnd;
+    batch.clear();
+    table->prefix_index->Scan(prefix, pos, [&](uint64_t key_pos, string_view key) {
+      if (batch.size() >= kBatchSize && key_pos != batch.back().first) {
+        next = key_pos;
+        return false;
+      }
+      batch.emplace_back(key_pos, key);
+      return true;
+    });
+
+    for (const auto& [key_pos, key] : batch) {
+      // Stop only between positions, so that a position is scanned either fully or not at all.
+      if (key_pos != last) {
+        bool timeout = ++steps % kScanClockStep == 0 &&
+                       util::ProactorBase::GetMonotonicTimeNs() >= deadline;
+        if (timeout || res->keys.size() >= scan_opts.limit) {
+          res->end = key_pos;
+          return;
+        }
+        last = key_pos;
+      }
+
+      PrimeIterator it = table->prime.Find(key);
+      DCHECK(IsValid(it)) << key;
+      if (IsValid(it) && ScanCb(op_args, it, scan_opts, &scratch, &res->keys))
+        res->positions.push_back(key_pos);
+    }
+
+    if (next == kScanEnd)
+      return;
+    pos = next;
+  }
+}
+
+// Scans the shard from pos until it finds scan_opts.limit keys or runs out of time.
+void OpScan(const OpArgs& op_args, const ScanOpts& scan_opts, ScanPos pos, uint64_t budget_ns,
+            ShardScan* res) {
   auto& db_slice = op_args.shard->db_slice();
   DCHECK(db_slice.IsDbValid(op_args.db_cntx.db_index));
 
-  unsigned cnt = 0;
+  uint64_t deadline = util::ProactorBase::GetMonotonicTimeNs() + budget_ns;
+  PrimeTable* prime_table = db_slice.GetPrimeTable(op_args.db_cntx.db_index);
 
-  VLOG(1) << "PrimeTable " << db_slice.shard_id() << "/" << op_args.db_cntx.db_index << " has "
-          << db_slice.DbSize(op_args.db_cntx.db_index);
+  const PrefixIndex* index = db_slice.GetDBTable(op_args.db_cntx.db_index)->prefix_index.get();
+  if (index && scan_opts.bucket_id == UINT_MAX) {
+    string_view prefix = index->IndexedPrefix(scan_opts.pattern);
+    if (!prefix.empty())
+      return OpIndexScan(op_args, scan_opts, prefix, pos, deadline, res);
+  }
 
-  PrimeTable::Cursor cur = *cursor;
-  auto [prime_table, expire_table] = db_slice.GetTables(op_args.db_cntx.db_index);
-  do {
-    cur = prime_table->Traverse(
-        cur, [&](PrimeIterator it) { cnt += ScanCb(op_args, it, scan_opts, vec); });
-  } while (cur && cnt < scan_opts.limit);
+  // Cursor 0 is both the start and the end of a traversal.
+  PrimeTable::Cursor cur = 0;
+  if (pos != 0) {
+    cur = prime_table->AlignCursor(PosCursor(pos));
+    if (!cur)
+      return;
+  }
 
-  VLOG(1) << "OpScan " << db_slice.shard_id() << " cursor: " << cur.value();
-  *cursor = cur.value();
+  string scratch;
+  for (unsigned i = 1;; ++i) {
+    ScanPos cur_pos = CursorPos(cur);
+    cur = prime_table->TraverseStep(cur, [&](PrimeIterator it) {
+      if (ScanCb(op_args, it, scan_opts, &scratch, &res->keys))
+        res->positions.push_back(cur_pos);
+    });
+
+    if (!cur)
+      break;
+    if (res->keys.size() >= scan_opts.limit ||
+        (i % kScanClockStep == 0 && util::ProactorBase::GetMonotonicTimeNs() >= deadline)) {
+      res->end = CursorPos(cur);
+      break;
+    }
+  }
+
+  VLOG(1) << "OpScan " << db_slice.shard_id() << " found " << res->keys.size() << " till "
+          << res->end;
 }
 
 uint64_t ScanGeneric(uint64_t cursor, const ScanOpts& scan_opts, StringVec* keys,
                      ConnectionContext* cntx) {
-  ShardId sid = cursor % 1024;
+  if ((cursor >> 32) >= PrimeTable::kLogicalBucketNum)  // protection
+    return 0;
 
-  EngineShardSet* ess = shard_set;
-  unsigned shard_count = ess->size();
+  vector<ShardScan> scans(shard_set->size());
+  DbContext db_cntx{.db_index = cntx->conn_state.db_index, .time_now_ms = GetCurrentTimeMs()};
+  uint64_t budget_ns = uint64_t(absl::GetFlag(FLAGS_scan_time_budget_usec)) * 1000;
+
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    OpArgs op_args{shard, 0, db_cntx};
+    OpScan(op_args, scan_opts, cursor, budget_ns, &scans[shard->shard_id()]);
+  });
+
+  // Every shard has been scanned up to end. The keys that shards found past it are found again
+  // by the next call.
+  ScanPos end = kScanEnd;
+  for (const ShardScan& scan : scans) {
+    end = min(end, scan.end);
+  }
+
+  // Reply with about limit keys, all the keys of a position or none of them.
+  vector<ScanPos> positions;
+  for (const ShardScan& scan : scans) {
+    for (ScanPos pos : scan.positions) {
+      if (pos < end)
+        positions.push_back(pos);
+    }
+  }
 
-  // Dash table returns a cursor with its right byte empty. We will use it
-  // for encoding shard index. For now scan has a limitation of 255 shards.
-  CHECK_LT(shard_count, 1024u);
+  if (positions.size() > scan_opts.limit) {
+    sort(positions.begin(), positions.end());
+    size_t cut = scan_opts.limit;
+    while (cut > 0 && positions[cut] == positions[cut - 1])
+      --cut;
+    if (cut == 0) {
+      cut = scan_opts.limit;
+      while (cut < positions.size() && positions[cut] == positions[cut - 1])
+        ++cut;
+    }
+    if (cut < positions.size())
+      end = positions[cut];
+  }
 
-  if (sid >= shard_count) {  // protection
-    return 0;
+  for (ShardScan& scan : scans) {
+    for (size_t i = 0; i < scan.keys.size(); ++i) {
+      if (scan.positions[i] < end)
+        keys->push_back(std::move(scan.keys[i]));
+    }
   }
 
-  cursor >>= 10;
-  DbContext db_cntx{.db_index = cntx->conn_state.db_index, .time_now_ms = GetCurrentTimeMs()};
+  return end == kScanEnd ? 0 : end;
+}
 
-  do {
-    ess->Await(sid, [&] {
-      OpArgs op_args{EngineShard::tlocal(), 0, db_cntx};
+// The reply of KEYS and of SCAN ALL. The keys are serialized as RESP bulk strings as soon as
+// the shards return them, which takes a fraction of the memory of a vector of strings, and are
+// written to the socket chunk by chunk. A RESP array is prefixed by its length, so the reply can
+// only be sent once the whole keyspace is scanned.
+class KeysReply {
+ public:
+  void Add(string_view key);
 
-      OpScan(op_args, scan_opts, &cursor, keys);
-    });
-    if (cursor == 0) {
-      ++sid;
-      if (unsigned(sid) == shard_count)
-        break;
-    }
-  } while (keys->size() < scan_opts.limit);
+  void Send(ConnectionContext* cntx) const;
 
-  if (sid < shard_count) {
-    cursor = (cursor << 10) | sid;
-  } else {
-    DCHECK_EQ(0u, cursor);
+  size_t size() const {
+    return size_;
   }
 
-  return cursor;
+ private:
+  static constexpr size_t kChunkSize = 1 << 16;
+
+  vector<string> chunks_;
+  size_t size_ = 0;
+};
+
+void KeysReply::Add(string_view key) {
+  if (chunks_.empty() || chunks_.back().size() + key.size() + 16 > kChunkSize) {
+    chunks_.emplace_back();
+    chunks_.back().reserve(kChunkSize);
+  }
+  absl::StrAppend(&chunks_.back(), "$", key.size(), "\r\n", key, "\r\n");
+  ++size_;
+}
+
+void KeysReply::Send(ConnectionContext* cntx) const {
+  (*cntx)->StartArray(size_);
+  for (const string& chunk : chunks_) {
+    (*cntx)->SendRaw(chunk);
+  }
+}
+
+// Scans from cursor to the end of the keyspace, or until limit keys are found if limit is not 0.
+// Every step is bounded by the scan time budget of the shards and the fiber is suspended while
+// the shards run it, so that neither the shards nor the other connections of the thread stall.
+void ScanAll(uint64_t cursor, const ScanOpts& scan_opts, size_t limit, ConnectionContext* cntx,
+             KeysReply* reply) {
+  StringVec keys;
+  do {
+    keys.clear();
+    cursor = ScanGeneric(cursor, scan_opts, &keys, cntx);
+    for (const string& key : keys) {
+      reply->Add(key);
+    }
+  } while (cursor != 0 && (limit == 0 || reply->size() < limit));
 }
 
 OpStatus OpExpire(const OpArgs& op_args, string_view key, const DbSlice::ExpireParams& params) {
@@ -588,6 +779,322 @@ OpStatus OpExpire(const OpArgs& op_args, string_view key, const DbSlice::ExpireP
   return db_slice.UpdateExpire(op_args.db_cntx, it, expire_it, params);
 }
 
+// Journals a relative expiry as PEXPIREAT, so that the replica does not count it from the time
+// it applies the command.
+OpStatus OpExpireAbsolute(Transaction* t, EngineShard* shard, string_view key,
+                          const DbSlice::ExpireParams& params) {
+  OpArgs op_args = t->GetOpArgs(shard);
+  OpStatus status = OpExpire(op_args, key, params);
+  if (status != OpStatus::OK) {
+    t->RecordJournal(shard, {});
+    return status;
+  }
+
+  int64_t delta_ms = params.unit == TimeUnit::SEC ? params.value * 1000 : params.value;
+  string at_ms = absl::StrCat(int64_t(op_args.db_cntx.time_now_ms) + delta_ms);
+  t->RecordJournal(shard, {"PEXPIREAT", key, at_ms});
+  return status;
+}
+
+struct MigrateOptions {
+  string host;
+  uint16_t port = 0;
+  DbIndex db = 0;
+  uint32_t timeout_ms = 0;
+  bool copy = false;
+  bool replace = false;
+  string username;
+  string password;
+};
+
+// A command for the target of MIGRATE.
+struct MigrateCmd {
+  enum Kind : uint8_t {
+    RESTORE,  // restores the key whole.
+    CHUNK,    // adds the members of a chunk of the key into its temporary key.
+    RENAME,   // renames the complete temporary key into the key.
+    CLEANUP,  // deletes the temporary key.
+  };
+
+  vector<string> args;
+  Kind kind;
+  uint32_t key;  // the index of the key in the keys of the shard.
+};
+
+// The migration of the keys of a shard. Every hop into the shard fills cmds with about
+// migrate_batch_bytes, which the flow of the shard pipelines to the target through its own
+// connection.
+struct MigrateShard {
+  // The key, whose members are sent in chunks into a temporary key of the target.
+  struct Chunked {
+    uint32_t key;
+    string tmp_key;
+    uint64_t cursor = 0;
+  };
+
+  ArgSlice keys;
+  unique_ptr<MigrationClient> client;
+  size_t next_key = 0;
+  optional<Chunked> chunked;
+  bool chunk_failed = false;  // the target rejected a chunk of the chunked key.
+
+  vector<MigrateCmd> cmds;
+  vector<string_view> migrated;  // the keys that the target restored.
+  string error;
+  bool found = false;
+  bool failed = false;  // the connection broke.
+};
+
+// Up to this number of members are read by a single scan of a chunked container.
+constexpr size_t kMigrateScanCount = 128;
+
+// Values that use more memory than migrate_chunk_bytes are sent in chunks of members if their
+// encodings support it. The others are small, or not containers, and restored whole.
+bool IsChunked(const PrimeValue& pv) {
+  if (pv.MallocUsed() <= absl::GetFlag(FLAGS_migrate_chunk_bytes))
+    return false;
+
+  switch (pv.ObjType()) {
+    case OBJ_LIST:
+      return true;
+    case OBJ_SET:
+    case OBJ_HASH:
+      return pv.Encoding() == kEncodingStrMap2;
+    case OBJ_ZSET:
+      return pv.Encoding() == kEncodingSortedMap;
+  }
+  return false;
+}
+
+// Appends the command that adds the next chunk of the members of the value into the temporary
+// key, about budget bytes. Once the value is complete, appends the commands that set its expiry
+// and rename it. Returns the size of the members.
+size_t AddMigrateChunk(const MigrateOptions& opts, const PrimeValue& pv, uint64_t expire_ms,
+                       MigrateShard* ms, size_t budget) {
+  MigrateShard::Chunked& ch = *ms->chunked;
+  MigrateCmd cmd{{}, MigrateCmd::CHUNK, ch.key};
+  size_t bytes = 0;
+  auto add = [&](string_view arg) {
+    cmd.args.emplace_back(arg);
+    bytes += arg.size();
+  };
+
+  bool complete = false;
+  uint32_t cursor = ch.cursor;
+  switch (pv.ObjType()) {
+    case OBJ_LIST:
+      add("RPUSH");
+      add(ch.tmp_key);
+      container_utils::IterateList(
+          pv,
+          [&](container_utils::ContainerEntry ce) {
+            add(ce.ToString());
+            ++ch.cursor;
+            return bytes < budget;
+          },
+          ch.cursor);
+      complete = ch.cursor >= pv.Size();
+      break;
+    case OBJ_SET: {
+      add("SADD");
+      add(ch.tmp_key);
+      const StringSet* ss = static_cast<const StringSet*>(pv.RObjPtr());
+      do {
+        cursor = ss->Scan(cursor, kMigrateScanCount, [&](sds m) { add({m, sdslen(m)}); });
+      } while (cursor && bytes < budget);
+      break;
+    }
+    case OBJ_HASH: {
+      add("HSET");
+      add(ch.tmp_key);
+      const StringMap* sm = static_cast<const StringMap*>(pv.RObjPtr());
+      do {
+        cursor = sm->Scan(cursor, kMigrateScanCount, [&](sds entry) {
+          add(StringMap::Field(entry));
+          add(StringMap::Value(entry));
+        });
+      } while (cursor && bytes < budget);
+      break;
+    }
+    case OBJ_ZSET: {
+      add("ZADD");
+      add(ch.tmp_key);
+      const SortedMap* zs = static_cast<const SortedMap*>(pv.RObjPtr());
+      char buf[128];
+      do {
+        cursor = zs->Scan(cursor, kMigrateScanCount, [&](sds member, double score) {
+          add(RedisReplyBuilder::FormatDouble(score, buf, sizeof(buf)));
+          add({member, sdslen(member)});
+        });
+      } while (cursor && bytes < budget);
+      break;
+    }
+    default:
+      LOG(DFATAL) << "Unexpected type " << pv.ObjType();
+  }
+
+  if (pv.ObjType() != OBJ_LIST) {
+    ch.cursor = cursor;
+    complete = cursor == 0;
+  }
+
+  if (cmd.args.size() > 2)
+    ms->cmds.push_back(std::move(cmd));
+
+  if (complete) {
+    if (expire_ms) {
+      MigrateCmd cmd{{"PEXPIREAT", ch.tmp_key, absl::StrCat(expire_ms)}, MigrateCmd::CHUNK, ch.key};
+      ms->cmds.push_back(std::move(cmd));
+    }
+    string_view rename = opts.replace ? "RENAME" : "RENAMENX";
+    ms->cmds.push_back(MigrateCmd{{string(rename), ch.tmp_key, string(ms->keys[ch.key])},
+                                  MigrateCmd::RENAME, ch.key});
+    ms->chunked.reset();
+  }
+  return bytes;
+}
+
+// Fills the commands of the next batch of the shard, runs in the shard thread.
+void FillMigrateBatch(const OpArgs& op_args, const MigrateOptions& opts, TxId txid,
+                      MigrateShard* ms) {
+  auto& db_slice = op_args.shard->db_slice();
+  size_t budget = absl::GetFlag(FLAGS_migrate_batch_bytes);
+  size_t bytes = 0;
+
+  ms->cmds.clear();
+  if (ms->failed)
+    return;
+
+  while (bytes < budget) {
+    if (ms->chunked) {
+      MigrateShard::Chunked& ch = *ms->chunked;
+      auto [it, exp_it] = db_slice.FindExt(op_args.db_cntx, ms->keys[ch.key]);
+
+      // The transaction locks the key, however an earlier chunk may have failed on the target.
+      if (!IsValid(it) || ms->chunk_failed) {
+        ms->cmds.push_back(MigrateCmd{{"DEL", ch.tmp_key}, MigrateCmd::CLEANUP, ch.key});
+        ms->chunked.reset();
+        continue;
+      }
+
+      uint64_t expire_ms = db_slice.ExpireTime(exp_it);
+      bytes += AddMigrateChunk(opts, it->second, expire_ms, ms, budget - bytes);
+      continue;
+    }
+
+    if (ms->next_key == ms->keys.size())
+      break;
+
+    uint32_t index = ms->next_key++;
+    string_view key = ms->keys[index];
+    auto [it, exp_it] = db_slice.FindExt(op_args.db_cntx, key);
+    if (!IsValid(it))
+      continue;
+
+    ms->found = true;
+    if (IsChunked(it->second)) {
+      // The temporary key keeps the hash tag of the key, if it has one.
+      string tmp_key = absl::StrCat(key, ":migrate:", txid);
+      ms->chunked = MigrateShard::Chunked{index, tmp_key};
+      ms->chunk_failed = false;
+      ms->cmds.push_back(MigrateCmd{{"DEL", tmp_key}, MigrateCmd::CLEANUP, index});
+      continue;
+    }
+
+    string payload = DumpValue(it->second);
+    bytes += payload.size();
+    MigrateCmd cmd{{"RESTORE", string(key), absl::StrCat(db_slice.ExpireTime(exp_it)),
+                    std::move(payload), "ABSTTL"},
+                   MigrateCmd::RESTORE,
+                   index};
+    if (opts.replace)
+      cmd.args.push_back("REPLACE");
+    ms->cmds.push_back(std::move(cmd));
+  }
+}
+
+// Sends the batch of the shard to the target and records the keys that it restored. The rename
+// of a chunked key waits for the replies to its chunks, so that a partial value never replaces
+// the key on the target.
+void SendMigrateBatch(MigrateShard* ms) {
+  vector<MigrationClient::Reply> replies;
+  vector<string> busy_tmp_keys;  // the temporary keys that RENAMENX did not rename.
+  size_t sent = 0;
+
+  auto set_error = [ms](string error) {
+    if (ms->error.empty())
+      ms->error = std::move(error);
+  };
+
+  // Sends the commands up to end and handles their replies.
+  auto flush = [&](size_t end) {
+    for (size_t i = sent; i < end; ++i) {
+      const vector<string>& args = ms->cmds[i].args;
+      vector<string_view> views(args.begin(), args.end());
+      ms->client->AddCommand(views);
+    }
+
+    if (error_code ec = ms->client->Flush(&replies); ec) {
+      set_error(absl::StrCat("IOERR error or timeout with the target instance: ", ec.message()));
+      ms->failed = true;
+      return false;
+    }
+
+    for (size_t i = 0; i < replies.size(); ++i) {
+      const MigrateCmd& cmd = ms->cmds[sent + i];
+      const MigrationClient::Reply& reply = replies[i];
+      if (!reply.error.empty()) {
+        set_error(absl::StrCat("Target instance replied with error: ", reply.error));
+        if (cmd.kind == MigrateCmd::CHUNK)
+          ms->chunk_failed = true;
+        continue;
+      }
+
+      if (cmd.kind == MigrateCmd::RESTORE) {
+        ms->migrated.push_back(ms->keys[cmd.key]);
+      } else if (cmd.kind == MigrateCmd::RENAME) {
+        // RENAMENX replies 0 if the key exists on the target.
+        if (cmd.args[0] == "RENAMENX" && reply.ival == 0) {
+          set_error("Target instance replied with error: BUSYKEY Target key name already exists.");
+          busy_tmp_keys.push_back(cmd.args[1]);
+        } else {
+          ms->migrated.push_back(ms->keys[cmd.key]);
+        }
+      }
+    }
+    sent = end;
+    return true;
+  };
+
+  // FillMigrateBatch handled the failures of the previous batches.
+  ms->chunk_failed = false;
+  for (size_t i = 0; i < ms->cmds.size(); ++i) {
+    MigrateCmd& cmd = ms->cmds[i];
+    if (cmd.kind != MigrateCmd::RENAME)
+      continue;
+
+    // The chunks of the renamed key precede it, since a shard sends one chunked key at a time.
+    ms->chunk_failed = false;
+    if (!flush(i))
+      return;
+    if (ms->chunk_failed)
+      cmd = MigrateCmd{{"DEL", cmd.args[1]}, MigrateCmd::CLEANUP, cmd.key};
+    ms->chunk_failed = false;
+  }
+
+  if (!flush(ms->cmds.size()) || busy_tmp_keys.empty())
+    return;
+
+  for (const string& tmp_key : busy_tmp_keys) {
+    string_view args[] = {"DEL", tmp_key};
+    ms->client->AddCommand(args);
+  }
+  if (error_code ec = ms->client->Flush(&replies); ec) {
+    set_error(absl::StrCat("IOERR error or timeout with the target instance: ", ec.message()));
+    ms->failed = true;
+  }
+}
+
 }  // namespace
 
 void GenericFamily::Init(util::ProactorPool* pp) {
@@ -597,15 +1104,23 @@ void GenericFamily::Shutdown() {
 }
 
 void GenericFamily::Del(CmdArgList args, ConnectionContext* cntx) {
+  DelGeneric(args, false, cntx);
+}
+
+void GenericFamily::Unlink(CmdArgList args, ConnectionContext* cntx) {
+  DelGeneric(args, true, cntx);
+}
+
+void GenericFamily::DelGeneric(CmdArgList args, bool lazy, ConnectionContext* cntx) {
   Transaction* transaction = cntx->transaction;
   VLOG(1) << "Del " << ArgS(args, 1);
 
   atomic_uint32_t result{0};
   bool is_mc = cntx->protocol() == Protocol::MEMCACHE;
 
-  auto cb = [&result](const Transaction* t, EngineShard* shard) {
+  auto cb = [&result, lazy](const Transaction* t, EngineShard* shard) {
     ArgSlice args = t->ShardArgsInShard(shard->shard_id());
-    auto res = OpDel(t->GetOpArgs(shard), args);
+    auto res = OpDel(t->GetOpArgs(shard), args, lazy);
     result.fetch_add(res.value_or(0), memory_order_relaxed);
 
     return OpStatus::OK;
@@ -624,7 +1139,7 @@ void GenericFamily::Del(CmdArgList args, ConnectionContext* cntx) {
     if (del_cnt == 0) {
       mc_builder->SendNotFound();
     } else {
-      mc_builder->SendSimpleString("DELETED");
+      mc_builder->SendDeleted();
     }
   } else {
     (*cntx)->SendLong(del_cnt);
@@ -695,7 +1210,7 @@ void GenericFamily::Expire(CmdArgList args, ConnectionContext* cntx) {
   DbSlice::ExpireParams params{.value = int_arg};
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpExpire(t->GetOpArgs(shard), key, params);
+    return OpExpireAbsolute(t, shard, key, params);
   };
 
   OpStatus status = cntx->transaction->ScheduleSingleHop(move(cb));
@@ -727,24 +1242,13 @@ void GenericFamily::ExpireAt(CmdArgList args, ConnectionContext* cntx) {
 }
 
 void GenericFamily::Keys(CmdArgList args, ConnectionContext* cntx) {
-  string_view pattern(ArgS(args, 1));
-  uint64_t cursor = 0;
-
-  StringVec keys;
-
   ScanOpts scan_opts;
-  scan_opts.pattern = pattern;
+  scan_opts.pattern = ArgS(args, 1);
   scan_opts.limit = 512;
-  auto output_limit = absl::GetFlag(FLAGS_keys_output_limit);
-
-  do {
-    cursor = ScanGeneric(cursor, scan_opts, &keys, cntx);
-  } while (cursor != 0 && keys.size() < output_limit);
 
-  (*cntx)->StartArray(keys.size());
-  for (const auto& k : keys) {
-    (*cntx)->SendBulkString(k);
-  }
+  KeysReply reply;
+  ScanAll(0, scan_opts, absl::GetFlag(FLAGS_keys_output_limit), cntx, &reply);
+  reply.Send(cntx);
 }
 
 void GenericFamily::PexpireAt(CmdArgList args, ConnectionContext* cntx) {
@@ -782,7 +1286,7 @@ void GenericFamily::Pexpire(CmdArgList args, ConnectionContext* cntx) {
   DbSlice::ExpireParams params{.value = int_arg, .unit = TimeUnit::MSEC};
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpExpire(t->GetOpArgs(shard), key, params);
+    return OpExpireAbsolute(t, shard, key, params);
   };
   OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
 
@@ -913,11 +1417,73 @@ OpResult<SortEntryList> OpFetchSortEntries(const OpArgs& op_args, std::string_vi
   return success ? OpResult{std::move(result)} : OpStatus::WRONG_TYPE;
 }
 
+// Numeric sorts of at least that many entries use the radix sort, unless LIMIT selects a small
+// part of them.
+constexpr size_t kRadixSortMinLen = 512;
+
+// Maps the score to an unsigned key that has the same order.
+uint64_t RadixKey(double score) {
+  uint64_t bits;
+  memcpy(&bits, &score, sizeof(bits));
+  return (bits >> 63) ? ~bits : bits | (1ULL << 63);
+}
+
+// LSD radix sort of the scores, returns the indices of the entries in the sorted order. Skips
+// the bytes that are equal in all the keys, e.g. the high bytes of small integers.
+std::vector<uint32_t> RadixSortOrder(const std::vector<SortEntry<false>>& entries,
+                                     bool reversed) {
+  size_t n = entries.size();
+  std::vector<std::pair<uint64_t, uint32_t>> items(n), tmp(n);
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t key = RadixKey(entries[i].score);
+    items[i] = {reversed ? ~key : key, uint32_t(i)};
+  }
+
+  for (unsigned shift = 0; shift < 64; shift += 8) {
+    size_t count[256] = {0};
+    for (const auto& item : items)
+      ++count[(item.first >> shift) & 0xFF];
+    if (count[(items[0].first >> shift) & 0xFF] == n)
+      continue;
+
+    size_t pos = 0;
+    for (size_t& c : count) {
+      size_t len = c;
+      c = pos;
+      pos += len;
+    }
+    for (const auto& item : items)
+      tmp[count[(item.first >> shift) & 0xFF]++] = item;
+    items.swap(tmp);
+  }
+
+  std::vector<uint32_t> order(n);
+  for (size_t i = 0; i < n; ++i)
+    order[i] = items[i].second;
+  return order;
+}
+
+// Orders the entries so that [start, end) holds that range of the sorted entries. Only the
+// range is sorted, after it was selected in linear time.
+template <typename Entries>
+void SortRange(size_t start, size_t end, bool reversed, Entries* entries) {
+  auto cmp = [reversed](const auto& lhs, const auto& rhs) {
+    return reversed ? rhs.Cmp() < lhs.Cmp() : lhs.Cmp() < rhs.Cmp();
+  };
+
+  auto first = entries->begin();
+  if (end < entries->size())
+    std::nth_element(first, first + end, entries->end(), cmp);
+  if (start > 0)
+    std::nth_element(first, first + start, first + end, cmp);
+  std::sort(first + start, first + end, cmp);
+}
+
 void GenericFamily::Sort(CmdArgList args, ConnectionContext* cntx) {
   std::string_view key = ArgS(args, 1);
   bool alpha = false;
   bool reversed = false;
-  std::optional<std::pair<size_t, size_t>> bounds;
+  int64_t offset = 0, count = -1;
 
   for (size_t i = 2; i < args.size(); i++) {
     ToUpper(&args[i]);
@@ -925,19 +1491,22 @@ void GenericFamily::Sort(CmdArgList args, ConnectionContext* cntx) {
     std::string_view arg = ArgS(args, i);
     if (arg == "ALPHA") {
       alpha = true;
+    } else if (arg == "ASC") {
+      reversed = false;
     } else if (arg == "DESC") {
       reversed = true;
     } else if (arg == "LIMIT") {
-      int offset, limit;
       if (i + 2 >= args.size()) {
         return (*cntx)->SendError(kSyntaxErr);
       }
       if (!absl::SimpleAtoi(ArgS(args, i + 1), &offset) ||
-          !absl::SimpleAtoi(ArgS(args, i + 2), &limit)) {
+          !absl::SimpleAtoi(ArgS(args, i + 2), &count)) {
         return (*cntx)->SendError(kInvalidIntErr);
       }
-      bounds = {offset, limit};
       i += 2;
+    } else {
+      // BY, GET and STORE are not supported.
+      return (*cntx)->SendError(kSyntaxErr);
     }
   }
 
@@ -952,30 +1521,30 @@ void GenericFamily::Sort(CmdArgList args, ConnectionContext* cntx) {
   if (!entries.ok())
     return (*cntx)->SendEmptyArray();
 
-  auto sort_call = [cntx, bounds, reversed](auto& entries) {
-    if (bounds) {
-      auto sort_it = entries.begin() + std::min(bounds->first + bounds->second, entries.size());
-      std::partial_sort(entries.begin(), sort_it, entries.end(),
-                        [reversed](const auto& lhs, const auto& rhs) {
-                          return bool(lhs.Cmp() < rhs.Cmp()) ^ reversed;
-                        });
-    } else {
-      std::sort(entries.begin(), entries.end(), [reversed](const auto& lhs, const auto& rhs) {
-        return bool(lhs.Cmp() < rhs.Cmp()) ^ reversed;
-      });
-    }
-
-    auto start_it = entries.begin();
-    auto end_it = entries.end();
-    if (bounds) {
-      start_it += std::min(bounds->first, entries.size());
-      end_it = entries.begin() + std::min(bounds->first + bounds->second, entries.size());
+  auto sort_call = [cntx, offset, count, reversed](auto& entries) {
+    // As in redis, a negative offset starts from the first entry and a negative count returns
+    // all the entries from the offset.
+    size_t size = entries.size();
+    size_t start = std::min<size_t>(std::max<int64_t>(offset, 0), size);
+    size_t end = count < 0 ? size : start + std::min<size_t>(count, size - start);
+
+    (*cntx)->StartArray(end - start);
+    if (start == end)
+      return;
+
+    using Entry = typename std::decay_t<decltype(entries)>::value_type;
+    if constexpr (std::is_same_v<Entry, SortEntry<false>>) {
+      if (size >= kRadixSortMinLen && (end - start) * 4 >= size) {
+        std::vector<uint32_t> order = RadixSortOrder(entries, reversed);
+        for (size_t i = start; i < end; ++i)
+          (*cntx)->SendBulkString(entries[order[i]].key);
+        return;
+      }
     }
 
-    (*cntx)->StartArray(std::distance(start_it, end_it));
-    for (auto it = start_it; it != end_it; ++it) {
-      (*cntx)->SendBulkString(it->key);
-    }
+    SortRange(start, end, reversed, &entries);
+    for (size_t i = start; i < end; ++i)
+      (*cntx)->SendBulkString(entries[i].key);
   };
   std::visit(std::move(sort_call), entries.value());
 }
@@ -1021,6 +1590,159 @@ void GenericFamily::Restore(CmdArgList args, ConnectionContext* cntx) {
   }
 }
 
+// MIGRATE host port key|"" destination-db timeout [COPY] [REPLACE] [AUTH password]
+// [AUTH2 username password] [KEYS key [key ...]]
+// The transaction locks the keys for the whole migration. Every shard of the keys migrates
+// them through its own connection to the target, in hops that serialize a batch of them,
+// between which the batches are pipelined to the target in parallel.
+void GenericFamily::Migrate(CmdArgList args, ConnectionContext* cntx) {
+  MigrateOptions opts;
+  opts.host = ArgS(args, 1);
+  int64_t db = 0, timeout_ms = 0;
+  if (!absl::SimpleAtoi(ArgS(args, 2), &opts.port) || !absl::SimpleAtoi(ArgS(args, 4), &db) ||
+      !absl::SimpleAtoi(ArgS(args, 5), &timeout_ms)) {
+    return (*cntx)->SendError(kInvalidIntErr);
+  }
+  if (db < 0 || db >= absl::GetFlag(FLAGS_dbnum)) {
+    return (*cntx)->SendError(kDbIndOutOfRangeErr);
+  }
+  opts.db = db;
+  opts.timeout_ms = timeout_ms <= 0 ? 1000 : timeout_ms;
+
+  for (size_t i = 6; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view opt = ArgS(args, i);
+    if (opt == "COPY") {
+      opts.copy = true;
+    } else if (opt == "REPLACE") {
+      opts.replace = true;
+    } else if (opt == "AUTH" && i + 1 < args.size()) {
+      opts.password = ArgS(args, ++i);
+    } else if (opt == "AUTH2" && i + 2 < args.size()) {
+      opts.username = ArgS(args, ++i);
+      opts.password = ArgS(args, ++i);
+    } else if (opt == "KEYS" && i + 1 < args.size()) {
+      if (!ArgS(args, 3).empty()) {
+        return (*cntx)->SendError(
+            "When using MIGRATE KEYS option, the key argument must be set to the empty string");
+      }
+      break;  // the keys follow.
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
+  Transaction* t = cntx->transaction;
+  vector<MigrateShard> shards(shard_set->size());
+  vector<ShardId> active;
+  for (ShardId sid = 0; sid < shards.size(); ++sid) {
+    if (t->IsActive(sid)) {
+      shards[sid].keys = t->ShardArgsInShard(sid);
+      shards[sid].client = make_unique<MigrationClient>(opts.timeout_ms);
+      active.push_back(sid);
+    }
+  }
+
+  // Runs fn for every active shard in parallel, each in a fiber of this thread.
+  auto run_flows = [&](auto fn) {
+    vector<util::fibers_ext::Fiber> flows;
+    for (ShardId sid : active)
+      flows.push_back(
+          util::ProactorBase::me()->LaunchFiber([&fn, &shards, sid] { fn(&shards[sid]); }));
+    for (auto& flow : flows)
+      flow.Join();
+  };
+
+  // The connections are set up before the keys are locked.
+  run_flows([&opts](MigrateShard* ms) {
+    error_code ec = ms->client->Connect(opts.host, opts.port);
+    if (ec) {
+      ms->error = absl::StrCat("IOERR error or timeout connecting to the client: ", ec.message());
+      ms->failed = true;
+      return;
+    }
+
+    StringVec auth = {"AUTH"};
+    if (!opts.username.empty())
+      auth.push_back(opts.username);
+    auth.push_back(opts.password);
+    string db = absl::StrCat(opts.db);
+    if (!opts.password.empty())
+      ms->client->AddCommand(vector<string_view>(auth.begin(), auth.end()));
+    string_view select[] = {"SELECT", db};
+    ms->client->AddCommand(select);
+
+    vector<MigrationClient::Reply> replies;
+    ec = ms->client->Flush(&replies);
+    for (const auto& reply : replies) {
+      if (!reply.error.empty() && ms->error.empty())
+        ms->error = absl::StrCat("Target instance replied with error: ", reply.error);
+    }
+    if (ec || !ms->error.empty()) {
+      if (ms->error.empty())
+        ms->error = absl::StrCat("IOERR error or timeout with the target instance: ", ec.message());
+      ms->failed = true;
+    }
+  });
+
+  bool connected = all_of(active.begin(), active.end(),
+                          [&shards](ShardId sid) { return !shards[sid].failed; });
+  if (!connected) {
+    for (ShardId sid : active) {
+      if (!shards[sid].error.empty())
+        return (*cntx)->SendError(shards[sid].error);
+    }
+  }
+
+  t->Schedule();
+
+  auto fill_cb = [&](Transaction* t, EngineShard* shard) {
+    FillMigrateBatch(t->GetOpArgs(shard), opts, t->txid(), &shards[shard->shard_id()]);
+    return OpStatus::OK;
+  };
+
+  while (true) {
+    t->Execute(fill_cb, false);
+    bool pending = any_of(active.begin(), active.end(),
+                          [&shards](ShardId sid) { return !shards[sid].cmds.empty(); });
+    if (!pending)
+      break;
+
+    run_flows([](MigrateShard* ms) {
+      if (!ms->cmds.empty())
+        SendMigrateBatch(ms);
+    });
+  }
+
+  // The restored keys are deleted and journaled as DEL instead of MIGRATE.
+  auto del_cb = [&](Transaction* t, EngineShard* shard) {
+    MigrateShard& ms = shards[shard->shard_id()];
+    if (opts.copy || ms.migrated.empty()) {
+      t->RecordJournal(shard, {});
+      return OpStatus::OK;
+    }
+
+    OpDel(t->GetOpArgs(shard), ms.migrated);
+    vector<string_view> del = {"DEL"};
+    del.insert(del.end(), ms.migrated.begin(), ms.migrated.end());
+    t->RecordJournal(shard, del);
+    return OpStatus::OK;
+  };
+  t->Execute(std::move(del_cb), true);
+
+  bool found = false;
+  for (ShardId sid : active) {
+    shards[sid].client->Close();
+    if (!shards[sid].error.empty())
+      return (*cntx)->SendError(shards[sid].error);
+    found |= shards[sid].found;
+  }
+
+  if (!found)
+    return (*cntx)->SendSimpleString("NOKEY");
+  (*cntx)->SendOk();
+}
+
 void GenericFamily::Move(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
   int64_t target_db;
@@ -1111,6 +1833,9 @@ void GenericFamily::Select(CmdArgList args, ConnectionContext* cntx) {
   if (index < 0 || index >= absl::GetFlag(FLAGS_dbnum)) {
     return (*cntx)->SendError(kDbIndOutOfRangeErr);
   }
+  if (ClusterConfig::IsEnabled() && index != 0) {
+    return (*cntx)->SendError("SELECT is not allowed in cluster mode");
+  }
   cntx->conn_state.db_index = index;
   auto cb = [index](EngineShard* shard) {
     shard->db_slice().ActivateDb(index);
@@ -1211,7 +1936,21 @@ void GenericFamily::Scan(CmdArgList args, ConnectionContext* cntx) {
     return (*cntx)->SendError("invalid cursor");
   }
 
-  OpResult<ScanOpts> ops = ScanOpts::TryFrom(args.subspan(2));
+  // SCAN cursor ALL [MATCH pattern] [COUNT count] [TYPE type] scans to the end of the keyspace
+  // and replies with all the keys at once, like KEYS does.
+  bool all = false;
+  CmdArgVec opt_args;
+  for (size_t i = 2; i < args.size(); ++i) {
+    if (absl::EqualsIgnoreCase(ArgS(args, i), "ALL")) {
+      all = true;
+      continue;
+    }
+    opt_args.push_back(args[i]);
+    if (i + 1 < args.size())
+      opt_args.push_back(args[++i]);
+  }
+
+  OpResult<ScanOpts> ops = ScanOpts::TryFrom(CmdArgList{opt_args});
   if (!ops) {
     DVLOG(1) << "Scan invalid args - return " << ops << " to the user";
     return (*cntx)->SendError(ops.status());
@@ -1219,6 +1958,14 @@ void GenericFamily::Scan(CmdArgList args, ConnectionContext* cntx) {
 
   ScanOpts scan_op = ops.value();
 
+  if (all) {
+    KeysReply reply;
+    ScanAll(cursor, scan_op, 0, cntx, &reply);
+    (*cntx)->StartArray(2);
+    (*cntx)->SendBulkString("0");
+    return reply.Send(cntx);
+  }
+
   StringVec keys;
   cursor = ScanGeneric(cursor, scan_op, &keys, cntx);
 
@@ -1244,18 +1991,17 @@ OpResult<uint64_t> GenericFamily::OpTtl(Transaction* t, EngineShard* shard, stri
   return ttl_ms;
 }
 
-OpResult<uint32_t> GenericFamily::OpDel(const OpArgs& op_args, ArgSlice keys) {
+OpResult<uint32_t> GenericFamily::OpDel(const OpArgs& op_args, ArgSlice keys, bool lazy) {
   DVLOG(1) << "Del: " << keys[0];
   auto& db_slice = op_args.shard->db_slice();
 
   uint32_t res = 0;
 
-  for (uint32_t i = 0; i < keys.size(); ++i) {
-    auto fres = db_slice.FindExt(op_args.db_cntx, keys[i]);
-    if (!IsValid(fres.first))
-      continue;
-    res += int(db_slice.Del(op_args.db_cntx.db_index, fres.first));
-  }
+  // Deletions do not move other entries in the table so it's safe to delete
+  // from within the batched lookup.
+  db_slice.FindMany(op_args.db_cntx, keys, [&](unsigned, PrimeIterator it, ExpireIterator) {
+    res += int(db_slice.Del(op_args.db_cntx.db_index, it, lazy));
+  });
 
   return res;
 }
@@ -1265,10 +2011,8 @@ OpResult<uint32_t> GenericFamily::OpExists(const OpArgs& op_args, ArgSlice keys)
   auto& db_slice = op_args.shard->db_slice();
   uint32_t res = 0;
 
-  for (uint32_t i = 0; i < keys.size(); ++i) {
-    auto find_res = db_slice.FindExt(op_args.db_cntx, keys[i]);
-    res += IsValid(find_res.first);
-  }
+  db_slice.FindMany(op_args.db_cntx, keys,
+                    [&](unsigned, PrimeIterator it, ExpireIterator) { res += IsValid(it); });
   return res;
 }
 
@@ -1295,7 +2039,7 @@ OpResult<void> GenericFamily::OpRen(const OpArgs& op_args, string_view from_key,
   // we keep the value we want to move.
   PrimeValue from_obj = std::move(from_it->second);
 
-  // Restore the expire flag on 'from' so we could delete it from expire table.
+  // Restore the expire flag on 'from' so that Del accounts for its deadline.
   from_it->second.SetExpire(IsValid(from_expire));
 
   if (IsValid(to_it)) {
@@ -1391,7 +2135,7 @@ void GenericFamily::Register(CommandRegistry* registry) {
              * We don't allow PING during loading since in Redis PING is used as
              * failure detection, and a loading server is considered to be
              * not available. */
-            << CI{"PING", CO::FAST, -1, 0, 0, 0}.HFUNC(Ping)
+            << CI{"PING", CO::FAST | CO::PRIORITY, -1, 0, 0, 0}.HFUNC(Ping)
             << CI{"ECHO", CO::LOADING | CO::FAST, 2, 0, 0, 0}.HFUNC(Echo)
             << CI{"EXISTS", CO::READONLY | CO::FAST, -2, 1, -1, 1}.HFUNC(Exists)
             << CI{"TOUCH", CO::READONLY | CO::FAST, -2, 1, -1, 1}.HFUNC(Exists)
@@ -1410,11 +2154,14 @@ void GenericFamily::Register(CommandRegistry* registry) {
             << CI{"TIME", CO::LOADING | CO::FAST, 1, 0, 0, 0}.HFUNC(Time)
             << CI{"TYPE", CO::READONLY | CO::FAST | CO::LOADING, 2, 1, 1, 1}.HFUNC(Type)
             << CI{"DUMP", CO::READONLY, 2, 1, 1, 1}.HFUNC(Dump)
-            << CI{"UNLINK", CO::WRITE, -2, 1, -1, 1}.HFUNC(Del)
+            << CI{"UNLINK", CO::WRITE, -2, 1, -1, 1}.HFUNC(Unlink)
             << CI{"STICK", CO::WRITE, -2, 1, -1, 1}.HFUNC(Stick)
             << CI{"SORT", CO::READONLY, -2, 1, 1, 1}.HFUNC(Sort)
+            << CI{"SORT_RO", CO::READONLY, -2, 1, 1, 1}.HFUNC(Sort)
             << CI{"MOVE", CO::WRITE | CO::GLOBAL_TRANS, 3, 1, 1, 1}.HFUNC(Move)
-            << CI{"RESTORE", CO::WRITE, -4, 1, 1, 1}.HFUNC(Restore);
+            << CI{"RESTORE", CO::WRITE, -4, 1, 1, 1}.HFUNC(Restore)
+            << CI{"MIGRATE", CO::WRITE | CO::VARIADIC_KEYS | CO::NOSCRIPT, -6, 3, 3, 1}
+                   .HFUNC(Migrate);
 }
 
 }  // namespace dfly
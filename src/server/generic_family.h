@@ -33,6 +33,7 @@ class GenericFamily {
 
  private:
   static void Del(CmdArgList args, ConnectionContext* cntx);
+  static void Unlink(CmdArgList args, ConnectionContext* cntx);
   static void Ping(CmdArgList args, ConnectionContext* cntx);
   static void Exists(CmdArgList args, ConnectionContext* cntx);
   static void Expire(CmdArgList args, ConnectionContext* cntx);
@@ -57,13 +58,16 @@ class GenericFamily {
   static void Type(CmdArgList args, ConnectionContext* cntx);
   static void Dump(CmdArgList args, ConnectionContext* cntx);
   static void Restore(CmdArgList args, ConnectionContext* cntx);
+  static void Migrate(CmdArgList args, ConnectionContext* cntx);
 
   static OpResult<void> RenameGeneric(CmdArgList args, bool skip_exist_dest,
                                       ConnectionContext* cntx);
+  static void DelGeneric(CmdArgList args, bool lazy, ConnectionContext* cntx);
   static void TtlGeneric(CmdArgList args, ConnectionContext* cntx, TimeUnit unit);
 
   static OpResult<uint64_t> OpTtl(Transaction* t, EngineShard* shard, std::string_view key);
-  static OpResult<uint32_t> OpDel(const OpArgs& op_args, ArgSlice keys);
+  // If lazy is set, large values are freed in the background, see LazyFreeQueue.
+  static OpResult<uint32_t> OpDel(const OpArgs& op_args, ArgSlice keys, bool lazy = false);
   static OpResult<void> OpRen(const OpArgs& op_args, std::string_view from, std::string_view to,
                               bool skip_exists);
   static OpResult<uint32_t> OpStick(const OpArgs& op_args, ArgSlice keys);
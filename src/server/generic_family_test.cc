@@ -4,6 +4,8 @@
 
 #include "server/generic_family.h"
 
+#include <set>
+
 extern "C" {
 #include "redis/rdb.h"
 }
@@ -97,6 +99,50 @@ TEST_F(GenericFamilyTest, Del) {
   del_fb.Join();
 }
 
+TEST_F(GenericFamilyTest, Unlink) {
+  for (size_t i = 0; i < 1000; ++i) {
+    Run({"sadd", "set", StrCat(i)});
+    Run({"rpush", "list", StrCat(i)});
+  }
+  Run({"sadd", "small", "a"});
+  Run({"set", "str", "foo"});
+
+  EXPECT_EQ(4, CheckedInt({"unlink", "set", "list", "small", "str", "missing"}));
+  EXPECT_EQ(0, CheckedInt({"exists", "set", "list", "small", "str"}));
+
+  // The lists and sets that were unlinked are freed in the background.
+  auto metrics = service_->server_family().GetMetrics();
+  EXPECT_EQ(2u, metrics.lazy_free.pending_objects + metrics.lazy_free.freed_objects);
+  while (service_->server_family().GetMetrics().lazy_free.pending_objects > 0) {
+    fibers_ext::SleepFor(1ms);
+  }
+  EXPECT_EQ(0u, service_->server_family().GetMetrics().lazy_free.pending_bytes);
+
+  Run({"sadd", "set", "a"});
+  EXPECT_EQ(1, CheckedInt({"scard", "set"}));
+}
+
+TEST_F(GenericFamilyTest, FlushAsync) {
+  for (size_t i = 0; i < 1000; ++i) {
+    Run({"set", StrCat("key", i), "1"});
+    Run({"hset", "hash", StrCat(i), "1"});
+  }
+
+  EXPECT_EQ("OK", Run({"flushdb", "async"}));
+  EXPECT_EQ(0, CheckedInt({"dbsize"}));
+  while (service_->server_family().GetMetrics().lazy_free.pending_objects > 0) {
+    fibers_ext::SleepFor(1ms);
+  }
+
+  Run({"set", "key", "1"});
+  EXPECT_EQ("OK", Run({"flushall", "sync"}));
+  EXPECT_EQ(0, CheckedInt({"dbsize"}));
+  EXPECT_EQ(0u, service_->server_family().GetMetrics().lazy_free.pending_objects);
+
+  EXPECT_THAT(Run({"flushdb", "later"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"flushall", "sync", "async"}), ErrArg("syntax error"));
+}
+
 TEST_F(GenericFamilyTest, TTL) {
   EXPECT_EQ(-2, CheckedInt({"ttl", "foo"}));
   EXPECT_EQ(-2, CheckedInt({"pttl", "foo"}));
@@ -105,6 +151,36 @@ TEST_F(GenericFamilyTest, TTL) {
   EXPECT_EQ(-1, CheckedInt({"pttl", "foo"}));
 }
 
+TEST_F(GenericFamilyTest, ExpireCount) {
+  auto expires = [&] { return service_->server_family().GetMetrics().db[0].expire_count; };
+
+  Run({"debug", "populate", "1000"});
+  for (unsigned i = 0; i < 1000; i += 2) {
+    Run({"pexpire", absl::StrCat("key:", i), "100"});
+  }
+  EXPECT_EQ(500u, expires());
+
+  // Long periods are rounded to seconds.
+  Run({"pexpire", "key:1", "3000000400"});
+  EXPECT_NEAR(3000000400, CheckedInt({"pttl", "key:1"}), 1000);
+  EXPECT_EQ(501u, expires());
+  Run({"persist", "key:1"});
+  EXPECT_EQ(-1, CheckedInt({"pttl", "key:1"}));
+
+  // The deadline moves with the key.
+  Run({"rename", "key:0", "renamed"});
+  EXPECT_EQ(100, CheckedInt({"pttl", "renamed"}));
+  EXPECT_EQ(500u, expires());
+
+  AdvanceTime(100);
+  for (unsigned i = 2; i < 1000; i += 2) {
+    Run({"exists", absl::StrCat("key:", i)});
+  }
+  Run({"exists", "renamed"});
+  EXPECT_EQ(0u, expires());
+  EXPECT_EQ(500, CheckedInt({"dbsize"}));
+}
+
 TEST_F(GenericFamilyTest, Exists) {
   Run({"mset", "x", "0", "y", "1"});
   auto resp = Run({"exists", "x", "y", "x"});
@@ -307,6 +383,111 @@ TEST_F(GenericFamilyTest, Scan) {
   EXPECT_THAT(vec, Each(StartsWith("zset")));
 }
 
+// A full scan visits every key once, although the shards are scanned in parallel.
+TEST_F(GenericFamilyTest, ScanAll) {
+  Run({"debug", "populate", "10000"});
+  Run({"set", "foo", "bar"});
+
+  set<string> found;
+  string cursor = "0";
+  unsigned calls = 0;
+  do {
+    auto resp = Run({"scan", cursor, "count", "100"});
+    ASSERT_THAT(resp, ArrLen(2));
+    cursor = ToSV(resp.GetVec()[0].GetBuf());
+
+    vector<string> keys = StrArray(resp.GetVec()[1]);
+    EXPECT_LE(keys.size(), 200u);
+    for (const auto& key : keys) {
+      ASSERT_TRUE(found.insert(key).second) << key;
+    }
+    ++calls;
+  } while (cursor != "0");
+
+  EXPECT_EQ(10001, found.size());
+  EXPECT_GT(calls, 50);
+
+  // Few keys match, so every call covers a large part of the table.
+  found.clear();
+  do {
+    auto resp = Run({"scan", cursor, "match", "key:1*", "type", "string"});
+    cursor = ToSV(resp.GetVec()[0].GetBuf());
+    for (const auto& key : StrArray(resp.GetVec()[1])) {
+      ASSERT_TRUE(found.insert(key).second) << key;
+    }
+  } while (cursor != "0");
+  EXPECT_EQ(1111, found.size());
+
+  EXPECT_THAT(Run({"scan", "1099511627776"}).GetVec()[0], "0");
+}
+
+TEST_F(GenericFamilyTest, KeysAll) {
+  Run({"debug", "populate", "20000"});
+
+  auto resp = Run({"keys", "*"});
+  vector<string> keys = StrArray(resp);
+  EXPECT_EQ(20000, set<string>(keys.begin(), keys.end()).size());
+  EXPECT_EQ(1111, StrArray(Run({"keys", "key:1*"})).size());
+
+  resp = Run({"scan", "0", "all", "match", "key:1*", "count", "10"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec()[0], "0");
+  keys = StrArray(resp.GetVec()[1]);
+  EXPECT_EQ(1111, set<string>(keys.begin(), keys.end()).size());
+
+  Run({"set", "all", "bar"});
+  resp = Run({"scan", "0", "match", "all", "ALL"});
+  EXPECT_THAT(StrArray(resp.GetVec()[1]), ElementsAre("all"));
+  EXPECT_THAT(Run({"scan", "0", "all", "foo"}), ErrArg("syntax error"));
+}
+
+TEST_F(GenericFamilyTest, ScanPrefixIndex) {
+  Run({"debug", "populate", "10000"});
+  for (unsigned i = 0; i < 300; ++i) {
+    Run({"set", absl::StrCat("t:", i % 3, ":", i), "v"});
+  }
+  shard_set->RunBriefInParallel(
+      [](EngineShard* shard) { shard->db_slice().EnablePrefixIndex(":"); });
+  Run({"set", "t:1:new", "v"});
+  Run({"set", "t:1:expiring", "v", "px", "10"});
+  Run({"del", "t:1:1"});
+
+  auto scan_all = [&](string_view pattern) {
+    set<string> found;
+    string cursor = "0";
+    do {
+      auto resp = Run({"scan", cursor, "match", pattern, "count", "7"});
+      cursor = ToSV(resp.GetVec()[0].GetBuf());
+      for (const auto& key : StrArray(resp.GetVec()[1])) {
+        EXPECT_TRUE(found.insert(key).second) << key;
+      }
+    } while (cursor != "0");
+    return found;
+  };
+
+  set<string> found = scan_all("t:1:*");
+  EXPECT_EQ(101, found.size());
+  EXPECT_TRUE(found.count("t:1:new"));
+  EXPECT_FALSE(found.count("t:1:1"));
+
+  AdvanceTime(20);
+  EXPECT_EQ(100, scan_all("t:1:*").size());
+  EXPECT_EQ(38, scan_all("t:1:1*").size());
+  EXPECT_EQ(1111, StrArray(Run({"keys", "key:1*"})).size());
+
+  // INFO reads the memory of the index from what the shards publish on their heartbeat.
+  shard_set->TEST_EnableHeartBeat();
+  string info;
+  for (unsigned i = 0; i < 1000; ++i) {
+    info = Run({"info", "memory"}).GetString();
+    if (info.find("prefix_index_used_memory:0\r\n") == string::npos)
+      break;
+    fibers_ext::SleepFor(1ms);
+  }
+  EXPECT_THAT(info, HasSubstr("prefix_index_used_memory:"));
+  EXPECT_THAT(info, Not(HasSubstr("prefix_index_used_memory:0\r\n")));
+}
+
 TEST_F(GenericFamilyTest, Sort) {
   // Test list sort with params
   Run({"del", "list-1"});
@@ -372,6 +553,49 @@ TEST_F(GenericFamilyTest, Sort) {
   ASSERT_THAT(Run({"sort", "list-2"}), ErrArg("One or more scores can't be converted into double"));
 }
 
+TEST_F(GenericFamilyTest, SortLarge) {
+  // Enough entries for the radix sort, with negative numbers and duplicates.
+  vector<string> cmd{"rpush", "list-1"};
+  vector<double> scores;
+  for (int i = 0; i < 2000; ++i) {
+    double score = double((i * 7919) % 1500 - 700) / 4;
+    scores.push_back(score);
+    cmd.push_back(absl::StrCat(score));
+  }
+  vector<string_view> args(cmd.begin(), cmd.end());
+  Run(ArgSlice{args});
+
+  sort(scores.begin(), scores.end());
+  auto expected = [&](size_t start, size_t end, bool desc) {
+    vector<string> res;
+    for (size_t i = start; i < end; ++i)
+      res.push_back(absl::StrCat(desc ? scores[scores.size() - 1 - i] : scores[i]));
+    return res;
+  };
+  auto strings = [](const RespExpr& resp) {
+    vector<string> res;
+    for (const auto& e : resp.GetVec())
+      res.push_back(e.GetString());
+    return res;
+  };
+
+  auto resp = Run({"sort", "list-1"});
+  ASSERT_THAT(resp, ArrLen(2000));
+  EXPECT_EQ(expected(0, 2000, false), strings(resp));
+
+  resp = Run({"sort_ro", "list-1", "desc", "limit", "1000", "-1"});
+  ASSERT_THAT(resp, ArrLen(1000));
+  EXPECT_EQ(expected(1000, 2000, true), strings(resp));
+
+  // A small LIMIT selects the range instead.
+  resp = Run({"sort", "list-1", "limit", "10", "5"});
+  EXPECT_EQ(expected(10, 15, false), strings(resp));
+  resp = Run({"sort", "list-1", "desc", "limit", "-5", "3"});
+  EXPECT_EQ(expected(0, 3, true), strings(resp));
+
+  EXPECT_THAT(Run({"sort_ro", "list-1", "store", "dest"}), ErrArg("syntax error"));
+}
+
 TEST_F(GenericFamilyTest, Time) {
   auto resp = Run({"time"});
   EXPECT_THAT(resp, ArrLen(2));
@@ -446,6 +670,24 @@ TEST_F(GenericFamilyTest, Dump) {
   EXPECT_EQ(resp.type, RespExpr::NIL);
 }
 
+TEST_F(GenericFamilyTest, MigrateErrors) {
+  Run({"set", "key", "1"});
+  EXPECT_THAT(Run({"migrate", "localhost", "port", "key", "0", "1000"}),
+              ErrArg("value is not an integer"));
+  EXPECT_THAT(Run({"migrate", "localhost", "6379", "key", "100", "1000"}),
+              ErrArg("DB index is out of range"));
+  EXPECT_THAT(Run({"migrate", "localhost", "6379", "key", "0", "1000", "FOO"}),
+              ErrArg("syntax error"));
+  EXPECT_THAT(Run({"migrate", "localhost", "6379", "key", "0", "1000", "KEYS", "key"}),
+              ErrArg("the key argument must be set to the empty string"));
+  EXPECT_THAT(Run({"migrate", "localhost", "6379", "", "0", "1000", "KEYS"}),
+              ErrArg("syntax error"));
+
+  // Nothing listens on the port.
+  EXPECT_THAT(Run({"migrate", "127.0.0.1", "1", "key", "0", "1000"}), ErrArg("IOERR"));
+  EXPECT_EQ(Run({"get", "key"}), "1");
+}
+
 TEST_F(GenericFamilyTest, Restore) {
   using std::chrono::duration_cast;
   using std::chrono::milliseconds;
@@ -0,0 +1,134 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/handoff_client.h"
+
+#include <absl/strings/str_cat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "base/logging.h"
+#include "facade/redis_parser.h"
+
+namespace dfly {
+
+using namespace std;
+using facade::RedisParser;
+using facade::RespExpr;
+
+namespace {
+
+error_code LastError() {
+  return error_code{errno, system_category()};
+}
+
+bool WriteAll(int fd, string_view data) {
+  while (!data.empty()) {
+    ssize_t res = write(fd, data.data(), data.size());
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      return false;
+    data.remove_prefix(res);
+  }
+  return true;
+}
+
+}  // namespace
+
+HandoffClient::~HandoffClient() {
+  Close();
+}
+
+error_code HandoffClient::Connect(const string& unix_path, uint32_t timeout_ms) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (unix_path.size() >= sizeof(addr.sun_path))
+    return make_error_code(errc::filename_too_long);
+  memcpy(addr.sun_path, unix_path.data(), unix_path.size());
+
+  Close();
+  fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd_ < 0) {
+    error_code ec = LastError();
+    Close();
+    return ec;
+  }
+
+  timeval tv{timeout_ms / 1000, long(timeout_ms % 1000) * 1000};
+  if (setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0 ||
+      setsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0 ||
+      connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    error_code ec = LastError();
+    Close();
+    return ec;
+  }
+
+  return {};
+}
+
+error_code HandoffClient::Command(initializer_list<string_view> args, vector<int64_t>* ints) {
+  if (fd_ < 0)
+    return make_error_code(errc::not_connected);
+
+  string request = absl::StrCat("*", args.size(), "\r\n");
+  for (string_view arg : args)
+    absl::StrAppend(&request, "$", arg.size(), "\r\n", arg, "\r\n");
+  if (!WriteAll(fd_, request))
+    return LastError();
+
+  RedisParser parser{false};
+  RespExpr::Vec resp;
+  string buf;
+  size_t pos = 0;
+  while (true) {
+    char chunk[512];
+    ssize_t res = read(fd_, chunk, sizeof(chunk));
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      return res < 0 ? LastError() : make_error_code(errc::connection_aborted);
+    buf.append(chunk, res);
+
+    uint32_t consumed = 0;
+    uint8_t* data = reinterpret_cast<uint8_t*>(buf.data());
+    RedisParser::Result result = parser.Parse({data + pos, buf.size() - pos}, &consumed, &resp);
+    pos += consumed;
+    if (result == RedisParser::OK)
+      break;
+    if (result != RedisParser::INPUT_PENDING)
+      return make_error_code(errc::bad_message);
+  }
+
+  ints->clear();
+  for (const RespExpr& expr : resp) {
+    switch (expr.type) {
+      case RespExpr::INT64:
+        ints->push_back(get<int64_t>(expr.u));
+        break;
+      case RespExpr::STRING:
+        break;
+      case RespExpr::ERROR:
+        error_ = string(facade::ToSV(expr.GetBuf()));
+        return make_error_code(errc::operation_not_permitted);
+      default:
+        return make_error_code(errc::bad_message);
+    }
+  }
+
+  return {};
+}
+
+void HandoffClient::Close() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+}  // namespace dfly
@@ -0,0 +1,44 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace dfly {
+
+// Client side of the handoff socket of the running process, see --handoff_socket. The successor
+// process uses it from its main thread before the proactors serve any connection, hence it blocks
+// the thread instead of a fiber. Not thread-safe.
+class HandoffClient {
+ public:
+  HandoffClient() = default;
+  HandoffClient(const HandoffClient&) = delete;
+  ~HandoffClient();
+
+  // Every read and write of the socket fails after timeout_ms.
+  std::error_code Connect(const std::string& unix_path, uint32_t timeout_ms);
+
+  // Sends the command and reads its reply: an integer, an array of integers or a simple string,
+  // whose integers are stored into ints. An error reply is returned as
+  // errc::operation_not_permitted, its message is kept in error().
+  std::error_code Command(std::initializer_list<std::string_view> args, std::vector<int64_t>* ints);
+
+  const std::string& error() const {
+    return error_;
+  }
+
+  void Close();
+
+ private:
+  int fd_ = -1;
+  std::string error_;
+};
+
+}  // namespace dfly
@@ -0,0 +1,280 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/hll_family.h"
+
+extern "C" {
+#include "redis/object.h"
+}
+
+#include "base/flags.h"
+#include "base/logging.h"
+#include "core/hyperloglog.h"
+#include "server/command_registry.h"
+#include "server/conn_context.h"
+#include "server/engine_shard_set.h"
+#include "server/error.h"
+#include "server/tiered_storage.h"
+#include "server/transaction.h"
+
+ABSL_FLAG(uint32_t, hll_sparse_max_bytes, 3000,
+          "HyperLogLog values are kept in the sparse encoding up to this length in bytes, as "
+          "hll-sparse-max-bytes of redis does.");
+
+namespace dfly {
+
+using namespace std;
+using namespace facade;
+using absl::GetFlag;
+
+namespace {
+
+constexpr char kInvalidHllErr[] = "-WRONGTYPE Key is not a valid HyperLogLog string value.";
+
+// The registers merged from the keys of a shard.
+struct ShardRegisters {
+  unique_ptr<HllRegisters> regs;  // null if none of the keys exist.
+  bool dense = false;             // whether any of the keys is dense.
+};
+
+// Returns the value without copying it, unless it is encoded or external.
+string_view GetSlice(const PrimeValue& pv, EngineShard* shard, string* scratch) {
+  if (pv.IsExternal()) {
+    auto* tiered = shard->tiered_storage();
+    auto [offset, size] = pv.GetExternalPtr();
+    scratch->resize(size);
+
+    error_code ec = tiered->Read(offset, size, scratch->data());
+    CHECK(!ec) << "TBD: " << ec;
+    return *scratch;
+  }
+  return pv.GetSlice(scratch);
+}
+
+void StoreValue(const OpArgs& op_args, string_view key, PrimeIterator it, bool added,
+                string_view value) {
+  auto& db_slice = op_args.shard->db_slice();
+  if (!added) {
+    db_slice.PreUpdate(op_args.db_cntx.db_index, it);
+  }
+  it->second.SetString(value);
+  db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, !added);
+}
+
+OpResult<int> OpAdd(const OpArgs& op_args, string_view key, ArgSlice elements) {
+  auto [it, added] = op_args.shard->db_slice().AddOrFind(op_args.db_cntx, key);
+
+  string hll;
+  if (added) {
+    hll = MakeHll();
+  } else {
+    if (it->second.ObjType() != OBJ_STRING)
+      return OpStatus::WRONG_TYPE;
+
+    string scratch;
+    hll = GetSlice(it->second, op_args.shard, &scratch);
+    if (!IsHll(hll))
+      return OpStatus::INVALID_VALUE;
+  }
+
+  int res = HllAdd(elements, GetFlag(FLAGS_hll_sparse_max_bytes), &hll);
+  if (res < 0)
+    return OpStatus::INVALID_VALUE;
+
+  if (added || res > 0) {
+    StoreValue(op_args, key, it, added, hll);
+  }
+  return added ? 1 : res;
+}
+
+OpResult<uint64_t> OpCount(const OpArgs& op_args, string_view key) {
+  auto& db_slice = op_args.shard->db_slice();
+  OpResult<PrimeIterator> it_res = db_slice.Find(op_args.db_cntx, key, OBJ_STRING);
+  if (!it_res)
+    return it_res.status();
+
+  string scratch;
+  string_view hll = GetSlice(it_res.value()->second, op_args.shard, &scratch);
+  if (!IsHll(hll))
+    return OpStatus::INVALID_VALUE;
+
+  if (optional<uint64_t> cached = HllCachedCount(hll); cached)
+    return *cached;
+
+  HllRegisters regs;
+  if (!regs.Merge(hll))
+    return OpStatus::INVALID_VALUE;
+  uint64_t count = regs.Count();
+
+  // As redis does, the count is cached in the value until the value changes.
+  string value{hll};
+  HllSetCachedCount(count, &value);
+  StoreValue(op_args, key, it_res.value(), false, value);
+  return count;
+}
+
+// Merges the registers of the existing keys.
+OpResult<ShardRegisters> OpMerge(const OpArgs& op_args, ArgSlice keys) {
+  auto& db_slice = op_args.shard->db_slice();
+  ShardRegisters res;
+  string scratch;
+
+  for (string_view key : keys) {
+    OpResult<PrimeIterator> it_res = db_slice.Find(op_args.db_cntx, key, OBJ_STRING);
+    if (it_res.status() == OpStatus::KEY_NOTFOUND)
+      continue;
+    if (!it_res)
+      return it_res.status();
+
+    string_view hll = GetSlice(it_res.value()->second, op_args.shard, &scratch);
+    if (!IsHll(hll))
+      return OpStatus::INVALID_VALUE;
+
+    if (!res.regs)
+      res.regs = make_unique<HllRegisters>();
+    if (!res.regs->Merge(hll))
+      return OpStatus::INVALID_VALUE;
+    res.dense |= !IsSparseHll(hll);
+  }
+  return res;
+}
+
+OpStatus NoOpCb(Transaction* t, EngineShard* shard) {
+  return OpStatus::OK;
+}
+
+void SendHllError(OpStatus status, ConnectionContext* cntx) {
+  if (status == OpStatus::INVALID_VALUE) {
+    return (*cntx)->SendError(kInvalidHllErr);
+  }
+  (*cntx)->SendError(status);
+}
+
+// Merges the registers of all the shards into merged.
+OpStatus MergeShardResults(vector<OpResult<ShardRegisters>>* results, ShardRegisters* merged) {
+  for (auto& res : *results) {
+    if (!res)
+      return res.status();
+
+    ShardRegisters& shard_regs = res.value();
+    if (!shard_regs.regs)
+      continue;
+
+    if (merged->regs) {
+      merged->regs->Merge(*shard_regs.regs);
+    } else {
+      merged->regs = std::move(shard_regs.regs);
+    }
+    merged->dense |= shard_regs.dense;
+  }
+  return OpStatus::OK;
+}
+
+void PFAdd(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  vector<string_view> vals(args.size() - 2);
+  for (size_t i = 2; i < args.size(); ++i) {
+    vals[i - 2] = ArgS(args, i);
+  }
+  ArgSlice arg_slice{vals.data(), vals.size()};
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpAdd(t->GetOpArgs(shard), key, arg_slice);
+  };
+
+  OpResult<int> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result) {
+    return (*cntx)->SendLong(result.value());
+  }
+  SendHllError(result.status(), cntx);
+}
+
+void PFCount(CmdArgList args, ConnectionContext* cntx) {
+  if (args.size() == 2) {
+    string_view key = ArgS(args, 1);
+    auto cb = [&](Transaction* t, EngineShard* shard) {
+      return OpCount(t->GetOpArgs(shard), key);
+    };
+
+    OpResult<uint64_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+    if (result) {
+      return (*cntx)->SendLong(result.value());
+    }
+    if (result.status() == OpStatus::KEY_NOTFOUND) {
+      return (*cntx)->SendLong(0);
+    }
+    return SendHllError(result.status(), cntx);
+  }
+
+  // Every shard merges its keys, and the results are merged here and counted.
+  vector<OpResult<ShardRegisters>> results(shard_set->size());
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    ArgSlice largs = t->ShardArgsInShard(shard->shard_id());
+    results[shard->shard_id()] = OpMerge(t->GetOpArgs(shard), largs);
+    return OpStatus::OK;
+  };
+  cntx->transaction->ScheduleSingleHop(std::move(cb));
+
+  ShardRegisters merged;
+  OpStatus status = MergeShardResults(&results, &merged);
+  if (status != OpStatus::OK) {
+    return SendHllError(status, cntx);
+  }
+  (*cntx)->SendLong(merged.regs ? merged.regs->Count() : 0);
+}
+
+void PFMerge(CmdArgList args, ConnectionContext* cntx) {
+  // As in redis, the destination is merged as well.
+  string_view dest_key = ArgS(args, 1);
+  ShardId dest_shard = Shard(dest_key, shard_set->size());
+
+  vector<OpResult<ShardRegisters>> results(shard_set->size());
+  auto merge_cb = [&](Transaction* t, EngineShard* shard) {
+    ArgSlice largs = t->ShardArgsInShard(shard->shard_id());
+    results[shard->shard_id()] = OpMerge(t->GetOpArgs(shard), largs);
+    return OpStatus::OK;
+  };
+
+  cntx->transaction->Schedule();
+  cntx->transaction->Execute(std::move(merge_cb), false);
+
+  ShardRegisters merged;
+  OpStatus status = MergeShardResults(&results, &merged);
+  if (status != OpStatus::OK) {
+    cntx->transaction->Execute(NoOpCb, true);
+    return SendHllError(status, cntx);
+  }
+
+  // The result is sparse unless one of the values is dense.
+  string hll = merged.regs
+                   ? merged.regs->ToHll(!merged.dense, GetFlag(FLAGS_hll_sparse_max_bytes))
+                   : MakeHll();
+
+  auto store_cb = [&](Transaction* t, EngineShard* shard) {
+    if (shard->shard_id() == dest_shard) {
+      OpArgs op_args = t->GetOpArgs(shard);
+      auto [it, added] = shard->db_slice().AddOrFind(op_args.db_cntx, dest_key);
+      StoreValue(op_args, dest_key, it, added, hll);
+    }
+    return OpStatus::OK;
+  };
+
+  cntx->transaction->Execute(std::move(store_cb), true);
+  (*cntx)->SendOk();
+}
+
+}  // namespace
+
+using CI = CommandId;
+
+#define HFUNC(x) SetHandler(&x)
+
+void HllFamily::Register(CommandRegistry* registry) {
+  // PFCOUNT caches the count of a single key in its value, which is not a logical change.
+  *registry << CI{"PFADD", CO::WRITE | CO::DENYOOM | CO::FAST, -2, 1, 1, 1}.HFUNC(PFAdd)
+            << CI{"PFCOUNT", CO::READONLY, -2, 1, -1, 1}.HFUNC(PFCount)
+            << CI{"PFMERGE", CO::WRITE | CO::DENYOOM, -2, 1, -1, 1}.HFUNC(PFMerge);
+}
+
+}  // namespace dfly
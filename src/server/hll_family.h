@@ -0,0 +1,20 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+/// @brief Implements the HyperLogLog commands: PFADD, PFCOUNT and PFMERGE.
+/// HyperLogLogs are string values in the format of redis, see core/hyperloglog.h.
+///     PFADD: https://redis.io/commands/pfadd/
+///     PFCOUNT: https://redis.io/commands/pfcount/
+///     PFMERGE: https://redis.io/commands/pfmerge/
+namespace dfly {
+class CommandRegistry;
+
+class HllFamily {
+ public:
+  static void Register(CommandRegistry* registry);
+};
+
+}  // namespace dfly
@@ -0,0 +1,109 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/hll_family.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "facade/facade_test.h"
+#include "server/command_registry.h"
+#include "server/test_utils.h"
+
+using namespace testing;
+using namespace std;
+using namespace util;
+
+namespace dfly {
+
+class HllFamilyTest : public BaseFamilyTest {
+ protected:
+  // Adds the elements prefix0 .. prefix{n - 1} to key.
+  void AddRange(string_view key, string_view prefix, unsigned n) {
+    vector<string> args = {"pfadd", string(key)};
+    for (unsigned i = 0; i < n; ++i) {
+      args.push_back(absl::StrCat(prefix, i));
+      if (args.size() == 1002 || i + 1 == n) {
+        vector<string_view> sv_args(args.begin(), args.end());
+        Run(ArgSlice{sv_args.data(), sv_args.size()});
+        args.resize(2);
+      }
+    }
+  }
+};
+
+TEST_F(HllFamilyTest, Add) {
+  EXPECT_EQ(1, CheckedInt({"pfadd", "hll", "a", "b", "c", "d", "e", "f", "g"}));
+  EXPECT_EQ(0, CheckedInt({"pfadd", "hll", "a", "b"}));
+  EXPECT_EQ(1, CheckedInt({"pfadd", "hll", "h"}));
+  EXPECT_EQ(8, CheckedInt({"pfcount", "hll"}));
+
+  // A key is created even without elements.
+  EXPECT_EQ(1, CheckedInt({"pfadd", "empty"}));
+  EXPECT_EQ(0, CheckedInt({"pfadd", "empty"}));
+  EXPECT_EQ(0, CheckedInt({"pfcount", "empty"}));
+  EXPECT_EQ(0, CheckedInt({"pfcount", "missing"}));
+  EXPECT_EQ(1, CheckedInt({"exists", "empty"}));
+
+  Run({"set", "str", "foo"});
+  EXPECT_THAT(Run({"pfadd", "str", "a"}), ErrArg("not a valid HyperLogLog"));
+  EXPECT_THAT(Run({"pfcount", "str"}), ErrArg("not a valid HyperLogLog"));
+  Run({"sadd", "set", "a"});
+  EXPECT_THAT(Run({"pfadd", "set", "a"}), ErrArg("WRONGTYPE"));
+}
+
+TEST_F(HllFamilyTest, Count) {
+  AddRange("hll", "x", 10000);
+  int64_t count = CheckedInt({"pfcount", "hll"});
+  EXPECT_NEAR(10000, count, 200);
+
+  // The cached count is reused until the value changes.
+  EXPECT_EQ(count, CheckedInt({"pfcount", "hll"}));
+  AddRange("hll", "y", 10000);
+  EXPECT_NEAR(20000, CheckedInt({"pfcount", "hll"}), 400);
+
+  // The value is a plain string that can be copied around.
+  string value{ToSV(Run({"get", "hll"}).GetBuf())};
+  Run({"set", "copy", value});
+  EXPECT_EQ(CheckedInt({"pfcount", "hll"}), CheckedInt({"pfcount", "copy"}));
+}
+
+TEST_F(HllFamilyTest, MultiKeyCount) {
+  AddRange("a", "x", 3000);
+  AddRange("b", "x", 1000);
+  AddRange("c", "y", 2000);
+  Run({"pfadd", "d"});
+
+  EXPECT_NEAR(5000, CheckedInt({"pfcount", "a", "b", "c", "d", "missing"}), 100);
+  EXPECT_NEAR(3000, CheckedInt({"pfcount", "a", "b"}), 60);
+  EXPECT_EQ(0, CheckedInt({"pfcount", "missing1", "missing2"}));
+
+  Run({"set", "str", "foo"});
+  EXPECT_THAT(Run({"pfcount", "a", "str"}), ErrArg("not a valid HyperLogLog"));
+}
+
+TEST_F(HllFamilyTest, Merge) {
+  AddRange("a", "x", 3000);
+  AddRange("b", "y", 100);
+  AddRange("dest", "z", 10);
+
+  EXPECT_EQ("OK", Run({"pfmerge", "dest", "a", "b", "missing"}));
+  EXPECT_NEAR(3110, CheckedInt({"pfcount", "dest"}), 70);
+  EXPECT_NEAR(3000, CheckedInt({"pfcount", "a"}), 60);
+
+  // Merging sparse values keeps them sparse.
+  EXPECT_EQ("OK", Run({"pfmerge", "small", "b"}));
+  EXPECT_EQ(CheckedInt({"pfcount", "b"}), CheckedInt({"pfcount", "small"}));
+  EXPECT_LT(CheckedInt({"strlen", "small"}), CheckedInt({"strlen", "a"}));
+
+  EXPECT_EQ("OK", Run({"pfmerge", "new"}));
+  EXPECT_EQ(0, CheckedInt({"pfcount", "new"}));
+
+  Run({"set", "str", "foo"});
+  EXPECT_THAT(Run({"pfmerge", "dest", "str"}), ErrArg("not a valid HyperLogLog"));
+  EXPECT_THAT(Run({"pfmerge", "str", "a"}), ErrArg("not a valid HyperLogLog"));
+}
+
+}  // namespace dfly
@@ -0,0 +1,113 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include <benchmark/benchmark.h>
+#include <mimalloc.h>
+
+#include <absl/strings/str_cat.h>
+
+#include "base/flags.h"
+#include "base/init.h"
+#include "base/logging.h"
+#include "server/engine_shard_set.h"
+#include "server/main_service.h"
+#include "server/transaction.h"
+#include "util/uring/uring_pool.h"
+
+extern "C" {
+#include "redis/zmalloc.h"
+}
+
+// Measures the latency of single-hop transactions that span all the shards, with the hops
+// dispatched via the hop rings (batched=1) or via the shard queues (batched=0). For example:
+//   ./hop_bench --benchmark_counters_tabular=true
+
+ABSL_DECLARE_FLAG(bool, batch_hops);
+ABSL_DECLARE_FLAG(std::string, dbfilename);
+
+using namespace std;
+using namespace util;
+
+namespace dfly {
+
+namespace {
+
+// Returns an MGET command line with a key in every shard.
+vector<string> MGetAllShards(unsigned num_shards) {
+  vector<string> res{"MGET"};
+  vector<bool> covered(num_shards, false);
+  for (unsigned i = 0, left = num_shards; left > 0; ++i) {
+    string key = absl::StrCat("key", i);
+    ShardId sid = Shard(key, num_shards);
+    if (!covered[sid]) {
+      covered[sid] = true;
+      --left;
+      res.push_back(std::move(key));
+    }
+  }
+  return res;
+}
+
+}  // namespace
+
+static void BM_MultiShardHop(benchmark::State& state) {
+  unsigned num_shards = state.range(0);
+  absl::SetFlag(&FLAGS_batch_hops, state.range(1) != 0);
+
+  unique_ptr<ProactorPool> pp(new uring::UringPool(16, num_shards));
+  pp->Run();
+
+  Service service{pp.get()};
+  Service::InitOpts opts;
+  opts.disable_time_update = true;
+  service.Init(nullptr, nullptr, opts);
+
+  vector<string> cmd = MGetAllShards(num_shards);
+  vector<MutableSlice> args;
+  for (string& s : cmd) {
+    args.emplace_back(s.data(), s.size());
+  }
+  const CommandId* cid = service.FindCmd("MGET");
+
+  pp->at(0)->Await([&] {
+    for (auto _ : state) {
+      boost::intrusive_ptr<Transaction> trans(new Transaction{cid});
+      CHECK(trans->InitByArgs(0, CmdArgList{args}) == OpStatus::OK);
+      trans->ScheduleSingleHop([](Transaction*, EngineShard*) { return OpStatus::OK; });
+    }
+  });
+
+  vector<EngineShard::Stats> shard_stats(num_shards);
+  shard_set->RunBriefInParallel(
+      [&](EngineShard* es) { shard_stats[es->shard_id()] = es->stats(); });
+
+  EngineShard::Stats stats;
+  for (const auto& s : shard_stats) {
+    stats += s;
+  }
+  state.counters["hops_per_batch"] =
+      double(stats.batched_hops) / std::max<uint64_t>(1, stats.hop_batches);
+
+  service.Shutdown();
+  pp->Stop();
+}
+BENCHMARK(BM_MultiShardHop)
+    ->ArgNames({"shards", "batched"})
+    ->ArgsProduct({{8, 32, 64}, {0, 1}})
+    ->Unit(benchmark::kMicrosecond)
+    ->UseRealTime();
+
+}  // namespace dfly
+
+int main(int argc, char* argv[]) {
+  // Consumes --benchmark_xxx flags before absl flags are parsed.
+  benchmark::Initialize(&argc, argv);
+  MainInitGuard guard(&argc, &argv);
+
+  absl::SetFlag(&FLAGS_dbfilename, "");
+  init_zmalloc_threadlocal(mi_heap_get_backing());
+
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -0,0 +1,139 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/hot_keys.h"
+
+#include <absl/container/flat_hash_map.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "base/logging.h"
+
+namespace dfly {
+
+using namespace std;
+
+struct HotKeys::Window {
+  explicit Window(uint64_t now_ms) : start_ms(now_ms) {
+  }
+
+  TopKeys current{kCapacity};
+  TopKeys previous{kCapacity};
+  uint64_t start_ms;
+  uint64_t previous_ms = 0;  // the length of the previous window, 0 if it is empty.
+};
+
+HotKeys::HotKeys(uint32_t sample_rate)
+    : sample_rate_(sample_rate), countdown_(1), rand_state_(0x9e3779b97f4a7c15ULL) {
+  CHECK_GT(sample_rate, 0u);
+  countdown_ = NextGap();
+}
+
+HotKeys::~HotKeys() {
+}
+
+void HotKeys::Sample(DbIndex db, string_view key, uint64_t now_ms) {
+  countdown_ = NextGap();
+
+  if (db >= windows_.size())
+    windows_.resize(db + 1);
+
+  unique_ptr<Window>& w = windows_[db];
+  if (!w)
+    w.reset(new Window(now_ms));
+
+  uint64_t age = now_ms > w->start_ms ? now_ms - w->start_ms : 0;
+  if (age >= kWindowMs) {
+    if (age < 2 * kWindowMs) {
+      swap(w->current, w->previous);
+      w->previous_ms = age;
+    } else {
+      w->previous.Clear();
+      w->previous_ms = 0;
+    }
+    w->current.Clear();
+    w->start_ms = now_ms;
+  }
+
+  w->current.Add(key);
+}
+
+// The gaps between the samples are geometric, so every access is sampled with the same
+// probability 1 / sample_rate.
+uint32_t HotKeys::NextGap() {
+  if (sample_rate_ == 1)
+    return 1;
+
+  // xorshift64*
+  rand_state_ ^= rand_state_ >> 12;
+  rand_state_ ^= rand_state_ << 25;
+  rand_state_ ^= rand_state_ >> 27;
+  uint64_t r = rand_state_ * 0x2545f4914f6cdd1dULL;
+
+  double u = double((r >> 11) + 1) / double(1ULL << 53);  // in (0, 1]
+  double gap = 1 + floor(log(u) / log1p(-1.0 / sample_rate_));
+  return gap < UINT32_MAX ? uint32_t(gap) : UINT32_MAX;
+}
+
+vector<HotKeys::Key> HotKeys::Top(size_t n, uint64_t now_ms) const {
+  vector<Key> res;
+
+  for (size_t db = 0; db < windows_.size(); ++db) {
+    const Window* w = windows_[db].get();
+    if (!w)
+      continue;
+
+    uint64_t age = now_ms > w->start_ms ? now_ms - w->start_ms : 0;
+    if (age >= 2 * kWindowMs)
+      continue;
+
+    absl::flat_hash_map<string_view, pair<uint64_t, uint64_t>> merged;  // (count, error)
+    uint64_t elapsed_ms = age;
+    vector<TopKeys::Entry> current = w->current.Top(kCapacity);
+    vector<TopKeys::Entry> previous;
+
+    // A current window older than kWindowMs had no samples since it ended, and the previous
+    // one is older than that.
+    if (age < kWindowMs) {
+      previous = w->previous.Top(kCapacity);
+      elapsed_ms += w->previous_ms;
+    }
+
+    for (const auto* entries : {&current, &previous}) {
+      for (const TopKeys::Entry& e : *entries) {
+        auto& [count, error] = merged[e.key];
+        count += e.count;
+        error += e.error;
+      }
+    }
+
+    // Do not extrapolate the rates from the first samples.
+    double scale = sample_rate_ * 1000.0 / max<uint64_t>(elapsed_ms, 1000);
+    for (const auto& [key, counts] : merged) {
+      res.push_back(Key{string(key), DbIndex(db), counts.first * scale, counts.second * scale});
+    }
+  }
+
+  auto cmp = [](const Key& l, const Key& r) { return l.ops_per_sec > r.ops_per_sec; };
+  if (n < res.size()) {
+    partial_sort(res.begin(), res.begin() + n, res.end(), cmp);
+    res.resize(n);
+  } else {
+    sort(res.begin(), res.end(), cmp);
+  }
+
+  return res;
+}
+
+size_t HotKeys::MallocUsed() const {
+  size_t res = windows_.capacity() * sizeof(unique_ptr<Window>);
+  for (const auto& w : windows_) {
+    if (w)
+      res += sizeof(Window) + w->current.MallocUsed() + w->previous.MallocUsed();
+  }
+  return res;
+}
+
+}  // namespace dfly
@@ -0,0 +1,60 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <memory>
+
+#include "core/top_keys.h"
+#include "server/common.h"
+
+namespace dfly {
+
+// Finds the hot keys of a shard and their rates without MONITOR. Samples the key accesses and
+// counts the samples of every database in the Space-Saving summaries of the current and of the
+// previous time window, so that the keys that cooled down age out. The gaps between the
+// samples are random so that periodic access patterns are not aliased.
+class HotKeys {
+ public:
+  static constexpr size_t kCapacity = 64;      // tracked keys per database.
+  static constexpr uint64_t kWindowMs = 10000;
+
+  struct Key {
+    std::string key;
+    DbIndex db = 0;
+    double ops_per_sec = 0;  // estimated from the samples, may overestimate by error_per_sec.
+    double error_per_sec = 0;
+  };
+
+  // Samples one access out of sample_rate on average.
+  explicit HotKeys(uint32_t sample_rate);
+  ~HotKeys();
+
+  void Touch(DbIndex db, std::string_view key, uint64_t now_ms) {
+    if (--countdown_ == 0)
+      Sample(db, key, now_ms);
+  }
+
+  // Returns up to n keys of all the databases with the highest rates first.
+  std::vector<Key> Top(size_t n, uint64_t now_ms) const;
+
+  uint32_t sample_rate() const {
+    return sample_rate_;
+  }
+
+  size_t MallocUsed() const;
+
+ private:
+  struct Window;
+
+  void Sample(DbIndex db, std::string_view key, uint64_t now_ms);
+  uint32_t NextGap();
+
+  uint32_t sample_rate_;
+  uint32_t countdown_;
+  uint64_t rand_state_;
+  std::vector<std::unique_ptr<Window>> windows_;  // indexed by DbIndex.
+};
+
+}  // namespace dfly
@@ -11,13 +11,22 @@ extern "C" {
 #include "redis/util.h"
 }
 
+#include <absl/random/random.h>
+#include <absl/strings/match.h>
+
+#include "base/flags.h"
 #include "base/logging.h"
+#include "core/string_map.h"
 #include "facade/error.h"
 #include "server/command_registry.h"
 #include "server/conn_context.h"
+#include "server/container_utils.h"
 #include "server/engine_shard_set.h"
+#include "server/streamed_reply.h"
 #include "server/transaction.h"
 
+ABSL_DECLARE_FLAG(uint32_t, offshard_copy_min_len);
+
 using namespace std;
 
 namespace dfly {
@@ -31,6 +40,20 @@ using IncrByParam = std::variant<double, int64_t>;
 using OptStr = std::optional<std::string>;
 enum GetAllMode : uint8_t { FIELDS = 1, VALUES = 2 };
 
+thread_local absl::InsecureBitGen random_gen;
+
+// Like SADDEX.
+constexpr uint32_t kMaxTtl = (1UL << 26);
+
+// Returns the map of a hash that is not a listpack, whose fields expire against the time of
+// the operation.
+StringMap* GetStringMap(const PrimeValue& pv, const DbContext& db_cntx) {
+  DCHECK_EQ(kEncodingStrMap2, pv.Encoding());
+  StringMap* sm = (StringMap*)pv.RObjPtr();
+  sm->set_time(container_utils::TimeNowSecRel(db_cntx.time_now_ms));
+  return sm;
+}
+
 bool IsGoodForListpack(CmdArgList args, const uint8_t* lp) {
   size_t sum = 0;
   for (auto s : args) {
@@ -66,7 +89,6 @@ string_view LpGetView(uint8_t* lp_it, uint8_t int_buf[]) {
 pair<uint8_t*, bool> LpInsert(uint8_t* lp, string_view field, string_view val, bool skip_exists) {
   uint8_t* vptr;
 
-  uint8_t* fptr = lpFirst(lp);
   uint8_t* fsrc = field.empty() ? lp : (uint8_t*)field.data();
 
   // if we vsrc is NULL then lpReplace will delete the element, which is not what we want.
@@ -76,20 +98,18 @@ pair<uint8_t*, bool> LpInsert(uint8_t* lp, string_view field, string_view val, b
 
   bool updated = false;
 
+  uint8_t* fptr = container_utils::LpFindKey(lp, field);
   if (fptr) {
-    fptr = lpFind(lp, fptr, fsrc, field.size(), 1);
-    if (fptr) {
-      if (skip_exists) {
-        return make_pair(lp, false);
-      }
-      /* Grab pointer to the value (fptr points to the field) */
-      vptr = lpNext(lp, fptr);
-      updated = true;
-
-      /* Replace value */
-      lp = lpReplace(lp, &vptr, vsrc, val.size());
-      DCHECK_EQ(0u, lpLength(lp) % 2);
+    if (skip_exists) {
+      return make_pair(lp, false);
     }
+    /* Grab pointer to the value (fptr points to the field) */
+    vptr = lpNext(lp, fptr);
+    updated = true;
+
+    /* Replace value */
+    lp = lpReplace(lp, &vptr, vsrc, val.size());
+    DCHECK_EQ(0u, lpLength(lp) % 2);
   }
 
   if (!updated) {
@@ -102,65 +122,86 @@ pair<uint8_t*, bool> LpInsert(uint8_t* lp, string_view field, string_view val, b
   return make_pair(lp, !updated);
 }
 
+// Returns the value of the field or nullopt if it does not exist.
+OptStr GetValue(const PrimeValue& pv, const DbContext& db_cntx, string_view field) {
+  if (pv.Encoding() == kEncodingListPack) {
+    uint8_t* lp = (uint8_t*)pv.RObjPtr();
+    uint8_t* fptr = container_utils::LpFindKey(lp, field);
+    if (!fptr)
+      return nullopt;
+
+    return LpGetVal(lpNext(lp, fptr));
+  }
+
+  optional<string_view> res = GetStringMap(pv, db_cntx)->Find(field);
+  if (!res)
+    return nullopt;
+  return string{*res};
+}
+
 OpStatus OpIncrBy(const OpArgs& op_args, string_view key, string_view field, IncrByParam* param) {
   auto& db_slice = op_args.shard->db_slice();
   const auto [it, inserted] = db_slice.AddOrFind(op_args.db_cntx, key);
 
   DbTableStats* stats = db_slice.MutableStats(op_args.db_cntx.db_index);
 
-  robj* hset = nullptr;
   size_t lpb = 0;
 
   PrimeValue& pv = it->second;
   if (inserted) {
     pv.InitRobj(OBJ_HASH, kEncodingListPack, lpNew(0));
     stats->listpack_blob_cnt++;
-    hset = it->second.AsRObj();
   } else {
     if (pv.ObjType() != OBJ_HASH)
       return OpStatus::WRONG_TYPE;
 
     db_slice.PreUpdate(op_args.db_cntx.db_index, it);
-    hset = it->second.AsRObj();
 
     if (pv.Encoding() == kEncodingListPack) {
-      lpb = lpBytes((uint8_t*)pv.RObjPtr());
+      uint8_t* lp = (uint8_t*)pv.RObjPtr();
+      lpb = lpBytes(lp);
       stats->listpack_bytes -= lpb;
 
       if (lpb >= kMaxListPackLen) {
         stats->listpack_blob_cnt--;
-        hashTypeConvert(hset, OBJ_ENCODING_HT);
+        pv.InitRobj(OBJ_HASH, kEncodingStrMap2, HSetFamily::ConvertToStrMap(lp));
+        lpb = 0;
       }
     }
   }
 
-  int enc = pv.Encoding();
-  uint8_t* vstr = NULL;
-  unsigned int vlen = UINT_MAX;
-  long long old_val = 0;
+  auto set_value = [&](string_view sval) {
+    if (pv.Encoding() == kEncodingListPack) {
+      uint8_t* lp = (uint8_t*)pv.RObjPtr();
 
-  op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, field.data(), field.size());
+      lp = LpInsert(lp, field, sval, false).first;
+      pv.SetRObjPtr(lp);
+      stats->listpack_bytes += lpBytes(lp);
+    } else {
+      // Like INCR, the increment keeps the ttl.
+      StringMap* sm = GetStringMap(pv, op_args.db_cntx);
+      sds entry = sm->FindEntry(field);
+      uint32_t at = entry ? StringMap::ExpireTime(entry) : UINT32_MAX;
+      sm->AddOrUpdate(field, sval, at == UINT32_MAX ? UINT32_MAX : at - sm->time_now());
+    }
+  };
 
-  int exist_res = hashTypeGetValue(hset, op_args.shard->tmp_str1, &vstr, &vlen, &old_val);
+  OptStr exist_val = GetValue(pv, op_args.db_cntx, field);
 
   if (holds_alternative<double>(*param)) {
     long double value;
     double incr = get<double>(*param);
-    if (exist_res == C_OK) {
-      if (vstr) {
-        const char* exist_val = reinterpret_cast<char*>(vstr);
-
-        if (!string2ld(exist_val, vlen, &value)) {
-          stats->listpack_bytes += lpb;
+    if (exist_val) {
+      if (!string2ld(exist_val->data(), exist_val->size(), &value)) {
+        stats->listpack_bytes += lpb;
 
-          return OpStatus::INVALID_VALUE;
-        }
-      } else {
-        value = old_val;
+        return OpStatus::INVALID_VALUE;
       }
       value += incr;
 
       if (isnan(value) || isinf(value)) {
+        stats->listpack_bytes += lpb;
+
         return OpStatus::INVALID_FLOAT;
       }
     } else {
@@ -169,28 +210,15 @@ OpStatus OpIncrBy(const OpArgs& op_args, string_view key, string_view field, Inc
 
     char buf[128];
     char* str = RedisReplyBuilder::FormatDouble(value, buf, sizeof(buf));
-    string_view sval{str};
-
-    if (enc == kEncodingListPack) {
-      uint8_t* lp = (uint8_t*)pv.RObjPtr();
+    set_value(str);
 
-      lp = LpInsert(lp, field, sval, false).first;
-      pv.SetRObjPtr(lp);
-      stats->listpack_bytes += lpBytes(lp);
-    } else {
-      sds news = sdsnewlen(str, sval.size());
-      hashTypeSet(hset, op_args.shard->tmp_str1, news, HASH_SET_TAKE_VALUE);
-      pv.SyncRObj();
-    }
     param->emplace<double>(value);
   } else {  // integer increment
-    if (exist_res == C_OK && vstr) {
-      const char* exist_val = reinterpret_cast<char*>(vstr);
-      if (!string2ll(exist_val, vlen, &old_val)) {
-        stats->listpack_bytes += lpb;
+    long long old_val = 0;
+    if (exist_val && !string2ll(exist_val->data(), exist_val->size(), &old_val)) {
+      stats->listpack_bytes += lpb;
 
-        return OpStatus::INVALID_VALUE;
-      }
+      return OpStatus::INVALID_VALUE;
     }
 
     int64_t incr = get<int64_t>(*param);
@@ -204,19 +232,8 @@ OpStatus OpIncrBy(const OpArgs& op_args, string_view key, string_view field, Inc
     int64_t new_val = old_val + incr;
     char buf[32];
     char* next = absl::numbers_internal::FastIntToBuffer(new_val, buf);
-    string_view sval{buf, size_t(next - buf)};
-
-    if (enc == kEncodingListPack) {
-      uint8_t* lp = (uint8_t*)pv.RObjPtr();
+    set_value(string_view{buf, size_t(next - buf)});
 
-      lp = LpInsert(lp, field, sval, false).first;
-      pv.SetRObjPtr(lp);
-      stats->listpack_bytes += lpBytes(lp);
-    } else {
-      sds news = sdsfromlonglong(new_val);
-      hashTypeSet(hset, op_args.shard->tmp_str1, news, HASH_SET_TAKE_VALUE);
-      pv.SyncRObj();
-    }
     param->emplace<int64_t>(new_val);
   }
 
@@ -227,15 +244,6 @@ OpStatus OpIncrBy(const OpArgs& op_args, string_view key, string_view field, Inc
 
 OpResult<StringVec> OpScan(const OpArgs& op_args, std::string_view key, uint64_t* cursor,
                            const ScanOpts& scan_op) {
-  using PrivateDataRef = std::tuple<StringVec&, const ScanOpts&>;
-  constexpr size_t HASH_TABLE_ENTRIES_FACTOR = 2;  // return key/value
-
-  /* We set the max number of iterations to ten times the specified
-   * COUNT, so if the hash table is in a pathological state (very
-   * sparsely populated) we avoid to block too much time at the cost
-   * of returning no or very few elements. (taken from redis code at db.c line 904 */
-  constexpr size_t INTERATION_FACTOR = 10;
-
   OpResult<PrimeIterator> find_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_HASH);
 
   if (!find_res) {
@@ -245,53 +253,31 @@ OpResult<StringVec> OpScan(const OpArgs& op_args, std::string_view key, uint64_t
 
   PrimeIterator it = find_res.value();
   StringVec res;
-  uint32_t count = scan_op.limit * HASH_TABLE_ENTRIES_FACTOR;
-  robj* hset = it->second.AsRObj();
-
-  if (hset->encoding == OBJ_ENCODING_LISTPACK) {
-    uint8_t* lp = (uint8_t*)hset->ptr;
-    uint8_t* lp_elem = lpFirst(lp);
-
-    DCHECK(lp_elem);  // empty containers are not allowed.
+  const PrimeValue& pv = it->second;
 
+  // Both encodings report about scan_op.limit fields per call, in the order of their hashes, so
+  // the cursor stays valid when the listpack turns into a StringMap.
+  if (pv.Encoding() == kEncodingListPack) {
+    uint8_t* lp = (uint8_t*)pv.RObjPtr();
     unsigned char intbuf[LP_INTBUF_SIZE];
 
-    // We do single pass on listpack for this operation - ignore any limits.
-    do {
-      string_view key = LpGetView(lp_elem, intbuf);
-      lp_elem = lpNext(lp, lp_elem);  // switch to value
-      DCHECK(lp_elem);
-
-      if (scan_op.Matches(key)) {
-        res.emplace_back(key);
-        res.emplace_back(LpGetView(lp_elem, intbuf));
+    *cursor = container_utils::ScanListpackPairs(lp, *cursor, scan_op.limit, [&](uint8_t* p) {
+      string_view field = LpGetView(p, intbuf);
+      if (scan_op.Matches(field)) {
+        res.emplace_back(field);
+        res.emplace_back(LpGetView(lpNext(lp, p), intbuf));
       }
-      lp_elem = lpNext(lp, lp_elem);  // switch to next key
-    } while (lp_elem);
-
-    *cursor = 0;
+    });
   } else {
-    dict* ht = (dict*)hset->ptr;
-    long max_iterations = count * INTERATION_FACTOR;
-    PrivateDataRef private_data_ref(res, scan_op);
-    void* private_data = &private_data_ref;
-
-    // note about this lambda - don't capture here! it should be convertible to C function!
-    auto scanCb = [](void* private_data, const dictEntry* de) {
-      StringVec& res = std::get<0>(*(PrivateDataRef*)private_data);
-      const ScanOpts& scan_op = std::get<1>(*(PrivateDataRef*)private_data);
-      sds val = (sds)de->key;
-      auto len = sdslen(val);
-      if (scan_op.Matches(std::string_view(val, len))) {
-        res.emplace_back(val, len);
-        val = (sds)de->v.val;
-        res.emplace_back(val, sdslen(val));
-      }
-    };
+    StringMap* sm = GetStringMap(pv, op_args.db_cntx);
 
-    do {
-      *cursor = dictScan(ht, *cursor, scanCb, NULL, private_data);
-    } while (*cursor && max_iterations-- && res.size() < count);
+    *cursor = sm->Scan(*cursor, scan_op.limit, [&](sds entry) {
+      string_view field = StringMap::Field(entry);
+      if (scan_op.Matches(field)) {
+        res.emplace_back(field);
+        res.emplace_back(StringMap::Value(entry));
+      }
+    });
   }
 
   return res;
@@ -308,37 +294,50 @@ OpResult<uint32_t> OpDel(const OpArgs& op_args, string_view key, CmdArgList valu
 
   db_slice.PreUpdate(op_args.db_cntx.db_index, *it_res);
   CompactObj& co = (*it_res)->second;
-  robj* hset = co.AsRObj();
   unsigned deleted = 0;
   bool key_remove = false;
+  bool is_lp = co.Encoding() == kEncodingListPack;
   DbTableStats* stats = db_slice.MutableStats(op_args.db_cntx.db_index);
 
-  if (hset->encoding == OBJ_ENCODING_LISTPACK) {
+  if (is_lp) {
+    robj* hset = co.AsRObj();
     stats->listpack_bytes -= lpBytes((uint8_t*)hset->ptr);
-  }
 
-  for (auto s : values) {
-    op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, s.data(), s.size());
+    for (auto s : values) {
+      op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, s.data(), s.size());
 
-    if (hashTypeDelete(hset, op_args.shard->tmp_str1)) {
-      ++deleted;
-      if (hashTypeLength(hset) == 0) {
-        key_remove = true;
-        break;
+      if (hashTypeDelete(hset, op_args.shard->tmp_str1)) {
+        ++deleted;
+        if (hashTypeLength(hset) == 0) {
+          key_remove = true;
+          break;
+        }
       }
     }
-  }
 
-  co.SyncRObj();
+    co.SyncRObj();
+  } else {
+    StringMap* sm = GetStringMap(co, op_args.db_cntx);
+
+    for (size_t i = 0; i < values.size(); ++i) {
+      if (sm->Erase(ArgS(values, i))) {
+        ++deleted;
+        if (sm->Empty()) {
+          key_remove = true;
+          break;
+        }
+      }
+    }
+  }
 
   db_slice.PostUpdate(op_args.db_cntx.db_index, *it_res, key);
   if (key_remove) {
-    if (hset->encoding == OBJ_ENCODING_LISTPACK) {
+    if (is_lp) {
       stats->listpack_blob_cnt--;
     }
     db_slice.Del(op_args.db_cntx.db_index, *it_res);
-  } else if (hset->encoding == OBJ_ENCODING_LISTPACK) {
-    stats->listpack_bytes += lpBytes((uint8_t*)hset->ptr);
+  } else if (is_lp) {
+    stats->listpack_bytes += lpBytes((uint8_t*)co.RObjPtr());
   }
 
   return deleted;
@@ -353,57 +352,29 @@ OpResult<vector<OptStr>> OpMGet(const OpArgs& op_args, std::string_view key, Cmd
   if (!it_res)
     return it_res.status();
 
-  CompactObj& co = (*it_res)->second;
-  robj* hset = co.AsRObj();
+  const CompactObj& co = (*it_res)->second;
 
   std::vector<OptStr> result(fields.size());
 
-  if (hset->encoding == OBJ_ENCODING_LISTPACK) {
-    uint8_t* lp = (uint8_t*)hset->ptr;
-    absl::flat_hash_map<string_view, unsigned> reverse;
-    reverse.reserve(fields.size() + 1);
-    for (size_t i = 0; i < fields.size(); ++i) {
-      reverse.emplace(ArgS(fields, i), i);  // map fields to their index.
-    }
-
-    char ibuf[32];
-    uint8_t* lp_elem = lpFirst(lp);
-    int64_t ele_len;
-    string_view key;
-    DCHECK(lp_elem);  // empty containers are not allowed.
-    size_t lplen = lpLength(lp);
-    DCHECK(lplen > 0 && lplen % 2 == 0);
+  if (co.Encoding() == kEncodingListPack) {
+    uint8_t* lp = (uint8_t*)co.RObjPtr();
+    vector<string_view> names(fields.size());
+    for (size_t i = 0; i < fields.size(); ++i)
+      names[i] = ArgS(fields, i);
 
     // We do single pass on listpack for this operation.
-    do {
-      uint8_t* elem = lpGet(lp_elem, &ele_len, NULL);
-      if (elem) {
-        key = string_view{reinterpret_cast<char*>(elem), size_t(ele_len)};
-      } else {
-        char* next = absl::numbers_internal::FastIntToBuffer(ele_len, ibuf);
-        key = string_view{ibuf, size_t(next - ibuf)};
-      }
-      lp_elem = lpNext(lp, lp_elem);  // switch to value
-      DCHECK(lp_elem);
-
-      auto it = reverse.find(key);
-      if (it != reverse.end()) {
-        DCHECK_LT(it->second, result.size());
-        result[it->second].emplace(LpGetVal(lp_elem));  // populate found items.
-      }
-
-      lp_elem = lpNext(lp, lp_elem);  // switch to the next key
-    } while (lp_elem);
+    vector<uint8_t*> entries(fields.size());
+    container_utils::LpFindKeys(lp, names, entries.data());
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (entries[i])
+        result[i].emplace(LpGetVal(lpNext(lp, entries[i])));
+    }
   } else {
-    DCHECK_EQ(OBJ_ENCODING_HT, hset->encoding);
-    dict* d = (dict*)hset->ptr;
+    StringMap* sm = GetStringMap(co, op_args.db_cntx);
     for (size_t i = 0; i < fields.size(); ++i) {
-      op_args.shard->tmp_str1 =
-          sdscpylen(op_args.shard->tmp_str1, fields[i].data(), fields[i].size());
-      dictEntry* de = dictFind(d, op_args.shard->tmp_str1);
-      if (de) {
-        sds val = (sds)dictGetVal(de);
-        result[i].emplace(val, sdslen(val));
+      optional<string_view> val = sm->Find(ArgS(fields, i));
+      if (val) {
+        result[i].emplace(*val);
       }
     }
   }
@@ -416,8 +387,7 @@ OpResult<uint32_t> OpLen(const OpArgs& op_args, string_view key) {
   auto it_res = db_slice.Find(op_args.db_cntx, key, OBJ_HASH);
 
   if (it_res) {
-    robj* hset = (*it_res)->second.AsRObj();
-    return hashTypeLength(hset);
+    return (*it_res)->second.Size();
   }
   if (it_res.status() == OpStatus::KEY_NOTFOUND)
     return 0;
@@ -430,82 +400,189 @@ OpResult<string> OpGet(const OpArgs& op_args, string_view key, string_view field
   if (!it_res)
     return it_res.status();
 
-  robj* hset = (*it_res)->second.AsRObj();
+  OptStr val = GetValue((*it_res)->second, op_args.db_cntx, field);
+  if (!val)
+    return OpStatus::KEY_NOTFOUND;
 
-  op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, field.data(), field.size());
+  return std::move(*val);
+}
 
-  if (hset->encoding == OBJ_ENCODING_LISTPACK) {
-    unsigned char* vstr = NULL;
-    unsigned int vlen = UINT_MAX;
-    long long vll = LLONG_MAX;
+// Calls add for the fields and/or the values of the hash, from cursor until the slice is
+// exhausted. Returns the cursor to continue from, or 0 once all of them were added. Only the
+// StringMap hashes can be large, the listpacks are added at once.
+template <typename F>
+uint32_t ScanHashSlice(const PrimeValue& pv, const DbContext& db_cntx, uint8_t mask,
+                       uint32_t cursor, TimeSlice* slice, F&& add) {
+  if (pv.Encoding() == kEncodingListPack) {
+    robj* hset = pv.AsRObj();
+    hashTypeIterator* hi = hashTypeInitIterator(hset);
 
-    int ret = hashTypeGetFromListpack(hset, op_args.shard->tmp_str1, &vstr, &vlen, &vll);
-    if (ret < 0) {
-      return OpStatus::KEY_NOTFOUND;
-    }
-    if (vstr) {
-      const char* src = reinterpret_cast<const char*>(vstr);
-      return string{src, vlen};
+    while (hashTypeNext(hi) != C_ERR) {
+      if (mask & FIELDS) {
+        add(LpGetVal(hi->fptr));
+      }
+
+      if (mask & VALUES) {
+        add(LpGetVal(hi->vptr));
+      }
     }
 
-    return absl::StrCat(vll);
+    hashTypeReleaseIterator(hi);
+    return 0;
   }
-  DCHECK_EQ(hset->encoding, OBJ_ENCODING_HT);
 
-  dictEntry* de = dictFind((dict*)hset->ptr, op_args.shard->tmp_str1);
-  if (!de)
-    return OpStatus::KEY_NOTFOUND;
+  StringMap* sm = GetStringMap(pv, db_cntx);
 
-  sds val = (sds)dictGetVal(de);
+  auto cb = [&](sds entry) {
+    if (mask & FIELDS) {
+      add(StringMap::Field(entry));
+    }
+
+    if (mask & VALUES) {
+      add(StringMap::Value(entry));
+    }
+  };
+
+  do {
+    cursor = sm->Scan(cursor, cb);
+  } while (cursor && !slice->Exhausted());
 
-  return string(val, sdslen(val));
+  return cursor;
 }
 
-OpResult<vector<string>> OpGetAll(const OpArgs& op_args, string_view key, uint8_t mask) {
+// The progress of a sliced HGETALL, HKEYS or HVALS.
+struct GetAllState {
+  vector<string> res;
+  uint32_t cursor = 0;
+};
+
+OpStatus OpGetAll(const OpArgs& op_args, string_view key, uint8_t mask, TimeSlice* slice,
+                  GetAllState* state) {
   auto& db_slice = op_args.shard->db_slice();
   auto it_res = db_slice.Find(op_args.db_cntx, key, OBJ_HASH);
   if (!it_res) {
-    if (it_res.status() == OpStatus::KEY_NOTFOUND)
-      return vector<string>{};
-    return it_res.status();
+    // The key could also expire between the slices, then it is read as missing.
+    state->res.clear();
+    return it_res.status() == OpStatus::KEY_NOTFOUND ? OpStatus::OK : it_res.status();
   }
 
-  robj* hset = (*it_res)->second.AsRObj();
-  hashTypeIterator* hi = hashTypeInitIterator(hset);
+  const PrimeValue& pv = (*it_res)->second;
 
-  vector<string> res;
   bool keyval = (mask == (FIELDS | VALUES));
-  size_t len = hashTypeLength(hset);
-  res.resize(keyval ? len * 2 : len);
-  unsigned index = 0;
+  if (state->cursor == 0) {
+    size_t len = pv.Size();
+    state->res.reserve(keyval ? len * 2 : len);
+  }
 
-  if (hset->encoding == OBJ_ENCODING_LISTPACK) {
-    while (hashTypeNext(hi) != C_ERR) {
-      if (mask & FIELDS) {
-        res[index++] = LpGetVal(hi->fptr);
-      }
+  state->cursor =
+      ScanHashSlice(pv, op_args.db_cntx, mask, state->cursor, slice,
+                    [state](string_view str) { state->res.emplace_back(str); });
+  return OpStatus::OK;
+}
 
-      if (mask & VALUES) {
-        res[index++] = LpGetVal(hi->vptr);
+// The progress of a streamed HGETALL, HKEYS or HVALS.
+struct StreamAllState {
+  StreamedReply reply;
+  uint32_t cursor = 0;
+};
+
+OpStatus OpStreamAll(const OpArgs& op_args, string_view key, uint8_t mask, TimeSlice* slice,
+                     StreamAllState* state) {
+  auto& db_slice = op_args.shard->db_slice();
+  auto it_res = db_slice.Find(op_args.db_cntx, key, OBJ_HASH);
+  if (!it_res) {
+    // Pinned keys do not move or get evicted, so only the first hop can miss the key.
+    DCHECK(!state->reply.started());
+    return it_res.status() == OpStatus::KEY_NOTFOUND ? OpStatus::OK : it_res.status();
+  }
+
+  const PrimeValue& pv = (*it_res)->second;
+
+  // A key with an expiry could expire between the hops, after its length was sent.
+  TimeSlice whole{0};
+  TimeSlice* hop_slice = pv.HasExpire() ? &whole : slice;
+
+  if (!state->reply.started()) {
+    // The expired fields are deleted as they are iterated over, so that the size becomes exact.
+    if (pv.Encoding() == kEncodingStrMap2) {
+      StringMap* sm = GetStringMap(pv, op_args.db_cntx);
+      if (sm->ExpirationUsed()) {
+        for (auto it = sm->begin(); it != sm->end(); ++it) {
+        }
       }
     }
-  } else {
-    while (hashTypeNext(hi) != C_ERR) {
-      if (mask & FIELDS) {
-        sds key = (sds)dictGetKey(hi->de);
-        res[index++].assign(key, sdslen(key));
-      }
+    state->reply.Start(pv.Size());
+  }
 
-      if (mask & VALUES) {
-        sds val = (sds)dictGetVal(hi->de);
-        res[index++].assign(val, sdslen(val));
+  state->cursor =
+      ScanHashSlice(pv, op_args.db_cntx, mask, state->cursor, hop_slice,
+                    [state, slice](string_view str) { state->reply.Add(str, slice); });
+  state->reply.EndHop(*slice, &db_slice);
+  return OpStatus::OK;
+}
+
+// Reads HGETALL, HKEYS or HVALS in two hops like GET with --offshard_copy_min_len. The first
+// hop keeps the key locked and pins a large map so that the connection thread copies its
+// entries instead of the shard thread. The second hop unpins it before the reply is written.
+// Reading a map with expiring fields deletes them, hence the shard reads such maps, as well as
+// the keys with expiry that concurrent readers may delete.
+OpStatus CopyAllOffShard(string_view key, uint8_t mask, size_t min_len, Transaction* trans,
+                         vector<string>* res) {
+  StringMap* pinned = nullptr;
+
+  auto read_cb = [&](Transaction* t, EngineShard* shard) -> OpStatus {
+    OpArgs op_args = t->GetOpArgs(shard);
+    auto it_res = shard->db_slice().Find(op_args.db_cntx, key, OBJ_HASH);
+    if (!it_res)
+      return it_res.status() == OpStatus::KEY_NOTFOUND ? OpStatus::OK : it_res.status();
+
+    const PrimeValue& pv = (*it_res)->second;
+    if (pv.Encoding() == kEncodingStrMap2 && !pv.HasExpire() && pv.MallocUsed() >= min_len) {
+      StringMap* sm = GetStringMap(pv, op_args.db_cntx);
+      if (!sm->ExpirationUsed()) {
+        shard->db_slice().PinRead();
+        pinned = sm;
+        return OpStatus::OK;
       }
     }
+
+    TimeSlice whole{0};
+    ScanHashSlice(pv, op_args.db_cntx, mask, 0, &whole,
+                  [res](string_view str) { res->emplace_back(str); });
+    return OpStatus::OK;
+  };
+
+  OpStatus status = OpStatus::OK;
+  trans->Schedule();
+  trans->Execute(
+      [&](Transaction* t, EngineShard* shard) {
+        status = read_cb(t, shard);
+        return status;
+      },
+      false);
+
+  // The map does not change while its key is locked.
+  if (pinned) {
+    res->reserve(mask == (FIELDS | VALUES) ? pinned->Size() * 2 : pinned->Size());
+    uint32_t cursor = 0;
+    do {
+      cursor = pinned->Scan(cursor, [&](sds entry) {
+        if (mask & FIELDS)
+          res->emplace_back(StringMap::Field(entry));
+        if (mask & VALUES)
+          res->emplace_back(StringMap::Value(entry));
+      });
+    } while (cursor);
   }
 
-  hashTypeReleaseIterator(hi);
+  auto unpin_cb = [&](Transaction* t, EngineShard* shard) {
+    if (pinned)
+      shard->db_slice().UnpinRead();
+    return OpStatus::OK;
+  };
+  trans->Execute(unpin_cb, true);
 
-  return res;
+  return status;
 }
 
 OpResult<size_t> OpStrLen(const OpArgs& op_args, string_view key, string_view field) {
@@ -518,29 +595,28 @@ OpResult<size_t> OpStrLen(const OpArgs& op_args, string_view key, string_view fi
     return it_res.status();
   }
 
-  robj* hset = (*it_res)->second.AsRObj();
-  size_t field_len = 0;
-  op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, field.data(), field.size());
+  const PrimeValue& pv = (*it_res)->second;
 
-  if (hset->encoding == OBJ_ENCODING_LISTPACK) {
-    unsigned char* vstr = NULL;
-    unsigned int vlen = UINT_MAX;
-    long long vll = LLONG_MAX;
-
-    if (hashTypeGetFromListpack(hset, op_args.shard->tmp_str1, &vstr, &vlen, &vll) == 0)
-      field_len = vstr ? vlen : sdigits10(vll);
+  if (pv.Encoding() == kEncodingListPack) {
+    uint8_t* lp = (uint8_t*)pv.RObjPtr();
+    uint8_t* fptr = container_utils::LpFindKey(lp, field);
+    if (!fptr)
+      return 0;
 
-    return field_len;
+    unsigned int vlen = 0;
+    long long vll = 0;
+    uint8_t* vstr = lpGetValue(lpNext(lp, fptr), &vlen, &vll);
+    return vstr ? vlen : sdigits10(vll);
   }
 
-  DCHECK_EQ(hset->encoding, OBJ_ENCODING_HT);
-
-  dictEntry* de = dictFind((dict*)hset->ptr, op_args.shard->tmp_str1);
-  return de ? sdslen((sds)de->v.val) : 0;
+  optional<string_view> val = GetStringMap(pv, op_args.db_cntx)->Find(field);
+  return val ? val->size() : 0;
 }
 
+// The fields expire after ttl_sec, unless it is UINT32_MAX. Only StringMap hashes have fields
+// that expire.
 OpResult<uint32_t> OpSet(const OpArgs& op_args, string_view key, CmdArgList values,
-                         bool skip_if_exists) {
+                         bool skip_if_exists, uint32_t ttl_sec = UINT32_MAX) {
   DCHECK(!values.empty() && 0 == values.size() % 2);
 
   auto& db_slice = op_args.shard->db_slice();
@@ -555,28 +631,28 @@ OpResult<uint32_t> OpSet(const OpArgs& op_args, string_view key, CmdArgList valu
 
   uint8_t* lp = nullptr;
   PrimeIterator& it = add_res.first;
+  PrimeValue& pv = it->second;
 
   if (add_res.second) {  // new key
     lp = lpNew(0);
-    it->second.InitRobj(OBJ_HASH, kEncodingListPack, lp);
+    pv.InitRobj(OBJ_HASH, kEncodingListPack, lp);
 
     stats->listpack_blob_cnt++;
     stats->listpack_bytes += lpBytes(lp);
   } else {
-    if (it->second.ObjType() != OBJ_HASH)
+    if (pv.ObjType() != OBJ_HASH)
       return OpStatus::WRONG_TYPE;
 
     db_slice.PreUpdate(op_args.db_cntx.db_index, it);
   }
-  robj* hset = it->second.AsRObj();
 
-  if (hset->encoding == OBJ_ENCODING_LISTPACK) {
-    lp = (uint8_t*)hset->ptr;
+  if (pv.Encoding() == kEncodingListPack) {
+    lp = (uint8_t*)pv.RObjPtr();
     stats->listpack_bytes -= lpBytes(lp);
 
-    if (!IsGoodForListpack(values, lp)) {
+    if (ttl_sec != UINT32_MAX || !IsGoodForListpack(values, lp)) {
       stats->listpack_blob_cnt--;
-      hashTypeConvert(hset, OBJ_ENCODING_HT);
+      pv.InitRobj(OBJ_HASH, kEncodingStrMap2, HSetFamily::ConvertToStrMap(lp));
       lp = nullptr;
     }
   }
@@ -589,38 +665,218 @@ OpResult<uint32_t> OpSet(const OpArgs& op_args, string_view key, CmdArgList valu
       tie(lp, inserted) = LpInsert(lp, ArgS(values, i), ArgS(values, i + 1), skip_if_exists);
       created += inserted;
     }
-    hset->ptr = lp;
+    pv.SetRObjPtr(lp);
     stats->listpack_bytes += lpBytes(lp);
   } else {
-    DCHECK_EQ(OBJ_ENCODING_HT, hset->encoding);
-    dict* this_dict = (dict*)hset->ptr;
+    StringMap* sm = GetStringMap(pv, op_args.db_cntx);
 
-    // Dictionary
     for (size_t i = 0; i < values.size(); i += 2) {
-      sds fs = sdsnewlen(values[i].data(), values[i].size());
-      dictEntry* existing;
-      dictEntry* de = dictAddRaw(this_dict, fs, &existing);
-      if (de) {
-        ++created;
-      } else {  // already exists
-        sdsfree(fs);
-        if (skip_if_exists)
-          continue;
-
-        de = existing;
-        dictFreeVal(this_dict, existing);
-      }
-
-      sds vs = sdsnewlen(values[i + 1].data(), values[i + 1].size());
-      dictSetVal(this_dict, de, vs);
+      string_view field = ArgS(values, i);
+      string_view value = ArgS(values, i + 1);
+      created += skip_if_exists ? sm->AddOrSkip(field, value, ttl_sec)
+                                : sm->AddOrUpdate(field, value, ttl_sec);
     }
+
+    if (ttl_sec != UINT32_MAX)
+      db_slice.IndexFieldExpiry(op_args.db_cntx, key, sm, sm->time_now() + ttl_sec);
   }
-  it->second.SyncRObj();
   db_slice.PostUpdate(op_args.db_cntx.db_index, it, key);
 
   return created;
 }
 
+// Sets the ttl of the fields of the hash. Returns for every field 1 if its ttl was set, or -2 if
+// the hash does not have it.
+OpResult<vector<long>> OpExpire(const OpArgs& op_args, string_view key, uint32_t ttl_sec,
+                                CmdArgList fields) {
+  auto& db_slice = op_args.shard->db_slice();
+  auto it_res = db_slice.Find(op_args.db_cntx, key, OBJ_HASH);
+  if (!it_res)
+    return it_res.status();
+
+  PrimeIterator it = *it_res;
+  PrimeValue& pv = it->second;
+  vector<long> res(fields.size(), -2);
+
+  // Only StringMap hashes have fields that expire, a listpack is converted if it has any.
+  if (pv.Encoding() == kEncodingListPack) {
+    uint8_t* lp = (uint8_t*)pv.RObjPtr();
+    bool found = false;
+    for (size_t i = 0; i < fields.size() && !found; ++i)
+      found = container_utils::LpFindKey(lp, ArgS(fields, i)) != nullptr;
+    if (!found)
+      return res;
+
+    db_slice.PreUpdate(op_args.db_cntx.db_index, it);
+    lp = (uint8_t*)pv.RObjPtr();  // PreUpdate could move a tiny listpack.
+    DbTableStats* stats = db_slice.MutableStats(op_args.db_cntx.db_index);
+    stats->listpack_blob_cnt--;
+    stats->listpack_bytes -= lpBytes(lp);
+    pv.InitRobj(OBJ_HASH, kEncodingStrMap2, HSetFamily::ConvertToStrMap(lp));
+  } else {
+    db_slice.PreUpdate(op_args.db_cntx.db_index, it);
+  }
+
+  StringMap* sm = GetStringMap(pv, op_args.db_cntx);
+  bool updated = false;
+  for (size_t i = 0; i < fields.size(); ++i) {
+    if (sm->SetExpire(ArgS(fields, i), ttl_sec)) {
+      res[i] = 1;
+      updated = true;
+    }
+  }
+
+  if (updated)
+    db_slice.IndexFieldExpiry(op_args.db_cntx, key, sm, sm->time_now() + ttl_sec);
+  db_slice.PostUpdate(op_args.db_cntx.db_index, it, key);
+
+  // The lookups could expire the remaining fields.
+  if (sm->Empty())
+    db_slice.Del(op_args.db_cntx.db_index, it);
+
+  return res;
+}
+
+// Returns for every field its remaining ttl in seconds, -1 if it does not expire or -2 if the
+// hash does not have it.
+OpResult<vector<long>> OpTtl(const OpArgs& op_args, string_view key, CmdArgList fields) {
+  auto it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_HASH);
+  if (!it_res)
+    return it_res.status();
+
+  const PrimeValue& pv = (*it_res)->second;
+  vector<long> res(fields.size(), -2);
+
+  if (pv.Encoding() == kEncodingListPack) {
+    uint8_t* lp = (uint8_t*)pv.RObjPtr();
+    for (size_t i = 0; i < fields.size(); ++i) {
+      if (container_utils::LpFindKey(lp, ArgS(fields, i)))
+        res[i] = -1;
+    }
+    return res;
+  }
+
+  StringMap* sm = GetStringMap(pv, op_args.db_cntx);
+  for (size_t i = 0; i < fields.size(); ++i) {
+    sds entry = sm->FindEntry(ArgS(fields, i));
+    if (!entry)
+      continue;
+
+    uint32_t at = StringMap::ExpireTime(entry);
+    res[i] = at == UINT32_MAX ? -1 : long(at - sm->time_now());
+  }
+  return res;
+}
+
+bool ParseFieldTtl(string_view str, uint32_t* ttl_sec) {
+  return absl::SimpleAtoi(str, ttl_sec) && *ttl_sec > 0 && *ttl_sec <= kMaxTtl;
+}
+
+// The ttl of HSETEX and HEXPIRE, either ttl_sec or EXAT <unix time in seconds>. The master
+// journals the commands with EXAT, so that the replica does not count the ttl from the time when
+// it applies them.
+struct FieldTtl {
+  uint32_t ttl_sec = 0;
+  uint64_t at_sec = 0;  // set for EXAT.
+
+  // Parses the ttl at args[i] and returns the index of the argument after it, or 0 if the ttl
+  // is invalid.
+  size_t Parse(CmdArgList args, size_t i) {
+    if (!absl::EqualsIgnoreCase(ArgS(args, i), "EXAT"))
+      return ParseFieldTtl(ArgS(args, i), &ttl_sec) ? i + 1 : 0;
+    if (i + 1 >= args.size() || !absl::SimpleAtoi(ArgS(args, i + 1), &at_sec) || at_sec == 0)
+      return 0;
+    return i + 2;
+  }
+
+  // The ttl at the time of the operation. A deadline that passed expires the fields right away.
+  uint32_t Get(const DbContext& db_cntx) const {
+    if (at_sec == 0)
+      return ttl_sec;
+    uint64_t now_sec = db_cntx.time_now_ms / 1000;
+    return at_sec > now_sec ? min<uint64_t>(at_sec - now_sec, kMaxTtl) : 0;
+  }
+
+  // The deadline to journal.
+  string At(const DbContext& db_cntx) const {
+    return absl::StrCat(at_sec ? at_sec : db_cntx.time_now_ms / 1000 + ttl_sec);
+  }
+};
+
+// Journals cmd key EXAT <at> followed by args, the arguments after the ttl.
+void RecordFieldTtl(Transaction* t, EngineShard* shard, string_view cmd, string_view key,
+                    const FieldTtl& ttl, CmdArgList args) {
+  string at = ttl.At(t->GetOpArgs(shard).db_cntx);
+  vector<string_view> journal_cmd{cmd, key, "EXAT", at};
+  for (size_t i = 0; i < args.size(); ++i)
+    journal_cmd.push_back(ArgS(args, i));
+  t->RecordJournal(shard, journal_cmd);
+}
+
+// Returns count distinct random fields, or -count fields that may repeat if count is negative,
+// each followed by its value if with_values is set.
+OpResult<StringVec> OpRandField(const OpArgs& op_args, string_view key, int32_t count,
+                                bool with_values) {
+  auto it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_HASH);
+  if (!it_res)
+    return it_res.status();
+
+  const PrimeValue& pv = it_res.value()->second;
+  size_t num = count < 0 ? -int64_t(count) : count;
+  StringVec res;
+
+  if (pv.Encoding() == kEncodingStrMap2) {
+    StringMap* sm = GetStringMap(pv, op_args.db_cntx);
+    auto add = [&res, with_values](sds entry) {
+      res.emplace_back(StringMap::Field(entry));
+      if (with_values)
+        res.emplace_back(StringMap::Value(entry));
+    };
+
+    if (count >= 0) {
+      sm->SampleEntries(absl::Uniform<uint64_t>(random_gen), num, add);
+    } else {
+      for (size_t i = 0; i < num; ++i) {
+        sds entry = sm->RandomEntry(absl::Uniform<uint64_t>(random_gen));
+        if (!entry)  // all the fields expired.
+          break;
+        add(entry);
+      }
+    }
+    return res;
+  }
+
+  if (pv.Encoding() != kEncodingListPack) {
+    LOG(ERROR) << "Invalid encoding " << pv.Encoding();
+    return OpStatus::INVALID_VALUE;
+  }
+
+  uint8_t* lp = (uint8_t*)pv.RObjPtr();
+  size_t hlen = lpLength(lp) / 2;
+  CHECK_GT(hlen, 0u);
+  if (count >= 0)
+    num = min(num, hlen);
+
+  vector<listpackEntry> fields(num), values(with_values ? num : 0);
+  listpackEntry* vals = with_values ? values.data() : nullptr;
+  if (count >= 0) {
+    num = lpRandomPairsUnique(lp, num, fields.data(), vals);
+  } else if (num > 0) {
+    lpRandomPairs(lp, num, fields.data(), vals);
+  }
+
+  auto to_string = [](const listpackEntry& entry) {
+    return entry.sval ? string(reinterpret_cast<char*>(entry.sval), entry.slen)
+                      : absl::StrCat(entry.lval);
+  };
+  for (size_t i = 0; i < num; ++i) {
+    res.push_back(to_string(fields[i]));
+    if (with_values)
+      res.push_back(to_string(values[i]));
+  }
+  return res;
+}
+
 }  // namespace
 
 void HSetFamily::HDel(CmdArgList args, ConnectionContext* cntx) {
@@ -661,7 +917,12 @@ void HSetFamily::HExists(CmdArgList args, ConnectionContext* cntx) {
     auto it_res = db_slice.Find(t->db_context(), key, OBJ_HASH);
 
     if (it_res) {
-      robj* hset = (*it_res)->second.AsRObj();
+      const PrimeValue& pv = (*it_res)->second;
+      if (pv.Encoding() == kEncodingStrMap2) {
+        return int(GetStringMap(pv, t->db_context())->Contains(field));
+      }
+
+      robj* hset = pv.AsRObj();
       shard->tmp_str1 = sdscpylen(shard->tmp_str1, field.data(), field.size());
 
       return hashTypeExists(hset, shard->tmp_str1);
@@ -776,7 +1037,17 @@ void HSetFamily::HIncrByFloat(CmdArgList args, ConnectionContext* cntx) {
   IncrByParam param{dval};
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpIncrBy(t->GetOpArgs(shard), key, field, &param);
+    OpStatus status = OpIncrBy(t->GetOpArgs(shard), key, field, &param);
+
+    // The journal sets the stored sum, so that the replica does not round the increment again.
+    if (status == OpStatus::OK) {
+      char buf[128];
+      const char* str = RedisReplyBuilder::FormatDouble(get<double>(param), buf, sizeof(buf));
+      t->RecordJournal(shard, {"HSET", key, field, str});
+    } else {
+      t->RecordJournal(shard, {});
+    }
+    return status;
   };
 
   OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
@@ -809,17 +1080,49 @@ void HSetFamily::HGetAll(CmdArgList args, ConnectionContext* cntx) {
 
 void HSetFamily::HGetGeneric(CmdArgList args, ConnectionContext* cntx, uint8_t getall_mask) {
   string_view key = ArgS(args, 1);
+  bool is_map = (getall_mask == (FIELDS | VALUES));
+
+  uint32_t offshard_min_len = absl::GetFlag(FLAGS_offshard_copy_min_len);
+  if (offshard_min_len > 0 && !cntx->transaction->IsMulti()) {
+    vector<string> res;
+    OpStatus status =
+        CopyAllOffShard(key, getall_mask, offshard_min_len, cntx->transaction, &res);
+    if (status != OpStatus::OK)
+      return (*cntx)->SendError(status);
+    return (*cntx)->SendStringCollection(
+        absl::Span<const string>{res}, is_map ? RedisReplyBuilder::MAP : RedisReplyBuilder::ARRAY);
+  }
 
-  auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpGetAll(t->GetOpArgs(shard), key, getall_mask);
+  // The replies of multi transactions and scripts are collected as usual.
+  if (!cntx->transaction->IsMulti()) {
+    RedisReplyBuilder* rb = cntx->operator->();
+    StreamAllState state{StreamedReply{is_map ? RedisReplyBuilder::MAP : RedisReplyBuilder::ARRAY}};
+    auto cb = [&](Transaction* t, EngineShard* shard, TimeSlice* slice) {
+      return OpStreamAll(t->GetOpArgs(shard), key, getall_mask, slice, &state);
+    };
+
+    OpStatus status =
+        cntx->transaction->ScheduleStreamed(std::move(cb), [&] { state.reply.Flush(rb); });
+    if (status == OpStatus::OK) {
+      state.reply.Finish(rb);
+    } else {
+      rb->SendError(status);
+    }
+    return;
+  }
+
+  GetAllState state;
+  auto cb = [&](Transaction* t, EngineShard* shard, TimeSlice* slice) {
+    return OpGetAll(t->GetOpArgs(shard), key, getall_mask, slice, &state);
   };
 
-  OpResult<vector<string>> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  OpStatus status = cntx->transaction->ScheduleSliced(std::move(cb));
 
-  if (result) {
-    (*cntx)->SendStringArr(absl::Span<const string>{*result});
+  if (status == OpStatus::OK) {
+    (*cntx)->SendStringCollection(absl::Span<const string>{state.res},
+                                  is_map ? RedisReplyBuilder::MAP : RedisReplyBuilder::ARRAY);
   } else {
-    (*cntx)->SendError(result.status());
+    (*cntx)->SendError(status);
   }
 }
 
@@ -919,51 +1222,125 @@ void HSetFamily::HStrLen(CmdArgList args, ConnectionContext* cntx) {
   }
 }
 
-void HSetFamily::HRandField(CmdArgList args, ConnectionContext* cntx) {
+// Syntax: HSETEX key <ttl_sec | EXAT unix_sec> field value [field value ...]
+void HSetFamily::HSetEx(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
+  FieldTtl ttl;
 
-  auto cb = [&](Transaction* t, EngineShard* shard) -> OpResult<StringVec> {
-    auto& db_slice = shard->db_slice();
-    auto it_res = db_slice.Find(t->db_context(), key, OBJ_HASH);
+  size_t fields_start = ttl.Parse(args, 2);
+  if (fields_start == 0) {
+    return (*cntx)->SendError(kInvalidIntErr);
+  }
+  if (fields_start == args.size() || (args.size() - fields_start) % 2 != 0) {
+    return (*cntx)->SendError(facade::WrongNumArgsError("hsetex"), kSyntaxErrType);
+  }
 
-    if (!it_res)
-      return it_res.status();
+  args.remove_prefix(fields_start);
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    OpArgs op_args = t->GetOpArgs(shard);
+    OpResult<uint32_t> res = OpSet(op_args, key, args, false, ttl.Get(op_args.db_cntx));
+    if (res)
+      RecordFieldTtl(t, shard, "HSETEX", key, ttl, args);
+    else
+      t->RecordJournal(shard, {});
+    return res;
+  };
 
-    const PrimeValue& pv = it_res.value()->second;
-    StringVec str_vec;
+  OpResult<uint32_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result) {
+    (*cntx)->SendLong(*result);
+  } else {
+    (*cntx)->SendError(result.status());
+  }
+}
 
-    if (pv.Encoding() == OBJ_ENCODING_HT) {
-      dict* this_dict = (dict*)pv.RObjPtr();
-      dictEntry* de = dictGetFairRandomKey(this_dict);
-      sds key = (sds)de->key;
-      str_vec.emplace_back(key, sdslen(key));
-    } else if (pv.Encoding() == OBJ_ENCODING_LISTPACK) {
-      uint8_t* lp = (uint8_t*)pv.RObjPtr();
-      size_t lplen = lpLength(lp);
-      CHECK(lplen > 0 && lplen % 2 == 0);
+// Syntax: HEXPIRE key <ttl_sec | EXAT unix_sec> field [field ...]
+void HSetFamily::HExpire(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  FieldTtl ttl;
+
+  size_t fields_start = ttl.Parse(args, 2);
+  if (fields_start == 0) {
+    return (*cntx)->SendError(kInvalidIntErr);
+  }
+  if (fields_start == args.size()) {
+    return (*cntx)->SendError(facade::WrongNumArgsError("hexpire"), kSyntaxErrType);
+  }
 
-      size_t hlen = lplen / 2;
-      listpackEntry key;
+  args.remove_prefix(fields_start);
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    OpArgs op_args = t->GetOpArgs(shard);
+    OpResult<vector<long>> res = OpExpire(op_args, key, ttl.Get(op_args.db_cntx), args);
+    if (res && find(res->begin(), res->end(), 1) != res->end())
+      RecordFieldTtl(t, shard, "HEXPIRE", key, ttl, args);
+    else
+      t->RecordJournal(shard, {});
+    return res;
+  };
 
-      lpRandomPair(lp, hlen, &key, NULL);
-      if (key.sval) {
-        str_vec.emplace_back(reinterpret_cast<char*>(key.sval), key.slen);
-      } else {
-        str_vec.emplace_back(absl::StrCat(key.lval));
-      }
-    } else {
-      LOG(ERROR) << "Invalid encoding " << pv.Encoding();
-      return OpStatus::INVALID_VALUE;
-    }
-    return str_vec;
+  SendFieldResults(cntx->transaction->ScheduleSingleHopT(std::move(cb)), args.size(), cntx);
+}
+
+// Syntax: HTTL key field [field ...]
+void HSetFamily::HTtl(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+
+  args.remove_prefix(2);
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpTtl(t->GetOpArgs(shard), key, args);
+  };
+
+  SendFieldResults(cntx->transaction->ScheduleSingleHopT(std::move(cb)), args.size(), cntx);
+}
+
+void HSetFamily::SendFieldResults(const OpResult<vector<long>>& result, size_t num_fields,
+                                  ConnectionContext* cntx) {
+  if (!result && result.status() != OpStatus::KEY_NOTFOUND) {
+    return (*cntx)->SendError(result.status());
+  }
+
+  (*cntx)->StartArray(num_fields);
+  for (size_t i = 0; i < num_fields; ++i) {
+    (*cntx)->SendLong(result ? (*result)[i] : -2);
+  }
+}
+
+// Syntax: HRANDFIELD key [count [WITHVALUES]]
+void HSetFamily::HRandField(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  int32_t count = 1;
+  bool with_values = false;
+
+  if (args.size() > 4) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+  if (args.size() > 2 && !absl::SimpleAtoi(ArgS(args, 2), &count)) {
+    return (*cntx)->SendError(kInvalidIntErr);
+  }
+  if (args.size() == 4) {
+    ToUpper(&args[3]);
+    if (ArgS(args, 3) != "WITHVALUES")
+      return (*cntx)->SendError(kSyntaxErr);
+    with_values = true;
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpRandField(t->GetOpArgs(shard), key, count, with_values);
   };
 
   OpResult<StringVec> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
-  if (result) {
-    CHECK_EQ(1u, result->size());  // TBD: to support count and withvalues.
+  if (!result && result.status() != OpStatus::KEY_NOTFOUND) {
+    return (*cntx)->SendError(result.status());
+  }
+
+  if (args.size() > 2) {
+    return (*cntx)->SendStringArr(result ? *result : StringVec{});
+  }
+
+  if (result && !result->empty()) {
     (*cntx)->SendBulkString(result->front());
   } else {
-    (*cntx)->SendError(result.status());
+    (*cntx)->SendNull();
   }
 }
 
@@ -975,6 +1352,7 @@ void HSetFamily::Register(CommandRegistry* registry) {
   *registry << CI{"HDEL", CO::FAST | CO::WRITE, -3, 1, 1, 1}.HFUNC(HDel)
             << CI{"HLEN", CO::FAST | CO::READONLY, 2, 1, 1, 1}.HFUNC(HLen)
             << CI{"HEXISTS", CO::FAST | CO::READONLY, 3, 1, 1, 1}.HFUNC(HExists)
+            << CI{"HEXPIRE", CO::WRITE | CO::FAST, -4, 1, 1, 1}.HFUNC(HExpire)
             << CI{"HGET", CO::FAST | CO::READONLY, 3, 1, 1, 1}.HFUNC(HGet)
             << CI{"HGETALL", CO::FAST | CO::READONLY, 2, 1, 1, 1}.HFUNC(HGetAll)
             << CI{"HMGET", CO::FAST | CO::READONLY, -3, 1, 1, 1}.HFUNC(HMGet)
@@ -985,11 +1363,13 @@ void HSetFamily::Register(CommandRegistry* registry) {
             << CI{"HKEYS", CO::READONLY, 2, 1, 1, 1}.HFUNC(HKeys)
 
             // TODO: add options support
-            << CI{"HRANDFIELD", CO::READONLY, 2, 1, 1, 1}.HFUNC(HRandField)
+            << CI{"HRANDFIELD", CO::READONLY, -2, 1, 1, 1}.HFUNC(HRandField)
             << CI{"HSCAN", CO::READONLY, -3, 1, 1, 1}.HFUNC(HScan)
             << CI{"HSET", CO::WRITE | CO::FAST | CO::DENYOOM, -4, 1, 1, 1}.HFUNC(HSet)
+            << CI{"HSETEX", CO::WRITE | CO::FAST | CO::DENYOOM, -5, 1, 1, 1}.HFUNC(HSetEx)
             << CI{"HSETNX", CO::WRITE | CO::DENYOOM | CO::FAST, 4, 1, 1, 1}.HFUNC(HSetNx)
             << CI{"HSTRLEN", CO::READONLY | CO::FAST, 3, 1, 1, 1}.HFUNC(HStrLen)
+            << CI{"HTTL", CO::READONLY | CO::FAST, -3, 1, 1, 1}.HFUNC(HTtl)
             << CI{"HVALS", CO::READONLY, 2, 1, 1, 1}.HFUNC(HVals);
 }
 
@@ -997,4 +1377,29 @@ uint32_t HSetFamily::MaxListPackLen() {
   return kMaxListPackLen;
 }
 
+StringMap* HSetFamily::ConvertToStrMap(uint8_t* lp) {
+  StringMap* sm = new StringMap(CompactObj::memory_resource());
+  size_t lplen = lpLength(lp);
+  if (lplen == 0)
+    return sm;
+
+  sm->Reserve(lplen / 2);
+
+  uint8_t* lp_elem = lpFirst(lp);
+  uint8_t field_buf[LP_INTBUF_SIZE], value_buf[LP_INTBUF_SIZE];
+
+  do {
+    string_view field = LpGetView(lp_elem, field_buf);
+    lp_elem = lpNext(lp, lp_elem);  // switch to value
+    DCHECK(lp_elem);
+    string_view value = LpGetView(lp_elem, value_buf);
+    lp_elem = lpNext(lp, lp_elem);  // switch to next field
+
+    bool added = sm->AddOrUpdate(field, value);
+    LOG_IF(ERROR, !added) << "Duplicate hash field " << field;
+  } while (lp_elem);
+
+  return sm;
+}
+
 }  // namespace dfly
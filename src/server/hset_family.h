@@ -5,6 +5,7 @@
 #pragma once
 
 #include <optional>
+#include <vector>
 
 #include "facade/op_status.h"
 #include "server/common.h"
@@ -13,6 +14,7 @@ namespace dfly {
 
 class ConnectionContext;
 class CommandRegistry;
+class StringMap;
 using facade::OpResult;
 using facade::OpStatus;
 
@@ -21,8 +23,10 @@ class HSetFamily {
   static void Register(CommandRegistry* registry);
   static uint32_t MaxListPackLen();
 
- private:
+  // Converts a listpack hash into StringMap. Does not release lp.
+  static StringMap* ConvertToStrMap(uint8_t* lp);
 
+ private:
   static void HDel(CmdArgList args, ConnectionContext* cntx);
   static void HLen(CmdArgList args, ConnectionContext* cntx);
   static void HExists(CmdArgList args, ConnectionContext* cntx);
@@ -36,10 +40,17 @@ class HSetFamily {
   static void HScan(CmdArgList args, ConnectionContext* cntx);
   static void HSet(CmdArgList args, ConnectionContext* cntx);
   static void HSetNx(CmdArgList args, ConnectionContext* cntx);
+  static void HSetEx(CmdArgList args, ConnectionContext* cntx);
+  static void HExpire(CmdArgList args, ConnectionContext* cntx);
+  static void HTtl(CmdArgList args, ConnectionContext* cntx);
   static void HStrLen(CmdArgList args, ConnectionContext* cntx);
   static void HRandField(CmdArgList args, ConnectionContext* cntx);
 
   static void HGetGeneric(CmdArgList args, ConnectionContext* cntx, uint8_t getall_mask);
+
+  // Sends the per field results of HEXPIRE and HTTL.
+  static void SendFieldResults(const OpResult<std::vector<long>>& result, size_t num_fields,
+                               ConnectionContext* cntx);
 };
 
 }  // namespace dfly
@@ -10,11 +10,14 @@ extern "C" {
 #include "redis/sds.h"
 }
 
+#include "base/flags.h"
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "facade/facade_test.h"
 #include "server/test_utils.h"
 
+ABSL_DECLARE_FLAG(uint32_t, offshard_copy_min_len);
+
 using namespace testing;
 using namespace std;
 using namespace util;
@@ -95,6 +98,33 @@ TEST_F(HSetFamilyTest, Get) {
   EXPECT_THAT(resp.GetVec(), ElementsAre("a", "1", "b", "2", "c", "3"));
 }
 
+TEST_F(HSetFamilyTest, ListpackLookup) {
+  Run({"hset", "x", "1", "int", "01", "str", "-5", "neg", "", "empty", "a", "b"});
+  EXPECT_EQ("int", Run({"hget", "x", "1"}));
+  EXPECT_EQ("str", Run({"hget", "x", "01"}));
+  EXPECT_EQ("neg", Run({"hget", "x", "-5"}));
+  EXPECT_EQ("empty", Run({"hget", "x", ""}));
+  EXPECT_THAT(Run({"hget", "x", "5"}), ArgType(RespExpr::NIL));
+  EXPECT_EQ(1, CheckedInt({"hstrlen", "x", "a"}));
+  EXPECT_EQ(0, CheckedInt({"hstrlen", "x", "c"}));
+
+  auto resp = Run({"hmget", "x", "a", "1", "a", "c", "01"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("b", "int", "b", ArgType(RespExpr::NIL), "str"));
+
+  // Many fields are resolved through a hash map.
+  vector<string> fields;
+  for (unsigned i = 0; i < 20; ++i)
+    fields.push_back(i % 2 ? "-5" : absl::StrCat("f", i));
+  fields.push_back("");
+  vector<string_view> args = {"hmget", "x"};
+  args.insert(args.end(), fields.begin(), fields.end());
+  resp = Run(absl::MakeSpan(args));
+  ASSERT_THAT(resp, ArrLen(21));
+  EXPECT_THAT(resp.GetVec()[0], ArgType(RespExpr::NIL));
+  EXPECT_EQ("neg", resp.GetVec()[19]);
+  EXPECT_EQ("empty", resp.GetVec()[20]);
+}
+
 TEST_F(HSetFamilyTest, HSetNx) {
   EXPECT_EQ(1, CheckedInt({"hsetnx", "key", "field", "val"}));
   EXPECT_EQ(Run({"hget", "key", "field"}), "val");
@@ -123,13 +153,27 @@ TEST_F(HSetFamilyTest, HScan) {
     Run({"HSET", "myhash", absl::StrCat("Field-", i), absl::StrCat("Value-", i)});
   }
 
-  // Note that even though this limit by 4, it would return more because
-  // all fields are on listpack
+  // The listpack is scanned by count fields as well.
   auto resp = Run({"hscan", "myhash", "0", "count", "4"});
   EXPECT_THAT(resp, ArrLen(2));
   auto vec = StrArray(resp.GetVec()[1]);
-  EXPECT_EQ(vec.size(), 20);
+  EXPECT_EQ(vec.size(), 8);
   EXPECT_THAT(vec, Each(AnyOf(StartsWith("Field"), StartsWith("Value"))));
+  EXPECT_NE("0", resp.GetVec()[0].GetString());
+
+  string cursor = "0";
+  vector<string> fields;
+  do {
+    resp = Run({"hscan", "myhash", cursor, "count", "4"});
+    ASSERT_THAT(resp, ArrLen(2));
+    cursor = resp.GetVec()[0].GetString();
+    vec = StrArray(resp.GetVec()[1]);
+    for (size_t i = 0; i < vec.size(); i += 2)
+      fields.push_back(vec[i]);
+  } while (cursor != "0");
+  sort(fields.begin(), fields.end());
+  EXPECT_EQ(fields.end(), unique(fields.begin(), fields.end()));
+  EXPECT_EQ(10, fields.size());
 
   // Now run with filter on the results - we are expecting to not getting
   // any result at this point
@@ -153,7 +197,7 @@ TEST_F(HSetFamilyTest, HScan) {
   vec = StrArray(resp.GetVec()[1]);
 
   // See https://redis.io/commands/scan/ --> "The COUNT option", for why this cannot be exact
-  EXPECT_GT(vec.size(), 40);  // This should be larger than (20 * 2) and less than about 50
+  EXPECT_GE(vec.size(), 40);  // This should be at least (20 * 2) and less than about 50
   EXPECT_LT(vec.size(), 60);
 }
 
@@ -163,4 +207,229 @@ TEST_F(HSetFamilyTest, HScanLpMatchBug) {
   EXPECT_THAT(resp, ArrLen(2));
 }
 
+TEST_F(HSetFamilyTest, LargeHash) {
+  // Values longer than hash_max_listpack_value force the hash out of listpack.
+  string long_val(100, 'x');
+  for (int i = 0; i < 100; i++) {
+    Run({"hset", "key", absl::StrCat("f", i), absl::StrCat(long_val, i)});
+  }
+  EXPECT_EQ(100, CheckedInt({"hlen", "key"}));
+  EXPECT_EQ(absl::StrCat(long_val, 7), Run({"hget", "key", "f7"}));
+  EXPECT_EQ(0, CheckedInt({"hset", "key", "f7", "short"}));
+  EXPECT_EQ("short", Run({"hget", "key", "f7"}));
+  EXPECT_EQ(5, CheckedInt({"hstrlen", "key", "f7"}));
+  EXPECT_EQ(1, CheckedInt({"hexists", "key", "f7"}));
+  EXPECT_EQ(0, CheckedInt({"hsetnx", "key", "f7", "other"}));
+
+  EXPECT_EQ(10, CheckedInt({"hincrby", "key", "counter", "10"}));
+  EXPECT_EQ(15, CheckedInt({"hincrby", "key", "counter", "5"}));
+
+  auto resp = Run({"hgetall", "key"});
+  EXPECT_THAT(resp, ArrLen(202));
+
+  resp = Run({"hrandfield", "key"});
+  string field = resp.GetString();
+  EXPECT_EQ(1, CheckedInt({"hexists", "key", field}));
+
+  EXPECT_EQ(2, CheckedInt({"hdel", "key", "f1", "f2", "missing"}));
+  EXPECT_EQ(99, CheckedInt({"hlen", "key"}));
+
+  string cursor = "0";
+  size_t total = 0;
+  do {
+    resp = Run({"hscan", "key", cursor, "count", "10"});
+    ASSERT_THAT(resp, ArrLen(2));
+    auto vec = resp.GetVec();
+    cursor = vec[0].GetString();
+    total += StrArray(vec[1]).size();
+  } while (cursor != "0");
+  EXPECT_GE(total, 99 * 2);
+}
+
+TEST_F(HSetFamilyTest, HRandField) {
+  EXPECT_THAT(Run({"hrandfield", "missing"}), ArgType(RespExpr::NIL));
+  EXPECT_THAT(Run({"hrandfield", "missing", "2"}), ArrLen(0));
+
+  Run({"hset", "small", "a", "1", "b", "2", "c", "3"});
+  auto resp = Run({"hrandfield", "small", "5"});
+  ASSERT_THAT(resp, ArrLen(3));
+  EXPECT_THAT(resp.GetVec(), UnorderedElementsAre("a", "b", "c"));
+  resp = Run({"hrandfield", "small", "-5", "withvalues"});
+  ASSERT_THAT(resp, ArrLen(10));
+  for (unsigned i = 0; i < 10; i += 2) {
+    EXPECT_EQ(resp.GetVec()[i].GetString()[0] - 'a' + 1, stoi(resp.GetVec()[i + 1].GetString()));
+  }
+  EXPECT_THAT(Run({"hrandfield", "small", "1", "values"}), ErrArg("syntax error"));
+
+  // Values longer than hash_max_listpack_value force the hash out of listpack.
+  string long_val(100, 'x');
+  for (int i = 0; i < 1000; i++) {
+    Run({"hset", "key", absl::StrCat("f", i), absl::StrCat(long_val, i)});
+  }
+
+  resp = Run({"hrandfield", "key", "100", "withvalues"});
+  ASSERT_THAT(resp, ArrLen(200));
+  std::set<string> fields;
+  for (unsigned i = 0; i < 200; i += 2) {
+    string field = resp.GetVec()[i].GetString();
+    EXPECT_TRUE(fields.insert(field).second) << field;
+    EXPECT_EQ(absl::StrCat(long_val, field.substr(1)), resp.GetVec()[i + 1].GetString());
+  }
+  EXPECT_THAT(Run({"hrandfield", "key", "800"}), ArrLen(800));
+  EXPECT_THAT(Run({"hrandfield", "key", "2000"}), ArrLen(1000));
+  EXPECT_THAT(Run({"hrandfield", "key", "-2000"}), ArrLen(2000));
+}
+
+TEST_F(HSetFamilyTest, TinyHash) {
+  auto hash_bytes = [this] {
+    return service_->server_family().GetMetrics().db[0].memory_usage_by_type[OBJ_HASH];
+  };
+
+  // A hash of a single small field is stored inline and allocates nothing.
+  Run({"hset", "h", "a", "1"});
+  EXPECT_EQ(0u, hash_bytes());
+  EXPECT_THAT(Run({"hincrby", "h", "a", "5"}), IntArg(6));
+  EXPECT_EQ(0u, hash_bytes());
+
+  Run({"hset", "h", "bb", "22"});
+  EXPECT_GT(hash_bytes(), 0u);
+  EXPECT_THAT(Run({"hgetall", "h"}).GetVec(), ElementsAre("a", "6", "bb", "22"));
+
+  EXPECT_THAT(Run({"hdel", "h", "bb"}), IntArg(1));
+  EXPECT_EQ(0u, hash_bytes());
+  EXPECT_EQ(Run({"hget", "h", "a"}), "6");
+  EXPECT_THAT(Run({"hexists", "h", "a"}), IntArg(1));
+  EXPECT_THAT(Run({"hlen", "h"}), IntArg(1));
+
+  // The field ttls convert it to a StringMap.
+  auto resp = Run({"hexpire", "h", "100", "a", "b"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), IntArg(-2)));
+  EXPECT_THAT(Run({"httl", "h", "a"}), IntArg(100));
+}
+
+TEST_F(HSetFamilyTest, FieldTtl) {
+  EXPECT_THAT(Run({"hset", "key", "persistent", "v"}), IntArg(1));
+  EXPECT_THAT(Run({"hsetex", "key", "10", "f1", "v1", "f2", "v2"}), IntArg(2));
+  EXPECT_THAT(Run({"hsetex", "key", "10", "f1"}), ErrArg("wrong number"));
+  EXPECT_THAT(Run({"hsetex", "key", "0", "f1", "v1"}), ErrArg("not an integer"));
+
+  auto resp = Run({"httl", "key", "f1", "persistent", "missing"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(10), IntArg(-1), IntArg(-2)));
+  resp = Run({"hexpire", "key", "20", "f2", "persistent", "missing"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), IntArg(1), IntArg(-2)));
+  resp = Run({"hexpire", "missing", "20", "f1", "f2"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(-2), IntArg(-2)));
+
+  // Setting a value drops the ttl of the field, an increment keeps it.
+  EXPECT_THAT(Run({"hset", "key", "persistent", "v"}), IntArg(0));
+  EXPECT_THAT(Run({"hsetex", "key", "10", "counter", "1"}), IntArg(1));
+  EXPECT_THAT(Run({"hincrby", "key", "counter", "1"}), IntArg(2));
+  resp = Run({"httl", "key", "persistent", "counter"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(-1), IntArg(10)));
+
+  AdvanceTime(10000);
+  EXPECT_THAT(Run({"hget", "key", "f1"}), ArgType(RespExpr::NIL));
+  EXPECT_THAT(Run({"hexists", "key", "counter"}), IntArg(0));
+  EXPECT_EQ(Run({"hget", "key", "f2"}), "v2");
+  resp = Run({"hgetall", "key"});
+  EXPECT_THAT(resp.GetVec(), UnorderedElementsAre("persistent", "v", "f2", "v2"));
+
+  AdvanceTime(10000);
+  resp = Run({"hgetall", "key"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("persistent", "v"));
+
+  Run({"set", "str", "v"});
+  EXPECT_THAT(Run({"hsetex", "str", "10", "f", "v"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"httl", "str", "f"}), ErrArg("WRONGTYPE"));
+}
+
+TEST_F(HSetFamilyTest, FieldTtlAt) {
+  uint64_t now_sec = TEST_current_time_ms / 1000;
+  EXPECT_THAT(Run({"hsetex", "key", "EXAT", absl::StrCat(now_sec + 30), "f1", "v1"}), IntArg(1));
+  EXPECT_THAT(Run({"httl", "key", "f1"}), IntArg(30));
+  EXPECT_THAT(Run({"hset", "key", "f2", "v2"}), IntArg(1));
+  auto resp = Run({"hexpire", "key", "exat", absl::StrCat(now_sec + 50), "f2", "missing"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), IntArg(-2)));
+  EXPECT_THAT(Run({"httl", "key", "f2"}), IntArg(50));
+
+  // A deadline that passed expires the fields right away.
+  EXPECT_THAT(Run({"hsetex", "key", "EXAT", absl::StrCat(now_sec - 1), "f3", "v3"}), IntArg(1));
+  EXPECT_THAT(Run({"hexists", "key", "f3"}), IntArg(0));
+  resp = Run({"hexpire", "key", "EXAT", absl::StrCat(now_sec), "f1"});
+  EXPECT_THAT(resp, IntArg(1));
+  EXPECT_THAT(Run({"hget", "key", "f1"}), ArgType(RespExpr::NIL));
+  EXPECT_EQ(Run({"hget", "key", "f2"}), "v2");
+
+  EXPECT_THAT(Run({"hsetex", "key", "EXAT", "0", "f", "v"}), ErrArg("not an integer"));
+  EXPECT_THAT(Run({"hsetex", "key", "EXAT", "soon", "f", "v"}), ErrArg("not an integer"));
+  EXPECT_THAT(Run({"hsetex", "key", "EXAT", "100", "f"}), ErrArg("wrong number"));
+  EXPECT_THAT(Run({"hexpire", "key", "EXAT", "100"}), ErrArg("wrong number"));
+}
+
+TEST_F(HSetFamilyTest, FieldTtlActiveExpiry) {
+  for (unsigned i = 0; i < 100; ++i) {
+    Run({"hsetex", "short", "1", absl::StrCat("f", i), "v"});
+    Run({"hsetex", "mixed", absl::StrCat(1 + i % 2), absl::StrCat("f", i), "v"});
+  }
+  Run({"hset", "mixed", "persistent", "v"});
+
+  auto expire_step = [] {
+    shard_set->RunBriefInParallel([](EngineShard* shard) {
+      shard->db_slice().DeleteDueFieldsStep(DbSlice::Context{0, GetCurrentTimeMs()}, 100);
+    });
+  };
+
+  // The passes are not due yet.
+  expire_step();
+  EXPECT_EQ(0u, service_->server_family().GetMetrics().events.expired_hash_fields);
+
+  // The expired fields are deleted without accessing the hashes, and so is the hash that has
+  // none left.
+  AdvanceTime(1000);
+  expire_step();
+  EXPECT_EQ(150u, service_->server_family().GetMetrics().events.expired_hash_fields);
+  EXPECT_THAT(Run({"exists", "short"}), IntArg(0));
+  EXPECT_THAT(Run({"exists", "mixed"}), IntArg(1));
+
+  // The next pass of the hash is scheduled at its next expiring field.
+  AdvanceTime(1000);
+  expire_step();
+  EXPECT_EQ(200u, service_->server_family().GetMetrics().events.expired_hash_fields);
+  EXPECT_THAT(Run({"hlen", "mixed"}), IntArg(1));
+}
+
+TEST_F(HSetFamilyTest, GetAllOffShardCopy) {
+  absl::FlagSaver fs;
+  absl::SetFlag(&FLAGS_offshard_copy_min_len, 64);
+
+  vector<string> args{"hset", "large"}, fields;
+  for (unsigned i = 0; i < 300; ++i) {
+    fields.push_back(absl::StrCat("field", i));
+    args.push_back(fields.back());
+    args.push_back(absl::StrCat("value", i));
+  }
+  Run(absl::MakeSpan(args));
+  Run({"hset", "small", "a", "1"});
+  Run({"hset", "ttl", "a", "1"});
+  Run({"expire", "ttl", "100"});
+  Run({"hsetex", "fieldttl", "100", "a", "1"});
+  Run({"hset", "fieldttl", "b", "2"});
+  Run({"lpush", "list", "a"});
+
+  auto resp = Run({"hgetall", "large"});
+  ASSERT_THAT(resp, ArrLen(600));
+  EXPECT_THAT(StrArray(Run({"hkeys", "large"})), UnorderedElementsAreArray(fields));
+  EXPECT_THAT(Run({"hvals", "large"}), ArrLen(300));
+
+  EXPECT_THAT(Run({"hgetall", "small"}).GetVec(), ElementsAre("a", "1"));
+  EXPECT_THAT(Run({"hgetall", "ttl"}).GetVec(), ElementsAre("a", "1"));
+  EXPECT_THAT(StrArray(Run({"hkeys", "fieldttl"})), UnorderedElementsAre("a", "b"));
+  EXPECT_THAT(Run({"hgetall", "missing"}), ArrLen(0));
+  EXPECT_THAT(Run({"hgetall", "list"}), ErrArg("WRONGTYPE"));
+
+  // The lock is released before the reply is written.
+  EXPECT_THAT(Run({"hset", "large", "field0", "new"}), IntArg(0));
+  EXPECT_EQ(Run({"hget", "large", "field0"}), "new");
+}
+
 }  // namespace dfly
@@ -0,0 +1,197 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/huge_pages.h"
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_split.h>
+#include <absl/strings/strip.h>
+#include <mimalloc.h>
+#include <sys/mman.h>
+
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include "base/flags.h"
+#include "base/logging.h"
+
+ABSL_FLAG(std::string, shard_huge_pages, "off",
+          "Backs the data heap of every shard, its DashTable segments and values, with 2MB "
+          "pages, while the connections stay on small pages: \"off\", \"madvise\" - transparent "
+          "huge pages, which the kernel may back by small pages when it runs out of huge ones, "
+          "\"hugetlb\" - pages of the hugetlb pool, maxmemory / shards of them per shard, or "
+          "madvise if the pool does not have enough. The huge pages are not returned to the OS. "
+          "Unlike --use_large_pages, which applies to all the allocations");
+
+namespace dfly {
+
+using namespace std;
+
+namespace {
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)  // MAP_HUGE_SHIFT is 26.
+#endif
+
+// Maps size bytes aligned to the huge pages, without reserving them with the kernel.
+void* MapAligned(size_t size) {
+  size_t len = size + HugePageArena::kPageSize;
+  void* ptr = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (ptr == MAP_FAILED)
+    return nullptr;
+
+  uintptr_t raw = reinterpret_cast<uintptr_t>(ptr);
+  uintptr_t aligned = (raw + HugePageArena::kPageSize - 1) & ~(HugePageArena::kPageSize - 1);
+  if (size_t head = aligned - raw; head > 0)
+    munmap(ptr, head);
+  if (size_t tail = raw + len - aligned - size; tail > 0)
+    munmap(reinterpret_cast<void*>(aligned + size), tail);
+  return reinterpret_cast<void*>(aligned);
+}
+
+}  // namespace
+
+auto HugePageArena::ConfiguredMode() -> Mode {
+  string mode = absl::GetFlag(FLAGS_shard_huge_pages);
+  if (mode == "madvise")
+    return MADVISE;
+  if (mode == "hugetlb")
+    return HUGETLB;
+  LOG_IF(ERROR, mode != "off") << "Unknown shard_huge_pages " << mode << ", using off";
+  return OFF;
+}
+
+const char* HugePageArena::ModeName(Mode mode) {
+  switch (mode) {
+    case OFF:
+      return "off";
+    case MADVISE:
+      return "madvise";
+    case HUGETLB:
+      return "hugetlb";
+  }
+  return "off";
+}
+
+HugePageArena HugePageArena::Map(Mode mode, size_t size) {
+  HugePageArena res;
+  if (mode == OFF || size == 0)
+    return res;
+
+  size = (size + kPageSize - 1) & ~(kPageSize - 1);
+  void* ptr = nullptr;
+  if (mode == HUGETLB) {
+    ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (ptr == MAP_FAILED) {
+      LOG(WARNING) << "Could not map " << size << " bytes of hugetlb pages, using madvise: "
+                   << strerror(errno);
+      ptr = nullptr;
+      mode = MADVISE;
+    }
+  }
+
+  if (mode == MADVISE) {
+    ptr = MapAligned(size);
+    if (!ptr) {
+      LOG(ERROR) << "Could not map the huge page arena of " << size << " bytes: "
+                 << strerror(errno);
+      return res;
+    }
+    LOG_IF(WARNING, madvise(ptr, size, MADV_HUGEPAGE) != 0)
+        << "Transparent huge pages are not available: " << strerror(errno);
+  }
+
+  // The pages are pinned, mimalloc does not decommit large pages.
+  mi_arena_id_t arena_id;
+  if (!mi_manage_os_memory_ex(ptr, size, true /* committed */, true /* large */, true /* zero */,
+                              -1 /* numa node */, true /* exclusive */, &arena_id)) {
+    LOG(ERROR) << "mimalloc did not accept the huge page arena";
+    munmap(ptr, size);
+    return res;
+  }
+
+  res.mode_ = mode;
+  res.start_ = reinterpret_cast<uintptr_t>(ptr);
+  res.size_ = size;
+  res.arena_id_ = arena_id;
+  return res;
+}
+
+mi_heap_t* HugePageArena::NewHeap() const {
+  return mode_ == OFF ? nullptr : mi_heap_new_in_arena(arena_id_);
+}
+
+vector<HugePageArena::Usage> HugePageArena::ReadUsage(const vector<HugePageArena>& arenas) {
+  vector<pair<uintptr_t, size_t>> ranges;
+  for (const HugePageArena& arena : arenas)
+    ranges.emplace_back(arena.start(), arena.size());
+
+  ifstream is("/proc/self/smaps");
+  return ParseSmaps(is, ranges);
+}
+
+auto HugePageArena::ParseSmaps(istream& is, const vector<pair<uintptr_t, size_t>>& ranges)
+    -> vector<Usage> {
+  vector<Usage> res(ranges.size());
+
+  // The overlap of the current mapping with every range, as a fraction of the mapping.
+  vector<double> overlap(ranges.size(), 0);
+  bool overlaps = false;
+
+  string line;
+  while (getline(is, line)) {
+    string_view sv = line;
+    pair<string_view, string_view> kv = absl::StrSplit(sv, absl::MaxSplits(':', 1));
+
+    if (kv.first.find('-') != string_view::npos && kv.first.find(' ') != string_view::npos) {
+      // The header of a mapping: "<start>-<end> <perms> ...".
+      string_view range = sv.substr(0, sv.find(' '));
+      pair<string_view, string_view> bounds = absl::StrSplit(range, absl::MaxSplits('-', 1));
+      uint64_t start, end;
+      overlaps = false;
+      if (!absl::SimpleHexAtoi(bounds.first, &start) ||
+          !absl::SimpleHexAtoi(bounds.second, &end) || end <= start) {
+        continue;
+      }
+
+      for (size_t i = 0; i < ranges.size(); ++i) {
+        uint64_t from = max<uint64_t>(start, ranges[i].first);
+        uint64_t to = min<uint64_t>(end, ranges[i].first + ranges[i].second);
+        overlap[i] = from < to ? double(to - from) / (end - start) : 0;
+        overlaps |= from < to;
+      }
+      continue;
+    }
+
+    if (!overlaps)
+      continue;
+
+    bool huge = kv.first == "AnonHugePages" || kv.first == "Private_Hugetlb" ||
+                kv.first == "Shared_Hugetlb";
+    bool resident = huge ? kv.first != "AnonHugePages" : kv.first == "Rss";
+    if (!huge && !resident)
+      continue;
+
+    // "<value> kB"
+    size_t kb;
+    if (!absl::SimpleAtoi(absl::StripSuffix(absl::StripAsciiWhitespace(kv.second), " kB"), &kb))
+      continue;
+
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      size_t bytes = size_t(overlap[i] * kb * 1024);
+      if (huge)
+        res[i].huge += bytes;
+      if (resident)
+        res[i].resident += bytes;
+    }
+  }
+
+  return res;
+}
+
+}  // namespace dfly
@@ -0,0 +1,78 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <utility>
+#include <vector>
+
+typedef struct mi_heap_s mi_heap_t;
+
+namespace dfly {
+
+// An exclusive mimalloc arena of huge pages for the data heap of a shard, which holds its
+// DashTable segments and values, see --shard_huge_pages. The heaps of the connections and the
+// other allocations stay on small pages. The arena is pinned: mimalloc never returns its pages
+// to the OS, so that the kernel does not split them, and it is never unmapped.
+class HugePageArena {
+ public:
+  enum Mode : uint8_t {
+    OFF,
+    MADVISE,  // transparent huge pages of a region marked with MADV_HUGEPAGE.
+    HUGETLB,  // pages of the hugetlb pool, reserved for the whole arena when it is mapped.
+  };
+
+  static constexpr size_t kPageSize = 2 << 20;
+
+  // The mode of --shard_huge_pages, OFF if it is invalid.
+  static Mode ConfiguredMode();
+  static const char* ModeName(Mode mode);
+
+  // Maps an arena of at least size bytes and registers it with mimalloc. HUGETLB falls back to
+  // MADVISE if the hugetlb pool is too small. Returns an OFF arena if the region can not be
+  // mapped.
+  static HugePageArena Map(Mode mode, size_t size);
+
+  // A heap that allocates only from the arena, nullptr for an OFF arena. mimalloc fails the
+  // allocations of the heap once the arena is full.
+  mi_heap_t* NewHeap() const;
+
+  Mode mode() const {
+    return mode_;
+  }
+
+  uintptr_t start() const {
+    return start_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  // The resident bytes of an arena and those of them on huge pages.
+  struct Usage {
+    size_t resident = 0;
+    size_t huge = 0;
+  };
+
+  // Reads the usage of the arenas from /proc/self/smaps.
+  static std::vector<Usage> ReadUsage(const std::vector<HugePageArena>& arenas);
+
+  // Parses the smaps of the process into the usage of the ranges of memory, given by their
+  // start and size. A mapping that the kernel merged with its neighbours is attributed in
+  // proportion to its overlap with each range.
+  static std::vector<Usage> ParseSmaps(std::istream& is,
+                                       const std::vector<std::pair<uintptr_t, size_t>>& ranges);
+
+ private:
+  Mode mode_ = OFF;
+  uintptr_t start_ = 0;
+  size_t size_ = 0;
+  int arena_id_ = 0;  // mi_arena_id_t
+};
+
+}  // namespace dfly
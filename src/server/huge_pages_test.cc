@@ -0,0 +1,85 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/huge_pages.h"
+
+#include <mimalloc.h>
+
+#include <sstream>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace testing;
+using namespace std;
+
+namespace dfly {
+
+class HugePagesTest : public testing::Test {};
+
+TEST_F(HugePagesTest, ParseSmaps) {
+  // A THP arena split into two mappings, a hugetlb arena and an unrelated mapping.
+  istringstream is(R"(7f0000000000-7f0000400000 rw-p 00000000 00:00 0
+Size:               4096 kB
+Rss:                3072 kB
+AnonHugePages:      2048 kB
+VmFlags: rd wr mr mw me ac hg
+7f0000400000-7f0000800000 rw-p 00000000 00:00 0
+Rss:                1024 kB
+AnonHugePages:         0 kB
+7f1000000000-7f1000400000 rw-p 00000000 00:00 0
+Rss:                   0 kB
+Private_Hugetlb:    4096 kB
+5600000000-5600100000 r-xp 00000000 08:01 1234 /usr/bin/dragonfly
+Rss:                1024 kB
+AnonHugePages:      1024 kB
+)");
+
+  vector<HugePageArena::Usage> usage =
+      HugePageArena::ParseSmaps(is, {{0x7f0000000000, 8 << 20}, {0x7f1000000000, 4 << 20}});
+  ASSERT_EQ(2, usage.size());
+  EXPECT_EQ(4 << 20, usage[0].resident);
+  EXPECT_EQ(2 << 20, usage[0].huge);
+  EXPECT_EQ(4 << 20, usage[1].resident);
+  EXPECT_EQ(4 << 20, usage[1].huge);
+}
+
+TEST_F(HugePagesTest, MergedMapping) {
+  // Two arenas of 4MB that the kernel merged into a single mapping.
+  istringstream is(R"(7f0000000000-7f0000800000 rw-p 00000000 00:00 0
+Rss:                8192 kB
+AnonHugePages:      4096 kB
+)");
+
+  vector<HugePageArena::Usage> usage =
+      HugePageArena::ParseSmaps(is, {{0x7f0000000000, 4 << 20}, {0x7f0000400000, 4 << 20}});
+  ASSERT_EQ(2, usage.size());
+  EXPECT_EQ(4 << 20, usage[0].resident);
+  EXPECT_EQ(2 << 20, usage[0].huge);
+  EXPECT_EQ(usage[0].resident, usage[1].resident);
+}
+
+TEST_F(HugePagesTest, Arena) {
+  EXPECT_EQ(HugePageArena::OFF, HugePageArena::Map(HugePageArena::OFF, 1 << 30).mode());
+
+  HugePageArena arena = HugePageArena::Map(HugePageArena::MADVISE, 64 << 20);
+  ASSERT_EQ(HugePageArena::MADVISE, arena.mode());
+  EXPECT_EQ(0, arena.start() % HugePageArena::kPageSize);
+  EXPECT_EQ(64 << 20, arena.size());
+
+  mi_heap_t* heap = arena.NewHeap();
+  ASSERT_TRUE(heap);
+  void* ptr = mi_heap_malloc(heap, 1024);
+  uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+  EXPECT_GE(addr, arena.start());
+  EXPECT_LT(addr, arena.start() + arena.size());
+
+  vector<HugePageArena::Usage> usage = HugePageArena::ReadUsage({arena});
+  ASSERT_EQ(1, usage.size());
+  EXPECT_GT(usage[0].resident, 0);
+  mi_free(ptr);
+  mi_heap_delete(heap);
+}
+
+}  // namespace dfly
@@ -5,6 +5,7 @@
 #include "server/io_mgr.h"
 
 #include <fcntl.h>
+#include <liburing.h>
 #include <mimalloc.h>
 
 #include "base/flags.h"
@@ -13,6 +14,9 @@
 #include "util/uring/proactor.h"
 
 ABSL_FLAG(bool, backing_file_direct, false, "If true uses O_DIRECT to open backing files");
+ABSL_FLAG(uint32_t, backing_file_fixed_buffers, 64,
+          "Number of 4KB buffers per shard that are registered with io_uring for the tiered "
+          "storage IO. 0 disables the buffer registration");
 
 namespace dfly {
 
@@ -29,6 +33,20 @@ constexpr inline size_t alignup(size_t num, size_t align) {
   return (num + amask) & (~amask);
 }
 
+// Switches the prepared read or write to the registered file and buffer, if there are any.
+void UseRegistered(uring::SubmitEntry* se, uint8_t fixed_opcode, int fixed_fd, int buf_index) {
+  io_uring_sqe* sqe = se->sqe();
+  if (buf_index >= 0) {
+    sqe->opcode = fixed_opcode;
+    sqe->buf_index = buf_index;
+  }
+
+  if (fixed_fd >= 0) {
+    sqe->fd = fixed_fd;
+    sqe->flags |= IOSQE_FIXED_FILE;
+  }
+}
+
 }  // namespace
 
 IoMgr::IoMgr() {
@@ -66,9 +84,70 @@ error_code IoMgr::Open(const string& path) {
     }
   }
   sz_ = kInitialSize;
+  RegisterWithRing();
+
   return error_code{};
 }
 
+void IoMgr::RegisterWithRing() {
+  Proactor* proactor = (Proactor*)ProactorBase::me();
+  io_uring* ring = &proactor->ring();
+
+  int fd = backing_file_->fd();
+  int res = io_uring_register_files(ring, &fd, 1);
+  if (res < 0) {
+    LOG(WARNING) << "Could not register the backing file with io_uring: "
+                 << detail::SafeErrorMessage(-res);
+  } else {
+    fixed_fd_ = 0;
+  }
+
+  unsigned num_bufs = absl::GetFlag(FLAGS_backing_file_fixed_buffers);
+  if (num_bufs == 0)
+    return;
+
+  // One contiguous region, so that all the buffers share the registered index 0.
+  size_t pool_size = num_bufs * kBufferSize;
+  char* pool = (char*)mi_malloc_aligned(pool_size, 4096);
+  iovec v{.iov_base = pool, .iov_len = pool_size};
+  res = io_uring_register_buffers(ring, &v, 1);
+  if (res < 0) {
+    LOG(WARNING) << "Could not register io buffers: " << detail::SafeErrorMessage(-res);
+    mi_free(pool);
+    return;
+  }
+
+  buf_pool_ = pool;
+  buf_pool_size_ = pool_size;
+  for (unsigned i = 0; i < num_bufs; ++i) {
+    free_bufs_.push_back(pool + i * kBufferSize);
+  }
+}
+
+char* IoMgr::AllocBuffer(size_t len) {
+  if (len > kBufferSize || free_bufs_.empty())
+    return (char*)mi_malloc_aligned(len, 4096);
+
+  char* res = free_bufs_.back();
+  free_bufs_.pop_back();
+  return res;
+}
+
+void IoMgr::FreeBuffer(char* buf, size_t len) {
+  if (FixedBufferIndex(buf, len) >= 0) {
+    free_bufs_.push_back(buf);
+  } else {
+    mi_free_size_aligned(buf, len, 4096);
+  }
+}
+
+int IoMgr::FixedBufferIndex(const void* buf, size_t len) const {
+  const char* ptr = reinterpret_cast<const char*>(buf);
+  if (ptr >= buf_pool_ && ptr + len <= buf_pool_ + buf_pool_size_)
+    return 0;
+  return -1;
+}
+
 error_code IoMgr::GrowAsync(size_t len, GrowCb cb) {
   DCHECK_EQ(0u, len % (1 << 20));
 
@@ -98,16 +177,69 @@ error_code IoMgr::WriteAsync(size_t offset, string_view blob, WriteCb cb) {
 
   Proactor* proactor = (Proactor*)ProactorBase::me();
 
-  auto ring_cb = [cb = move(cb)](Proactor::IoResult res, uint32_t flags, int64_t payload) {
+  auto ring_cb = [this, start = ProactorBase::GetMonotonicTimeNs(), cb = move(cb)](
+                     Proactor::IoResult res, uint32_t flags, int64_t payload) {
+    FinishIo(start);
     cb(res);
   };
 
+  ++pending_ios_;
   uring::SubmitEntry se = proactor->GetSubmitEntry(move(ring_cb), 0);
   se.PrepWrite(backing_file_->fd(), blob.data(), blob.size(), offset);
+  UseRegistered(&se, IORING_OP_WRITE_FIXED, fixed_fd_,
+                FixedBufferIndex(blob.data(), blob.size()));
 
   return error_code{};
 }
 
+error_code IoMgr::ReadAsync(size_t offset, io::MutableBytes dest, ReadCb cb) {
+  DCHECK(!dest.empty());
+  VLOG(1) << "ReadAsync " << offset << "/" << dest.size();
+
+  Proactor* proactor = (Proactor*)ProactorBase::me();
+
+  // With O_DIRECT we read the aligned range that covers dest into a bounce buffer,
+  // taken from the registered pool when it fits.
+  uint8_t* space = nullptr;
+  size_t read_offs = offset;
+  size_t space_needed = dest.size();
+  if (absl::GetFlag(FLAGS_backing_file_direct)) {
+    read_offs = offset & ~4095ULL;
+    space_needed = alignup(offset + dest.size(), 4096) - read_offs;
+    space = (uint8_t*)AllocBuffer(space_needed);
+  }
+
+  auto ring_cb = [this, dest, space, space_needed, skip = offset - read_offs,
+                  start = ProactorBase::GetMonotonicTimeNs(),
+                  cb = move(cb)](Proactor::IoResult res, uint32_t flags, int64_t payload) {
+    FinishIo(start);
+    if (res >= 0 && size_t(res) < space_needed) {  // the range is beyond the end of file.
+      res = -EIO;
+    }
+
+    if (space) {
+      if (res >= 0)
+        memcpy(dest.data(), space + skip, dest.size());
+      FreeBuffer((char*)space, space_needed);
+    }
+    cb(res);
+  };
+
+  ++pending_ios_;
+  uint8_t* read_dest = space ? space : dest.data();
+  uring::SubmitEntry se = proactor->GetSubmitEntry(move(ring_cb), 0);
+  se.PrepRead(backing_file_->fd(), read_dest, space_needed, read_offs);
+  UseRegistered(&se, IORING_OP_READ_FIXED, fixed_fd_, FixedBufferIndex(read_dest, space_needed));
+
+  return error_code{};
+}
+
+void IoMgr::FinishIo(uint64_t start_ns) {
+  --pending_ios_;
+  ++stats_.ios;
+  stats_.latency_usec += (ProactorBase::GetMonotonicTimeNs() - start_ns) / 1000;
+}
+
 error_code IoMgr::Read(size_t offset, io::MutableBytes dest) {
   DCHECK(!dest.empty());
 
@@ -134,10 +266,31 @@ error_code IoMgr::Read(size_t offset, io::MutableBytes dest) {
   return backing_file_->Read(&v, 1, offset, 0);
 }
 
+error_code IoMgr::PunchHole(size_t offset, size_t len) {
+  constexpr int kMode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+  int res = fallocate(backing_file_->fd(), kMode, offset, len);
+  if (res < 0)
+    return error_code{errno, system_category()};
+  return error_code{};
+}
+
 void IoMgr::Shutdown() {
-  while (flags_val) {
+  while (flags_val || pending_ios_) {
     fibers_ext::SleepFor(200us);  // TODO: hacky for now.
   }
+
+  io_uring* ring = &((Proactor*)ProactorBase::me())->ring();
+  if (buf_pool_) {
+    io_uring_unregister_buffers(ring);
+    mi_free(buf_pool_);
+    buf_pool_ = nullptr;
+    free_bufs_.clear();
+  }
+
+  if (fixed_fd_ >= 0) {
+    io_uring_unregister_files(ring);
+    fixed_fd_ = -1;
+  }
 }
 
 }  // namespace dfly
@@ -6,6 +6,7 @@
 
 #include <functional>
 #include <string>
+#include <vector>
 
 #include "util/uring/uring_file.h"
 
@@ -20,6 +21,9 @@ class IoMgr {
   // (io_res, )
   using GrowCb = std::function<void(int)>;
 
+  // io_res is negative on error, otherwise the read has filled the whole destination.
+  using ReadCb = std::function<void(int)>;
+
   IoMgr();
 
   // blocks until all the pending requests are finished.
@@ -34,8 +38,24 @@ class IoMgr {
   // Returns error if submission failed. Otherwise - returns the io result
   // via cb. A caller must make sure that the blob exists until cb is called.
   std::error_code WriteAsync(size_t offset, std::string_view blob, WriteCb cb);
+
+  // Same contract as WriteAsync, dest must exist until cb is called.
+  std::error_code ReadAsync(size_t offset, io::MutableBytes dest, ReadCb cb);
   std::error_code Read(size_t offset, io::MutableBytes dest);
 
+  // Releases the storage of the range without changing the file size. Blocks the thread,
+  // so that no IO request to the range can be reordered with it.
+  std::error_code PunchHole(size_t offset, size_t len);
+
+  // Returns a 4KB aligned buffer of len bytes. Buffers of up to kBufferSize bytes are taken
+  // from the pool that is registered with the ring while it lasts. Reads and writes through
+  // the pool buffers use IORING_OP_READ_FIXED/WRITE_FIXED and save mapping the pages
+  // on every request.
+  char* AllocBuffer(size_t len);
+  void FreeBuffer(char* buf, size_t len);
+
+  static constexpr size_t kBufferSize = 4096;
+
   // Total file span
   size_t Span() const {
     return sz_;
@@ -45,10 +65,41 @@ class IoMgr {
     return flags.grow_progress;
   }
 
+  struct Stats {
+    size_t ios = 0;           // completed reads and writes.
+    size_t latency_usec = 0;  // total over the completed ios.
+  };
+
+  const Stats& stats() const {
+    return stats_;
+  }
+
+  // Number of reads and writes in flight.
+  size_t queue_depth() const {
+    return pending_ios_;
+  }
+
  private:
+  void RegisterWithRing();
+  void FinishIo(uint64_t start_ns);
+
+  // Returns the index of the registered buffer that hosts [buf, buf + len), -1 if none.
+  int FixedBufferIndex(const void* buf, size_t len) const;
+
   std::unique_ptr<util::uring::LinuxFile> backing_file_;
   size_t sz_ = 0;
 
+  // When registered, the index of the backing file in the ring's fixed files.
+  int fixed_fd_ = -1;
+
+  // Reads and writes in flight, the pool buffers can not be released before they complete.
+  size_t pending_ios_ = 0;
+  Stats stats_;
+
+  char* buf_pool_ = nullptr;
+  size_t buf_pool_size_ = 0;
+  std::vector<char*> free_bufs_;
+
   union {
     uint8_t flags_val;
     struct {
@@ -0,0 +1,202 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/journal/frame.h"
+
+#include <absl/base/internal/endian.h>
+#include <lz4.h>
+#include <zstd.h>
+
+#include <atomic>
+
+#include "base/logging.h"
+#include "util/fibers/fibers_ext.h"
+
+namespace dfly {
+namespace journal {
+
+using namespace std;
+using namespace util;
+
+namespace {
+
+atomic_uint64_t frames_written{0};
+atomic_uint64_t frame_raw_bytes{0};
+atomic_uint64_t frame_wire_bytes{0};
+
+// Compresses data into dest and returns the compressed size, or 0 if it failed.
+size_t Compress(FrameCodec codec, string_view data, char* dest, size_t capacity) {
+  if (codec == FrameCodec::LZ4) {
+    int res = LZ4_compress_default(data.data(), dest, data.size(), capacity);
+    return res > 0 ? res : 0;
+  }
+
+  DCHECK(codec == FrameCodec::ZSTD);
+  thread_local ZSTD_CCtx* cctx = ZSTD_createCCtx();
+  size_t res = ZSTD_compressCCtx(cctx, dest, capacity, data.data(), data.size(), 1);
+  return ZSTD_isError(res) ? 0 : res;
+}
+
+size_t CompressBound(FrameCodec codec, size_t len) {
+  return codec == FrameCodec::LZ4 ? LZ4_compressBound(len) : ZSTD_compressBound(len);
+}
+
+// The largest size that a payload of the codec decodes to. An LZ4 sequence encodes at most 255
+// bytes of a match per byte, and a ZSTD block of a repeated byte takes 4 bytes for up to 128KB.
+size_t MaxDecodedLen(FrameCodec codec, size_t payload_len) {
+  constexpr size_t kLz4MaxRatio = 255, kZstdMaxRatio = 1 << 15;
+  switch (codec) {
+    case FrameCodec::NONE:
+      return payload_len;
+    case FrameCodec::LZ4:
+      return payload_len * kLz4MaxRatio;
+    case FrameCodec::ZSTD:
+      return payload_len * kZstdMaxRatio;
+  }
+  return 0;
+}
+
+}  // namespace
+
+void EncodeFrame(FrameCodec codec, string_view data, string* dest) {
+  size_t start = dest->size();
+  size_t payload_len = 0;
+  if (codec != FrameCodec::NONE) {
+    dest->resize(start + kFrameHeaderSize + CompressBound(codec, data.size()));
+    payload_len = Compress(codec, data, dest->data() + start + kFrameHeaderSize,
+                           dest->size() - start - kFrameHeaderSize);
+  }
+
+  if (payload_len == 0 || payload_len >= data.size()) {
+    codec = FrameCodec::NONE;
+    payload_len = data.size();
+    dest->resize(start + kFrameHeaderSize);
+    dest->append(data);
+  } else {
+    dest->resize(start + kFrameHeaderSize + payload_len);
+  }
+
+  char* header = dest->data() + start;
+  header[0] = char(codec);
+  absl::little_endian::Store32(header + 1, payload_len);
+  absl::little_endian::Store32(header + 5, data.size());
+}
+
+bool ParseFrame(string_view src, FrameCodec* codec, string_view* payload, size_t* raw_len,
+                size_t* frame_len) {
+  if (src.size() < kFrameHeaderSize)
+    return false;
+
+  size_t payload_len = absl::little_endian::Load32(src.data() + 1);
+  *frame_len = kFrameHeaderSize + payload_len;
+  if (src.size() < *frame_len)
+    return false;
+
+  *codec = FrameCodec(src[0]);
+  *payload = src.substr(kFrameHeaderSize, payload_len);
+  *raw_len = absl::little_endian::Load32(src.data() + 5);
+  return true;
+}
+
+bool DecodeFrame(FrameCodec codec, string_view payload, size_t raw_len, string* dest) {
+  if (codec == FrameCodec::NONE) {
+    if (payload.size() != raw_len)
+      return false;
+    dest->append(payload);
+    return true;
+  }
+
+  // The decoded length of a corrupted header must not allocate more than the payload can hold.
+  if (raw_len > MaxDecodedLen(codec, payload.size()))
+    return false;
+
+  size_t start = dest->size();
+  dest->resize(start + raw_len);
+  char* out = dest->data() + start;
+  size_t res = 0;
+  if (codec == FrameCodec::LZ4) {
+    int len = LZ4_decompress_safe(payload.data(), out, payload.size(), raw_len);
+    res = len < 0 ? SIZE_MAX : len;
+  } else if (codec == FrameCodec::ZSTD) {
+    thread_local ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    res = ZSTD_decompressDCtx(dctx, out, raw_len, payload.data(), payload.size());
+    if (ZSTD_isError(res))
+      res = SIZE_MAX;
+  } else {
+    res = SIZE_MAX;
+  }
+
+  return res == raw_len;
+}
+
+FrameStats GetFrameStats() {
+  FrameStats res;
+  res.frames = frames_written.load(memory_order_relaxed);
+  res.raw_bytes = frame_raw_bytes.load(memory_order_relaxed);
+  res.wire_bytes = frame_wire_bytes.load(memory_order_relaxed);
+  return res;
+}
+
+FrameWriter::FrameWriter(io::Sink* sink, FrameCodec codec, size_t frame_size, uint32_t delay_us)
+    : sink_(sink), codec_(codec), frame_size_(frame_size), delay_us_(delay_us) {
+  flush_fb_ = ::boost::fibers::fiber(&FrameWriter::FlushFb, this);
+}
+
+FrameWriter::~FrameWriter() {
+  Stop();
+}
+
+void FrameWriter::Write(string_view data) {
+  bool notify = pending_.empty();
+  pending_.append(data);
+
+  if (pending_.size() >= frame_size_)
+    Flush();
+  else if (notify)
+    pending_ec_.notify();
+}
+
+void FrameWriter::Flush() {
+  lock_guard lk(mu_);
+
+  // Another flush could have taken the data while we waited for the lock.
+  if (pending_.empty() || ec_)
+    return;
+
+  frame_.clear();
+  EncodeFrame(codec_, pending_, &frame_);
+  frames_written.fetch_add(1, memory_order_relaxed);
+  frame_raw_bytes.fetch_add(pending_.size(), memory_order_relaxed);
+  frame_wire_bytes.fetch_add(frame_.size(), memory_order_relaxed);
+  pending_.clear();
+
+  ec_ = sink_->Write(io::Buffer(frame_));
+  VLOG_IF(1, ec_) << "Could not write journal frame " << ec_.message();
+}
+
+void FrameWriter::Stop() {
+  if (!flush_fb_.joinable())
+    return;
+
+  stopped_ = true;
+  pending_ec_.notify();
+  flush_fb_.join();
+  pending_.clear();
+}
+
+void FrameWriter::FlushFb() {
+  while (true) {
+    pending_ec_.await([this] { return stopped_ || !pending_.empty(); });
+    if (stopped_)
+      break;
+
+    fibers_ext::SleepFor(chrono::microseconds(delay_us_));
+    if (stopped_)
+      break;
+    Flush();
+  }
+}
+
+}  // namespace journal
+}  // namespace dfly
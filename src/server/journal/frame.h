@@ -0,0 +1,87 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <boost/fiber/fiber.hpp>
+#include <boost/fiber/mutex.hpp>
+#include <string>
+#include <string_view>
+
+#include "io/io.h"
+#include "util/fibers/event_count.h"
+
+namespace dfly {
+namespace journal {
+
+// The stable sync stream of a flow is a sequence of frames, each holding a batch of the
+// RespWriter output: u8 codec | u32 payload length | u32 decoded length | payload.
+// The lengths are little endian.
+enum class FrameCodec : uint8_t { NONE = 0, LZ4 = 1, ZSTD = 2 };
+
+constexpr size_t kFrameHeaderSize = 9;
+
+struct FrameStats {
+  uint64_t frames = 0;
+  uint64_t raw_bytes = 0;   // of the decoded frames.
+  uint64_t wire_bytes = 0;  // of the frames, headers included.
+};
+
+// Appends the frame of data to dest. The frame falls back to NONE if the codec does not
+// make it smaller.
+void EncodeFrame(FrameCodec codec, std::string_view data, std::string* dest);
+
+// Parses the frame at the start of src. Returns false if src holds no complete frame, frame_len
+// is set to the total size of the frame once src holds its header.
+bool ParseFrame(std::string_view src, FrameCodec* codec, std::string_view* payload,
+                size_t* raw_len, size_t* frame_len);
+
+// Appends the decoded payload to dest. Returns false if the payload is corrupted.
+bool DecodeFrame(FrameCodec codec, std::string_view payload, size_t raw_len, std::string* dest);
+
+// Totals of the frames written by all the FrameWriters of the process.
+FrameStats GetFrameStats();
+
+// Batches the stream of a flow into frames. A frame is written once it reaches frame_size,
+// or by a background fiber once its first data waited for delay_us, so that a quiet stream
+// is not delayed for long. Must be used from the thread that created it.
+class FrameWriter {
+ public:
+  FrameWriter(io::Sink* sink, FrameCodec codec, size_t frame_size, uint32_t delay_us);
+  ~FrameWriter();
+
+  // Writes synchronously if the pending frame is full, which keeps the backpressure of the sink
+  // on the caller.
+  void Write(std::string_view data);
+
+  // Writes the pending frame.
+  void Flush();
+
+  // Stops the background fiber, the pending data is dropped.
+  void Stop();
+
+  std::error_code error() const {
+    return ec_;
+  }
+
+ private:
+  void FlushFb();
+
+  io::Sink* sink_;
+  FrameCodec codec_;
+  size_t frame_size_;
+  uint32_t delay_us_;
+
+  std::string pending_, frame_;
+  std::error_code ec_;
+  bool stopped_ = false;
+
+  // Serializes the writes of the frames, which preserves their order.
+  ::boost::fibers::mutex mu_;
+  util::fibers_ext::EventCount pending_ec_;
+  ::boost::fibers::fiber flush_fb_;
+};
+
+}  // namespace journal
+}  // namespace dfly
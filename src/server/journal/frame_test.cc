@@ -0,0 +1,116 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/journal/frame.h"
+
+#include <absl/base/internal/endian.h>
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace testing;
+using namespace std;
+
+namespace dfly {
+namespace journal {
+
+class FrameTest : public testing::TestWithParam<FrameCodec> {
+ protected:
+  // A stream of commands, which compresses well.
+  static string Commands(unsigned count) {
+    string res;
+    for (unsigned i = 0; i < count; ++i) {
+      absl::StrAppend(&res, "*3\r\n$3\r\nSET\r\n$", absl::StrCat(i).size(), "\r\n", i,
+                      "\r\n$5\r\nvalue\r\n");
+    }
+    return res;
+  }
+
+  // Parses and decodes the frame at the start of src into *dest.
+  static bool Decode(string_view src, string* dest, size_t* frame_len) {
+    FrameCodec codec;
+    string_view payload;
+    size_t raw_len = 0;
+    return ParseFrame(src, &codec, &payload, &raw_len, frame_len) &&
+           DecodeFrame(codec, payload, raw_len, dest);
+  }
+};
+
+TEST_P(FrameTest, RoundTrip) {
+  string data = Commands(1000), frames;
+  EncodeFrame(GetParam(), data, &frames);
+  EncodeFrame(GetParam(), "", &frames);
+  EncodeFrame(GetParam(), "*1\r\n$4\r\nPING\r\n", &frames);
+
+  if (GetParam() != FrameCodec::NONE) {
+    EXPECT_EQ(GetParam(), FrameCodec(frames[0]));
+    EXPECT_LT(frames.size(), data.size());
+  }
+
+  string decoded;
+  size_t frame_len = 0;
+  string_view src = frames;
+  for (unsigned i = 0; i < 3; ++i) {
+    ASSERT_TRUE(Decode(src, &decoded, &frame_len)) << i;
+    src.remove_prefix(frame_len);
+  }
+  EXPECT_TRUE(src.empty());
+  EXPECT_EQ(data + "*1\r\n$4\r\nPING\r\n", decoded);
+}
+
+TEST_P(FrameTest, Truncated) {
+  string frame;
+  EncodeFrame(GetParam(), Commands(100), &frame);
+
+  FrameCodec codec;
+  string_view payload;
+  size_t raw_len = 0, frame_len = 0;
+  EXPECT_FALSE(ParseFrame(string_view{frame}.substr(0, kFrameHeaderSize - 1), &codec, &payload,
+                          &raw_len, &frame_len));
+
+  // Once the header arrived, the frame length tells how much to wait for.
+  EXPECT_FALSE(ParseFrame(string_view{frame}.substr(0, frame.size() - 1), &codec, &payload,
+                          &raw_len, &frame_len));
+  EXPECT_EQ(frame.size(), frame_len);
+  EXPECT_TRUE(ParseFrame(frame, &codec, &payload, &raw_len, &frame_len));
+}
+
+TEST_P(FrameTest, Corrupted) {
+  string frame, decoded;
+  size_t frame_len = 0;
+  EncodeFrame(GetParam(), Commands(100), &frame);
+
+  // A payload that lost its end.
+  string bad = frame.substr(0, frame.size() - 3);
+  absl::little_endian::Store32(bad.data() + 1, bad.size() - kFrameHeaderSize);
+  EXPECT_FALSE(Decode(bad, &decoded, &frame_len));
+
+  // A wrong decoded length.
+  bad = frame;
+  absl::little_endian::Store32(bad.data() + 5, absl::little_endian::Load32(bad.data() + 5) - 1);
+  EXPECT_FALSE(Decode(bad, &decoded, &frame_len));
+
+  // A decoded length that the payload can not hold is not allocated.
+  bad = frame;
+  absl::little_endian::Store32(bad.data() + 5, UINT32_MAX);
+  EXPECT_FALSE(Decode(bad, &decoded, &frame_len));
+  EXPECT_LT(decoded.capacity(), UINT32_MAX);
+}
+
+TEST_P(FrameTest, BadCodec) {
+  string frame, decoded;
+  size_t frame_len = 0;
+  EncodeFrame(GetParam(), Commands(100), &frame);
+
+  frame[0] = 7;
+  EXPECT_FALSE(Decode(frame, &decoded, &frame_len));
+  EXPECT_TRUE(decoded.empty());
+}
+
+INSTANTIATE_TEST_SUITE_P(Codecs, FrameTest,
+                         Values(FrameCodec::NONE, FrameCodec::LZ4, FrameCodec::ZSTD));
+
+}  // namespace journal
+}  // namespace dfly
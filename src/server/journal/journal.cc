@@ -4,6 +4,12 @@
 
 #include "server/journal/journal.h"
 
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_join.h>
+#include <absl/strings/str_split.h>
+#include <absl/time/clock.h>
+
 #include <filesystem>
 
 #include "base/logging.h"
@@ -26,16 +32,20 @@ thread_local JournalSlice journal_slice;
 
 }  // namespace
 
-Journal::Journal() {
+Journal::Journal(unsigned thread_count)
+    : session_(absl::GetCurrentTimeNanos() / 1000000), slices_(thread_count) {
 }
 
 error_code Journal::OpenInThread(bool persistent, string_view dir) {
-  journal_slice.Init(unsigned(ProactorBase::GetIndex()));
+  unsigned index = ProactorBase::GetIndex();
+  journal_slice.Init(index);
+  DCHECK_LT(index, slices_.size());
+  slices_[index].store(&journal_slice, memory_order_release);
 
   error_code ec;
 
   if (persistent) {
-    ec = journal_slice.Open(dir);
+    ec = journal_slice.Open(dir, session_);
     if (ec) {
       return ec;
     }
@@ -101,6 +111,10 @@ LSN Journal::GetLsn() const {
   return journal_slice.cur_lsn();
 }
 
+bool Journal::IsPersistent() const {
+  return journal_slice.IsOpen() && !journal_slice.status();
+}
+
 bool Journal::EnterLameDuck() {
   if (!journal_slice.IsOpen()) {
     return false;
@@ -115,6 +129,88 @@ void Journal::RecordEntry(const Entry& entry) {
   journal_slice.AddLogRecord(entry);
 }
 
+void Journal::AwaitSynced(unsigned thread_index, LSN lsn) {
+  if (JournalSlice* slice = slices_[thread_index].load(memory_order_acquire); slice)
+    slice->AwaitSynced(lsn);
+}
+
+bool Journal::HasBacklog(LSN lsn) const {
+  return journal_slice.HasBacklog(lsn);
+}
+
+bool Journal::ReadBacklog(LSN lsn, RespWriter* writer, string* dest) const {
+  return journal_slice.ReadBacklog(lsn, writer, dest);
+}
+
+string Position::Format() const {
+  return absl::StrCat(session, ":", absl::StrJoin(lsns, ","));
+}
+
+optional<Position> Position::Parse(string_view src) {
+  size_t pos = src.find(':');
+  Position res;
+  if (pos == string_view::npos || !absl::SimpleAtoi(src.substr(0, pos), &res.session))
+    return nullopt;
+
+  for (string_view lsn : absl::StrSplit(src.substr(pos + 1), ',')) {
+    if (!absl::SimpleAtoi(lsn, &res.lsns.emplace_back()))
+      return nullopt;
+  }
+  return res;
+}
+
+void Position::Merge(const Position& o) {
+  // A session starts after the ones before it.
+  if (o.session != session) {
+    if (o.session > session)
+      *this = o;
+    return;
+  }
+
+  if (lsns.size() < o.lsns.size())
+    lsns.resize(o.lsns.size());
+  for (size_t i = 0; i < o.lsns.size(); ++i)
+    lsns[i] = max(lsns[i], o.lsns[i]);
+}
+
+void RespWriter::AppendLsn(string* dest) {
+  string lsn = absl::StrCat(next_lsn_);
+  AppendCommand({"DFLY", "LSN", lsn}, dest);
+}
+
+void RespWriter::Append(LSN lsn, DbIndex db_index, TxId txid, const Barrier& barrier,
+                        string_view cmd, string* dest) {
+  if (lsn != next_lsn_) {
+    next_lsn_ = lsn;
+    AppendLsn(dest);
+  }
+
+  if (db_index != db_index_) {
+    string db_str = absl::StrCat(db_index);
+    AppendCommand({"SELECT", db_str}, dest);
+    db_index_ = db_index;
+  }
+
+  if (barrier.shard_cnt > 1) {
+    string txid_str = absl::StrCat(txid), seq_str = absl::StrCat(barrier.seq);
+    string cnt_str = absl::StrCat(barrier.shard_cnt);
+    if (cmd.empty())
+      AppendCommand({"DFLY", "BARRIER", txid_str, seq_str, cnt_str}, dest);
+    else
+      AppendCommand({"DFLY", "BARRIER", txid_str, seq_str, cnt_str, "EXEC"}, dest);
+  }
+
+  dest->append(cmd);
+  next_lsn_ = lsn + 1;
+}
+
+void RespWriter::AppendCommand(ArgSlice cmd, string* dest) {
+  absl::StrAppend(dest, "*", cmd.size(), "\r\n");
+  for (string_view arg : cmd) {
+    absl::StrAppend(dest, "$", arg.size(), "\r\n", arg, "\r\n");
+  }
+}
+
 /*
 void Journal::OpArgs(TxId txid, Op opcode, Span keys) {
   DCHECK(journal_slice.IsOpen());
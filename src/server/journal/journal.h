@@ -13,12 +13,19 @@ class Transaction;
 
 namespace journal {
 
+class JournalSlice;
 
 class Journal {
  public:
   using Span = absl::Span<const std::string_view>;
 
-  Journal();
+  explicit Journal(unsigned thread_count);
+
+  // Tells apart the files of the journals of the processes that write into the same directory,
+  // the LSNs of every process start from 1. The time when the journal was created, in ms.
+  uint64_t session() const {
+    return session_;
+  }
 
   // Returns true if journal has been active and changed its state to lameduck mode
   // and false otherwise.
@@ -55,12 +62,31 @@ class Journal {
 */
   LSN GetLsn() const;
 
+  // Whether the records of the thread are written into the files, see DFLY JOURNAL START.
+  bool IsPersistent() const;
+
   void RecordEntry(const Entry& entry);
 
+  // Waits until the records of the thread before lsn reach the disk, see
+  // JournalSlice::AwaitSynced. Can be called from any thread.
+  void AwaitSynced(unsigned thread_index, LSN lsn);
+
+  // Whether the backlog holds all the records with commands starting from lsn.
+  bool HasBacklog(LSN lsn) const;
+
+  // Appends the commands of the backlog starting from lsn to dest. Returns false if the backlog
+  // does not hold all of them anymore.
+  bool ReadBacklog(LSN lsn, RespWriter* writer, std::string* dest) const;
+
  private:
 
   mutable boost::fibers::mutex state_mu_;
 
+  uint64_t session_;
+
+  // The slices by the index of their threads, set by OpenInThread.
+  std::vector<std::atomic<JournalSlice*>> slices_;
+
   std::atomic_bool lameduck_{false};
 };
 
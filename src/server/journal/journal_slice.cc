@@ -4,14 +4,51 @@
 
 #include "server/journal/journal_slice.h"
 
+#include <absl/base/internal/endian.h>
 #include <absl/container/inlined_vector.h>
+#include <absl/strings/numbers.h>
 #include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <absl/strings/strip.h>
+#include <absl/time/clock.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <filesystem>
 
+extern "C" {
+#include "redis/object.h"
+}
+
+#include "base/flags.h"
 #include "base/logging.h"
+#include "server/error.h"
 #include "util/fibers/fibers_ext.h"
+#include "util/uring/proactor.h"
+
+extern char** environ;
+
+ABSL_FLAG(std::string, journal_fsync, "1000",
+          "When the records of the file-based journal reach the disk: \"always\" - every record "
+          "is synced before its command replies, the records that arrive while a sync runs are "
+          "synced together by the next one, <N> - the records are written and synced "
+          "together every N milliseconds, \"os\" - the records are written every second and the "
+          "OS decides when to sync them");
+ABSL_FLAG(uint64_t, repl_backlog_size, 1 << 20,
+          "The size in bytes of the journal backlog of each shard. A replica that reconnects "
+          "resumes the replication from the backlog if it still holds the records the replica "
+          "missed, otherwise it repeats the full sync. 0 disables the backlog");
+ABSL_FLAG(uint64_t, journal_segment_size, 0,
+          "The size in bytes at which the file-based journal of every thread moves on to a new "
+          "segment. 0 writes a single segment per thread");
+ABSL_FLAG(std::string, journal_archive_cmd, "",
+          "If set, this shell command runs for every finished segment of the file-based journal "
+          "with its path in the DF_JOURNAL_SEGMENT environment variable, e.g. to upload it to "
+          "object storage. The segments of a thread are archived in the background, one after "
+          "another, see DFLY RESTORE");
 
 namespace dfly {
 namespace journal {
@@ -22,41 +59,97 @@ namespace fs = std::filesystem;
 
 namespace {
 
-string ShardName(std::string_view base, unsigned index) {
-  return absl::StrCat(base, "-", absl::Dec(index, absl::kZeroPad4), ".log");
+// Pending records are written early once they reach it.
+constexpr size_t kMaxPendingLen = 1 << 20;
+
+// Parses --journal_fsync into the flush period, see JournalSlice::flush_ms_.
+int32_t ParseFlushMs() {
+  string val = absl::GetFlag(FLAGS_journal_fsync);
+  if (val == "always")
+    return 0;
+  if (val == "os")
+    return -1;
+
+  uint32_t ms = 0;
+  if (!absl::SimpleAtoi(val, &ms) || ms == 0 || ms > INT32_MAX) {
+    LOG(ERROR) << "Invalid journal_fsync " << val << ", syncing every second";
+    ms = 1000;
+  }
+  return ms;
 }
 
-}  // namespace
+template <typename T> void AppendLittle(T val, string* dest) {
+  char buf[sizeof(T)];
+  if constexpr (sizeof(T) == 1) {
+    buf[0] = val;
+  } else if constexpr (sizeof(T) == 2) {
+    absl::little_endian::Store16(buf, val);
+  } else if constexpr (sizeof(T) == 4) {
+    absl::little_endian::Store32(buf, val);
+  } else {
+    absl::little_endian::Store64(buf, val);
+  }
+  dest->append(buf, sizeof(T));
+}
 
-#define CHECK_EC(x)                                                                 \
-  do {                                                                              \
-    auto __ec$ = (x);                                                               \
-    CHECK(!__ec$) << "Error: " << __ec$ << " " << __ec$.message() << " for " << #x; \
-  } while (false)
+// Runs cmd with the path of the segment and waits for it, polling so that the thread is not
+// blocked meanwhile.
+error_code RunArchiveCmd(const string& cmd, const string& path) {
+  string path_env = absl::StrCat("DF_JOURNAL_SEGMENT=", path);
+  vector<char*> envp;
+  for (char** env = environ; *env; ++env) {
+    envp.push_back(*env);
+  }
+  envp.push_back(path_env.data());
+  envp.push_back(nullptr);
+
+  pid_t pid;
+  const char* argv[] = {"/bin/sh", "-c", cmd.c_str(), nullptr};
+  int res = posix_spawn(&pid, argv[0], nullptr, nullptr, const_cast<char**>(argv), envp.data());
+  if (res != 0)
+    return error_code{res, system_category()};
+
+  int status = 0;
+  pid_t wait_res;
+  while ((wait_res = waitpid(pid, &status, WNOHANG)) == 0 || (wait_res < 0 && errno == EINTR)) {
+    fibers_ext::SleepFor(10ms);
+  }
+  if (wait_res < 0)
+    return error_code{errno, system_category()};
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    return make_error_code(errc::io_error);
+  return error_code{};
+}
+
+}  // namespace
 
 struct JournalSlice::RingItem {
   LSN lsn;
   TxId txid;
   Op opcode;
+  DbIndex db_index;
+  Barrier barrier;
+  std::string cmd;  // encoded by RespWriter::AppendCommand.
 };
 
 JournalSlice::JournalSlice() {
 }
 
 JournalSlice::~JournalSlice() {
-  CHECK(!shard_file_);
+  CHECK(!open_);
 }
 
 void JournalSlice::Init(unsigned index) {
-  if (ring_buffer_)  // calling this function multiple times is allowed and it's a no-op.
+  if (slice_index_ != UINT32_MAX)  // calling this function multiple times is allowed.
     return;
 
   slice_index_ = index;
-  ring_buffer_.emplace(128);  // TODO: to make it configurable
+  ring_limit_ = absl::GetFlag(FLAGS_repl_backlog_size);
+  backlog_start_ = lsn_;
 }
 
-std::error_code JournalSlice::Open(std::string_view dir) {
-  CHECK(!shard_file_);
+std::error_code JournalSlice::Open(std::string_view dir, uint64_t session) {
+  CHECK(!open_);
   DCHECK_NE(slice_index_, UINT32_MAX);
 
   fs::path dir_path;
@@ -78,45 +171,156 @@ std::error_code JournalSlice::Open(std::string_view dir) {
     // LOG(INFO) << int(dir_status.type());
   }
 
-  dir_path.append(ShardName("journal", slice_index_));
-  shard_path_ = dir_path;
+  dir_ = dir_path;
+  segment_ = Segment{session, slice_index_, lsn_, 0};
+  segment_size_ = absl::GetFlag(FLAGS_journal_segment_size);
+  RETURN_ON_ERR(OpenSegment());
+  status_ec_.clear();
+  open_ = true;
+
+  if (!absl::GetFlag(FLAGS_journal_archive_cmd).empty()) {
+    archive_done_ = false;
+    archive_fb_ = fibers::fiber([this] { ArchiveFb(); });
+  }
+
+  flush_ms_ = ParseFlushMs();
+  flush_done_ = fibers_ext::Done{};
+  flush_stop_ = false;
+  synced_lsn_.store(lsn_, memory_order_relaxed);
+  group_commit_.store(flush_ms_ == 0, memory_order_release);
+  flush_fb_ = fibers::fiber([this] { FlushFb(); });
+
+  return error_code{};
+}
+
+error_code JournalSlice::Close() {
+  VLOG(1) << "JournalSlice::Close";
+
+  CHECK(open_);
+  lameduck_ = true;
+
+  // The records are not logged until the journal opens again, so the backlog can not resume
+  // the replicas from the current LSN either.
+  ring_buffer_.clear();
+  ring_bytes_ = 0;
+  backlog_start_ = ++lsn_;
+
+  if (flush_fb_.joinable()) {
+    flush_stop_ = true;
+    flush_ec_.notify();
+    flush_done_.Notify();
+    flush_fb_.join();
+  }
+
+  // A failed journal still closes its segment, it holds the records before the failure.
+  error_code ec = Flush(flush_ms_ >= 0);
+  // The last segment covers the skipped LSN as well, so that the segments stay contiguous.
+  if (error_code finish_ec = FinishSegment(lsn_); !ec)
+    ec = finish_ec;
+  open_ = false;
+  group_commit_.store(false, memory_order_release);
+  synced_ec_.notifyAll();
+
+  DVLOG(1) << "Closing " << shard_path_;
+  LOG_IF(ERROR, ec) << "Error closing journal file " << ec;
+
+  // The last segment is archived before the journal closes.
+  if (archive_fb_.joinable()) {
+    archive_done_ = true;
+    archive_ec_.notify();
+    archive_fb_.join();
+  }
+
+  return ec;
+}
+
+io::Result<unique_ptr<uring::LinuxFile>> JournalSlice::OpenSegmentFile(const Segment& segment,
+                                                                       string* path) const {
+  *path = fs::path{dir_}.append(SegmentName(segment));
 
   // For file integrity guidelines see:
   // https://lwn.net/Articles/457667/
   // https://www.evanjones.ca/durability-filesystem.html
   // NOTE: O_DSYNC is omitted.
   constexpr auto kJournalFlags = O_CLOEXEC | O_CREAT | O_TRUNC | O_RDWR;
-  io::Result<std::unique_ptr<uring::LinuxFile>> res =
-      uring::OpenLinux(shard_path_, kJournalFlags, 0666);
+  io::Result<std::unique_ptr<uring::LinuxFile>> res = uring::OpenLinux(*path, kJournalFlags, 0666);
+  VLOG_IF(1, res) << "Opened journal " << *path;
+  return res;
+}
+
+error_code JournalSlice::OpenSegment() {
+  io::Result<std::unique_ptr<uring::LinuxFile>> res = OpenSegmentFile(segment_, &shard_path_);
   if (!res) {
     return res.error();
   }
-  DVLOG(1) << "Opened journal " << shard_path_;
 
   shard_file_ = std::move(res).value();
-  file_offset_ = 0;
-  status_ec_.clear();
-
+  file_offset_ = synced_offset_ = 0;
   return error_code{};
 }
 
-error_code JournalSlice::Close() {
-  VLOG(1) << "JournalSlice::Close";
-
-  CHECK(shard_file_);
-  lameduck_ = true;
+error_code JournalSlice::RotateSegment(LSN end_lsn) {
+  // The next segment opens before the current one is finished. If it can not be opened, the
+  // current segment stays complete and open, and Close finishes it.
+  Segment next = segment_;
+  next.first = end_lsn;
+  string next_path;
+  io::Result<std::unique_ptr<uring::LinuxFile>> res = OpenSegmentFile(next, &next_path);
+  if (!res) {
+    return res.error();
+  }
 
-  auto ec = shard_file_->Close();
+  error_code ec = FinishSegment(end_lsn);
+  segment_ = next;
+  shard_path_ = std::move(next_path);
+  shard_file_ = std::move(res).value();
+  file_offset_ = synced_offset_ = 0;
+  return ec;
+}
 
-  DVLOG(1) << "Closing " << shard_path_;
-  LOG_IF(ERROR, ec) << "Error closing journal file " << ec;
+error_code JournalSlice::FinishSegment(LSN end_lsn) {
+  // The archived segments are complete on the disk.
+  error_code ec;
+  if (file_offset_ != synced_offset_)
+    ec = Sync();
+  if (error_code close_ec = shard_file_->Close(); !ec)
+    ec = close_ec;
   shard_file_.reset();
+  if (ec)
+    return ec;
+
+  Segment finished = segment_;
+  finished.last = end_lsn - 1;
+  fs::path path{dir_};
+  path.append(SegmentName(finished));
+  fs::rename(shard_path_, path, ec);
+  if (ec)
+    return ec;
+
+  if (archive_fb_.joinable()) {
+    archive_queue_.push_back(path);
+    archive_ec_.notify();
+  }
+  return error_code{};
+}
 
-  return ec;
+void JournalSlice::ArchiveFb() {
+  string cmd = absl::GetFlag(FLAGS_journal_archive_cmd);
+  while (true) {
+    archive_ec_.await([this] { return archive_done_ || !archive_queue_.empty(); });
+    if (archive_queue_.empty())
+      return;
+
+    string path = std::move(archive_queue_.front());
+    archive_queue_.pop_front();
+    error_code ec = RunArchiveCmd(cmd, path);
+    LOG_IF(ERROR, ec) << "Could not archive the journal segment " << path << ": " << ec.message();
+    VLOG_IF(1, !ec) << "Archived the journal segment " << path;
+  }
 }
 
 void JournalSlice::AddLogRecord(const Entry& entry) {
-  DCHECK(ring_buffer_);
+  DCHECK_NE(slice_index_, UINT32_MAX);
 
   iterating_cb_arr_ = true;
   for (const auto& k_v : change_cb_arr_) {
@@ -124,21 +328,250 @@ void JournalSlice::AddLogRecord(const Entry& entry) {
   }
   iterating_cb_arr_ = false;
 
-  RingItem item;
-  item.lsn = lsn_;
-  item.opcode = entry.opcode;
-  item.txid = entry.txid;
-  VLOG(1) << "Writing item " << item.lsn;
-  ring_buffer_->EmplaceOrOverride(move(item));
+  if (entry.opcode == Op::COMMAND && (!entry.cmd.empty() || entry.barrier.shard_cnt > 1)) {
+    if (ring_limit_ == 0) {
+      backlog_start_ = lsn_ + 1;
+    } else {
+      RingItem item{lsn_, entry.txid, entry.opcode, entry.db_ind, entry.barrier, {}};
+      RespWriter::AppendCommand(entry.cmd, &item.cmd);
+      ring_bytes_ += sizeof(RingItem) + item.cmd.size();
+      ring_buffer_.push_back(move(item));
+
+      while (ring_bytes_ > ring_limit_) {
+        const RingItem& front = ring_buffer_.front();
+        backlog_start_ = front.lsn + 1;
+        ring_bytes_ -= sizeof(RingItem) + front.cmd.size();
+        ring_buffer_.pop_front();
+      }
+    }
+  }
+
+  // A failed journal writes nothing anymore, see status().
+  if (!open_ || status_ec_) {
+    ++lsn_;
+    return;
+  }
 
-  if (shard_file_) {
-    string line = absl::StrCat(lsn_, " ", entry.txid, " ", entry.opcode, "\n");
-    error_code ec = shard_file_->Write(io::Buffer(line), file_offset_, 0);
-    CHECK_EC(ec);
-    file_offset_ += line.size();
+  // The LSN advances before the flush, which ends the segment before it. A flush that fails
+  // marks the journal as failed.
+  EncodeRecord(lsn_++, entry, &pending_);
+  if (flush_ms_ == 0) {
+    flush_ec_.notify();
+  } else if (pending_.size() >= kMaxPendingLen) {
+    Flush(false);
   }
+}
+
+bool JournalSlice::ReadBacklog(LSN lsn, RespWriter* writer, string* dest) const {
+  if (!HasBacklog(lsn))
+    return false;
+
+  // The items are ordered by their LSNs.
+  auto it = lower_bound(ring_buffer_.begin(), ring_buffer_.end(), lsn,
+                        [](const RingItem& item, LSN val) { return item.lsn < val; });
+  for (; it != ring_buffer_.end(); ++it) {
+    writer->Append(it->lsn, it->db_index, it->txid, it->barrier, it->cmd, dest);
+  }
+  return true;
+}
+
+void JournalSlice::EncodeRecord(LSN lsn, const Entry& entry, string* dest) {
+  string value;
+  if (entry.opcode == Op::VAL && entry.pval_ptr && entry.pval_ptr->ObjType() == OBJ_STRING)
+    entry.pval_ptr->GetString(&value);
+
+  uint64_t time_ms = entry.time_ms ? entry.time_ms : absl::GetCurrentTimeNanos() / 1000000;
+
+  size_t start = dest->size();
+  AppendLittle<uint32_t>(0, dest);  // the length is filled below.
+  AppendLittle<uint8_t>(uint8_t(entry.opcode), dest);
+  AppendLittle<uint64_t>(lsn, dest);
+  AppendLittle<uint64_t>(time_ms, dest);
+  AppendLittle<uint64_t>(entry.txid, dest);
+  AppendLittle<uint16_t>(entry.db_ind, dest);
+  AppendLittle<uint32_t>(entry.barrier.seq, dest);
+  AppendLittle<uint32_t>(entry.barrier.shard_cnt, dest);
+  AppendLittle<uint64_t>(entry.expire_ms, dest);
+  AppendLittle<uint32_t>(entry.key.size(), dest);
+  dest->append(entry.key);
+  dest->append(value);
+
+  if (entry.opcode == Op::COMMAND) {
+    AppendLittle<uint32_t>(entry.cmd.size(), dest);
+    for (string_view arg : entry.cmd) {
+      AppendLittle<uint32_t>(arg.size(), dest);
+      dest->append(arg);
+    }
+  }
+
+  absl::little_endian::Store32(dest->data() + start, dest->size() - start - sizeof(uint32_t));
+}
+
+size_t JournalSlice::DecodeRecord(string_view src, Record* dest) {
+  constexpr size_t kFixedLen = 1 + 8 + 8 + 8 + 2 + 4 + 4 + 8 + 4;
+  if (src.size() < sizeof(uint32_t))
+    return 0;
+  size_t len = absl::little_endian::Load32(src.data());
+  if (src.size() < sizeof(uint32_t) + len)
+    return 0;
+  if (len < kFixedLen)
+    return SIZE_MAX;
+
+  const char* ptr = src.data() + sizeof(uint32_t);
+  const char* end = ptr + len;
+  auto load = [&ptr](auto* val) {
+    using T = std::remove_pointer_t<decltype(val)>;
+    if constexpr (sizeof(T) == 1) {
+      *val = T(*ptr);
+    } else if constexpr (sizeof(T) == 2) {
+      *val = T(absl::little_endian::Load16(ptr));
+    } else if constexpr (sizeof(T) == 4) {
+      *val = T(absl::little_endian::Load32(ptr));
+    } else {
+      *val = T(absl::little_endian::Load64(ptr));
+    }
+    ptr += sizeof(T);
+  };
+
+  uint32_t key_len = 0;
+  load(&dest->opcode);
+  load(&dest->lsn);
+  load(&dest->time_ms);
+  load(&dest->txid);
+  load(&dest->db_index);
+  load(&dest->barrier.seq);
+  load(&dest->barrier.shard_cnt);
+  load(&dest->expire_ms);
+  load(&key_len);
+  if (size_t(end - ptr) < key_len)
+    return SIZE_MAX;
+  dest->key = string_view{ptr, key_len};
+  ptr += key_len;
+
+  dest->value = string_view{};
+  dest->cmd.clear();
+  if (dest->opcode != Op::COMMAND) {
+    dest->value = string_view{ptr, size_t(end - ptr)};
+    return sizeof(uint32_t) + len;
+  }
+
+  uint32_t count = 0;
+  if (end - ptr < 4)
+    return SIZE_MAX;
+  load(&count);
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t arg_len = 0;
+    if (end - ptr < 4)
+      return SIZE_MAX;
+    load(&arg_len);
+    if (size_t(end - ptr) < arg_len)
+      return SIZE_MAX;
+    dest->cmd.emplace_back(ptr, arg_len);
+    ptr += arg_len;
+  }
+  return ptr == end ? sizeof(uint32_t) + len : SIZE_MAX;
+}
 
-  ++lsn_;
+string JournalSlice::SegmentName(const Segment& segment) {
+  string res = absl::StrCat("journal-", segment.session, "-",
+                            absl::Dec(segment.index, absl::kZeroPad4), "-",
+                            absl::Dec(segment.first, absl::kZeroPad20));
+  if (segment.last > 0)
+    absl::StrAppend(&res, "-", absl::Dec(segment.last, absl::kZeroPad20));
+  res.append(".log");
+  return res;
+}
+
+optional<JournalSlice::Segment> JournalSlice::ParseSegmentName(string_view name) {
+  if (!absl::ConsumePrefix(&name, "journal-") || !absl::ConsumeSuffix(&name, ".log"))
+    return nullopt;
+
+  vector<string_view> parts = absl::StrSplit(name, '-');
+  Segment res;
+  if (parts.size() < 3 || parts.size() > 4 || !absl::SimpleAtoi(parts[0], &res.session) ||
+      !absl::SimpleAtoi(parts[1], &res.index) || !absl::SimpleAtoi(parts[2], &res.first) ||
+      (parts.size() == 4 && !absl::SimpleAtoi(parts[3], &res.last)))
+    return nullopt;
+  return res;
+}
+
+error_code JournalSlice::Flush(bool sync) {
+  lock_guard lk(flush_mu_);
+  if (status_ec_)
+    return status_ec_;
+
+  error_code ec = FlushLocked(sync);
+  if (ec) {
+    LOG(ERROR) << "The journal " << shard_path_ << " failed: " << ec.message();
+    status_ec_ = ec;
+    pending_.clear();
+    group_commit_.store(false, memory_order_release);
+    synced_ec_.notifyAll();
+  }
+  return ec;
+}
+
+error_code JournalSlice::FlushLocked(bool sync) {
+  // The records that are added while this flush waits for the disk form the next group.
+  // The records before end_lsn are in buf or in the file already.
+  string buf;
+  buf.swap(pending_);
+  LSN end_lsn = lsn_;
+  if (!buf.empty()) {
+    size_t offset = file_offset_;
+    file_offset_ += buf.size();
+    RETURN_ON_ERR(shard_file_->Write(io::Buffer(buf), offset, 0));
+  } else if (!sync || file_offset_ == synced_offset_) {
+    return error_code{};
+  }
+
+  if (sync) {
+    RETURN_ON_ERR(Sync());
+    synced_lsn_.store(end_lsn, memory_order_release);
+    synced_ec_.notifyAll();
+  }
+
+  if (segment_size_ > 0 && file_offset_ >= segment_size_)
+    return RotateSegment(end_lsn);
+
+  return error_code{};
+}
+
+error_code JournalSlice::Sync() {
+  uring::Proactor* proactor = static_cast<uring::Proactor*>(ProactorBase::me());
+  uring::FiberCall fc(proactor);
+  fc->PrepFSync(shard_file_->fd(), IORING_FSYNC_DATASYNC);
+  uring::FiberCall::IoResult io_res = fc.Get();
+  if (io_res < 0)
+    return error_code{-io_res, system_category()};
+  synced_offset_ = file_offset_;
+  return error_code{};
+}
+
+void JournalSlice::AwaitSynced(LSN lsn) {
+  synced_ec_.await([&] {
+    return !group_commit_.load(memory_order_acquire) ||
+           synced_lsn_.load(memory_order_acquire) >= lsn;
+  });
+}
+
+void JournalSlice::FlushFb() {
+  if (flush_ms_ == 0) {
+    // The commands wait for the sync in their coordinators, hence the shard keeps running the
+    // next commands while a sync runs and their records form the next group.
+    while (!status_ec_) {
+      flush_ec_.await([this] { return flush_stop_ || !pending_.empty(); });
+      if (pending_.empty())
+        return;
+      Flush(true);
+    }
+    return;
+  }
+
+  auto period = chrono::milliseconds(flush_ms_ > 0 ? flush_ms_ : 1000);
+  while (!flush_done_.WaitFor(period) && !status_ec_) {
+    Flush(flush_ms_ > 0);
+  }
 }
 
 uint32_t JournalSlice::RegisterOnChange(ChangeCallback cb) {
@@ -4,14 +4,16 @@
 
 #pragma once
 
+#include <atomic>
 #include <boost/fiber/condition_variable.hpp>
 #include <boost/fiber/fiber.hpp>
+#include <deque>
 #include <optional>
 #include <string_view>
 
-#include "base/ring_buffer.h"
 #include "server/common.h"
 #include "server/journal/types.h"
+#include "util/fibers/fibers_ext.h"
 #include "util/uring/uring_file.h"
 
 namespace dfly {
@@ -25,7 +27,8 @@ class JournalSlice {
 
   void Init(unsigned index);
 
-  std::error_code Open(std::string_view dir);
+  // Opens the first segment of the session in dir, see SegmentName.
+  std::error_code Open(std::string_view dir, uint64_t session);
 
   std::error_code Close();
 
@@ -33,31 +36,147 @@ class JournalSlice {
     return lsn_;
   }
 
+  // The error that failed the file-based journal, which stops writing until it opens again.
   std::error_code status() const {
     return status_ec_;
   }
 
   // Whether the file-based journaling is open.
   bool IsOpen() const {
-    return bool(shard_file_);
+    return open_;
   }
 
   void AddLogRecord(const Entry& entry);
 
+  // With --journal_fsync=always, waits until the records before lsn reach the disk, which the
+  // group commits of FlushFb do. Returns at once in the other modes, or once the journal closes
+  // or fails. Can be called from any thread.
+  void AwaitSynced(LSN lsn);
+
   uint32_t RegisterOnChange(ChangeCallback cb);
   void Unregister(uint32_t);
 
+  // Whether the backlog holds all the records with commands starting from lsn.
+  bool HasBacklog(LSN lsn) const {
+    return slice_index_ != UINT32_MAX && lsn >= backlog_start_ && lsn <= lsn_;
+  }
+
+  // Appends the commands of the backlog starting from lsn to dest, see HasBacklog.
+  bool ReadBacklog(LSN lsn, RespWriter* writer, std::string* dest) const;
+
+  // A record decoded by DecodeRecord, its strings point into the decoded buffer.
+  struct Record {
+    Op opcode;
+    LSN lsn;
+    uint64_t time_ms;
+    TxId txid;
+    DbIndex db_index;
+    Barrier barrier;
+    uint64_t expire_ms;
+    std::string_view key, value;
+    std::vector<std::string_view> cmd;
+  };
+
+  // Appends the binary record of the entry to dest. A record is:
+  // u32 length of the rest | u8 opcode | u64 lsn | u64 time_ms | u64 txid | u16 db index |
+  // u32 barrier seq | u32 barrier shard_cnt | u64 expire_ms | u32 key length | key | value,
+  // where the value is the string value of a VAL entry, if any. The value of a COMMAND entry is
+  // u32 count of the arguments followed by u32 length | bytes of each argument. The integers
+  // are little endian.
+  static void EncodeRecord(LSN lsn, const Entry& entry, std::string* dest);
+
+  // Decodes the record at the start of src into dest and returns its size. Returns 0 if src
+  // does not hold all of it, and SIZE_MAX if it is malformed.
+  static size_t DecodeRecord(std::string_view src, Record* dest);
+
+  // The journal is written into segments, see --journal_segment_size. A segment is named by
+  // the session of the journal, the index of the thread and the LSN of its first record, and
+  // once it is finished also of its last one:
+  // journal-<session>-<index>-<first>[-<last>].log
+  struct Segment {
+    uint64_t session = 0;
+    unsigned index = 0;
+    LSN first = 0, last = 0;  // last is 0 for the segment that is written.
+  };
+
+  static std::string SegmentName(const Segment& segment);
+  static std::optional<Segment> ParseSegmentName(std::string_view name);
+
  private:
   struct RingItem;
 
+  // Writes the pending records with a single write and, if sync is true, waits for them to
+  // reach the disk. The records added meanwhile are written by the next flush. An error fails
+  // the journal, see status().
+  std::error_code Flush(bool sync);
+  std::error_code FlushLocked(bool sync);  // Flush under flush_mu_.
+
+  // Flushes and syncs the pending records every flush_ms_ until the slice closes. With
+  // --journal_fsync=always it flushes and syncs them as soon as they are added instead.
+  void FlushFb();
+
+  // Waits for the written records to reach the disk.
+  std::error_code Sync();
+
+  // Creates the file of the segment and sets path to it.
+  io::Result<std::unique_ptr<util::uring::LinuxFile>> OpenSegmentFile(const Segment& segment,
+                                                                      std::string* path) const;
+
+  // Opens the segment that starts at segment_.first.
+  std::error_code OpenSegment();
+
+  // Moves on to the segment that starts at end_lsn once the current one is full.
+  std::error_code RotateSegment(LSN end_lsn);
+
+  // Syncs and closes the segment that ends before end_lsn, renames it by its LSN range and
+  // queues it for --journal_archive_cmd.
+  std::error_code FinishSegment(LSN end_lsn);
+
+  // Runs --journal_archive_cmd for the finished segments until the slice closes.
+  void ArchiveFb();
+
+  std::string dir_;
+  Segment segment_;
   std::string shard_path_;
   std::unique_ptr<util::uring::LinuxFile> shard_file_;
-  std::optional<base::RingBuffer<RingItem>> ring_buffer_;
+  size_t segment_size_ = 0;  // 0 writes a single segment.
+
+  // The finished segments that ArchiveFb did not ship yet.
+  std::deque<std::string> archive_queue_;
+  util::fibers_ext::EventCount archive_ec_;
+  ::boost::fibers::fiber archive_fb_;
+  bool archive_done_ = false;
+
+  // Encoded records that were not written yet.
+  std::string pending_;
+  ::boost::fibers::mutex flush_mu_;  // serializes the writes and syncs of the flushes.
+  ::boost::fibers::fiber flush_fb_;
+  util::fibers_ext::Done flush_done_;
+  util::fibers_ext::EventCount flush_ec_;  // wakes up FlushFb for the group commits.
+  bool flush_stop_ = false;
+
+  // The records before synced_lsn_ are on the disk. The commands wait for it while group_commit_
+  // is set, see AwaitSynced.
+  std::atomic<LSN> synced_lsn_{0};
+  std::atomic_bool group_commit_{false};
+  util::fibers_ext::EventCount synced_ec_;
+
+  // By --journal_fsync: 0 - group commits every record, positive - syncs every flush_ms_ by
+  // FlushFb, negative - never syncs and leaves it to the OS.
+  int32_t flush_ms_ = 0;
+
+  // The backlog of the records with commands for the replicas that resume the replication.
+  // It is limited by --repl_backlog_size and starts from backlog_start_.
+  std::deque<RingItem> ring_buffer_;
+  size_t ring_bytes_ = 0;
+  size_t ring_limit_ = 0;
+  LSN backlog_start_ = 1;
 
   bool iterating_cb_arr_ = false;
   std::vector<std::pair<uint32_t, ChangeCallback>> change_cb_arr_;
 
   size_t file_offset_ = 0;
+  size_t synced_offset_ = 0;  // the prefix of the file that is known to be on the disk.
   LSN lsn_ = 1;
 
   uint32_t slice_index_ = UINT32_MAX;
@@ -65,6 +184,7 @@ class JournalSlice {
 
   std::error_code status_ec_;
 
+  bool open_ = false;  // between Open and Close, the records are written into shard_file_.
   bool lameduck_ = false;
 };
 
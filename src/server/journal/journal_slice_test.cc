@@ -0,0 +1,298 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/journal/journal_slice.h"
+
+#include <absl/base/internal/endian.h>
+#include <absl/strings/str_cat.h>
+#include <gmock/gmock.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+
+#include "base/flags.h"
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "util/uring/uring_pool.h"
+
+ABSL_DECLARE_FLAG(std::string, journal_fsync);
+ABSL_DECLARE_FLAG(uint64_t, journal_segment_size);
+
+using namespace testing;
+using namespace std;
+using namespace util;
+
+namespace dfly {
+namespace journal {
+
+namespace fs = std::filesystem;
+
+using Segment = JournalSlice::Segment;
+
+class JournalSliceTest : public Test {
+ protected:
+  static string Encode(LSN lsn, const Entry& entry) {
+    string res;
+    JournalSlice::EncodeRecord(lsn, entry, &res);
+    return res;
+  }
+
+  // Reads the records of the segments in dir by their LSNs, checking that the segments follow
+  // each other and hold the records of their LSN ranges.
+  static vector<JournalSlice::Record> ReadSegments(const fs::path& dir, vector<string>* bufs,
+                                                   unsigned* segment_cnt) {
+    vector<Segment> segments;
+    for (const auto& file : fs::directory_iterator(dir)) {
+      optional<Segment> segment = JournalSlice::ParseSegmentName(file.path().filename().string());
+      EXPECT_TRUE(segment) << file.path();
+      if (segment)
+        segments.push_back(*segment);
+    }
+    sort(segments.begin(), segments.end(),
+         [](const Segment& l, const Segment& r) { return l.first < r.first; });
+    *segment_cnt = segments.size();
+
+    vector<JournalSlice::Record> res;
+    bufs->reserve(segments.size());
+    for (size_t i = 0; i < segments.size(); ++i) {
+      EXPECT_GT(segments[i].last, 0u) << "unfinished segment " << i;
+      if (i > 0)
+        EXPECT_EQ(segments[i - 1].last + 1, segments[i].first);
+
+      ifstream in(dir / JournalSlice::SegmentName(segments[i]), ios::binary);
+      bufs->emplace_back(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+      string_view src = bufs->back();
+      while (!src.empty()) {
+        JournalSlice::Record record;
+        size_t len = JournalSlice::DecodeRecord(src, &record);
+        if (len == 0 || len == SIZE_MAX) {
+          ADD_FAILURE() << "bad record in segment " << i;
+          break;
+        }
+        EXPECT_GE(record.lsn, segments[i].first);
+        EXPECT_LE(record.lsn, segments[i].last);
+        res.push_back(move(record));
+        src.remove_prefix(len);
+      }
+    }
+    return res;
+  }
+};
+
+TEST_F(JournalSliceTest, EncodeDecodeCommand) {
+  vector<string_view> cmd{"SET", "key", "", string_view{"a\0b", 3}};
+  Entry entry = Entry::Command(2, 7, {}, 1, cmd);
+  entry.time_ms = 123;
+  entry.barrier = Barrier{3, 2};
+  string buf = Encode(5, entry);
+
+  JournalSlice::Record record;
+  ASSERT_EQ(buf.size(), JournalSlice::DecodeRecord(buf, &record));
+  EXPECT_EQ(Op::COMMAND, record.opcode);
+  EXPECT_EQ(5u, record.lsn);
+  EXPECT_EQ(123u, record.time_ms);
+  EXPECT_EQ(7u, record.txid);
+  EXPECT_EQ(2u, record.db_index);
+  EXPECT_EQ(3u, record.barrier.seq);
+  EXPECT_EQ(2u, record.barrier.shard_cnt);
+  EXPECT_EQ(0u, record.expire_ms);
+  EXPECT_EQ("", record.key);
+  EXPECT_THAT(record.cmd, ElementsAreArray(cmd));
+}
+
+TEST_F(JournalSliceTest, EncodeDecodeKey) {
+  Entry entry{Op::DEL, 1, 9, "key"};
+  entry.expire_ms = 1000;
+
+  // Two records back to back are decoded one after another.
+  string buf = Encode(1, entry) + Encode(2, Entry::Sched(10));
+  JournalSlice::Record record;
+  size_t len = JournalSlice::DecodeRecord(buf, &record);
+  ASSERT_GT(len, 0u);
+  ASSERT_LT(len, buf.size());
+  EXPECT_EQ(Op::DEL, record.opcode);
+  EXPECT_EQ("key", record.key);
+  EXPECT_EQ("", record.value);
+  EXPECT_EQ(1000u, record.expire_ms);
+  EXPECT_TRUE(record.cmd.empty());
+  EXPECT_GT(record.time_ms, 0u);  // the time when it was encoded.
+
+  ASSERT_EQ(buf.size() - len, JournalSlice::DecodeRecord(string_view{buf}.substr(len), &record));
+  EXPECT_EQ(Op::SCHED, record.opcode);
+  EXPECT_EQ(2u, record.lsn);
+  EXPECT_EQ(10u, record.txid);
+}
+
+TEST_F(JournalSliceTest, DecodePartial) {
+  vector<string_view> cmd{"SET", "key", "value"};
+  string buf = Encode(1, Entry::Command(0, 1, {}, 1, cmd));
+
+  JournalSlice::Record record;
+  for (size_t i = 0; i < buf.size(); ++i) {
+    EXPECT_EQ(0u, JournalSlice::DecodeRecord(string_view{buf}.substr(0, i), &record)) << i;
+  }
+}
+
+TEST_F(JournalSliceTest, DecodeMalformed) {
+  vector<string_view> cmd{"SET", "key", "value"};
+  string buf = Encode(1, Entry::Command(0, 1, {}, 1, cmd));
+  JournalSlice::Record record;
+
+  // Shorter than the fixed fields.
+  string bad(4, '\0');
+  absl::little_endian::Store32(bad.data(), 0);
+  EXPECT_EQ(SIZE_MAX, JournalSlice::DecodeRecord(bad, &record));
+
+  // The last argument is longer than the record.
+  bad = buf;
+  absl::little_endian::Store32(bad.data() + bad.size() - 5 - 4, 6);
+  EXPECT_EQ(SIZE_MAX, JournalSlice::DecodeRecord(bad, &record));
+
+  // More arguments than the record holds.
+  bad = buf;
+  size_t count_pos = 4 + 1 + 8 + 8 + 8 + 2 + 4 + 4 + 8 + 4;
+  absl::little_endian::Store32(bad.data() + count_pos, 4);
+  EXPECT_EQ(SIZE_MAX, JournalSlice::DecodeRecord(bad, &record));
+
+  // Bytes after the last argument.
+  bad = buf + "x";
+  absl::little_endian::Store32(bad.data(), bad.size() - 4);
+  EXPECT_EQ(SIZE_MAX, JournalSlice::DecodeRecord(bad, &record));
+}
+
+TEST_F(JournalSliceTest, SegmentName) {
+  Segment segment{1700000000000, 3, 42, 0};
+  string name = JournalSlice::SegmentName(segment);
+  EXPECT_EQ("journal-1700000000000-0003-00000000000000000042.log", name);
+
+  optional<Segment> parsed = JournalSlice::ParseSegmentName(name);
+  ASSERT_TRUE(parsed);
+  EXPECT_EQ(segment.session, parsed->session);
+  EXPECT_EQ(segment.index, parsed->index);
+  EXPECT_EQ(segment.first, parsed->first);
+  EXPECT_EQ(0u, parsed->last);
+
+  segment.last = 99;
+  parsed = JournalSlice::ParseSegmentName(JournalSlice::SegmentName(segment));
+  ASSERT_TRUE(parsed);
+  EXPECT_EQ(42u, parsed->first);
+  EXPECT_EQ(99u, parsed->last);
+
+  for (string_view bad : {"", "journal-.log", "journal-1-2.log", "journal-1-2-3-4-5.log",
+                          "journal-1-2-x.log", "journal-1-2-3.tmp", "snapshot-1-2-3.log",
+                          "journal-1-2-3-.log"}) {
+    EXPECT_FALSE(JournalSlice::ParseSegmentName(bad)) << bad;
+  }
+}
+
+// The fibers append while the flushes of each other write, sync and rotate the segments, so
+// every record must land in the segment of its LSN.
+TEST_F(JournalSliceTest, RotateUnderConcurrentAppends) {
+  constexpr unsigned kFibers = 4, kRecords = 100;
+
+  fs::path dir = fs::temp_directory_path() / absl::StrCat("journal_slice_test_", getpid());
+  fs::remove_all(dir);
+  absl::SetFlag(&FLAGS_journal_fsync, "always");
+  absl::SetFlag(&FLAGS_journal_segment_size, 1024);
+
+  uring::UringPool pp{16, 1};
+  pp.Run();
+  pp.at(0)->Await([&] {
+    JournalSlice slice;
+    slice.Init(0);
+    ASSERT_FALSE(slice.Open(dir.string(), 1));
+
+    vector<::boost::fibers::fiber> fibers;
+    for (unsigned i = 0; i < kFibers; ++i) {
+      fibers.emplace_back([&slice, i] {
+        for (unsigned j = 0; j < kRecords; ++j) {
+          string key = absl::StrCat("key-", i, "-", j);
+          vector<string_view> cmd{"SET", key, "value"};
+          slice.AddLogRecord(Entry::Command(0, i * kRecords + j + 1, {}, 1, cmd));
+        }
+      });
+    }
+    for (auto& fb : fibers)
+      fb.join();
+
+    EXPECT_FALSE(slice.status());
+    EXPECT_FALSE(slice.Close());
+  });
+  pp.Stop();
+
+  vector<string> bufs;
+  unsigned segment_cnt = 0;
+  vector<JournalSlice::Record> records = ReadSegments(dir, &bufs, &segment_cnt);
+  EXPECT_GT(segment_cnt, 2u);
+  ASSERT_EQ(kFibers * kRecords, records.size());
+  for (size_t i = 0; i < records.size(); ++i) {
+    EXPECT_EQ(i + 1, records[i].lsn);
+    ASSERT_EQ(3u, records[i].cmd.size());
+  }
+  fs::remove_all(dir);
+}
+
+// With --journal_fsync=always the records are synced by the group commits of the flush fiber,
+// which the other threads wait for.
+TEST_F(JournalSliceTest, AwaitGroupCommit) {
+  constexpr unsigned kRecords = 100;
+
+  fs::path dir = fs::temp_directory_path() / absl::StrCat("journal_slice_test_", getpid());
+  fs::remove_all(dir);
+  absl::SetFlag(&FLAGS_journal_fsync, "always");
+  absl::SetFlag(&FLAGS_journal_segment_size, 0);
+
+  uring::UringPool pp{16, 2};
+  pp.Run();
+  JournalSlice slice;
+  pp.at(0)->Await([&] {
+    slice.Init(0);
+    ASSERT_FALSE(slice.Open(dir.string(), 1));
+  });
+
+  for (unsigned i = 0; i < kRecords; ++i) {
+    LSN lsn = pp.at(0)->Await([&] {
+      string key = absl::StrCat("key-", i);
+      vector<string_view> cmd{"SET", key, "value"};
+      slice.AddLogRecord(Entry::Command(0, i + 1, {}, 1, cmd));
+      return slice.cur_lsn();
+    });
+    pp.at(1)->Await([&] { slice.AwaitSynced(lsn); });
+
+    // The records before lsn are in the file of the open segment.
+    fs::directory_iterator file(dir);
+    ASSERT_NE(file, fs::directory_iterator{});
+    ifstream in(file->path(), ios::binary);
+    string buf{istreambuf_iterator<char>(in), istreambuf_iterator<char>()};
+    unsigned cnt = 0;
+    JournalSlice::Record record;
+    for (string_view src = buf; !src.empty(); ++cnt) {
+      size_t len = JournalSlice::DecodeRecord(src, &record);
+      ASSERT_TRUE(len > 0 && len != SIZE_MAX) << i;
+      src.remove_prefix(len);
+    }
+    EXPECT_EQ(i + 1, cnt);
+  }
+
+  pp.at(0)->Await([&] {
+    EXPECT_FALSE(slice.status());
+    EXPECT_FALSE(slice.Close());
+  });
+
+  // A closed journal does not hold the waiters.
+  pp.at(1)->Await([&] { slice.AwaitSynced(UINT64_MAX); });
+  pp.Stop();
+
+  vector<string> bufs;
+  unsigned segment_cnt = 0;
+  vector<JournalSlice::Record> records = ReadSegments(dir, &bufs, &segment_cnt);
+  EXPECT_EQ(1u, segment_cnt);
+  EXPECT_EQ(kRecords, records.size());
+  fs::remove_all(dir);
+}
+
+}  // namespace journal
+}  // namespace dfly
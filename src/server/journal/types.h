@@ -3,6 +3,8 @@
 //
 #pragma once
 
+#include <optional>
+
 #include "server/common.h"
 #include "server/table.h"
 
@@ -19,9 +21,18 @@ enum class Op : uint8_t {
   VAL = 10,
   DEL,
   MSET,
+  COMMAND,  // a write command with its arguments, see Transaction::RecordJournal.
 };
 
 // TODO: to pass all the attributes like ttl, stickiness etc.
+// Set for the entries of a multi-shard command that is journaled whole by one of its shards.
+// The replica applies the command once its flows of all these shards reach it. seq tells apart
+// the commands of a multi transaction, which share its txid.
+struct Barrier {
+  uint32_t seq = 0;
+  uint32_t shard_cnt = 1;
+};
+
 struct Entry {
   Entry(Op op, DbIndex did, TxId tid, std::string_view skey)
       : opcode(op), db_ind(did), txid(tid), key(skey) {
@@ -36,15 +47,79 @@ struct Entry {
     return Entry{Op::SCHED, 0, tid, {}};
   }
 
+  // keys are the arguments of the command in this shard, one key every key_step of them.
+  // cmd is empty in all the shards of a multi-shard command but one, which journals the whole
+  // command.
+  static Entry Command(DbIndex did, TxId tid, ArgSlice keys, unsigned key_step, ArgSlice cmd) {
+    Entry res{Op::COMMAND, did, tid, {}};
+    res.keys = keys;
+    res.key_step = key_step;
+    res.cmd = cmd;
+    return res;
+  }
+
   Op opcode;
   DbIndex db_ind;
   TxId txid;
   std::string_view key;
   const PrimeValue* pval_ptr = nullptr;
   uint64_t expire_ms = 0;  // 0 means no expiry.
+
+  // The time of the transaction, which is the same in all its shards. 0 records the time when
+  // the entry is journaled.
+  uint64_t time_ms = 0;
+
+  // Set for Op::COMMAND.
+  ArgSlice keys;
+  unsigned key_step = 1;
+  ArgSlice cmd;
+  Barrier barrier;
 };
 
 using ChangeCallback = std::function<void(const Entry&)>;
 
+// The position of a snapshot in the file-based journal: the session of the journal and the LSN
+// of the first record after the snapshot by thread, 0 for the threads it did not snapshot.
+// Saved with the snapshot, so that a restore replays the journal from it.
+struct Position {
+  uint64_t session = 0;
+  std::vector<LSN> lsns;
+
+  // <session>:<lsn>,<lsn>...
+  std::string Format() const;
+  static std::optional<Position> Parse(std::string_view src);
+
+  // Merges the position of a snapshot of other shards, or of a later one, e.g. a delta.
+  void Merge(const Position& o);
+};
+
+// Writes the commands that stable sync streams to a replica flow as RESP commands. A command is
+// preceded by SELECT when its database changes and by "DFLY LSN <lsn>" when its LSN does not
+// follow the previous one, so that the replica knows the LSN to resume the flow from.
+// The records of a barrier are written as "DFLY BARRIER <txid> <seq> <shard_cnt> [EXEC]". The
+// flow that journals the command adds EXEC and applies the command that follows once all the
+// flows reach the barrier, the other flows wait for it and count the barrier as a record.
+class RespWriter {
+ public:
+  // The replica applies the commands of a flow starting from lsn in the database 0.
+  explicit RespWriter(LSN lsn) : next_lsn_(lsn) {
+  }
+
+  // Appends the marker of the LSN of the next command.
+  void AppendLsn(std::string* dest);
+
+  // Appends the record lsn with the command encoded by AppendCommand, which is empty for
+  // the barriers without the command.
+  void Append(LSN lsn, DbIndex db_index, TxId txid, const Barrier& barrier, std::string_view cmd,
+              std::string* dest);
+
+  // Appends cmd as a RESP array, which unlike an inline command is binary safe.
+  static void AppendCommand(ArgSlice cmd, std::string* dest);
+
+ private:
+  LSN next_lsn_;
+  DbIndex db_index_ = 0;
+};
+
 }  // namespace journal
 }  // namespace dfly
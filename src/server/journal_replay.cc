@@ -0,0 +1,267 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/journal_replay.h"
+
+#include <absl/base/internal/endian.h>
+#include <absl/container/flat_hash_map.h>
+#include <absl/strings/str_cat.h>
+
+#include <algorithm>
+#include <filesystem>
+
+#include "base/io_buf.h"
+#include "base/logging.h"
+#include "facade/facade_types.h"
+#include "io/file.h"
+#include "server/conn_context.h"
+#include "server/journal/journal_slice.h"
+#include "server/main_service.h"
+#include "util/uring/uring_file.h"
+
+namespace dfly {
+
+using namespace std;
+using namespace util;
+using journal::JournalSlice;
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr size_t kReadLen = 1 << 16;
+
+}  // namespace
+
+// The records of a thread, read from its segments in order.
+struct JournalReplay::Stream {
+  unsigned index = 0;
+  LSN until = UINT64_MAX;   // the first LSN that is not replayed.
+  vector<string> paths;     // of the segments, in the order of their LSNs.
+  size_t next_path = 0;
+
+  unique_ptr<io::FileSource> src;
+  base::IoBuf buf{kReadLen};
+  size_t rec_size = 0;  // of rec, which stays in buf until the next record is read.
+  JournalSlice::Record rec;
+
+  bool blocked = false;  // rec is a multi-shard command that waits for the other threads.
+  bool done = false;
+
+  // Returns false at the end of the segments.
+  io::Result<bool> Next();
+};
+
+io::Result<bool> JournalReplay::Stream::Next() {
+  buf.ConsumeInput(rec_size);
+  rec_size = 0;
+
+  while (true) {
+    string_view input = facade::ToSV(buf.InputBuffer());
+    size_t size = JournalSlice::DecodeRecord(input, &rec);
+    if (size == SIZE_MAX)
+      return nonstd::make_unexpected(make_error_code(errc::bad_message));
+    if (size > 0) {
+      rec_size = size;
+      return true;
+    }
+
+    if (!src) {
+      if (next_path == paths.size()) {
+        // A crash may leave the last record partially written.
+        LOG_IF(WARNING, !input.empty())
+            << "Skipping the incomplete last record of the journal of thread " << index;
+        return false;
+      }
+
+      io::Result<io::ReadonlyFile*> file = uring::OpenRead(paths[next_path]);
+      if (!file)
+        return nonstd::make_unexpected(file.error());
+      src.reset(new io::FileSource(*file));
+      continue;
+    }
+
+    size_t need = input.size() < sizeof(uint32_t)
+                      ? kReadLen
+                      : sizeof(uint32_t) + absl::little_endian::Load32(input.data());
+    buf.EnsureCapacity(max(kReadLen, need - input.size()));
+    io::Result<size_t> res = src->ReadSome(buf.AppendBuffer());
+    if (!res)
+      return nonstd::make_unexpected(res.error());
+    if (*res == 0) {
+      // A finished segment ends with a complete record.
+      src.reset();
+      if (++next_path < paths.size() && !input.empty())
+        return nonstd::make_unexpected(make_error_code(errc::bad_message));
+      continue;
+    }
+    buf.CommitWrite(*res);
+  }
+}
+
+JournalReplay::JournalReplay(Service* service, string dir, journal::Position pos)
+    : service_(service), dir_(std::move(dir)), pos_(std::move(pos)) {
+}
+
+JournalReplay::~JournalReplay() {
+}
+
+GenericError JournalReplay::OpenStreams() {
+  for (LSN lsn : pos_.lsns) {
+    if (lsn == 0)
+      return GenericError{make_error_code(errc::invalid_argument),
+                          "The snapshot does not cover all the shards"};
+  }
+
+  absl::flat_hash_map<unsigned, vector<JournalSlice::Segment>> segments;
+  error_code ec;
+  for (const fs::directory_entry& entry : fs::directory_iterator(dir_, ec)) {
+    optional<JournalSlice::Segment> segment =
+        JournalSlice::ParseSegmentName(entry.path().filename().string());
+    if (segment && segment->session == pos_.session && segment->index < pos_.lsns.size())
+      segments[segment->index].push_back(*segment);
+  }
+  if (ec)
+    return GenericError{ec, absl::StrCat("Could not list the journal directory ", dir_)};
+
+  for (unsigned index = 0; index < pos_.lsns.size(); ++index) {
+    auto stream = make_unique<Stream>();
+    stream->index = index;
+    if (index < until_lsns_.size())
+      stream->until = until_lsns_[index];
+
+    vector<JournalSlice::Segment>& thread_segments = segments[index];
+    sort(thread_segments.begin(), thread_segments.end(),
+         [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    // The segments must cover all the LSNs from the snapshot on, only the last one can be
+    // unfinished.
+    LSN expected = pos_.lsns[index];
+    bool open_end = false;
+    for (const JournalSlice::Segment& segment : thread_segments) {
+      if (segment.last > 0 && segment.last < expected)
+        continue;
+      if (open_end || segment.first > expected) {
+        return GenericError{make_error_code(errc::no_such_file_or_directory),
+                            absl::StrCat("Missing the journal segment of thread ", index,
+                                         " with LSN ", expected)};
+      }
+
+      fs::path path{dir_};
+      path.append(JournalSlice::SegmentName(segment));
+      stream->paths.push_back(path);
+      expected = segment.last + 1;
+      open_end = segment.last == 0;
+    }
+
+    stats_.segments += stream->paths.size();
+    streams_.push_back(std::move(stream));
+  }
+  return GenericError{};
+}
+
+GenericError JournalReplay::Advance(Stream* stream) {
+  LSN start = pos_.lsns[stream->index];
+  while (!stream->done) {
+    io::Result<bool> res = stream->Next();
+    if (!res) {
+      return GenericError{res.error(),
+                          absl::StrCat("Could not read the journal of thread ", stream->index)};
+    }
+
+    const JournalSlice::Record& rec = stream->rec;
+    if (!*res || rec.lsn >= stream->until || (until_ms_ && rec.time_ms > until_ms_)) {
+      stream->done = true;
+      break;
+    }
+
+    // The records before the snapshot are part of it.
+    if (rec.lsn < start || rec.opcode != journal::Op::COMMAND)
+      continue;
+
+    if (rec.barrier.shard_cnt > 1) {
+      stream->blocked = true;
+      break;
+    }
+    if (!rec.cmd.empty())
+      Execute(*stream);
+  }
+  return GenericError{};
+}
+
+void JournalReplay::Execute(const Stream& stream) {
+  const JournalSlice::Record& rec = stream.rec;
+
+  // The commands take mutable arguments.
+  vector<string> strs(rec.cmd.begin(), rec.cmd.end());
+  vector<MutableSlice> args(strs.size());
+  for (size_t i = 0; i < strs.size(); ++i)
+    args[i] = MutableSlice{strs[i].data(), strs[i].size()};
+
+  io::NullSink null_sink;
+  ConnectionContext cntx{&null_sink, nullptr};
+  cntx.is_replicating = true;
+  cntx.conn_state.db_index = rec.db_index;
+  service_->DispatchCommand(CmdArgList{args.data(), args.size()}, &cntx);
+  ++stats_.commands;
+}
+
+GenericError JournalReplay::Run() {
+  if (GenericError err = OpenStreams(); err)
+    return err;
+
+  using BarrierKey = pair<TxId, uint32_t>;  // txid and seq of the barrier.
+  while (true) {
+    for (auto& stream : streams_) {
+      if (!stream->blocked) {
+        if (GenericError err = Advance(stream.get()); err)
+          return err;
+      }
+    }
+
+    // Every thread is either done or waits for a multi-shard command.
+    absl::flat_hash_map<BarrierKey, vector<Stream*>> barriers;
+    for (auto& stream : streams_) {
+      if (stream->blocked) {
+        const JournalSlice::Record& rec = stream->rec;
+        barriers[BarrierKey{rec.txid, rec.barrier.seq}].push_back(stream.get());
+      }
+    }
+    if (barriers.empty())
+      break;
+
+    // The first shard of the command journals it and the others record only the barrier.
+    bool progress = false;
+    for (auto& [key, arrived] : barriers) {
+      if (arrived.size() < arrived.front()->rec.barrier.shard_cnt)
+        continue;
+
+      for (Stream* stream : arrived) {
+        if (!stream->rec.cmd.empty())
+          Execute(*stream);
+      }
+      for (Stream* stream : arrived)
+        stream->blocked = false;
+      progress = true;
+    }
+
+    if (!progress) {
+      for (auto& stream : streams_) {
+        if (!stream->blocked)
+          continue;
+        LOG(WARNING) << "The replay of thread " << stream->index
+                     << " stopped at the multi-shard command of LSN " << stream->rec.lsn;
+        stream->blocked = false;
+        stream->done = true;
+        ++stats_.cut_threads;
+      }
+      break;
+    }
+  }
+
+  VLOG(1) << "Replayed " << stats_.commands << " commands of " << stats_.segments
+          << " journal segments";
+  return GenericError{};
+}
+
+}  // namespace dfly
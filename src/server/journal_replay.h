@@ -0,0 +1,72 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "server/common.h"
+#include "server/journal/types.h"
+
+namespace dfly {
+
+class Service;
+
+// Replays the segments of the file-based journal that follow a restored snapshot, see DFLY
+// RESTORE. The records of every thread are applied in their order starting from the LSN of the
+// snapshot, the multi-shard commands once the records of all their shards are reached, like
+// the replica applies its flows. A target stops the replay of every thread at the first record
+// past it. The replay of the threads that wait for a multi-shard command that the target cuts
+// stops there as well, which keeps the result consistent.
+class JournalReplay {
+ public:
+  struct Stats {
+    size_t segments = 0;
+    size_t commands = 0;
+    size_t cut_threads = 0;  // whose replay stopped at a multi-shard command cut by the target.
+  };
+
+  JournalReplay(Service* service, std::string dir, journal::Position pos);
+  ~JournalReplay();
+
+  // Replays the records before until of every thread, see CLIENT LSNTOKEN.
+  void SetLsnTarget(std::vector<LSN> until) {
+    until_lsns_ = std::move(until);
+  }
+
+  // Replays the records of the transactions that started at or before until_ms, in unix time.
+  void SetTimeTarget(uint64_t until_ms) {
+    until_ms_ = until_ms;
+  }
+
+  // Must run in a proactor thread.
+  GenericError Run();
+
+  const Stats& stats() const {
+    return stats_;
+  }
+
+ private:
+  struct Stream;
+
+  GenericError OpenStreams();
+
+  // Reads the records of the stream until it reaches a multi-shard command or its end.
+  GenericError Advance(Stream* stream);
+
+  void Execute(const Stream& stream);
+
+  Service* service_;
+  std::string dir_;
+  journal::Position pos_;
+  std::vector<LSN> until_lsns_;
+  uint64_t until_ms_ = 0;
+
+  std::vector<std::unique_ptr<Stream>> streams_;
+  Stats stats_;
+};
+
+}  // namespace dfly
@@ -8,7 +8,11 @@ extern "C" {
 #include "redis/object.h"
 }
 
+#include <absl/container/flat_hash_map.h>
+#include <absl/strings/ascii.h>
 #include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
 #include <absl/strings/str_join.h>
 
 #include <jsoncons/json.hpp>
@@ -16,14 +20,26 @@ extern "C" {
 #include <jsoncons_ext/jsonpath/jsonpath.hpp>
 #include <jsoncons_ext/jsonpointer/jsonpointer.hpp>
 
+#include <list>
+#include <map>
+
+#include "base/flags.h"
 #include "base/logging.h"
 #include "core/json_object.h"
+#include "core/json_pack.h"
 #include "server/command_registry.h"
 #include "server/error.h"
-#include "server/journal/journal.h"
+#include "server/server_state.h"
 #include "server/tiered_storage.h"
 #include "server/transaction.h"
 
+ABSL_FLAG(uint32_t, json_path_cache_size, 256,
+          "The number of compiled JSONPath expressions that every thread caches, 0 disables "
+          "the cache.");
+ABSL_FLAG(bool, json_packed, false,
+          "If true, keeps the new JSON documents in a compact binary form, that takes a few times "
+          "less memory than the document tree and is unpacked for the complex paths only.");
+
 namespace dfly {
 
 using namespace std;
@@ -44,11 +60,10 @@ inline OpStatus JsonReplaceVerifyNoOp() {
   return OpStatus::OK;
 }
 
-inline void RecordJournal(const OpArgs& op_args, string_view key, const PrimeKey& pvalue) {
-  if (op_args.shard->journal()) {
-    journal::Entry entry{op_args.db_cntx.db_index, op_args.txid, key, pvalue};
-    op_args.shard->journal()->RecordEntry(entry);
-  }
+void PackInto(const JsonType& value, PrimeValue* pv) {
+  string blob;
+  PackJson(value, &blob);
+  pv->SetPackedJson(blob);
 }
 
 void SetJson(const OpArgs& op_args, string_view key, JsonType&& value) {
@@ -56,11 +71,20 @@ void SetJson(const OpArgs& op_args, string_view key, JsonType&& value) {
   DbIndex db_index = op_args.db_cntx.db_index;
   auto [it_output, added] = db_slice.AddOrFind(op_args.db_cntx, key);
   db_slice.PreUpdate(db_index, it_output);
-  it_output->second.SetJson(std::move(value));
+  if (absl::GetFlag(FLAGS_json_packed)) {
+    PackInto(value, &it_output->second);
+  } else {
+    it_output->second.SetJson(std::move(value));
+  }
   db_slice.PostUpdate(db_index, it_output, key);
-  RecordJournal(op_args, key, it_output->second);
 }
 
+// The document of a JSON key, either its tree or its packed form, see json_pack.h.
+struct JsonDoc {
+  const JsonType* tree = nullptr;
+  optional<PackedJson> packed;
+};
+
 string JsonTypeToName(const JsonType& val) {
   using namespace std::string_literals;
 
@@ -104,29 +128,310 @@ void PrintOptVec(ConnectionContext* cntx, const OpResult<vector<optional<T>>>& r
   }
 }
 
-error_code JsonReplace(JsonType& instance, string_view path, JsonReplaceCb callback) {
+// A step of a simple JSONPath, a member name or an array index.
+struct PathStep {
+  string name;  // empty for an index.
+  size_t index = 0;
+};
+
+// Parses the paths of member names and array indices only, e.g. $.a.b[0] or $['a'][1], that
+// select at most one value and can be evaluated by walking the document. Returns false for all
+// the other paths, which are compiled by jsoncons. The names are restricted to identifiers, so
+// that the normalized path, the one that jsoncons passes to the callbacks, needs no escaping.
+// jsoncons resolves "length" of an array to its size, so it is left to jsoncons as well.
+bool ParseSimplePath(string_view path, vector<PathStep>* steps, string* normalized) {
+  if (path.empty() || path[0] != '$')
+    return false;
+  path.remove_prefix(1);
+  *normalized = "$";
+
+  auto is_ident = [](string_view name) {
+    if (name.empty() || name.size() > 64 || absl::ascii_isdigit(name[0]) || name == "length")
+      return false;
+    for (char c : name) {
+      if (!absl::ascii_isalnum(c) && c != '_')
+        return false;
+    }
+    return true;
+  };
+
+  while (!path.empty()) {
+    PathStep step;
+    if (path[0] == '.') {
+      size_t end = path.find_first_of(".[", 1);
+      step.name = string(path.substr(1, end == string_view::npos ? end : end - 1));
+      if (!is_ident(step.name))
+        return false;
+      path.remove_prefix(end == string_view::npos ? path.size() : end);
+    } else if (absl::StartsWith(path, "['")) {
+      size_t end = path.find("']", 2);
+      if (end == string_view::npos)
+        return false;
+      step.name = string(path.substr(2, end - 2));
+      if (!is_ident(step.name))
+        return false;
+      path.remove_prefix(end + 2);
+    } else if (path[0] == '[') {
+      size_t end = path.find(']');
+      if (end == string_view::npos || end == 1 || end > 10)
+        return false;
+      for (char c : path.substr(1, end - 1)) {
+        if (!absl::ascii_isdigit(c))
+          return false;
+      }
+      CHECK(absl::SimpleAtoi(path.substr(1, end - 1), &step.index));
+      path.remove_prefix(end + 1);
+    } else {
+      return false;
+    }
+
+    if (step.name.empty()) {
+      absl::StrAppend(normalized, "[", step.index, "]");
+    } else {
+      absl::StrAppend(normalized, "['", step.name, "']");
+    }
+    steps->push_back(std::move(step));
+  }
+
+  return true;
+}
+
+// Returns the value that the simple path selects, or null if there is none.
+template <typename J> J* WalkSimplePath(J* val, const vector<PathStep>& steps) {
+  for (const PathStep& step : steps) {
+    if (step.name.empty()) {
+      if (!val->is_array() || step.index >= val->size())
+        return nullptr;
+      val = &(*val)[step.index];
+    } else {
+      if (!val->is_object())
+        return nullptr;
+      auto it = val->find(step.name);
+      if (it == val->object_range().end())
+        return nullptr;
+      val = &it->value();
+    }
+  }
+  return val;
+}
+
+optional<PackedJson> WalkSimplePath(PackedJson val, const vector<PathStep>& steps) {
+  for (const PathStep& step : steps) {
+    if (step.name.empty()) {
+      if (val.type() != PackedJson::ARRAY || step.index >= val.size())
+        return nullopt;
+      val = val.At(step.index);
+    } else {
+      if (val.type() != PackedJson::OBJECT)
+        return nullopt;
+      optional<PackedJson> member = val.Find(step.name);
+      if (!member)
+        return nullopt;
+      val = *member;
+    }
+  }
+  return val;
+}
+
+// A bounded LRU cache of compiled JSONPath expressions, one per thread. The clients tend to
+// repeat few paths, and compiling a path costs more than evaluating it on a small document.
+// The entries are shared, so that an evicted expression stays valid for the commands that
+// still evaluate it.
+template <typename T> class PathCache {
+ public:
+  // Returns the cached expression of path or the one that compile(path, &ec) returns.
+  template <typename F> shared_ptr<T> Get(string_view path, F&& compile, error_code* ec) {
+    auto& stats = ServerState::tlocal()->connection_stats;
+    if (auto it = index_.find(path); it != index_.end()) {
+      ++stats.json_path_cache_hits;
+      lru_.splice(lru_.begin(), lru_, it->second);
+      return it->second->second;
+    }
+
+    ++stats.json_path_cache_misses;
+    shared_ptr<T> res = compile(path, ec);
+    size_t capacity = absl::GetFlag(FLAGS_json_path_cache_size);
+    if (*ec || capacity == 0)
+      return res;
+
+    while (lru_.size() >= capacity) {
+      index_.erase(lru_.back().first);
+      lru_.pop_back();
+    }
+    lru_.emplace_front(string(path), res);
+    index_.emplace(lru_.front().first, lru_.begin());
+    return res;
+  }
+
+ private:
+  using Entry = pair<string, shared_ptr<T>>;
+
+  list<Entry> lru_;
+  absl::flat_hash_map<string_view, typename list<Entry>::iterator> index_;
+};
+
+// A compiled JSONPath for the read-only commands. It is compiled on the connection thread and
+// then evaluated by the shards. The simple paths bypass the jsoncons evaluator.
+class JsonPath {
+ public:
+  static shared_ptr<const JsonPath> Compile(string_view path, error_code* ec) {
+    thread_local PathCache<JsonPath> cache;
+    return cache.Get(
+        path,
+        [](string_view path, error_code* ec) {
+          auto res = make_shared<JsonPath>();
+          if (!ParseSimplePath(path, &res->steps_, &res->normalized_)) {
+            res->steps_.clear();
+            res->expr_.emplace(jsonpath::make_expression<JsonType>(path, *ec));
+          }
+          return res;
+        },
+        ec);
+  }
+
+  // Calls cb(path, value) for every value that the expression selects.
+  template <typename Cb> void evaluate(const JsonType& instance, Cb&& cb) const {
+    if (expr_) {
+      expr_->evaluate(instance, std::forward<Cb>(cb));
+    } else if (const JsonType* val = WalkSimplePath(&instance, steps_); val) {
+      cb(normalized_, *val);
+    }
+  }
+
+  // Same for a document that may be packed. The simple paths are walked over the packed form,
+  // unpacking only the selected value, the other ones need the whole document unpacked.
+  template <typename Cb> void evaluate(const JsonDoc& doc, Cb&& cb) const {
+    if (doc.tree) {
+      evaluate(*doc.tree, std::forward<Cb>(cb));
+    } else if (expr_) {
+      JsonType instance = UnpackJson(*doc.packed);
+      expr_->evaluate(instance, std::forward<Cb>(cb));
+    } else if (optional<PackedJson> val = WalkSimplePath(*doc.packed, steps_); val) {
+      cb(normalized_, UnpackJson(*val));
+    }
+  }
+
+  // Returns the array of the selected values.
+  JsonType evaluate(const JsonType& instance) const {
+    if (expr_)
+      return expr_->evaluate(instance);
+
+    JsonType res(json_array_arg);
+    if (const JsonType* val = WalkSimplePath(&instance, steps_); val)
+      res.push_back(*val);
+    return res;
+  }
+
+  bool is_simple() const {
+    return !expr_;
+  }
+
+  // Requires: is_simple(). Returns the selected value of a packed document.
+  optional<PackedJson> Select(PackedJson doc) const {
+    return WalkSimplePath(doc, steps_);
+  }
+
+ private:
+  vector<PathStep> steps_;
+  string normalized_;
+  optional<JsonExpression> expr_;  // set unless the path is simple.
+};
+
+using JsonPathPtr = shared_ptr<const JsonPath>;
+
+// A compiled JSONPath that selects mutable values, for the write commands. It is compiled and
+// evaluated by the shard that holds the document.
+class MutableJsonPath {
   using evaluator_t = jsoncons::jsonpath::detail::jsonpath_evaluator<JsonType, JsonType&>;
   using value_type = evaluator_t::value_type;
   using reference = evaluator_t::reference;
   using json_selector_t = evaluator_t::path_expression_type;
   using json_location_type = evaluator_t::json_location_type;
-  jsonpath::custom_functions<JsonType> funcs = jsonpath::custom_functions<JsonType>();
 
+ public:
+  static shared_ptr<MutableJsonPath> Compile(string_view path, error_code* ec) {
+    thread_local PathCache<MutableJsonPath> cache;
+    return cache.Get(
+        path,
+        [](string_view path, error_code* ec) {
+          auto res = make_shared<MutableJsonPath>();
+          if (!ParseSimplePath(path, &res->steps_, &res->normalized_)) {
+            res->steps_.clear();
+
+            // The selectors point into the static resources, hence both are kept together.
+            evaluator_t e;
+            res->expr_.emplace(e.compile(res->static_resources_, path, *ec));
+          }
+          return res;
+        },
+        ec);
+  }
+
+  void Replace(JsonType& instance, const JsonReplaceCb& callback) {
+    if (!expr_) {
+      if (JsonType* val = WalkSimplePath(&instance, steps_); val)
+        callback(normalized_, *val);
+      return;
+    }
+
+    jsoncons::jsonpath::detail::dynamic_resources<value_type, reference> resources;
+    auto f = [&callback](const json_location_type& path, reference val) {
+      callback(path.to_string(), val);
+    };
+
+    expr_->evaluate(resources, instance, resources.root_path_node(), instance, f,
+                    jsonpath::result_options::nodups);
+  }
+
+  // Same for a packed document. A scalar that a simple path selects is replaced in place when
+  // its new value packs to the same size, e.g. a number or a boolean. Otherwise the document is
+  // unpacked, updated and packed again.
+  void Replace(PrimeValue* pv, const JsonReplaceCb& callback) {
+    PackedJson doc(pv->GetPackedJson());
+    if (!expr_) {
+      optional<PackedJson> target = WalkSimplePath(doc, steps_);
+      if (!target)
+        return;
+
+      if (target->IsScalar()) {
+        JsonType val = UnpackJson(*target);
+        callback(normalized_, val);
+
+        string packed;
+        PackJson(val, &packed);
+        if (packed.size() == target->ByteSize()) {
+          pv->PatchPackedJson(target->data() - doc.data(), packed);
+          return;
+        }
+
+        JsonType instance = UnpackJson(doc);
+        *WalkSimplePath(&instance, steps_) = std::move(val);
+        PackInto(instance, pv);
+        return;
+      }
+    }
+
+    JsonType instance = UnpackJson(doc);
+    Replace(instance, callback);
+    PackInto(instance, pv);
+  }
+
+ private:
+  vector<PathStep> steps_;
+  string normalized_;
+  jsonpath::custom_functions<JsonType> funcs_;
+  jsoncons::jsonpath::detail::static_resources<value_type, reference> static_resources_{funcs_};
+  optional<json_selector_t> expr_;
+};
+
+error_code JsonReplace(JsonType& instance, string_view path, JsonReplaceCb callback) {
   error_code ec;
-  jsoncons::jsonpath::detail::static_resources<value_type, reference> static_resources(funcs);
-  evaluator_t e;
-  json_selector_t expr = e.compile(static_resources, path, ec);
+  shared_ptr<MutableJsonPath> expr = MutableJsonPath::Compile(path, &ec);
   if (ec) {
     return ec;
   }
 
-  jsoncons::jsonpath::detail::dynamic_resources<value_type, reference> resources;
-  auto f = [&callback](const json_location_type& path, reference val) {
-    callback(path.to_string(), val);
-  };
-
-  expr.evaluate(resources, instance, resources.root_path_node(), instance, f,
-                jsonpath::result_options::nodups);
+  expr->Replace(instance, callback);
   return ec;
 }
 
@@ -140,19 +445,26 @@ OpStatus UpdateEntry(const OpArgs& op_args, std::string_view key, std::string_vi
   PrimeIterator entry_it = it_res.value();
   auto& db_slice = op_args.shard->db_slice();
   auto db_index = op_args.db_cntx.db_index;
-  JsonType* json_val = entry_it->second.GetJson();
-  DCHECK(json_val) << "should have a valid JSON object for key '" << key << "' the type for it is '"
-                   << entry_it->second.ObjType() << "'";
-  JsonType& json_entry = *json_val;
+  PrimeValue& pv = entry_it->second;
   db_slice.PreUpdate(db_index, entry_it);
 
   // Run the update operation on this entry
-  error_code ec = JsonReplace(json_entry, path, callback);
+  error_code ec;
+  shared_ptr<MutableJsonPath> expr = MutableJsonPath::Compile(path, &ec);
   if (ec) {
     VLOG(1) << "Failed to evaluate expression on json with error: " << ec.message();
     return OpStatus::SYNTAX_ERR;
   }
 
+  if (pv.IsPackedJson()) {
+    expr->Replace(&pv, callback);
+  } else {
+    JsonType* json_val = pv.GetJson();
+    DCHECK(json_val) << "should have a valid JSON object for key '" << key
+                     << "' the type for it is '" << pv.ObjType() << "'";
+    expr->Replace(*json_val, callback);
+  }
+
   // Make sure that we don't have other internal issue with the operation
   OpStatus res = verify_op();
   if (res == OpStatus::OK) {
@@ -162,15 +474,59 @@ OpStatus UpdateEntry(const OpArgs& op_args, std::string_view key, std::string_vi
   return res;
 }
 
-OpResult<JsonType*> GetJson(const OpArgs& op_args, string_view key) {
+OpResult<JsonDoc> GetJson(const OpArgs& op_args, string_view key) {
   OpResult<PrimeIterator> it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_JSON);
   if (!it_res.ok())
     return it_res.status();
 
-  JsonType* json_val = it_res.value()->second.GetJson();
-  DCHECK(json_val) << "should have a valid JSON object for key " << key;
+  const PrimeValue& pv = it_res.value()->second;
+  JsonDoc res;
+  if (pv.IsPackedJson()) {
+    res.packed.emplace(pv.GetPackedJson());
+  } else {
+    res.tree = pv.GetJson();
+    DCHECK(res.tree) << "should have a valid JSON object for key " << key;
+  }
 
-  return json_val;
+  return res;
+}
+
+// Prints the reply of OpGet for a packed document and simple paths from the packed form.
+string PackedGet(PackedJson doc, const vector<pair<string_view, JsonPathPtr>>& expressions) {
+  string res;
+  if (expressions.empty()) {
+    PackedJsonToString(doc, &res);
+    return res;
+  }
+
+  auto print_array = [&](const JsonPath& expr) {
+    res.push_back('[');
+    if (optional<PackedJson> val = expr.Select(doc); val)
+      PackedJsonToString(*val, &res);
+    res.push_back(']');
+  };
+
+  if (expressions.size() == 1) {
+    print_array(*expressions[0].second);
+    return res;
+  }
+
+  // The paths are the keys of an object, ordered and deduplicated as in JsonType.
+  map<string_view, const JsonPath*> paths;
+  for (const auto& [path, expr] : expressions) {
+    paths[path] = expr.get();
+  }
+
+  res.push_back('{');
+  for (const auto& [path, expr] : paths) {
+    if (res.size() > 1)
+      res.push_back(',');
+    res.append(JsonType(path.data(), path.size()).to_string());
+    res.push_back(':');
+    print_array(*expr);
+  }
+  res.push_back('}');
+  return res;
 }
 
 // Returns the index of the next right bracket
@@ -342,55 +698,64 @@ void SendJsonValue(ConnectionContext* cntx, const JsonType& j) {
 }
 
 OpResult<string> OpGet(const OpArgs& op_args, string_view key,
-                       vector<pair<string_view, JsonExpression>> expressions) {
-  OpResult<JsonType*> result = GetJson(op_args, key);
+                       const vector<pair<string_view, JsonPathPtr>>& expressions) {
+  OpResult<JsonDoc> result = GetJson(op_args, key);
   if (!result) {
     return result.status();
   }
 
-  const JsonType& json_entry = *(result.value());
+  // A packed document is printed without unpacking it, unless a path needs jsoncons.
+  const JsonDoc& doc = result.value();
+  optional<JsonType> unpacked;
+  if (doc.packed) {
+    auto is_simple = [](const auto& expr) { return expr.second->is_simple(); };
+    if (all_of(expressions.begin(), expressions.end(), is_simple))
+      return PackedGet(*doc.packed, expressions);
+    unpacked = UnpackJson(*doc.packed);
+  }
+
+  const JsonType& json_entry = unpacked ? *unpacked : *doc.tree;
   if (expressions.empty()) {
     // this implicitly means that we're using $ which
     // means we just brings all values
     return json_entry.to_string();
   }
   if (expressions.size() == 1) {
-    json out = expressions[0].second.evaluate(json_entry);
+    json out = expressions[0].second->evaluate(json_entry);
     return out.as<string>();
   }
 
   json out;
   for (auto& expr : expressions) {
-    json eval = expr.second.evaluate(json_entry);
+    json eval = expr.second->evaluate(json_entry);
     out[expr.first] = eval;
   }
 
   return out.as<string>();
 }
 
-OpResult<vector<string>> OpType(const OpArgs& op_args, string_view key, JsonExpression expression) {
-  OpResult<JsonType*> result = GetJson(op_args, key);
+OpResult<vector<string>> OpType(const OpArgs& op_args, string_view key,
+                                const JsonPath& expression) {
+  OpResult<JsonDoc> result = GetJson(op_args, key);
   if (!result) {
     return result.status();
   }
 
-  const JsonType& json_entry = *(result.value());
   vector<string> vec;
   auto cb = [&vec](const string_view& path, const JsonType& val) {
     vec.emplace_back(JsonTypeToName(val));
   };
 
-  expression.evaluate(json_entry, cb);
+  expression.evaluate(result.value(), cb);
   return vec;
 }
 
 OpResult<vector<OptSizeT>> OpStrLen(const OpArgs& op_args, string_view key,
-                                    JsonExpression expression) {
-  OpResult<JsonType*> result = GetJson(op_args, key);
+                                    const JsonPath& expression) {
+  OpResult<JsonDoc> result = GetJson(op_args, key);
   if (!result) {
     return result.status();
   }
-  const JsonType& json_entry = *(result.value());
   vector<OptSizeT> vec;
   auto cb = [&vec](const string_view& path, const JsonType& val) {
     if (val.is_string()) {
@@ -400,18 +765,17 @@ OpResult<vector<OptSizeT>> OpStrLen(const OpArgs& op_args, string_view key,
     }
   };
 
-  expression.evaluate(json_entry, cb);
+  expression.evaluate(result.value(), cb);
   return vec;
 }
 
 OpResult<vector<OptSizeT>> OpObjLen(const OpArgs& op_args, string_view key,
-                                    JsonExpression expression) {
-  OpResult<JsonType*> result = GetJson(op_args, key);
+                                    const JsonPath& expression) {
+  OpResult<JsonDoc> result = GetJson(op_args, key);
   if (!result) {
     return result.status();
   }
 
-  const JsonType& json_entry = *(result.value());
   vector<OptSizeT> vec;
   auto cb = [&vec](const string_view& path, const JsonType& val) {
     if (val.is_object()) {
@@ -421,18 +785,17 @@ OpResult<vector<OptSizeT>> OpObjLen(const OpArgs& op_args, string_view key,
     }
   };
 
-  expression.evaluate(json_entry, cb);
+  expression.evaluate(result.value(), cb);
   return vec;
 }
 
 OpResult<vector<OptSizeT>> OpArrLen(const OpArgs& op_args, string_view key,
-                                    JsonExpression expression) {
-  OpResult<JsonType*> result = GetJson(op_args, key);
+                                    const JsonPath& expression) {
+  OpResult<JsonDoc> result = GetJson(op_args, key);
   if (!result) {
     return result.status();
   }
 
-  const JsonType& json_entry = *(result.value());
   vector<OptSizeT> vec;
   auto cb = [&vec](const string_view& path, const JsonType& val) {
     if (val.is_array()) {
@@ -442,7 +805,7 @@ OpResult<vector<OptSizeT>> OpArrLen(const OpArgs& op_args, string_view key,
     }
   };
 
-  expression.evaluate(json_entry, cb);
+  expression.evaluate(result.value(), cb);
   return vec;
 }
 
@@ -517,16 +880,21 @@ OpResult<long> OpDel(const OpArgs& op_args, string_view key, string_view path) {
     return total_deletions;
   }
 
-  OpResult<JsonType*> result = GetJson(op_args, key);
-  if (!result) {
+  auto& db_slice = op_args.shard->db_slice();
+  OpResult<PrimeIterator> it_res = db_slice.Find(op_args.db_cntx, key, OBJ_JSON);
+  if (!it_res) {
     return total_deletions;
   }
 
   vector<string> deletion_items;
   auto cb = [&](const string& path, JsonType& val) { deletion_items.emplace_back(path); };
 
-  // json j = move(result.value());
-  JsonType& json_entry = *(result.value());
+  // A packed document is unpacked for the patch and then packed again.
+  PrimeValue& pv = it_res.value()->second;
+  optional<JsonType> unpacked;
+  if (pv.IsPackedJson())
+    unpacked = UnpackJson(PackedJson(pv.GetPackedJson()));
+  JsonType& json_entry = unpacked ? *unpacked : *pv.GetJson();
   error_code ec = JsonReplace(json_entry, path, cb);
   if (ec) {
     VLOG(1) << "Failed to evaluate expression on json with error: " << ec.message();
@@ -552,15 +920,20 @@ OpResult<long> OpDel(const OpArgs& op_args, string_view key, string_view path) {
     return 0;
   }
 
-  // SetString(op_args, key, j.as_string());
+  if (unpacked) {
+    db_slice.PreUpdate(op_args.db_cntx.db_index, it_res.value());
+    PackInto(*unpacked, &pv);
+    db_slice.PostUpdate(op_args.db_cntx.db_index, it_res.value(), key);
+  }
+
   return total_deletions;
 }
 
 // Returns a vector of string vectors,
 // keys within the same object are stored in the same string vector.
 OpResult<vector<StringVec>> OpObjKeys(const OpArgs& op_args, string_view key,
-                                      JsonExpression expression) {
-  OpResult<JsonType*> result = GetJson(op_args, key);
+                                      const JsonPath& expression) {
+  OpResult<JsonDoc> result = GetJson(op_args, key);
   if (!result) {
     return result.status();
   }
@@ -578,9 +951,8 @@ OpResult<vector<StringVec>> OpObjKeys(const OpArgs& op_args, string_view key,
       current_object.emplace_back(member.key());
     }
   };
-  JsonType& json_entry = *(result.value());
 
-  expression.evaluate(json_entry, cb);
+  expression.evaluate(result.value(), cb);
   return vec;
 }
 
@@ -797,7 +1169,7 @@ OpResult<vector<OptSizeT>> OpArrAppend(const OpArgs& op_args, string_view key, s
                                        const vector<JsonType>& append_values) {
   vector<OptSizeT> vec;
 
-  OpResult<JsonType*> result = GetJson(op_args, key);
+  OpResult<JsonDoc> result = GetJson(op_args, key);
   if (!result) {
     return result.status();
   }
@@ -825,9 +1197,9 @@ OpResult<vector<OptSizeT>> OpArrAppend(const OpArgs& op_args, string_view key, s
 // An index value of -1 represents unfound in the array.
 // JSON scalar has types of string, boolean, null, and number.
 OpResult<vector<OptLong>> OpArrIndex(const OpArgs& op_args, string_view key,
-                                     JsonExpression expression, const JsonType& search_val,
+                                     const JsonPath& expression, const JsonType& search_val,
                                      int start_index, int end_index) {
-  OpResult<JsonType*> result = GetJson(op_args, key);
+  OpResult<JsonDoc> result = GetJson(op_args, key);
   if (!result) {
     return result.status();
   }
@@ -881,18 +1253,16 @@ OpResult<vector<OptLong>> OpArrIndex(const OpArgs& op_args, string_view key,
 
     vec.emplace_back(pos);
   };
-  JsonType& json_entry = *(result.value());
-  expression.evaluate(json_entry, cb);
+  expression.evaluate(result.value(), cb);
   return vec;
 }
 
 // Returns string vector that represents the query result of each supplied key.
 OpResult<vector<OptString>> OpMGet(const OpArgs& op_args, const vector<string_view>& keys,
-                                   JsonExpression expression) {
+                                   const JsonPath& expression) {
   vector<OptString> vec;
   for (auto& it : keys) {
-    // OpResult<JsonType> result = GetJson(op_args, it);
-    OpResult<JsonType*> result = GetJson(op_args, it);
+    OpResult<JsonDoc> result = GetJson(op_args, it);
     if (!result) {
       vec.emplace_back();
       continue;
@@ -909,8 +1279,7 @@ OpResult<vector<OptString>> OpMGet(const OpArgs& op_args, const vector<string_vi
 
       vec.push_back(move(str));
     };
-    const JsonType& json_entry = *(result.value());
-    expression.evaluate(json_entry, cb);
+    expression.evaluate(result.value(), cb);
   }
 
   return vec;
@@ -918,8 +1287,8 @@ OpResult<vector<OptString>> OpMGet(const OpArgs& op_args, const vector<string_vi
 
 // Returns numeric vector that represents the number of fields of JSON value at each path.
 OpResult<vector<OptSizeT>> OpFields(const OpArgs& op_args, string_view key,
-                                    JsonExpression expression) {
-  OpResult<JsonType*> result = GetJson(op_args, key);
+                                    const JsonPath& expression) {
+  OpResult<JsonDoc> result = GetJson(op_args, key);
   if (!result) {
     return result.status();
   }
@@ -928,23 +1297,21 @@ OpResult<vector<OptSizeT>> OpFields(const OpArgs& op_args, string_view key,
   auto cb = [&vec](const string_view& path, const JsonType& val) {
     vec.emplace_back(CountJsonFields(val));
   };
-  const JsonType& json_entry = *(result.value());
-  expression.evaluate(json_entry, cb);
+  expression.evaluate(result.value(), cb);
   return vec;
 }
 
 // Returns json vector that represents the result of the json query.
 OpResult<vector<JsonType>> OpResp(const OpArgs& op_args, string_view key,
-                                  JsonExpression expression) {
-  OpResult<JsonType*> result = GetJson(op_args, key);
+                                  const JsonPath& expression) {
+  OpResult<JsonDoc> result = GetJson(op_args, key);
   if (!result) {
     return result.status();
   }
 
   vector<JsonType> vec;
   auto cb = [&vec](const string_view& path, const JsonType& val) { vec.emplace_back(val); };
-  const JsonType& json_entry = *(result.value());
-  expression.evaluate(json_entry, cb);
+  expression.evaluate(result.value(), cb);
   return vec;
 }
 
@@ -1015,7 +1382,7 @@ void JsonFamily::Resp(CmdArgList args, ConnectionContext* cntx) {
   string_view path = ArgS(args, 2);
 
   error_code ec;
-  JsonExpression expression = jsonpath::make_expression<JsonType>(path, ec);
+  JsonPathPtr expression = JsonPath::Compile(path, &ec);
 
   if (ec) {
     VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
@@ -1024,7 +1391,7 @@ void JsonFamily::Resp(CmdArgList args, ConnectionContext* cntx) {
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpResp(t->GetOpArgs(shard), key, move(expression));
+    return OpResp(t->GetOpArgs(shard), key, *expression);
   };
 
   Transaction* trans = cntx->transaction;
@@ -1068,7 +1435,7 @@ void JsonFamily::Debug(CmdArgList args, ConnectionContext* cntx) {
   error_code ec;
   string_view key = ArgS(args, 2);
   string_view path = ArgS(args, 3);
-  JsonExpression expression = jsonpath::make_expression<JsonType>(path, ec);
+  JsonPathPtr expression = JsonPath::Compile(path, &ec);
 
   if (ec) {
     VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
@@ -1077,7 +1444,7 @@ void JsonFamily::Debug(CmdArgList args, ConnectionContext* cntx) {
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return func(t->GetOpArgs(shard), key, move(expression));
+    return func(t->GetOpArgs(shard), key, *expression);
   };
 
   Transaction* trans = cntx->transaction;
@@ -1093,7 +1460,7 @@ void JsonFamily::Debug(CmdArgList args, ConnectionContext* cntx) {
 void JsonFamily::MGet(CmdArgList args, ConnectionContext* cntx) {
   error_code ec;
   string_view path = ArgS(args, args.size() - 1);
-  JsonExpression expression = jsonpath::make_expression<JsonType>(path, ec);
+  JsonPathPtr expression = JsonPath::Compile(path, &ec);
 
   if (ec) {
     VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
@@ -1107,7 +1474,7 @@ void JsonFamily::MGet(CmdArgList args, ConnectionContext* cntx) {
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpMGet(t->GetOpArgs(shard), vec, move(expression));
+    return OpMGet(t->GetOpArgs(shard), vec, *expression);
   };
 
   Transaction* trans = cntx->transaction;
@@ -1132,7 +1499,7 @@ void JsonFamily::ArrIndex(CmdArgList args, ConnectionContext* cntx) {
   string_view path = ArgS(args, 2);
 
   error_code ec;
-  JsonExpression expression = jsonpath::make_expression<JsonType>(path, ec);
+  JsonPathPtr expression = JsonPath::Compile(path, &ec);
 
   if (ec) {
     VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
@@ -1170,7 +1537,7 @@ void JsonFamily::ArrIndex(CmdArgList args, ConnectionContext* cntx) {
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpArrIndex(t->GetOpArgs(shard), key, move(expression), *search_value, start_index,
+    return OpArrIndex(t->GetOpArgs(shard), key, *expression, *search_value, start_index,
                       end_index);
   };
 
@@ -1300,7 +1667,7 @@ void JsonFamily::ArrPop(CmdArgList args, ConnectionContext* cntx) {
   }
 
   error_code ec;
-  JsonExpression expression = jsonpath::make_expression<JsonType>(path, ec);
+  JsonPathPtr expression = JsonPath::Compile(path, &ec);
 
   if (ec) {
     VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
@@ -1374,7 +1741,7 @@ void JsonFamily::ObjKeys(CmdArgList args, ConnectionContext* cntx) {
   string_view path = ArgS(args, 2);
 
   error_code ec;
-  JsonExpression expression = jsonpath::make_expression<JsonType>(path, ec);
+  JsonPathPtr expression = JsonPath::Compile(path, &ec);
 
   if (ec) {
     VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
@@ -1383,7 +1750,7 @@ void JsonFamily::ObjKeys(CmdArgList args, ConnectionContext* cntx) {
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpObjKeys(t->GetOpArgs(shard), key, move(expression));
+    return OpObjKeys(t->GetOpArgs(shard), key, *expression);
   };
 
   Transaction* trans = cntx->transaction;
@@ -1492,7 +1859,7 @@ void JsonFamily::Type(CmdArgList args, ConnectionContext* cntx) {
   string_view path = ArgS(args, 2);
 
   error_code ec;
-  JsonExpression expression = jsonpath::make_expression<JsonType>(path, ec);
+  JsonPathPtr expression = JsonPath::Compile(path, &ec);
 
   if (ec) {
     VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
@@ -1501,7 +1868,7 @@ void JsonFamily::Type(CmdArgList args, ConnectionContext* cntx) {
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpType(t->GetOpArgs(shard), key, move(expression));
+    return OpType(t->GetOpArgs(shard), key, *expression);
   };
 
   Transaction* trans = cntx->transaction;
@@ -1528,7 +1895,7 @@ void JsonFamily::ArrLen(CmdArgList args, ConnectionContext* cntx) {
   string_view path = ArgS(args, 2);
 
   error_code ec;
-  JsonExpression expression = jsonpath::make_expression<JsonType>(path, ec);
+  JsonPathPtr expression = JsonPath::Compile(path, &ec);
 
   if (ec) {
     VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
@@ -1537,7 +1904,7 @@ void JsonFamily::ArrLen(CmdArgList args, ConnectionContext* cntx) {
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpArrLen(t->GetOpArgs(shard), key, move(expression));
+    return OpArrLen(t->GetOpArgs(shard), key, *expression);
   };
 
   Transaction* trans = cntx->transaction;
@@ -1555,7 +1922,7 @@ void JsonFamily::ObjLen(CmdArgList args, ConnectionContext* cntx) {
   string_view path = ArgS(args, 2);
 
   error_code ec;
-  JsonExpression expression = jsonpath::make_expression<JsonType>(path, ec);
+  JsonPathPtr expression = JsonPath::Compile(path, &ec);
 
   if (ec) {
     VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
@@ -1564,7 +1931,7 @@ void JsonFamily::ObjLen(CmdArgList args, ConnectionContext* cntx) {
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpObjLen(t->GetOpArgs(shard), key, move(expression));
+    return OpObjLen(t->GetOpArgs(shard), key, *expression);
   };
 
   Transaction* trans = cntx->transaction;
@@ -1582,7 +1949,7 @@ void JsonFamily::StrLen(CmdArgList args, ConnectionContext* cntx) {
   string_view path = ArgS(args, 2);
 
   error_code ec;
-  JsonExpression expression = jsonpath::make_expression<JsonType>(path, ec);
+  JsonPathPtr expression = JsonPath::Compile(path, &ec);
 
   if (ec) {
     VLOG(1) << "Invalid JSONPath syntax: " << ec.message();
@@ -1591,7 +1958,7 @@ void JsonFamily::StrLen(CmdArgList args, ConnectionContext* cntx) {
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpStrLen(t->GetOpArgs(shard), key, move(expression));
+    return OpStrLen(t->GetOpArgs(shard), key, *expression);
   };
 
   Transaction* trans = cntx->transaction;
@@ -1608,12 +1975,12 @@ void JsonFamily::Get(CmdArgList args, ConnectionContext* cntx) {
   DCHECK_GE(args.size(), 2U);
   string_view key = ArgS(args, 1);
 
-  vector<pair<string_view, JsonExpression>> expressions;
+  vector<pair<string_view, JsonPathPtr>> expressions;
 
   for (size_t i = 2; i < args.size(); ++i) {
     string_view path = ArgS(args, i);
     error_code ec;
-    JsonExpression expr = jsonpath::make_expression<JsonType>(path, ec);
+    JsonPathPtr expr = JsonPath::Compile(path, &ec);
 
     if (ec) {
       LOG(WARNING) << "path '" << path << "': Invalid JSONPath syntax: " << ec.message();
@@ -1623,7 +1990,7 @@ void JsonFamily::Get(CmdArgList args, ConnectionContext* cntx) {
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpGet(t->GetOpArgs(shard), key, move(expressions));
+    return OpGet(t->GetOpArgs(shard), key, expressions);
   };
 
   Transaction* trans = cntx->transaction;
@@ -14,6 +14,8 @@ using namespace testing;
 using namespace std;
 using namespace util;
 
+ABSL_DECLARE_FLAG(bool, json_packed);
+
 namespace dfly {
 
 class JsonFamilyTest : public BaseFamilyTest {
@@ -941,4 +943,76 @@ TEST_F(JsonFamilyTest, Set) {
   EXPECT_EQ(resp, R"([{"a":[0,0,0,0,0]}])");
 }
 
+TEST_F(JsonFamilyTest, PathCache) {
+  string json = R"(
+    {"a":{"b":[1, {"c":"x"}, 3], "n":1}, "length":2}
+  )";
+
+  auto resp = Run({"JSON.SET", "json", ".", json});
+  ASSERT_THAT(resp, "OK");
+
+  // The simple paths are walked directly and select the same values as jsoncons does.
+  EXPECT_EQ(Run({"JSON.GET", "json", "$.a.b[1]"}), R"([{"c":"x"}])");
+  EXPECT_EQ(Run({"JSON.GET", "json", "$['a']['b'][1].c"}), R"(["x"])");
+  EXPECT_EQ(Run({"JSON.GET", "json", "$.a.b[1:2]"}), R"([{"c":"x"}])");
+  EXPECT_EQ(Run({"JSON.GET", "json", "$.a.b[3]"}), "[]");
+  EXPECT_EQ(Run({"JSON.GET", "json", "$.a.b.c"}), "[]");
+  EXPECT_EQ(Run({"JSON.GET", "json", "$.length"}), "[2]");
+  EXPECT_THAT(Run({"JSON.TYPE", "json", "$.a.n"}), "integer");
+
+  auto metrics = service_->server_family().GetMetrics();
+  size_t hits = metrics.conn_stats.json_path_cache_hits;
+  size_t misses = metrics.conn_stats.json_path_cache_misses;
+  for (unsigned i = 0; i < 3; ++i) {
+    EXPECT_EQ(Run({"JSON.GET", "json", "$.a.b[1]"}), R"([{"c":"x"}])");
+  }
+  metrics = service_->server_family().GetMetrics();
+  EXPECT_EQ(hits + 3, metrics.conn_stats.json_path_cache_hits);
+  EXPECT_EQ(misses, metrics.conn_stats.json_path_cache_misses);
+
+  // The writes get the normalized paths of the simple paths as well.
+  EXPECT_THAT(Run({"JSON.NUMINCRBY", "json", "$.a.b[2]", "4"}), "[7]");
+  EXPECT_THAT(Run({"JSON.NUMINCRBY", "json", "$.a.b[2]", "4"}), "[11]");
+  EXPECT_THAT(Run({"JSON.DEL", "json", "$.a.b[1]"}), IntArg(1));
+  EXPECT_EQ(Run({"JSON.GET", "json", "$.a"}), R"([{"b":[1,11],"n":1}])");
+}
+
+TEST_F(JsonFamilyTest, PackedDocuments) {
+  absl::FlagSaver saver;
+  absl::SetFlag(&FLAGS_json_packed, true);
+
+  string json = R"(
+    {"a":{"b":[1, {"c":"x"}, 3.5], "n":1, "t":true}, "s":"str\"q", "big":123456789012345678901}
+  )";
+  auto resp = Run({"JSON.SET", "json", "$", json});
+  ASSERT_THAT(resp, "OK");
+
+  // The root and the simple paths are printed from the packed form.
+  EXPECT_EQ(Run({"JSON.GET", "json"}),
+            R"({"a":{"b":[1,{"c":"x"},3.5],"n":1,"t":true},"big":123456789012345678901,)"
+            R"("s":"str\"q"})");
+  EXPECT_EQ(Run({"JSON.GET", "json", "$.a.b[1]"}), R"([{"c":"x"}])");
+  EXPECT_EQ(Run({"JSON.GET", "json", "$.a.x"}), "[]");
+  EXPECT_EQ(Run({"JSON.GET", "json", "$.a.n", "$.a.b[2]"}), R"({"$.a.b[2]":[3.5],"$.a.n":[1]})");
+  EXPECT_EQ(Run({"JSON.GET", "json", "$..c"}), R"(["x"])");
+  EXPECT_THAT(Run({"JSON.TYPE", "json", "$.a.b[2]"}), "number");
+  EXPECT_THAT(Run({"JSON.STRLEN", "json", "$.s"}), IntArg(5));
+  EXPECT_THAT(Run({"JSON.OBJLEN", "json", "$.a"}), IntArg(3));
+
+  // Numbers and booleans are replaced in place, the other values repack the document.
+  EXPECT_THAT(Run({"JSON.NUMINCRBY", "json", "$.a.n", "2"}), "[3]");
+  EXPECT_THAT(Run({"JSON.NUMMULTBY", "json", "$.a.b[2]", "3"}), "[10.5]");
+  EXPECT_THAT(Run({"JSON.TOGGLE", "json", "$.a.t"}), IntArg(0));
+  EXPECT_THAT(Run({"JSON.STRAPPEND", "json", "$.s", "!"}), IntArg(6));
+  EXPECT_THAT(Run({"JSON.ARRAPPEND", "json", "$.a.b", "4"}), IntArg(4));
+  EXPECT_THAT(Run({"JSON.DEL", "json", "$.a.b[1]"}), IntArg(1));
+  EXPECT_EQ(Run({"JSON.GET", "json", "$.a"}), R"([{"b":[1,10.5,4],"n":3,"t":false}])");
+  EXPECT_EQ(Run({"JSON.GET", "json", "$.s"}), R"(["str\"q!"])");
+
+  resp = Run({"JSON.SET", "json", "$.a.n", R"({"m":[]})"});
+  ASSERT_THAT(resp, "OK");
+  EXPECT_EQ(Run({"JSON.GET", "json", "$.a.n"}), R"([{"m":[]}])");
+  EXPECT_THAT(Run({"TYPE", "json"}), "ReJSON-RL");
+}
+
 }  // namespace dfly
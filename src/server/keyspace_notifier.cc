@@ -0,0 +1,198 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/keyspace_notifier.h"
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
+
+extern "C" {
+#include "redis/object.h"
+}
+
+#include "base/flags.h"
+#include "base/logging.h"
+#include "facade/dragonfly_connection.h"
+#include "server/channel_slice.h"
+#include "server/engine_shard_set.h"
+#include "server/server_state.h"
+
+ABSL_FLAG(uint32_t, notify_keyspace_max_pending, 100000,
+          "Maximum number of keyspace notifications that a shard buffers until it yields. "
+          "The events above it are dropped");
+
+ABSL_FLAG(uint32_t, notify_keyspace_max_queue, 10000,
+          "Keyspace notifications are dropped for a subscriber connection that has this many "
+          "messages and requests queued");
+
+namespace dfly {
+
+using namespace std;
+using namespace util;
+
+namespace {
+
+// The characters of the classes, in the order of the Class bits.
+constexpr char kClassChars[] = "KEg$lshzxetn";
+
+// The classes that "A" enables.
+constexpr uint32_t kAllClasses = KeyspaceNotifier::GENERIC | KeyspaceNotifier::STRING |
+                                 KeyspaceNotifier::LIST | KeyspaceNotifier::SET |
+                                 KeyspaceNotifier::HASH | KeyspaceNotifier::ZSET |
+                                 KeyspaceNotifier::EXPIRED | KeyspaceNotifier::EVICTED |
+                                 KeyspaceNotifier::STREAM;
+
+constexpr string_view kKeyspacePrefix = "__keyspace@";
+constexpr string_view kKeyeventPrefix = "__keyevent@";
+
+// A message of the batch of a thread and the subscriber it goes to.
+struct Delivery {
+  ChannelSlice::Subscriber subscriber;
+  shared_ptr<const string> buf;
+  uint32_t channel_len;
+};
+
+}  // namespace
+
+auto KeyspaceNotifier::Stats::operator+=(const Stats& o) -> Stats& {
+  events += o.events;
+  dropped += o.dropped;
+  batches += o.batches;
+
+  return *this;
+}
+
+optional<uint32_t> KeyspaceNotifier::ParseClasses(string_view flags) {
+  uint32_t res = 0;
+  for (char c : flags) {
+    if (c == 'A') {
+      res |= kAllClasses;
+      continue;
+    }
+
+    const char* pos = strchr(kClassChars, c);
+    if (c == '\0' || pos == nullptr)
+      return nullopt;
+    res |= 1u << (pos - kClassChars);
+  }
+  return res;
+}
+
+string KeyspaceNotifier::FormatClasses(uint32_t classes) {
+  string res;
+  if ((classes & kAllClasses) == kAllClasses) {
+    res = "A";
+    classes &= ~kAllClasses;
+  }
+
+  // The type classes first and the K, E and n flags after them, as redis lists them.
+  for (unsigned i = 2; i < 11; ++i) {
+    if (classes & (1u << i))
+      res.push_back(kClassChars[i]);
+  }
+  if (classes & KEYSPACE)
+    res.push_back('K');
+  if (classes & KEYEVENT)
+    res.push_back('E');
+  if (classes & NEW)
+    res.push_back('n');
+  return res;
+}
+
+auto KeyspaceNotifier::TypeClass(unsigned obj_type) -> Class {
+  switch (obj_type) {
+    case OBJ_STRING:
+      return STRING;
+    case OBJ_LIST:
+      return LIST;
+    case OBJ_SET:
+      return SET;
+    case OBJ_HASH:
+      return HASH;
+    case OBJ_ZSET:
+      return ZSET;
+    case OBJ_STREAM:
+      return STREAM;
+  }
+  return GENERIC;
+}
+
+bool KeyspaceNotifier::IsNotificationChannel(string_view channel) {
+  return absl::StartsWith(channel, kKeyspacePrefix) || absl::StartsWith(channel, kKeyeventPrefix);
+}
+
+void KeyspaceNotifier::Notify(string_view event, DbIndex db, string_view key) {
+  if (pending_.size() >= absl::GetFlag(FLAGS_notify_keyspace_max_pending)) {
+    ++stats_.dropped;
+    return;
+  }
+
+  ++stats_.events;
+  pending_.push_back(Event{absl::AsciiStrToLower(event), string{key}, db});
+
+  if (!flush_scheduled_) {
+    flush_scheduled_ = true;
+    ProactorBase::me()->DispatchBrief([this] { Flush(); });
+  }
+}
+
+void KeyspaceNotifier::Flush() {
+  flush_scheduled_ = false;
+  ++stats_.batches;
+
+  vector<Event> events = std::move(pending_);
+  pending_.clear();
+
+  ChannelSlice& cs = EngineShard::tlocal()->channel_slice();
+  absl::flat_hash_map<uint32_t, vector<Delivery>> by_thread;
+
+  // The channel and the message are copied once into a buffer that all the subscribers share.
+  auto publish = [&](string channel, string_view message) {
+    vector<ChannelSlice::Subscriber> subscribers = cs.FetchSubscribers(channel);
+    if (subscribers.empty())
+      return;
+
+    uint32_t channel_len = channel.size();
+    channel.append(message);
+    auto buf = make_shared<const string>(std::move(channel));
+    for (ChannelSlice::Subscriber& subscriber : subscribers) {
+      uint32_t tid = subscriber.thread_id;
+      by_thread[tid].push_back(Delivery{std::move(subscriber), buf, channel_len});
+    }
+  };
+
+  for (const Event& ev : events) {
+    if (classes_ & KEYSPACE)
+      publish(absl::StrCat(kKeyspacePrefix, ev.db, "__:", ev.key), ev.event);
+    if (classes_ & KEYEVENT)
+      publish(absl::StrCat(kKeyeventPrefix, ev.db, "__:", ev.event), ev.key);
+  }
+
+  // Hops once into every thread that has subscribers. The borrow tokens that FetchSubscribers
+  // took keep the connections alive until their messages are queued.
+  for (auto& [tid, deliveries] : by_thread) {
+    auto batch = make_shared<vector<Delivery>>(std::move(deliveries));
+    auto cb = [batch] {
+      size_t max_queue = absl::GetFlag(FLAGS_notify_keyspace_max_queue);
+      for (Delivery& delivery : *batch) {
+        facade::Connection* conn = delivery.subscriber.conn_cntx->owner();
+        if (conn->dispatch_queue_len() >= max_queue) {
+          ++ServerState::tl_connection_stats()->notify_dropped_cnt;
+        } else {
+          facade::Connection::PubMessage msg;
+          msg.pattern = std::move(delivery.subscriber.pattern);
+          msg.buf = std::move(delivery.buf);
+          msg.channel_len = delivery.channel_len;
+          conn->SendMsgVecAsync(std::move(msg));
+        }
+        delivery.subscriber.borrow_token.Dec();
+      }
+    };
+    shard_set->pool()->at(tid)->DispatchBrief(std::move(cb));
+  }
+}
+
+}  // namespace dfly
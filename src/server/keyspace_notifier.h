@@ -0,0 +1,109 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "server/common.h"
+
+namespace dfly {
+
+// Keyspace notifications, see CONFIG SET notify-keyspace-events. Every shard keeps a notifier
+// next to its DbSlice, which reports the writes of the commands, the deletions, the expired and
+// the evicted keys. The events of the enabled classes are buffered and published in a batch
+// once the shard yields, to the subscribers of __keyspace@<db>__:<key> and
+// __keyevent@<db>__:<event>. The subscriptions to these channels are kept in all the shards,
+// like the patterns, so that every shard finds the subscribers of its events locally.
+// The shard never waits for the subscribers: the events are dropped and counted when the buffer
+// of the shard or the queue of a subscriber connection is full.
+class KeyspaceNotifier {
+ public:
+  // The classes of notify-keyspace-events, by the characters that enable them.
+  enum Class : uint32_t {
+    KEYSPACE = 1 << 0,  // K
+    KEYEVENT = 1 << 1,  // E
+    GENERIC = 1 << 2,   // g
+    STRING = 1 << 3,    // $
+    LIST = 1 << 4,      // l
+    SET = 1 << 5,       // s
+    HASH = 1 << 6,      // h
+    ZSET = 1 << 7,      // z
+    EXPIRED = 1 << 8,   // x
+    EVICTED = 1 << 9,   // e
+    STREAM = 1 << 10,   // t
+    NEW = 1 << 11,      // n
+  };
+
+  struct Stats {
+    size_t events = 0;   // buffered by the shard.
+    size_t dropped = 0;  // because the buffer of the shard was full.
+    size_t batches = 0;
+
+    Stats& operator+=(const Stats& o);
+  };
+
+  // Returns nullopt if flags has an unknown character. "A" is an alias of "g$lshzxet".
+  static std::optional<uint32_t> ParseClasses(std::string_view flags);
+  static std::string FormatClasses(uint32_t classes);
+
+  // The class of the writes to values of the obj_type.
+  static Class TypeClass(unsigned obj_type);
+
+  static bool IsNotificationChannel(std::string_view channel);
+
+  void SetClasses(uint32_t classes) {
+    classes_ = classes;
+  }
+
+  uint32_t classes() const {
+    return classes_;
+  }
+
+  // Whether any event is published, it is the only cost of the notifications when they are off.
+  bool active() const {
+    return classes_ & (KEYSPACE | KEYEVENT);
+  }
+
+  bool Enabled(Class cls) const {
+    return active() && (classes_ & cls);
+  }
+
+  // The command that runs in the shard, its writes are notified with its name as the event.
+  void SetCommand(std::string_view name) {
+    command_ = name;
+  }
+
+  std::string_view command() const {
+    return command_;
+  }
+
+  // Buffers the event, the caller checks that its class is enabled.
+  void Notify(std::string_view event, DbIndex db, std::string_view key);
+
+  Stats GetStats() const {
+    return stats_;
+  }
+
+ private:
+  struct Event {
+    std::string event;
+    std::string key;
+    DbIndex db;
+  };
+
+  // Publishes the buffered events to the subscribers, grouped by their threads.
+  void Flush();
+
+  uint32_t classes_ = 0;
+  std::string_view command_;
+  std::vector<Event> pending_;
+  bool flush_scheduled_ = false;
+  Stats stats_;
+};
+
+}  // namespace dfly
@@ -0,0 +1,125 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/lazy_free.h"
+
+#include <mimalloc.h>
+
+#include <algorithm>
+
+#include "base/logging.h"
+#include "server/server_state.h"
+
+namespace dfly {
+
+using namespace std;
+
+#define ADD(x) (x) += o.x
+
+LazyFreeQueue::Stats& LazyFreeQueue::Stats::operator+=(const Stats& o) {
+  static_assert(sizeof(Stats) == 24);
+
+  ADD(pending_objects);
+  ADD(pending_bytes);
+  ADD(freed_objects);
+
+  return *this;
+}
+
+#undef ADD
+
+LazyFreeQueue::~LazyFreeQueue() {
+}
+
+bool LazyFreeQueue::IsLarge(const PrimeValue& pv) {
+  switch (pv.ObjType()) {
+    case OBJ_LIST:
+    case OBJ_SET:
+    case OBJ_HASH:
+    case OBJ_ZSET:
+      return !pv.IsExternal() && pv.Size() >= kMinElements;
+  }
+  return false;
+}
+
+void LazyFreeQueue::Add(PrimeValue* pv) {
+  size_t bytes = pv->MallocUsed();
+  values_.push_back(PendingValue{std::move(*pv), bytes});
+  pending_bytes_ += bytes;
+}
+
+void LazyFreeQueue::Add(boost::intrusive_ptr<DbTable> table) {
+  size_t bytes = table->stats.obj_memory_usage + table->prime.mem_usage();
+  tables_.push_back(PendingTable{std::move(table), PrimeTable::Cursor{}, bytes});
+  pending_bytes_ += bytes;
+}
+
+bool LazyFreeQueue::FreeStep(size_t budget) {
+  while (budget > 0 && !values_.empty()) {
+    PendingValue& pending = values_.front();
+    size_t elements = std::clamp<size_t>(pending.value.Size(), 1, budget);
+    budget -= elements;
+    if (!pending.value.FreeStep(elements))
+      continue;
+
+    pending.value.Reset();
+    pending_bytes_ -= pending.bytes;
+    ++freed_objects_;
+    values_.pop_front();
+  }
+
+  if (budget > 0 && !tables_.empty())
+    FreeTableStep(budget);
+
+  return !empty();
+}
+
+size_t LazyFreeQueue::FreeTableStep(size_t budget) {
+  PendingTable& pending = tables_.front();
+
+  // A snapshot that still reads the table releases it once it is done.
+  if (pending.table->use_count() > 1) {
+    pending_bytes_ -= pending.bytes;
+    tables_.pop_front();
+    return 0;
+  }
+
+  // The values are freed in the table, or moved to values_ if they are large, and the keys
+  // as well, so that destroying the table frees only its segments.
+  size_t freed = 0;
+  auto cb = [&](PrimeIterator it) {
+    if (IsLarge(it->second)) {
+      size_t bytes = std::min(it->second.MallocUsed(), pending.bytes);
+      pending.bytes -= bytes;
+      pending_bytes_ -= bytes;
+      Add(&it->second);
+    } else {
+      it->second.Reset();
+    }
+    it->first.Reset();
+    ++freed;
+  };
+
+  do {
+    pending.cursor = pending.table->prime.Traverse(pending.cursor, cb);
+  } while (pending.cursor && freed < budget);
+
+  if (!pending.cursor) {
+    pending_bytes_ -= pending.bytes;
+    ++freed_objects_;
+    tables_.pop_front();
+    mi_heap_collect(ServerState::tlocal()->data_heap(), true);
+  }
+  return freed;
+}
+
+auto LazyFreeQueue::GetStats() const -> Stats {
+  Stats res;
+  res.pending_objects = values_.size() + tables_.size();
+  res.pending_bytes = pending_bytes_;
+  res.freed_objects = freed_objects_;
+  return res;
+}
+
+}  // namespace dfly
@@ -0,0 +1,71 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <deque>
+
+#include "server/table.h"
+
+namespace dfly {
+
+// Values and tables that were detached from the shard and are destroyed in the background,
+// see UNLINK and FLUSHDB ASYNC. Destroying a container with millions of elements or a whole
+// table takes long enough to stall all the keys of the shard, hence the shard frees a bounded
+// number of elements at a time, when it is idle.
+class LazyFreeQueue {
+ public:
+  // Values with fewer elements are freed in place, as redis does.
+  static constexpr size_t kMinElements = 64;
+
+  struct Stats {
+    size_t pending_objects = 0;
+    size_t pending_bytes = 0;
+    size_t freed_objects = 0;
+
+    Stats& operator+=(const Stats& o);
+  };
+
+  ~LazyFreeQueue();
+
+  // Returns whether the value is large enough to be freed lazily.
+  static bool IsLarge(const PrimeValue& pv);
+
+  // Takes the value, which is left empty.
+  void Add(PrimeValue* pv);
+
+  // Takes the table, which is freed once it is not shared with snapshots anymore.
+  void Add(boost::intrusive_ptr<DbTable> table);
+
+  // Frees up to about budget elements. Returns false if there is nothing left to free.
+  bool FreeStep(size_t budget);
+
+  bool empty() const {
+    return values_.empty() && tables_.empty();
+  }
+
+  Stats GetStats() const;
+
+ private:
+  struct PendingValue {
+    PrimeValue value;
+    size_t bytes;
+  };
+
+  struct PendingTable {
+    boost::intrusive_ptr<DbTable> table;
+    PrimeTable::Cursor cursor;
+    size_t bytes;
+  };
+
+  // Frees up to about budget elements of the table at the front.
+  size_t FreeTableStep(size_t budget);
+
+  std::deque<PendingValue> values_;
+  std::deque<PendingTable> tables_;
+  size_t pending_bytes_ = 0;
+  size_t freed_objects_ = 0;
+};
+
+}  // namespace dfly
@@ -5,13 +5,13 @@
 
 extern "C" {
 #include "redis/object.h"
-#include "redis/sds.h"
 }
 
 #include <absl/strings/numbers.h>
 
 #include "base/flags.h"
 #include "base/logging.h"
+#include "core/chunked_list.h"
 #include "server/blocking_controller.h"
 #include "server/command_registry.h"
 #include "server/conn_context.h"
@@ -19,6 +19,7 @@ extern "C" {
 #include "server/engine_shard_set.h"
 #include "server/error.h"
 #include "server/server_state.h"
+#include "server/streamed_reply.h"
 #include "server/transaction.h"
 
 /**
@@ -40,7 +41,7 @@ ABSL_FLAG(int32_t, list_max_listpack_size, -2, "Maximum listpack size, default i
 
 /**
  * Lists may also be compressed.
- * Compress depth is the number of quicklist listpack nodes from *each* side of
+ * Compress depth is the number of listpack chunks from *each* side of
  * the list to *exclude* from compression.  The head and tail of the list
  * are always uncompressed for fast push/pop operations.  Settings are:
  * 0: disable all list compression
@@ -66,44 +67,25 @@ using absl::GetFlag;
 
 namespace {
 
-quicklist* GetQL(const PrimeValue& mv) {
-  return (quicklist*)mv.RObjPtr();
+ChunkedList* GetList(const PrimeValue& mv) {
+  DCHECK_EQ(kEncodingChunkedList, mv.Encoding());
+  return (ChunkedList*)mv.RObjPtr();
 }
 
-void* listPopSaver(unsigned char* data, size_t sz) {
-  return createStringObject((char*)data, sz);
+ChunkedList* NewList(PrimeValue* pv) {
+  ChunkedList* list = new ChunkedList(GetFlag(FLAGS_list_max_listpack_size),
+                                      GetFlag(FLAGS_list_compress_depth));
+  pv->InitRobj(OBJ_LIST, kEncodingChunkedList, list);
+  return list;
 }
 
-string ListPop(ListDir dir, quicklist* ql) {
-  long long vlong;
-  robj* value = NULL;
-
-  int ql_where = (dir == ListDir::LEFT) ? QUICKLIST_HEAD : QUICKLIST_TAIL;
-
-  // Empty list automatically removes the key (see below).
-  CHECK_EQ(1,
-           quicklistPopCustom(ql, ql_where, (unsigned char**)&value, NULL, &vlong, listPopSaver));
-  string res;
-  if (value) {
-    DCHECK(value->encoding == OBJ_ENCODING_EMBSTR || value->encoding == OBJ_ENCODING_RAW);
-    sds s = (sds)(value->ptr);
-    res = string{s, sdslen(s)};
-    decrRefCount(value);
-  } else {
-    res = absl::StrCat(vlong);
-  }
-
-  return res;
+inline ChunkedList::Where ToWhere(ListDir dir) {
+  return dir == ListDir::LEFT ? ChunkedList::HEAD : ChunkedList::TAIL;
 }
 
-bool ElemCompare(const quicklistEntry& entry, string_view elem) {
-  if (entry.value) {
-    return entry.sz == elem.size() &&
-           (entry.sz == 0 || memcmp(entry.value, elem.data(), entry.sz) == 0);
-  }
-
-  absl::AlphaNum an(entry.longval);
-  return elem == an.Piece();
+string ListPop(ListDir dir, ChunkedList* list) {
+  // Empty list automatically removes the key (see below).
+  return list->Pop(ToWhere(dir));
 }
 
 using FFResult = pair<PrimeKey, unsigned>;  // key, argument index.
@@ -176,34 +158,40 @@ OpResult<ShardFFResult> FindFirst(Transaction* trans) {
   return OpResult<ShardFFResult>{move(shard_result)};
 }
 
+// Pops up to count elements from the first non-empty list of the keys of the transaction.
 class BPopper {
  public:
-  explicit BPopper(ListDir dir);
+  BPopper(ListDir dir, uint32_t count);
 
-  // Returns WRONG_TYPE, OK.
-  // If OK is returned then use result() to fetch the value.
-  OpStatus Run(Transaction* t, unsigned msec);
+  // Returns WRONG_TYPE, OK or TIMED_OUT. If all the lists are empty, blocks for msec, or
+  // indefinitely if msec is 0, unless block is false or the transaction is multi.
+  // If OK is returned then use key() and values() to fetch the result.
+  OpStatus Run(Transaction* t, bool block, unsigned msec);
 
-  // returns (key, value) pair.
-  auto result() const {
-    return make_pair<string_view, string_view>(key_, value_);
+  string_view key() const {
+    return key_;
+  }
+
+  const StringVec& values() const {
+    return values_;
   }
 
  private:
   OpStatus Pop(Transaction* t, EngineShard* shard);
 
   ListDir dir_;
+  uint32_t count_;
 
   ShardFFResult ff_result_;
 
   string key_;
-  string value_;
+  StringVec values_;
 };
 
-BPopper::BPopper(ListDir dir) : dir_(dir) {
+BPopper::BPopper(ListDir dir, uint32_t count) : dir_(dir), count_(count) {
 }
 
-OpStatus BPopper::Run(Transaction* t, unsigned msec) {
+OpStatus BPopper::Run(Transaction* t, bool block, unsigned msec) {
   using time_point = Transaction::time_point;
 
   time_point tp =
@@ -216,7 +204,7 @@ OpStatus BPopper::Run(Transaction* t, unsigned msec) {
   OpResult<ShardFFResult> result = FindFirst(t);
 
   if (result.status() == OpStatus::KEY_NOTFOUND) {
-    if (is_multi) {
+    if (is_multi || !block) {
       // close transaction and return.
       auto cb = [](Transaction* t, EngineShard* shard) { return OpStatus::OK; };
       t->Execute(std::move(cb), true);
@@ -224,9 +212,19 @@ OpStatus BPopper::Run(Transaction* t, unsigned msec) {
       return OpStatus::TIMED_OUT;
     }
 
+    // A waiter of one element is woken once per pushed element. The ones that pop more are
+    // woken only while the list holds more than the waiters woken before are about to pop,
+    // so that a single push does not wake waiters that would find the list empty.
+    Transaction::KeyReadyChecker checker;
+    if (count_ > 1) {
+      checker = [count = count_](const PrimeValue& pv, string_view key, size_t awakened) {
+        return pv.ObjType() == OBJ_LIST && pv.Size() > awakened * count;
+      };
+    }
+
     // Block
     ++stats->num_blocked_clients;
-    bool wait_succeeded = t->WaitOnWatch(tp);
+    bool wait_succeeded = t->WaitOnWatch(tp, std::move(checker));
     --stats->num_blocked_clients;
 
     if (!wait_succeeded)
@@ -261,12 +259,16 @@ OpStatus BPopper::Pop(Transaction* t, EngineShard* shard) {
     auto it_res = db_slice.Find(t->db_context(), key_, OBJ_LIST);
     CHECK(it_res);  // must exist and must be ok.
     PrimeIterator it = *it_res;
-    quicklist* ql = GetQL(it->second);
+    ChunkedList* list = GetList(it->second);
 
     db_slice.PreUpdate(t->db_index(), it);
-    value_ = ListPop(dir_, ql);
+    uint32_t count = min<size_t>(count_, list->Size());
+    values_.reserve(count);
+    for (uint32_t i = 0; i < count; ++i) {
+      values_.push_back(ListPop(dir_, list));
+    }
     db_slice.PostUpdate(t->db_index(), it, key_);
-    if (quicklistCount(ql) == 0) {
+    if (list->Size() == 0) {
       CHECK(shard->db_slice().Del(t->db_index(), it));
     }
   }
@@ -282,20 +284,18 @@ OpResult<string> OpMoveSingleShard(const OpArgs& op_args, string_view src, strin
     return src_res.status();
 
   PrimeIterator src_it = *src_res;
-  quicklist* src_ql = GetQL(src_it->second);
+  ChunkedList* src_list = GetList(src_it->second);
 
   if (src == dest) {  // simple case.
     db_slice.PreUpdate(op_args.db_cntx.db_index, src_it);
-    string val = ListPop(src_dir, src_ql);
-
-    int pos = (dest_dir == ListDir::LEFT) ? QUICKLIST_HEAD : QUICKLIST_TAIL;
-    quicklistPush(src_ql, val.data(), val.size(), pos);
+    string val = ListPop(src_dir, src_list);
+    src_list->Push(val, ToWhere(dest_dir));
     db_slice.PostUpdate(op_args.db_cntx.db_index, src_it, src);
 
     return val;
   }
 
-  quicklist* dest_ql = nullptr;
+  ChunkedList* dest_list = nullptr;
   PrimeIterator dest_it;
   bool new_key = false;
   try {
@@ -305,32 +305,31 @@ OpResult<string> OpMoveSingleShard(const OpArgs& op_args, string_view src, strin
   }
 
   if (new_key) {
-    robj* obj = createQuicklistObject();
-    dest_ql = (quicklist*)obj->ptr;
-    quicklistSetOptions(dest_ql, GetFlag(FLAGS_list_max_listpack_size),
-                        GetFlag(FLAGS_list_compress_depth));
-    dest_it->second.ImportRObj(obj);
+    dest_list = NewList(&dest_it->second);
 
     // Insertion of dest could invalidate src_it. Find it again.
-    src_it = db_slice.GetTables(op_args.db_cntx.db_index).first->Find(src);
+    src_it = db_slice.GetPrimeTable(op_args.db_cntx.db_index)->Find(src);
   } else {
     if (dest_it->second.ObjType() != OBJ_LIST)
       return OpStatus::WRONG_TYPE;
 
-    dest_ql = GetQL(dest_it->second);
+    dest_list = GetList(dest_it->second);
     db_slice.PreUpdate(op_args.db_cntx.db_index, dest_it);
   }
 
   db_slice.PreUpdate(op_args.db_cntx.db_index, src_it);
 
-  string val = ListPop(src_dir, src_ql);
-  int pos = (dest_dir == ListDir::LEFT) ? QUICKLIST_HEAD : QUICKLIST_TAIL;
-  quicklistPush(dest_ql, val.data(), val.size(), pos);
+  string val = ListPop(src_dir, src_list);
+  dest_list->Push(val, ToWhere(dest_dir));
 
   db_slice.PostUpdate(op_args.db_cntx.db_index, src_it, src);
   db_slice.PostUpdate(op_args.db_cntx.db_index, dest_it, dest, !new_key);
 
-  if (quicklistCount(src_ql) == 0) {
+  // The blocked pops of a new dest are woken as by a push.
+  if (new_key && op_args.shard->blocking_controller())
+    op_args.shard->blocking_controller()->AwakeWatched(op_args.db_cntx.db_index, dest);
+
+  if (src_list->Size() == 0) {
     CHECK(db_slice.Del(op_args.db_cntx.db_index, src_it));
   }
 
@@ -348,17 +347,10 @@ OpResult<string> Peek(const OpArgs& op_args, string_view key, ListDir dir, bool
   if (!fetch)
     return OpStatus::OK;
 
-  quicklist* ql = GetQL(it_res.value()->second);
-  quicklistEntry entry = container_utils::QLEntry();
-  quicklistIter* iter = (dir == ListDir::LEFT) ? quicklistGetIterator(ql, AL_START_HEAD)
-                                               : quicklistGetIterator(ql, AL_START_TAIL);
-  CHECK(quicklistNext(iter, &entry));
-  quicklistReleaseIterator(iter);
-
-  if (entry.value)
-    return string(reinterpret_cast<char*>(entry.value), entry.sz);
-  else
-    return absl::StrCat(entry.longval);
+  ChunkedList* list = GetList(it_res.value()->second);
+  optional<string> res = list->At(dir == ListDir::LEFT ? 0 : -1);
+  CHECK(res);
+  return std::move(*res);
 }
 
 OpResult<uint32_t> OpPush(const OpArgs& op_args, std::string_view key, ListDir dir,
@@ -380,27 +372,21 @@ OpResult<uint32_t> OpPush(const OpArgs& op_args, std::string_view key, ListDir d
     }
   }
 
-  quicklist* ql = nullptr;
+  ChunkedList* list = nullptr;
 
   if (new_key) {
-    robj* o = createQuicklistObject();
-    ql = (quicklist*)o->ptr;
-    quicklistSetOptions(ql, GetFlag(FLAGS_list_max_listpack_size),
-                        GetFlag(FLAGS_list_compress_depth));
-    it->second.ImportRObj(o);
+    list = NewList(&it->second);
   } else {
     if (it->second.ObjType() != OBJ_LIST)
       return OpStatus::WRONG_TYPE;
     es->db_slice().PreUpdate(op_args.db_cntx.db_index, it);
-    ql = GetQL(it->second);
+    list = GetList(it->second);
   }
 
-  // Left push is LIST_HEAD.
-  int pos = (dir == ListDir::LEFT) ? QUICKLIST_HEAD : QUICKLIST_TAIL;
-
+  // Left push is the head.
+  ChunkedList::Where where = ToWhere(dir);
   for (auto v : vals) {
-    es->tmp_str1 = sdscpylen(es->tmp_str1, v.data(), v.size());
-    quicklistPush(ql, es->tmp_str1, sdslen(es->tmp_str1), pos);
+    list->Push(v, where);
   }
 
   if (new_key) {
@@ -413,7 +399,7 @@ OpResult<uint32_t> OpPush(const OpArgs& op_args, std::string_view key, ListDir d
     es->db_slice().PostUpdate(op_args.db_cntx.db_index, it, key, true);
   }
 
-  return quicklistCount(ql);
+  return list->Size();
 }
 
 OpResult<StringVec> OpPop(const OpArgs& op_args, string_view key, ListDir dir, uint32_t count,
@@ -424,34 +410,197 @@ OpResult<StringVec> OpPop(const OpArgs& op_args, string_view key, ListDir dir, u
     return it_res.status();
 
   PrimeIterator it = *it_res;
-  quicklist* ql = GetQL(it->second);
+  ChunkedList* list = GetList(it->second);
   db_slice.PreUpdate(op_args.db_cntx.db_index, it);
 
   StringVec res;
-  if (quicklistCount(ql) < count) {
-    count = quicklistCount(ql);
+  if (list->Size() < count) {
+    count = list->Size();
   }
   res.reserve(count);
 
   if (return_results) {
     for (unsigned i = 0; i < count; ++i) {
-      res.push_back(ListPop(dir, ql));
+      res.push_back(ListPop(dir, list));
     }
   } else {
     for (unsigned i = 0; i < count; ++i) {
-      ListPop(dir, ql);
+      ListPop(dir, list);
     }
   }
 
   db_slice.PostUpdate(op_args.db_cntx.db_index, it, key);
 
-  if (quicklistCount(ql) == 0) {
+  if (list->Size() == 0) {
     CHECK(db_slice.Del(op_args.db_cntx.db_index, it));
   }
 
   return res;
 }
 
+// Moves an element between the lists of a scheduled transaction in two hops. The first one
+// checks the types of the keys and peeks the element that the second one moves. If the source
+// list does not exist, the transaction is concluded only if conclude_missing is set, so that a
+// blocking move can wait on it.
+OpResult<string> OpMoveScheduled(Transaction* trans, string_view src, string_view dest,
+                                 ListDir src_dir, ListDir dest_dir, bool conclude_missing) {
+  // A key may appear twice in the arguments of its shard, if src == dest.
+  OpResult<string> find_res[2];
+  auto find_cb = [&](Transaction* t, EngineShard* shard) {
+    OpArgs op_args = t->GetOpArgs(shard);
+    for (string_view key : t->ShardArgsInShard(shard->shard_id())) {
+      if (key == src)
+        find_res[0] = Peek(op_args, src, src_dir, true);
+      if (key == dest)
+        find_res[1] = Peek(op_args, dest, src_dir, false);
+    }
+    return OpStatus::OK;
+  };
+  trans->Execute(move(find_cb), false);
+
+  if (!find_res[0] || find_res[1].status() == OpStatus::WRONG_TYPE) {
+    if (conclude_missing || find_res[0].status() != OpStatus::KEY_NOTFOUND) {
+      auto cb = [](Transaction* t, EngineShard* shard) { return OpStatus::OK; };
+      trans->Execute(move(cb), true);
+    }
+    return find_res[0] ? find_res[1] : find_res[0];
+  }
+
+  // Everything is ok, lets proceed with the mutations.
+  bool single_shard = trans->unique_shard_cnt() == 1;
+  auto move_cb = [&](Transaction* t, EngineShard* shard) {
+    OpArgs op_args = t->GetOpArgs(shard);
+    if (single_shard) {
+      find_res[0] = OpMoveSingleShard(op_args, src, dest, src_dir, dest_dir);
+      return OpStatus::OK;
+    }
+
+    string_view key = t->ShardArgsInShard(shard->shard_id()).front();
+    if (key == dest) {
+      string_view val{find_res[0].value()};
+      absl::Span<string_view> span{&val, 1};
+      OpPush(op_args, key, dest_dir, false, span);
+    } else {
+      OpPop(op_args, key, src_dir, 1, false);
+    }
+    return OpStatus::OK;
+  };
+  trans->Execute(move(move_cb), true);
+
+  return find_res[0];
+}
+
+void SendMoveResult(const OpResult<string>& result, ConnectionContext* cntx) {
+  if (result) {
+    return (*cntx)->SendBulkString(*result);
+  }
+
+  switch (result.status()) {
+    case OpStatus::KEY_NOTFOUND:
+      (*cntx)->SendNull();
+      break;
+
+    default:
+      (*cntx)->SendError(result.status());
+      break;
+  }
+}
+
+// Expects an upper case argument.
+optional<ListDir> ParseDir(string_view arg) {
+  if (arg == "LEFT")
+    return ListDir::LEFT;
+  if (arg == "RIGHT")
+    return ListDir::RIGHT;
+  return nullopt;
+}
+
+// Parses the timeout of a blocking command in seconds. Returns the error if it is invalid.
+const char* ParseTimeout(string_view arg, unsigned* msec) {
+  float timeout;
+  if (!absl::SimpleAtof(arg, &timeout)) {
+    return "timeout is not a float or out of range";
+  }
+  if (timeout < 0) {
+    return "timeout is negative";
+  }
+  *msec = unsigned(timeout * 1000);
+  return nullptr;
+}
+
+// Validates numkeys of LMPOP and BLMPOP at args[kNumPos], which the keys and the direction
+// follow. The positions of the keys are determined by it.
+template <size_t kNumPos> bool MPopValidator(CmdArgList args, ConnectionContext* cntx) {
+  uint32_t num_keys;
+  if (!absl::SimpleAtoi(ArgS(args, kNumPos), &num_keys) || num_keys == 0) {
+    (*cntx)->SendError("numkeys should be greater than 0");
+    return false;
+  }
+  if (num_keys > args.size() - kNumPos - 2) {
+    (*cntx)->SendError(kSyntaxErr);
+    return false;
+  }
+  return true;
+}
+
+// The progress of a streamed LRANGE.
+struct StreamRangeState {
+  StreamedReply reply{RedisReplyBuilder::ARRAY};
+  long from = 0;  // the index of the next element.
+  long end = 0;
+};
+
+OpStatus OpStreamRange(const OpArgs& op_args, string_view key, long start, long end,
+                       TimeSlice* slice, StreamRangeState* state) {
+  auto& db_slice = op_args.shard->db_slice();
+  auto it_res = db_slice.Find(op_args.db_cntx, key, OBJ_LIST);
+  if (!it_res) {
+    // Pinned keys do not move or get evicted, so only the first hop can miss the key.
+    DCHECK(!state->reply.started());
+    return it_res.status();
+  }
+
+  const PrimeValue& pv = it_res.value()->second;
+  if (!state->reply.started()) {
+    long llen = GetList(pv)->Size();
+    if (start < 0)
+      start = llen + start;
+    if (end < 0)
+      end = llen + end;
+    if (start < 0)
+      start = 0;
+
+    if (start > end || start >= llen) {
+      state->reply.Start(0);
+      return OpStatus::OK;
+    }
+
+    state->from = start;
+    state->end = min(end, llen - 1);
+    state->reply.Start(state->end - start + 1);
+  }
+
+  // The length is sent first, hence a list whose key could expire between the hops is read in
+  // one hop.
+  TimeSlice whole{0};
+  TimeSlice* hop_slice = pv.HasExpire() ? &whole : slice;
+
+  // The previous hop may have been interrupted after the last element.
+  if (state->from <= state->end) {
+    container_utils::IterateList(
+        pv,
+        [state, slice, hop_slice](container_utils::ContainerEntry ce) {
+          state->reply.Add(ce, slice);
+          ++state->from;
+          return !hop_slice->Exhausted();
+        },
+        state->from, state->end);
+  }
+
+  state->reply.EndHop(*slice, &db_slice);
+  return OpStatus::OK;
+}
+
 }  // namespace
 
 void ListFamily::LPush(CmdArgList args, ConnectionContext* cntx) {
@@ -637,16 +786,33 @@ void ListFamily::LRange(CmdArgList args, ConnectionContext* cntx) {
     return;
   }
 
-  auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpRange(t->GetOpArgs(shard), key, start, end);
+  // The replies of multi transactions and scripts are collected as usual.
+  if (!cntx->transaction->IsMulti()) {
+    RedisReplyBuilder* rb = cntx->operator->();
+    StreamRangeState state;
+    auto cb = [&](Transaction* t, EngineShard* shard, TimeSlice* slice) {
+      return OpStreamRange(t->GetOpArgs(shard), key, start, end, slice, &state);
+    };
+
+    OpStatus status =
+        cntx->transaction->ScheduleStreamed(std::move(cb), [&] { state.reply.Flush(rb); });
+    if (status != OpStatus::OK && status != OpStatus::KEY_NOTFOUND) {
+      return rb->SendError(status);
+    }
+    return state.reply.Finish(rb);
+  }
+
+  StringVec res;
+  auto cb = [&](Transaction* t, EngineShard* shard, TimeSlice* slice) {
+    return OpRange(t->GetOpArgs(shard), key, start, end, slice, &res);
   };
 
-  auto res = cntx->transaction->ScheduleSingleHopT(std::move(cb));
-  if (!res && res.status() != OpStatus::KEY_NOTFOUND) {
-    return (*cntx)->SendError(res.status());
+  OpStatus status = cntx->transaction->ScheduleSliced(std::move(cb));
+  if (status != OpStatus::OK && status != OpStatus::KEY_NOTFOUND) {
+    return (*cntx)->SendError(status);
   }
 
-  (*cntx)->SendStringArr(*res);
+  (*cntx)->SendStringArr(res);
 }
 
 // lrem key 5 foo, will remove foo elements from the list if exists at most 5 times.
@@ -705,55 +871,151 @@ void ListFamily::BRPop(CmdArgList args, ConnectionContext* cntx) {
 void ListFamily::LMove(CmdArgList args, ConnectionContext* cntx) {
   std::string_view src = ArgS(args, 1);
   std::string_view dest = ArgS(args, 2);
-  std::string_view src_dir_str = ArgS(args, 3);
-  std::string_view dest_dir_str = ArgS(args, 4);
 
   ToUpper(&args[3]);
   ToUpper(&args[4]);
 
-  ListDir src_dir;
-  ListDir dest_dir;
-  if (src_dir_str == "LEFT") {
-    src_dir = ListDir::LEFT;
-  } else if (src_dir_str == "RIGHT") {
-    src_dir = ListDir::RIGHT;
-  } else {
+  optional<ListDir> src_dir = ParseDir(ArgS(args, 3));
+  optional<ListDir> dest_dir = ParseDir(ArgS(args, 4));
+  if (!src_dir || !dest_dir) {
     return (*cntx)->SendError(kSyntaxErr);
   }
-  if (dest_dir_str == "LEFT") {
-    dest_dir = ListDir::LEFT;
-  } else if (dest_dir_str == "RIGHT") {
-    dest_dir = ListDir::RIGHT;
-  } else {
+
+  MoveGeneric(cntx, src, dest, *src_dir, *dest_dir);
+}
+
+// BLMOVE source destination LEFT|RIGHT LEFT|RIGHT timeout
+void ListFamily::BLMove(CmdArgList args, ConnectionContext* cntx) {
+  string_view src = ArgS(args, 1);
+  string_view dest = ArgS(args, 2);
+
+  ToUpper(&args[3]);
+  ToUpper(&args[4]);
+
+  optional<ListDir> src_dir = ParseDir(ArgS(args, 3));
+  optional<ListDir> dest_dir = ParseDir(ArgS(args, 4));
+  if (!src_dir || !dest_dir) {
     return (*cntx)->SendError(kSyntaxErr);
   }
 
-  MoveGeneric(cntx, src, dest, src_dir, dest_dir);
+  unsigned msec;
+  if (const char* error = ParseTimeout(ArgS(args, 5), &msec)) {
+    return (*cntx)->SendError(error);
+  }
+
+  // Multi transactions do not block, as with BLPOP.
+  Transaction* transaction = cntx->transaction;
+  if (transaction->IsMulti()) {
+    return MoveGeneric(cntx, src, dest, *src_dir, *dest_dir);
+  }
+
+  transaction->Schedule();
+  OpResult<string> result =
+      OpMoveScheduled(transaction, src, dest, *src_dir, *dest_dir, false);
+
+  if (result.status() == OpStatus::KEY_NOTFOUND) {
+    using time_point = Transaction::time_point;
+    time_point tp =
+        msec ? chrono::steady_clock::now() + chrono::milliseconds(msec) : time_point::max();
+
+    // Only a push to the source wakes the move, once per pushed element, like a BLPOP waiter.
+    // The woken transaction keeps the locks of both lists, so the move that follows is atomic
+    // and the waiters that share the source are not woken to find it empty.
+    auto ready_cb = [src](const PrimeValue& pv, string_view key, size_t awakened) {
+      return key == src && pv.ObjType() == OBJ_LIST && pv.Size() > awakened;
+    };
+
+    auto* stats = ServerState::tl_connection_stats();
+    ++stats->num_blocked_clients;
+    bool wait_succeeded = transaction->WaitOnWatch(tp, std::move(ready_cb));
+    --stats->num_blocked_clients;
+
+    if (!wait_succeeded) {
+      return (*cntx)->SendNull();
+    }
+    result = OpMoveScheduled(transaction, src, dest, *src_dir, *dest_dir, true);
+  }
+
+  SendMoveResult(result, cntx);
+}
+
+void ListFamily::LMPop(CmdArgList args, ConnectionContext* cntx) {
+  MPopGeneric(false, std::move(args), cntx);
+}
+
+void ListFamily::BLMPop(CmdArgList args, ConnectionContext* cntx) {
+  MPopGeneric(true, std::move(args), cntx);
+}
+
+// LMPOP numkeys key [key ...] LEFT|RIGHT [COUNT count]
+// BLMPOP timeout numkeys key [key ...] LEFT|RIGHT [COUNT count]
+void ListFamily::MPopGeneric(bool blocking, CmdArgList args, ConnectionContext* cntx) {
+  unsigned msec = 0;
+  if (blocking) {
+    if (const char* error = ParseTimeout(ArgS(args, 1), &msec)) {
+      return (*cntx)->SendError(error);
+    }
+  }
+
+  // Validated by MPopValidator.
+  size_t num_pos = blocking ? 2 : 1;
+  uint32_t num_keys = 0;
+  CHECK(absl::SimpleAtoi(ArgS(args, num_pos), &num_keys));
+  size_t dir_pos = num_pos + 1 + num_keys;
+
+  ToUpper(&args[dir_pos]);
+  optional<ListDir> dir = ParseDir(ArgS(args, dir_pos));
+  if (!dir) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  uint32_t count = 1;
+  for (size_t i = dir_pos + 1; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    if (ArgS(args, i) == "COUNT" && i + 1 < args.size()) {
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &count) || count == 0) {
+        return (*cntx)->SendError("count should be greater than 0");
+      }
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
+  BPopper popper(*dir, count);
+  OpStatus result = popper.Run(cntx->transaction, blocking, msec);
+
+  switch (result) {
+    case OpStatus::OK:
+      (*cntx)->StartArray(2);
+      (*cntx)->SendBulkString(popper.key());
+      return (*cntx)->SendStringArr(popper.values());
+    case OpStatus::WRONG_TYPE:
+      return (*cntx)->SendError(kWrongTypeErr);
+    case OpStatus::TIMED_OUT:
+      return (*cntx)->SendNullArray();
+    default:
+      LOG(ERROR) << "Unexpected error " << result;
+  }
+  return (*cntx)->SendNullArray();
 }
 
 void ListFamily::BPopGeneric(ListDir dir, CmdArgList args, ConnectionContext* cntx) {
   DCHECK_GE(args.size(), 3u);
 
-  float timeout;
-  auto timeout_str = ArgS(args, args.size() - 1);
-  if (!absl::SimpleAtof(timeout_str, &timeout)) {
-    return (*cntx)->SendError("timeout is not a float or out of range");
+  unsigned msec;
+  if (const char* error = ParseTimeout(ArgS(args, args.size() - 1), &msec)) {
+    return (*cntx)->SendError(error);
   }
-  if (timeout < 0) {
-    return (*cntx)->SendError("timeout is negative");
-  }
-  VLOG(1) << "BLPop start " << timeout;
+  VLOG(1) << "BLPop start " << msec;
 
   Transaction* transaction = cntx->transaction;
-  BPopper popper(dir);
-  OpStatus result = popper.Run(transaction, unsigned(timeout * 1000));
+  BPopper popper(dir, 1);
+  OpStatus result = popper.Run(transaction, true, msec);
 
   if (result == OpStatus::OK) {
-    auto res = popper.result();
-
-    VLOG(1) << "BLPop returned from " << res.first;  // key.
+    VLOG(1) << "BLPop returned from " << popper.key();
 
-    std::string_view str_arr[2] = {res.first, res.second};
+    std::string_view str_arr[2] = {popper.key(), popper.values().front()};
 
     return (*cntx)->SendStringArr(str_arr);
   }
@@ -852,64 +1114,11 @@ void ListFamily::MoveGeneric(ConnectionContext* cntx, string_view src, string_vi
     result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
   } else {
     CHECK_EQ(2u, cntx->transaction->unique_shard_cnt());
-
-    OpResult<string> find_res[2];
-
-    // Transaction is comprised of 2 hops:
-    // 1 - check for entries existence, their types and if possible -
-    //     read the value we may move from the source list.
-    // 2.  If everything is ok, pop from source and push the peeked value into
-    //     the destination.
-    //
     cntx->transaction->Schedule();
-    auto cb = [&](Transaction* t, EngineShard* shard) {
-      auto args = t->ShardArgsInShard(shard->shard_id());
-      DCHECK_EQ(1u, args.size());
-      bool is_dest = args.front() == dest;
-      find_res[is_dest] = Peek(t->GetOpArgs(shard), args.front(), src_dir, !is_dest);
-      return OpStatus::OK;
-    };
-
-    cntx->transaction->Execute(move(cb), false);
-
-    if (!find_res[0] || find_res[1].status() == OpStatus::WRONG_TYPE) {
-      auto cb = [&](Transaction* t, EngineShard* shard) { return OpStatus::OK; };
-      cntx->transaction->Execute(move(cb), true);
-      result = find_res[0] ? find_res[1] : find_res[0];
-    } else {
-      // Everything is ok, lets proceed with the mutations.
-      auto cb = [&](Transaction* t, EngineShard* shard) {
-        auto args = t->ShardArgsInShard(shard->shard_id());
-        bool is_dest = args.front() == dest;
-        OpArgs op_args = t->GetOpArgs(shard);
-
-        if (is_dest) {
-          string_view val{find_res[0].value()};
-          absl::Span<string_view> span{&val, 1};
-          OpPush(op_args, args.front(), dest_dir, false, span);
-        } else {
-          OpPop(op_args, args.front(), src_dir, 1, false);
-        }
-        return OpStatus::OK;
-      };
-      cntx->transaction->Execute(move(cb), true);
-      result = std::move(find_res[0].value());
-    }
-  }
-
-  if (result) {
-    return (*cntx)->SendBulkString(*result);
+    result = OpMoveScheduled(cntx->transaction, src, dest, src_dir, dest_dir, true);
   }
 
-  switch (result.status()) {
-    case OpStatus::KEY_NOTFOUND:
-      (*cntx)->SendNull();
-      break;
-
-    default:
-      (*cntx)->SendError(result.status());
-      break;
-  }
+  SendMoveResult(result, cntx);
 }
 
 OpResult<uint32_t> ListFamily::OpLen(const OpArgs& op_args, std::string_view key) {
@@ -917,32 +1126,21 @@ OpResult<uint32_t> ListFamily::OpLen(const OpArgs& op_args, std::string_view key
   if (!res)
     return res.status();
 
-  quicklist* ql = GetQL(res.value()->second);
+  ChunkedList* list = GetList(res.value()->second);
 
-  return quicklistCount(ql);
+  return list->Size();
 }
 
 OpResult<string> ListFamily::OpIndex(const OpArgs& op_args, std::string_view key, long index) {
   auto res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_LIST);
   if (!res)
     return res.status();
-  quicklist* ql = GetQL(res.value()->second);
-  quicklistEntry entry = container_utils::QLEntry();
-  quicklistIter* iter = quicklistGetIteratorAtIdx(ql, AL_START_TAIL, index);
-  if (!iter)
+  ChunkedList* list = GetList(res.value()->second);
+  optional<string> str = list->At(index);
+  if (!str)
     return OpStatus::KEY_NOTFOUND;
 
-  quicklistNext(iter, &entry);
-  string str;
-
-  if (entry.value) {
-    str.assign(reinterpret_cast<char*>(entry.value), entry.sz);
-  } else {
-    str = absl::StrCat(entry.longval);
-  }
-  quicklistReleaseIterator(iter);
-
-  return str;
+  return std::move(*str);
 }
 
 OpResult<vector<uint32_t>> ListFamily::OpPos(const OpArgs& op_args, std::string_view key,
@@ -952,40 +1150,34 @@ OpResult<vector<uint32_t>> ListFamily::OpPos(const OpArgs& op_args, std::string_
   if (!it_res.ok())
     return it_res.status();
 
-  int direction = AL_START_HEAD;
+  bool reverse = false;
   if (rank < 0) {
     rank = -rank;
-    direction = AL_START_TAIL;
+    reverse = true;
   }
 
-  quicklist* ql = GetQL(it_res.value()->second);
-  quicklistIter* ql_iter = quicklistGetIterator(ql, direction);
-  quicklistEntry entry;
-
-  int index = 0;
+  ChunkedList* list = GetList(it_res.value()->second);
+  ChunkedList::Pattern pattern(element);
+  size_t limit = max_len == 0 ? list->Size() : max_len;
+  size_t index = 0;
   int matched = 0;
   vector<uint32_t> matches;
-  string str;
 
-  while (quicklistNext(ql_iter, &entry) && (max_len == 0 || index < max_len)) {
-    if (entry.value) {
-      str.assign(reinterpret_cast<char*>(entry.value), entry.sz);
-    } else {
-      str = absl::StrCat(entry.longval);
-    }
-    if (str == element) {
-      matched++;
-      auto k = (direction == AL_START_TAIL) ? ql->count - index - 1 : index;
-      if (matched >= rank) {
-        matches.push_back(k);
-        if (count && matched - rank + 1 >= count) {
-          break;
-        }
+  for (auto it = list->GetIterator(reverse ? -1 : 0, reverse); index < limit;
+       it.Next(), ++index) {
+    index += it.Seek(pattern, limit - index);
+    if (it.Done() || index >= limit)
+      break;
+
+    matched++;
+    auto k = reverse ? list->Size() - index - 1 : index;
+    if (matched >= rank) {
+      matches.push_back(k);
+      if (count && matched - rank + 1 >= count) {
+        break;
       }
     }
-    index++;
   }
-  quicklistReleaseIterator(ql_iter);
   return matches;
 }
 
@@ -996,32 +1188,21 @@ OpResult<int> ListFamily::OpInsert(const OpArgs& op_args, string_view key, strin
   if (!it_res)
     return it_res.status();
 
-  quicklist* ql = GetQL(it_res.value()->second);
-  quicklistEntry entry = container_utils::QLEntry();
-  quicklistIter* qiter = quicklistGetIterator(ql, AL_START_HEAD);
-  bool found = false;
+  ChunkedList* list = GetList(it_res.value()->second);
+  auto it = list->GetIterator(0);
+  it.Seek(ChunkedList::Pattern(pivot));
+  if (it.Done())
+    return -1;
 
-  while (quicklistNext(qiter, &entry)) {
-    if (ElemCompare(entry, pivot)) {
-      found = true;
-      break;
-    }
-  }
-
-  int res = -1;
-  if (found) {
-    db_slice.PreUpdate(op_args.db_cntx.db_index, *it_res);
-    if (insert_param == LIST_TAIL) {
-      quicklistInsertAfter(qiter, &entry, elem.data(), elem.size());
-    } else {
-      DCHECK_EQ(LIST_HEAD, insert_param);
-      quicklistInsertBefore(qiter, &entry, elem.data(), elem.size());
-    }
-    db_slice.PostUpdate(op_args.db_cntx.db_index, *it_res, key);
-    res = quicklistCount(ql);
+  db_slice.PreUpdate(op_args.db_cntx.db_index, *it_res);
+  if (insert_param == LIST_TAIL) {
+    list->Insert(std::move(it), elem, ChunkedList::TAIL);
+  } else {
+    DCHECK_EQ(LIST_HEAD, insert_param);
+    list->Insert(std::move(it), elem, ChunkedList::HEAD);
   }
-  quicklistReleaseIterator(qiter);
-  return res;
+  db_slice.PostUpdate(op_args.db_cntx.db_index, *it_res, key);
+  return list->Size();
 }
 
 OpResult<uint32_t> ListFamily::OpRem(const OpArgs& op_args, string_view key, string_view elem,
@@ -1033,35 +1214,31 @@ OpResult<uint32_t> ListFamily::OpRem(const OpArgs& op_args, string_view key, str
     return it_res.status();
 
   PrimeIterator it = *it_res;
-  quicklist* ql = GetQL(it->second);
+  ChunkedList* list = GetList(it->second);
 
-  int iter_direction = AL_START_HEAD;
-  long long index = 0;
+  bool reverse = false;
   if (count < 0) {
     count = -count;
-    iter_direction = AL_START_TAIL;
-    index = -1;
+    reverse = true;
   }
 
-  quicklistIter* qiter = quicklistGetIteratorAtIdx(ql, iter_direction, index);
-  quicklistEntry entry;
+  ChunkedList::Pattern pattern(elem);
   unsigned removed = 0;
-  const uint8_t* elem_ptr = reinterpret_cast<const uint8_t*>(elem.data());
 
   db_slice.PreUpdate(op_args.db_cntx.db_index, it);
-  while (quicklistNext(qiter, &entry)) {
-    if (quicklistCompare(&entry, elem_ptr, elem.size())) {
-      quicklistDelEntry(qiter, &entry);
-      removed++;
-      if (count && removed == count)
-        break;
-    }
+  for (auto list_it = list->GetIterator(reverse ? -1 : 0, reverse);;) {
+    list_it.Seek(pattern);
+    if (list_it.Done())
+      break;
+
+    list->Erase(&list_it);
+    removed++;
+    if (count && removed == count)
+      break;
   }
   db_slice.PostUpdate(op_args.db_cntx.db_index, it, key);
 
-  quicklistReleaseIterator(qiter);
-
-  if (quicklistCount(ql) == 0) {
+  if (list->Size() == 0) {
     CHECK(db_slice.Del(op_args.db_cntx.db_index, it));
   }
 
@@ -1076,10 +1253,10 @@ OpStatus ListFamily::OpSet(const OpArgs& op_args, string_view key, string_view e
     return it_res.status();
 
   PrimeIterator it = *it_res;
-  quicklist* ql = GetQL(it->second);
+  ChunkedList* list = GetList(it->second);
 
   db_slice.PreUpdate(op_args.db_cntx.db_index, it);
-  int replaced = quicklistReplaceAtIndex(ql, index, elem.data(), elem.size());
+  bool replaced = list->Replace(index, elem);
   db_slice.PostUpdate(op_args.db_cntx.db_index, it, key);
 
   if (!replaced) {
@@ -1095,8 +1272,8 @@ OpStatus ListFamily::OpTrim(const OpArgs& op_args, string_view key, long start,
     return it_res.status();
 
   PrimeIterator it = *it_res;
-  quicklist* ql = GetQL(it->second);
-  long llen = quicklistCount(ql);
+  ChunkedList* list = GetList(it->second);
+  long llen = list->Size();
 
   /* convert negative indexes */
   if (start < 0)
@@ -1122,24 +1299,28 @@ OpStatus ListFamily::OpTrim(const OpArgs& op_args, string_view key, long start,
   }
 
   db_slice.PreUpdate(op_args.db_cntx.db_index, it);
-  quicklistDelRange(ql, 0, ltrim);
-  quicklistDelRange(ql, -rtrim, rtrim);
+  list->Erase(0, ltrim);
+  if (rtrim > 0)
+    list->Erase(-rtrim, rtrim);
   db_slice.PostUpdate(op_args.db_cntx.db_index, it, key);
 
-  if (quicklistCount(ql) == 0) {
+  if (list->Size() == 0) {
     CHECK(db_slice.Del(op_args.db_cntx.db_index, it));
   }
   return OpStatus::OK;
 }
 
-OpResult<StringVec> ListFamily::OpRange(const OpArgs& op_args, std::string_view key, long start,
-                                        long end) {
-  auto res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_LIST);
-  if (!res)
-    return res.status();
+OpStatus ListFamily::OpRange(const OpArgs& op_args, std::string_view key, long start, long end,
+                             TimeSlice* slice, StringVec* res) {
+  auto it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_LIST);
+  if (!it_res) {
+    // The key could also expire between the slices, then it is read as missing.
+    res->clear();
+    return it_res.status();
+  }
 
-  quicklist* ql = GetQL(res.value()->second);
-  long llen = quicklistCount(ql);
+  ChunkedList* list = GetList(it_res.value()->second);
+  long llen = list->Size();
 
   /* convert negative indexes */
   if (start < 0)
@@ -1153,19 +1334,25 @@ OpResult<StringVec> ListFamily::OpRange(const OpArgs& op_args, std::string_view
    * The range is empty when start > end or start >= length. */
   if (start > end || start >= llen) {
     /* Out of range start or start > end result in empty list */
-    return StringVec{};
+    return OpStatus::OK;
   }
 
-  StringVec str_vec;
+  end = min(end, llen - 1);
+  long from = start + res->size();
+  if (from > end)  // the previous slice was interrupted after the last element.
+    return OpStatus::OK;
+
+  if (res->empty())
+    res->reserve(end - start + 1);
   container_utils::IterateList(
-      res.value()->second,
-      [&str_vec](container_utils::ContainerEntry ce) {
-        str_vec.emplace_back(ce.ToString());
-        return true;
+      it_res.value()->second,
+      [res, slice](container_utils::ContainerEntry ce) {
+        res->emplace_back(ce.ToString());
+        return !slice->Exhausted();
       },
-      start, end);
+      from, end);
 
-  return str_vec;
+  return OpStatus::OK;
 }
 
 using CI = CommandId;
@@ -1173,6 +1360,10 @@ using CI = CommandId;
 #define HFUNC(x) SetHandler(&ListFamily::x)
 
 void ListFamily::Register(CommandRegistry* registry) {
+  // The keys of the blocking pops are tried in the order of the arguments.
+  constexpr uint32_t kBPopMask = CO::WRITE | CO::NOSCRIPT | CO::BLOCKING | CO::REVERSE_MAPPING;
+  constexpr uint32_t kBMoveMask = CO::WRITE | CO::NOSCRIPT | CO::BLOCKING | CO::DENYOOM;
+
   *registry << CI{"LPUSH", CO::WRITE | CO::FAST | CO::DENYOOM, -3, 1, 1, 1}.HFUNC(LPush)
             << CI{"LPUSHX", CO::WRITE | CO::FAST | CO::DENYOOM, -3, 1, 1, 1}.HFUNC(LPushX)
             << CI{"LPOP", CO::WRITE | CO::FAST | CO::DENYOOM, -2, 1, 1, 1}.HFUNC(LPop)
@@ -1180,8 +1371,14 @@ void ListFamily::Register(CommandRegistry* registry) {
             << CI{"RPUSHX", CO::WRITE | CO::FAST | CO::DENYOOM, -3, 1, 1, 1}.HFUNC(RPushX)
             << CI{"RPOP", CO::WRITE | CO::FAST | CO::DENYOOM, -2, 1, 1, 1}.HFUNC(RPop)
             << CI{"RPOPLPUSH", CO::WRITE | CO::FAST | CO::DENYOOM, 3, 1, 2, 1}.HFUNC(RPopLPush)
-            << CI{"BLPOP", CO::WRITE | CO::NOSCRIPT | CO::BLOCKING, -3, 1, -2, 1}.HFUNC(BLPop)
-            << CI{"BRPOP", CO::WRITE | CO::NOSCRIPT | CO::BLOCKING, -3, 1, -2, 1}.HFUNC(BRPop)
+            << CI{"BLPOP", kBPopMask, -3, 1, -2, 1}.HFUNC(BLPop)
+            << CI{"BRPOP", kBPopMask, -3, 1, -2, 1}.HFUNC(BRPop)
+            << CI{"LMPOP", CO::WRITE | CO::VARIADIC_KEYS | CO::REVERSE_MAPPING, -4, 2, 2, 1}
+                   .HFUNC(LMPop)
+                   .SetValidator(&MPopValidator<1>)
+            << CI{"BLMPOP", kBPopMask | CO::VARIADIC_KEYS, -5, 3, 3, 1}
+                   .HFUNC(BLMPop)
+                   .SetValidator(&MPopValidator<2>)
             << CI{"LLEN", CO::READONLY | CO::FAST, 2, 1, 1, 1}.HFUNC(LLen)
             << CI{"LPOS", CO::READONLY | CO::FAST, -3, 1, 1, 1}.HFUNC(LPos)
             << CI{"LINDEX", CO::READONLY, 3, 1, 1, 1}.HFUNC(LIndex)
@@ -1190,7 +1387,8 @@ void ListFamily::Register(CommandRegistry* registry) {
             << CI{"LSET", CO::WRITE | CO::DENYOOM, 4, 1, 1, 1}.HFUNC(LSet)
             << CI{"LTRIM", CO::WRITE, 4, 1, 1, 1}.HFUNC(LTrim)
             << CI{"LREM", CO::WRITE, 4, 1, 1, 1}.HFUNC(LRem)
-            << CI{"LMOVE", CO::WRITE | CO::DENYOOM, 5, 1, 2, 1}.HFUNC(LMove);
+            << CI{"LMOVE", CO::WRITE | CO::DENYOOM, 5, 1, 2, 1}.HFUNC(LMove)
+            << CI{"BLMOVE", kBMoveMask, 6, 1, 2, 1}.HFUNC(BLMove);
 }
 
 }  // namespace dfly
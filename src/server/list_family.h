@@ -14,6 +14,7 @@ using facade::OpResult;
 class ConnectionContext;
 class CommandRegistry;
 class EngineShard;
+class TimeSlice;
 
 class ListFamily {
  public:
@@ -28,6 +29,8 @@ class ListFamily {
   static void RPop(CmdArgList args, ConnectionContext* cntx);
   static void BLPop(CmdArgList args, ConnectionContext* cntx);
   static void BRPop(CmdArgList args, ConnectionContext* cntx);
+  static void LMPop(CmdArgList args, ConnectionContext* cntx);
+  static void BLMPop(CmdArgList args, ConnectionContext* cntx);
   static void LLen(CmdArgList args, ConnectionContext* cntx);
   static void LPos(CmdArgList args, ConnectionContext* cntx);
   static void LIndex(CmdArgList args, ConnectionContext* cntx);
@@ -38,6 +41,7 @@ class ListFamily {
   static void LSet(CmdArgList args, ConnectionContext* cntx);
   static void RPopLPush(CmdArgList args, ConnectionContext* cntx);
   static void LMove(CmdArgList args, ConnectionContext* cntx);
+  static void BLMove(CmdArgList args, ConnectionContext* cntx);
 
   static void PopGeneric(ListDir dir, CmdArgList args, ConnectionContext* cntx);
   static void PushGeneric(ListDir dir, bool skip_notexist, CmdArgList args,
@@ -46,6 +50,7 @@ class ListFamily {
                           ListDir src_dir, ListDir dest_dir);
 
   static void BPopGeneric(ListDir dir, CmdArgList args, ConnectionContext* cntx);
+  static void MPopGeneric(bool blocking, CmdArgList args, ConnectionContext* cntx);
 
   static OpResult<uint32_t> OpLen(const OpArgs& op_args, std::string_view key);
   static OpResult<std::string> OpIndex(const OpArgs& op_args, std::string_view key, long index);
@@ -61,8 +66,10 @@ class ListFamily {
                                 long count);
   static facade::OpStatus OpTrim(const OpArgs& op_args, std::string_view key, long start, long end);
 
-  static OpResult<StringVec> OpRange(const OpArgs& op_args, std::string_view key, long start,
-                                     long end);
+  // Appends the elements start..end of the list to res. Resumes after the elements already in
+  // res if its previous slice was interrupted.
+  static facade::OpStatus OpRange(const OpArgs& op_args, std::string_view key, long start,
+                                  long end, TimeSlice* slice, StringVec* res);
 };
 
 }  // namespace dfly
@@ -4,8 +4,10 @@
 
 #include "server/list_family.h"
 
+#include <absl/flags/reflection.h>
 #include <absl/strings/match.h>
 
+#include "base/flags.h"
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "facade/facade_test.h"
@@ -16,6 +18,9 @@
 #include "server/test_utils.h"
 #include "server/transaction.h"
 
+ABSL_DECLARE_FLAG(int32_t, list_compress_depth);
+ABSL_DECLARE_FLAG(int32_t, list_max_listpack_size);
+
 using namespace testing;
 using namespace std;
 using namespace util;
@@ -621,6 +626,164 @@ TEST_F(ListFamilyTest, LMove) {
   ASSERT_THAT(Run({"lmove", kKey1, kKey1, "LEFT", "R"}), ArgType(RespExpr::ERROR));
 }
 
+TEST_F(ListFamilyTest, BLPopWakesAsManyAsPushed) {
+  constexpr unsigned kWaiters = 3;
+  vector<RespExpr> resp(kWaiters);
+  atomic_uint popped{0};
+  vector<fibers_ext::Fiber> fbs;
+  for (unsigned i = 0; i < kWaiters; ++i) {
+    fbs.push_back(pp_->at(i % 2)->LaunchFiber([&, i] {
+      resp[i] = Run(absl::StrCat("w", i), {"blpop", kKey1, "0"});
+      popped.fetch_add(1);
+    }));
+  }
+
+  while (service_->server_family().GetMetrics().conn_stats.num_blocked_clients < kWaiters) {
+    fibers_ext::SleepFor(1ms);
+  }
+
+  // Two items wake exactly two waiters, the third one keeps waiting.
+  Run({"lpush", kKey1, "A", "B"});
+  while (popped.load() < 2) {
+    fibers_ext::SleepFor(1ms);
+  }
+  fibers_ext::SleepFor(5ms);
+  EXPECT_EQ(2u, popped.load());
+  EXPECT_EQ(0, CheckedInt({"exists", kKey1}));
+
+  Run({"lpush", kKey1, "C"});
+  for (auto& fb : fbs) {
+    fb.Join();
+  }
+
+  vector<string> values;
+  for (const auto& r : resp) {
+    ASSERT_THAT(r, ArrLen(2));
+    values.emplace_back(ToSV(r.GetVec()[1].GetBuf()));
+  }
+  EXPECT_THAT(values, UnorderedElementsAre("A", "B", "C"));
+}
+
+TEST_F(ListFamilyTest, LMPop) {
+  EXPECT_THAT(Run({"lmpop", "1", kKey1, "left"}), ArgType(RespExpr::NIL_ARRAY));
+  Run({"rpush", kKey2, "1", "2", "3"});
+  Run({"rpush", kKey3, "4"});
+
+  // The first non-empty list in the order of the arguments.
+  auto resp = Run({"lmpop", "3", kKey1, kKey3, kKey2, "LEFT"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_EQ(kKey3, resp.GetVec()[0]);
+  EXPECT_THAT(resp.GetVec()[1].GetVec(), ElementsAre("4"));
+
+  resp = Run({"lmpop", "2", kKey1, kKey2, "right", "count", "2"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_EQ(kKey2, resp.GetVec()[0]);
+  EXPECT_THAT(resp.GetVec()[1].GetVec(), ElementsAre("3", "2"));
+  resp = Run({"lmpop", "1", kKey2, "left", "count", "5"});
+  EXPECT_THAT(resp.GetVec()[1].GetVec(), ElementsAre("1"));
+  EXPECT_EQ(0, CheckedInt({"exists", kKey2}));
+
+  EXPECT_THAT(Run({"lmpop", "0", kKey1, "left"}), ErrArg("numkeys"));
+  EXPECT_THAT(Run({"lmpop", "3", kKey1, "left"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"lmpop", "1", kKey1, "up"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"lmpop", "1", kKey1, "left", "count", "0"}), ErrArg("count"));
+  Run({"set", kKey1, "foo"});
+  EXPECT_THAT(Run({"lmpop", "1", kKey1, "left"}), ErrArg("WRONGTYPE"));
+}
+
+TEST_F(ListFamilyTest, BLMPop) {
+  EXPECT_THAT(Run({"blmpop", "0.01", "2", kKey1, kKey2, "left"}), ArgType(RespExpr::NIL_ARRAY));
+
+  RespExpr resp;
+  auto fb = pp_->at(0)->LaunchFiber(fibers::launch::dispatch, [&] {
+    resp = Run({"blmpop", "0", "2", kKey1, kKey2, "left", "count", "2"});
+  });
+  while (service_->server_family().GetMetrics().conn_stats.num_blocked_clients == 0) {
+    fibers_ext::SleepFor(1ms);
+  }
+
+  pp_->at(1)->Await([&] { Run({"rpush", kKey2, "1", "2", "3"}); });
+  fb.Join();
+
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_EQ(kKey2, resp.GetVec()[0]);
+  EXPECT_THAT(resp.GetVec()[1].GetVec(), ElementsAre("1", "2"));
+  EXPECT_EQ("3", Run({"lrange", kKey2, "0", "-1"}));
+  ASSERT_FALSE(IsLocked(0, kKey1));
+  ASSERT_FALSE(IsLocked(0, kKey2));
+}
+
+TEST_F(ListFamilyTest, BLMove) {
+  EXPECT_THAT(Run({"blmove", kKey1, kKey2, "left", "right", "0.01"}), ArgType(RespExpr::NIL));
+  EXPECT_THAT(Run({"blmove", kKey1, kKey2, "left", "up", "0"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"blmove", kKey1, kKey2, "left", "left", "-1"}), ErrArg("negative"));
+
+  Run({"rpush", kKey1, "1", "2"});
+  EXPECT_EQ("2", Run({"blmove", kKey1, kKey2, "right", "left", "0"}));
+  EXPECT_EQ("1", Run({"blmove", kKey1, kKey1, "left", "right", "0"}));
+
+  // Blocks on the source only, a push that creates the destination does not wake it.
+  Run({"del", kKey1, kKey2});
+  RespExpr resp;
+  auto fb = pp_->at(0)->LaunchFiber(fibers::launch::dispatch, [&] {
+    resp = Run({"blmove", kKey1, kKey2, "left", "right", "0"});
+  });
+  while (service_->server_family().GetMetrics().conn_stats.num_blocked_clients == 0) {
+    fibers_ext::SleepFor(1ms);
+  }
+
+  pp_->at(1)->Await([&] { Run({"rpush", kKey2, "3"}); });
+  fibers_ext::SleepFor(5ms);
+  EXPECT_EQ(1u, service_->server_family().GetMetrics().conn_stats.num_blocked_clients);
+
+  pp_->at(1)->Await([&] { Run({"rpush", kKey1, "4"}); });
+  fb.Join();
+
+  EXPECT_EQ("4", resp);
+  EXPECT_EQ(0, CheckedInt({"exists", kKey1}));
+  EXPECT_THAT(Run({"lrange", kKey2, "0", "-1"}).GetVec(), ElementsAre("3", "4"));
+  ASSERT_FALSE(IsLocked(0, kKey1));
+  ASSERT_FALSE(IsLocked(0, kKey2));
+}
+
+TEST_F(ListFamilyTest, BLMoveSharedSource) {
+  constexpr unsigned kWaiters = 4;
+  vector<RespExpr> resp(kWaiters);
+  atomic_uint moved{0};
+  vector<fibers_ext::Fiber> fbs;
+  for (unsigned i = 0; i < kWaiters; ++i) {
+    fbs.push_back(pp_->at(i % 2)->LaunchFiber([&, i] {
+      resp[i] = Run(absl::StrCat("w", i), {"blmove", kKey1, kKey2, "left", "right", "0"});
+      moved.fetch_add(1);
+    }));
+  }
+
+  while (service_->server_family().GetMetrics().conn_stats.num_blocked_clients < kWaiters) {
+    fibers_ext::SleepFor(1ms);
+  }
+
+  // Every element wakes a single consumer, which moves it.
+  Run({"lpush", kKey1, "A"});
+  while (moved.load() < 1) {
+    fibers_ext::SleepFor(1ms);
+  }
+  fibers_ext::SleepFor(5ms);
+  EXPECT_EQ(1u, moved.load());
+  EXPECT_EQ(kWaiters - 1, service_->server_family().GetMetrics().conn_stats.num_blocked_clients);
+
+  Run({"rpush", kKey1, "B", "C", "D"});
+  for (auto& fb : fbs) {
+    fb.Join();
+  }
+
+  vector<string> values;
+  for (const auto& r : resp) {
+    values.emplace_back(ToSV(r.GetBuf()));
+  }
+  EXPECT_THAT(values, UnorderedElementsAre("A", "B", "C", "D"));
+  EXPECT_EQ(4, CheckedInt({"llen", kKey2}));
+}
+
 TEST_F(ListFamilyTest, TwoQueueBug451) {
   // The bug was that if 2 push operations where queued together in the tx queue,
   // and the first awoke pending blpop, then the PollExecution function would continue with the
@@ -659,4 +822,39 @@ TEST_F(ListFamilyTest, TwoQueueBug451) {
     f.Join();
 }
 
+// Positional commands on a list that spans many chunks, most of them compressed.
+TEST_F(ListFamilyTest, LargeList) {
+  absl::FlagSaver fs;
+  absl::SetFlag(&FLAGS_list_compress_depth, 1);
+  absl::SetFlag(&FLAGS_list_max_listpack_size, 16);
+
+  vector<string> cmd{"rpush", kKey1};
+  for (unsigned i = 0; i < 5000; ++i) {
+    cmd.push_back(absl::StrCat("val", i));
+  }
+  vector<string_view> sv_args(cmd.begin(), cmd.end());
+  Run(absl::MakeSpan(sv_args));
+  EXPECT_EQ(5000, CheckedInt({"llen", kKey1}));
+
+  EXPECT_EQ("val2500", Run({"lindex", kKey1, "2500"}));
+  EXPECT_EQ("val4999", Run({"lindex", kKey1, "-1"}));
+
+  EXPECT_EQ(Run({"lset", kKey1, "1234", "x"}), "OK");
+  EXPECT_EQ("x", Run({"lindex", kKey1, "1234"}));
+  EXPECT_THAT(Run({"lpos", kKey1, "x"}), IntArg(1234));
+
+  EXPECT_THAT(Run({"linsert", kKey1, "before", "val3000", "y"}), IntArg(5001));
+  EXPECT_EQ("y", Run({"lindex", kKey1, "3000"}));
+  EXPECT_EQ("val3000", Run({"lindex", kKey1, "3001"}));
+
+  EXPECT_THAT(Run({"lrem", kKey1, "0", "y"}), IntArg(1));
+  EXPECT_EQ(Run({"ltrim", kKey1, "1000", "-1001"}), "OK");
+  EXPECT_EQ(3000, CheckedInt({"llen", kKey1}));
+  EXPECT_EQ("val1000", Run({"lindex", kKey1, "0"}));
+  EXPECT_EQ("val3999", Run({"lindex", kKey1, "-1"}));
+
+  auto resp = Run({"lrange", kKey1, "1498", "1500"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("val2498", "val2499", "val2500"));
+}
+
 }  // namespace dfly
@@ -5,10 +5,12 @@
 #include "server/main_service.h"
 
 extern "C" {
+#include "redis/object.h"
 #include "redis/redis_aux.h"
 }
 
 #include <absl/cleanup/cleanup.h>
+#include <absl/random/random.h>
 #include <absl/strings/ascii.h>
 #include <absl/strings/str_format.h>
 #include <xxhash.h>
@@ -20,19 +22,29 @@ extern "C" {
 #include "base/logging.h"
 #include "facade/dragonfly_connection.h"
 #include "facade/error.h"
+#include "facade/numa.h"
 #include "server/bitops_family.h"
+#include "server/bloom_family.h"
+#include "server/cluster_family.h"
 #include "server/conn_context.h"
 #include "server/error.h"
 #include "server/generic_family.h"
+#include "server/hll_family.h"
 #include "server/hset_family.h"
 #include "server/json_family.h"
 #include "server/list_family.h"
+#include "server/memory_cmd.h"
+#include "server/pipeline_squasher.h"
+#include "server/profiler.h"
 #include "server/script_mgr.h"
+#include "server/search_family.h"
 #include "server/server_state.h"
 #include "server/set_family.h"
 #include "server/stream_family.h"
 #include "server/string_family.h"
+#include "server/tracepoints.h"
 #include "server/transaction.h"
+#include "server/ts_family.h"
 #include "server/version.h"
 #include "server/zset_family.h"
 #include "util/html/sorted_table.h"
@@ -42,6 +54,61 @@ using namespace std;
 
 ABSL_FLAG(uint32_t, port, 6379, "Redis port");
 ABSL_FLAG(uint32_t, memcache_port, 0, "Memcached port");
+ABSL_FLAG(bool, multi_exec_lock_ahead, true,
+          "If true, EXEC locks the keys of its commands ahead and spans only their shards "
+          "instead of locking all the shards");
+ABSL_FLAG(bool, lua_single_shard_inline, true,
+          "If true, scripts whose declared keys belong to a single shard run in the thread of "
+          "that shard and their redis.call invocations run inline without hops");
+
+ABSL_FLAG(uint32_t, tx_slow_log_usec, 100000,
+          "Transactional commands that run longer than this are logged with the latency "
+          "breakdown of their transaction and are listed by DEBUG TX. 0 disables it");
+
+ABSL_FLAG(int32_t, slowlog_log_slower_than, 10000,
+          "The commands that run at least that many microseconds are kept in the SLOWLOG of "
+          "their thread. 0 keeps all the commands, a negative value disables the slowlog");
+ABSL_FLAG(uint32_t, slowlog_max_len, 128, "The number of commands kept in the SLOWLOG per thread");
+
+ABSL_FLAG(uint32_t, migrate_connections, 0,
+          "If positive, a connection migrates to the thread of a shard once this many more of its "
+          "single shard commands access that shard than the other shards. Its commands then run "
+          "in the thread of their shard without hopping. 0 disables the migrations");
+
+ABSL_FLAG(string, loading_reads, "reject",
+          "How the read-only commands are served while a snapshot loads: \"reject\" replies "
+          "with an error, \"per_shard\" serves the commands whose keys belong to the shards "
+          "that finished loading and rejects the rest, \"nil\" serves all the commands on the "
+          "data loaded so far. The write commands are rejected in all the modes");
+
+ABSL_FLAG(uint32_t, heap_profile_sample_bytes, 0,
+          "If positive, one zmalloc allocation per this many bytes is sampled with its stack, "
+          "so that /debug/pprof/heap on the HTTP console shows the memory in use. Costs a "
+          "lookup per free while a thread holds samples. 0 disables it");
+
+ABSL_FLAG(uint32_t, shed_queue_len, 0,
+          "If positive, a transactional command that is not a control command is rejected "
+          "with --shed_error while the transaction queue plus the hop backlog of a shard it "
+          "spans is longer, as of the last heartbeat of that shard.");
+
+ABSL_FLAG(string, shed_error, "-LOADSHED Server is overloaded, try again later",
+          "The error of the commands that are shed, see --shed_queue_len.");
+
+ABSL_FLAG(uint32_t, client_ops_limit, 0,
+          "If positive, every client connection is delayed once it runs more commands per second, "
+          "with bursts of up to 100ms worth of them. The replicas, the control commands and those "
+          "called from scripts are not counted. CLIENT THROTTLE overrides it per connection.");
+
+ABSL_FLAG(uint32_t, client_cpu_limit, 0,
+          "If positive, the microseconds of CPU time per second that every client connection may "
+          "use parsing and running its commands in the connection thread and in the shards, see "
+          "the cpu_ fields of CLIENT LIST. A connection over its budget is delayed before its next "
+          "command. CLIENT THROTTLE overrides it per connection.");
+
+ABSL_FLAG(vector<string>, relaxed_read_commands, {},
+          "Read-only commands, e.g. MGET,EXISTS, that run over multiple shards without being "
+          "scheduled in the transaction queues, hence may observe a multi-shard write on some "
+          "of the shards only. A connection enables it for all its reads by CLIENT READMODE.");
 
 ABSL_DECLARE_FLAG(string, requirepass);
 
@@ -69,17 +136,237 @@ std::optional<VarzFunction> engine_varz;
 
 constexpr size_t kMaxThreadSize = 1024;
 
-// Unwatch all keys for a connection and unregister from DbSlices.
+// Whether a shard of the transaction was overloaded as of its last heartbeat, see
+// --shed_queue_len.
+bool IsOverloaded(const Transaction& trans, uint32_t max_queue_len) {
+  const auto& shards = EngineShardSet::GetCachedStats();
+  for (ShardId sid = 0; sid < shards.size(); ++sid) {
+    if (!trans.IsGlobal() && !trans.IsActive(sid))
+      continue;
+    uint64_t len = shards[sid].txq_len.load(memory_order_relaxed) +
+                   shards[sid].hop_backlog.load(memory_order_relaxed);
+    if (len > max_queue_len)
+      return true;
+  }
+  return false;
+}
+
+// Whether the command accesses the keys of a script that runs for longer than lua_time_limit.
+bool IsBusyScriptKeys(const ScriptMgr& script_mgr, DbIndex db, const CommandId* cid,
+                      CmdArgList args) {
+  OpResult<KeyIndex> key_index = DetermineKeys(cid, args);
+  if (!key_index)
+    return false;
+
+  vector<string_view> keys;
+  for (unsigned i = key_index->start; i < key_index->end; i += key_index->step)
+    keys.push_back(ArgS(args, i));
+  if (key_index->bonus)
+    keys.push_back(ArgS(args, key_index->bonus));
+  return script_mgr.IsBusy(db, keys);
+}
+
+// The LSNs of the token of CLIENT READAFTER in the shards of the master that the keys of the
+// read map to, all of them for the keyless reads.
+vector<LSN> ReadAfterLsns(const ConnectionState::ReadAfter& read_after, const CommandId* cid,
+                          CmdArgList args) {
+  if (cid->first_key_pos() == 0 || read_after.lsns.empty())
+    return read_after.lsns;
+  OpResult<KeyIndex> key_index = DetermineKeys(cid, args);
+  if (!key_index)
+    return read_after.lsns;
+
+  ShardId shard_num = read_after.lsns.size();
+  vector<LSN> res(shard_num, 0);
+  auto add = [&](string_view key) {
+    ShardId sid = Shard(key, shard_num);
+    res[sid] = read_after.lsns[sid];
+  };
+  for (unsigned i = key_index->start; i < key_index->end; i += key_index->step)
+    add(ArgS(args, i));
+  if (key_index->bonus)
+    add(ArgS(args, key_index->bonus));
+  return res;
+}
+
+// Whether the read-only command can run while a snapshot loads, see --loading_reads.
+bool CanReadWhileLoading(const CommandId* cid, CmdArgList args) {
+  if ((cid->opt_mask() & CO::READONLY) == 0 || (cid->opt_mask() & CO::ADMIN))
+    return false;
+
+  string mode = GetFlag(FLAGS_loading_reads);
+  if (mode == "nil")
+    return true;
+
+  // The keyless commands, like SCAN, may span all the shards.
+  if (mode != "per_shard" || cid->first_key_pos() == 0)
+    return false;
+
+  OpResult<KeyIndex> key_index = DetermineKeys(cid, args);
+  if (!key_index)
+    return false;
+
+  auto loading = [&](unsigned index) {
+    if (index >= args.size())  // the arity is checked later.
+      return false;
+    return EngineShardSet::IsLoading(Shard(ArgS(args, index), shard_set->size()));
+  };
+
+  for (unsigned i = key_index->start; i < key_index->end; i += key_index->step) {
+    if (loading(i))
+      return false;
+  }
+  return key_index->bonus == 0 || !loading(key_index->bonus);
+}
+
+// Logs a slow transaction and keeps its description for DEBUG TX.
+void LogSlowTx(const CommandId* cid, const Transaction& trans,
+               const uint64_t (&phases)[TxLatency::NUM_PHASES]) {
+  // Blocking commands wait for their keys by design.
+  uint32_t threshold = GetFlag(FLAGS_tx_slow_log_usec);
+  if (threshold == 0 || phases[TxLatency::TOTAL] < threshold || (cid->opt_mask() & CO::BLOCKING))
+    return;
+
+  string descr = StrCat(trans.DebugId(), " ooo:", trans.IsOOO());
+  for (unsigned i = 0; i < TxLatency::NUM_PHASES; ++i) {
+    absl::StrAppend(&descr, " ", TxLatency::PhaseName(TxLatency::Phase(i)), ":", phases[i], "us");
+  }
+  LOG(INFO) << "Slow transaction " << descr;
+  ServerState::tlocal()->AddSlowTx(std::move(descr));
+}
+
+// Adds the command to the SLOWLOG of the thread. As Redis does, keeps at most kSlowLogMaxArgs
+// arguments of at most kSlowLogMaxArgLen bytes each.
+void AddSlowLogEntry(CmdArgList args, ConnectionContext* cntx,
+                     const uint64_t (&phases)[TxLatency::NUM_PHASES]) {
+  constexpr size_t kSlowLogMaxArgs = 32;
+  constexpr size_t kSlowLogMaxArgLen = 128;
+  static atomic_uint64_t next_id{0};
+
+  SlowLogEntry entry;
+  entry.id = next_id.fetch_add(1, memory_order_relaxed);
+  entry.unix_ts = time(nullptr);
+  entry.dispatch_wait_usec = cntx->dispatch_wait_usec;
+  copy(begin(phases), end(phases), entry.phases_usec);
+
+  size_t num_args = min(args.size(), kSlowLogMaxArgs);
+  for (size_t i = 0; i < num_args; ++i) {
+    string_view arg = ArgS(args, i);
+    if (i == kSlowLogMaxArgs - 1 && args.size() > kSlowLogMaxArgs) {
+      entry.args.push_back(StrCat("... (", args.size() - i, " more arguments)"));
+    } else if (arg.size() > kSlowLogMaxArgLen) {
+      entry.args.push_back(StrCat(arg.substr(0, kSlowLogMaxArgLen), "... (",
+                                  arg.size() - kSlowLogMaxArgLen, " more bytes)"));
+    } else {
+      entry.args.emplace_back(arg);
+    }
+  }
+
+  if (facade::Connection* owner = cntx->owner()) {
+    entry.client_addr = owner->RemoteEndpointStr();
+    entry.client_name = owner->GetName();
+  }
+
+  ServerState::tlocal()->AddSlowLogEntry(std::move(entry), GetFlag(FLAGS_slowlog_max_len));
+}
+
+// Records the latency of a command that ran from start_ns until end_ns. The commands that did
+// not run a transaction of their own, including multi transactions whose timestamps span all
+// their commands, record only their total latency.
+void RecordCmdLatency(const CommandId* cid, CmdArgList args, ConnectionContext* cntx,
+                      const Transaction* trans, uint64_t start_ns, uint64_t end_ns) {
+  auto usec = [](uint64_t from, uint64_t to) -> uint64_t {
+    return to > from ? (to - from) / 1000 : 0;
+  };
+
+  ServerState* ss = ServerState::tlocal();
+  Transaction::Timing timing;
+  if (trans && !trans->IsMulti())
+    timing = trans->GetTiming();
+
+  uint64_t phases[TxLatency::NUM_PHASES] = {0};
+  phases[TxLatency::TOTAL] = usec(start_ns, end_ns);
+  if (timing.schedule_ns == 0) {
+    ss->RecordCmdLatency(cid->name(), phases[TxLatency::TOTAL]);
+  } else {
+    phases[TxLatency::SCHEDULE] = usec(timing.schedule_ns, timing.enqueue_ns);
+    phases[TxLatency::QUEUE] = usec(timing.enqueue_ns, timing.run_start_ns);
+    phases[TxLatency::EXEC] = usec(timing.run_start_ns, timing.run_end_ns);
+    phases[TxLatency::REPLY] = usec(timing.run_end_ns, end_ns);
+    ss->RecordTxLatency(cid->name(), phases);
+    LogSlowTx(cid, *trans, phases);
+  }
+
+  int32_t slower_than = GetFlag(FLAGS_slowlog_log_slower_than);
+  if (slower_than >= 0 && phases[TxLatency::TOTAL] >= uint64_t(slower_than) &&
+      !(cid->opt_mask() & CO::BLOCKING)) {
+    AddSlowLogEntry(args, cntx, phases);
+  }
+}
+
+// The bursts that the budgets of the connections allow, as IoRateLimiter::kBurstNs.
+constexpr uint64_t kThrottleBurstNs = 100'000'000;
+
+// Takes cost_ns from a token bucket whose time is *tat_ns and returns for how long the taker
+// must wait, see IoRateLimiter::Acquire.
+uint64_t AcquireBucket(uint64_t cost_ns, uint64_t now_ns, uint64_t* tat_ns) {
+  *tat_ns = max(*tat_ns, now_ns) + cost_ns;
+  return *tat_ns > now_ns + kThrottleBurstNs ? *tat_ns - now_ns - kThrottleBurstNs : 0;
+}
+
+uint32_t ClientOpsLimit(const ConnectionState::Throttle& throttle) {
+  return throttle.ops_limit ? throttle.ops_limit : GetFlag(FLAGS_client_ops_limit);
+}
+
+uint32_t ClientCpuLimit(const ConnectionState::Throttle& throttle) {
+  return throttle.cpu_limit_usec ? throttle.cpu_limit_usec : GetFlag(FLAGS_client_cpu_limit);
+}
+
+// Counts the shard of a single shard command towards the majority vote of the connection
+// and requests migrating the connection once the shard dominates.
+void SampleShardAffinity(const Transaction& trans, ConnectionContext* cntx) {
+  uint32_t threshold = GetFlag(FLAGS_migrate_connections);
+  if (threshold == 0 || trans.unique_shard_cnt() != 1 || trans.IsMulti())
+    return;
+
+  // The state of these connections is bound to their thread.
+  const ConnectionState& state = cntx->conn_state;
+  if (cntx->monitor || cntx->replica_conn || state.exec_info.IsActive() || state.script_info ||
+      state.subscribe_info || state.tracking_info || state.repl_flow_id != kuint32max) {
+    return;
+  }
+
+  ConnectionState::ShardAffinity& affinity = cntx->conn_state.shard_affinity;
+  ShardId sid = trans.GetUniqueShard();
+  if (affinity.votes == 0)
+    affinity.shard = sid;
+
+  if (affinity.shard != sid) {
+    --affinity.votes;
+    return;
+  }
+
+  if (++affinity.votes < threshold)
+    return;
+
+  // Shard sid runs in the thread with the same index, which serves no connections when the
+  // shard threads are dedicated.
+  affinity.votes = 0;
+  if (facade::ThreadRoles::Get(shard_set->pool()->size()).dedicated())
+    return;
+  if (int(sid) != ProactorBase::GetIndex())
+    cntx->owner()->RequestAsyncMigration(shard_set->pool()->at(sid));
+}
+
+// The deletion count of the key in the shard, 0 while its database does not exist.
+uint32_t DeletionCount(DbSlice& db_slice, DbIndex db_ind, string_view key) {
+  return db_slice.IsDbValid(db_ind) ? db_slice.GetDBTable(db_ind)->DeletionCount(key) : 0;
+}
+
+// Unwatch all keys for a connection. The shards do not know the watchers, so it does not hop.
 // Used by UNWATCH, DICARD and EXEC.
 void UnwatchAllKeys(ConnectionContext* cntx) {
-  auto& exec_info = cntx->conn_state.exec_info;
-  if (!exec_info.watched_keys.empty()) {
-    auto cb = [&](EngineShard* shard) {
-      shard->db_slice().UnregisterConnectionWatches(&exec_info);
-    };
-    shard_set->RunBriefInParallel(std::move(cb));
-  }
-  exec_info.ClearWatched();
+  cntx->conn_state.exec_info.ClearWatched();
 }
 
 void MultiCleanup(ConnectionContext* cntx) {
@@ -166,23 +453,61 @@ std::string MakeMonitorMessage(const ConnectionState& conn_state,
   return message;
 }
 
-void DispatchMonitorIfNeeded(bool admin_cmd, ConnectionContext* connection, CmdArgList args) {
+thread_local absl::InsecureBitGen monitor_sample_gen;
+
+bool MonitorKeysMatch(const MonitorFilter& filter, const CommandId* cid, CmdArgList args) {
+  if (cid->first_key_pos() <= 0 || (cid->opt_mask() & CO::GLOBAL_TRANS))
+    return false;
+
+  OpResult<KeyIndex> key_index = DetermineKeys(cid, args);
+  if (!key_index)
+    return false;
+
+  if (key_index->bonus && filter.MatchesKey(ArgS(args, key_index->bonus)))
+    return true;
+  for (unsigned i = key_index->start; i < key_index->end; i += key_index->step) {
+    if (filter.MatchesKey(ArgS(args, i)))
+      return true;
+  }
+  return false;
+}
+
+// The cheap checks run first, so that most of the commands are rejected without looking at
+// their keys.
+bool MonitorFilterMatches(const MonitorFilter& filter, const CommandId* cid,
+                          const ConnectionContext* cntx, CmdArgList args) {
+  if (!filter.cmd.empty() && filter.cmd != cid->name())
+    return false;
+  if (filter.db && *filter.db != cntx->conn_state.db_index)
+    return false;
+  if (filter.client_id && *filter.client_id != cntx->owner()->GetClientId())
+    return false;
+  if (filter.sample_rate < 1 && !absl::Bernoulli(monitor_sample_gen, filter.sample_rate))
+    return false;
+  return filter.key_pattern.empty() || MonitorKeysMatch(filter, cid, args);
+}
+
+void DispatchMonitorIfNeeded(const CommandId* cid, ConnectionContext* connection,
+                             CmdArgList args) {
   // We are not sending any admin command in the monitor, and we do not want to
   // do any processing if we don't have any waiting connections with monitor
   // enabled on them - see https://redis.io/commands/monitor/
-  const auto& my_monitors = ServerState::tlocal()->Monitors();
-  if (!(my_monitors.Empty() || admin_cmd)) {
-    //  We have connections waiting to get the info on the last command, send it to them
-    auto monitor_msg = MakeMonitorMessage(connection->conn_state, connection->owner(), args);
-    // Note that this is accepted by value for lifetime reasons
-    // we want to have our own copy since we are assuming that
-    // 1. there will be not to many connections that we in monitor state
-    // 2. we need to have for each of them each own copy for thread safe reasons
-    VLOG(1) << "sending command '" << monitor_msg << "' to the clients that registered on it";
-    shard_set->pool()->DispatchBrief(
-        [msg = std::move(monitor_msg)](unsigned idx, util::ProactorBase*) {
-          ServerState::tlocal()->Monitors().Send(msg);
-        });
+  auto& my_monitors = ServerState::tlocal()->Monitors();
+  if (my_monitors.Empty() || (cid->opt_mask() & CO::ADMIN))
+    return;
+
+  // The message is formatted only once a monitor accepts the command, and it is
+  // copied for the other ones since every connection owns its messages.
+  optional<string> monitor_msg;
+  for (const auto& monitor : my_monitors.All()) {
+    if (!MonitorFilterMatches(monitor.filter, cid, connection, args))
+      continue;
+
+    if (!monitor_msg) {
+      monitor_msg = MakeMonitorMessage(connection->conn_state, connection->owner(), args);
+      VLOG(1) << "sending command '" << *monitor_msg << "' to the clients that registered on it";
+    }
+    my_monitors.Enqueue(monitor, *monitor_msg);
   }
 }
 
@@ -396,6 +721,19 @@ bool IsTransactional(const CommandId* cid) {
   return false;
 }
 
+// Returns the shard of the keys if all of them belong to a single shard.
+optional<ShardId> KeysShard(CmdArgList keys) {
+  if (keys.empty())
+    return nullopt;
+
+  ShardId sid = Shard(ArgS(keys, 0), shard_set->size());
+  for (size_t i = 1; i < keys.size(); ++i) {
+    if (Shard(ArgS(keys, i), shard_set->size()) != sid)
+      return nullopt;
+  }
+  return sid;
+}
+
 bool EvalValidator(CmdArgList args, ConnectionContext* cntx) {
   string_view num_keys_str = ArgS(args, 2);
   int32_t num_keys;
@@ -455,6 +793,144 @@ void TxTable(const http::QueryArgs& args, HttpContext* send) {
   send->Invoke(std::move(resp));
 }
 
+// Shows the sampled memory usage per key prefix of the default database.
+void MemoryTable(const http::QueryArgs& args, HttpContext* send) {
+  using html::SortedTable;
+  constexpr size_t kMaxPrefixes = 100;
+
+  http::StringResponse resp = http::MakeStringResponse(h2::status::ok);
+  resp.body() = SortedTable::HtmlStart();
+  SortedTable::StartTable({"Prefix", "Bytes"}, &resp.body());
+
+  if (shard_set) {
+    for (const auto& [prefix, bytes] : MemoryCmd::SamplePrefixMemory(0, kMaxPrefixes)) {
+      absl::AlphaNum bytes_an(bytes);
+      SortedTable::Row({prefix, bytes_an.Piece()}, &resp.body());
+    }
+  }
+
+  SortedTable::EndTable(&resp.body());
+  send->Invoke(std::move(resp));
+}
+
+// The profiles expose the internals of the process, so they require the password of AUTH as a
+// query argument if one is set.
+bool CheckHttpPassword(const http::QueryArgs& args, HttpContext* send) {
+  const string& pass = GetFlag(FLAGS_requirepass);
+  if (pass.empty())
+    return true;
+
+  for (const auto& [key, value] : args) {
+    if (key == "password" && value == pass)
+      return true;
+  }
+
+  http::StringResponse resp = http::MakeStringResponse(h2::status::unauthorized);
+  resp.body() = "password query argument is missing or wrong\n";
+  send->Invoke(std::move(resp));
+  return false;
+}
+
+void SendProfile(string profile, HttpContext* send) {
+  http::StringResponse resp = http::MakeStringResponse(h2::status::ok);
+  resp.set(h2::field::content_type, "application/octet-stream");
+  resp.set(h2::field::content_disposition, "attachment; filename=profile.pb");
+  resp.body() = std::move(profile);
+  send->Invoke(std::move(resp));
+}
+
+// /debug/pprof/profile?seconds=N, 30 seconds by default as in go.
+void CpuProfile(const http::QueryArgs& args, HttpContext* send) {
+  if (!CheckHttpPassword(args, send))
+    return;
+
+  int64_t seconds = 30;
+  for (const auto& [key, value] : args) {
+    if (key == "seconds" && (!absl::SimpleAtoi(value, &seconds) || seconds < 1 || seconds > 300)) {
+      http::StringResponse resp = http::MakeStringResponse(h2::status::bad_request);
+      resp.body() = "seconds must be between 1 and 300\n";
+      send->Invoke(std::move(resp));
+      return;
+    }
+  }
+
+  optional<string> profile = profiler::CollectCpuProfile(absl::Seconds(seconds));
+  if (!profile) {
+    http::StringResponse resp = http::MakeStringResponse(h2::status::conflict);
+    resp.body() = "another CPU profile is being collected\n";
+    send->Invoke(std::move(resp));
+    return;
+  }
+  SendProfile(std::move(*profile), send);
+}
+
+// Sends the message to the subscribers of the channel. Shard channels skip the patterns.
+void DoPublish(bool sharded, CmdArgList args, ConnectionContext* cntx) {
+  string_view channel = ArgS(args, 1);
+  string_view message = ArgS(args, 2);
+  ShardId sid = Shard(channel, shard_set->size());
+
+  auto cb = [&] {
+    ChannelSlice& cs = EngineShard::tlocal()->channel_slice();
+    return sharded ? cs.FetchShardSubscribers(channel) : cs.FetchSubscribers(channel);
+  };
+
+  // How do we know that subscribers did not disappear after we fetched them?
+  // Each subscriber object hold a borrow_token.
+  // OnClose does not reset subscribe_info before all tokens are returned.
+  vector<ChannelSlice::Subscriber> subscriber_arr = shard_set->Await(sid, std::move(cb));
+  size_t published = subscriber_arr.size();
+
+  if (!subscriber_arr.empty()) {
+    // The channel and the message are copied once into a buffer that the messages of all the
+    // subscribers share. It lives until the last of the connections sends it.
+    string buf;
+    buf.reserve(channel.size() + message.size());
+    buf.append(channel).append(message);
+    std::shared_ptr<const string> shared_buf = std::make_shared<const string>(std::move(buf));
+
+    sort(subscriber_arr.begin(), subscriber_arr.end(),
+         [](const auto& left, const auto& right) { return left.thread_id < right.thread_id; });
+
+    // Hops once into every thread that has subscribers, and fans out there to its connections.
+    fibers_ext::BlockingCounter bc{0};
+    for (size_t start = 0, end = 0; start < subscriber_arr.size(); start = end) {
+      unsigned thread_id = subscriber_arr[start].thread_id;
+      while (end < subscriber_arr.size() && subscriber_arr[end].thread_id == thread_id)
+        ++end;
+
+      auto publish_cb = [&, start, end, bc]() mutable {
+        for (size_t i = start; i < end; ++i) {
+          ChannelSlice::Subscriber& subscriber = subscriber_arr[i];
+          facade::Connection* conn = subscriber.conn_cntx->owner();
+          DCHECK(conn);
+
+          facade::Connection::PubMessage pmsg;
+          pmsg.pattern = std::move(subscriber.pattern);
+          pmsg.buf = shared_buf;
+          pmsg.channel_len = channel.size();
+          pmsg.sharded = sharded;
+          conn->SendMsgVecAsync(std::move(pmsg));
+        }
+        bc.Dec();
+      };
+
+      bc.Add(1);
+      shard_set->pool()->at(thread_id)->DispatchBrief(std::move(publish_cb));
+    }
+    bc.Wait();
+  }
+
+  // If subscriber connections are closing they will wait
+  // for the tokens to be reclaimed in OnClose(). This guarantees that subscribers we gathered
+  // still exist till we finish publishing.
+  for (auto& s : subscriber_arr) {
+    s.borrow_token.Dec();
+  }
+
+  (*cntx)->SendLong(published);
+}
+
 }  // namespace
 
 Service::Service(ProactorPool* pp) : pp_(*pp), server_family_(this) {
@@ -479,15 +955,44 @@ Service::~Service() {
 void Service::Init(util::AcceptServer* acceptor, util::ListenerInterface* main_interface,
                    const InitOpts& opts) {
   InitRedisTables();
+  if (uint32_t sample_bytes = GetFlag(FLAGS_heap_profile_sample_bytes); sample_bytes > 0)
+    profiler::EnableHeapSampling(sample_bytes);
+
+  // The threads are bound before they create their heaps, so that the memory of their shards
+  // is allocated on their node.
+  bool numa_bind = facade::NumaBindEnabled();
+  bool pin_threads = facade::PinThreadsEnabled();
+  pp_.AwaitFiberOnAll([&](uint32_t index, ProactorBase* pb) {
+    if (numa_bind) {
+      facade::BindThreadToNode(facade::NumaTopology::Get().NodeOfThread(index, pp_.size()));
+    } else if (pin_threads) {
+      facade::PinThreadToCpu(index);
+    }
+    ServerState::tlocal()->Init();
+  });
 
-  pp_.AwaitFiberOnAll([&](uint32_t index, ProactorBase* pb) { ServerState::tlocal()->Init(); });
+  facade::ThreadRoles roles = facade::ThreadRoles::Get(pp_.size());
+  LOG_IF(INFO, roles.dedicated()) << "Running " << roles.num_shards << " shard threads and "
+                                  << roles.conn_count << " connection threads";
+  shard_set->Init(roles.num_shards, !opts.disable_time_update);
+  pp_.AwaitFiberOnAll([](uint32_t index, ProactorBase* pb) {
+    profiler::InitThread(index, EngineShard::tlocal() != nullptr);
+  });
 
-  uint32_t shard_num = pp_.size() > 1 ? pp_.size() - 1 : pp_.size();
-  shard_set->Init(shard_num, !opts.disable_time_update);
+  for (string name : GetFlag(FLAGS_relaxed_read_commands)) {
+    absl::AsciiStrToUpper(&name);
+    const CommandId* cid = registry_.Find(name);
+    if (!cid || (cid->opt_mask() & CO::READONLY) == 0) {
+      LOG(WARNING) << "Ignoring " << name << " in relaxed_read_commands, not a read-only command";
+      continue;
+    }
+    relaxed_read_cmds_.insert(cid);
+  }
 
   request_latency_usec.Init(&pp_);
   StringFamily::Init(&pp_);
   GenericFamily::Init(&pp_);
+  ClusterFamily::Init(&pp_);
   server_family_.Init(acceptor, main_interface);
 }
 
@@ -505,6 +1010,7 @@ void Service::Shutdown() {
   server_family_.Shutdown();
   StringFamily::Shutdown();
   GenericFamily::Shutdown();
+  ClusterFamily::Shutdown();
 
   shard_set->Shutdown();
 
@@ -545,7 +1051,8 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
     return;
   }
 
-  if ((etl.gstate() == GlobalState::LOADING && (cid->opt_mask() & CO::LOADING) == 0) ||
+  if ((etl.gstate() == GlobalState::LOADING && (cid->opt_mask() & CO::LOADING) == 0 &&
+       !CanReadWhileLoading(cid, args)) ||
       etl.gstate() == GlobalState::SHUTTING_DOWN) {
     string err = StrCat("Can not execute during ", GlobalStateName(etl.gstate()));
     (*cntx)->SendError(err);
@@ -571,10 +1078,21 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
     return (*cntx)->SendError("This Redis command is not allowed from script");
   }
 
+  if (under_script && (cid->opt_mask() & CO::WRITE)) {
+    ScriptRun* run = dfly_cntx->conn_state.script_info->run;
+    if (run && !run->StartWrite())
+      return (*cntx)->SendError("script was killed");
+  }
+
   bool is_write_cmd = (cid->opt_mask() & CO::WRITE) ||
                       (under_script && dfly_cntx->conn_state.script_info->is_write);
   bool under_multi = dfly_cntx->conn_state.exec_info.IsActive() && !is_trans_cmd;
 
+  // The takeover by a replica may end the pause by making this instance a replica.
+  if (is_write_cmd && !under_multi && !dfly_cntx->is_replicating && etl.writes_paused()) {
+    etl.AwaitWritesResumed();
+  }
+
   if (!etl.is_master && is_write_cmd && !dfly_cntx->is_replicating) {
     (*cntx)->SendError("-READONLY You can't write against a read only replica.");
     return;
@@ -594,6 +1112,11 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
     return;
   }
 
+  if (ClusterConfig::IsEnabled() && !under_script &&
+      !ClusterFamily::CheckKeySlots(cid, args, dfly_cntx)) {
+    return;
+  }
+
   if (under_multi) {
     if (cid->opt_mask() & CO::ADMIN) {
       (*cntx)->SendError("Can not run admin commands under transactions");
@@ -636,7 +1159,14 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
     return (*cntx)->SendSimpleString("QUEUED");
   }
 
+  // The commands of scripts and of the squashed pipelines are accounted with their connections.
+  bool throttled = !under_script && !dfly_cntx->is_replicating &&
+                   !dfly_cntx->conn_state.throttle.exempt && (cid->opt_mask() & CO::PRIORITY) == 0;
+  if (throttled)
+    ThrottleClient(1, dfly_cntx);
+
   uint64_t start_usec = ProactorBase::GetMonotonicTimeNs(), end_usec;
+  DFLY_TRACE(cmd__start, cid->name());
 
   // Create command transaction
   intrusive_ptr<Transaction> dist_trans;
@@ -648,13 +1178,18 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
       if (!key_index_res)
         return (*cntx)->SendError(key_index_res.status());
 
+      // Only the declared keys are locked, and the inline execution of single shard scripts
+      // relies on all the keys belonging to the shard of the script.
       const auto& key_index = *key_index_res;
-      for (unsigned i = key_index.start; i < key_index.end; ++i) {
-        string_view key = ArgS(args, i);
-        if (!dfly_cntx->conn_state.script_info->keys.contains(key)) {
+      const auto& declared = dfly_cntx->conn_state.script_info->keys;
+      for (unsigned i = key_index.start; i < key_index.end; i += key_index.step) {
+        if (!declared.contains(ArgS(args, i))) {
           return (*cntx)->SendError("script tried accessing undeclared key");
         }
       }
+      if (key_index.bonus && !declared.contains(ArgS(args, key_index.bonus))) {
+        return (*cntx)->SendError("script tried accessing undeclared key");
+      }
 
       dfly_cntx->transaction->SetExecCmd(cid);
       OpStatus st = dfly_cntx->transaction->InitByArgs(dfly_cntx->conn_state.db_index, args);
@@ -667,11 +1202,53 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
     DCHECK(dfly_cntx->transaction == nullptr);
 
     if (IsTransactional(cid)) {
+      // The keys of a busy script stay locked until it finishes or is killed.
+      const ScriptMgr& script_mgr = *server_family_.script_mgr();
+      if (script_mgr.HasBusyRuns() &&
+          IsBusyScriptKeys(script_mgr, dfly_cntx->conn_state.db_index, cid, args)) {
+        return (*cntx)->SendError(
+            "-BUSY A script that runs for longer than lua_time_limit holds the keys. "
+            "You can call SCRIPT KILL.");
+      }
+
+      // On a replica, the reads after CLIENT READAFTER wait for the writes of its token.
+      const auto& read_after = dfly_cntx->conn_state.read_after;
+      if (read_after && (cid->opt_mask() & CO::READONLY) && !etl.is_master &&
+          !server_family_.AwaitAppliedLsns(read_after->master_id,
+                                           ReadAfterLsns(*read_after, cid, args),
+                                           read_after->timeout_ms)) {
+        return (*cntx)->SendError(
+            "-TRYAGAIN The replica did not apply the writes of the LSN token in time");
+      }
+
       dist_trans.reset(new Transaction{cid});
       OpStatus st = dist_trans->InitByArgs(dfly_cntx->conn_state.db_index, args);
       if (st != OpStatus::OK)
         return (*cntx)->SendError(st);
 
+      // Control commands and the replication stream are never shed, neither is EXEC, which
+      // would leave the connection in its MULTI.
+      uint32_t shed_len = GetFlag(FLAGS_shed_queue_len);
+      if (shed_len > 0 && (cid->opt_mask() & CO::PRIORITY) == 0 && !is_trans_cmd &&
+          !dfly_cntx->is_replicating && IsOverloaded(*dist_trans, shed_len)) {
+        ++etl.connection_stats.shed_cmd_cnt;
+        return (*cntx)->SendError(GetFlag(FLAGS_shed_error), "loadshed");
+      }
+
+      const auto& tracking_info = dfly_cntx->conn_state.tracking_info;
+      if (tracking_info && !tracking_info->bcast)
+        dist_trans->SetTrackingClient(dfly_cntx->owner()->GetClientId());
+
+      auto& write_lsns = dfly_cntx->conn_state.write_lsns;
+      if (write_lsns.empty())
+        write_lsns.resize(shard_set->size());
+      dist_trans->SetWriteLsns(write_lsns.data());
+
+      if ((cid->opt_mask() & CO::READONLY) && dist_trans->unique_shard_cnt() > 1 &&
+          (dfly_cntx->conn_state.relaxed_reads || relaxed_read_cmds_.contains(cid))) {
+        dist_trans->SetRelaxedRead(true);
+      }
+
       dfly_cntx->transaction = dist_trans.get();
       dfly_cntx->last_command_debug.shards_count = dfly_cntx->transaction->unique_shard_cnt();
     } else {
@@ -689,21 +1266,74 @@ void Service::DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx)
     dfly_cntx->reply_builder()->CloseConnection();
   }
 
-  DispatchMonitorIfNeeded(cid->opt_mask() & CO::ADMIN, dfly_cntx, args);
+  DispatchMonitorIfNeeded(cid, dfly_cntx, args);
 
   end_usec = ProactorBase::GetMonotonicTimeNs();
 
   request_latency_usec.IncBy(cmd_str, (end_usec - start_usec) / 1000);
+  DFLY_TRACE(cmd__end, cid->name(), dist_trans ? dist_trans->txid() : 0, end_usec - start_usec);
+  RecordCmdLatency(cid, args, dfly_cntx, dist_trans.get(), start_usec, end_usec);
   if (dist_trans) {
     dfly_cntx->last_command_debug.clock = dist_trans->txid();
     dfly_cntx->last_command_debug.is_ooo = dist_trans->IsOOO();
+    SampleShardAffinity(*dist_trans, dfly_cntx);
   }
 
   if (!under_script) {
+    // The coordinator runs the command except while it runs the hops or waits for them.
+    uint64_t wall_ns = end_usec - start_usec;
+    uint64_t shard_ns = dist_trans ? dist_trans->GetExecNs() : 0;
+    uint64_t dispatch_ns = wall_ns - (dist_trans ? min(wall_ns, dist_trans->hop_ns()) : 0);
+    dfly_cntx->cpu_time.shard_ns += shard_ns;
+    dfly_cntx->cpu_time.dispatch_ns += dispatch_ns;
+    if (throttled)
+      ChargeClientCpu(shard_ns + dispatch_ns, dfly_cntx);
+
     dfly_cntx->transaction = nullptr;
   }
 }
 
+void Service::ThrottleClient(uint32_t ops, ConnectionContext* cntx) {
+  ConnectionState::Throttle& throttle = cntx->conn_state.throttle;
+  uint32_t ops_limit = ClientOpsLimit(throttle);
+  uint32_t cpu_limit = ClientCpuLimit(throttle);
+  if (ops_limit == 0 && cpu_limit == 0)
+    return;
+
+  uint64_t now = ProactorBase::GetMonotonicTimeNs();
+  uint64_t wait_ns = 0;
+  if (ops_limit)
+    wait_ns = AcquireBucket(ops * 1'000'000'000ULL / ops_limit, now, &throttle.ops_tat_ns);
+
+  // The CPU time is taken once the commands ran, see ChargeClientCpu.
+  if (cpu_limit)
+    wait_ns = max(wait_ns, AcquireBucket(0, now, &throttle.cpu_tat_ns));
+
+  if (wait_ns == 0)
+    return;
+
+  ServerState::tlocal()->connection_stats.throttled_cmd_cnt += ops;
+  throttle.throttled_ns += wait_ns;
+  fibers_ext::SleepFor(chrono::nanoseconds(wait_ns));
+}
+
+void Service::ChargeClientCpu(uint64_t cpu_ns, ConnectionContext* cntx) {
+  ConnectionState::Throttle& throttle = cntx->conn_state.throttle;
+  uint32_t cpu_limit = ClientCpuLimit(throttle);
+  if (cpu_limit == 0)
+    return;
+
+  // cpu_limit microseconds of CPU per second of the bucket.
+  AcquireBucket(cpu_ns * 1'000'000 / cpu_limit, ProactorBase::GetMonotonicTimeNs(),
+                &throttle.cpu_tat_ns);
+}
+
+void Service::DispatchManyCommands(absl::Span<CmdArgList> args_list,
+                                   facade::ConnectionContext* cntx) {
+  PipelineSquasher squasher{this, static_cast<ConnectionContext*>(cntx)};
+  squasher.Run(args_list);
+}
+
 void Service::DispatchMC(const MemcacheParser::Command& cmd, std::string_view value,
                          facade::ConnectionContext* cntx) {
   absl::InlinedVector<MutableSlice, 8> args;
@@ -758,6 +1388,9 @@ void Service::DispatchMC(const MemcacheParser::Command& cmd, std::string_view va
     case MemcacheParser::VERSION:
       mc_builder->SendSimpleString(StrCat("VERSION ", kGitTag));
       return;
+    case MemcacheParser::META_NOOP:
+      mc_builder->SendSimpleString("MN");
+      return;
     default:
       mc_builder->SendClientError("bad command line format");
       return;
@@ -791,16 +1424,22 @@ void Service::DispatchMC(const MemcacheParser::Command& cmd, std::string_view va
       char* key = const_cast<char*>(s.data());
       args.emplace_back(key, s.size());
     }
+    if (cmd.meta && (cmd.meta_flags & MemcacheParser::META_RETURN_CAS))
+      dfly_cntx->conn_state.memcache_flag = ConnectionState::FETCH_CAS_VER;
   } else {  // write commands.
     if (store_opt[0]) {
       args.emplace_back(store_opt, strlen(store_opt));
     }
   }
 
+  if (cmd.meta)
+    mc_builder->SetMetaCommand(&cmd);
+
   DispatchCommand(CmdArgList{args}, cntx);
 
   // Reset back.
   dfly_cntx->conn_state.memcache_flag = 0;
+  mc_builder->SetMetaCommand(nullptr);
 }
 
 facade::ConnectionContext* Service::CreateContext(util::FiberSocketBase* peer,
@@ -878,31 +1517,29 @@ void Service::Multi(CmdArgList args, ConnectionContext* cntx) {
 
 void Service::Watch(CmdArgList args, ConnectionContext* cntx) {
   auto& exec_info = cntx->conn_state.exec_info;
-
-  // Skip if EXEC will already fail due previous WATCH.
-  if (exec_info.watched_dirty.load(memory_order_relaxed)) {
-    return (*cntx)->SendOk();
+  auto& watched = exec_info.watched_keys;
+  size_t first = watched.size();
+  for (size_t i = 1; i < args.size(); i++) {
+    watched.push_back({cntx->db_index(), string(ArgS(args, i))});
   }
 
-  atomic_uint32_t keys_existed = 0;
+  // Records the state of the shards. The writes do not track the watchers, EXEC compares it
+  // with the state at its time, see CheckWatchedKeys.
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    ArgSlice largs = t->ShardArgsInShard(shard->shard_id());
-    for (auto k : largs) {
-      shard->db_slice().RegisterWatchedKey(cntx->db_index(), k, &exec_info);
+    DbSlice& db_slice = shard->db_slice();
+    for (size_t i = first; i < watched.size(); ++i) {
+      if (Shard(watched[i].key, shard_set->size()) != shard->shard_id())
+        continue;
+
+      // Deletes the key if it expired, so that it counts as missing.
+      db_slice.FindExt(t->db_context(), watched[i].key);
+      watched[i].version = db_slice.version();
+      watched[i].deletions = DeletionCount(db_slice, t->db_index(), watched[i].key);
     }
-
-    auto res = GenericFamily::OpExists(t->GetOpArgs(shard), largs);
-    keys_existed.fetch_add(res.value_or(0), memory_order_relaxed);
     return OpStatus::OK;
   };
   cntx->transaction->ScheduleSingleHop(std::move(cb));
 
-  // Duplicate keys are stored to keep correct count.
-  exec_info.watched_existed += keys_existed.load(memory_order_relaxed);
-  for (size_t i = 1; i < args.size(); i++) {
-    exec_info.watched_keys.emplace_back(cntx->db_index(), ArgS(args, i));
-  }
-
   return (*cntx)->SendOk();
 }
 
@@ -933,24 +1570,24 @@ void Service::Eval(CmdArgList args, ConnectionContext* cntx) {
     return (*cntx)->SendNull();
   }
 
-  ServerState* ss = ServerState::tlocal();
-  Interpreter& script = ss->GetInterpreter();
-
   string result;
-  Interpreter::AddResult add_result = script.AddFunction(body, &result);
-  if (add_result == Interpreter::COMPILE_ERR) {
-    return (*cntx)->SendError(result, facade::kScriptErrType);
-  }
+  {
+    BorrowedInterpreter script{&ServerState::tlocal()->interpreter_mgr()};
+    Interpreter::AddResult add_result = script->AddFunction(body, &result);
+    if (add_result == Interpreter::COMPILE_ERR) {
+      return (*cntx)->SendError(result, facade::kScriptErrType);
+    }
 
-  if (add_result == Interpreter::ADD_OK) {
-    server_family_.script_mgr()->InsertFunction(result, body);
+    if (add_result == Interpreter::ADD_OK) {
+      server_family_.script_mgr()->InsertFunction(result, body);
+    }
   }
 
   EvalArgs eval_args;
   eval_args.sha = result;
   eval_args.keys = args.subspan(3, num_keys);
   eval_args.args = args.subspan(3 + num_keys);
-  EvalInternal(eval_args, &script, cntx);
+  EvalInternal(eval_args, cntx);
 }
 
 void Service::EvalSha(CmdArgList args, ConnectionContext* cntx) {
@@ -962,19 +1599,8 @@ void Service::EvalSha(CmdArgList args, ConnectionContext* cntx) {
   ToLower(&args[1]);
 
   string_view sha = ArgS(args, 1);
-  ServerState* ss = ServerState::tlocal();
-  Interpreter& script = ss->GetInterpreter();
-  bool exists = script.Exists(sha);
-
-  if (!exists) {
-    const char* body = (sha.size() == 40) ? server_family_.script_mgr()->Find(sha) : nullptr;
-    if (!body) {
-      return (*cntx)->SendError(facade::kScriptNotFound);
-    }
-
-    string res;
-    CHECK_EQ(Interpreter::ADD_OK, script.AddFunction(body, &res));
-    CHECK_EQ(res, sha);
+  if (sha.size() != 40 || !server_family_.script_mgr()->Find(sha)) {
+    return (*cntx)->SendError(facade::kScriptNotFound);
   }
 
   EvalArgs ev_args;
@@ -982,11 +1608,10 @@ void Service::EvalSha(CmdArgList args, ConnectionContext* cntx) {
   ev_args.keys = args.subspan(3, num_keys);
   ev_args.args = args.subspan(3 + num_keys);
 
-  EvalInternal(ev_args, &script, cntx);
+  EvalInternal(ev_args, cntx);
 }
 
-void Service::EvalInternal(const EvalArgs& eval_args, Interpreter* interpreter,
-                           ConnectionContext* cntx) {
+void Service::EvalInternal(const EvalArgs& eval_args, ConnectionContext* cntx) {
   DCHECK(!eval_args.sha.empty());
 
   // Sanitizing the input to avoid code injection.
@@ -994,6 +1619,16 @@ void Service::EvalInternal(const EvalArgs& eval_args, Interpreter* interpreter,
     return (*cntx)->SendError(facade::kScriptNotFound);
   }
 
+  if (GetFlag(FLAGS_lua_single_shard_inline)) {
+    optional<ShardId> sid = KeysShard(eval_args.keys);
+    EngineShard* local_shard = EngineShard::tlocal();
+    if (sid && !(local_shard && local_shard->shard_id() == *sid)) {
+      return EvalOnShard(*sid, eval_args, cntx);
+    }
+  }
+
+  // The interpreter is borrowed for the whole run of the script, including its hops.
+  BorrowedInterpreter interpreter{&ServerState::tlocal()->interpreter_mgr()};
   bool exists = interpreter->Exists(eval_args.sha);
 
   if (!exists) {
@@ -1023,14 +1658,21 @@ void Service::EvalInternal(const EvalArgs& eval_args, Interpreter* interpreter,
   if (!eval_args.keys.empty())
     cntx->transaction->Schedule();
 
-  auto lk = interpreter->Lock();
-
   interpreter->SetGlobalArray("KEYS", eval_args.keys);
   interpreter->SetGlobalArray("ARGV", eval_args.args);
   interpreter->SetRedisFunc(
       [cntx, this](CmdArgList args, ObjectExplorer* reply) { CallFromScript(args, reply, cntx); });
 
+  ScriptRun run;
+  run.db = cntx->db_index();
+  run.start_ns = ProactorBase::GetMonotonicTimeNs();
+  run.keys = &cntx->conn_state.script_info->keys;
+  cntx->conn_state.script_info->run = &run;
+  ScriptMgr* script_mgr = server_family_.script_mgr();
+  interpreter->SetInterruptFunc([script_mgr, &run] { return script_mgr->CheckRun(&run); });
+
   Interpreter::RunResult result = interpreter->RunFunction(eval_args.sha, &error);
+  script_mgr->FinishRun(&run);
 
   cntx->conn_state.script_info.reset();  // reset script_info
 
@@ -1055,6 +1697,27 @@ void Service::EvalInternal(const EvalArgs& eval_args, Interpreter* interpreter,
   interpreter->ResetStack();
 }
 
+void Service::EvalOnShard(ShardId sid, const EvalArgs& eval_args, ConnectionContext* cntx) {
+  ::io::StringSink sink;
+
+  // The script runs on the interpreter of the shard thread. The reply is captured there
+  // and sent from the connection thread.
+  shard_set->pool()->at(sid)->Await([&] {
+    RedisReplyBuilder capture(&sink);
+    SinkReplyBuilder* orig = cntx->Inject(&capture);
+
+    EvalInternal(eval_args, cntx);
+
+    auto& err_count_map = ServerState::tlocal()->connection_stats.err_count_map;
+    for (const auto& k_v : capture.err_count()) {
+      err_count_map[k_v.first] += k_v.second;
+    }
+    cntx->Inject(orig);
+  });
+
+  (*cntx)->SendRaw(sink.str());
+}
+
 void Service::Discard(CmdArgList args, ConnectionContext* cntx) {
   RedisReplyBuilder* rb = (*cntx).operator->();
 
@@ -1066,28 +1729,40 @@ void Service::Discard(CmdArgList args, ConnectionContext* cntx) {
   rb->SendOk();
 }
 
-// Return true if non of the connections watched keys expired.
-bool CheckWatchedKeyExpiry(ConnectionContext* cntx, const CommandRegistry& registry) {
+// Returns true if none of the watched keys changed since WATCH. An existing key is unchanged if
+// the version of its bucket is older than its watch, which may fail spuriously when another key
+// of the bucket changed. A missing key is unchanged if no key of its deletion slot was deleted,
+// which covers the keys that were added and deleted, and the keys that expired.
+bool CheckWatchedKeys(ConnectionContext* cntx, const CommandRegistry& registry) {
   static char EXISTS[] = "EXISTS";
   auto& exec_info = cntx->conn_state.exec_info;
 
   CmdArgVec str_list(exec_info.watched_keys.size() + 1);
   str_list[0] = MutableSlice{EXISTS, strlen(EXISTS)};
   for (size_t i = 1; i < str_list.size(); i++) {
-    auto& [db, s] = exec_info.watched_keys[i - 1];
+    string& s = exec_info.watched_keys[i - 1].key;
     str_list[i] = MutableSlice{s.data(), s.size()};
   }
 
-  atomic_uint32_t watch_exist_count{0};
-  auto cb = [&watch_exist_count](Transaction* t, EngineShard* shard) {
-    ArgSlice args = t->ShardArgsInShard(shard->shard_id());
-    auto res = GenericFamily::OpExists(t->GetOpArgs(shard), args);
-    watch_exist_count.fetch_add(res.value_or(0), memory_order_relaxed);
+  atomic_bool changed{false};
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    DbSlice& db_slice = shard->db_slice();
+    for (const auto& wk : exec_info.watched_keys) {
+      if (Shard(wk.key, shard_set->size()) != shard->shard_id())
+        continue;
+
+      PrimeIterator it = db_slice.FindExt(t->db_context(), wk.key).first;
+      uint32_t deletions = DeletionCount(db_slice, t->db_index(), wk.key);
+      if (IsValid(it) ? it.GetVersion() >= wk.version : deletions != wk.deletions) {
+        changed.store(true, memory_order_relaxed);
+        break;
+      }
+    }
 
     return OpStatus::OK;
   };
 
-  VLOG(1) << "Checking expired watch keys";
+  VLOG(1) << "Checking watched keys";
 
   cntx->transaction->SetExecCmd(registry.Find(EXISTS));
   cntx->transaction->InitByArgs(cntx->conn_state.db_index,
@@ -1095,22 +1770,137 @@ bool CheckWatchedKeyExpiry(ConnectionContext* cntx, const CommandRegistry& regis
   OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
   CHECK_EQ(OpStatus::OK, status);
 
-  // The comparison can still be true even if a key expired due to another one being created.
-  // So we have to check the watched_dirty flag, which is set if a key expired.
-  return watch_exist_count.load() == exec_info.watched_existed &&
-         !exec_info.watched_dirty.load(memory_order_relaxed);
+  return !changed.load(memory_order_relaxed);
 }
 
 // Check if exec_info watches keys on dbs other than db_indx.
 bool IsWatchingOtherDbs(DbIndex db_indx, const ConnectionState::ExecInfo& exec_info) {
-  for (const auto& [key_db, _] : exec_info.watched_keys) {
-    if (key_db != db_indx) {
+  for (const auto& wk : exec_info.watched_keys) {
+    if (wk.db != db_indx) {
       return true;
     }
   }
   return false;
 }
 
+// Argument lists of the queued commands. The slices point into the stored commands.
+vector<CmdArgVec> ExecArgLists(ConnectionState::ExecInfo* exec_info) {
+  vector<CmdArgVec> res(exec_info->body.size());
+  for (size_t i = 0; i < res.size(); ++i) {
+    for (string& s : exec_info->body[i].cmd) {
+      res[i].emplace_back(s.data(), s.size());
+    }
+  }
+  return res;
+}
+
+// Initializes the EXEC transaction with the keys of all its commands and of the watched keys
+// so that it locks only their shards. Fills the shard of every command into cmd_shards, or
+// kInvalidSid if the command spans several shards or has no keys. Returns false if some command
+// does not allow locking ahead, in which case EXEC locks all the shards as usual.
+bool InitExecLockAhead(absl::Span<CmdArgVec> arg_lists, ConnectionContext* cntx,
+                       vector<ShardId>* cmd_shards) {
+  static char EXEC[] = "EXEC";
+  auto& exec_info = cntx->conn_state.exec_info;
+
+  CmdArgVec lock_args{MutableSlice{EXEC, strlen(EXEC)}};
+  absl::flat_hash_set<string_view> uniq_keys;
+  auto add_key = [&](MutableSlice key) {
+    if (uniq_keys.emplace(key.data(), key.size()).second)
+      lock_args.push_back(key);
+  };
+
+  cmd_shards->assign(arg_lists.size(), kInvalidSid);
+  for (size_t i = 0; i < arg_lists.size(); ++i) {
+    const CommandId* cid = exec_info.body[i].descr;
+    if (!IsTransactional(cid))
+      continue;
+
+    if (cid->opt_mask() & (CO::GLOBAL_TRANS | CO::BLOCKING))
+      return false;
+
+    CmdArgList args{arg_lists[i]};
+    OpResult<KeyIndex> key_index = DetermineKeys(cid, args);
+    if (!key_index)
+      return false;
+
+    ShardId sid = Shard(ArgS(args, key_index->start), shard_set->size());
+    for (unsigned j = key_index->start; j < key_index->end; j += key_index->step) {
+      add_key(args[j]);
+      if (Shard(ArgS(args, j), shard_set->size()) != sid)
+        sid = kInvalidSid;
+    }
+    if (key_index->bonus) {
+      add_key(args[key_index->bonus]);
+      if (Shard(ArgS(args, key_index->bonus), shard_set->size()) != sid)
+        sid = kInvalidSid;
+    }
+    (*cmd_shards)[i] = sid;
+  }
+
+  for (auto& wk : exec_info.watched_keys) {
+    add_key(MutableSlice{wk.key.data(), wk.key.size()});
+  }
+
+  if (lock_args.size() == 1)
+    return false;
+
+  OpStatus st = cntx->transaction->InitLockAhead(cntx->conn_state.db_index,
+                                                 CmdArgList{lock_args.data(), lock_args.size()});
+  return st == OpStatus::OK;
+}
+
+// Runs the commands of a lock-ahead EXEC whose commands access single shards. The commands of
+// every shard run in one hop into its thread. The keys of all the commands are locked, hence
+// other transactions can not observe that commands on different shards run out of their order.
+void ExecByShards(absl::Span<CmdArgVec> arg_lists, const vector<ShardId>& cmd_shards,
+                  ConnectionContext* cntx) {
+  auto& exec_info = cntx->conn_state.exec_info;
+  vector<vector<unsigned>> shard_cmds(shard_set->size());
+  for (unsigned i = 0; i < cmd_shards.size(); ++i) {
+    shard_cmds[cmd_shards[i]].push_back(i);
+  }
+
+  vector<string> replies(arg_lists.size());
+  for (ShardId sid = 0; sid < shard_cmds.size(); ++sid) {
+    if (shard_cmds[sid].empty())
+      continue;
+
+    shard_set->pool()->at(sid)->Await([&] {
+      ::io::StringSink sink;
+      RedisReplyBuilder capture(&sink);
+      SinkReplyBuilder* orig = cntx->Inject(&capture);
+
+      for (unsigned index : shard_cmds[sid]) {
+        const CommandId* cid = exec_info.body[index].descr;
+        CmdArgList args{arg_lists[index]};
+
+        cntx->transaction->SetExecCmd(cid);
+        OpStatus st = cntx->transaction->InitByArgs(cntx->conn_state.db_index, args);
+        if (st == OpStatus::OK) {
+          cid->Invoke(args, cntx);
+        } else {
+          capture.SendError(st);
+        }
+        replies[index] = sink.str();
+        sink.Clear();
+      }
+
+      auto& err_count_map = ServerState::tlocal()->connection_stats.err_count_map;
+      for (const auto& k_v : capture.err_count()) {
+        err_count_map[k_v.first] += k_v.second;
+      }
+      cntx->Inject(orig);
+    });
+  }
+
+  string blob;
+  for (const string& reply : replies) {
+    blob.append(reply);
+  }
+  (*cntx)->SendRaw(blob);
+}
+
 void Service::Exec(CmdArgList args, ConnectionContext* cntx) {
   RedisReplyBuilder* rb = (*cntx).operator->();
 
@@ -1129,12 +1919,13 @@ void Service::Exec(CmdArgList args, ConnectionContext* cntx) {
     return rb->SendError("-EXECABORT Transaction discarded because of previous errors");
   }
 
-  if (exec_info.watched_dirty.load(memory_order_relaxed)) {
-    return rb->SendNull();
-  }
+  vector<CmdArgVec> arg_lists = ExecArgLists(&exec_info);
+  vector<ShardId> cmd_shards;
+  bool lock_ahead = !arg_lists.empty() && GetFlag(FLAGS_multi_exec_lock_ahead) &&
+                    InitExecLockAhead(absl::MakeSpan(arg_lists), cntx, &cmd_shards);
 
-  // EXEC should not run if any of the watched keys expired.
-  if (!exec_info.watched_keys.empty() && !CheckWatchedKeyExpiry(cntx, registry_)) {
+  // EXEC should not run if any of the watched keys changed or expired.
+  if (!exec_info.watched_keys.empty() && !CheckWatchedKeys(cntx, registry_)) {
     cntx->transaction->UnlockMulti();
     return rb->SendNull();
   }
@@ -1142,18 +1933,20 @@ void Service::Exec(CmdArgList args, ConnectionContext* cntx) {
   VLOG(1) << "StartExec " << exec_info.body.size();
   rb->StartArray(exec_info.body.size());
 
-  if (!exec_info.body.empty()) {
-    CmdArgVec str_list;
+  bool by_shards = lock_ahead && arg_lists.size() > 1 &&
+                   all_of(cmd_shards.begin(), cmd_shards.end(),
+                          [](ShardId sid) { return sid != kInvalidSid; });
 
-    for (auto& scmd : exec_info.body) {
-      str_list.resize(scmd.cmd.size());
-      for (size_t i = 0; i < scmd.cmd.size(); ++i) {
-        string& s = scmd.cmd[i];
-        str_list[i] = MutableSlice{s.data(), s.size()};
-      }
+  if (by_shards) {
+    ExecByShards(absl::MakeSpan(arg_lists), cmd_shards, cntx);
+    VLOG(1) << "Exec unlocking " << exec_info.body.size() << " commands";
+    cntx->transaction->UnlockMulti();
+  } else if (!exec_info.body.empty()) {
+    for (size_t i = 0; i < exec_info.body.size(); ++i) {
+      auto& scmd = exec_info.body[i];
 
       cntx->transaction->SetExecCmd(scmd.descr);
-      CmdArgList cmd_arg_list{str_list.data(), str_list.size()};
+      CmdArgList cmd_arg_list{arg_lists[i].data(), arg_lists[i].size()};
       if (IsTransactional(scmd.descr)) {
         OpStatus st = cntx->transaction->InitByArgs(cntx->conn_state.db_index, cmd_arg_list);
         if (st != OpStatus::OK) {
@@ -1174,64 +1967,11 @@ void Service::Exec(CmdArgList args, ConnectionContext* cntx) {
 }
 
 void Service::Publish(CmdArgList args, ConnectionContext* cntx) {
-  string_view channel = ArgS(args, 1);
-
-  // shared_ptr ensures that the message lives until it's been sent to all subscribers and handled
-  // by DispatchOperations.
-  std::shared_ptr<const std::string> message = std::make_shared<const std::string>(ArgS(args, 2));
-  ShardId sid = Shard(channel, shard_count());
-
-  auto cb = [&] { return EngineShard::tlocal()->channel_slice().FetchSubscribers(channel); };
-
-  // How do we know that subscribers did not disappear after we fetched them?
-  // Each subscriber object hold a borrow_token.
-  // OnClose does not reset subscribe_info before all tokens are returned.
-  vector<ChannelSlice::Subscriber> subscriber_arr = shard_set->Await(sid, std::move(cb));
-  atomic_uint32_t published{0};
-
-  if (!subscriber_arr.empty()) {
-    sort(subscriber_arr.begin(), subscriber_arr.end(),
-         [](const auto& left, const auto& right) { return left.thread_id < right.thread_id; });
-
-    vector<unsigned> slices(shard_set->pool()->size(), UINT_MAX);
-    for (size_t i = 0; i < subscriber_arr.size(); ++i) {
-      if (slices[subscriber_arr[i].thread_id] > i) {
-        slices[subscriber_arr[i].thread_id] = i;
-      }
-    }
-
-    // We run publish_cb in each subscriber's thread.
-    auto publish_cb = [&](unsigned idx, util::ProactorBase*) mutable {
-      unsigned start = slices[idx];
-
-      for (unsigned i = start; i < subscriber_arr.size(); ++i) {
-        const ChannelSlice::Subscriber& subscriber = subscriber_arr[i];
-        if (subscriber.thread_id != idx)
-          break;
-
-        published.fetch_add(1, memory_order_relaxed);
-
-        facade::Connection* conn = subscriber_arr[i].conn_cntx->owner();
-        DCHECK(conn);
-        facade::Connection::PubMessage pmsg;
-        pmsg.channel = channel;
-        pmsg.message = message;
-        pmsg.pattern = subscriber.pattern;
-        conn->SendMsgVecAsync(pmsg);
-      }
-    };
-
-    shard_set->pool()->Await(publish_cb);
-  }
-
-  // If subscriber connections are closing they will wait
-  // for the tokens to be reclaimed in OnClose(). This guarantees that subscribers we gathered
-  // still exist till we finish publishing.
-  for (auto& s : subscriber_arr) {
-    s.borrow_token.Dec();
-  }
+  DoPublish(false, args, cntx);
+}
 
-  (*cntx)->SendLong(published.load(memory_order_relaxed));
+void Service::SPublish(CmdArgList args, ConnectionContext* cntx) {
+  DoPublish(true, args, cntx);
 }
 
 void Service::Subscribe(CmdArgList args, ConnectionContext* cntx) {
@@ -1250,6 +1990,22 @@ void Service::Unsubscribe(CmdArgList args, ConnectionContext* cntx) {
   }
 }
 
+void Service::SSubscribe(CmdArgList args, ConnectionContext* cntx) {
+  args.remove_prefix(1);
+
+  cntx->ChangeShardSubscription(true, true, std::move(args));
+}
+
+void Service::SUnsubscribe(CmdArgList args, ConnectionContext* cntx) {
+  args.remove_prefix(1);
+
+  if (args.size() == 0) {
+    cntx->SUnsubscribeAll(true);
+  } else {
+    cntx->ChangeShardSubscription(false, true, std::move(args));
+  }
+}
+
 void Service::PSubscribe(CmdArgList args, ConnectionContext* cntx) {
   args.remove_prefix(1);
   cntx->ChangePSub(true, true, args);
@@ -1279,11 +2035,13 @@ void Service::Function(CmdArgList args, ConnectionContext* cntx) {
   return (*cntx)->SendError(err, kSyntaxErrType);
 }
 
-void Service::PubsubChannels(string_view pattern, ConnectionContext* cntx) {
+void Service::PubsubChannels(string_view pattern, bool sharded, ConnectionContext* cntx) {
   vector<vector<string>> result_set(shard_set->size());
 
   shard_set->RunBriefInParallel([&](EngineShard* shard) {
-    result_set[shard->shard_id()] = shard->channel_slice().ListChannels(pattern);
+    ChannelSlice& cs = shard->channel_slice();
+    result_set[shard->shard_id()] =
+        sharded ? cs.ListShardChannels(pattern) : cs.ListChannels(pattern);
   });
 
   vector<string> union_set;
@@ -1301,12 +2059,23 @@ void Service::PubsubPatterns(ConnectionContext* cntx) {
   (*cntx)->SendLong(pattern_count);
 }
 
+// MONITOR [CMD name] [MATCH pattern] [DB index] [CLIENT id] [SAMPLE rate]
 void Service::Monitor(CmdArgList args, ConnectionContext* cntx) {
+  OpResult<MonitorFilter> filter = MonitorFilter::TryFrom(args.subspan(1));
+  if (!filter) {
+    (*cntx)->SendError(filter.status());
+    return;
+  }
+
   VLOG(1) << "starting monitor on this connection: " << cntx->owner()->GetClientInfo();
+  // A repeated MONITOR replaces the filter of the connection.
+  if (cntx->monitor)
+    cntx->ChangeMonitor(false /* start */);
+
   // we are registering the current connection for all threads so they will be aware of
   // this connection, to send to it any command
   (*cntx)->SendOk();
-  cntx->ChangeMonitor(true /* start */);
+  cntx->ChangeMonitor(true /* start */, std::move(*filter));
 }
 
 void Service::Pubsub(CmdArgList args, ConnectionContext* cntx) {
@@ -1325,6 +2094,8 @@ void Service::Pubsub(CmdArgList args, ConnectionContext* cntx) {
         "\tReturn the currently active channels matching a <pattern> (default: '*').",
         "NUMPAT",
         "\tReturn number of subscriptions to patterns.",
+        "SHARDCHANNELS [<pattern>]",
+        "\tReturn the currently active shard channels matching a <pattern> (default: '*').",
         "HELP",
         "\tPrints this help."};
 
@@ -1332,13 +2103,13 @@ void Service::Pubsub(CmdArgList args, ConnectionContext* cntx) {
     return;
   }
 
-  if (subcmd == "CHANNELS") {
+  if (subcmd == "CHANNELS" || subcmd == "SHARDCHANNELS") {
     string_view pattern;
     if (args.size() > 2) {
       pattern = ArgS(args, 2);
     }
 
-    PubsubChannels(pattern, cntx);
+    PubsubChannels(pattern, subcmd == "SHARDCHANNELS", cntx);
   } else if (subcmd == "NUMPAT") {
     PubsubPatterns(cntx);
   } else {
@@ -1349,7 +2120,7 @@ void Service::Pubsub(CmdArgList args, ConnectionContext* cntx) {
 VarzValue::Map Service::GetVarzStats() {
   VarzValue::Map res;
 
-  Metrics m = server_family_.GetMetrics();
+  Metrics m = server_family_.GetPublishedMetrics();
   DbStats db_stats;
   for (const auto& s : m.db) {
     db_stats += s;
@@ -1360,6 +2131,16 @@ VarzValue::Map Service::GetVarzStats() {
   double load = double(db_stats.key_count) / (1 + db_stats.bucket_count);
   res.emplace_back("table_load_factor", VarzValue::FromDouble(load));
 
+  constexpr pair<const char*, unsigned> kTypeMem[] = {
+      {"string_mem_usage", OBJ_STRING}, {"list_mem_usage", OBJ_LIST},
+      {"set_mem_usage", OBJ_SET},       {"zset_mem_usage", OBJ_ZSET},
+      {"hash_mem_usage", OBJ_HASH},     {"stream_mem_usage", OBJ_STREAM},
+      {"json_mem_usage", OBJ_JSON},     {"sbf_mem_usage", OBJ_SBF},
+      {"ts_mem_usage", OBJ_TS}};
+  for (const auto& [name, type] : kTypeMem) {
+    res.emplace_back(name, VarzValue::FromInt(db_stats.memory_usage_by_type[type]));
+  }
+
   return res;
 }
 
@@ -1376,6 +2157,20 @@ GlobalState Service::SwitchState(GlobalState from, GlobalState to) {
 void Service::ConfigureHttpHandlers(util::HttpListenerBase* base) {
   server_family_.ConfigureMetrics(base);
   base->RegisterCb("/txz", TxTable);
+  base->RegisterCb("/memz", MemoryTable);
+  base->RegisterCb("/debug/pprof/profile", CpuProfile);
+  base->RegisterCb("/debug/pprof/heap", [this](const http::QueryArgs& args, HttpContext* send) {
+    if (!CheckHttpPassword(args, send))
+      return;
+
+    if (!profiler::HeapSamplingEnabled()) {
+      http::StringResponse resp = http::MakeStringResponse(h2::status::not_found);
+      resp.body() = "heap sampling is disabled, see --heap_profile_sample_bytes\n";
+      send->Invoke(std::move(resp));
+      return;
+    }
+    SendProfile(profiler::CollectHeapProfile(&pp_), send);
+  });
 }
 
 void Service::OnClose(facade::ConnectionContext* cntx) {
@@ -1392,6 +2187,12 @@ void Service::OnClose(facade::ConnectionContext* cntx) {
       token.Wait();
     }
 
+    if (conn_state.subscribe_info && !conn_state.subscribe_info->shard_channels.empty()) {
+      auto token = conn_state.subscribe_info->borrow_token;
+      server_cntx->SUnsubscribeAll(false);
+      token.Wait();
+    }
+
     if (conn_state.subscribe_info) {
       DCHECK(!conn_state.subscribe_info->patterns.empty());
       auto token = conn_state.subscribe_info->borrow_token;
@@ -1402,6 +2203,7 @@ void Service::OnClose(facade::ConnectionContext* cntx) {
     }
   }
 
+  server_cntx->DisableTracking();
   DeactivateMonitoring(server_cntx);
 
   server_family_.OnClose(server_cntx);
@@ -1416,7 +2218,13 @@ string Service::GetContextInfo(facade::ConnectionContext* cntx) {
   if (cntx->conn_closing)
     buf[index++] = 't';
 
-  return index ? absl::StrCat("flags:", buf) : string();
+  string res = index ? absl::StrCat("flags:", buf) : string();
+  const auto& throttle = static_cast<ConnectionContext*>(cntx)->conn_state.throttle;
+  if (throttle.throttled_ns > 0) {
+    absl::StrAppend(&res, res.empty() ? "" : " ", "throttled_ms=",
+                    throttle.throttled_ns / 1'000'000);
+  }
+  return res;
 }
 
 using ServiceFunc = void (Service::*)(CmdArgList, ConnectionContext* cntx);
@@ -1442,12 +2250,15 @@ void Service::RegisterCommands() {
              &EvalValidator)
       << CI{"EXEC", kExecMask, 1, 0, 0, 0}.MFUNC(Exec)
       << CI{"PUBLISH", CO::LOADING | CO::FAST, 3, 0, 0, 0}.MFUNC(Publish)
+      << CI{"SPUBLISH", CO::LOADING | CO::FAST, 3, 0, 0, 0}.MFUNC(SPublish)
       << CI{"SUBSCRIBE", CO::NOSCRIPT | CO::LOADING, -2, 0, 0, 0}.MFUNC(Subscribe)
       << CI{"UNSUBSCRIBE", CO::NOSCRIPT | CO::LOADING, -1, 0, 0, 0}.MFUNC(Unsubscribe)
+      << CI{"SSUBSCRIBE", CO::NOSCRIPT | CO::LOADING, -2, 0, 0, 0}.MFUNC(SSubscribe)
+      << CI{"SUNSUBSCRIBE", CO::NOSCRIPT | CO::LOADING, -1, 0, 0, 0}.MFUNC(SUnsubscribe)
       << CI{"PSUBSCRIBE", CO::NOSCRIPT | CO::LOADING, -2, 0, 0, 0}.MFUNC(PSubscribe)
       << CI{"PUNSUBSCRIBE", CO::NOSCRIPT | CO::LOADING, -1, 0, 0, 0}.MFUNC(PUnsubscribe)
       << CI{"FUNCTION", CO::NOSCRIPT, 2, 0, 0, 0}.MFUNC(Function)
-      << CI{"MONITOR", CO::ADMIN, 1, 0, 0, 0}.MFUNC(Monitor)
+      << CI{"MONITOR", CO::ADMIN, -1, 0, 0, 0}.MFUNC(Monitor)
       << CI{"PUBSUB", CO::LOADING | CO::FAST, -1, 0, 0, 0}.MFUNC(Pubsub);
 
   StreamFamily::Register(&registry_);
@@ -1459,6 +2270,11 @@ void Service::RegisterCommands() {
   ZSetFamily::Register(&registry_);
   JsonFamily::Register(&registry_);
   BitOpsFamily::Register(&registry_);
+  HllFamily::Register(&registry_);
+  BloomFamily::Register(&registry_);
+  SearchFamily::Register(&registry_);
+  TimeSeriesFamily::Register(&registry_);
+  ClusterFamily::Register(&registry_);
 
   server_family_.Register(&registry_);
 
@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <absl/container/flat_hash_set.h>
+
 #include "base/varz_value.h"
 #include "facade/service_interface.h"
 #include "server/command_registry.h"
@@ -39,9 +41,19 @@ class Service : public facade::ServiceInterface {
   void Shutdown();
 
   void DispatchCommand(CmdArgList args, facade::ConnectionContext* cntx) final;
+  void DispatchManyCommands(absl::Span<CmdArgList> args_list,
+                            facade::ConnectionContext* cntx) final;
   void DispatchMC(const MemcacheParser::Command& cmd, std::string_view value,
                   facade::ConnectionContext* cntx) final;
 
+  // Delays the connection while its budgets of --client_ops_limit and --client_cpu_limit are
+  // used up, then takes ops commands from them. Runs in the thread of the connection.
+  void ThrottleClient(uint32_t ops, ConnectionContext* cntx);
+
+  // Takes the CPU time that the commands of the connection used from its budget, see
+  // ThrottleClient.
+  void ChargeClientCpu(uint64_t cpu_ns, ConnectionContext* cntx);
+
   facade::ConnectionContext* CreateContext(util::FiberSocketBase* peer,
                                            facade::Connection* owner) final;
 
@@ -97,14 +109,17 @@ class Service : public facade::ServiceInterface {
   void EvalSha(CmdArgList args, ConnectionContext* cntx);
   void Exec(CmdArgList args, ConnectionContext* cntx);
   void Publish(CmdArgList args, ConnectionContext* cntx);
+  void SPublish(CmdArgList args, ConnectionContext* cntx);
   void Subscribe(CmdArgList args, ConnectionContext* cntx);
   void Unsubscribe(CmdArgList args, ConnectionContext* cntx);
+  void SSubscribe(CmdArgList args, ConnectionContext* cntx);
+  void SUnsubscribe(CmdArgList args, ConnectionContext* cntx);
   void PSubscribe(CmdArgList args, ConnectionContext* cntx);
   void PUnsubscribe(CmdArgList args, ConnectionContext* cntx);
   void Function(CmdArgList args, ConnectionContext* cntx);
   void Monitor(CmdArgList args, ConnectionContext* cntx);
   void Pubsub(CmdArgList args, ConnectionContext* cntx);
-  void PubsubChannels(std::string_view pattern, ConnectionContext* cntx);
+  void PubsubChannels(std::string_view pattern, bool sharded, ConnectionContext* cntx);
   void PubsubPatterns(ConnectionContext* cntx);
 
   struct EvalArgs {
@@ -112,7 +127,11 @@ class Service : public facade::ServiceInterface {
     CmdArgList keys, args;
   };
 
-  void EvalInternal(const EvalArgs& eval_args, Interpreter* interpreter, ConnectionContext* cntx);
+  // Runs the script on an interpreter borrowed from the pool of the thread.
+  void EvalInternal(const EvalArgs& eval_args, ConnectionContext* cntx);
+
+  // Runs the script in the thread of shard sid, which holds all its keys.
+  void EvalOnShard(ShardId sid, const EvalArgs& eval_args, ConnectionContext* cntx);
 
   void CallFromScript(CmdArgList args, ObjectExplorer* reply, ConnectionContext* cntx);
 
@@ -125,6 +144,9 @@ class Service : public facade::ServiceInterface {
   CommandRegistry registry_;
   absl::flat_hash_map<std::string, unsigned> unknown_cmds_;
 
+  // Set by --relaxed_read_commands, see Transaction::SetRelaxedRead.
+  absl::flat_hash_set<const CommandId*> relaxed_read_cmds_;
+
   mutable ::boost::fibers::mutex mu_;
 
   GlobalState global_state_ = GlobalState::ACTIVE;  // protected by mu_;
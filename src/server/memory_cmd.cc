@@ -5,14 +5,35 @@
 #include "server/memory_cmd.h"
 
 #include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+#include <absl/strings/str_join.h>
 #include <mimalloc.h>
 
+#include <array>
+#include <cmath>
+
+extern "C" {
+#include "redis/object.h"
+}
+
+#include "base/flags.h"
 #include "facade/error.h"
 #include "server/engine_shard_set.h"
+#include "server/server_family.h"
 #include "server/server_state.h"
 
+ABSL_FLAG(std::string, mem_prefix_delimiter, ":",
+          "Delimiter that ends the key prefix, by which MEMORY STATS groups the keys");
+ABSL_FLAG(uint32_t, mem_prefix_sample_keys, 1000,
+          "Number of keys per shard that MEMORY STATS samples to estimate the usage per prefix");
+
+ABSL_DECLARE_FLAG(float, mem_defrag_threshold);
+ABSL_DECLARE_FLAG(float, commit_use_threshold);
+ABSL_DECLARE_FLAG(float, mem_utilization_threshold);
+
 using namespace std;
 using namespace facade;
+using absl::GetFlag;
 
 namespace dfly {
 
@@ -36,6 +57,129 @@ bool MiArenaVisit(const mi_heap_t* heap, const mi_heap_area_t* area, void* block
   return true;
 };
 
+// The pages of a heap with blocks of the same size.
+struct PageStats {
+  size_t pages = 0;
+  size_t committed = 0;
+  size_t used = 0;
+
+  // The pages below mem_utilization_threshold, which DefragTask empties by moving their blocks
+  // into other pages. Their unused bytes are what it can reclaim.
+  size_t sparse_pages = 0;
+  size_t reclaimable = 0;
+
+  // Number of pages by their utilization, in steps of 10%.
+  array<size_t, 10> histogram{};
+
+  PageStats& operator+=(const PageStats& o) {
+    pages += o.pages;
+    committed += o.committed;
+    used += o.used;
+    sparse_pages += o.sparse_pages;
+    reclaimable += o.reclaimable;
+    for (size_t i = 0; i < histogram.size(); ++i)
+      histogram[i] += o.histogram[i];
+    return *this;
+  }
+};
+
+// By block size, in ascending order.
+using HeapPageStats = vector<pair<size_t, PageStats>>;
+
+// Visits the pages, but not the blocks, of the heap. Approximates mi_heap_page_is_underutilized,
+// which also skips the page that the heap currently allocates from.
+HeapPageStats CollectPageStats(const mi_heap_t* heap) {
+  struct Ctx {
+    absl::flat_hash_map<size_t, PageStats> by_size;
+    float sparse_ratio;
+  } ctx{{}, GetFlag(FLAGS_mem_utilization_threshold)};
+
+  auto cb = [](const mi_heap_t*, const mi_heap_area_t* area, void* block, size_t block_size,
+               void* arg) {
+    if (area->committed == 0)
+      return true;
+
+    Ctx* ctx = reinterpret_cast<Ctx*>(arg);
+    PageStats& ps = ctx->by_size[area->block_size];
+    size_t used = min(area->used * area->block_size, area->committed);
+    double utilization = double(used) / area->committed;
+
+    ++ps.pages;
+    ps.committed += area->committed;
+    ps.used += used;
+    ++ps.histogram[min<size_t>(utilization * 10, ps.histogram.size() - 1)];
+    if (utilization < ctx->sparse_ratio) {
+      ++ps.sparse_pages;
+      ps.reclaimable += area->committed - used;
+    }
+    return true;
+  };
+  mi_heap_visit_blocks(heap, false /* visit only the areas */, cb, &ctx);
+
+  HeapPageStats res(ctx.by_size.begin(), ctx.by_size.end());
+  sort(res.begin(), res.end(), [](const auto& l, const auto& r) { return l.first < r.first; });
+  return res;
+}
+
+PageStats SumPageStats(const HeapPageStats& heap) {
+  PageStats res;
+  for (const auto& [block_size, ps] : heap)
+    res += ps;
+  return res;
+}
+
+// Rounds up to a multiple of 0.05, as the thresholds are given.
+double RoundThreshold(double val) {
+  return ceil(val * 20) / 20;
+}
+
+string Percent(size_t part, size_t whole) {
+  return absl::StrFormat("%.1f%%", whole ? 100.0 * part / whole : 0.0);
+}
+
+constexpr size_t kMaxStatsPrefixes = 32;
+
+// Number of the block sizes with the most reclaimable bytes that MEMORY DOCTOR lists per shard.
+constexpr size_t kDoctorBlockSizes = 5;
+
+// Object types that are reported by MEMORY STATS.
+constexpr unsigned kStatsTypes[] = {OBJ_STRING, OBJ_LIST, OBJ_SET, OBJ_ZSET, OBJ_HASH,
+                                    OBJ_STREAM, OBJ_JSON, OBJ_SBF, OBJ_TS};
+
+using PrefixMap = absl::flat_hash_map<string, size_t>;
+
+// Runs in the shard thread.
+PrefixMap SampleShardPrefixes(DbIndex db_ind, string_view delim, size_t limit) {
+  PrefixMap res;
+  DbSlice& slice = EngineShard::tlocal()->db_slice();
+  if (!slice.IsDbValid(db_ind))
+    return res;
+
+  PrimeTable* prime = slice.GetPrimeTable(db_ind);
+  PrimeTable::Cursor cursor;
+  size_t sampled = 0;
+  string scratch;
+
+  do {
+    cursor = prime->Traverse(cursor, [&](PrimeIterator it) {
+      string_view key = it->first.GetSlice(&scratch);
+      size_t pos = delim.empty() ? string_view::npos : key.find(delim);
+      string_view prefix = pos == string_view::npos ? string_view{} : key.substr(0, pos);
+      res[prefix] += it->first.MallocUsed() + it->second.MallocUsed();
+      ++sampled;
+    });
+  } while (cursor && sampled < limit);
+
+  if (sampled < prime->size()) {
+    double scale = double(prime->size()) / sampled;
+    for (auto& k_v : res) {
+      k_v.second = size_t(k_v.second * scale);
+    }
+  }
+
+  return res;
+}
+
 }  // namespace
 
 MemoryCmd::MemoryCmd(ServerFamily* owner, ConnectionContext* cntx) : sf_(*owner), cntx_(cntx) {
@@ -55,12 +199,150 @@ void MemoryCmd::Run(CmdArgList args) {
     string res = shard_set->pool()->at(tid)->AwaitBrief([&] { return MallocStats(tid); });
 
     return (*cntx_)->SendBulkString(res);
+  } else if (sub_cmd == "STATS") {
+    return Stats();
+  } else if (sub_cmd == "DOCTOR") {
+    return (*cntx_)->SendBulkString(Doctor());
+  } else if (sub_cmd == "BIGKEYS" && args.size() <= 3) {
+    uint32_t count = 10;
+    if (args.size() == 3 && !absl::SimpleAtoi(ArgS(args, 2), &count)) {
+      return (*cntx_)->SendError(kInvalidIntErr);
+    }
+    return ReportBigKeys(min<size_t>(count, BigKeys::kTopKeys));
   }
 
   string err = UnknownSubCmd(sub_cmd, "MEMORY");
   return (*cntx_)->SendError(err, kSyntaxErrType);
 }
 
+auto MemoryCmd::SamplePrefixMemory(DbIndex db_ind, size_t max_prefixes) -> PrefixMemory {
+  vector<PrefixMap> shard_prefixes(shard_set->size());
+  string delim = GetFlag(FLAGS_mem_prefix_delimiter);
+  size_t limit = max<uint32_t>(GetFlag(FLAGS_mem_prefix_sample_keys), 1);
+
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    shard_prefixes[shard->shard_id()] = SampleShardPrefixes(db_ind, delim, limit);
+  });
+
+  PrefixMap merged;
+  for (const auto& prefixes : shard_prefixes) {
+    for (const auto& k_v : prefixes) {
+      merged[k_v.first] += k_v.second;
+    }
+  }
+
+  PrefixMemory res(merged.begin(), merged.end());
+  sort(res.begin(), res.end(), [](const auto& l, const auto& r) { return l.second > r.second; });
+  if (res.size() > max_prefixes)
+    res.resize(max_prefixes);
+
+  return res;
+}
+
+void MemoryCmd::Stats() {
+  Metrics m = sf_.GetMetrics();
+  DbStats total;
+  for (const auto& db_stats : m.db) {
+    total += db_stats;
+  }
+
+  PrefixMemory prefixes = SamplePrefixMemory(cntx_->conn_state.db_index, kMaxStatsPrefixes);
+
+  auto* rb = static_cast<RedisReplyBuilder*>(cntx_->reply_builder());
+  rb->StartArray(12);
+  rb->SendBulkString("keys.count");
+  rb->SendLong(total.key_count);
+  rb->SendBulkString("dataset.bytes");
+  rb->SendLong(total.obj_memory_usage);
+  rb->SendBulkString("table.bytes");
+  rb->SendLong(total.table_mem_usage);
+  rb->SendBulkString("heap.bytes");
+  rb->SendLong(m.heap_used_bytes);
+
+  rb->SendBulkString("types");
+  rb->StartArray(ABSL_ARRAYSIZE(kStatsTypes) * 2);
+  for (unsigned type : kStatsTypes) {
+    rb->SendBulkString(ObjTypeName(type));
+    rb->SendLong(total.memory_usage_by_type[type]);
+  }
+
+  rb->SendBulkString("prefixes");
+  rb->StartArray(prefixes.size() * 2);
+  for (const auto& [prefix, bytes] : prefixes) {
+    rb->SendBulkString(prefix);
+    rb->SendLong(bytes);
+  }
+}
+
+void MemoryCmd::ReportBigKeys(size_t count) {
+  vector<BigKeys::Report> reports(shard_set->size());
+  shard_set->RunBriefInParallel(
+      [&](EngineShard* shard) { reports[shard->shard_id()] = shard->big_keys().last(); });
+
+  BigKeys::Report report = std::move(reports[0]);
+  for (size_t i = 1; i < reports.size(); ++i) {
+    report.Merge(reports[i], count);
+  }
+
+  unsigned num_types = 0;
+  for (unsigned type : kStatsTypes) {
+    num_types += report.types[type].keys > 0;
+  }
+
+  auto* rb = static_cast<RedisReplyBuilder*>(cntx_->reply_builder());
+  rb->StartArray(6);
+
+  // The age of the oldest report of a shard, -1 until every shard finished a pass.
+  rb->SendBulkString("pass.age.sec");
+  if (report.finished_ms == 0) {
+    rb->SendLong(-1);
+  } else {
+    uint64_t now_ms = GetCurrentTimeMs();
+    rb->SendLong(now_ms > report.finished_ms ? (now_ms - report.finished_ms) / 1000 : 0);
+  }
+  rb->SendBulkString("pass.duration.ms");
+  rb->SendLong(report.duration_ms);
+
+  rb->SendBulkString("types");
+  rb->StartArray(num_types * 2);
+  for (unsigned type : kStatsTypes) {
+    const BigKeys::TypeStats& ts = report.types[type];
+    if (ts.keys == 0)
+      continue;
+
+    rb->SendBulkString(ObjTypeName(type));
+    rb->StartArray(8);
+    rb->SendBulkString("keys");
+    rb->SendLong(ts.keys);
+    rb->SendBulkString("bytes");
+    rb->SendLong(ts.bytes);
+
+    rb->SendBulkString("largest");
+    size_t num_keys = min(ts.largest.size(), count);
+    rb->StartArray(num_keys);
+    for (size_t i = 0; i < num_keys; ++i) {
+      rb->StartArray(3);
+      rb->SendBulkString(ts.largest[i].key);
+      rb->SendLong(ts.largest[i].db);
+      rb->SendLong(ts.largest[i].bytes);
+    }
+
+    // Pairs of the upper bound of a bucket and its number of keys, for the non empty buckets.
+    rb->SendBulkString("histogram");
+    unsigned num_buckets = 0;
+    for (size_t keys : ts.histogram) {
+      num_buckets += keys > 0;
+    }
+    rb->StartArray(num_buckets * 2);
+    for (unsigned i = 0; i < BigKeys::kHistBuckets; ++i) {
+      if (ts.histogram[i] == 0)
+        continue;
+      rb->SendLong((2UL << i) - 1);
+      rb->SendLong(ts.histogram[i]);
+    }
+  }
+}
+
 string MemoryCmd::MallocStats(unsigned tid) {
   string str;
 
@@ -84,10 +366,95 @@ string MemoryCmd::MallocStats(unsigned tid) {
     used += k_v.second * get<3>(k_v.first);
   }
 
+  absl::StrAppend(&str, "\nPage utilization by block size from thread:", tid, "\n");
+  absl::StrAppend(&str, "BlockSize Pages Committed Used Reclaimable PagesByUtilization(0-100%)\n");
+  HeapPageStats page_stats = CollectPageStats(data_heap);
+  for (const auto& [block_size, ps] : page_stats) {
+    absl::StrAppend(&str, block_size, " ", ps.pages, " ", ps.committed, " ", ps.used, " ",
+                    ps.reclaimable, " ", absl::StrJoin(ps.histogram, ","), "\n");
+  }
+
   uint64_t delta = (absl::GetCurrentTimeNanos() - start) / 1000;
   absl::StrAppend(&str, "--- End mimalloc statistics, took ", delta, "us ---\n");
   absl::StrAppend(&str, "total reserved: ", reserved, ", comitted: ", committed, ", used: ", used,
-                  "\n");
+                  ", reclaimable by defrag: ", SumPageStats(page_stats).reclaimable, "\n");
+
+  return str;
+}
+
+string MemoryCmd::Doctor() {
+  vector<HeapPageStats> shard_stats(shard_set->size());
+  shard_set->RunBriefInParallel([&](EngineShard* shard) {
+    shard_stats[shard->shard_id()] = CollectPageStats(ServerState::tlocal()->data_heap());
+  });
+
+  string str;
+  PageStats total;
+  for (size_t sid = 0; sid < shard_stats.size(); ++sid) {
+    PageStats shard_total = SumPageStats(shard_stats[sid]);
+    total += shard_total;
+    absl::StrAppend(&str, "shard ", sid, ": committed ", shard_total.committed, ", used ",
+                    shard_total.used, " (", Percent(shard_total.used, shard_total.committed),
+                    "), reclaimable by defrag ", shard_total.reclaimable, " in ",
+                    shard_total.sparse_pages, " of ", shard_total.pages, " pages\n");
+
+    HeapPageStats& top = shard_stats[sid];
+    sort(top.begin(), top.end(),
+         [](const auto& l, const auto& r) { return l.second.reclaimable > r.second.reclaimable; });
+    for (size_t i = 0; i < min(top.size(), kDoctorBlockSizes); ++i) {
+      const auto& [block_size, ps] = top[i];
+      if (ps.reclaimable == 0)
+        break;
+      absl::StrAppend(&str, "  block size ", block_size, ": ", ps.pages, " pages, used ",
+                      Percent(ps.used, ps.committed), ", reclaimable ", ps.reclaimable, "\n");
+    }
+  }
+
+  // DefragTaskState::IsRequired compares the committed memory of the process with the used one.
+  size_t used = used_mem_current.load(memory_order_relaxed);
+  size_t committed = max<int64_t>(GetMallocCurrentCommitted(), 0);
+  size_t after_defrag = committed > total.reclaimable ? committed - total.reclaimable : 0;
+  double ratio = used ? double(committed) / used : 0;
+  double ratio_after = used ? double(after_defrag) / used : 0;
+  float defrag_threshold = GetFlag(FLAGS_mem_defrag_threshold);
+  float commit_use = GetFlag(FLAGS_commit_use_threshold);
+
+  absl::StrAppend(&str, "\nprocess: committed ", committed, ", used ", used,
+                  absl::StrFormat(", committed/used %.2f, after defrag about %.2f\n", ratio,
+                                  ratio_after));
+  absl::StrAppend(&str, "defrag runs when committed/used > commit_use_threshold (", commit_use,
+                  ") and committed > mem_defrag_threshold (", defrag_threshold,
+                  ") * maxmemory (", max_memory_limit, ")\n");
+
+  absl::StrAppend(&str, "\nrecommendations:\n");
+  if (used == 0 || total.reclaimable < total.committed / 20) {
+    absl::StrAppend(&str, "- less than 5% of the committed memory can be reclaimed, defrag is "
+                          "not needed\n");
+    return str;
+  }
+
+  // Below the ratio that defrag can reach, it would rescan the shards without any gain.
+  double rec_commit_use = max(1.05, RoundThreshold(ratio_after * 1.1));
+  if (abs(rec_commit_use - commit_use) > 0.01) {
+    absl::StrAppend(&str,
+                    absl::StrFormat("- commit_use_threshold %.2f: defrag can bring the ratio "
+                                    "down to about %.2f\n",
+                                    rec_commit_use, ratio_after));
+  }
+
+  double rec_defrag =
+      min(1.0, max(0.0, RoundThreshold(double(committed) / max_memory_limit) - 0.05));
+  if (ratio > rec_commit_use && committed <= max_memory_limit * defrag_threshold) {
+    absl::StrAppend(&str,
+                    absl::StrFormat("- mem_defrag_threshold %.2f: the current one keeps defrag "
+                                    "from reclaiming %d bytes\n",
+                                    rec_defrag, total.reclaimable));
+  }
+
+  if (ratio <= rec_commit_use) {
+    absl::StrAppend(&str, "- the committed memory is close to what defrag can reach, the "
+                          "thresholds can stay\n");
+  }
 
   return str;
 }
@@ -4,6 +4,10 @@
 
 #pragma once
 
+#include <string>
+#include <utility>
+#include <vector>
+
 #include "server/conn_context.h"
 
 namespace dfly {
@@ -16,8 +20,25 @@ class MemoryCmd {
 
   void Run(CmdArgList args);
 
+  // Estimated memory usage of keys and values grouped by key prefix, in descending order.
+  using PrefixMemory = std::vector<std::pair<std::string, size_t>>;
+
+  // Samples up to mem_prefix_sample_keys entries of db_ind in every shard and groups them by the
+  // key part that precedes mem_prefix_delimiter. The sampled bytes are scaled by the number of
+  // keys in the shard. Keys without the delimiter are accounted under an empty prefix.
+  // Returns at most max_prefixes of the largest groups.
+  static PrefixMemory SamplePrefixMemory(DbIndex db_ind, size_t max_prefixes);
+
  private:
   std::string MallocStats(unsigned tid);
+  void Stats();
+
+  // Reports the page utilization of the heap of every shard and the memory that DefragTask
+  // can reclaim, and recommends the defrag thresholds for it.
+  std::string Doctor();
+
+  // Reports the result of the last background pass of every shard, see BigKeys.
+  void ReportBigKeys(size_t count);
 
   ServerFamily& sf_;
   ConnectionContext* cntx_;
@@ -0,0 +1,137 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/migration.h"
+
+#include <netinet/tcp.h>
+
+#include <boost/asio/ip/tcp.hpp>
+
+#include "base/logging.h"
+#include "server/replica.h"
+#include "util/proactor_base.h"
+
+namespace dfly {
+
+using namespace std;
+using namespace util;
+using facade::RedisParser;
+using facade::RespExpr;
+
+MigrationClient::MigrationClient(uint32_t timeout_ms) : timeout_ms_(max(timeout_ms, 1u)) {
+}
+
+MigrationClient::~MigrationClient() {
+  Close();
+}
+
+error_code MigrationClient::Connect(const string& host, uint16_t port) {
+  char ip_addr[INET6_ADDRSTRLEN];
+  int resolve_res = ResolveDns(host, ip_addr);
+  if (resolve_res != 0) {
+    LOG(WARNING) << "Dns error " << gai_strerror(resolve_res) << ", host: " << host;
+    return make_error_code(errc::host_unreachable);
+  }
+
+  sock_.reset(ProactorBase::me()->CreateSocket());
+  watchdog_ = ProactorBase::me()->LaunchFiber([this] { Watchdog(); });
+
+  op_start_ns_ = ProactorBase::GetMonotonicTimeNs();
+  error_code ec = sock_->Connect({boost::asio::ip::make_address(ip_addr), port});
+  op_start_ns_ = 0;
+  if (timed_out_)
+    return make_error_code(errc::timed_out);
+  if (ec)
+    return ec;
+
+  int yes = 1;
+  setsockopt(sock_->native_handle(), IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  return ec;
+}
+
+void MigrationClient::AddCommand(absl::Span<const string_view> args) {
+  serializer_.SendCommandArray(args);
+  ++pending_;
+}
+
+error_code MigrationClient::Flush(vector<Reply>* replies) {
+  DCHECK(sock_);
+  replies->clear();
+  if (pending_ == 0)
+    return {};
+
+  op_start_ns_ = ProactorBase::GetMonotonicTimeNs();
+  error_code ec = sock_->Write(::io::Buffer(sink_.str()));
+  sink_.Clear();
+  if (!ec)
+    ec = ReadReplies(replies);
+  op_start_ns_ = 0;
+  pending_ = 0;
+
+  return timed_out_ ? make_error_code(errc::timed_out) : ec;
+}
+
+error_code MigrationClient::ReadReplies(vector<Reply>* replies) {
+  while (replies->size() < pending_) {
+    while (io_buf_.InputLen() > 0 && replies->size() < pending_) {
+      uint32_t consumed = 0;
+      RedisParser::Result res = parser_.Parse(io_buf_.InputBuffer(), &consumed, &resp_args_);
+      if (res == RedisParser::INPUT_PENDING) {
+        io_buf_.ConsumeInput(consumed);
+        break;
+      }
+      if (res != RedisParser::OK || resp_args_.empty())
+        return make_error_code(errc::bad_message);
+
+      Reply reply;
+      const RespExpr& expr = resp_args_.front();
+      if (expr.type == RespExpr::ERROR) {
+        reply.error = string(facade::ToSV(expr.GetBuf()));
+      } else if (expr.type == RespExpr::INT64) {
+        reply.ival = get<int64_t>(expr.u);
+      }
+      replies->push_back(std::move(reply));
+      io_buf_.ConsumeInput(consumed);
+    }
+
+    if (replies->size() == pending_)
+      break;
+
+    io_buf_.EnsureCapacity(1 << 14);
+    ::io::Result<size_t> res = sock_->Recv(io_buf_.AppendBuffer());
+    if (!res)
+      return res.error();
+    if (*res == 0)
+      return make_error_code(errc::connection_aborted);
+    io_buf_.CommitWrite(*res);
+  }
+
+  return {};
+}
+
+void MigrationClient::Watchdog() {
+  auto period = chrono::milliseconds(timeout_ms_ / 4 + 1);
+  while (!closed_.WaitFor(period)) {
+    uint64_t start = op_start_ns_;
+    if (start && ProactorBase::GetMonotonicTimeNs() - start > uint64_t(timeout_ms_) * 1000000) {
+      LOG(WARNING) << "The target of MIGRATE did not respond for " << timeout_ms_ << "ms";
+      timed_out_ = true;
+      sock_->Shutdown(SHUT_RDWR);
+      return;
+    }
+  }
+}
+
+void MigrationClient::Close() {
+  if (!sock_)
+    return;
+
+  closed_.Notify();
+  if (watchdog_.IsJoinable())
+    watchdog_.Join();
+  sock_->Close();
+  sock_.reset();
+}
+
+}  // namespace dfly
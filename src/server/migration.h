@@ -0,0 +1,79 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/types/span.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "base/io_buf.h"
+#include "facade/facade_types.h"
+#include "facade/redis_parser.h"
+#include "facade/reply_builder.h"
+#include "io/io.h"
+#include "util/fiber_socket_base.h"
+#include "util/fibers/fiber.h"
+#include "util/fibers/fibers_ext.h"
+
+namespace dfly {
+
+// A connection of MIGRATE to its target. The commands are queued and sent in a single write by
+// Flush, which then reads all their replies. An operation on the socket fails once the target
+// does not respond for timeout_ms. Must be used in the thread that connected it.
+class MigrationClient {
+ public:
+  struct Reply {
+    std::string error;  // the message of an error reply, empty otherwise.
+    int64_t ival = 0;   // the value of an integer reply.
+  };
+
+  explicit MigrationClient(uint32_t timeout_ms);
+  MigrationClient(const MigrationClient&) = delete;
+  ~MigrationClient();
+
+  std::error_code Connect(const std::string& host, uint16_t port);
+
+  void AddCommand(absl::Span<const std::string_view> args);
+
+  // The number and the total size of the queued commands.
+  size_t pending() const {
+    return pending_;
+  }
+
+  size_t pending_bytes() const {
+    return sink_.str().size();
+  }
+
+  // Sends the queued commands and replaces replies with their replies, in order.
+  std::error_code Flush(std::vector<Reply>* replies);
+
+  void Close();
+
+ private:
+  std::error_code ReadReplies(std::vector<Reply>* replies);
+
+  // Shuts the socket down if an operation takes longer than the timeout.
+  void Watchdog();
+
+  uint32_t timeout_ms_;
+  std::unique_ptr<util::FiberSocketBase> sock_;
+  ::io::StringSink sink_;
+  facade::ReqSerializer serializer_{&sink_};
+  base::IoBuf io_buf_{1 << 14};
+  facade::RedisParser parser_{false};
+  facade::RespVec resp_args_;
+  size_t pending_ = 0;
+
+  uint64_t op_start_ns_ = 0;  // 0 unless an operation is in flight.
+  bool timed_out_ = false;
+  util::fibers_ext::Done closed_;
+  util::fibers_ext::Fiber watchdog_;
+};
+
+}  // namespace dfly
@@ -0,0 +1,168 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/pipeline_squasher.h"
+
+#include "base/logging.h"
+#include "server/command_registry.h"
+#include "server/engine_shard_set.h"
+#include "server/main_service.h"
+#include "server/server_state.h"
+#include "server/transaction.h"
+
+namespace dfly {
+
+using namespace std;
+using namespace util;
+
+PipelineSquasher::PipelineSquasher(Service* service, ConnectionContext* cntx)
+    : service_(service), cntx_(cntx), shard_cmds_(shard_set->size()),
+      shard_cpu_(shard_set->size()) {
+}
+
+void PipelineSquasher::Run(absl::Span<CmdArgList> args_list) {
+  for (CmdArgList args : args_list) {
+    optional<ShardId> sid = CanSquash() ? SquashableShard(args) : nullopt;
+    if (sid) {
+      shard_cmds_[*sid].push_back(cmds_.size());
+      cmds_.push_back(args);
+      continue;
+    }
+
+    Flush();
+    service_->DispatchCommand(args, cntx_);
+  }
+
+  Flush();
+}
+
+bool PipelineSquasher::CanSquash() const {
+  const ConnectionState& state = cntx_->conn_state;
+  if (state.exec_info.IsActive() || state.script_info || state.tracking_info || state.asking ||
+      state.read_after)
+    return false;
+
+  return !cntx_->monitor && (!cntx_->req_auth || cntx_->authenticated);
+}
+
+optional<ShardId> PipelineSquasher::SquashableShard(CmdArgList args) const {
+  ToUpper(&args[0]);
+  const CommandId* cid = service_->FindCmd(ArgS(args, 0));
+  if (!cid || cid->first_key_pos() == 0)
+    return nullopt;
+
+  // Commands that need the real connection context or that span the shards.
+  constexpr uint32_t kNoSquashMask =
+      CO::ADMIN | CO::NOSCRIPT | CO::BLOCKING | CO::GLOBAL_TRANS | CO::VARIADIC_KEYS;
+  if ((cid->opt_mask() & kNoSquashMask) || cid->name() == string_view{"WATCH"})
+    return nullopt;
+
+  // Malformed commands are rejected by DispatchCommand.
+  int arity = cid->arity();
+  if ((arity > 0 && args.size() != size_t(arity)) || (arity < 0 && args.size() < size_t(-arity)))
+    return nullopt;
+  if (cid->key_arg_step() == 2 && (args.size() % 2) == 0)
+    return nullopt;
+
+  OpResult<KeyIndex> key_index = DetermineKeys(cid, args);
+  if (!key_index)
+    return nullopt;
+
+  ShardId sid = Shard(ArgS(args, key_index->start), shard_set->size());
+  for (unsigned i = key_index->start; i < key_index->end; i += key_index->step) {
+    if (Shard(ArgS(args, i), shard_set->size()) != sid)
+      return nullopt;
+  }
+  if (key_index->bonus && Shard(ArgS(args, key_index->bonus), shard_set->size()) != sid)
+    return nullopt;
+
+  return sid;
+}
+
+void PipelineSquasher::Flush() {
+  if (cmds_.empty())
+    return;
+
+  // Nothing to squash.
+  if (cmds_.size() == 1) {
+    service_->DispatchCommand(cmds_.front(), cntx_);
+  } else {
+    replies_.resize(cmds_.size());
+    if (cntx_->conn_state.write_lsns.empty())
+      cntx_->conn_state.write_lsns.resize(shard_set->size());
+    if (!cntx_->is_replicating)
+      service_->ThrottleClient(cmds_.size(), cntx_);
+
+    fibers_ext::BlockingCounter bc{0};
+    for (ShardId sid = 0; sid < shard_cmds_.size(); ++sid) {
+      if (shard_cmds_[sid].empty())
+        continue;
+
+      bc.Add(1);
+      shard_set->pool()->at(sid)->Dispatch([this, sid, bc]() mutable {
+        RunOnShard(sid);
+        bc.Dec();
+      });
+    }
+    bc.Wait();
+
+    uint64_t cpu_ns = 0;
+    for (auto& cpu : shard_cpu_) {
+      cntx_->cpu_time.dispatch_ns += cpu.dispatch_ns;
+      cntx_->cpu_time.shard_ns += cpu.shard_ns;
+      cpu_ns += cpu.total_ns();
+      cpu = {};
+    }
+    if (!cntx_->is_replicating)
+      service_->ChargeClientCpu(cpu_ns, cntx_);
+
+    vector<string_view> replies(replies_.begin(), replies_.end());
+    cntx_->reply_builder()->SendRawVec(replies);
+    if (close_connection_.load(memory_order_relaxed))
+      cntx_->reply_builder()->CloseConnection();
+
+    ServerState::tlocal()->connection_stats.squashed_cmd_cnt += cmds_.size();
+    replies_.clear();
+  }
+
+  cmds_.clear();
+  for (auto& indices : shard_cmds_) {
+    indices.clear();
+  }
+}
+
+void PipelineSquasher::RunOnShard(ShardId sid) {
+  ::io::StringSink sink;
+  ConnectionContext stub{&sink, cntx_->owner()};
+  stub.conn_state.db_index = cntx_->conn_state.db_index;
+  stub.req_auth = cntx_->req_auth;
+  stub.authenticated = cntx_->authenticated;
+  stub.is_replicating = cntx_->is_replicating;
+  stub->SetResp3((*cntx_)->IsResp3());
+  stub.conn_state.throttle.exempt = true;
+
+  for (unsigned index : shard_cmds_[sid]) {
+    service_->DispatchCommand(cmds_[index], &stub);
+    replies_[index] = sink.str();
+    sink.Clear();
+  }
+
+  // The commands of the shard wrote only there, see WAIT.
+  if (!stub.conn_state.write_lsns.empty() && stub.conn_state.write_lsns[sid] > 0)
+    cntx_->conn_state.write_lsns[sid] = stub.conn_state.write_lsns[sid];
+
+  shard_cpu_[sid] = stub.cpu_time;
+
+  SinkReplyBuilder* builder = stub.reply_builder();
+  auto& err_count_map = ServerState::tlocal()->connection_stats.err_count_map;
+  for (const auto& k_v : builder->err_count()) {
+    err_count_map[k_v.first] += k_v.second;
+  }
+
+  if (builder->GetError()) {
+    close_connection_.store(true, memory_order_relaxed);
+  }
+}
+
+}  // namespace dfly
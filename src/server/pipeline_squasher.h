@@ -0,0 +1,53 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <atomic>
+#include <optional>
+
+#include "server/conn_context.h"
+
+namespace dfly {
+
+class Service;
+
+// Executes a pipeline of commands of a single connection. Consecutive commands whose keys
+// belong to a single shard are grouped by shard, every group runs in one hop into the thread
+// of its shard and the replies are sent in the order of the commands. Commands of the same
+// shard, hence all the commands on the same key, run in their order. The other commands are
+// dispatched as usual and separate the groups.
+class PipelineSquasher {
+ public:
+  PipelineSquasher(Service* service, ConnectionContext* cntx);
+
+  // Runs the commands and sends their replies.
+  void Run(absl::Span<CmdArgList> args_list);
+
+ private:
+  // Returns true if the connection state allows running its commands with a stub context.
+  bool CanSquash() const;
+
+  // Returns the shard of the keys of the command, or nullopt if it can not be squashed.
+  std::optional<ShardId> SquashableShard(CmdArgList args) const;
+
+  // Runs the pending commands and sends their replies.
+  void Flush();
+
+  // Runs in the thread of sid. Runs the pending commands of the shard and captures their replies.
+  void RunOnShard(ShardId sid);
+
+  Service* service_;
+  ConnectionContext* cntx_;
+
+  std::vector<CmdArgList> cmds_;
+  std::vector<std::vector<unsigned>> shard_cmds_;  // indices into cmds_ per shard.
+  std::vector<std::string> replies_;               // per command in cmds_.
+
+  // The CPU time of the commands per shard, accounted with the connection.
+  std::vector<facade::ConnectionContext::CpuTime> shard_cpu_;
+  std::atomic_bool close_connection_{false};
+};
+
+}  // namespace dfly
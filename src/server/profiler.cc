@@ -0,0 +1,441 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/profiler.h"
+
+#include <absl/base/macros.h>
+#include <absl/container/flat_hash_map.h>
+#include <absl/debugging/symbolize.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <thread>
+
+#include "base/logging.h"
+#include "util/fibers/fibers_ext.h"
+#include "util/proactor_pool.h"
+
+extern "C" {
+#include "redis/zmalloc.h"
+}
+
+namespace dfly {
+namespace profiler {
+
+using namespace std;
+
+namespace {
+
+constexpr unsigned kMaxDepth = 64;
+constexpr unsigned kCpuHz = 100;
+constexpr size_t kMaxCpuSamples = 1 << 17;
+
+// The frames of the signal handler, or of the allocation hooks, above the sampled stack.
+constexpr unsigned kSkippedFrames = 2;
+
+// Set by InitThread, read by the signal handler.
+thread_local int32_t thread_index = -1;
+thread_local bool is_shard_thread = false;
+
+string_view ThreadKind(int32_t index, bool is_shard) {
+  return index < 0 ? "other" : (is_shard ? "shard" : "io");
+}
+
+// Serializes a profile.proto message. Samples with the same stack and thread are merged.
+class ProfileBuilder {
+ public:
+  struct ValueType {
+    string_view type;
+    string_view unit;
+  };
+
+  ProfileBuilder(initializer_list<ValueType> sample_types, ValueType period_type, int64_t period);
+
+  // pcs are return addresses except for pcs[0] if exact_leaf.
+  void AddSample(const void* const* pcs, unsigned depth, bool exact_leaf, int32_t thread,
+                 bool is_shard, absl::Span<const int64_t> values);
+
+  string Serialize(absl::Time start, absl::Duration duration);
+
+ private:
+  struct Sample {
+    vector<uint64_t> locations;
+    vector<int64_t> values;
+    int32_t thread;
+    bool is_shard;
+  };
+
+  int64_t StringId(string_view str);
+  uint64_t LocationId(const void* pc, bool exact);
+
+  static void AppendVarint(uint64_t val, string* dest);
+  static void AppendTag(unsigned field, unsigned wire_type, string* dest);
+  static void AppendInt(unsigned field, uint64_t val, string* dest);
+  static void AppendBytes(unsigned field, string_view bytes, string* dest);
+  static void AppendPacked(unsigned field, absl::Span<const uint64_t> vals, string* dest);
+
+  vector<ValueType> sample_types_;
+  ValueType period_type_;
+  int64_t period_;
+
+  vector<string> strings_;
+  absl::flat_hash_map<string, int64_t> string_ids_;
+
+  // (pc, exact) -> location id, the location of id has the function of id.
+  absl::flat_hash_map<pair<const void*, bool>, uint64_t> location_ids_;
+  vector<pair<const void*, int64_t>> locations_;  // address and function name of every id - 1.
+
+  vector<Sample> samples_;
+  absl::flat_hash_map<string, size_t> sample_index_;  // key of the sample -> index in samples_.
+};
+
+ProfileBuilder::ProfileBuilder(initializer_list<ValueType> sample_types, ValueType period_type,
+                               int64_t period)
+    : sample_types_(sample_types), period_type_(period_type), period_(period) {
+  StringId("");  // string_table[0] must be empty.
+}
+
+void ProfileBuilder::AddSample(const void* const* pcs, unsigned depth, bool exact_leaf,
+                               int32_t thread, bool is_shard, absl::Span<const int64_t> values) {
+  string key(reinterpret_cast<const char*>(pcs), depth * sizeof(void*));
+  key.append(reinterpret_cast<const char*>(&thread), sizeof(thread));
+
+  auto [it, inserted] = sample_index_.emplace(std::move(key), samples_.size());
+  if (!inserted) {
+    Sample& sample = samples_[it->second];
+    for (size_t i = 0; i < values.size(); ++i)
+      sample.values[i] += values[i];
+    return;
+  }
+
+  Sample sample{.locations = {}, .values = {values.begin(), values.end()}, .thread = thread,
+                .is_shard = is_shard};
+  for (unsigned i = 0; i < depth; ++i)
+    sample.locations.push_back(LocationId(pcs[i], exact_leaf && i == 0));
+  samples_.push_back(std::move(sample));
+}
+
+int64_t ProfileBuilder::StringId(string_view str) {
+  auto [it, inserted] = string_ids_.emplace(str, strings_.size());
+  if (inserted)
+    strings_.emplace_back(str);
+  return it->second;
+}
+
+uint64_t ProfileBuilder::LocationId(const void* pc, bool exact) {
+  auto [it, inserted] = location_ids_.emplace(make_pair(pc, exact), locations_.size() + 1);
+  if (inserted) {
+    // A return address follows the call, so its predecessor belongs to the calling line.
+    const char* lookup = reinterpret_cast<const char*>(pc) - (exact ? 0 : 1);
+    char name[1024];
+    if (!absl::Symbolize(lookup, name, sizeof(name)))
+      snprintf(name, sizeof(name), "%p", pc);
+    locations_.emplace_back(pc, StringId(name));
+  }
+  return it->second;
+}
+
+string ProfileBuilder::Serialize(absl::Time start, absl::Duration duration) {
+  string res, msg;
+
+  auto append_value_type = [&](unsigned field, ValueType vt) {
+    msg.clear();
+    AppendInt(1, StringId(vt.type), &msg);
+    AppendInt(2, StringId(vt.unit), &msg);
+    AppendBytes(field, msg, &res);
+  };
+
+  for (ValueType vt : sample_types_)
+    append_value_type(1, vt);
+
+  int64_t kind_key = StringId("thread_kind"), thread_key = StringId("thread");
+  for (const Sample& sample : samples_) {
+    msg.clear();
+    AppendPacked(1, sample.locations, &msg);
+    vector<uint64_t> values(sample.values.begin(), sample.values.end());
+    AppendPacked(2, values, &msg);
+
+    string label;
+    AppendInt(1, kind_key, &label);
+    AppendInt(2, StringId(ThreadKind(sample.thread, sample.is_shard)), &label);
+    AppendBytes(3, label, &msg);
+    if (sample.thread >= 0) {
+      label.clear();
+      AppendInt(1, thread_key, &label);
+      AppendInt(3, sample.thread, &label);
+      AppendBytes(3, label, &msg);
+    }
+    AppendBytes(2, msg, &res);
+  }
+
+  // Every location has a line of its own function, so that pprof needs no binaries.
+  for (size_t i = 0; i < locations_.size(); ++i) {
+    uint64_t id = i + 1;
+    string line;
+    AppendInt(1, id, &line);
+
+    msg.clear();
+    AppendInt(1, id, &msg);
+    AppendInt(3, reinterpret_cast<uint64_t>(locations_[i].first), &msg);
+    AppendBytes(4, line, &msg);
+    AppendBytes(4, msg, &res);
+
+    msg.clear();
+    AppendInt(1, id, &msg);
+    AppendInt(2, locations_[i].second, &msg);
+    AppendInt(3, locations_[i].second, &msg);
+    AppendBytes(5, msg, &res);
+  }
+
+  append_value_type(11, period_type_);
+  AppendInt(12, period_, &res);
+  AppendInt(9, absl::ToUnixNanos(start), &res);
+  AppendInt(10, absl::ToInt64Nanoseconds(duration), &res);
+
+  // The fields may come in any order, the strings are last since all of them are known by now.
+  for (const string& str : strings_)
+    AppendBytes(6, str, &res);
+
+  return res;
+}
+
+void ProfileBuilder::AppendVarint(uint64_t val, string* dest) {
+  while (val >= 0x80) {
+    dest->push_back(char(val | 0x80));
+    val >>= 7;
+  }
+  dest->push_back(char(val));
+}
+
+void ProfileBuilder::AppendTag(unsigned field, unsigned wire_type, string* dest) {
+  AppendVarint((field << 3) | wire_type, dest);
+}
+
+void ProfileBuilder::AppendInt(unsigned field, uint64_t val, string* dest) {
+  AppendTag(field, 0, dest);
+  AppendVarint(val, dest);
+}
+
+void ProfileBuilder::AppendBytes(unsigned field, string_view bytes, string* dest) {
+  AppendTag(field, 2, dest);
+  AppendVarint(bytes.size(), dest);
+  dest->append(bytes);
+}
+
+void ProfileBuilder::AppendPacked(unsigned field, absl::Span<const uint64_t> vals, string* dest) {
+  string packed;
+  for (uint64_t v : vals)
+    AppendVarint(v, &packed);
+  AppendBytes(field, packed, dest);
+}
+
+/*
+  CPU profile: the SIGPROF handler writes the stack of the interrupted thread into the next
+  slot of a preallocated buffer.
+*/
+
+struct CpuSample {
+  int32_t thread;
+  bool is_shard;
+  uint8_t depth;
+  void* pcs[kMaxDepth];
+};
+
+atomic_bool cpu_profile_running{false};
+atomic_bool cpu_sampling{false};
+atomic_int cpu_handlers_inflight{0};
+CpuSample* cpu_samples = nullptr;
+size_t cpu_samples_capacity = 0;
+atomic_size_t cpu_samples_next{0};
+
+const void* InterruptedPc(const void* ucontext) {
+  const auto* uc = reinterpret_cast<const ucontext_t*>(ucontext);
+#if defined(__x86_64__)
+  return reinterpret_cast<const void*>(uc->uc_mcontext.gregs[REG_RIP]);
+#elif defined(__aarch64__)
+  return reinterpret_cast<const void*>(uc->uc_mcontext.pc);
+#else
+  return nullptr;
+#endif
+}
+
+// backtrace() unwinds by the unwind tables, which also describe the signal trampoline, so
+// that the stack of the interrupted function is found even without frame pointers.
+void ProfSignalHandler(int sig, siginfo_t* info, void* ucontext) {
+  int saved_errno = errno;
+  cpu_handlers_inflight.fetch_add(1);
+  if (cpu_sampling.load()) {
+    size_t index = cpu_samples_next.fetch_add(1, memory_order_relaxed);
+    if (index < cpu_samples_capacity) {
+      void* frames[kMaxDepth + kSkippedFrames];
+      int depth = backtrace(frames, ABSL_ARRAYSIZE(frames));
+
+      // The interrupted pc is the first frame after the handler and its trampoline.
+      const void* pc = InterruptedPc(ucontext);
+      int first = 0;
+      while (first < depth && frames[first] != pc)
+        ++first;
+      if (first == depth)
+        first = min<int>(depth, kSkippedFrames);
+
+      CpuSample& sample = cpu_samples[index];
+      sample.thread = thread_index;
+      sample.is_shard = is_shard_thread;
+      sample.depth = min<int>(depth - first, kMaxDepth);
+      memcpy(sample.pcs, frames + first, sample.depth * sizeof(void*));
+    }
+  }
+  cpu_handlers_inflight.fetch_sub(1);
+  errno = saved_errno;
+}
+
+void SetProfTimer(unsigned hz) {
+  itimerval timer{};
+  if (hz) {
+    timer.it_interval.tv_usec = 1000000 / hz;
+    timer.it_value = timer.it_interval;
+  }
+  CHECK_EQ(0, setitimer(ITIMER_PROF, &timer, nullptr));
+}
+
+/*
+  Heap profile: zmalloc passes the sampled blocks to the hooks below, on their thread.
+*/
+
+size_t heap_sample_bytes = 0;
+
+struct HeapSample {
+  uint32_t usable;
+  uint8_t depth;
+  void* pcs[kMaxDepth];
+};
+
+thread_local absl::flat_hash_map<void*, HeapSample>* heap_samples = nullptr;
+
+void OnSampledAlloc(void* ptr, size_t usable) {
+  if (!heap_samples)
+    heap_samples = new absl::flat_hash_map<void*, HeapSample>;
+
+  void* frames[kMaxDepth + kSkippedFrames];
+  int depth = max<int>(backtrace(frames, ABSL_ARRAYSIZE(frames)) - kSkippedFrames, 0);
+
+  HeapSample& sample = (*heap_samples)[ptr];
+  sample.usable = usable;
+  sample.depth = depth;
+  memcpy(sample.pcs, frames + kSkippedFrames, depth * sizeof(void*));
+}
+
+int OnSampledFree(void* ptr) {
+  return heap_samples && heap_samples->erase(ptr);
+}
+
+}  // namespace
+
+void InitThread(unsigned index, bool is_shard) {
+  thread_index = index;
+  is_shard_thread = is_shard;
+}
+
+optional<string> CollectCpuProfile(absl::Duration duration) {
+  if (cpu_profile_running.exchange(true))
+    return nullopt;
+
+  size_t capacity = absl::ToInt64Seconds(duration + absl::Seconds(1)) * kCpuHz *
+                    max(1u, thread::hardware_concurrency());
+  cpu_samples_capacity = min(capacity, kMaxCpuSamples);
+  unique_ptr<CpuSample[]> samples(new CpuSample[cpu_samples_capacity]);
+  cpu_samples = samples.get();
+  cpu_samples_next.store(0);
+
+  // backtrace() loads the unwinder on its first use, which must not happen in the handler.
+  void* warmup[2];
+  backtrace(warmup, 2);
+
+  struct sigaction sa {}, prev_sa {};
+  sa.sa_sigaction = ProfSignalHandler;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  CHECK_EQ(0, sigaction(SIGPROF, &sa, &prev_sa));
+
+  absl::Time start = absl::Now();
+  cpu_sampling.store(true);
+  SetProfTimer(kCpuHz);
+
+  util::fibers_ext::SleepFor(absl::ToChronoMilliseconds(duration));
+
+  SetProfTimer(0);
+  cpu_sampling.store(false);
+  while (cpu_handlers_inflight.load() > 0)
+    this_thread::yield();
+  CHECK_EQ(0, sigaction(SIGPROF, &prev_sa, nullptr));
+  absl::Duration elapsed = absl::Now() - start;
+
+  size_t num_samples = min(cpu_samples_next.load(), cpu_samples_capacity);
+  if (cpu_samples_next.load() > cpu_samples_capacity) {
+    LOG(WARNING) << "CPU profile dropped " << cpu_samples_next.load() - cpu_samples_capacity
+                 << " samples";
+  }
+
+  constexpr int64_t kPeriodNs = 1000000000 / kCpuHz;
+  ProfileBuilder builder({{"samples", "count"}, {"cpu", "nanoseconds"}},
+                         {"cpu", "nanoseconds"}, kPeriodNs);
+  const int64_t values[] = {1, kPeriodNs};
+  for (size_t i = 0; i < num_samples; ++i) {
+    const CpuSample& s = cpu_samples[i];
+    builder.AddSample(s.pcs, s.depth, true, s.thread, s.is_shard, values);
+  }
+
+  cpu_samples = nullptr;
+  cpu_samples_capacity = 0;
+  string res = builder.Serialize(start, elapsed);
+  cpu_profile_running.store(false);
+
+  return res;
+}
+
+void EnableHeapSampling(size_t sample_bytes) {
+  heap_sample_bytes = sample_bytes;
+  zmalloc_set_sample_hooks(sample_bytes, OnSampledAlloc, OnSampledFree);
+}
+
+bool HeapSamplingEnabled() {
+  return heap_sample_bytes > 0;
+}
+
+string CollectHeapProfile(util::ProactorPool* pp) {
+  vector<vector<HeapSample>> per_thread(pp->size());
+  vector<bool> is_shard(pp->size());
+
+  pp->AwaitFiberOnAll([&](unsigned index, util::ProactorBase* pb) {
+    is_shard[index] = is_shard_thread;
+    if (heap_samples) {
+      per_thread[index].reserve(heap_samples->size());
+      for (const auto& [ptr, sample] : *heap_samples)
+        per_thread[index].push_back(sample);
+    }
+  });
+
+  ProfileBuilder builder({{"inuse_objects", "count"}, {"inuse_space", "bytes"}},
+                         {"space", "bytes"}, heap_sample_bytes);
+  for (size_t index = 0; index < per_thread.size(); ++index) {
+    for (const HeapSample& s : per_thread[index]) {
+      // The sample stands for the bytes since the previous one, as zmalloc samples every
+      // heap_sample_bytes. Larger blocks are always sampled and stand for themselves.
+      int64_t bytes = max<int64_t>(s.usable, heap_sample_bytes);
+      const int64_t values[] = {max<int64_t>(1, bytes / max<uint32_t>(1, s.usable)), bytes};
+      builder.AddSample(s.pcs, s.depth, false, index, is_shard[index], values);
+    }
+  }
+
+  return builder.Serialize(absl::Now(), absl::ZeroDuration());
+}
+
+}  // namespace profiler
+}  // namespace dfly
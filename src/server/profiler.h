@@ -0,0 +1,43 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/time/time.h>
+
+#include <optional>
+#include <string>
+
+namespace util {
+class ProactorPool;
+}  // namespace util
+
+namespace dfly {
+
+// On-demand profiles of the running process in the protobuf format of pprof, see
+// https://github.com/google/pprof/blob/main/proto/profile.proto. The samples are symbolized
+// in the process and labeled with the kind ("shard", "io" or "other") and index of their
+// thread, e.g. `pprof -tagfocus=thread_kind=shard`.
+namespace profiler {
+
+// Runs on every proactor thread, once the shards were created.
+void InitThread(unsigned index, bool is_shard);
+
+// Samples the CPU time of the process every 10ms by SIGPROF for the given duration. Suspends
+// the calling fiber. Returns nullopt if another CPU profile is being collected.
+std::optional<std::string> CollectCpuProfile(absl::Duration duration);
+
+// Samples the zmalloc allocations of every thread once per sample_bytes, which must be set
+// before the threads start allocating.
+void EnableHeapSampling(size_t sample_bytes);
+
+bool HeapSamplingEnabled();
+
+// The sampled allocations that are still alive. Every sample is weighted by the bytes that were
+// allocated since the previous one, hence the totals estimate the memory in use by zmalloc.
+// Frees on another thread than the allocating one are not seen, so their samples remain.
+std::string CollectHeapProfile(util::ProactorPool* pp);
+
+}  // namespace profiler
+}  // namespace dfly
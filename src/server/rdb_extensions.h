@@ -13,3 +13,44 @@ const uint8_t RDB_OPCODE_FULLSYNC_END = 200;
 const uint8_t RDB_OPCODE_COMPRESSED_ZSTD_BLOB_START = 201;
 const uint8_t RDB_OPCODE_COMPRESSED_LZ4_BLOB_START = 202;
 const uint8_t RDB_OPCODE_COMPRESSED_BLOB_END = 203;
+
+// Value type of string values that are saved in their CompactObj compressed form.
+// Followed by the codec byte, the uncompressed length and the compressed blob.
+const uint8_t RDB_TYPE_COMPRESSED_STRING = 204;
+
+// A zstd dictionary that is referenced by compressed values or blobs that follow it.
+// Followed by the dictionary as a string.
+const uint8_t RDB_OPCODE_ZSTD_DICT = 205;
+
+// A key that was deleted since the snapshot that a delta snapshot is based on.
+// Followed by the key as a string.
+const uint8_t RDB_OPCODE_DELETED_KEY = 206;
+
+// Value type of scalable bloom filters. Followed by the growth factor and the false positive
+// rate of the last filter as binary doubles, the number of elements before the last filter and
+// in it, the capacity of the last filter, the number of filters and, for each filter, its number
+// of hash functions and its bits as a string.
+const uint8_t RDB_TYPE_SBF = 207;
+
+// Value type of JSON documents. Followed by the document in the packed form of json_pack.h as
+// a string, which is how the packed documents are kept in memory.
+const uint8_t RDB_TYPE_JSON = 208;
+
+// Value type of time series. Followed by the series in the form of TimeSeries::Serialize as a
+// string, which keeps the chunks compressed as they are in memory.
+const uint8_t RDB_TYPE_TS = 209;
+
+// Value type of sets that are kept in a StringSet. Followed by the number of members and the
+// members packed into strings of RDB_PACKED_CHUNK_LEN bytes or so, each a sequence of
+// length-prefixed members, and an empty string that ends them.
+const uint8_t RDB_TYPE_SET_STRSET = 210;
+
+// Value type of hashes that are kept in a StringMap. Like RDB_TYPE_SET_STRSET, with the number
+// of fields and every packed field followed by its value.
+const uint8_t RDB_TYPE_HASH_STRMAP = 211;
+
+const size_t RDB_PACKED_CHUNK_LEN = 32768;
+
+// String encoding, after RDB_ENCVAL, of the strings that DF snapshots compress with LZ4 instead
+// of LZF. Followed by the compressed length, the uncompressed length and the LZ4 block.
+const uint8_t RDB_ENC_LZ4 = 4;
@@ -18,17 +18,31 @@ extern "C" {
 }
 #include <absl/cleanup/cleanup.h>
 #include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+#include <lz4.h>
 #include <lz4frame.h>
 #include <zstd.h>
 
+#include <jsoncons/json.hpp>
+
 #include "base/endian.h"
 #include "base/flags.h"
 #include "base/logging.h"
+#include "core/bloom.h"
+#include "core/chunked_list.h"
+#include "core/json_object.h"
+#include "core/json_pack.h"
+#include "core/sorted_map.h"
+#include "core/string_map.h"
 #include "core/string_set.h"
+#include "core/time_series.h"
+#include "core/zstd_dict.h"
 #include "server/engine_shard_set.h"
 #include "server/error.h"
 #include "server/hset_family.h"
+#include "server/journal/journal.h"
 #include "server/rdb_extensions.h"
+#include "server/rdb_save.h"
 #include "server/script_mgr.h"
 #include "server/server_state.h"
 #include "server/set_family.h"
@@ -38,6 +52,7 @@ ABSL_DECLARE_FLAG(int32_t, list_max_listpack_size);
 ABSL_DECLARE_FLAG(int32_t, list_compress_depth);
 ABSL_DECLARE_FLAG(uint32_t, dbnum);
 ABSL_DECLARE_FLAG(bool, use_set2);
+ABSL_DECLARE_FLAG(bool, json_packed);
 
 #define SET_OR_RETURN(expr, dest)              \
   do {                                         \
@@ -204,6 +219,60 @@ bool resizeStringSet(robj* set, size_t size, bool use_set2) {
   }
 }
 
+// Reads the next length-prefixed string of the chunk of RDB_TYPE_SET_STRSET or
+// RDB_TYPE_HASH_STRMAP into dest and removes it from chunk.
+bool NextPacked(string_view* chunk, string_view* dest) {
+  if (chunk->empty())
+    return false;
+
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(chunk->data());
+  uint64_t len;
+  size_t enclen;
+  int type = (src[0] & 0xC0) >> 6;
+  if (type == RDB_6BITLEN) {
+    len = src[0] & 0x3F;
+    enclen = 1;
+  } else if (type == RDB_14BITLEN) {
+    if (chunk->size() < 2)
+      return false;
+    len = ((src[0] & 0x3F) << 8) | src[1];
+    enclen = 2;
+  } else if (src[0] == RDB_32BITLEN) {
+    if (chunk->size() < 5)
+      return false;
+    len = absl::big_endian::Load32(src + 1);
+    enclen = 5;
+  } else if (src[0] == RDB_64BITLEN) {
+    if (chunk->size() < 9)
+      return false;
+    len = absl::big_endian::Load64(src + 1);
+    enclen = 9;
+  } else {
+    return false;
+  }
+
+  if (chunk->size() - enclen < len)
+    return false;
+
+  *dest = chunk->substr(enclen, len);
+  chunk->remove_prefix(enclen + len);
+  return true;
+}
+
+// The largest blob that the codec produces from len bytes, 0 for an unknown codec.
+size_t CompressBound(CompressCodec codec, size_t len) {
+  switch (codec) {
+    case CompressCodec::LZ4:
+      return LZ4_compressBound(len);
+    case CompressCodec::ZSTD:
+    case CompressCodec::ZSTD_DICT:
+      return ZSTD_compressBound(len);
+    case CompressCodec::NONE:
+      break;
+  }
+  return 0;
+}
+
 }  // namespace
 
 class DecompressImpl {
@@ -252,8 +321,19 @@ io::Result<base::IoBuf*> ZstdDecompress::Decompress(std::string_view str) {
   if (dest.size() < uncomp_size) {
     return Unexpected(errc::out_of_memory);
   }
-  size_t const d_size =
-      ZSTD_decompressDCtx(dctx_, dest.data(), dest.size(), str.data(), str.size());
+  size_t d_size;
+  unsigned dict_id = ZSTD_getDictID_fromFrame(str.data(), str.size());
+  if (dict_id) {
+    const ZstdDictRegistry::Entry* dict = ZstdDictRegistry::Find(dict_id);
+    if (!dict) {
+      LOG(ERROR) << "Unknown zstd dictionary " << dict_id;
+      return Unexpected(errc::rdb_file_corrupted);
+    }
+    d_size = ZSTD_decompress_usingDDict(dctx_, dest.data(), dest.size(), str.data(), str.size(),
+                                        dict->ddict);
+  } else {
+    d_size = ZSTD_decompressDCtx(dctx_, dest.data(), dest.size(), str.data(), str.size());
+  }
   if (d_size == 0 || d_size != uncomp_size) {
     LOG(ERROR) << "Invalid ZSTD compressed string";
     return Unexpected(errc::rdb_file_corrupted);
@@ -369,6 +449,7 @@ class RdbLoaderBase::OpaqueObjLoader {
 
   void operator()(const LzfString& lzfstr);
   void operator()(const unique_ptr<LoadTrace>& ptr);
+  void operator()(const CompressedString& cstr);
 
   std::error_code ec() const {
     return ec_;
@@ -380,6 +461,9 @@ class RdbLoaderBase::OpaqueObjLoader {
   void CreateList(const LoadTrace* ltrace);
   void CreateZSet(const LoadTrace* ltrace);
   void CreateStream(const LoadTrace* ltrace);
+  void CreateSBF(const LoadTrace* ltrace);
+  void CreatePackedSet(const LoadTrace* ltrace);
+  void CreatePackedHMap(const LoadTrace* ltrace);
 
   void HandleBlob(string_view blob);
 
@@ -415,6 +499,18 @@ void RdbLoaderBase::OpaqueObjLoader::operator()(const LzfString& lzfstr) {
   HandleBlob(tmp);
 }
 
+void RdbLoaderBase::OpaqueObjLoader::operator()(const CompressedString& cstr) {
+  CompactObj::CompressedBlob cb{
+      .codec = CompressCodec(cstr.codec),
+      .raw_size = cstr.uncompressed_len,
+      .blob = string_view{cstr.compressed_blob.data(), cstr.compressed_blob.size()}};
+
+  if (!pv_->ImportCompressed(cb)) {
+    LOG(ERROR) << "Invalid compressed string";
+    ec_ = RdbError(errc::rdb_file_corrupted);
+  }
+}
+
 void RdbLoaderBase::OpaqueObjLoader::operator()(const unique_ptr<LoadTrace>& ptr) {
   switch (rdb_type_) {
     case RDB_TYPE_SET:
@@ -434,6 +530,15 @@ void RdbLoaderBase::OpaqueObjLoader::operator()(const unique_ptr<LoadTrace>& ptr
     case RDB_TYPE_STREAM_LISTPACKS:
       CreateStream(ptr.get());
       break;
+    case RDB_TYPE_SBF:
+      CreateSBF(ptr.get());
+      break;
+    case RDB_TYPE_SET_STRSET:
+      CreatePackedSet(ptr.get());
+      break;
+    case RDB_TYPE_HASH_STRMAP:
+      CreatePackedHMap(ptr.get());
+      break;
     default:
       LOG(FATAL) << "Unsupported rdb type " << rdb_type_;
   }
@@ -571,37 +676,30 @@ void RdbLoaderBase::OpaqueObjLoader::CreateHMap(const LoadTrace* ltrace) {
     res = createObject(OBJ_HASH, lp);
     res->encoding = OBJ_ENCODING_LISTPACK;
   } else {
-    dict* hmap = dictCreate(&hashDictType);
+    StringMap* string_map = new StringMap(CompactObj::memory_resource());
 
-    auto cleanup = absl::MakeCleanup([&] { dictRelease(hmap); });
-
-    if (len > DICT_HT_INITIAL_SIZE) {
-      if (dictTryExpand(hmap, len) != DICT_OK) {
-        LOG(ERROR) << "OOM in dictTryExpand " << len;
-        ec_ = RdbError(errc::out_of_memory);
-        return;
-      }
-    }
+    auto cleanup = absl::MakeCleanup([&] { delete string_map; });
+    string_map->Reserve(len);
 
+    string field;
     for (size_t i = 0; i < len; ++i) {
-      sds key = ToSds(ltrace->arr[i * 2].rdb_var);
-      sds val = ToSds(ltrace->arr[i * 2 + 1].rdb_var);
+      // ToSV may reuse its buffer, hence we copy the field.
+      field = ToSV(ltrace->arr[i * 2].rdb_var);
+      string_view value = ToSV(ltrace->arr[i * 2 + 1].rdb_var);
 
-      if (!key || !val)
+      if (ec_)
         return;
 
-      /* Add pair to hash table */
-      int ret = dictAdd(hmap, key, val);
-      if (ret == DICT_ERR) {
+      if (!string_map->AddOrSkip(field, value)) {
         LOG(ERROR) << "Duplicate hash fields detected";
         ec_ = RdbError(errc::rdb_file_corrupted);
         return;
       }
     }
 
-    res = createObject(OBJ_HASH, hmap);
-    res->encoding = OBJ_ENCODING_HT;
+    pv_->InitRobj(OBJ_HASH, kEncodingStrMap2, string_map);
     std::move(cleanup).Cancel();
+    return;
   }
 
   DCHECK(res);
@@ -609,9 +707,9 @@ void RdbLoaderBase::OpaqueObjLoader::CreateHMap(const LoadTrace* ltrace) {
 }
 
 void RdbLoaderBase::OpaqueObjLoader::CreateList(const LoadTrace* ltrace) {
-  quicklist* ql =
-      quicklistNew(GetFlag(FLAGS_list_max_listpack_size), GetFlag(FLAGS_list_compress_depth));
-  auto cleanup = absl::Cleanup([&] { quicklistRelease(ql); });
+  ChunkedList* list = new ChunkedList(GetFlag(FLAGS_list_max_listpack_size),
+                                      GetFlag(FLAGS_list_compress_depth));
+  auto cleanup = absl::Cleanup([&] { delete list; });
 
   for (size_t i = 0; i < ltrace->arr.size(); ++i) {
     unsigned container = ltrace->arr[i].encoding;
@@ -621,7 +719,7 @@ void RdbLoaderBase::OpaqueObjLoader::CreateList(const LoadTrace* ltrace) {
       return;
 
     if (container == QUICKLIST_NODE_CONTAINER_PLAIN) {
-      quicklistAppendPlainNode(ql, (uint8_t*)sv.data(), sv.size());
+      list->Push(sv, ChunkedList::TAIL);
       continue;
     }
 
@@ -660,67 +758,57 @@ void RdbLoaderBase::OpaqueObjLoader::CreateList(const LoadTrace* ltrace) {
       lp = lpShrinkToFit(lp);
     }
 
-    quicklistAppendListpack(ql, lp);
+    list->AppendListpack(lp);
   }
 
-  if (quicklistCount(ql) == 0) {
+  if (list->Size() == 0) {
     ec_ = RdbError(errc::empty_key);
     return;
   }
 
-  robj* res = createObject(OBJ_LIST, ql);
-  res->encoding = OBJ_ENCODING_QUICKLIST;
   std::move(cleanup).Cancel();
-
-  pv_->ImportRObj(res);
+  pv_->InitRobj(OBJ_LIST, kEncodingChunkedList, list);
 }
 
 void RdbLoaderBase::OpaqueObjLoader::CreateZSet(const LoadTrace* ltrace) {
-  robj* res = createZsetObject();
-  zset* zs = (zset*)res->ptr;
-
-  auto cleanup = absl::Cleanup([&] { decrRefCount(res); });
-
   size_t zsetlen = ltrace->arr.size();
-  if (zsetlen > DICT_HT_INITIAL_SIZE && dictTryExpand(zs->dict, zsetlen) != DICT_OK) {
-    LOG(ERROR) << "OOM in dictTryExpand " << zsetlen;
-    ec_ = RdbError(errc::out_of_memory);
-    return;
-  }
+  SortedMap* zs = new SortedMap(CompactObj::memory_resource());
+
+  auto cleanup = absl::Cleanup([&] { delete zs; });
 
   size_t maxelelen = 0, totelelen = 0;
 
   for (size_t i = 0; i < zsetlen; ++i) {
-    sds sdsele = ToSds(ltrace->arr[i].rdb_var);
-    if (!sdsele)
+    string_view ele = ToSV(ltrace->arr[i].rdb_var);
+    if (ec_)
       return;
 
     double score = ltrace->arr[i].score;
 
     /* Don't care about integer-encoded strings. */
-    if (sdslen(sdsele) > maxelelen)
-      maxelelen = sdslen(sdsele);
-    totelelen += sdslen(sdsele);
+    if (ele.size() > maxelelen)
+      maxelelen = ele.size();
+    totelelen += ele.size();
 
-    zskiplistNode* znode = zslInsert(zs->zsl, score, sdsele);
-    int ret = dictAdd(zs->dict, sdsele, &znode->score);
-    if (ret != DICT_OK) {
+    if (!zs->Insert(score, ele)) {
       LOG(ERROR) << "Duplicate zset fields detected";
-      sdsfree(sdsele);
       ec_ = RdbError(errc::rdb_file_corrupted);
       return;
     }
   }
 
   /* Convert *after* loading, since sorted sets are not stored ordered. */
-  if (zsetLength(res) <= server.zset_max_listpack_entries &&
+  if (zs->Size() <= server.zset_max_listpack_entries &&
       maxelelen <= server.zset_max_listpack_value && lpSafeToAdd(NULL, totelelen)) {
-    zsetConvert(res, OBJ_ENCODING_LISTPACK);
+    robj* res = createObject(OBJ_ZSET, zs->ToListPack());
+    res->encoding = OBJ_ENCODING_LISTPACK;
+    pv_->ImportRObj(res);
+    return;
   }
 
   std::move(cleanup).Cancel();
 
-  pv_->ImportRObj(res);
+  pv_->InitRobj(OBJ_ZSET, kEncodingSortedMap, zs);
 }
 
 void RdbLoaderBase::OpaqueObjLoader::CreateStream(const LoadTrace* ltrace) {
@@ -839,12 +927,161 @@ void RdbLoaderBase::OpaqueObjLoader::CreateStream(const LoadTrace* ltrace) {
   pv_->ImportRObj(res);
 }
 
+void RdbLoaderBase::OpaqueObjLoader::CreateSBF(const LoadTrace* ltrace) {
+  const SbfTrace& trace = *ltrace->sbf_trace;
+  if (!(trace.fp_prob > 0 && trace.fp_prob < 1) || !(trace.grow_factor >= 1) ||
+      trace.max_capacity == 0 || ltrace->arr.empty()) {
+    LOG(ERROR) << "Invalid bloom filter parameters";
+    ec_ = RdbError(errc::rdb_file_corrupted);
+    return;
+  }
+
+  SBF sbf(trace.grow_factor, trace.fp_prob, trace.max_capacity, trace.prev_size,
+          trace.current_size, CompactObj::memory_resource());
+  for (const LoadBlob& blob : ltrace->arr) {
+    string_view bits = ToSV(blob.rdb_var);
+    if (ec_)
+      return;
+
+    if (!sbf.AddFilter(bits, blob.encoding)) {
+      LOG(ERROR) << "Invalid bloom filter";
+      ec_ = RdbError(errc::rdb_file_corrupted);
+      return;
+    }
+  }
+  pv_->SetSBF(std::move(sbf));
+}
+
+void RdbLoaderBase::OpaqueObjLoader::CreatePackedSet(const LoadTrace* ltrace) {
+  size_t len = ltrace->packed_len;
+  robj* res = nullptr;
+  StringSet* set = nullptr;
+  if (GetFlag(FLAGS_use_set2)) {
+    set = new StringSet{CompactObj::memory_resource()};
+    res = createObject(OBJ_SET, set);
+    res->encoding = OBJ_ENCODING_HT;
+  } else {
+    res = createSetObject();
+  }
+
+  auto cleanup = absl::MakeCleanup([&] { decrRefCount(res); });
+
+  // The table is sized once, the members are added without rehashing.
+  if (set) {
+    set->Reserve(len);
+  } else if (len > DICT_HT_INITIAL_SIZE && dictTryExpand((dict*)res->ptr, len) != DICT_OK) {
+    LOG(ERROR) << "OOM in dictTryExpand " << len;
+    ec_ = RdbError(errc::out_of_memory);
+    return;
+  }
+
+  size_t added = 0;
+  string_view member;
+  for (const LoadBlob& blob : ltrace->arr) {
+    string_view chunk = ToSV(blob.rdb_var);
+    if (ec_)
+      return;
+
+    while (!chunk.empty()) {
+      bool success = NextPacked(&chunk, &member);
+      if (success) {
+        if (set) {
+          success = set->Add(member);
+        } else {
+          sds ele = sdsnewlen(member.data(), member.size());
+          success = dictAdd((dict*)res->ptr, ele, NULL) == DICT_OK;
+          if (!success)
+            sdsfree(ele);
+        }
+      }
+
+      if (!success) {
+        LOG(ERROR) << "Invalid or duplicate packed set members";
+        ec_ = RdbError(errc::rdb_file_corrupted);
+        return;
+      }
+      ++added;
+    }
+  }
+
+  if (added != len) {
+    LOG(ERROR) << "Expected " << len << " packed set members, got " << added;
+    ec_ = RdbError(errc::rdb_file_corrupted);
+    return;
+  }
+
+  pv_->ImportRObj(res);
+  std::move(cleanup).Cancel();
+}
+
+void RdbLoaderBase::OpaqueObjLoader::CreatePackedHMap(const LoadTrace* ltrace) {
+  size_t len = ltrace->packed_len;
+  StringMap* string_map = new StringMap(CompactObj::memory_resource());
+
+  auto cleanup = absl::MakeCleanup([&] { delete string_map; });
+  string_map->Reserve(len);
+
+  size_t added = 0;
+  string_view field, value;
+  for (const LoadBlob& blob : ltrace->arr) {
+    string_view chunk = ToSV(blob.rdb_var);
+    if (ec_)
+      return;
+
+    // A field and its value are always packed into the same chunk.
+    while (!chunk.empty()) {
+      if (!NextPacked(&chunk, &field) || !NextPacked(&chunk, &value) ||
+          !string_map->AddOrSkip(field, value)) {
+        LOG(ERROR) << "Invalid or duplicate packed hash fields";
+        ec_ = RdbError(errc::rdb_file_corrupted);
+        return;
+      }
+      ++added;
+    }
+  }
+
+  if (added != len) {
+    LOG(ERROR) << "Expected " << len << " packed hash fields, got " << added;
+    ec_ = RdbError(errc::rdb_file_corrupted);
+    return;
+  }
+
+  pv_->InitRobj(OBJ_HASH, kEncodingStrMap2, string_map);
+  std::move(cleanup).Cancel();
+}
+
 void RdbLoaderBase::OpaqueObjLoader::HandleBlob(string_view blob) {
   if (rdb_type_ == RDB_TYPE_STRING) {
     pv_->SetString(blob);
     return;
   }
 
+  if (rdb_type_ == RDB_TYPE_JSON) {
+    if (!PackedJson::Validate(blob)) {
+      LOG(ERROR) << "Invalid packed JSON";
+      ec_ = RdbError(errc::rdb_file_corrupted);
+      return;
+    }
+
+    if (absl::GetFlag(FLAGS_json_packed)) {
+      pv_->SetPackedJson(blob);
+    } else {
+      pv_->SetJson(UnpackJson(PackedJson(blob)));
+    }
+    return;
+  }
+
+  if (rdb_type_ == RDB_TYPE_TS) {
+    TimeSeries ts(0, CompactObj::memory_resource());
+    if (!ts.Parse(blob)) {
+      LOG(ERROR) << "Invalid time series";
+      ec_ = RdbError(errc::rdb_file_corrupted);
+      return;
+    }
+    pv_->SetTimeSeries(std::move(ts));
+    return;
+  }
+
   robj* res = nullptr;
   if (rdb_type_ == RDB_TYPE_SET_INTSET) {
     if (!intsetValidateIntegrity((const uint8_t*)blob.data(), blob.size(), 0)) {
@@ -885,13 +1122,14 @@ void RdbLoaderBase::OpaqueObjLoader::HandleBlob(string_view blob) {
       return;
     }
 
-    res = createObject(OBJ_HASH, lp);
-    res->encoding = OBJ_ENCODING_LISTPACK;
+    if (lpBytes(lp) > HSetFamily::MaxListPackLen()) {
+      pv_->InitRobj(OBJ_HASH, kEncodingStrMap2, HSetFamily::ConvertToStrMap(lp));
+      lpFree(lp);
+      return;
+    }
 
-    if (lpBytes(lp) > HSetFamily::MaxListPackLen())
-      hashTypeConvert(res, OBJ_ENCODING_HT);
-    else
-      res->ptr = lpShrinkToFit((uint8_t*)res->ptr);
+    res = createObject(OBJ_HASH, lpShrinkToFit(lp));
+    res->encoding = OBJ_ENCODING_LISTPACK;
   } else if (rdb_type_ == RDB_TYPE_ZSET_ZIPLIST) {
     unsigned char* lp = lpNew(blob.size());
     if (!ziplistPairsConvertAndValidateIntegrity((uint8_t*)blob.data(), blob.size(), &lp)) {
@@ -907,13 +1145,49 @@ void RdbLoaderBase::OpaqueObjLoader::HandleBlob(string_view blob) {
       return;
     }
 
-    res = createObject(OBJ_ZSET, lp);
+    if (lpBytes(lp) > server.zset_max_listpack_entries) {
+      SortedMap* zs = SortedMap::FromListPack(CompactObj::memory_resource(), lp);
+      lpFree(lp);
+      pv_->InitRobj(OBJ_ZSET, kEncodingSortedMap, zs);
+      return;
+    }
+
+    res = createObject(OBJ_ZSET, lpShrinkToFit(lp));
     res->encoding = OBJ_ENCODING_LISTPACK;
+  } else if (rdb_type_ == RDB_TYPE_HASH_LISTPACK || rdb_type_ == RDB_TYPE_ZSET_LISTPACK) {
+    // The listpacks of the DF snapshots are copied as they are.
+    uint8_t* src = (uint8_t*)blob.data();
+    if (!lpValidateIntegrity(src, blob.size(), 1, NULL, NULL) || lpLength(src) % 2 != 0) {
+      LOG(ERROR) << "Listpack integrity check failed.";
+      ec_ = RdbError(errc::rdb_file_corrupted);
+      return;
+    }
+
+    if (lpLength(src) == 0) {
+      ec_ = RdbError(errc::empty_key);
+      return;
+    }
 
-    if (lpBytes(lp) > server.zset_max_listpack_entries)
-      zsetConvert(res, OBJ_ENCODING_SKIPLIST);
-    else
-      res->ptr = lpShrinkToFit(lp);
+    uint8_t* lp = (uint8_t*)zmalloc(blob.size());
+    memcpy(lp, src, blob.size());
+
+    if (rdb_type_ == RDB_TYPE_HASH_LISTPACK) {
+      if (lpBytes(lp) > HSetFamily::MaxListPackLen()) {
+        pv_->InitRobj(OBJ_HASH, kEncodingStrMap2, HSetFamily::ConvertToStrMap(lp));
+        lpFree(lp);
+        return;
+      }
+      res = createObject(OBJ_HASH, lp);
+    } else {
+      if (lpLength(lp) / 2 > server.zset_max_listpack_entries) {
+        SortedMap* zs = SortedMap::FromListPack(CompactObj::memory_resource(), lp);
+        lpFree(lp);
+        pv_->InitRobj(OBJ_ZSET, kEncodingSortedMap, zs);
+        return;
+      }
+      res = createObject(OBJ_ZSET, lp);
+    }
+    res->encoding = OBJ_ENCODING_LISTPACK;
   } else {
     LOG(FATAL) << "Unsupported rdb type " << rdb_type_;
   }
@@ -1073,6 +1347,12 @@ auto RdbLoaderBase::FetchGenericString() -> io::Result<string> {
         return FetchIntegerObject(len);
       case RDB_ENC_LZF:
         return FetchLzfStringObject();
+      case RDB_ENC_LZ4: {
+        io::Result<base::PODArray<char>> blob = ReadLz4();
+        if (!blob)
+          return make_unexpected(blob.error());
+        return string{blob->data(), blob->size()};
+      }
       default:
         LOG(ERROR) << "Unknown RDB string encoding len " << len;
         return Unexpected(errc::rdb_file_corrupted);
@@ -1215,6 +1495,12 @@ auto RdbLoaderBase::ReadObj(int rdbtype) -> io::Result<OpaqueObj> {
       return ReadIntSet();
     case RDB_TYPE_HASH_ZIPLIST:
       return ReadHZiplist();
+    case RDB_TYPE_HASH_LISTPACK:
+    case RDB_TYPE_ZSET_LISTPACK:
+      return ReadListPack(rdbtype);
+    case RDB_TYPE_SET_STRSET:
+    case RDB_TYPE_HASH_STRMAP:
+      return ReadPackedStrings(rdbtype);
     case RDB_TYPE_HASH:
       return ReadHMap();
     case RDB_TYPE_ZSET:
@@ -1228,6 +1514,22 @@ auto RdbLoaderBase::ReadObj(int rdbtype) -> io::Result<OpaqueObj> {
     case RDB_TYPE_STREAM_LISTPACKS:
       return ReadStreams();
       break;
+    case RDB_TYPE_COMPRESSED_STRING:
+      return ReadCompressedString();
+    case RDB_TYPE_SBF:
+      return ReadSBF();
+    case RDB_TYPE_JSON: {
+      auto fetch = ReadStringObj();
+      if (!fetch)
+        return make_unexpected(fetch.error());
+      return OpaqueObj{std::move(*fetch), RDB_TYPE_JSON};
+    }
+    case RDB_TYPE_TS: {
+      auto fetch = ReadStringObj();
+      if (!fetch)
+        return make_unexpected(fetch.error());
+      return OpaqueObj{std::move(*fetch), RDB_TYPE_TS};
+    }
   }
 
   LOG(ERROR) << "Unsupported rdb type " << rdbtype;
@@ -1249,6 +1551,8 @@ auto RdbLoaderBase::ReadStringObj() -> io::Result<RdbVariant> {
         return ReadIntObj(len);
       case RDB_ENC_LZF:
         return ReadLzf();
+      case RDB_ENC_LZ4:
+        return ReadLz4();
       default:
         LOG(ERROR) << "Unknown RDB string encoding " << len;
         return Unexpected(errc::rdb_file_corrupted);
@@ -1302,6 +1606,73 @@ auto RdbLoaderBase::ReadLzf() -> io::Result<LzfString> {
   return res;
 }
 
+auto RdbLoaderBase::ReadLz4() -> io::Result<base::PODArray<char>> {
+  uint64_t clen, len;
+  SET_OR_UNEXPECT(LoadLen(NULL), clen);
+  SET_OR_UNEXPECT(LoadLen(NULL), len);
+
+  if (len > 1ULL << 29 || len <= clen || clen == 0) {
+    LOG(ERROR) << "Bad compressed string";
+    return Unexpected(errc::rdb_file_corrupted);
+  }
+
+  // Decompresses straight from the input buffer if it holds the whole block.
+  const char* cbuf;
+  bool zerocopy_decompress = mem_buf_->InputLen() >= clen;
+  if (zerocopy_decompress) {
+    cbuf = reinterpret_cast<const char*>(mem_buf_->InputBuffer().data());
+  } else {
+    compr_buf_.resize(clen);
+    error_code ec = FetchBuf(clen, compr_buf_.data());
+    if (ec)
+      return make_unexpected(ec);
+    cbuf = reinterpret_cast<const char*>(compr_buf_.data());
+  }
+
+  base::PODArray<char> res;
+  res.resize(len);
+  int size = LZ4_decompress_safe(cbuf, res.data(), clen, len);
+  if (size < 0 || size_t(size) != len) {
+    LOG(ERROR) << "Invalid LZ4 compressed string";
+    return Unexpected(errc::rdb_file_corrupted);
+  }
+
+  if (zerocopy_decompress)
+    mem_buf_->ConsumeInput(clen);
+  return res;
+}
+
+auto RdbLoaderBase::ReadCompressedString() -> io::Result<OpaqueObj> {
+  CompressedString res;
+  uint64_t clen, uncompressed_len;
+
+  SET_OR_UNEXPECT(FetchInt<uint8_t>(), res.codec);
+  SET_OR_UNEXPECT(LoadLen(NULL), uncompressed_len);
+  SET_OR_UNEXPECT(LoadLen(NULL), clen);
+
+  if (uncompressed_len > 1ULL << 28) {
+    LOG(ERROR) << "Uncompressed length is too big " << uncompressed_len;
+    return Unexpected(errc::rdb_file_corrupted);
+  }
+
+  // The blob is allocated before it is read, hence a corrupted length must not reach resize.
+  size_t bound = CompressBound(CompressCodec(res.codec), uncompressed_len);
+  if (clen == 0 || clen > 1ULL << 28 || clen > bound) {
+    LOG(ERROR) << "Bad compressed string of codec " << unsigned(res.codec) << ", length " << clen
+               << " for " << uncompressed_len << " bytes";
+    return Unexpected(errc::rdb_file_corrupted);
+  }
+  res.uncompressed_len = uncompressed_len;
+
+  res.compressed_blob.resize(clen);
+  error_code ec = FetchBuf(clen, res.compressed_blob.data());
+  if (ec) {
+    return make_unexpected(ec);
+  }
+
+  return OpaqueObj{std::move(res), RDB_TYPE_COMPRESSED_STRING};
+}
+
 auto RdbLoaderBase::ReadSet() -> io::Result<OpaqueObj> {
   size_t len;
   SET_OR_UNEXPECT(LoadLen(NULL), len);
@@ -1355,6 +1726,44 @@ auto RdbLoaderBase::ReadHZiplist() -> io::Result<OpaqueObj> {
   return OpaqueObj{std::move(str_obj), RDB_TYPE_HASH_ZIPLIST};
 }
 
+auto RdbLoaderBase::ReadListPack(int rdbtype) -> io::Result<OpaqueObj> {
+  RdbVariant str_obj;
+  SET_OR_UNEXPECT(ReadStringObj(), str_obj);
+
+  if (StrLen(str_obj) == 0) {
+    return Unexpected(errc::rdb_file_corrupted);
+  }
+
+  return OpaqueObj{std::move(str_obj), rdbtype};
+}
+
+auto RdbLoaderBase::ReadPackedStrings(int rdbtype) -> io::Result<OpaqueObj> {
+  unique_ptr<LoadTrace> load_trace(new LoadTrace);
+  SET_OR_UNEXPECT(LoadLen(nullptr), load_trace->packed_len);
+
+  if (load_trace->packed_len == 0)
+    return Unexpected(errc::empty_key);
+
+  // Every packed string takes at least a byte, which bounds the table that the count presizes.
+  size_t total_len = 0;
+  while (true) {
+    RdbVariant chunk;
+    SET_OR_UNEXPECT(ReadStringObj(), chunk);
+    size_t chunk_len = StrLen(chunk);
+    if (chunk_len == 0)
+      break;
+
+    total_len += chunk_len;
+    load_trace->arr.emplace_back().rdb_var = std::move(chunk);
+  }
+
+  if (load_trace->packed_len > total_len) {
+    return Unexpected(errc::rdb_file_corrupted);
+  }
+
+  return OpaqueObj{std::move(load_trace), rdbtype};
+}
+
 auto RdbLoaderBase::ReadHMap() -> io::Result<OpaqueObj> {
   uint64_t len;
   SET_OR_UNEXPECT(LoadLen(nullptr), len);
@@ -1585,6 +1994,31 @@ auto RdbLoaderBase::ReadStreams() -> io::Result<OpaqueObj> {
   return OpaqueObj{std::move(load_trace), RDB_TYPE_STREAM_LISTPACKS};
 }
 
+auto RdbLoaderBase::ReadSBF() -> io::Result<OpaqueObj> {
+  unique_ptr<LoadTrace> load_trace(new LoadTrace);
+  load_trace->sbf_trace.reset(new SbfTrace);
+  SbfTrace& trace = *load_trace->sbf_trace;
+
+  SET_OR_UNEXPECT(FetchBinaryDouble(), trace.grow_factor);
+  SET_OR_UNEXPECT(FetchBinaryDouble(), trace.fp_prob);
+  SET_OR_UNEXPECT(LoadLen(nullptr), trace.prev_size);
+  SET_OR_UNEXPECT(LoadLen(nullptr), trace.current_size);
+  SET_OR_UNEXPECT(LoadLen(nullptr), trace.max_capacity);
+
+  uint64_t num_filters;
+  SET_OR_UNEXPECT(LoadLen(nullptr), num_filters);
+
+  // The filters are appended as they are read rather than allocated upfront, so that a corrupted
+  // count stops at the end of the input.
+  for (uint64_t i = 0; i < num_filters; ++i) {
+    LoadBlob& blob = load_trace->arr.emplace_back();
+    SET_OR_UNEXPECT(LoadLen(nullptr), blob.encoding);
+    SET_OR_UNEXPECT(ReadStringObj(), blob.rdb_var);
+  }
+
+  return OpaqueObj{std::move(load_trace), RDB_TYPE_SBF};
+}
+
 template <typename T> io::Result<T> RdbLoaderBase::FetchInt() {
   auto ec = EnsureRead(sizeof(T));
   if (ec)
@@ -1667,6 +2101,7 @@ error_code RdbLoader::Load(io::Source* src) {
   ObjSettings settings;
   settings.now = mstime();
   size_t keys_loaded = 0;
+  size_t reported_bytes = 0, reported_keys = 0;
 
   while (!stop_early_.load(memory_order_relaxed)) {
     /* Read type. */
@@ -1770,15 +2205,37 @@ error_code RdbLoader::Load(io::Source* src) {
       continue;
     }
 
-    if (!rdbIsObjectType(type)) {
+    if (type == RDB_OPCODE_ZSTD_DICT) {
+      RETURN_ON_ERR(HandleZstdDict());
+      continue;
+    }
+
+    if (type == RDB_OPCODE_DELETED_KEY) {
+      RETURN_ON_ERR(LoadDeletedKey());
+      continue;
+    }
+
+    if (!rdbIsObjectType(type) && type != RDB_TYPE_COMPRESSED_STRING && type != RDB_TYPE_SBF &&
+        type != RDB_TYPE_JSON && type != RDB_TYPE_TS && type != RDB_TYPE_SET_STRSET &&
+        type != RDB_TYPE_HASH_STRMAP) {
       return RdbError(errc::invalid_rdb_type);
     }
 
     ++keys_loaded;
     RETURN_ON_ERR(LoadKeyValPair(type, &settings));
     settings.Reset();
+
+    if (progress_cb_ && keys_loaded % 1024 == 0) {
+      progress_cb_(bytes_read_ - reported_bytes, keys_loaded - reported_keys);
+      reported_bytes = bytes_read_;
+      reported_keys = keys_loaded;
+    }
   }  // main load loop
 
+  if (progress_cb_) {
+    progress_cb_(bytes_read_ - reported_bytes, keys_loaded - reported_keys);
+  }
+
   if (stop_early_) {
     return *ec_;
   }
@@ -1919,6 +2376,17 @@ error_code RdbLoaderBase::HandleCompressedBlobFinish() {
   return kOk;
 }
 
+error_code RdbLoaderBase::HandleZstdDict() {
+  string dict;
+  SET_OR_RETURN(FetchGenericString(), dict);
+
+  if (!ZstdDictRegistry::Register(dict)) {
+    LOG(ERROR) << "Could not register zstd dictionary of " << dict.size() << " bytes";
+    return RdbError(errc::rdb_file_corrupted);
+  }
+  return kOk;
+}
+
 error_code RdbLoader::HandleAux() {
   /* AUX: generic string-string fields. Use to add state to RDB
    * which is backward compatible. Implementations of RDB loading
@@ -1942,11 +2410,10 @@ error_code RdbLoader::HandleAux() {
   } else if (auxkey == "repl-offset") {
     // TODO
   } else if (auxkey == "lua") {
-    ServerState* ss = ServerState::tlocal();
-    Interpreter& script = ss->GetInterpreter();
+    BorrowedInterpreter script{&ServerState::tlocal()->interpreter_mgr()};
     string_view body{auxval};
     string result;
-    Interpreter::AddResult add_result = script.AddFunction(body, &result);
+    Interpreter::AddResult add_result = script->AddFunction(body, &result);
     if (add_result == Interpreter::ADD_OK) {
       if (script_mgr_)
         script_mgr_->InsertFunction(result, body);
@@ -1975,6 +2442,27 @@ error_code RdbLoader::HandleAux() {
     }
   } else if (auxkey == "redis-bits") {
     /* Just ignored. */
+  } else if (auxkey == "delta") {
+    delta_ = true;
+  } else if (auxkey == "journal-pos") {
+    optional<journal::Position> pos = journal::Position::Parse(auxval);
+    if (!pos) {
+      LOG(ERROR) << "Bad journal position " << auxval;
+      return RdbError(errc::rdb_file_corrupted);
+    }
+    journal_pos_.Merge(*pos);
+  } else if (auxkey == "flushdb") {
+    // The summary of a delta snapshot, loaded before its shard files.
+    uint32_t dbid;
+    if (!absl::SimpleAtoi(auxval, &dbid) || dbid >= GetFlag(FLAGS_dbnum)) {
+      LOG(ERROR) << "Bad flushdb index " << auxval;
+      return RdbError(errc::bad_db_index);
+    }
+
+    shard_set->RunBriefInParallel([dbid](EngineShard* es) {
+      if (es->db_slice().IsDbValid(dbid))
+        es->db_slice().FlushDb(dbid);
+    });
   } else {
     /* We ignore fields we don't understand, as by AUX field
      * contract. */
@@ -2021,6 +2509,16 @@ void RdbLoader::LoadItemsBuffer(DbIndex db_ind, const ItemsBuf& ib) {
   DbContext db_cntx{.db_index = db_ind, .time_now_ms = GetCurrentTimeMs()};
 
   for (const auto& item : ib) {
+    // A delta entry replaces the entry of the base together with its expiry.
+    if (delta_) {
+      auto [it, exp_it] = db_slice.FindExt(db_cntx, item.key);
+      if (IsValid(it))
+        db_slice.Del(db_ind, it);
+    }
+
+    if (item.val.rdb_type == RDB_OPCODE_DELETED_KEY)
+      continue;
+
     PrimeValue pv;
     if (ec_ = Visit(item, &pv); ec_) {
       stop_early_ = true;
@@ -2035,11 +2533,69 @@ void RdbLoader::LoadItemsBuffer(DbIndex db_ind, const ItemsBuf& ib) {
       LOG(WARNING) << "RDB has duplicated key '" << item.key << "' in DB " << db_ind;
     }
   }
+
+  if (journal_batches_)
+    JournalItems(db_ind, ib);
+}
+
+// The batch is journaled as a single record of the RDB of its entries, rather than a command for
+// every key. Its keys are the keys of the record, see SliceSnapshot::OnJournalEntry.
+void RdbLoader::JournalItems(DbIndex db_ind, const ItemsBuf& ib) {
+  EngineShard* shard = EngineShard::tlocal();
+  journal::Journal* journal = shard->journal();
+  if (!journal)
+    return;
+
+  DbSlice& db_slice = shard->db_slice();
+  DbContext db_cntx{.db_index = db_ind, .time_now_ms = GetCurrentTimeMs()};
+  RdbSerializer serializer(CompressionMode::NONE);
+  char magic[16];
+  size_t sz = absl::SNPrintF(magic, sizeof(magic), "REDIS%04d", RDB_VERSION);
+  CHECK(!serializer.WriteRaw(io::Buffer(string_view{magic, sz})));
+  CHECK(!serializer.SelectDb(db_ind));
+
+  vector<string_view> keys;
+  keys.reserve(ib.size());
+  for (const auto& item : ib) {
+    auto [it, exp_it] = db_slice.FindExt(db_cntx, item.key);
+    if (!IsValid(it))  // expired, or a deleted key of a delta.
+      continue;
+    CHECK(serializer.SaveEntry(it->first, it->second, db_slice.ExpireTime(exp_it)));
+    keys.push_back(item.key);
+  }
+  if (keys.empty())
+    return;
+
+  // The loader does not verify the checksum.
+  uint8_t checksum[8] = {0};
+  CHECK(!serializer.WriteOpcode(RDB_OPCODE_EOF));
+  CHECK(!serializer.WriteRaw(checksum));
+
+  io::StringSink sink;
+  CHECK(!serializer.FlushToSink(&sink));
+  string payload = std::move(sink).str();
+  journal->RecordEntry(journal::Entry::Command(db_ind, 0, keys, 1, {"DFLY", "LOAD", payload}));
 }
 
 void RdbLoader::ResizeDb(size_t key_num, size_t expire_num) {
   DCHECK_LT(key_num, 1U << 31);
   DCHECK_LT(expire_num, 1U << 31);
+
+  // Presizes the tables so that they do not split segments during the load. The callbacks run
+  // before the items of the database that are flushed after them.
+  auto reserve = [db_ind = cur_db_index_](size_t key_size) {
+    return [db_ind, key_size] { EngineShard::tlocal()->db_slice().Reserve(db_ind, key_size); };
+  };
+
+  if (pinned_shard_) {
+    shard_set->Add(*pinned_shard_, reserve(key_num));
+    return;
+  }
+
+  // Otherwise the keys spread evenly over the shards.
+  for (unsigned i = 0; i < shard_set->size(); ++i) {
+    shard_set->Add(i, reserve(key_num / shard_set->size()));
+  }
 }
 
 error_code RdbLoader::LoadKeyValPair(int type, ObjSettings* settings) {
@@ -2088,4 +2644,20 @@ error_code RdbLoader::LoadKeyValPair(int type, ObjSettings* settings) {
   return kOk;
 }
 
+error_code RdbLoader::LoadDeletedKey() {
+  string key;
+  SET_OR_RETURN(FetchGenericString(), key);
+
+  ShardId sid = Shard(key, shard_set->size());
+  auto& out_buf = shard_buf_[sid];
+  out_buf.emplace_back(Item{std::move(key), OpaqueObj{0LL, RDB_OPCODE_DELETED_KEY}, 0});
+
+  constexpr size_t kBufSize = 128;
+  if (out_buf.size() >= kBufSize) {
+    FlushShardAsync(sid);
+  }
+
+  return kOk;
+}
+
 }  // namespace dfly
@@ -4,6 +4,7 @@
 #pragma once
 
 #include <boost/fiber/mutex.hpp>
+#include <optional>
 #include <system_error>
 
 extern "C" {
@@ -14,6 +15,7 @@ extern "C" {
 #include "base/pod_array.h"
 #include "io/io.h"
 #include "server/common.h"
+#include "server/journal/types.h"
 
 namespace dfly {
 
@@ -36,8 +38,15 @@ class RdbLoaderBase {
     uint64_t uncompressed_len;
   };
 
-  using RdbVariant =
-      std::variant<long long, base::PODArray<char>, LzfString, std::unique_ptr<LoadTrace>>;
+  // String value that was stored compressed by CompactObj, see RDB_TYPE_COMPRESSED_STRING.
+  struct CompressedString {
+    base::PODArray<char> compressed_blob;
+    uint32_t uncompressed_len;
+    uint8_t codec;
+  };
+
+  using RdbVariant = std::variant<long long, base::PODArray<char>, LzfString,
+                                  std::unique_ptr<LoadTrace>, CompressedString>;
 
   struct OpaqueObj {
     RdbVariant obj;
@@ -80,9 +89,24 @@ class RdbLoaderBase {
     std::vector<StreamCGTrace> cgroup;
   };
 
+  // The parameters of a scalable bloom filter. Its filters are the blobs of the LoadTrace, with
+  // their number of hash functions as the encoding.
+  struct SbfTrace {
+    double grow_factor;
+    double fp_prob;
+    uint64_t prev_size;
+    uint64_t current_size;
+    uint64_t max_capacity;
+  };
+
   struct LoadTrace {
     std::vector<LoadBlob> arr;
+
+    // The number of the strings packed into the chunks of RDB_TYPE_SET_STRSET and
+    // RDB_TYPE_HASH_STRMAP, the chunks are the blobs.
+    uint64_t packed_len = 0;
     std::unique_ptr<StreamTrace> stream_trace;
+    std::unique_ptr<SbfTrace> sbf_trace;
   };
 
   class OpaqueObjLoader;
@@ -118,17 +142,25 @@ class RdbLoaderBase {
   ::io::Result<RdbVariant> ReadStringObj();
   ::io::Result<long long> ReadIntObj(int encoding);
   ::io::Result<LzfString> ReadLzf();
+  ::io::Result<base::PODArray<char>> ReadLz4();
+  ::io::Result<OpaqueObj> ReadCompressedString();
 
   ::io::Result<OpaqueObj> ReadSet();
   ::io::Result<OpaqueObj> ReadIntSet();
   ::io::Result<OpaqueObj> ReadHZiplist();
+  ::io::Result<OpaqueObj> ReadListPack(int rdbtype);
+  ::io::Result<OpaqueObj> ReadPackedStrings(int rdbtype);
   ::io::Result<OpaqueObj> ReadHMap();
   ::io::Result<OpaqueObj> ReadZSet(int rdbtype);
   ::io::Result<OpaqueObj> ReadZSetZL();
   ::io::Result<OpaqueObj> ReadListQuicklist(int rdbtype);
   ::io::Result<OpaqueObj> ReadStreams();
+  ::io::Result<OpaqueObj> ReadSBF();
   std::error_code HandleCompressedBlob(int op_type);
   std::error_code HandleCompressedBlobFinish();
+
+  // Registers the zstd dictionary that the following values and blobs may reference.
+  std::error_code HandleZstdDict();
   void AlocateDecompressOnce(int op_type);
 
   static size_t StrLen(const RdbVariant& tset);
@@ -183,9 +215,37 @@ class RdbLoader : protected RdbLoaderBase {
     full_sync_cut_cb = std::move(cb);
   }
 
+  // Set callback that reports the progress of the load with the bytes read and the keys parsed
+  // since its previous call.
+  void SetProgressCb(std::function<void(size_t bytes, size_t keys)> cb) {
+    progress_cb_ = std::move(cb);
+  }
+
+  // All the keys of the source belong to the shard, as with a shard file of a dragonfly
+  // snapshot that is loaded into the same number of shards.
+  void set_pinned_shard(ShardId sid) {
+    pinned_shard_ = sid;
+  }
+
+  // Records every batch of items that a shard loads in its journal, as a DFLY LOAD of their
+  // RDB, so that the replicas load them as well. Used by DFLY LOAD, unlike the loads of the
+  // snapshots that precede the journal.
+  void set_journal_batches(bool journal) {
+    journal_batches_ = journal;
+  }
+
+  // The position of the snapshot in the file-based journal, empty unless it was saved with
+  // the journal open.
+  const journal::Position& journal_pos() const {
+    return journal_pos_;
+  }
+
  private:
   struct ObjSettings;
   std::error_code LoadKeyValPair(int type, ObjSettings* settings);
+
+  // Queues the deletion of a key from RDB_OPCODE_DELETED_KEY.
+  std::error_code LoadDeletedKey();
   void ResizeDb(size_t key_num, size_t expire_num);
   std::error_code HandleAux();
 
@@ -193,6 +253,7 @@ class RdbLoader : protected RdbLoaderBase {
   void FlushShardAsync(ShardId sid);
 
   void LoadItemsBuffer(DbIndex db_ind, const ItemsBuf& ib);
+  void JournalItems(DbIndex db_ind, const ItemsBuf& ib);
 
   ScriptMgr* script_mgr_;
   std::unique_ptr<ItemsBuf[]> shard_buf_;
@@ -202,11 +263,19 @@ class RdbLoader : protected RdbLoaderBase {
 
   DbIndex cur_db_index_ = 0;
 
+  // True when loading a delta snapshot, whose entries replace the loaded ones.
+  bool delta_ = false;
+  bool journal_batches_ = false;
+  journal::Position journal_pos_;
+
   AggregateError ec_;
   std::atomic_bool stop_early_{false};
 
   // Callback when receiving RDB_OPCODE_FULLSYNC_END
   std::function<void()> full_sync_cut_cb;
+
+  std::function<void(size_t, size_t)> progress_cb_;
+  std::optional<ShardId> pinned_shard_;
 };
 
 }  // namespace dfly
@@ -7,14 +7,23 @@
 #include <absl/cleanup/cleanup.h>
 #include <absl/strings/str_cat.h>
 #include <absl/strings/str_format.h>
+#include <lz4.h>
 #include <lz4frame.h>
 #include <zstd.h>
 
+#include "core/bloom.h"
+#include "core/chunked_list.h"
+#include "core/crc64.h"
+#include "core/json_object.h"
+#include "core/sorted_map.h"
+#include "core/string_map.h"
 #include "core/string_set.h"
+#include "core/zstd_dict.h"
 
 extern "C" {
 #include "redis/intset.h"
 #include "redis/listpack.h"
+#include "redis/quicklist.h"
 #include "redis/rdb.h"
 #include "redis/stream.h"
 #include "redis/util.h"
@@ -27,16 +36,28 @@ extern "C" {
 #include "base/logging.h"
 #include "server/engine_shard_set.h"
 #include "server/error.h"
+#include "server/journal/journal.h"
 #include "server/rdb_extensions.h"
+#include "server/server_state.h"
 #include "server/snapshot.h"
 #include "util/fibers/simple_channel.h"
+#include "util/proactor_base.h"
 
 ABSL_FLAG(int, compression_mode, 3,
           "set 0 for no compression,"
-          "set 1 for single entry lzf compression,"
+          "set 1 for single entry compression, lz4 on df snapshot and lzf on rdb snapshot,"
           "set 2 for multi entry zstd compression on df snapshot and single entry on rdb snapshot,"
           "set 3 for multi entry lz4 compression on df snapshot and single entry on rdb snapshot");
 ABSL_FLAG(int, compression_level, 2, "The compression level to use on zstd/lz4 compression");
+ABSL_FLAG(bool, df_snapshot_deltas, false,
+          "If true, dragonfly snapshots track the changes that follow them, so that SAVE DELTA "
+          "can write only the changed buckets and the deleted keys");
+ABSL_FLAG(bool, rdb_native_encodings, true,
+          "If true, dragonfly snapshots and full syncs save the listpacks and the DenseSet based "
+          "sets and hashes in their in-memory forms, which only dragonfly loads");
+ABSL_FLAG(bool, rdb_checksum, false,
+          "If true, the snapshot files end with the CRC64 of their contents, as redis writes "
+          "them with rdbchecksum yes. Otherwise the checksum is zero");
 
 namespace dfly {
 
@@ -44,6 +65,7 @@ using namespace std;
 using base::IoBuf;
 using io::Bytes;
 using nonstd::make_unexpected;
+using util::ProactorBase;
 
 namespace {
 
@@ -138,8 +160,8 @@ uint8_t RdbObjectType(unsigned type, unsigned encoding) {
     case OBJ_STRING:
       return RDB_TYPE_STRING;
     case OBJ_LIST:
-      if (encoding == OBJ_ENCODING_QUICKLIST)
-        return RDB_TYPE_LIST_QUICKLIST;
+      if (encoding == kEncodingChunkedList)
+        return RDB_TYPE_LIST_QUICKLIST;  // we save the chunks as quicklist nodes.
       break;
     case OBJ_SET:
       if (encoding == kEncodingIntSet)
@@ -150,24 +172,52 @@ uint8_t RdbObjectType(unsigned type, unsigned encoding) {
     case OBJ_ZSET:
       if (encoding == OBJ_ENCODING_LISTPACK)
         return RDB_TYPE_ZSET_ZIPLIST;  // we save using the old ziplist encoding.
-      else if (encoding == OBJ_ENCODING_SKIPLIST)
+      else if (encoding == kEncodingSortedMap)
         return RDB_TYPE_ZSET_2;
       break;
     case OBJ_HASH:
       if (encoding == kEncodingListPack)
         return RDB_TYPE_HASH_ZIPLIST;
-      else if (encoding == kEncodingStrMap)
+      else if (encoding == kEncodingStrMap || encoding == kEncodingStrMap2)
         return RDB_TYPE_HASH;
       break;
     case OBJ_STREAM:
       return RDB_TYPE_STREAM_LISTPACKS;
     case OBJ_MODULE:
       return RDB_TYPE_MODULE_2;
+    case OBJ_SBF:
+      return RDB_TYPE_SBF;
+    case OBJ_JSON:
+      return RDB_TYPE_JSON;
+    case OBJ_TS:
+      return RDB_TYPE_TS;
   }
   LOG(FATAL) << "Unknown encoding " << encoding << " for type " << type;
   return 0; /* avoid warning */
 }
 
+uint8_t NativeObjectType(unsigned type, unsigned encoding) {
+  switch (type) {
+    case OBJ_LIST:
+      return RDB_TYPE_LIST_QUICKLIST_2;
+    case OBJ_SET:
+      if (encoding == kEncodingStrMap2)
+        return RDB_TYPE_SET_STRSET;
+      break;
+    case OBJ_ZSET:
+      if (encoding == OBJ_ENCODING_LISTPACK)
+        return RDB_TYPE_ZSET_LISTPACK;
+      break;
+    case OBJ_HASH:
+      if (encoding == kEncodingListPack)
+        return RDB_TYPE_HASH_LISTPACK;
+      else if (encoding == kEncodingStrMap2)
+        return RDB_TYPE_HASH_STRMAP;
+      break;
+  }
+  return RdbObjectType(type, encoding);
+}
+
 class CompressorImpl {
  public:
   CompressorImpl() {
@@ -179,6 +229,10 @@ class CompressorImpl {
   }
   virtual io::Result<io::Bytes> Compress(io::Bytes data) = 0;
 
+  // Sets the dictionary for the following Compress calls, ignored by non-zstd compressors.
+  virtual void SetDict(const ZstdDictRegistry::Entry* dict) {
+  }
+
  protected:
   int compression_level_ = 1;
   size_t compressed_size_total_ = 0;
@@ -197,8 +251,13 @@ class ZstdCompressor : public CompressorImpl {
 
   io::Result<io::Bytes> Compress(io::Bytes data);
 
+  void SetDict(const ZstdDictRegistry::Entry* dict) final {
+    dict_ = dict;
+  }
+
  private:
   ZSTD_CCtx* cctx_;
+  const ZstdDictRegistry::Entry* dict_ = nullptr;
   base::PODArray<uint8_t> compr_buf_;
 };
 
@@ -207,8 +266,16 @@ io::Result<io::Bytes> ZstdCompressor::Compress(io::Bytes data) {
   if (compr_buf_.capacity() < buf_size) {
     compr_buf_.reserve(buf_size);
   }
-  size_t compressed_size = ZSTD_compressCCtx(cctx_, compr_buf_.data(), compr_buf_.capacity(),
-                                             data.data(), data.size(), compression_level_);
+  size_t compressed_size;
+
+  // The dictionary determines the compression level.
+  if (dict_) {
+    compressed_size = ZSTD_compress_usingCDict(cctx_, compr_buf_.data(), compr_buf_.capacity(),
+                                               data.data(), data.size(), dict_->cdict);
+  } else {
+    compressed_size = ZSTD_compressCCtx(cctx_, compr_buf_.data(), compr_buf_.capacity(),
+                                        data.data(), data.size(), compression_level_);
+  }
 
   if (ZSTD_isError(compressed_size)) {
     return make_unexpected(error_code{int(compressed_size), generic_category()});
@@ -251,8 +318,9 @@ io::Result<io::Bytes> Lz4Compressor::Compress(io::Bytes data) {
   return io::Bytes(compr_buf_.data(), frame_size);
 }
 
-RdbSerializer::RdbSerializer(CompressionMode compression_mode)
-    : mem_buf_{4_KB}, tmp_buf_(nullptr), compression_mode_(compression_mode) {
+RdbSerializer::RdbSerializer(CompressionMode compression_mode, bool native_encodings)
+    : mem_buf_{4_KB}, tmp_buf_(nullptr), compression_mode_(compression_mode),
+      native_encodings_(native_encodings) {
 }
 
 RdbSerializer::~RdbSerializer() {
@@ -292,6 +360,17 @@ io::Result<uint8_t> RdbSerializer::SaveEntry(const PrimeKey& pk, const PrimeValu
                                              uint64_t expire_ms) {
   uint8_t buf[16];
   error_code ec;
+
+  // Compressed strings are saved as is, but only in DF snapshots that are never read by redis.
+  bool save_compressed = pv.IsCompressed() &&
+                         (compression_mode_ == CompressionMode::MULTY_ENTRY_ZSTD ||
+                          compression_mode_ == CompressionMode::MULTY_ENTRY_LZ4);
+  if (save_compressed) {
+    ec = SaveDictOf(pv);
+    if (ec)
+      return make_unexpected(ec);
+  }
+
   /* Save the expire time */
   if (expire_ms > 0) {
     buf[0] = RDB_OPCODE_EXPIRETIME_MS;
@@ -304,7 +383,12 @@ io::Result<uint8_t> RdbSerializer::SaveEntry(const PrimeKey& pk, const PrimeValu
   string_view key = pk.GetSlice(&tmp_str_);
   unsigned obj_type = pv.ObjType();
   unsigned encoding = pv.Encoding();
-  uint8_t rdb_type = RdbObjectType(obj_type, encoding);
+
+  uint8_t rdb_type = RDB_TYPE_COMPRESSED_STRING;
+  if (!save_compressed) {
+    rdb_type = native_encodings_ ? NativeObjectType(obj_type, encoding)
+                                 : RdbObjectType(obj_type, encoding);
+  }
 
   DVLOG(3) << "Saving key/val start " << key;
 
@@ -315,7 +399,7 @@ io::Result<uint8_t> RdbSerializer::SaveEntry(const PrimeKey& pk, const PrimeValu
   ec = SaveString(key);
   if (ec)
     return make_unexpected(ec);
-  ec = SaveValue(pv);
+  ec = save_compressed ? SaveCompressedString(pv) : SaveValue(pv);
   if (ec)
     return make_unexpected(ec);
   return rdb_type;
@@ -326,7 +410,7 @@ error_code RdbSerializer::SaveObject(const PrimeValue& pv) {
   CHECK_NE(obj_type, OBJ_STRING);
 
   if (obj_type == OBJ_LIST) {
-    return SaveListObject(pv.AsRObj());
+    return SaveListObject(pv);
   }
 
   if (obj_type == OBJ_SET) {
@@ -334,7 +418,7 @@ error_code RdbSerializer::SaveObject(const PrimeValue& pv) {
   }
 
   if (obj_type == OBJ_HASH) {
-    return SaveHSetObject(pv.AsRObj());
+    return SaveHSetObject(pv);
   }
 
   if (obj_type == OBJ_ZSET) {
@@ -345,57 +429,41 @@ error_code RdbSerializer::SaveObject(const PrimeValue& pv) {
     return SaveStreamObject(pv.AsRObj());
   }
 
+  if (obj_type == OBJ_SBF) {
+    return SaveSBFObject(pv);
+  }
+
+  if (obj_type == OBJ_JSON) {
+    return SaveJsonObject(pv);
+  }
+
+  if (obj_type == OBJ_TS) {
+    return SaveTimeSeriesObject(pv);
+  }
+
   LOG(ERROR) << "Not implemented " << obj_type;
   return make_error_code(errc::function_not_supported);
 }
 
-error_code RdbSerializer::SaveListObject(const robj* obj) {
+error_code RdbSerializer::SaveListObject(const PrimeValue& pv) {
   /* Save a list value */
-  DCHECK_EQ(OBJ_ENCODING_QUICKLIST, obj->encoding);
-  const quicklist* ql = reinterpret_cast<const quicklist*>(obj->ptr);
-  quicklistNode* node = ql->head;
-  DVLOG(1) << "Saving list of length " << ql->len;
-  RETURN_ON_ERR(SaveLen(ql->len));
-
-  while (node) {
-    DVLOG(3) << "QL node (encoding/container/sz): " << node->encoding << "/" << node->container
-             << "/" << node->sz;
-    if (QL_NODE_IS_PLAIN(node)) {
-      if (quicklistNodeIsCompressed(node)) {
-        void* data;
-        size_t compress_len = quicklistGetLzf(node, &data);
-
-        RETURN_ON_ERR(SaveLzfBlob(Bytes{reinterpret_cast<uint8_t*>(data), compress_len}, node->sz));
-      } else {
-        RETURN_ON_ERR(SaveString(node->entry, node->sz));
-      }
-    } else {
-      // listpack
-      uint8_t* lp = node->entry;
-      uint8_t* decompressed = NULL;
-
-      if (quicklistNodeIsCompressed(node)) {
-        void* data;
-        size_t compress_len = quicklistGetLzf(node, &data);
-        decompressed = (uint8_t*)zmalloc(node->sz);
-
-        if (lzf_decompress(data, compress_len, decompressed, node->sz) == 0) {
-          /* Someone requested decompress, but we can't decompress.  Not good. */
-          zfree(decompressed);
-          return make_error_code(errc::illegal_byte_sequence);
-        }
-        lp = decompressed;
-      }
+  DCHECK_EQ(kEncodingChunkedList, pv.Encoding());
+  const ChunkedList* list = reinterpret_cast<const ChunkedList*>(pv.RObjPtr());
+  DVLOG(1) << "Saving list of length " << list->Size();
+  RETURN_ON_ERR(SaveLen(list->NumChunks()));
 
-      auto cleanup = absl::MakeCleanup([=] {
-        if (decompressed)
-          zfree(decompressed);
-      });
-      RETURN_ON_ERR(SaveListPackAsZiplist(lp));
+  error_code ec;
+  list->ForEachListpack([&](const uint8_t* lp) {
+    if (native_encodings_) {
+      ec = SaveLen(QUICKLIST_NODE_CONTAINER_PACKED);
+      if (!ec)
+        ec = SaveListPack(lp);
+    } else {
+      ec = SaveListPackAsZiplist(const_cast<uint8_t*>(lp));
     }
-    node = node->next;
-  }
-  return error_code{};
+    return !ec;
+  });
+  return ec;
 }
 
 error_code RdbSerializer::SaveSetObject(const PrimeValue& obj) {
@@ -418,6 +486,14 @@ error_code RdbSerializer::SaveSetObject(const PrimeValue& obj) {
 
     RETURN_ON_ERR(SaveLen(set->Size()));
 
+    if (native_encodings_) {
+      string chunk;
+      for (sds ele : *set) {
+        RETURN_ON_ERR(AppendPacked(string_view{ele, sdslen(ele)}, &chunk));
+      }
+      return FinishPacked(&chunk);
+    }
+
     for (sds ele : *set) {
       RETURN_ON_ERR(SaveString(string_view{ele, sdslen(ele)}));
     }
@@ -432,10 +508,28 @@ error_code RdbSerializer::SaveSetObject(const PrimeValue& obj) {
   return error_code{};
 }
 
-error_code RdbSerializer::SaveHSetObject(const robj* obj) {
-  DCHECK_EQ(OBJ_HASH, obj->type);
-  if (obj->encoding == OBJ_ENCODING_HT) {
-    dict* set = (dict*)obj->ptr;
+error_code RdbSerializer::SaveHSetObject(const PrimeValue& pv) {
+  DCHECK_EQ(OBJ_HASH, pv.ObjType());
+  if (pv.Encoding() == kEncodingStrMap2) {
+    StringMap* sm = (StringMap*)pv.RObjPtr();
+
+    RETURN_ON_ERR(SaveLen(sm->Size()));
+
+    if (native_encodings_) {
+      string chunk;
+      for (sds entry : *sm) {
+        RETURN_ON_ERR(AppendPacked(StringMap::Field(entry), &chunk));
+        RETURN_ON_ERR(AppendPacked(StringMap::Value(entry), &chunk));
+      }
+      return FinishPacked(&chunk);
+    }
+
+    for (sds entry : *sm) {
+      RETURN_ON_ERR(SaveString(StringMap::Field(entry)));
+      RETURN_ON_ERR(SaveString(StringMap::Value(entry)));
+    }
+  } else if (pv.Encoding() == kEncodingStrMap) {
+    dict* set = (dict*)pv.RObjPtr();
 
     RETURN_ON_ERR(SaveLen(dictSize(set)));
 
@@ -451,13 +545,13 @@ error_code RdbSerializer::SaveHSetObject(const robj* obj) {
       RETURN_ON_ERR(SaveString(string_view{value, sdslen(value)}));
     }
   } else {
-    CHECK_EQ(unsigned(OBJ_ENCODING_LISTPACK), obj->encoding);
+    CHECK_EQ(kEncodingListPack, pv.Encoding());
 
-    uint8_t* lp = (uint8_t*)obj->ptr;
+    uint8_t* lp = (uint8_t*)pv.RObjPtr();
     size_t lplen = lpLength(lp);
     CHECK(lplen > 0 && lplen % 2 == 0);  // has (key,value) pairs.
 
-    RETURN_ON_ERR(SaveListPackAsZiplist(lp));
+    RETURN_ON_ERR(native_encodings_ ? SaveListPack(lp) : SaveListPackAsZiplist(lp));
   }
 
   return error_code{};
@@ -465,28 +559,22 @@ error_code RdbSerializer::SaveHSetObject(const robj* obj) {
 
 error_code RdbSerializer::SaveZSetObject(const robj* obj) {
   DCHECK_EQ(OBJ_ZSET, obj->type);
-  if (obj->encoding == OBJ_ENCODING_SKIPLIST) {
-    zset* zs = (zset*)obj->ptr;
-    zskiplist* zsl = zs->zsl;
-
-    RETURN_ON_ERR(SaveLen(zsl->length));
-
-    /* We save the skiplist elements from the greatest to the smallest
-     * (that's trivial since the elements are already ordered in the
-     * skiplist): this improves the load process, since the next loaded
-     * element will always be the smaller, so adding to the skiplist
-     * will always immediately stop at the head, making the insertion
-     * O(1) instead of O(log(N)). */
-    zskiplistNode* zn = zsl->tail;
-    while (zn != NULL) {
-      RETURN_ON_ERR(SaveString(string_view{zn->ele, sdslen(zn->ele)}));
-      RETURN_ON_ERR(SaveBinaryDouble(zn->score));
-      zn = zn->backward;
+  if (obj->encoding == kEncodingSortedMap) {
+    const SortedMap* zs = (const SortedMap*)obj->ptr;
+
+    RETURN_ON_ERR(SaveLen(zs->Size()));
+
+    /* We save the elements from the greatest to the smallest, like redis does for its
+     * skiplist, so that the loader that inserts them into a skiplist would always insert
+     * at the head. */
+    for (auto it = zs->Last(); !it.IsEnd(); --it) {
+      RETURN_ON_ERR(SaveString(string_view{it->member, sdslen(it->member)}));
+      RETURN_ON_ERR(SaveBinaryDouble(it->score));
     }
   } else {
     CHECK_EQ(obj->encoding, unsigned(OBJ_ENCODING_LISTPACK)) << "Unknown zset encoding";
     uint8_t* lp = (uint8_t*)obj->ptr;
-    RETURN_ON_ERR(SaveListPackAsZiplist(lp));
+    RETURN_ON_ERR(native_encodings_ ? SaveListPack(lp) : SaveListPackAsZiplist(lp));
   }
 
   return error_code{};
@@ -569,6 +657,39 @@ error_code RdbSerializer::SaveStreamObject(const robj* obj) {
   return error_code{};
 }
 
+error_code RdbSerializer::SaveSBFObject(const PrimeValue& pv) {
+  const SBF* sbf = pv.GetSBF();
+  RETURN_ON_ERR(SaveBinaryDouble(sbf->grow_factor()));
+  RETURN_ON_ERR(SaveBinaryDouble(sbf->fp_probability()));
+  RETURN_ON_ERR(SaveLen(sbf->prev_size()));
+  RETURN_ON_ERR(SaveLen(sbf->current_size()));
+  RETURN_ON_ERR(SaveLen(sbf->max_capacity()));
+  RETURN_ON_ERR(SaveLen(sbf->num_filters()));
+
+  for (size_t i = 0; i < sbf->num_filters(); ++i) {
+    const Bloom& filter = sbf->filter(i);
+    RETURN_ON_ERR(SaveLen(filter.hash_cnt()));
+    RETURN_ON_ERR(SaveString(filter.data()));
+  }
+  return error_code{};
+}
+
+error_code RdbSerializer::SaveJsonObject(const PrimeValue& pv) {
+  // The packed documents are saved as they are, without encoding them again.
+  if (pv.IsPackedJson())
+    return SaveString(pv.GetPackedJson());
+
+  tmp_str_.clear();
+  PackJson(*pv.GetJson(), &tmp_str_);
+  return SaveString(tmp_str_);
+}
+
+error_code RdbSerializer::SaveTimeSeriesObject(const PrimeValue& pv) {
+  tmp_str_.clear();
+  pv.GetTimeSeries()->Serialize(&tmp_str_);
+  return SaveString(tmp_str_);
+}
+
 /* Save a long long value as either an encoded string or a string. */
 error_code RdbSerializer::SaveLongLongAsString(int64_t value) {
   uint8_t buf[32];
@@ -618,6 +739,28 @@ error_code RdbSerializer::SaveListPackAsZiplist(uint8_t* lp) {
   return ec;
 }
 
+error_code RdbSerializer::SaveListPack(const uint8_t* lp) {
+  return SaveString(lp, lpBytes(const_cast<uint8_t*>(lp)));
+}
+
+error_code RdbSerializer::AppendPacked(string_view s, string* chunk) {
+  uint8_t buf[9];
+  unsigned enclen = SerializeLen(s.size(), buf);
+  chunk->append(reinterpret_cast<char*>(buf), enclen).append(s);
+  if (chunk->size() < RDB_PACKED_CHUNK_LEN)
+    return error_code{};
+
+  RETURN_ON_ERR(SaveString(*chunk));
+  chunk->clear();
+  return error_code{};
+}
+
+error_code RdbSerializer::FinishPacked(string* chunk) {
+  if (!chunk->empty())
+    RETURN_ON_ERR(SaveString(*chunk));
+  return SaveString(string_view{});
+}
+
 error_code RdbSerializer::SaveStreamPEL(rax* pel, bool nacks) {
   /* Number of entries in the PEL. */
 
@@ -714,6 +857,10 @@ error_code RdbSerializer::FlushToSink(io::Sink* s) {
   RETURN_ON_ERR(s->Write(mem_buf_.InputBuffer()));
   mem_buf_.ConsumeInput(sz);
 
+  // The dictionaries are in the sink now, so that the loader knows them before it decompresses
+  // the following blobs.
+  flushed_dicts_.insert(saved_dicts_.begin(), saved_dicts_.end());
+
   return error_code{};
 }
 
@@ -735,6 +882,12 @@ error_code RdbSerializer::SaveString(string_view val) {
   /* Try LZF compression - under 20 bytes it's unable to compress even
    * aaaaaaaaaaaaaaaaaa so skip it */
   size_t len = val.size();
+  if (compression_mode_ == CompressionMode::SINGLE_ENTRY_LZ4 && len > 20) {
+    error_code ec;
+    if (TrySaveLz4String(val, &ec))
+      return ec;
+  }
+
   if ((compression_mode_ == CompressionMode::SINGLE_ENTRY) && (len > 20)) {
     size_t comprlen, outlen = len;
     tmp_buf_.resize(outlen + 1);
@@ -761,6 +914,32 @@ error_code RdbSerializer::SaveString(string_view val) {
   return error_code{};
 }
 
+error_code RdbSerializer::SaveCompressedString(const PrimeValue& pv) {
+  CompactObj::CompressedBlob cb = pv.GetCompressed();
+
+  RETURN_ON_ERR(WriteOpcode(uint8_t(cb.codec)));
+  RETURN_ON_ERR(SaveLen(cb.raw_size));
+  RETURN_ON_ERR(SaveLen(cb.blob.size()));
+
+  return WriteRaw(Bytes{reinterpret_cast<const uint8_t*>(cb.blob.data()), cb.blob.size()});
+}
+
+error_code RdbSerializer::SaveDictOf(const PrimeValue& pv) {
+  CompactObj::CompressedBlob cb = pv.GetCompressed();
+  if (cb.codec != CompressCodec::ZSTD_DICT)
+    return error_code{};
+
+  uint32_t dict_id = ZSTD_getDictID_fromFrame(cb.blob.data(), cb.blob.size());
+  if (!saved_dicts_.insert(dict_id).second)
+    return error_code{};
+
+  const ZstdDictRegistry::Entry* dict = ZstdDictRegistry::Find(dict_id);
+  CHECK(dict) << "Unknown zstd dictionary " << dict_id;
+
+  RETURN_ON_ERR(WriteOpcode(RDB_OPCODE_ZSTD_DICT));
+  return SaveString(dict->raw);
+}
+
 error_code RdbSerializer::SaveLen(size_t len) {
   uint8_t buf[16];
   unsigned enclen = SerializeLen(len, buf);
@@ -778,6 +957,32 @@ error_code RdbSerializer::SaveLzfBlob(const io::Bytes& src, size_t uncompressed_
   return error_code{};
 }
 
+bool RdbSerializer::TrySaveLz4String(string_view val, error_code* ec) {
+  // Like with LZF, the compression has to save more than 8 bytes and 15% of the string,
+  // LZ4 gives up once its output does not fit into capacity.
+  size_t len = val.size();
+  DCHECK_GT(len, 20u);
+  if (len > LZ4_MAX_INPUT_SIZE)
+    return false;
+
+  size_t capacity = min<size_t>(len - 9, len * 0.85 - 1);
+  tmp_buf_.resize(capacity);
+  int comprlen = LZ4_compress_default(val.data(), reinterpret_cast<char*>(tmp_buf_.data()),
+                                      len, capacity);
+  if (comprlen <= 0)
+    return false;
+
+  uint8_t opcode = (RDB_ENCVAL << 6) | RDB_ENC_LZ4;
+  *ec = WriteOpcode(opcode);
+  if (!*ec)
+    *ec = SaveLen(comprlen);
+  if (!*ec)
+    *ec = SaveLen(len);
+  if (!*ec)
+    *ec = WriteRaw(Bytes{tmp_buf_.data(), size_t(comprlen)});
+  return true;
+}
+
 AlignedBuffer::AlignedBuffer(size_t cap, ::io::Sink* upstream)
     : capacity_(cap), upstream_(upstream) {
   aligned_buf_ = (char*)mi_malloc_aligned(kBufLen, 4_KB);
@@ -829,13 +1034,69 @@ error_code AlignedBuffer::Flush() {
   return upstream_->Write(&ivec, 1);
 }
 
+IoRateLimiter::IoRateLimiter(uint64_t bytes_per_sec)
+    : max_rate_(bytes_per_sec), rate_(bytes_per_sec) {
+  CHECK_GT(bytes_per_sec, 0u);
+}
+
+uint64_t IoRateLimiter::Acquire(size_t len, uint64_t now_ns) {
+  uint64_t cost_ns = len * 1'000'000'000ULL / rate_.load(memory_order_relaxed);
+  uint64_t tat = tat_ns_.load(memory_order_relaxed);
+  uint64_t next;
+  do {
+    next = max(tat, now_ns) + cost_ns;
+  } while (!tat_ns_.compare_exchange_weak(tat, next, memory_order_relaxed));
+
+  return next > now_ns + kBurstNs ? next - now_ns - kBurstNs : 0;
+}
+
+void IoRateLimiter::Adjust(bool overloaded) {
+  uint64_t rate = rate_.load(memory_order_relaxed);
+  if (overloaded) {
+    rate = max(rate / 2, max<uint64_t>(max_rate_ / 16, 1));
+  } else {
+    rate = min(rate + max<uint64_t>(max_rate_ / 8, 1), max_rate_);
+  }
+  rate_.store(rate, memory_order_relaxed);
+}
+
+io::Result<size_t> RateLimitedSink::WriteSome(const iovec* v, uint32_t len) {
+  size_t total_len = 0;
+  for (uint32_t i = 0; i < len; ++i) {
+    total_len += v[i].iov_len;
+  }
+
+  uint64_t wait_ns = limiter_->Acquire(total_len, ProactorBase::GetMonotonicTimeNs());
+  if (wait_ns > 0)
+    util::fibers_ext::SleepFor(chrono::nanoseconds(wait_ns));
+
+  return upstream_->WriteSome(v, len);
+}
+
+io::Result<size_t> Crc64Sink::WriteSome(const iovec* v, uint32_t len) {
+  io::Result<size_t> res = upstream_->WriteSome(v, len);
+  if (!res)
+    return res;
+
+  // Only the written prefix is accounted, the caller retries the rest.
+  size_t left = *res;
+  for (uint32_t i = 0; i < len && left > 0; ++i) {
+    size_t sz = min(left, v[i].iov_len);
+    crc_ = Crc64(crc_, v[i].iov_base, sz);
+    left -= sz;
+  }
+  return res;
+}
+
 class RdbSaver::Impl {
  public:
   // We pass K=sz to say how many producers are pushing data in order to maintain
   // correct closing semantics - channel is closing when K producers marked it as closed.
-  Impl(bool align_writes, unsigned producers_len, CompressionMode compression_mode, io::Sink* sink);
+  Impl(bool align_writes, unsigned producers_len, CompressionMode compression_mode,
+       bool native_encodings, io::Sink* sink);
 
-  void StartSnapshotting(bool stream_journal, const Cancellation* cll, EngineShard* shard);
+  void StartSnapshotting(bool stream_journal, const Cancellation* cll, EngineShard* shard,
+                         SliceSnapshot::DeltaMode delta_mode);
 
   void StopSnapshotting(EngineShard* shard);
 
@@ -863,8 +1124,22 @@ class RdbSaver::Impl {
     return sink_;
   }
 
+  // The CRC64 of everything written so far, zero if --rdb_checksum is off.
+  uint64_t checksum() const {
+    return crc_sink_ ? crc_sink_->crc() : 0;
+  }
+
   void Cancel();
 
+  const journal::Position& journal_pos() const {
+    return journal_pos_;
+  }
+
+  double TraversalProgress(EngineShard* shard) {
+    auto& snapshot = GetSnapshot(shard);
+    return snapshot ? snapshot->TraversalProgress() : 0;
+  }
+
  private:
   unique_ptr<SliceSnapshot>& GetSnapshot(EngineShard* shard);
 
@@ -874,6 +1149,9 @@ class RdbSaver::Impl {
   RdbSerializer meta_serializer_;
   SliceSnapshot::RecordChannel channel_;
   std::optional<AlignedBuffer> aligned_buf_;
+  std::optional<Crc64Sink> crc_sink_;
+  journal::Position journal_pos_;  // the LSNs of the shards when their snapshots started.
+  bool native_encodings_;
   CompressionMode
       compression_mode_;  // Single entry compression is compatible with redis rdb snapshot
                           // Multi entry compression is available only on df snapshot, this will
@@ -883,17 +1161,28 @@ class RdbSaver::Impl {
 // We pass K=sz to say how many producers are pushing data in order to maintain
 // correct closing semantics - channel is closing when K producers marked it as closed.
 RdbSaver::Impl::Impl(bool align_writes, unsigned producers_len, CompressionMode compression_mode,
-                     io::Sink* sink)
+                     bool native_encodings, io::Sink* sink)
     : sink_(sink), shard_snapshots_(producers_len),
       meta_serializer_(CompressionMode::NONE),  // Note: I think there is not need for compression
                                                 // at all in meta serializer
-      channel_{128, producers_len}, compression_mode_(compression_mode) {
+      channel_{128, producers_len}, compression_mode_(compression_mode),
+      native_encodings_(native_encodings) {
   if (align_writes) {
     aligned_buf_.emplace(kBufLen, sink);
     sink_ = &aligned_buf_.value();
   }
 
+  if (absl::GetFlag(FLAGS_rdb_checksum)) {
+    crc_sink_.emplace(sink_);
+    sink_ = &crc_sink_.value();
+  }
+
   DCHECK(producers_len > 0 || channel_.IsClosing());
+
+  if (journal::Journal* journal = ServerState::tlocal()->journal(); journal) {
+    journal_pos_.session = journal->session();
+    journal_pos_.lsns.resize(shard_set->size());
+  }
 }
 
 error_code RdbSaver::Impl::SaveAuxFieldStrStr(string_view key, string_view val) {
@@ -920,20 +1209,26 @@ error_code RdbSaver::Impl::ConsumeChannel(const Cancellation* cll) {
 
   auto& channel = channel_;
   while (channel.Pop(record)) {
-    if (io_error || cll->IsCancelled())
+    if (io_error || cll->IsCancelled()) {
+      SliceSnapshot::ReleaseRecord(record);
       continue;
+    }
 
     do {
-      if (cll->IsCancelled())
+      if (cll->IsCancelled()) {
+        SliceSnapshot::ReleaseRecord(record);
         continue;
+      }
 
       if (record.db_index != last_db_index) {
         unsigned enclen = SerializeLen(record.db_index, buf + 1);
         string_view str{(char*)buf, enclen + 1};
 
         io_error = sink_->Write(io::Buffer(str));
-        if (io_error)
+        if (io_error) {
+          SliceSnapshot::ReleaseRecord(record);
           break;
+        }
         last_db_index = record.db_index;
       }
 
@@ -942,6 +1237,7 @@ error_code RdbSaver::Impl::ConsumeChannel(const Cancellation* cll) {
 
       io_error = sink_->Write(io::Buffer(record.value));
 
+      SliceSnapshot::ReleaseRecord(record);
       record.value.clear();
     } while (!io_error && channel.TryPop(record));
   }  // while (channel.pop)
@@ -960,11 +1256,17 @@ error_code RdbSaver::Impl::ConsumeChannel(const Cancellation* cll) {
 }
 
 void RdbSaver::Impl::StartSnapshotting(bool stream_journal, const Cancellation* cll,
-                                       EngineShard* shard) {
+                                       EngineShard* shard, SliceSnapshot::DeltaMode delta_mode) {
   auto& s = GetSnapshot(shard);
-  s.reset(new SliceSnapshot(&shard->db_slice(), &channel_, compression_mode_));
+  s.reset(new SliceSnapshot(&shard->db_slice(), &channel_, compression_mode_, native_encodings_));
+
+  // The snapshot starts in a global transaction, hence the later records of the file-based
+  // journal are exactly the writes after it, see DFLY RESTORE.
+  journal::Journal* journal = shard->journal();
+  if (!stream_journal && journal && journal->IsPersistent() && !journal_pos_.lsns.empty())
+    journal_pos_.lsns[shard->shard_id()] = journal->GetLsn();
 
-  s->Start(stream_journal, cll);
+  s->Start(stream_journal, cll, delta_mode);
 }
 
 void RdbSaver::Impl::StopSnapshotting(EngineShard* shard) {
@@ -982,6 +1284,7 @@ void RdbSaver::Impl::Cancel() {
 
   dfly::SliceSnapshot::DbRecord rec;
   while (channel_.Pop(rec)) {
+    SliceSnapshot::ReleaseRecord(rec);
   }
 
   snapshot->Join();
@@ -1003,27 +1306,28 @@ unique_ptr<SliceSnapshot>& RdbSaver::Impl::GetSnapshot(EngineShard* shard) {
   return shard_snapshots_[sid];
 }
 
-RdbSaver::RdbSaver(::io::Sink* sink, SaveMode save_mode, bool align_writes) {
+RdbSaver::RdbSaver(::io::Sink* sink, SaveMode save_mode, bool align_writes, bool compress) {
   CHECK_NOTNULL(sink);
-  int compression_mode = absl::GetFlag(FLAGS_compression_mode);
+  int compression_mode = compress ? absl::GetFlag(FLAGS_compression_mode) : 0;
   int producer_count = 0;
   switch (save_mode) {
     case SaveMode::SUMMARY:
       producer_count = 0;
       if (compression_mode >= 1) {
-        compression_mode_ = CompressionMode::SINGLE_ENTRY;
+        compression_mode_ = CompressionMode::SINGLE_ENTRY_LZ4;
       } else {
         compression_mode_ = CompressionMode::NONE;
       }
       break;
     case SaveMode::SINGLE_SHARD:
+    case SaveMode::SINGLE_SHARD_DELTA:
       producer_count = 1;
       if (compression_mode == 3) {
         compression_mode_ = CompressionMode::MULTY_ENTRY_LZ4;
       } else if (compression_mode == 2) {
         compression_mode_ = CompressionMode::MULTY_ENTRY_ZSTD;
       } else if (compression_mode == 1) {
-        compression_mode_ = CompressionMode::SINGLE_ENTRY;
+        compression_mode_ = CompressionMode::SINGLE_ENTRY_LZ4;
       } else {
         compression_mode_ = CompressionMode::NONE;
       }
@@ -1038,7 +1342,9 @@ RdbSaver::RdbSaver(::io::Sink* sink, SaveMode save_mode, bool align_writes) {
       break;
   }
   VLOG(1) << "Rdb save using compression mode:" << uint32_t(compression_mode_);
-  impl_.reset(new Impl(align_writes, producer_count, compression_mode_, sink));
+  // Only the redis compatible rdb files keep the redis encodings, for the exports.
+  bool native_encodings = save_mode != SaveMode::RDB && absl::GetFlag(FLAGS_rdb_native_encodings);
+  impl_.reset(new Impl(align_writes, producer_count, compression_mode_, native_encodings, sink));
   save_mode_ = save_mode;
 }
 
@@ -1047,7 +1353,17 @@ RdbSaver::~RdbSaver() {
 
 void RdbSaver::StartSnapshotInShard(bool stream_journal, const Cancellation* cll,
                                     EngineShard* shard) {
-  impl_->StartSnapshotting(stream_journal, cll, shard);
+  // Replication streams its own changes, only the snapshots on disk start the delta epochs.
+  using DeltaMode = SliceSnapshot::DeltaMode;
+  DeltaMode delta_mode = DeltaMode::NONE;
+  if (save_mode_ == SaveMode::SINGLE_SHARD_DELTA) {
+    delta_mode = DeltaMode::DELTA;
+  } else if (save_mode_ == SaveMode::SINGLE_SHARD && !stream_journal &&
+             absl::GetFlag(FLAGS_df_snapshot_deltas)) {
+    delta_mode = DeltaMode::BASE;
+  }
+
+  impl_->StartSnapshotting(stream_journal, cll, shard, delta_mode);
 }
 
 void RdbSaver::StopSnapshotInShard(EngineShard* shard) {
@@ -1065,6 +1381,14 @@ error_code RdbSaver::SaveHeader(const StringVec& lua_scripts) {
   return error_code{};
 }
 
+error_code RdbSaver::SaveFlushedDbs(const vector<DbIndex>& dbs) {
+  DCHECK(save_mode_ == SaveMode::SUMMARY);
+  for (DbIndex db_ind : dbs) {
+    RETURN_ON_ERR(SaveAuxFieldStrInt("flushdb", db_ind));
+  }
+  return error_code{};
+}
+
 error_code RdbSaver::SaveBody(const Cancellation* cll, RdbTypeFreqMap* freq_map) {
   RETURN_ON_ERR(impl_->serializer()->FlushToSink(impl_->sink()));
 
@@ -1106,11 +1430,17 @@ error_code RdbSaver::SaveAux(const StringVec& lua_scripts) {
   RETURN_ON_ERR(SaveAuxFieldStrInt("aof-preamble", aof_preamble));
 
   // Save lua scripts only in rdb or summary file
-  DCHECK(save_mode_ != SaveMode::SINGLE_SHARD || lua_scripts.empty());
+  DCHECK((save_mode_ != SaveMode::SINGLE_SHARD && save_mode_ != SaveMode::SINGLE_SHARD_DELTA) ||
+         lua_scripts.empty());
   for (const string& s : lua_scripts) {
     RETURN_ON_ERR(impl_->SaveAuxFieldStrStr("lua", s));
   }
 
+  // The entries of a delta replace the loaded ones.
+  if (save_mode_ == SaveMode::SINGLE_SHARD_DELTA) {
+    RETURN_ON_ERR(SaveAuxFieldStrInt("delta", 1));
+  }
+
   // TODO: "repl-stream-db", "repl-id", "repl-offset"
   return error_code{};
 }
@@ -1121,12 +1451,18 @@ error_code RdbSaver::SaveEpilog() {
 
   auto& ser = *impl_->serializer();
 
+  const journal::Position& journal_pos = impl_->journal_pos();
+  if (any_of(journal_pos.lsns.begin(), journal_pos.lsns.end(), [](LSN lsn) { return lsn > 0; }))
+    RETURN_ON_ERR(impl_->SaveAuxFieldStrStr("journal-pos", journal_pos.Format()));
+
   /* EOF opcode */
   RETURN_ON_ERR(ser.WriteOpcode(RDB_OPCODE_EOF));
 
   /* CRC64 checksum. It will be zero if checksum computation is disabled, the
-   * loading code skips the check in this case. */
-  chksum = 0;
+   * loading code skips the check in this case. The checksum covers the EOF opcode,
+   * hence it is flushed first. */
+  RETURN_ON_ERR(ser.FlushToSink(impl_->sink()));
+  chksum = impl_->checksum();
 
   absl::little_endian::Store64(buf, chksum);
   RETURN_ON_ERR(ser.WriteRaw(buf));
@@ -1146,6 +1482,16 @@ void RdbSaver::Cancel() {
   impl_->Cancel();
 }
 
+double RdbSaver::TraversalProgress(EngineShard* shard) {
+  return impl_->TraversalProgress(shard);
+}
+
+CompressionMode SingleEntryMode(CompressionMode mode) {
+  if (mode == CompressionMode::NONE || mode == CompressionMode::SINGLE_ENTRY)
+    return mode;
+  return CompressionMode::SINGLE_ENTRY_LZ4;
+}
+
 void RdbSerializer::AllocateCompressorOnce() {
   if (compressor_impl_) {
     return;
@@ -1171,6 +1517,12 @@ void RdbSerializer::CompressBlob() {
   }
 
   AllocateCompressorOnce();
+
+  if (compression_mode_ == CompressionMode::MULTY_ENTRY_ZSTD) {
+    const ZstdDictRegistry::Entry* dict = ZstdDictRegistry::ThreadDict();
+    compressor_impl_->SetDict(dict && flushed_dicts_.contains(dict->id) ? dict : nullptr);
+  }
+
   // Compress the data
   auto ec = compressor_impl_->Compress(blob_to_compress);
   if (!ec) {
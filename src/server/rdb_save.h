@@ -4,12 +4,14 @@
 #pragma once
 
 #include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
 
 extern "C" {
 #include "redis/lzfP.h"
 #include "redis/object.h"
 }
 
+#include <atomic>
 #include <optional>
 
 #include "base/io_buf.h"
@@ -25,6 +27,10 @@ namespace dfly {
 
 uint8_t RdbObjectType(unsigned type, unsigned encoding);
 
+// Like RdbObjectType, but the listpacks and the DenseSet based containers are saved as they are
+// in memory, which only Dragonfly can load.
+uint8_t NativeObjectType(unsigned type, unsigned encoding);
+
 class EngineShard;
 
 class AlignedBuffer : public ::io::Sink {
@@ -54,14 +60,89 @@ class AlignedBuffer : public ::io::Sink {
   off_t buf_offs_ = 0;
 };
 
+// Token bucket that limits the write rate of a snapshot. It is shared by the files that are
+// written in parallel, since they share the storage device. The rate backs off while the
+// foreground IO suffers: Adjust halves it on overload and restores it gradually otherwise.
+class IoRateLimiter {
+ public:
+  // Allows bursts of up to kBurstNs worth of the rate.
+  static constexpr uint64_t kBurstNs = 100'000'000;
+
+  explicit IoRateLimiter(uint64_t bytes_per_sec);
+
+  // Takes len bytes from the bucket at now_ns and returns for how many nanoseconds the writer
+  // must wait before writing them. Thread-safe.
+  uint64_t Acquire(size_t len, uint64_t now_ns);
+
+  // Decreases the rate if overloaded, down to 1/16 of the configured rate, otherwise increases
+  // it by 1/8 of the configured rate, up to the configured rate.
+  void Adjust(bool overloaded);
+
+  uint64_t rate() const {
+    return rate_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  uint64_t max_rate_;
+  std::atomic_uint64_t rate_;
+
+  // The time at which the bucket would be full again if nothing else was taken.
+  std::atomic_uint64_t tat_ns_{0};
+};
+
+// Delays the writes into upstream according to the limiter.
+class RateLimitedSink : public ::io::Sink {
+ public:
+  RateLimitedSink(::io::Sink* upstream, IoRateLimiter* limiter)
+      : upstream_(upstream), limiter_(limiter) {
+  }
+
+  io::Result<size_t> WriteSome(const iovec* v, uint32_t len) final;
+
+ private:
+  ::io::Sink* upstream_;
+  IoRateLimiter* limiter_;
+};
+
+// Passes the writes to upstream and computes the redis CRC64 of the bytes it accepted.
+class Crc64Sink : public ::io::Sink {
+ public:
+  explicit Crc64Sink(::io::Sink* upstream) : upstream_(upstream) {
+  }
+
+  io::Result<size_t> WriteSome(const iovec* v, uint32_t len) final;
+
+  uint64_t crc() const {
+    return crc_;
+  }
+
+ private:
+  ::io::Sink* upstream_;
+  uint64_t crc_ = 0;
+};
+
 // SaveMode for snapshot. Used by RdbSaver to adjust internals.
 enum class SaveMode {
   SUMMARY,       // Save only header values (summary.dfs). Expected to read no shards.
   SINGLE_SHARD,  // Save single shard values (XXXX.dfs). Expected to read one shard.
+  SINGLE_SHARD_DELTA,  // Save the changes of a single shard since its previous snapshot.
   RDB,           // Save .rdb file. Expected to read all shards.
 };
 
-enum class CompressionMode { NONE, SINGLE_ENTRY, MULTY_ENTRY_ZSTD, MULTY_ENTRY_LZ4 };
+// SINGLE_ENTRY compresses the strings with LZF, as redis does. SINGLE_ENTRY_LZ4 compresses them
+// with LZ4 instead, which is several times faster but is understood only by Dragonfly, so it is
+// used only in the DF snapshots and the full sync, see RDB_ENC_LZ4.
+enum class CompressionMode {
+  NONE,
+  SINGLE_ENTRY,
+  MULTY_ENTRY_ZSTD,
+  MULTY_ENTRY_LZ4,
+  SINGLE_ENTRY_LZ4
+};
+
+// The per-entry compression of the serializers that a snapshot in mode can not compress into
+// blobs.
+CompressionMode SingleEntryMode(CompressionMode mode);
 
 class RdbSaver {
  public:
@@ -70,7 +151,9 @@ class RdbSaver {
   // single_shard - false, means we capture all the data using a single RdbSaver instance
   // (corresponds to legacy, redis compatible mode)
   // if align_writes is true - writes data in aligned chunks of 4KB to fit direct I/O requirements.
-  explicit RdbSaver(::io::Sink* sink, SaveMode save_mode, bool align_writes);
+  // if compress is false - ignores --compression_mode, e.g. for the replication over localhost.
+  explicit RdbSaver(::io::Sink* sink, SaveMode save_mode, bool align_writes,
+                    bool compress = true);
 
   ~RdbSaver();
 
@@ -84,6 +167,10 @@ class RdbSaver {
   // Stores auxiliary (meta) values and lua scripts.
   std::error_code SaveHeader(const StringVec& lua_scripts);
 
+  // Stores the databases flushed since the previous snapshot in the summary of a delta.
+  // Must be called after SaveHeader.
+  std::error_code SaveFlushedDbs(const std::vector<DbIndex>& dbs);
+
   // Writes the RDB file into sink. Waits for the serialization to finish.
   // Fills freq_map with the histogram of rdb types.
   // freq_map can optionally be null.
@@ -91,6 +178,10 @@ class RdbSaver {
 
   void Cancel();
 
+  // Returns the share of the buckets of the shard that the snapshot traversed, in percent.
+  // Must be called from the thread of the shard.
+  double TraversalProgress(EngineShard* shard);
+
   SaveMode Mode() const {
     return save_mode_;
   }
@@ -112,7 +203,9 @@ class CompressorImpl;
 
 class RdbSerializer {
  public:
-  RdbSerializer(CompressionMode compression_mode);
+  // With native_encodings the containers are saved in the Dragonfly specific types that keep
+  // them as they are in memory, see NativeObjectType. Otherwise the output is understood by redis.
+  RdbSerializer(CompressionMode compression_mode, bool native_encodings = false);
 
   ~RdbSerializer();
 
@@ -147,15 +240,31 @@ class RdbSerializer {
 
  private:
   std::error_code SaveLzfBlob(const ::io::Bytes& src, size_t uncompressed_len);
+
+  // Returns false if LZ4 does not save enough to store val compressed.
+  bool TrySaveLz4String(std::string_view val, std::error_code* ec);
+  std::error_code SaveCompressedString(const PrimeValue& pv);
+
+  // Saves the zstd dictionary of the compressed value unless it was already saved.
+  std::error_code SaveDictOf(const PrimeValue& pv);
   std::error_code SaveObject(const PrimeValue& pv);
-  std::error_code SaveListObject(const robj* obj);
+  std::error_code SaveListObject(const PrimeValue& pv);
   std::error_code SaveSetObject(const PrimeValue& pv);
-  std::error_code SaveHSetObject(const robj* obj);
+  std::error_code SaveHSetObject(const PrimeValue& pv);
   std::error_code SaveZSetObject(const robj* obj);
   std::error_code SaveStreamObject(const robj* obj);
+  std::error_code SaveSBFObject(const PrimeValue& pv);
+  std::error_code SaveJsonObject(const PrimeValue& pv);
+  std::error_code SaveTimeSeriesObject(const PrimeValue& pv);
   std::error_code SaveLongLongAsString(int64_t value);
   std::error_code SaveBinaryDouble(double val);
   std::error_code SaveListPackAsZiplist(uint8_t* lp);
+  std::error_code SaveListPack(const uint8_t* lp);
+
+  // Appends s to the chunk of RDB_TYPE_SET_STRSET or RDB_TYPE_HASH_STRMAP, which is saved once
+  // it is full. FinishPacked saves the rest and the empty string that ends the chunks.
+  std::error_code AppendPacked(std::string_view s, std::string* chunk);
+  std::error_code FinishPacked(std::string* chunk);
   std::error_code SaveStreamPEL(rax* pel, bool nacks);
   std::error_code SaveStreamConsumers(streamCG* cg);
   // If membuf data is compressable use compression impl to compress the data and write it to membuf
@@ -167,9 +276,16 @@ class RdbSerializer {
   base::PODArray<uint8_t> tmp_buf_;
   std::string tmp_str_;
   CompressionMode compression_mode_;
+  bool native_encodings_;
   // TODO : This compressor impl should support different compression algorithms zstd/lz4 etc.
   std::unique_ptr<CompressorImpl> compressor_impl_;
 
+  // Ids of zstd dictionaries written into the stream and of those already flushed to the sink.
+  // Blobs are compressed only with flushed dictionaries, so that a blob does not depend on
+  // a dictionary inside it.
+  absl::flat_hash_set<uint32_t> saved_dicts_;
+  absl::flat_hash_set<uint32_t> flushed_dicts_;
+
   static constexpr size_t kMinStrSizeToCompress = 256;
   static constexpr double kMinCompressionReductionPrecentage = 0.95;
   struct CompressionStats {
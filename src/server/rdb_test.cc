@@ -9,16 +9,25 @@ extern "C" {
 #include "redis/zmalloc.h"
 }
 
+#include <absl/base/internal/endian.h>
 #include <absl/flags/reflection.h>
+#include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
 #include <mimalloc.h>
 
+#include <fstream>
+
 #include "base/flags.h"
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "facade/facade_test.h"  // needed to find operator== for RespExpr.
 #include "io/file.h"
 #include "server/engine_shard_set.h"
+#include "server/error.h"
+#include "server/rdb_extensions.h"
 #include "server/rdb_load.h"
+#include "server/rdb_save.h"
+#include "server/snapshot.h"
 #include "server/test_utils.h"
 
 using namespace testing;
@@ -31,6 +40,18 @@ using absl::StrCat;
 ABSL_DECLARE_FLAG(int32, list_compress_depth);
 ABSL_DECLARE_FLAG(int32, list_max_listpack_size);
 ABSL_DECLARE_FLAG(int, compression_mode);
+ABSL_DECLARE_FLAG(bool, df_snapshot_format);
+ABSL_DECLARE_FLAG(bool, df_snapshot_deltas);
+ABSL_DECLARE_FLAG(uint32_t, value_compression_min_len);
+ABSL_DECLARE_FLAG(int, value_compression_codec);
+ABSL_DECLARE_FLAG(uint32_t, value_dict_train_bytes);
+ABSL_DECLARE_FLAG(uint64_t, snapshot_write_bytes_per_sec);
+ABSL_DECLARE_FLAG(uint32_t, snapshot_io_latency_usec);
+ABSL_DECLARE_FLAG(string, snapshot_upload_cmd);
+ABSL_DECLARE_FLAG(uint64_t, snapshot_buffer_limit);
+ABSL_DECLARE_FLAG(bool, json_packed);
+ABSL_DECLARE_FLAG(bool, rdb_checksum);
+ABSL_DECLARE_FLAG(bool, rdb_native_encodings);
 
 namespace dfly {
 
@@ -119,6 +140,23 @@ TEST_F(RdbTest, LoadSmall6) {
   EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), IntArg(1)));
 }
 
+TEST_F(RdbTest, DflyLoad) {
+  ifstream ifs(base::ProgramRunfile("testdata/redis6_small.rdb"), ios::binary);
+  string payload{istreambuf_iterator<char>(ifs), istreambuf_iterator<char>()};
+  ASSERT_FALSE(payload.empty());
+
+  auto resp = Run({"dfly", "load", payload});
+  ASSERT_THAT(resp, ArrLen(6));
+  EXPECT_EQ(resp.GetVec()[0], "keys");
+  EXPECT_THAT(resp.GetVec()[3], IntArg(payload.size()));
+
+  EXPECT_THAT(Run({"get", "strkey"}), "abcdefghjjjjjjjjjj");
+  Run({"select", "1"});
+  EXPECT_EQ(10, CheckedInt({"dbsize"}));
+
+  EXPECT_THAT(Run({"dfly", "load", "REDIS"}), ErrArg("Could not load the payload"));
+}
+
 TEST_F(RdbTest, Stream) {
   io::FileSource fs = GetSource("redis6_stream.rdb");
   RdbLoader loader(service_->script_mgr());
@@ -160,6 +198,224 @@ TEST_F(RdbTest, ComressionModeSaveDragonflyAndReload) {
   }
 }
 
+TEST_F(RdbTest, SingleEntryLz4) {
+  absl::FlagSaver fs;
+  SetFlag(&FLAGS_compression_mode, 1);
+
+  string large = StrCat(string(1000, 'a'), string(1000, 'b'));
+  Run({"set", "str", large});
+  Run({"set", "short", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"});
+  Run({"rpush", "list", large, "tail"});
+  Run({"hset", "hash", "field", large});
+
+  // The DF snapshot compresses the strings with LZ4, the rdb snapshot with LZF.
+  for (string_view format : {"df", "rdb"}) {
+    ASSERT_EQ(Run({"save", format}), "OK");
+    auto save_info = service_->server_family().GetLastSaveInfo();
+    ASSERT_EQ(Run({"debug", "load", save_info->file_name}), "OK");
+
+    EXPECT_EQ(Run({"get", "str"}), large);
+    EXPECT_EQ(Run({"get", "short"}), "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa");
+    EXPECT_EQ(Run({"lindex", "list", "0"}), large);
+    EXPECT_EQ(Run({"hget", "hash", "field"}), large);
+  }
+}
+
+TEST_F(RdbTest, Checksum) {
+  Run({"debug", "populate", "10000"});
+
+  auto read_file = [&] {
+    auto save_info = service_->server_family().GetLastSaveInfo();
+    ifstream ifs(save_info->file_name, ios::binary);
+    return string{istreambuf_iterator<char>(ifs), istreambuf_iterator<char>()};
+  };
+
+  ASSERT_EQ(Run({"save", "rdb"}), "OK");
+  string contents = read_file();
+  ASSERT_GT(contents.size(), 8u);
+  EXPECT_EQ(0u, absl::little_endian::Load64(contents.data() + contents.size() - 8));
+
+  absl::FlagSaver fs;
+  SetFlag(&FLAGS_rdb_checksum, true);
+  ASSERT_EQ(Run({"save", "rdb"}), "OK");
+  contents = read_file();
+  ASSERT_GT(contents.size(), 8u);
+  uint64_t chksum = crc64(0, to_byte(contents.data()), contents.size() - 8);
+  EXPECT_NE(0u, chksum);
+  EXPECT_EQ(chksum, absl::little_endian::Load64(contents.data() + contents.size() - 8));
+
+  ASSERT_EQ(Run({"debug", "reload", "nosave"}), "OK");
+  EXPECT_EQ(10000, CheckedInt({"dbsize"}));
+}
+
+TEST_F(RdbTest, NativeEncodings) {
+  absl::FlagSaver fs;
+  SetFlag(&FLAGS_df_snapshot_format, true);
+
+  // Large enough for several packed chunks.
+  vector<string> set_args{"sadd", "set"}, hash_args{"hset", "hash"};
+  for (unsigned i = 0; i < 1000; ++i) {
+    set_args.push_back(StrCat("member:", i, string(50, 'm')));
+    hash_args.push_back(StrCat("field:", i));
+    hash_args.push_back(StrCat("value:", i, string(50, 'v')));
+  }
+  Run(ArgSlice{set_args.data(), set_args.size()});
+  Run(ArgSlice{hash_args.data(), hash_args.size()});
+  Run({"sadd", "intset", "1", "2", "3"});
+  Run({"hset", "small_hash", "field1", "val1", "field2", "2"});
+  Run({"zadd", "zset", "1.5", "a", "-1", "b"});
+  Run({"rpush", "list", "a", "b", "123"});
+
+  for (bool native : {true, false}) {
+    SetFlag(&FLAGS_rdb_native_encodings, native);
+    ASSERT_EQ(Run({"debug", "reload"}), "OK");
+
+    EXPECT_EQ(1000, CheckedInt({"scard", "set"}));
+    EXPECT_EQ(1, CheckedInt({"sismember", "set", StrCat("member:999", string(50, 'm'))}));
+    EXPECT_EQ(1000, CheckedInt({"hlen", "hash"}));
+    EXPECT_EQ(Run({"hget", "hash", "field:7"}), StrCat("value:7", string(50, 'v')));
+    EXPECT_EQ(3, CheckedInt({"scard", "intset"}));
+    EXPECT_EQ(Run({"hget", "small_hash", "field2"}), "2");
+    EXPECT_EQ(Run({"zscore", "zset", "a"}), "1.5");
+    EXPECT_THAT(Run({"lrange", "list", "0", "-1"}).GetVec(), ElementsAre("a", "b", "123"));
+  }
+}
+
+TEST_F(RdbTest, DflyFormatByDefault) {
+  absl::FlagSaver fs;
+  SetFlag(&FLAGS_df_snapshot_format, true);
+  Run({"debug", "populate", "10000"});
+
+  ASSERT_EQ(Run({"save"}), "OK");
+  auto save_info = service_->server_family().GetLastSaveInfo();
+  EXPECT_TRUE(absl::EndsWith(save_info->file_name, "summary.dfs")) << save_info->file_name;
+
+  // The shard files are loaded in parallel.
+  ASSERT_EQ(Run({"debug", "reload", "nosave"}), "OK");
+  EXPECT_EQ(10000, CheckedInt({"dbsize"}));
+
+  ASSERT_EQ(Run({"save", "rdb"}), "OK");
+  save_info = service_->server_family().GetLastSaveInfo();
+  EXPECT_TRUE(absl::EndsWith(save_info->file_name, ".rdb")) << save_info->file_name;
+}
+
+TEST_F(RdbTest, IoRateLimiter) {
+  constexpr uint64_t kMs = 1'000'000;
+  IoRateLimiter limiter(1000);  // a byte per ms.
+
+  // A burst of 100ms passes without waiting.
+  EXPECT_EQ(0u, limiter.Acquire(100, 0));
+  EXPECT_EQ(100 * kMs, limiter.Acquire(100, 0));
+  EXPECT_EQ(0u, limiter.Acquire(0, 300 * kMs));
+
+  limiter.Adjust(true);
+  EXPECT_EQ(500u, limiter.rate());
+  EXPECT_EQ(100 * kMs, limiter.Acquire(100, 300 * kMs));
+
+  for (unsigned i = 0; i < 10; ++i) {
+    limiter.Adjust(true);
+  }
+  EXPECT_EQ(62u, limiter.rate());
+  for (unsigned i = 0; i < 10; ++i) {
+    limiter.Adjust(false);
+  }
+  EXPECT_EQ(1000u, limiter.rate());
+}
+
+TEST_F(RdbTest, RateLimitedSave) {
+  absl::FlagSaver fs;
+  SetFlag(&FLAGS_df_snapshot_format, true);
+  SetFlag(&FLAGS_snapshot_write_bytes_per_sec, 2 << 20);
+  SetFlag(&FLAGS_snapshot_io_latency_usec, 1000);
+  Run({"debug", "populate", "10000"});
+
+  ASSERT_EQ(Run({"save"}), "OK");
+  ASSERT_EQ(Run({"debug", "reload", "nosave"}), "OK");
+  EXPECT_EQ(10000, CheckedInt({"dbsize"}));
+}
+
+TEST_F(RdbTest, SnapshotBufferLimit) {
+  absl::FlagSaver fs;
+  SetFlag(&FLAGS_snapshot_buffer_limit, 4096);
+  Run({"debug", "populate", "10000"});
+
+  // The traversal waits for the writes of the records, and every record is released.
+  ASSERT_EQ(Run({"save", "rdb"}), "OK");
+  EXPECT_EQ(0u, SliceSnapshot::BufferedBytes());
+  ASSERT_EQ(Run({"debug", "reload", "nosave"}), "OK");
+  EXPECT_EQ(10000, CheckedInt({"dbsize"}));
+}
+
+TEST_F(RdbTest, UploadCmd) {
+  absl::FlagSaver fs;
+  SetFlag(&FLAGS_df_snapshot_format, true);
+  Run({"debug", "populate", "10000"});
+
+  // Uploads into the working directory, where the files are loaded from.
+  SetFlag(&FLAGS_snapshot_upload_cmd, "cat > \"$DF_SNAPSHOT_FILE\"");
+  ASSERT_EQ(Run({"save"}), "OK");
+  ASSERT_EQ(Run({"debug", "reload", "nosave"}), "OK");
+  EXPECT_EQ(10000, CheckedInt({"dbsize"}));
+
+  SetFlag(&FLAGS_snapshot_upload_cmd, "cat > /dev/null; exit 1");
+  EXPECT_THAT(Run({"save"}), ErrArg("Broken pipe"));
+}
+
+TEST_F(RdbTest, SaveDelta) {
+  absl::FlagSaver fs;
+  SetFlag(&FLAGS_df_snapshot_format, true);
+  Run({"debug", "populate", "1000"});
+  pp_->at(1)->Await([&] {
+    Run({"select", "1"});
+    Run({"set", "other", "1"});
+  });
+
+  // A delta needs a base that tracks the changes.
+  EXPECT_THAT(Run({"save", "delta"}), ErrArg("no base snapshot"));
+  SetFlag(&FLAGS_df_snapshot_deltas, true);
+  ASSERT_EQ(Run({"save"}), "OK");
+
+  Run({"set", "key:1", "changed"});
+  Run({"del", "key:2"});
+  Run({"expire", "key:3", "1000"});
+  Run({"set", "new", "1"});
+  ASSERT_EQ(Run({"bgsave", "delta"}), "OK");
+  auto save_info = service_->server_family().GetLastSaveInfo();
+  EXPECT_TRUE(absl::EndsWith(save_info->file_name, "-delta-0001-summary.dfs"))
+      << save_info->file_name;
+
+  // The key deleted before the previous delta is added again.
+  Run({"set", "key:2", "again"});
+  Run({"del", "key:4"});
+  pp_->at(1)->Await([&] { Run({"flushdb"}); });
+  ASSERT_EQ(Run({"save", "delta"}), "OK");
+
+  // Loads the base and applies both deltas.
+  ASSERT_EQ(Run({"debug", "reload", "nosave"}), "OK");
+  EXPECT_EQ(1000, CheckedInt({"dbsize"}));
+  EXPECT_EQ(Run({"get", "key:1"}), "changed");
+  EXPECT_EQ(Run({"get", "key:2"}), "again");
+  EXPECT_EQ(Run({"get", "key:5"}), "value:5");
+  EXPECT_THAT(Run({"get", "key:4"}), ArgType(RespExpr::NIL));
+  EXPECT_EQ(Run({"get", "new"}), "1");
+  EXPECT_GT(CheckedInt({"ttl", "key:3"}), 0);
+  pp_->at(1)->Await([&] { EXPECT_EQ(0, CheckedInt({"dbsize"})); });
+}
+
+TEST_F(RdbTest, LoadProgress) {
+  Run({"debug", "populate", "5000"});
+  ASSERT_EQ(Run({"save", "df"}), "OK");
+
+  // The shard files presize the tables of their shards.
+  ASSERT_EQ(Run({"debug", "reload", "nosave"}), "OK");
+  EXPECT_EQ(5000, CheckedInt({"dbsize"}));
+
+  string info = Run({"info", "persistence"}).GetString();
+  EXPECT_THAT(info, HasSubstr("loading:0"));
+  EXPECT_THAT(info, HasSubstr("rdb_last_load_keys_loaded:5000"));
+  EXPECT_THAT(info, HasSubstr("rdb_last_load_bytes_per_sec:"));
+}
+
 TEST_F(RdbTest, RdbLoaderOnReadCompressedDataShouldNotEnterEnsureReadFlow) {
   SetFlag(&FLAGS_compression_mode, 2);
   for (int i = 0; i < 1000; ++i) {
@@ -173,6 +429,105 @@ TEST_F(RdbTest, RdbLoaderOnReadCompressedDataShouldNotEnterEnsureReadFlow) {
   ASSERT_EQ(resp, "OK");
 }
 
+TEST_F(RdbTest, SaveCompressedValues) {
+  absl::FlagSaver fs;
+  SetFlag(&FLAGS_value_compression_min_len, 256);
+
+  string val;
+  for (unsigned i = 0; i < 100; ++i) {
+    absl::StrAppend(&val, "{\"user\":", i, ",\"cart\":[1,2,3]}");
+  }
+
+  for (int codec = 1; codec <= 2; ++codec) {
+    SetFlag(&FLAGS_value_compression_codec, codec);
+    for (int mode = 0; mode <= 3; ++mode) {
+      SetFlag(&FLAGS_compression_mode, mode);
+      Run({"set", "key", val});
+      Run({"set", "small", "val"});
+
+      ASSERT_EQ(Run({"save", "df"}), "OK");
+      auto save_info = service_->server_family().GetLastSaveInfo();
+      ASSERT_EQ(Run({"debug", "load", save_info->file_name}), "OK");
+
+      EXPECT_EQ(Run({"get", "key"}), val);
+      EXPECT_EQ(Run({"get", "small"}), "val");
+      EXPECT_EQ(val.size(), CheckedInt({"strlen", "key"}));
+      EXPECT_EQ(Run({"getrange", "key", "0", "8"}), "{\"user\":0");
+    }
+  }
+}
+
+TEST_F(RdbTest, SaveDictCompressedValues) {
+  absl::FlagSaver fs;
+  SetFlag(&FLAGS_value_compression_min_len, 128);
+  SetFlag(&FLAGS_value_compression_codec, 3);
+  SetFlag(&FLAGS_value_dict_train_bytes, 64 << 10);
+  shard_set->TEST_EnableHeartBeat();
+
+  auto make_val = [](unsigned i) {
+    return StrCat("{\"session\":", i, ",\"user\":\"user", i * 13, "\",\"agent\":\"Mozilla/5.0\",",
+                  "\"cart\":[", i % 7, ",", i % 11, "],\"currency\":\"USD\",\"items\":", i % 5,
+                  ",\"checkout\":", i % 3 ? "false" : "true", "}");
+  };
+
+  constexpr unsigned kNumKeys = 4000;
+  for (unsigned i = 0; i < kNumKeys; ++i) {
+    Run({"set", StrCat("key", i), make_val(i)});
+  }
+
+  // Wait for the shards to train their dictionaries.
+  shard_set->pool()->AwaitFiberOnAll([&](unsigned index, ProactorBase* base) {
+    EngineShard* shard = EngineShard::tlocal();
+    if (!shard)
+      return;
+    for (unsigned i = 0; i < 100 && shard->stats().zstd_dicts_trained == 0; ++i) {
+      fibers_ext::SleepFor(20ms);
+    }
+    EXPECT_EQ(1u, shard->stats().zstd_dicts_trained);
+  });
+
+  // These values are compressed with the dictionaries.
+  for (unsigned i = kNumKeys; i < 2 * kNumKeys; ++i) {
+    Run({"set", StrCat("key", i), make_val(i)});
+  }
+
+  for (int mode = 0; mode <= 3; ++mode) {
+    SetFlag(&FLAGS_compression_mode, mode);
+    ASSERT_EQ(Run({"save", "df"}), "OK");
+    auto save_info = service_->server_family().GetLastSaveInfo();
+    ASSERT_EQ(Run({"debug", "load", save_info->file_name}), "OK");
+
+    for (unsigned i = 0; i < 2 * kNumKeys; i += 97) {
+      ASSERT_EQ(Run({"get", StrCat("key", i)}), make_val(i)) << i;
+    }
+  }
+}
+
+TEST_F(RdbTest, LoadBadCompressedLength) {
+  // A compressed string of key "key" that decompresses into 10 bytes, with the length of its
+  // blob in the 32 bit encoding. The blob itself is missing.
+  auto make_rdb = [](uint8_t codec, uint32_t clen) {
+    string rdb = StrCat("REDIS0009", string(1, RDB_TYPE_COMPRESSED_STRING), "\x03key");
+    rdb.push_back(codec);
+    rdb.push_back(10);
+    char len[4];
+    absl::big_endian::Store32(len, clen);
+    StrAppend(&rdb, "\x80", string_view{len, sizeof(len)});
+    return rdb;
+  };
+
+  // The lengths are rejected before the loader allocates the blob and reads it.
+  for (auto [codec, clen] : vector<pair<uint8_t, uint32_t>>{
+           {1, 0}, {1, 1u << 20}, {2, 1u << 29}, {3, 1u << 20}, {9, 5}}) {
+    string rdb = make_rdb(codec, clen);
+    io::BytesSource src(io::Buffer(rdb));
+    RdbLoader loader(service_->script_mgr());
+    error_code ec = pp_->at(0)->Await([&] { return loader.Load(&src); });
+    EXPECT_EQ(rdb::rdb_file_corrupted, ec.value()) << unsigned(codec) << " " << clen;
+  }
+  EXPECT_EQ(0, CheckedInt({"dbsize"}));
+}
+
 TEST_F(RdbTest, Reload) {
   absl::FlagSaver fs;
 
@@ -206,6 +561,67 @@ TEST_F(RdbTest, Reload) {
   EXPECT_EQ(2, CheckedInt({"ZCARD", "zs2"}));
 }
 
+TEST_F(RdbTest, SBF) {
+  EXPECT_EQ("OK", Run({"bf.reserve", "k", "0.01", "100", "expansion", "3"}));
+  for (unsigned i = 0; i < 1000; ++i) {
+    Run({"bf.add", "k", absl::StrCat(i)});
+  }
+
+  ASSERT_EQ(Run({"debug", "reload"}), "OK");
+  EXPECT_EQ("MBbloom--", Run({"type", "k"}));
+  for (unsigned i = 0; i < 1000; ++i) {
+    ASSERT_EQ(1, CheckedInt({"bf.exists", "k", absl::StrCat(i)})) << i;
+  }
+
+  // The filter keeps growing as it did before the reload.
+  EXPECT_EQ(1, CheckedInt({"bf.add", "k", "foo"}));
+  EXPECT_EQ(1, CheckedInt({"bf.exists", "k", "foo"}));
+
+  string dump{ToSV(Run({"dump", "k"}).GetBuf())};
+  EXPECT_EQ("OK", Run({"restore", "copy", "0", dump}));
+  EXPECT_EQ(1, CheckedInt({"bf.exists", "copy", "foo"}));
+}
+
+TEST_F(RdbTest, TimeSeries) {
+  EXPECT_EQ("OK", Run({"ts.create", "ts", "retention", "100000", "labels", "host", "a"}));
+  for (unsigned i = 1; i <= 1000; ++i) {
+    Run({"ts.add", "ts", absl::StrCat(i * 10), absl::StrCat(i * 0.5)});
+  }
+
+  ASSERT_EQ(Run({"debug", "reload"}), "OK");
+  EXPECT_EQ("TSDB-TYPE", Run({"type", "ts"}));
+  EXPECT_THAT(Run({"ts.get", "ts"}).GetVec(), ElementsAre(IntArg(10000), "500"));
+  EXPECT_THAT(Run({"ts.range", "ts", "-", "+"}), ArrLen(1000));
+  EXPECT_THAT(Run({"ts.mrange", "-", "15", "filter", "host=a"}), ArrLen(3));
+
+  string dump{ToSV(Run({"dump", "ts"}).GetBuf())};
+  EXPECT_EQ("OK", Run({"restore", "copy", "0", dump}));
+  EXPECT_EQ(10010, CheckedInt({"ts.add", "copy", "10010", "1"}));
+}
+
+TEST_F(RdbTest, Json) {
+  absl::FlagSaver fs;
+  string json = R"({"a":{"b":[1,-2,3.5,null]},"s":"x\ny","big":123456789012345678901})";
+  EXPECT_EQ("OK", Run({"json.set", "tree", "$", json}));
+  SetFlag(&FLAGS_json_packed, true);
+  EXPECT_EQ("OK", Run({"json.set", "packed", "$", json}));
+
+  // The documents are reloaded in the representation of the flag.
+  string expected = R"({"a":{"b":[1,-2,3.5,null]},"big":123456789012345678901,"s":"x\ny"})";
+  for (bool packed : {true, false}) {
+    SetFlag(&FLAGS_json_packed, packed);
+    ASSERT_EQ(Run({"debug", "reload"}), "OK");
+    EXPECT_EQ("ReJSON-RL", Run({"type", "tree"}));
+    EXPECT_EQ(expected, Run({"json.get", "tree"}));
+    EXPECT_EQ(expected, Run({"json.get", "packed"}));
+  }
+
+  EXPECT_EQ("[2]", Run({"json.numincrby", "packed", "$.a.b[0]", "1"}));
+  string dump{ToSV(Run({"dump", "packed"}).GetBuf())};
+  EXPECT_EQ("OK", Run({"restore", "copy", "0", dump}));
+  EXPECT_EQ("[[2,-2,3.5,null]]", Run({"json.get", "copy", "$.a.b"}));
+}
+
 TEST_F(RdbTest, ReloadTtl) {
   Run({"set", "key", "val"});
   Run({"expire", "key", "1000"});
@@ -7,6 +7,7 @@ extern "C" {
 #include "redis/rdb.h"
 }
 
+#include <absl/cleanup/cleanup.h>
 #include <absl/functional/bind_front.h>
 #include <absl/strings/escaping.h>
 #include <absl/strings/str_cat.h>
@@ -14,14 +15,21 @@ extern "C" {
 
 #include <boost/asio/ip/tcp.hpp>
 
+#include "base/flags.h"
 #include "base/logging.h"
 #include "facade/dragonfly_connection.h"
 #include "facade/redis_parser.h"
 #include "server/error.h"
+#include "server/journal/frame.h"
 #include "server/main_service.h"
 #include "server/rdb_load.h"
 #include "util/proactor_base.h"
 
+ABSL_FLAG(uint32_t, repl_ack_interval_ms, 1000,
+          "The interval at which every flow of the stable sync acknowledges the LSN it applied "
+          "to the master. With 0 the flows acknowledge only when the master asks for it, "
+          "see WAIT");
+
 namespace dfly {
 
 using namespace std;
@@ -32,6 +40,32 @@ using absl::StrCat;
 
 namespace {
 
+error_code Recv(FiberSocketBase* input, base::IoBuf* dest) {
+  auto buf = dest->AppendBuffer();
+  io::Result<size_t> exp_size = input->Recv(buf);
+  if (!exp_size)
+    return exp_size.error();
+
+  dest->CommitWrite(*exp_size);
+
+  return error_code{};
+}
+
+constexpr unsigned kRdbEofMarkSize = 40;
+
+// Distribute flow indices over all available threads (shard_set pool size). The flow of
+// the master shard i runs in the thread of shard i, so if the replica has as many shards as
+// the master, the commands of the flow belong to the shard of its thread and run without a hop.
+vector<vector<unsigned>> Partition(unsigned num_flows) {
+  vector<vector<unsigned>> partition(shard_set->pool()->size());
+  for (unsigned i = 0; i < num_flows; ++i) {
+    partition[i % partition.size()].push_back(i);
+  }
+  return partition;
+}
+
+}  // namespace
+
 // TODO: 2. Use time-out on socket-reads so that we would not deadlock on unresponsive master.
 //       3. Support ipv6 at some point.
 int ResolveDns(std::string_view host, char* dest) {
@@ -66,30 +100,6 @@ int ResolveDns(std::string_view host, char* dest) {
   return res;
 }
 
-error_code Recv(FiberSocketBase* input, base::IoBuf* dest) {
-  auto buf = dest->AppendBuffer();
-  io::Result<size_t> exp_size = input->Recv(buf);
-  if (!exp_size)
-    return exp_size.error();
-
-  dest->CommitWrite(*exp_size);
-
-  return error_code{};
-}
-
-constexpr unsigned kRdbEofMarkSize = 40;
-
-// Distribute flow indices over all available threads (shard_set pool size).
-vector<vector<unsigned>> Partition(unsigned num_flows) {
-  vector<vector<unsigned>> partition(shard_set->pool()->size());
-  for (unsigned i = 0; i < num_flows; ++i) {
-    partition[i % partition.size()].push_back(i);
-  }
-  return partition;
-}
-
-}  // namespace
-
 Replica::Replica(string host, uint16_t port, Service* se) : service_(*se) {
   master_context_.host = std::move(host);
   master_context_.port = port;
@@ -115,9 +125,6 @@ static const char kConnErr[] = "could not connect to master: ";
 bool Replica::Start(ConnectionContext* cntx) {
   CHECK(!sock_);
 
-  ProactorBase* mythread = ProactorBase::me();
-  CHECK(mythread);
-
   // 1. Connect socket.
   error_code ec = ConnectSocket();
   if (ec) {
@@ -125,23 +132,35 @@ bool Replica::Start(ConnectionContext* cntx) {
     return false;
   }
 
-  // 2. Greet.
-  state_mask_ = R_ENABLED | R_TCP_CONNECTED;
-  last_io_time_ = mythread->GetMonotonicTimeNs();
-  ec = Greet();
+  ec = Start();
   if (ec) {
     (*cntx)->SendError(StrCat("could not greet master ", ec.message()));
     return false;
   }
 
+  (*cntx)->SendOk();
+  return true;
+}
+
+error_code Replica::Start() {
+  ProactorBase* mythread = ProactorBase::me();
+  CHECK(mythread);
+
+  if (!sock_) {
+    RETURN_ON_ERR(ConnectSocket());
+  }
+
+  // 2. Greet.
+  state_mask_ = R_ENABLED | R_TCP_CONNECTED;
+  last_io_time_ = mythread->GetMonotonicTimeNs();
+  RETURN_ON_ERR(Greet());
+
   // 3. Init basic context.
   cntx_.Reset(absl::bind_front(&Replica::DefaultErrorHandler, this));
 
   // 4. Spawn main coordination fiber.
   sync_fb_ = ::boost::fibers::fiber(&Replica::MainReplicationFb, this);
-
-  (*cntx)->SendOk();
-  return true;
+  return error_code{};
 }
 
 void Replica::Stop() {
@@ -221,13 +240,29 @@ void Replica::MainReplicationFb() {
     // 4. Start stable state sync.
     DCHECK(state_mask_ & R_SYNC_OK);
 
+    bool streamed = false;
     if (HasDflyMaster())
-      ec = ConsumeDflyStream();
+      ec = ConsumeDflyStream(&streamed);
     else
       ec = ConsumeRedisStream();
 
     JoinAllFlows();
-    state_mask_ &= ~R_SYNC_OK;
+
+    // The next sync resumes the flows from the LSNs that they reached, also after the stream
+    // broke, as the flows count only the commands that they applied.
+    if (streamed) {
+      flow_lsns_.clear();
+      for (const auto& flow : shard_flows_) {
+        flow_lsns_.push_back(flow->journal_lsn_);
+      }
+      lsn_master_id_ = master_context_.master_repl_id;
+    }
+
+    // The error handler closed the sockets of a stream that broke, the next sync reconnects.
+    if (ec)
+      state_mask_ &= R_ENABLED;
+    else
+      state_mask_ &= ~R_SYNC_OK;
   }
 
   VLOG(1) << "Main replication fiber finished";
@@ -339,6 +374,17 @@ error_code Replica::Greet() {
   }
 
   io_buf.ConsumeInput(consumed);
+
+  if (local_ && num_df_flows_ > 0) {
+    RETURN_ON_ERR(SendCommand("REPLCONF local 1", &serializer));
+    RETURN_ON_ERR(ReadRespReply(&io_buf, &consumed));
+    if (!CheckRespIsSimpleReply("OK")) {
+      LOG(ERROR) << "Bad REPLCONF local response " << ToSV(io_buf.InputBuffer());
+      return make_error_code(errc::bad_message);
+    }
+    io_buf.ConsumeInput(consumed);
+  }
+
   state_mask_ |= R_GREETED;
 
   return error_code{};
@@ -426,9 +472,24 @@ error_code Replica::InitiatePSync() {
 error_code Replica::InitiateDflySync() {
   DCHECK_GT(num_df_flows_, 0u);
 
+  // The flows resume from the LSNs that they reached if they streamed from this master before.
+  // A failed attempt is not repeated, the next sync is full.
+  vector<LSN> lsns = move(flow_lsns_);
+  flow_lsns_.clear();
+  bool resume = lsns.size() == num_df_flows_ && lsn_master_id_ == master_context_.master_repl_id;
+
+  barriers_ = make_shared<Barriers>();
+  atomic_store(&applied_lsns_, make_shared<AppliedLsns>(master_context_.master_repl_id,
+                                                        num_df_flows_));
   shard_flows_.resize(num_df_flows_);
   for (unsigned i = 0; i < num_df_flows_; ++i) {
     shard_flows_[i].reset(new Replica(master_context_, i, &service_));
+    shard_flows_[i]->barriers_ = barriers_;
+    shard_flows_[i]->applied_lsns_ = applied_lsns_;
+    if (resume) {
+      shard_flows_[i]->journal_lsn_ = lsns[i];
+      shard_flows_[i]->partial_sync_ = true;
+    }
   }
 
   // Blocked on untill all flows got full sync cut.
@@ -451,6 +512,19 @@ error_code Replica::InitiateDflySync() {
   });
   RETURN_ON_ERR(cntx_.GetError());
 
+  size_t partial_cnt = count_if(shard_flows_.begin(), shard_flows_.end(),
+                                [](const auto& flow) { return flow->partial_sync_; });
+  if (partial_cnt == num_df_flows_) {
+    LOG(INFO) << "Resuming stable sync from the journal backlog";
+    return cntx_.GetError();
+  }
+
+  // The full sync of the flows that can not resume would mix with the flows that resume.
+  if (partial_cnt > 0) {
+    return cntx_.Error(make_error_code(errc::resource_unavailable_try_again),
+                       "Could not resume all the flows, repeating full sync");
+  }
+
   // Send DFLY SYNC.
   if (auto ec = SendNextPhaseRequest(); ec) {
     return cntx_.Error(ec);
@@ -510,11 +584,12 @@ error_code Replica::ConsumeRedisStream() {
   return ec;
 }
 
-error_code Replica::ConsumeDflyStream() {
+error_code Replica::ConsumeDflyStream(bool* streamed) {
   // Send DFLY STARTSTABLE.
   if (auto ec = SendNextPhaseRequest(); ec) {
     return cntx_.Error(ec);
   }
+  *streamed = true;
 
   // Wait for all flows to finish full sync.
   JoinAllFlows();
@@ -535,6 +610,9 @@ error_code Replica::ConsumeDflyStream() {
 }
 
 void Replica::CloseAllSockets() {
+  if (barriers_)
+    barriers_->Cancel();
+
   if (sock_) {
     sock_->proactor()->Await([this] {
       auto ec = sock_->Shutdown(SHUT_RDWR);
@@ -594,6 +672,8 @@ error_code Replica::StartFullSyncFlow(fibers_ext::BlockingCounter sb, Context* c
   ReqSerializer serializer{sock_.get()};
   auto cmd = StrCat("DFLY FLOW ", master_context_.master_repl_id, " ",
                     master_context_.dfly_session_id, " ", master_context_.dfly_flow_id);
+  if (partial_sync_)
+    absl::StrAppend(&cmd, " ", journal_lsn_);
   RETURN_ON_ERR(SendCommand(cmd, &serializer));
 
   parser_.reset(new RedisParser{false});  // client mode
@@ -609,15 +689,22 @@ error_code Replica::StartFullSyncFlow(fibers_ext::BlockingCounter sb, Context* c
 
   string_view flow_directive = ToSV(resp_args_[0].GetBuf());
   string eof_token;
+  partial_sync_ = flow_directive == "PARTIAL";
   if (flow_directive == "FULL") {
     eof_token = ToSV(resp_args_[1].GetBuf());
-  } else {
+  } else if (!partial_sync_) {
     LOG(ERROR) << "Bad FLOW response " << ToSV(leftover_buf_->InputBuffer());
   }
   leftover_buf_->ConsumeInput(consumed);
 
   state_mask_ = R_ENABLED | R_TCP_CONNECTED;
 
+  // The flow skips the full sync and streams from its LSN after STARTSTABLE.
+  if (partial_sync_) {
+    sb.Dec();
+    return error_code{};
+  }
+
   // We can not discard io_buf because it may contain data
   // besides the response we parsed. Therefore we pass it further to ReplicateDFFb.
   sync_fb_ = ::boost::fibers::fiber(&Replica::FullSyncDflyFb, this, move(eof_token), sb, cntx);
@@ -686,21 +773,72 @@ void Replica::FullSyncDflyFb(string eof_token, fibers_ext::BlockingCounter bc, C
 }
 
 void Replica::StableSyncDflyFb(Context* cntx) {
-  base::IoBuf io_buf(16_KB);
+  // The master batches the stream into frames. frame_buf holds the frames read from the socket
+  // and io_buf the commands they decode into.
+  base::IoBuf frame_buf(16_KB), io_buf(16_KB);
   parser_.reset(new RedisParser);
 
   // Check leftover from stable state.
   if (leftover_buf_ && leftover_buf_->InputLen() > 0) {
     size_t len = leftover_buf_->InputLen();
-    leftover_buf_->ReadAndConsume(len, io_buf.AppendBuffer().data());
-    io_buf.CommitWrite(len);
+    frame_buf.EnsureCapacity(len);
+    leftover_buf_->ReadAndConsume(len, frame_buf.AppendBuffer().data());
+    frame_buf.CommitWrite(len);
     leftover_buf_.reset();
   }
 
-  string ack_cmd;
+  applied_bytes_ = 0;
+  lag_ = {};
+
+  // The acknowledgements run until the stream stops.
+  ack_requested_ = acks_stopped_ = false;
+  ::boost::fibers::fiber acks_fb(&Replica::StableSyncAcksFb, this,
+                                 absl::GetFlag(FLAGS_repl_ack_interval_ms), cntx);
+  auto cleanup = absl::MakeCleanup([&] {
+    acks_stopped_ = true;
+    acks_ec_.notify();
+    acks_fb.join();
+  });
 
+  // The reads of CLIENT READAFTER on other threads wait for it.
+  atomic<LSN>& applied_lsn = applied_lsns_->lsns[master_context_.dfly_flow_id];
+  applied_lsn.store(journal_lsn_, memory_order_release);
+
+  string decoded;
+  uint64_t decoded_bytes = 0;
   while (!cntx->IsCancelled()) {
-    io::MutableBytes buf = io_buf.AppendBuffer();
+    journal::FrameCodec codec;
+    string_view payload;
+    size_t raw_len = 0, frame_len = 0;
+    while (journal::ParseFrame(ToSV(frame_buf.InputBuffer()), &codec, &payload, &raw_len,
+                               &frame_len)) {
+      decoded.clear();
+      if (!journal::DecodeFrame(codec, payload, raw_len, &decoded)) {
+        cntx->Error(make_error_code(errc::bad_message), "Corrupted journal frame");
+        return;
+      }
+      frame_buf.ConsumeInput(frame_len);
+      frame_len = 0;
+
+      io_buf.EnsureCapacity(decoded.size());
+      memcpy(io_buf.AppendBuffer().data(), decoded.data(), decoded.size());
+      io_buf.CommitWrite(decoded.size());
+      if (auto ec = ParseAndExecute(&io_buf); ec) {
+        cntx->Error(ec);
+        return;
+      }
+
+      // A command that the frame splits stays in io_buf until the next frame.
+      decoded_bytes += decoded.size();
+      applied_bytes_ = decoded_bytes - io_buf.InputLen();
+      applied_lsn.store(journal_lsn_, memory_order_release);
+    }
+
+    // Makes room for the rest of a frame that is larger than the buffer.
+    size_t missing = frame_len > frame_buf.InputLen() ? frame_len - frame_buf.InputLen() : 0;
+    frame_buf.EnsureCapacity(max<size_t>(missing, 4_KB));
+
+    io::MutableBytes buf = frame_buf.AppendBuffer();
     io::Result<size_t> size_res = sock_->Recv(buf);
     if (!size_res) {
       cntx->Error(size_res.error());
@@ -709,10 +847,27 @@ void Replica::StableSyncDflyFb(Context* cntx) {
 
     last_io_time_ = sock_->proactor()->GetMonotonicTimeNs();
 
-    io_buf.CommitWrite(*size_res);
+    frame_buf.CommitWrite(*size_res);
     repl_offs_ += *size_res;
+  }
+}
+
+void Replica::StableSyncAcksFb(uint32_t interval_ms, Context* cntx) {
+  ReqSerializer serializer{sock_.get()};
+  auto ready = [this] { return ack_requested_ || acks_stopped_; };
+  while (true) {
+    if (interval_ms > 0) {
+      acks_ec_.await_until(ready, chrono::steady_clock::now() + chrono::milliseconds(interval_ms));
+    } else {
+      acks_ec_.await(ready);
+    }
+    if (acks_stopped_)
+      return;
 
-    if (auto ec = ParseAndExecute(&io_buf); ec) {
+    // The GETACK requests that arrive until the acknowledgement is sent share it.
+    ack_requested_ = false;
+    string ack = StrCat("REPLCONF ACK ", journal_lsn_, " ", applied_bytes_);
+    if (auto ec = SendCommand(ack, &serializer); ec) {
       cntx->Error(ec);
       return;
     }
@@ -875,6 +1030,7 @@ error_code Replica::ParseAndExecute(base::IoBuf* io_buf) {
   io::NullSink null_sink;  // we never reply back on the commands.
   ConnectionContext conn_context{&null_sink, nullptr};
   conn_context.is_replicating = true;
+  conn_context.conn_state.db_index = db_index_;
 
   do {
     result = parser_->Parse(io_buf->InputBuffer(), &consumed, &resp_args_);
@@ -886,7 +1042,22 @@ error_code Replica::ParseAndExecute(base::IoBuf* io_buf) {
                   << "\n consumed: " << consumed;
           facade::RespToArgList(resp_args_, &cmd_str_args_);
           CmdArgList arg_list{cmd_str_args_.data(), cmd_str_args_.size()};
-          service_.DispatchCommand(arg_list, &conn_context);
+          // DFLY LOAD is the record of a bulk load, it is applied like the other commands.
+          bool flow_record = IsDflyFlow() && arg_list.size() >= 3 &&
+                             ArgS(arg_list, 0) == "DFLY" && ArgS(arg_list, 1) != "LOAD";
+          if (flow_record) {
+            RETURN_ON_ERR(HandleFlowRecord(arg_list));
+          } else {
+            service_.DispatchCommand(arg_list, &conn_context);
+            if (exec_barrier_) {
+              barriers_->Release(*exec_barrier_);
+              exec_barrier_.reset();
+            }
+
+            // SELECT is not journaled, the master sends it when the database changes.
+            if (IsDflyFlow() && ArgS(arg_list, 0) != "SELECT")
+              ++journal_lsn_;
+          }
         }
         io_buf->ConsumeInput(consumed);
         break;
@@ -899,11 +1070,158 @@ error_code Replica::ParseAndExecute(base::IoBuf* io_buf) {
         return std::make_error_code(std::errc::bad_message);
     }
   } while (io_buf->InputLen() > 0 && result == RedisParser::OK);
+  db_index_ = conn_context.conn_state.db_index;
   VLOG(1) << "ParseAndExecute: " << io_buf->InputLen() << " " << ToSV(io_buf->InputBuffer());
 
   return error_code{};
 }
 
+error_code Replica::HandleFlowRecord(CmdArgList args) {
+  string_view record = ArgS(args, 1);
+  if (record == "LSN" && args.size() == 3) {
+    if (!absl::SimpleAtoi(ArgS(args, 2), &journal_lsn_))
+      return make_error_code(errc::bad_message);
+    return error_code{};
+  }
+
+  // The master waits for the acknowledgement of the records before it, see DflyCmd::Wait.
+  // It is not a journal record either.
+  if (record == "GETACK" && args.size() == 3) {
+    ack_requested_ = true;
+    acks_ec_.notify();
+    return error_code{};
+  }
+
+  // The reply of the master to the acknowledgement of the flow, it is not a journal record.
+  if (record == "LAG" && args.size() == 5) {
+    if (!absl::SimpleAtoi(ArgS(args, 2), &lag_.entries) ||
+        !absl::SimpleAtoi(ArgS(args, 3), &lag_.bytes) ||
+        !absl::SimpleAtoi(ArgS(args, 4), &lag_.ms))
+      return make_error_code(errc::bad_message);
+    return error_code{};
+  }
+
+  Barriers::Key key;
+  uint32_t shard_cnt = 0;
+  if (record != "BARRIER" || args.size() < 5 || args.size() > 6 ||
+      !absl::SimpleAtoi(ArgS(args, 2), &key.first) ||
+      !absl::SimpleAtoi(ArgS(args, 3), &key.second) || !absl::SimpleAtoi(ArgS(args, 4), &shard_cnt))
+    return make_error_code(errc::bad_message);
+
+  // The flow with EXEC applies the next command, the other flows count the barrier as a record.
+  if (args.size() == 6) {
+    if (!barriers_->AwaitAll(key, shard_cnt))
+      return make_error_code(errc::operation_canceled);
+    exec_barrier_ = key;
+  } else {
+    if (!barriers_->Arrive(key, shard_cnt))
+      return make_error_code(errc::operation_canceled);
+    ++journal_lsn_;
+  }
+
+  return error_code{};
+}
+
+bool Replica::Barriers::AwaitAll(Key key, uint32_t shard_cnt) {
+  unique_lock lk(mu_);
+  State& state = states_[key];
+  ++state.arrived;
+  cv_.wait(lk, [&] { return cancelled_ || state.arrived == shard_cnt; });
+  return !cancelled_;
+}
+
+bool Replica::Barriers::Arrive(Key key, uint32_t shard_cnt) {
+  unique_lock lk(mu_);
+  State& state = states_[key];
+  ++state.arrived;
+  cv_.notify_all();
+  cv_.wait(lk, [&] { return cancelled_ || state.released; });
+  if (!state.released)
+    return false;
+
+  // The last flow to pass removes the barrier.
+  if (++state.passed == shard_cnt - 1)
+    states_.erase(key);
+  return true;
+}
+
+void Replica::Barriers::Release(Key key) {
+  lock_guard lk(mu_);
+  states_[key].released = true;
+  cv_.notify_all();
+}
+
+void Replica::Barriers::Cancel() {
+  lock_guard lk(mu_);
+  cancelled_ = true;
+  cv_.notify_all();
+}
+
+error_code Replica::PauseMaster(uint32_t timeout_ms) {
+  CHECK(sock_);
+
+  return sock_->proactor()->Await([this, timeout_ms]() -> error_code {
+    if ((state_mask_ & R_SYNC_OK) == 0 || !HasDflyMaster())
+      return make_error_code(errc::operation_not_permitted);
+
+    // The main socket is idle in the stable sync, the flows stream over their own sockets.
+    base::IoBuf io_buf{128};
+    ReqSerializer serializer{sock_.get()};
+    uint32_t consumed = 0;
+    RETURN_ON_ERR(SendCommand(
+        StrCat("DFLY TAKEOVER ", master_context_.dfly_session_id, " ", timeout_ms), &serializer));
+    RETURN_ON_ERR(ReadRespReply(&io_buf, &consumed));
+
+    vector<LSN> lsns(resp_args_.size());
+    bool valid = lsns.size() == shard_flows_.size();
+    for (size_t i = 0; valid && i < lsns.size(); ++i) {
+      valid = resp_args_[i].type == RespExpr::INT64;
+      lsns[i] = valid ? get<int64_t>(resp_args_[i].u) : 0;
+    }
+    if (!valid) {
+      LOG(ERROR) << "Bad DFLY TAKEOVER response " << ToSV(io_buf.InputBuffer());
+      return make_error_code(errc::bad_message);
+    }
+
+    uint64_t deadline = ProactorBase::GetMonotonicTimeNs() + uint64_t(timeout_ms) * 1000000;
+    for (size_t i = 0; i < lsns.size(); ++i) {
+      while (shard_flows_[i]->journal_lsn_ < lsns[i]) {
+        if (ProactorBase::GetMonotonicTimeNs() > deadline || cntx_.IsCancelled())
+          return make_error_code(errc::timed_out);
+        fibers_ext::SleepFor(1ms);
+      }
+    }
+    return error_code{};
+  });
+}
+
+error_code Replica::FinishTakeover(bool commit, uint16_t port, string_view master_id,
+                                   const vector<LSN>& lsns) {
+  CHECK(sock_);
+
+  string cmd = StrCat("DFLY TAKEOVER ", master_context_.dfly_session_id);
+  if (commit) {
+    absl::StrAppend(&cmd, " COMMIT ", port, " ", master_id);
+    for (LSN lsn : lsns)
+      absl::StrAppend(&cmd, " ", lsn);
+  } else {
+    absl::StrAppend(&cmd, " ABORT");
+  }
+
+  return sock_->proactor()->Await([&]() -> error_code {
+    base::IoBuf io_buf{128};
+    ReqSerializer serializer{sock_.get()};
+    uint32_t consumed = 0;
+    RETURN_ON_ERR(SendCommand(cmd, &serializer));
+    RETURN_ON_ERR(ReadRespReply(&io_buf, &consumed));
+    if (!CheckRespIsSimpleReply("OK")) {
+      LOG(ERROR) << "Bad DFLY TAKEOVER response " << ToSV(io_buf.InputBuffer());
+      return make_error_code(errc::bad_message);
+    }
+    return error_code{};
+  });
+}
+
 Replica::Info Replica::GetInfo() const {
   CHECK(sock_);
 
@@ -918,7 +1236,13 @@ Replica::Info Replica::GetInfo() const {
     res.port = master_context_.port;
     res.master_link_established = (state_mask_ & R_TCP_CONNECTED);
     res.sync_in_progress = (state_mask_ & R_SYNCING);
+    res.stable_sync = (state_mask_ & R_SYNC_OK);
     res.master_last_io_sec = (ProactorBase::GetMonotonicTimeNs() - last_io_time) / 1000000000UL;
+
+    for (const auto& flow : shard_flows_) {
+      res.flows.push_back({flow->journal_lsn_, flow->applied_bytes_, flow->lag_.entries,
+                           flow->lag_.bytes, flow->lag_.ms});
+    }
     return res;
   });
 }
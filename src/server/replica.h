@@ -3,7 +3,13 @@
 //
 #pragma once
 
+#include <absl/container/node_hash_map.h>
+
+#include <atomic>
+#include <boost/fiber/condition_variable.hpp>
 #include <boost/fiber/fiber.hpp>
+#include <boost/fiber/mutex.hpp>
+#include <optional>
 #include <variant>
 
 #include "base/io_buf.h"
@@ -22,6 +28,10 @@ namespace dfly {
 class Service;
 class ConnectionContext;
 
+// Resolves the IPv4 address of host into dest of INET6_ADDRSTRLEN bytes. Returns 0 or the error
+// of getaddrinfo.
+int ResolveDns(std::string_view host, char* dest);
+
 class Replica {
  private:
   // The attributes of the master we are connecting to.
@@ -55,8 +65,34 @@ class Replica {
   // false if it has failed.
   bool Start(ConnectionContext* cntx);
 
+  // Same, but returns the error instead of replying it.
+  std::error_code Start();
+
   void Stop();  // thread-safe
 
+  // The master is on the same host, e.g. the predecessor of a live handoff. Must be called
+  // before Start. The replica announces it with REPLCONF LOCAL, see DflyCmd::SetLocal.
+  void EnableLocalMode() {
+    local_ = true;
+  }
+
+  // The flows resume the stable sync from lsns if the master is master_id, e.g. the replica
+  // that took this instance over. Must be called before Start.
+  void SetResumePoint(std::string master_id, std::vector<LSN> lsns) {
+    lsn_master_id_ = std::move(master_id);
+    flow_lsns_ = std::move(lsns);
+  }
+
+  // The first step of REPLTAKEOVER, in the stable sync with a dragonfly master. Pauses the writes
+  // of the master for at most timeout_ms and waits until the flows applied all of them.
+  std::error_code PauseMaster(uint32_t timeout_ms);
+
+  // The last step of REPLTAKEOVER, once this instance is the master master_id on port. The
+  // master becomes its replica and resumes from lsns. Resumes the writes of the master if
+  // PauseMaster succeeded and commit is false.
+  std::error_code FinishTakeover(bool commit, uint16_t port, std::string_view master_id,
+                                 const std::vector<LSN>& lsns);
+
   void Pause(bool pause);
 
  private: /* Main standalone mode functions */
@@ -70,7 +106,8 @@ class Replica {
   std::error_code InitiateDflySync();  // Dragonfly full sync.
 
   std::error_code ConsumeRedisStream();  // Redis stable state.
-  std::error_code ConsumeDflyStream();   // Dragonfly stable state.
+  // Dragonfly stable state. Sets *streamed once the flows started to stream.
+  std::error_code ConsumeDflyStream(bool* streamed);
 
   void CloseAllSockets();  // Close all sockets.
   void JoinAllFlows();     // Join all flows if possible.
@@ -96,6 +133,10 @@ class Replica {
   // Single flow stable state sync fiber spawned by StartStableSyncFlow.
   void StableSyncDflyFb(Context* cntx);
 
+  // Acknowledges the LSN and the stream bytes that the flow applied every interval_ms and when
+  // the master asks for it with GETACK, until acks_stopped_ is set.
+  void StableSyncAcksFb(uint32_t interval_ms, Context* cntx);
+
  private: /* Utility */
   struct PSyncResponse {
     // string - end of sync token (diskless)
@@ -113,6 +154,10 @@ class Replica {
 
   std::error_code ParseAndExecute(base::IoBuf* io_buf);
 
+  // Handles the "DFLY LSN" and "DFLY BARRIER" records of a flow, see journal::RespWriter,
+  // and the "DFLY LAG" and "DFLY GETACK" messages of the master.
+  std::error_code HandleFlowRecord(CmdArgList args);
+
   // Check if reps_args contains a simple reply.
   bool CheckRespIsSimpleReply(std::string_view reply) const;
 
@@ -128,11 +173,65 @@ class Replica {
     uint16_t port;
     bool master_link_established;
     bool sync_in_progress;      // snapshot sync.
+    bool stable_sync;           // the full sync succeeded, the replica follows the master.
     time_t master_last_io_sec;  // monotonic clock.
+
+    // The lag of every flow is the one the master reported for its last acknowledgement.
+    struct Flow {
+      LSN applied_lsn;
+      uint64_t applied_bytes;
+      uint64_t lag_entries, lag_bytes, lag_ms;
+    };
+    std::vector<Flow> flows;
   };
 
   Info GetInfo() const;  // thread-safe, blocks fiber
 
+  // The LSNs that the flows applied in the stable sync with the master master_id, published for
+  // the reads of CLIENT READAFTER. Every sync replaces them, starting from 0.
+  struct AppliedLsns {
+    AppliedLsns(std::string master_id, size_t flows)
+        : master_id(std::move(master_id)), lsns(flows) {
+    }
+
+    std::string master_id;
+    std::vector<std::atomic<LSN>> lsns;  // by the flow, hence by the thread of the master.
+  };
+
+  // Thread-safe, nullptr before the first sync with a dragonfly master.
+  std::shared_ptr<const AppliedLsns> GetAppliedLsns() const {
+    return std::atomic_load(&applied_lsns_);
+  }
+
+ private:
+  // Synchronizes the flows at the barriers of the multi-shard commands. The flow that applies
+  // the command waits for the other flows to arrive, which wait until it releases them.
+  class Barriers {
+   public:
+    using Key = std::pair<TxId, uint32_t>;  // txid and seq of the barrier.
+
+    // Return false if cancelled.
+    bool AwaitAll(Key key, uint32_t shard_cnt);
+    bool Arrive(Key key, uint32_t shard_cnt);
+
+    void Release(Key key);
+    void Cancel();
+
+   private:
+    struct State {
+      uint32_t arrived = 0;
+      uint32_t passed = 0;  // the flows that the release unblocked.
+      bool released = false;
+    };
+
+    ::boost::fibers::mutex mu_;
+    ::boost::fibers::condition_variable_any cv_;
+    absl::node_hash_map<Key, State> states_;
+    bool cancelled_ = false;
+  };
+
+ public:
+
   bool HasDflyMaster() const {
     return !master_context_.dfly_session_id.empty();
   }
@@ -163,6 +262,37 @@ class Replica {
   facade::RespVec resp_args_;
   facade::CmdArgVec cmd_str_args_;
 
+  // The database that SELECT of the master stream switched to.
+  DbIndex db_index_ = 0;
+
+  // Flow mode: the LSN of the next command that the flow applies, see journal::RespWriter.
+  // The flow asks the master to resume from it if partial_sync_ is set by InitiateDflySync,
+  // which stays set if the master agreed.
+  LSN journal_lsn_ = 0;
+  bool partial_sync_ = false;
+
+  // Flow mode: the bytes of the stable sync stream that the flow applied, and its lag as the
+  // master reported it.
+  uint64_t applied_bytes_ = 0;
+  struct {
+    uint64_t entries = 0, bytes = 0, ms = 0;
+  } lag_;
+
+  // Flow mode: wakes StableSyncAcksFb, which runs in the thread of the flow.
+  util::fibers_ext::EventCount acks_ec_;
+  bool ack_requested_ = false, acks_stopped_ = false;
+
+  // Shared by the flows of the sync, and the barrier of the next command that the flow applies.
+  std::shared_ptr<Barriers> barriers_;
+  std::optional<Barriers::Key> exec_barrier_;
+
+  // Shared by the flows of the sync, which publish their journal_lsn_ in the stable sync.
+  std::shared_ptr<AppliedLsns> applied_lsns_;
+
+  // The LSNs that the flows reached in the last stable sync with the master lsn_master_id_.
+  std::vector<LSN> flow_lsns_;
+  std::string lsn_master_id_;
+
   Context cntx_;  // context for tasks in replica.
 
   // repl_offs - till what offset we've already read from the master.
@@ -173,6 +303,7 @@ class Replica {
   unsigned num_df_flows_ = 0;
 
   bool is_paused_ = false;
+  bool local_ = false;
 };
 
 }  // namespace dfly
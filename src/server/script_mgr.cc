@@ -6,15 +6,24 @@
 
 #include <absl/strings/str_cat.h>
 
+#include <boost/fiber/operations.hpp>
+
+#include "base/flags.h"
 #include "base/logging.h"
 #include "core/interpreter.h"
 #include "facade/error.h"
+#include "server/engine_shard_set.h"
 #include "server/server_state.h"
 
+ABSL_FLAG(uint32_t, lua_time_limit, 5000,
+          "After this many milliseconds a script is busy: the commands on its keys fail with "
+          "BUSY and SCRIPT KILL stops it if it did not write. 0 disables it");
+
 namespace dfly {
 
 using namespace std;
 using namespace facade;
+using namespace util;
 
 ScriptMgr::ScriptMgr() {
 }
@@ -30,6 +39,8 @@ void ScriptMgr::Run(CmdArgList args, ConnectionContext* cntx) {
         "   Return information about the existence of the scripts in the script cache.",
         "LOAD <script>",
         "   Load a script into the scripts cache without executing it.",
+        "KILL",
+        "   Kill the scripts that run for longer than lua_time_limit and did not write.",
         "HELP"
         "   Prints this help."};
     return (*cntx)->SendSimpleStrArr(kHelp, ABSL_ARRAYSIZE(kHelp));
@@ -60,10 +71,9 @@ void ScriptMgr::Run(CmdArgList args, ConnectionContext* cntx) {
       return (*cntx)->SendBulkString(sha);
     }
 
-    Interpreter& interpreter = ServerState::tlocal()->GetInterpreter();
-    // no need to lock the interpreter since we do not mess the stack.
+    BorrowedInterpreter interpreter{&ServerState::tlocal()->interpreter_mgr()};
     string error_or_id;
-    Interpreter::AddResult add_result = interpreter.AddFunction(body, &error_or_id);
+    Interpreter::AddResult add_result = interpreter->AddFunction(body, &error_or_id);
     if (add_result == Interpreter::ALREADY_EXISTS) {
       return (*cntx)->SendBulkString(error_or_id);
     }
@@ -76,6 +86,10 @@ void ScriptMgr::Run(CmdArgList args, ConnectionContext* cntx) {
     return (*cntx)->SendBulkString(error_or_id);
   }
 
+  if (subcmd == "KILL" && args.size() == 1) {
+    return Kill(cntx);
+  }
+
   string err = absl::StrCat("Unknown subcommand or wrong number of arguments for '", subcmd,
                             "'. Try SCRIPT HELP.");
   cntx->reply_builder()->SendError(err, kSyntaxErrType);
@@ -86,14 +100,40 @@ bool ScriptMgr::InsertFunction(std::string_view id, std::string_view body) {
   CHECK_EQ(key.size(), id.size());
   memcpy(key.data(), id.data(), key.size());
 
-  lock_guard lk(mu_);
-  auto [it, inserted] = db_.emplace(key, nullptr);
-  if (inserted) {
-    it->second.reset(new char[body.size() + 1]);
-    memcpy(it->second.get(), body.data(), body.size());
-    it->second[body.size()] = '\0';
+  string bytecode;
+  {
+    lock_guard lk(mu_);
+    auto [it, inserted] = db_.emplace(key, ScriptData{});
+    if (!inserted)
+      return false;
+
+    it->second.body.reset(new char[body.size() + 1]);
+    memcpy(it->second.body.get(), body.data(), body.size());
+    it->second.body[body.size()] = '\0';
+
+    ServerState::tlocal()->interpreter_mgr().ForEach([&](Interpreter* interpreter) {
+      if (it->second.bytecode.empty())
+        interpreter->DumpFunction(id, &it->second.bytecode);
+    });
+    CHECK(!it->second.bytecode.empty());
+    bytecode = it->second.bytecode;
   }
-  return inserted;
+
+  // Compiling lazily in every thread causes latency spikes when many scripts are loaded,
+  // for example after an RDB load. Interpreters that are created later compile lazily.
+  shard_set->pool()->AwaitBrief([&](unsigned, ProactorBase*) {
+    ServerState::tlocal()->interpreter_mgr().ForEach([&](Interpreter* interpreter) {
+      if (interpreter->Exists(id))
+        return;
+
+      string error;
+      if (!interpreter->AddBytecode(id, bytecode, &error)) {
+        LOG(DFATAL) << "Could not load the bytecode of " << id << ": " << error;
+      }
+    });
+  });
+
+  return true;
 }
 
 const char* ScriptMgr::Find(std::string_view sha) const {
@@ -108,7 +148,73 @@ const char* ScriptMgr::Find(std::string_view sha) const {
   if (it == db_.end())
     return nullptr;
 
-  return it->second.get();
+  return it->second.body.get();
+}
+
+bool ScriptMgr::CheckRun(ScriptRun* run) {
+  if (run->state.load(memory_order_relaxed) == ScriptRun::KILLED)
+    return false;
+
+  uint64_t limit_ms = absl::GetFlag(FLAGS_lua_time_limit);
+  if (!run->busy && limit_ms > 0 &&
+      ProactorBase::GetMonotonicTimeNs() - run->start_ns > limit_ms * 1000000) {
+    LOG(WARNING) << "A script runs for longer than " << limit_ms << "ms";
+    run->busy = true;
+
+    lock_guard lk(busy_mu_);
+    busy_runs_.push_back(run);
+    busy_cnt_.fetch_add(1, memory_order_relaxed);
+  }
+
+  boost::this_fiber::yield();
+  return run->state.load(memory_order_relaxed) != ScriptRun::KILLED;
+}
+
+void ScriptMgr::FinishRun(ScriptRun* run) {
+  if (!run->busy)
+    return;
+
+  lock_guard lk(busy_mu_);
+  auto it = find(busy_runs_.begin(), busy_runs_.end(), run);
+  DCHECK(it != busy_runs_.end());
+  busy_runs_.erase(it);
+  busy_cnt_.fetch_sub(1, memory_order_relaxed);
+}
+
+bool ScriptMgr::IsBusy(DbIndex db, absl::Span<const string_view> keys) const {
+  lock_guard lk(busy_mu_);
+  for (const ScriptRun* run : busy_runs_) {
+    if (run->db != db)
+      continue;
+    for (string_view key : keys) {
+      if (run->keys->contains(key))
+        return true;
+    }
+  }
+  return false;
+}
+
+void ScriptMgr::Kill(ConnectionContext* cntx) {
+  bool busy = false, killed = false;
+  {
+    lock_guard lk(busy_mu_);
+    busy = !busy_runs_.empty();
+    for (ScriptRun* run : busy_runs_) {
+      ScriptRun::State expected = ScriptRun::RUNNING;
+      if (run->state.compare_exchange_strong(expected, ScriptRun::KILLED) ||
+          expected == ScriptRun::KILLED) {
+        killed = true;
+      }
+    }
+  }
+
+  if (!busy)
+    return (*cntx)->SendError("-NOTBUSY No scripts in execution right now.");
+  if (!killed) {
+    return (*cntx)->SendError(
+        "-UNKILLABLE Sorry the script already executed write commands against the dataset.");
+  }
+  (*cntx)->SendOk();
 }
 
 vector<string> ScriptMgr::GetLuaScripts() const {
@@ -117,7 +223,7 @@ vector<string> ScriptMgr::GetLuaScripts() const {
   lock_guard lk(mu_);
   res.reserve(db_.size());
   for (const auto& k_v : db_) {
-    res.emplace_back(k_v.second.get());
+    res.emplace_back(k_v.second.body.get());
   }
 
   return res;
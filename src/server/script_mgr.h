@@ -5,8 +5,10 @@
 #pragma once
 
 #include <absl/container/flat_hash_map.h>
+#include <absl/types/span.h>
 
 #include <array>
+#include <atomic>
 #include <boost/fiber/mutex.hpp>
 
 #include "server/conn_context.h"
@@ -15,6 +17,24 @@ namespace dfly {
 
 class EngineShardSet;
 
+// A running script. The scripts that run for longer than lua_time_limit are registered as busy:
+// the commands on their keys fail with BUSY, and SCRIPT KILL stops them unless they wrote.
+struct ScriptRun {
+  enum State : uint8_t { RUNNING, WROTE, KILLED };
+
+  // Called before every write command of the script. Returns false if it was killed.
+  bool StartWrite() {
+    State expected = RUNNING;
+    return state.compare_exchange_strong(expected, WROTE) || expected == WROTE;
+  }
+
+  DbIndex db = 0;
+  uint64_t start_ns = 0;
+  const absl::flat_hash_set<std::string_view>* keys = nullptr;
+  std::atomic<State> state{RUNNING};
+  bool busy = false;
+};
+
 // This class has a state through the lifetime of a server because it manipulates scripts
 class ScriptMgr {
  public:
@@ -22,6 +42,9 @@ class ScriptMgr {
 
   void Run(CmdArgList args, ConnectionContext* cntx);
 
+  // Stores the function and installs its precompiled bytecode into the interpreters of all
+  // the threads before returning. The function must be already added to an interpreter of the
+  // calling thread. Returns false if the function already existed.
   bool InsertFunction(std::string_view sha, std::string_view body);
 
   // Returns body as null-terminated c-string. NULL if sha is not found.
@@ -29,10 +52,37 @@ class ScriptMgr {
 
   std::vector<std::string> GetLuaScripts() const;
 
+  // The interrupt function of the running script. Registers it as busy once it exceeds
+  // lua_time_limit, and yields so that the other connections of the thread are served.
+  // Returns false if the script was killed.
+  bool CheckRun(ScriptRun* run);
+
+  // Unregisters the run after the script finished.
+  void FinishRun(ScriptRun* run);
+
+  bool HasBusyRuns() const {
+    return busy_cnt_.load(std::memory_order_relaxed) > 0;
+  }
+
+  // Whether a busy script declared any of the keys.
+  bool IsBusy(DbIndex db, absl::Span<const std::string_view> keys) const;
+
  private:
+  void Kill(ConnectionContext* cntx);
+
   using ScriptKey = std::array<char, 40>;
-  absl::flat_hash_map<ScriptKey, std::unique_ptr<char[]>> db_;  // protected by mu_
+
+  struct ScriptData {
+    std::unique_ptr<char[]> body;
+    std::string bytecode;
+  };
+
+  absl::flat_hash_map<ScriptKey, ScriptData> db_;  // protected by mu_
   mutable ::boost::fibers::mutex mu_;
+
+  std::vector<ScriptRun*> busy_runs_;  // protected by busy_mu_
+  std::atomic_uint32_t busy_cnt_{0};
+  mutable ::boost::fibers::mutex busy_mu_;
 };
 
 }  // namespace dfly
@@ -0,0 +1,323 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/search_family.h"
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+
+#include "base/logging.h"
+#include "server/command_registry.h"
+#include "server/conn_context.h"
+#include "server/doc_index.h"
+#include "server/engine_shard_set.h"
+#include "server/error.h"
+#include "server/transaction.h"
+
+namespace dfly {
+
+using namespace std;
+using namespace facade;
+
+namespace {
+
+constexpr size_t kMaxFields = 1024;
+constexpr char kUnknownIndex[] = "Unknown Index name";
+
+const char* FieldTypeName(DocIndexSchema::FieldType type) {
+  switch (type) {
+    case DocIndexSchema::TAG:
+      return "TAG";
+    case DocIndexSchema::TEXT:
+      return "TEXT";
+    case DocIndexSchema::NUMERIC:
+      return "NUMERIC";
+  }
+  return "";
+}
+
+// Parses the arguments of FT.CREATE after the index name. Returns the error message if they are
+// invalid.
+optional<string> ParseSchema(CmdArgList args, DocIndexSchema* schema) {
+  size_t i = 2;
+  for (; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view arg = ArgS(args, i);
+    if (arg == "ON" && i + 1 < args.size()) {
+      ToUpper(&args[++i]);
+      string_view type = ArgS(args, i);
+      if (type == "HASH")
+        schema->type = DocIndexSchema::HASH;
+      else if (type == "JSON")
+        schema->type = DocIndexSchema::JSON;
+      else
+        return absl::StrCat("Invalid index type ", type);
+    } else if (arg == "PREFIX" && i + 1 < args.size()) {
+      size_t num;
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &num) || num > args.size() - i - 1)
+        return string{kSyntaxErr};
+      for (; num > 0; --num)
+        schema->prefixes.emplace_back(ArgS(args, ++i));
+    } else if (arg == "SCHEMA") {
+      break;
+    } else {
+      return string{kSyntaxErr};
+    }
+  }
+
+  for (++i; i < args.size(); ++i) {
+    DocIndexSchema::Field field;
+    field.identifier = ArgS(args, i);
+    field.alias = field.identifier;
+    if (schema->type == DocIndexSchema::JSON && !absl::StartsWith(field.identifier, "$."))
+      return absl::StrCat("Invalid JSON path ", field.identifier);
+
+    if (i + 2 < args.size() && absl::EqualsIgnoreCase(ArgS(args, i + 1), "AS")) {
+      field.alias = ArgS(args, i + 2);
+      i += 2;
+    }
+    if (++i == args.size())
+      return string{kSyntaxErr};
+
+    ToUpper(&args[i]);
+    string_view type = ArgS(args, i);
+    if (type == "TAG") {
+      field.type = DocIndexSchema::TAG;
+      if (i + 1 < args.size() && absl::EqualsIgnoreCase(ArgS(args, i + 1), "SEPARATOR")) {
+        if (i + 2 == args.size() || ArgS(args, i + 2).size() != 1)
+          return string{"Separator must be a single character"};
+        field.separator = ArgS(args, i + 2)[0];
+        i += 2;
+      }
+    } else if (type == "TEXT") {
+      field.type = DocIndexSchema::TEXT;
+    } else if (type == "NUMERIC") {
+      field.type = DocIndexSchema::NUMERIC;
+    } else {
+      return absl::StrCat("Invalid field type for field `", field.alias, "`");
+    }
+
+    if (schema->FieldIndex(field.alias) >= 0)
+      return absl::StrCat("Duplicate field in schema - ", field.alias);
+    if (schema->fields.size() == kMaxFields)
+      return string{"Too many fields in schema"};
+    schema->fields.push_back(std::move(field));
+  }
+
+  if (schema->fields.empty())
+    return string{"Fields arguments are missing"};
+  return nullopt;
+}
+
+void FtCreate(CmdArgList args, ConnectionContext* cntx) {
+  string_view name = ArgS(args, 1);
+  DocIndexSchema schema;
+  if (optional<string> error = ParseSchema(args, &schema))
+    return (*cntx)->SendError(*error);
+
+  // The callbacks of a multi shard hop must return OK, so the shards report by a flag.
+  atomic_bool exists{false};
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    PrimeTable* db0 = shard->db_slice().GetPrimeTable(0);
+    if (!shard->doc_indices().Create(name, schema, db0))
+      exists.store(true, memory_order_relaxed);
+    return OpStatus::OK;
+  };
+
+  cntx->transaction->ScheduleSingleHop(std::move(cb));
+  if (exists.load(memory_order_relaxed))
+    return (*cntx)->SendError("Index already exists");
+  (*cntx)->SendOk();
+}
+
+void FtDropIndex(CmdArgList args, ConnectionContext* cntx) {
+  string_view name = ArgS(args, 1);
+  atomic_bool missing{false};
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    if (!shard->doc_indices().Drop(name))
+      missing.store(true, memory_order_relaxed);
+    return OpStatus::OK;
+  };
+
+  cntx->transaction->ScheduleSingleHop(std::move(cb));
+  if (missing.load(memory_order_relaxed))
+    return (*cntx)->SendError(kUnknownIndex);
+  (*cntx)->SendOk();
+}
+
+void FtInfo(CmdArgList args, ConnectionContext* cntx) {
+  string_view name = ArgS(args, 1);
+  atomic_ulong num_docs{0};
+  atomic_bool missing{false};
+  DocIndexSchema schema;
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    const ShardDocIndex* index = shard->doc_indices().Find(name);
+    if (!index) {
+      missing.store(true, memory_order_relaxed);
+      return OpStatus::OK;
+    }
+    num_docs.fetch_add(index->num_docs(), memory_order_relaxed);
+    if (shard->shard_id() == 0)
+      schema = index->schema();
+    return OpStatus::OK;
+  };
+
+  cntx->transaction->ScheduleSingleHop(std::move(cb));
+  if (missing.load(memory_order_relaxed))
+    return (*cntx)->SendError(kUnknownIndex);
+
+  (*cntx)->StartArray(8);
+  (*cntx)->SendBulkString("index_name");
+  (*cntx)->SendBulkString(name);
+  (*cntx)->SendBulkString("index_definition");
+  (*cntx)->StartArray(4);
+  (*cntx)->SendBulkString("key_type");
+  (*cntx)->SendBulkString(schema.type == DocIndexSchema::HASH ? "HASH" : "JSON");
+  (*cntx)->SendBulkString("prefixes");
+  (*cntx)->SendStringArr(absl::Span<const string>{schema.prefixes});
+  (*cntx)->SendBulkString("attributes");
+  (*cntx)->StartArray(schema.fields.size());
+  for (const DocIndexSchema::Field& field : schema.fields) {
+    bool tag = field.type == DocIndexSchema::TAG;
+    (*cntx)->StartArray(tag ? 8 : 6);
+    (*cntx)->SendBulkString("identifier");
+    (*cntx)->SendBulkString(field.identifier);
+    (*cntx)->SendBulkString("attribute");
+    (*cntx)->SendBulkString(field.alias);
+    (*cntx)->SendBulkString("type");
+    (*cntx)->SendBulkString(FieldTypeName(field.type));
+    if (tag) {
+      (*cntx)->SendBulkString("SEPARATOR");
+      (*cntx)->SendBulkString(string_view{&field.separator, 1});
+    }
+  }
+  (*cntx)->SendBulkString("num_docs");
+  (*cntx)->SendLong(num_docs.load(memory_order_relaxed));
+}
+
+void FtList(CmdArgList args, ConnectionContext* cntx) {
+  vector<string> names;
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    if (shard->shard_id() == 0)
+      names = shard->doc_indices().Names();
+    return OpStatus::OK;
+  };
+
+  cntx->transaction->ScheduleSingleHop(std::move(cb));
+  sort(names.begin(), names.end());
+  (*cntx)->SendStringArr(absl::Span<const string>{names});
+}
+
+// A matching document of FT.SEARCH, its fields are empty with NOCONTENT.
+struct SearchDoc {
+  string key;
+  vector<pair<string, string>> fields;
+};
+
+struct ShardSearchResult {
+  vector<SearchDoc> docs;
+  optional<string> error;
+};
+
+void FtSearch(CmdArgList args, ConnectionContext* cntx) {
+  string_view name = ArgS(args, 1);
+  string_view query_str = ArgS(args, 2);
+  bool no_content = false;
+  size_t offset = 0, limit = 10;
+
+  for (size_t i = 3; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view arg = ArgS(args, i);
+    if (arg == "NOCONTENT") {
+      no_content = true;
+    } else if (arg == "LIMIT" && i + 2 < args.size()) {
+      if (!absl::SimpleAtoi(ArgS(args, i + 1), &offset) ||
+          !absl::SimpleAtoi(ArgS(args, i + 2), &limit))
+        return (*cntx)->SendError(kInvalidIntErr);
+      i += 2;
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
+  vector<ShardSearchResult> results(shard_set->size());
+  atomic_bool missing{false};
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    const ShardDocIndex* index = shard->doc_indices().Find(name);
+    if (!index) {
+      missing.store(true, memory_order_relaxed);
+      return OpStatus::OK;
+    }
+
+    ShardSearchResult& result = results[shard->shard_id()];
+    DocQuery query;
+    if ((result.error = DocQuery::Parse(query_str, index->schema(), &query)))
+      return OpStatus::OK;
+
+    // Copied since the lookups below may expire the keys, which removes them from the index.
+    for (string_view key : index->Search(query))
+      result.docs.push_back(SearchDoc{string{key}, {}});
+    if (no_content)
+      return OpStatus::OK;
+
+    DbContext db_cntx = t->db_context();
+    db_cntx.db_index = 0;
+    for (SearchDoc& doc : result.docs) {
+      auto [it, exp_it] = shard->db_slice().FindExt(db_cntx, doc.key);
+      if (!IsValid(it))
+        continue;
+      VisitDocFields(it->second, [&](string_view field, string_view value) {
+        doc.fields.emplace_back(field, value);
+      });
+    }
+    return OpStatus::OK;
+  };
+
+  cntx->transaction->ScheduleSingleHop(std::move(cb));
+  if (missing.load(memory_order_relaxed))
+    return (*cntx)->SendError(kUnknownIndex);
+
+  vector<SearchDoc> docs;
+  for (ShardSearchResult& result : results) {
+    if (result.error)
+      return (*cntx)->SendError(*result.error);
+    move(result.docs.begin(), result.docs.end(), back_inserter(docs));
+  }
+  sort(docs.begin(), docs.end(),
+       [](const SearchDoc& a, const SearchDoc& b) { return a.key < b.key; });
+
+  size_t start = min(offset, docs.size());
+  size_t end = start + min(limit, docs.size() - start);
+  (*cntx)->StartArray(1 + (end - start) * (no_content ? 1 : 2));
+  (*cntx)->SendLong(docs.size());
+  for (size_t i = start; i < end; ++i) {
+    (*cntx)->SendBulkString(docs[i].key);
+    if (no_content)
+      continue;
+    (*cntx)->StartArray(docs[i].fields.size() * 2);
+    for (const auto& [field, value] : docs[i].fields) {
+      (*cntx)->SendBulkString(field);
+      (*cntx)->SendBulkString(value);
+    }
+  }
+}
+
+}  // namespace
+
+using CI = CommandId;
+
+#define HFUNC(x) SetHandler(&x)
+
+void SearchFamily::Register(CommandRegistry* registry) {
+  *registry << CI{"FT.CREATE", CO::WRITE | CO::GLOBAL_TRANS, -2, 0, 0, 0}.HFUNC(FtCreate)
+            << CI{"FT.DROPINDEX", CO::WRITE | CO::GLOBAL_TRANS, -2, 0, 0, 0}.HFUNC(FtDropIndex)
+            << CI{"FT.INFO", CO::READONLY | CO::GLOBAL_TRANS, 2, 0, 0, 0}.HFUNC(FtInfo)
+            << CI{"FT._LIST", CO::READONLY | CO::GLOBAL_TRANS, 1, 0, 0, 0}.HFUNC(FtList)
+            << CI{"FT.SEARCH", CO::READONLY | CO::GLOBAL_TRANS, -3, 0, 0, 0}.HFUNC(FtSearch);
+}
+
+}  // namespace dfly
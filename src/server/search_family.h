@@ -0,0 +1,23 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+/// @brief Implements a subset of the RediSearch commands: FT.CREATE, FT.DROPINDEX, FT.INFO,
+/// FT._LIST and FT.SEARCH. Every shard indexes its own hashes or JSON values of db 0, see
+/// server/doc_index.h, and FT.SEARCH merges the matches of the shards.
+///     FT.CREATE: https://redis.io/commands/ft.create/
+///     FT.DROPINDEX: https://redis.io/commands/ft.dropindex/
+///     FT.INFO: https://redis.io/commands/ft.info/
+///     FT._LIST: https://redis.io/commands/ft._list/
+///     FT.SEARCH: https://redis.io/commands/ft.search/
+namespace dfly {
+class CommandRegistry;
+
+class SearchFamily {
+ public:
+  static void Register(CommandRegistry* registry);
+};
+
+}  // namespace dfly
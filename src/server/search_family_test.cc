@@ -0,0 +1,122 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/search_family.h"
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "facade/facade_test.h"
+#include "server/command_registry.h"
+#include "server/test_utils.h"
+
+using namespace testing;
+using namespace std;
+using namespace util;
+
+namespace dfly {
+
+class SearchFamilyTest : public BaseFamilyTest {
+ protected:
+  void AddHashes() {
+    Run({"hset", "doc:1", "title", "Hello World", "tags", "red, Blue", "price", "10"});
+    Run({"hset", "doc:2", "title", "Goodbye world", "tags", "green", "price", "20"});
+    Run({"hset", "other:1", "title", "hello", "tags", "red", "price", "10"});
+  }
+};
+
+TEST_F(SearchFamilyTest, CreateDrop) {
+  EXPECT_THAT(Run({"ft.create", "idx", "on", "hash", "schema"}), ErrArg("Fields arguments"));
+  EXPECT_THAT(Run({"ft.create", "idx", "schema", "f", "foo"}), ErrArg("Invalid field type"));
+  EXPECT_THAT(Run({"ft.create", "idx", "on", "json", "schema", "f", "tag"}),
+              ErrArg("Invalid JSON path"));
+  EXPECT_THAT(Run({"ft.create", "idx", "schema", "f", "tag", "f", "text"}),
+              ErrArg("Duplicate field"));
+
+  EXPECT_EQ("OK", Run({"ft.create", "idx", "prefix", "1", "doc:", "schema", "title", "text"}));
+  EXPECT_THAT(Run({"ft.create", "idx", "schema", "title", "text"}), ErrArg("already exists"));
+  EXPECT_EQ("OK", Run({"ft.create", "idx2", "schema", "t", "as", "title", "text"}));
+  EXPECT_THAT(Run({"ft._list"}).GetVec(), ElementsAre("idx", "idx2"));
+
+  EXPECT_EQ("OK", Run({"ft.dropindex", "idx"}));
+  EXPECT_THAT(Run({"ft.dropindex", "idx"}), ErrArg("Unknown Index name"));
+  EXPECT_THAT(Run({"ft.search", "idx", "*"}), ErrArg("Unknown Index name"));
+  EXPECT_EQ("idx2", Run({"ft._list"}));
+}
+
+TEST_F(SearchFamilyTest, SearchHash) {
+  AddHashes();
+  EXPECT_EQ("OK", Run({"ft.create", "idx", "on", "hash", "prefix", "1", "doc:", "schema", "title",
+                       "text", "tags", "tag", "price", "numeric"}));
+
+  auto resp = Run({"ft.search", "idx", "world", "nocontent"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(2), "doc:1", "doc:2"));
+  resp = Run({"ft.search", "idx", "@title:hello", "nocontent"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), "doc:1"));
+  resp = Run({"ft.search", "idx", "@tags:{blue | green}", "nocontent"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(2), "doc:1", "doc:2"));
+  resp = Run({"ft.search", "idx", "@price:[15 +inf]", "nocontent"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), "doc:2"));
+  resp = Run({"ft.search", "idx", "@price:[-inf (20] -@tags:{red}", "nocontent"});
+  EXPECT_THAT(resp, IntArg(0));
+  resp = Run({"ft.search", "idx", "* -hello", "nocontent"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), "doc:2"));
+  resp = Run({"ft.search", "idx", "*", "nocontent", "limit", "1", "5"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(2), "doc:2"));
+
+  resp = Run({"ft.search", "idx", "@tags:{green}"});
+  ASSERT_THAT(resp, ArrLen(3));
+  EXPECT_THAT(resp.GetVec()[1], "doc:2");
+  EXPECT_THAT(resp.GetVec()[2].GetVec(),
+              ElementsAre("title", "Goodbye world", "tags", "green", "price", "20"));
+
+  EXPECT_THAT(Run({"ft.search", "idx", "@foo:bar"}), ErrArg("Unknown field `foo`"));
+  EXPECT_THAT(Run({"ft.search", "idx", "@price:bar"}), ErrArg("not a TEXT field"));
+  EXPECT_THAT(Run({"ft.search", "idx", "@price:[1]"}), ErrArg("Syntax error"));
+}
+
+TEST_F(SearchFamilyTest, FollowWrites) {
+  EXPECT_EQ("OK", Run({"ft.create", "idx", "prefix", "1", "doc:", "schema", "title", "text",
+                       "tags", "tag", "price", "numeric"}));
+  AddHashes();
+  auto resp = Run({"ft.info", "idx"});
+  ASSERT_THAT(resp, ArrLen(8));
+  EXPECT_THAT(resp.GetVec()[7], IntArg(2));
+
+  Run({"hset", "doc:1", "price", "30", "title", "moved"});
+  resp = Run({"ft.search", "idx", "@price:[25 35]", "nocontent"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), "doc:1"));
+  EXPECT_THAT(Run({"ft.search", "idx", "hello"}), IntArg(0));
+
+  Run({"del", "doc:2"});
+  EXPECT_THAT(Run({"ft.search", "idx", "world"}), IntArg(0));
+  Run({"set", "doc:1", "str"});
+  EXPECT_THAT(Run({"ft.search", "idx", "*"}), IntArg(0));
+
+  AddHashes();
+  Run({"flushall"});
+  EXPECT_THAT(Run({"ft.search", "idx", "*"}), IntArg(0));
+  EXPECT_EQ("idx", Run({"ft._list"}));
+}
+
+TEST_F(SearchFamilyTest, SearchJson) {
+  Run({"json.set", "j:1", ".", R"({"name": "alice", "age": 30, "tags": ["a", "b"]})"});
+  Run({"json.set", "j:2", ".", R"({"name": "bob", "age": 40.5, "tags": ["b"]})"});
+  EXPECT_EQ("OK", Run({"ft.create", "idx", "on", "json", "prefix", "1", "j:", "schema", "$.name",
+                       "as", "name", "tag", "$.age", "as", "age", "numeric", "$.tags", "as",
+                       "tags", "tag"}));
+
+  auto resp = Run({"ft.search", "idx", "@name:{alice}", "nocontent"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), "j:1"));
+  resp = Run({"ft.search", "idx", "@age:[(30 50]", "nocontent"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(1), "j:2"));
+  resp = Run({"ft.search", "idx", "@tags:{b}", "nocontent"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(IntArg(2), "j:1", "j:2"));
+
+  Run({"json.set", "j:2", "$.name", R"("carol")"});
+  resp = Run({"ft.search", "idx", "@name:{carol}"});
+  ASSERT_THAT(resp, ArrLen(3));
+  EXPECT_THAT(resp.GetVec()[2].GetVec(), ElementsAre("$", HasSubstr("carol")));
+}
+
+}  // namespace dfly
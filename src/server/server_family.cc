@@ -6,15 +6,25 @@
 
 #include <absl/cleanup/cleanup.h>
 #include <absl/random/random.h>  // for master_id_ generation.
+#include <absl/strings/ascii.h>
 #include <absl/strings/match.h>
+#include <absl/strings/str_format.h>
 #include <absl/strings/str_join.h>
 #include <absl/strings/str_replace.h>
+#include <absl/strings/str_split.h>
+#include <absl/strings/strip.h>
+#include <fcntl.h>
+#include <spawn.h>
 #include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <chrono>
+#include <csignal>
 #include <filesystem>
 #include <optional>
+#include <thread>
 
 extern "C" {
 #include "redis/redis_aux.h"
@@ -23,6 +33,8 @@ extern "C" {
 #include "base/flags.h"
 #include "base/logging.h"
 #include "facade/dragonfly_connection.h"
+#include "facade/dragonfly_listener.h"
+#include "facade/numa.h"
 #include "io/file_util.h"
 #include "io/proc_reader.h"
 #include "server/command_registry.h"
@@ -31,6 +43,8 @@ extern "C" {
 #include "server/dflycmd.h"
 #include "server/engine_shard_set.h"
 #include "server/error.h"
+#include "server/handoff_client.h"
+#include "server/journal/frame.h"
 #include "server/journal/journal.h"
 #include "server/main_service.h"
 #include "server/memory_cmd.h"
@@ -39,6 +53,7 @@ extern "C" {
 #include "server/replica.h"
 #include "server/script_mgr.h"
 #include "server/server_state.h"
+#include "server/snapshot.h"
 #include "server/tiered_storage.h"
 #include "server/transaction.h"
 #include "server/version.h"
@@ -47,6 +62,8 @@ extern "C" {
 #include "util/fibers/fiber_file.h"
 #include "util/uring/uring_file.h"
 
+extern char** environ;
+
 using namespace std;
 
 ABSL_FLAG(string, dir, "", "working directory");
@@ -54,10 +71,40 @@ ABSL_FLAG(string, dbfilename, "dump", "the filename to save/load the DB");
 ABSL_FLAG(string, requirepass, "", "password for AUTH authentication");
 ABSL_FLAG(string, save_schedule, "",
           "glob spec for the UTC time to save a snapshot which matches HH:MM 24h time");
+ABSL_FLAG(bool, df_snapshot_format, false,
+          "If true, SAVE, BGSAVE and the scheduled snapshots write the dragonfly format: "
+          "a file per shard, written in parallel, and a summary file");
+ABSL_FLAG(string, snapshot_upload_cmd, "",
+          "If set, the snapshot files are not written into --dir but streamed into the standard "
+          "input of this shell command, a process per file, that runs with the name of the file in "
+          "the DF_SNAPSHOT_FILE environment variable, for example "
+          "'aws s3 cp - s3://bucket/$DF_SNAPSHOT_FILE'. The save fails if a process fails");
+ABSL_FLAG(uint64_t, snapshot_write_bytes_per_sec, 0,
+          "Limits the rate at which a snapshot is written, summed over its files, so that it does "
+          "not saturate the storage device. 0 means no limit");
+ABSL_FLAG(uint32_t, snapshot_io_latency_usec, 0,
+          "If positive, the write rate of a rate limited snapshot backs off while the average "
+          "latency of the tiered storage IO exceeds it");
+
+ABSL_FLAG(uint32_t, idle_conn_reclaim_sec, 60,
+          "The connections that have not sent a request for this many seconds release the "
+          "buffers they keep from their previous requests. 0 disables the reclamation");
+
+ABSL_FLAG(uint32_t, handoff_drain_sec, 30,
+          "How long the predecessor of a handoff keeps serving its clients after the successor "
+          "took over, read-only, before it exits");
+ABSL_FLAG(uint32_t, handoff_sync_timeout_sec, 600,
+          "How long the successor of a handoff waits for the full sync with its predecessor");
+
+ABSL_FLAG(uint32_t, read_after_timeout_ms, 50,
+          "How long a read after CLIENT READAFTER waits for the replica to apply the writes of the "
+          "LSN token, unless it sets its own TIMEOUT. The read fails with TRYAGAIN after it");
 
 ABSL_DECLARE_FLAG(uint32_t, port);
 ABSL_DECLARE_FLAG(bool, cache_mode);
 ABSL_DECLARE_FLAG(uint32_t, hz);
+ABSL_DECLARE_FLAG(uint32_t, dbnum);
+ABSL_DECLARE_FLAG(bool, df_snapshot_deltas);
 
 namespace dfly {
 
@@ -77,6 +124,10 @@ namespace {
 
 const auto kRdbWriteFlags = O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC | O_DIRECT;
 
+// Delta files are named after the snapshot they are based on: <name>-<ts>-delta-<seq>-XXXX.dfs
+// and <name>-<ts>-delta-<seq>-summary.dfs.
+constexpr string_view kDeltaInfix = "-delta-";
+
 using EngineFunc = void (ServerFamily::*)(CmdArgList args, ConnectionContext* cntx);
 
 inline CommandId::Handler HandlerFunc(ServerFamily* se, EngineFunc f) {
@@ -117,7 +168,10 @@ string InferLoadFile(fs::path data_dir) {
 
     if (short_vec) {
       auto it = std::find_if(short_vec->rbegin(), short_vec->rend(), [](const auto& stat) {
-        return absl::EndsWith(stat.name, ".rdb") || absl::EndsWith(stat.name, "summary.dfs");
+        // The deltas are loaded together with their base.
+        return absl::EndsWith(stat.name, ".rdb") ||
+               (absl::EndsWith(stat.name, "summary.dfs") &&
+                !absl::StrContains(stat.name, kDeltaInfix));
       });
       if (it != short_vec->rend())
         return it->name;
@@ -170,14 +224,39 @@ class LinuxWriteWrapper : public io::Sink {
   off_t offset_ = 0;
 };
 
+// Streams the data into the standard input of a shell command, for example an uploader to
+// object storage, so that the snapshot does not need local disk space.
+class PipeWriteSink : public io::Sink {
+ public:
+  ~PipeWriteSink();
+
+  // Spawns cmd with file_name in the DF_SNAPSHOT_FILE environment variable.
+  std::error_code Start(const std::string& cmd, const std::string& file_name);
+
+  io::Result<size_t> WriteSome(const iovec* v, uint32_t len) final;
+
+  // Closes the pipe and waits for the process to exit, fails if it exits with an error.
+  std::error_code Close();
+
+ private:
+  int fd_ = -1;
+  pid_t pid_ = -1;
+};
+
 class RdbSnapshot {
  public:
-  RdbSnapshot(FiberQueueThreadPool* fq_tp) : fq_tp_(fq_tp) {
+  // limiter is optional and must outlive the snapshot.
+  RdbSnapshot(FiberQueueThreadPool* fq_tp, IoRateLimiter* limiter)
+      : fq_tp_(fq_tp), limiter_(limiter) {
   }
 
   error_code Start(SaveMode save_mode, const std::string& path, const StringVec& lua_scripts);
   void StartInShard(EngineShard* shard);
 
+  error_code SaveFlushedDbs(const std::vector<DbIndex>& dbs) {
+    return saver_->SaveFlushedDbs(dbs);
+  }
+
   error_code SaveBody();
   error_code Close();
 
@@ -191,8 +270,11 @@ class RdbSnapshot {
 
  private:
   bool started_ = false;
+  bool is_pipe_ = false;  // io_sink_ streams into --snapshot_upload_cmd.
   FiberQueueThreadPool* fq_tp_;
+  IoRateLimiter* limiter_;
   std::unique_ptr<io::Sink> io_sink_;
+  std::unique_ptr<RateLimitedSink> limited_sink_;  // wraps io_sink_ if limiter_ is set.
   std::unique_ptr<RdbSaver> saver_;
   RdbTypeFreqMap freq_map_;
 
@@ -208,10 +290,100 @@ io::Result<size_t> LinuxWriteWrapper::WriteSome(const iovec* v, uint32_t len) {
   return res;
 }
 
+error_code LastError() {
+  return error_code{errno, system_category()};
+}
+
+PipeWriteSink::~PipeWriteSink() {
+  Close();
+}
+
+error_code PipeWriteSink::Start(const string& cmd, const string& file_name) {
+  // A process that exits early fails the save with EPIPE instead of killing the server.
+  signal(SIGPIPE, SIG_IGN);
+
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) != 0)
+    return LastError();
+
+  // A larger pipe wakes the writer less often.
+  fcntl(fds[1], F_SETPIPE_SZ, 1 << 20);
+
+  string file_env = StrCat("DF_SNAPSHOT_FILE=", file_name);
+  vector<char*> envp;
+  for (char** env = environ; *env; ++env) {
+    envp.push_back(*env);
+  }
+  envp.push_back(file_env.data());
+  envp.push_back(nullptr);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+
+  const char* argv[] = {"/bin/sh", "-c", cmd.c_str(), nullptr};
+  int res = posix_spawn(&pid_, argv[0], &actions, nullptr, const_cast<char**>(argv), envp.data());
+  posix_spawn_file_actions_destroy(&actions);
+  close(fds[0]);
+
+  if (res != 0) {
+    close(fds[1]);
+    pid_ = -1;
+    return error_code{res, system_category()};
+  }
+
+  // The writes must not block the thread, the writer sleeps while the pipe is full.
+  fd_ = fds[1];
+  fcntl(fd_, F_SETFL, O_NONBLOCK);
+  return {};
+}
+
+io::Result<size_t> PipeWriteSink::WriteSome(const iovec* v, uint32_t len) {
+  while (true) {
+    ssize_t res = writev(fd_, v, len);
+    if (res >= 0)
+      return res;
+    if (errno != EAGAIN && errno != EINTR)
+      return nonstd::make_unexpected(LastError());
+    if (errno == EAGAIN)
+      util::fibers_ext::SleepFor(1ms);
+  }
+}
+
+error_code PipeWriteSink::Close() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+
+  if (pid_ < 0)
+    return {};
+
+  // Polls, so that the thread is not blocked while the process finishes the upload.
+  int status = 0;
+  pid_t res;
+  while ((res = waitpid(pid_, &status, WNOHANG)) == 0 || (res < 0 && errno == EINTR)) {
+    util::fibers_ext::SleepFor(10ms);
+  }
+  pid_ = -1;
+
+  if (res < 0)
+    return LastError();
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    return make_error_code(errc::broken_pipe);
+  return {};
+}
+
 error_code RdbSnapshot::Start(SaveMode save_mode, const std::string& path,
                               const StringVec& lua_scripts) {
   bool is_direct = false;
-  if (fq_tp_) {  // EPOLL
+  if (string upload_cmd = GetFlag(FLAGS_snapshot_upload_cmd); !upload_cmd.empty()) {
+    auto* pipe_sink = new PipeWriteSink;
+    io_sink_.reset(pipe_sink);
+    if (auto ec = pipe_sink->Start(upload_cmd, fs::path(path).filename().generic_string()); ec)
+      return ec;
+    is_pipe_ = true;
+  } else if (fq_tp_) {  // EPOLL
     auto res = util::OpenFiberWriteFile(path, fq_tp_);
     if (!res)
       return res.error();
@@ -225,7 +397,13 @@ error_code RdbSnapshot::Start(SaveMode save_mode, const std::string& path,
     is_direct = kRdbWriteFlags & O_DIRECT;
   }
 
-  saver_.reset(new RdbSaver(io_sink_.get(), save_mode, is_direct));
+  io::Sink* sink = io_sink_.get();
+  if (limiter_) {
+    limited_sink_.reset(new RateLimitedSink(sink, limiter_));
+    sink = limited_sink_.get();
+  }
+
+  saver_.reset(new RdbSaver(sink, save_mode, is_direct));
 
   return saver_->SaveHeader(lua_scripts);
 }
@@ -236,6 +414,9 @@ error_code RdbSnapshot::SaveBody() {
 
 error_code RdbSnapshot::Close() {
   // TODO: to solve it in a more elegant way.
+  if (is_pipe_) {
+    return static_cast<PipeWriteSink*>(io_sink_.get())->Close();
+  }
   if (fq_tp_) {
     return static_cast<io::WriteFile*>(io_sink_.get())->Close();
   }
@@ -267,6 +448,65 @@ void ExtendFilenameWithShard(absl::Time now, int shard, fs::path* filename) {
   }
 }
 
+// Returns the summary file of a dragonfly snapshot followed by its shard files.
+io::Result<vector<string>> SnapshotFiles(const string& summary_path) {
+  string glob = StrCat(absl::StripSuffix(summary_path, "summary.dfs"), "????.dfs");
+  io::Result<io::StatShortVec> files = io::StatFiles(glob);
+  if (!files)
+    return nonstd::make_unexpected(files.error());
+
+  if (files->empty())
+    return nonstd::make_unexpected(make_error_code(errc::no_such_file_or_directory));
+
+  vector<string> res{summary_path};
+  for (auto& fstat : *files) {
+    res.push_back(std::move(fstat.name));
+  }
+  return res;
+}
+
+// Returns the summaries of the deltas of a dragonfly snapshot in the order they were saved.
+vector<string> DeltaSummaries(const string& summary_path) {
+  string glob = StrCat(absl::StripSuffix(summary_path, "-summary.dfs"), kDeltaInfix,
+                       "????-summary.dfs");
+  vector<string> res;
+  io::Result<io::StatShortVec> files = io::StatFiles(glob);
+  if (files) {
+    for (auto& fstat : *files) {
+      res.push_back(std::move(fstat.name));
+    }
+  }
+  sort(res.begin(), res.end());
+  return res;
+}
+
+// Removes the files of the deltas that match delta, so that they are not loaded.
+void RemoveDeltaFiles(absl::Time base_time, string_view delta, fs::path prefix) {
+  prefix.replace_extension();
+  string glob = StrCat(prefix.generic_string(), "-", FormatTs(base_time), "-", delta, "-*.dfs");
+  io::Result<io::StatShortVec> files = io::StatFiles(glob);
+  if (!files)
+    return;
+
+  for (const auto& fstat : *files) {
+    error_code ec;
+    fs::remove(fstat.name, ec);
+    LOG_IF(WARNING, ec) << "Could not remove " << fstat.name << ": " << ec.message();
+  }
+}
+
+// Returns the index of the shard that saved the file of a dragonfly snapshot,
+// or -1 for the summary and the rdb files.
+int ShardFileIndex(string_view path) {
+  if (!absl::ConsumeSuffix(&path, ".dfs") || path.size() < 5 || path[path.size() - 5] != '-')
+    return -1;
+
+  uint32_t index;
+  if (!absl::SimpleAtoi(path.substr(path.size() - 4), &index))
+    return -1;
+  return index;
+}
+
 }  // namespace
 
 std::optional<SnapshotSpec> ParseSaveSchedule(string_view time) {
@@ -323,7 +563,7 @@ ServerFamily::ServerFamily(Service* service) : service_(*service) {
   last_save_info_ = make_shared<LastSaveInfo>();
   last_save_info_->save_time = start_time_;
   script_mgr_.reset(new ScriptMgr());
-  journal_.reset(new journal::Journal);
+  journal_.reset(new journal::Journal(service->proactor_pool().size()));
 
   {
     absl::InsecureBitGen eng;
@@ -353,6 +593,7 @@ void ServerFamily::Init(util::AcceptServer* acceptor, util::ListenerInterface* m
     const auto& stats = EngineShardSet::GetCachedStats();
     for (const auto& s : stats)
       sum += s.used_memory.load(memory_order_relaxed);
+    sum += SliceSnapshot::BufferedBytes();
 
     used_mem_current.store(sum, memory_order_relaxed);
 
@@ -384,6 +625,12 @@ void ServerFamily::Init(util::AcceptServer* acceptor, util::ListenerInterface* m
     LOG(ERROR) << "Data directory error: " << file_ec.message();
   }
 
+  uint32_t idle_reclaim_sec = GetFlag(FLAGS_idle_conn_reclaim_sec);
+  if (main_listener_ && idle_reclaim_sec > 0) {
+    idle_sweep_fiber_ =
+        pb_task_->LaunchFiber([this, idle_reclaim_sec] { SweepIdleConnections(idle_reclaim_sec); });
+  }
+
   string save_time = GetFlag(FLAGS_save_schedule);
   if (!save_time.empty()) {
     std::optional<SnapshotSpec> spec = ParseSaveSchedule(save_time);
@@ -407,6 +654,16 @@ void ServerFamily::Shutdown() {
     snapshot_fiber_.Join();
   }
 
+  is_idle_sweep_done_.Notify();
+  if (idle_sweep_fiber_.IsJoinable()) {
+    idle_sweep_fiber_.Join();
+  }
+
+  is_handoff_drain_done_.Notify();
+  if (handoff_drain_fiber_.IsJoinable()) {
+    handoff_drain_fiber_.Join();
+  }
+
   pb_task_->Await([this] {
     pb_task_->CancelPeriodic(stats_caching_task_);
     stats_caching_task_ = 0;
@@ -425,47 +682,81 @@ void ServerFamily::Shutdown() {
   });
 }
 
-// Load starts as many fibers as there are files to load each one separately.
-// It starts one more fiber that waits for all load fibers to finish and returns the first
-// error (if any occured) with a future.
+// Load runs in stages, each stage starts as many fibers as there are files to load each one
+// separately. The first stage loads the snapshot. A dragonfly snapshot may be followed by its
+// deltas, every delta is loaded in two stages: its summary, which flushes the databases that were
+// flushed before the delta, and its shard files.
+// Another fiber runs the stages one after another and returns the first error (if any occured)
+// with a future.
 fibers::future<std::error_code> ServerFamily::Load(const std::string& load_path) {
   CHECK(absl::EndsWith(load_path, ".rdb") || absl::EndsWith(load_path, "summary.dfs"));
 
-  vector<std::string> paths{{load_path}};
+  auto error_future = [](error_code ec) {
+    fibers::promise<std::error_code> ec_promise;
+    ec_promise.set_value(ec);
+    return ec_promise.get_future();
+  };
+
+  vector<vector<string>> stages;
 
   // Collect all other files in case we're loading dfs.
   if (absl::EndsWith(load_path, "summary.dfs")) {
-    std::string glob = absl::StrReplaceAll(load_path, {{"summary", "????"}});
-    io::Result<io::StatShortVec> files = io::StatFiles(glob);
-
-    if (files && files->size() == 0) {
-      fibers::promise<std::error_code> ec_promise;
-      ec_promise.set_value(make_error_code(errc::no_such_file_or_directory));
-      return ec_promise.get_future();
+    // A delta summary is loaded together with its base and the deltas that precede it.
+    string base_path = load_path, last_delta;
+    if (size_t pos = load_path.rfind(kDeltaInfix); pos != string::npos) {
+      base_path = StrCat(load_path.substr(0, pos), "-summary.dfs");
+      last_delta = load_path;
     }
 
-    for (auto& fstat : *files) {
-      paths.push_back(std::move(fstat.name));
+    io::Result<vector<string>> files = SnapshotFiles(base_path);
+    if (!files)
+      return error_future(files.error());
+    stages.push_back(std::move(*files));
+
+    for (const string& delta_path : DeltaSummaries(base_path)) {
+      if (!last_delta.empty() && delta_path > last_delta)
+        break;
+
+      files = SnapshotFiles(delta_path);
+      if (!files)
+        return error_future(files.error());
+      stages.push_back({files->front()});
+      stages.emplace_back(files->begin() + 1, files->end());
     }
+  } else {
+    stages.push_back({load_path});
   }
 
   // Check all paths are valid.
-  for (const auto& path : paths) {
-    error_code ec;
-    fs::canonical(path, ec);
-    if (ec) {
-      LOG(ERROR) << "Error loading " << load_path << " " << ec.message();
-      fibers::promise<std::error_code> ec_promise;
-      ec_promise.set_value(ec);
-      return ec_promise.get_future();
+  for (const auto& paths : stages) {
+    for (const auto& path : paths) {
+      error_code ec;
+      fs::canonical(path, ec);
+      if (ec) {
+        LOG(ERROR) << "Error loading " << load_path << " " << ec.message();
+        return error_future(ec);
+      }
     }
   }
 
   LOG(INFO) << "Loading " << load_path;
+  if (stages.size() > 1) {
+    LOG(INFO) << "Applying " << (stages.size() - 1) / 2 << " deltas";
+  }
+
+  // Marked before the switch, so that reads served during the load never see a loading shard
+  // as loaded, see --loading_reads.
+  for (ShardId sid = 0; sid < shard_count(); ++sid) {
+    EngineShardSet::SetLoading(sid, true);
+  }
 
   GlobalState new_state = service_.SwitchState(GlobalState::ACTIVE, GlobalState::LOADING);
   if (new_state != GlobalState::LOADING) {
     LOG(WARNING) << GlobalStateName(new_state) << " in progress, ignored";
+    // Otherwise the shards belong to the load in progress.
+    for (ShardId sid = 0; new_state != GlobalState::LOADING && sid < shard_count(); ++sid) {
+      EngineShardSet::SetLoading(sid, false);
+    }
     return {};
   }
 
@@ -481,46 +772,129 @@ fibers::future<std::error_code> ServerFamily::Load(const std::string& load_path)
 
   auto& pool = service_.proactor_pool();
 
-  vector<util::fibers_ext::Fiber> load_fibers;
-  load_fibers.reserve(paths.size());
-
-  auto first_error = std::make_shared<AggregateError>();
+  // The loader routes every key by Shard(), so the snapshot loads into any number of shards.
+  // When the number did not change, a shard file is parsed by the thread of its shard and its
+  // keys stay in the thread.
+  size_t shard_files = stages.front().size() - 1;
+  if (shard_files > 0 && shard_files != shard_count()) {
+    LOG(INFO) << "Loading " << shard_files << " shard files into " << shard_count()
+              << " shards, the keys are redistributed";
+  }
 
-  for (auto& path : paths) {
-    // For single file, choose thread that does not handle shards if possible.
-    // This will balance out the CPU during the load.
-    ProactorBase* proactor;
-    if (paths.size() == 1 && shard_count() < pool.size()) {
-      proactor = pool.at(shard_count());
-    } else {
-      proactor = pool.GetNextProactor();
+  size_t total_bytes = 0;
+  for (const auto& paths : stages) {
+    for (const auto& path : paths) {
+      error_code ec;
+      total_bytes += fs::file_size(path, ec);
     }
+  }
 
-    auto load_fiber = [this, first_error, path = std::move(path)]() {
-      *first_error = LoadRdb(path);
-    };
-    load_fibers.push_back(proactor->LaunchFiber(std::move(load_fiber)));
+  load_progress_.start_time.store(time(NULL), memory_order_relaxed);
+  load_progress_.total_bytes.store(total_bytes, memory_order_relaxed);
+  load_progress_.loaded_bytes.store(0, memory_order_relaxed);
+  load_progress_.loaded_keys.store(0, memory_order_relaxed);
+  load_progress_.loading.store(true, memory_order_relaxed);
+  {
+    lock_guard lk(load_mu_);
+    loaded_journal_pos_ = journal::Position{};
   }
 
   boost::fibers::promise<std::error_code> ec_promise;
   boost::fibers::future<std::error_code> ec_future = ec_promise.get_future();
 
-  // Run fiber that empties the channel and sets ec_promise.
-  auto load_join_fiber = [this, first_error, load_fibers = std::move(load_fibers),
+  // Run fiber that runs the stages and sets ec_promise.
+  auto load_join_fiber = [this, &pool, stages = std::move(stages),
                           ec_promise = std::move(ec_promise)]() mutable {
-    for (auto& fiber : load_fibers) {
-      fiber.Join();
+    absl::Time start = absl::Now();
+    AggregateError first_error;
+    for (size_t stage = 0; stage < stages.size(); ++stage) {
+      auto& paths = stages[stage];
+      bool last_stage = stage + 1 == stages.size();
+      vector<util::fibers_ext::Fiber> load_fibers;
+      load_fibers.reserve(paths.size());
+
+      // The keys of a shard file stay in its shard when the number of shards did not change.
+      size_t num_shard_files = count_if(paths.begin(), paths.end(), [](const string& path) {
+        return ShardFileIndex(path) >= 0;
+      });
+      bool pin = num_shard_files == shard_count();
+
+      for (auto& path : paths) {
+        // For single file, choose thread that does not handle shards if possible.
+        // This will balance out the CPU during the load.
+        ProactorBase* proactor;
+        int shard_index = ShardFileIndex(path);
+        if (shard_index >= 0 && unsigned(shard_index) < shard_count()) {
+          proactor = pool.at(shard_index);
+        } else if (paths.size() == 1 && shard_count() < pool.size()) {
+          proactor = pool.at(shard_count());
+        } else {
+          proactor = pool.GetNextProactor();
+        }
+
+        optional<ShardId> pinned_shard;
+        if (pin && shard_index >= 0 && unsigned(shard_index) < shard_count())
+          pinned_shard = shard_index;
+
+        // A pinned shard is fully loaded once its file of the last stage is.
+        auto load_fiber = [this, &first_error, pinned_shard, last_stage,
+                           path = std::move(path)]() {
+          error_code ec = LoadRdb(path, pinned_shard);
+          if (!ec && pinned_shard && last_stage)
+            EngineShardSet::SetLoading(*pinned_shard, false);
+          first_error = ec;
+        };
+        load_fibers.push_back(proactor->LaunchFiber(std::move(load_fiber)));
+      }
+
+      for (auto& fiber : load_fibers) {
+        fiber.Join();
+      }
+
+      // A delta applies only on top of the fully loaded stages before it.
+      if (first_error)
+        break;
     }
 
     VLOG(1) << "Load finished";
+    load_progress_.duration_sec.store(absl::ToDoubleSeconds(absl::Now() - start),
+                                      memory_order_relaxed);
+    load_progress_.loading.store(false, memory_order_relaxed);
+    for (ShardId sid = 0; sid < shard_count(); ++sid) {
+      EngineShardSet::SetLoading(sid, false);
+    }
     service_.SwitchState(GlobalState::LOADING, GlobalState::ACTIVE);
-    ec_promise.set_value(**first_error);
+    ec_promise.set_value(*first_error);
   };
   pool.GetNextProactor()->Dispatch(std::move(load_join_fiber));
 
   return ec_future;
 }
 
+void ServerFamily::SweepIdleConnections(uint32_t idle_sec) {
+  // Sweeps a few times per idle period, so that a connection is reclaimed soon after it idles.
+  const auto period = std::chrono::seconds(max(1u, idle_sec / 4));
+  while (!is_idle_sweep_done_.WaitFor(period)) {
+    atomic_uint64_t idle{0}, memory{0}, reclaimed{0};
+    auto cb = [&](util::Connection* conn) {
+      facade::Connection* dcon = static_cast<facade::Connection*>(conn);
+      if (dcon->IdleSec() < time_t(idle_sec))
+        return;
+
+      if (dcon->ReclaimIdleMemory())
+        reclaimed.fetch_add(1, memory_order_relaxed);
+      idle.fetch_add(1, memory_order_relaxed);
+      memory.fetch_add(dcon->MemoryUsage(), memory_order_relaxed);
+    };
+    main_listener_->TraverseConnections(cb);
+
+    idle_conn_stats_.clients.store(idle.load(memory_order_relaxed), memory_order_relaxed);
+    idle_conn_stats_.memory.store(memory.load(memory_order_relaxed), memory_order_relaxed);
+    idle_conn_stats_.reclaims.fetch_add(reclaimed.load(memory_order_relaxed),
+                                        memory_order_relaxed);
+  }
+}
+
 void ServerFamily::SnapshotScheduling(const SnapshotSpec& spec) {
   const auto loop_sleep_time = std::chrono::seconds(20);
   while (true) {
@@ -550,14 +924,14 @@ void ServerFamily::SnapshotScheduling(const SnapshotSpec& spec) {
     boost::intrusive_ptr<Transaction> trans(new Transaction{cid});
     trans->InitByArgs(0, {});
 
-    GenericError ec = DoSave(false, trans.get());
+    GenericError ec = DoSave(GetFlag(FLAGS_df_snapshot_format), trans.get());
     if (ec) {
       LOG(WARNING) << "Failed to perform snapshot " << ec.Format();
     }
   }
 }
 
-error_code ServerFamily::LoadRdb(const std::string& rdb_file) {
+error_code ServerFamily::LoadRdb(const std::string& rdb_file, optional<ShardId> pinned_shard) {
   error_code ec;
   io::ReadonlyFileOrError res;
 
@@ -571,18 +945,26 @@ error_code ServerFamily::LoadRdb(const std::string& rdb_file) {
     io::FileSource fs(*res);
 
     RdbLoader loader(script_mgr());
+    if (pinned_shard)
+      loader.set_pinned_shard(*pinned_shard);
+    loader.SetProgressCb([this](size_t bytes, size_t keys) {
+      load_progress_.loaded_bytes.fetch_add(bytes, memory_order_relaxed);
+      load_progress_.loaded_keys.fetch_add(keys, memory_order_relaxed);
+    });
     ec = loader.Load(&fs);
     if (!ec) {
       LOG(INFO) << "Done loading RDB, keys loaded: " << loader.keys_loaded();
       LOG(INFO) << "Loading finished after "
                 << strings::HumanReadableElapsedTime(loader.load_time());
+
+      lock_guard lk(load_mu_);
+      loaded_journal_pos_.Merge(loader.journal_pos());
     }
   } else {
     ec = res.error();
   }
 
-  service_.SwitchState(GlobalState::LOADING, GlobalState::ACTIVE);
-
+  // Load() switches the state back once all the files are loaded.
   return ec;
 }
 
@@ -613,6 +995,23 @@ void AppendMetricHeader(string_view metric_name, string_view metric_help, Metric
   absl::StrAppend(dest, "# TYPE ", full_metric_name, " ", MetricTypeName(type), "\n");
 }
 
+// Label values escape the backslash, the double quote and the line feed.
+string EscapeLabelValue(string_view value) {
+  string res;
+  res.reserve(value.size());
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      res.push_back('\\');
+      res.push_back(c);
+    } else if (c == '\n') {
+      res.append("\\n");
+    } else {
+      res.push_back(c);
+    }
+  }
+  return res;
+}
+
 void AppendLabelTupple(absl::Span<const string_view> label_names,
                        absl::Span<const string_view> label_values, string* dest) {
   if (label_names.empty())
@@ -643,43 +1042,129 @@ void AppendMetricWithoutLabels(string_view name, string_view help, const absl::A
   AppendMetricValue(name, value, {}, {}, dest);
 }
 
-void PrintPrometheusMetrics(const Metrics& m, StringResponse* resp) {
+// Buckets are cumulative, with the upper bounds 2^k - 1 that match the histogram boundaries:
+// from 15us to about 16 seconds.
+void AppendLatencyHistogram(string_view name, string_view help, const LatencyHistogram& hist,
+                            string* dest) {
+  string bucket_name = StrCat(name, "_bucket");
+  AppendMetricHeader(name, help, MetricType::HISTOGRAM, dest);
+  for (unsigned exp = 4; exp <= 24; exp += 2) {
+    AppendMetricValue(bucket_name, hist.CountBelowPow2(exp), {"le"}, {StrCat((1ULL << exp) - 1)},
+                      dest);
+  }
+  AppendMetricValue(bucket_name, hist.count(), {"le"}, {"+Inf"}, dest);
+  AppendMetricValue(StrCat(name, "_sum"), hist.sum(), {}, {}, dest);
+  AppendMetricValue(StrCat(name, "_count"), hist.count(), {}, {}, dest);
+}
+
+using CachedStats = EngineShardSet::CachedStats;
+
+// Appends the series of the metric of every shard, followed by their sum if total_name is set.
+void AppendShardMetric(string_view name, string_view total_name, string_view help,
+                       MetricType type, atomic_uint64_t CachedStats::*field, string* dest) {
+  const vector<CachedStats>& stats = EngineShardSet::GetCachedStats();
+  uint64_t total = 0;
+
+  AppendMetricHeader(name, help, type, dest);
+  for (size_t i = 0; i < stats.size(); ++i) {
+    uint64_t value = (stats[i].*field).load(memory_order_relaxed);
+    AppendMetricValue(name, value, {"shard"}, {StrCat(i)}, dest);
+    total += value;
+  }
+
+  if (!total_name.empty())
+    AppendMetricWithoutLabels(total_name, help, total, type, dest);
+}
+
+// Prints the metrics from the stats that the threads and the shards publish periodically, so that
+// a scrape does not hop into the shards and does not delay their transactions.
+void PrintPrometheusMetrics(time_t uptime, const optional<Replica::Info>& replica,
+                            StringResponse* resp) {
+  const ServerState::PublishedStats ps = ServerState::GetPublishedStats();
+  string* dest = &resp->body();
+
   // Server metrics
-  AppendMetricWithoutLabels("up", "", 1, MetricType::GAUGE, &resp->body());
-  AppendMetricWithoutLabels("uptime_in_seconds", "", m.uptime, MetricType::GAUGE, &resp->body());
+  AppendMetricWithoutLabels("up", "", 1, MetricType::GAUGE, dest);
+  AppendMetricWithoutLabels("uptime_in_seconds", "", uptime, MetricType::GAUGE, dest);
 
   // Clients metrics
-  AppendMetricWithoutLabels("connected_clients", "", m.conn_stats.num_conns, MetricType::GAUGE,
-                            &resp->body());
-  AppendMetricWithoutLabels("client_read_buf_capacity", "", m.conn_stats.read_buf_capacity,
-                            MetricType::GAUGE, &resp->body());
-  AppendMetricWithoutLabels("blocked_clients", "", m.conn_stats.num_blocked_clients,
-                            MetricType::GAUGE, &resp->body());
+  AppendMetricWithoutLabels("connected_clients", "", ps.num_conns, MetricType::GAUGE, dest);
+  AppendMetricWithoutLabels("client_read_buf_capacity", "", ps.read_buf_capacity,
+                            MetricType::GAUGE, dest);
+  AppendMetricWithoutLabels("blocked_clients", "", ps.num_blocked_clients, MetricType::GAUGE,
+                            dest);
 
   // Memory metrics
-  AppendMetricWithoutLabels("memory_used_bytes", "", m.heap_used_bytes, MetricType::GAUGE,
-                            &resp->body());
+  AppendMetricWithoutLabels("memory_used_bytes", "", used_mem_current.load(memory_order_relaxed),
+                            MetricType::GAUGE, dest);
   AppendMetricWithoutLabels("memory_used_peak_bytes", "", used_mem_peak.load(memory_order_relaxed),
-                            MetricType::GAUGE, &resp->body());
+                            MetricType::GAUGE, dest);
   AppendMetricWithoutLabels("comitted_memory", "", GetMallocCurrentCommitted(), MetricType::GAUGE,
-                            &resp->body());
-  AppendMetricWithoutLabels("memory_max_bytes", "", max_memory_limit, MetricType::GAUGE,
-                            &resp->body());
-
-  AppendMetricWithoutLabels("commands_processed_total", "", m.conn_stats.command_cnt,
-                            MetricType::COUNTER, &resp->body());
+                            dest);
+  AppendMetricWithoutLabels("memory_max_bytes", "", max_memory_limit, MetricType::GAUGE, dest);
+  AppendShardMetric("shard_memory_used_bytes", "", "Memory used by the shard", MetricType::GAUGE,
+                    &CachedStats::used_memory, dest);
+
+  AppendMetricWithoutLabels("commands_processed_total", "", ps.command_cnt, MetricType::COUNTER,
+                            dest);
+  AppendShardMetric("shard_ops_total", "", "Transaction callbacks that ran in the shard",
+                    MetricType::COUNTER, &CachedStats::tx_runs, dest);
+
+  // Shard saturation
+  AppendShardMetric("shard_txq_length", "", "Transactions in the queue of the shard",
+                    MetricType::GAUGE, &CachedStats::txq_len, dest);
+  AppendShardMetric("shard_txq_max_length", "", "The longest queue since CONFIG RESETSTAT",
+                    MetricType::GAUGE, &CachedStats::txq_max_len, dest);
+  AppendShardMetric("shard_hop_backlog", "", "Hops that wait for the shard", MetricType::GAUGE,
+                    &CachedStats::hop_backlog, dest);
+  AppendShardMetric("shard_busy_usec_total", "", "CPU time of the shard thread",
+                    MetricType::COUNTER, &CachedStats::busy_usec, dest);
+  AppendShardMetric("shard_queued_hops_total", "", "Hops that went through the shard queue",
+                    MetricType::COUNTER, &CachedStats::queued_hops, dest);
+  AppendShardMetric("shard_hop_wait_usec_total", "", "Time of the queued hops until they ran",
+                    MetricType::COUNTER, &CachedStats::hop_wait_usec, dest);
+  AppendShardMetric("shard_ooo_runs_total", "", "Transactions that ran out of order",
+                    MetricType::COUNTER, &CachedStats::ooo_runs, dest);
+  AppendShardMetric("shard_quick_runs_total", "", "Single shard transactions that ran quickly",
+                    MetricType::COUNTER, &CachedStats::quick_runs, dest);
 
   // Net metrics
-  AppendMetricWithoutLabels("net_input_bytes_total", "", m.conn_stats.io_read_bytes,
-                            MetricType::COUNTER, &resp->body());
-  AppendMetricWithoutLabels("net_output_bytes_total", "", m.conn_stats.io_write_bytes,
-                            MetricType::COUNTER, &resp->body());
+  AppendMetricWithoutLabels("net_input_bytes_total", "", ps.io_read_bytes, MetricType::COUNTER,
+                            dest);
+  AppendMetricWithoutLabels("net_output_bytes_total", "", ps.io_write_bytes, MetricType::COUNTER,
+                            dest);
 
   // DB stats
-  AppendMetricWithoutLabels("expired_keys_total", "", m.events.expired_keys, MetricType::COUNTER,
-                            &resp->body());
-  AppendMetricWithoutLabels("evicted_keys_total", "", m.events.evicted_keys, MetricType::COUNTER,
-                            &resp->body());
+  AppendShardMetric("shard_keys", "", "Number of keys in the shard", MetricType::GAUGE,
+                    &CachedStats::keys, dest);
+  AppendShardMetric("shard_expired_keys_total", "expired_keys_total", "", MetricType::COUNTER,
+                    &CachedStats::expired_keys, dest);
+  AppendShardMetric("shard_evicted_keys_total", "evicted_keys_total", "", MetricType::COUNTER,
+                    &CachedStats::evicted_keys, dest);
+  AppendShardMetric("shard_keyspace_hits_total", "keyspace_hits_total", "", MetricType::COUNTER,
+                    &CachedStats::hits, dest);
+  AppendShardMetric("shard_keyspace_misses_total", "keyspace_misses_total", "",
+                    MetricType::COUNTER, &CachedStats::misses, dest);
+
+  vector<pair<size_t, size_t>> db_keys;
+  TieredStats ts;
+  vector<HotKeys::Key> hot_keys;
+  for (const CachedStats& stats : EngineShardSet::GetCachedStats()) {
+    lock_guard lk(stats.mu);
+    hot_keys.insert(hot_keys.end(), stats.hot_keys.begin(), stats.hot_keys.end());
+    db_keys.resize(max(db_keys.size(), stats.db_keys.size()));
+    for (size_t i = 0; i < stats.db_keys.size(); ++i) {
+      db_keys[i].first += stats.db_keys[i].first;
+      db_keys[i].second += stats.db_keys[i].second;
+    }
+    if (stats.tiered.num_devices > 0) {
+      ts.num_devices = stats.tiered.num_devices;
+      ts.read_latency += stats.tiered.read_latency;
+      ts.write_latency += stats.tiered.write_latency;
+      ts.pending_wait_latency += stats.tiered.pending_wait_latency;
+      ts.grow_latency += stats.tiered.grow_latency;
+    }
+  }
 
   string db_key_metrics;
   string db_key_expire_metrics;
@@ -688,14 +1173,63 @@ void PrintPrometheusMetrics(const Metrics& m, StringResponse* resp) {
   AppendMetricHeader("db_keys_expiring", "Total number of expiring keys by DB", MetricType::GAUGE,
                      &db_key_expire_metrics);
 
-  for (size_t i = 0; i < m.db.size(); ++i) {
-    AppendMetricValue("db_keys", m.db[i].key_count, {"db"}, {StrCat("db", i)}, &db_key_metrics);
-    AppendMetricValue("db_keys_expiring", m.db[i].expire_count, {"db"}, {StrCat("db", i)},
+  for (size_t i = 0; i < db_keys.size(); ++i) {
+    AppendMetricValue("db_keys", db_keys[i].first, {"db"}, {StrCat("db", i)}, &db_key_metrics);
+    AppendMetricValue("db_keys_expiring", db_keys[i].second, {"db"}, {StrCat("db", i)},
                       &db_key_expire_metrics);
   }
 
-  absl::StrAppend(&resp->body(), db_key_metrics);
-  absl::StrAppend(&resp->body(), db_key_expire_metrics);
+  absl::StrAppend(dest, db_key_metrics);
+  absl::StrAppend(dest, db_key_expire_metrics);
+
+  // The keys are label values, so only a bounded number of the hottest ones is exported.
+  if (!hot_keys.empty()) {
+    constexpr size_t kMaxHotKeys = EngineShardSet::kCachedHotKeys;
+    auto cmp = [](const auto& l, const auto& r) { return l.ops_per_sec > r.ops_per_sec; };
+    size_t num_keys = min(hot_keys.size(), kMaxHotKeys);
+    partial_sort(hot_keys.begin(), hot_keys.begin() + num_keys, hot_keys.end(), cmp);
+
+    AppendMetricHeader("hot_key_ops_per_sec", "Estimated rate of the hottest keys",
+                       MetricType::GAUGE, dest);
+    for (size_t i = 0; i < num_keys; ++i) {
+      const HotKeys::Key& k = hot_keys[i];
+      AppendMetricValue("hot_key_ops_per_sec", k.ops_per_sec, {"db", "key"},
+                        {StrCat("db", k.db), EscapeLabelValue(k.key)}, dest);
+    }
+  }
+
+  // Tiered storage metrics
+  if (ts.num_devices > 0) {
+    AppendShardMetric("shard_tiered_reads_total", "", "Reads from the backing file",
+                      MetricType::COUNTER, &CachedStats::tiered_reads, dest);
+    AppendShardMetric("shard_tiered_writes_total", "", "Writes into the backing file",
+                      MetricType::COUNTER, &CachedStats::tiered_writes, dest);
+    AppendShardMetric("shard_tiered_reserved_bytes", "", "Storage reserved by the stored values",
+                      MetricType::GAUGE, &CachedStats::tiered_reserved, dest);
+    AppendLatencyHistogram("tiered_read_latency_usec", "Latency of reads from the backing file",
+                           ts.read_latency, dest);
+    AppendLatencyHistogram("tiered_write_latency_usec", "Latency of writes into the backing file",
+                           ts.write_latency, dest);
+    AppendLatencyHistogram("tiered_pending_wait_latency_usec",
+                           "Time writes wait for the number of pending writes to drop",
+                           ts.pending_wait_latency, dest);
+    AppendLatencyHistogram("tiered_grow_latency_usec", "Latency of growing the backing file",
+                           ts.grow_latency, dest);
+  }
+
+  // Replication metrics. A replica compares the journal positions of its shards with these of
+  // the master to tell how far behind it is.
+  AppendMetricWithoutLabels("connected_slaves", "", ps.num_replicas, MetricType::GAUGE, dest);
+  AppendShardMetric("shard_journal_lsn", "", "Last journal entry of the shard", MetricType::GAUGE,
+                    &CachedStats::journal_lsn, dest);
+  if (replica) {
+    AppendMetricWithoutLabels("master_link_up", "", int(replica->master_link_established),
+                              MetricType::GAUGE, dest);
+    AppendMetricWithoutLabels("master_last_io_seconds_ago", "", replica->master_last_io_sec,
+                              MetricType::GAUGE, dest);
+    AppendMetricWithoutLabels("master_sync_in_progress", "", int(replica->sync_in_progress),
+                              MetricType::GAUGE, dest);
+  }
 }
 
 void ServerFamily::ConfigureMetrics(util::HttpListenerBase* http_base) {
@@ -704,7 +1238,14 @@ void ServerFamily::ConfigureMetrics(util::HttpListenerBase* http_base) {
 
   auto cb = [this](const util::http::QueryArgs& args, util::HttpContext* send) {
     StringResponse resp = util::http::MakeStringResponse(boost::beast::http::status::ok);
-    PrintPrometheusMetrics(this->GetMetrics(), &resp);
+
+    // The replica is the only source that is not published, it is read from its own thread.
+    optional<Replica::Info> replica_info;
+    if (!ServerState::tlocal()->is_master) {
+      auto replica_ptr = replica_;
+      replica_info = replica_ptr->GetInfo();
+    }
+    PrintPrometheusMetrics(time(NULL) - start_time_, replica_info, &resp);
 
     return send->Invoke(std::move(resp));
   };
@@ -783,35 +1324,65 @@ static void RunStage(bool new_version, std::function<void(unsigned)> cb) {
   }
 };
 
-using PartialSaveOpts =
-    tuple<const fs::path& /*filename*/, const fs::path& /*path*/, absl::Time /*start*/>;
+// Returns the total latency in usec and the number of the tiered storage IOs of all the shards.
+pair<size_t, size_t> TieredIoTotals() {
+  size_t latency_usec = 0, ios = 0;
+  for (const auto& stats : EngineShardSet::GetCachedStats()) {
+    lock_guard lk(stats.mu);
+    for (size_t i = 0; i < stats.tiered.num_devices; ++i) {
+      latency_usec += stats.tiered.devices[i].latency_usec;
+      ios += stats.tiered.devices[i].ios;
+    }
+  }
+  return {latency_usec, ios};
+}
+
+// Adjusts the limiter to the average latency of the tiered storage IO until done is notified.
+void AdjustSnapshotRate(IoRateLimiter* limiter, util::fibers_ext::Done* done) {
+  const size_t target_usec = GetFlag(FLAGS_snapshot_io_latency_usec);
+  pair<size_t, size_t> prev = TieredIoTotals();
+  while (!done->WaitFor(100ms)) {
+    pair<size_t, size_t> cur = TieredIoTotals();
+    size_t ios = cur.second - prev.second;
+    limiter->Adjust(ios > 0 && (cur.first - prev.first) / ios > target_usec);
+    prev = cur;
+  }
+}
+
+using PartialSaveOpts = tuple<const fs::path& /*filename*/, const fs::path& /*path*/,
+                              absl::Time /*start*/, const string& /*delta*/>;
 
 // Start saving a single snapshot of a multi-file dfly snapshot.
 // If shard is null, then this is the summary file.
+// delta is the "delta-<seq>" part of the names of the delta files, empty for a full snapshot.
 error_code DoPartialSave(PartialSaveOpts opts, const dfly::StringVec& scripts,
                          RdbSnapshot* snapshot, EngineShard* shard) {
-  auto [filename, path, now] = opts;
+  auto [filename, path, now, delta] = opts;
   // Construct resulting filename.
-  fs::path full_filename = filename;
-  if (shard == nullptr) {
-    ExtendFilename(now, "summary", &full_filename);
-  } else {
-    ExtendFilenameWithShard(now, shard->shard_id(), &full_filename);
+  string postfix =
+      shard == nullptr ? string{"summary"} : StrCat(absl::Dec(shard->shard_id(), absl::kZeroPad4));
+  if (!delta.empty()) {
+    postfix = StrCat(delta, "-", postfix);
   }
+  fs::path full_filename = filename;
+  ExtendFilename(now, postfix, &full_filename);
   fs::path full_path = path / full_filename;  // use / operator to concatenate paths.
 
   // Start rdb saving.
-  SaveMode mode = shard == nullptr ? SaveMode::SUMMARY : SaveMode::SINGLE_SHARD;
+  SaveMode mode = SaveMode::SUMMARY;
+  if (shard) {
+    mode = delta.empty() ? SaveMode::SINGLE_SHARD : SaveMode::SINGLE_SHARD_DELTA;
+  }
   error_code local_ec = snapshot->Start(mode, full_path.generic_string(), scripts);
 
-  if (!local_ec && mode == SaveMode::SINGLE_SHARD) {
+  if (!local_ec && shard) {
     snapshot->StartInShard(shard);
   }
 
   return local_ec;
 }
 
-GenericError ServerFamily::DoSave(bool new_version, Transaction* trans) {
+GenericError ServerFamily::DoSave(bool new_version, Transaction* trans, bool delta) {
   fs::path dir_path(GetFlag(FLAGS_dir));
   AggregateGenericError ec;
 
@@ -832,6 +1403,13 @@ GenericError ServerFamily::DoSave(bool new_version, Transaction* trans) {
     service_.SwitchState(GlobalState::SAVING, GlobalState::ACTIVE);
   };
 
+  // A delta is based on the previous dragonfly snapshot, either the full one or a delta.
+  bool track_deltas = new_version && GetFlag(FLAGS_df_snapshot_deltas);
+  if (delta && (!track_deltas || !delta_base_time_)) {
+    return {make_error_code(errc::operation_not_permitted),
+            "no base snapshot for a delta, save a full snapshot with df_snapshot_deltas first"};
+  }
+
   const auto& dbfilename = GetFlag(FLAGS_dbfilename);
   fs::path filename = dbfilename.empty() ? "dump" : dbfilename;
   fs::path path = dir_path;
@@ -839,6 +1417,12 @@ GenericError ServerFamily::DoSave(bool new_version, Transaction* trans) {
   absl::Time start = absl::Now();
   shared_ptr<LastSaveInfo> save_info;
 
+  // Shared by all the files of the snapshot, they are written to the same device.
+  unique_ptr<IoRateLimiter> limiter;
+  if (uint64_t rate = GetFlag(FLAGS_snapshot_write_bytes_per_sec); rate > 0) {
+    limiter.reset(new IoRateLimiter(rate));
+  }
+
   vector<unique_ptr<RdbSnapshot>> snapshots;
   absl::flat_hash_map<string_view, size_t> rdb_name_map;
   fibers::mutex mu;  // guards rdb_name_map
@@ -862,9 +1446,15 @@ GenericError ServerFamily::DoSave(bool new_version, Transaction* trans) {
     }
   };
 
+  // The files of a delta are named after its base.
+  absl::Time name_time = delta ? *delta_base_time_ : start;
+  string delta_name =
+      delta ? StrCat("delta-", absl::Dec(delta_seq_ + 1, absl::kZeroPad4)) : string{};
+  vector<vector<DbIndex>> flushed_dbs(shard_set->size());
+
   // Start snapshots.
   if (new_version) {
-    auto file_opts = make_tuple(cref(filename), cref(path), start);
+    auto file_opts = make_tuple(cref(filename), cref(path), name_time, cref(delta_name));
 
     // In the new version (.dfs) we store a file for every shard and one more summary file.
     // Summary file is always last in snapshots array.
@@ -874,7 +1464,7 @@ GenericError ServerFamily::DoSave(bool new_version, Transaction* trans) {
     {
       const auto scripts = script_mgr_->GetLuaScripts();
       auto& snapshot = snapshots[shard_set->size()];
-      snapshot.reset(new RdbSnapshot(fq_threadpool_.get()));
+      snapshot.reset(new RdbSnapshot(fq_threadpool_.get(), limiter.get()));
       if (auto local_ec = DoPartialSave(file_opts, scripts, snapshot.get(), nullptr); local_ec) {
         ec = local_ec;
         snapshot.reset();
@@ -883,8 +1473,14 @@ GenericError ServerFamily::DoSave(bool new_version, Transaction* trans) {
 
     // Save shard files.
     auto cb = [&](Transaction* t, EngineShard* shard) {
+      // Collected in the same hop that starts the epoch of the next delta.
+      if (delta) {
+        DCHECK(shard->db_slice().HasDeltaEpoch());
+        flushed_dbs[shard->shard_id()] = shard->db_slice().delta_flushed_dbs();
+      }
+
       auto& snapshot = snapshots[shard->shard_id()];
-      snapshot.reset(new RdbSnapshot(fq_threadpool_.get()));
+      snapshot.reset(new RdbSnapshot(fq_threadpool_.get(), limiter.get()));
       if (auto local_ec = DoPartialSave(file_opts, {}, snapshot.get(), shard); local_ec) {
         ec = local_ec;
         snapshot.reset();
@@ -893,13 +1489,25 @@ GenericError ServerFamily::DoSave(bool new_version, Transaction* trans) {
     };
 
     trans->ScheduleSingleHop(std::move(cb));
+
+    // The summary is written by SaveBody, the flushes are loaded before the shard files.
+    auto& summary = snapshots[shard_set->size()];
+    if (delta && summary) {
+      vector<DbIndex> dbs;
+      for (const auto& shard_dbs : flushed_dbs) {
+        dbs.insert(dbs.end(), shard_dbs.begin(), shard_dbs.end());
+      }
+      sort(dbs.begin(), dbs.end());
+      dbs.erase(unique(dbs.begin(), dbs.end()), dbs.end());
+      ec = summary->SaveFlushedDbs(dbs);
+    }
   } else {
     snapshots.resize(1);
 
     ExtendFilenameWithShard(start, -1, &filename);
     path /= filename;  // use / operator to concatenate paths.
 
-    snapshots[0].reset(new RdbSnapshot(fq_threadpool_.get()));
+    snapshots[0].reset(new RdbSnapshot(fq_threadpool_.get(), limiter.get()));
     const auto lua_scripts = script_mgr_->GetLuaScripts();
     ec = snapshots[0]->Start(SaveMode::RDB, path.generic_string(), lua_scripts);
 
@@ -917,16 +1525,51 @@ GenericError ServerFamily::DoSave(bool new_version, Transaction* trans) {
 
   is_saving_.store(true, memory_order_relaxed);
 
+  util::fibers_ext::Done rate_done;
+  util::fibers_ext::Fiber rate_fiber;
+  if (limiter && GetFlag(FLAGS_snapshot_io_latency_usec) > 0) {
+    rate_fiber = ProactorBase::me()->LaunchFiber(
+        [&limiter, &rate_done] { AdjustSnapshotRate(limiter.get(), &rate_done); });
+  }
+
   // Perform snapshot serialization, block the current fiber until it completes.
   // TODO: Add cancellation in case of error.
   RunStage(new_version, save_cb);
 
+  if (rate_fiber.IsJoinable()) {
+    rate_done.Notify();
+    rate_fiber.Join();
+  }
+
   is_saving_.store(false, memory_order_relaxed);
 
   RunStage(new_version, close_cb);
 
+  // Deltas of an earlier snapshot saved in the same second would follow this one.
+  if (new_version && !delta && !ec) {
+    RemoveDeltaFiles(start, "delta-????", path / filename);
+  }
+
+  if (track_deltas) {
+    if (!ec) {
+      if (delta) {
+        ++delta_seq_;
+      } else {
+        delta_base_time_ = start;
+        delta_seq_ = 0;
+      }
+    } else {
+      // The shards may have started epochs that no file is based on.
+      shard_set->RunBriefInParallel([](EngineShard* es) { es->db_slice().StopDeltaEpochs(); });
+      delta_base_time_.reset();
+      if (delta) {
+        RemoveDeltaFiles(name_time, delta_name, path / filename);
+      }
+    }
+  }
+
   if (new_version) {
-    ExtendFilename(start, "summary", &filename);
+    ExtendFilename(name_time, delta ? StrCat(delta_name, "-summary") : "summary", &filename);
     path /= filename;
   }
 
@@ -955,14 +1598,14 @@ GenericError ServerFamily::DoSave(bool new_version, Transaction* trans) {
   return *ec;
 }
 
-error_code ServerFamily::Drakarys(Transaction* transaction, DbIndex db_ind) {
+error_code ServerFamily::Drakarys(Transaction* transaction, DbIndex db_ind, bool async) {
   VLOG(1) << "Drakarys";
 
   transaction->Schedule();  // TODO: to convert to ScheduleSingleHop ?
 
   transaction->Execute(
-      [db_ind](Transaction* t, EngineShard* shard) {
-        shard->db_slice().FlushDb(db_ind);
+      [db_ind, async](Transaction* t, EngineShard* shard) {
+        shard->db_slice().FlushDb(db_ind, async);
         return OpStatus::OK;
       },
       true);
@@ -975,37 +1618,59 @@ shared_ptr<const LastSaveInfo> ServerFamily::GetLastSaveInfo() const {
   return last_save_info_;
 }
 
-void ServerFamily::DbSize(CmdArgList args, ConnectionContext* cntx) {
-  atomic_ulong num_keys{0};
-
-  shard_set->RunBriefInParallel(
-      [&](EngineShard* shard) {
-        auto db_size = shard->db_slice().DbSize(cntx->conn_state.db_index);
-        num_keys.fetch_add(db_size, memory_order_relaxed);
-      },
-      [](ShardId) { return true; });
+journal::Position ServerFamily::GetLoadedJournalPos() const {
+  lock_guard lk(load_mu_);
+  return loaded_journal_pos_;
+}
 
-  return (*cntx)->SendLong(num_keys.load(memory_order_relaxed));
+// The shards publish their sizes on every change, hence DBSIZE does not hop into them.
+void ServerFamily::DbSize(CmdArgList args, ConnectionContext* cntx) {
+  return (*cntx)->SendLong(EngineShardSet::DbSize(cntx->conn_state.db_index));
 }
 
 void ServerFamily::BreakOnShutdown() {
   dfly_cmd_->BreakOnShutdown();
 }
 
+// Parses the optional ASYNC|SYNC argument of FLUSHDB and FLUSHALL. The tables are freed in the
+// background unless SYNC is given.
+static bool ParseFlushMode(CmdArgList args, bool* async) {
+  *async = true;
+  if (args.size() == 1)
+    return true;
+  if (args.size() > 2)
+    return false;
+
+  ToUpper(&args[1]);
+  string_view mode = ArgS(args, 1);
+  if (mode != "ASYNC" && mode != "SYNC")
+    return false;
+
+  *async = mode == "ASYNC";
+  return true;
+}
+
 void ServerFamily::FlushDb(CmdArgList args, ConnectionContext* cntx) {
+  bool async;
+  if (!ParseFlushMode(args, &async)) {
+    (*cntx)->SendError(kSyntaxErr);
+    return;
+  }
+
   DCHECK(cntx->transaction);
-  Drakarys(cntx->transaction, cntx->transaction->db_index());
+  Drakarys(cntx->transaction, cntx->transaction->db_index(), async);
   cntx->reply_builder()->SendOk();
 }
 
 void ServerFamily::FlushAll(CmdArgList args, ConnectionContext* cntx) {
-  if (args.size() > 1) {
+  bool async;
+  if (!ParseFlushMode(args, &async)) {
     (*cntx)->SendError(kSyntaxErr);
     return;
   }
 
   DCHECK(cntx->transaction);
-  Drakarys(cntx->transaction, DbSlice::kDbAll);
+  Drakarys(cntx->transaction, DbSlice::kDbAll, async);
   (*cntx)->SendOk();
 }
 
@@ -1067,6 +1732,128 @@ void ServerFamily::Client(CmdArgList args, ConnectionContext* cntx) {
     return (*cntx)->SendBulkString(result);
   }
 
+  // CLIENT TRACKING ON|OFF [BCAST] [PREFIX prefix ...]
+  if (sub_cmd == "TRACKING" && args.size() >= 3) {
+    ToUpper(&args[2]);
+    string_view mode = ArgS(args, 2);
+    if (mode == "OFF" && args.size() == 3) {
+      cntx->DisableTracking();
+      return (*cntx)->SendOk();
+    }
+    if (mode != "ON")
+      return (*cntx)->SendError(kSyntaxErr);
+
+    bool bcast = false;
+    vector<string> prefixes;
+    for (size_t i = 3; i < args.size(); ++i) {
+      ToUpper(&args[i]);
+      string_view opt = ArgS(args, i);
+      if (opt == "BCAST") {
+        bcast = true;
+      } else if (opt == "PREFIX" && i + 1 < args.size()) {
+        prefixes.emplace_back(ArgS(args, ++i));
+      } else {
+        // REDIRECT, OPTIN, OPTOUT and NOLOOP are not supported.
+        return (*cntx)->SendError(kSyntaxErr);
+      }
+    }
+
+    if (!bcast && !prefixes.empty())
+      return (*cntx)->SendError("PREFIX option requires BCAST mode to be enabled");
+
+    // The invalidation messages are pushed into the connection, hence there is no RESP2 mode.
+    if (!(*cntx)->IsResp3())
+      return (*cntx)->SendError("client tracking requires RESP3, switch the protocol with HELLO 3");
+
+    cntx->EnableTracking(bcast, std::move(prefixes));
+    return (*cntx)->SendOk();
+  }
+
+  // CLIENT READMODE RELAXED|STRICT, see --relaxed_read_commands.
+  if (sub_cmd == "READMODE" && args.size() == 3) {
+    ToUpper(&args[2]);
+    string_view mode = ArgS(args, 2);
+    if (mode != "RELAXED" && mode != "STRICT")
+      return (*cntx)->SendError(kSyntaxErr);
+
+    cntx->conn_state.relaxed_reads = (mode == "RELAXED");
+    return (*cntx)->SendOk();
+  }
+
+  // CLIENT LSNTOKEN, on the master. Returns the token of the writes of the connection so far,
+  // <master id>:<lsn>,... with the LSN that follows its last write in every shard.
+  if (sub_cmd == "LSNTOKEN" && args.size() == 2) {
+    if (!ServerState::tlocal()->is_master)
+      return (*cntx)->SendError("LSN tokens are issued by the master");
+
+    vector<LSN> lsns = cntx->conn_state.write_lsns;
+    lsns.resize(shard_set->size());
+    return (*cntx)->SendBulkString(StrCat(master_id_, ":", absl::StrJoin(lsns, ",")));
+  }
+
+  // CLIENT READAFTER <token> [TIMEOUT <ms>] | OFF
+  // On a replica, the following reads of the connection wait until the replica applied the
+  // writes of the token in the shards of their keys, see AwaitAppliedLsns.
+  if (sub_cmd == "READAFTER" && (args.size() == 3 || args.size() == 5)) {
+    string_view token = ArgS(args, 2);
+    if (args.size() == 3 && absl::EqualsIgnoreCase(token, "OFF")) {
+      cntx->conn_state.read_after.reset();
+      return (*cntx)->SendOk();
+    }
+
+    auto read_after = make_unique<ConnectionState::ReadAfter>();
+    read_after->timeout_ms = GetFlag(FLAGS_read_after_timeout_ms);
+    if (args.size() == 5) {
+      ToUpper(&args[3]);
+      if (ArgS(args, 3) != "TIMEOUT" || !absl::SimpleAtoi(ArgS(args, 4), &read_after->timeout_ms))
+        return (*cntx)->SendError(kSyntaxErr);
+    }
+
+    size_t pos = token.find(':');
+    bool valid = pos != string_view::npos && pos > 0;
+    if (valid) {
+      read_after->master_id = token.substr(0, pos);
+      for (string_view lsn : absl::StrSplit(token.substr(pos + 1), ',')) {
+        valid = absl::SimpleAtoi(lsn, &read_after->lsns.emplace_back());
+        if (!valid)
+          break;
+      }
+    }
+    if (!valid)
+      return (*cntx)->SendError("Invalid LSN token");
+
+    cntx->conn_state.read_after = std::move(read_after);
+    return (*cntx)->SendOk();
+  }
+
+  // CLIENT THROTTLE <client id> <ops per sec> <cpu usec per sec>
+  // Overrides --client_ops_limit and --client_cpu_limit for the connection, 0 restores them.
+  if (sub_cmd == "THROTTLE" && args.size() == 5) {
+    uint32_t client_id, ops_limit, cpu_limit;
+    if (!absl::SimpleAtoi(ArgS(args, 2), &client_id) ||
+        !absl::SimpleAtoi(ArgS(args, 3), &ops_limit) ||
+        !absl::SimpleAtoi(ArgS(args, 4), &cpu_limit)) {
+      return (*cntx)->SendError(kInvalidIntErr);
+    }
+
+    atomic_bool found{false};
+    auto cb = [&](util::Connection* conn) {
+      facade::Connection* dcon = static_cast<facade::Connection*>(conn);
+      if (dcon->GetClientId() != client_id || !dcon->cntx())
+        return;
+
+      auto& throttle = static_cast<ConnectionContext*>(dcon->cntx())->conn_state.throttle;
+      throttle.ops_limit = ops_limit;
+      throttle.cpu_limit_usec = cpu_limit;
+      found.store(true, memory_order_relaxed);
+    };
+
+    main_listener_->TraverseConnections(cb);
+    if (!found.load(memory_order_relaxed))
+      return (*cntx)->SendError("No such client");
+    return (*cntx)->SendOk();
+  }
+
   LOG_FIRST_N(ERROR, 10) << "Subcommand " << sub_cmd << " not supported";
   return (*cntx)->SendError(UnknownSubCmd(sub_cmd, "CLIENT"), kSyntaxErrType);
 }
@@ -1076,10 +1863,77 @@ void ServerFamily::Config(CmdArgList args, ConnectionContext* cntx) {
   string_view sub_cmd = ArgS(args, 1);
 
   if (sub_cmd == "SET") {
+    // CONFIG SET db-maxmemory <db> <bytes>, 0 bytes removes the quota.
+    if (args.size() >= 3 && absl::EqualsIgnoreCase(ArgS(args, 2), "db-maxmemory")) {
+      if (args.size() != 5)
+        return (*cntx)->SendError(WrongNumArgsError("config set db-maxmemory"));
+
+      uint32_t db_ind;
+      int64_t bytes;
+      if (!absl::SimpleAtoi(ArgS(args, 3), &db_ind))
+        return (*cntx)->SendError(kInvalidIntErr);
+      if (db_ind >= GetFlag(FLAGS_dbnum))
+        return (*cntx)->SendError(kDbIndOutOfRangeErr);
+      if (!ParseHumanReadableBytes(ArgS(args, 4), &bytes) || bytes < 0)
+        return (*cntx)->SendError(kInvalidIntErr);
+
+      shard_set->RunBriefInParallel(
+          [&](EngineShard* shard) { shard->db_slice().SetMemoryQuota(db_ind, bytes); });
+    }
+
+    // CONFIG SET maxmemory-policy <policy>
+    if (args.size() >= 3 && absl::EqualsIgnoreCase(ArgS(args, 2), "maxmemory-policy")) {
+      if (args.size() != 4)
+        return (*cntx)->SendError(WrongNumArgsError("config set maxmemory-policy"));
+
+      optional<EvictionPolicy> policy = ParseEvictionPolicy(ArgS(args, 3));
+      if (!policy)
+        return (*cntx)->SendError(absl::StrCat("unknown eviction policy ", ArgS(args, 3)));
+
+      shard_set->RunBriefInParallel(
+          [&](EngineShard* shard) { shard->db_slice().SetEvictionPolicy(*policy); });
+    }
+
+    // CONFIG SET notify-keyspace-events <classes>
+    if (args.size() >= 3 && absl::EqualsIgnoreCase(ArgS(args, 2), "notify-keyspace-events")) {
+      if (args.size() != 4)
+        return (*cntx)->SendError(WrongNumArgsError("config set notify-keyspace-events"));
+
+      optional<uint32_t> classes = KeyspaceNotifier::ParseClasses(ArgS(args, 3));
+      if (!classes)
+        return (*cntx)->SendError("Invalid event class character. Use 'Ag$lshzxetKEn'.");
+
+      shard_set->RunBriefInParallel(
+          [&](EngineShard* shard) { shard->db_slice().keyspace_notifier().SetClasses(*classes); });
+    }
     return (*cntx)->SendOk();
   } else if (sub_cmd == "GET" && args.size() == 3) {
     string_view param = ArgS(args, 2);
-    string_view res[2] = {param, "tbd"};
+    string value = "tbd";
+
+    if (absl::EqualsIgnoreCase(param, "db-maxmemory")) {
+      // "<db> <bytes>" pairs separated by spaces, like the "save" option of redis.
+      value = shard_set->Await(0, [] {
+        const DbSlice& db_slice = EngineShard::tlocal()->db_slice();
+        string res;
+        for (DbIndex i = 0; i < GetFlag(FLAGS_dbnum); ++i) {
+          if (size_t quota = db_slice.memory_quota(i); quota > 0)
+            absl::StrAppend(&res, res.empty() ? "" : " ", i, " ", quota);
+        }
+        return res;
+      });
+    } else if (absl::EqualsIgnoreCase(param, "notify-keyspace-events")) {
+      value = shard_set->Await(0, [] {
+        uint32_t classes = EngineShard::tlocal()->db_slice().keyspace_notifier().classes();
+        return KeyspaceNotifier::FormatClasses(classes);
+      });
+    } else if (absl::EqualsIgnoreCase(param, "maxmemory-policy")) {
+      value = shard_set->Await(0, [] {
+        return string{EvictionPolicyName(EngineShard::tlocal()->db_slice().eviction_policy())};
+      });
+    }
+
+    string_view res[2] = {param, value};
 
     return (*cntx)->SendStringArr(res);
   } else if (sub_cmd == "RESETSTAT") {
@@ -1087,8 +1941,12 @@ void ServerFamily::Config(CmdArgList args, ConnectionContext* cntx) {
       auto* stats = ServerState::tl_connection_stats();
       stats->cmd_count_map.clear();
       stats->err_count_map.clear();
+      ServerState::tlocal()->ResetTxLatency();
+      ServerState::tlocal()->ResetSlowLog();
       stats->command_cnt = 0;
       stats->async_writes_cnt = 0;
+      if (EngineShard* shard = EngineShard::tlocal())
+        shard->ResetMaxStats();
     });
     return (*cntx)->SendOk();
   } else {
@@ -1114,7 +1972,8 @@ void ServerFamily::Memory(CmdArgList args, ConnectionContext* cntx) {
 
 void ServerFamily::Save(CmdArgList args, ConnectionContext* cntx) {
   string err_detail;
-  bool new_version = false;
+  bool new_version = GetFlag(FLAGS_df_snapshot_format);
+  bool delta = false;
   if (args.size() > 2) {
     return (*cntx)->SendError(kSyntaxErr);
   }
@@ -1124,12 +1983,17 @@ void ServerFamily::Save(CmdArgList args, ConnectionContext* cntx) {
     string_view sub_cmd = ArgS(args, 1);
     if (sub_cmd == "DF") {
       new_version = true;
+    } else if (sub_cmd == "RDB") {
+      new_version = false;
+    } else if (sub_cmd == "DELTA") {
+      new_version = true;
+      delta = true;
     } else {
       return (*cntx)->SendError(UnknownSubCmd(sub_cmd, "SAVE"), kSyntaxErrType);
     }
   }
 
-  GenericError ec = DoSave(new_version, cntx->transaction);
+  GenericError ec = DoSave(new_version, cntx->transaction, delta);
   if (ec) {
     (*cntx)->SendError(ec.Format());
   } else {
@@ -1146,6 +2010,10 @@ static void MergeInto(const DbSlice::Stats& src, Metrics* dest) {
 
   dest->events += src.events;
   dest->small_string_bytes += src.small_string_bytes;
+  dest->small_string_segments = max(dest->small_string_segments, src.small_string_segments);
+  dest->key_prefixes += src.key_prefixes;
+  dest->key_prefix_bytes += src.key_prefix_bytes;
+  dest->lazy_free += src.lazy_free;
 }
 
 Metrics ServerFamily::GetMetrics() const {
@@ -1162,6 +2030,8 @@ Metrics ServerFamily::GetMetrics() const {
     result.uptime = time(NULL) - this->start_time_;
     result.conn_stats += ss->connection_stats;
     result.qps += uint64_t(ss->MovingSum6());
+    result.lua_memory_bytes += ss->GetInterpreterMemory();
+    result.lua_stats += ss->GetInterpreterStats();
 
     if (shard) {
       MergeInto(shard->db_slice().GetStats(), &result);
@@ -1171,12 +2041,17 @@ Metrics ServerFamily::GetMetrics() const {
         result.tiered_stats += shard->tiered_storage()->GetStats();
       }
       result.shard_stats += shard->stats();
+      result.tracking_stats += shard->db_slice().tracking_table().GetStats();
+      result.keyspace_events_stats += shard->db_slice().keyspace_notifier().GetStats();
       result.traverse_ttl_per_sec += shard->GetMovingSum6(EngineShard::TTL_TRAVERSE);
       result.delete_ttl_per_sec += shard->GetMovingSum6(EngineShard::TTL_DELETE);
     }
   };
 
   service_.proactor_pool().AwaitFiberOnAll(std::move(cb));
+  // The records are allocated in the shard threads and released by the consumers.
+  result.snapshot_buffer_bytes = SliceSnapshot::BufferedBytes();
+  result.heap_used_bytes += result.snapshot_buffer_bytes;
   result.qps /= 6;  // normalize moving average stats
   result.traverse_ttl_per_sec /= 6;
   result.delete_ttl_per_sec /= 6;
@@ -1184,6 +2059,56 @@ Metrics ServerFamily::GetMetrics() const {
   return result;
 }
 
+Metrics ServerFamily::GetPublishedMetrics() const {
+  Metrics result;
+  result.uptime = time(NULL) - this->start_time_;
+
+  for (const CachedStats& stats : EngineShardSet::GetCachedStats()) {
+    result.heap_used_bytes += stats.used_memory.load(memory_order_relaxed);
+    result.db.resize(max(result.db.size(), stats.db_sizes.size()));
+
+    lock_guard lk(stats.mu);
+    MergeInto(stats.slice, &result);
+    result.tiered_stats += stats.tiered;
+    result.shard_stats += stats.shard;
+    result.tracking_stats += stats.tracking;
+    result.keyspace_events_stats += stats.keyspace_events;
+    result.traverse_ttl_per_sec += stats.traverse_ttl_per_sec;
+    result.delete_ttl_per_sec += stats.delete_ttl_per_sec;
+  }
+
+  // The number of keys is exact, like DBSIZE.
+  for (size_t i = 0; i < result.db.size(); ++i)
+    result.db[i].key_count = EngineShardSet::DbSize(i);
+
+  // The stats of the connections are kept by the threads that own them, they are read briefly
+  // in every thread without going through the shard queues.
+  util::ProactorPool& pool = service_.proactor_pool();
+  vector<Metrics> thread_metrics(pool.size());
+  pool.AwaitBrief([&](unsigned index, ProactorBase*) {
+    ServerState* ss = ServerState::tlocal();
+    Metrics& dest = thread_metrics[index];
+    dest.conn_stats = ss->connection_stats;
+    dest.qps = uint64_t(ss->MovingSum6());
+    dest.lua_memory_bytes = ss->GetInterpreterMemory();
+    dest.lua_stats = ss->GetInterpreterStats();
+  });
+  for (const Metrics& src : thread_metrics) {
+    result.conn_stats += src.conn_stats;
+    result.qps += src.qps;
+    result.lua_memory_bytes += src.lua_memory_bytes;
+    result.lua_stats += src.lua_stats;
+  }
+
+  result.snapshot_buffer_bytes = SliceSnapshot::BufferedBytes();
+  result.heap_used_bytes += result.snapshot_buffer_bytes;
+  result.qps /= 6;
+  result.traverse_ttl_per_sec /= 6;
+  result.delete_ttl_per_sec /= 6;
+
+  return result;
+}
+
 void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
   if (args.size() > 2) {
     return (*cntx)->SendError(kSyntaxErr);
@@ -1211,7 +2136,7 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
   };
 
 #define ADD_HEADER(x) absl::StrAppend(&info, x "\r\n")
-  Metrics m = GetMetrics();
+  Metrics m = GetPublishedMetrics();
 
   if (should_enter("SERVER")) {
     ProactorBase::ProactorKind kind = ProactorBase::me()->GetKind();
@@ -1242,6 +2167,20 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("connected_clients", m.conn_stats.num_conns);
     append("client_read_buf_capacity", m.conn_stats.read_buf_capacity);
     append("blocked_clients", m.conn_stats.num_blocked_clients);
+    append("tls_offloaded_clients", m.conn_stats.num_tls_offloaded);
+    append("shm_clients", m.conn_stats.num_shm_clients);
+    append("pipeline_queue_length", m.conn_stats.pipeline_queue_len);
+    append("pipeline_queue_bytes", m.conn_stats.pipeline_queue_bytes);
+    append("pipeline_throttled_count", m.conn_stats.pipeline_throttle_cnt);
+    append("tracking_clients", m.tracking_stats.clients);
+
+    // As of the last sweep of the idle connections, see --idle_conn_reclaim_sec.
+    size_t idle_clients = idle_conn_stats_.clients.load(memory_order_relaxed);
+    size_t idle_memory = idle_conn_stats_.memory.load(memory_order_relaxed);
+    append("idle_clients", idle_clients);
+    append("idle_clients_memory", idle_memory);
+    append("idle_clients_memory_avg", idle_memory / max<size_t>(1, idle_clients));
+    append("idle_clients_reclaims", idle_conn_stats_.reclaims.load(memory_order_relaxed));
   }
 
   if (should_enter("MEMORY")) {
@@ -1250,6 +2189,7 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("used_memory", m.heap_used_bytes);
     append("used_memory_human", HumanReadableNumBytes(m.heap_used_bytes));
     append("used_memory_peak", used_mem_peak.load(memory_order_relaxed));
+    append("snapshot_buffers", m.snapshot_buffer_bytes);
 
     append("comitted_memory", GetMallocCurrentCommitted());
 
@@ -1267,7 +2207,10 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     // is known we approximate their allocations by taking 16 bytes per member.
     append("object_used_memory", total.obj_memory_usage);
     append("table_used_memory", total.table_mem_usage);
+    append("prefix_index_used_memory", total.prefix_index_mem_usage);
     append("num_buckets", total.bucket_count);
+    append("table_load_factor", double(total.key_count) / std::max<size_t>(1, total.bucket_count));
+    append("table_overflow_segments", total.overflow_segments);
     append("num_entries", total.key_count);
     append("inline_keys", total.inline_keys);
     append("strval_bytes", total.strval_memory_usage);
@@ -1275,9 +2218,39 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("listpack_blobs", total.listpack_blob_cnt);
     append("listpack_bytes", total.listpack_bytes);
     append("small_string_bytes", m.small_string_bytes);
+    append("small_string_segments", m.small_string_segments);
+    append("small_string_segments_limit", SmallString::MaxSegments());
+    append("key_prefixes", m.key_prefixes);
+    append("key_prefix_bytes", m.key_prefix_bytes);
+    append("lazyfree_pending_objects", m.lazy_free.pending_objects);
+    append("lazyfree_pending_bytes", m.lazy_free.pending_bytes);
+    append("lazyfreed_objects", m.lazy_free.freed_objects);
+    append("used_memory_lua", m.lua_memory_bytes);
+    append("tracking_table_memory", m.tracking_stats.memory);
     append("maxmemory", max_memory_limit);
     append("maxmemory_human", HumanReadableNumBytes(max_memory_limit));
     append("cache_mode", GetFlag(FLAGS_cache_mode) ? "cache" : "store");
+
+    // The huge page coverage of the data heaps of the shards, see --shard_huge_pages.
+    vector<HugePageArena> arenas;
+    for (const EngineShardSet::CachedStats& stats : EngineShardSet::GetCachedStats())
+      arenas.push_back(stats.huge_pages);
+    auto is_on = [](const HugePageArena& arena) { return arena.mode() != HugePageArena::OFF; };
+    if (any_of(arenas.begin(), arenas.end(), is_on)) {
+      vector<HugePageArena::Usage> usage = HugePageArena::ReadUsage(arenas);
+      HugePageArena::Usage total;
+      for (size_t sid = 0; sid < arenas.size(); ++sid) {
+        const char* mode = HugePageArena::ModeName(arenas[sid].mode());
+        append(StrCat("shard", sid, "_huge_pages_mode"), mode);
+        append(StrCat("shard", sid, "_huge_pages_bytes"), usage[sid].huge);
+        append(StrCat("shard", sid, "_huge_pages_resident_bytes"), usage[sid].resident);
+        total.huge += usage[sid].huge;
+        total.resident += usage[sid].resident;
+      }
+      append("huge_pages_bytes", total.huge);
+      append("huge_pages_coverage_perc",
+             total.resident ? total.huge * 100.0 / total.resident : 0);
+    }
   }
 
   if (should_enter("STATS")) {
@@ -1286,6 +2259,17 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("instantaneous_ops_per_sec", m.qps);
     append("total_commands_processed", m.conn_stats.command_cnt);
     append("total_pipelined_commands", m.conn_stats.pipelined_cmd_cnt);
+    append("total_squashed_commands", m.conn_stats.squashed_cmd_cnt);
+    append("total_shed_commands", m.conn_stats.shed_cmd_cnt);
+    append("total_throttled_commands", m.conn_stats.throttled_cmd_cnt);
+    append("client_output_buffer_limit_disconnections", m.conn_stats.output_limit_disconnects);
+    append("client_output_buffer_limit_dropped_messages", m.conn_stats.output_limit_dropped_msgs);
+    append("total_coalesced_reads", m.conn_stats.coalesced_read_cnt);
+    append("total_coalesced_incrs", m.conn_stats.coalesced_incr_cnt);
+    append("pipeline_cache_hits", m.conn_stats.pipeline_cache_hit_cnt);
+    append("pipeline_cache_misses", m.conn_stats.pipeline_cache_miss_cnt);
+    append("json_path_cache_hits", m.conn_stats.json_path_cache_hits);
+    append("json_path_cache_misses", m.conn_stats.json_path_cache_misses);
     append("total_net_input_bytes", m.conn_stats.io_read_bytes);
     append("total_net_output_bytes", m.conn_stats.io_write_bytes);
     append("instantaneous_input_kbps", -1);
@@ -1294,31 +2278,112 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     append("expired_keys", m.events.expired_keys);
     append("evicted_keys", m.events.evicted_keys);
     append("hard_evictions", m.events.hard_evictions);
+    append("proactive_evictions", m.events.proactive_evictions);
+    append("quota_evictions", m.events.quota_evictions);
+    for (unsigned i = 0; i < kNumEvictionPolicies; ++i) {
+      string name = absl::StrReplaceAll(EvictionPolicyName(EvictionPolicy(i)), {{"-", "_"}});
+      append(absl::StrCat(name, "_evictions"), m.events.policy_evictions[i]);
+    }
     append("garbage_checked", m.events.garbage_checked);
     append("garbage_collected", m.events.garbage_collected);
     append("bump_ups", m.events.bumpups);
     append("stash_unloaded", m.events.stash_unloaded);
+    append("segment_splits", m.events.segment_splits);
+    append("overflow_splits", m.events.overflow_splits);
+    append("segments_merged", m.events.segments_merged);
     append("traverse_ttl_sec", m.traverse_ttl_per_sec);
     append("delete_ttl_sec", m.delete_ttl_per_sec);
-    append("keyspace_hits", -1);
-    append("keyspace_misses", -1);
+    append("keyspace_hits", m.events.hits);
+    append("keyspace_misses", m.events.misses);
+    append("admission_rejected", m.events.admission_rejected);
+    append("expire_wheel_deleted", m.events.wheel_expired_keys);
+    append("expire_lag_avg_ms",
+           m.events.expire_lag_ms / std::max<size_t>(1, m.events.wheel_expired_keys));
+    append("expire_backlog", total.expire_backlog);
+    append("expired_hash_fields", m.events.expired_hash_fields);
     append("total_reads_processed", m.conn_stats.io_read_cnt);
     append("total_writes_processed", m.conn_stats.io_write_cnt);
+    append("writes_per_command",
+           double(m.conn_stats.io_write_cnt) / std::max<size_t>(1, m.conn_stats.command_cnt));
     append("async_writes_count", m.conn_stats.async_writes_cnt);
+    append("connection_migrations", m.conn_stats.num_migrations);
+    append("quick_runs", m.shard_stats.quick_runs);
+    append("quick_run_ratio",
+           double(m.shard_stats.quick_runs) / std::max<size_t>(1, m.conn_stats.command_cnt));
     append("parser_err_count", m.conn_stats.parser_err_cnt);
     append("defrag_attempt_total", m.shard_stats.defrag_attempt_total);
     append("defrag_realloc_total", m.shard_stats.defrag_realloc_total);
     append("defrag_task_invocation_total", m.shard_stats.defrag_task_invocation_total);
+    append("defrag_string_bytes", m.shard_stats.defrag_string_bytes);
+    append("defrag_list_bytes", m.shard_stats.defrag_list_bytes);
+    append("defrag_set_bytes", m.shard_stats.defrag_set_bytes);
+    append("defrag_zset_bytes", m.shard_stats.defrag_zset_bytes);
+    append("defrag_hash_bytes", m.shard_stats.defrag_hash_bytes);
+    append("defrag_stream_bytes", m.shard_stats.defrag_stream_bytes);
+    append("zstd_dicts_trained", m.shard_stats.zstd_dicts_trained);
+    append("hop_batches", m.shard_stats.hop_batches);
+    append("batched_hops", m.shard_stats.batched_hops);
+    append("priority_hops", m.shard_stats.priority_hops);
+    append("relaxed_runs", m.shard_stats.relaxed_runs);
+    append("inline_hops", m.shard_stats.inline_hops);
+    append("slice_yields", m.shard_stats.slice_yields);
+    append("max_slice_usec", m.shard_stats.max_slice_usec);
+    append("lua_interpreters", m.lua_stats.interpreters);
+    append("lua_interpreters_borrowed", m.lua_stats.borrowed);
+    append("lua_interpreter_waits", m.lua_stats.waits);
+    append("tracking_total_keys", m.tracking_stats.keys);
+    append("tracking_total_items", m.tracking_stats.items);
+    append("tracking_total_prefixes", m.tracking_stats.prefixes);
+    append("tracking_invalidation_messages", m.tracking_stats.invalidation_msgs);
+    append("tracking_evicted_keys", m.tracking_stats.evicted_keys);
+    append("keyspace_events", m.keyspace_events_stats.events);
+    append("keyspace_events_batches", m.keyspace_events_stats.batches);
+    append("keyspace_events_dropped",
+           m.keyspace_events_stats.dropped + m.conn_stats.notify_dropped_cnt);
   }
 
   if (should_enter("TIERED", true)) {
     ADD_HEADER("# TIERED");
     append("external_entries", total.external_entries);
     append("external_bytes", total.external_size);
+    for (unsigned type : {OBJ_STRING, OBJ_LIST, OBJ_SET, OBJ_ZSET, OBJ_HASH}) {
+      string prefix = absl::StrCat("external_", ObjTypeName(type));
+      append(absl::StrCat(prefix, "_entries"), total.external_entries_by_type[type]);
+      append(absl::StrCat(prefix, "_bytes"), total.external_size_by_type[type]);
+    }
     append("external_reads", m.tiered_stats.external_reads);
+    append("external_coalesced_reads", m.tiered_stats.coalesced_reads);
+    append("external_range_reads", m.tiered_stats.range_reads);
     append("external_writes", m.tiered_stats.external_writes);
+    append("external_loads", m.tiered_stats.external_loads);
+    append("external_compacted_pages", m.tiered_stats.compacted_pages);
+    append("external_promotions", m.tiered_stats.promotions);
+    append("external_demotions", m.tiered_stats.demotions);
+    append("external_relocated_blocks", m.tiered_stats.relocated_blocks);
+    append("external_released_bytes", m.tiered_stats.released_bytes);
     append("external_reserved", m.tiered_stats.storage_reserved);
     append("external_capacity", m.tiered_stats.storage_capacity);
+
+    for (unsigned i = 0; i < m.tiered_stats.num_devices; ++i) {
+      const TieredStats::DeviceStats& dev = m.tiered_stats.devices[i];
+      string prefix = absl::StrCat("external_dev", i);
+      append(absl::StrCat(prefix, "_ios"), dev.ios);
+      append(absl::StrCat(prefix, "_avg_latency_usec"), dev.ios ? dev.latency_usec / dev.ios : 0);
+      append(absl::StrCat(prefix, "_queue_depth"), dev.queue_depth);
+    }
+
+    auto append_latency = [&](string_view name, const LatencyHistogram& hist) {
+      string prefix = absl::StrCat("external_", name, "_latency");
+      append(absl::StrCat(prefix, "_count"), hist.count());
+      append(absl::StrCat(prefix, "_p50_usec"), hist.Percentile(50));
+      append(absl::StrCat(prefix, "_p99_usec"), hist.Percentile(99));
+      append(absl::StrCat(prefix, "_p999_usec"), hist.Percentile(99.9));
+      append(absl::StrCat(prefix, "_max_usec"), hist.max());
+    };
+    append_latency("read", m.tiered_stats.read_latency);
+    append_latency("write", m.tiered_stats.write_latency);
+    append_latency("pending_wait", m.tiered_stats.pending_wait_latency);
+    append_latency("grow", m.tiered_stats.grow_latency);
   }
 
   if (should_enter("PERSISTENCE", true)) {
@@ -1336,6 +2401,33 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     for (const auto& k_v : save_info->freq_map) {
       append(StrCat("rdb_", k_v.first), k_v.second);
     }
+
+    const auto& lp = load_progress_;
+    bool loading = lp.loading.load(memory_order_relaxed);
+    size_t total_bytes = lp.total_bytes.load(memory_order_relaxed);
+    size_t loaded_bytes = lp.loaded_bytes.load(memory_order_relaxed);
+    size_t loaded_keys = lp.loaded_keys.load(memory_order_relaxed);
+    append("loading", int(loading));
+    if (loading) {
+      time_t start_time = lp.start_time.load(memory_order_relaxed);
+      time_t elapsed = std::max<time_t>(1, time(NULL) - start_time);
+      size_t bytes_per_sec = loaded_bytes / elapsed;
+      append("loading_start_time", start_time);
+      append("loading_total_bytes", total_bytes);
+      append("loading_loaded_bytes", loaded_bytes);
+      append("loading_loaded_perc", total_bytes ? loaded_bytes * 100.0 / total_bytes : 0);
+      append("loading_loaded_keys", loaded_keys);
+      append("loading_bytes_per_sec", bytes_per_sec);
+      append("loading_eta_seconds",
+             bytes_per_sec ? (total_bytes - std::min(total_bytes, loaded_bytes)) / bytes_per_sec
+                           : 0);
+    } else if (lp.start_time.load(memory_order_relaxed)) {
+      double duration = lp.duration_sec.load(memory_order_relaxed);
+      append("rdb_last_load_keys_loaded", loaded_keys);
+      append("rdb_last_load_bytes", loaded_bytes);
+      append("rdb_last_load_duration_sec", duration);
+      append("rdb_last_load_bytes_per_sec", duration > 0 ? size_t(loaded_bytes / duration) : 0);
+    }
   }
 
   if (should_enter("REPLICATION")) {
@@ -1347,6 +2439,40 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
       append("role", "master");
       append("connected_slaves", m.conn_stats.num_replicas);
       append("master_replid", master_id_);
+
+      DflyCmd::SyncStats ss = dfly_cmd_->GetSyncStats();
+      append("sync_full", ss.full);
+      append("sync_partial_ok", ss.partial);
+      append("sync_shared", ss.shared);
+
+      // The stable sync streams are batched into frames, see journal/frame.h.
+      journal::FrameStats fs = journal::GetFrameStats();
+      append("repl_frames", fs.frames);
+      append("repl_avg_frame_bytes", fs.frames ? fs.raw_bytes / fs.frames : 0);
+      append("repl_compression_ratio", fs.wire_bytes ? double(fs.raw_bytes) / fs.wire_bytes : 1.0);
+
+      // The lag of a replica is the sum of the lags of its flows, except for the time lag.
+      for (const auto& replica : dfly_cmd_->GetReplicasInfo()) {
+        uint64_t lag_entries = 0, lag_bytes = 0, lag_ms = 0;
+        double progress = 0;
+        for (const auto& flow : replica.flows) {
+          lag_entries += flow.lag_entries;
+          lag_bytes += flow.lag_bytes;
+          lag_ms = std::max(lag_ms, flow.lag_ms);
+          progress += flow.full_sync_progress / replica.flows.size();
+        }
+        string prefix = StrCat("slave", replica.sync_id);
+        append(prefix, StrCat("state=", replica.state, ",lag_entries=", lag_entries,
+                              ",lag_bytes=", lag_bytes, ",lag_ms=", lag_ms,
+                              ",full_sync_perc=", progress));
+        for (size_t i = 0; i < replica.flows.size(); ++i) {
+          const auto& flow = replica.flows[i];
+          append(StrCat(prefix, "_flow", i),
+                 StrCat("lsn=", flow.cur_lsn, ",acked_lsn=", flow.acked_lsn, ",lag_entries=",
+                        flow.lag_entries, ",lag_bytes=", flow.lag_bytes, ",lag_ms=", flow.lag_ms,
+                        ",full_sync_perc=", flow.full_sync_progress));
+        }
+      }
     } else {
       append("role", "slave");
 
@@ -1362,6 +2488,26 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
       append("master_link_status", link);
       append("master_last_io_seconds_ago", rinfo.master_last_io_sec);
       append("master_sync_in_progress", rinfo.sync_in_progress);
+
+      // The lag of the flows as the master reported it, and the LSNs that they applied.
+      uint64_t lag_entries = 0, lag_bytes = 0, lag_ms = 0, applied_bytes = 0;
+      for (const auto& flow : rinfo.flows) {
+        lag_entries += flow.lag_entries;
+        lag_bytes += flow.lag_bytes;
+        lag_ms = std::max(lag_ms, flow.lag_ms);
+        applied_bytes += flow.applied_bytes;
+      }
+      append("slave_repl_offset", applied_bytes);
+      append("master_lag_entries", lag_entries);
+      append("master_lag_bytes", lag_bytes);
+      append("master_lag_ms", lag_ms);
+      for (size_t i = 0; i < rinfo.flows.size(); ++i) {
+        const auto& flow = rinfo.flows[i];
+        append(StrCat("flow", i),
+               StrCat("applied_lsn=", flow.applied_lsn, ",applied_bytes=", flow.applied_bytes,
+                      ",lag_entries=", flow.lag_entries, ",lag_bytes=", flow.lag_bytes,
+                      ",lag_ms=", flow.lag_ms));
+      }
     }
   }
 
@@ -1377,6 +2523,22 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
     for (const auto& k_v : m.conn_stats.cmd_count_map) {
       append(StrCat("cmd_", k_v.first), k_v.second);
     }
+
+    // Redis reports call counts and usec per command, the percentiles are ours.
+    ServerState::TxLatencyMap latency = MergeTxLatency({});
+    vector<pair<string_view, const LatencyHistogram*>> totals;
+    for (const auto& [name, lat] : latency) {
+      totals.emplace_back(name, &lat.phases[TxLatency::TOTAL]);
+    }
+    sort(totals.begin(), totals.end());
+
+    for (const auto& [name, hist] : totals) {
+      double per_call = hist->count() ? double(hist->sum()) / hist->count() : 0;
+      append(StrCat("cmdstat_", absl::AsciiStrToLower(name)),
+             absl::StrFormat("calls=%u,usec=%u,usec_per_call=%.2f,p50=%u,p99=%u,p999=%u",
+                             hist->count(), hist->sum(), per_call, hist->Percentile(50),
+                             hist->Percentile(99), hist->Percentile(99.9)));
+    }
   }
 
   if (should_enter("ERRORSTATS", true)) {
@@ -1393,12 +2555,55 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
       bool show = (i == 0) || (stats.key_count > 0);
       if (show) {
         string val = StrCat("keys=", stats.key_count, ",expires=", stats.expire_count,
-                            ",avg_ttl=-1");  // TODO
+                            ",avg_ttl=-1",  // TODO
+                            ",memory=", stats.obj_memory_usage + stats.table_mem_usage);
         append(StrCat("db", i), val);
       }
     }
   }
 
+  // Hidden because it scans the memory mappings of the process.
+  if (should_enter("NUMA", true)) {
+    ADD_HEADER("# NUMA");
+    const facade::NumaTopology& topology = facade::NumaTopology::Get();
+    facade::NumaStats numa = facade::GetNumaStats();
+    append("numa_nodes", topology.num_nodes());
+    append("numa_bind", facade::NumaBindEnabled());
+    for (unsigned i = 0; i < topology.num_nodes(); ++i) {
+      unsigned id = topology.node(i).id;
+      append(StrCat("node", id, "_cpus"), topology.node(i).cpus.size());
+      append(StrCat("node", id, "_used_memory"), numa.node_bytes[i]);
+    }
+    append("numa_local_allocs", numa.local_allocs);
+    append("numa_remote_allocs", numa.remote_allocs);
+  }
+
+  // Hidden because of its line per shard. The stats lag by at most one heartbeat.
+  if (should_enter("SHARDS", true)) {
+    ADD_HEADER("# Shards");
+    const auto& shards = EngineShardSet::GetCachedStats();
+    for (size_t i = 0; i < shards.size(); ++i) {
+      auto get = [&](atomic_uint64_t CachedStats::*field) {
+        return (shards[i].*field).load(memory_order_relaxed);
+      };
+      uint64_t ooo_runs = get(&CachedStats::ooo_runs);
+      uint64_t quick_runs = get(&CachedStats::quick_runs);
+      double ooo_ratio = double(ooo_runs) / std::max<uint64_t>(1, quick_runs);
+      string val = StrCat("txq_len=", get(&CachedStats::txq_len), ",txq_max_len=",
+                          get(&CachedStats::txq_max_len), ",hop_backlog=",
+                          get(&CachedStats::hop_backlog), ",busy_ratio=",
+                          get(&CachedStats::busy_permille) / 1000.0, ",avg_hop_wait_usec=",
+                          get(&CachedStats::avg_hop_wait_usec), ",ooo_runs=", ooo_runs,
+                          ",quick_runs=", quick_runs, ",ooo_quick_ratio=", ooo_ratio);
+      auto hb_mode = EngineShard::HeartbeatMode(get(&CachedStats::heartbeat_mode));
+      StrAppend(&val, ",heartbeat_hz=", get(&CachedStats::heartbeat_hz),
+                ",heartbeat=", EngineShard::HeartbeatModeName(hb_mode),
+                ",heartbeat_boosts=", get(&CachedStats::heartbeat_boosts),
+                ",heartbeat_backoffs=", get(&CachedStats::heartbeat_backoffs));
+      append(StrCat("shard", i), val);
+    }
+  }
+
   if (should_enter("CPU")) {
     ADD_HEADER("# CPU");
     struct rusage ru, cu, tu;
@@ -1417,27 +2622,26 @@ void ServerFamily::Info(CmdArgList args, ConnectionContext* cntx) {
 }
 
 void ServerFamily::Hello(CmdArgList args, ConnectionContext* cntx) {
-  // Allow calling this commands with no arguments or protover=2
-  // technically that is all that is supported at the moment.
+  // Allow calling this commands with no arguments or protover=2|3.
   // For all other cases degrade to 'unknown command' so that clients
-  // checking for the existence of the command to detect if RESP3 is
-  // supported or whether authentication can be performed using HELLO
-  // will gracefully fallback to RESP2 and using the AUTH command explicitly.
+  // checking whether authentication can be performed using HELLO
+  // will gracefully fallback to using the AUTH command explicitly.
   if (args.size() > 1) {
     string_view proto_version = ArgS(args, 1);
-    if (proto_version != "2" || args.size() > 2) {
+    if ((proto_version != "2" && proto_version != "3") || args.size() > 2) {
       (*cntx)->SendError(UnknownCmd("HELLO", args.subspan(1)));
       return;
     }
+    (*cntx)->SetResp3(proto_version == "3");
   }
 
-  (*cntx)->StartArray(12);
+  (*cntx)->StartCollection(6, RedisReplyBuilder::MAP);
   (*cntx)->SendBulkString("server");
   (*cntx)->SendBulkString("redis");
   (*cntx)->SendBulkString("version");
   (*cntx)->SendBulkString(GetVersion());
   (*cntx)->SendBulkString("proto");
-  (*cntx)->SendLong(2);
+  (*cntx)->SendLong((*cntx)->IsResp3() ? 3 : 2);
   (*cntx)->SendBulkString("id");
   (*cntx)->SendLong(cntx->owner()->GetClientId());
   (*cntx)->SendBulkString("mode");
@@ -1455,15 +2659,15 @@ void ServerFamily::ReplicaOf(CmdArgList args, ConnectionContext* cntx) {
     // use this lock as critical section to prevent concurrent replicaof commands running.
     unique_lock lk(replicaof_mu_);
 
-    // Switch to primary mode.
+    // Switch to primary mode. A master that was taken over may have no replica, if it could not
+    // connect to the new master.
     if (!ServerState::tlocal()->is_master) {
-      auto repl_ptr = replica_;
-      CHECK(repl_ptr);
-
       pool.AwaitFiberOnAll(
           [&](util::ProactorBase* pb) { ServerState::tlocal()->is_master = true; });
-      replica_->Stop();
-      replica_.reset();
+      if (replica_) {
+        replica_->Stop();
+        replica_.reset();
+      }
     }
 
     return (*cntx)->SendOk();
@@ -1517,7 +2721,290 @@ void ServerFamily::ReplicaOf(CmdArgList args, ConnectionContext* cntx) {
       [&](util::ProactorBase* pb) { ServerState::tlocal()->is_master = is_master; });
 }
 
+// The predecessor side of a live handoff, HandoffFrom sends the subcommands in this order:
+// START - replies with the port to replicate from.
+// TAKEOVER - rejects the writes from now on and replies with the LSN of the journal of every
+//            thread, which the replica applied all the writes before once it reached them.
+// DONE - stops accepting connections and exits after --handoff_drain_sec.
+// ABORT - accepts the writes again, if the successor failed to catch up.
+void ServerFamily::Handoff(CmdArgList args, ConnectionContext* cntx) {
+  ToUpper(&args[1]);
+  string_view sub_cmd = ArgS(args, 1);
+  auto& pool = service_.proactor_pool();
+
+  if (sub_cmd == "START") {
+    if (!ServerState::tlocal()->is_master)
+      return (*cntx)->SendError("a replica can not hand off");
+    return (*cntx)->SendLong(GetFlag(FLAGS_port));
+  }
+
+  if (sub_cmd == "TAKEOVER") {
+    unique_lock lk(replicaof_mu_);
+    if (replica_)
+      return (*cntx)->SendError("a replica can not hand off");
+
+    handoff_frozen_.store(true, memory_order_relaxed);
+    pool.AwaitFiberOnAll([](util::ProactorBase* pb) { ServerState::tlocal()->is_master = false; });
+
+    // The global transaction runs after the writes that were scheduled before the freeze.
+    vector<LSN> lsns = DflyCmd::JournalLsns(cntx->transaction);
+
+    (*cntx)->StartArray(lsns.size());
+    for (LSN lsn : lsns)
+      (*cntx)->SendLong(lsn);
+    return;
+  }
+
+  if (sub_cmd == "ABORT") {
+    unique_lock lk(replicaof_mu_);
+    if (handoff_frozen_.exchange(false, memory_order_relaxed)) {
+      LOG(WARNING) << "Handoff aborted, accepting writes again";
+      pool.AwaitFiberOnAll(
+          [](util::ProactorBase* pb) { ServerState::tlocal()->is_master = true; });
+    }
+    return (*cntx)->SendOk();
+  }
+
+  if (sub_cmd == "DONE") {
+    if (!handoff_frozen_.load(memory_order_relaxed))
+      return (*cntx)->SendError("no handoff in progress");
+
+    uint32_t drain_sec = GetFlag(FLAGS_handoff_drain_sec);
+    LOG(INFO) << "Handed off, exiting in " << drain_sec << "s";
+    static_cast<facade::Listener*>(main_listener_)->StopAccepting();
+    if (!handoff_drain_fiber_.IsJoinable()) {
+      handoff_drain_fiber_ =
+          pb_task_->LaunchFiber([this, drain_sec] { DrainHandoff(drain_sec); });
+    }
+    return (*cntx)->SendOk();
+  }
+
+  (*cntx)->SendError(UnknownSubCmd(sub_cmd, "HANDOFF"), kSyntaxErrType);
+}
+
+void ServerFamily::DrainHandoff(uint32_t drain_sec) {
+  if (!is_handoff_drain_done_.WaitFor(chrono::seconds(drain_sec)))
+    acceptor_->Stop();
+}
+
+error_code ServerFamily::HandoffCommand(initializer_list<string_view> args, size_t num_ints,
+                                        vector<int64_t>* ints) {
+  error_code ec = handoff_client_->Command(args, ints);
+  if (ec == errc::operation_not_permitted) {
+    LOG(ERROR) << "Handoff failed: " << handoff_client_->error();
+  } else if (!ec && ints->size() != num_ints) {
+    ec = make_error_code(errc::bad_message);
+  }
+  return ec;
+}
+
+error_code ServerFamily::HandoffFrom(const string& socket_path) {
+  // The timeout of a single command, the full sync is polled.
+  constexpr uint32_t kCommandTimeoutMs = 10000;
+  constexpr auto kPollPeriod = chrono::milliseconds(10);
+  constexpr auto kCatchupTimeout = chrono::seconds(10);
+
+  handoff_client_.reset(new HandoffClient);
+  RETURN_ON_ERR(handoff_client_->Connect(socket_path, kCommandTimeoutMs));
+
+  vector<int64_t> ints;
+  RETURN_ON_ERR(HandoffCommand({"HANDOFF", "START"}, 1, &ints));
+  uint16_t port = ints[0];
+  LOG(INFO) << "Handing off from " << socket_path << ", replicating port " << port;
+
+  // The data of the predecessor replaces the loaded snapshot, if any.
+  if (load_result_.valid())
+    load_result_.wait();
+  shard_set->RunBlockingInParallel(
+      [](EngineShard* shard) { shard->db_slice().FlushDb(DbSlice::kDbAll); });
+
+  auto& pool = service_.proactor_pool();
+  auto set_master = [&](bool is_master) {
+    pool.AwaitFiberOnAll(
+        [is_master](util::ProactorBase* pb) { ServerState::tlocal()->is_master = is_master; });
+  };
+
+  shared_ptr<Replica> replica = make_shared<Replica>("127.0.0.1", port, &service_);
+  replica->EnableLocalMode();
+  error_code ec = pb_task_->Await([&] {
+    unique_lock lk(replicaof_mu_);
+    set_master(false);
+    error_code ec = replica->Start();
+    if (ec) {
+      set_master(true);
+    } else {
+      replica_ = replica;
+    }
+    return ec;
+  });
+  RETURN_ON_ERR(ec);
+
+  // As REPLICAOF NO ONE.
+  auto promote = [&] {
+    pb_task_->Await([&] {
+      unique_lock lk(replicaof_mu_);
+      set_master(true);
+      replica_->Stop();
+      replica_.reset();
+    });
+  };
+
+  // 1. The full sync.
+  auto sync_timeout = chrono::seconds(GetFlag(FLAGS_handoff_sync_timeout_sec));
+  auto deadline = chrono::steady_clock::now() + sync_timeout;
+  while (!replica->GetInfo().stable_sync) {
+    if (chrono::steady_clock::now() > deadline) {
+      promote();
+      return make_error_code(errc::timed_out);
+    }
+    this_thread::sleep_for(kPollPeriod);
+  }
+
+  // 2. The writes that the predecessor accepted before the freeze.
+  // Every flow replicates a thread of the predecessor.
+  ec = HandoffCommand({"HANDOFF", "TAKEOVER"}, replica->GetInfo().flows.size(), &ints);
+  deadline = chrono::steady_clock::now() + kCatchupTimeout;
+  while (!ec) {
+    Replica::Info info = replica->GetInfo();
+    bool caught_up = true;
+    for (size_t i = 0; caught_up && i < ints.size(); ++i)
+      caught_up = info.flows[i].applied_lsn >= LSN(ints[i]);
+    if (caught_up)
+      break;
+
+    if (chrono::steady_clock::now() > deadline)
+      ec = make_error_code(errc::timed_out);
+    else
+      this_thread::sleep_for(kPollPeriod);
+  }
+
+  if (ec) {
+    vector<int64_t> ignored;
+    HandoffCommand({"HANDOFF", "ABORT"}, 0, &ignored);
+    promote();
+    return ec;
+  }
+
+  // 3. This process is the master, the predecessor stays read-only until it exits.
+  promote();
+  LOG(INFO) << "Took over the data of " << socket_path;
+  return ec;
+}
+
+void ServerFamily::FinishHandoff() {
+  if (!handoff_client_)
+    return;
+
+  vector<int64_t> ints;
+  error_code ec = HandoffCommand({"HANDOFF", "DONE"}, 0, &ints);
+  LOG_IF(ERROR, ec) << "Could not finish the handoff " << ec.message();
+  handoff_client_.reset();
+}
+
+// REPLTAKEOVER [timeout_sec], a planned failover run on the replica.
+// 1. The master pauses its writes and the replica waits until its flows applied all of them.
+// 2. The journal of this instance records from LSNs that the master resumes from as its
+//    replica, hence the roles swap without a full sync.
+// 3. The replica becomes the master. The paused writes fail with READONLY on the old master.
+void ServerFamily::ReplTakeover(CmdArgList args, ConnectionContext* cntx) {
+  uint32_t timeout_sec = 10;
+  if (args.size() > 1 && (!absl::SimpleAtoi(ArgS(args, 1), &timeout_sec) || timeout_sec == 0))
+    return (*cntx)->SendError(kInvalidIntErr);
+
+  auto& pool = service_.proactor_pool();
+  unique_lock lk(replicaof_mu_);
+  if (!replica_)
+    return (*cntx)->SendError("REPLTAKEOVER is allowed only on a replica");
+
+  // Opened before the master pauses, so that it records every write that the flows apply.
+  pool.AwaitFiberOnAll([this](auto* pb) {
+    CHECK(!journal_->OpenInThread(false, ""sv));  // can only fail in persistent mode.
+  });
+
+  error_code ec = replica_->PauseMaster(timeout_sec * 1000);
+  if (ec) {
+    LOG(WARNING) << "Could not take over the master " << ec.message();
+    if (ec == errc::timed_out)
+      replica_->FinishTakeover(false, 0, {}, {});
+    return (*cntx)->SendError(StrCat("could not take over the master ", ec.message()));
+  }
+
+  // Nothing writes into the journal until this instance becomes the master.
+  vector<LSN> lsns(pool.size());
+  pool.AwaitFiberOnAll([&](unsigned index, auto* pb) { lsns[index] = journal_->GetLsn(); });
+
+  ec = replica_->FinishTakeover(true, GetFlag(FLAGS_port), master_id_, lsns);
+  if (ec) {
+    // Both instances stay read-only rather than risk two masters.
+    LOG(ERROR) << "Could not swap the roles with the master " << ec.message();
+    return (*cntx)->SendError(StrCat("could not swap the roles ", ec.message()));
+  }
+
+  // As REPLICAOF NO ONE.
+  pool.AwaitFiberOnAll([](util::ProactorBase* pb) { ServerState::tlocal()->is_master = true; });
+  replica_->Stop();
+  replica_.reset();
+  LOG(INFO) << "Took over the master";
+  (*cntx)->SendOk();
+}
+
+error_code ServerFamily::FollowTakeover(string host, uint16_t port, string master_id,
+                                        vector<LSN> lsns) {
+  auto& pool = service_.proactor_pool();
+  unique_lock lk(replicaof_mu_);
+  if (replica_)
+    return make_error_code(errc::operation_in_progress);
+
+  pool.AwaitFiberOnAll([](util::ProactorBase* pb) { ServerState::tlocal()->is_master = false; });
+
+  auto replica = make_shared<Replica>(move(host), port, &service_);
+  replica->SetResumePoint(move(master_id), move(lsns));
+  error_code ec = replica->Start();
+  if (!ec)
+    replica_ = move(replica);
+  return ec;
+}
+
+bool ServerFamily::AwaitAppliedLsns(string_view master_id, absl::Span<const LSN> lsns,
+                                    uint32_t timeout_ms) {
+  // See Info on why replica_ is copied without replicaof_mu_ once is_master is false.
+  if (ServerState::tlocal()->is_master)
+    return false;
+  auto replica_ptr = replica_;
+  shared_ptr<const Replica::AppliedLsns> applied = replica_ptr->GetAppliedLsns();
+  if (!applied || applied->master_id != master_id || applied->lsns.size() < lsns.size())
+    return false;
+
+  auto reached = [&] {
+    for (size_t i = 0; i < lsns.size(); ++i) {
+      if (applied->lsns[i].load(memory_order_acquire) < lsns[i])
+        return false;
+    }
+    return true;
+  };
+
+  // The flows publish their progress without notifying anyone, a lagging read polls it.
+  uint64_t deadline = ProactorBase::GetMonotonicTimeNs() + uint64_t(timeout_ms) * 1000000;
+  while (!reached()) {
+    if (ProactorBase::GetMonotonicTimeNs() >= deadline)
+      return false;
+    util::fibers_ext::SleepFor(100us);
+  }
+  return true;
+}
+
 void ServerFamily::ReplConf(CmdArgList args, ConnectionContext* cntx) {
+  // The flows of a replica get no reply to their acknowledgements, it would interleave with
+  // the stream of the flow.
+  if (args.size() == 4 && cntx->conn_state.repl_flow_id != kuint32max &&
+      absl::EqualsIgnoreCase(ArgS(args, 1), "ACK")) {
+    LSN lsn = 0;
+    uint64_t bytes = 0;
+    if (absl::SimpleAtoi(ArgS(args, 2), &lsn) && absl::SimpleAtoi(ArgS(args, 3), &bytes))
+      dfly_cmd_->OnFlowAck(cntx, lsn, bytes);
+    return;
+  }
+
   if (args.size() % 2 == 0)
     goto err;
 
@@ -1547,6 +3034,9 @@ void ServerFamily::ReplConf(CmdArgList args, ConnectionContext* cntx) {
         (*cntx)->SendLong(shard_set->pool()->size());
         return;
       }
+    } else if (cmd == "LOCAL") {
+      if (arg == "1" && cntx->conn_state.repl_session_id > 0)
+        dfly_cmd_->SetLocal(cntx->conn_state.repl_session_id);
     } else {
       VLOG(1) << cmd << " " << arg;
     }
@@ -1563,6 +3053,21 @@ void ServerFamily::Role(CmdArgList args, ConnectionContext* cntx) {
   (*cntx)->SendRaw("*3\r\n$6\r\nmaster\r\n:0\r\n*0\r\n");
 }
 
+void ServerFamily::Wait(CmdArgList args, ConnectionContext* cntx) {
+  uint32_t numreplicas = 0, timeout_ms = 0;
+  if (!absl::SimpleAtoi(ArgS(args, 1), &numreplicas) ||
+      !absl::SimpleAtoi(ArgS(args, 2), &timeout_ms))
+    return (*cntx)->SendError(kInvalidIntErr);
+
+  if (!ServerState::tlocal()->is_master)
+    return (*cntx)->SendError("WAIT cannot be used with replica instances");
+
+  // Only the fiber of the connection blocks. Under EXEC it replies right away, like redis.
+  if (cntx->transaction)
+    numreplicas = 0;
+  (*cntx)->SendLong(dfly_cmd_->WaitForAcks(cntx->conn_state.write_lsns, numreplicas, timeout_ms));
+}
+
 void ServerFamily::Script(CmdArgList args, ConnectionContext* cntx) {
   args.remove_prefix(1);
   ToUpper(&args.front());
@@ -1595,10 +3100,136 @@ void ServerFamily::Latency(CmdArgList args, ConnectionContext* cntx) {
     return (*cntx)->SendEmptyArray();
   }
 
+  if (sub_cmd == "HISTOGRAM") {
+    return LatencyHistogramCmd(args.subspan(2), cntx);
+  }
+
+  if (sub_cmd == "RESET" && args.size() == 2) {
+    service_.proactor_pool().AwaitFiberOnAll(
+        [](ProactorBase* pb) { ServerState::tlocal()->ResetTxLatency(); });
+    return (*cntx)->SendLong(0);
+  }
+
   LOG_FIRST_N(ERROR, 10) << "Subcommand " << sub_cmd << " not supported";
   (*cntx)->SendError(kSyntaxErr);
 }
 
+ServerState::TxLatencyMap ServerFamily::MergeTxLatency(
+    const absl::flat_hash_set<string>& filter) const {
+  ServerState::TxLatencyMap merged;
+  fibers::mutex mu;
+  service_.proactor_pool().AwaitFiberOnAll([&](ProactorBase* pb) {
+    lock_guard lk(mu);
+    for (const auto& [name, lat] : ServerState::tlocal()->tx_latency()) {
+      if (filter.empty() || filter.contains(name))
+        merged[name] += lat;
+    }
+  });
+  return merged;
+}
+
+// Replies with the latency breakdown of the given commands, or of all the commands that ran.
+// Every command is followed by its calls and the percentiles of every phase of TxLatency, the
+// phases other than total are empty for the commands that did not run a transaction.
+void ServerFamily::LatencyHistogramCmd(CmdArgList commands, ConnectionContext* cntx) {
+  absl::flat_hash_set<string> filter;
+  for (unsigned i = 0; i < commands.size(); ++i) {
+    ToUpper(&commands[i]);
+    filter.emplace(ArgS(commands, i));
+  }
+
+  ServerState::TxLatencyMap merged = MergeTxLatency(filter);
+
+  vector<string_view> names;
+  for (const auto& k_v : merged) {
+    names.push_back(k_v.first);
+  }
+  sort(names.begin(), names.end());
+
+  constexpr unsigned kFieldsPerPhase = 4;
+  (*cntx)->StartArray(names.size() * 2);
+  for (string_view name : names) {
+    const TxLatency& lat = merged[name];
+    (*cntx)->SendBulkString(name);
+    (*cntx)->StartArray(2 + TxLatency::NUM_PHASES * kFieldsPerPhase * 2);
+    (*cntx)->SendBulkString("calls");
+    (*cntx)->SendLong(lat.phases[TxLatency::TOTAL].count());
+
+    for (unsigned i = 0; i < TxLatency::NUM_PHASES; ++i) {
+      const LatencyHistogram& hist = lat.phases[i];
+      string_view phase = TxLatency::PhaseName(TxLatency::Phase(i));
+      (*cntx)->SendBulkString(StrCat(phase, "_p50_usec"));
+      (*cntx)->SendLong(hist.Percentile(50));
+      (*cntx)->SendBulkString(StrCat(phase, "_p99_usec"));
+      (*cntx)->SendLong(hist.Percentile(99));
+      (*cntx)->SendBulkString(StrCat(phase, "_p999_usec"));
+      (*cntx)->SendLong(hist.Percentile(99.9));
+      (*cntx)->SendBulkString(StrCat(phase, "_max_usec"));
+      (*cntx)->SendLong(hist.max());
+    }
+  }
+}
+
+// SLOWLOG GET [count] | LEN | RESET. Every entry of GET has the fields of Redis followed by
+// the breakdown of the command, pairs of a phase and its microseconds.
+void ServerFamily::SlowLog(CmdArgList args, ConnectionContext* cntx) {
+  ToUpper(&args[1]);
+  string_view sub_cmd = ArgS(args, 1);
+
+  if (sub_cmd == "RESET" && args.size() == 2) {
+    service_.proactor_pool().AwaitFiberOnAll(
+        [](ProactorBase* pb) { ServerState::tlocal()->ResetSlowLog(); });
+    return (*cntx)->SendOk();
+  }
+
+  if (sub_cmd == "LEN" && args.size() == 2) {
+    atomic_size_t len{0};
+    service_.proactor_pool().AwaitFiberOnAll(
+        [&](ProactorBase* pb) { len.fetch_add(ServerState::tlocal()->slowlog().size()); });
+    return (*cntx)->SendLong(len.load());
+  }
+
+  if (sub_cmd != "GET" || args.size() > 3)
+    return (*cntx)->SendError(kSyntaxErr);
+
+  int64_t count = 10;
+  if (args.size() == 3 && (!absl::SimpleAtoi(ArgS(args, 2), &count) || count < -1))
+    return (*cntx)->SendError(kInvalidIntErr);
+
+  vector<SlowLogEntry> entries;
+  fibers::mutex mu;
+  service_.proactor_pool().AwaitFiberOnAll([&](ProactorBase* pb) {
+    const auto& slowlog = ServerState::tlocal()->slowlog();
+    lock_guard lk(mu);
+    entries.insert(entries.end(), slowlog.begin(), slowlog.end());
+  });
+
+  // The newest first, as by Redis.
+  sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.id > b.id; });
+  if (count >= 0 && entries.size() > size_t(count))
+    entries.resize(count);
+
+  constexpr unsigned kNumPhases = TxLatency::TOTAL + 1;  // dispatch_wait and the tx phases.
+  (*cntx)->StartArray(entries.size());
+  for (const SlowLogEntry& entry : entries) {
+    (*cntx)->StartArray(7);
+    (*cntx)->SendLong(entry.id);
+    (*cntx)->SendLong(entry.unix_ts);
+    (*cntx)->SendLong(entry.phases_usec[TxLatency::TOTAL]);
+    (*cntx)->SendStringArr(absl::Span<const string>{entry.args});
+    (*cntx)->SendBulkString(entry.client_addr);
+    (*cntx)->SendBulkString(entry.client_name);
+
+    (*cntx)->StartArray(kNumPhases * 2);
+    (*cntx)->SendBulkString("dispatch_wait");
+    (*cntx)->SendLong(entry.dispatch_wait_usec);
+    for (unsigned i = 0; i < TxLatency::TOTAL; ++i) {
+      (*cntx)->SendBulkString(TxLatency::PhaseName(TxLatency::Phase(i)));
+      (*cntx)->SendLong(entry.phases_usec[i]);
+    }
+  }
+}
+
 void ServerFamily::_Shutdown(CmdArgList args, ConnectionContext* cntx) {
   CHECK_NOTNULL(acceptor_)->Stop();
   (*cntx)->SendOk();
@@ -1625,34 +3256,39 @@ void ServerFamily::Dfly(CmdArgList args, ConnectionContext* cntx) {
 #define HFUNC(x) SetHandler(HandlerFunc(this, &ServerFamily::x))
 
 void ServerFamily::Register(CommandRegistry* registry) {
-  constexpr auto kReplicaOpts = CO::ADMIN | CO::GLOBAL_TRANS;
+  constexpr auto kReplicaOpts = CO::ADMIN | CO::GLOBAL_TRANS | CO::PRIORITY;
   constexpr auto kMemOpts = CO::LOADING | CO::READONLY | CO::FAST | CO::NOSCRIPT;
 
   *registry << CI{"AUTH", CO::NOSCRIPT | CO::FAST | CO::LOADING, -2, 0, 0, 0}.HFUNC(Auth)
             << CI{"BGSAVE", CO::ADMIN | CO::GLOBAL_TRANS, 1, 0, 0, 0}.HFUNC(Save)
-            << CI{"CLIENT", CO::NOSCRIPT | CO::LOADING, -2, 0, 0, 0}.HFUNC(Client)
+            << CI{"CLIENT", CO::NOSCRIPT | CO::LOADING | CO::PRIORITY, -2, 0, 0, 0}.HFUNC(Client)
             << CI{"CONFIG", CO::ADMIN, -2, 0, 0, 0}.HFUNC(Config)
             << CI{"DBSIZE", CO::READONLY | CO::FAST | CO::LOADING, 1, 0, 0, 0}.HFUNC(DbSize)
             << CI{"DEBUG", CO::ADMIN | CO::LOADING, -2, 0, 0, 0}.HFUNC(Debug)
-            << CI{"FLUSHDB", CO::WRITE | CO::GLOBAL_TRANS, 1, 0, 0, 0}.HFUNC(FlushDb)
+            << CI{"FLUSHDB", CO::WRITE | CO::GLOBAL_TRANS, -1, 0, 0, 0}.HFUNC(FlushDb)
             << CI{"FLUSHALL", CO::WRITE | CO::GLOBAL_TRANS, -1, 0, 0, 0}.HFUNC(FlushAll)
-            << CI{"INFO", CO::LOADING, -1, 0, 0, 0}.HFUNC(Info)
+            << CI{"INFO", CO::LOADING | CO::PRIORITY, -1, 0, 0, 0}.HFUNC(Info)
             << CI{"HELLO", CO::LOADING, -1, 0, 0, 0}.HFUNC(Hello)
             << CI{"LASTSAVE", CO::LOADING | CO::FAST, 1, 0, 0, 0}.HFUNC(LastSave)
             << CI{"LATENCY", CO::NOSCRIPT | CO::LOADING | CO::FAST, -2, 0, 0, 0}.HFUNC(Latency)
             << CI{"MEMORY", kMemOpts, -2, 0, 0, 0}.HFUNC(Memory)
             << CI{"SAVE", CO::ADMIN | CO::GLOBAL_TRANS, -1, 0, 0, 0}.HFUNC(Save)
+            << CI{"SLOWLOG", CO::ADMIN | CO::FAST | CO::LOADING, -2, 0, 0, 0}.HFUNC(SlowLog)
             << CI{"SHUTDOWN", CO::ADMIN | CO::NOSCRIPT | CO::LOADING, 1, 0, 0, 0}.HFUNC(_Shutdown)
+            << CI{"HANDOFF", kReplicaOpts, 2, 0, 0, 0}.HFUNC(Handoff)
             << CI{"SLAVEOF", kReplicaOpts, 3, 0, 0, 0}.HFUNC(ReplicaOf)
             << CI{"REPLICAOF", kReplicaOpts, 3, 0, 0, 0}.HFUNC(ReplicaOf)
-            << CI{"REPLCONF", CO::ADMIN | CO::LOADING, -1, 0, 0, 0}.HFUNC(ReplConf)
-            << CI{"ROLE", CO::LOADING | CO::FAST | CO::NOSCRIPT, 1, 0, 0, 0}.HFUNC(Role)
+            << CI{"REPLCONF", CO::ADMIN | CO::LOADING | CO::PRIORITY, -1, 0, 0, 0}.HFUNC(ReplConf)
+            << CI{"REPLTAKEOVER", kReplicaOpts, -1, 0, 0, 0}.HFUNC(ReplTakeover)
+            << CI{"ROLE", CO::LOADING | CO::FAST | CO::NOSCRIPT | CO::PRIORITY, 1, 0, 0, 0}
+                   .HFUNC(Role)
             // We won't support DF->REDIS replication for now, hence we do not need to support
             // these commands.
             // << CI{"SYNC", CO::ADMIN | CO::GLOBAL_TRANS, 1, 0, 0, 0}.HFUNC(Sync)
             // << CI{"PSYNC", CO::ADMIN | CO::GLOBAL_TRANS, 3, 0, 0, 0}.HFUNC(Psync)
             << CI{"SCRIPT", CO::NOSCRIPT, -2, 0, 0, 0}.HFUNC(Script)
-            << CI{"DFLY", CO::ADMIN | CO::GLOBAL_TRANS, -2, 0, 0, 0}.HFUNC(Dfly);
+            << CI{"WAIT", CO::NOSCRIPT | CO::LOADING, 3, 0, 0, 0}.HFUNC(Wait)
+            << CI{"DFLY", CO::ADMIN | CO::GLOBAL_TRANS | CO::PRIORITY, -2, 0, 0, 0}.HFUNC(Dfly);
 }
 
 }  // namespace dfly
@@ -4,11 +4,18 @@
 
 #pragma once
 
+#include <absl/container/flat_hash_set.h>
+#include <absl/time/time.h>
+
+#include <optional>
+
 #include <boost/fiber/future.hpp>
 
 #include "facade/conn_context.h"
 #include "facade/redis_parser.h"
 #include "server/engine_shard_set.h"
+#include "server/journal/types.h"
+#include "server/server_state.h"
 #include "util/fibers/fiber.h"
 #include "util/proactor_pool.h"
 
@@ -28,6 +35,7 @@ class ConnectionContext;
 class CommandRegistry;
 class DflyCmd;
 class Service;
+class HandoffClient;
 class Replica;
 class ScriptMgr;
 
@@ -40,8 +48,17 @@ struct Metrics {
   size_t uptime = 0;
   size_t qps = 0;
   size_t heap_used_bytes = 0;
+  size_t snapshot_buffer_bytes = 0;  // included in heap_used_bytes.
   size_t heap_comitted_bytes = 0;
   size_t small_string_bytes = 0;
+  size_t small_string_segments = 0;  // the most of any shard, the limit is per thread.
+  size_t key_prefixes = 0;
+  size_t key_prefix_bytes = 0;
+  size_t lua_memory_bytes = 0;
+  LazyFreeQueue::Stats lazy_free;
+  InterpreterManager::Stats lua_stats;
+  TrackingTable::Stats tracking_stats;
+  KeyspaceNotifier::Stats keyspace_events_stats;
   uint32_t traverse_ttl_per_sec = 0;
   uint32_t delete_ttl_per_sec = 0;
 
@@ -75,6 +92,10 @@ class ServerFamily {
 
   Metrics GetMetrics() const;
 
+  // Like GetMetrics, but reads the stats of the shards from what they published on their last
+  // heartbeat instead of hopping into them, see EngineShardSet::CachedStats. Used by INFO.
+  Metrics GetPublishedMetrics() const;
+
   ScriptMgr* script_mgr() {
     return script_mgr_.get();
   }
@@ -82,11 +103,12 @@ class ServerFamily {
   void StatsMC(std::string_view section, facade::ConnectionContext* cntx);
 
   // if new_version is true, saves DF specific, non redis compatible snapshot.
-  GenericError DoSave(bool new_version, Transaction* transaction);
+  // if delta is true, saves only the changes since the previous DF snapshot.
+  GenericError DoSave(bool new_version, Transaction* transaction, bool delta = false);
 
   // Burns down and destroy all the data from the database.
   // if kDbAll is passed, burns all the databases to the ground.
-  std::error_code Drakarys(Transaction* transaction, DbIndex db_ind);
+  std::error_code Drakarys(Transaction* transaction, DbIndex db_ind, bool async = true);
 
   std::shared_ptr<const LastSaveInfo> GetLastSaveInfo() const;
 
@@ -94,6 +116,9 @@ class ServerFamily {
   // future with error_code.
   boost::fibers::future<std::error_code> Load(const std::string& file_name);
 
+  // The position in the file-based journal of the snapshot that the last Load loaded.
+  journal::Position GetLoadedJournalPos() const;
+
   // used within tests.
   bool IsSaving() const {
     return is_saving_.load(std::memory_order_relaxed);
@@ -115,6 +140,27 @@ class ServerFamily {
 
   void BreakOnShutdown();
 
+  // Takes over the process that serves the handoff socket socket_path on the same host, see
+  // --handoff_from. Replicates it over localhost, freezes its writes once the replica caught up
+  // and promotes this process when the replica applied them. Runs on the main thread, before
+  // this process listens.
+  std::error_code HandoffFrom(const std::string& socket_path);
+
+  // Tells the predecessor of HandoffFrom to stop accepting connections, once this process
+  // accepts them. No-op without a handoff.
+  void FinishHandoff();
+
+  // Makes this master a replica of the replica host:port that took it over with REPLTAKEOVER.
+  // The flows resume from the journal LSNs of the new master master_id, without a full sync.
+  std::error_code FollowTakeover(std::string host, uint16_t port, std::string master_id,
+                                 std::vector<LSN> lsns);
+
+  // Blocks the calling fiber of a replica until the stable sync with the master master_id
+  // applied lsns, the LSNs of CLIENT LSNTOKEN by the shard of the master, 0 for the shards to
+  // skip. Returns false if it does not within timeout_ms, see CLIENT READAFTER.
+  bool AwaitAppliedLsns(std::string_view master_id, absl::Span<const LSN> lsns,
+                        uint32_t timeout_ms);
+
  private:
   uint32_t shard_count() const {
     return shard_set->size();
@@ -129,27 +175,49 @@ class ServerFamily {
   void Memory(CmdArgList args, ConnectionContext* cntx);
   void FlushDb(CmdArgList args, ConnectionContext* cntx);
   void FlushAll(CmdArgList args, ConnectionContext* cntx);
+  void Handoff(CmdArgList args, ConnectionContext* cntx);
   void Info(CmdArgList args, ConnectionContext* cntx);
   void Hello(CmdArgList args, ConnectionContext* cntx);
   void LastSave(CmdArgList args, ConnectionContext* cntx);
   void Latency(CmdArgList args, ConnectionContext* cntx);
+  void LatencyHistogramCmd(CmdArgList commands, ConnectionContext* cntx);
+
+  // Merges the latency histograms of all the threads for the commands in filter, or for all the
+  // commands if it is empty.
+  ServerState::TxLatencyMap MergeTxLatency(const absl::flat_hash_set<std::string>& filter) const;
   void Psync(CmdArgList args, ConnectionContext* cntx);
+  void SlowLog(CmdArgList args, ConnectionContext* cntx);
   void ReplicaOf(CmdArgList args, ConnectionContext* cntx);
   void ReplConf(CmdArgList args, ConnectionContext* cntx);
+  void ReplTakeover(CmdArgList args, ConnectionContext* cntx);
   void Role(CmdArgList args, ConnectionContext* cntx);
   void Save(CmdArgList args, ConnectionContext* cntx);
   void Script(CmdArgList args, ConnectionContext* cntx);
   void Sync(CmdArgList args, ConnectionContext* cntx);
+  void Wait(CmdArgList args, ConnectionContext* cntx);
 
   void _Shutdown(CmdArgList args, ConnectionContext* cntx);
 
   void SyncGeneric(std::string_view repl_master_id, uint64_t offs, ConnectionContext* cntx);
 
-  std::error_code LoadRdb(const std::string& rdb_file);
+  // pinned_shard is the shard that all the keys of the file belong to, if known.
+  std::error_code LoadRdb(const std::string& rdb_file, std::optional<ShardId> pinned_shard);
 
   void SnapshotScheduling(const SnapshotSpec& time);
 
+  // Periodically releases the buffers of the connections idle for at least idle_sec.
+  void SweepIdleConnections(uint32_t idle_sec);
+
+  // Waits for the clients to move to the successor of a handoff, then stops the acceptor.
+  void DrainHandoff(uint32_t drain_sec);
+
+  // Sends the HANDOFF command to the predecessor, expects its reply to have num_ints integers.
+  std::error_code HandoffCommand(std::initializer_list<std::string_view> args, size_t num_ints,
+                                 std::vector<int64_t>* ints);
+
   util::fibers_ext::Fiber snapshot_fiber_;
+  util::fibers_ext::Fiber idle_sweep_fiber_;
+  util::fibers_ext::Fiber handoff_drain_fiber_;
   boost::fibers::future<std::error_code> load_result_;
 
   uint32_t stats_caching_task_ = 0;
@@ -165,6 +233,8 @@ class ServerFamily {
   std::unique_ptr<ScriptMgr> script_mgr_;
   std::unique_ptr<journal::Journal> journal_;
   std::unique_ptr<DflyCmd> dfly_cmd_;
+  std::unique_ptr<HandoffClient> handoff_client_;  // the predecessor of HandoffFrom.
+  std::atomic_bool handoff_frozen_{false};          // HANDOFF TAKEOVER froze the writes.
   std::string master_id_;
 
   time_t start_time_ = 0;  // in seconds, epoch time.
@@ -172,7 +242,29 @@ class ServerFamily {
   std::shared_ptr<LastSaveInfo> last_save_info_;  // protected by save_mu_;
   std::atomic_bool is_saving_{false};
 
-  util::fibers_ext::Done is_snapshot_done_;
+  // Start time of the snapshot that the next delta is based on and the number of its deltas.
+  // Accessed only in the SAVING state.
+  std::optional<absl::Time> delta_base_time_;
+  unsigned delta_seq_ = 0;
+
+  // Progress of the running load and the totals of the last one, reported by INFO PERSISTENCE.
+  struct LoadProgress {
+    std::atomic_bool loading{false};
+    std::atomic<time_t> start_time{0};
+    std::atomic_size_t total_bytes{0}, loaded_bytes{0}, loaded_keys{0};
+    std::atomic<double> duration_sec{0};
+  } load_progress_;
+
+  mutable ::boost::fibers::mutex load_mu_;
+  journal::Position loaded_journal_pos_;  // protected by load_mu_
+
+  // The idle connections as of the last sweep and the times their buffers were released.
+  struct IdleConnStats {
+    std::atomic_size_t clients{0}, memory{0};
+    std::atomic_uint64_t reclaims{0};
+  } idle_conn_stats_;
+
+  util::fibers_ext::Done is_snapshot_done_, is_idle_sweep_done_, is_handoff_drain_done_;
   std::unique_ptr<util::fibers_ext::FiberQueueThreadPool> fq_threadpool_;
 };
 
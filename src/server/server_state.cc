@@ -5,7 +5,9 @@
 #include "server/server_state.h"
 
 #include "base/logging.h"
+#include "facade/dragonfly_connection.h"
 #include "server/conn_context.h"
+#include "server/engine_shard_set.h"
 
 namespace dfly {
 
@@ -17,12 +19,14 @@ void MonitorsRepo::Add(ConnectionContext* connection) {
   monitors_.push_back(connection);
 }
 
-void MonitorsRepo::Send(const std::string& msg) {
-  if (!monitors_.empty()) {
-    VLOG(1) << "thread " << util::ProactorBase::GetIndex() << " sending monitor message '" << msg
-            << "' for " << monitors_.size();
+void MonitorsRepo::Send(const MessageBatch& batch) {
+  VLOG(1) << "thread " << util::ProactorBase::GetIndex() << " sending " << batch.size()
+          << " monitor messages for " << monitors_.size();
+  for (const auto& [client_id, msg] : batch) {
     for (auto monitor_conn : monitors_) {
-      monitor_conn->SendMonitorMsg(msg);
+      // The monitor may have stopped since the message was queued.
+      if (monitor_conn->owner()->GetClientId() == client_id)
+        monitor_conn->SendMonitorMsg(msg);
     }
   }
 }
@@ -39,12 +43,39 @@ void MonitorsRepo::Remove(const ConnectionContext* conn) {
   }
 }
 
-void MonitorsRepo::NotifyChangeCount(bool added) {
-  if (added) {
-    ++global_count_;
-  } else {
-    DCHECK(global_count_ > 0);
-    --global_count_;
+void MonitorsRepo::NotifyAdded(const Monitor& monitor) {
+  all_.push_back(monitor);
+}
+
+void MonitorsRepo::NotifyRemoved(uint32_t client_id) {
+  auto it = std::find_if(all_.begin(), all_.end(),
+                         [client_id](const auto& val) { return val.client_id == client_id; });
+  DCHECK(it != all_.end());
+  if (it != all_.end())
+    all_.erase(it);
+}
+
+void MonitorsRepo::Enqueue(const Monitor& monitor, std::string msg) {
+  if (pending_.size() <= monitor.thread)
+    pending_.resize(monitor.thread + 1);
+  pending_[monitor.thread].emplace_back(monitor.client_id, std::move(msg));
+
+  if (!flush_scheduled_) {
+    flush_scheduled_ = true;
+    util::ProactorBase::me()->DispatchBrief([this] { Flush(); });
+  }
+}
+
+void MonitorsRepo::Flush() {
+  flush_scheduled_ = false;
+
+  for (unsigned thread = 0; thread < pending_.size(); ++thread) {
+    if (pending_[thread].empty())
+      continue;
+
+    shard_set->pool()->at(thread)->DispatchBrief(
+        [batch = std::move(pending_[thread])] { ServerState::tlocal()->Monitors().Send(batch); });
+    pending_[thread].clear();
   }
 }
 
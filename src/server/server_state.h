@@ -4,11 +4,17 @@
 
 #pragma once
 
+#include <absl/container/node_hash_map.h>
+
+#include <deque>
 #include <optional>
+#include <string>
 #include <vector>
 
 #include "core/interpreter.h"
+#include "server/cluster_config.h"
 #include "server/common.h"
+#include "util/fibers/event_count.h"
 #include "util/sliding_counter.h"
 
 typedef struct mi_heap_s mi_heap_t;
@@ -20,6 +26,104 @@ namespace journal {
 class Journal;
 }  // namespace journal
 
+// Pool of the interpreters of a thread. A script borrows an interpreter for its whole run, so that
+// a script that waits for a hop does not hold back the scripts of other connections.
+class InterpreterManager {
+ public:
+  // Starts with a single interpreter.
+  explicit InterpreterManager(unsigned max_size);
+
+  // Returns a free interpreter. Creates one if all of them are borrowed and the pool did not reach
+  // its maximal size, otherwise waits for an interpreter to be returned.
+  Interpreter* Get();
+
+  void Return(Interpreter* interpreter);
+
+  // Calls f for every interpreter, including the borrowed ones.
+  template <typename F> void ForEach(F&& f) {
+    for (Interpreter& interpreter : storage_) {
+      f(&interpreter);
+    }
+  }
+
+  struct Stats {
+    size_t interpreters = 0;
+    size_t borrowed = 0;
+    uint64_t waits = 0;  // how many times Get waited for a free interpreter.
+
+    Stats& operator+=(const Stats& o);
+  };
+
+  Stats GetStats() const;
+
+  size_t MemoryUsage() const;
+
+ private:
+  unsigned max_size_;
+  uint64_t waits_ = 0;
+  std::deque<Interpreter> storage_;  // keeps the addresses stable.
+  std::vector<Interpreter*> available_;
+  util::fibers_ext::EventCount available_ec_;
+};
+
+// Borrows an interpreter of the thread for the lifetime of the object.
+class BorrowedInterpreter {
+ public:
+  explicit BorrowedInterpreter(InterpreterManager* manager)
+      : manager_(manager), interpreter_(manager->Get()) {
+  }
+
+  ~BorrowedInterpreter() {
+    manager_->Return(interpreter_);
+  }
+
+  BorrowedInterpreter(const BorrowedInterpreter&) = delete;
+  void operator=(const BorrowedInterpreter&) = delete;
+
+  Interpreter* operator->() {
+    return interpreter_;
+  }
+
+  Interpreter& operator*() {
+    return *interpreter_;
+  }
+
+ private:
+  InterpreterManager* manager_;
+  Interpreter* interpreter_;
+};
+
+// Latency breakdown of the transactions of a command. The commands that do not run a transaction
+// of their own only fill the TOTAL phase.
+struct TxLatency {
+  enum Phase : uint8_t {
+    SCHEDULE,  // until the last shard registered the transaction.
+    QUEUE,     // waiting in the tx queues for the locks and the preceding transactions.
+    EXEC,      // from the first callback until the last one, including the hops in between.
+    REPLY,     // from the last callback until the reply was sent.
+    TOTAL,     // the whole command.
+    NUM_PHASES
+  };
+
+  static const char* PhaseName(Phase phase);
+
+  LatencyHistogram phases[NUM_PHASES];
+
+  TxLatency& operator+=(const TxLatency& o);
+};
+
+// A command of SLOWLOG. The phases of the commands that did not run a transaction of their own
+// are 0, except for TOTAL.
+struct SlowLogEntry {
+  uint64_t id = 0;  // increases across all the threads.
+  uint64_t unix_ts = 0;
+  uint32_t dispatch_wait_usec = 0;  // the request waited in the dispatch queue of its connection.
+  uint64_t phases_usec[TxLatency::NUM_PHASES] = {0};
+  std::vector<std::string> args;  // truncated as by Redis.
+  std::string client_addr;
+  std::string client_name;
+};
+
 // This would be used as a thread local storage of sending
 // monitor messages.
 // Each thread will have its own list of all the connections that are
@@ -35,42 +139,62 @@ class Journal;
 // at which this would run. It also minimized the number of copied for this list.
 class MonitorsRepo {
  public:
+  // A monitoring connection of any of the threads.
+  struct Monitor {
+    uint32_t client_id;
+    unsigned thread;
+    MonitorFilter filter;
+  };
+
+  // pairs of the client id of the monitoring connection and of the message.
+  using MessageBatch = std::vector<std::pair<uint32_t, std::string>>;
+
   // This function adds a new connection to be monitored. This function only add
   // new connection that belong to this thread! Must not be called outside of this
   // thread context
   void Add(ConnectionContext* info);
 
-  // Note that this is accepted by value for lifetime reasons
-  // we want to have our own copy since we are assuming that
-  // 1. there will be not to many connections that we in monitor state
-  // 2. we need to have for each of them each own copy for thread safe reasons
-  void Send(const std::string& msg);
+  // Sends the messages to the monitoring connections of this thread.
+  void Send(const MessageBatch& batch);
 
   // This function remove a connection what was monitored. This function only removes
   // a connection that belong to this thread! Must not be called outside of this
   // thread context
   void Remove(const ConnectionContext* conn);
 
-  // We have for each thread the total number of monitors in the application.
+  // We have for each thread the list of the monitors in the application.
   // So this call is thread safe since we hold a copy of this for each thread.
   // If this return true, then we don't need to run the monitor operation at all.
   bool Empty() const {
-    return global_count_ == 0u;
+    return all_.empty();
   }
 
-  // This function is run on all threads to either increment or decrement the "shared" counter
-  // of the monitors - it must be called as part of removing a monitor (for example
+  // These functions are run on all threads to update their list of the monitors of all threads
+  // - they must be called as part of adding or removing a monitor (for example
   // when a connection is closed).
-  void NotifyChangeCount(bool added);
+  void NotifyAdded(const Monitor& monitor);
+  void NotifyRemoved(uint32_t client_id);
+
+  const std::vector<Monitor>& All() const {
+    return all_;
+  }
+
+  // Queues the message for the monitor. The messages that are queued until the running fiber
+  // yields are sent together, in a single hop per thread of the monitors.
+  void Enqueue(const Monitor& monitor, std::string msg);
 
   std::size_t Size() const {
     return monitors_.size();
   }
 
  private:
+  void Flush();
+
   using MonitorVec = std::vector<ConnectionContext*>;
-  MonitorVec monitors_;            // save connections belonging to this thread only!
-  unsigned int global_count_ = 0;  // by global its means that we count the monitor for all threads
+  MonitorVec monitors_;       // save connections belonging to this thread only!
+  std::vector<Monitor> all_;  // the monitors of all the threads.
+  std::vector<MessageBatch> pending_;  // the messages to send, by the thread of the monitor.
+  bool flush_scheduled_ = false;
 };
 
 // Present in every server thread. This class differs from EngineShard. The latter manages
@@ -92,14 +216,51 @@ class ServerState {  // public struct - to allow initialization.
     return &state_.connection_stats;
   }
 
+  // The connection counters summed over all the threads. Every thread publishes its counters
+  // periodically, so that they can be read without hopping into the threads.
+  struct PublishedStats {
+    uint64_t num_conns = 0;
+    uint64_t num_replicas = 0;
+    uint64_t num_blocked_clients = 0;
+    uint64_t read_buf_capacity = 0;
+    uint64_t command_cnt = 0;
+    uint64_t io_read_bytes = 0;
+    uint64_t io_write_bytes = 0;
+  };
+
   ServerState();
   ~ServerState();
 
   void Init();
   void Shutdown();
 
+  // Adds the changes of the counters of this thread since its last call to the published sums.
+  void PublishStats();
+
+  static PublishedStats GetPublishedStats();
+
   bool is_master = true;
 
+  // The write commands of the clients of this thread wait while the writes are paused, as with
+  // CLIENT PAUSE WRITE. DFLY TAKEOVER pauses them until the replica applied all of them.
+  void PauseWrites(bool pause) {
+    writes_paused_ = pause;
+    if (!pause)
+      writes_resumed_ec_.notifyAll();
+  }
+
+  bool writes_paused() const {
+    return writes_paused_;
+  }
+
+  void AwaitWritesResumed() {
+    writes_resumed_ec_.await([this] { return !writes_paused_; });
+  }
+
+  // The cluster topology as seen by this thread, null until it is configured. Published by
+  // ClusterFamily to all the threads.
+  std::shared_ptr<const ClusterConfig> cluster_config;
+
   facade::ConnectionStats connection_stats;
 
   void TxCountInc() {
@@ -122,7 +283,60 @@ class ServerState {  // public struct - to allow initialization.
     gstate_ = s;
   }
 
-  Interpreter& GetInterpreter();
+  InterpreterManager& interpreter_mgr();
+
+  // Returns the memory used by the interpreters of this thread.
+  size_t GetInterpreterMemory() const {
+    return interpreter_mgr_ ? interpreter_mgr_->MemoryUsage() : 0;
+  }
+
+  InterpreterManager::Stats GetInterpreterStats() const {
+    return interpreter_mgr_ ? interpreter_mgr_->GetStats() : InterpreterManager::Stats{};
+  }
+
+  // Histograms of the commands of this thread, by command name. They are updated without
+  // synchronization and merged when read.
+  using TxLatencyMap = absl::node_hash_map<std::string_view, TxLatency>;
+
+  // Records the breakdown of a command in microseconds.
+  void RecordTxLatency(std::string_view cmd, const uint64_t (&phases_usec)[TxLatency::NUM_PHASES]) {
+    TxLatency& lat = tx_latency_[cmd];
+    for (unsigned i = 0; i < TxLatency::NUM_PHASES; ++i) {
+      lat.phases[i].Add(phases_usec[i]);
+    }
+  }
+
+  // Records the total latency of a command that did not run a transaction of its own.
+  void RecordCmdLatency(std::string_view cmd, uint64_t usec) {
+    tx_latency_[cmd].phases[TxLatency::TOTAL].Add(usec);
+  }
+
+  const TxLatencyMap& tx_latency() const {
+    return tx_latency_;
+  }
+
+  void ResetTxLatency() {
+    tx_latency_.clear();
+    slow_txs_.clear();
+  }
+
+  // Keeps the last max_len slow commands of this thread.
+  void AddSlowLogEntry(SlowLogEntry entry, size_t max_len);
+
+  const std::deque<SlowLogEntry>& slowlog() const {
+    return slowlog_;
+  }
+
+  void ResetSlowLog() {
+    slowlog_.clear();
+  }
+
+  // Keeps the descriptions of the last kMaxSlowTxs slow transactions of this thread.
+  void AddSlowTx(std::string descr);
+
+  const std::deque<std::string>& slow_txs() const {
+    return slow_txs_;
+  }
 
   // Returns sum of all requests in the last 6 seconds
   // (not including the current one).
@@ -140,6 +354,11 @@ class ServerState {  // public struct - to allow initialization.
     return data_heap_;
   }
 
+  // Replaces the data heap of the thread before it allocates any data, see HugePageArena.
+  void set_data_heap(mi_heap_t* heap) {
+    data_heap_ = heap;
+  }
+
   journal::Journal* journal() {
     return journal_;
   }
@@ -153,18 +372,31 @@ class ServerState {  // public struct - to allow initialization.
   }
 
  private:
+  void Publish(const PublishedStats& current);
+
   int64_t live_transactions_ = 0;
   mi_heap_t* data_heap_;
   journal::Journal* journal_ = nullptr;
 
-  std::optional<Interpreter> interpreter_;
+  std::optional<InterpreterManager> interpreter_mgr_;
   GlobalState gstate_ = GlobalState::ACTIVE;
 
+  static constexpr size_t kMaxSlowTxs = 16;
+  TxLatencyMap tx_latency_;
+  std::deque<std::string> slow_txs_;  // the newest last.
+  std::deque<SlowLogEntry> slowlog_;  // the newest last.
+
   using Counter = util::SlidingCounter<7>;
   Counter qps_;
 
   MonitorsRepo monitors_;
 
+  PublishedStats published_;  // the counters of this thread as of its last publish.
+  uint32_t publish_task_ = 0;
+
+  bool writes_paused_ = false;
+  util::fibers_ext::EventCount writes_resumed_ec_;
+
   static thread_local ServerState state_;
 };
 
@@ -11,6 +11,9 @@ extern "C" {
 #include "redis/util.h"
 }
 
+#include <absl/random/random.h>
+#include <absl/strings/numbers.h>
+
 #include "base/flags.h"
 #include "base/logging.h"
 #include "base/stl_util.h"
@@ -20,9 +23,11 @@ extern "C" {
 #include "server/container_utils.h"
 #include "server/engine_shard_set.h"
 #include "server/error.h"
+#include "server/streamed_reply.h"
 #include "server/transaction.h"
 
 ABSL_DECLARE_FLAG(bool, use_set2);
+ABSL_DECLARE_FLAG(uint32_t, offshard_copy_min_len);
 
 namespace dfly {
 
@@ -38,12 +43,12 @@ namespace {
 
 constexpr uint32_t kMaxIntSetEntries = 256;
 
-// I use relative time from Oct 1, 2022
-constexpr uint64_t kNowBase = 1664582400ULL;
+// How many members are probed together against StringSets, see StringSet::ContainsBatch.
+constexpr unsigned kProbeBatch = 256;
 
-uint32_t TimeNowSecRel(uint64_t now_ms) {
-  return (now_ms / 1000) - kNowBase;
-}
+using container_utils::TimeNowSecRel;
+
+thread_local absl::InsecureBitGen random_gen;
 
 bool IsDenseEncoding(const CompactObj& co) {
   return co.Encoding() == kEncodingStrMap2;
@@ -212,23 +217,17 @@ void InitSet(ArgSlice vals, CompactObj* set) {
 uint64_t ScanStrSet(const DbContext& db_context, const CompactObj& co, uint64_t curs,
                     const ScanOpts& scan_op, StringVec* res) {
   uint32_t count = scan_op.limit;
-  long maxiterations = count * 10;
 
   if (IsDenseEncoding(co)) {
     StringSet* set = (StringSet*)co.RObjPtr();
     set->set_time(TimeNowSecRel(db_context.time_now_ms));
 
-    do {
-      auto scan_callback = [&](const sds ptr) {
-        string_view str{ptr, sdslen(ptr)};
-        if (scan_op.Matches(str)) {
-          res->push_back(std::string(str));
-        }
-      };
-
-      curs = set->Scan(curs, scan_callback);
-
-    } while (curs && maxiterations-- && res->size() < count);
+    // The set bounds the work of the call by count, so that a sparse set is not scanned whole.
+    curs = set->Scan(curs, count, [&](const sds ptr) {
+      string_view str{ptr, sdslen(ptr)};
+      if (scan_op.Matches(str))
+        res->emplace_back(str);
+    });
   } else {
     DCHECK_EQ(co.Encoding(), kEncodingStrMap);
     using PrivateDataRef = std::tuple<StringVec*, const ScanOpts&>;
@@ -247,6 +246,7 @@ uint64_t ScanStrSet(const DbContext& db_context, const CompactObj& co, uint64_t
       }
     };
 
+    long maxiterations = count * 10;
     do {
       curs = dictScan(ds, curs, scan_callback, NULL, private_data);
     } while (curs && maxiterations-- && res->size() < count);
@@ -310,6 +310,18 @@ bool IsInSet(const DbContext& db_context, const SetType& st, string_view member)
 
 void FindInSet(StringVec& memberships, const DbContext& db_context, const SetType& st,
                const vector<string_view>& members) {
+  if (IsDenseEncoding(st)) {
+    StringSet* ss = (StringSet*)st.first;
+    ss->set_time(TimeNowSecRel(db_context.time_now_ms));
+
+    unique_ptr<bool[]> found(new bool[members.size()]);
+    ss->ContainsBatch(members.data(), members.size(), found.get());
+    for (size_t i = 0; i < members.size(); ++i) {
+      memberships.emplace_back(to_string(found[i]));
+    }
+    return;
+  }
+
   for (const auto& member : members) {
     bool status = IsInSet(db_context, st, member);
     memberships.emplace_back(to_string(status));
@@ -322,6 +334,22 @@ void DiffStrSet(const DbContext& db_context, const SetType& st,
   if (IsDenseEncoding(st)) {
     StringSet* ss = (StringSet*)st.first;
     ss->set_time(TimeNowSecRel(db_context.time_now_ms));
+
+    // Probe the smaller side: when the result is smaller than the set, look up each
+    // of its members in the set instead of iterating over the whole set.
+    if (result->size() < ss->Size()) {
+      // Erasing invalidates the iterators of result, hence we copy the views first.
+      vector<string_view> members(result->begin(), result->end());
+      unique_ptr<bool[]> found(new bool[members.size()]);
+      ss->ContainsBatch(members.data(), members.size(), found.get());
+
+      for (size_t i = 0; i < members.size(); ++i) {
+        if (found[i])
+          result->erase(members[i]);
+      }
+      return;
+    }
+
     for (sds ptr : *ss) {
       result->erase(string_view{ptr, sdslen(ptr)});
     }
@@ -338,43 +366,76 @@ void DiffStrSet(const DbContext& db_context, const SetType& st,
   }
 }
 
-void InterStrSet(const DbContext& db_context, const vector<SetType>& vec, StringVec* result) {
+// Removes from members those that are not in st.
+void RetainInSet(const DbContext& db_context, const SetType& st, vector<string_view>* members) {
+  DCHECK_LE(members->size(), kProbeBatch);
+  bool found[kProbeBatch];
+
+  if (IsDenseEncoding(st)) {
+    StringSet* ss = (StringSet*)st.first;
+    ss->set_time(TimeNowSecRel(db_context.time_now_ms));
+    ss->ContainsBatch(members->data(), members->size(), found);
+  } else {
+    for (size_t i = 0; i < members->size(); ++i) {
+      found[i] = IsInSet(db_context, st, (*members)[i]);
+    }
+  }
+
+  size_t dest = 0;
+  for (size_t i = 0; i < members->size(); ++i) {
+    if (found[i])
+      (*members)[dest++] = (*members)[i];
+  }
+  members->resize(dest);
+}
+
+// Members of the first (smallest) set are collected into batches, and each batch is filtered
+// through the other sets one set at a time. This way the lookups into each set are batched and
+// only the members that survived the previous sets are probed. Calls cb with the members of the
+// intersection and stops once it returns false.
+void InterStrSet(const DbContext& db_context, const vector<SetType>& vec,
+                 const function<bool(string_view)>& cb) {
+  vector<string_view> batch;
+  batch.reserve(kProbeBatch);
+
+  // Returns false when cb stops the intersection.
+  auto flush = [&] {
+    for (size_t j = 1; j < vec.size() && !batch.empty(); ++j) {
+      if (vec[j].first != vec.front().first)
+        RetainInSet(db_context, vec[j], &batch);
+    }
+
+    /* Only take action when all vec contain the member */
+    for (string_view member : batch) {
+      if (!cb(member))
+        return false;
+    }
+    batch.clear();
+    return true;
+  };
+
   if (IsDenseEncoding(vec.front())) {
     StringSet* ss = (StringSet*)vec.front().first;
     ss->set_time(TimeNowSecRel(db_context.time_now_ms));
     for (const sds ptr : *ss) {
-      std::string_view str{ptr, sdslen(ptr)};
-      size_t j = 1;
-      for (j = 1; j < vec.size(); ++j) {
-        if (vec[j].first != ss && !IsInSet(db_context, vec[j], str)) {
-          break;
-        }
-      }
-
-      if (j == vec.size()) {
-        result->push_back(std::string(str));
-      }
+      batch.emplace_back(ptr, sdslen(ptr));
+      if (batch.size() == kProbeBatch && !flush())
+        return;
     }
+    flush();
   } else {
     DCHECK_EQ(vec.front().second, kEncodingStrMap);
     dict* ds = (dict*)vec.front().first;
     dictIterator* di = dictGetIterator(ds);
     dictEntry* de = nullptr;
     while ((de = dictNext(di))) {
-      size_t j = 1;
       sds key = (sds)de->key;
-      string_view member{key, sdslen(key)};
-
-      for (j = 1; j < vec.size(); j++) {
-        if (vec[j].first != ds && !IsInSet(db_context, vec[j], member))
-          break;
-      }
-
-      /* Only take action when all vec contain the member */
-      if (j == vec.size()) {
-        result->push_back(string(member));
-      }
+      batch.emplace_back(key, sdslen(key));
+      if (batch.size() == kProbeBatch && !flush())
+        break;
     }
+    if (!de)
+      flush();
     dictReleaseIterator(di);
   }
 }
@@ -386,9 +447,11 @@ StringVec PopStrSet(const DbContext& db_context, unsigned count, const SetType&
     StringSet* ss = (StringSet*)st.first;
     ss->set_time(TimeNowSecRel(db_context.time_now_ms));
 
-    // TODO: this loop is inefficient because Pop searches again and again an occupied bucket.
-    for (unsigned i = 0; i < count && !ss->Empty(); ++i) {
-      result.push_back(ss->Pop().value());
+    // The members are copied before they are erased, since the sample refers to them.
+    ss->Sample(absl::Uniform<uint64_t>(random_gen), count,
+               [&result](sds member) { result.emplace_back(member, sdslen(member)); });
+    for (const string& member : result) {
+      ss->Erase(member);
     }
   } else {
     DCHECK_EQ(st.second, kEncodingStrMap);
@@ -465,7 +528,10 @@ ResultSetView DiffResultVec(const ResultStringVec& result_vec, ShardId src_shard
   return uniques;
 }
 
-OpResult<SvArray> InterResultVec(const ResultStringVec& result_vec, unsigned required_shard_cnt) {
+// Intersects the results of the shards smallest-first: the members of the smallest result are
+// the candidates, which are counted in the other results. Returns up to limit members.
+OpResult<SvArray> InterResultVec(const ResultStringVec& result_vec, unsigned required_shard_cnt,
+                                 size_t limit = numeric_limits<size_t>::max()) {
   absl::flat_hash_map<std::string_view, unsigned> uniques;
 
   for (const auto& res : result_vec) {
@@ -478,34 +544,42 @@ OpResult<SvArray> InterResultVec(const ResultStringVec& result_vec, unsigned req
       return OpStatus::OK;  // empty set.
   }
 
-  bool first = true;
+  vector<const StringVec*> parts;
   for (const auto& res : result_vec) {
     if (res.status() == OpStatus::SKIPPED)
       continue;
 
     DCHECK(res);  // we handled it above.
+    parts.push_back(&res.value());
+  }
 
-    // I use this awkward 'first' condition instead of table[s]++ deliberately.
-    // I do not want to add keys that I know will not stay in the set.
-    if (first) {
-      for (const string& s : res.value()) {
-        uniques.emplace(s, 1);
-      }
-      first = false;
-    } else {
-      for (const string& s : res.value()) {
-        auto it = uniques.find(s);
-        if (it != uniques.end()) {
-          ++it->second;
-        }
+  SvArray result;
+  if (parts.empty())
+    return result;
+
+  sort(parts.begin(), parts.end(),
+       [](const StringVec* l, const StringVec* r) { return l->size() < r->size(); });
+
+  // I do not want to add keys that I know will not stay in the set, hence only the members of
+  // the smallest result are inserted.
+  uniques.reserve(parts.front()->size());
+  for (const string& s : *parts.front()) {
+    uniques.emplace(s, 1);
+  }
+  for (size_t i = 1; i < parts.size(); ++i) {
+    for (const string& s : *parts[i]) {
+      auto it = uniques.find(s);
+      if (it != uniques.end()) {
+        ++it->second;
       }
     }
   }
 
-  SvArray result;
-  result.reserve(uniques.size());
+  result.reserve(min(uniques.size(), limit));
 
   for (const auto& k_v : uniques) {
+    if (result.size() == limit)
+      break;
     if (k_v.second == required_shard_cnt) {
       result.push_back(k_v.first);
     }
@@ -767,33 +841,76 @@ OpResult<unsigned> Mover::Commit(Transaction* t) {
   return res;
 }
 
-// Read-only OpUnion op on sets.
-OpResult<StringVec> OpUnion(const OpArgs& op_args, ArgSlice keys) {
-  DCHECK(!keys.empty());
+// Passes the members of the set to add, from the cursor on, and returns the cursor to resume
+// from when the slice is exhausted, or 0 once all of them were added. Only the dense sets can
+// be large, the others are added at once.
+template <typename F>
+uint32_t ScanSetSlice(const PrimeValue& pv, uint32_t cursor, TimeSlice* slice, F&& add) {
+  if (!IsDenseEncoding(pv)) {
+    container_utils::IterateSet(pv, [&add](container_utils::ContainerEntry ce) {
+      add(ce.ToString());
+      return true;
+    });
+    return 0;
+  }
+
+  StringSet* ss = (StringSet*)pv.RObjPtr();
+  do {
+    cursor = ss->Scan(cursor, [&add](sds ptr) { add(string_view{ptr, sdslen(ptr)}); });
+  } while (cursor && !slice->Exhausted());
+
+  return cursor;
+}
+
+// The progress of a sliced union in a shard.
+struct UnionState {
   absl::flat_hash_set<string> uniques;
+  unsigned key_index = 0;
+  uint32_t cursor = 0;
+};
+
+OpStatus OpUnion(const OpArgs& op_args, ArgSlice keys, TimeSlice* slice, UnionState* state) {
+  DCHECK(!keys.empty());
 
-  for (string_view key : keys) {
+  while (state->key_index < keys.size()) {
     OpResult<PrimeIterator> find_res =
-        op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_SET);
-    if (find_res) {
+        op_args.shard->db_slice().Find(op_args.db_cntx, keys[state->key_index], OBJ_SET);
+    if (!find_res) {
+      if (find_res.status() != OpStatus::KEY_NOTFOUND)
+        return find_res.status();
+
+      // The set expired while we scanned it, so we start over to read a consistent state.
+      if (state->cursor) {
+        *state = UnionState{};
+        continue;
+      }
+    } else {
       PrimeValue& pv = find_res.value()->second;
       if (IsDenseEncoding(pv)) {
         StringSet* ss = (StringSet*)pv.RObjPtr();
         ss->set_time(TimeNowSecRel(op_args.db_cntx.time_now_ms));
       }
-      container_utils::IterateSet(pv, [&uniques](container_utils::ContainerEntry ce) {
-        uniques.emplace(ce.ToString());
-        return true;
-      });
-      continue;
+      state->cursor = ScanSetSlice(pv, state->cursor, slice,
+                                   [state](string_view member) { state->uniques.emplace(member); });
+      if (state->cursor)
+        return OpStatus::OK;
     }
 
-    if (find_res.status() != OpStatus::KEY_NOTFOUND) {
-      return find_res.status();
-    }
+    ++state->key_index;
   }
 
-  return ToVec(std::move(uniques));
+  return OpStatus::OK;
+}
+
+// Read-only OpUnion op on sets.
+OpResult<StringVec> OpUnion(const OpArgs& op_args, ArgSlice keys) {
+  TimeSlice slice{0};
+  UnionState state;
+  OpStatus status = OpUnion(op_args, keys, &slice, &state);
+  if (status != OpStatus::OK)
+    return status;
+
+  return ToVec(std::move(state.uniques));
 }
 
 // Read-only OpDiff op on sets.
@@ -849,6 +966,69 @@ OpResult<StringVec> OpDiff(const OpArgs& op_args, ArgSlice keys) {
   return ToVec(std::move(uniques));
 }
 
+// Finds the sets of the keys, ordered by their sizes so that the smallest one is probed
+// against the others.
+OpResult<vector<SetType>> FindInterSets(const Transaction* t, EngineShard* es, ArgSlice keys) {
+  // we must copy by value because AsRObj is temporary.
+  vector<SetType> sets(keys.size());
+
+  OpStatus status = OpStatus::OK;
+
+  for (size_t i = 0; i < keys.size(); ++i) {
+    OpResult<PrimeIterator> find_res = es->db_slice().Find(t->db_context(), keys[i], OBJ_SET);
+    if (!find_res) {
+      if (status == OpStatus::OK || status == OpStatus::KEY_NOTFOUND ||
+          find_res.status() != OpStatus::KEY_NOTFOUND) {
+        status = find_res.status();
+      }
+      continue;
+    }
+    const PrimeValue& pv = find_res.value()->second;
+    void* ptr = pv.RObjPtr();
+    sets[i] = make_pair(ptr, pv.Encoding());
+  }
+
+  if (status != OpStatus::OK)
+    return status;
+
+  auto comp = [db_contx = t->db_context()](const SetType& left, const SetType& right) {
+    return SetTypeLen(db_contx, left) < SetTypeLen(db_contx, right);
+  };
+
+  std::sort(sets.begin(), sets.end(), comp);
+  return sets;
+}
+
+// Calls cb with the members of the intersection of the sets, which FindInterSets ordered, and
+// stops once it returns false.
+void InterSets(const DbContext& db_context, const vector<SetType>& sets,
+               const function<bool(string_view)>& cb) {
+  if (sets.front().second != kEncodingIntSet) {
+    InterStrSet(db_context, sets, cb);
+    return;
+  }
+
+  int ii = 0;
+  intset* is = (intset*)sets.front().first;
+  int64_t intele;
+  char buf[32];
+
+  while (intsetGet(is, ii++, &intele)) {
+    size_t j = 1;
+    for (j = 1; j < sets.size(); j++) {
+      if (sets[j].first != is && !IsInSet(db_context, sets[j], intele))
+        break;
+    }
+
+    /* Only take action when all sets contain the member */
+    if (j == sets.size()) {
+      char* end = absl::numbers_internal::FastIntToBuffer(intele, buf);
+      if (!cb(string_view{buf, size_t(end - buf)}))
+        return;
+    }
+  }
+}
+
 // Read-only OpInter op on sets.
 OpResult<StringVec> OpInter(const Transaction* t, EngineShard* es, bool remove_first) {
   ArgSlice keys = t->ShardArgsInShard(es->shard_id());
@@ -877,60 +1057,88 @@ OpResult<StringVec> OpInter(const Transaction* t, EngineShard* es, bool remove_f
     return result;
   }
 
-  // we must copy by value because AsRObj is temporary.
-  vector<SetType> sets(keys.size());
+  OpResult<vector<SetType>> sets = FindInterSets(t, es, keys);
+  if (!sets)
+    return sets.status();
 
-  OpStatus status = OpStatus::OK;
+  InterSets(t->db_context(), *sets, [&result](string_view member) {
+    result.emplace_back(member);
+    return true;
+  });
 
-  for (size_t i = 0; i < keys.size(); ++i) {
-    OpResult<PrimeIterator> find_res = es->db_slice().Find(t->db_context(), keys[i], OBJ_SET);
-    if (!find_res) {
-      if (status == OpStatus::OK || status == OpStatus::KEY_NOTFOUND ||
-          find_res.status() != OpStatus::KEY_NOTFOUND) {
-        status = find_res.status();
-      }
-      continue;
-    }
-    const PrimeValue& pv = find_res.value()->second;
-    void* ptr = pv.RObjPtr();
-    sets[i] = make_pair(ptr, pv.Encoding());
-  }
+  return result;
+}
 
-  if (status != OpStatus::OK)
-    return status;
+// Counts the intersection of the sets of the shard in place, up to limit members.
+OpResult<size_t> OpInterCard(const Transaction* t, EngineShard* es, size_t limit) {
+  ArgSlice keys = t->ShardArgsInShard(es->shard_id());
+  DCHECK(!keys.empty());
 
-  auto comp = [db_contx = t->db_context()](const SetType& left, const SetType& right) {
-    return SetTypeLen(db_contx, left) < SetTypeLen(db_contx, right);
-  };
+  OpResult<vector<SetType>> sets = FindInterSets(t, es, keys);
+  if (!sets)
+    return sets.status();
 
-  std::sort(sets.begin(), sets.end(), comp);
+  if (sets->size() == 1)
+    return min<size_t>(SetTypeLen(t->db_context(), sets->front()), limit);
 
-  int encoding = sets.front().second;
-  if (encoding == kEncodingIntSet) {
-    int ii = 0;
-    intset* is = (intset*)sets.front().first;
-    int64_t intele;
-
-    while (intsetGet(is, ii++, &intele)) {
-      size_t j = 1;
-      for (j = 1; j < sets.size(); j++) {
-        if (sets[j].first != is && !IsInSet(t->db_context(), sets[j], intele))
-          break;
-      }
+  size_t count = 0;
+  InterSets(t->db_context(), *sets, [&count, limit](string_view) { return ++count < limit; });
+  return count;
+}
 
-      /* Only take action when all sets contain the member */
-      if (j == sets.size()) {
-        result.push_back(absl::StrCat(intele));
-      }
+// count - how many elements to pop.
+// Returns count distinct random members, or -count members that may repeat if count is
+// negative. The dense sets are sampled, the others are small and read whole.
+OpResult<StringVec> OpRandMember(const OpArgs& op_args, string_view key, int32_t count) {
+  OpResult<PrimeIterator> find_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_SET);
+  if (!find_res)
+    return find_res.status();
+
+  const PrimeValue& pv = find_res.value()->second;
+  StringVec result;
+  size_t num = count < 0 ? -int64_t(count) : count;
+  result.reserve(min(num, pv.Size()));
+
+  if (IsDenseEncoding(pv)) {
+    StringSet* ss = (StringSet*)pv.RObjPtr();
+    ss->set_time(TimeNowSecRel(op_args.db_cntx.time_now_ms));
+    if (count >= 0) {
+      ss->Sample(absl::Uniform<uint64_t>(random_gen), num,
+                 [&result](sds member) { result.emplace_back(member, sdslen(member)); });
+      return result;
     }
-  } else {
-    InterStrSet(t->db_context(), sets, &result);
+
+    for (size_t i = 0; i < num; ++i) {
+      sds member = ss->Random(absl::Uniform<uint64_t>(random_gen));
+      if (!member)
+        break;
+      result.emplace_back(member, sdslen(member));
+    }
+    return result;
   }
 
+  StringVec members;
+  container_utils::IterateSet(pv, [&members](container_utils::ContainerEntry ce) {
+    members.push_back(ce.ToString());
+    return true;
+  });
+
+  if (count >= 0) {
+    // A partial Fisher-Yates shuffle picks the first num members.
+    num = min(num, members.size());
+    for (size_t i = 0; i < num; ++i) {
+      swap(members[i], members[absl::Uniform<size_t>(random_gen, i, members.size())]);
+    }
+    members.resize(num);
+    return members;
+  }
+
+  for (size_t i = 0; i < num && !members.empty(); ++i) {
+    result.push_back(members[absl::Uniform<size_t>(random_gen, 0, members.size())]);
+  }
   return result;
 }
 
-// count - how many elements to pop.
 OpResult<StringVec> OpPop(const OpArgs& op_args, string_view key, unsigned count) {
   auto& db_slice = op_args.shard->db_slice();
   OpResult<PrimeIterator> find_res = db_slice.Find(op_args.db_cntx, key, OBJ_SET);
@@ -962,8 +1170,8 @@ OpResult<StringVec> OpPop(const OpArgs& op_args, string_view key, unsigned count
     /* Delete the set as it is now empty */
     CHECK(db_slice.Del(op_args.db_cntx.db_index, it));
   } else {
-    SetType st{it->second.RObjPtr(), it->second.Encoding()};
     db_slice.PreUpdate(op_args.db_cntx.db_index, it);
+    SetType st{it->second.RObjPtr(), it->second.Encoding()};
     if (st.second == kEncodingIntSet) {
       intset* is = (intset*)st.first;
       int64_t val = 0;
@@ -996,15 +1204,13 @@ OpResult<StringVec> OpScan(const OpArgs& op_args, string_view key, uint64_t* cur
 
   if (it->second.Encoding() == kEncodingIntSet) {
     intset* is = (intset*)it->second.RObjPtr();
-    int64_t intele;
-    uint32_t pos = 0;
-    while (intsetGet(is, pos++, &intele)) {
-      std::string int_str = absl::StrCat(intele);
-      if (scan_op.Matches(int_str)) {
-        res.push_back(int_str);
-      }
-    }
-    *cursor = 0;
+    char buf[32];
+    *cursor = container_utils::ScanIntSet(is, *cursor, scan_op.limit, [&](int64_t intele) {
+      char* end = absl::numbers_internal::FastIntToBuffer(intele, buf);
+      string_view str{buf, size_t(end - buf)};
+      if (scan_op.Matches(str))
+        res.emplace_back(str);
+    });
   } else {
     *cursor = ScanStrSet(op_args.db_cntx, it->second, *cursor, scan_op, &res);
   }
@@ -1153,6 +1359,37 @@ void SCard(CmdArgList args, ConnectionContext* cntx) {
   }
 }
 
+// Syntax: SRANDMEMBER key [count]
+void SRandMember(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  int32_t count = 1;
+  if (args.size() > 3) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+  if (args.size() == 3 && !absl::SimpleAtoi(ArgS(args, 2), &count)) {
+    return (*cntx)->SendError(kInvalidIntErr);
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpRandMember(t->GetOpArgs(shard), key, count);
+  };
+
+  OpResult<StringVec> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!result && result.status() != OpStatus::KEY_NOTFOUND) {
+    return (*cntx)->SendError(result.status());
+  }
+
+  if (args.size() == 3) {
+    return (*cntx)->SendStringArr(result ? *result : StringVec{});
+  }
+
+  if (result && !result->empty()) {
+    (*cntx)->SendBulkString(result->front());
+  } else {
+    (*cntx)->SendNull();
+  }
+}
+
 void SPop(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
   unsigned count = 1;
@@ -1165,7 +1402,18 @@ void SPop(CmdArgList args, ConnectionContext* cntx) {
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpPop(t->GetOpArgs(shard), key, count);
+    OpResult<StringVec> res = OpPop(t->GetOpArgs(shard), key, count);
+
+    // The members are popped randomly, so the journal removes the popped ones.
+    vector<string_view> cmd;
+    if (res && !res->empty()) {
+      cmd.reserve(res->size() + 2);
+      cmd.push_back("SREM");
+      cmd.push_back(key);
+      cmd.insert(cmd.end(), res->begin(), res->end());
+    }
+    t->RecordJournal(shard, cmd);
+    return res;
   };
 
   OpResult<StringVec> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
@@ -1214,7 +1462,7 @@ void SDiff(CmdArgList args, ConnectionContext* cntx) {
   if (cntx->conn_state.script_info) {  // sort under script
     sort(arr.begin(), arr.end());
   }
-  (*cntx)->SendStringArr(arr);
+  (*cntx)->SendStringCollection(arr, facade::RedisReplyBuilder::SET);
 }
 
 void SDiffStore(CmdArgList args, ConnectionContext* cntx) {
@@ -1271,20 +1519,174 @@ void SDiffStore(CmdArgList args, ConnectionContext* cntx) {
   (*cntx)->SendLong(result.size());
 }
 
+// The progress of a streamed SMEMBERS.
+struct StreamMembersState {
+  StreamedReply reply{facade::RedisReplyBuilder::SET};
+  uint32_t cursor = 0;
+};
+
+OpStatus OpStreamMembers(const OpArgs& op_args, string_view key, TimeSlice* slice,
+                         StreamMembersState* state) {
+  auto& db_slice = op_args.shard->db_slice();
+  OpResult<PrimeIterator> find_res = db_slice.Find(op_args.db_cntx, key, OBJ_SET);
+  if (!find_res) {
+    // Pinned keys do not move or get evicted, so only the first hop can miss the key.
+    DCHECK(!state->reply.started());
+    return find_res.status();
+  }
+
+  PrimeValue& pv = find_res.value()->second;
+
+  // The length is sent first, hence a set whose key could expire between the hops is read in
+  // one hop.
+  TimeSlice whole{0};
+  TimeSlice* hop_slice = pv.HasExpire() ? &whole : slice;
+
+  if (IsDenseEncoding(pv)) {
+    StringSet* ss = (StringSet*)pv.RObjPtr();
+    ss->set_time(TimeNowSecRel(op_args.db_cntx.time_now_ms));
+
+    // The expired members are deleted as they are scanned, so that the size becomes exact.
+    if (!state->reply.started() && ss->ExpirationUsed()) {
+      uint32_t cursor = 0;
+      do {
+        cursor = ss->Scan(cursor, [](sds) {});
+      } while (cursor);
+    }
+  }
+
+  if (!state->reply.started())
+    state->reply.Start(pv.Size());
+
+  state->cursor = ScanSetSlice(pv, state->cursor, hop_slice, [state, slice](string_view member) {
+    state->reply.Add(member, slice);
+  });
+  state->reply.EndHop(*slice, &db_slice);
+  return OpStatus::OK;
+}
+
+// Reads SMEMBERS in two hops like GET with --offshard_copy_min_len. The first hop keeps the
+// key locked and pins a large set so that the connection thread copies its members instead of
+// the shard thread. The second hop unpins it before the reply is written. Reading a set with
+// expiring members deletes them, hence the shard reads such sets, as well as the keys with
+// expiry that concurrent readers may delete.
+OpStatus CopyMembersOffShard(string_view key, size_t min_len, Transaction* trans,
+                             StringVec* res) {
+  StringSet* pinned = nullptr;
+
+  auto read_cb = [&](Transaction* t, EngineShard* shard) -> OpStatus {
+    OpArgs op_args = t->GetOpArgs(shard);
+    OpResult<PrimeIterator> find_res = shard->db_slice().Find(op_args.db_cntx, key, OBJ_SET);
+    if (!find_res)
+      return find_res.status();
+
+    PrimeValue& pv = find_res.value()->second;
+    if (IsDenseEncoding(pv)) {
+      StringSet* ss = (StringSet*)pv.RObjPtr();
+      ss->set_time(TimeNowSecRel(op_args.db_cntx.time_now_ms));
+      if (!pv.HasExpire() && !ss->ExpirationUsed() && pv.MallocUsed() >= min_len) {
+        shard->db_slice().PinRead();
+        pinned = ss;
+        return OpStatus::OK;
+      }
+    }
+
+    TimeSlice whole{0};
+    ScanSetSlice(pv, 0, &whole, [res](string_view member) { res->emplace_back(member); });
+    return OpStatus::OK;
+  };
+
+  OpStatus status = OpStatus::OK;
+  trans->Schedule();
+  trans->Execute(
+      [&](Transaction* t, EngineShard* shard) {
+        status = read_cb(t, shard);
+        return status;
+      },
+      false);
+
+  // The set does not change while its key is locked.
+  if (pinned) {
+    res->reserve(pinned->Size());
+    uint32_t cursor = 0;
+    do {
+      cursor = pinned->Scan(cursor, [res](sds ptr) { res->emplace_back(ptr, sdslen(ptr)); });
+    } while (cursor);
+  }
+
+  auto unpin_cb = [&](Transaction* t, EngineShard* shard) {
+    if (pinned)
+      shard->db_slice().UnpinRead();
+    return OpStatus::OK;
+  };
+  trans->Execute(unpin_cb, true);
+
+  return status;
+}
+
 void SMembers(CmdArgList args, ConnectionContext* cntx) {
-  auto cb = [](Transaction* t, EngineShard* shard) { return OpInter(t, shard, false); };
+  string_view key = ArgS(args, 1);
 
-  OpResult<StringVec> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  uint32_t offshard_min_len = GetFlag(FLAGS_offshard_copy_min_len);
+  if (offshard_min_len > 0 && !cntx->transaction->IsMulti()) {
+    StringVec svec;
+    OpStatus status = CopyMembersOffShard(key, offshard_min_len, cntx->transaction, &svec);
+    if (status != OpStatus::OK && status != OpStatus::KEY_NOTFOUND)
+      return (*cntx)->SendError(status);
+    return (*cntx)->SendStringCollection(svec, facade::RedisReplyBuilder::SET);
+  }
+
+  // The replies of multi transactions and scripts are collected as usual, the latter are sorted.
+  if (!cntx->transaction->IsMulti()) {
+    facade::RedisReplyBuilder* rb = cntx->operator->();
+    StreamMembersState state;
+    auto cb = [&](Transaction* t, EngineShard* shard, TimeSlice* slice) {
+      return OpStreamMembers(t->GetOpArgs(shard), key, slice, &state);
+    };
 
-  if (result || result.status() == OpStatus::KEY_NOTFOUND) {
-    StringVec& svec = result.value();
+    OpStatus status =
+        cntx->transaction->ScheduleStreamed(std::move(cb), [&] { state.reply.Flush(rb); });
+    if (status == OpStatus::OK || status == OpStatus::KEY_NOTFOUND) {
+      state.reply.Finish(rb);
+    } else {
+      rb->SendError(status);
+    }
+    return;
+  }
+
+  StringVec svec;
+  uint32_t cursor = 0;
 
+  auto cb = [&](Transaction* t, EngineShard* shard, TimeSlice* slice) {
+    OpArgs op_args = t->GetOpArgs(shard);
+    OpResult<PrimeIterator> find_res = shard->db_slice().Find(op_args.db_cntx, key, OBJ_SET);
+    if (!find_res) {
+      // The key could also expire between the slices, then it is read as missing.
+      svec.clear();
+      return find_res.status();
+    }
+
+    PrimeValue& pv = find_res.value()->second;
+    if (IsDenseEncoding(pv)) {
+      StringSet* ss = (StringSet*)pv.RObjPtr();
+      ss->set_time(TimeNowSecRel(op_args.db_cntx.time_now_ms));
+      if (cursor == 0)
+        svec.reserve(ss->Size());
+    }
+    cursor = ScanSetSlice(pv, cursor, slice,
+                          [&svec](string_view member) { svec.emplace_back(member); });
+    return OpStatus::OK;
+  };
+
+  OpStatus status = cntx->transaction->ScheduleSliced(std::move(cb));
+
+  if (status == OpStatus::OK || status == OpStatus::KEY_NOTFOUND) {
     if (cntx->conn_state.script_info) {  // sort under script
       sort(svec.begin(), svec.end());
     }
-    (*cntx)->SendStringArr(*result);
+    (*cntx)->SendStringCollection(svec, facade::RedisReplyBuilder::SET);
   } else {
-    (*cntx)->SendError(result.status());
+    (*cntx)->SendError(status);
   }
 }
 
@@ -1304,7 +1706,7 @@ void SInter(CmdArgList args, ConnectionContext* cntx) {
     if (cntx->conn_state.script_info) {  // sort under script
       sort(arr.begin(), arr.end());
     }
-    (*cntx)->SendStringArr(arr);
+    (*cntx)->SendStringCollection(arr, facade::RedisReplyBuilder::SET);
   } else {
     (*cntx)->SendError(result.status());
   }
@@ -1350,16 +1752,70 @@ void SInterStore(CmdArgList args, ConnectionContext* cntx) {
   (*cntx)->SendLong(result->size());
 }
 
-void SUnion(CmdArgList args, ConnectionContext* cntx) {
-  ResultStringVec result_set(shard_set->size());
+// SINTERCARD numkeys key [key ...] [LIMIT limit]
+void SInterCard(CmdArgList args, ConnectionContext* cntx) {
+  unsigned num_keys;
+  // we parsed the structure before, when transaction has been initialized.
+  CHECK(absl::SimpleAtoi(ArgS(args, 1), &num_keys));
+  if (num_keys == 0) {
+    return (*cntx)->SendError("numkeys should be greater than 0");
+  }
 
+  uint64_t limit = 0;
+  for (size_t i = 2 + num_keys; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    if (ArgS(args, i) != "LIMIT" || i + 1 == args.size()) {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+    if (!absl::SimpleAtoi(ArgS(args, ++i), &limit)) {
+      return (*cntx)->SendError("LIMIT can't be negative");
+    }
+  }
+  size_t max_count = limit ? limit : numeric_limits<size_t>::max();
+
+  // When all the keys are in a single shard, the intersection is counted there in place and
+  // stops at the limit.
+  if (cntx->transaction->unique_shard_cnt() == 1) {
+    auto cb = [&](Transaction* t, EngineShard* shard) { return OpInterCard(t, shard, max_count); };
+    OpResult<size_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+    if (result || result.status() == OpStatus::KEY_NOTFOUND)
+      return (*cntx)->SendLong(result ? *result : 0);
+    return (*cntx)->SendError(result.status());
+  }
+
+  // Otherwise every shard intersects its sets smallest-first and the local intersections are
+  // intersected, the same way as SINTER does.
+  ResultStringVec result_set(shard_set->size(), OpStatus::SKIPPED);
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    ArgSlice largs = t->ShardArgsInShard(shard->shard_id());
-    result_set[shard->shard_id()] = OpUnion(t->GetOpArgs(shard), largs);
+    result_set[shard->shard_id()] = OpInter(t, shard, false);
     return OpStatus::OK;
   };
 
   cntx->transaction->ScheduleSingleHop(std::move(cb));
+  OpResult<SvArray> result =
+      InterResultVec(result_set, cntx->transaction->unique_shard_cnt(), max_count);
+  if (!result)
+    return (*cntx)->SendError(result.status());
+  (*cntx)->SendLong(result->size());
+}
+
+void SUnion(CmdArgList args, ConnectionContext* cntx) {
+  ResultStringVec result_set(shard_set->size());
+  vector<UnionState> states(shard_set->size());
+
+  auto cb = [&](Transaction* t, EngineShard* shard, TimeSlice* slice) {
+    ShardId sid = shard->shard_id();
+    ArgSlice largs = t->ShardArgsInShard(sid);
+    OpStatus status = OpUnion(t->GetOpArgs(shard), largs, slice, &states[sid]);
+    if (status != OpStatus::OK) {
+      result_set[sid] = status;
+    } else if (!slice->interrupted()) {
+      result_set[sid] = ToVec(std::move(states[sid].uniques));
+    }
+    return OpStatus::OK;
+  };
+
+  cntx->transaction->ScheduleSliced(std::move(cb));
 
   ResultSetView unionset = UnionResultVec(result_set);
   if (unionset) {
@@ -1367,7 +1823,7 @@ void SUnion(CmdArgList args, ConnectionContext* cntx) {
     if (cntx->conn_state.script_info) {  // sort under script
       sort(arr.begin(), arr.end());
     }
-    (*cntx)->SendStringArr(arr);
+    (*cntx)->SendStringCollection(arr, facade::RedisReplyBuilder::SET);
   } else {
     (*cntx)->SendError(unionset.status());
   }
@@ -1539,6 +1995,7 @@ void SetFamily::Register(CommandRegistry* registry) {
             << CI{"SDIFFSTORE", CO::WRITE | CO::DENYOOM, -3, 1, -1, 1}.HFUNC(SDiffStore)
             << CI{"SINTER", CO::READONLY, -2, 1, -1, 1}.HFUNC(SInter)
             << CI{"SINTERSTORE", CO::WRITE | CO::DENYOOM, -3, 1, -1, 1}.HFUNC(SInterStore)
+            << CI{"SINTERCARD", CO::READONLY | CO::VARIADIC_KEYS, -3, 2, 2, 1}.HFUNC(SInterCard)
             << CI{"SMEMBERS", CO::READONLY, 2, 1, 1, 1}.HFUNC(SMembers)
             << CI{"SISMEMBER", CO::FAST | CO::READONLY, 3, 1, 1, 1}.HFUNC(SIsMember)
             << CI{"SMISMEMBER", CO::READONLY, -3, 1, 1, 1}.HFUNC(SMIsMember)
@@ -1546,6 +2003,7 @@ void SetFamily::Register(CommandRegistry* registry) {
             << CI{"SREM", CO::WRITE | CO::FAST | CO::DENYOOM, -3, 1, 1, 1}.HFUNC(SRem)
             << CI{"SCARD", CO::READONLY | CO::FAST, 2, 1, 1, 1}.HFUNC(SCard)
             << CI{"SPOP", CO::WRITE | CO::FAST, -2, 1, 1, 1}.HFUNC(SPop)
+            << CI{"SRANDMEMBER", CO::READONLY, -2, 1, 1, 1}.HFUNC(SRandMember)
             << CI{"SUNION", CO::READONLY, -2, 1, -1, 1}.HFUNC(SUnion)
             << CI{"SUNIONSTORE", CO::WRITE | CO::DENYOOM, -3, 1, -1, 1}.HFUNC(SUnionStore)
             << CI{"SSCAN", CO::READONLY, -3, 1, 1, 1}.HFUNC(SScan);
@@ -4,12 +4,15 @@
 
 #include "server/set_family.h"
 
+#include "base/flags.h"
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "facade/facade_test.h"
 #include "server/command_registry.h"
 #include "server/test_utils.h"
 
+ABSL_DECLARE_FLAG(uint32_t, offshard_copy_min_len);
+
 using namespace testing;
 using namespace std;
 using namespace util;
@@ -33,6 +36,29 @@ TEST_F(SetFamilyTest, SAdd) {
   EXPECT_EQ(resp, "set");
 }
 
+TEST_F(SetFamilyTest, TinySet) {
+  auto set_bytes = [this] {
+    return service_->server_family().GetMetrics().db[0].memory_usage_by_type[OBJ_SET];
+  };
+
+  // Up to 4 members of 16 bits are stored inline and allocate nothing.
+  EXPECT_THAT(Run({"sadd", "a", "1", "2", "3"}), IntArg(3));
+  Run({"sadd", "b", "2", "3", "4"});
+  EXPECT_EQ(0u, set_bytes());
+  EXPECT_THAT(Run({"sinter", "a", "b"}).GetVec(), UnorderedElementsAre("2", "3"));
+  EXPECT_THAT(Run({"smove", "a", "b", "1"}), IntArg(1));
+  EXPECT_THAT(Run({"smembers", "b"}).GetVec(), UnorderedElementsAre("1", "2", "3", "4"));
+  EXPECT_EQ(0u, set_bytes());
+
+  Run({"sadd", "b", "100000"});
+  EXPECT_GT(set_bytes(), 0u);
+  EXPECT_THAT(Run({"scard", "b"}), IntArg(5));
+
+  EXPECT_THAT(Run({"spop", "b", "4"}), ArrLen(4));
+  EXPECT_EQ(0u, set_bytes());
+  EXPECT_EQ(Run({"spop", "b"}), "1");
+}
+
 TEST_F(SetFamilyTest, IntConv) {
   auto resp = Run({"sadd", "x", "134"});
   EXPECT_THAT(resp, IntArg(1));
@@ -94,6 +120,41 @@ TEST_F(SetFamilyTest, SInter) {
   EXPECT_THAT(resp, IntArg(0));
 }
 
+TEST_F(SetFamilyTest, SInterCard) {
+  Run({"sadd", "a", "1", "2", "3", "4"});
+  Run({"sadd", "b", "3", "5", "6", "2"});
+  Run({"sadd", "c", "x", "y", "2", "3", "z"});
+
+  EXPECT_THAT(Run({"sintercard", "2", "a", "b"}), IntArg(2));
+  EXPECT_THAT(Run({"sintercard", "3", "a", "b", "c"}), IntArg(2));
+  EXPECT_THAT(Run({"sintercard", "3", "a", "b", "c", "limit", "1"}), IntArg(1));
+  EXPECT_THAT(Run({"sintercard", "3", "a", "b", "c", "LIMIT", "0"}), IntArg(2));
+  EXPECT_THAT(Run({"sintercard", "1", "c"}), IntArg(5));
+  EXPECT_THAT(Run({"sintercard", "1", "c", "limit", "3"}), IntArg(3));
+  EXPECT_THAT(Run({"sintercard", "2", "c", "c"}), IntArg(5));
+  EXPECT_THAT(Run({"sintercard", "2", "a", "missing"}), IntArg(0));
+  EXPECT_THAT(Run({"sintercard", "1", "missing"}), IntArg(0));
+
+  EXPECT_THAT(Run({"sintercard", "0", "a"}), ErrArg("greater than 0"));
+  EXPECT_THAT(Run({"sintercard", "2", "a", "b", "limit", "-1"}), ErrArg("can't be negative"));
+  EXPECT_THAT(Run({"sintercard", "2", "a", "b", "foo", "1"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"sintercard", "3", "a", "b"}), ErrArg("syntax error"));
+
+  Run({"set", "str", ""});
+  EXPECT_THAT(Run({"sintercard", "2", "a", "str"}), ErrArg("WRONGTYPE"));
+
+  // A large dense set is probed by the smaller one and the count stops at the limit.
+  vector<string> args = {"sadd", "large"};
+  for (unsigned i = 0; i < 1000; ++i)
+    args.push_back(absl::StrCat("m", i));
+  Run(absl::MakeSpan(args));
+  args[1] = "large2";
+  args.resize(502);
+  Run(absl::MakeSpan(args));
+  EXPECT_THAT(Run({"sintercard", "2", "large", "large2"}), IntArg(500));
+  EXPECT_THAT(Run({"sintercard", "2", "large", "large2", "limit", "300"}), IntArg(300));
+}
+
 TEST_F(SetFamilyTest, SMove) {
   auto resp = Run({"sadd", "a", "1", "2", "3", "4"});
   Run({"sadd", "b", "3", "5", "6", "2"});
@@ -132,6 +193,43 @@ TEST_F(SetFamilyTest, SPop) {
   EXPECT_THAT(resp.GetVec(), IsSubsetOf({"a", "b", "c"}));
 }
 
+TEST_F(SetFamilyTest, SRandMember) {
+  EXPECT_THAT(Run({"srandmember", "missing"}), ArgType(RespExpr::NIL));
+  EXPECT_THAT(Run({"srandmember", "missing", "3"}), ArrLen(0));
+
+  Run({"sadd", "ints", "1", "2", "3"});
+  auto resp = Run({"srandmember", "ints", "5"});
+  ASSERT_THAT(resp, ArrLen(3));
+  EXPECT_THAT(resp.GetVec(), UnorderedElementsAre("1", "2", "3"));
+  resp = Run({"srandmember", "ints", "-5"});
+  ASSERT_THAT(resp, ArrLen(5));
+  EXPECT_THAT(resp.GetVec(), IsSubsetOf({"1", "2", "3"}));
+  EXPECT_THAT(Run({"srandmember", "ints"}), testing::AnyOf("1", "2", "3"));
+
+  vector<string> cmd{"sadd", "set"};
+  for (unsigned i = 0; i < 1000; ++i) {
+    cmd.push_back(absl::StrCat("m", i));
+  }
+  vector<string_view> sv_args(cmd.begin(), cmd.end());
+  Run(absl::MakeSpan(sv_args));
+
+  for (unsigned count : {10u, 900u, 2000u}) {
+    resp = Run({"srandmember", "set", absl::StrCat(count)});
+    ASSERT_THAT(resp, ArrLen(min(count, 1000u)));
+    std::set<string> members;
+    for (const auto& member : resp.GetVec()) {
+      EXPECT_TRUE(members.insert(member.GetString()).second);
+    }
+  }
+  EXPECT_THAT(Run({"srandmember", "set", "-3000"}), ArrLen(3000));
+  EXPECT_THAT(Run({"srandmember", "set", "1", "2"}), ErrArg("syntax error"));
+
+  resp = Run({"spop", "set", "100"});
+  ASSERT_THAT(resp, ArrLen(100));
+  EXPECT_EQ(900, CheckedInt({"scard", "set"}));
+  EXPECT_EQ(0, CheckedInt({"sismember", "set", resp.GetVec()[0].GetString()}));
+}
+
 TEST_F(SetFamilyTest, SMIsMember) {
   Run({"sadd", "foo", "a"});
   Run({"sadd", "foo", "b"});
@@ -173,16 +271,33 @@ TEST_F(SetFamilyTest, SScan) {
     Run({"sadd", "myintset", absl::StrCat(i)});
   }
 
-  // Note that even though this limit by 4, it would return more because
-  // all fields are on intlist
+  // The intset is scanned by count members as well.
   auto resp = Run({"sscan", "myintset", "0", "count", "4"});
   auto vec = StrArray(resp.GetVec()[1]);
-  EXPECT_THAT(vec.size(), 15);
+  EXPECT_THAT(vec.size(), 4);
+  EXPECT_NE("0", resp.GetVec()[0].GetString());
 
-  resp = Run({"sscan", "myintset", "0", "match", "1*"});
+  resp = Run({"sscan", "myintset", "0", "match", "1*", "count", "100"});
+  EXPECT_EQ("0", resp.GetVec()[0].GetString());
   vec = StrArray(resp.GetVec()[1]);
   EXPECT_THAT(vec, UnorderedElementsAre("1", "10", "11", "12", "13", "14"));
 
+  // The cursor of the intset goes on when it turns into a string set.
+  string cursor = "0";
+  vector<string> members;
+  do {
+    resp = Run({"sscan", "myintset", cursor, "count", "4"});
+    cursor = resp.GetVec()[0].GetString();
+    for (const auto& m : StrArray(resp.GetVec()[1]))
+      members.push_back(m);
+    if (members.size() >= 8)
+      Run({"sadd", "myintset", "str"});
+  } while (cursor != "0");
+  sort(members.begin(), members.end());
+  for (int i = 0; i < 15; i++) {
+    EXPECT_TRUE(binary_search(members.begin(), members.end(), absl::StrCat(i))) << i;
+  }
+
   // test string set
   for (int i = 0; i < 15; i++) {
     Run({"sadd", "mystrset", absl::StrCat("str-", i)});
@@ -190,21 +305,58 @@ TEST_F(SetFamilyTest, SScan) {
 
   resp = Run({"sscan", "mystrset", "0", "count", "5"});
   vec = StrArray(resp.GetVec()[1]);
-  EXPECT_THAT(vec.size(), 5);
+  EXPECT_GE(vec.size(), 5);
+  EXPECT_LE(vec.size(), 10);
 
-  resp = Run({"sscan", "mystrset", "0", "match", "str-1*"});
+  resp = Run({"sscan", "mystrset", "0", "match", "str-1*", "count", "100"});
   vec = StrArray(resp.GetVec()[1]);
   EXPECT_THAT(vec, UnorderedElementsAre("str-1", "str-10", "str-11", "str-12", "str-13", "str-14"));
 
-  resp = Run({"sscan", "mystrset", "0", "match", "str-1*", "count", "3"});
-  vec = StrArray(resp.GetVec()[1]);
-  EXPECT_THAT(vec, IsSubsetOf({"str-1", "str-10", "str-11", "str-12", "str-13", "str-14"}));
-  EXPECT_EQ(vec.size(), 3);
+  cursor = "0";
+  members.clear();
+  do {
+    resp = Run({"sscan", "mystrset", cursor, "match", "str-1*", "count", "3"});
+    cursor = resp.GetVec()[0].GetString();
+    vec = StrArray(resp.GetVec()[1]);
+    EXPECT_THAT(vec, IsSubsetOf({"str-1", "str-10", "str-11", "str-12", "str-13", "str-14"}));
+    members.insert(members.end(), vec.begin(), vec.end());
+  } while (cursor != "0");
+  EXPECT_THAT(members, UnorderedElementsAre("str-1", "str-10", "str-11", "str-12", "str-13",
+                                            "str-14"));
 
   // nothing should match this
-  resp = Run({"sscan", "mystrset", "0", "match", "1*"});
+  resp = Run({"sscan", "mystrset", "0", "match", "1*", "count", "100"});
   vec = StrArray(resp.GetVec()[1]);
   EXPECT_THAT(vec.size(), 0);
 }
 
+TEST_F(SetFamilyTest, SMembersOffShardCopy) {
+  absl::FlagSaver fs;
+  absl::SetFlag(&FLAGS_offshard_copy_min_len, 64);
+
+  vector<string> args{"sadd", "large"}, members;
+  for (unsigned i = 0; i < 300; ++i) {
+    members.push_back(absl::StrCat("member", i));
+    args.push_back(members.back());
+  }
+  Run(absl::MakeSpan(args));
+  Run({"sadd", "ints", "1", "2", "3"});
+  Run({"sadd", "ttl", "a", "b"});
+  Run({"expire", "ttl", "100"});
+  Run({"saddex", "memberttl", "100", "a"});
+  Run({"sadd", "memberttl", "b"});
+  Run({"lpush", "list", "a"});
+
+  EXPECT_THAT(StrArray(Run({"smembers", "large"})), UnorderedElementsAreArray(members));
+  EXPECT_THAT(Run({"smembers", "ints"}).GetVec(), UnorderedElementsAre("1", "2", "3"));
+  EXPECT_THAT(Run({"smembers", "ttl"}).GetVec(), UnorderedElementsAre("a", "b"));
+  EXPECT_THAT(Run({"smembers", "memberttl"}).GetVec(), UnorderedElementsAre("a", "b"));
+  EXPECT_THAT(Run({"smembers", "missing"}), ArrLen(0));
+  EXPECT_THAT(Run({"smembers", "list"}), ErrArg("WRONGTYPE"));
+
+  // The lock is released before the reply is written.
+  EXPECT_THAT(Run({"srem", "large", "member0"}), IntArg(1));
+  EXPECT_THAT(Run({"smembers", "large"}), ArrLen(299));
+}
+
 }  // namespace dfly
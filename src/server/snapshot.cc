@@ -6,21 +6,33 @@
 
 extern "C" {
 #include "redis/object.h"
+#include "redis/rdb.h"
 }
 
 #include <absl/functional/bind_front.h>
 #include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
 
+#include "base/flags.h"
 #include "base/logging.h"
 #include "server/db_slice.h"
 #include "server/engine_shard_set.h"
 #include "server/journal/journal.h"
 #include "server/rdb_extensions.h"
 #include "server/rdb_save.h"
+#include "server/tracepoints.h"
 #include "util/fiber_sched_algo.h"
 #include "util/proactor_base.h"
 
+ABSL_FLAG(uint64_t, snapshot_buffer_limit, 0,
+          "If positive, the bucket traversal of the snapshots pauses while their serialized "
+          "records that were not written yet exceed this many bytes. The buckets that writes "
+          "serialize ahead of the traversal are still buffered. 0 means no limit");
+ABSL_FLAG(uint32_t, full_sync_min_cpu_percent, 10,
+          "The share of the shard CPU that the traversal of a full sync backs off to while "
+          "transactions wait in the shard queue. It grows back to the whole CPU once the queue "
+          "stays empty. 100 disables the throttling");
+
 namespace dfly {
 
 using namespace std;
@@ -29,21 +41,40 @@ using namespace chrono_literals;
 namespace this_fiber = ::boost::this_fiber;
 using boost::fibers::fiber;
 
-SliceSnapshot::SliceSnapshot(DbSlice* slice, RecordChannel* dest, CompressionMode compression_mode)
+namespace {
+
+atomic_size_t buffered_bytes{0};
+fibers_ext::EventCount buffers_ec;  // notified when the records are released.
+
+constexpr uint64_t kThrottlePeriodNs = 10'000'000;
+
+}  // namespace
 
-    : db_slice_(slice), dest_(dest), compression_mode_(compression_mode) {
+SliceSnapshot::SliceSnapshot(DbSlice* slice, RecordChannel* dest, CompressionMode compression_mode,
+                             bool native_encodings)
+    : db_slice_(slice), dest_(dest), compression_mode_(compression_mode),
+      native_encodings_(native_encodings) {
   db_array_ = slice->databases();
 }
 
 SliceSnapshot::~SliceSnapshot() {
 }
 
-void SliceSnapshot::Start(bool stream_journal, const Cancellation* cll) {
+void SliceSnapshot::Start(bool stream_journal, const Cancellation* cll, DeltaMode delta_mode) {
   DCHECK(!snapshot_fb_.joinable());
 
   auto db_cb = absl::bind_front(&SliceSnapshot::OnDbChange, this);
   snapshot_version_ = db_slice_->RegisterOnChange(move(db_cb));
 
+  if (delta_mode != DeltaMode::NONE) {
+    DbSlice::DeltaEpoch epoch = db_slice_->StartDeltaEpoch(snapshot_version_);
+    if (delta_mode == DeltaMode::DELTA) {
+      DCHECK_GT(epoch.version, 0u);
+      delta_base_ = epoch.version;
+      deleted_keys_ = std::move(epoch.deleted_keys);
+    }
+  }
+
   if (stream_journal) {
     auto* journal = db_slice_->shard_owner()->journal();
     DCHECK(journal);
@@ -52,9 +83,16 @@ void SliceSnapshot::Start(bool stream_journal, const Cancellation* cll) {
   }
 
   default_buffer_.reset(new io::StringFile);
-  default_serializer_.reset(new RdbSerializer(compression_mode_));
+  default_serializer_.reset(new RdbSerializer(compression_mode_, native_encodings_));
+  buffer_limit_ = absl::GetFlag(FLAGS_snapshot_buffer_limit);
+
+  // Only the full syncs stream the journal.
+  throttle_.enabled = stream_journal;
+  throttle_.min_budget = min(100u, absl::GetFlag(FLAGS_full_sync_min_cpu_percent)) / 100.0;
+  throttle_.period_start_ns = ProactorBase::GetMonotonicTimeNs();
 
-  VLOG(1) << "DbSaver::Start - saving entries with version less than " << snapshot_version_;
+  VLOG(1) << "DbSaver::Start - saving entries with version less than " << snapshot_version_
+          << " and greater than " << delta_base_;
 
   snapshot_fb_ = fiber([this, stream_journal, cll] {
     IterateBucketsFb(cll);
@@ -87,6 +125,23 @@ void SliceSnapshot::Cancel() {
   }
 }
 
+size_t SliceSnapshot::BufferedBytes() {
+  return buffered_bytes.load(memory_order_relaxed);
+}
+
+void SliceSnapshot::ReleaseRecord(const DbRecord& record) {
+  buffered_bytes.fetch_sub(record.value.size(), memory_order_relaxed);
+  buffers_ec.notify();
+}
+
+void SliceSnapshot::WaitForBuffers(const Cancellation* cll) {
+  if (buffer_limit_ == 0 || BufferedBytes() <= buffer_limit_)
+    return;
+
+  // The consumers keep popping the records after a cancellation, so the wait ends.
+  buffers_ec.await([&] { return cll->IsCancelled() || BufferedBytes() <= buffer_limit_; });
+}
+
 void SliceSnapshot::Join() {
   // Fiber could have already been joined by Stop.
   if (snapshot_fb_.joinable())
@@ -111,6 +166,8 @@ void SliceSnapshot::IterateBucketsFb(const Cancellation* cll) {
     FiberProps::SetName(std::move(fiber_name));
   }
 
+  SaveDeletedKeys(cll);
+
   PrimeTable::Cursor cursor;
   for (DbIndex db_indx = 0; db_indx < db_array_.size(); ++db_indx) {
     if (cll->IsCancelled())
@@ -124,6 +181,14 @@ void SliceSnapshot::IterateBucketsFb(const Cancellation* cll) {
     {
       lock_guard lk(mu_);
       current_db_ = db_indx;
+      current_bid_ = 0;
+
+      // Lets the loader presize the table, a delta holds only a part of it.
+      if (!delta_base_) {
+        CHECK(!default_serializer_->WriteOpcode(RDB_OPCODE_RESIZEDB));
+        CHECK(!default_serializer_->SaveLen(pt->size()));
+        CHECK(!default_serializer_->SaveLen(db_array_[db_indx]->expire_count));
+      }
     }
 
     VLOG(1) << "Start traversing " << pt->size() << " items";
@@ -131,10 +196,15 @@ void SliceSnapshot::IterateBucketsFb(const Cancellation* cll) {
       if (cll->IsCancelled())
         return;
 
+      uint64_t start_ns = throttle_.enabled ? ProactorBase::GetMonotonicTimeNs() : 0;
       PrimeTable::Cursor next =
           pt->Traverse(cursor, absl::bind_front(&SliceSnapshot::BucketSaveCb, this));
       cursor = next;
+      current_bid_ = cursor ? cursor.bucket_id() : PrimeTable::kLogicalBucketNum;
       FlushDefaultBuffer(false);
+      if (throttle_.enabled)
+        Throttle(start_ns);
+      WaitForBuffers(cll);
 
       if (stats_.serialized >= last_yield + 100) {
         DVLOG(2) << "Before sleep " << this_fiber::properties<FiberProps>().name();
@@ -155,6 +225,7 @@ void SliceSnapshot::IterateBucketsFb(const Cancellation* cll) {
   // Wait for SerializePhysicalBucket to finish.
   mu_.lock();
   mu_.unlock();
+  traversal_done_ = true;
 
   // TODO: investigate why a single byte gets stuck and does not arrive to replica
   for (unsigned i = 10; i > 1; i--)
@@ -165,6 +236,87 @@ void SliceSnapshot::IterateBucketsFb(const Cancellation* cll) {
           << stats_.side_saved << "/" << stats_.savecb_calls;
 }
 
+double SliceSnapshot::TraversalProgress() const {
+  if (traversal_done_)
+    return 100;
+
+  // The traversal goes over the logical buckets of all the segments of a table in bucket order,
+  // so a table is weighted by its segments.
+  double passed = 0, total = 0;
+  for (DbIndex db_indx = 0; db_indx < db_array_.size(); ++db_indx) {
+    if (!db_array_[db_indx])
+      continue;
+
+    double segments = db_array_[db_indx]->prime.unique_segments();
+    total += segments;
+    if (db_indx < current_db_)
+      passed += segments;
+    else if (db_indx == current_db_)
+      passed += segments * current_bid_ / PrimeTable::kLogicalBucketNum;
+  }
+  return total > 0 ? passed * 100 / total : 0;
+}
+
+void SliceSnapshot::Throttle(uint64_t start_ns) {
+  uint64_t now = ProactorBase::GetMonotonicTimeNs();
+  throttle_.used_ns += now - start_ns;
+  throttle_.busy |= !db_slice_->shard_owner()->txq()->Empty();
+
+  uint64_t period_end = throttle_.period_start_ns + kThrottlePeriodNs;
+  if (now < period_end) {
+    if (throttle_.used_ns < throttle_.budget * kThrottlePeriodNs)
+      return;
+
+    // The budget of the period is spent, the foreground traffic runs in the rest of it.
+    fibers_ext::SleepFor(chrono::nanoseconds(period_end - now));
+    now = ProactorBase::GetMonotonicTimeNs();
+  }
+
+  if (throttle_.busy)
+    throttle_.budget = max(throttle_.min_budget, throttle_.budget / 2);
+  else
+    throttle_.budget = min(1.0, throttle_.budget + 0.125);
+
+  throttle_.period_start_ns = now;
+  throttle_.used_ns = 0;
+  throttle_.busy = false;
+}
+
+// The tombstones do not intersect with the saved entries: a key that is added again after its
+// deletion is removed from the deleted keys of the epoch.
+void SliceSnapshot::SaveDeletedKeys(const Cancellation* cll) {
+  for (DbIndex db_indx = 0; db_indx < deleted_keys_.size(); ++db_indx) {
+    if (deleted_keys_[db_indx].empty() || !db_array_[db_indx])
+      continue;
+
+    {
+      lock_guard lk(mu_);
+      current_db_ = db_indx;
+    }
+
+    unsigned count = 0;
+    for (const string& key : deleted_keys_[db_indx]) {
+      if (cll->IsCancelled())
+        return;
+
+      {
+        lock_guard lk(mu_);
+        CHECK(!default_serializer_->WriteOpcode(RDB_OPCODE_DELETED_KEY));
+        CHECK(!default_serializer_->SaveString(key));
+      }
+
+      if (++count % 100 == 0) {
+        FlushDefaultBuffer(false);
+        fibers_ext::Yield();
+      }
+    }
+    FlushDefaultBuffer(true);
+  }
+
+  VLOG(1) << "Saved the tombstones of " << deleted_keys_.size() << " databases";
+  deleted_keys_.clear();
+}
+
 bool SliceSnapshot::BucketSaveCb(PrimeIterator it) {
   // if we touched that physical bucket - skip it.
   // We must make sure we TraverseBucket exactly once for each physical bucket.
@@ -186,6 +338,11 @@ bool SliceSnapshot::BucketSaveCb(PrimeIterator it) {
     return false;
   }
 
+  if (IsUnchanged(v)) {
+    ++stats_.skipped;
+    return false;
+  }
+
   ++stats_.serialized += SerializeBucket(current_db_, it);
   return false;
 }
@@ -196,22 +353,20 @@ unsigned SliceSnapshot::SerializeBucket(DbIndex db_index, PrimeTable::bucket_ite
   // traverse physical bucket and write it into string file.
   it.SetVersion(snapshot_version_);
   unsigned result = 0;
+  DFLY_TRACE(snapshot__bucket__start, db_slice_->shard_id(), db_index);
 
   lock_guard lk(mu_);
 
   optional<RdbSerializer> tmp_serializer;
   RdbSerializer* serializer_ptr = default_serializer_.get();
   if (db_index != current_db_) {
-    CompressionMode compression_mode = compression_mode_ == CompressionMode::NONE
-                                           ? CompressionMode::NONE
-                                           : CompressionMode::SINGLE_ENTRY;
-    tmp_serializer.emplace(compression_mode);
+    tmp_serializer.emplace(SingleEntryMode(compression_mode_), native_encodings_);
     serializer_ptr = &*tmp_serializer;
   }
 
   while (!it.is_done()) {
     ++result;
-    SerializeEntry(db_index, it->first, it->second, nullopt, serializer_ptr);
+    SerializeEntry(PrimeIterator{it}, serializer_ptr);
     ++it;
   }
 
@@ -219,20 +374,15 @@ unsigned SliceSnapshot::SerializeBucket(DbIndex db_index, PrimeTable::bucket_ite
     FlushTmpSerializer(db_index, &*tmp_serializer);
   }
 
+  DFLY_TRACE(snapshot__bucket__done, db_slice_->shard_id(), db_index, result);
   return result;
 }
 
 // This function should not block and should not preempt because it's called
 // from SerializePhysicalBucket which should execute atomically.
-void SliceSnapshot::SerializeEntry(DbIndex db_indx, const PrimeKey& pk, const PrimeValue& pv,
-                                   optional<uint64_t> expire, RdbSerializer* serializer) {
-  time_t expire_time = expire.value_or(0);
-  if (!expire && pv.HasExpire()) {
-    auto eit = db_array_[db_indx]->expire.Find(pk);
-    expire_time = db_slice_->ExpireTime(eit);
-  }
-
-  io::Result<uint8_t> res = serializer->SaveEntry(pk, pv, expire_time);
+void SliceSnapshot::SerializeEntry(PrimeIterator it, RdbSerializer* serializer) {
+  time_t expire_time = db_slice_->ExpireTime(ExpireIterator::Of(it));
+  io::Result<uint8_t> res = serializer->SaveEntry(it->first, it->second, expire_time);
   CHECK(res);
   ++type_freq_map_[*res];
 }
@@ -257,36 +407,50 @@ bool SliceSnapshot::FlushDefaultBuffer(bool force) {
 }
 
 void SliceSnapshot::OnDbChange(DbIndex db_index, const DbSlice::ChangeReq& req) {
-  PrimeTable* table = db_slice_->GetTables(db_index).first;
+  PrimeTable* table = db_slice_->GetPrimeTable(db_index);
 
   if (const PrimeTable::bucket_iterator* bit = req.update()) {
-    if (bit->GetVersion() < snapshot_version_) {
+    uint64_t v = bit->GetVersion();
+    if (v < snapshot_version_ && !IsUnchanged(v)) {
       stats_.side_saved += SerializeBucket(db_index, *bit);
     }
   } else {
     string_view key = get<string_view>(req.change);
     table->CVCUponInsert(snapshot_version_, key, [this, db_index](PrimeTable::bucket_iterator it) {
       DCHECK_LT(it.GetVersion(), snapshot_version_);
-      stats_.side_saved += SerializeBucket(db_index, it);
+      if (!IsUnchanged(it.GetVersion()))
+        stats_.side_saved += SerializeBucket(db_index, it);
     });
   }
 }
 
+// Saves the keys of the command with their values after it ran, or tombstones for the keys
+// that it deleted.
 void SliceSnapshot::OnJournalEntry(const journal::Entry& entry) {
-  CHECK(journal::Op::VAL == entry.opcode);
+  if (entry.opcode != journal::Op::COMMAND || entry.keys.empty())
+    return;
+
+  if (entry.db_ind >= db_array_.size() || !db_array_[entry.db_ind])
+    return;
 
   optional<RdbSerializer> tmp_serializer;
   RdbSerializer* serializer_ptr = default_serializer_.get();
   if (entry.db_ind != current_db_) {
-    CompressionMode compression_mode = compression_mode_ == CompressionMode::NONE
-                                           ? CompressionMode::NONE
-                                           : CompressionMode::SINGLE_ENTRY;
-    tmp_serializer.emplace(compression_mode);
+    tmp_serializer.emplace(SingleEntryMode(compression_mode_), native_encodings_);
     serializer_ptr = &*tmp_serializer;
   }
 
-  PrimeKey pkey{entry.key};
-  SerializeEntry(entry.db_ind, pkey, *entry.pval_ptr, entry.expire_ms, serializer_ptr);
+  PrimeTable* table = &db_array_[entry.db_ind]->prime;
+  for (size_t i = 0; i < entry.keys.size(); i += entry.key_step) {
+    string_view key = entry.keys[i];
+    PrimeIterator it = table->Find(key);
+    if (IsValid(it)) {
+      SerializeEntry(it, serializer_ptr);
+    } else {
+      CHECK(!serializer_ptr->WriteOpcode(RDB_OPCODE_DELETED_KEY));
+      CHECK(!serializer_ptr->SaveString(key));
+    }
+  }
 
   if (tmp_serializer) {
     FlushTmpSerializer(entry.db_ind, &*tmp_serializer);
@@ -311,6 +475,7 @@ SliceSnapshot::DbRecord SliceSnapshot::GetDbRecord(DbIndex db_index, std::string
   DVLOG(2) << "Pushed " << id;
 
   stats_.channel_bytes += value.size();
+  buffered_bytes.fetch_add(value.size(), memory_order_relaxed);
   return DbRecord{.db_index = db_index, .id = id, .value = std::move(value)};
 }
 
@@ -61,12 +61,19 @@ class SliceSnapshot {
   using RecordChannel =
       ::util::fibers_ext::SimpleChannel<DbRecord, base::mpmc_bounded_queue<DbRecord>>;
 
-  SliceSnapshot(DbSlice* slice, RecordChannel* dest, CompressionMode compression_mode);
+  // NONE - a full snapshot that does not track the deltas.
+  // BASE - a full snapshot that starts a delta epoch.
+  // DELTA - saves only the changes of the delta epoch and starts a new one.
+  enum class DeltaMode { NONE, BASE, DELTA };
+
+  // native_encodings is passed to the serializers, see RdbSerializer.
+  SliceSnapshot(DbSlice* slice, RecordChannel* dest, CompressionMode compression_mode,
+                bool native_encodings);
   ~SliceSnapshot();
 
   // Initialize snapshot, start bucket iteration fiber, register listeners.
   // In journal streaming mode it needs to be stopped by either Stop or Cancel.
-  void Start(bool stream_journal, const Cancellation* cll);
+  void Start(bool stream_journal, const Cancellation* cll, DeltaMode delta_mode = DeltaMode::NONE);
 
   // Stop snapshot. Only needs to be called for journal streaming mode.
   void Stop();
@@ -74,6 +81,17 @@ class SliceSnapshot {
   // Wait for iteration fiber to stop.
   void Join();
 
+  // Returns the share of the buckets that the traversal passed, in percent. Must be called from
+  // the thread of the shard.
+  double TraversalProgress() const;
+
+  // Bytes of the records that were pushed into the channels of all the snapshots and were not
+  // consumed yet. They are accounted in used_memory.
+  static size_t BufferedBytes();
+
+  // Must be called by the consumer of the channel for every record it pops.
+  static void ReleaseRecord(const DbRecord& record);
+
   // Force stop. Needs to be called together with cancelling the context.
   // Snapshot can't always react to cancellation in streaming mode becuase the
   // iteration fiber might have finished running by then.
@@ -84,6 +102,22 @@ class SliceSnapshot {
   // and submits them to SerializeBucket.
   void IterateBucketsFb(const Cancellation* cll);
 
+  // Blocks the traversal while the buffered records of all the snapshots exceed
+  // --snapshot_buffer_limit, until the consumers catch up.
+  void WaitForBuffers(const Cancellation* cll);
+
+  // Called by the traversal of a full sync after every step that started at start_ns. Keeps its
+  // CPU time within the budget of every throttle period, see Throttle.
+  void Throttle(uint64_t start_ns);
+
+  // Saves the keys deleted in the delta epoch as tombstones.
+  void SaveDeletedKeys(const Cancellation* cll);
+
+  // Returns true if the bucket has not changed since the base of the delta.
+  bool IsUnchanged(uint64_t version) const {
+    return version <= delta_base_;
+  }
+
   // Called on traversing cursor by IterateBucketsFb.
   bool BucketSaveCb(PrimeIterator it);
 
@@ -92,8 +126,7 @@ class SliceSnapshot {
   unsigned SerializeBucket(DbIndex db_index, PrimeTable::bucket_iterator bucket_it);
 
   // Serialize entry into passed serializer.
-  void SerializeEntry(DbIndex db_index, const PrimeKey& pk, const PrimeValue& pv,
-                      std::optional<uint64_t> expire, RdbSerializer* serializer);
+  void SerializeEntry(PrimeIterator it, RdbSerializer* serializer);
 
   // Push StringFile buffer to channel.
   void PushFileToChannel(DbIndex db_index, io::StringFile* sfile);
@@ -142,7 +175,9 @@ class SliceSnapshot {
   RecordChannel* dest_;
   std::atomic_bool closed_chan_{false};  // true if dest_->StartClosing was already called
 
-  DbIndex current_db_;
+  DbIndex current_db_ = 0;
+  unsigned current_bid_ = 0;  // the logical bucket of current_db_ that the traversal reached.
+  bool traversal_done_ = false;
 
   // TODO : drop default_buffer from this class, we dont realy need it.
   std::unique_ptr<io::StringFile> default_buffer_;  // filled by default_serializer_
@@ -152,12 +187,30 @@ class SliceSnapshot {
   ::boost::fibers::fiber snapshot_fb_;  // IterateEntriesFb
 
   CompressionMode compression_mode_;
+  bool native_encodings_;
   RdbTypeFreqMap type_freq_map_;
 
   // version upper bound for entries that should be saved (not included).
   uint64_t snapshot_version_ = 0;
   uint32_t journal_cb_id_ = 0;
   uint64_t rec_id_ = 0;
+  size_t buffer_limit_ = 0;  // 0 for no limit.
+
+  // The full syncs of the replicas yield the shard to the foreground traffic. The budget is
+  // the share of every period that the traversal may use, it halves after a period in which
+  // transactions waited in the queue of the shard and grows back otherwise.
+  struct ThrottleState {
+    bool enabled = false;
+    double budget = 1;
+    double min_budget = 1;
+    uint64_t period_start_ns = 0;
+    uint64_t used_ns = 0;
+    bool busy = false;
+  } throttle_;
+
+  // Version of the previous snapshot in the delta mode, 0 for a full snapshot.
+  uint64_t delta_base_ = 0;
+  std::vector<absl::flat_hash_set<std::string>> deleted_keys_;
 
   struct Stats {
     size_t channel_bytes = 0;
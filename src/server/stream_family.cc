@@ -4,24 +4,34 @@
 
 #include "server/stream_family.h"
 
+#include <absl/container/flat_hash_map.h>
 #include <absl/strings/str_cat.h>
 
 extern "C" {
 #include "redis/object.h"
+#include "redis/redis_aux.h"
 #include "redis/stream.h"
 }
 
+#include "base/flags.h"
 #include "base/logging.h"
 #include "facade/error.h"
+#include "server/blocking_controller.h"
 #include "server/command_registry.h"
 #include "server/conn_context.h"
 #include "server/engine_shard_set.h"
+#include "server/server_state.h"
 #include "server/transaction.h"
 
+ABSL_FLAG(bool, stream_background_trim, true,
+          "If true, the approximate trims of XADD, i.e. MAXLEN ~ and MINID ~, run when the shard "
+          "is idle rather than inline");
+
 namespace dfly {
 
 using namespace facade;
 using namespace std;
+using absl::GetFlag;
 
 namespace {
 
@@ -43,10 +53,15 @@ struct RangeId {
   bool exclude = false;
 };
 
+struct TrimOpts {
+  streamAddTrimArgs args = {};  // no trimming by default.
+  bool limit_given = false;
+};
+
 struct AddOpts {
   ParsedStreamId parsed_id;
-  uint32_t max_limit = kuint32max;
-  bool max_limit_approx = false;
+  TrimOpts trim;
+  bool no_mkstream = false;
 };
 
 struct GroupInfo {
@@ -63,6 +78,49 @@ struct RangeOpts {
   uint32_t count = kuint32max;
 };
 
+// The position to read a stream from, one per key of XREAD and XREADGROUP.
+struct ReadId {
+  streamID id{0, 0};     // the reply begins after this id.
+  bool last_id = false;  // "$" of XREAD or ">" of XREADGROUP.
+};
+
+struct ReadOpts {
+  string_view group;  // GROUP of XREADGROUP.
+  string_view consumer;
+  bool noack = false;
+  uint32_t count = kuint32max;
+  int64_t block_ms = -1;  // -1 if the command does not block.
+  vector<ReadId> ids;     // in the order of the keys.
+};
+
+struct ClaimOpts {
+  string_view group;
+  string_view consumer;
+  int64_t min_idle_ms = 0;
+  int64_t delivery_ms = -1;  // set by IDLE or TIME, the current time by default.
+  int64_t retry_count = -1;
+  bool force = false;
+  bool just_id = false;
+  streamID last_id{0, 0};  // LASTID
+};
+
+// The changes of XREADGROUP and XCLAIM to a group, which are journaled instead of the commands.
+// The replica could not repeat them, since the delivery times are the current ones and the
+// entries that a read delivers depend on the state of the group.
+struct GroupChanges {
+  struct Delivery {
+    streamID id;
+    mstime_t time;
+    uint64_t count;
+  };
+
+  vector<Delivery> delivered;  // the entries that became pending for the consumer.
+  vector<streamID> dropped;    // the deleted entries that left the PEL.
+  optional<streamID> last_id;  // the new last delivered id of the group.
+};
+
+constexpr streamID kMaxStreamId{UINT64_MAX, UINT64_MAX};
+
 const char kInvalidStreamId[] = "Invalid stream ID specified as stream command argument";
 const char kXGroupKeyNotFound[] =
     "The XGROUP subcommand requires the key to exist. "
@@ -138,16 +196,102 @@ bool ParseRangeId(string_view id, RangeId* dest) {
   return ParseID(id, dest->exclude, 0, &dest->parsed_id);
 }
 
+// Parses MAXLEN or MINID, with the optional "=" or "~", or LIMIT at args[*indx], which is in
+// upper case, and moves *indx to the value of the option. Returns the error, if any.
+const char* ParseTrimOption(CmdArgList args, unsigned* indx, TrimOpts* dest) {
+  streamAddTrimArgs& trim = dest->args;
+  string_view opt = ArgS(args, *indx);
+  if (*indx + 1 >= args.size())
+    return kSyntaxErr;
+
+  if (opt == "LIMIT") {
+    if (!absl::SimpleAtoi(ArgS(args, ++*indx), &trim.limit))
+      return kInvalidIntErr;
+    if (trim.limit < 0)
+      return "The LIMIT argument must be >= 0.";
+    dest->limit_given = true;
+    return nullptr;
+  }
+
+  int strategy = opt == "MAXLEN" ? TRIM_STRATEGY_MAXLEN : TRIM_STRATEGY_MINID;
+  if (trim.trim_strategy != TRIM_STRATEGY_NONE && trim.trim_strategy != strategy)
+    return "syntax error, MAXLEN and MINID options at the same time are not compatible";
+  trim.trim_strategy = strategy;
+
+  string_view next = ArgS(args, *indx + 1);
+  trim.approx_trim = next == "~";
+  if (next == "~" || next == "=") {
+    if (++*indx + 1 >= args.size())
+      return kSyntaxErr;
+  }
+
+  string_view threshold = ArgS(args, ++*indx);
+  if (strategy == TRIM_STRATEGY_MAXLEN) {
+    if (!absl::SimpleAtoi(threshold, &trim.maxlen))
+      return kInvalidIntErr;
+    if (trim.maxlen < 0)
+      return "The MAXLEN argument must be >= 0.";
+  } else {
+    ParsedStreamId parsed;
+    if (!ParseID(threshold, true, 0, &parsed) || !parsed.id_given)
+      return kInvalidStreamId;
+    trim.minid = parsed.val;
+  }
+
+  return nullptr;
+}
+
+// Validates the parsed options and sets the default LIMIT of the approximate trimming, which
+// bounds the work of a command as in Redis.
+const char* FinishTrimOpts(TrimOpts* dest) {
+  streamAddTrimArgs& trim = dest->args;
+  if (!trim.approx_trim) {
+    if (dest->limit_given)
+      return "syntax error, LIMIT cannot be used without the special ~ option";
+  } else if (!dest->limit_given) {
+    trim.limit = 100 * server.stream_node_max_entries;
+  }
+
+  return nullptr;
+}
+
+// Runs the trim that XADD or XTRIM parsed. The approximate trims of XADD are usually postponed
+// to the idle time of the shard, see StreamTrimQueue, and return 0.
+int64_t Trim(const OpArgs& op_args, string_view key, stream* s, const TrimOpts& opts,
+             bool deferrable) {
+  streamAddTrimArgs args = opts.args;
+  if (args.trim_strategy == TRIM_STRATEGY_NONE)
+    return 0;
+
+  if (deferrable && args.approx_trim && GetFlag(FLAGS_stream_background_trim) &&
+      op_args.shard->stream_trim()->Add(op_args.db_cntx.db_index, key, s, args)) {
+    return 0;
+  }
+
+  return streamTrim(s, &args);
+}
+
+// Sets *length to the length of the stream after the entry was added and the stream trimmed.
 OpResult<streamID> OpAdd(const OpArgs& op_args, string_view key, const AddOpts& opts,
-                         CmdArgList args) {
+                         CmdArgList args, uint64_t* length) {
+  // The temporary strings that are longer are freed after the call.
+  constexpr size_t kMaxTmpStrAlloc = 4096;
+
   DCHECK(!args.empty() && args.size() % 2 == 0);
   auto& db_slice = op_args.shard->db_slice();
   pair<PrimeIterator, bool> add_res;
 
-  try {
-    add_res = db_slice.AddOrFind(op_args.db_cntx, key);
-  } catch (bad_alloc&) {
-    return OpStatus::OUT_OF_MEMORY;
+  if (opts.no_mkstream) {
+    auto res_it = db_slice.Find(op_args.db_cntx, key, OBJ_STREAM);
+    if (!res_it)
+      return res_it.status();
+    add_res = {*res_it, false};
+  } else {
+    try {
+      add_res = db_slice.AddOrFind(op_args.db_cntx, key);
+    } catch (bad_alloc&) {
+      return OpStatus::OUT_OF_MEMORY;
+    }
   }
 
   robj* stream_obj = nullptr;
@@ -166,23 +310,39 @@ OpResult<streamID> OpAdd(const OpArgs& op_args, string_view key, const AddOpts&
 
   stream* stream_inst = (stream*)it->second.RObjPtr();
 
-  // we should really get rid of this monstrousity and rewrite streamAppendItem ourselves here.
-  unique_ptr<robj*[]> objs(new robj*[args.size()]);
+  // streamAppendItem() copies the fields and the values into the listpack from the sds strings
+  // of the objects, so these are filled from the temporary strings of the shard rather than
+  // allocated for every call.
+  vector<sds>& strs = op_args.shard->tmp_strs;
+  while (strs.size() < args.size()) {
+    strs.push_back(sdsempty());
+  }
+
+  absl::InlinedVector<robj, 16> objs(args.size());
+  absl::InlinedVector<robj*, 16> argv(args.size());
   for (size_t i = 0; i < args.size(); ++i) {
-    objs[i] = createStringObject(args[i].data(), args[i].size());
+    strs[i] = sdscpylen(strs[i], args[i].data(), args[i].size());
+    objs[i].type = OBJ_STRING;
+    objs[i].encoding = OBJ_ENCODING_RAW;
+    objs[i].ptr = strs[i];
+    argv[i] = &objs[i];
   }
 
   streamID result_id;
   const auto& parsed_id = opts.parsed_id;
   streamID passed_id = parsed_id.val;
-  int res = streamAppendItem(stream_inst, objs.get(), args.size() / 2, &result_id,
+  int res = streamAppendItem(stream_inst, argv.data(), args.size() / 2, &result_id,
                              parsed_id.id_given ? &passed_id : nullptr, parsed_id.has_seq);
 
   for (size_t i = 0; i < args.size(); ++i) {
-    decrRefCount(objs[i]);
+    if (sdsalloc(strs[i]) > kMaxTmpStrAlloc) {
+      sdsfree(strs[i]);
+      strs[i] = sdsempty();
+    }
   }
 
   if (res != C_OK) {
+    db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, !add_res.second);
     if (errno == ERANGE)
       return OpStatus::OUT_OF_RANGE;
     if (errno == EDOM)
@@ -191,34 +351,42 @@ OpResult<streamID> OpAdd(const OpArgs& op_args, string_view key, const AddOpts&
     return OpStatus::OUT_OF_MEMORY;
   }
 
-  if (opts.max_limit < kuint32max) {
-    /* Notify xtrim event if needed. */
-    streamTrimByLength(stream_inst, opts.max_limit, opts.max_limit_approx);
-    // TODO: when replicating, we should propagate it as exact limit in case of trimming.
-  }
+  Trim(op_args, key, stream_inst, opts.trim, true);
+  *length = stream_inst->length;
+  db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, !add_res.second);
+
+  AwakeReaders(op_args, key);
   return result_id;
 }
 
-OpResult<RecordVec> OpRange(const OpArgs& op_args, string_view key, const RangeOpts& opts) {
+// Sets *length to the length of the stream after the trim.
+OpResult<int64_t> OpTrim(const OpArgs& op_args, string_view key, const TrimOpts& opts,
+                         uint64_t* length) {
   auto& db_slice = op_args.shard->db_slice();
   OpResult<PrimeIterator> res_it = db_slice.Find(op_args.db_cntx, key, OBJ_STREAM);
   if (!res_it)
     return res_it.status();
 
-  RecordVec result;
+  PrimeIterator it = *res_it;
+  db_slice.PreUpdate(op_args.db_cntx.db_index, it);
+  stream* s = (stream*)it->second.RObjPtr();
+  int64_t deleted = Trim(op_args, key, s, opts, false);
+  *length = s->length;
+  db_slice.PostUpdate(op_args.db_cntx.db_index, it, key);
 
-  if (opts.count == 0)
-    return result;
+  return deleted;
+}
 
+// Appends to dest at most count entries of the stream in the range [start, end].
+void AppendRecords(stream* s, streamID start, streamID end, bool rev, size_t count,
+                   RecordVec* dest) {
   streamIterator si;
   int64_t numfields;
   streamID id;
-  CompactObj& cobj = (*res_it)->second;
-  stream* s = (stream*)cobj.RObjPtr();
-  streamID sstart = opts.start.val, send = opts.end.val;
+  size_t added = 0;
 
-  streamIteratorStart(&si, s, &sstart, &send, opts.is_rev);
-  while (streamIteratorGetID(&si, &id, &numfields)) {
+  streamIteratorStart(&si, s, &start, &end, rev);
+  while (added < count && streamIteratorGetID(&si, &id, &numfields)) {
     Record rec;
     rec.id = id;
     rec.kv_arr.reserve(numfields);
@@ -234,13 +402,54 @@ OpResult<RecordVec> OpRange(const OpArgs& op_args, string_view key, const RangeO
       rec.kv_arr.emplace_back(move(skey), move(sval));
     }
 
-    result.push_back(move(rec));
-
-    if (opts.count == result.size())
-      break;
+    dest->push_back(move(rec));
+    ++added;
   }
 
   streamIteratorStop(&si);
+}
+
+// Returns true if the stream holds more than n entries after id. Stops at the first n + 1.
+bool HasEntriesAfter(stream* s, streamID id, uint64_t n) {
+  if (streamCompareID(&s->last_id, &id) <= 0 || streamIncrID(&id) != C_OK)
+    return false;
+
+  streamIterator si;
+  int64_t numfields;
+  streamID cur, end = kMaxStreamId;
+  uint64_t seen = 0;
+
+  streamIteratorStart(&si, s, &id, &end, 0);
+  while (seen <= n && streamIteratorGetID(&si, &cur, &numfields)) {
+    ++seen;
+  }
+  streamIteratorStop(&si);
+
+  return seen > n;
+}
+
+// Wakes the XREAD and XREADGROUP commands that wait for the stream.
+void AwakeReaders(const OpArgs& op_args, string_view key) {
+  BlockingController* bc = op_args.shard->blocking_controller();
+  if (bc) {
+    bc->AwakeWatched(op_args.db_cntx.db_index, key);
+  }
+}
+
+OpResult<RecordVec> OpRange(const OpArgs& op_args, string_view key, const RangeOpts& opts) {
+  auto& db_slice = op_args.shard->db_slice();
+  OpResult<PrimeIterator> res_it = db_slice.Find(op_args.db_cntx, key, OBJ_STREAM);
+  if (!res_it)
+    return res_it.status();
+
+  RecordVec result;
+
+  if (opts.count == 0)
+    return result;
+
+  CompactObj& cobj = (*res_it)->second;
+  stream* s = (stream*)cobj.RObjPtr();
+  AppendRecords(s, opts.start.val, opts.end.val, opts.is_rev, opts.count, &result);
 
   return result;
 }
@@ -349,6 +558,7 @@ OpStatus OpDestroyGroup(const OpArgs& op_args, string_view key, string_view gnam
   if (scg) {
     raxRemove(s->cgroups, (uint8_t*)(gname.data()), gname.size(), NULL);
     streamFreeCG(scg);
+    AwakeReaders(op_args, key);  // the blocked readers of the group fail.
     return OpStatus::OK;
   }
 
@@ -400,6 +610,7 @@ OpStatus OpSetId(const OpArgs& op_args, string_view key, string_view gname, stri
     }
   }
   cg->last_id = sid;
+  AwakeReaders(op_args, key);
 
   return OpStatus::OK;
 }
@@ -486,6 +697,243 @@ OpResult<uint32_t> OpDel(const OpArgs& op_args, string_view key, absl::Span<stre
   return deleted;
 }
 
+// XREAD of a single stream.
+OpResult<RecordVec> OpRead(const OpArgs& op_args, string_view key, const ReadOpts& opts,
+                           ReadId* read_id) {
+  auto& db_slice = op_args.shard->db_slice();
+  OpResult<PrimeIterator> res_it = db_slice.Find(op_args.db_cntx, key, OBJ_STREAM);
+  if (!res_it) {
+    // A stream that does not exist yet is read from its beginning.
+    read_id->last_id = false;
+    return res_it.status();
+  }
+
+  CompactObj& cobj = (*res_it)->second;
+  stream* s = (stream*)cobj.RObjPtr();
+  RecordVec result;
+
+  // "$" is resolved by the first read, so that the blocked command returns the entries that
+  // are added after it.
+  if (read_id->last_id) {
+    read_id->id = s->last_id;
+    read_id->last_id = false;
+    return result;
+  }
+
+  streamID start = read_id->id;
+  if (streamIncrID(&start) == C_OK) {
+    AppendRecords(s, start, kMaxStreamId, false, opts.count, &result);
+  }
+
+  return result;
+}
+
+// XREADGROUP of a single stream. Returns SKIPPED if the group does not exist.
+OpResult<RecordVec> OpReadGroup(const OpArgs& op_args, string_view key, const ReadOpts& opts,
+                                const ReadId& read_id, GroupChanges* changes) {
+  OpResult<pair<stream*, streamCG*>> cgr_res = FindGroup(op_args, key, opts.group);
+  if (!cgr_res)
+    return cgr_res.status();
+
+  auto [s, cg] = *cgr_res;
+  if (cg == nullptr)
+    return OpStatus::SKIPPED;
+
+  auto* shard = op_args.shard;
+  shard->tmp_str1 = sdscpylen(shard->tmp_str1, opts.consumer.data(), opts.consumer.size());
+  streamConsumer* consumer = streamLookupConsumer(cg, shard->tmp_str1, SLC_DEFAULT);
+  if (consumer == nullptr) {
+    consumer = streamCreateConsumer(cg, shard->tmp_str1, NULL, 0, SCC_DEFAULT);
+  }
+
+  RecordVec result;
+  mstime_t now = mstime();
+  unsigned char buf[sizeof(streamID)];
+
+  if (!read_id.last_id) {
+    // The history of the consumer: its pending entries after the id. The deleted entries are
+    // returned without their fields.
+    streamID start = read_id.id;
+    if (streamIncrID(&start) != C_OK)
+      return result;
+
+    streamEncodeID(buf, &start);
+    raxIterator ri;
+    raxStart(&ri, consumer->pel);
+    raxSeek(&ri, ">=", buf, sizeof(buf));
+    while (result.size() < opts.count && raxNext(&ri)) {
+      streamID id;
+      streamDecodeID(ri.key, &id);
+      size_t prev_size = result.size();
+      AppendRecords(s, id, id, false, 1, &result);
+      if (result.size() == prev_size) {
+        result.push_back(Record{id, {}});
+      }
+
+      streamNACK* nack = (streamNACK*)ri.data;
+      nack->delivery_time = now;
+      nack->delivery_count++;
+      changes->delivered.push_back({id, now, nack->delivery_count});
+    }
+    raxStop(&ri);
+
+    return result;
+  }
+
+  streamID start = cg->last_id;
+  if (streamIncrID(&start) != C_OK)
+    return result;
+
+  AppendRecords(s, start, kMaxStreamId, false, opts.count, &result);
+
+  for (const Record& rec : result) {
+    streamID id = rec.id;
+    if (cg->entries_read != SCG_INVALID_ENTRIES_READ &&
+        !streamRangeHasTombstones(s, &id, NULL)) {
+      cg->entries_read++;
+    } else if (s->entries_added) {
+      cg->entries_read = streamEstimateDistanceFromFirstEverEntry(s, &id);
+    }
+    cg->last_id = id;
+    changes->last_id = id;
+
+    if (opts.noack)
+      continue;
+
+    // The entry may be pending for another consumer if the group was moved back by SETID.
+    streamEncodeID(buf, &id);
+    streamNACK* nack = streamCreateNACK(consumer);
+    if (!raxTryInsert(cg->pel, buf, sizeof(buf), nack, NULL)) {
+      streamFreeNACK(nack);
+      nack = (streamNACK*)raxFind(cg->pel, buf, sizeof(buf));
+      raxRemove(nack->consumer->pel, buf, sizeof(buf), NULL);
+      nack->consumer = consumer;
+      nack->delivery_time = now;
+      nack->delivery_count = 1;
+    }
+    raxInsert(consumer->pel, buf, sizeof(buf), nack, NULL);
+    changes->delivered.push_back({id, nack->delivery_time, nack->delivery_count});
+  }
+
+  return result;
+}
+
+OpResult<uint32_t> OpAck(const OpArgs& op_args, string_view key, string_view gname,
+                         absl::Span<streamID> ids) {
+  OpResult<pair<stream*, streamCG*>> cgr_res = FindGroup(op_args, key, gname);
+  if (!cgr_res)
+    return cgr_res.status();
+
+  streamCG* cg = cgr_res->second;
+  if (cg == nullptr)
+    return 0u;
+
+  uint32_t acknowledged = 0;
+  unsigned char buf[sizeof(streamID)];
+
+  for (streamID id : ids) {
+    streamEncodeID(buf, &id);
+
+    // From the group PEL and the consumer PEL, which share the NACK.
+    streamNACK* nack = (streamNACK*)raxFind(cg->pel, buf, sizeof(buf));
+    if (nack == raxNotFound)
+      continue;
+
+    raxRemove(cg->pel, buf, sizeof(buf), NULL);
+    raxRemove(nack->consumer->pel, buf, sizeof(buf), NULL);
+    streamFreeNACK(nack);
+    ++acknowledged;
+  }
+
+  return acknowledged;
+}
+
+// Returns the claimed entries, without their fields if opts.just_id is set.
+// Returns SKIPPED if the group does not exist.
+OpResult<RecordVec> OpClaim(const OpArgs& op_args, string_view key, const ClaimOpts& opts,
+                            absl::Span<streamID> ids, GroupChanges* changes) {
+  OpResult<pair<stream*, streamCG*>> cgr_res = FindGroup(op_args, key, opts.group);
+  if (!cgr_res)
+    return cgr_res.status();
+
+  auto [s, cg] = *cgr_res;
+  if (cg == nullptr)
+    return OpStatus::SKIPPED;
+
+  mstime_t now = mstime();
+  mstime_t delivery_ms = opts.delivery_ms >= 0 ? min<mstime_t>(opts.delivery_ms, now) : now;
+
+  streamID last_id = opts.last_id;
+  if (streamCompareID(&last_id, &cg->last_id) > 0) {
+    cg->last_id = last_id;
+    changes->last_id = last_id;
+  }
+
+  auto* shard = op_args.shard;
+  streamConsumer* consumer = nullptr;
+  RecordVec result;
+  unsigned char buf[sizeof(streamID)];
+
+  for (streamID id : ids) {
+    streamEncodeID(buf, &id);
+    streamNACK* nack = (streamNACK*)raxFind(cg->pel, buf, sizeof(buf));
+
+    // Only the existing entries are claimed, the deleted ones leave the PEL.
+    if (!streamEntryExists(s, &id)) {
+      if (nack != raxNotFound) {
+        raxRemove(cg->pel, buf, sizeof(buf), NULL);
+        raxRemove(nack->consumer->pel, buf, sizeof(buf), NULL);
+        streamFreeNACK(nack);
+        changes->dropped.push_back(id);
+      }
+      continue;
+    }
+
+    // FORCE adds the entries that are not pending to the PEL.
+    if (nack == raxNotFound) {
+      if (!opts.force)
+        continue;
+      nack = streamCreateNACK(NULL);
+      raxInsert(cg->pel, buf, sizeof(buf), nack, NULL);
+    }
+
+    if (opts.min_idle_ms > 0 && now - nack->delivery_time < opts.min_idle_ms)
+      continue;
+
+    if (consumer == nullptr) {
+      shard->tmp_str1 = sdscpylen(shard->tmp_str1, opts.consumer.data(), opts.consumer.size());
+      consumer = streamLookupConsumer(cg, shard->tmp_str1, SLC_DEFAULT);
+      if (consumer == nullptr) {
+        consumer = streamCreateConsumer(cg, shard->tmp_str1, NULL, 0, SCC_DEFAULT);
+      }
+    }
+
+    if (nack->consumer != consumer) {
+      if (nack->consumer) {
+        raxRemove(nack->consumer->pel, buf, sizeof(buf), NULL);
+      }
+      raxInsert(consumer->pel, buf, sizeof(buf), nack, NULL);
+      nack->consumer = consumer;
+    }
+
+    nack->delivery_time = delivery_ms;
+    if (opts.retry_count >= 0) {
+      nack->delivery_count = opts.retry_count;
+    } else if (!opts.just_id) {
+      nack->delivery_count++;
+    }
+    changes->delivered.push_back({id, nack->delivery_time, nack->delivery_count});
+
+    if (opts.just_id) {
+      result.push_back(Record{id, {}});
+    } else {
+      AppendRecords(s, id, id, false, 1, &result);
+    }
+  }
+
+  return result;
+}
+
 void CreateGroup(CmdArgList args, string_view key, ConnectionContext* cntx) {
   if (args.size() < 2)
     return (*cntx)->SendError(UnknownSubCmd("CREATE", "XGROUP"));
@@ -563,6 +1011,251 @@ void SetId(string_view key, string_view gname, CmdArgList args, ConnectionContex
   }
 }
 
+// Replies with the entries like XRANGE. The entries without fields, which were deleted while
+// pending, are replied with a null array instead of their fields.
+void SendRecords(const RecordVec& records, ConnectionContext* cntx) {
+  (*cntx)->StartArray(records.size());
+  for (const auto& item : records) {
+    (*cntx)->StartArray(2);
+    (*cntx)->SendBulkString(StreamIdRepr(item.id));
+    if (item.kv_arr.empty()) {
+      (*cntx)->SendNullArray();
+      continue;
+    }
+
+    (*cntx)->StartArray(item.kv_arr.size() * 2);
+    for (const auto& k_v : item.kv_arr) {
+      (*cntx)->SendBulkString(k_v.first);
+      (*cntx)->SendBulkString(k_v.second);
+    }
+  }
+}
+
+// An id of XREAD, XREADGROUP, XACK or XCLAIM, i.e. <ms> or <ms>-<seq>.
+bool ParseExactId(string_view str, streamID* dest) {
+  ParsedStreamId parsed_id;
+  if (!ParseID(str, true, 0, &parsed_id) || !parsed_id.id_given || !parsed_id.has_seq)
+    return false;
+
+  *dest = parsed_id.val;
+  return true;
+}
+
+// Journals the changes to the group as XGROUP SETID, XACK of the dropped entries and XCLAIM of
+// every delivered entry with its delivery time and count, like Redis propagates them. Returns
+// false if there are none.
+bool RecordGroupChanges(Transaction* t, EngineShard* shard, string_view key, string_view group,
+                        string_view consumer, const GroupChanges& changes) {
+  if (changes.last_id) {
+    string id = StreamIdRepr(*changes.last_id);
+    t->RecordJournal(shard, {"XGROUP", "SETID", key, group, id});
+  }
+
+  if (!changes.dropped.empty()) {
+    vector<string> ids;
+    for (const streamID& id : changes.dropped)
+      ids.push_back(StreamIdRepr(id));
+    vector<string_view> cmd{"XACK", key, group};
+    cmd.insert(cmd.end(), ids.begin(), ids.end());
+    t->RecordJournal(shard, cmd);
+  }
+
+  for (const GroupChanges::Delivery& delivery : changes.delivered) {
+    string id = StreamIdRepr(delivery.id), time = absl::StrCat(delivery.time);
+    string count = absl::StrCat(delivery.count);
+    t->RecordJournal(shard, {"XCLAIM", key, group, consumer, "0", id, "TIME", time, "RETRYCOUNT",
+                             count, "FORCE", "JUSTID"});
+  }
+
+  return changes.last_id || !changes.dropped.empty() || !changes.delivered.empty();
+}
+
+// XREAD [COUNT count] [BLOCK ms] STREAMS key [key ...] id [id ...]
+// XREADGROUP GROUP group consumer [COUNT count] [BLOCK ms] [NOACK]
+//   STREAMS key [key ...] id [id ...]
+void XReadGeneric(CmdArgList args, bool is_group, ConnectionContext* cntx) {
+  ReadOpts opts;
+
+  unsigned indx = 1;
+  if (is_group) {
+    ToUpper(&args[1]);
+    if (args.size() < 4 || ArgS(args, 1) != "GROUP")
+      return (*cntx)->SendError(kSyntaxErr);
+
+    opts.group = ArgS(args, 2);
+    opts.consumer = ArgS(args, 3);
+    indx = 4;
+  }
+
+  for (; indx < args.size(); ++indx) {
+    ToUpper(&args[indx]);
+    string_view arg = ArgS(args, indx);
+    if (arg == "STREAMS")
+      break;
+
+    bool has_value = indx + 1 < args.size();
+    if (arg == "COUNT" && has_value) {
+      if (!absl::SimpleAtoi(ArgS(args, ++indx), &opts.count))
+        return (*cntx)->SendError(kInvalidIntErr);
+      if (opts.count == 0)  // does not limit the reply, as in Redis.
+        opts.count = kuint32max;
+    } else if (arg == "BLOCK" && has_value) {
+      if (!absl::SimpleAtoi(ArgS(args, ++indx), &opts.block_ms))
+        return (*cntx)->SendError("timeout is not an integer or out of range");
+      if (opts.block_ms < 0)
+        return (*cntx)->SendError("timeout is negative");
+    } else if (is_group && arg == "NOACK") {
+      opts.noack = true;
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
+  // DetermineKeys() verified that STREAMS is followed by the pairs of keys and ids.
+  DCHECK_LT(indx, args.size());
+  unsigned keys_pos = indx + 1;
+  unsigned num_streams = (args.size() - keys_pos) / 2;
+  bool has_history = false;  // XREADGROUP replies the history of the consumer without waiting.
+
+  opts.ids.resize(num_streams);
+  for (unsigned i = 0; i < num_streams; ++i) {
+    string_view id = ArgS(args, keys_pos + num_streams + i);
+    if (id == (is_group ? ">" : "$")) {
+      opts.ids[i].last_id = true;
+    } else if (ParseExactId(id, &opts.ids[i].id)) {
+      has_history |= is_group;
+    } else {
+      return (*cntx)->SendError(kInvalidStreamId, kSyntaxErrType);
+    }
+  }
+
+  vector<OpResult<RecordVec>> results(num_streams, OpResult<RecordVec>{OpStatus::KEY_NOTFOUND});
+
+  auto read_cb = [&](Transaction* t, EngineShard* shard) {
+    ShardId sid = shard->shard_id();
+    ArgSlice keys = t->ShardArgsInShard(sid);
+    OpArgs op_args = t->GetOpArgs(shard);
+
+    bool changed = false;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      // The reverse index does not count the command name.
+      size_t key_indx = t->ReverseArgIndex(sid, i) + 1 - keys_pos;
+      ReadId& read_id = opts.ids[key_indx];
+      if (!is_group) {
+        results[key_indx] = OpRead(op_args, keys[i], opts, &read_id);
+        continue;
+      }
+
+      GroupChanges changes;
+      results[key_indx] = OpReadGroup(op_args, keys[i], opts, read_id, &changes);
+      changed |= RecordGroupChanges(t, shard, keys[i], opts.group, opts.consumer, changes);
+    }
+
+    // A read that delivered nothing is not journaled.
+    if (is_group && !changed)
+      t->RecordJournal(shard, {});
+    return OpStatus::OK;
+  };
+
+  // Returns true if there is nothing to reply yet.
+  auto is_empty = [&] {
+    if (has_history)
+      return false;
+    for (const auto& res : results) {
+      if (res && !res->empty())
+        return false;
+      if (!res && (is_group || res.status() != OpStatus::KEY_NOTFOUND))
+        return false;  // replies with an error.
+    }
+    return true;
+  };
+
+  Transaction* transaction = cntx->transaction;
+  if (opts.block_ms < 0 || transaction->IsMulti()) {
+    transaction->ScheduleSingleHop(read_cb);
+  } else {
+    transaction->Schedule();
+    transaction->Execute(read_cb, false);
+
+    if (!is_empty()) {
+      transaction->Execute([](Transaction* t, EngineShard* shard) { return OpStatus::OK; }, true);
+    } else {
+      absl::flat_hash_map<string_view, unsigned> key_indices;
+      for (unsigned i = 0; i < num_streams; ++i) {
+        key_indices.emplace(ArgS(args, keys_pos + i), i);
+      }
+
+      // An XREAD waiter is woken by any new entry and a group reader only if the entries
+      // after the last delivered one are more than the woken readers are about to consume.
+      // The ones that wait for a deleted group are woken to fail.
+      auto ready_cb = [&](const PrimeValue& pv, string_view key, size_t awakened) {
+        auto it = key_indices.find(key);
+        if (it == key_indices.end() || pv.ObjType() != OBJ_STREAM)
+          return false;
+
+        stream* s = (stream*)pv.RObjPtr();
+        if (!is_group)
+          return HasEntriesAfter(s, opts.ids[it->second].id, 0);
+
+        void* cg = s->cgroups ? raxFind(s->cgroups, (uint8_t*)opts.group.data(),
+                                        opts.group.size())
+                              : raxNotFound;
+        if (cg == raxNotFound)
+          return true;
+        if (awakened > 0 && opts.count == kuint32max)
+          return false;
+        return HasEntriesAfter(s, ((streamCG*)cg)->last_id, uint64_t(awakened) * opts.count);
+      };
+
+      using time_point = Transaction::time_point;
+      time_point tp = opts.block_ms ? chrono::steady_clock::now() +
+                                          chrono::milliseconds(opts.block_ms)
+                                    : time_point::max();
+
+      auto* stats = ServerState::tl_connection_stats();
+      ++stats->num_blocked_clients;
+      bool wait_succeeded = transaction->WaitOnWatch(tp, std::move(ready_cb));
+      --stats->num_blocked_clients;
+
+      if (!wait_succeeded)
+        return (*cntx)->SendNullArray();
+
+      transaction->Execute(read_cb, true);
+    }
+  }
+
+  vector<unsigned> replied;
+  for (unsigned i = 0; i < num_streams; ++i) {
+    const auto& res = results[i];
+    if (res) {
+      if (!res->empty() || (is_group && !opts.ids[i].last_id))
+        replied.push_back(i);
+      continue;
+    }
+
+    OpStatus status = res.status();
+    if (status == OpStatus::KEY_NOTFOUND && !is_group)
+      continue;
+
+    if (status == OpStatus::KEY_NOTFOUND || status == OpStatus::SKIPPED) {
+      return (*cntx)->SendError(absl::StrCat("-NOGROUP No such key '", ArgS(args, keys_pos + i),
+                                             "' or consumer group '", opts.group,
+                                             "' in XREADGROUP with GROUP option"));
+    }
+    return (*cntx)->SendError(status);
+  }
+
+  if (replied.empty())
+    return (*cntx)->SendNullArray();
+
+  (*cntx)->StartArray(replied.size());
+  for (unsigned i : replied) {
+    (*cntx)->StartArray(2);
+    (*cntx)->SendBulkString(ArgS(args, keys_pos + i));
+    SendRecords(*results[i], cntx);
+  }
+}
+
 }  // namespace
 
 void StreamFamily::XAdd(CmdArgList args, ConnectionContext* cntx) {
@@ -573,24 +1266,19 @@ void StreamFamily::XAdd(CmdArgList args, ConnectionContext* cntx) {
   for (; id_indx < args.size(); ++id_indx) {
     ToUpper(&args[id_indx]);
     string_view arg = ArgS(args, id_indx);
-    if (arg == "MAXLEN") {
-      if (id_indx + 2 >= args.size()) {
-        return (*cntx)->SendError(kSyntaxErr);
-      }
-      ++id_indx;
-      if (ArgS(args, id_indx) == "~") {
-        add_opts.max_limit_approx = true;
-        ++id_indx;
-      }
-      arg = ArgS(args, id_indx);
-      if (!absl::SimpleAtoi(arg, &add_opts.max_limit)) {
-        return (*cntx)->SendError(kSyntaxErr);
-      }
+    if (arg == "MAXLEN" || arg == "MINID" || arg == "LIMIT") {
+      if (const char* error = ParseTrimOption(args, &id_indx, &add_opts.trim))
+        return (*cntx)->SendError(error);
+    } else if (arg == "NOMKSTREAM") {
+      add_opts.no_mkstream = true;
     } else {
       break;
     }
   }
 
+  if (const char* error = FinishTrimOpts(&add_opts.trim))
+    return (*cntx)->SendError(error);
+
   args.remove_prefix(id_indx);
   if (args.size() < 3 || args.size() % 2 == 0) {
     return (*cntx)->SendError(WrongNumArgsError("XADD"), kSyntaxErrType);
@@ -603,8 +1291,29 @@ void StreamFamily::XAdd(CmdArgList args, ConnectionContext* cntx) {
   }
 
   args.remove_prefix(1);
+
+  // XADD is journaled with the ID that it added, and with the exact length that it trimmed the
+  // stream to, as the approximate trims depend on the nodes of the stream. A trim that was
+  // postponed trims nothing then, and is journaled when it runs, see StreamTrimQueue.
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpAdd(t->GetOpArgs(shard), key, add_opts, args);
+    uint64_t length = 0;
+    OpResult<streamID> res = OpAdd(t->GetOpArgs(shard), key, add_opts, args, &length);
+    if (!res)
+      return res;
+
+    string id = StreamIdRepr(*res);
+    string maxlen = absl::StrCat(length);
+    vector<string_view> cmd = {"XADD", key};
+    if (add_opts.trim.args.trim_strategy != TRIM_STRATEGY_NONE) {
+      cmd.push_back("MAXLEN");
+      cmd.push_back(maxlen);
+    }
+    cmd.push_back(id);
+    for (size_t i = 0; i < args.size(); ++i) {
+      cmd.push_back(ArgS(args, i));
+    }
+    t->RecordJournal(shard, cmd);
+    return res;
   };
 
   OpResult<streamID> add_result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
@@ -612,6 +1321,10 @@ void StreamFamily::XAdd(CmdArgList args, ConnectionContext* cntx) {
     return (*cntx)->SendBulkString(StreamIdRepr(*add_result));
   }
 
+  if (add_result.status() == OpStatus::KEY_NOTFOUND) {
+    return (*cntx)->SendNull();
+  }
+
   if (add_result.status() == OpStatus::STREAM_ID_SMALL) {
     return (*cntx)->SendError(
         "The ID specified in XADD is equal or smaller than "
@@ -621,6 +1334,114 @@ void StreamFamily::XAdd(CmdArgList args, ConnectionContext* cntx) {
   return (*cntx)->SendError(add_result.status());
 }
 
+void StreamFamily::XAck(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  string_view gname = ArgS(args, 2);
+  args.remove_prefix(3);
+
+  absl::InlinedVector<streamID, 8> ids(args.size());
+  for (size_t i = 0; i < args.size(); ++i) {
+    if (!ParseExactId(ArgS(args, i), &ids[i])) {
+      return (*cntx)->SendError(kInvalidStreamId, kSyntaxErrType);
+    }
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpAck(t->GetOpArgs(shard), key, gname, absl::Span{ids.data(), ids.size()});
+  };
+
+  OpResult<uint32_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result || result.status() == OpStatus::KEY_NOTFOUND) {
+    return (*cntx)->SendLong(*result);
+  }
+
+  (*cntx)->SendError(result.status());
+}
+
+// XCLAIM key group consumer min-idle-time id [id ...] [IDLE ms] [TIME unix-time-ms]
+//   [RETRYCOUNT count] [FORCE] [JUSTID] [LASTID id]
+void StreamFamily::XClaim(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  ClaimOpts opts;
+  opts.group = ArgS(args, 2);
+  opts.consumer = ArgS(args, 3);
+
+  if (!absl::SimpleAtoi(ArgS(args, 4), &opts.min_idle_ms)) {
+    return (*cntx)->SendError("Invalid min-idle-time argument for XCLAIM");
+  }
+  opts.min_idle_ms = max<int64_t>(opts.min_idle_ms, 0);
+
+  // The ids are followed by the options.
+  unsigned indx = 5;
+  absl::InlinedVector<streamID, 8> ids;
+  for (; indx < args.size(); ++indx) {
+    streamID id;
+    if (!ParseExactId(ArgS(args, indx), &id))
+      break;
+    ids.push_back(id);
+  }
+
+  if (ids.empty()) {
+    return (*cntx)->SendError(kInvalidStreamId, kSyntaxErrType);
+  }
+
+  for (; indx < args.size(); ++indx) {
+    ToUpper(&args[indx]);
+    string_view arg = ArgS(args, indx);
+    bool has_value = indx + 1 < args.size();
+
+    if (arg == "FORCE") {
+      opts.force = true;
+    } else if (arg == "JUSTID") {
+      opts.just_id = true;
+    } else if (arg == "IDLE" && has_value) {
+      int64_t idle_ms;
+      if (!absl::SimpleAtoi(ArgS(args, ++indx), &idle_ms))
+        return (*cntx)->SendError("Invalid IDLE option argument for XCLAIM");
+      opts.delivery_ms = max<int64_t>(mstime() - idle_ms, 0);
+    } else if (arg == "TIME" && has_value) {
+      if (!absl::SimpleAtoi(ArgS(args, ++indx), &opts.delivery_ms))
+        return (*cntx)->SendError("Invalid TIME option argument for XCLAIM");
+      opts.delivery_ms = max<int64_t>(opts.delivery_ms, 0);
+    } else if (arg == "RETRYCOUNT" && has_value) {
+      if (!absl::SimpleAtoi(ArgS(args, ++indx), &opts.retry_count) || opts.retry_count < 0)
+        return (*cntx)->SendError("Invalid RETRYCOUNT option argument for XCLAIM");
+    } else if (arg == "LASTID" && has_value) {
+      if (!ParseExactId(ArgS(args, ++indx), &opts.last_id))
+        return (*cntx)->SendError(kInvalidStreamId, kSyntaxErrType);
+    } else {
+      return (*cntx)->SendError(absl::StrCat("Unrecognized XCLAIM option '", arg, "'"));
+    }
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    GroupChanges changes;
+    auto res = OpClaim(t->GetOpArgs(shard), key, opts, absl::Span{ids.data(), ids.size()},
+                       &changes);
+    if (!RecordGroupChanges(t, shard, key, opts.group, opts.consumer, changes))
+      t->RecordJournal(shard, {});
+    return res;
+  };
+
+  OpResult<RecordVec> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!result) {
+    if (result.status() == OpStatus::KEY_NOTFOUND || result.status() == OpStatus::SKIPPED) {
+      return (*cntx)->SendError(
+          absl::StrCat("-NOGROUP No such key '", key, "' or consumer group '", opts.group, "'"));
+    }
+    return (*cntx)->SendError(result.status());
+  }
+
+  if (!opts.just_id) {
+    return SendRecords(*result, cntx);
+  }
+
+  (*cntx)->StartArray(result->size());
+  for (const auto& item : *result) {
+    (*cntx)->SendBulkString(StreamIdRepr(item.id));
+  }
+}
+
 void StreamFamily::XDel(CmdArgList args, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
   args.remove_prefix(2);
@@ -760,6 +1581,14 @@ void StreamFamily::XRange(CmdArgList args, ConnectionContext* cntx) {
   XRangeGeneric(std::move(args), false, cntx);
 }
 
+void StreamFamily::XRead(CmdArgList args, ConnectionContext* cntx) {
+  XReadGeneric(std::move(args), false, cntx);
+}
+
+void StreamFamily::XReadGroup(CmdArgList args, ConnectionContext* cntx) {
+  XReadGeneric(std::move(args), true, cntx);
+}
+
 void StreamFamily::XRevRange(CmdArgList args, ConnectionContext* cntx) {
   XRangeGeneric(std::move(args), true, cntx);
 }
@@ -791,6 +1620,43 @@ void StreamFamily::XSetId(CmdArgList args, ConnectionContext* cntx) {
   }
 }
 
+void StreamFamily::XTrim(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  TrimOpts trim_opts;
+
+  for (unsigned indx = 2; indx < args.size(); ++indx) {
+    ToUpper(&args[indx]);
+    string_view arg = ArgS(args, indx);
+    if (arg != "MAXLEN" && arg != "MINID" && arg != "LIMIT")
+      return (*cntx)->SendError(kSyntaxErr);
+    if (const char* error = ParseTrimOption(args, &indx, &trim_opts))
+      return (*cntx)->SendError(error);
+  }
+
+  if (trim_opts.args.trim_strategy == TRIM_STRATEGY_NONE)
+    return (*cntx)->SendError(kSyntaxErr);
+  if (const char* error = FinishTrimOpts(&trim_opts))
+    return (*cntx)->SendError(error);
+
+  // An approximate trim is journaled with the exact length that it left.
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    uint64_t length = 0;
+    OpResult<int64_t> res = OpTrim(t->GetOpArgs(shard), key, trim_opts, &length);
+    if (res && trim_opts.args.approx_trim) {
+      string maxlen = absl::StrCat(length);
+      t->RecordJournal(shard, {"XTRIM", key, "MAXLEN", maxlen});
+    }
+    return res;
+  };
+
+  OpResult<int64_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result || result.status() == OpStatus::KEY_NOTFOUND) {
+    return (*cntx)->SendLong(*result);
+  }
+
+  return (*cntx)->SendError(result.status());
+}
+
 void StreamFamily::XRangeGeneric(CmdArgList args, bool is_rev, ConnectionContext* cntx) {
   string_view key = ArgS(args, 1);
   string_view start = ArgS(args, 2);
@@ -833,17 +1699,7 @@ void StreamFamily::XRangeGeneric(CmdArgList args, bool is_rev, ConnectionContext
   OpResult<RecordVec> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
 
   if (result) {
-    (*cntx)->StartArray(result->size());
-    for (const auto& item : *result) {
-      (*cntx)->StartArray(2);
-      (*cntx)->SendBulkString(StreamIdRepr(item.id));
-      (*cntx)->StartArray(item.kv_arr.size() * 2);
-      for (const auto& k_v : item.kv_arr) {
-        (*cntx)->SendBulkString(k_v.first);
-        (*cntx)->SendBulkString(k_v.second);
-      }
-    }
-    return;
+    return SendRecords(*result, cntx);
   }
 
   if (result.status() == OpStatus::KEY_NOTFOUND) {
@@ -857,14 +1713,21 @@ void StreamFamily::XRangeGeneric(CmdArgList args, bool is_rev, ConnectionContext
 void StreamFamily::Register(CommandRegistry* registry) {
   using CI = CommandId;
 
-  *registry << CI{"XADD", CO::WRITE | CO::FAST, -5, 1, 1, 1}.HFUNC(XAdd)
+  constexpr uint32_t kReadMask = CO::BLOCKING | CO::VARIADIC_KEYS;
+
+  *registry << CI{"XACK", CO::WRITE | CO::FAST, -4, 1, 1, 1}.HFUNC(XAck)
+            << CI{"XADD", CO::WRITE | CO::FAST, -5, 1, 1, 1}.HFUNC(XAdd)
+            << CI{"XCLAIM", CO::WRITE | CO::FAST, -6, 1, 1, 1}.HFUNC(XClaim)
             << CI{"XDEL", CO::WRITE | CO::FAST, -3, 1, 1, 1}.HFUNC(XDel)
             << CI{"XGROUP", CO::WRITE | CO::DENYOOM, -2, 2, 2, 1}.HFUNC(XGroup)
             << CI{"XINFO", CO::READONLY | CO::NOSCRIPT, -2, 0, 0, 0}.HFUNC(XInfo)
             << CI{"XLEN", CO::READONLY | CO::FAST, 2, 1, 1, 1}.HFUNC(XLen)
             << CI{"XRANGE", CO::READONLY, -4, 1, 1, 1}.HFUNC(XRange)
+            << CI{"XREAD", CO::READONLY | kReadMask, -4, 3, 3, 1}.HFUNC(XRead)
+            << CI{"XREADGROUP", CO::WRITE | kReadMask, -7, 6, 6, 1}.HFUNC(XReadGroup)
             << CI{"XREVRANGE", CO::READONLY, -4, 1, 1, 1}.HFUNC(XRevRange)
-            << CI{"XSETID", CO::WRITE | CO::DENYOOM, 3, 1, 1, 1}.HFUNC(XSetId);
+            << CI{"XSETID", CO::WRITE | CO::DENYOOM, 3, 1, 1, 1}.HFUNC(XSetId)
+            << CI{"XTRIM", CO::WRITE, -4, 1, 1, 1}.HFUNC(XTrim);
 }
 
 }  // namespace dfly
@@ -14,6 +14,8 @@ using namespace testing;
 using namespace std;
 using namespace util;
 
+ABSL_DECLARE_FLAG(bool, stream_background_trim);
+
 namespace dfly {
 
 class StreamFamilyTest : public BaseFamilyTest {
@@ -64,6 +66,51 @@ TEST_F(StreamFamilyTest, AddExtended) {
   EXPECT_THAT(resp3, ErrArg("equal or smaller than"));
 }
 
+TEST_F(StreamFamilyTest, Trim) {
+  for (unsigned i = 1; i <= 10; ++i) {
+    Run({"xadd", "s", absl::StrCat(i), "f", "v"});
+  }
+
+  EXPECT_THAT(Run({"xtrim", "s", "maxlen", "5"}), IntArg(5));
+  EXPECT_THAT(Run({"xtrim", "s", "minid", "=", "8"}), IntArg(2));
+  EXPECT_EQ(Run({"xrange", "s", "-", "+"}).GetVec()[0].GetVec()[0], "8-0");
+
+  // A node of the stream is deleted only as a whole by the approximate trimming.
+  EXPECT_THAT(Run({"xtrim", "s", "maxlen", "~", "1"}), IntArg(0));
+  EXPECT_THAT(Run({"xlen", "s"}), IntArg(3));
+  EXPECT_THAT(Run({"xtrim", "nokey", "maxlen", "0"}), IntArg(0));
+
+  EXPECT_THAT(Run({"xtrim", "s", "maxlen", "1", "limit", "10"}), ErrArg("without the special ~"));
+  EXPECT_THAT(Run({"xtrim", "s", "maxlen", "-1"}), ErrArg("must be >= 0"));
+  EXPECT_THAT(Run({"xtrim", "s", "minid", "1", "maxlen", "1"}), ErrArg("not compatible"));
+  EXPECT_THAT(Run({"xtrim", "s", "limit", "1", "~"}), ErrArg("syntax error"));
+
+  Run({"xadd", "s", "minid", "10", "11", "f", "v"});
+  EXPECT_THAT(Run({"xlen", "s"}), IntArg(2));
+  EXPECT_EQ(Run({"xadd", "s", "maxlen", "=", "1", "12", "f", "v"}), "12-0");
+  EXPECT_THAT(Run({"xlen", "s"}), IntArg(1));
+
+  EXPECT_THAT(Run({"xadd", "nokey", "nomkstream", "*", "f", "v"}), ArgType(RespExpr::NIL));
+  EXPECT_THAT(Run({"exists", "nokey"}), IntArg(0));
+}
+
+// The nodes hold up to 100 entries, hence the approximate trimming keeps 150 of them.
+TEST_F(StreamFamilyTest, TrimApprox) {
+  absl::FlagSaver saver;
+  for (bool background : {false, true}) {
+    absl::SetFlag(&FLAGS_stream_background_trim, background);
+    string key = background ? "background" : "inline";
+    for (unsigned i = 1; i <= 250; ++i) {
+      Run({"xadd", key, "maxlen", "~", "100", absl::StrCat(i), "f", "v"});
+    }
+
+    for (unsigned j = 0; j < 1000 && CheckedInt({"xlen", key}) != 150; ++j) {
+      fibers_ext::SleepFor(1ms);
+    }
+    EXPECT_EQ(150, CheckedInt({"xlen", key}));
+  }
+}
+
 TEST_F(StreamFamilyTest, Range) {
   Run({"xadd", "key", "1-*", "f1", "v1"});
   Run({"xadd", "key", "1-*", "f2", "v2"});
@@ -84,4 +131,152 @@ TEST_F(StreamFamilyTest, Range) {
   EXPECT_THAT(sub1, ElementsAre("1-0", ArrLen(2)));
 }
 
+TEST_F(StreamFamilyTest, Read) {
+  Run({"xadd", "s1", "1-1", "f", "v1"});
+  Run({"xadd", "s1", "1-2", "f", "v2"});
+  Run({"xadd", "s2", "2-1", "g", "w1"});
+
+  auto resp = Run({"xread", "count", "1", "streams", "s1", "1-1"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("s1", ArrLen(1)));
+  EXPECT_THAT(resp.GetVec()[1].GetVec()[0].GetVec(), ElementsAre("1-2", ArrLen(2)));
+
+  resp = Run({"xread", "streams", "s1", "missing", "s2", "0", "0", "0"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec()[0].GetVec(), ElementsAre("s1", ArrLen(2)));
+  EXPECT_THAT(resp.GetVec()[1].GetVec(), ElementsAre("s2", ArrLen(1)));
+
+  EXPECT_THAT(Run({"xread", "streams", "s1", "$"}), ArgType(RespExpr::NIL_ARRAY));
+  EXPECT_THAT(Run({"xread", "streams", "s1", "1-2"}), ArgType(RespExpr::NIL_ARRAY));
+  EXPECT_THAT(Run({"xread", "streams", "s1", "bad"}), ErrArg("Invalid stream ID"));
+  EXPECT_THAT(Run({"xread", "streams", "s1", "s2", "0"}), ErrArg("syntax error"));
+
+  Run({"set", "str", "v"});
+  EXPECT_THAT(Run({"xread", "streams", "str", "0"}), ErrArg("WRONGTYPE"));
+}
+
+TEST_F(StreamFamilyTest, ReadGroup) {
+  Run({"xadd", "s", "1-1", "f", "v1"});
+  Run({"xadd", "s", "1-2", "f", "v2"});
+  Run({"xgroup", "create", "s", "g", "0"});
+
+  auto resp = Run({"xreadgroup", "group", "g", "c1", "count", "1", "streams", "s", ">"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec()[1].GetVec()[0].GetVec(), ElementsAre("1-1", ArrLen(2)));
+
+  resp = Run({"xreadgroup", "group", "g", "c2", "streams", "s", ">"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec()[1].GetVec()[0].GetVec(), ElementsAre("1-2", ArrLen(2)));
+  EXPECT_THAT(Run({"xreadgroup", "group", "g", "c2", "streams", "s", ">"}),
+              ArgType(RespExpr::NIL_ARRAY));
+
+  // The history of a consumer is its pending entries.
+  resp = Run({"xreadgroup", "group", "g", "c1", "streams", "s", "0"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec()[1].GetVec()[0].GetVec(), ElementsAre("1-1", ArrLen(2)));
+
+  EXPECT_THAT(Run({"xack", "s", "g", "1-1", "1-2", "5-5"}), IntArg(2));
+  EXPECT_THAT(Run({"xack", "s", "g", "1-1"}), IntArg(0));
+  EXPECT_THAT(Run({"xack", "s", "nogroup", "1-1"}), IntArg(0));
+  resp = Run({"xreadgroup", "group", "g", "c1", "streams", "s", "0"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("s", ArrLen(0)));
+
+  resp = Run({"xinfo", "groups", "s"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("name", "g", "consumers", "2", "pending", "0",
+                                         "last-delivered-id", "1-2"));
+
+  EXPECT_THAT(Run({"xreadgroup", "group", "nogroup", "c", "streams", "s", ">"}),
+              ErrArg("NOGROUP"));
+  EXPECT_THAT(Run({"xreadgroup", "group", "g", "c", "streams", "missing", ">"}),
+              ErrArg("NOGROUP"));
+}
+
+TEST_F(StreamFamilyTest, Claim) {
+  Run({"xadd", "s", "1-1", "f", "v1"});
+  Run({"xadd", "s", "1-2", "f", "v2"});
+  Run({"xgroup", "create", "s", "g", "0"});
+  Run({"xreadgroup", "group", "g", "c1", "streams", "s", ">"});
+
+  // The entries are not idle long enough.
+  EXPECT_THAT(Run({"xclaim", "s", "g", "c2", "3600000", "1-1"}), ArrLen(0));
+
+  auto resp = Run({"xclaim", "s", "g", "c2", "0", "1-1", "9-9"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec(), ElementsAre("1-1", ArrLen(2)));
+
+  EXPECT_THAT(Run({"xclaim", "s", "g", "c2", "0", "1-2", "justid"}), "1-2");
+  resp = Run({"xreadgroup", "group", "g", "c2", "streams", "s", "0"});
+  EXPECT_THAT(resp.GetVec()[1], ArrLen(2));
+  resp = Run({"xreadgroup", "group", "g", "c1", "streams", "s", "0"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("s", ArrLen(0)));
+
+  EXPECT_THAT(Run({"xclaim", "s", "nogroup", "c2", "0", "1-1"}), ErrArg("NOGROUP"));
+  EXPECT_THAT(Run({"xclaim", "s", "g", "c2", "0", "1-1", "bad"}), ErrArg("Unrecognized"));
+}
+
+TEST_F(StreamFamilyTest, ReadBlocking) {
+  Run({"xadd", "s", "1-1", "f", "v1"});
+
+  RespExpr resp;
+  auto fb = pp_->at(1)->LaunchFiber(
+      [&] { resp = Run("reader", {"xread", "block", "0", "streams", "s", "$"}); });
+
+  while (service_->server_family().GetMetrics().conn_stats.num_blocked_clients < 1) {
+    fibers_ext::SleepFor(1ms);
+  }
+
+  Run({"xadd", "s", "1-2", "f", "v2"});
+  fb.Join();
+
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec()[1].GetVec()[0].GetVec(), ElementsAre("1-2", ArrLen(2)));
+
+  EXPECT_THAT(Run({"xread", "block", "5", "streams", "s", "$"}), ArgType(RespExpr::NIL_ARRAY));
+}
+
+TEST_F(StreamFamilyTest, ReadGroupWakesAsManyAsAdded) {
+  constexpr unsigned kReaders = 3;
+  Run({"xadd", "s", "1-1", "f", "v"});
+  Run({"xgroup", "create", "s", "g", "$"});
+
+  vector<RespExpr> resp(kReaders);
+  atomic_uint read{0};
+  vector<fibers_ext::Fiber> fbs;
+  for (unsigned i = 0; i < kReaders; ++i) {
+    fbs.push_back(pp_->at(i % 2)->LaunchFiber([&, i] {
+      string consumer = absl::StrCat("c", i);
+      resp[i] = Run(consumer, {"xreadgroup", "group", "g", consumer, "count", "1", "block", "0",
+                               "streams", "s", ">"});
+      read.fetch_add(1);
+    }));
+  }
+
+  while (service_->server_family().GetMetrics().conn_stats.num_blocked_clients < kReaders) {
+    fibers_ext::SleepFor(1ms);
+  }
+
+  // A single entry wakes a single reader, the rest keep waiting.
+  Run({"xadd", "s", "2-1", "f", "v"});
+  while (read.load() < 1) {
+    fibers_ext::SleepFor(1ms);
+  }
+  fibers_ext::SleepFor(5ms);
+  EXPECT_EQ(1u, read.load());
+
+  Run({"xadd", "s", "2-2", "f", "v"});
+  Run({"xadd", "s", "2-3", "f", "v"});
+  for (auto& fb : fbs) {
+    fb.Join();
+  }
+
+  vector<string> ids;
+  for (const auto& r : resp) {
+    ASSERT_THAT(r, ArrLen(2));
+    auto entries = r.GetVec()[1].GetVec();
+    ASSERT_EQ(1u, entries.size());
+    ids.emplace_back(ToSV(entries[0].GetVec()[0].GetBuf()));
+  }
+  EXPECT_THAT(ids, UnorderedElementsAre("2-1", "2-2", "2-3"));
+}
+
 }  // namespace dfly
@@ -0,0 +1,84 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/stream_trim.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/logging.h"
+#include "server/db_slice.h"
+#include "server/journal/journal.h"
+
+namespace dfly {
+
+using namespace std;
+
+bool StreamTrimQueue::Add(DbIndex db, string_view key, stream* s,
+                          const streamAddTrimArgs& args) {
+  DCHECK(args.approx_trim);
+
+  auto it = pending_.find(s);
+  if (it != pending_.end() && ++it->second.deferrals >= kMaxDeferrals) {
+    pending_.erase(it);
+    return false;
+  }
+
+  // A new stream may take the address of a deleted one that is still pending.
+  Pending& pending = it != pending_.end() ? it->second : pending_[s];
+  pending.db = db;
+  pending.key = key;
+  pending.args = args;
+  return true;
+}
+
+bool StreamTrimQueue::TrimStep(DbSlice* slice, journal::Journal* journal, uint64_t now_ms,
+                               unsigned budget) {
+  // XADD may change the queue while the journal preempts, hence the streams are looked up
+  // again one by one.
+  vector<stream*> streams;
+  for (auto it = pending_.begin(); streams.size() < budget && it != pending_.end(); ++it) {
+    streams.push_back(it->first);
+  }
+
+  for (stream* s : streams) {
+    auto it = pending_.find(s);
+    if (it == pending_.end())
+      continue;
+
+    // A copy, since XADD may replace the pending trim while the journal preempts.
+    Pending pending = it->second;
+    if (!Trim(slice, journal, now_ms, s, pending))
+      pending_.erase(s);
+  }
+
+  return !pending_.empty();
+}
+
+bool StreamTrimQueue::Trim(DbSlice* slice, journal::Journal* journal, uint64_t now_ms,
+                           stream* s, const Pending& pending) {
+  DbContext cntx{pending.db, now_ms};
+  auto res = slice->Find(cntx, pending.key, OBJ_STREAM);
+  if (!res || (*res)->second.RObjPtr() != s)
+    return false;
+
+  string_view key = pending.key;
+  if (!slice->CheckLock(IntentLock::EXCLUSIVE, KeyLockArgs{pending.db, ArgSlice{&key, 1}, 1}))
+    return false;
+
+  PrimeIterator it = *res;
+  streamAddTrimArgs args = pending.args;
+  slice->PreUpdate(pending.db, it);
+  int64_t deleted = streamTrim(s, &args);
+  slice->PostUpdate(pending.db, it, key);
+
+  // The replica trims to the length that the approximate trim left.
+  if (deleted > 0 && journal) {
+    string length = absl::StrCat(s->length);
+    journal->RecordEntry(journal::Entry::Command(pending.db, 0, ArgSlice{&key, 1}, 1,
+                                                 {"XTRIM", key, "MAXLEN", length}));
+  }
+  return deleted > 0;
+}
+
+}  // namespace dfly
@@ -0,0 +1,69 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <string>
+#include <string_view>
+
+extern "C" {
+#include "redis/stream.h"
+}
+
+#include "server/table.h"
+
+namespace dfly {
+
+class DbSlice;
+
+namespace journal {
+class Journal;
+}  // namespace journal
+
+// The approximate trims of XADD, i.e. MAXLEN ~ and MINID ~, which the shard runs when it is idle
+// rather than inline. An approximate trim may keep more entries than asked for anyway, so
+// postponing it does not change what XADD guarantees, while a stream that ingests at a high rate
+// is trimmed once per idle period instead of on every XADD.
+class StreamTrimQueue {
+ public:
+  // A shard that is never idle trims a stream inline once per that many of its XADDs.
+  static constexpr uint32_t kMaxDeferrals = 1024;
+
+  // Schedules the trim of the stream s, that is stored at key, replacing its pending trim.
+  // Returns false if the stream should be trimmed now, because its trim was postponed
+  // kMaxDeferrals times already.
+  bool Add(DbIndex db, std::string_view key, stream* s, const streamAddTrimArgs& args);
+
+  // Trims up to budget streams by args.limit entries at most. A stream stays in the queue until
+  // its trim deletes nothing. The streams that were deleted or replaced since they were added,
+  // and these that are locked by a transaction, are dropped: their next XADD adds them again.
+  // Every trim is recorded in the journal, if any, as XTRIM to the exact resulting length. The
+  // journal may preempt, hence the step must run in a fiber then. Returns false if nothing is
+  // pending.
+  bool TrimStep(DbSlice* slice, journal::Journal* journal, uint64_t now_ms, unsigned budget);
+
+  bool empty() const {
+    return pending_.empty();
+  }
+
+ private:
+  struct Pending {
+    DbIndex db;
+    std::string key;
+    streamAddTrimArgs args;
+    uint32_t deferrals = 0;
+  };
+
+  // Trims the stream if it is still stored at the key of pending. Returns whether it should
+  // be trimmed again.
+  bool Trim(DbSlice* slice, journal::Journal* journal, uint64_t now_ms, stream* s,
+            const Pending& pending);
+
+  // The address identifies the stream, the key is verified before it is trimmed.
+  absl::flat_hash_map<stream*, Pending> pending_;
+};
+
+}  // namespace dfly
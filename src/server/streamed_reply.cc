@@ -0,0 +1,75 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/streamed_reply.h"
+
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+
+#include "base/logging.h"
+#include "server/db_slice.h"
+#include "server/transaction.h"
+
+namespace dfly {
+
+using namespace std;
+
+void StreamedReply::Start(uint32_t len) {
+  DCHECK(!started_);
+  started_ = true;
+  len_ = len;
+  remaining_ = type_ == CollectionType::MAP ? uint64_t(len) * 2 : len;
+}
+
+void StreamedReply::Add(string_view elem, TimeSlice* slice) {
+  DCHECK_GT(remaining_, 0u);
+  --remaining_;
+
+  size_t prev = buf_.size();
+  absl::StrAppend(&buf_, "$", elem.size(), "\r\n", elem, "\r\n");
+  slice->AddOutput(buf_.size() - prev);
+}
+
+void StreamedReply::Add(container_utils::ContainerEntry ce, TimeSlice* slice) {
+  if (ce.value)
+    return Add(string_view{ce.value, ce.length}, slice);
+
+  char buf[absl::numbers_internal::kFastToBufferSize];
+  char* end = absl::numbers_internal::FastIntToBuffer(ce.longval, buf);
+  Add(string_view{buf, size_t(end - buf)}, slice);
+}
+
+void StreamedReply::EndHop(const TimeSlice& slice, DbSlice* db_slice) {
+  if (slice.interrupted() && !pinned_) {
+    db_slice->PinRead();
+    pinned_ = true;
+  } else if (!slice.interrupted() && pinned_) {
+    db_slice->UnpinRead();
+    pinned_ = false;
+  }
+}
+
+void StreamedReply::Flush(facade::RedisReplyBuilder* rb) {
+  if (!started_)
+    return;
+
+  if (!header_sent_) {
+    rb->StartCollection(len_, type_);
+    header_sent_ = true;
+  }
+
+  if (!buf_.empty()) {
+    rb->SendRaw(buf_);
+    buf_.clear();
+  }
+}
+
+void StreamedReply::Finish(facade::RedisReplyBuilder* rb) {
+  DCHECK(!pinned_);
+  if (!header_sent_)
+    rb->StartCollection(0, type_);
+  DCHECK_EQ(0u, remaining_);
+}
+
+}  // namespace dfly
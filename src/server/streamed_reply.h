@@ -0,0 +1,63 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include "facade/reply_builder.h"
+#include "server/container_utils.h"
+
+namespace dfly {
+
+class DbSlice;
+class TimeSlice;
+
+// The reply of HGETALL, SMEMBERS or LRANGE, which the shard serializes in the hops of
+// Transaction::ScheduleStreamed and the coordinator sends after each of them. Every element is
+// written once, in RESP, into a buffer of about a chunk, rather than into a vector of strings
+// that holds the whole container until its reply is serialized.
+class StreamedReply {
+ public:
+  using CollectionType = facade::RedisReplyBuilder::CollectionType;
+
+  explicit StreamedReply(CollectionType type) : type_(type) {
+  }
+
+  // Runs in the shard, in the first hop. len is the number of entries of the collection,
+  // i.e. the number of pairs for maps. The header is sent with it, before the elements, so
+  // the shard must add exactly that many elements in its hops.
+  void Start(uint32_t len);
+
+  bool started() const {
+    return started_;
+  }
+
+  // Run in the shard. Accounts for the output in slice.
+  void Add(std::string_view elem, TimeSlice* slice);
+  void Add(container_utils::ContainerEntry ce, TimeSlice* slice);
+
+  // Runs in the shard at the end of every hop. Pins the reads of the slice while more hops
+  // follow, so that the container is neither evicted nor moved between them.
+  void EndHop(const TimeSlice& slice, DbSlice* db_slice);
+
+  // Runs in the coordinator after every hop, sends the elements of the hop.
+  void Flush(facade::RedisReplyBuilder* rb);
+
+  // Runs in the coordinator after the last hop. Sends an empty collection if the shard did not
+  // start the reply, e.g. because the key does not exist.
+  void Finish(facade::RedisReplyBuilder* rb);
+
+ private:
+  std::string buf_;
+  uint32_t len_ = 0;
+  uint64_t remaining_ = 0;  // elements to add.
+  CollectionType type_;
+  bool started_ = false;
+  bool header_sent_ = false;
+  bool pinned_ = false;
+};
+
+}  // namespace dfly
@@ -8,23 +8,58 @@ extern "C" {
 #include "redis/object.h"
 }
 
+#include <absl/container/flat_hash_map.h>
 #include <absl/container/inlined_vector.h>
+#include <absl/strings/match.h>
 #include <double-conversion/string-to-double.h>
 
 #include <chrono>
+#include <mutex>
 
+#include "base/flags.h"
 #include "base/logging.h"
+#include "core/chunked_string.h"
+#include "core/segment_allocator.h"
+#include "core/zstd_dict.h"
 #include "redis/util.h"
 #include "server/command_registry.h"
 #include "server/conn_context.h"
 #include "server/engine_shard_set.h"
 #include "server/error.h"
 #include "server/io_mgr.h"
-#include "server/journal/journal.h"
+#include "server/server_state.h"
 #include "server/tiered_storage.h"
 #include "server/transaction.h"
 #include "util/varz.h"
 
+ABSL_FLAG(uint32_t, offshard_copy_min_len, 0,
+          "If positive, the values of at least this many bytes are copied out for GET, HGETALL, "
+          "HKEYS, HVALS and SMEMBERS by the connection thread directly from the locked value, "
+          "instead of by the shard thread. The key is unlocked before the reply is written. "
+          "0 copies all the values in the shard thread.");
+ABSL_FLAG(uint32_t, value_compression_min_len, 0,
+          "String values of at least this length are stored compressed if they compress well. "
+          "0 disables value compression.");
+ABSL_FLAG(bool, coalesce_reads, true,
+          "If true, concurrent GETs of the same key from the connections of a thread share "
+          "the hop of the first one, as long as it has not started to run in the shard.");
+ABSL_FLAG(bool, coalesce_incrs, true,
+          "If true, concurrent INCR family commands on the same key from the connections of a "
+          "thread are applied in the hop of the first one, as long as it has not started to run "
+          "in the shard. Their replies are exact.");
+ABSL_FLAG(std::vector<std::string>, counter_prefixes, {},
+          "Keys with one of these prefixes are hot counters: the INCR family commands of each "
+          "thread add up to a delta that is applied to the key at most counter_staleness_ms "
+          "later. Their replies add the delta to the value that the thread applied last.");
+ABSL_FLAG(uint32_t, counter_staleness_ms, 10,
+          "The staleness bound of the replies and of the stored values of hot counters.");
+ABSL_FLAG(uint32_t, string_chunked_min_len, 1 << 17,
+          "String values that APPEND or PREPEND extend to at least this length are stored in "
+          "chunks, so that further appends do not copy them. 0 disables chunked strings.");
+ABSL_FLAG(int, value_compression_codec, 1,
+          "Codec of compressed string values: 1 for lz4, 2 for zstd, 3 for zstd with a "
+          "dictionary trained by each shard on its values.");
+
 namespace dfly {
 
 namespace {
@@ -56,6 +91,64 @@ string GetString(EngineShard* shard, const PrimeValue& pv) {
   return res;
 }
 
+// String value that may still be in flight from the tiered storage. Shard callbacks
+// only submit the read, and the coordinator waits for it after the hop so that the shard
+// thread is not stalled by the disk.
+class StringValue {
+ public:
+  StringValue() = default;
+  explicit StringValue(string val) : val_(std::move(val)) {
+  }
+  explicit StringValue(TieredStorage::ReadFuture future) : future_(std::move(future)) {
+  }
+
+  // Blocks the calling fiber until the read completes.
+  string Get() &&;
+
+  // Must run in the shard thread of pv.
+  static StringValue Read(EngineShard* shard, const PrimeValue& pv);
+
+ private:
+  string val_;
+  TieredStorage::ReadFuture future_;
+};
+
+string StringValue::Get() && {
+  if (!future_.valid())
+    return std::move(val_);
+
+  const io::Result<string>& res = future_.get();
+  CHECK(res) << "TBD: " << res.error();
+  return *res;
+}
+
+StringValue StringValue::Read(EngineShard* shard, const PrimeValue& pv) {
+  if (!pv.IsExternal())
+    return StringValue{GetString(shard, pv)};
+
+  auto [offset, size] = pv.GetExternalPtr();
+  return StringValue{shard->tiered_storage()->ReadAsync(offset, size)};
+}
+
+// Sets the value, compressing it if it is large enough, see --value_compression_min_len.
+void SetStringValue(string_view value, EngineShard* shard, PrimeValue* pv) {
+  uint32_t min_len = absl::GetFlag(FLAGS_value_compression_min_len);
+  if (min_len == 0 || value.size() < min_len) {
+    pv->SetString(value);
+    return;
+  }
+
+  CompressCodec codec = CompressCodec(absl::GetFlag(FLAGS_value_compression_codec));
+  if (codec == CompressCodec::ZSTD_DICT && !ZstdDictRegistry::ThreadDict()) {
+    // Values are stored uncompressed until the shard trains its dictionary.
+    shard->SampleValue(value);
+    pv->SetString(value);
+    return;
+  }
+
+  pv->SetCompressedString(value, codec);
+}
+
 string_view GetSlice(EngineShard* shard, const PrimeValue& pv, string* tmp) {
   if (pv.IsExternal()) {
     *tmp = GetString(shard, pv);
@@ -64,13 +157,6 @@ string_view GetSlice(EngineShard* shard, const PrimeValue& pv, string* tmp) {
   return pv.GetSlice(tmp);
 }
 
-inline void RecordJournal(const OpArgs& op_args, string_view key, const PrimeKey& pvalue) {
-  if (op_args.shard->journal()) {
-    journal::Entry entry{op_args.db_cntx.db_index, op_args.txid, key, pvalue};
-    op_args.shard->journal()->RecordEntry(entry);
-  }
-}
-
 OpResult<uint32_t> OpSetRange(const OpArgs& op_args, string_view key, size_t start,
                               string_view value) {
   auto& db_slice = op_args.shard->db_slice();
@@ -87,6 +173,13 @@ OpResult<uint32_t> OpSetRange(const OpArgs& op_args, string_view key, size_t sta
 
   auto [it, added] = db_slice.AddOrFind(op_args.db_cntx, key);
 
+  if (!added && it->second.IsChunked()) {
+    db_slice.PreUpdate(op_args.db_cntx.db_index, it);
+    it->second.GetChunked()->Write(start, value);
+    db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, true);
+    return it->second.Size();
+  }
+
   string s;
 
   if (added) {
@@ -105,7 +198,6 @@ OpResult<uint32_t> OpSetRange(const OpArgs& op_args, string_view key, size_t sta
   memcpy(s.data() + start, value.data(), value.size());
   it->second.SetString(s);
   db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, !added);
-  RecordJournal(op_args, key, it->second);
 
   return it->second.Size();
 }
@@ -136,6 +228,22 @@ OpResult<string> OpGetRange(const OpArgs& op_args, string_view key, int32_t star
   if (size_t(end) >= strlen)
     end = strlen - 1;
 
+  if (co.IsChunked()) {
+    string res(end - start + 1, '\0');
+    co.GetChunked()->Read(start, res.size(), res.data());
+    return res;
+  }
+
+  // Only the pages of the range are read, the value stays offloaded.
+  if (co.IsExternal()) {
+    string res(end - start + 1, '\0');
+    auto [offset, size] = co.GetExternalPtr();
+    error_code ec =
+        op_args.shard->tiered_storage()->ReadRange(offset, start, res.size(), res.data());
+    CHECK(!ec) << "TBD: " << ec;
+    return res;
+  }
+
   string tmp;
   string_view slice = GetSlice(op_args.shard, co, &tmp);
 
@@ -144,19 +252,46 @@ OpResult<string> OpGetRange(const OpArgs& op_args, string_view key, int32_t star
 
 size_t ExtendExisting(const OpArgs& op_args, PrimeIterator it, string_view key, string_view val,
                       bool prepend) {
-  string tmp, new_val;
   auto* shard = op_args.shard;
+  auto& db_slice = shard->db_slice();
+
+  if (it->second.IsChunked()) {
+    db_slice.PreUpdate(op_args.db_cntx.db_index, it);
+    ChunkedString* str = it->second.GetChunked();
+    if (prepend)
+      str->Prepend(val);
+    else
+      str->Append(val);
+    db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, true);
+
+    return str->Size();
+  }
+
+  string tmp, new_val;
   string_view slice = GetSlice(shard, it->second, &tmp);
+
+  uint32_t chunked_min_len = absl::GetFlag(FLAGS_string_chunked_min_len);
+  if (chunked_min_len > 0 && slice.size() + val.size() >= chunked_min_len) {
+    // The chunks are filled before the old value is freed, as slice may point into it.
+    ChunkedString str(prepend ? val : slice);
+    str.Append(prepend ? slice : val);
+    size_t len = str.Size();
+
+    db_slice.PreUpdate(op_args.db_cntx.db_index, it);
+    it->second.SetChunkedString(std::move(str));
+    db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, true);
+
+    return len;
+  }
+
   if (prepend)
     new_val = absl::StrCat(val, slice);
   else
     new_val = absl::StrCat(slice, val);
 
-  auto& db_slice = shard->db_slice();
   db_slice.PreUpdate(op_args.db_cntx.db_index, it);
   it->second.SetString(new_val);
   db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, true);
-  RecordJournal(op_args, key, it->second);
 
   return new_val.size();
 }
@@ -170,7 +305,6 @@ OpResult<uint32_t> ExtendOrSet(const OpArgs& op_args, string_view key, string_vi
   if (inserted) {
     it->second.SetString(val);
     db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, false);
-    RecordJournal(op_args, key, it->second);
 
     return val.size();
   }
@@ -191,8 +325,8 @@ OpResult<bool> ExtendOrSkip(const OpArgs& op_args, string_view key, string_view
   return ExtendExisting(op_args, *it_res, key, val, prepend);
 }
 
-OpResult<string> OpGet(const OpArgs& op_args, string_view key, bool del_hit = false,
-                       const DbSlice::ExpireParams& exp_params = {}) {
+OpResult<StringValue> OpGet(const OpArgs& op_args, string_view key, bool del_hit = false,
+                            const DbSlice::ExpireParams& exp_params = {}) {
   /*Get primeIterator and ExpireIterator at the same time*/
   auto [it, it_expire] = op_args.shard->db_slice().FindExt(op_args.db_cntx, key);
 
@@ -205,7 +339,9 @@ OpResult<string> OpGet(const OpArgs& op_args, string_view key, bool del_hit = fa
   const PrimeValue& pv = it->second;
 
   if (del_hit) {
-    string key_bearer = GetString(op_args.shard, pv);
+    // Deleting the key before the read completes is safe since the tiered storage defers
+    // reusing the blob space until then.
+    StringValue key_bearer = StringValue::Read(op_args.shard, pv);
 
     DVLOG(1) << "Del: " << key;
     auto& db_slice = op_args.shard->db_slice();
@@ -216,7 +352,7 @@ OpResult<string> OpGet(const OpArgs& op_args, string_view key, bool del_hit = fa
   }
 
   /*Get value before expire*/
-  string ret_val = GetString(op_args.shard, pv);
+  StringValue ret_val = StringValue::Read(op_args.shard, pv);
 
   if (exp_params.IsDefined()) {
     DVLOG(1) << "Expire: " << key;
@@ -233,13 +369,10 @@ OpResult<double> OpIncrFloat(const OpArgs& op_args, string_view key, double val)
   auto& db_slice = op_args.shard->db_slice();
   auto [it, inserted] = db_slice.AddOrFind(op_args.db_cntx, key);
 
-  char buf[128];
-
+  // The sum is kept as a double, which formats as FormatDouble does, and is parsed only once.
   if (inserted) {
-    char* str = RedisReplyBuilder::FormatDouble(val, buf, sizeof(buf));
-    it->second.SetString(str);
+    it->second.SetDouble(val);
     db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, false);
-    RecordJournal(op_args, key, it->second);
 
     return val;
   }
@@ -247,17 +380,22 @@ OpResult<double> OpIncrFloat(const OpArgs& op_args, string_view key, double val)
   if (it->second.ObjType() != OBJ_STRING)
     return OpStatus::WRONG_TYPE;
 
-  if (it->second.Size() == 0)
-    return OpStatus::INVALID_FLOAT;
+  double base;
+  if (auto opt_base = it->second.TryGetDouble(); opt_base) {
+    base = *opt_base;
+  } else {
+    if (it->second.Size() == 0)
+      return OpStatus::INVALID_FLOAT;
 
-  string tmp;
-  string_view slice = GetSlice(op_args.shard, it->second, &tmp);
+    string tmp;
+    string_view slice = GetSlice(op_args.shard, it->second, &tmp);
 
-  StringToDoubleConverter stod(StringToDoubleConverter::NO_FLAGS, 0, 0, NULL, NULL);
-  int processed_digits = 0;
-  double base = stod.StringToDouble(slice.data(), slice.size(), &processed_digits);
-  if (unsigned(processed_digits) != slice.size()) {
-    return OpStatus::INVALID_FLOAT;
+    StringToDoubleConverter stod(StringToDoubleConverter::NO_FLAGS, 0, 0, NULL, NULL);
+    int processed_digits = 0;
+    base = stod.StringToDouble(slice.data(), slice.size(), &processed_digits);
+    if (unsigned(processed_digits) != slice.size()) {
+      return OpStatus::INVALID_FLOAT;
+    }
   }
 
   base += val;
@@ -266,12 +404,9 @@ OpResult<double> OpIncrFloat(const OpArgs& op_args, string_view key, double val)
     return OpStatus::INVALID_FLOAT;
   }
 
-  char* str = RedisReplyBuilder::FormatDouble(base, buf, sizeof(buf));
-
   db_slice.PreUpdate(op_args.db_cntx.db_index, it);
-  it->second.SetString(str);
+  it->second.SetDouble(base);
   db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, true);
-  RecordJournal(op_args, key, it->second);
 
   return base;
 }
@@ -298,8 +433,6 @@ OpResult<int64_t> OpIncrBy(const OpArgs& op_args, string_view key, int64_t incr,
       return OpStatus::OUT_OF_MEMORY;
     }
 
-    RecordJournal(op_args, key, it->second);
-
     return incr;
   }
 
@@ -323,7 +456,6 @@ OpResult<int64_t> OpIncrBy(const OpArgs& op_args, string_view key, int64_t incr,
   db_slice.PreUpdate(op_args.db_cntx.db_index, it);
   it->second.SetInt(new_val);
   db_slice.PostUpdate(op_args.db_cntx.db_index, it, key);
-  RecordJournal(op_args, key, it->second);
 
   return new_val;
 }
@@ -363,9 +495,22 @@ OpResult<void> SetGeneric(ConnectionContext* cntx, const SetCmd::SetParams& spar
                           string_view key, string_view value) {
   DCHECK(cntx->transaction);
 
+  // A set with an expiry is journaled as SET ... PXAT, so that the replica does not count the
+  // expiry from the time it applies the command.
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    SetCmd sg(t->GetOpArgs(shard));
-    return sg.Set(sparams, key, value);
+    OpArgs op_args = t->GetOpArgs(shard);
+    SetCmd sg(op_args);
+    OpStatus status = sg.Set(sparams, key, value);
+    if (sparams.expire_after_ms == 0)
+      return status;
+
+    if (status != OpStatus::OK) {
+      t->RecordJournal(shard, {});
+      return status;
+    }
+    string at_ms = absl::StrCat(op_args.db_cntx.time_now_ms + sparams.expire_after_ms);
+    t->RecordJournal(shard, {"SET", key, value, "PXAT", at_ms});
+    return status;
   };
   return cntx->transaction->ScheduleSingleHop(std::move(cb));
 }
@@ -411,8 +556,8 @@ OpStatus SetCmd::Set(const SetParams& params, string_view key, string_view value
   }
 
   // Adding new value.
-  PrimeValue tvalue{value};
-  tvalue.SetFlag(params.memcache_flags != 0);
+  PrimeValue tvalue;
+  SetStringValue(value, op_args_.shard, &tvalue);
   it->second = std::move(tvalue);
   db_slice.PostUpdate(op_args_.db_cntx.db_index, it, key, false);
 
@@ -422,7 +567,7 @@ OpStatus SetCmd::Set(const SetParams& params, string_view key, string_view value
   }
 
   if (params.memcache_flags)
-    db_slice.SetMCFlag(op_args_.db_cntx.db_index, it->first.AsRef(), params.memcache_flags);
+    DbSlice::SetMCFlag(it, params.memcache_flags);
 
   if (shard->tiered_storage() &&
       TieredStorage::EligibleForOffload(value)) {  // external storage enabled.
@@ -431,7 +576,6 @@ OpStatus SetCmd::Set(const SetParams& params, string_view key, string_view value
     shard->tiered_storage()->UnloadItem(op_args_.db_cntx.db_index, it);
   }
 
-  RecordJournal(op_args_, key, it->second);
   return OpStatus::OK;
 }
 
@@ -455,25 +599,21 @@ OpStatus SetCmd::SetExisting(const SetParams& params, PrimeIterator it, ExpireIt
   uint64_t at_ms =
       params.expire_after_ms ? params.expire_after_ms + op_args_.db_cntx.time_now_ms : 0;
   if (IsValid(e_it) && at_ms) {
-    e_it->second = db_slice.FromAbsoluteTime(at_ms);
+    db_slice.SetExpireTime(op_args_.db_cntx.db_index, it, e_it, at_ms);
   } else if (!(params.flags & SET_KEEP_EXPIRE)) {
     // We need to update expiry, or maybe erase the object if it was expired.
     bool changed = db_slice.UpdateExpire(op_args_.db_cntx.db_index, it, at_ms);
     if (changed && at_ms == 0)  // erased.
-      return OpStatus::OK;      // TODO: to update journal with deletion.
+      return OpStatus::OK;
   }
 
   db_slice.PreUpdate(op_args_.db_cntx.db_index, it);
 
-  // Check whether we need to update flags table.
-  bool req_flag_update = (params.memcache_flags != 0) != prime_value.HasFlag();
-  if (req_flag_update) {
-    prime_value.SetFlag(params.memcache_flags != 0);
-    db_slice.SetMCFlag(op_args_.db_cntx.db_index, it->first.AsRef(), params.memcache_flags);
-  }
+  // The flags are stored inline, so they are overwritten together with the value.
+  DbSlice::SetMCFlag(it, params.memcache_flags);
 
   // overwrite existing entry.
-  prime_value.SetString(value);
+  SetStringValue(value, shard, &prime_value);
 
   if (value.size() >= kMinTieredLen) {  // external storage enabled.
 
@@ -486,7 +626,6 @@ OpStatus SetCmd::SetExisting(const SetParams& params, PrimeIterator it, ExpireIt
   }
 
   db_slice.PostUpdate(op_args_.db_cntx.db_index, it, key);
-  RecordJournal(op_args_, key, it->second);
 
   return OpStatus::OK;
 }
@@ -603,30 +742,402 @@ void StringFamily::SetNx(CmdArgList args, ConnectionContext* cntx) {
   return builder->SendLong(0);  // value do exists, we need to report that we didn't change it
 }
 
+namespace {
+
+// A GET that is in flight from this thread. The GETs of the same key that arrive before it
+// starts to run in the shard wait for it and reply with its result, since it reads the key
+// after they arrived.
+struct InflightGet {
+  std::atomic_bool started{false};
+  unsigned waiters = 0;
+
+  // Set before the waiters are notified.
+  OpStatus status = OpStatus::OK;
+  std::shared_ptr<const string> value;
+  util::fibers_ext::Done done;
+};
+
+// The key views point into the arguments of the leading GET, which removes its entry before it
+// returns.
+thread_local absl::flat_hash_map<pair<DbIndex, string_view>, shared_ptr<InflightGet>>
+    inflight_gets;
+
+// Applies the increments in order, as the commands would one after another. Records the
+// stored sum in the journal, as the replica does not see the commands one by one.
+vector<OpResult<int64_t>> OpIncrByMany(Transaction* t, EngineShard* shard, string_view key,
+                                       absl::Span<const int64_t> deltas) {
+  OpArgs op_args = t->GetOpArgs(shard);
+  vector<OpResult<int64_t>> results;
+  results.reserve(deltas.size());
+  optional<int64_t> stored;
+  for (int64_t delta : deltas) {
+    results.push_back(OpIncrBy(op_args, key, delta, false));
+    if (results.back())
+      stored = *results.back();
+  }
+
+  if (stored) {
+    string str = absl::StrCat(*stored);
+    t->RecordJournal(shard, {"SET", key, str, "KEEPTTL"});
+  } else {
+    t->RecordJournal(shard, {});
+  }
+  return results;
+}
+
+// An INCR family command that is in flight from this thread. The increments of the same key
+// that arrive before it starts to run in the shard are applied in its hop after its own one,
+// in their order of arrival.
+struct InflightIncr {
+  // Returns the index of the result of incr, or nullopt if the hop has started already.
+  optional<size_t> Join(int64_t incr) {
+    lock_guard lk(mu);
+    if (started)
+      return nullopt;
+    deltas.push_back(incr);
+    return deltas.size() - 1;
+  }
+
+  // Called by the shard, returns the increments to apply.
+  vector<int64_t> Start() {
+    lock_guard lk(mu);
+    started = true;
+    return std::move(deltas);
+  }
+
+  // The shard takes the increments while the connections of the thread may still add theirs.
+  std::mutex mu;
+  bool started = false;
+  vector<int64_t> deltas;
+
+  // Set before the waiters are notified.
+  vector<OpResult<int64_t>> results;
+  util::fibers_ext::Done done;
+};
+
+// As inflight_gets, the key views point into the arguments of the leading command.
+thread_local absl::flat_hash_map<pair<DbIndex, string_view>, shared_ptr<InflightIncr>>
+    inflight_incrs;
+
+OpResult<int64_t> IncrCoalesced(DbIndex db, string_view key, int64_t incr, Transaction* trans) {
+  pair<DbIndex, string_view> inflight_key{db, key};
+  if (auto it = inflight_incrs.find(inflight_key); it != inflight_incrs.end()) {
+    shared_ptr<InflightIncr> inflight = it->second;
+    if (optional<size_t> index = inflight->Join(incr); index) {
+      inflight->done.Wait();
+      ServerState::tlocal()->connection_stats.coalesced_incr_cnt++;
+      return inflight->results[*index];
+    }
+
+    // This command takes the place of the started one for the next ones.
+    inflight_incrs.erase(it);
+  }
+
+  auto inflight = make_shared<InflightIncr>();
+  inflight->deltas.push_back(incr);
+  inflight_incrs.emplace(inflight_key, inflight);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) -> OpResult<int64_t> {
+    vector<int64_t> deltas = inflight->Start();
+    if (deltas.size() == 1)
+      return OpIncrBy(t->GetOpArgs(shard), key, deltas[0], false);
+
+    inflight->results = OpIncrByMany(t, shard, key, deltas);
+    return inflight->results[0];
+  };
+  OpResult<int64_t> result = trans->ScheduleSingleHopT(std::move(cb));
+
+  auto it = inflight_incrs.find(inflight_key);
+  if (it != inflight_incrs.end() && it->second == inflight)
+    inflight_incrs.erase(it);
+  inflight->done.Notify();
+
+  return result;
+}
+
+// The increments of a hot counter by the connections of this thread, see --counter_prefixes.
+struct HotCounter {
+  int64_t delta = 0;     // not applied yet.
+  int64_t applying = 0;  // in a hop that is in flight.
+  int64_t value = 0;     // of the key after the increments of this thread were applied last.
+  uint64_t valid_until_ns = 0;  // the replies are based on value until then.
+};
+
+// The hot counters of a thread, whose deltas are applied by its flush fiber.
+struct HotCounters {
+  vector<absl::flat_hash_map<string, HotCounter>> dbs;
+  ::boost::fibers::fiber flush_fb;
+  util::fibers_ext::Done stop;
+};
+
+// Set by StringFamily::Init, if counter_prefixes is not empty.
+vector<string> counter_prefixes;
+uint64_t counter_staleness_ns = 0;
+const CommandId* incrby_cid = nullptr;
+util::ProactorPool* counters_pool = nullptr;
+thread_local HotCounters* hot_counters = nullptr;
+
+bool IsHotCounter(string_view key) {
+  for (const string& prefix : counter_prefixes) {
+    if (absl::StartsWith(key, prefix))
+      return true;
+  }
+  return false;
+}
+
+// Applies the delta of the counter, followed by incr if it is given, in the hop of trans or of
+// a new transaction if trans is null. Returns the result of the last increment.
+OpResult<int64_t> ApplyHotCounter(DbIndex db, string_view key, optional<int64_t> incr,
+                                  Transaction* trans) {
+  HotCounters* hc = hot_counters;
+  if (hc->dbs.size() <= db)
+    hc->dbs.resize(db + 1);
+
+  // The map may change while the hop is in flight, so that the entry is looked up again after.
+  string key_str{key};
+  HotCounter& counter = hc->dbs[db][key_str];
+  int64_t delta = exchange(counter.delta, 0);
+  counter.applying += delta;
+
+  absl::InlinedVector<int64_t, 2> deltas;
+  if (delta != 0)
+    deltas.push_back(delta);
+  if (incr)
+    deltas.push_back(*incr);
+  DCHECK(!deltas.empty());
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpIncrByMany(t, shard, key_str, deltas).back();
+  };
+
+  OpResult<int64_t> result;
+  if (trans) {
+    result = trans->ScheduleSingleHopT(std::move(cb));
+  } else {
+    string name = "INCRBY", arg = absl::StrCat(delta);
+    MutableSlice args[3] = {MutableSlice{name.data(), name.size()},
+                            MutableSlice{key_str.data(), key_str.size()},
+                            MutableSlice{arg.data(), arg.size()}};
+    boost::intrusive_ptr<Transaction> flush_trans(new Transaction{incrby_cid});
+    flush_trans->InitByArgs(db, CmdArgList{args, 3});
+    result = flush_trans->ScheduleSingleHopT(std::move(cb));
+  }
+
+  if (auto it = hc->dbs[db].find(key_str); it != hc->dbs[db].end()) {
+    it->second.applying -= delta;
+    if (result) {
+      it->second.value = *result;
+      it->second.valid_until_ns = util::ProactorBase::GetMonotonicTimeNs() + counter_staleness_ns;
+    }
+  }
+
+  return result;
+}
+
+// Adds incr to the delta of the hot counter while the value that this thread applied last is
+// recent enough, otherwise applies both.
+OpResult<int64_t> IncrHotCounter(DbIndex db, string_view key, int64_t incr, Transaction* trans) {
+  HotCounters* hc = hot_counters;
+  if (db < hc->dbs.size()) {
+    auto it = hc->dbs[db].find(key);
+    if (it != hc->dbs[db].end() &&
+        util::ProactorBase::GetMonotonicTimeNs() < it->second.valid_until_ns) {
+      HotCounter& counter = it->second;
+      int64_t delta, base, estimate;
+      if (!__builtin_add_overflow(counter.delta, incr, &delta) &&
+          !__builtin_add_overflow(counter.value, counter.applying, &base) &&
+          !__builtin_add_overflow(base, delta, &estimate)) {
+        counter.delta = delta;
+        return estimate;
+      }
+    }
+  }
+
+  return ApplyHotCounter(db, key, incr, trans);
+}
+
+// Applies the deltas of the hot counters of this thread, and forgets the counters that are
+// neither incremented nor read recently.
+void FlushHotCounters() {
+  HotCounters* hc = hot_counters;
+  uint64_t now = util::ProactorBase::GetMonotonicTimeNs();
+  vector<pair<DbIndex, string>> pending;
+  for (DbIndex db = 0; db < hc->dbs.size(); ++db) {
+    auto& counters = hc->dbs[db];
+    for (auto it = counters.begin(); it != counters.end();) {
+      const HotCounter& counter = it->second;
+      if (counter.delta != 0) {
+        pending.emplace_back(db, it->first);
+      } else if (counter.applying == 0 && counter.valid_until_ns < now) {
+        counters.erase(it++);
+        continue;
+      }
+      ++it;
+    }
+  }
+
+  for (const auto& [db, key] : pending) {
+    auto it = hc->dbs[db].find(key);
+    if (it != hc->dbs[db].end() && it->second.delta != 0)
+      ApplyHotCounter(db, key, nullopt, nullptr);
+  }
+}
+
+void HotCountersFb() {
+  auto period = chrono::nanoseconds(counter_staleness_ns);
+  while (!hot_counters->stop.WaitFor(period)) {
+    FlushHotCounters();
+  }
+  FlushHotCounters();
+}
+
+void SendGetResult(OpStatus status, string_view value, ConnectionContext* cntx) {
+  switch (status) {
+    case OpStatus::OK:
+      (*cntx)->SendBulkString(value);
+      break;
+    case OpStatus::WRONG_TYPE:
+      (*cntx)->SendError(kWrongTypeErr);
+      break;
+    default:
+      (*cntx)->SendNull();
+  }
+}
+
+// Serves GET in two hops. The first hop keeps the key locked and pins large values so that
+// the connection thread copies them directly from the shard memory, instead of the shard
+// thread. The second hop unpins the value and releases the lock before the reply is written,
+// so that a slow socket does not hold the key.
+void GetOffShardCopy(string_view key, size_t min_len, ConnectionContext* cntx) {
+  Transaction* trans = cntx->transaction;
+  string copied;
+  StringValue value;
+  PrimeValue value_ref;
+  SegmentAllocator* owner = nullptr;
+  bool pinned = false;
+
+  auto read_cb = [&](Transaction* t, EngineShard* shard) -> OpStatus {
+    auto& db_slice = shard->db_slice();
+    PrimeIterator it = db_slice.FindExt(t->db_context(), key).first;
+
+    if (!IsValid(it))
+      return OpStatus::KEY_NOTFOUND;
+
+    const PrimeValue& pv = it->second;
+    if (pv.ObjType() != OBJ_STRING)
+      return OpStatus::WRONG_TYPE;
+
+    // Keys with expiry may be deleted by concurrent readers of the same key, hence we copy them.
+    if (pv.IsExternal() || pv.HasExpire() || pv.Size() < min_len) {
+      value = StringValue::Read(shard, pv);
+      return OpStatus::OK;
+    }
+
+    db_slice.PinRead();
+    value_ref = pv.AsRef();
+    owner = SmallString::ThreadAllocator();
+    pinned = true;
+
+    return OpStatus::OK;
+  };
+
+  OpStatus status = OpStatus::OK;
+  trans->Schedule();
+  trans->Execute(
+      [&](Transaction* t, EngineShard* shard) {
+        status = read_cb(t, shard);
+        return status;
+      },
+      false);
+
+  // The pinned value stays valid only while the key is locked.
+  if (pinned && value_ref.IsChunked()) {
+    const ChunkedString* str = value_ref.GetChunked();
+    for (size_t i = 0; i < str->NumChunks(); ++i)
+      copied.append(str->GetChunk(i));
+  } else if (pinned) {
+    SmallString::ForeignReadScope scope(owner);
+    string_view slice = value_ref.GetSlice(&copied);
+    if (slice.data() != copied.data())
+      copied.assign(slice);
+  } else if (status == OpStatus::OK) {
+    copied = std::move(value).Get();
+  }
+
+  auto unpin_cb = [&](Transaction* t, EngineShard* shard) {
+    if (pinned)
+      shard->db_slice().UnpinRead();
+    return OpStatus::OK;
+  };
+  trans->Execute(unpin_cb, true);
+
+  SendGetResult(status, copied, cntx);
+}
+
+}  // namespace
+
 void StringFamily::Get(CmdArgList args, ConnectionContext* cntx) {
   get_qps.Inc();
 
   string_view key = ArgS(args, 1);
 
-  auto cb = [&](Transaction* t, EngineShard* shard) { return OpGet(t->GetOpArgs(shard), key); };
+  uint32_t offshard_min_len = absl::GetFlag(FLAGS_offshard_copy_min_len);
+  if (offshard_min_len > 0 && !cntx->transaction->IsMulti()) {
+    return GetOffShardCopy(key, offshard_min_len, cntx);
+  }
 
-  DVLOG(1) << "Before Get::ScheduleSingleHopT " << key;
   Transaction* trans = cntx->transaction;
-  OpResult<string> result = trans->ScheduleSingleHopT(std::move(cb));
 
-  if (result) {
-    DVLOG(1) << "GET " << trans->DebugId() << ": " << key << " " << result.value();
-    (*cntx)->SendBulkString(*result);
-  } else {
-    switch (result.status()) {
-      case OpStatus::WRONG_TYPE:
-        (*cntx)->SendError(kWrongTypeErr);
-        break;
-      default:
-        DVLOG(1) << "GET " << key << " nil";
-        (*cntx)->SendNull();
+  // The waiters are not tracked by CLIENT TRACKING, the key is tracked by the hop.
+  bool coalesce =
+      absl::GetFlag(FLAGS_coalesce_reads) && !trans->IsMulti() && !cntx->conn_state.tracking_info;
+  pair<DbIndex, string_view> inflight_key{cntx->db_index(), key};
+  shared_ptr<InflightGet> inflight;
+
+  if (coalesce) {
+    auto it = inflight_gets.find(inflight_key);
+    if (it != inflight_gets.end() && !it->second->started.load()) {
+      inflight = it->second;
+      inflight->waiters++;
+      inflight->done.Wait();
+
+      ServerState::tlocal()->connection_stats.coalesced_read_cnt++;
+      return SendGetResult(inflight->status, inflight->value ? *inflight->value : "", cntx);
     }
+
+    // If the GET in flight already started, this one takes its place for the next ones. The
+    // entry is replaced with the key view of this GET.
+    if (it != inflight_gets.end())
+      inflight_gets.erase(it);
+    inflight = make_shared<InflightGet>();
+    inflight_gets.emplace(inflight_key, inflight);
   }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    if (inflight)
+      inflight->started.store(true);
+    return OpGet(t->GetOpArgs(shard), key);
+  };
+
+  DVLOG(1) << "Before Get::ScheduleSingleHopT " << key;
+  OpResult<StringValue> result = trans->ScheduleSingleHopT(std::move(cb));
+  string value = result ? std::move(*result).Get() : string{};
+  DVLOG(1) << "GET " << trans->DebugId() << ": " << key << " " << value;
+
+  if (inflight) {
+    auto it = inflight_gets.find(inflight_key);
+    if (it != inflight_gets.end() && it->second == inflight)
+      inflight_gets.erase(it);
+
+    if (inflight->waiters) {
+      inflight->status = result.status();
+      inflight->value = make_shared<const string>(std::move(value));
+      inflight->done.Notify();
+      return SendGetResult(result.status(), *inflight->value, cntx);
+    }
+  }
+
+  SendGetResult(result.status(), value, cntx);
 }
 
 void StringFamily::GetDel(CmdArgList args, ConnectionContext* cntx) {
@@ -642,11 +1153,12 @@ void StringFamily::GetDel(CmdArgList args, ConnectionContext* cntx) {
   DVLOG(1) << "Before Get::ScheduleSingleHopT " << key;
 
   Transaction* trans = cntx->transaction;
-  OpResult<string> result = trans->ScheduleSingleHopT(std::move(cb));
+  OpResult<StringValue> result = trans->ScheduleSingleHopT(std::move(cb));
 
   if (result) {
-    DVLOG(1) << "GET " << trans->DebugId() << ": " << key << " " << result.value();
-    (*cntx)->SendBulkString(*result);
+    string value = std::move(*result).Get();
+    DVLOG(1) << "GET " << trans->DebugId() << ": " << key << " " << value;
+    (*cntx)->SendBulkString(value);
   } else {
     switch (result.status()) {
       case OpStatus::WRONG_TYPE:
@@ -730,16 +1242,30 @@ void StringFamily::GetEx(CmdArgList args, ConnectionContext* cntx) {
     }
   }
 
-  auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpGet(t->GetOpArgs(shard), key, false, exp_params);
+  // A relative expiry is journaled as PEXPIREAT, like EXPIRE and PEXPIRE are.
+  bool relative = exp_params.value > INT64_MIN && !exp_params.absolute && !exp_params.persist;
+  auto cb = [&](Transaction* t, EngineShard* shard) -> OpResult<StringValue> {
+    OpArgs op_args = t->GetOpArgs(shard);
+    OpResult<StringValue> res = OpGet(op_args, key, false, exp_params);
+    if (!relative)
+      return res;
+
+    if (!res) {
+      t->RecordJournal(shard, {});
+      return res;
+    }
+    int64_t delta_ms = exp_params.unit == TimeUnit::SEC ? int_arg * 1000 : int_arg;
+    string at_ms = absl::StrCat(int64_t(op_args.db_cntx.time_now_ms) + delta_ms);
+    t->RecordJournal(shard, {"PEXPIREAT", key, at_ms});
+    return res;
   };
 
   DVLOG(1) << "Before Get::ScheduleSingleHopT " << key;
 
-  OpResult<string> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  OpResult<StringValue> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
 
   if (result)
-    return (*cntx)->SendBulkString(*result);
+    return (*cntx)->SendBulkString(std::move(*result).Get());
 
   switch (result.status()) {
     case OpStatus::WRONG_TYPE:
@@ -779,7 +1305,17 @@ void StringFamily::IncrByFloat(CmdArgList args, ConnectionContext* cntx) {
   }
 
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpIncrFloat(t->GetOpArgs(shard), key, val);
+    OpResult<double> res = OpIncrFloat(t->GetOpArgs(shard), key, val);
+
+    // The journal sets the stored sum, so that the replica does not round the increment again.
+    if (res) {
+      char buf[128];
+      const char* str = RedisReplyBuilder::FormatDouble(*res, buf, sizeof(buf));
+      t->RecordJournal(shard, {"SET", key, str, "KEEPTTL"});
+    } else {
+      t->RecordJournal(shard, {});
+    }
+    return res;
   };
 
   OpResult<double> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
@@ -823,13 +1359,22 @@ void StringFamily::Prepend(CmdArgList args, ConnectionContext* cntx) {
 
 void StringFamily::IncrByGeneric(string_view key, int64_t val, ConnectionContext* cntx) {
   bool skip_on_missing = cntx->protocol() == Protocol::MEMCACHE;
+  Transaction* trans = cntx->transaction;
+  bool single = !skip_on_missing && !trans->IsMulti();
 
-  auto cb = [&](Transaction* t, EngineShard* shard) {
-    OpResult<int64_t> res = OpIncrBy(t->GetOpArgs(shard), key, val, skip_on_missing);
-    return res;
-  };
+  OpResult<int64_t> result;
+  if (single && hot_counters && IsHotCounter(key)) {
+    result = IncrHotCounter(cntx->db_index(), key, val, trans);
+  } else if (single && absl::GetFlag(FLAGS_coalesce_incrs)) {
+    result = IncrCoalesced(cntx->db_index(), key, val, trans);
+  } else {
+    auto cb = [&](Transaction* t, EngineShard* shard) {
+      OpResult<int64_t> res = OpIncrBy(t->GetOpArgs(shard), key, val, skip_on_missing);
+      return res;
+    };
+    result = trans->ScheduleSingleHopT(std::move(cb));
+  }
 
-  OpResult<int64_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
   auto* builder = cntx->reply_builder();
 
   DVLOG(2) << "IncrByGeneric " << key << "/" << result.value();
@@ -904,12 +1449,7 @@ void StringFamily::SetExGeneric(bool seconds, CmdArgList args, ConnectionContext
   else
     sparams.expire_after_ms = unit_vals;
 
-  auto cb = [&](Transaction* t, EngineShard* shard) {
-    SetCmd sg(t->GetOpArgs(shard));
-    return sg.Set(sparams, key, value);
-  };
-
-  OpResult<void> result = cntx->transaction->ScheduleSingleHop(std::move(cb));
+  OpResult<void> result = SetGeneric(cntx, sparams, key, value);
 
   return (*cntx)->SendError(result.status());
 }
@@ -960,7 +1500,13 @@ void StringFamily::MGet(CmdArgList args, ConnectionContext* cntx) {
       auto& dest = res[indx].emplace();
       auto& src = *results[j];
       dest.key = ArgS(args, indx + 1);
-      dest.value = std::move(src.value);
+      if (src.value_future.valid()) {
+        const io::Result<string>& value = src.value_future.get();
+        CHECK(value) << "TBD: " << value.error();
+        dest.value = *value;
+      } else {
+        dest.value = std::move(src.value);
+      }
       dest.mc_flag = src.mc_flag;
       dest.mc_ver = src.mc_ver;
     }
@@ -1119,22 +1665,27 @@ auto StringFamily::OpMGet(bool fetch_mcflag, bool fetch_mcver, const Transaction
   MGetResponse response(args.size());
 
   auto& db_slice = shard->db_slice();
-  for (size_t i = 0; i < args.size(); ++i) {
-    OpResult<PrimeIterator> it_res = db_slice.Find(t->db_context(), args[i], OBJ_STRING);
-    if (!it_res)
-      continue;
+  db_slice.FindMany(t->db_context(), args, [&](unsigned i, PrimeIterator it, ExpireIterator) {
+    if (!IsValid(it) || it->second.ObjType() != OBJ_STRING)
+      return;
 
-    const PrimeIterator& it = *it_res;
     auto& dest = response[i].emplace();
 
-    dest.value = GetString(shard, it->second);
+    const PrimeValue& pv = it->second;
+    if (pv.IsExternal()) {
+      auto [offset, size] = pv.GetExternalPtr();
+      dest.value_future = shard->tiered_storage()->ReadAsync(offset, size);
+    } else {
+      dest.value = GetString(shard, pv);
+    }
+
     if (fetch_mcflag) {
-      dest.mc_flag = db_slice.GetMCFlag(t->db_index(), it->first);
+      dest.mc_flag = DbSlice::GetMCFlag(it);
       if (fetch_mcver) {
         dest.mc_ver = it.GetVersion();
       }
     }
-  }
+  });
 
   return response;
 }
@@ -1142,11 +1693,32 @@ auto StringFamily::OpMGet(bool fetch_mcflag, bool fetch_mcver, const Transaction
 void StringFamily::Init(util::ProactorPool* pp) {
   set_qps.Init(pp);
   get_qps.Init(pp);
+
+  counter_prefixes = absl::GetFlag(FLAGS_counter_prefixes);
+  counter_staleness_ns = uint64_t(absl::GetFlag(FLAGS_counter_staleness_ms)) * 1000000;
+  if (!counter_prefixes.empty() && counter_staleness_ns > 0) {
+    counters_pool = pp;
+    pp->AwaitFiberOnAll([](util::ProactorBase* pb) {
+      hot_counters = new HotCounters;
+      hot_counters->flush_fb = ::boost::fibers::fiber(&HotCountersFb);
+    });
+  }
 }
 
 void StringFamily::Shutdown() {
   set_qps.Shutdown();
   get_qps.Shutdown();
+
+  // The remaining deltas are applied before the shards shut down.
+  if (counters_pool) {
+    counters_pool->AwaitFiberOnAll([](util::ProactorBase* pb) {
+      hot_counters->stop.Notify();
+      hot_counters->flush_fb.join();
+      delete hot_counters;
+      hot_counters = nullptr;
+    });
+    counters_pool = nullptr;
+  }
 }
 
 #define HFUNC(x) SetHandler(&StringFamily::x)
@@ -1175,6 +1747,8 @@ void StringFamily::Register(CommandRegistry* registry) {
             << CI{"SUBSTR", CO::READONLY | CO::FAST, 4, 1, 1, 1}.HFUNC(
                    GetRange)  // Alias for GetRange
             << CI{"SETRANGE", CO::WRITE | CO::FAST | CO::DENYOOM, 4, 1, 1, 1}.HFUNC(SetRange);
+
+  incrby_cid = registry->Find("INCRBY");
 }
 
 }  // namespace dfly
@@ -6,6 +6,7 @@
 
 #include "server/common.h"
 #include "server/engine_shard_set.h"
+#include "server/tiered_storage.h"
 #include "util/proactor_pool.h"
 
 namespace dfly {
@@ -88,6 +89,7 @@ class StringFamily {
 
   struct GetResp {
     std::string value;
+    TieredStorage::ReadFuture value_future;  // valid if the value is read from the disk.
     uint64_t mc_ver = 0;  // 0 means we do not output it (i.e has not been requested).
     uint32_t mc_flag = 0;
   };
@@ -4,6 +4,9 @@
 
 #include "server/string_family.h"
 
+#include <thread>
+
+#include "base/flags.h"
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "facade/facade_test.h"
@@ -19,6 +22,11 @@ using namespace std;
 using namespace util;
 using absl::StrCat;
 
+ABSL_DECLARE_FLAG(uint32_t, offshard_copy_min_len);
+ABSL_DECLARE_FLAG(uint32_t, string_chunked_min_len);
+ABSL_DECLARE_FLAG(std::vector<std::string>, counter_prefixes);
+ABSL_DECLARE_FLAG(uint32_t, counter_staleness_ms);
+
 namespace dfly {
 
 class StringFamilyTest : public BaseFamilyTest {
@@ -75,6 +83,43 @@ TEST_F(StringFamilyTest, Append) {
   EXPECT_THAT(Run({"ttl", "key"}), IntArg(100));
 }
 
+TEST_F(StringFamilyTest, ChunkedAppend) {
+  absl::SetFlag(&FLAGS_string_chunked_min_len, 1000);
+
+  string expected(900, 'a');
+  Run({"set", "key", expected});
+  for (unsigned i = 0; i < 1000; ++i) {
+    string part(100 + i % 7, 'b' + i % 20);
+    if (i % 4 == 0) {
+      Run({"prepend", "key", part});
+      expected = part + expected;
+    } else {
+      Run({"append", "key", part});
+      expected += part;
+    }
+  }
+
+  EXPECT_THAT(Run({"strlen", "key"}), IntArg(expected.size()));
+  EXPECT_EQ(Run({"get", "key"}), expected);
+  EXPECT_EQ(Run({"getrange", "key", "65530", "65545"}), expected.substr(65530, 16));
+  EXPECT_EQ(Run({"getrange", "key", "-10", "-1"}), expected.substr(expected.size() - 10));
+
+  EXPECT_THAT(Run({"setrange", "key", "65535", "xyz"}), IntArg(expected.size()));
+  expected.replace(65535, 3, "xyz");
+  size_t len = expected.size();
+  EXPECT_THAT(Run({"setrange", "key", StrCat(len + 2), "end"}), IntArg(len + 5));
+  expected += string(2, '\0') + "end";
+  EXPECT_EQ(Run({"get", "key"}), expected);
+
+  absl::SetFlag(&FLAGS_offshard_copy_min_len, 20);
+  EXPECT_EQ(Run({"get", "key"}), expected);
+  absl::SetFlag(&FLAGS_offshard_copy_min_len, 0);
+
+  EXPECT_EQ(Run({"set", "key", "val"}), "OK");
+  EXPECT_THAT(Run({"append", "key", "ue"}), IntArg(5));
+  absl::SetFlag(&FLAGS_string_chunked_min_len, 1 << 17);
+}
+
 TEST_F(StringFamilyTest, Expire) {
   ASSERT_EQ(Run({"set", "key", "val", "PX", "20"}), "OK");
 
@@ -227,6 +272,43 @@ TEST_F(StringFamilyTest, MGetSet) {
   set_fb.Join();
 }
 
+TEST_F(StringFamilyTest, MGetMany) {
+  // Enough keys to span several prefetch batches in every shard.
+  vector<string> mset_args{"mset"};
+  vector<string> mget_args{"mget"};
+  for (unsigned i = 0; i < 100; ++i) {
+    if (i % 2 == 0) {
+      mset_args.push_back(StrCat("key", i));
+      mset_args.push_back(StrCat(i));
+    }
+    mget_args.push_back(StrCat("key", i));
+  }
+  Run({"lpush", "key1", "a"});  // wrong type is reported as nil.
+
+  vector<string_view> sv_args(mset_args.begin(), mset_args.end());
+  EXPECT_EQ(Run(absl::MakeSpan(sv_args)), "OK");
+
+  sv_args.assign(mget_args.begin(), mget_args.end());
+  auto resp = Run(absl::MakeSpan(sv_args));
+  ASSERT_THAT(resp, ArrLen(100));
+
+  const auto& vec = resp.GetVec();
+  for (unsigned i = 0; i < 100; ++i) {
+    if (i % 2 == 0) {
+      EXPECT_EQ(vec[i], StrCat(i)) << i;
+    } else {
+      EXPECT_THAT(vec[i], ArgType(RespExpr::NIL)) << i;
+    }
+  }
+
+  sv_args[0] = "exists";
+  EXPECT_EQ(51, CheckedInt(absl::MakeSpan(sv_args)));
+
+  sv_args[0] = "del";
+  EXPECT_EQ(51, CheckedInt(absl::MakeSpan(sv_args)));
+  EXPECT_EQ(0, CheckedInt({"dbsize"}));
+}
+
 TEST_F(StringFamilyTest, MSetGet) {
   Run({"mset", "x", "0", "y", "0", "a", "0", "b", "0"});
   ASSERT_EQ(2, GetDebugInfo().shards_count);
@@ -401,6 +483,17 @@ TEST_F(StringFamilyTest, IncrByFloat) {
   Run({"SET", "num", "2.566"});
   resp = Run({"INCRBYFLOAT", "num", "1.0"});
   EXPECT_EQ(resp, "3.566");
+
+  // The sum is stored as a double, which reads as its shortest representation.
+  resp = Run({"INCRBYFLOAT", "num", "0.1"});
+  EXPECT_EQ(resp, "3.666");
+  EXPECT_EQ(Run({"GET", "num"}), "3.666");
+  EXPECT_THAT(Run({"STRLEN", "num"}), IntArg(5));
+  EXPECT_EQ(Run({"GETRANGE", "num", "0", "1"}), "3.");
+
+  EXPECT_EQ(Run({"INCRBYFLOAT", "fresh", "1e30"}), "1e+30");
+  EXPECT_THAT(Run({"APPEND", "fresh", "x"}), IntArg(6));
+  EXPECT_EQ(Run({"GET", "fresh"}), "1e+30x");
 }
 
 TEST_F(StringFamilyTest, SetNx) {
@@ -557,4 +650,145 @@ TEST_F(StringFamilyTest, GetEx) {
   EXPECT_THAT(Run({"getex", "foo"}), ArgType(RespExpr::NIL));
 }
 
+TEST_F(StringFamilyTest, GetOffShardCopy) {
+  absl::SetFlag(&FLAGS_offshard_copy_min_len, 20);
+
+  string ascii_val(30000, 'a');  // packed into SmallString.
+  string large_val(100000, 'b');
+  string binary_val(200, '\xff');
+
+  Run({"set", "small", "val"});
+  Run({"set", "ascii", ascii_val});
+  Run({"set", "large", large_val});
+  Run({"set", "binary", binary_val});
+  Run({"set", "ttl", large_val, "EX", "100"});
+  Run({"lpush", "list", "a"});
+
+  for (unsigned i = 0; i < 5; ++i) {
+    string key = StrCat("key", i);
+    Run({"set", key, StrCat(ascii_val, i)});
+    EXPECT_EQ(Run({"get", key}), StrCat(ascii_val, i));
+  }
+
+  EXPECT_EQ(Run({"get", "small"}), "val");
+  EXPECT_EQ(Run({"get", "ascii"}), ascii_val);
+  EXPECT_EQ(Run({"get", "large"}), large_val);
+  EXPECT_EQ(Run({"get", "binary"}), binary_val);
+  EXPECT_EQ(Run({"get", "ttl"}), large_val);
+  EXPECT_THAT(Run({"get", "list"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"get", "missing"}), ArgType(RespExpr::NIL));
+
+  // The lock is released before the reply is written.
+  EXPECT_EQ(Run({"set", "large", "val"}), "OK");
+  EXPECT_EQ(Run({"get", "large"}), "val");
+
+  absl::SetFlag(&FLAGS_offshard_copy_min_len, 0);
+}
+
+TEST_F(StringFamilyTest, CoalescedGets) {
+  Run({"set", "hot", "val"});
+  Run({"lpush", "list", "a"});
+  ASSERT_LT(shard_set->size(), pp_->size());
+  ProactorBase* proactor = pp_->at(shard_set->size());  // a thread without a shard.
+
+  // The GETs that arrive while the first one waits for the stalled shard share its hop.
+  auto run_gets = [&](string_view key, vector<RespExpr>* replies) {
+    auto stall = [] { this_thread::sleep_for(chrono::milliseconds(100)); };
+    shard_set->Add(Shard(key, shard_set->size()), stall);
+    vector<fibers_ext::Fiber> fibers;
+    for (unsigned i = 0; i < replies->size(); ++i) {
+      fibers.push_back(proactor->LaunchFiber(
+          [&, i] { (*replies)[i] = Run(StrCat("conn", i), {"get", key}); }));
+    }
+    for (auto& fb : fibers)
+      fb.Join();
+  };
+
+  vector<RespExpr> replies(5);
+  run_gets("hot", &replies);
+  for (const auto& reply : replies)
+    EXPECT_EQ(reply, "val");
+  EXPECT_EQ(4, service_->server_family().GetMetrics().conn_stats.coalesced_read_cnt);
+
+  run_gets("list", &replies);
+  for (const auto& reply : replies)
+    EXPECT_THAT(reply, ErrArg("WRONGTYPE"));
+
+  // A GET that follows a write reads it.
+  EXPECT_EQ(Run({"set", "hot", "new"}), "OK");
+  EXPECT_EQ(Run({"get", "hot"}), "new");
+}
+
+TEST_F(StringFamilyTest, CoalescedIncrs) {
+  Run({"lpush", "list", "a"});
+  ASSERT_LT(shard_set->size(), pp_->size());
+  ProactorBase* proactor = pp_->at(shard_set->size());  // a thread without a shard.
+
+  // The increments that arrive while the first one waits for the stalled shard share its hop.
+  auto run_incrs = [&](string_view key, vector<RespExpr>* replies) {
+    auto stall = [] { this_thread::sleep_for(chrono::milliseconds(100)); };
+    shard_set->Add(Shard(key, shard_set->size()), stall);
+    vector<fibers_ext::Fiber> fibers;
+    for (unsigned i = 0; i < replies->size(); ++i) {
+      fibers.push_back(proactor->LaunchFiber([&, i] {
+        (*replies)[i] = Run(StrCat("conn", i), {"incrby", key, StrCat(i + 1)});
+      }));
+    }
+    for (auto& fb : fibers)
+      fb.Join();
+  };
+
+  vector<RespExpr> replies(5);
+  run_incrs("counter", &replies);
+  vector<int64_t> values;
+  for (const auto& reply : replies) {
+    ASSERT_EQ(RespExpr::INT64, reply.type);
+    values.push_back(get<int64_t>(reply.u));
+  }
+  sort(values.begin(), values.end());
+  EXPECT_EQ(values.back(), 15);
+  EXPECT_EQ(unique(values.begin(), values.end()), values.end());
+  EXPECT_EQ(4, service_->server_family().GetMetrics().conn_stats.coalesced_incr_cnt);
+  EXPECT_EQ(Run({"get", "counter"}), "15");
+
+  run_incrs("list", &replies);
+  for (const auto& reply : replies)
+    EXPECT_THAT(reply, ErrArg("WRONGTYPE"));
+}
+
+class HotCounterTest : public StringFamilyTest {
+ protected:
+  void SetUp() override {
+    absl::SetFlag(&FLAGS_counter_prefixes, {"rate:"});
+    absl::SetFlag(&FLAGS_counter_staleness_ms, 500);
+    StringFamilyTest::SetUp();
+  }
+
+  void TearDown() override {
+    StringFamilyTest::TearDown();
+    absl::SetFlag(&FLAGS_counter_prefixes, {});
+    absl::SetFlag(&FLAGS_counter_staleness_ms, 10);
+  }
+};
+
+TEST_F(HotCounterTest, Deltas) {
+  // The first increment is applied, the next ones add up to the delta of the thread.
+  for (unsigned i = 1; i <= 10; ++i)
+    EXPECT_THAT(Run({"incr", "rate:a"}), IntArg(i));
+  EXPECT_EQ(Run({"get", "rate:a"}), "1");
+
+  // Other keys are incremented exactly.
+  EXPECT_THAT(Run({"incrby", "other", "5"}), IntArg(5));
+  EXPECT_EQ(Run({"get", "other"}), "5");
+
+  // The delta is applied within the staleness bound.
+  this_thread::sleep_for(chrono::milliseconds(700));
+  EXPECT_EQ(Run({"get", "rate:a"}), "10");
+
+  EXPECT_EQ(Run({"set", "rate:a", "100"}), "OK");
+  this_thread::sleep_for(chrono::milliseconds(600));
+  EXPECT_THAT(Run({"decr", "rate:a"}), IntArg(99));
+  EXPECT_EQ(Run({"get", "rate:a"}), "99");
+}
+
 }  // namespace dfly
@@ -5,6 +5,7 @@
 #include "server/table.h"
 
 #include "base/logging.h"
+#include "server/doc_index.h"
 
 namespace dfly {
 
@@ -15,7 +16,7 @@ unsigned kInitSegmentLog = 3;
 
 DbTableStats& DbTableStats::operator+=(const DbTableStats& o) {
   constexpr size_t kDbSz = sizeof(DbTableStats);
-  static_assert(kDbSz == 64);
+  static_assert(kDbSz == 64 + kObjTypeMax * 8 * 3);
 
   ADD(inline_keys);
   ADD(obj_memory_usage);
@@ -26,13 +27,17 @@ DbTableStats& DbTableStats::operator+=(const DbTableStats& o) {
   ADD(external_entries);
   ADD(external_size);
 
+  for (unsigned i = 0; i < kObjTypeMax; ++i) {
+    ADD(memory_usage_by_type[i]);
+    ADD(external_entries_by_type[i]);
+    ADD(external_size_by_type[i]);
+  }
+
   return *this;
 }
 
 DbTable::DbTable(std::pmr::memory_resource* mr)
-    : prime(kInitSegmentLog, detail::PrimeTablePolicy{}, mr),
-      expire(0, detail::ExpireTablePolicy{}, mr),
-      mcflag(0, detail::ExpireTablePolicy{}, mr) {
+    : prime(kInitSegmentLog, detail::PrimeTablePolicy{}, mr) {
 }
 
 DbTable::~DbTable() {
@@ -41,20 +46,32 @@ DbTable::~DbTable() {
 void DbTable::Clear() {
   prime.size();
   prime.Clear();
-  expire.Clear();
-  mcflag.Clear();
+  expire_count = 0;
+  if (prefix_index)
+    prefix_index->Clear();
   stats = DbTableStats{};
 }
 
-void DbTable::Release(IntentLock::Mode mode, std::string_view key, unsigned count) {
-  DVLOG(1) << "Release " << IntentLock::ModeName(mode) << " " << count << " for " << key;
+void DbTable::UnindexDoc(const PrimeKey& key) {
+  if (!doc_indices->empty()) {
+    std::string tmp;
+    doc_indices->OnDelete(key.GetSlice(&tmp));
+  }
+}
 
-  auto it = trans_locks.find(key);
-  CHECK(it != trans_locks.end()) << key;
+void LockTable::Release(IntentLock::Mode mode, uint64_t fp, unsigned count) {
+  auto it = locks_.find(fp);
+  CHECK(it != locks_.end()) << fp;
   it->second.Release(mode, count);
   if (it->second.IsFree()) {
-    trans_locks.erase(it);
+    locks_.erase(it);
   }
 }
 
+void DbTable::Release(IntentLock::Mode mode, std::string_view key, unsigned count) {
+  DVLOG(1) << "Release " << IntentLock::ModeName(mode) << " " << count << " for " << key;
+
+  trans_locks.Release(mode, LockTable::Fingerprint(key), count);
+}
+
 }  // namespace dfly
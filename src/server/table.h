@@ -5,12 +5,18 @@
 #pragma once
 
 #include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
+
+#include <array>
+#include <optional>
 
 #include <boost/smart_ptr/intrusive_ptr.hpp>
 #include <boost/smart_ptr/intrusive_ref_counter.hpp>
 
 #include "core/expire_period.h"
 #include "core/intent_lock.h"
+#include "core/prefix_index.h"
+#include "core/timing_wheel.h"
 #include "server/conn_context.h"
 #include "server/detail/table.h"
 
@@ -20,12 +26,39 @@ using PrimeKey = detail::PrimeKey;
 using PrimeValue = detail::PrimeValue;
 
 using PrimeTable = DashTable<PrimeKey, PrimeValue, detail::PrimeTablePolicy>;
-using ExpireTable = DashTable<PrimeKey, ExpirePeriod, detail::ExpireTablePolicy>;
 
 /// Iterators are invalidated when new keys are added to the table or some entries are deleted.
 /// Iterators are still valid  if a different entry in the table was mutated.
 using PrimeIterator = PrimeTable::iterator;
-using ExpireIterator = ExpireTable::iterator;
+
+class ShardDocIndices;
+
+// Points to the expiry deadline of a PrimeTable entry, which is stored inline in its slot.
+// Invalid if the entry does not expire. Invalidated together with the PrimeIterator.
+class ExpireIterator {
+ public:
+  ExpireIterator() = default;
+
+  // The entry must have an expiry.
+  explicit ExpireIterator(PrimeIterator it) : it_(it) {
+  }
+
+  // Returns the expiry of the entry, if it has one.
+  static ExpireIterator Of(PrimeIterator it) {
+    return !it.is_done() && it->second.HasExpire() ? ExpireIterator{it} : ExpireIterator{};
+  }
+
+  bool is_done() const {
+    return it_.is_done();
+  }
+
+  ExpirePeriod period() const {
+    return ExpirePeriod::FromValue(it_.GetExpiry());
+  }
+
+ private:
+  PrimeIterator it_;
+};
 
 inline bool IsValid(PrimeIterator it) {
   return !it.is_done();
@@ -35,6 +68,9 @@ inline bool IsValid(ExpireIterator it) {
   return !it.is_done();
 }
 
+// Number of object types that are tracked by DbTableStats, the largest one being OBJ_TS.
+constexpr unsigned kObjTypeMax = OBJ_TS + 1;
+
 struct DbTableStats {
   // Number of inline keys.
   uint64_t inline_keys = 0;
@@ -51,30 +87,170 @@ struct DbTableStats {
   size_t external_entries = 0;
   size_t external_size = 0;
 
+  // Value memory usage per object type, indexed by OBJ_xxx.
+  std::array<size_t, kObjTypeMax> memory_usage_by_type = {};
+
+  // Entries and bytes offloaded into the tiered storage per object type, indexed by OBJ_xxx.
+  std::array<size_t, kObjTypeMax> external_entries_by_type = {};
+  std::array<size_t, kObjTypeMax> external_size_by_type = {};
+
+  void AddTypeMemoryUsage(unsigned type, ssize_t delta) {
+    memory_usage_by_type[type] += delta;
+  }
+
+  void AddExternal(unsigned type, ssize_t entries, ssize_t size) {
+    external_entries += entries;
+    external_size += size;
+    external_entries_by_type[type] += entries;
+    external_size_by_type[type] += size;
+  }
+
   DbTableStats& operator+=(const DbTableStats& o);
 };
 
-using LockTable = absl::flat_hash_map<std::string, IntentLock>;
+// Intent locks of the keys of a DbTable. The locks are keyed by the fingerprint of the key, which
+// is the hash of PrimeTable, so the keys are never copied and callers that already hold the hash
+// of a key do not need to compute it again. Keys with colliding fingerprints share their lock.
+// This is safe since a lock that was not granted only prevents a transaction from running out of
+// order, and the only cost is a false conflict with a probability of 2^-64 per pair of keys.
+class LockTable {
+ public:
+  static uint64_t Fingerprint(std::string_view key) {
+    return detail::PrimeTablePolicy::HashFn(key);
+  }
+
+  // Returns true if the lock was acquired. In any case, the intent is recorded.
+  bool Acquire(IntentLock::Mode mode, uint64_t fp) {
+    return locks_[fp].Acquire(mode);
+  }
+
+  // The intents must have been recorded by Acquire.
+  void Release(IntentLock::Mode mode, uint64_t fp, unsigned count = 1);
+
+  // Returns true if the lock can be acquired in this mode, like IntentLock::Check.
+  bool Check(IntentLock::Mode mode, uint64_t fp) const {
+    auto it = locks_.find(fp);
+    return it == locks_.end() || it->second.Check(mode);
+  }
+
+  bool Contains(uint64_t fp) const {
+    return locks_.contains(fp);
+  }
+
+  bool empty() const {
+    return locks_.empty();
+  }
+
+  size_t size() const {
+    return locks_.size();
+  }
+
+  void swap(LockTable& other) {
+    locks_.swap(other.locks_);
+  }
+
+ private:
+  // Fingerprints are well mixed already.
+  struct FpHash {
+    size_t operator()(uint64_t fp) const {
+      return fp;
+    }
+  };
+
+  // Open addressing with the locks stored inline, erased once they are free.
+  absl::flat_hash_map<uint64_t, IntentLock, FpHash> locks_;
+};
 
 // A single Db table that represents a table that can be chosen with "SELECT" command.
 struct DbTable : boost::intrusive_ref_counter<DbTable, boost::thread_unsafe_counter> {
   PrimeTable prime;
-  ExpireTable expire;
-  DashTable<PrimeKey, uint32_t, detail::ExpireTablePolicy> mcflag;
+
+  // Number of the entries with EXPIRE_BIT.
+  size_t expire_count = 0;
 
   // Contains transaction locks
   LockTable trans_locks;
 
-  // Stores a list of dependant connections for each watched key.
-  absl::flat_hash_map<std::string, std::vector<ConnectionState::ExecInfo*>> watched_keys;
-
   mutable DbTableStats stats;
-  ExpireTable::Cursor expire_cursor;
+  PrimeTable::Cursor expire_cursor;
   PrimeTable::Cursor prime_cursor;
+  PrimeTable::Cursor ts_trim_cursor;
+
+  // Optional index of the expiring keys by deadline, see DbSlice::EnableExpireWheel.
+  std::unique_ptr<TimingWheel> expire_wheel;
+
+  // Index of the hashes with expiring fields by their next pass, see DbSlice::IndexFieldExpiry.
+  // Created once the db has such a hash.
+  std::unique_ptr<TimingWheel> field_expire_wheel;
+
+  // Optional index of the keys by their prefixes, see DbSlice::EnablePrefixIndex.
+  std::unique_ptr<PrefixIndex> prefix_index;
+
+  // The search indices of the shard, set for db 0 only, see DbSlice::SetDocIndices.
+  ShardDocIndices* doc_indices = nullptr;
+
+  // Directory index from which the incremental segment merging continues.
+  uint32_t prime_merge_cursor = 0;
+
+  // Directory index from which FreeMemWithEvictionStep continues.
+  uint32_t evict_cursor = 0;
+
+  // Keys deleted since the last snapshot, the tombstones of the next delta snapshot.
+  // Engaged while the slice tracks delta epochs, see DbSlice::StartDeltaEpoch.
+  std::optional<absl::flat_hash_set<std::string>> deleted_keys;
+
+  // Counts the deletions of keys by a hash of the key, so that EXEC tells whether a watched key
+  // that does not exist was deleted since WATCH, see ConnectionState::WatchedKey.
+  static constexpr unsigned kDeletionSlots = 1024;
+  std::array<uint32_t, kDeletionSlots> deletion_counts = {};
 
   explicit DbTable(std::pmr::memory_resource* mr);
   ~DbTable();
 
+  void RecordDeletion(const PrimeKey& key) {
+    ++deletion_counts[prime.DoHash(key) % kDeletionSlots];
+    if (deleted_keys)
+      deleted_keys->insert(key.ToString());
+  }
+
+  uint32_t DeletionCount(std::string_view key) const {
+    return deletion_counts[prime.DoHash(key) % kDeletionSlots];
+  }
+
+  // Called on the table that replaces a flushed one, whose keys were all deleted.
+  void InheritDeletions(const DbTable& flushed) {
+    for (unsigned i = 0; i < kDeletionSlots; ++i)
+      deletion_counts[i] = flushed.deletion_counts[i] + 1;
+  }
+
+  // A key that is added again is saved with its bucket, not as a tombstone.
+  void ForgetDeletion(std::string_view key) {
+    if (deleted_keys && !deleted_keys->empty())
+      deleted_keys->erase(key);
+  }
+
+  // The position of a key in the prefix index. It is derived from the hash of the key, so that
+  // it does not change while the key exists, and it is a valid SCAN cursor.
+  static uint64_t PrefixPos(uint64_t hash) {
+    return ((hash >> 32) % PrimeTable::kLogicalBucketNum) << 32 | (hash & 0xFFFFFFFF);
+  }
+
+  void IndexKey(std::string_view key) {
+    if (prefix_index)
+      prefix_index->Add(key, PrefixPos(prime.DoHash(key)));
+  }
+
+  void UnindexKey(const PrimeKey& key) {
+    if (prefix_index) {
+      std::string tmp;
+      prefix_index->Remove(key.GetSlice(&tmp), PrefixPos(prime.DoHash(key)));
+    }
+    if (doc_indices)
+      UnindexDoc(key);
+  }
+
+  void UnindexDoc(const PrimeKey& key);
+
   void Clear();
   void Release(IntentLock::Mode mode, std::string_view key, unsigned count);
 };
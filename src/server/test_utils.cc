@@ -9,6 +9,7 @@ extern "C" {
 }
 
 #include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
 #include <absl/strings/str_split.h>
 #include <mimalloc.h>
 
@@ -55,19 +56,8 @@ TestConnection::TestConnection(Protocol protocol)
     : facade::Connection(protocol, nullptr, nullptr, nullptr) {
 }
 
-void TestConnection::SendMsgVecAsync(const PubMessage& pmsg) {
-  backing_str_.emplace_back(new string(pmsg.channel));
-  PubMessage dest;
-  dest.channel = *backing_str_.back();
-
-  backing_str_.emplace_back(new string(*pmsg.message));
-  dest.message = pmsg.message;
-
-  if (!pmsg.pattern.empty()) {
-    backing_str_.emplace_back(new string(pmsg.pattern));
-    dest.pattern = *backing_str_.back();
-  }
-  messages.push_back(dest);
+void TestConnection::SendMsgVecAsync(PubMessage pmsg) {
+  messages.push_back(std::move(pmsg));
 }
 
 class BaseFamilyTest::TestConnWrapper {
@@ -90,6 +80,10 @@ class BaseFamilyTest::TestConnWrapper {
     return dfly::SplitLines(sink_.str());
   }
 
+  size_t ReplySize() const {
+    return sink_.str().size();
+  }
+
   void ClearSink() {
     sink_.Clear();
   }
@@ -148,8 +142,9 @@ void BaseFamilyTest::SetUp() {
   auto cb = [&](EngineShard* s) { s->db_slice().UpdateExpireBase(TEST_current_time_ms - 1000, 0); };
   shard_set->RunBriefInParallel(cb);
 
-  const TestInfo* const test_info = UnitTest::GetInstance()->current_test_info();
-  LOG(INFO) << "Starting " << test_info->name();
+  // Benchmarks set up the fixture outside of a test.
+  if (const TestInfo* const test_info = UnitTest::GetInstance()->current_test_info())
+    LOG(INFO) << "Starting " << test_info->name();
 }
 
 void BaseFamilyTest::TearDown() {
@@ -157,8 +152,8 @@ void BaseFamilyTest::TearDown() {
   service_.reset();
   pp_->Stop();
 
-  const TestInfo* const test_info = UnitTest::GetInstance()->current_test_info();
-  LOG(INFO) << "Finishing " << test_info->name();
+  if (const TestInfo* const test_info = UnitTest::GetInstance()->current_test_info())
+    LOG(INFO) << "Finishing " << test_info->name();
 }
 
 void BaseFamilyTest::WaitUntilLocked(DbIndex db_index, string_view key, double timeout) {
@@ -207,6 +202,61 @@ RespExpr BaseFamilyTest::Run(std::string_view id, ArgSlice slice) {
   return e;
 }
 
+StringVec BaseFamilyTest::RunPipeline(const vector<StringVec>& cmds) {
+  if (!ProactorBase::IsProactorThread()) {
+    return pp_->at(0)->Await([&] { return this->RunPipeline(cmds); });
+  }
+
+  TestConnWrapper* conn_wrapper = AddFindConn(Protocol::REDIS, GetId());
+
+  vector<CmdArgVec> args_vec;
+  for (const StringVec& cmd : cmds) {
+    vector<string_view> slice(cmd.begin(), cmd.end());
+    args_vec.push_back(conn_wrapper->Args(ArgSlice{slice}));
+  }
+
+  vector<CmdArgList> args_list;
+  for (CmdArgVec& args : args_vec) {
+    args_list.emplace_back(args);
+  }
+  service_->DispatchManyCommands(absl::MakeSpan(args_list), conn_wrapper->cmd_cntx());
+
+  return conn_wrapper->SplitLines();
+}
+
+size_t BaseFamilyTest::RunDiscardReply(string_view id, ArgSlice list) {
+  DCHECK(ProactorBase::IsProactorThread());
+  TestConnWrapper* conn_wrapper = AddFindConn(Protocol::REDIS, id);
+
+  // Unlike Args(), does not keep the arguments until the end of the test.
+  string buf;
+  for (string_view v : list) {
+    buf.append(v);
+  }
+  CmdArgVec args;
+  size_t offset = 0;
+  for (string_view v : list) {
+    args.emplace_back(buf.data() + offset, v.size());
+    offset += v.size();
+  }
+
+  auto* context = conn_wrapper->cmd_cntx();
+  service_->DispatchCommand(CmdArgList{args}, context);
+  DCHECK(context->transaction == nullptr);
+
+  return conn_wrapper->ReplySize();
+}
+
+void BaseFamilyTest::RunInFibers(unsigned num_fibers, const std::function<void(unsigned)>& fn) {
+  vector<fibers_ext::Fiber> fibers;
+  for (unsigned i = 0; i < num_fibers; ++i) {
+    fibers.push_back(pp_->at(i % pp_->size())->LaunchFiber([&fn, i] { fn(i); }));
+  }
+  for (auto& fb : fibers) {
+    fb.Join();
+  }
+}
+
 auto BaseFamilyTest::RunMC(MP::CmdType cmd_type, string_view key, string_view value, uint32_t flags,
                            chrono::seconds ttl) -> MCResponse {
   if (!ProactorBase::IsProactorThread()) {
@@ -276,6 +326,23 @@ auto BaseFamilyTest::GetMC(MP::CmdType cmd_type, std::initializer_list<std::stri
   return conn->SplitLines();
 }
 
+auto BaseFamilyTest::RunMCLine(string_view line, string_view value) -> MCResponse {
+  if (!ProactorBase::IsProactorThread()) {
+    return pp_->at(0)->Await([&] { return this->RunMCLine(line, value); });
+  }
+
+  string buf = absl::StrCat(line, "\r\n");
+  MP::Command cmd;
+  uint32_t consumed = 0;
+  CHECK_EQ(MP::OK, MemcacheParser{}.Parse(buf, &consumed, &cmd)) << line;
+  CHECK_EQ(buf.size(), consumed);
+
+  TestConnWrapper* conn = AddFindConn(Protocol::MEMCACHE, GetId());
+  service_->DispatchMC(cmd, value, conn->cmd_cntx());
+
+  return conn->SplitLines();
+}
+
 int64_t BaseFamilyTest::CheckedInt(ArgSlice list) {
   RespExpr resp = Run(list);
   if (resp.type == RespExpr::INT64) {
@@ -363,6 +430,14 @@ size_t BaseFamilyTest::SubscriberMessagesLen(string_view conn_id) const {
   return it->second->conn()->messages.size();
 }
 
+ProactorBase* BaseFamilyTest::GetMigrationRequest(string_view conn_id) const {
+  auto it = connections_.find(conn_id);
+  if (it == connections_.end())
+    return nullptr;
+
+  return it->second->conn()->migration_request;
+}
+
 facade::Connection::PubMessage BaseFamilyTest::GetPublishedMessage(string_view conn_id,
                                                                    size_t index) const {
   facade::Connection::PubMessage res;
@@ -6,6 +6,8 @@
 
 #include <gmock/gmock.h>
 
+#include <functional>
+
 #include "facade/dragonfly_connection.h"
 #include "facade/memcache_parser.h"
 #include "facade/redis_parser.h"
@@ -21,12 +23,15 @@ class TestConnection : public facade::Connection {
  public:
   TestConnection(Protocol protocol);
 
-  void SendMsgVecAsync(const PubMessage& pmsg) final;
+  void SendMsgVecAsync(PubMessage pmsg) final;
 
-  std::vector<PubMessage> messages;
+  // The test connections do not migrate, the request is only recorded.
+  void RequestAsyncMigration(util::ProactorBase* dest) final {
+    migration_request = dest;
+  }
 
- private:
-  std::vector<std::unique_ptr<std::string>> backing_str_;
+  std::vector<PubMessage> messages;
+  util::ProactorBase* migration_request = nullptr;
 };
 
 class BaseFamilyTest : public ::testing::Test {
@@ -50,11 +55,24 @@ class BaseFamilyTest : public ::testing::Test {
 
   RespExpr Run(std::string_view id, ArgSlice list);
 
+  // Dispatches the commands as a pipeline and returns the lines of their replies.
+  StringVec RunPipeline(const std::vector<StringVec>& cmds);
+
+  // For benchmarks: dispatches the command on the connection id and drops its reply without
+  // parsing it. Must be called from a proactor thread. Returns the length of the reply.
+  size_t RunDiscardReply(std::string_view id, ArgSlice list);
+
+  // For benchmarks: runs fn(i) for every i < num_fibers in fibers that are spread round-robin
+  // over the proactors, and waits for all of them.
+  void RunInFibers(unsigned num_fibers, const std::function<void(unsigned)>& fn);
+
   using MCResponse = std::vector<std::string>;
   MCResponse RunMC(MemcacheParser::CmdType cmd_type, std::string_view key, std::string_view value,
                    uint32_t flags = 0, std::chrono::seconds ttl = std::chrono::seconds{});
   MCResponse RunMC(MemcacheParser::CmdType cmd_type, std::string_view key = std::string_view{});
   MCResponse GetMC(MemcacheParser::CmdType cmd_type, std::initializer_list<std::string_view> list);
+  // Parses the command line, i.e. "mg key v", and dispatches it with the data block value.
+  MCResponse RunMCLine(std::string_view line, std::string_view value = std::string_view{});
 
   int64_t CheckedInt(std::initializer_list<std::string_view> list) {
     return CheckedInt(ArgSlice{list.begin(), list.size()});
@@ -80,6 +98,7 @@ class BaseFamilyTest : public ::testing::Test {
 
   std::string GetId() const;
   size_t SubscriberMessagesLen(std::string_view conn_id) const;
+  util::ProactorBase* GetMigrationRequest(std::string_view conn_id) const;
 
   // Returns message parts as returned by RESP:
   // pmessage, pattern, channel, message
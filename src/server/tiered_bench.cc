@@ -0,0 +1,445 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include <absl/container/flat_hash_set.h>
+#include <absl/random/discrete_distribution.h>
+#include <absl/random/random.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_format.h>
+#include <absl/strings/str_split.h>
+#include <unistd.h>
+
+#include <boost/fiber/mutex.hpp>
+#include <cstring>
+#include <iostream>
+
+#include "base/flags.h"
+#include "base/init.h"
+#include "base/logging.h"
+#include "core/external_alloc.h"
+#include "core/latency_histogram.h"
+#include "server/io_mgr.h"
+#include "util/fibers/event_count.h"
+#include "util/fibers/fiber.h"
+#include "util/fibers/fibers_ext.h"
+#include "util/uring/uring_pool.h"
+
+// A benchmark of the IO path of the tiered storage. Every thread owns a backing file with its
+// IoMgr and ExternalAllocator, as a shard does, and runs --concurrency fibers that offload
+// values to it and read them back. Once a thread keeps --max_live_mb of values, every write
+// frees a random value first, so that the allocator reuses and fragments its pages. For
+// example, a mix of small and large values on a file opened with O_DIRECT:
+//   ./tiered_bench --value_sizes=512:6,4096:3,65536:1 --read_ratio=0.8 --backing_file_direct
+//                  --backing_prefix=/mnt/nvme/bench --test_time=60
+
+ABSL_FLAG(std::string, backing_prefix, "/tmp/tiered_bench",
+          "The prefix of the backing files, a file per thread");
+ABSL_FLAG(std::string, value_sizes, "4096:1",
+          "The weights of the value sizes, as size:weight pairs, for example 512:6,65536:1");
+ABSL_FLAG(double, read_ratio, 0.5, "The fraction of the operations that read a value back");
+ABSL_FLAG(uint32_t, concurrency, 16, "The number of fibers per thread that issue the IO");
+ABSL_FLAG(uint32_t, max_pending_writes, 32,
+          "The maximal number of writes in flight per thread, as "
+          "--tiered_storage_max_pending_writes of the server");
+ABSL_FLAG(uint64_t, max_live_mb, 512,
+          "The payload that every thread keeps in its file before it starts freeing values");
+ABSL_FLAG(uint64_t, requests, 100000,
+          "The number of operations per fiber, ignored if --test_time is set");
+ABSL_FLAG(uint32_t, test_time, 0, "If positive, the run takes that many seconds");
+ABSL_FLAG(bool, verify, true, "Checks the contents of the values that are read back");
+ABSL_FLAG(uint64_t, seed, 0, "The seed of the random generators");
+
+using namespace std;
+using namespace util;
+using absl::GetFlag;
+
+namespace dfly {
+
+namespace {
+
+constexpr size_t kPageSize = 4096;
+
+struct Workload {
+  vector<uint32_t> sizes;
+  vector<double> weights;
+  uint64_t requests = 0;
+  uint64_t end_ns = 0;  // 0 unless --test_time is set.
+};
+
+struct Stats {
+  LatencyHistogram write_hist, read_hist;
+  uint64_t payload_written = 0;  // the bytes of the values.
+  uint64_t device_written = 0;   // the bytes written to the files, whole pages.
+  uint64_t payload_read = 0;
+  uint64_t errors = 0;
+  uint64_t mismatches = 0;
+  uint64_t grows = 0;
+
+  // The state of the files at the end of the run.
+  uint64_t span = 0;
+  uint64_t capacity = 0;
+  uint64_t allocated = 0;
+  uint64_t live_payload = 0;
+
+  Stats& operator+=(const Stats& o) {
+    write_hist += o.write_hist;
+    read_hist += o.read_hist;
+    payload_written += o.payload_written;
+    device_written += o.device_written;
+    payload_read += o.payload_read;
+    errors += o.errors;
+    mismatches += o.mismatches;
+    grows += o.grows;
+    span += o.span;
+    capacity += o.capacity;
+    allocated += o.allocated;
+    live_payload += o.live_payload;
+    return *this;
+  }
+};
+
+size_t PageAlign(size_t len) {
+  return (len + kPageSize - 1) & ~(kPageSize - 1);
+}
+
+// Writes the id of the value to its first bytes and fills the rest with a pattern of the id.
+void FillValue(uint64_t id, char* buf, size_t len) {
+  memset(buf, 'a' + id % 26, len);
+  memcpy(buf, &id, min(len, sizeof(id)));
+}
+
+bool CheckValue(uint64_t id, const char* buf, size_t len) {
+  size_t id_len = min(len, sizeof(id));
+  return memcmp(buf, &id, id_len) == 0 && (len == id_len || buf[len - 1] == 'a' + id % 26);
+}
+
+// The backing file of a thread and the fibers that load it.
+class Device {
+ public:
+  Device(const Workload& wl, uint64_t seed);
+
+  error_code Open(const string& path);
+  void Run();
+  void Close();
+
+  const Stats& stats() const {
+    return stats_;
+  }
+
+ private:
+  struct Value {
+    uint64_t id;
+    size_t offset;
+    uint32_t len;
+  };
+
+  void Write();
+  void Read();
+  void FreeRandom();
+
+  // Allocates a block of len bytes, growing the file if needed. Returns -1 if it can not grow.
+  int64_t Allocate(size_t len);
+
+  const Workload& wl_;
+  IoMgr io_mgr_;
+  ExternalAllocator alloc_;
+  absl::InsecureBitGen gen_;
+  absl::discrete_distribution<size_t> size_dist_;
+
+  vector<Value> values_;
+  absl::flat_hash_set<uint64_t> live_ids_;
+  uint64_t next_id_ = 0;
+  size_t live_bytes_ = 0;
+
+  unsigned pending_writes_ = 0;
+  bool grow_failed_ = false;
+  fibers_ext::EventCount evc_;
+
+  Stats stats_;
+};
+
+Device::Device(const Workload& wl, uint64_t seed)
+    : wl_(wl),
+      gen_(absl::SeedSeq{uint32_t(seed), uint32_t(seed >> 32)}),
+      size_dist_(wl.weights.begin(), wl.weights.end()) {
+}
+
+error_code Device::Open(const string& path) {
+  error_code ec = io_mgr_.Open(path);
+  if (ec)
+    return ec;
+  alloc_.AddStorage(0, io_mgr_.Span());
+  return error_code{};
+}
+
+void Device::Run() {
+  double read_ratio = GetFlag(FLAGS_read_ratio);
+  for (uint64_t i = 0; i < wl_.requests; ++i) {
+    if (wl_.end_ns && ProactorBase::GetMonotonicTimeNs() >= wl_.end_ns)
+      break;
+    if (grow_failed_)
+      break;
+
+    if (!values_.empty() && absl::Bernoulli(gen_, read_ratio))
+      Read();
+    else
+      Write();
+  }
+}
+
+void Device::Close() {
+  io_mgr_.Shutdown();
+
+  stats_.span = io_mgr_.Span();
+  stats_.capacity = alloc_.capacity();
+  stats_.allocated = alloc_.allocated_bytes();
+  stats_.live_payload = live_bytes_;
+}
+
+int64_t Device::Allocate(size_t len) {
+  while (true) {
+    int64_t res = alloc_.Malloc(len);
+    if (res >= 0)
+      return res;
+
+    // The same as TieredStorage::InitiateGrow, the storage is added once the file grew.
+    if (!io_mgr_.grow_pending()) {
+      size_t start = io_mgr_.Span();
+      size_t grow_size = -res;
+      error_code ec = io_mgr_.GrowAsync(grow_size, [this, start, grow_size](int io_res) {
+        if (io_res == 0) {
+          alloc_.AddStorage(start, grow_size);
+          ++stats_.grows;
+        } else {
+          LOG_FIRST_N(ERROR, 10) << "Error enlarging storage " << io_res;
+          grow_failed_ = true;
+        }
+        evc_.notifyAll();
+      });
+      if (ec) {
+        LOG(ERROR) << "Could not grow the backing file: " << ec.message();
+        grow_failed_ = true;
+      }
+    }
+
+    evc_.await([this] { return grow_failed_ || !io_mgr_.grow_pending(); });
+    if (grow_failed_)
+      return -1;
+  }
+}
+
+void Device::Write() {
+  evc_.await([this] { return pending_writes_ < GetFlag(FLAGS_max_pending_writes); });
+
+  if (!values_.empty() && live_bytes_ >= GetFlag(FLAGS_max_live_mb) << 20)
+    FreeRandom();
+
+  uint32_t len = wl_.sizes[size_dist_(gen_)];
+  size_t page_size = PageAlign(len);
+  int64_t offset = Allocate(page_size);
+  if (offset < 0)
+    return;
+
+  uint64_t id = next_id_++;
+  char* buf = io_mgr_.AllocBuffer(page_size);
+  FillValue(id, buf, len);
+
+  ++pending_writes_;
+  uint64_t start = ProactorBase::GetMonotonicTimeNs();
+  fibers_ext::Done done;
+  int write_res = 0;
+  auto cb = [&, done](int io_res) mutable {
+    write_res = io_res;
+    done.Notify();
+  };
+  error_code ec = io_mgr_.WriteAsync(offset, string_view{buf, page_size}, move(cb));
+  if (ec)
+    write_res = -ec.value();
+  else
+    done.Wait();
+  --pending_writes_;
+  evc_.notifyAll();
+
+  io_mgr_.FreeBuffer(buf, page_size);
+  if (write_res < 0) {
+    ++stats_.errors;
+    alloc_.Free(offset, page_size);
+    return;
+  }
+
+  stats_.write_hist.Add((ProactorBase::GetMonotonicTimeNs() - start) / 1000);
+  stats_.payload_written += len;
+  stats_.device_written += page_size;
+
+  values_.push_back(Value{id, size_t(offset), len});
+  live_ids_.insert(id);
+  live_bytes_ += len;
+}
+
+void Device::Read() {
+  Value value = values_[absl::Uniform<size_t>(gen_, 0, values_.size())];
+  size_t page_size = PageAlign(value.len);
+  char* buf = io_mgr_.AllocBuffer(page_size);
+
+  uint64_t start = ProactorBase::GetMonotonicTimeNs();
+  fibers_ext::Done done;
+  int read_res = 0;
+  auto cb = [&, done](int io_res) mutable {
+    read_res = io_res;
+    done.Notify();
+  };
+  io::MutableBytes dest{reinterpret_cast<uint8_t*>(buf), page_size};
+  error_code ec = io_mgr_.ReadAsync(value.offset, dest, move(cb));
+  if (ec)
+    read_res = -ec.value();
+  else
+    done.Wait();
+
+  if (read_res < 0) {
+    ++stats_.errors;
+  } else {
+    stats_.read_hist.Add((ProactorBase::GetMonotonicTimeNs() - start) / 1000);
+    stats_.payload_read += value.len;
+
+    // A value that was freed while it was read may have been overwritten meanwhile.
+    if (GetFlag(FLAGS_verify) && !CheckValue(value.id, buf, value.len) &&
+        live_ids_.contains(value.id)) {
+      ++stats_.mismatches;
+    }
+  }
+  io_mgr_.FreeBuffer(buf, page_size);
+}
+
+void Device::FreeRandom() {
+  size_t index = absl::Uniform<size_t>(gen_, 0, values_.size());
+  Value value = values_[index];
+  values_[index] = values_.back();
+  values_.pop_back();
+
+  alloc_.Free(value.offset, PageAlign(value.len));
+  live_ids_.erase(value.id);
+  live_bytes_ -= value.len;
+}
+
+bool ParseWorkload(Workload* wl) {
+  for (string_view item : absl::StrSplit(GetFlag(FLAGS_value_sizes), ',', absl::SkipEmpty())) {
+    vector<string_view> parts = absl::StrSplit(item, ':');
+    uint32_t size = 0;
+    double weight = 0;
+    if (parts.size() != 2 || !absl::SimpleAtoi(parts[0], &size) || size == 0 ||
+        !absl::SimpleAtod(parts[1], &weight) || weight < 0) {
+      LOG(ERROR) << "Bad value size item " << item;
+      return false;
+    }
+    wl->sizes.push_back(size);
+    wl->weights.push_back(weight);
+  }
+
+  if (wl->sizes.empty()) {
+    LOG(ERROR) << "--value_sizes is empty";
+    return false;
+  }
+  double read_ratio = GetFlag(FLAGS_read_ratio);
+  if (read_ratio < 0 || read_ratio > 1) {
+    LOG(ERROR) << "--read_ratio must be between 0 and 1";
+    return false;
+  }
+  if (GetFlag(FLAGS_max_pending_writes) == 0) {
+    LOG(ERROR) << "--max_pending_writes must be positive";
+    return false;
+  }
+
+  wl->requests = GetFlag(FLAGS_test_time) ? UINT64_MAX : GetFlag(FLAGS_requests);
+  return true;
+}
+
+void PrintStats(const Stats& stats, double secs) {
+  cout << absl::StrFormat("%-8s %12s %12s %10s %8s %8s %8s %8s %8s\n", "op", "requests",
+                          "ops/sec", "MB/sec", "p50", "p90", "p99", "p99.9", "max");
+
+  auto print = [&](string_view name, const LatencyHistogram& hist, uint64_t bytes) {
+    cout << absl::StrFormat("%-8s %12u %12.0f %10.1f %8u %8u %8u %8u %8u\n", name, hist.count(),
+                            hist.count() / secs, bytes / secs / (1 << 20), hist.Percentile(50),
+                            hist.Percentile(90), hist.Percentile(99), hist.Percentile(99.9),
+                            hist.max());
+  };
+
+  print("write", stats.write_hist, stats.payload_written);
+  print("read", stats.read_hist, stats.payload_read);
+  cout << "The latencies are in usec, the throughput counts the bytes of the values.\n";
+
+  // The values are written one per request, rounded up to whole pages. The server batches the
+  // small values into shared pages, see TieredStorage::FlushPending.
+  auto mb = [](uint64_t bytes) { return double(bytes) / (1 << 20); };
+  double amplification =
+      stats.payload_written ? double(stats.device_written) / stats.payload_written : 0;
+  cout << absl::StrFormat("written: %.1fMB of values, %.1fMB to the files, amplification %.2f\n",
+                          mb(stats.payload_written), mb(stats.device_written), amplification);
+
+  // The allocator rounds the blocks up to its size classes and keeps the pages whose values
+  // were partially freed.
+  double used = stats.capacity ? double(stats.allocated) / stats.capacity : 0;
+  double frag = stats.allocated ? 1 - double(stats.live_payload) / stats.allocated : 0;
+  cout << absl::StrFormat(
+      "files: %.1fMB, %u grows, allocator capacity %.1fMB, allocated %.1fMB (%.1f%%), "
+      "live values %.1fMB, fragmentation %.1f%%\n",
+      mb(stats.span), stats.grows, mb(stats.capacity), mb(stats.allocated), used * 100,
+      mb(stats.live_payload), frag * 100);
+  cout << stats.errors << " IO errors, " << stats.mismatches << " corrupted values.\n";
+}
+
+}  // namespace
+
+}  // namespace dfly
+
+int main(int argc, char* argv[]) {
+  MainInitGuard guard(&argc, &argv);
+  using namespace dfly;
+
+  Workload wl;
+  if (!ParseWorkload(&wl))
+    return 1;
+
+  unique_ptr<ProactorPool> pp(new uring::UringPool(1024));
+  pp->Run();
+
+  uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
+  if (uint32_t secs = GetFlag(FLAGS_test_time); secs > 0)
+    wl.end_ns = start_ns + secs * 1000000000ULL;
+
+  Stats stats;
+  ::boost::fibers::mutex mu;
+  bool failed = false;
+  uint64_t seed = GetFlag(FLAGS_seed);
+  pp->AwaitFiberOnAll([&](unsigned index, ProactorBase* pb) {
+    string path = absl::StrFormat("%s-%u", GetFlag(FLAGS_backing_prefix), index);
+    Device device(wl, seed * pp->size() + index);
+    if (error_code ec = device.Open(path); ec) {
+      LOG(ERROR) << "Could not open " << path << ": " << ec.message();
+      lock_guard lk(mu);
+      failed = true;
+      return;
+    }
+
+    vector<fibers_ext::Fiber> fibers;
+    for (uint32_t i = 0; i < max(1u, GetFlag(FLAGS_concurrency)); ++i)
+      fibers.push_back(pb->LaunchFiber([&device] { device.Run(); }));
+    for (auto& fb : fibers)
+      fb.Join();
+
+    device.Close();
+    unlink(path.c_str());
+
+    lock_guard lk(mu);
+    stats += device.stats();
+  });
+
+  double secs = (ProactorBase::GetMonotonicTimeNs() - start_ns) / 1e9;
+  pp->Stop();
+
+  if (failed)
+    return 1;
+  PrintStats(stats, secs);
+  return 0;
+}
@@ -5,18 +5,37 @@
 #include "server/tiered_storage.h"
 
 extern "C" {
+#include "redis/intset.h"
+#include "redis/listpack.h"
 #include "redis/object.h"
+#include "redis/zmalloc.h"
 }
 
 #include <mimalloc.h>
 
 #include "base/flags.h"
 #include "base/logging.h"
+#include "core/chunked_list.h"
 #include "server/db_slice.h"
+#include "server/tracepoints.h"
 #include "util/proactor_base.h"
 
 ABSL_FLAG(uint32_t, tiered_storage_max_pending_writes, 32,
           "Maximal number of pending writes per thread");
+ABSL_FLAG(uint32_t, tiered_cold_sweep_buckets, 16,
+          "Number of buckets scanned on every heartbeat for hashes, lists, sets and sorted sets "
+          "that were not accessed since the previous scan. Those are offloaded to the tiered "
+          "storage. 0 disables offloading of containers");
+ABSL_FLAG(uint32_t, tiered_promote_threshold, 4,
+          "Estimated number of recent accesses after which an offloaded string is promoted "
+          "back into memory, given that the memory budget allows it. Promoted values are not "
+          "offloaded again while they are hot. 0 disables promotion");
+ABSL_FLAG(uint32_t, tiered_compaction_bytes_per_step, 64 << 10,
+          "Maximal number of bytes moved on every heartbeat out of the sparse pages of the "
+          "backing file, so that their storage can be released. 0 disables the relocation");
+
+ABSL_DECLARE_FLAG(int32_t, list_max_listpack_size);
+ABSL_DECLARE_FLAG(int32_t, list_compress_depth);
 
 namespace dfly {
 
@@ -27,6 +46,122 @@ string BackingFileName(string_view base, unsigned index) {
   return absl::StrCat(base, "-", absl::Dec(index, absl::kZeroPad4), ".ssd");
 }
 
+namespace {
+
+// Returns the length of the blob that stores pv in the backing file, or 0 if pv can not be
+// stored there. Containers are stored only in their contiguous encodings: hashes and sorted
+// sets as listpacks, sets as intsets and lists as their decompressed listpack chunks back to
+// back. Every listpack starts with its total length, so the list chunks need no framing.
+// Strings stored as roaring bitmaps stay in memory, as their bytes may take far more space.
+size_t SerializedLen(const PrimeValue& pv) {
+  switch (pv.ObjType()) {
+    case OBJ_STRING:
+      return pv.IsBitmap() ? 0 : pv.Size();
+    case OBJ_HASH:
+      return pv.Encoding() == kEncodingListPack ? lpBytes((uint8_t*)pv.RObjPtr()) : 0;
+    case OBJ_ZSET:
+      return pv.Encoding() == OBJ_ENCODING_LISTPACK ? lpBytes((uint8_t*)pv.RObjPtr()) : 0;
+    case OBJ_SET:
+      return pv.Encoding() == kEncodingIntSet ? intsetBlobLen((intset*)pv.RObjPtr()) : 0;
+    case OBJ_LIST:
+      return ((const ChunkedList*)pv.RObjPtr())->ListpackBytes();
+  }
+  return 0;
+}
+
+// dest must have at least SerializedLen(pv) bytes available.
+void SerializeValue(const PrimeValue& pv, char* dest) {
+  switch (pv.ObjType()) {
+    case OBJ_STRING:
+      pv.GetString(dest);
+      break;
+    case OBJ_LIST:
+      ((const ChunkedList*)pv.RObjPtr())->ForEachListpack([&dest](const uint8_t* lp) {
+        size_t lp_len = lpBytes(const_cast<uint8_t*>(lp));
+        memcpy(dest, lp, lp_len);
+        dest += lp_len;
+        return true;
+      });
+      break;
+    default:
+      memcpy(dest, pv.RObjPtr(), SerializedLen(pv));
+  }
+}
+
+// Rebuilds the value that was serialized by SerializeValue into dest.
+void DeserializeValue(unsigned obj_type, unsigned encoding, string_view blob, PrimeValue* dest) {
+  if (obj_type == OBJ_STRING) {
+    dest->SetString(blob);
+    return;
+  }
+
+  void* inner = nullptr;
+  if (obj_type == OBJ_LIST) {
+    ChunkedList* list = new ChunkedList(GetFlag(FLAGS_list_max_listpack_size),
+                                        GetFlag(FLAGS_list_compress_depth));
+    while (!blob.empty()) {
+      size_t lp_len = absl::little_endian::Load32(blob.data());
+      DCHECK_LE(lp_len, blob.size());
+      uint8_t* lp = (uint8_t*)zmalloc(lp_len);
+      memcpy(lp, blob.data(), lp_len);
+      list->AppendListpack(lp);
+      blob.remove_prefix(lp_len);
+    }
+    inner = list;
+  } else {
+    inner = zmalloc(blob.size());
+    memcpy(inner, blob.data(), blob.size());
+  }
+
+  // InitRobj resets the object flags.
+  bool has_expire = dest->HasExpire();
+  bool has_flag = dest->HasFlag();
+  dest->InitRobj(obj_type, encoding, inner);
+  dest->SetExpire(has_expire);
+  dest->SetFlag(has_flag);
+}
+
+// Replaces the value with the pointer to its blob in the backing file.
+void SetExternal(size_t offset, size_t len, DbTableStats* stats, PrimeValue* pv) {
+  unsigned obj_type = pv->ObjType();
+  size_t heap_size = pv->MallocUsed();
+
+  stats->obj_memory_usage -= heap_size;
+  stats->AddTypeMemoryUsage(obj_type, -heap_size);
+  if (obj_type == OBJ_STRING) {
+    stats->strval_memory_usage -= heap_size;
+    pv->SetExternal(offset, len);
+  } else {
+    pv->SetExternal(offset, len, obj_type, pv->Encoding());
+  }
+
+  stats->AddExternal(obj_type, 1, len);
+}
+
+// Replaces the pointer to the blob with the value deserialized from it.
+void LoadExternal(string_view blob, DbTableStats* stats, PrimeValue* pv) {
+  unsigned obj_type = pv->ObjType();
+  DeserializeValue(obj_type, pv->Encoding(), blob, pv);
+
+  size_t heap_size = pv->MallocUsed();
+  stats->obj_memory_usage += heap_size;
+  stats->AddTypeMemoryUsage(obj_type, heap_size);
+  if (obj_type == OBJ_STRING)
+    stats->strval_memory_usage += heap_size;
+  stats->AddExternal(obj_type, -1, -ssize_t(blob.size()));
+}
+
+inline uint64_t NowUsec() {
+  return util::ProactorBase::GetMonotonicTimeNs() / 1000;
+}
+
+bool IsObjFitToUnload(const PrimeValue& pv) {
+  return !pv.IsExternal() && !pv.HasIoPending() &&
+         SerializedLen(pv) >= TieredStorage::kMinBlobLen;
+}
+
+}  // namespace
+
 #if 0
 struct IndexKey {
   DbIndex db_indx;
@@ -61,8 +196,33 @@ struct EntryHash {
 #endif
 
 const size_t kBatchSize = 4096;
+static_assert(kBatchSize == IoMgr::kBufferSize);
+
+// Storage offsets keep the index of their device in the bits above kDeviceShift,
+// and the offset into its backing file below them.
+const unsigned kDeviceShift = 40;
+static_assert(TieredStats::kMaxDevices << (kDeviceShift - 12) <= UINT32_MAX,
+              "page indices must fit into 32 bits");
+
+inline size_t LocalOffset(size_t offset) {
+  return offset & ((1ULL << kDeviceShift) - 1);
+}
 const size_t kPageAlignment = 4096;
 
+// Shared pages that hold less live data than this are compacted by moving their entries
+// into other pages.
+const size_t kCompactionThreshold = kBatchSize / 4;
+
+// Width of the sketch that tracks accesses of strings, and the bound on the number of
+// promotion candidates waiting for PromoteStep.
+const size_t kAccessSketchCapacity = 1 << 14;
+const size_t kMaxPromotionQueue = 256;
+const unsigned kPromotionsPerStep = 16;
+
+// Pages of the backing file whose live blocks take less than this ratio are relocated.
+const double kSparsePageUsage = 0.25;
+const unsigned kPunchPagesPerStep = 4;
+
 // we must support defragmentation of small entries.
 // This is similar to in-memory external defragmentation:
 // some of the values are deleted but the page is still used.
@@ -87,26 +247,28 @@ class TieredStorage::ActiveIoRequest {
   static constexpr unsigned kMaxEntriesCount = 56;
 
  public:
-  explicit ActiveIoRequest(DbIndex db_index, size_t file_offs)
-      : db_index_(db_index), file_offset_(file_offs), batch_offs_(kBatchSize) {
-    block_ptr_ = (char*)mi_malloc_aligned(kBatchSize, kPageAlignment);
+  // Values are serialized directly into the IO buffer, which comes from the registered pool
+  // of io_mgr when possible. io_mgr is the device of file_offs.
+  ActiveIoRequest(DbIndex db_index, size_t file_offs, IoMgr* io_mgr)
+      : db_index_(db_index), file_offset_(file_offs), batch_offs_(kBatchSize), io_mgr_(io_mgr) {
+    block_ptr_ = io_mgr->AllocBuffer(kBatchSize);
     DCHECK_EQ(0u, intptr_t(block_ptr_) % kPageAlignment);
   }
 
   ~ActiveIoRequest() {
-    mi_free(block_ptr_);
+    io_mgr_->FreeBuffer(block_ptr_, kBatchSize);
   }
 
   bool CanAccommodate(size_t length) const {
     return batch_offs_ >= length + 8 + HeaderLength();
   }
 
-  void Serialize(PrimeKey pkey, const PrimeValue& co);
-  void WriteAsync(IoMgr* iomgr, std::function<void(int)> cb);
+  void Serialize(PrimeIterator it);
+  void WriteAsync(std::function<void(int)> cb);
   void Undo(DbSlice* db_slice);
 
-  // Returns total number of bytes being offloaded by externalized values.
-  unsigned ExternalizeEntries(DbSlice* db_slice);
+  // Returns the page usage by the externalized values.
+  MultiBatch ExternalizeEntries(DbSlice* db_slice);
 
   ActiveIoRequest(const ActiveIoRequest&) = delete;
   ActiveIoRequest& operator=(const ActiveIoRequest&) = delete;
@@ -137,32 +299,41 @@ class TieredStorage::ActiveIoRequest {
   size_t file_offset_;
 
   size_t batch_offs_;
+  IoMgr* io_mgr_;
   char* block_ptr_;
 
   uint64_t hash_values_[kMaxEntriesCount];
+
+  struct EntryInfo {
+    size_t offset;
+    uint64_t version;  // bucket version at serialization, see ExternalizeEntries.
+  };
+
   // key -> offset
-  absl::flat_hash_map<string, size_t> entries_;
+  absl::flat_hash_map<string, EntryInfo> entries_;
 };
 
-void TieredStorage::ActiveIoRequest::Serialize(PrimeKey pkey, const PrimeValue& co) {
+void TieredStorage::ActiveIoRequest::Serialize(PrimeIterator it) {
+  const PrimeValue& co = it->second;
   DCHECK(!co.HasIoPending());
   DCHECK_LT(entries_.size(), ABSL_ARRAYSIZE(hash_values_));
 
-  size_t item_size = co.Size();
+  size_t item_size = SerializedLen(co);
   DCHECK_LE(item_size + HeaderLength(), batch_offs_);
   used_size_ += item_size;
-  batch_offs_ -= item_size;                // advance backwards
-  co.GetString(block_ptr_ + batch_offs_);  // serialize the object
+  batch_offs_ -= item_size;                      // advance backwards
+  SerializeValue(co, block_ptr_ + batch_offs_);  // serialize the object
 
   string keystr;
-  pkey.GetString(&keystr);
+  it->first.GetString(&keystr);
   uint64_t keyhash = CompactObj::HashCode(keystr);
   hash_values_[entries_.size()] = keyhash;
-  bool added = entries_.emplace(std::move(keystr), file_offset_ + batch_offs_).second;
+  EntryInfo info{file_offset_ + batch_offs_, it.GetVersion()};
+  bool added = entries_.emplace(std::move(keystr), info).second;
   CHECK(added);
 }
 
-void TieredStorage::ActiveIoRequest::WriteAsync(IoMgr* io_mgr, std::function<void(int)> cb) {
+void TieredStorage::ActiveIoRequest::WriteAsync(std::function<void(int)> cb) {
   DCHECK_LE(HeaderLength(), batch_offs_);
   DCHECK_LE(entries_.size(), kMaxEntriesCount);
 
@@ -172,11 +343,11 @@ void TieredStorage::ActiveIoRequest::WriteAsync(IoMgr* io_mgr, std::function<voi
   }
 
   string_view sv{block_ptr_, kBatchSize};
-  io_mgr->WriteAsync(file_offset_, sv, move(cb));
+  io_mgr_->WriteAsync(LocalOffset(file_offset_), sv, move(cb));
 }
 
 void TieredStorage::ActiveIoRequest::Undo(DbSlice* db_slice) {
-  PrimeTable* pt = db_slice->GetTables(db_index_).first;
+  PrimeTable* pt = db_slice->GetPrimeTable(db_index_);
   for (const auto& [pkey, _] : entries_) {
     PrimeIterator it = pt->Find(pkey);
 
@@ -188,51 +359,46 @@ void TieredStorage::ActiveIoRequest::Undo(DbSlice* db_slice) {
   }
 }
 
-unsigned TieredStorage::ActiveIoRequest::ExternalizeEntries(DbSlice* db_slice) {
-  PrimeTable* pt = db_slice->GetTables(db_index_).first;
+auto TieredStorage::ActiveIoRequest::ExternalizeEntries(DbSlice* db_slice) -> MultiBatch {
+  PrimeTable* pt = db_slice->GetPrimeTable(db_index_);
   DbTableStats* stats = db_slice->MutableStats(db_index_);
-  unsigned total_used = 0;
+  MultiBatch res{db_index_};
 
   for (const auto& k_v : entries_) {
     const auto& pkey = k_v.first;
 
-    size_t item_offset = k_v.second;
+    size_t item_offset = k_v.second.offset;
 
     PrimeIterator it = pt->Find(pkey);
 
-    // TODO: the key may be deleted or overriden. The last one is especially dangerous.
-    // we should update active pending request with any change we make to the entry.
-    // it should not be a problem since we have HasIoPending tag that mean we must
-    // update the inflight request (or mark the entry as cancelled).
-    CHECK(!it.is_done()) << "TBD";
-    CHECK(it->second.HasIoPending());
+    // The entry could be deleted or changed while it was written. Every change bumps the
+    // version of its bucket, so we externalize only the entries whose bucket has not changed.
+    // Unrelated changes in the bucket just postpone the unloading.
+    if (it.is_done() || !it->second.HasIoPending())
+      continue;
 
     it->second.SetIoPending(false);
+    if (it.GetVersion() != k_v.second.version)
+      continue;
 
     PrimeValue& pv = it->second;
-    size_t heap_size = pv.MallocUsed();
-    size_t item_size = pv.Size();
-
-    total_used += item_size;
-    stats->obj_memory_usage -= heap_size;
-    if (pv.ObjType() == OBJ_STRING)
-      stats->strval_memory_usage -= heap_size;
+    size_t item_size = SerializedLen(pv);
+    res.used += item_size;
+    ++res.entries;
 
     VLOG(2) << "SetExternal: " << pkey << " " << item_offset;
-    pv.SetExternal(item_offset, item_size);
-
-    stats->external_entries += 1;
-    stats->external_size += item_size;
+    SetExternal(item_offset, item_size, stats, &pv);
   }
 
-  return total_used;
+  return res;
 }
 
 bool TieredStorage::PerDb::ShouldFlush() const {
   return bucket_cursors.size() > bucket_cursors.capacity() / 2;
 }
 
-TieredStorage::TieredStorage(DbSlice* db_slice) : db_slice_(*db_slice) {
+TieredStorage::TieredStorage(DbSlice* db_slice)
+    : db_slice_(*db_slice), access_sketch_(kAccessSketchCapacity) {
 }
 
 TieredStorage::~TieredStorage() {
@@ -241,51 +407,215 @@ TieredStorage::~TieredStorage() {
   }
 }
 
-error_code TieredStorage::Open(const string& base) {
-  string path = BackingFileName(base, db_slice_.shard_id());
+error_code TieredStorage::Open(const vector<string>& prefixes) {
+  CHECK(!prefixes.empty() && prefixes.size() <= TieredStats::kMaxDevices) << prefixes.size();
+
+  for (const string& base : prefixes) {
+    devices_.emplace_back(new Device);
+    Device& device = *devices_.back();
+    error_code ec = device.io_mgr.Open(BackingFileName(base, db_slice_.shard_id()));
+    if (ec)
+      return ec;
 
-  error_code ec = io_mgr_.Open(path);
-  if (!ec) {
-    if (io_mgr_.Span()) {  // Add initial storage.
-      alloc_.AddStorage(0, io_mgr_.Span());
+    if (device.io_mgr.Span()) {  // Add initial storage.
+      device.alloc.AddStorage(0, device.io_mgr.Span());
     }
   }
-  return ec;
+
+  return error_code{};
+}
+
+auto TieredStorage::DeviceOf(size_t offset) -> Device& {
+  size_t index = offset >> kDeviceShift;
+  DCHECK_LT(index, devices_.size());
+  return *devices_[index];
+}
+
+int64_t TieredStorage::Malloc(size_t len) {
+  // Prefer the devices with shorter queues.
+  unsigned best = devices_.size();
+  for (unsigned i = 0; i < devices_.size(); ++i) {
+    if (best == devices_.size() ||
+        devices_[i]->io_mgr.queue_depth() < devices_[best]->io_mgr.queue_depth()) {
+      best = i;
+    }
+  }
+
+  int64_t needed = 0;
+  for (unsigned i = 0; i < devices_.size(); ++i) {
+    unsigned index = (best + i) % devices_.size();
+    int64_t res = devices_[index]->alloc.Malloc(len);
+    if (res >= 0)
+      return res | (int64_t(index) << kDeviceShift);
+    needed = res;
+  }
+
+  return needed;
+}
+
+void TieredStorage::FreeBlock(size_t offset, size_t len) {
+  DeviceOf(offset).alloc.Free(LocalOffset(offset), len);
+}
+
+bool TieredStorage::GrowPending() const {
+  for (const auto& device : devices_) {
+    if (device->io_mgr.grow_pending())
+      return true;
+  }
+  return false;
 }
 
 std::error_code TieredStorage::Read(size_t offset, size_t len, char* dest) {
+  io::Result<string> res = ReadAsync(offset, len).get();
+  if (!res)
+    return res.error();
+
+  memcpy(dest, res->data(), len);
+  return error_code{};
+}
+
+auto TieredStorage::ReadAsync(size_t offset, size_t len) -> ReadFuture {
+  auto it = pending_reads_.find(offset);
+  if (it != pending_reads_.end()) {
+    DCHECK_EQ(len, it->second->buf.size());
+    ++stats_.coalesced_reads;
+    return it->second->future;
+  }
+
   stats_.external_reads++;
   DVLOG(1) << "Read " << offset << " " << len;
 
-  return io_mgr_.Read(offset, io::MutableBytes{reinterpret_cast<uint8_t*>(dest), len});
+  PendingRead* req = new PendingRead;
+  req->buf.resize(len);
+  req->future = req->promise.get_future().share();
+  pending_reads_.emplace(offset, req);
+
+  DFLY_TRACE(tiered__read__submit, offset, len);
+  auto cb = [this, offset, req, start = NowUsec()](int io_res) {
+    uint64_t latency = NowUsec() - start;
+    stats_.read_latency.Add(latency);
+    DFLY_TRACE(tiered__read__done, offset, req->buf.size(), io_res, latency);
+    pending_reads_.erase(offset);
+
+    if (io_res < 0) {
+      error_code ec{-io_res, system_category()};
+      LOG(ERROR) << "Error reading from ssd storage " << ec.message();
+      req->promise.set_value(nonstd::make_unexpected(ec));
+    } else {
+      req->promise.set_value(std::move(req->buf));
+    }
+
+    if (req->free_len) {
+      Free(offset, req->free_len);
+    }
+    delete req;
+  };
+
+  io::MutableBytes dest{reinterpret_cast<uint8_t*>(req->buf.data()), len};
+  error_code ec = DeviceOf(offset).io_mgr.ReadAsync(LocalOffset(offset), dest, std::move(cb));
+  CHECK(!ec) << "TBD: " << ec;
+
+  return req->future;
+}
+
+error_code TieredStorage::ReadRange(size_t offset, size_t pos, size_t len, char* dest) {
+  if (auto it = pending_reads_.find(offset); it != pending_reads_.end()) {
+    ++stats_.coalesced_reads;
+    ReadFuture future = it->second->future;
+    io::Result<string> res = future.get();
+    if (!res)
+      return res.error();
+
+    memcpy(dest, res->data() + pos, len);
+    return error_code{};
+  }
+
+  stats_.range_reads++;
+  DVLOG(1) << "ReadRange " << offset << " " << pos << " " << len;
+
+  ++range_reads_[offset].count;
+  uint64_t start = NowUsec();
+  io::MutableBytes bytes{reinterpret_cast<uint8_t*>(dest), len};
+  error_code ec = DeviceOf(offset).io_mgr.Read(LocalOffset(offset) + pos, bytes);
+  stats_.read_latency.Add(NowUsec() - start);
+
+  // The map could be rehashed while the fiber was blocked.
+  auto it = range_reads_.find(offset);
+  DCHECK(it != range_reads_.end());
+  if (--it->second.count == 0) {
+    size_t free_len = it->second.free_len;
+    range_reads_.erase(it);
+    if (free_len)
+      Free(offset, free_len);
+  }
+
+  if (ec)
+    LOG(ERROR) << "Error reading from ssd storage " << ec.message();
+  return ec;
 }
 
 void TieredStorage::Free(size_t offset, size_t len) {
+  // The range can not be reused before its reads complete.
+  if (auto it = pending_reads_.find(offset); it != pending_reads_.end()) {
+    it->second->free_len = len;
+    return;
+  }
+
+  if (auto it = range_reads_.find(offset); it != range_reads_.end()) {
+    it->second.free_len = len;
+    return;
+  }
+
   if (offset % 4096 == 0) {
-    alloc_.Free(offset, len);
+    single_owners_.erase(offset);
+    FreeBlock(offset, len);
   } else {
     size_t offs_page = offset / 4096;
     auto it = multi_cnt_.find(offs_page);
     CHECK(it != multi_cnt_.end()) << offs_page;
     MultiBatch& mb = it->second;
     CHECK_GE(mb.used, len);
+    CHECK_GT(mb.entries, 0u);
     mb.used -= len;
-    if (mb.used == 0) {
-      alloc_.Free(offs_page * 4096, ExternalAllocator::kMinBlockSize);
+    --mb.entries;
+
+    // A page that is queued for compaction is released by CompactStep.
+    if (mb.compacting)
+      return;
+
+    if (mb.entries == 0) {
+      FreeBlock(offs_page * 4096, ExternalAllocator::kMinBlockSize);
       VLOG(1) << "multi_cnt_ erase " << it->first;
       multi_cnt_.erase(it);
+    } else if (mb.used < kCompactionThreshold) {
+      mb.compacting = true;
+      compaction_queue_.push_back(offs_page);
     }
   }
 }
 
 void TieredStorage::Shutdown() {
-  io_mgr_.Shutdown();
+  while (!pending_reads_.empty() || !range_reads_.empty()) {
+    util::fibers_ext::SleepFor(200us);
+  }
+  for (auto& device : devices_) {
+    device->io_mgr.Shutdown();
+  }
 }
 
 TieredStats TieredStorage::GetStats() const {
   TieredStats res = stats_;
-  res.storage_capacity = alloc_.capacity();
-  res.storage_reserved = alloc_.allocated_bytes();
+  res.num_devices = devices_.size();
+  for (unsigned i = 0; i < devices_.size(); ++i) {
+    const Device& device = *devices_[i];
+    res.storage_capacity += device.alloc.capacity();
+    res.storage_reserved += device.alloc.allocated_bytes();
+
+    const IoMgr::Stats& io_stats = device.io_mgr.stats();
+    res.devices[i].ios = io_stats.ios;
+    res.devices[i].latency_usec = io_stats.latency_usec;
+    res.devices[i].queue_depth = device.io_mgr.queue_depth();
+  }
 
   return res;
 }
@@ -295,13 +625,23 @@ void TieredStorage::SendIoRequest(ActiveIoRequest* req) {
   // static string tmp(4096, 'x');
   // string_view sv{tmp};
 
+  uint64_t start = NowUsec();
   active_req_sem_.await(
       [this] { return num_active_requests_ <= GetFlag(FLAGS_tiered_storage_max_pending_writes); });
 
-  auto cb = [this, req](int res) { FinishIoRequest(res, req); };
+  uint64_t submitted = NowUsec();
+  stats_.pending_wait_latency.Add(submitted - start);
+
+  DFLY_TRACE(tiered__write__submit, req->page_index() * kBatchSize, kBatchSize);
+  auto cb = [this, req, submitted](int res) {
+    uint64_t latency = NowUsec() - submitted;
+    stats_.write_latency.Add(latency);
+    DFLY_TRACE(tiered__write__done, req->page_index() * kBatchSize, kBatchSize, res, latency);
+    FinishIoRequest(res, req);
+  };
 
   ++num_active_requests_;
-  req->WriteAsync(&io_mgr_, move(cb));
+  req->WriteAsync(move(cb));
   ++stats_.external_writes;
 
 #else
@@ -314,12 +654,15 @@ void TieredStorage::FinishIoRequest(int io_res, ActiveIoRequest* req) {
     LOG(ERROR) << "Error writing into ssd file: " << util::detail::SafeErrorMessage(-io_res);
     req->Undo(&db_slice_);
   } else {
-    uint16_t used_total = req->ExternalizeEntries(&db_slice_);
+    MultiBatch mb = req->ExternalizeEntries(&db_slice_);
 
     CHECK_GT(req->entries().size(), 1u);  // multi-item batch
-    MultiBatch mb{used_total};
-    VLOG(1) << "multi_cnt_ emplace " << req->page_index();
-    multi_cnt_.emplace(req->page_index(), mb);
+    if (mb.entries == 0) {                // all the entries changed meanwhile.
+      FreeBlock(req->page_index() * kBatchSize, ExternalAllocator::kMinBlockSize);
+    } else {
+      VLOG(1) << "multi_cnt_ emplace " << req->page_index();
+      multi_cnt_.emplace(req->page_index(), mb);
+    }
   }
 
   delete req;
@@ -332,10 +675,13 @@ void TieredStorage::FinishIoRequest(int io_res, ActiveIoRequest* req) {
 }
 
 error_code TieredStorage::UnloadItem(DbIndex db_index, PrimeIterator it) {
-  CHECK_EQ(OBJ_STRING, it->second.ObjType());
+  size_t blob_len = SerializedLen(it->second);
+  if (blob_len < kMinBlobLen)  // not a contiguous container.
+    return error_code{};
 
-  // Relevant only for OBJ_STRING, see CHECK above.
-  size_t blob_len = it->second.Size();
+  // Hot values would be promoted again right away.
+  if (it->second.ObjType() == OBJ_STRING && IsHot(it->first))
+    return error_code{};
 
   if (blob_len >= kBatchSize / 2 &&
       num_active_requests_ < GetFlag(FLAGS_tiered_storage_max_pending_writes)) {
@@ -343,15 +689,7 @@ error_code TieredStorage::UnloadItem(DbIndex db_index, PrimeIterator it) {
     return error_code{};
   }
 
-  if (db_arr_.size() <= db_index) {
-    db_arr_.resize(db_index + 1);
-  }
-
-  if (db_arr_[db_index] == nullptr) {
-    db_arr_[db_index] = new PerDb;
-  }
-
-  PerDb* db = db_arr_[db_index];
+  PerDb* db = GetPerDb(db_index);
   db->bucket_cursors.EmplaceOrOverride(it.bucket_cursor().value());
   // db->pending_upload[it.bucket_cursor().value()] += blob_len;
 
@@ -361,7 +699,12 @@ error_code TieredStorage::UnloadItem(DbIndex db_index, PrimeIterator it) {
       FlushPending(db_index);
 
       // if we reached high utilization of the file range - try to grow the file.
-      if (alloc_.allocated_bytes() > size_t(alloc_.capacity() * 0.85)) {
+      size_t allocated = 0, capacity = 0;
+      for (const auto& device : devices_) {
+        allocated += device->alloc.allocated_bytes();
+        capacity += device->alloc.capacity();
+      }
+      if (allocated > size_t(capacity * 0.85)) {
         InitiateGrow(1ULL << 28);
       }
     }
@@ -370,14 +713,357 @@ error_code TieredStorage::UnloadItem(DbIndex db_index, PrimeIterator it) {
   return error_code{};
 }
 
-bool IsObjFitToUnload(const PrimeValue& pv) {
-  return pv.ObjType() == OBJ_STRING && !pv.IsExternal() && pv.Size() >= 64 && !pv.HasIoPending();
-};
+TieredStorage::PerDb* TieredStorage::GetPerDb(DbIndex db_index) {
+  if (db_arr_.size() <= db_index) {
+    db_arr_.resize(db_index + 1);
+  }
+
+  if (db_arr_[db_index] == nullptr) {
+    db_arr_[db_index] = new PerDb;
+  }
+
+  return db_arr_[db_index];
+}
+
+PrimeIterator TieredStorage::Load(DbIndex db_index, PrimeIterator it) {
+  DCHECK(it->second.IsExternal());
+  DCHECK_NE(OBJ_STRING, it->second.ObjType());
+
+  auto [offset, size] = it->second.GetExternalPtr();
+  string key = it->first.ToString();
+
+  unique_ptr<char[]> blob(new char[size]);
+  error_code ec = Read(offset, size, blob.get());
+  CHECK(!ec) << "TBD: " << ec;
+
+  // The read preempts us, so the entry could move, be loaded by another fiber or deleted.
+  it = db_slice_.GetPrimeTable(db_index)->Find(key);
+  if (it.is_done() || !it->second.IsExternal() ||
+      it->second.GetExternalPtr() != make_pair(offset, size)) {
+    return it;
+  }
+
+  PrimeValue& pv = it->second;
+  LoadExternal(string_view{blob.get(), size}, db_slice_.MutableStats(db_index), &pv);
+  pv.SetTouched(true);
+  Free(offset, size);
+  ++stats_.external_loads;
+
+  return it;
+}
+
+void TieredStorage::CompactStep() {
+  if (compaction_queue_.empty())
+    return;
+
+  uint32_t page_index = compaction_queue_.front();
+  compaction_queue_.pop_front();
+
+  auto it = multi_cnt_.find(page_index);
+  CHECK(it != multi_cnt_.end()) << page_index;
+  DCHECK(it->second.compacting);
+  size_t page_offset = size_t(page_index) * kBatchSize;
+
+  // The page header holds the hashes of its keys, which lead us to their entries.
+  vector<string> moved_keys;
+  DbIndex db_index = it->second.db_index;
+  if (it->second.entries > 0 && db_slice_.IsDbValid(db_index)) {
+    unique_ptr<char[]> page(new char[kBatchSize]);
+    error_code ec = Read(page_offset, kBatchSize, page.get());
+    CHECK(!ec) << "TBD: " << ec;
+
+    it = multi_cnt_.find(page_index);  // the map could change during the read.
+    MultiBatch& mb = it->second;
+    PrimeTable* pt = db_slice_.GetPrimeTable(db_index);
+    DbTableStats* stats = db_slice_.MutableStats(db_index);
+
+    unsigned num_hashes = uint8_t(page[0]);
+    for (unsigned i = 0; i < num_hashes && mb.entries > 0; ++i) {
+      uint64_t hash = absl::little_endian::Load64(page.get() + 1 + i * 8);
+      PrimeIterator pit =
+          pt->FindByHash(hash, [hash](const PrimeKey& key) { return key.HashCode() == hash; });
+
+      // The key could be deleted, overridden or renamed meanwhile. Entries that are being
+      // read stay, since the page can not be reused before their reads complete.
+      if (pit.is_done() || !pit->second.IsExternal() ||
+          pit->second.GetExternalPtr().first / kBatchSize != page_index ||
+          pending_reads_.contains(pit->second.GetExternalPtr().first) ||
+          range_reads_.contains(pit->second.GetExternalPtr().first)) {
+        continue;
+      }
+
+      PrimeValue& pv = pit->second;
+      auto [offset, size] = pv.GetExternalPtr();
+      LoadExternal(string_view{page.get() + offset - page_offset, size}, stats, &pv);
+
+      mb.used -= size;
+      --mb.entries;
+      moved_keys.push_back(pit->first.ToString());
+    }
+  }
+
+  it = multi_cnt_.find(page_index);
+  if (it->second.entries == 0) {
+    FreeBlock(page_offset, ExternalAllocator::kMinBlockSize);
+    VLOG(1) << "multi_cnt_ erase " << page_index;
+    multi_cnt_.erase(it);
+    ++stats_.compacted_pages;
+  } else {
+    // Some entries could not be found by their hash, e.g. renamed keys. The page is released
+    // once they are freed.
+    it->second.compacting = false;
+  }
+
+  // Pack the moved entries together with other values. UnloadItem may preempt, so we
+  // look up every key again.
+  PrimeTable* pt = db_slice_.GetPrimeTable(db_index);
+  for (const string& key : moved_keys) {
+    PrimeIterator pit = pt->Find(key);
+    if (!pit.is_done() && IsObjFitToUnload(pit->second)) {
+      UnloadItem(db_index, pit);
+    }
+  }
+}
+
+void TieredStorage::UnloadColdStep(DbIndex db_index) {
+  unsigned num_buckets = GetFlag(FLAGS_tiered_cold_sweep_buckets);
+  if (num_buckets == 0 || GrowPending() ||
+      num_active_requests_ >= GetFlag(FLAGS_tiered_storage_max_pending_writes)) {
+    return;
+  }
+
+  PerDb* db = GetPerDb(db_index);
+  PrimeTable* pt = db_slice_.GetPrimeTable(db_index);
+
+  // A value is cold if it has not been looked up since the previous pass over its bucket.
+  // Strings are offloaded when they are written, so the only strings that are found here
+  // are the ones that were promoted.
+  vector<string> cold_keys;
+  auto cb = [&](PrimeIterator it) {
+    PrimeValue& pv = it->second;
+    if (!IsObjFitToUnload(pv))
+      return;
+
+    if (pv.IsTouched()) {
+      pv.SetTouched(false);
+    } else {
+      cold_keys.push_back(it->first.ToString());
+    }
+  };
+
+  for (unsigned i = 0; i < num_buckets; ++i) {
+    db->cold_cursor = pt->Traverse(db->cold_cursor, cb);
+  }
+
+  // UnloadItem may preempt, so we look up every key again.
+  for (const string& key : cold_keys) {
+    PrimeIterator it = pt->Find(key);
+    if (!it.is_done() && IsObjFitToUnload(it->second) && !IsHot(it->first)) {
+      UnloadItem(db_index, it);
+      ++stats_.demotions;
+    }
+  }
+}
+
+bool TieredStorage::IsHot(const PrimeKey& key) const {
+  unsigned threshold = GetFlag(FLAGS_tiered_promote_threshold);
+  return threshold > 0 && access_sketch_.Estimate(key.HashCode()) >= threshold;
+}
+
+void TieredStorage::RecordAccess(DbIndex db_index, PrimeIterator it) {
+  unsigned threshold = GetFlag(FLAGS_tiered_promote_threshold);
+  if (threshold == 0)
+    return;
+
+  uint64_t hash = it->first.HashCode();
+  access_sketch_.Increment(hash);
+
+  // The estimate grows by at most one per increment, hence a key is queued once every time
+  // it becomes hot.
+  if (it->second.IsExternal() && access_sketch_.Estimate(hash) == threshold &&
+      promotion_queue_.size() < kMaxPromotionQueue) {
+    promotion_queue_.emplace_back(db_index, it->first.ToString());
+  }
+}
+
+void TieredStorage::PromoteStep() {
+  struct Promotion {
+    DbIndex db_index;
+    string key;
+    size_t offset;
+    ReadFuture future;
+  };
+
+  // Submit all the reads first so that they run in parallel.
+  vector<Promotion> promotions;
+  ssize_t budget = db_slice_.memory_budget();
+  while (!promotion_queue_.empty() && promotions.size() < kPromotionsPerStep) {
+    auto [db_index, key] = std::move(promotion_queue_.front());
+    promotion_queue_.pop_front();
+
+    if (!db_slice_.IsDbValid(db_index))
+      continue;
+
+    PrimeIterator it = db_slice_.GetPrimeTable(db_index)->Find(key);
+    if (it.is_done() || !it->second.IsExternal() || it->second.ObjType() != OBJ_STRING)
+      continue;
+
+    auto [offset, size] = it->second.GetExternalPtr();
+
+    // Keep a page of headroom so that promotions do not push the shard into eviction.
+    budget -= ssize_t(size);
+    if (budget < ssize_t(kBatchSize))
+      break;
+
+    promotions.push_back(Promotion{db_index, std::move(key), offset, ReadAsync(offset, size)});
+  }
+
+  for (Promotion& promotion : promotions) {
+    const io::Result<string>& blob = promotion.future.get();
+    CHECK(blob) << "TBD: " << blob.error();
+
+    // The key could be deleted or overridden during the read.
+    if (!db_slice_.IsDbValid(promotion.db_index))
+      continue;
+    PrimeIterator it = db_slice_.GetPrimeTable(promotion.db_index)->Find(promotion.key);
+    if (it.is_done() || !it->second.IsExternal() ||
+        it->second.GetExternalPtr() != make_pair(promotion.offset, blob->size())) {
+      continue;
+    }
+
+    PrimeValue& pv = it->second;
+    LoadExternal(*blob, db_slice_.MutableStats(promotion.db_index), &pv);
+    pv.SetTouched(true);
+    Free(promotion.offset, blob->size());
+    ++stats_.promotions;
+  }
+}
+
+void TieredStorage::CompactFileStep() {
+  for (auto& device : devices_) {
+    for (auto [offset, len] : device->alloc.TakeReleasedPages(kPunchPagesPerStep)) {
+      error_code ec = device->io_mgr.PunchHole(offset, len);
+      if (ec) {
+        LOG_FIRST_N(WARNING, 1) << "Could not release backing storage: " << ec.message();
+        break;
+      }
+      stats_.released_bytes += len;
+    }
+  }
+
+  // Foreground reads and writes go first.
+  size_t budget = GetFlag(FLAGS_tiered_compaction_bytes_per_step);
+  if (budget == 0 || !pending_reads_.empty() || !range_reads_.empty() || GrowPending() ||
+      num_active_requests_ >= GetFlag(FLAGS_tiered_storage_max_pending_writes)) {
+    return;
+  }
+
+  // The devices take turns in providing the sparse pages.
+  for (unsigned i = 0; i < devices_.size() && relocation_blocks_.empty(); ++i) {
+    unsigned index = relocation_device_++ % devices_.size();
+    int64_t page_offset = devices_[index]->alloc.FindSparsePage(kSparsePageUsage);
+    if (page_offset < 0)
+      continue;
+
+    for (size_t offset : devices_[index]->alloc.AllocatedBlocks(page_offset)) {
+      relocation_blocks_.push_back(offset | (size_t(index) << kDeviceShift));
+    }
+  }
+
+  while (budget > 0 && !relocation_blocks_.empty()) {
+    size_t offset = relocation_blocks_.back();
+    relocation_blocks_.pop_back();
+    budget -= std::min(budget, RelocateBlock(offset));
+  }
+}
+
+size_t TieredStorage::RelocateBlock(size_t offset) {
+  // The entries of shared pages are moved by CompactStep.
+  if (auto it = multi_cnt_.find(offset / kBatchSize); it != multi_cnt_.end()) {
+    MultiBatch& mb = it->second;
+    if (mb.compacting)
+      return 0;
+    mb.compacting = true;
+    compaction_queue_.push_back(it->first);
+    return mb.used;
+  }
+
+  // The block could be freed or still being written.
+  auto owner_it = single_owners_.find(offset);
+  if (owner_it == single_owners_.end() || owner_it->second.relocating)
+    return 0;
+
+  DbIndex db_index = owner_it->second.db_index;
+  uint64_t key_hash = owner_it->second.key_hash;
+  auto find = [this, db_index, key_hash](PrimeIterator* it) {
+    if (!db_slice_.IsDbValid(db_index))
+      return false;
+
+    PrimeTable* pt = db_slice_.GetPrimeTable(db_index);
+    *it = pt->FindByHash(key_hash,
+                         [key_hash](const PrimeKey& key) { return key.HashCode() == key_hash; });
+    return !it->is_done() && it->second.IsExternal();
+  };
+
+  PrimeIterator it;
+  if (!find(&it) || it->second.GetExternalPtr().first != offset)
+    return 0;
+
+  size_t len = it->second.GetExternalPtr().second;
+  int64_t new_offset = Malloc(len);
+  if (new_offset < 0)
+    return 0;
+
+  // The block is read and written without holding the entry, hence the bucket version
+  // tells whether the entry was replaced meanwhile, possibly by a value at the same offset.
+  constexpr size_t kMask = kPageAlignment - 1;
+  size_t page_size = (len + kMask) & (~kMask);
+  IoMgr* io_mgr = &DeviceOf(new_offset).io_mgr;
+  char* block_ptr = io_mgr->AllocBuffer(page_size);
+  uint64_t version = it.GetVersion();
+  owner_it->second.relocating = true;
+
+  auto finish = [this, find, io_mgr, block_ptr, db_index, key_hash, offset, new_offset, len,
+                 page_size, version](int io_res) {
+    io_mgr->FreeBuffer(block_ptr, page_size);
+    if (auto owner_it = single_owners_.find(offset); owner_it != single_owners_.end())
+      owner_it->second.relocating = false;
+
+    if (io_res < 0) {
+      LOG(ERROR) << "Error relocating in ssd storage " << util::detail::SafeErrorMessage(-io_res);
+    }
+
+    PrimeIterator it;
+    if (io_res < 0 || !find(&it) || it.GetVersion() != version ||
+        it->second.GetExternalPtr() != make_pair(offset, len)) {
+      FreeBlock(new_offset, len);
+      return;
+    }
+
+    PrimeValue& pv = it->second;
+    pv.SetExternal(new_offset, len, pv.ObjType(), pv.Encoding());
+    single_owners_.emplace(new_offset, SingleOwner{db_index, key_hash});
+    Free(offset, len);
+    ++stats_.relocated_blocks;
+  };
+
+  auto read_cb = [finish, io_mgr, block_ptr, new_offset, page_size](int io_res) {
+    if (io_res < 0)
+      return finish(io_res);
+    io_mgr->WriteAsync(LocalOffset(new_offset), string_view{block_ptr, page_size}, finish);
+  };
+
+  io::MutableBytes dest{reinterpret_cast<uint8_t*>(block_ptr), len};
+  error_code ec = DeviceOf(offset).io_mgr.ReadAsync(LocalOffset(offset), dest, std::move(read_cb));
+  CHECK(!ec) << "TBD: " << ec;
+
+  return len;
+}
 
 void TieredStorage::WriteSingle(DbIndex db_index, PrimeIterator it, size_t blob_len) {
   DCHECK(!it->second.HasIoPending());
 
-  int64_t res = alloc_.Malloc(blob_len);
+  int64_t res = Malloc(blob_len);
   if (res < 0) {
     InitiateGrow(-res);
     return;
@@ -393,45 +1079,61 @@ void TieredStorage::WriteSingle(DbIndex db_index, PrimeIterator it, size_t blob_
     char* block_ptr = nullptr;
     PrimeTable* pt = nullptr;
     size_t blob_len = 0;
+    size_t page_size = 0;
     off_t offset = 0;
     string key;
+    uint64_t version = 0;
   } req;
 
-  char* block_ptr = (char*)mi_malloc_aligned(page_size, kPageAlignment);
+  IoMgr* io_mgr = &DeviceOf(res).io_mgr;
+  char* block_ptr = io_mgr->AllocBuffer(page_size);
 
   req.blob_len = blob_len;
+  req.page_size = page_size;
   req.offset = res;
   req.key = it->first.ToString();
-  req.pt = db_slice_.GetTables(db_index).first;
+  req.pt = db_slice_.GetPrimeTable(db_index);
   req.block_ptr = block_ptr;
+  req.version = it.GetVersion();
 
-  it->second.GetString(block_ptr);
+  SerializeValue(it->second, block_ptr);
   it->second.SetIoPending(true);
 
-  auto cb = [req = std::move(req)](int io_res) {
+  DFLY_TRACE(tiered__write__submit, res, page_size);
+  auto cb = [this, io_mgr, db_index, req = std::move(req), start = NowUsec()](int io_res) {
+    uint64_t latency = NowUsec() - start;
+    stats_.write_latency.Add(latency);
+    DFLY_TRACE(tiered__write__done, req.offset, req.page_size, io_res, latency);
+    io_mgr->FreeBuffer(req.block_ptr, req.page_size);
     PrimeIterator it = req.pt->Find(req.key);
-    CHECK(!it.is_done());
 
-    // TODO: what happens when if the entry was deleted meanwhile
-    // or it has been serialized again?
-    CHECK(it->second.HasIoPending()) << "TBD: fix inconsistencies";
-    it->second.SetIoPending(false);
+    // See ExternalizeEntries for how we detect the entries that changed during the write.
+    bool changed = it.is_done() || !it->second.HasIoPending();
+    if (!changed) {
+      it->second.SetIoPending(false);
+      changed = it.GetVersion() != req.version;
+    }
 
     if (io_res < 0) {
       LOG(ERROR) << "Error writing to ssd storage " << util::detail::SafeErrorMessage(-io_res);
+    }
+
+    if (io_res < 0 || changed) {
+      FreeBlock(req.offset, req.blob_len);
       return;
     }
-    it->second.SetExternal(req.offset, req.blob_len);
-    mi_free(req.block_ptr);
+
+    SetExternal(req.offset, req.blob_len, db_slice_.MutableStats(db_index), &it->second);
+    single_owners_.emplace(req.offset, SingleOwner{db_index, it->first.HashCode()});
   };
 
-  io_mgr_.WriteAsync(res, string_view{block_ptr, page_size}, std::move(cb));
+  io_mgr->WriteAsync(LocalOffset(res), string_view{block_ptr, page_size}, std::move(cb));
 }
 
 void TieredStorage::FlushPending(DbIndex db_index) {
   PerDb* db = db_arr_[db_index];
 
-  DCHECK(!io_mgr_.grow_pending() && !db->bucket_cursors.empty());
+  DCHECK(!GrowPending() && !db->bucket_cursors.empty());
 
   vector<uint64_t> canonic_req;
   canonic_req.reserve(db->bucket_cursors.size());
@@ -454,8 +1156,9 @@ void TieredStorage::FlushPending(DbIndex db_index) {
   PrimeTable::iterator single_batch[kMaxBatchLen];
   unsigned batch_len = 0;
 
+  // Large items leave no room for others in the batch, they are written by WriteSingle.
   auto tr_cb = [&](PrimeTable::iterator it) {
-    if (IsObjFitToUnload(it->second)) {
+    if (IsObjFitToUnload(it->second) && SerializedLen(it->second) < kBatchSize / 2) {
       CHECK_LT(batch_len, kMaxBatchLen);
       single_batch[batch_len++] = it;
     }
@@ -466,11 +1169,11 @@ void TieredStorage::FlushPending(DbIndex db_index) {
   for (size_t i = 0; i < canonic_req.size(); ++i) {
     uint64_t cursor_val = canonic_req[i];
     PrimeTable::Cursor curs(cursor_val);
-    db_slice_.GetTables(db_index).first->Traverse(curs, tr_cb);
+    db_slice_.GetPrimeTable(db_index)->Traverse(curs, tr_cb);
 
     for (unsigned j = 0; j < batch_len; ++j) {
       PrimeIterator it = single_batch[j];
-      size_t item_size = it->second.Size();
+      size_t item_size = SerializedLen(it->second);
       DCHECK_GT(item_size, 0u);
 
       if (!active_req || !active_req->CanAccommodate(item_size)) {
@@ -483,7 +1186,7 @@ void TieredStorage::FlushPending(DbIndex db_index) {
           active_req = nullptr;
         }
 
-        int64_t res = alloc_.Malloc(item_size);
+        int64_t res = Malloc(item_size);
         if (res < 0) {
           InitiateGrow(-res);
           return;
@@ -492,10 +1195,10 @@ void TieredStorage::FlushPending(DbIndex db_index) {
         size_t batch_size = ExternalAllocator::GoodSize(item_size);
         DCHECK_EQ(batch_size, ExternalAllocator::GoodSize(batch_size));
 
-        active_req = new ActiveIoRequest(db_index, res);
+        active_req = new ActiveIoRequest(db_index, res, &DeviceOf(res).io_mgr);
       }
 
-      active_req->Serialize(it->first.AsRef(), it->second);
+      active_req->Serialize(it);
       it->second.SetIoPending(true);
     }
     batch_len = 0;
@@ -515,21 +1218,33 @@ void TieredStorage::FlushPending(DbIndex db_index) {
 }
 
 void TieredStorage::InitiateGrow(size_t grow_size) {
-  if (io_mgr_.grow_pending())
+  if (GrowPending())
     return;
   DCHECK_GT(grow_size, 0u);
 
-  size_t start = io_mgr_.Span();
+  // Grow the device with the least free space.
+  Device* device = nullptr;
+  size_t min_free = SIZE_MAX;
+  for (auto& candidate : devices_) {
+    size_t free_space = candidate->alloc.capacity() - candidate->alloc.allocated_bytes();
+    if (free_space < min_free) {
+      min_free = free_space;
+      device = candidate.get();
+    }
+  }
+
+  size_t start = device->io_mgr.Span();
 
-  auto cb = [start, grow_size, this](int io_res) {
+  auto cb = [this, start, grow_size, device, grow_start = NowUsec()](int io_res) {
+    stats_.grow_latency.Add(NowUsec() - grow_start);
     if (io_res == 0) {
-      alloc_.AddStorage(start, grow_size);
+      device->alloc.AddStorage(start, grow_size);
     } else {
       LOG_FIRST_N(ERROR, 10) << "Error enlarging storage " << io_res;
     }
   };
 
-  error_code ec = io_mgr_.GrowAsync(grow_size, move(cb));
+  error_code ec = device->io_mgr.GrowAsync(grow_size, move(cb));
   CHECK(!ec) << "TBD";  // TODO
 }
 
@@ -5,8 +5,13 @@
 
 #include <absl/container/flat_hash_map.h>
 
+#include <deque>
+
+#include <boost/fiber/future.hpp>
+
 #include "base/ring_buffer.h"
 #include "core/external_alloc.h"
+#include "core/frequency_sketch.h"
 #include "server/common.h"
 #include "server/io_mgr.h"
 #include "server/table.h"
@@ -23,13 +28,56 @@ class TieredStorage {
   explicit TieredStorage(DbSlice* db_slice);
   ~TieredStorage();
 
-  std::error_code Open(const std::string& path);
+  // Opens one backing file per prefix. The storage is spread across them, hence each prefix
+  // is expected to be on its own device.
+  std::error_code Open(const std::vector<std::string>& prefixes);
 
+  using ReadFuture = boost::fibers::shared_future<io::Result<std::string>>;
+
+  // Blocks the calling fiber until the read completes.
   std::error_code Read(size_t offset, size_t len, char* dest);
 
-  // Schedules unloading of the item, pointed by the iterator.
+  // Submits the read and returns immediately, so that the caller can release the shard
+  // before waiting for the value. Concurrent reads of the same offset share one IO request.
+  // The range is not reused until its reads complete even if it is freed meanwhile.
+  ReadFuture ReadAsync(size_t offset, size_t len);
+
+  // Reads len bytes at pos of the value stored at offset, blocking the calling fiber. Only the
+  // pages that cover the range are read, unless a read of the whole value is in flight already.
+  std::error_code ReadRange(size_t offset, size_t pos, size_t len, char* dest);
+
+  // Schedules unloading of the item, pointed by the iterator. Strings and containers in their
+  // contiguous encodings (listpacks, intsets) can be unloaded, other items are ignored.
   std::error_code UnloadItem(DbIndex db_index, PrimeIterator it);
 
+  // Reads the unloaded container pointed by it back into memory. Preempts the calling fiber,
+  // hence returns the iterator to the entry after the read, which is done if the key
+  // has been deleted meanwhile.
+  PrimeIterator Load(DbIndex db_index, PrimeIterator it);
+
+  // Scans the next buckets of the database and unloads the containers that have not been
+  // accessed since the previous scan. Called from the shard heartbeat.
+  void UnloadColdStep(DbIndex db_index);
+
+  // Compacts one of the shared pages whose live entries fell under a quarter of the page,
+  // by loading them back and unloading them again together with other values.
+  // Called from the shard heartbeat.
+  void CompactStep();
+
+  // Records an access of the string pointed by it, either offloaded or not. Offloaded
+  // strings that become hot are queued for promotion, see --tiered_promote_threshold.
+  void RecordAccess(DbIndex db_index, PrimeIterator it);
+
+  // Reads the queued hot strings back into memory while the memory budget allows it.
+  // Called from the shard heartbeat.
+  void PromoteStep();
+
+  // Releases the storage of the free pages of the backing file and moves the live blocks
+  // out of sparse pages, so that their storage can be released as well. The relocation is
+  // limited by --tiered_compaction_bytes_per_step and pauses while reads are in flight.
+  // Called from the shard heartbeat.
+  void CompactFileStep();
+
   static bool EligibleForOffload(std::string_view val) {
     return val.size() >= kMinBlobLen;
   }
@@ -52,6 +100,7 @@ class TieredStorage {
   struct PerDb {
     base::RingBuffer<uint64_t> bucket_cursors;  // buckets cursors pending for unloading.
     absl::flat_hash_map<PrimeKey, ActiveIoRequest*, Hasher> active_requests;
+    PrimeTable::Cursor cold_cursor;  // where UnloadColdStep continues.
 
     PerDb(const PerDb&) = delete;
     PerDb& operator=(const PerDb&) = delete;
@@ -62,17 +111,35 @@ class TieredStorage {
     bool ShouldFlush() const;
   };
 
+  // A backing file with its own allocator.
+  struct Device {
+    IoMgr io_mgr;
+    ExternalAllocator alloc;
+  };
+
+  Device& DeviceOf(size_t offset);
+
+  // Allocates on the device with the shortest IO queue that has space. Returns a negative
+  // result like ExternalAllocator::Malloc if none has.
+  int64_t Malloc(size_t len);
+  void FreeBlock(size_t offset, size_t len);
+  bool GrowPending() const;
+
+  PerDb* GetPerDb(DbIndex db_index);
+  bool IsHot(const PrimeKey& key) const;
+
+  // Schedules moving the block at offset into another page. Returns the number of bytes
+  // that will be moved.
+  size_t RelocateBlock(size_t offset);
   void WriteSingle(DbIndex db_index, PrimeIterator it, size_t blob_len);
 
   void FlushPending(DbIndex db_index);
   void InitiateGrow(size_t size);
   void SendIoRequest(ActiveIoRequest* req);
   void FinishIoRequest(int io_res, ActiveIoRequest* req);
-  void SetExternal(DbIndex db_index, size_t item_offset, PrimeValue* dest);
 
   DbSlice& db_slice_;
-  IoMgr io_mgr_;
-  ExternalAllocator alloc_;
+  std::vector<std::unique_ptr<Device>> devices_;
 
   size_t submitted_io_writes_ = 0;
   size_t submitted_io_write_size_ = 0;
@@ -94,14 +161,58 @@ class TieredStorage {
   // multi_cnt_.second is MultiBatch object storing number of allocated records in the batch
   // and its capacity (/ 4k).
   struct MultiBatch {
-    uint16_t used;      // number of used bytes
-    uint16_t reserved;  // in 4k pages.
+    DbIndex db_index;
+    uint16_t used = 0;     // number of used bytes
+    uint16_t entries = 0;  // number of live entries, the page is freed when none is left.
+    bool compacting = false;
 
-    MultiBatch(uint16_t mem_used) : used(mem_used) {
+    MultiBatch(DbIndex index) : db_index(index) {
     }
   };
   absl::flat_hash_map<uint32_t, MultiBatch> multi_cnt_;
 
+  // Pages in multi_cnt_ that are waiting for CompactStep.
+  std::deque<uint32_t> compaction_queue_;
+
+  struct PendingRead {
+    boost::fibers::promise<io::Result<std::string>> promise;
+    ReadFuture future;
+    std::string buf;
+    size_t free_len = 0;  // set if the range was freed during the read.
+  };
+
+  // offset -> in-flight read.
+  absl::flat_hash_map<size_t, PendingRead*> pending_reads_;
+
+  struct RangeReads {
+    unsigned count = 0;
+    size_t free_len = 0;  // set if the range was freed during the reads.
+  };
+
+  // offset of the value -> its partial reads in flight. The reads hold off the release
+  // and the relocation of the value as the reads in pending_reads_ do.
+  absl::flat_hash_map<size_t, RangeReads> range_reads_;
+
+  // Owners of the single-value blocks, used to relocate them.
+  struct SingleOwner {
+    DbIndex db_index;
+    bool relocating = false;
+    uint64_t key_hash;
+
+    SingleOwner(DbIndex index, uint64_t hash) : db_index(index), key_hash(hash) {
+    }
+  };
+
+  // offset -> owner of the block.
+  absl::flat_hash_map<size_t, SingleOwner> single_owners_;
+
+  // Live blocks of the sparse page that is being relocated.
+  std::vector<size_t> relocation_blocks_;
+  unsigned relocation_device_ = 0;  // the device that provides the next sparse page.
+
+  FrequencySketch access_sketch_;  // of the string keys.
+  std::deque<std::pair<DbIndex, std::string>> promotion_queue_;
+
   TieredStats stats_;
 };
 
@@ -0,0 +1,45 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+// Static tracepoints (USDT) of the "dragonfly" provider, for example:
+//   bpftrace -e 'usdt:./dragonfly:dragonfly:cmd__end { @[str(arg0)] = hist(arg2 / 1000); }'
+// Lists the probes with their arguments: readelf -n dragonfly | grep -A2 stapsdt
+//
+// A probe is a single nop until a tracer attaches to it, but its arguments are always evaluated,
+// therefore the probes pass only the values at hand. Rather than durations, they often pass
+// timestamps of ProactorBase::GetMonotonicTimeNs, which is CLOCK_MONOTONIC as is nsecs in
+// bpftrace.
+//
+// cmd__start(name)                               Service::DispatchCommand.
+// cmd__end(name, txid, latency_ns)
+// tx__schedule(txid, sid, enqueue_ns)            in every shard, either queued or run at once.
+// tx__execute(txid, sid, start_ns, end_ns)       a callback of the transaction ran in the shard.
+// tx__conclude(txid, shard_cnt, schedule_ns)     in the coordinator, after the last hop.
+// hop__enqueue(txid, sid, seq)                   EngineShard::AddHop.
+// hop__dequeue(txid, sid, wait_ns)               the hop starts to run in the shard.
+// evict__step(sid, db, evicted, freed_bytes)     DbSlice::FreeMemWithEvictionStep.
+// tiered__read__submit(offset, len)
+// tiered__read__done(offset, len, io_res, latency_usec)
+// tiered__write__submit(offset, len)
+// tiered__write__done(offset, len, io_res, latency_usec)
+// snapshot__bucket__start(sid, db)               SliceSnapshot::SerializeBucket.
+// snapshot__bucket__done(sid, db, entries)
+//
+// Compiled in with DF_USE_USDT when sys/sdt.h (systemtap-sdt-dev) is installed.
+
+#ifdef DFLY_USE_USDT
+
+#include <sys/sdt.h>
+
+#define DFLY_TRACE(name, ...) STAP_PROBEV(dragonfly, name, __VA_ARGS__)
+
+#else
+
+#define DFLY_TRACE(name, ...) \
+  do {                        \
+  } while (0)
+
+#endif
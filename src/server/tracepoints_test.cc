@@ -0,0 +1,129 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/tracepoints.h"
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/strings/str_split.h>
+#include <elf.h>
+
+#include <cstring>
+#include <fstream>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "server/test_utils.h"
+
+using namespace testing;
+using namespace std;
+
+namespace dfly {
+
+class TracepointsTest : public BaseFamilyTest {};
+
+// The probes compile to a nop without a tracer, but DFLY_TRACE is still a single statement.
+TEST_F(TracepointsTest, Statement) {
+  unsigned calls = 0;
+  [[maybe_unused]] auto arg = [&calls] { return ++calls; };
+
+  if (calls > 0)
+    DFLY_TRACE(test__probe, arg());
+  else
+    DFLY_TRACE(test__probe, arg(), arg());
+
+#ifdef DFLY_USE_USDT
+  EXPECT_EQ(2u, calls);
+#else
+  EXPECT_EQ(0u, calls);  // the arguments are not compiled at all.
+#endif
+}
+
+// The sites of the probes run with or without a tracer, including the commands without a
+// transaction, whose cmd__end passes txid 0, and the multi-shard and the blocked transactions.
+TEST_F(TracepointsTest, ProbedPaths) {
+  EXPECT_EQ(Run({"ping"}), "PONG");
+  EXPECT_EQ(Run({"mset", "a", "1", "b", "2", "c", "3"}), "OK");
+  EXPECT_THAT(Run({"mget", "a", "b", "c"}).GetVec(), ElementsAre("1", "2", "3"));
+
+  Run({"multi"});
+  Run({"incr", "a"});
+  Run({"del", "b"});
+  EXPECT_THAT(Run({"exec"}).GetVec(), ElementsAre(IntArg(2), IntArg(1)));
+
+  EXPECT_THAT(Run({"blpop", "list", "0.01"}), ArgType(RespExpr::NIL_ARRAY));
+}
+
+#ifdef DFLY_USE_USDT
+
+// The probes of the "dragonfly" provider in the .note.stapsdt section of the running binary,
+// by their names, with the argument counts of all the sites of each probe.
+static absl::flat_hash_map<string, vector<unsigned>> ReadProbes() {
+  ifstream in("/proc/self/exe", ios::binary);
+  string elf{istreambuf_iterator<char>(in), istreambuf_iterator<char>()};
+  absl::flat_hash_map<string, vector<unsigned>> res;
+  if (elf.size() < sizeof(Elf64_Ehdr))
+    return res;
+
+  const Elf64_Ehdr* ehdr = reinterpret_cast<const Elf64_Ehdr*>(elf.data());
+  const Elf64_Shdr* shdrs = reinterpret_cast<const Elf64_Shdr*>(elf.data() + ehdr->e_shoff);
+  const char* shstrtab = elf.data() + shdrs[ehdr->e_shstrndx].sh_offset;
+
+  for (unsigned i = 0; i < ehdr->e_shnum; ++i) {
+    if (shdrs[i].sh_type != SHT_NOTE || string_view{shstrtab + shdrs[i].sh_name} != ".note.stapsdt")
+      continue;
+
+    string_view notes{elf.data() + shdrs[i].sh_offset, shdrs[i].sh_size};
+    while (notes.size() >= sizeof(Elf64_Nhdr)) {
+      const Elf64_Nhdr* nhdr = reinterpret_cast<const Elf64_Nhdr*>(notes.data());
+      size_t name_len = (nhdr->n_namesz + 3) & ~3u, desc_len = (nhdr->n_descsz + 3) & ~3u;
+      const char* desc = notes.data() + sizeof(Elf64_Nhdr) + name_len;
+
+      // The pc, the base and the semaphore, then provider, name and arguments.
+      const char* provider = desc + 3 * sizeof(uint64_t);
+      const char* name = provider + strlen(provider) + 1;
+      const char* args = name + strlen(name) + 1;
+      if (nhdr->n_type == 3 && string_view{provider} == "dragonfly") {
+        res[name].push_back(args[0] ? vector<string_view>(absl::StrSplit(args, ' ')).size() : 0);
+      }
+      notes.remove_prefix(min(notes.size(), sizeof(Elf64_Nhdr) + name_len + desc_len));
+    }
+  }
+  return res;
+}
+
+// Every probe of tracepoints.h is in the binary with the arguments that the header lists,
+// since the tracing scripts depend on them.
+TEST_F(TracepointsTest, Notes) {
+  const vector<pair<string, unsigned>> kProbes = {
+      {"cmd__start", 1},
+      {"cmd__end", 3},
+      {"tx__schedule", 3},
+      {"tx__execute", 4},
+      {"tx__conclude", 3},
+      {"hop__enqueue", 3},
+      {"hop__dequeue", 3},
+      {"evict__step", 4},
+      {"tiered__read__submit", 2},
+      {"tiered__read__done", 4},
+      {"tiered__write__submit", 2},
+      {"tiered__write__done", 4},
+      {"snapshot__bucket__start", 2},
+      {"snapshot__bucket__done", 3},
+  };
+
+  absl::flat_hash_map<string, vector<unsigned>> probes = ReadProbes();
+  for (const auto& [name, arg_cnt] : kProbes) {
+    auto it = probes.find(name);
+    ASSERT_TRUE(it != probes.end()) << name;
+    EXPECT_THAT(it->second, Each(arg_cnt)) << name;
+  }
+
+  // The sites that run in several places, e.g. the writes of the small and the big values.
+  EXPECT_GE(probes["tiered__write__submit"].size(), 2u);
+  EXPECT_GE(probes["tx__schedule"].size(), 2u);
+}
+
+#endif
+
+}  // namespace dfly
@@ -0,0 +1,184 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/tracking_table.h"
+
+#include <absl/strings/match.h>
+
+#include "base/flags.h"
+#include "base/logging.h"
+#include "facade/dragonfly_connection.h"
+#include "server/conn_context.h"
+#include "server/engine_shard_set.h"
+
+ABSL_FLAG(uint64_t, tracking_table_max_keys, 1000000,
+          "Maximum number of keys tracked for the client side caching across all the shards. "
+          "Above it the keys are invalidated and forgotten. 0 means no limit.");
+
+namespace dfly {
+
+using namespace std;
+using namespace util;
+
+auto TrackingTable::Stats::operator+=(const Stats& o) -> Stats& {
+  clients = std::max(clients, o.clients);
+  keys += o.keys;
+  items += o.items;
+  prefixes += o.prefixes;
+  memory += o.memory;
+  invalidation_msgs += o.invalidation_msgs;
+  evicted_keys += o.evicted_keys;
+
+  return *this;
+}
+
+void TrackingTable::AddClient(uint32_t client_id, ConnectionContext* cntx, uint32_t thread_id,
+                              const fibers_ext::BlockingCounter& borrow_token,
+                              const vector<string>& prefixes) {
+  clients_.emplace(piecewise_construct, forward_as_tuple(client_id),
+                   forward_as_tuple(cntx, borrow_token, thread_id));
+  for (const string& prefix : prefixes) {
+    prefixes_.emplace_back(prefix, client_id);
+  }
+}
+
+void TrackingTable::RemoveClient(uint32_t client_id) {
+  clients_.erase(client_id);
+  prefixes_.erase(remove_if(prefixes_.begin(), prefixes_.end(),
+                            [client_id](const auto& p) { return p.second == client_id; }),
+                  prefixes_.end());
+
+  // Forget the keys of the last client.
+  if (clients_.empty()) {
+    keys_.clear();
+    items_ = key_bytes_ = 0;
+  }
+}
+
+void TrackingTable::Track(uint32_t client_id, ArgSlice keys) {
+  if (!clients_.contains(client_id))
+    return;
+
+  for (string_view key : keys) {
+    auto [it, inserted] = keys_.try_emplace(key);
+    if (inserted)
+      key_bytes_ += key.size();
+
+    auto& ids = it->second;
+    if (find(ids.begin(), ids.end(), client_id) == ids.end()) {
+      ids.push_back(client_id);
+      ++items_;
+    }
+  }
+
+  uint64_t max_keys = absl::GetFlag(FLAGS_tracking_table_max_keys);
+  if (max_keys == 0)
+    return;
+
+  max_keys = std::max<uint64_t>(1, max_keys / shard_set->size());
+  while (keys_.size() > max_keys) {
+    // The clients must not keep caching a key that we do not track anymore.
+    string key = keys_.begin()->first;
+    Invalidate(key);
+    ++evicted_keys_;
+  }
+}
+
+void TrackingTable::Invalidate(string_view key) {
+  if (auto it = keys_.find(key); it != keys_.end()) {
+    for (uint32_t client_id : it->second) {
+      AddPending(client_id, key);
+    }
+    items_ -= it->second.size();
+    key_bytes_ -= it->first.size();
+    keys_.erase(it);
+  }
+
+  for (const auto& [prefix, client_id] : prefixes_) {
+    if (absl::StartsWith(key, prefix))
+      AddPending(client_id, key);
+  }
+}
+
+void TrackingTable::InvalidateAll() {
+  for (auto& [client_id, client] : clients_) {
+    if (!client.flush_all && client.pending.empty())
+      dirty_.push_back(client_id);
+    client.flush_all = true;
+    client.pending.clear();
+  }
+  keys_.clear();
+  items_ = key_bytes_ = 0;
+
+  if (!dirty_.empty() && !flush_scheduled_) {
+    flush_scheduled_ = true;
+    ProactorBase::me()->DispatchBrief([this] { Flush(); });
+  }
+}
+
+auto TrackingTable::GetStats() const -> Stats {
+  Stats res;
+  res.clients = clients_.size();
+  res.keys = keys_.size();
+  res.items = items_;
+  res.prefixes = prefixes_.size();
+  res.memory = keys_.capacity() * (sizeof(decltype(keys_)::value_type) + 1) + key_bytes_ +
+               prefixes_.capacity() * sizeof(decltype(prefixes_)::value_type);
+  res.invalidation_msgs = invalidation_msgs_;
+  res.evicted_keys = evicted_keys_;
+
+  return res;
+}
+
+void TrackingTable::AddPending(uint32_t client_id, string_view key) {
+  auto it = clients_.find(client_id);
+  if (it == clients_.end())  // the connection stopped tracking.
+    return;
+
+  Client& client = it->second;
+  if (client.flush_all)
+    return;
+
+  if (client.pending.empty())
+    dirty_.push_back(client_id);
+  client.pending.emplace_back(key);
+
+  if (!flush_scheduled_) {
+    flush_scheduled_ = true;
+    ProactorBase::me()->DispatchBrief([this] { Flush(); });
+  }
+}
+
+void TrackingTable::Flush() {
+  flush_scheduled_ = false;
+
+  for (uint32_t client_id : dirty_) {
+    auto it = clients_.find(client_id);
+    if (it == clients_.end())
+      continue;
+
+    Client& client = it->second;
+
+    // An empty list of keys means all the keys.
+    auto keys = make_shared<const vector<string>>(std::move(client.pending));
+    client.pending.clear();
+    client.flush_all = false;
+    ++invalidation_msgs_;
+
+    // The token keeps the connection alive until the message is queued.
+    client.borrow_token.Inc();
+    facade::Connection* conn = client.cntx->owner();
+    auto cb = [conn, keys = std::move(keys), token = client.borrow_token]() mutable {
+      facade::Connection::PubMessage msg;
+      msg.invalidated_keys = std::move(keys);
+      conn->SendMsgVecAsync(std::move(msg));
+      token.Dec();
+    };
+    shard_set->pool()->at(client.thread_id)->DispatchBrief(std::move(cb));
+  }
+
+  dirty_.clear();
+}
+
+}  // namespace dfly
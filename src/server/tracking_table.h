@@ -0,0 +1,95 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/inlined_vector.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "server/common.h"
+#include "util/fibers/fibers_ext.h"
+
+namespace dfly {
+
+class ConnectionContext;
+
+// Server-assisted client side caching, see CLIENT TRACKING. Every shard keeps the table next to
+// its DbSlice and every tracking connection is registered in all the shards. In the default mode
+// the table holds the keys the connections read and a key is forgotten once it changes, until
+// it is read again. In the broadcast mode the connections are notified about the changes of
+// all the keys that start with one of their prefixes.
+// The keys invalidated by the shard are batched per connection and sent as a single push message
+// once the shard yields.
+class TrackingTable {
+ public:
+  struct Stats {
+    size_t clients = 0;  // every shard tracks all the clients, hence it is not summed up.
+    size_t keys = 0;
+    size_t items = 0;  // number of (key, client) pairs.
+    size_t prefixes = 0;
+    size_t memory = 0;
+    size_t invalidation_msgs = 0;
+    size_t evicted_keys = 0;  // forgotten because the table exceeded its size limit.
+
+    Stats& operator+=(const Stats& o);
+  };
+
+  // prefixes are used in the broadcast mode, where an empty prefix matches all the keys.
+  // The connection lives until RemoveClient is called and all its borrow tokens are returned.
+  void AddClient(uint32_t client_id, ConnectionContext* cntx, uint32_t thread_id,
+                 const util::fibers_ext::BlockingCounter& borrow_token,
+                 const std::vector<std::string>& prefixes);
+  void RemoveClient(uint32_t client_id);
+
+  // Registers the keys read by the client in the default mode.
+  void Track(uint32_t client_id, ArgSlice keys);
+
+  // Called when the key changes or is deleted.
+  void Invalidate(std::string_view key);
+
+  // Called when the database is flushed. The clients are notified with a null key.
+  void InvalidateAll();
+
+  bool empty() const {
+    return clients_.empty();
+  }
+
+  Stats GetStats() const;
+
+ private:
+  struct Client {
+    ConnectionContext* cntx;
+    util::fibers_ext::BlockingCounter borrow_token;
+    uint32_t thread_id;
+    bool flush_all = false;
+    std::vector<std::string> pending;  // invalidated keys that have not been sent yet.
+
+    Client(ConnectionContext* c, const util::fibers_ext::BlockingCounter& token, uint32_t tid)
+        : cntx(c), borrow_token(token), thread_id(tid) {
+    }
+  };
+
+  void AddPending(uint32_t client_id, std::string_view key);
+
+  // Sends the pending invalidations of every client.
+  void Flush();
+
+  // Clients of removed connections are skipped when the key is invalidated.
+  absl::flat_hash_map<std::string, absl::InlinedVector<uint32_t, 2>> keys_;
+  std::vector<std::pair<std::string, uint32_t>> prefixes_;
+  absl::flat_hash_map<uint32_t, Client> clients_;
+  std::vector<uint32_t> dirty_;  // clients with pending invalidations.
+
+  size_t key_bytes_ = 0;
+  size_t items_ = 0;
+  size_t invalidation_msgs_ = 0;
+  size_t evicted_keys_ = 0;
+  bool flush_scheduled_ = false;
+};
+
+}  // namespace dfly
@@ -6,6 +6,7 @@
 
 #include <absl/strings/match.h>
 
+#include "base/flags.h"
 #include "base/logging.h"
 #include "server/blocking_controller.h"
 #include "server/command_registry.h"
@@ -13,6 +14,19 @@
 #include "server/engine_shard_set.h"
 #include "server/journal/journal.h"
 #include "server/server_state.h"
+#include "server/tracepoints.h"
+
+ABSL_FLAG(bool, batch_hops, true,
+          "If true, transaction hops are dispatched to the shards via lock-free rings that "
+          "the shards drain in batches, otherwise every hop is a message in the shard queue");
+ABSL_FLAG(uint32_t, shard_slice_usec, 0,
+          "If positive, the commands that read whole large values, like HGETALL, LRANGE, "
+          "SMEMBERS or SUNION, run in hops of about this duration with their keys locked, so "
+          "that the other transactions of the shard run between them. 0 runs them in one hop");
+ABSL_FLAG(uint32_t, reply_chunk_kb, 64,
+          "If positive, HGETALL, HKEYS, HVALS, SMEMBERS and LRANGE serialize large replies in "
+          "hops that produce about this much output, and send every part before the next hop "
+          "runs. 0 builds these replies in the hops of --shard_slice_usec");
 
 namespace dfly {
 
@@ -28,8 +42,88 @@ atomic_uint64_t op_seq{1};
 
 [[maybe_unused]] constexpr size_t kTransSize = sizeof(Transaction);
 
+// Maximal number of transactions and buffers of each kind that are kept by TLPool.
+constexpr size_t kMaxPooledTransactions = 64;
+
 }  // namespace
 
+// Multi-key transactions spill shard_data_, args_ and reverse_index_ to the heap, since
+// shard_data_ spans all the shards. The pool keeps only the buffers that were spilled, hence it
+// does not hold inline storage that has nothing to reuse.
+struct Transaction::TLPool {
+  std::vector<void*> blocks;
+  std::vector<decltype(Transaction::shard_data_)> shard_data;
+  std::vector<decltype(Transaction::args_)> args;
+  std::vector<decltype(Transaction::reverse_index_)> reverse_index;
+  std::vector<std::unique_ptr<Multi>> multi;
+
+  ~TLPool() {
+    for (void* ptr : blocks) {
+      ::operator delete(ptr);
+    }
+  }
+
+  // Returns a pooled container or an empty one. The containers are move-constructed since
+  // PerShardData is not assignable.
+  template <typename T> static T Take(std::vector<T>* pool) {
+    if (pool->empty())
+      return T{};
+
+    T res(std::move(pool->back()));
+    pool->pop_back();
+    return res;
+  }
+
+  template <typename T> static void Put(T* src, std::vector<T>* pool) {
+    // An empty container has only its inline capacity.
+    if (src->capacity() > T{}.capacity() && pool->size() < kMaxPooledTransactions) {
+      src->resize(0);  // unlike clear(), keeps the allocated storage.
+      pool->push_back(std::move(*src));
+    }
+  }
+
+  void PutBuffers(Transaction* trans);
+};
+
+thread_local Transaction::TLPool Transaction::tl_pool;
+
+void Transaction::TLPool::PutBuffers(Transaction* trans) {
+  Put(&trans->shard_data_, &shard_data);
+  Put(&trans->args_, &args);
+  Put(&trans->reverse_index_, &reverse_index);
+
+  if (trans->multi_ && multi.size() < kMaxPooledTransactions) {
+    Multi* m = trans->multi_.get();
+    m->locks.clear();
+    m->keys.clear();
+    m->multi_opts = 0;
+    m->is_expanding = true;
+    m->locks_recorded = false;
+    m->lock_ahead = false;
+    multi.push_back(std::move(trans->multi_));
+  }
+}
+
+void* Transaction::operator new(size_t sz) {
+  DCHECK_EQ(sz, sizeof(Transaction));
+  auto& blocks = tl_pool.blocks;
+  if (blocks.empty())
+    return ::operator new(sz);
+
+  void* ptr = blocks.back();
+  blocks.pop_back();
+  return ptr;
+}
+
+void Transaction::operator delete(void* ptr) {
+  auto& blocks = tl_pool.blocks;
+  if (blocks.size() < kMaxPooledTransactions) {
+    blocks.push_back(ptr);
+  } else {
+    ::operator delete(ptr);
+  }
+}
+
 IntentLock::Mode Transaction::Mode() const {
   return (cid_->opt_mask() & CO::READONLY) ? IntentLock::SHARED : IntentLock::EXCLUSIVE;
 }
@@ -41,10 +135,14 @@ IntentLock::Mode Transaction::Mode() const {
  * @param ess
  * @param cs
  */
-Transaction::Transaction(const CommandId* cid) : cid_(cid) {
+Transaction::Transaction(const CommandId* cid)
+    : shard_data_(TLPool::Take(&tl_pool.shard_data)), args_(TLPool::Take(&tl_pool.args)),
+      reverse_index_(TLPool::Take(&tl_pool.reverse_index)), cid_(cid) {
   string_view cmd_name(cid_->name());
   if (cmd_name == "EXEC" || cmd_name == "EVAL" || cmd_name == "EVALSHA") {
-    multi_.reset(new Multi);
+    multi_ = TLPool::Take(&tl_pool.multi);
+    if (!multi_)
+      multi_.reset(new Multi);
     multi_->multi_opts = cid->opt_mask();
 
     if (cmd_name == "EVAL" || cmd_name == "EVALSHA") {
@@ -56,6 +154,7 @@ Transaction::Transaction(const CommandId* cid) : cid_(cid) {
 Transaction::~Transaction() {
   DVLOG(2) << "Transaction " << StrCat(Name(), "@", txid_, "/", unique_shard_cnt_, ")")
            << " destroyed";
+  tl_pool.PutBuffers(this);
 }
 
 /**
@@ -80,6 +179,9 @@ Transaction::~Transaction() {
 
 OpStatus Transaction::InitByArgs(DbIndex index, CmdArgList args) {
   db_index_ = index;
+  full_args_ = args;
+  key_step_ = 1;
+  ++cmd_seq_;
 
   if (IsGlobal()) {
     unique_shard_cnt_ = shard_set->size();
@@ -96,12 +198,41 @@ OpStatus Transaction::InitByArgs(DbIndex index, CmdArgList args) {
     return key_index_res.status();
 
   const auto& key_index = *key_index_res;
+  key_step_ = key_index.step;
 
   if (key_index.start == args.size()) {  // eval with 0 keys.
     CHECK(absl::StartsWith(cid_->name(), "EVAL"));
     return OpStatus::OK;
   }
 
+  return InitByKeys(key_index, args);
+}
+
+OpStatus Transaction::InitLockAhead(DbIndex index, CmdArgList args) {
+  DCHECK(multi_ && multi_->is_expanding);
+  DCHECK_EQ(0u, txid_);
+  CHECK_GT(args.size(), 1U);
+
+  // From now on EXEC behaves like EVAL: it locks all the keys at once and spans only
+  // the shards of its keys.
+  multi_->is_expanding = false;
+  multi_->lock_ahead = true;
+  multi_->multi_opts &= ~CO::GLOBAL_TRANS;
+
+  // EXEC was initialized as a global transaction that spans all the shards.
+  db_index_ = index;
+  unique_shard_cnt_ = 0;
+  args_.clear();
+
+  KeyIndex key_index;
+  key_index.start = 1;
+  key_index.end = args.size();
+  key_index.step = 1;
+
+  return InitByKeys(key_index, args);
+}
+
+OpStatus Transaction::InitByKeys(const KeyIndex& key_index, CmdArgList args) {
   DCHECK_LT(key_index.start, args.size());
   DCHECK_GT(key_index.start, 0u);
 
@@ -290,6 +421,7 @@ void Transaction::SetExecCmd(const CommandId* cid) {
 
   unique_shard_cnt_ = 0;
   args_.clear();
+  full_args_ = {};
   cid_ = cid;
   cb_ = nullptr;
 }
@@ -349,7 +481,20 @@ bool Transaction::RunInShard(EngineShard* shard) {
     OpStatus status = OpStatus::OK;
 
     if (!was_suspended) {
+      shard->IncTxRun();
+      uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
+      if (sd.run_start_ns == 0)
+        sd.run_start_ns = start_ns;
+      KeyspaceNotifier& notifier = shard->db_slice().keyspace_notifier();
+      notifier.SetCommand(cid_->name());
       status = cb_(this, shard);
+      notifier.SetCommand({});
+      sd.run_end_ns = ProactorBase::GetMonotonicTimeNs();
+      sd.exec_ns += sd.run_end_ns - start_ns;
+      shard->RecordSlice(sd.run_end_ns - start_ns);
+      DFLY_TRACE(tx__execute, txid_, shard->shard_id(), start_ns, sd.run_end_ns);
+      TrackKeys(shard);
+      JournalCommand(shard);
     }
 
     if (unique_shard_cnt_ == 1) {
@@ -366,6 +511,7 @@ bool Transaction::RunInShard(EngineShard* shard) {
     // TODO: to log at most once per sec.
     LOG_FIRST_N(ERROR, 16) << " out of memory";
     local_result_ = OpStatus::OUT_OF_MEMORY;
+    shard->db_slice().keyspace_notifier().SetCommand({});
   } catch (std::exception& e) {
     LOG(FATAL) << "Unexpected exception " << e.what();
   }
@@ -427,6 +573,8 @@ void Transaction::ScheduleInternal() {
   DCHECK_EQ(0u, txid_);
   DCHECK_EQ(0, coordinator_state_ & (COORD_SCHED | COORD_OOO));
 
+  schedule_ns_ = ProactorBase::GetMonotonicTimeNs();
+
   bool span_all = IsGlobal();
   bool single_hop = (coordinator_state_ & COORD_EXEC_CONCLUDING);
 
@@ -549,6 +697,7 @@ void Transaction::LockMulti() {
 // BLPOP where a data must be read from multiple shards before performing another hop.
 OpStatus Transaction::ScheduleSingleHop(RunnableType cb) {
   DCHECK(!cb_);
+  uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
 
   cb_ = std::move(cb);
 
@@ -569,6 +718,7 @@ OpStatus Transaction::ScheduleSingleHop(RunnableType cb) {
     // memory_order_release because we do not want it to be reordered with shard_data writes
     // above.
     // IsArmedInShard() first checks run_count_ before accessing shard_data.
+    schedule_ns_ = ProactorBase::GetMonotonicTimeNs();
     run_count_.fetch_add(1, memory_order_release);
     time_now_ms_ = GetCurrentTimeMs();
 
@@ -588,7 +738,32 @@ OpStatus Transaction::ScheduleSingleHop(RunnableType cb) {
       }
     };
 
-    shard_set->Add(unique_shard_id_, std::move(schedule_cb));  // serves as a barrier.
+    // A connection that migrated to the thread of the shard runs it inline without a hop.
+    EngineShard* local_shard = EngineShard::tlocal();
+    if (local_shard && local_shard->shard_id() == unique_shard_id_) {
+      local_shard->IncInlineHop();
+      schedule_cb();
+    } else {
+      shard_set->Add(unique_shard_id_, std::move(schedule_cb));  // serves as a barrier.
+    }
+  } else if (relaxed_read_ && !multi_ && !IsGlobal() && (cid_->opt_mask() & CO::READONLY)) {
+    // A relaxed read is neither scheduled nor ordered with the other transactions of the shards.
+    schedule_ns_ = ProactorBase::GetMonotonicTimeNs();
+    time_now_ms_ = GetCurrentTimeMs();
+    use_count_.fetch_add(unique_shard_cnt_, memory_order_relaxed);
+    run_count_.store(unique_shard_cnt_, memory_order_release);
+
+    EngineShard* local_shard = EngineShard::tlocal();
+    for (ShardId i = 0; i < shard_data_.size(); ++i) {
+      if (shard_data_[i].arg_count == 0)
+        continue;
+      if (local_shard && local_shard->shard_id() == i) {
+        local_shard->IncInlineHop();
+        RunRelaxedHop(local_shard);
+      } else {
+        shard_set->Add(i, [this] { RunRelaxedHop(EngineShard::tlocal()); });
+      }
+    }
   } else {
     // Transaction spans multiple shards or it's global (like flushdb) or multi.
     // Note that the logic here is a bit different from the public Schedule() function.
@@ -605,12 +780,79 @@ OpStatus Transaction::ScheduleSingleHop(RunnableType cb) {
   DVLOG(1) << "ScheduleSingleHop before Wait " << DebugId() << " " << run_count_.load();
   WaitForShardCallbacks();
   DVLOG(1) << "ScheduleSingleHop after Wait " << DebugId();
+  DFLY_TRACE(tx__conclude, txid_, unique_shard_cnt_, schedule_ns_);
+  AwaitJournalSync();
 
   cb_ = nullptr;
+  hop_ns_ += ProactorBase::GetMonotonicTimeNs() - start_ns;
 
   return local_result_;
 }
 
+TimeSlice::TimeSlice(uint64_t budget_ns, size_t budget_bytes)
+    : budget_ns_(budget_ns),
+      start_ns_(budget_ns ? ProactorBase::GetMonotonicTimeNs() : 0),
+      budget_bytes_(budget_bytes) {
+}
+
+bool TimeSlice::CheckClock() {
+  interrupted_ = ProactorBase::GetMonotonicTimeNs() - start_ns_ >= budget_ns_;
+  return interrupted_;
+}
+
+OpStatus Transaction::ScheduleSliced(SlicedRunnableType cb) {
+  uint64_t budget_ns = uint64_t(absl::GetFlag(FLAGS_shard_slice_usec)) * 1000;
+  return RunSliced(cb, budget_ns, 0, nullptr);
+}
+
+OpStatus Transaction::ScheduleStreamed(SlicedRunnableType cb, const std::function<void()>& flush) {
+  uint64_t budget_ns = uint64_t(absl::GetFlag(FLAGS_shard_slice_usec)) * 1000;
+  size_t budget_bytes = size_t(absl::GetFlag(FLAGS_reply_chunk_kb)) * 1024;
+  return RunSliced(cb, budget_ns, budget_bytes, &flush);
+}
+
+OpStatus Transaction::RunSliced(const SlicedRunnableType& cb, uint64_t budget_ns,
+                                size_t budget_bytes, const std::function<void()>* flush) {
+  if ((budget_ns == 0 && budget_bytes == 0) || multi_) {
+    OpStatus status = ScheduleSingleHop([&cb](Transaction* t, EngineShard* shard) {
+      TimeSlice slice{0};
+      return cb(t, shard, &slice);
+    });
+    if (flush)
+      (*flush)();
+    return status;
+  }
+
+  // Indexed by shard id, every shard updates its own entry.
+  vector<uint8_t> pending(shard_set->size(), 0);
+  bool first = true;
+  auto run = [&](Transaction* t, EngineShard* shard) {
+    uint8_t& shard_pending = pending[shard->shard_id()];
+    if (!first && !shard_pending)
+      return OpStatus::OK;
+
+    TimeSlice slice{budget_ns, budget_bytes};
+    OpStatus status = cb(t, shard, &slice);
+    shard_pending = slice.interrupted();
+    if (shard_pending)
+      shard->IncSliceYield();
+    return status;
+  };
+
+  Schedule();
+  do {
+    Execute(run, false);
+    first = false;
+    if (flush)
+      (*flush)();
+  } while (find(pending.begin(), pending.end(), 1) != pending.end());
+
+  OpStatus result = local_result_;
+  Execute([](Transaction* t, EngineShard* shard) { return OpStatus::OK; }, true);
+
+  return result;
+}
+
 // Runs in the coordinator fiber.
 void Transaction::UnlockMulti() {
   VLOG(1) << "UnlockMulti " << DebugId();
@@ -640,16 +882,19 @@ void Transaction::UnlockMulti() {
 }
 
 void Transaction::Schedule() {
+  uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
   if (multi_ && multi_->is_expanding) {
     LockMulti();
   } else {
     ScheduleInternal();
   }
+  hop_ns_ += ProactorBase::GetMonotonicTimeNs() - start_ns;
 }
 
 // Runs in coordinator thread.
 void Transaction::Execute(RunnableType cb, bool conclude) {
   DCHECK(coordinator_state_ & COORD_SCHED);
+  uint64_t start_ns = ProactorBase::GetMonotonicTimeNs();
 
   cb_ = std::move(cb);
   coordinator_state_ |= COORD_EXEC;
@@ -665,8 +910,13 @@ void Transaction::Execute(RunnableType cb, bool conclude) {
   DVLOG(1) << "Wait on Exec " << DebugId();
   WaitForShardCallbacks();
   DVLOG(1) << "Wait on Exec " << DebugId() << " completed";
+  if (conclude) {
+    DFLY_TRACE(tx__conclude, txid_, unique_shard_cnt_, schedule_ns_);
+    AwaitJournalSync();
+  }
 
   cb_ = nullptr;
+  hop_ns_ += ProactorBase::GetMonotonicTimeNs() - start_ns;
 }
 
 // Runs in coordinator thread.
@@ -705,55 +955,208 @@ void Transaction::ExecuteAsync() {
   // IsArmedInShard in other threads.
   run_count_.store(unique_shard_cnt_, memory_order_release);
 
-  // We verify seq lock has the same generation number. See below for more info.
-  auto cb = [seq, this] {
-    EngineShard* shard = EngineShard::tlocal();
-
-    uint16_t local_mask = GetLocalMask(shard->shard_id());
-
-    // we use fetch_add with release trick to make sure that local_mask is loaded before
-    // we load seq_after. We could gain similar result with "atomic_thread_fence(acquire)"
-    uint32_t seq_after = seqlock_.fetch_add(0, memory_order_release);
-    bool should_poll = (seq_after == seq) && (local_mask & ARMED);
-
-    DVLOG(2) << "PollExecCb " << DebugId() << " sid(" << shard->shard_id() << ") "
-             << run_count_.load(memory_order_relaxed) << ", should_poll: " << should_poll;
-
-    // We verify that this callback is still relevant.
-    // If we still have the same sequence number and local_mask is ARMED it means
-    // the coordinator thread has not crossed WaitForShardCallbacks barrier.
-    // Otherwise, this callback is redundant. We may still call PollExecution but
-    // we should not pass this to it since it can be in undefined state for this callback.
-    if (should_poll) {
-      // shard->PollExecution(this) does not necessarily execute this transaction.
-      // Therefore, everything that should be handled during the callback execution
-      // should go into RunInShard.
-      shard->PollExecution("exec_cb", this);
+  // Every hop runs RunHop(seq) in its shard, either through the hop ring of the shard or
+  // through the shard queue. The hops serve as a barrier.
+  bool batch_hops = absl::GetFlag(FLAGS_batch_hops);
+  EngineShard* local_shard = EngineShard::tlocal();
+  auto dispatch = [&](ShardId sid) {
+    // A multi transaction holds the locks of its keys for its whole run, hence its hops into
+    // the shard of the coordinator thread run inline instead of going through the queue.
+    if (multi_ && !is_global && local_shard && local_shard->shard_id() == sid) {
+      local_shard->IncInlineHop();
+      RunHop(seq);
+    } else if (batch_hops || IsPriority()) {
+      shard_set->AddHop(sid, this, seq);
+    } else {
+      shard_set->Add(sid, [this, seq] { RunHop(seq); });
     }
-
-    DVLOG(2) << "ptr_release " << DebugId() << " " << seq;
-    intrusive_ptr_release(this);  // against use_count_.fetch_add above.
   };
 
   // IsArmedInShard is the protector of non-thread safe data.
   if (!is_global && unique_shard_cnt_ == 1) {
-    shard_set->Add(unique_shard_id_, std::move(cb));  // serves as a barrier.
+    dispatch(unique_shard_id_);
   } else {
     for (ShardId i = 0; i < shard_data_.size(); ++i) {
       auto& sd = shard_data_[i];
       if (!is_global && sd.arg_count == 0)
         continue;
-      shard_set->Add(i, cb);  // serves as a barrier.
+      dispatch(i);
     }
   }
 }
 
+// Runs in the shard thread. seq is the generation of seqlock_ when the hop was dispatched.
+void Transaction::RunHop(uint32_t seq) {
+  EngineShard* shard = EngineShard::tlocal();
+
+  uint16_t local_mask = GetLocalMask(shard->shard_id());
+
+  // we use fetch_add with release trick to make sure that local_mask is loaded before
+  // we load seq_after. We could gain similar result with "atomic_thread_fence(acquire)"
+  uint32_t seq_after = seqlock_.fetch_add(0, memory_order_release);
+  bool should_poll = (seq_after == seq) && (local_mask & ARMED);
+
+  DVLOG(2) << "PollExecCb " << DebugId() << " sid(" << shard->shard_id() << ") "
+           << run_count_.load(memory_order_relaxed) << ", should_poll: " << should_poll;
+
+  // We verify that this callback is still relevant.
+  // If we still have the same sequence number and local_mask is ARMED it means
+  // the coordinator thread has not crossed WaitForShardCallbacks barrier.
+  // Otherwise, this callback is redundant. We may still call PollExecution but
+  // we should not pass this to it since it can be in undefined state for this callback.
+  if (should_poll) {
+    // shard->PollExecution(this) does not necessarily execute this transaction.
+    // Therefore, everything that should be handled during the callback execution
+    // should go into RunInShard.
+    shard->PollExecution("exec_cb", this);
+  }
+
+  DVLOG(2) << "ptr_release " << DebugId() << " " << seq;
+  intrusive_ptr_release(this);  // against use_count_.fetch_add in ExecuteAsync.
+}
+
+void Transaction::TrackKeys(EngineShard* shard) {
+  if (tracking_client_ == 0 || multi_ || (cid_->opt_mask() & CO::READONLY) == 0)
+    return;
+
+  shard->db_slice().tracking_table().Track(tracking_client_, ShardArgsInShard(shard->shard_id()));
+}
+
+void Transaction::RecordJournal(EngineShard* shard, ArgSlice cmd) {
+  journal::Journal* journal = shard->journal();
+  if (!journal)
+    return;
+
+  ShardId sid = shard->shard_id();
+  shard_data_[SidToId(sid)].local_mask |= JOURNALED;
+  if (!cmd.empty())
+    RecordEntry(shard, journal::Entry::Command(db_index_, txid_, ShardKeys(sid), key_step_, cmd));
+}
+
+void Transaction::JournalCommand(EngineShard* shard) {
+  ShardId sid = shard->shard_id();
+  auto& sd = shard_data_[SidToId(sid)];
+  bool journaled = sd.local_mask & JOURNALED;
+  sd.local_mask &= ~JOURNALED;
+
+  journal::Journal* journal = shard->journal();
+  if (journaled || !journal || full_args_.empty() || (cid_->opt_mask() & CO::WRITE) == 0 ||
+      (coordinator_state_ & COORD_EXEC_CONCLUDING) == 0)
+    return;
+
+  // The journal callbacks may preempt, so the arguments can not use the thread local space.
+  ArgSlice keys = ShardKeys(sid);
+  absl::InlinedVector<string_view, 8> cmd;
+  bool whole = true, split = false;
+
+  if (unique_shard_cnt_ > 1) {
+    // Commands that act on each key separately are split by shards, the rest are journaled
+    // whole by their first shard.
+    string_view name = cid_->name();
+    if (!IsGlobal() && (name == "DEL" || name == "UNLINK" || name == "MSET")) {
+      cmd.push_back(ArgS(full_args_, 0));
+      cmd.insert(cmd.end(), keys.begin(), keys.end());
+      whole = false;
+      split = true;
+    } else {
+      ShardId first = 0;
+      while (!IsGlobal() && !IsActive(first))
+        ++first;
+      whole = first == sid;
+    }
+  }
+
+  if (whole) {
+    for (MutableSlice arg : full_args_) {
+      cmd.emplace_back(arg.data(), arg.size());
+    }
+  }
+
+  auto entry = journal::Entry::Command(db_index_, txid_, keys, key_step_, cmd);
+
+  // The replica applies the whole multi-shard commands at barriers of its flows. The commands
+  // that ran out of order are not ordered with the earlier ones in the shard queues, so their
+  // barriers could wait for each other in a cycle. They keep the order of their own flow.
+  if (unique_shard_cnt_ > 1 && !split && !IsOOO())
+    entry.barrier = {cmd_seq_, unique_shard_cnt_};
+
+  RecordEntry(shard, std::move(entry));
+}
+
+void Transaction::RecordEntry(EngineShard* shard, journal::Entry entry) {
+  // All the shards of the transaction record the same time.
+  entry.time_ms = time_now_ms_;
+  journal::Journal* journal = shard->journal();
+  journal->RecordEntry(entry);
+
+  // The replicas skip the records that carry neither a command nor a barrier, they learn their
+  // LSNs with the next record only.
+  if (write_lsns_ && (!entry.cmd.empty() || entry.barrier.shard_cnt > 1))
+    write_lsns_[shard->shard_id()] = journal->GetLsn();
+}
+
+void Transaction::AwaitJournalSync() {
+  if (!write_lsns_ || (cid_->opt_mask() & CO::READONLY))
+    return;
+  journal::Journal* journal = ServerState::tlocal()->journal();
+  if (!journal)
+    return;
+
+  // The shards flush and sync the records of the transactions that concluded meanwhile in
+  // groups, which the coordinators wait for instead of the shard callbacks. The earlier writes
+  // of the connection are on the disk already.
+  for (ShardId sid = 0; sid < shard_set->size(); ++sid) {
+    if (write_lsns_[sid] > 0 && (unique_shard_cnt_ != 1 || sid == unique_shard_id_))
+      journal->AwaitSynced(sid, write_lsns_[sid]);
+  }
+}
+
+void Transaction::RunRelaxedHop(EngineShard* shard) {
+  unsigned idx = SidToId(shard->shard_id());
+  auto& sd = shard_data_[idx];
+  KeyLockArgs largs = GetLockArgs(idx);
+
+  DVLOG(2) << "RunRelaxedHop " << DebugId() << " sid:" << shard->shard_id();
+
+  // The callback does not preempt, hence the lock only announces the read to the transactions
+  // of the shard that check the locks of their keys meanwhile, e.g. to run out of order.
+  shard->db_slice().Acquire(IntentLock::SHARED, largs);
+  shard->IncTxRun();
+  shard->IncRelaxedRun();
+
+  try {
+    sd.run_start_ns = ProactorBase::GetMonotonicTimeNs();
+    OpStatus status = cb_(this, shard);
+    sd.run_end_ns = ProactorBase::GetMonotonicTimeNs();
+    sd.exec_ns += sd.run_end_ns - sd.run_start_ns;
+    shard->RecordSlice(sd.run_end_ns - sd.run_start_ns);
+    TrackKeys(shard);
+
+    if (status == OpStatus::OUT_OF_MEMORY) {
+      local_result_ = status;
+    } else {
+      CHECK_EQ(OpStatus::OK, status);
+    }
+  } catch (std::bad_alloc&) {
+    LOG_FIRST_N(ERROR, 16) << " out of memory";
+    local_result_ = OpStatus::OUT_OF_MEMORY;
+  } catch (std::exception& e) {
+    LOG(FATAL) << "Unexpected exception " << e.what();
+  }
+
+  shard->db_slice().Release(IntentLock::SHARED, largs);
+
+  CHECK_GE(DecreaseRunCnt(), 1u);
+  intrusive_ptr_release(this);  // against use_count_.fetch_add in ScheduleSingleHop.
+}
+
 void Transaction::RunQuickie(EngineShard* shard) {
   DCHECK(!multi_);
   DCHECK_EQ(1u, shard_data_.size());
   DCHECK_EQ(0u, txid_);
 
   shard->IncQuickRun();
+  shard->IncTxRun();
 
   auto& sd = shard_data_[0];
   DCHECK_EQ(0, sd.local_mask & (KEYLOCK_ACQUIRED | OUT_OF_ORDER));
@@ -762,15 +1165,26 @@ void Transaction::RunQuickie(EngineShard* shard) {
   CHECK(cb_) << DebugId() << " " << shard->shard_id() << " " << args_[0];
 
   // Calling the callback in somewhat safe way
+  sd.run_start_ns = ProactorBase::GetMonotonicTimeNs();
   try {
+    KeyspaceNotifier& notifier = shard->db_slice().keyspace_notifier();
+    notifier.SetCommand(cid_->name());
     local_result_ = cb_(this, shard);
+    notifier.SetCommand({});
+    TrackKeys(shard);
+    JournalCommand(shard);
   } catch (std::bad_alloc&) {
     LOG_FIRST_N(ERROR, 16) << " out of memory";
     local_result_ = OpStatus::OUT_OF_MEMORY;
+    shard->db_slice().keyspace_notifier().SetCommand({});
   } catch (std::exception& e) {
     LOG(FATAL) << "Unexpected exception " << e.what();
   }
 
+  sd.run_end_ns = ProactorBase::GetMonotonicTimeNs();
+  sd.exec_ns += sd.run_end_ns - sd.run_start_ns;
+  shard->RecordSlice(sd.run_end_ns - sd.run_start_ns);
+  DFLY_TRACE(tx__execute, txid_, shard->shard_id(), sd.run_start_ns, sd.run_end_ns);
   sd.local_mask &= ~ARMED;
   cb_ = nullptr;  // We can do it because only a single shard runs the callback.
 }
@@ -804,6 +1218,39 @@ void Transaction::ExpireBlocking() {
   DVLOG(1) << "ExpireBlocking finished " << DebugId();
 }
 
+Transaction::Timing Transaction::GetTiming() const {
+  Timing res;
+  if (schedule_ns_ == 0)
+    return res;
+
+  res.schedule_ns = schedule_ns_;
+  for (const auto& sd : shard_data_) {
+    if (sd.enqueue_ns == 0)
+      continue;
+
+    res.enqueue_ns = std::max(res.enqueue_ns, sd.enqueue_ns);
+    if (sd.run_start_ns && (res.run_start_ns == 0 || sd.run_start_ns < res.run_start_ns))
+      res.run_start_ns = sd.run_start_ns;
+    res.run_end_ns = std::max(res.run_end_ns, sd.run_end_ns);
+  }
+
+  if (res.enqueue_ns == 0)
+    res.enqueue_ns = res.schedule_ns;
+
+  // Suspended transactions may never run a callback.
+  if (res.run_start_ns == 0)
+    res.run_start_ns = res.run_end_ns = res.enqueue_ns;
+
+  return res;
+}
+
+uint64_t Transaction::GetExecNs() const {
+  uint64_t res = 0;
+  for (const auto& sd : shard_data_)
+    res += sd.exec_ns;
+  return res;
+}
+
 const char* Transaction::Name() const {
   return cid_->name();
 }
@@ -811,7 +1258,8 @@ const char* Transaction::Name() const {
 KeyLockArgs Transaction::GetLockArgs(ShardId sid) const {
   KeyLockArgs res;
   res.db_index = db_index_;
-  res.key_step = cid_->key_arg_step();
+  // Lock-ahead EXEC is scheduled with the list of keys of its commands.
+  res.key_step = (multi_ && multi_->lock_ahead) ? 1 : cid_->key_arg_step();
   res.args = ShardArgsInShard(sid);
 
   return res;
@@ -830,6 +1278,8 @@ bool Transaction::ScheduleUniqueShard(EngineShard* shard) {
 
   auto& sd = shard_data_.front();
   DCHECK_EQ(TxQueue::kEnd, sd.pq_pos);
+  sd.enqueue_ns = ProactorBase::GetMonotonicTimeNs();
+  DFLY_TRACE(tx__schedule, txid_, shard->shard_id(), sd.enqueue_ns);
 
   // Fast path - for uncontended keys, just run the callback.
   // That applies for single key operations like set, get, lpush etc.
@@ -912,6 +1362,8 @@ pair<bool, bool> Transaction::ScheduleInShard(EngineShard* shard) {
   TxQueue::Iterator it = txq->Insert(this);
   DCHECK_EQ(TxQueue::kEnd, sd.pq_pos);
   sd.pq_pos = it;
+  sd.enqueue_ns = ProactorBase::GetMonotonicTimeNs();
+  DFLY_TRACE(tx__schedule, txid_, sid, sd.enqueue_ns);
 
   DVLOG(1) << "Insert into tx-queue, sid(" << sid << ") " << DebugId() << ", qlen " << txq->size();
 
@@ -973,11 +1425,14 @@ size_t Transaction::ReverseArgIndex(ShardId shard_id, size_t arg_index) const {
   return reverse_index_[sd.arg_start + arg_index];
 }
 
-bool Transaction::WaitOnWatch(const time_point& tp) {
+bool Transaction::WaitOnWatch(const time_point& tp, KeyReadyChecker krc) {
   // Assumes that transaction is pending and scheduled. TODO: To verify it with state machine.
   VLOG(2) << "WaitOnWatch Start use_count(" << use_count() << ")";
   using namespace chrono;
 
+  // Always reassigned, since the pooled transactions keep the checkers of their former commands.
+  key_ready_checker_ = move(krc);
+
   Execute([](Transaction* t, EngineShard* shard) { return t->AddToWatchedShardCb(shard); }, true);
 
   coordinator_state_ |= COORD_BLOCKED;
@@ -987,6 +1442,8 @@ bool Transaction::WaitOnWatch(const time_point& tp) {
            notify_txid_.load(memory_order_relaxed) != kuint64max;
   };
 
+  // Execute above accounted its hop.
+  uint64_t wait_start_ns = ProactorBase::GetMonotonicTimeNs();
   cv_status status = cv_status::no_timeout;
   if (tp == time_point::max()) {
     DVLOG(1) << "WaitOnWatch foreva " << DebugId();
@@ -1005,6 +1462,7 @@ bool Transaction::WaitOnWatch(const time_point& tp) {
   if ((coordinator_state_ & COORD_CANCELLED) || status == cv_status::timeout) {
     ExpireBlocking();
     coordinator_state_ &= ~COORD_BLOCKED;
+    hop_ns_ += ProactorBase::GetMonotonicTimeNs() - wait_start_ns;
     return false;
   }
 
@@ -1034,6 +1492,7 @@ bool Transaction::WaitOnWatch(const time_point& tp) {
 
   // Lift blocking mask.
   coordinator_state_ &= ~COORD_BLOCKED;
+  hop_ns_ += ProactorBase::GetMonotonicTimeNs() - wait_start_ns;
 
   return true;
 }
@@ -1151,7 +1610,14 @@ inline uint32_t Transaction::DecreaseRunCnt() {
   return res;
 }
 
+bool Transaction::IsPriority() const {
+  return (cid_->opt_mask() & CO::PRIORITY) != 0;
+}
+
 bool Transaction::IsGlobal() const {
+  if (multi_ && multi_->lock_ahead)
+    return false;
+
   return (cid_->opt_mask() & CO::GLOBAL_TRANS) != 0;
 }
 
@@ -1215,14 +1681,63 @@ OpResult<KeyIndex> DetermineKeys(const CommandId* cid, CmdArgList args) {
 
     string_view name{cid->name()};
 
-    if (!absl::StartsWith(name, "EVAL")) {
+    // XREAD [...] STREAMS key [key ...] id [id ...], the group and the consumer of XREADGROUP
+    // precede the options.
+    if (name == "XREAD" || name == "XREADGROUP") {
+      for (size_t i = name == "XREAD" ? 1 : 4; i < args.size(); ++i) {
+        if (!absl::EqualsIgnoreCase(ArgS(args, i), "STREAMS"))
+          continue;
+
+        size_t left = args.size() - i - 1;
+        if (left == 0 || left % 2 != 0)
+          return OpStatus::SYNTAX_ERR;
+
+        key_index.start = i + 1;
+        key_index.end = key_index.start + left / 2;
+        key_index.step = 1;
+        return key_index;
+      }
+      return OpStatus::SYNTAX_ERR;
+    }
+
+    // MIGRATE host port key|"" db timeout [COPY] [REPLACE] [AUTH password]
+    // [AUTH2 username password] [KEYS key [key ...]] has a single key or the keys that follow
+    // KEYS, if the key is empty.
+    if (name == "MIGRATE") {
+      key_index.step = 1;
+      if (!ArgS(args, 3).empty()) {
+        key_index.start = 3;
+        key_index.end = 4;
+        return key_index;
+      }
+
+      for (size_t i = 6; i < args.size(); ++i) {
+        string_view opt = ArgS(args, i);
+        if (absl::EqualsIgnoreCase(opt, "AUTH")) {
+          i += 1;
+        } else if (absl::EqualsIgnoreCase(opt, "AUTH2")) {
+          i += 2;
+        } else if (absl::EqualsIgnoreCase(opt, "KEYS") && i + 1 < args.size()) {
+          key_index.start = i + 1;
+          key_index.end = args.size();
+          return key_index;
+        }
+      }
+      return OpStatus::SYNTAX_ERR;
+    }
+
+    if (absl::EndsWith(name, "STORE")) {
       key_index.bonus = 1;  // Z<xxx>STORE commands
     }
-    string_view num(ArgS(args, 2));
+
+    // The number of keys precedes the first key: ZUNION numkeys key [key ...] but
+    // ZUNIONSTORE dest numkeys key [key ...] and EVAL script numkeys key [key ...].
+    unsigned num_pos = cid->first_key_pos() - 1;
+    string_view num(ArgS(args, num_pos));
     if (!absl::SimpleAtoi(num, &num_custom_keys) || num_custom_keys < 0)
       return OpStatus::INVALID_INT;
 
-    if (size_t(num_custom_keys) + 3 > args.size())
+    if (size_t(num_custom_keys) + num_pos + 1 > args.size())
       return OpStatus::SYNTAX_ERR;
   }
 
@@ -24,9 +24,51 @@ namespace dfly {
 class EngineShard;
 class BlockingController;
 
+namespace journal {
+struct Entry;
+}  // namespace journal
+
 using facade::OpResult;
 using facade::OpStatus;
 
+// The time budget of a hop of Transaction::ScheduleSliced. The callback checks Exhausted() for
+// every element it processes and returns once it is true, keeping its progress for the next hop.
+// The hops of Transaction::ScheduleStreamed are bounded by the output they produce as well.
+class TimeSlice {
+ public:
+  // A zero budget is unlimited.
+  explicit TimeSlice(uint64_t budget_ns, size_t budget_bytes = 0);
+
+  // Reads the clock once every kCheckInterval calls.
+  bool Exhausted() {
+    if (budget_bytes_ && output_bytes_ >= budget_bytes_)
+      interrupted_ = true;
+    return interrupted_ || (budget_ns_ && (++calls_ % kCheckInterval) == 0 && CheckClock());
+  }
+
+  // Accounts for the output that the callback produced.
+  void AddOutput(size_t bytes) {
+    output_bytes_ += bytes;
+  }
+
+  // Whether the callback stopped before completing its operation.
+  bool interrupted() const {
+    return interrupted_;
+  }
+
+ private:
+  static constexpr unsigned kCheckInterval = 64;
+
+  bool CheckClock();
+
+  uint64_t budget_ns_;
+  uint64_t start_ns_;
+  size_t budget_bytes_;
+  size_t output_bytes_ = 0;
+  unsigned calls_ = 0;
+  bool interrupted_ = false;
+};
+
 class Transaction {
   friend class BlockingController;
 
@@ -48,9 +90,20 @@ class Transaction {
   }
 
  public:
+  // Transactions are allocated from a thread-local pool of released transactions, see TLPool.
+  static void* operator new(size_t sz);
+  static void operator delete(void* ptr);
+
   using RunnableType = std::function<OpStatus(Transaction* t, EngineShard*)>;
+  using SlicedRunnableType = std::function<OpStatus(Transaction* t, EngineShard*, TimeSlice*)>;
   using time_point = ::std::chrono::steady_clock::time_point;
 
+  // Decides whether a transaction that waits for the key can make progress with its value,
+  // besides the `awakened` transactions that the key woke before and that did not run yet.
+  // Runs in the shard thread of the key.
+  using KeyReadyChecker =
+      std::function<bool(const PrimeValue& pv, std::string_view key, size_t awakened)>;
+
   enum LocalMask : uint16_t {
     ARMED = 1,  // Transaction was armed with the callback
     OUT_OF_ORDER = 2,
@@ -58,14 +111,38 @@ class Transaction {
     SUSPENDED_Q = 0x10,  // added by the coordination flow (via WaitBlocked()).
     AWAKED_Q = 0x20,     // awaked by condition (lpush etc)
     EXPIRED_Q = 0x40,    // timed-out and should be garbage collected from the blocking queue.
+    JOURNALED = 0x80,    // the callback journaled the effect of the command, see RecordJournal.
   };
 
   explicit Transaction(const CommandId* cid);
 
   OpStatus InitByArgs(DbIndex index, CmdArgList args);
 
+  // Called by EXEC before running its commands. args holds the command name followed by
+  // the keys of all the commands. The keys are locked at once when the transaction is scheduled
+  // and EXEC spans only the shards of these keys instead of all the shards.
+  OpStatus InitLockAhead(DbIndex index, CmdArgList args);
+
   void SetExecCmd(const CommandId* cid);
 
+  // The keys read by the transaction are tracked for the client, see CLIENT TRACKING.
+  void SetTrackingClient(uint32_t client_id) {
+    tracking_client_ = client_id;
+  }
+
+  // The shards store the LSN that follows the journal records of the transaction in
+  // write_lsns[shard id], see ConnectionState::write_lsns.
+  void SetWriteLsns(LSN* write_lsns) {
+    write_lsns_ = write_lsns;
+  }
+
+  // A single hop of a read-only command over multiple shards runs at once in every shard,
+  // without a txid and without going through the TxQueue. The shards may observe a
+  // multi-shard write at different points, i.e. the reply is not a consistent snapshot.
+  void SetRelaxedRead(bool relaxed) {
+    relaxed_read_ = relaxed;
+  }
+
   std::string DebugId() const;
 
   // Runs in engine thread
@@ -99,6 +176,10 @@ class Transaction {
     return shard_data_[SidToId(sid)].local_mask;
   }
 
+  // Runs in the shard thread. Polls the execution of the hop that ExecuteAsync dispatched with
+  // the seqlock generation seq and releases the reference that ExecuteAsync took for it.
+  void RunHop(uint32_t seq);
+
   // Schedules a transaction. Usually used for multi-hop transactions like Rename or BLPOP.
   // For single hop, use ScheduleSingleHop instead.
   void Schedule();
@@ -110,6 +191,19 @@ class Transaction {
   // will be ill-defined.
   OpStatus ScheduleSingleHop(RunnableType cb);
 
+  // Runs a long read operation in hops that are bounded by --shard_slice_usec, with the keys
+  // locked until the last one. The other transactions of the shards that do not conflict with
+  // it run between the hops. The callback runs again in the shards where its slice was
+  // interrupted, and should return the status of the whole operation from its last slice.
+  // Runs as a single hop when slicing is disabled or under multi.
+  OpStatus ScheduleSliced(SlicedRunnableType cb);
+
+  // Same as ScheduleSliced, but every hop is also bounded by --reply_chunk_kb of output, and
+  // flush runs in the coordinator fiber after every hop, with the keys still locked. A large
+  // reply is so serialized in the shard and sent in chunks, each before the next one is built,
+  // and a client that reads slowly holds the next hop back.
+  OpStatus ScheduleStreamed(SlicedRunnableType cb, const std::function<void()>& flush);
+
   // Fits only for single key scenarios because it writes into shared variable res from
   // potentially multiple threads.
   template <typename F> auto ScheduleSingleHopT(F&& f) -> decltype(f(this, nullptr)) {
@@ -137,6 +231,11 @@ class Transaction {
     return unique_shard_cnt_;
   }
 
+  // Valid only if unique_shard_cnt() is 1.
+  ShardId GetUniqueShard() const {
+    return unique_shard_id_;
+  }
+
   TxId notify_txid() const {
     return notify_txid_.load(std::memory_order_relaxed);
   }
@@ -147,6 +246,9 @@ class Transaction {
 
   bool IsGlobal() const;
 
+  // The transaction of a CO::PRIORITY command.
+  bool IsPriority() const;
+
   bool IsOOO() const {
     return coordinator_state_ & COORD_OOO;
   }
@@ -155,7 +257,14 @@ class Transaction {
   // or b) tp is reached. If tp is time_point::max() then waits indefinitely.
   // Expects that the transaction had been scheduled before, and uses Execute(.., true) to register.
   // Returns false if timeout occurred, true if was notified by one of the keys.
-  bool WaitOnWatch(const time_point& tp);
+  // Without a checker the transaction waits for a list and is woken in FIFO order, one per
+  // item of the list. With a checker it is woken only when the checker accepts the key.
+  bool WaitOnWatch(const time_point& tp, KeyReadyChecker krc = nullptr);
+
+  // Valid while the transaction is watched, see WaitOnWatch().
+  const KeyReadyChecker& key_ready_checker() const {
+    return key_ready_checker_;
+  }
 
   // Returns true if transaction is awaked, false if it's timed-out and can be removed from the
   // blocking queue. NotifySuspended may be called from (multiple) shard threads and
@@ -185,6 +294,34 @@ class Transaction {
     return db_index_;
   }
 
+  // Write commands are journaled with their arguments once their last hop runs in the shard.
+  // Commands that are not deterministic, like SPOP, call this from the callback of their last hop
+  // to journal a command with the same effect instead, possibly several times. An empty cmd
+  // journals nothing, for a command that had no effect in the shard. Runs in the shard thread.
+  void RecordJournal(EngineShard* shard, ArgSlice cmd);
+
+  // Monotonic timestamps in nanoseconds of the phases of a transaction.
+  struct Timing {
+    uint64_t schedule_ns = 0;   // the coordinator started to schedule the transaction.
+    uint64_t enqueue_ns = 0;    // the last shard registered the transaction.
+    uint64_t run_start_ns = 0;  // the first shard started to run a callback.
+    uint64_t run_end_ns = 0;    // the last shard finished its last callback.
+  };
+
+  // Runs in the coordinator thread after the transaction concluded. All the timestamps are 0
+  // if the transaction was not scheduled.
+  Timing GetTiming() const;
+
+  // The time the callbacks of the transaction ran in the shards, summed over the shards. Runs in
+  // the coordinator thread after the transaction concluded.
+  uint64_t GetExecNs() const;
+
+  // The time the coordinator spent scheduling the transaction, running its hops and waiting for
+  // them, summed over its hops.
+  uint64_t hop_ns() const {
+    return hop_ns_;
+  }
+
  private:
   struct LockCnt {
     unsigned cnt[2] = {0, 0};
@@ -196,15 +333,44 @@ class Transaction {
     return sid < shard_data_.size() ? sid : 0;
   }
 
+  // Distributes the keys of args described by key_index among the shards.
+  OpStatus InitByKeys(const KeyIndex& key_index, CmdArgList args);
+
   void ScheduleInternal();
   void LockMulti();
 
+  // Implements ScheduleSliced and ScheduleStreamed. flush may be null.
+  OpStatus RunSliced(const SlicedRunnableType& cb, uint64_t budget_ns, size_t budget_bytes,
+                     const std::function<void()>* flush);
+
   void ExpireBlocking();
   void ExecuteAsync();
 
   // Optimized version of RunInShard for single shard uncontended cases.
   void RunQuickie(EngineShard* shard);
 
+  // Runs the callback of a relaxed read in the shard under a shared intent lock of its keys and
+  // releases the reference that ScheduleSingleHop took for it, see SetRelaxedRead.
+  void RunRelaxedHop(EngineShard* shard);
+
+  // Registers the keys of the shard with the tracking client after a read-only command ran.
+  void TrackKeys(EngineShard* shard);
+
+  // Journals the write command after its last hop ran in the shard, see RecordJournal.
+  void JournalCommand(EngineShard* shard);
+
+  // Records the entry in the journal of the shard and updates write_lsns_.
+  void RecordEntry(EngineShard* shard, journal::Entry entry);
+
+  // Waits in the coordinator until the journal records of write_lsns_ reach the disk, see
+  // --journal_fsync=always.
+  void AwaitJournalSync();
+
+  // The arguments of the transaction in the shard, or empty if it has none.
+  ArgSlice ShardKeys(ShardId sid) const {
+    return args_.empty() ? ArgSlice{} : ShardArgsInShard(sid);
+  }
+
   //! Returns true if transaction run out-of-order during the scheduling phase.
   bool ScheduleUniqueShard(EngineShard* shard);
 
@@ -250,6 +416,12 @@ class Transaction {
     // tx queue.
     uint32_t pq_pos = TxQueue::kEnd;
 
+    // Monotonic timestamps in nanoseconds, see GetTiming.
+    uint64_t enqueue_ns = 0;
+    uint64_t run_start_ns = 0;
+    uint64_t run_end_ns = 0;
+    uint64_t exec_ns = 0;  // the callbacks ran in the shard, see GetExecNs.
+
     PerShardData(PerShardData&&) noexcept {
     }
 
@@ -266,6 +438,9 @@ class Transaction {
     // Whether this transaction can lock more keys during its progress.
     bool is_expanding = true;
     bool locks_recorded = false;
+
+    // EXEC that locked the keys of its commands ahead via InitLockAhead.
+    bool lock_ahead = false;
   };
 
   util::fibers_ext::EventCount blocking_ec_;  // used to wake blocking transactions.
@@ -286,12 +461,20 @@ class Transaction {
   std::vector<uint32_t> reverse_index_;
 
   RunnableType cb_;
+  KeyReadyChecker key_ready_checker_;
   std::unique_ptr<Multi> multi_;  // Initialized when the transaction is multi/exec.
 
   const CommandId* cid_;
 
+  // The command with its arguments passed to InitByArgs, used for journaling.
+  CmdArgList full_args_;
+  uint8_t key_step_ = 1;
+  uint32_t cmd_seq_ = 0;  // the number of the commands initialized by InitByArgs.
+
   TxId txid_{0};
   uint64_t time_now_ms_{0};
+  uint64_t schedule_ns_{0};
+  uint64_t hop_ns_{0};
   std::atomic<TxId> notify_txid_{kuint64max};
   std::atomic_uint32_t use_count_{0}, run_count_{0}, seqlock_{0};
 
@@ -304,6 +487,10 @@ class Transaction {
   // Used for single-hop transactions with unique_shards_ == 1, hence no data-race.
   OpStatus local_result_ = OpStatus::OK;
 
+  uint32_t tracking_client_ = 0;
+  LSN* write_lsns_ = nullptr;
+  bool relaxed_read_ = false;
+
   enum CoordinatorState : uint8_t {
     COORD_SCHED = 1,
     COORD_EXEC = 2,
@@ -337,6 +524,11 @@ class Transaction {
   };
 
   static thread_local TLTmpSpace tmp_space;
+
+  // Memory blocks and heap buffers of released transactions that are reused by the next
+  // transactions of the releasing thread.
+  struct TLPool;
+  static thread_local TLPool tl_pool;
 };
 
 inline uint16_t trans_id(const Transaction* ptr) {
@@ -0,0 +1,472 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/ts_family.h"
+
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+
+#include <cmath>
+
+#include "base/logging.h"
+#include "core/time_series.h"
+#include "server/command_registry.h"
+#include "server/conn_context.h"
+#include "server/engine_shard_set.h"
+#include "server/error.h"
+#include "server/transaction.h"
+
+namespace dfly {
+
+using namespace std;
+using namespace facade;
+
+namespace {
+
+using Sample = TimeSeries::Sample;
+
+constexpr char kKeyExists[] = "TSDB: key already exists";
+constexpr char kNoKey[] = "TSDB: the key does not exist";
+constexpr char kInvalidTs[] = "TSDB: invalid timestamp";
+constexpr char kInvalidValue[] = "TSDB: invalid value";
+constexpr char kOldTs[] = "TSDB: timestamp must be larger than the one of the last sample";
+
+struct CreateParams {
+  uint64_t retention_ms = 0;
+  vector<pair<string_view, string_view>> labels;
+};
+
+struct RangeParams {
+  uint64_t from = 0;
+  uint64_t to = UINT64_MAX;
+  size_t count = SIZE_MAX;
+  optional<TimeSeries::Aggregation> agg;
+  uint64_t bucket_ms = 0;
+};
+
+// A label filter of TS.MRANGE, "name=value" or "name!=value". An empty value matches the
+// series without the label.
+struct LabelFilter {
+  string_view name;
+  string_view value;
+  bool equal;
+
+  bool Matches(const TimeSeries& series) const {
+    optional<string_view> label = series.GetLabel(name);
+    return (label.value_or("") == value) == equal;
+  }
+};
+
+// A series matched by TS.MRANGE.
+struct SeriesResult {
+  string key;
+  vector<pair<string, string>> labels;
+  vector<Sample> samples;
+};
+
+// Parses the RETENTION and LABELS options starting at args[i].
+optional<string> ParseCreateParams(CmdArgList args, size_t i, CreateParams* params) {
+  for (; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view arg = ArgS(args, i);
+    if (arg == "RETENTION" && i + 1 < args.size()) {
+      if (!absl::SimpleAtoi(ArgS(args, ++i), &params->retention_ms))
+        return string{"TSDB: invalid retention"};
+    } else if (arg == "LABELS" && (args.size() - i) % 2 == 1) {
+      for (++i; i < args.size(); i += 2)
+        params->labels.emplace_back(ArgS(args, i), ArgS(args, i + 1));
+    } else {
+      return string{kSyntaxErr};
+    }
+  }
+  return nullopt;
+}
+
+bool ParseTimestamp(string_view arg, uint64_t* ts) {
+  if (arg == "-") {
+    *ts = 0;
+  } else if (arg == "+") {
+    *ts = UINT64_MAX;
+  } else {
+    return absl::SimpleAtoi(arg, ts);
+  }
+  return true;
+}
+
+// Parses the COUNT or AGGREGATION option at args[*i], advancing i past it. Returns false if
+// args[*i] is not an option of the range, or sets error if the option is invalid.
+bool ParseRangeOption(CmdArgList args, size_t* i, RangeParams* params, optional<string>* error) {
+  ToUpper(&args[*i]);
+  string_view arg = ArgS(args, *i);
+  if (arg == "COUNT" && *i + 1 < args.size()) {
+    if (!absl::SimpleAtoi(ArgS(args, ++*i), &params->count))
+      *error = "TSDB: invalid COUNT";
+  } else if (arg == "AGGREGATION" && *i + 2 < args.size()) {
+    params->agg = TimeSeries::ParseAggregation(ArgS(args, *i + 1));
+    if (!params->agg)
+      *error = "TSDB: Unknown aggregation type";
+    else if (!absl::SimpleAtoi(ArgS(args, *i + 2), &params->bucket_ms) || params->bucket_ms == 0)
+      *error = "TSDB: bucketDuration must be greater than zero";
+    *i += 2;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void Query(const TimeSeries& series, const RangeParams& params, vector<Sample>* dest) {
+  if (params.agg) {
+    series.Aggregate(params.from, params.to, *params.agg, params.bucket_ms, params.count, dest);
+  } else {
+    series.Range(params.from, params.to, params.count, dest);
+  }
+}
+
+void InitSeries(const CreateParams& params, PrimeValue* pv) {
+  pv->SetTimeSeries(TimeSeries(params.retention_ms, CompactObj::memory_resource()));
+  TimeSeries* series = pv->GetTimeSeries();
+  for (const auto& [name, value] : params.labels)
+    series->SetLabel(name, value);
+}
+
+OpStatus OpCreate(const OpArgs& op_args, string_view key, const CreateParams& params) {
+  auto& db_slice = op_args.shard->db_slice();
+  auto [it, added] = db_slice.AddOrFind(op_args.db_cntx, key);
+  if (!added)
+    return OpStatus::KEY_EXISTS;
+
+  InitSeries(params, &it->second);
+  db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, false);
+  return OpStatus::OK;
+}
+
+// Appends the sample, creating the series with params if it does not exist. Returns the
+// timestamp of the sample, which is the current time if ts is not set.
+OpResult<uint64_t> OpAdd(const OpArgs& op_args, string_view key, optional<uint64_t> ts,
+                         double value, const CreateParams& params) {
+  auto& db_slice = op_args.shard->db_slice();
+  uint64_t sample_ts = ts.value_or(op_args.db_cntx.time_now_ms);
+  auto [it, added] = db_slice.AddOrFind(op_args.db_cntx, key);
+  if (added) {
+    InitSeries(params, &it->second);
+  } else {
+    if (it->second.ObjType() != OBJ_TS)
+      return OpStatus::WRONG_TYPE;
+    optional<Sample> last = it->second.GetTimeSeries()->Last();
+    if (last && last->ts >= sample_ts)
+      return OpStatus::OUT_OF_RANGE;
+    db_slice.PreUpdate(op_args.db_cntx.db_index, it);
+  }
+
+  bool res = it->second.GetTimeSeries()->Add(sample_ts, value);
+  DCHECK(res);
+  db_slice.PostUpdate(op_args.db_cntx.db_index, it, key, !added);
+  return sample_ts;
+}
+
+OpResult<vector<Sample>> OpRange(const OpArgs& op_args, string_view key,
+                                 const RangeParams& params) {
+  OpResult<PrimeIterator> it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_TS);
+  if (!it_res)
+    return it_res.status();
+
+  vector<Sample> res;
+  Query(*it_res.value()->second.GetTimeSeries(), params, &res);
+  return res;
+}
+
+// Collects the matching series of the shard, it scans all the keys since there is no index of
+// the labels.
+vector<SeriesResult> OpMRange(const OpArgs& op_args, const RangeParams& params,
+                              const vector<LabelFilter>& filters, bool with_labels) {
+  DbSlice& db_slice = op_args.shard->db_slice();
+  PrimeTable* table = db_slice.GetPrimeTable(op_args.db_cntx.db_index);
+  vector<SeriesResult> res;
+
+  auto cb = [&](PrimeIterator it) {
+    if (it->second.ObjType() != OBJ_TS)
+      return;
+    if (it->second.HasExpire() &&
+        db_slice.ExpireTime(ExpireIterator{it}) <= time_t(op_args.db_cntx.time_now_ms))
+      return;
+
+    const TimeSeries& series = *it->second.GetTimeSeries();
+    for (const LabelFilter& filter : filters) {
+      if (!filter.Matches(series))
+        return;
+    }
+
+    SeriesResult& result = res.emplace_back();
+    it->first.GetString(&result.key);
+    if (with_labels) {
+      for (const auto& [name, value] : series.labels())
+        result.labels.emplace_back(name, value);
+    }
+    Query(series, params, &result.samples);
+  };
+
+  PrimeTable::Cursor cursor;
+  do {
+    cursor = table->Traverse(cursor, cb);
+  } while (cursor);
+  return res;
+}
+
+void SendSample(const Sample& sample, ConnectionContext* cntx) {
+  (*cntx)->StartArray(2);
+  (*cntx)->SendLong(sample.ts);
+  (*cntx)->SendDouble(sample.value);
+}
+
+void SendSamples(const vector<Sample>& samples, ConnectionContext* cntx) {
+  (*cntx)->StartArray(samples.size());
+  for (const Sample& sample : samples)
+    SendSample(sample, cntx);
+}
+
+void SendLabels(const vector<pair<string, string>>& labels, ConnectionContext* cntx) {
+  (*cntx)->StartArray(labels.size());
+  for (const auto& [name, value] : labels) {
+    (*cntx)->StartArray(2);
+    (*cntx)->SendBulkString(name);
+    (*cntx)->SendBulkString(value);
+  }
+}
+
+void SendError(OpStatus status, ConnectionContext* cntx) {
+  switch (status) {
+    case OpStatus::KEY_EXISTS:
+      return (*cntx)->SendError(kKeyExists);
+    case OpStatus::KEY_NOTFOUND:
+      return (*cntx)->SendError(kNoKey);
+    case OpStatus::OUT_OF_RANGE:
+      return (*cntx)->SendError(kOldTs);
+    default:
+      return (*cntx)->SendError(status);
+  }
+}
+
+void TSCreate(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  CreateParams params;
+  if (optional<string> error = ParseCreateParams(args, 2, &params))
+    return (*cntx)->SendError(*error);
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpCreate(t->GetOpArgs(shard), key, params);
+  };
+
+  OpStatus status = cntx->transaction->ScheduleSingleHop(std::move(cb));
+  if (status != OpStatus::OK)
+    return SendError(status, cntx);
+  (*cntx)->SendOk();
+}
+
+void TSAdd(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  optional<uint64_t> ts;
+  if (ArgS(args, 2) != "*") {
+    uint64_t val;
+    if (!absl::SimpleAtoi(ArgS(args, 2), &val))
+      return (*cntx)->SendError(kInvalidTs);
+    ts = val;
+  }
+
+  double value;
+  if (!absl::SimpleAtod(ArgS(args, 3), &value) || isnan(value))
+    return (*cntx)->SendError(kInvalidValue);
+
+  CreateParams params;
+  if (optional<string> error = ParseCreateParams(args, 4, &params))
+    return (*cntx)->SendError(*error);
+
+  // A sample added at "*" is journaled with the timestamp that it got, so that the replica does
+  // not take the time when it applies the command.
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    OpResult<uint64_t> res = OpAdd(t->GetOpArgs(shard), key, ts, value, params);
+    if (ts)
+      return res;
+
+    vector<string_view> cmd;
+    string ts_str;
+    if (res) {
+      ts_str = absl::StrCat(*res);
+      for (size_t i = 0; i < args.size(); ++i)
+        cmd.push_back(i == 2 ? string_view{ts_str} : ArgS(args, i));
+    }
+    t->RecordJournal(shard, cmd);
+    return res;
+  };
+
+  OpResult<uint64_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!result)
+    return SendError(result.status(), cntx);
+  (*cntx)->SendLong(*result);
+}
+
+void TSGet(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  auto cb = [&](Transaction* t, EngineShard* shard) -> OpResult<optional<Sample>> {
+    OpResult<PrimeIterator> it_res =
+        shard->db_slice().Find(t->GetOpArgs(shard).db_cntx, key, OBJ_TS);
+    if (!it_res)
+      return it_res.status();
+    return it_res.value()->second.GetTimeSeries()->Last();
+  };
+
+  OpResult<optional<Sample>> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!result)
+    return SendError(result.status(), cntx);
+  if (!*result)
+    return (*cntx)->StartArray(0);
+  SendSample(**result, cntx);
+}
+
+void TSRange(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  RangeParams params;
+  if (!ParseTimestamp(ArgS(args, 2), &params.from) || !ParseTimestamp(ArgS(args, 3), &params.to))
+    return (*cntx)->SendError(kInvalidTs);
+
+  optional<string> error;
+  for (size_t i = 4; i < args.size(); ++i) {
+    if (!ParseRangeOption(args, &i, &params, &error))
+      return (*cntx)->SendError(kSyntaxErr);
+    if (error)
+      return (*cntx)->SendError(*error);
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpRange(t->GetOpArgs(shard), key, params);
+  };
+
+  OpResult<vector<Sample>> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!result)
+    return SendError(result.status(), cntx);
+  SendSamples(*result, cntx);
+}
+
+void TSMRange(CmdArgList args, ConnectionContext* cntx) {
+  RangeParams params;
+  if (!ParseTimestamp(ArgS(args, 1), &params.from) || !ParseTimestamp(ArgS(args, 2), &params.to))
+    return (*cntx)->SendError(kInvalidTs);
+
+  bool with_labels = false;
+  vector<LabelFilter> filters;
+  optional<string> error;
+  size_t i = 3;
+  for (; i < args.size(); ++i) {
+    if (ParseRangeOption(args, &i, &params, &error)) {
+      if (error)
+        return (*cntx)->SendError(*error);
+    } else if (ArgS(args, i) == "WITHLABELS") {
+      with_labels = true;
+    } else if (ArgS(args, i) == "FILTER") {
+      break;
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
+  for (++i; i < args.size(); ++i) {
+    string_view arg = ArgS(args, i);
+    size_t pos = arg.find('=');
+    if (pos == 0 || pos == string_view::npos)
+      return (*cntx)->SendError("TSDB: failed parsing labels");
+    bool equal = arg[pos - 1] != '!';
+    string_view name = arg.substr(0, equal ? pos : pos - 1);
+    filters.push_back(LabelFilter{name, arg.substr(pos + 1), equal});
+  }
+  if (filters.empty())
+    return (*cntx)->SendError("TSDB: missing FILTER argument");
+
+  vector<vector<SeriesResult>> results(shard_set->size());
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    results[shard->shard_id()] = OpMRange(t->GetOpArgs(shard), params, filters, with_labels);
+    return OpStatus::OK;
+  };
+  cntx->transaction->ScheduleSingleHop(std::move(cb));
+
+  vector<SeriesResult> series;
+  for (vector<SeriesResult>& result : results)
+    move(result.begin(), result.end(), back_inserter(series));
+  sort(series.begin(), series.end(),
+       [](const SeriesResult& a, const SeriesResult& b) { return a.key < b.key; });
+
+  (*cntx)->StartArray(series.size());
+  for (const SeriesResult& result : series) {
+    (*cntx)->StartArray(3);
+    (*cntx)->SendBulkString(result.key);
+    SendLabels(result.labels, cntx);
+    SendSamples(result.samples, cntx);
+  }
+}
+
+void TSInfo(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  struct Info {
+    uint64_t size = 0, memory = 0, chunks = 0, retention_ms = 0, first_ts = 0, last_ts = 0;
+    vector<pair<string, string>> labels;
+  };
+
+  auto cb = [&](Transaction* t, EngineShard* shard) -> OpResult<Info> {
+    OpResult<PrimeIterator> it_res =
+        shard->db_slice().Find(t->GetOpArgs(shard).db_cntx, key, OBJ_TS);
+    if (!it_res)
+      return it_res.status();
+
+    const TimeSeries& series = *it_res.value()->second.GetTimeSeries();
+    Info info;
+    info.size = series.Size();
+    info.memory = it_res.value()->second.MallocUsed();
+    info.chunks = series.num_chunks();
+    info.retention_ms = series.retention_ms();
+    vector<Sample> first;
+    series.Range(0, UINT64_MAX, 1, &first);
+    if (!first.empty()) {
+      info.first_ts = first[0].ts;
+      info.last_ts = series.Last()->ts;
+    }
+    for (const auto& [name, value] : series.labels())
+      info.labels.emplace_back(name, value);
+    return info;
+  };
+
+  OpResult<Info> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (!result)
+    return SendError(result.status(), cntx);
+
+  (*cntx)->StartArray(14);
+  (*cntx)->SendBulkString("totalSamples");
+  (*cntx)->SendLong(result->size);
+  (*cntx)->SendBulkString("memoryUsage");
+  (*cntx)->SendLong(result->memory);
+  (*cntx)->SendBulkString("firstTimestamp");
+  (*cntx)->SendLong(result->first_ts);
+  (*cntx)->SendBulkString("lastTimestamp");
+  (*cntx)->SendLong(result->last_ts);
+  (*cntx)->SendBulkString("retentionTime");
+  (*cntx)->SendLong(result->retention_ms);
+  (*cntx)->SendBulkString("chunkCount");
+  (*cntx)->SendLong(result->chunks);
+  (*cntx)->SendBulkString("labels");
+  SendLabels(result->labels, cntx);
+}
+
+}  // namespace
+
+using CI = CommandId;
+
+#define HFUNC(x) SetHandler(&x)
+
+void TimeSeriesFamily::Register(CommandRegistry* registry) {
+  *registry << CI{"TS.CREATE", CO::WRITE | CO::DENYOOM | CO::FAST, -2, 1, 1, 1}.HFUNC(TSCreate)
+            << CI{"TS.ADD", CO::WRITE | CO::DENYOOM | CO::FAST, -4, 1, 1, 1}.HFUNC(TSAdd)
+            << CI{"TS.GET", CO::READONLY | CO::FAST, 2, 1, 1, 1}.HFUNC(TSGet)
+            << CI{"TS.RANGE", CO::READONLY, -4, 1, 1, 1}.HFUNC(TSRange)
+            << CI{"TS.MRANGE", CO::READONLY | CO::GLOBAL_TRANS, -5, 0, 0, 0}.HFUNC(TSMRange)
+            << CI{"TS.INFO", CO::READONLY | CO::FAST, 2, 1, 1, 1}.HFUNC(TSInfo);
+}
+
+}  // namespace dfly
@@ -0,0 +1,23 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+/// @brief Implements a subset of the commands of RedisTimeSeries: TS.CREATE, TS.ADD, TS.GET,
+/// TS.RANGE, TS.MRANGE and TS.INFO. The series are values of type OBJ_TS, see
+/// core/time_series.h. Every series keeps its samples in increasing timestamps, there are no
+/// duplicate policies, and TS.MRANGE scans the keys of the database for the label filters.
+///     TS.CREATE: https://redis.io/commands/ts.create/
+///     TS.ADD: https://redis.io/commands/ts.add/
+///     TS.RANGE: https://redis.io/commands/ts.range/
+///     TS.MRANGE: https://redis.io/commands/ts.mrange/
+namespace dfly {
+class CommandRegistry;
+
+class TimeSeriesFamily {
+ public:
+  static void Register(CommandRegistry* registry);
+};
+
+}  // namespace dfly
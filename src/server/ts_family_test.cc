@@ -0,0 +1,100 @@
+// Copyright 2022, DragonflyDB authors.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "server/ts_family.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "facade/facade_test.h"
+#include "server/command_registry.h"
+#include "server/test_utils.h"
+
+using namespace testing;
+using namespace std;
+using namespace util;
+
+namespace dfly {
+
+class TimeSeriesFamilyTest : public BaseFamilyTest {};
+
+TEST_F(TimeSeriesFamilyTest, CreateAdd) {
+  EXPECT_EQ("OK", Run({"ts.create", "ts", "retention", "1000", "labels", "host", "a"}));
+  EXPECT_THAT(Run({"ts.create", "ts"}), ErrArg("key already exists"));
+  EXPECT_THAT(Run({"ts.create", "ts2", "labels", "host"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"ts.create", "ts2", "retention", "x"}), ErrArg("invalid retention"));
+  EXPECT_EQ("TSDB-TYPE", Run({"type", "ts"}));
+
+  EXPECT_EQ(100, CheckedInt({"ts.add", "ts", "100", "1.5"}));
+  EXPECT_EQ(200, CheckedInt({"ts.add", "ts", "200", "-2"}));
+  EXPECT_THAT(Run({"ts.add", "ts", "200", "3"}), ErrArg("must be larger"));
+  EXPECT_THAT(Run({"ts.add", "ts", "x", "3"}), ErrArg("invalid timestamp"));
+  EXPECT_THAT(Run({"ts.add", "ts", "300", "nan"}), ErrArg("invalid value"));
+  EXPECT_THAT(Run({"ts.get", "ts"}).GetVec(), ElementsAre(IntArg(200), "-2"));
+
+  // TS.ADD creates the series with its options.
+  EXPECT_GT(CheckedInt({"ts.add", "auto", "*", "1", "labels", "host", "b"}), 0);
+  auto resp = Run({"ts.info", "auto"});
+  ASSERT_THAT(resp, ArrLen(14));
+  EXPECT_THAT(resp.GetVec()[1], IntArg(1));
+  EXPECT_THAT(resp.GetVec()[13].GetVec()[0].GetVec(), ElementsAre("host", "b"));
+
+  Run({"set", "str", "foo"});
+  EXPECT_THAT(Run({"ts.add", "str", "1", "1"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"ts.get", "missing"}), ErrArg("key does not exist"));
+  EXPECT_THAT(Run({"ts.range", "missing", "-", "+"}), ErrArg("key does not exist"));
+}
+
+TEST_F(TimeSeriesFamilyTest, Range) {
+  for (unsigned i = 0; i < 100; ++i) {
+    Run({"ts.add", "ts", absl::StrCat(i * 10), absl::StrCat(i % 10)});
+  }
+
+  EXPECT_THAT(Run({"ts.range", "ts", "-", "+"}), ArrLen(100));
+  auto resp = Run({"ts.range", "ts", "15", "40"});
+  ASSERT_THAT(resp, ArrLen(3));
+  EXPECT_THAT(resp.GetVec()[0].GetVec(), ElementsAre(IntArg(20), "2"));
+  EXPECT_THAT(Run({"ts.range", "ts", "15", "+", "count", "5"}), ArrLen(5));
+
+  resp = Run({"ts.range", "ts", "-", "+", "aggregation", "avg", "100"});
+  ASSERT_THAT(resp, ArrLen(10));
+  EXPECT_THAT(resp.GetVec()[9].GetVec(), ElementsAre(IntArg(900), "4.5"));
+  resp = Run({"ts.range", "ts", "0", "99", "aggregation", "max", "50"});
+  EXPECT_THAT(resp.GetVec()[1].GetVec(), ElementsAre(IntArg(50), "9"));
+
+  EXPECT_THAT(Run({"ts.range", "ts", "-", "+", "aggregation", "foo", "10"}),
+              ErrArg("Unknown aggregation"));
+  EXPECT_THAT(Run({"ts.range", "ts", "-", "+", "aggregation", "sum", "0"}),
+              ErrArg("bucketDuration"));
+  EXPECT_THAT(Run({"ts.range", "ts", "-", "+", "foo"}), ErrArg("syntax error"));
+}
+
+TEST_F(TimeSeriesFamilyTest, MRange) {
+  Run({"ts.create", "cpu:1", "labels", "metric", "cpu", "host", "a"});
+  Run({"ts.create", "cpu:2", "labels", "metric", "cpu", "host", "b"});
+  Run({"ts.create", "mem:1", "labels", "metric", "mem", "host", "a"});
+  for (string_view key : {"cpu:1", "cpu:2", "mem:1"}) {
+    Run({"ts.add", key, "10", "1"});
+    Run({"ts.add", key, "20", "3"});
+  }
+
+  auto resp = Run({"ts.mrange", "-", "+", "filter", "metric=cpu"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_EQ("cpu:1", resp.GetVec()[0].GetVec()[0]);
+  EXPECT_EQ("cpu:2", resp.GetVec()[1].GetVec()[0]);
+
+  resp = Run({"ts.mrange", "-", "+", "aggregation", "sum", "100", "withlabels", "filter",
+              "host=a", "metric!=cpu"});
+  ASSERT_THAT(resp, ArrLen(3));
+  EXPECT_EQ("mem:1", resp.GetVec()[0]);
+  EXPECT_THAT(resp.GetVec()[1], ArrLen(2));
+  EXPECT_THAT(resp.GetVec()[2].GetVec()[0].GetVec(), ElementsAre(IntArg(0), "4"));
+
+  EXPECT_THAT(Run({"ts.mrange", "-", "+", "filter", "host=c"}), ArrLen(0));
+  EXPECT_THAT(Run({"ts.mrange", "-", "+", "filter", "=a"}), ErrArg("failed parsing labels"));
+  EXPECT_THAT(Run({"ts.mrange", "-", "+", "foo", "filter", "a=b"}), ErrArg("syntax error"));
+}
+
+}  // namespace dfly
@@ -4,6 +4,10 @@
 
 #include "server/zset_family.h"
 
+#include <absl/strings/str_format.h>
+
+#include <deque>
+
 extern "C" {
 #include "redis/listpack.h"
 #include "redis/object.h"
@@ -13,6 +17,8 @@ extern "C" {
 
 #include "base/logging.h"
 #include "base/stl_util.h"
+#include "core/geohash.h"
+#include "core/sorted_map.h"
 #include "facade/error.h"
 #include "server/command_registry.h"
 #include "server/conn_context.h"
@@ -77,6 +83,33 @@ zlexrangespec GetLexRange(bool reverse, const ZSetFamily::LexInterval& li) {
   return range;
 }
 
+inline SortedMap* GetSortedMap(const robj* zobj) {
+  DCHECK_EQ(kEncodingSortedMap, zobj->encoding);
+  return (SortedMap*)zobj->ptr;
+}
+
+unsigned long ZsetLength(const robj* zobj) {
+  if (zobj->encoding == kEncodingSortedMap)
+    return GetSortedMap(zobj)->Size();
+  return zsetLength(zobj);
+}
+
+// zsetAdd converts listpacks to redis skiplists, hence we convert them to SortedMap
+// before they reach the listpack limits. Note that unlike zsetAdd, we do not check
+// whether the member already exists.
+void ConvertIfNeeded(robj* zobj, size_t member_len) {
+  if (zobj->encoding != OBJ_ENCODING_LISTPACK)
+    return;
+
+  uint8_t* lp = (uint8_t*)zobj->ptr;
+  if (lpLength(lp) / 2 + 1 > server.zset_max_listpack_entries ||
+      member_len > server.zset_max_listpack_value || !lpSafeToAdd(lp, member_len)) {
+    zobj->ptr = SortedMap::FromListPack(CompactObj::memory_resource(), lp);
+    zobj->encoding = kEncodingSortedMap;
+    lpFree(lp);
+  }
+}
+
 struct ZParams {
   unsigned flags = 0;  // mask of ZADD_IN_ macros.
   bool ch = false;     // Corresponds to CH option.
@@ -100,19 +133,18 @@ OpResult<PrimeIterator> FindZEntry(const ZParams& zparams, const OpArgs& op_args
 
   PrimeIterator& it = add_res.first;
   if (add_res.second || zparams.override) {
-    robj* zobj = nullptr;
+    if (!add_res.second) {
+      db_slice.PreUpdate(op_args.db_cntx.db_index, it);
+    }
 
     if (member_len > kMaxListPackValue) {
-      zobj = createZsetObject();
+      it->second.InitRobj(OBJ_ZSET, kEncodingSortedMap,
+                          new SortedMap(CompactObj::memory_resource()));
     } else {
-      zobj = createZsetListpackObject();
+      it->second.ImportRObj(createZsetListpackObject());
     }
 
-    DVLOG(2) << "Created zset " << zobj->ptr;
-    if (!add_res.second) {
-      db_slice.PreUpdate(op_args.db_cntx.db_index, it);
-    }
-    it->second.ImportRObj(zobj);
+    DVLOG(2) << "Created zset " << it->second.RObjPtr();
   } else {
     if (it->second.ObjType() != OBJ_ZSET)
       return OpStatus::WRONG_TYPE;
@@ -148,13 +180,13 @@ class IntervalVisitor {
 
  private:
   void ExtractListPack(const zrangespec& range);
-  void ExtractSkipList(const zrangespec& range);
+  void ExtractSortedMap(const zrangespec& range);
 
   void ExtractListPack(const zlexrangespec& range);
-  void ExtractSkipList(const zlexrangespec& range);
+  void ExtractSortedMap(const zlexrangespec& range);
 
   void PopListPack(ZSetFamily::TopNScored sc);
-  void PopSkipList(ZSetFamily::TopNScored sc);
+  void PopSortedMap(ZSetFamily::TopNScored sc);
 
   void ActionRange(unsigned start, unsigned end);  // rank
   void ActionRange(const zrangespec& range);       // score
@@ -174,10 +206,26 @@ class IntervalVisitor {
     }
   }
 
-  zskiplistNode* Next(zskiplistNode* ln) const {
-    return params_.reverse ? ln->backward : ln->level[0].forward;
+  void Next(SortedMap::Iterator* it) const {
+    if (params_.reverse) {
+      --*it;
+    } else {
+      ++*it;
+    }
+  }
+
+  // Returns the iterator that is offset positions after the one at rank, in the direction
+  // of the range.
+  SortedMap::Iterator Skip(const SortedMap* sm, size_t rank, size_t offset) const {
+    if (params_.reverse) {
+      return offset > rank ? SortedMap::Iterator{} : sm->AtRank(rank - offset);
+    }
+    return sm->AtRank(rank + offset);
   }
 
+  // Appends up to limit members starting from it, for as long as in_range holds.
+  template <typename InRange> void Extract(SortedMap::Iterator it, InRange&& in_range);
+
   bool IsUnder(double score, const zrangespec& spec) const {
     return params_.reverse ? zslValueGteMin(score, &spec) : zslValueLteMax(score, &spec);
   }
@@ -193,7 +241,7 @@ class IntervalVisitor {
 };
 
 void IntervalVisitor::operator()(const ZSetFamily::IndexInterval& ii) {
-  unsigned long llen = zsetLength(zobj_);
+  unsigned long llen = ZsetLength(zobj_);
   int32_t start = ii.first;
   int32_t end = ii.second;
 
@@ -278,8 +326,8 @@ void IntervalVisitor::ActionRange(const zrangespec& range) {
   if (zobj_->encoding == OBJ_ENCODING_LISTPACK) {
     ExtractListPack(range);
   } else {
-    CHECK_EQ(zobj_->encoding, OBJ_ENCODING_SKIPLIST);
-    ExtractSkipList(range);
+    CHECK_EQ(zobj_->encoding, kEncodingSortedMap);
+    ExtractSortedMap(range);
   }
 }
 
@@ -287,8 +335,8 @@ void IntervalVisitor::ActionRange(const zlexrangespec& range) {
   if (zobj_->encoding == OBJ_ENCODING_LISTPACK) {
     ExtractListPack(range);
   } else {
-    CHECK_EQ(zobj_->encoding, OBJ_ENCODING_SKIPLIST);
-    ExtractSkipList(range);
+    CHECK_EQ(zobj_->encoding, kEncodingSortedMap);
+    ExtractSortedMap(range);
   }
 }
 
@@ -300,9 +348,7 @@ void IntervalVisitor::ActionRem(unsigned start, unsigned end) {
     zl = lpDeleteRange(zl, 2 * start, 2 * removed_);
     zobj_->ptr = zl;
   } else {
-    CHECK_EQ(OBJ_ENCODING_SKIPLIST, zobj_->encoding);
-    zset* zs = (zset*)zobj_->ptr;
-    removed_ = zslDeleteRangeByRank(zs->zsl, start + 1, end + 1, zs->dict);
+    removed_ = GetSortedMap(zobj_)->DeleteRangeByRank(start, end);
   }
 }
 
@@ -314,9 +360,7 @@ void IntervalVisitor::ActionRem(const zrangespec& range) {
     zobj_->ptr = zl;
     removed_ = deleted;
   } else {
-    CHECK_EQ(OBJ_ENCODING_SKIPLIST, zobj_->encoding);
-    zset* zs = (zset*)zobj_->ptr;
-    removed_ = zslDeleteRangeByScore(zs->zsl, &range, zs->dict);
+    removed_ = GetSortedMap(zobj_)->DeleteRangeByScore(range);
   }
 }
 
@@ -328,9 +372,7 @@ void IntervalVisitor::ActionRem(const zlexrangespec& range) {
     zobj_->ptr = zl;
     removed_ = deleted;
   } else {
-    CHECK_EQ(OBJ_ENCODING_SKIPLIST, zobj_->encoding);
-    zset* zs = (zset*)zobj_->ptr;
-    removed_ = zslDeleteRangeByLex(zs->zsl, &range, zs->dict);
+    removed_ = GetSortedMap(zobj_)->DeleteRangeByLex(range);
   }
 }
 
@@ -338,8 +380,8 @@ void IntervalVisitor::ActionPop(ZSetFamily::TopNScored sc) {
   if (zobj_->encoding == OBJ_ENCODING_LISTPACK) {
     PopListPack(sc);
   } else {
-    CHECK_EQ(zobj_->encoding, OBJ_ENCODING_SKIPLIST);
-    PopSkipList(sc);
+    CHECK_EQ(zobj_->encoding, kEncodingSortedMap);
+    PopSortedMap(sc);
   }
 }
 
@@ -387,36 +429,17 @@ void IntervalVisitor::ExtractListPack(const zrangespec& range) {
   }
 }
 
-void IntervalVisitor::ExtractSkipList(const zrangespec& range) {
-  zset* zs = (zset*)zobj_->ptr;
-  zskiplist* zsl = zs->zsl;
-  zskiplistNode* ln;
-  unsigned offset = params_.offset;
-  unsigned limit = params_.limit;
-
-  /* If reversed, get the last node in range as starting point. */
-  if (params_.reverse) {
-    ln = zslLastInRange(zsl, &range);
-  } else {
-    ln = zslFirstInRange(zsl, &range);
-  }
-
-  /* If there is an offset, just traverse the number of elements without
-   * checking the score because that is done in the next loop. */
-  while (ln && offset--) {
-    ln = Next(ln);
-  }
-
-  while (ln && limit--) {
-    /* Abort when the node is no longer in range. */
-    if (!IsUnder(ln->score, range))
-      break;
+void IntervalVisitor::ExtractSortedMap(const zrangespec& range) {
+  const SortedMap* sm = GetSortedMap(zobj_);
+  auto [it, rank] = params_.reverse ? sm->LastInRange(range) : sm->FirstInRange(range);
+  if (it.IsEnd())
+    return;
 
-    result_.emplace_back(string{ln->ele, sdslen(ln->ele)}, ln->score);
+  // Unlike the skiplist, the tree skips the offset in O(log n).
+  if (params_.offset)
+    it = Skip(sm, rank, params_.offset);
 
-    /* Move to next node */
-    ln = Next(ln);
-  }
+  Extract(it, [&](const SortedMap::Iterator& cur) { return IsUnder(cur->score, range); });
 }
 
 void IntervalVisitor::ExtractListPack(const zlexrangespec& range) {
@@ -467,40 +490,32 @@ void IntervalVisitor::ExtractListPack(const zlexrangespec& range) {
   }
 }
 
-void IntervalVisitor::ExtractSkipList(const zlexrangespec& range) {
-  zset* zs = (zset*)zobj_->ptr;
-  zskiplist* zsl = zs->zsl;
-  zskiplistNode* ln;
-  unsigned offset = params_.offset;
-  unsigned limit = params_.limit;
+void IntervalVisitor::ExtractSortedMap(const zlexrangespec& range) {
+  const SortedMap* sm = GetSortedMap(zobj_);
+  auto [it, rank] = params_.reverse ? sm->LastInLexRange(range) : sm->FirstInLexRange(range);
+  if (it.IsEnd())
+    return;
 
-  /* If reversed, get the last node in range as starting point. */
-  if (params_.reverse) {
-    ln = zslLastInLexRange(zsl, &range);
-  } else {
-    ln = zslFirstInLexRange(zsl, &range);
-  }
+  if (params_.offset)
+    it = Skip(sm, rank, params_.offset);
 
-  /* If there is an offset, just traverse the number of elements without
-   * checking the score because that is done in the next loop. */
-  while (ln && offset--) {
-    ln = Next(ln);
-  }
+  Extract(it, [&](const SortedMap::Iterator& cur) {
+    return params_.reverse ? zslLexValueGteMin(cur->member, &range)
+                           : zslLexValueLteMax(cur->member, &range);
+  });
+}
 
-  while (ln && limit--) {
-    /* Abort when the node is no longer in range. */
-    if (params_.reverse) {
-      if (!zslLexValueGteMin(ln->ele, &range))
-        break;
-    } else {
-      if (!zslLexValueLteMax(ln->ele, &range))
-        break;
-    }
+template <typename InRange>
+void IntervalVisitor::Extract(SortedMap::Iterator it, InRange&& in_range) {
+  unsigned limit = params_.limit;
 
-    result_.emplace_back(string{ln->ele, sdslen(ln->ele)}, ln->score);
+  while (!it.IsEnd() && limit--) {
+    /* Abort when the node is no longer in range. */
+    if (!in_range(it))
+      break;
 
-    /* Move to next node */
-    ln = Next(ln);
+    result_.emplace_back(string{it->member, sdslen(it->member)}, it->score);
+    Next(&it);
   }
 }
 
@@ -543,25 +558,20 @@ void IntervalVisitor::PopListPack(ZSetFamily::TopNScored sc) {
   zobj_->ptr = lpDeleteRange(zl, start, 2 * sc);
 }
 
-void IntervalVisitor::PopSkipList(ZSetFamily::TopNScored sc) {
-  zset* zs = (zset*)zobj_->ptr;
-  zskiplist* zsl = zs->zsl;
-  zskiplistNode* ln;
+void IntervalVisitor::PopSortedMap(ZSetFamily::TopNScored sc) {
+  SortedMap* sm = GetSortedMap(zobj_);
 
   /* We start from the header, or the tail if reversed. */
-  if (params_.reverse) {
-    ln = zsl->tail;
-  } else {
-    ln = zsl->header;
-  }
-
-  while (ln && sc--) {
-    result_.emplace_back(string{ln->ele, sdslen(ln->ele)}, ln->score);
+  SortedMap::Iterator it = params_.reverse ? sm->Last() : sm->begin();
 
-    /* we can delete the element now */
-    zsetDel(zobj_, ln->ele);
+  while (!it.IsEnd() && sc--) {
+    result_.emplace_back(string{it->member, sdslen(it->member)}, it->score);
+    Next(&it);
+  }
 
-    ln = Next(ln);
+  /* we can delete the elements now */
+  for (const auto& member_score : result_) {
+    sm->Delete(member_score.first);
   }
 }
 
@@ -615,31 +625,20 @@ void SendAtLeastOneKeyError(ConnectionContext* cntx) {
 }
 
 enum class AggType : uint8_t { SUM, MIN, MAX };
-using ScoredMap = absl::flat_hash_map<std::string, double>;
-
-ScoredMap FromObject(const CompactObj& co, double weight) {
-  robj* obj = co.AsRObj();
-  ZSetFamily::RangeParams params;
-  params.with_scores = true;
-  IntervalVisitor vis(Action::RANGE, params, obj);
-  vis(ZSetFamily::IndexInterval(0, -1));
 
-  ZSetFamily::ScoredArray arr = vis.PopResult();
-  ScoredMap res;
-  res.reserve(arr.size());
-
-  for (auto& elem : arr) {
-    elem.second *= weight;
-    res.emplace(move(elem));
-  }
+using ScoredMemberView = std::pair<double, std::string_view>;
+using ScoredMemberSpan = absl::Span<ScoredMemberView>;
 
-  return res;
-}
+// Members that refer to the memory of their sorted sets, which stays valid as long as the
+// transaction holds the keys.
+using ScoredViewMap = absl::flat_hash_map<std::string_view, double>;
 
 double Aggregate(double v1, double v2, AggType atype) {
   switch (atype) {
-    case AggType::SUM:
-      return v1 + v2;
+    case AggType::SUM: {
+      double res = v1 + v2;
+      return isnan(res) ? 0 : res;  // inf + -inf, as redis does.
+    }
     case AggType::MAX:
       return max(v1, v2);
     case AggType::MIN:
@@ -648,148 +647,131 @@ double Aggregate(double v1, double v2, AggType atype) {
   return 0;
 }
 
-// the result is in the destination.
-void UnionScoredMap(ScoredMap* dest, ScoredMap* src, AggType agg_type) {
-  ScoredMap* target = dest;
-  ScoredMap* iter = src;
-
-  if (iter->size() > target->size())
-    swap(target, iter);
-
-  for (const auto& elem : *iter) {
-    auto [it, inserted] = target->emplace(elem);
-    if (!inserted) {
-      it->second = Aggregate(it->second, elem.second, agg_type);
-    }
+// A source of ZUNION/ZINTER and their variants, with its weight. Its members are read in place.
+class ZSetSource {
+ public:
+  ZSetSource(const PrimeValue& pv, double weight)
+      : ptr_(pv.RObjPtr()), encoding_(pv.Encoding()), weight_(weight) {
   }
 
-  if (target != dest)
-    dest->swap(*src);
-}
-
-void InterScoredMap(ScoredMap* dest, ScoredMap* src, AggType agg_type) {
-  ScoredMap* target = dest;
-  ScoredMap* iter = src;
-
-  if (iter->size() > target->size())
-    swap(target, iter);
-
-  auto it = iter->begin();
-  while (it != iter->end()) {
-    auto inter_it = target->find(it->first);
-    if (inter_it == target->end()) {
-      auto copy_it = it++;
-      iter->erase(copy_it);
-    } else {
-      it->second = Aggregate(it->second, inter_it->second, agg_type);
-      ++it;
-    }
+  size_t Size() const {
+    if (encoding_ == kEncodingSortedMap)
+      return ((const SortedMap*)ptr_)->Size();
+    return lpLength((uint8_t*)ptr_) / 2;
   }
 
-  if (iter != dest)
-    dest->swap(*src);
-}
+  // Calls cb(member, score) for every member, with its weighted score. Integers have no string
+  // form in a listpack, so they are rendered into ints, which must outlive the members.
+  template <typename F> void ForEach(deque<string>* ints, F&& cb) const;
 
-OpResult<ScoredMap> OpUnion(EngineShard* shard, Transaction* t, string_view dest, AggType agg_type,
-                            const vector<double>& weights, bool store) {
-  ArgSlice keys = t->ShardArgsInShard(shard->shard_id());
-  DVLOG(1) << "shard:" << shard->shard_id() << ", keys " << vector(keys.begin(), keys.end());
-  DCHECK(!keys.empty());
+  // Returns the weighted score of member, if it is in the set.
+  optional<double> Find(string_view member) const;
 
-  unsigned start = 0;
-
-  if (keys.front() == dest) {
-    ++start;
+ private:
+  double Weighted(double score) const {
+    double res = score * weight_;
+    return isnan(res) ? 0 : res;  // 0 * inf, as redis does.
   }
 
-  auto& db_slice = shard->db_slice();
-  vector<pair<PrimeIterator, double>> it_arr(keys.size() - start);
-  if (it_arr.empty())     // could be when only the dest key is hosted in this shard
-    return OpStatus::OK;  // return empty map
-
-  for (unsigned j = start; j < keys.size(); ++j) {
-    auto it_res = db_slice.Find(t->db_context(), keys[j], OBJ_ZSET);
-    if (it_res == OpStatus::WRONG_TYPE)  // TODO: support sets with default score 1.
-      return it_res.status();
-    if (!it_res)
-      continue;
+  void* ptr_;
+  unsigned encoding_;
+  double weight_;
+};
 
-    // first global index is 2 after {destkey, numkeys}
-    unsigned src_indx = j - start;
-    unsigned windex = t->ReverseArgIndex(shard->shard_id(), j) - 2;
-    DCHECK_LT(windex, weights.size());
-    it_arr[src_indx] = {*it_res, weights[windex]};
+template <typename F> void ZSetSource::ForEach(deque<string>* ints, F&& cb) const {
+  if (encoding_ == kEncodingSortedMap) {
+    const SortedMap* sm = (const SortedMap*)ptr_;
+    for (auto it = sm->begin(); !it.IsEnd(); ++it) {
+      cb(string_view{it->member, sdslen(it->member)}, Weighted(it->score));
+    }
+    return;
   }
 
-  ScoredMap result;
-  for (auto it = it_arr.begin(); it != it_arr.end(); ++it) {
-    if (it->first.is_done())
-      continue;
-
-    ScoredMap sm = FromObject(it->first->second, it->second);
-    if (result.empty())
-      result.swap(sm);
-    else
-      UnionScoredMap(&result, &sm, agg_type);
+  DCHECK_EQ(OBJ_ENCODING_LISTPACK, encoding_);
+  uint8_t* zl = (uint8_t*)ptr_;
+  unsigned vlen = 0;
+  long long vlong = 0;
+  for (uint8_t* eptr = lpFirst(zl); eptr;) {
+    uint8_t* sptr = lpNext(zl, eptr);
+    uint8_t* vstr = lpGetValue(eptr, &vlen, &vlong);
+    string_view member = vstr ? string_view{(const char*)vstr, vlen}
+                              : string_view{ints->emplace_back(absl::StrCat(vlong))};
+    cb(member, Weighted(zzlGetScore(sptr)));
+    eptr = lpNext(zl, sptr);
+  }
+}
+
+optional<double> ZSetSource::Find(string_view member) const {
+  if (encoding_ == kEncodingSortedMap) {
+    optional<double> score = ((const SortedMap*)ptr_)->GetScore(member);
+    return score ? optional<double>{Weighted(*score)} : nullopt;
+  }
+
+  uint8_t* zl = (uint8_t*)ptr_;
+  uint8_t* eptr = container_utils::LpFindKey(zl, member);
+  if (!eptr)
+    return nullopt;
+  return Weighted(zzlGetScore(lpNext(zl, eptr)));
+}
+
+// The sources that a shard hosts, reduced to a single set. Its members refer to the sources and
+// to ints. When more than one shard merges the reductions, the members are also split into
+// parts, one per merging shard.
+struct ShardReduction {
+  OpStatus status = OpStatus::SKIPPED;  // if the shard hosts no source.
+  ScoredViewMap members;
+  deque<string> ints;
+  vector<vector<ScoredMemberView>> parts;
+
+  // Calls cb(member, score) for the members of the part, while it returns true.
+  template <typename F> void ForEachInPart(unsigned part, F&& cb) const {
+    if (parts.empty()) {
+      for (const auto& [member, score] : members) {
+        if (!cb(member, score))
+          return;
+      }
+    } else {
+      for (const auto& [score, member] : parts[part]) {
+        if (!cb(member, score))
+          return;
+      }
+    }
   }
+};
 
-  return result;
-}
-
-OpResult<ScoredMap> OpInter(EngineShard* shard, Transaction* t, string_view dest, AggType agg_type,
-                            const vector<double>& weights, bool store) {
-  ArgSlice keys = t->ShardArgsInShard(shard->shard_id());
-  DVLOG(1) << "shard:" << shard->shard_id() << ", keys " << vector(keys.begin(), keys.end());
-  DCHECK(!keys.empty());
-
-  unsigned start = 0;
+void ReduceUnion(const vector<ZSetSource>& sources, AggType agg_type, ShardReduction* res) {
+  size_t max_size = 0;
+  for (const auto& src : sources)
+    max_size = max(max_size, src.Size());
+  res->members.reserve(max_size);
 
-  if (keys.front() == dest) {
-    ++start;
+  for (const auto& src : sources) {
+    src.ForEach(&res->ints, [&](string_view member, double score) {
+      auto [it, inserted] = res->members.emplace(member, score);
+      if (!inserted)
+        it->second = Aggregate(it->second, score, agg_type);
+    });
   }
+}
 
-  auto& db_slice = shard->db_slice();
-  vector<pair<PrimeIterator, double>> it_arr(keys.size() - start);
-  if (it_arr.empty())          // could be when only the dest key is hosted in this shard
-    return OpStatus::SKIPPED;  // return noop
-
-  for (unsigned j = start; j < keys.size(); ++j) {
-    auto it_res = db_slice.Find(t->db_context(), keys[j], OBJ_ZSET);
-    if (it_res == OpStatus::WRONG_TYPE)  // TODO: support sets with default score 1.
-      return it_res.status();
-
-    if (!it_res)
-      continue;  // we exit in the next loop
-
-    // first global index is 2 after {destkey, numkeys}
-    unsigned src_indx = j - start;
-    unsigned windex = t->ReverseArgIndex(shard->shard_id(), j) - 2;
-    DCHECK_LT(windex, weights.size());
-    it_arr[src_indx] = {*it_res, weights[windex]};
-  }
+// The smallest source bounds the intersection, so only its members are scanned, and each of them
+// is looked up in the other sources.
+void ReduceInter(vector<ZSetSource> sources, AggType agg_type, ShardReduction* res) {
+  sort(sources.begin(), sources.end(),
+       [](const ZSetSource& l, const ZSetSource& r) { return l.Size() < r.Size(); });
+  res->members.reserve(sources.front().Size());
 
-  ScoredMap result;
-  for (auto it = it_arr.begin(); it != it_arr.end(); ++it) {
-    if (it->first.is_done()) {
-      return ScoredMap{};
+  sources.front().ForEach(&res->ints, [&](string_view member, double score) {
+    for (size_t i = 1; i < sources.size(); ++i) {
+      optional<double> other = sources[i].Find(member);
+      if (!other)
+        return;
+      score = Aggregate(score, *other, agg_type);
     }
-
-    ScoredMap sm = FromObject(it->first->second, it->second);
-    if (result.empty())
-      result.swap(sm);
-    else
-      InterScoredMap(&result, &sm, agg_type);
-
-    if (result.empty())
-      return result;
-  }
-
-  return result;
+    res->members.emplace(member, score);
+  });
 }
 
-using ScoredMemberView = std::pair<double, std::string_view>;
-using ScoredMemberSpan = absl::Span<ScoredMemberView>;
-
 struct AddResult {
   double new_score = 0;
   unsigned num_updated = 0;
@@ -828,9 +810,15 @@ OpResult<AddResult> OpAdd(const OpArgs& op_args, const ZParams& zparams, string_
 
   for (size_t j = 0; j < members.size(); j++) {
     const auto& m = members[j];
-    tmp_str = sdscpylen(tmp_str, m.second.data(), m.second.size());
+    int retval;
 
-    int retval = zsetAdd(zobj, m.first, tmp_str, zparams.flags, &retflags, &new_score);
+    ConvertIfNeeded(zobj, m.second.size());
+    if (zobj->encoding == kEncodingSortedMap) {
+      retval = GetSortedMap(zobj)->Add(m.first, m.second, zparams.flags, &retflags, &new_score);
+    } else {
+      tmp_str = sdscpylen(tmp_str, m.second.data(), m.second.size());
+      retval = zsetAdd(zobj, m.first, tmp_str, zparams.flags, &retflags, &new_score);
+    }
 
     if (zparams.flags & ZADD_IN_INCR) {
       if (retval == 0) {
@@ -869,62 +857,453 @@ OpResult<AddResult> OpAdd(const OpArgs& op_args, const ZParams& zparams, string_
   return aresult;
 }
 
-struct StoreArgs {
+// The arguments of ZUNION, ZINTER and their STORE variants.
+struct SetOpArgs {
   AggType agg_type = AggType::SUM;
   unsigned num_keys;
+  unsigned first_key;  // the index of the first source in the arguments.
   vector<double> weights;
+  bool with_scores = false;
+
+  bool store = false;
+  string_view dest;
 };
 
-OpResult<StoreArgs> ParseStoreArgs(CmdArgList args) {
-  string_view num_str = ArgS(args, 2);
-  StoreArgs store_args;
+OpResult<SetOpArgs> ParseSetOpArgs(CmdArgList args, bool store) {
+  SetOpArgs op_args;
+  op_args.store = store;
+  if (store)
+    op_args.dest = ArgS(args, 1);
 
   // we parsed the structure before, when transaction has been initialized.
-  CHECK(absl::SimpleAtoi(num_str, &store_args.num_keys));
-  DCHECK_GE(args.size(), 3 + store_args.num_keys);
+  unsigned num_pos = store ? 2 : 1;
+  CHECK(absl::SimpleAtoi(ArgS(args, num_pos), &op_args.num_keys));
+  op_args.first_key = num_pos + 1;
+  DCHECK_GE(args.size(), op_args.first_key + op_args.num_keys);
 
-  store_args.weights.resize(store_args.num_keys, 1);
-  for (size_t i = 3 + store_args.num_keys; i < args.size(); ++i) {
+  op_args.weights.resize(op_args.num_keys, 1);
+  for (size_t i = op_args.first_key + op_args.num_keys; i < args.size(); ++i) {
     ToUpper(&args[i]);
     string_view arg = ArgS(args, i);
     if (arg == "WEIGHTS") {
-      if (args.size() <= i + store_args.num_keys) {
+      if (args.size() <= i + op_args.num_keys) {
         return OpStatus::SYNTAX_ERR;
       }
 
-      for (unsigned j = 0; j < store_args.num_keys; ++j) {
+      for (unsigned j = 0; j < op_args.num_keys; ++j) {
         string_view weight = ArgS(args, i + j + 1);
-        if (!absl::SimpleAtod(weight, &store_args.weights[j])) {
+        if (!absl::SimpleAtod(weight, &op_args.weights[j])) {
           return OpStatus::INVALID_FLOAT;
         }
       }
-      i += store_args.num_keys;
+      i += op_args.num_keys;
     } else if (arg == "AGGREGATE") {
-      if (i + 2 != args.size()) {
+      if (i + 1 == args.size()) {
         return OpStatus::SYNTAX_ERR;
       }
 
-      ToUpper(&args[i + 1]);
+      ToUpper(&args[++i]);
 
-      string_view agg = ArgS(args, i + 1);
+      string_view agg = ArgS(args, i);
       if (agg == "SUM") {
-        store_args.agg_type = AggType::SUM;
+        op_args.agg_type = AggType::SUM;
       } else if (agg == "MIN") {
-        store_args.agg_type = AggType::MIN;
+        op_args.agg_type = AggType::MIN;
       } else if (agg == "MAX") {
-        store_args.agg_type = AggType::MAX;
+        op_args.agg_type = AggType::MAX;
       } else {
         return OpStatus::SYNTAX_ERR;
       }
-      break;
+    } else if (arg == "WITHSCORES" && !store) {
+      op_args.with_scores = true;
     } else {
       return OpStatus::SYNTAX_ERR;
     }
   }
 
-  return store_args;
+  return op_args;
+};
+
+void SendSetOpArgsError(OpStatus status, ConnectionContext* cntx) {
+  if (status == OpStatus::INVALID_FLOAT)
+    return (*cntx)->SendError("weight value is not a float", kSyntaxErrType);
+  (*cntx)->SendError(status);
+}
+
+OpStatus NoOpCb(Transaction* t, EngineShard* shard) {
+  return OpStatus::OK;
 };
 
+// Reduces the sources that the shard hosts.
+OpStatus OpReduce(Transaction* t, EngineShard* shard, const SetOpArgs& args, bool inter,
+                  ShardReduction* res) {
+  ArgSlice keys = t->ShardArgsInShard(shard->shard_id());
+  DVLOG(1) << "shard:" << shard->shard_id() << ", keys " << vector(keys.begin(), keys.end());
+  DCHECK(!keys.empty());
+
+  unsigned start = 0;
+  if (args.store && keys.front() == args.dest) {
+    ++start;
+  }
+
+  if (start == keys.size())    // could be when only the dest key is hosted in this shard
+    return OpStatus::SKIPPED;  // return noop
+
+  auto& db_slice = shard->db_slice();
+  vector<ZSetSource> sources;
+  sources.reserve(keys.size() - start);
+  bool missing = false;
+
+  for (unsigned j = start; j < keys.size(); ++j) {
+    auto it_res = db_slice.Find(t->db_context(), keys[j], OBJ_ZSET);
+    if (it_res == OpStatus::WRONG_TYPE)  // TODO: support sets with default score 1.
+      return it_res.status();
+    if (!it_res) {
+      missing = true;
+      continue;
+    }
+
+    // ReverseArgIndex does not count the command name.
+    unsigned windex = t->ReverseArgIndex(shard->shard_id(), j) - (args.first_key - 1);
+    DCHECK_LT(windex, args.weights.size());
+    sources.emplace_back(it_res.value()->second, args.weights[windex]);
+  }
+
+  if (!inter) {
+    ReduceUnion(sources, args.agg_type, res);
+  } else if (!missing) {
+    ReduceInter(move(sources), args.agg_type, res);
+  }
+  return OpStatus::OK;
+}
+
+// Splits the reduction into parts by the hashes of the members.
+void Partition(unsigned num_parts, bool inter, ShardReduction* res) {
+  res->parts.resize(num_parts);
+  for (auto& part : res->parts)
+    part.reserve(res->members.size() / num_parts);
+
+  for (const auto& [member, score] : res->members)
+    res->parts[Shard(member, num_parts)].emplace_back(score, member);
+
+  // The intersection looks up the members of the other reductions, but the union only
+  // reads the parts.
+  if (!inter)
+    ScoredViewMap{}.swap(res->members);
+}
+
+template <typename F>
+void MergeUnion(const vector<ShardReduction>& reductions, unsigned part, AggType agg_type,
+                F&& emit) {
+  vector<const ShardReduction*> inputs;
+  for (const auto& res : reductions) {
+    if (res.status == OpStatus::OK)
+      inputs.push_back(&res);
+  }
+
+  // The members of a single reduction are already unique.
+  if (inputs.size() == 1) {
+    inputs.front()->ForEachInPart(part, [&](string_view member, double score) {
+      emit(member, score);
+      return true;
+    });
+    return;
+  }
+
+  ScoredViewMap merged;
+  for (const ShardReduction* res : inputs) {
+    res->ForEachInPart(part, [&](string_view member, double score) {
+      auto [it, inserted] = merged.emplace(member, score);
+      if (!inserted)
+        it->second = Aggregate(it->second, score, agg_type);
+      return true;
+    });
+  }
+
+  for (const auto& [member, score] : merged)
+    emit(member, score);
+}
+
+// Stops as soon as emit returns false.
+template <typename F>
+void MergeInter(const vector<ShardReduction>& reductions, unsigned part, AggType agg_type,
+                F&& emit) {
+  vector<const ShardReduction*> inputs;
+  for (const auto& res : reductions) {
+    if (res.status == OpStatus::OK)
+      inputs.push_back(&res);
+  }
+  if (inputs.empty())
+    return;
+
+  // Like within a shard, the smallest reduction is scanned and the others are probed.
+  auto smallest = min_element(inputs.begin(), inputs.end(), [](const auto* l, const auto* r) {
+    return l->members.size() < r->members.size();
+  });
+  swap(*smallest, inputs.front());
+
+  inputs.front()->ForEachInPart(part, [&](string_view member, double score) {
+    for (size_t i = 1; i < inputs.size(); ++i) {
+      auto it = inputs[i]->members.find(member);
+      if (it == inputs[i]->members.end())
+        return true;
+      score = Aggregate(score, it->second, agg_type);
+    }
+    return emit(member, score);
+  });
+}
+
+// How RunSetOp keeps the merged members.
+enum class MergeMode : uint8_t {
+  COUNT,  // only counts them, for ZINTERCARD.
+  VIEW,   // refers to them in place, while the transaction holds the keys.
+  COPY,   // copies them, when they must outlive the transaction or the sources.
+};
+
+// The members of one part, merged from the reductions of all the shards.
+struct MergedPart {
+  vector<ScoredMemberView> views;
+  ZSetFamily::ScoredArray copies;
+  size_t count = 0;
+};
+
+// Schedules the transaction and computes the union or the intersection of the sources in two
+// hops, neither of which copies the members of the sources. In the first, every shard reduces
+// the sources that it hosts to a single set. In the second, the members are partitioned by
+// their hashes among the shards of the transaction, and each of them merges its part of all the
+// reductions in parallel. The parts are disjoint, hence the result is their concatenation.
+// Every part stops merging after limit members. On error, the transaction is concluded.
+OpResult<vector<MergedPart>> RunSetOp(Transaction* trans, const SetOpArgs& args, bool inter,
+                                      MergeMode mode, size_t limit, bool conclude) {
+  vector<unsigned> part_of(shard_set->size(), 0);
+  unsigned num_parts = 0;
+  for (ShardId sid = 0; sid < shard_set->size(); ++sid) {
+    if (trans->IsActive(sid))
+      part_of[sid] = num_parts++;
+  }
+
+  vector<ShardReduction> reductions(shard_set->size());
+  auto reduce_cb = [&](Transaction* t, EngineShard* shard) {
+    ShardReduction* res = &reductions[shard->shard_id()];
+    res->status = OpReduce(t, shard, args, inter, res);
+    if (res->status == OpStatus::OK && num_parts > 1)
+      Partition(num_parts, inter, res);
+    return OpStatus::OK;
+  };
+
+  trans->Schedule();
+  trans->Execute(std::move(reduce_cb), false);
+
+  for (const auto& res : reductions) {
+    if (res.status != OpStatus::OK && res.status != OpStatus::SKIPPED) {
+      trans->Execute(NoOpCb, true);
+      return res.status;
+    }
+  }
+
+  vector<MergedPart> merged(num_parts);
+  auto merge_cb = [&](Transaction* t, EngineShard* shard) {
+    MergedPart* out = &merged[part_of[shard->shard_id()]];
+    auto emit = [&](string_view member, double score) {
+      if (mode == MergeMode::VIEW)
+        out->views.emplace_back(score, member);
+      else if (mode == MergeMode::COPY)
+        out->copies.emplace_back(string{member}, score);
+      return ++out->count < limit;
+    };
+
+    if (inter)
+      MergeInter(reductions, part_of[shard->shard_id()], args.agg_type, emit);
+    else
+      MergeUnion(reductions, part_of[shard->shard_id()], args.agg_type, emit);
+    return OpStatus::OK;
+  };
+
+  trans->Execute(std::move(merge_cb), conclude);
+  return std::move(merged);
+}
+
+// The geo commands keep the points as the members of sorted sets with their geohashes as
+// scores, see core/geohash.h.
+constexpr unsigned kGeoMaxCells = 32;
+constexpr double kGeoScoreEnd = double(1ULL << (kGeoStepMax * 2));
+constexpr char kGeoUnitErr[] = "unsupported unit provided. please use M, KM, FT, MI";
+constexpr char kGeoFromErr[] =
+    "exactly one of FROMMEMBER or FROMLONLAT can be specified for GEOSEARCH";
+constexpr char kGeoByErr[] = "exactly one of BYRADIUS and BYBOX can be specified for GEOSEARCH";
+
+struct GeoSearchParams {
+  optional<string_view> member;  // FROMMEMBER, otherwise the center is FROMLONLAT.
+  GeoPoint center{0, 0};
+  bool by_box = false;
+  double width = 0;  // the radius of BYRADIUS, in meters.
+  double height = 0;
+  double unit = 1;  // meters per unit.
+
+  enum Sort { NONE, ASC, DESC } sort = NONE;
+  uint64_t count = 0;  // 0 when there is no COUNT.
+  bool any = false;
+  bool with_coord = false;
+  bool with_dist = false;
+  bool with_hash = false;
+};
+
+struct GeoResult {
+  string member;
+  double dist;
+  uint64_t hash;
+};
+
+// Returns the meters per unit or 0 if the unit is not supported. Requires: upper-case unit.
+double GeoUnit(string_view unit) {
+  if (unit == "M")
+    return 1;
+  if (unit == "KM")
+    return 1000;
+  if (unit == "FT")
+    return 0.3048;
+  if (unit == "MI")
+    return 1609.34;
+  return 0;
+}
+
+// Scores that were not set by GEOADD are decoded as the nearest valid hash.
+uint64_t GeoScoreHash(double score) {
+  return uint64_t(clamp(score, 0.0, kGeoScoreEnd - 1));
+}
+
+string GeoDistStr(double dist) {
+  return absl::StrFormat("%.4f", dist);
+}
+
+// Calls cb(member, score) for the members of cell, for as long as cb returns true.
+template <typename F> bool ScanGeoCell(const SortedMap* sm, const GeoShape::Cell& cell, F&& cb) {
+  zrangespec range;
+  range.min = cell.min;
+  range.max = cell.max;
+  range.minex = 0;
+  range.maxex = 1;
+
+  for (auto it = sm->FirstInRange(range).first; !it.IsEnd() && it->score < range.max; ++it) {
+    if (!cb(string_view{it->member, sdslen(it->member)}, it->score))
+      return false;
+  }
+  return true;
+}
+
+// Scans the cells that cover the shape rather than the whole set. With COUNT n in ascending
+// order, the cells are scanned by their distance from the center and the scan stops at the
+// first cell that is farther than the n nearest points that were found so far. With ANY it
+// stops at the first n points.
+OpResult<vector<GeoResult>> OpGeoSearch(const OpArgs& op_args, string_view key,
+                                        const GeoSearchParams& params) {
+  OpResult<PrimeIterator> it_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_ZSET);
+  if (!it_res)
+    return it_res.status();
+
+  const PrimeValue& pv = it_res.value()->second;
+  ZSetSource source(pv, 1);
+  GeoPoint center = params.center;
+  if (params.member) {
+    optional<double> score = source.Find(*params.member);
+    if (!score)
+      return OpStatus::INVALID_VALUE;
+    center = GeoDecode(GeoScoreHash(*score));
+  }
+
+  GeoShape shape = params.by_box ? GeoShape::Box(center, params.width, params.height)
+                                 : GeoShape::Radius(center, params.width);
+  bool nearest = params.count && !params.any && params.sort == GeoSearchParams::ASC;
+  auto by_dist = [](const GeoResult& a, const GeoResult& b) { return a.dist < b.dist; };
+
+  vector<GeoResult> res;
+  auto add = [&](string_view member, double score) {
+    if (!(score >= 0 && score < kGeoScoreEnd))
+      return true;
+
+    uint64_t hash = score;
+    optional<double> dist = shape.Distance(GeoDecode(hash));
+    if (!dist)
+      return true;
+
+    // Keeps a max-heap of the count nearest points.
+    if (nearest && res.size() == params.count) {
+      if (*dist >= res.front().dist)
+        return true;
+      pop_heap(res.begin(), res.end(), by_dist);
+      res.back() = GeoResult{string{member}, *dist, hash};
+    } else {
+      res.push_back(GeoResult{string{member}, *dist, hash});
+    }
+    if (nearest)
+      push_heap(res.begin(), res.end(), by_dist);
+
+    return !params.any || res.size() < params.count;
+  };
+
+  if (pv.Encoding() == kEncodingSortedMap) {
+    const SortedMap* sm = GetSortedMap(pv.AsRObj());
+    vector<GeoShape::Cell> cells = shape.Cover(kGeoMaxCells);
+
+    if (nearest) {
+      sort(cells.begin(), cells.end(), [](const auto& a, const auto& b) {
+        return a.min_dist < b.min_dist;
+      });
+      for (const GeoShape::Cell& cell : cells) {
+        if (res.size() == params.count && cell.min_dist > res.front().dist)
+          break;
+        ScanGeoCell(sm, cell, add);
+      }
+    } else {
+      GeoShape::MergeAdjacent(&cells);
+      for (const GeoShape::Cell& cell : cells) {
+        if (!ScanGeoCell(sm, cell, add))
+          break;
+      }
+    }
+  } else {
+    // Listpacks are small enough to be scanned at once.
+    deque<string> ints;
+    source.ForEach(&ints, add);
+  }
+
+  if (params.sort == GeoSearchParams::ASC) {
+    sort(res.begin(), res.end(), by_dist);
+  } else if (params.sort == GeoSearchParams::DESC) {
+    sort(res.begin(), res.end(), [](const auto& a, const auto& b) { return a.dist > b.dist; });
+  }
+  if (params.count && res.size() > params.count)
+    res.resize(params.count);
+
+  return res;
+}
+
+void SendGeoResults(const vector<GeoResult>& results, const GeoSearchParams& params,
+                    ConnectionContext* cntx) {
+  unsigned num_fields = params.with_dist + params.with_hash + params.with_coord;
+  (*cntx)->StartArray(results.size());
+
+  for (const GeoResult& result : results) {
+    if (num_fields == 0) {
+      (*cntx)->SendBulkString(result.member);
+      continue;
+    }
+
+    (*cntx)->StartArray(num_fields + 1);
+    (*cntx)->SendBulkString(result.member);
+    if (params.with_dist)
+      (*cntx)->SendBulkString(GeoDistStr(result.dist / params.unit));
+    if (params.with_hash)
+      (*cntx)->SendLong(result.hash);
+    if (params.with_coord) {
+      GeoPoint point = GeoDecode(result.hash);
+      (*cntx)->StartArray(2);
+      (*cntx)->SendDouble(point.lon);
+      (*cntx)->SendDouble(point.lat);
+    }
+  }
+}
+
 }  // namespace
 
 void ZSetFamily::ZAdd(CmdArgList args, ConnectionContext* cntx) {
@@ -1032,7 +1411,7 @@ void ZSetFamily::ZCard(CmdArgList args, ConnectionContext* cntx) {
       return find_res.status();
     }
 
-    return zsetLength(find_res.value()->second.AsRObj());
+    return find_res.value()->second.Size();
   };
 
   OpResult<uint32_t> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
@@ -1106,69 +1485,46 @@ void ZSetFamily::ZIncrBy(CmdArgList args, ConnectionContext* cntx) {
   (*cntx)->SendDouble(add_result->new_score);
 }
 
-void ZSetFamily::ZInterStore(CmdArgList args, ConnectionContext* cntx) {
-  string_view dest_key = ArgS(args, 1);
-  OpResult<StoreArgs> store_args_res = ParseStoreArgs(args);
-
-  if (!store_args_res) {
-    switch (store_args_res.status()) {
-      case OpStatus::INVALID_FLOAT:
-        return (*cntx)->SendError("weight value is not a float", kSyntaxErrType);
-      default:
-        return (*cntx)->SendError(store_args_res.status());
-    }
-  }
-  const auto& store_args = *store_args_res;
-  if (store_args.num_keys == 0) {
-    return SendAtLeastOneKeyError(cntx);
-  }
-
-  vector<OpResult<ScoredMap>> maps(shard_set->size(), OpStatus::SKIPPED);
-
-  auto cb = [&](Transaction* t, EngineShard* shard) {
-    maps[shard->shard_id()] =
-        OpInter(shard, t, dest_key, store_args.agg_type, store_args.weights, false);
-    return OpStatus::OK;
-  };
-
-  cntx->transaction->Schedule();
-  cntx->transaction->Execute(std::move(cb), false);
-
-  ScoredMap result;
-  for (auto& op_res : maps) {
-    if (op_res.status() == OpStatus::SKIPPED)
-      continue;
+void ZSetFamily::ZInter(CmdArgList args, ConnectionContext* cntx) {
+  ZUnionInterGeneric(args, true, cntx);
+}
 
-    if (!op_res)
-      return (*cntx)->SendError(op_res.status());
+void ZSetFamily::ZInterCard(CmdArgList args, ConnectionContext* cntx) {
+  SetOpArgs op_args;
 
-    if (result.empty())
-      result.swap(op_res.value());
-    else
-      InterScoredMap(&result, &op_res.value(), store_args.agg_type);
-    if (result.empty())
-      break;
+  // we parsed the structure before, when transaction has been initialized.
+  CHECK(absl::SimpleAtoi(ArgS(args, 1), &op_args.num_keys));
+  if (op_args.num_keys == 0) {
+    return (*cntx)->SendError("numkeys should be greater than 0");
   }
+  op_args.first_key = 2;
+  op_args.weights.resize(op_args.num_keys, 1);
 
-  ShardId dest_shard = Shard(dest_key, maps.size());
-  AddResult add_result;
-  vector<ScoredMemberView> smvec;
-  for (const auto& elem : result) {
-    smvec.emplace_back(elem.second, elem.first);
+  uint64_t limit = 0;
+  for (size_t i = op_args.first_key + op_args.num_keys; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    if (ArgS(args, i) != "LIMIT" || i + 1 == args.size()) {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+    if (!absl::SimpleAtoi(ArgS(args, ++i), &limit)) {
+      return (*cntx)->SendError("LIMIT can't be negative");
+    }
   }
 
-  auto store_cb = [&](Transaction* t, EngineShard* shard) {
-    if (shard->shard_id() == dest_shard) {
-      ZParams zparams;
-      zparams.override = true;
-      add_result = OpAdd(t->GetOpArgs(shard), zparams, dest_key, ScoredMemberSpan{smvec}).value();
-    }
-    return OpStatus::OK;
-  };
+  size_t max_count = limit ? limit : numeric_limits<size_t>::max();
+  OpResult<vector<MergedPart>> merged =
+      RunSetOp(cntx->transaction, op_args, true, MergeMode::COUNT, max_count, true);
+  if (!merged)
+    return (*cntx)->SendError(merged.status());
 
-  cntx->transaction->Execute(std::move(store_cb), true);
+  size_t count = 0;
+  for (const auto& part : *merged)
+    count += part.count;
+  (*cntx)->SendLong(min(count, max_count));
+}
 
-  (*cntx)->SendLong(smvec.size());
+void ZSetFamily::ZInterStore(CmdArgList args, ConnectionContext* cntx) {
+  ZUnionInterStoreGeneric(args, true, cntx);
 }
 
 void ZSetFamily::ZPopMax(CmdArgList args, ConnectionContext* cntx) {
@@ -1434,12 +1790,20 @@ void ZSetFamily::ZScan(CmdArgList args, ConnectionContext* cntx) {
     return (*cntx)->SendError("invalid cursor");
   }
 
-  if (args.size() > 3) {
-    return (*cntx)->SendError("scan options are not supported yet");
+  // ZSCAN key cursor [MATCH pattern] [COUNT count]
+  if (args.size() > 7) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  OpResult<ScanOpts> ops = ScanOpts::TryFrom(args.subspan(3));
+  if (!ops) {
+    return (*cntx)->SendError(ops.status());
   }
 
+  ScanOpts scan_op = ops.value();
+
   auto cb = [&](Transaction* t, EngineShard* shard) {
-    return OpScan(t->GetOpArgs(shard), key, &cursor);
+    return OpScan(t->GetOpArgs(shard), key, &cursor, scan_op);
   };
 
   OpResult<StringVec> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
@@ -1455,60 +1819,342 @@ void ZSetFamily::ZScan(CmdArgList args, ConnectionContext* cntx) {
   }
 }
 
+void ZSetFamily::ZUnion(CmdArgList args, ConnectionContext* cntx) {
+  ZUnionInterGeneric(args, false, cntx);
+}
+
 void ZSetFamily::ZUnionStore(CmdArgList args, ConnectionContext* cntx) {
-  string_view dest_key = ArgS(args, 1);
-  OpResult<StoreArgs> store_args_res = ParseStoreArgs(args);
-
-  if (!store_args_res) {
-    switch (store_args_res.status()) {
-      case OpStatus::INVALID_FLOAT:
-        return (*cntx)->SendError("weight value is not a float", kSyntaxErrType);
-      default:
-        return (*cntx)->SendError(store_args_res.status());
-    }
+  ZUnionInterStoreGeneric(args, false, cntx);
+}
+
+void ZSetFamily::ZUnionInterGeneric(CmdArgList args, bool inter, ConnectionContext* cntx) {
+  OpResult<SetOpArgs> op_args = ParseSetOpArgs(args, false);
+  if (!op_args) {
+    return SendSetOpArgsError(op_args.status(), cntx);
   }
-  const auto& store_args = *store_args_res;
-  if (store_args.num_keys == 0) {
+  if (op_args->num_keys == 0) {
     return SendAtLeastOneKeyError(cntx);
   }
 
-  vector<OpResult<ScoredMap>> maps(shard_set->size());
+  OpResult<vector<MergedPart>> merged = RunSetOp(cntx->transaction, *op_args, inter,
+                                                 MergeMode::COPY, numeric_limits<size_t>::max(),
+                                                 true);
+  if (!merged)
+    return (*cntx)->SendError(merged.status());
 
-  auto cb = [&](Transaction* t, EngineShard* shard) {
-    maps[shard->shard_id()] =
-        OpUnion(shard, t, dest_key, store_args.agg_type, store_args.weights, false);
-    return OpStatus::OK;
-  };
+  size_t count = 0;
+  for (const auto& part : *merged)
+    count += part.count;
 
-  cntx->transaction->Schedule();
+  ScoredArray result;
+  result.reserve(count);
+  for (auto& part : *merged)
+    move(part.copies.begin(), part.copies.end(), back_inserter(result));
 
-  cntx->transaction->Execute(std::move(cb), false);
-  ScoredMap result;
+  sort(result.begin(), result.end(), [](const ScoredMember& l, const ScoredMember& r) {
+    return l.second != r.second ? l.second < r.second : l.first < r.first;
+  });
 
-  for (auto& op_res : maps) {
-    if (!op_res)
-      return (*cntx)->SendError(op_res.status());
-    UnionScoredMap(&result, &op_res.value(), store_args.agg_type);
+  RangeParams params;
+  params.with_scores = op_args->with_scores;
+  OutputScoredArrayResult(std::move(result), params, cntx);
+}
+
+void ZSetFamily::ZUnionInterStoreGeneric(CmdArgList args, bool inter, ConnectionContext* cntx) {
+  OpResult<SetOpArgs> op_args = ParseSetOpArgs(args, true);
+  if (!op_args) {
+    return SendSetOpArgsError(op_args.status(), cntx);
+  }
+  if (op_args->num_keys == 0) {
+    return SendAtLeastOneKeyError(cntx);
   }
-  ShardId dest_shard = Shard(dest_key, maps.size());
-  AddResult add_result;
-  vector<ScoredMemberView> smvec;
-  for (const auto& elem : result) {
-    smvec.emplace_back(elem.second, elem.first);
+
+  // The destination is overwritten in the last hop, so the members are copied if it is
+  // one of the sources.
+  string_view dest_key = op_args->dest;
+  MergeMode mode = MergeMode::VIEW;
+  for (unsigned i = 0; i < op_args->num_keys; ++i) {
+    if (ArgS(args, op_args->first_key + i) == dest_key)
+      mode = MergeMode::COPY;
   }
 
+  OpResult<vector<MergedPart>> merged = RunSetOp(cntx->transaction, *op_args, inter, mode,
+                                                 numeric_limits<size_t>::max(), false);
+  if (!merged)
+    return (*cntx)->SendError(merged.status());
+
+  ShardId dest_shard = Shard(dest_key, shard_set->size());
+  size_t stored = 0;
+
   auto store_cb = [&](Transaction* t, EngineShard* shard) {
-    if (shard->shard_id() == dest_shard) {
-      ZParams zparams;
-      zparams.override = true;
-      add_result = OpAdd(t->GetOpArgs(shard), zparams, dest_key, ScoredMemberSpan{smvec}).value();
+    if (shard->shard_id() != dest_shard)
+      return OpStatus::OK;
+
+    vector<ScoredMemberView> smvec;
+    for (const auto& part : *merged) {
+      smvec.insert(smvec.end(), part.views.begin(), part.views.end());
+      for (const auto& [member, score] : part.copies)
+        smvec.emplace_back(score, member);
     }
+
+    ZParams zparams;
+    zparams.override = true;
+    OpAdd(t->GetOpArgs(shard), zparams, dest_key, ScoredMemberSpan{smvec});
+    stored = smvec.size();
     return OpStatus::OK;
   };
 
   cntx->transaction->Execute(std::move(store_cb), true);
 
-  (*cntx)->SendLong(smvec.size());
+  (*cntx)->SendLong(stored);
+}
+
+void ZSetFamily::GeoAdd(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+
+  ZParams zparams;
+  size_t i = 2;
+  for (; i < args.size() - 1; ++i) {
+    ToUpper(&args[i]);
+
+    string_view cur_arg = ArgS(args, i);
+
+    if (cur_arg == "XX") {
+      zparams.flags |= ZADD_IN_XX;
+    } else if (cur_arg == "NX") {
+      zparams.flags |= ZADD_IN_NX;
+    } else if (cur_arg == "CH") {
+      zparams.ch = true;
+    } else {
+      break;
+    }
+  }
+
+  if (i == args.size() || (args.size() - i) % 3 != 0) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  if ((zparams.flags & ZADD_IN_NX) && (zparams.flags & ZADD_IN_XX)) {
+    return (*cntx)->SendError(kNxXxErr);
+  }
+
+  absl::InlinedVector<ScoredMemberView, 4> members;
+  for (; i < args.size(); i += 3) {
+    GeoPoint point;
+    if (!ParseDouble(ArgS(args, i), &point.lon) || !ParseDouble(ArgS(args, i + 1), &point.lat)) {
+      return (*cntx)->SendError(kInvalidFloatErr);
+    }
+    if (!GeoValid(point)) {
+      return (*cntx)->SendError(
+          absl::StrFormat("invalid longitude,latitude pair %f,%f", point.lon, point.lat));
+    }
+    members.emplace_back(GeoEncode(point), ArgS(args, i + 2));
+  }
+
+  absl::Span memb_sp{members.data(), members.size()};
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpAdd(t->GetOpArgs(shard), zparams, key, memb_sp);
+  };
+
+  OpResult<AddResult> add_result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (base::_in(add_result.status(), {OpStatus::WRONG_TYPE, OpStatus::OUT_OF_MEMORY})) {
+    return (*cntx)->SendError(add_result.status());
+  }
+
+  // KEY_NOTFOUND may happen in case of XX flag.
+  if (add_result.status() == OpStatus::KEY_NOTFOUND) {
+    return (*cntx)->SendLong(0);
+  }
+  (*cntx)->SendLong(add_result->num_updated);
+}
+
+void ZSetFamily::GeoHash(CmdArgList args, ConnectionContext* cntx) {
+  OpResult<MScoreResponse> result = GeoMScore(args.subspan(1), cntx);
+  if (!result) {
+    return (*cntx)->SendError(result.status());
+  }
+
+  (*cntx)->StartArray(result->size());
+  for (const auto& score : *result) {
+    if (score) {
+      (*cntx)->SendBulkString(GeoHashString(GeoDecode(GeoScoreHash(*score))));
+    } else {
+      (*cntx)->SendNull();
+    }
+  }
+}
+
+void ZSetFamily::GeoPos(CmdArgList args, ConnectionContext* cntx) {
+  OpResult<MScoreResponse> result = GeoMScore(args.subspan(1), cntx);
+  if (!result) {
+    return (*cntx)->SendError(result.status());
+  }
+
+  (*cntx)->StartArray(result->size());
+  for (const auto& score : *result) {
+    if (score) {
+      GeoPoint point = GeoDecode(GeoScoreHash(*score));
+      (*cntx)->StartArray(2);
+      (*cntx)->SendDouble(point.lon);
+      (*cntx)->SendDouble(point.lat);
+    } else {
+      (*cntx)->SendNullArray();
+    }
+  }
+}
+
+void ZSetFamily::GeoDist(CmdArgList args, ConnectionContext* cntx) {
+  double unit = 1;
+  if (args.size() == 5) {
+    ToUpper(&args[4]);
+    unit = GeoUnit(ArgS(args, 4));
+    if (unit == 0)
+      return (*cntx)->SendError(kGeoUnitErr);
+  } else if (args.size() != 4) {
+    return (*cntx)->SendError(kSyntaxErr);
+  }
+
+  OpResult<MScoreResponse> result = GeoMScore(args.subspan(1, 3), cntx);
+  if (!result) {
+    return (*cntx)->SendError(result.status());
+  }
+
+  const MScoreResponse& scores = *result;
+  if (!scores[0] || !scores[1]) {
+    return (*cntx)->SendNull();
+  }
+
+  double dist = GeoDistance(GeoDecode(GeoScoreHash(*scores[0])),
+                            GeoDecode(GeoScoreHash(*scores[1])));
+  (*cntx)->SendBulkString(GeoDistStr(dist / unit));
+}
+
+void ZSetFamily::GeoSearch(CmdArgList args, ConnectionContext* cntx) {
+  string_view key = ArgS(args, 1);
+  GeoSearchParams params;
+  bool from_lonlat = false, by_radius = false;
+
+  for (size_t i = 2; i < args.size(); ++i) {
+    ToUpper(&args[i]);
+    string_view cur_arg = ArgS(args, i);
+    size_t remaining = args.size() - i - 1;
+
+    if (cur_arg == "FROMMEMBER" && remaining >= 1) {
+      if (params.member || from_lonlat)
+        return (*cntx)->SendError(kGeoFromErr);
+      params.member = ArgS(args, ++i);
+    } else if (cur_arg == "FROMLONLAT" && remaining >= 2) {
+      if (params.member || from_lonlat)
+        return (*cntx)->SendError(kGeoFromErr);
+      GeoPoint& point = params.center;
+      if (!ParseDouble(ArgS(args, i + 1), &point.lon) ||
+          !ParseDouble(ArgS(args, i + 2), &point.lat)) {
+        return (*cntx)->SendError(kInvalidFloatErr);
+      }
+      if (!GeoValid(point)) {
+        return (*cntx)->SendError(
+            absl::StrFormat("invalid longitude,latitude pair %f,%f", point.lon, point.lat));
+      }
+      from_lonlat = true;
+      i += 2;
+    } else if ((cur_arg == "BYRADIUS" && remaining >= 2) ||
+               (cur_arg == "BYBOX" && remaining >= 3)) {
+      if (by_radius || params.by_box)
+        return (*cntx)->SendError(kGeoByErr);
+      params.by_box = cur_arg == "BYBOX";
+      by_radius = !params.by_box;
+
+      if (!ParseDouble(ArgS(args, i + 1), &params.width) ||
+          (params.by_box && !ParseDouble(ArgS(args, i + 2), &params.height))) {
+        return (*cntx)->SendError("need numeric radius");
+      }
+      if (params.width < 0 || params.height < 0) {
+        return (*cntx)->SendError(params.by_box ? "height or width cannot be negative"
+                                                : "radius cannot be negative");
+      }
+
+      i += params.by_box ? 3 : 2;
+      ToUpper(&args[i]);
+      params.unit = GeoUnit(ArgS(args, i));
+      if (params.unit == 0)
+        return (*cntx)->SendError(kGeoUnitErr);
+      params.width *= params.unit;
+      params.height *= params.unit;
+    } else if (cur_arg == "ASC") {
+      params.sort = GeoSearchParams::ASC;
+    } else if (cur_arg == "DESC") {
+      params.sort = GeoSearchParams::DESC;
+    } else if (cur_arg == "COUNT" && remaining >= 1) {
+      int64_t count;
+      if (!SimpleAtoi(ArgS(args, ++i), &count))
+        return (*cntx)->SendError(kInvalidIntErr);
+      if (count <= 0)
+        return (*cntx)->SendError("COUNT must be > 0");
+      params.count = count;
+
+      if (remaining >= 2) {
+        ToUpper(&args[i + 1]);
+        if (ArgS(args, i + 1) == "ANY") {
+          params.any = true;
+          ++i;
+        }
+      }
+    } else if (cur_arg == "WITHCOORD") {
+      params.with_coord = true;
+    } else if (cur_arg == "WITHDIST") {
+      params.with_dist = true;
+    } else if (cur_arg == "WITHHASH") {
+      params.with_hash = true;
+    } else {
+      return (*cntx)->SendError(kSyntaxErr);
+    }
+  }
+
+  if (!params.member && !from_lonlat)
+    return (*cntx)->SendError(kGeoFromErr);
+  if (!by_radius && !params.by_box)
+    return (*cntx)->SendError(kGeoByErr);
+  if (params.any && !params.count)
+    return (*cntx)->SendError("the ANY argument requires COUNT argument");
+
+  // As in redis, the nearest points are returned when there is a COUNT.
+  if (params.count && !params.any && params.sort == GeoSearchParams::NONE)
+    params.sort = GeoSearchParams::ASC;
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpGeoSearch(t->GetOpArgs(shard), key, params);
+  };
+
+  OpResult<vector<GeoResult>> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result.status() == OpStatus::KEY_NOTFOUND) {
+    return (*cntx)->SendEmptyArray();
+  }
+  if (result.status() == OpStatus::INVALID_VALUE) {
+    return (*cntx)->SendError("could not decode requested zset member");
+  }
+  if (!result) {
+    return (*cntx)->SendError(result.status());
+  }
+  SendGeoResults(*result, params, cntx);
+}
+
+OpResult<ZSetFamily::MScoreResponse> ZSetFamily::GeoMScore(CmdArgList args,
+                                                           ConnectionContext* cntx) {
+  string_view key = ArgS(args, 0);
+
+  absl::InlinedVector<string_view, 8> members(args.size() - 1);
+  for (size_t i = 1; i < args.size(); ++i) {
+    members[i - 1] = ArgS(args, i);
+  }
+
+  auto cb = [&](Transaction* t, EngineShard* shard) {
+    return OpMScore(t->GetOpArgs(shard), key, members);
+  };
+
+  OpResult<MScoreResponse> result = cntx->transaction->ScheduleSingleHopT(std::move(cb));
+  if (result.status() == OpStatus::KEY_NOTFOUND)
+    return MScoreResponse(members.size());
+  return result;
 }
 
 void ZSetFamily::ZRangeByScoreInternal(CmdArgList args, bool reverse, ConnectionContext* cntx) {
@@ -1667,7 +2313,7 @@ void ZSetFamily::ZPopMinMax(CmdArgList args, bool reverse, ConnectionContext* cn
 }
 
 OpResult<StringVec> ZSetFamily::OpScan(const OpArgs& op_args, std::string_view key,
-                                       uint64_t* cursor) {
+                                       uint64_t* cursor, const ScanOpts& scan_op) {
   OpResult<PrimeIterator> find_res = op_args.shard->db_slice().Find(op_args.db_cntx, key, OBJ_ZSET);
 
   if (!find_res)
@@ -1678,48 +2324,32 @@ OpResult<StringVec> ZSetFamily::OpScan(const OpArgs& op_args, std::string_view k
   robj* zobj = it->second.AsRObj();
   char buf[128];
 
+  // Both encodings report about scan_op.limit members per call, in the order of their hashes,
+  // so the cursor stays valid when the listpack turns into a SortedMap.
   if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
-    RangeParams params;
-    IntervalVisitor iv{Action::RANGE, params, zobj};
-
-    iv(IndexInterval{0, kuint32max});
-    ScoredArray arr = iv.PopResult();
-    res.resize(arr.size() * 2);
-
-    for (size_t i = 0; i < arr.size(); ++i) {
-      char* str = RedisReplyBuilder::FormatDouble(arr[i].second, buf, sizeof(buf));
-
-      res[2 * i] = std::move(arr[i].first);
-      res[2 * i + 1].assign(str);
-    }
-    *cursor = 0;
+    uint8_t* zl = (uint8_t*)zobj->ptr;
+    uint8_t intbuf[LP_INTBUF_SIZE];
+
+    *cursor = container_utils::ScanListpackPairs(zl, *cursor, scan_op.limit, [&](uint8_t* p) {
+      int64_t len;
+      uint8_t* str = lpGet(p, &len, intbuf);
+      string_view member{reinterpret_cast<char*>(str), size_t(len)};
+      if (scan_op.Matches(member)) {
+        res.emplace_back(member);
+        res.emplace_back(RedisReplyBuilder::FormatDouble(zzlGetScore(lpNext(zl, p)), buf,
+                                                         sizeof(buf)));
+      }
+    });
   } else {
-    CHECK_EQ(unsigned(OBJ_ENCODING_SKIPLIST), zobj->encoding);
-    uint32_t count = 20;
-    zset* zs = (zset*)zobj->ptr;
-
-    dict* ht = zs->dict;
-    long maxiterations = count * 10;
-
-    struct ScanArgs {
-      char* sbuf;
-      StringVec* res;
-    } sargs = {buf, &res};
-
-    auto scanCb = [](void* privdata, const dictEntry* de) {
-      ScanArgs* sargs = (ScanArgs*)privdata;
-
-      sds key = (sds)de->key;
-      double score = *(double*)dictGetVal(de);
-
-      sargs->res->emplace_back(key, sdslen(key));
-      char* str = RedisReplyBuilder::FormatDouble(score, sargs->sbuf, sizeof(buf));
-      sargs->res->emplace_back(str);
-    };
+    CHECK_EQ(kEncodingSortedMap, zobj->encoding);
 
-    do {
-      *cursor = dictScan(ht, *cursor, scanCb, NULL, &sargs);
-    } while (*cursor && maxiterations-- && res.size() < count);
+    *cursor = GetSortedMap(zobj)->Scan(*cursor, scan_op.limit, [&](sds member, double score) {
+      string_view str{member, sdslen(member)};
+      if (scan_op.Matches(str)) {
+        res.emplace_back(str);
+        res.emplace_back(RedisReplyBuilder::FormatDouble(score, buf, sizeof(buf)));
+      }
+    });
   }
 
   return res;
@@ -1736,10 +2366,14 @@ OpResult<unsigned> ZSetFamily::OpRem(const OpArgs& op_args, string_view key, Arg
   sds& tmp_str = op_args.shard->tmp_str1;
   unsigned deleted = 0;
   for (string_view member : members) {
-    tmp_str = sdscpylen(tmp_str, member.data(), member.size());
-    deleted += zsetDel(zobj, tmp_str);
+    if (zobj->encoding == kEncodingSortedMap) {
+      deleted += GetSortedMap(zobj)->Delete(member);
+    } else {
+      tmp_str = sdscpylen(tmp_str, member.data(), member.size());
+      deleted += zsetDel(zobj, tmp_str);
+    }
   }
-  auto zlen = zsetLength(zobj);
+  auto zlen = ZsetLength(zobj);
   res_it.value()->second.SyncRObj();
   db_slice.PostUpdate(op_args.db_cntx.db_index, *res_it, key);
 
@@ -1756,14 +2390,19 @@ OpResult<double> ZSetFamily::OpScore(const OpArgs& op_args, string_view key, str
     return res_it.status();
 
   robj* zobj = res_it.value()->second.AsRObj();
-  sds& tmp_str = op_args.shard->tmp_str1;
-  tmp_str = sdscpylen(tmp_str, member.data(), member.size());
-  double score;
-  int retval = zsetScore(zobj, tmp_str, &score);
-  if (retval != C_OK) {
-    return OpStatus::KEY_NOTFOUND;
+  if (zobj->encoding == kEncodingSortedMap) {
+    optional<double> score = GetSortedMap(zobj)->GetScore(member);
+    if (!score)
+      return OpStatus::KEY_NOTFOUND;
+    return *score;
   }
-  return score;
+
+  DCHECK_EQ(OBJ_ENCODING_LISTPACK, zobj->encoding);
+  uint8_t* zl = (uint8_t*)zobj->ptr;
+  uint8_t* eptr = container_utils::LpFindKey(zl, member);
+  if (!eptr)
+    return OpStatus::KEY_NOTFOUND;
+  return zzlGetScore(lpNext(zl, eptr));
 }
 
 OpResult<ZSetFamily::MScoreResponse> ZSetFamily::OpMScore(const OpArgs& op_args, string_view key,
@@ -1775,19 +2414,20 @@ OpResult<ZSetFamily::MScoreResponse> ZSetFamily::OpMScore(const OpArgs& op_args,
   MScoreResponse scores(members.size());
 
   robj* zobj = res_it.value()->second.AsRObj();
-  sds& tmp_str = op_args.shard->tmp_str1;
+  if (zobj->encoding == kEncodingSortedMap) {
+    for (size_t i = 0; i < members.size(); i++)
+      scores[i] = GetSortedMap(zobj)->GetScore(members[i]);
+    return scores;
+  }
 
+  // Resolves all the members in a single pass over the listpack.
+  DCHECK_EQ(OBJ_ENCODING_LISTPACK, zobj->encoding);
+  uint8_t* zl = (uint8_t*)zobj->ptr;
+  vector<uint8_t*> entries(members.size());
+  container_utils::LpFindKeys(zl, members, entries.data());
   for (size_t i = 0; i < members.size(); i++) {
-    const auto& m = members[i];
-
-    tmp_str = sdscpylen(tmp_str, m.data(), m.size());
-    double score;
-    int retval = zsetScore(zobj, tmp_str, &score);
-    if (retval == C_OK) {
-      scores[i] = score;
-    } else {
-      scores[i] = std::nullopt;
-    }
+    if (entries[i])
+      scores[i] = zzlGetScore(lpNext(zl, entries[i]));
   }
 
   return scores;
@@ -1810,7 +2450,7 @@ auto ZSetFamily::OpPopCount(const ZRangeSpec& range_spec, const OpArgs& op_args,
   res_it.value()->second.SyncRObj();
   db_slice.PostUpdate(op_args.db_cntx.db_index, *res_it, key);
 
-  auto zlen = zsetLength(zobj);
+  auto zlen = ZsetLength(zobj);
   if (zlen == 0) {
     CHECK(op_args.shard->db_slice().Del(op_args.db_cntx.db_index, res_it.value()));
   }
@@ -1849,7 +2489,7 @@ OpResult<unsigned> ZSetFamily::OpRemRange(const OpArgs& op_args, string_view key
   res_it.value()->second.SyncRObj();
   db_slice.PostUpdate(op_args.db_cntx.db_index, *res_it, key);
 
-  auto zlen = zsetLength(zobj);
+  auto zlen = ZsetLength(zobj);
   if (zlen == 0) {
     CHECK(op_args.shard->db_slice().Del(op_args.db_cntx.db_index, res_it.value()));
   }
@@ -1864,6 +2504,13 @@ OpResult<unsigned> ZSetFamily::OpRank(const OpArgs& op_args, string_view key, st
     return res_it.status();
 
   robj* zobj = res_it.value()->second.AsRObj();
+  if (zobj->encoding == kEncodingSortedMap) {
+    optional<size_t> rank = GetSortedMap(zobj)->GetRank(member, reverse);
+    if (!rank)
+      return OpStatus::KEY_NOTFOUND;
+    return *rank;
+  }
+
   op_args.shard->tmp_str1 = sdscpylen(op_args.shard->tmp_str1, member.data(), member.size());
 
   long res = zsetRank(zobj, op_args.shard->tmp_str1, reverse);
@@ -1914,30 +2561,16 @@ OpResult<unsigned> ZSetFamily::OpCount(const OpArgs& op_args, std::string_view k
       }
     }
   } else {
-    CHECK_EQ(unsigned(OBJ_ENCODING_SKIPLIST), zobj->encoding);
-    zset* zs = (zset*)zobj->ptr;
-    zskiplist* zsl = zs->zsl;
-    zskiplistNode* zn;
-    unsigned long rank;
+    CHECK_EQ(kEncodingSortedMap, zobj->encoding);
+    const SortedMap* sm = GetSortedMap(zobj);
 
-    /* Find first element in range */
-    zn = zslFirstInRange(zsl, &range);
-
-    /* Use rank of first element, if any, to determine preliminary count */
-    if (zn == NULL)
+    auto first = sm->FirstInRange(range);
+    if (first.first.IsEnd())
       return 0;
 
-    rank = zslGetRank(zsl, zn->score, zn->ele);
-    count = (zsl->length - (rank - 1));
-
-    /* Find last element in range */
-    zn = zslLastInRange(zsl, &range);
-
-    /* Use rank of last element, if any, to determine the actual count */
-    if (zn != NULL) {
-      rank = zslGetRank(zsl, zn->score, zn->ele);
-      count -= (zsl->length - rank);
-    }
+    auto last = sm->LastInRange(range);
+    DCHECK(!last.first.IsEnd());
+    count = last.second - first.second + 1;
   }
 
   return count;
@@ -1977,28 +2610,14 @@ OpResult<unsigned> ZSetFamily::OpLexCount(const OpArgs& op_args, string_view key
       }
     }
   } else {
-    DCHECK_EQ(OBJ_ENCODING_SKIPLIST, zobj->encoding);
-    zset* zs = (zset*)zobj->ptr;
-    zskiplist* zsl = zs->zsl;
-    zskiplistNode* zn;
-    unsigned long rank;
-
-    /* Find first element in range */
-    zn = zslFirstInLexRange(zsl, &range);
-
-    /* Use rank of first element, if any, to determine preliminary count */
-    if (zn != NULL) {
-      rank = zslGetRank(zsl, zn->score, zn->ele);
-      count = (zsl->length - (rank - 1));
-
-      /* Find last element in range */
-      zn = zslLastInLexRange(zsl, &range);
-
-      /* Use rank of last element, if any, to determine the actual count */
-      if (zn != NULL) {
-        rank = zslGetRank(zsl, zn->score, zn->ele);
-        count -= (zsl->length - rank);
-      }
+    DCHECK_EQ(kEncodingSortedMap, zobj->encoding);
+    const SortedMap* sm = GetSortedMap(zobj);
+
+    auto first = sm->FirstInLexRange(range);
+    if (!first.first.IsEnd()) {
+      auto last = sm->LastInLexRange(range);
+      DCHECK(!last.first.IsEnd());
+      count = last.second - first.second + 1;
     }
   }
 
@@ -2010,11 +2629,14 @@ OpResult<unsigned> ZSetFamily::OpLexCount(const OpArgs& op_args, string_view key
 
 void ZSetFamily::Register(CommandRegistry* registry) {
   constexpr uint32_t kUnionMask = CO::WRITE | CO::VARIADIC_KEYS | CO::REVERSE_MAPPING;
+  constexpr uint32_t kReadUnionMask = CO::READONLY | CO::VARIADIC_KEYS | CO::REVERSE_MAPPING;
 
   *registry << CI{"ZADD", CO::FAST | CO::WRITE | CO::DENYOOM, -4, 1, 1, 1}.HFUNC(ZAdd)
             << CI{"ZCARD", CO::FAST | CO::READONLY, 2, 1, 1, 1}.HFUNC(ZCard)
             << CI{"ZCOUNT", CO::FAST | CO::READONLY, 4, 1, 1, 1}.HFUNC(ZCount)
             << CI{"ZINCRBY", CO::FAST | CO::WRITE | CO::DENYOOM, 4, 1, 1, 1}.HFUNC(ZIncrBy)
+            << CI{"ZINTER", kReadUnionMask, -3, 2, 2, 1}.HFUNC(ZInter)
+            << CI{"ZINTERCARD", kReadUnionMask, -3, 2, 2, 1}.HFUNC(ZInterCard)
             << CI{"ZINTERSTORE", kUnionMask, -4, 3, 3, 1}.HFUNC(ZInterStore)
             << CI{"ZLEXCOUNT", CO::READONLY, 4, 1, 1, 1}.HFUNC(ZLexCount)
             << CI{"ZPOPMAX", CO::READONLY, 3, 1, 1, 1}.HFUNC(ZPopMax)
@@ -2034,7 +2656,13 @@ void ZSetFamily::Register(CommandRegistry* registry) {
             << CI{"ZREVRANGEBYSCORE", CO::READONLY, -4, 1, 1, 1}.HFUNC(ZRevRangeByScore)
             << CI{"ZREVRANK", CO::READONLY | CO::FAST, 3, 1, 1, 1}.HFUNC(ZRevRank)
             << CI{"ZSCAN", CO::READONLY, -3, 1, 1, 1}.HFUNC(ZScan)
-            << CI{"ZUNIONSTORE", kUnionMask, -4, 3, 3, 1}.HFUNC(ZUnionStore);
+            << CI{"ZUNION", kReadUnionMask, -3, 2, 2, 1}.HFUNC(ZUnion)
+            << CI{"ZUNIONSTORE", kUnionMask, -4, 3, 3, 1}.HFUNC(ZUnionStore)
+            << CI{"GEOADD", CO::FAST | CO::WRITE | CO::DENYOOM, -5, 1, 1, 1}.HFUNC(GeoAdd)
+            << CI{"GEOHASH", CO::FAST | CO::READONLY, -2, 1, 1, 1}.HFUNC(GeoHash)
+            << CI{"GEOPOS", CO::FAST | CO::READONLY, -2, 1, 1, 1}.HFUNC(GeoPos)
+            << CI{"GEODIST", CO::READONLY, -4, 1, 1, 1}.HFUNC(GeoDist)
+            << CI{"GEOSEARCH", CO::READONLY, -7, 1, 1, 1}.HFUNC(GeoSearch);
 }
 
 }  // namespace dfly
@@ -4,8 +4,13 @@
 
 #include "server/zset_family.h"
 
+#include <absl/strings/str_cat.h>
+
+#include <random>
+
 #include "base/gtest.h"
 #include "base/logging.h"
+#include "core/geohash.h"
 #include "facade/facade_test.h"
 #include "server/command_registry.h"
 #include "server/test_utils.h"
@@ -71,6 +76,11 @@ TEST_F(ZSetFamilyTest, ZMScore) {
   auto resp = Run({"zmscore", "zms", "another", "a", "nofield"});
   ASSERT_EQ(RespExpr::ARRAY, resp.type);
   EXPECT_THAT(resp.GetVec(), ElementsAre("42", "3.14", ArgType(RespExpr::NIL)));
+
+  Run({"zadd", "zms", "7", "10", "8", "010"});
+  resp = Run({"zmscore", "zms", "10", "a", "010", "10"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("7", "3.14", "8", "7"));
+  EXPECT_EQ("8", Run({"zscore", "zms", "010"}));
 }
 
 TEST_F(ZSetFamilyTest, ZRangeRank) {
@@ -262,6 +272,25 @@ TEST_F(ZSetFamilyTest, ZScan) {
   } while (cursor != 0);
 
   EXPECT_EQ(100 * 2, scan_len);
+
+  // The listpack is scanned by count members, and the scores follow the members.
+  for (unsigned i = 0; i < 20; ++i) {
+    Run({"zadd", "small", absl::StrCat(i), absl::StrCat("m", i)});
+  }
+  auto resp = Run({"zscan", "small", "0", "count", "5"});
+  ASSERT_THAT(resp, ArrLen(2));
+  EXPECT_THAT(resp.GetVec()[1], ArrLen(10));
+  EXPECT_NE("0", resp.GetVec()[0].GetString());
+
+  resp = Run({"zscan", "small", "0", "match", "m1*", "count", "100"});
+  EXPECT_EQ("0", resp.GetVec()[0].GetString());
+  auto vec = StrArray(resp.GetVec()[1]);
+  ASSERT_EQ(22, vec.size());
+  for (size_t i = 0; i < vec.size(); i += 2) {
+    EXPECT_EQ(vec[i], absl::StrCat("m", vec[i + 1]));
+  }
+
+  EXPECT_THAT(Run({"zscan", "small", "0", "foo", "bar"}), ErrArg("syntax error"));
 }
 
 TEST_F(ZSetFamilyTest, ZUnionStore) {
@@ -333,6 +362,58 @@ TEST_F(ZSetFamilyTest, ZInterStore) {
   EXPECT_THAT(resp.GetVec(), ElementsAre("b", "4"));
 }
 
+TEST_F(ZSetFamilyTest, ZUnionInter) {
+  EXPECT_EQ(3, CheckedInt({"zadd", "z1", "1", "a", "2", "b", "3", "10"}));
+  EXPECT_EQ(3, CheckedInt({"zadd", "z2", "3", "c", "2", "b", "5", "10"}));
+
+  auto resp = Run({"zunion", "2", "z1", "z2", "withscores"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("a", "1", "c", "3", "b", "4", "10", "8"));
+  resp = Run({"zunion", "3", "z1", "z2", "missing", "aggregate", "min"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("a", "b", "10", "c"));
+  resp = Run({"zinter", "2", "z1", "z2", "weights", "2", "1", "withscores"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("b", "6", "10", "11"));
+  EXPECT_THAT(Run({"zinter", "2", "z1", "missing"}), ArrLen(0));
+
+  EXPECT_THAT(Run({"zintercard", "2", "z1", "z2"}), IntArg(2));
+  EXPECT_THAT(Run({"zintercard", "2", "z1", "z2", "limit", "1"}), IntArg(1));
+  EXPECT_THAT(Run({"zintercard", "2", "z1", "z2", "limit", "0"}), IntArg(2));
+  EXPECT_THAT(Run({"zintercard", "1", "z1", "limit", "-1"}), ErrArg("can't be negative"));
+  EXPECT_THAT(Run({"zintercard", "0", "z1"}), ErrArg("greater than 0"));
+  EXPECT_THAT(Run({"zunion", "2", "z1"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"zunion", "1", "z1", "weights", "x"}), ErrArg("not a float"));
+
+  Run({"set", "foo", "bar"});
+  EXPECT_THAT(Run({"zinter", "2", "z1", "foo"}), ErrArg("WRONGTYPE"));
+  EXPECT_THAT(Run({"zinterstore", "dest", "2", "z1", "foo"}), ErrArg("WRONGTYPE"));
+}
+
+TEST_F(ZSetFamilyTest, ZUnionInterLarge) {
+  // The sets exceed the listpack limits and their keys span the shards.
+  vector<string> keys{"large1", "large2", "large3", "large4"};
+  for (unsigned i = 0; i < 1000; ++i) {
+    for (unsigned j = 0; j < keys.size(); ++j) {
+      if (i % (j + 2) == 0)
+        Run({"zadd", keys[j], absl::StrCat(i), absl::StrCat("m", i)});
+    }
+  }
+  // Only the multiples of 2, 3, 4 and 5 are in all of the sets.
+  EXPECT_THAT(Run({"zinterstore", "dest", "4", "large1", "large2", "large3", "large4"}),
+              IntArg(17));
+  auto resp = Run({"zrange", "dest", "0", "1", "withscores"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("m0", "0", "m60", "240"));
+  EXPECT_THAT(Run({"zintercard", "4", "large1", "large2", "large3", "large4"}), IntArg(17));
+
+  EXPECT_THAT(Run({"zunionstore", "dest", "2", "large1", "large2", "aggregate", "max"}),
+              IntArg(667));
+  EXPECT_THAT(Run({"zscore", "dest", "m999"}), "999");
+
+  // The destination is one of the sources.
+  EXPECT_THAT(Run({"zinterstore", "dest", "2", "dest", "large4", "weights", "1", "2"}),
+              IntArg(133));
+  EXPECT_THAT(Run({"zscore", "dest", "m990"}), "2970");
+  EXPECT_THAT(Run({"zcard", "dest"}), IntArg(133));
+}
+
 TEST_F(ZSetFamilyTest, ZAddBug148) {
   auto resp = Run({"zadd", "key", "1", "9fe9f1eb"});
   EXPECT_THAT(resp, IntArg(1));
@@ -381,4 +462,196 @@ TEST_F(ZSetFamilyTest, ZPopMax) {
   resp = Run({"zpopmax", "key", "1"});
   ASSERT_THAT(resp, ArrLen(0));
 }
+
+TEST_F(ZSetFamilyTest, LargeSet) {
+  // Exceeds the listpack limits, hence the set is converted to a SortedMap.
+  for (unsigned i = 0; i < 200; ++i) {
+    Run({"zadd", "key", absl::StrCat(i), absl::StrCat("m", 1000 + i)});
+  }
+  EXPECT_THAT(Run({"zcard", "key"}), IntArg(200));
+  EXPECT_THAT(Run({"zscore", "key", "m1150"}), "150");
+  EXPECT_THAT(Run({"zrank", "key", "m1150"}), IntArg(150));
+  EXPECT_THAT(Run({"zrevrank", "key", "m1150"}), IntArg(49));
+  EXPECT_THAT(Run({"zcount", "key", "10", "(20"}), IntArg(10));
+
+  auto resp = Run({"zrangebyscore", "key", "100", "+inf", "limit", "5", "2"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("m1105", "m1106"));
+  resp = Run({"zrevrangebyscore", "key", "100", "-inf", "limit", "5", "2"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("m1095", "m1094"));
+  resp = Run({"zrevrange", "key", "0", "1"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("m1199", "m1198"));
+
+  EXPECT_THAT(Run({"zadd", "key", "incr", "1000", "m1000"}), "1000");
+  EXPECT_THAT(Run({"zrevrank", "key", "m1000"}), IntArg(0));
+  EXPECT_THAT(Run({"zrem", "key", "m1000", "m1001"}), IntArg(2));
+  EXPECT_THAT(Run({"zremrangebyrank", "key", "0", "9"}), IntArg(10));
+  EXPECT_THAT(Run({"zremrangebyscore", "key", "12", "(20"}), IntArg(8));
+
+  resp = Run({"zpopmin", "key", "2"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("m1020", "m1021"));
+  EXPECT_THAT(Run({"zcard", "key"}), IntArg(178));
+
+  // A long member goes straight to a SortedMap.
+  string member(100, 'x');
+  EXPECT_THAT(Run({"zadd", "key2", "1", member, "0", "a"}), IntArg(2));
+  resp = Run({"zrange", "key2", "0", "-1"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("a", member));
+}
+
+class GeoFamilyTest : public ZSetFamilyTest {
+ protected:
+  void AddSicily() {
+    EXPECT_THAT(Run({"geoadd", "Sicily", "13.361389", "38.115556", "Palermo", "15.087269",
+                     "37.502669", "Catania"}),
+                IntArg(2));
+    EXPECT_THAT(Run({"geoadd", "Sicily", "12.758489", "38.788135", "edge1", "17.241510",
+                     "38.788135", "edge2"}),
+                IntArg(2));
+  }
+};
+
+TEST_F(GeoFamilyTest, GeoAdd) {
+  AddSicily();
+  EXPECT_THAT(Run({"geoadd", "Sicily", "13.361389", "38.115556", "Palermo"}), IntArg(0));
+  EXPECT_THAT(Run({"geoadd", "Sicily", "ch", "13.4", "38.1", "Palermo"}), IntArg(1));
+  EXPECT_THAT(Run({"geoadd", "Sicily", "nx", "13", "38", "Palermo", "13", "38", "x"}),
+              IntArg(1));
+  EXPECT_THAT(Run({"geoadd", "Sicily", "xx", "13", "38", "y"}), IntArg(0));
+  EXPECT_THAT(Run({"geoadd", "missing", "xx", "13", "38", "y"}), IntArg(0));
+  EXPECT_THAT(Run({"zcard", "Sicily"}), IntArg(5));
+  EXPECT_THAT(Run({"zscore", "Sicily", "Catania"}), "3479447370796909");
+
+  EXPECT_THAT(Run({"geoadd", "Sicily", "nx", "xx", "13", "38", "x"}), ErrArg("not compatible"));
+  EXPECT_THAT(Run({"geoadd", "Sicily", "13", "38"}), ErrArg("syntax error"));
+  EXPECT_THAT(Run({"geoadd", "Sicily", "13", "x", "a"}), ErrArg("not a valid float"));
+  EXPECT_THAT(Run({"geoadd", "Sicily", "200", "100", "a"}),
+              ErrArg("invalid longitude,latitude pair 200.000000,100.000000"));
+  Run({"set", "str", "foo"});
+  EXPECT_THAT(Run({"geoadd", "str", "13", "38", "a"}), ErrArg("WRONGTYPE"));
+}
+
+TEST_F(GeoFamilyTest, GeoPosDistHash) {
+  AddSicily();
+  auto resp = Run({"geopos", "Sicily", "Palermo", "missing"});
+  ASSERT_THAT(resp, ArrLen(2));
+  const auto& pos = resp.GetVec()[0].GetVec();
+  ASSERT_EQ(2, pos.size());
+  EXPECT_THAT(ToSV(pos[0].GetBuf()), StartsWith("13.36138933897"));
+  EXPECT_THAT(ToSV(pos[1].GetBuf()), StartsWith("38.11555639549"));
+  EXPECT_THAT(resp.GetVec()[1], ArgType(RespExpr::NIL_ARRAY));
+
+  EXPECT_EQ(Run({"geodist", "Sicily", "Palermo", "Catania"}), "166274.1516");
+  EXPECT_EQ(Run({"geodist", "Sicily", "Palermo", "Catania", "km"}), "166.2742");
+  EXPECT_EQ(Run({"geodist", "Sicily", "Palermo", "Catania", "MI"}), "103.3182");
+  EXPECT_THAT(Run({"geodist", "Sicily", "Palermo", "missing"}), ArgType(RespExpr::NIL));
+  EXPECT_THAT(Run({"geodist", "Sicily", "Palermo", "Catania", "yd"}), ErrArg("unsupported unit"));
+
+  resp = Run({"geohash", "Sicily", "Palermo", "Catania", "missing"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("sqc8b49rny0", "sqdtr74hyu0", ArgType(RespExpr::NIL)));
+  resp = Run({"geohash", "missing", "a", "b"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre(ArgType(RespExpr::NIL), ArgType(RespExpr::NIL)));
+}
+
+TEST_F(GeoFamilyTest, GeoSearch) {
+  AddSicily();
+  auto resp =
+      Run({"geosearch", "Sicily", "fromlonlat", "15", "37", "byradius", "200", "km", "asc"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("Catania", "Palermo"));
+
+  resp = Run({"geosearch", "Sicily", "fromlonlat", "15", "37", "bybox", "400", "400", "km", "asc",
+              "withdist"});
+  ASSERT_THAT(resp, ArrLen(4));
+  const auto& vec = resp.GetVec();
+  EXPECT_THAT(vec[0].GetVec(), ElementsAre("Catania", "56.4413"));
+  EXPECT_THAT(vec[1].GetVec(), ElementsAre("Palermo", "190.4424"));
+  EXPECT_THAT(vec[2].GetVec(), ElementsAre("edge2", "279.7403"));
+  EXPECT_THAT(vec[3].GetVec(), ElementsAre("edge1", "279.7405"));
+
+  resp = Run({"geosearch", "Sicily", "frommember", "Palermo", "byradius", "200", "km", "desc",
+              "count", "1", "withhash", "withcoord"});
+  ASSERT_THAT(resp, ArrLen(3));
+  EXPECT_THAT(resp.GetVec()[0], "Catania");
+  EXPECT_THAT(resp.GetVec()[1], IntArg(3479447370796909));
+  EXPECT_THAT(resp.GetVec()[2], ArrLen(2));
+
+  // COUNT returns the nearest points, unless ANY is given.
+  resp = Run({"geosearch", "Sicily", "fromlonlat", "15", "37", "bybox", "400", "400", "km",
+              "count", "2"});
+  EXPECT_THAT(resp.GetVec(), ElementsAre("Catania", "Palermo"));
+  resp = Run({"geosearch", "Sicily", "fromlonlat", "15", "37", "bybox", "400", "400", "km",
+              "count", "3", "any"});
+  EXPECT_THAT(resp, ArrLen(3));
+
+  EXPECT_THAT(Run({"geosearch", "missing", "frommember", "a", "byradius", "1", "m"}), ArrLen(0));
+  EXPECT_THAT(Run({"geosearch", "Sicily", "frommember", "a", "byradius", "1", "m"}),
+              ErrArg("could not decode requested zset member"));
+  EXPECT_THAT(Run({"geosearch", "Sicily", "byradius", "1", "m"}), ErrArg("exactly one of FROM"));
+  EXPECT_THAT(Run({"geosearch", "Sicily", "frommember", "Palermo", "count", "1"}),
+              ErrArg("exactly one of BYRADIUS"));
+  EXPECT_THAT(Run({"geosearch", "Sicily", "frommember", "Palermo", "byradius", "1", "m", "any"}),
+              ErrArg("syntax error"));
+  EXPECT_THAT(Run({"geosearch", "Sicily", "frommember", "Palermo", "byradius", "1", "yd"}),
+              ErrArg("unsupported unit"));
+  EXPECT_THAT(Run({"geosearch", "Sicily", "frommember", "Palermo", "byradius", "-1", "m"}),
+              ErrArg("radius cannot be negative"));
+  EXPECT_THAT(Run({"geosearch", "Sicily", "frommember", "Palermo", "byradius", "1", "m", "count",
+                   "0"}),
+              ErrArg("COUNT must be > 0"));
+}
+
+// Compares the searches over a sorted map with the points that are within the shapes.
+TEST_F(GeoFamilyTest, GeoSearchLarge) {
+  mt19937_64 gen(1);
+  uniform_real_distribution<double> lon(10, 20), lat(35, 45);
+  // The coordinates as they are parsed from the arguments.
+  auto random_point = [&] {
+    return GeoPoint{stod(absl::StrCat(lon(gen))), stod(absl::StrCat(lat(gen)))};
+  };
+
+  vector<GeoPoint> points;
+  for (unsigned i = 0; i < 1000; ++i) {
+    points.push_back(random_point());
+    Run({"geoadd", "points", absl::StrCat(points.back().lon), absl::StrCat(points.back().lat),
+         absl::StrCat("p", i)});
+  }
+
+  for (unsigned i = 0; i < 20; ++i) {
+    GeoPoint center = random_point();
+    double radius = 10000 * (i + 1);
+    GeoShape shape = GeoShape::Radius(center, radius);
+
+    vector<pair<double, string>> expected;
+    for (unsigned j = 0; j < points.size(); ++j) {
+      optional<double> dist = shape.Distance(GeoDecode(GeoEncode(points[j])));
+      if (dist)
+        expected.emplace_back(*dist, absl::StrCat("p", j));
+    }
+    sort(expected.begin(), expected.end());
+
+    auto resp = Run({"geosearch", "points", "fromlonlat", absl::StrCat(center.lon),
+                     absl::StrCat(center.lat), "byradius", absl::StrCat(radius), "m", "asc"});
+
+    // A single member is not wrapped in an array.
+    vector<string> found;
+    if (resp.type == RespExpr::ARRAY) {
+      for (const auto& e : resp.GetVec())
+        found.emplace_back(ToSV(e.GetBuf()));
+    } else {
+      found.emplace_back(ToSV(resp.GetBuf()));
+    }
+    ASSERT_EQ(expected.size(), found.size()) << i;
+    for (size_t j = 0; j < expected.size(); ++j) {
+      EXPECT_EQ(expected[j].second, found[j]) << i;
+    }
+
+    // The 3 nearest points, found by the early stop.
+    if (expected.size() >= 3) {
+      resp = Run({"geosearch", "points", "fromlonlat", absl::StrCat(center.lon),
+                  absl::StrCat(center.lat), "byradius", absl::StrCat(radius), "m", "count", "3"});
+      EXPECT_THAT(resp.GetVec(), ElementsAre(expected[0].second, expected[1].second,
+                                             expected[2].second));
+    }
+  }
+}
+
 }  // namespace dfly
@@ -1,4 +1,5 @@
 import random
+import time
 import pytest
 import asyncio
 import aioredis
@@ -22,6 +23,33 @@ async def test_monitor_command(async_pool):
     assert await run_monitor(messages, async_pool)
 
 
+@pytest.mark.asyncio
+async def test_monitor_filters(async_pool):
+    """
+    Only the commands that pass the filter of MONITOR are sent to the monitoring connection
+    """
+    conn = await async_pool.get_connection("MONITOR")
+    await conn.send_command("MONITOR", "CMD", "set", "MATCH", "mon:*")
+    assert await conn.read_response() == "OK"
+
+    client = aioredis.Redis(connection_pool=async_pool)
+    await client.set("mon:1", "a")
+    await client.get("mon:1")
+    await client.set("other", "b")
+    await client.set("mon:2", "c")
+
+    async with async_timeout.timeout(1):
+        first = await conn.read_response()
+        second = await conn.read_response()
+    assert '"SET" "mon:1" "a"' in first
+    assert '"SET" "mon:2" "c"' in second
+
+    with pytest.raises(asyncio.TimeoutError):
+        async with async_timeout.timeout(0.2):
+            await conn.read_response()
+    await conn.disconnect()
+
+
 def verify_response(monitor_response: dict, key: str, value: str) -> bool:
     if monitor_response is None:
         return False
@@ -101,6 +129,26 @@ async def test_pipeline_support(async_client):
     assert await run_pipeline_mode(async_client, messages)
 
 
+@pytest.mark.asyncio
+async def test_pipeline_big_values(async_client):
+    """
+    The big values of the queued requests reference the read buffer, mixed with small requests
+    and values that are split between reads.
+    """
+    values = {f"key{i}": f"{i}:" + "v" * random.randint(1, 20000) for i in range(200)}
+    pipe = async_client.pipeline(transaction=False)
+    for key, val in values.items():
+        pipe.set(key, val)
+        pipe.incr("counter")
+    assert all(await pipe.execute())
+
+    pipe = async_client.pipeline(transaction=False)
+    for key in values:
+        pipe.get(key)
+    assert await pipe.execute() == list(values.values())
+    assert await async_client.get("counter") == str(len(values))
+
+
 async def reader(channel: aioredis.client.PubSub, messages, max: int):
     message_count = len(messages)
     while message_count > 0:
@@ -221,3 +269,224 @@ async def test_multi_pubsub(async_client):
     state, message = await run_multi_pubsub(async_client, messages, "my-channel")
 
     assert state, message
+
+
+@pytest.mark.asyncio
+async def test_pubsub_output_limit(df_local_factory):
+    """
+    A subscriber that does not read its messages is disconnected once it exceeds the pubsub
+    output buffer limit, without blocking the publisher
+    """
+    server = df_local_factory.create(port=1111, proactor_threads=2,
+                                     client_output_buffer_limit="pubsub 1mb 512kb 60")
+    server.start()
+
+    # The subscriber never reads, its socket buffers fill up and the messages queue up.
+    reader, writer = await asyncio.open_connection("localhost", server.port)
+    writer.write(b"SUBSCRIBE slow\r\n")
+    await writer.drain()
+    await reader.readuntil(b":1\r\n")
+
+    client = aioredis.Redis(port=server.port)
+    payload = "x" * 64 * 1024
+    async with async_timeout.timeout(10):
+        for _ in range(1000):
+            if await client.publish("slow", payload) == 0:
+                break
+
+    assert await client.publish("slow", payload) == 0
+    stats = await client.info("stats")
+    assert stats["client_output_buffer_limit_disconnections"] == 1
+    assert stats["client_output_buffer_limit_dropped_messages"] > 0
+    writer.close()
+
+
+async def client_info(client, name):
+    # The lines end with the flags, which are not key=value pairs.
+    for line in (await client.execute_command("CLIENT", "LIST")).decode().splitlines():
+        info = dict(pair.split("=", 1) for pair in line.split() if "=" in pair)
+        if info.get("name") == name:
+            return info
+
+
+@pytest.mark.asyncio
+async def test_client_throttle(df_server):
+    """
+    CLIENT LIST shows the CPU time of every connection and CLIENT THROTTLE caps the commands
+    per second of a connection
+    """
+    client = aioredis.Redis(port=df_server.port, single_connection_client=True)
+    await client.client_setname("throttled")
+    for i in range(100):
+        await client.set(f"key{i}", "val")
+
+    info = await client_info(client, "throttled")
+    assert int(info["cpu_parse"]) + int(info["cpu_dispatch"]) + int(info["cpu_shard"]) > 0
+
+    with pytest.raises(aioredis.ResponseError, match="No such client"):
+        await client.execute_command("CLIENT THROTTLE 1000000 10 0")
+    await client.execute_command(f"CLIENT THROTTLE {info['id']} 50 0")
+
+    # A burst of 5 commands and 20ms for each of the others.
+    start = time.monotonic()
+    for i in range(25):
+        await client.get(f"key{i}")
+    assert time.monotonic() - start > 0.3
+
+    stats = await client.info("stats")
+    assert stats["total_throttled_commands"] > 0
+    info = await client_info(client, "throttled")
+    assert int(info["throttled_ms"]) > 0
+    await client.close()
+
+
+@pytest.mark.asyncio
+async def test_pipeline_backpressure(df_local_factory):
+    """
+    A connection stops reading its pipeline once its queue reaches --pipeline_queue_limit, and
+    resumes once the queued requests run
+    """
+    server = df_local_factory.create(port=1111, proactor_threads=2, pipeline_queue_limit=100)
+    server.start()
+    client = aioredis.Redis(port=server.port)
+
+    reader, writer = await asyncio.open_connection("localhost", server.port)
+    writer.write(b"CLIENT SETNAME piped\r\n")
+    await writer.drain()
+    await reader.readuntil(b"+OK\r\n")
+
+    # The pings queue up behind the blocked BLPOP. The writes are not drained, since the
+    # socket buffers fill up once the server stops reading.
+    num_pings = 200000
+    writer.write(b"BLPOP list 0\r\n" + b"PING\r\n" * num_pings)
+
+    info = None
+    async with async_timeout.timeout(10):
+        while info is None or info["phase"] != "throttled":
+            await asyncio.sleep(0.05)
+            info = await client_info(client, "piped")
+    assert 100 <= int(info["pipeline_queue"]) < num_pings
+    assert int(info["pipeline_bytes"]) > 0
+
+    stats = await client.info("clients")
+    assert stats["pipeline_throttled_count"] >= 1
+    assert stats["pipeline_queue_length"] >= 100
+
+    # Once the BLPOP returns, the connection reads and runs the rest of the pipeline.
+    await client.lpush("list", "a")
+    async with async_timeout.timeout(20):
+        await writer.drain()
+        await reader.readexactly(len(b"*2\r\n$4\r\nlist\r\n$1\r\na\r\n"))
+        replies = await reader.readexactly(len(b"+PONG\r\n") * num_pings)
+    assert replies == b"+PONG\r\n" * num_pings
+
+    stats = await client.info("clients")
+    assert stats["pipeline_queue_length"] == 0
+    assert stats["pipeline_queue_bytes"] == 0
+    writer.close()
+    await client.close()
+
+
+@pytest.mark.asyncio
+@pytest.mark.parametrize("cache_limit", [0, 1 << 20])
+async def test_pipeline_request_cache(df_local_factory, cache_limit):
+    """
+    The next pipeline requests of a thread reuse the blocks of the released ones, up to
+    --request_cache_limit, whether their arguments fit into the blocks or not
+    """
+    server = df_local_factory.create(port=1111, proactor_threads=1,
+                                     request_cache_limit=cache_limit)
+    server.start()
+    client = aioredis.Redis(port=server.port, decode_responses=True)
+
+    for n in range(2):
+        pipe = client.pipeline(transaction=False)
+        for i in range(1000):
+            pipe.set(f"key{i}", f"{n}:" + "v" * (i % 7 * 100))
+        assert all(await pipe.execute())
+    assert await client.mget("key0", "key1", "key6") == ["1:", "1:" + "v" * 100, "1:" + "v" * 600]
+
+    stats = await client.info("stats")
+    assert stats["pipeline_cache_misses"] > 0
+    if cache_limit == 0:
+        assert stats["pipeline_cache_hits"] == 0
+    else:
+        assert stats["pipeline_cache_hits"] > 0
+
+    # A connection that closes with queued requests releases them.
+    reader, writer = await asyncio.open_connection("localhost", server.port)
+    writer.write(b"BLPOP list 0\r\n" + b"SET key0 queued\r\n" * 1000)
+    await writer.drain()
+    async with async_timeout.timeout(5):
+        while (await client.info("clients"))["pipeline_queue_length"] == 0:
+            await asyncio.sleep(0.05)
+    writer.close()
+    await writer.wait_closed()
+
+    async with async_timeout.timeout(5):
+        while True:
+            stats = await client.info("clients")
+            if stats["connected_clients"] == 1 and stats["pipeline_queue_length"] == 0:
+                break
+            await asyncio.sleep(0.05)
+    assert stats["pipeline_queue_bytes"] == 0
+    assert await client.ping()
+    await client.close()
+
+
+@pytest.mark.asyncio
+@pytest.mark.parametrize("cache_limit", [0, 1 << 20])
+async def test_idle_read_buffers(df_local_factory, cache_limit):
+    """
+    The idle connections hold no read buffers, whether their thread caches the released ones or
+    frees them. A request that arrives in parts, or that is longer than the idle buffer, is
+    parsed from the acquired buffer, and the closed connections release their buffers
+    """
+    server = df_local_factory.create(port=1111, proactor_threads=2,
+                                     read_buf_cache_limit=cache_limit)
+    server.start()
+    client = aioredis.Redis(port=server.port)
+    base = (await client.info("clients"))["client_read_buf_capacity"]
+
+    conns = [await asyncio.open_connection("localhost", server.port) for _ in range(50)]
+    for reader, writer in conns:
+        writer.write(b"PING\r\n")
+        await writer.drain()
+        assert await reader.readexactly(7) == b"+PONG\r\n"
+
+    stats = await client.info("clients")
+    assert stats["connected_clients"] == 51
+    assert stats["client_read_buf_capacity"] == base
+
+    # The request is split inside of the bulk string, so the first part needs more data.
+    reader, writer = conns[0]
+    writer.write(b"*2\r\n$4\r\nECHO\r\n$5\r\nhel")
+    await writer.drain()
+    await asyncio.sleep(0.1)
+    assert (await client.info("clients"))["client_read_buf_capacity"] > base
+    writer.write(b"lo\r\n")
+    await writer.drain()
+    assert await reader.readexactly(11) == b"$5\r\nhello\r\n"
+    assert (await client.info("clients"))["client_read_buf_capacity"] == base
+
+    # A value longer than the idle buffer grows the acquired one.
+    value = "v" * 1000
+    reader, writer = conns[1]
+    writer.write(f"*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$1000\r\n{value}".encode())
+    await writer.drain()
+    await asyncio.sleep(0.1)
+    assert (await client.info("clients"))["client_read_buf_capacity"] > base + 256
+    writer.write(b"\r\n")
+    await writer.drain()
+    assert await reader.readexactly(5) == b"+OK\r\n"
+    assert await client.get("key") == value.encode()
+
+    for _, writer in conns:
+        writer.close()
+        await writer.wait_closed()
+
+    async with async_timeout.timeout(5):
+        while (await client.info("clients"))["connected_clients"] > 1:
+            await asyncio.sleep(0.05)
+    assert (await client.info("clients"))["client_read_buf_capacity"] == base
+    await client.close()
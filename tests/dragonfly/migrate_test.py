@@ -0,0 +1,59 @@
+import pytest
+import aioredis
+
+from .utility import *
+
+
+"""
+Test MIGRATE of plain keys and of large containers, which are sent in chunks.
+"""
+
+
+@pytest.mark.asyncio
+@pytest.mark.parametrize("t_source, t_target", [(4, 2), (1, 4)])
+async def test_migrate(df_local_factory, t_source, t_target):
+    source = df_local_factory.create(port=1111, proactor_threads=t_source,
+                                     migrate_chunk_bytes=4096, migrate_batch_bytes=8192)
+    target = df_local_factory.create(port=1112, proactor_threads=t_target)
+    source.start()
+    target.start()
+
+    c_source = aioredis.Redis(port=source.port)
+    c_target = aioredis.Redis(port=target.port)
+
+    await batch_fill_data_async(c_source, gen_test_data(2000, seed=1))
+    await c_source.rpush("list", *range(2000))
+    await c_source.sadd("set", *(f"m{i}" for i in range(2000)))
+    await c_source.hset("hash", mapping={f"f{i}": i for i in range(2000)})
+    await c_source.zadd("zset", {f"m{i}": i / 2 for i in range(2000)})
+    await c_source.pexpire("list", 100000)
+
+    keys = [k for k, _ in gen_test_data(2000, seed=1)] + ["list", "set", "hash", "zset"]
+    res = await c_source.execute_command("MIGRATE", "localhost", target.port, "", 0, 5000,
+                                         "KEYS", *keys)
+    assert res == b"OK"
+    assert await c_source.dbsize() == 0
+
+    await batch_check_data_async(c_target, gen_test_data(2000, seed=1))
+    assert await c_target.lrange("list", 0, -1) == [str(i).encode() for i in range(2000)]
+    assert await c_target.scard("set") == 2000
+    assert await c_target.hget("hash", "f1999") == b"1999"
+    assert await c_target.zscore("zset", "m3") == 1.5
+    assert 0 < await c_target.pttl("list") <= 100000
+    assert await c_target.dbsize() == 2004
+
+    # The keys exist on the target now.
+    await c_source.set("key", "value")
+    await c_target.set("key", "other")
+    with pytest.raises(aioredis.ResponseError, match="BUSYKEY"):
+        await c_source.execute_command("MIGRATE", "localhost", target.port, "key", 0, 5000)
+    assert await c_source.get("key") == b"value"
+
+    res = await c_source.execute_command("MIGRATE", "localhost", target.port, "key", 0, 5000,
+                                         "COPY", "REPLACE")
+    assert res == b"OK"
+    assert await c_source.get("key") == b"value"
+    assert await c_target.get("key") == b"value"
+
+    res = await c_source.execute_command("MIGRATE", "localhost", target.port, "none", 0, 5000)
+    assert res == b"NOKEY"
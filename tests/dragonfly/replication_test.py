@@ -2,7 +2,9 @@
 import pytest
 import asyncio
 import aioredis
+import async_timeout
 import random
+import time
 from itertools import count, chain, repeat
 
 from .utility import *
@@ -236,6 +238,187 @@ async def test_disconnect_replica(df_local_factory, t_master, t_crash_fs, t_cras
     assert await c_master.ping()
 
 
+"""
+Test that the replica applies a multi-shard command after the writes that preceded it in all
+of its shards, although the flows of the shards stream independently.
+"""
+
+
+@pytest.mark.asyncio
+async def test_multi_shard_command_order(df_local_factory):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=4)
+    replica = df_local_factory.create(port=BASE_PORT+1, proactor_threads=2)
+
+    master.start()
+    replica.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_replica = aioredis.Redis(port=replica.port)
+    await c_replica.execute_command("REPLICAOF localhost " + str(master.port))
+    await wait_available_async(c_replica)
+
+    # Most of the pairs of keys are in different shards. A RENAME that the replica applied before
+    # the SET would leave the source key behind.
+    async def write(n, seed):
+        c = aioredis.Redis(port=master.port)
+        for i in range(n):
+            await c.set(f"src-{seed}-{i}", i)
+            await c.rename(f"src-{seed}-{i}", f"dst-{seed}-{i}")
+            await c.sadd(f"set-{seed}", i)
+            await c.sunionstore(f"union-{seed}-{i}", f"set-{seed}")
+        await c.close()
+
+    await asyncio.gather(*(write(200, seed) for seed in range(8)))
+    await asyncio.sleep(1.0)
+
+    for seed in range(8):
+        for i in range(200):
+            assert await c_replica.exists(f"src-{seed}-{i}") == 0
+            assert as_str_val(await c_replica.get(f"dst-{seed}-{i}")) == str(i)
+            assert await c_replica.scard(f"union-{seed}-{i}") == i + 1
+
+
+"""
+Test that the replicas that sync together share one snapshot of the master.
+"""
+
+
+@pytest.mark.asyncio
+async def test_shared_full_sync(df_local_factory):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=4,
+                                     repl_shared_sync_window_ms=500)
+    replicas = [
+        df_local_factory.create(port=BASE_PORT+i+1, proactor_threads=2)
+        for i in range(3)
+    ]
+
+    master.start()
+    for replica in replicas:
+        replica.start()
+
+    c_master = aioredis.Redis(port=master.port)
+    c_replicas = [aioredis.Redis(port=replica.port) for replica in replicas]
+    await batch_fill_data_async(c_master, gen_test_data(20000, seed=1))
+
+    await asyncio.gather(*(c.execute_command("REPLICAOF localhost " + str(master.port))
+                           for c in c_replicas))
+    for c_replica in c_replicas:
+        await wait_available_async(c_replica)
+
+    await batch_fill_data_async(c_master, gen_test_data(1000, seed=2))
+    await asyncio.sleep(0.5)
+    for c_replica in c_replicas:
+        await batch_check_data_async(c_replica, gen_test_data(1000, seed=2))
+        await batch_check_data_async(c_replica, gen_test_data(20000, start=1000, seed=1))
+
+    assert (await c_master.info("replication"))["sync_shared"] == 1
+
+
+"""
+Test that the full sync keeps to --repl_full_sync_bytes_per_sec, while the foreground traffic
+of the master is served, and that the throttled full sync replicates all the data.
+"""
+
+
+@pytest.mark.asyncio
+async def test_full_sync_throttling(df_local_factory):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=2,
+                                     repl_full_sync_bytes_per_sec=2 << 20,
+                                     full_sync_min_cpu_percent=10)
+    replica = df_local_factory.create(port=BASE_PORT+1, proactor_threads=2)
+
+    master.start()
+    replica.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_replica = aioredis.Redis(port=replica.port)
+
+    # About 4MB that does not compress.
+    n_keys = 4000
+    big_values = [(f"big-{i}", random.randbytes(500).hex()) for i in range(n_keys)]
+    await batch_fill_data_async(c_master, big_values)
+
+    start = time.monotonic()
+    await c_replica.execute_command("REPLICAOF localhost " + str(master.port))
+
+    async def foreground():
+        await batch_fill_data_async(c_master, gen_test_data(2000, seed=1))
+        return time.monotonic()
+
+    fg_fut = asyncio.create_task(foreground())
+    await wait_available_async(c_replica)
+    synced = time.monotonic()
+    assert synced - start > 1.0
+
+    # The writes during the full sync are not held off until it ends.
+    assert await fg_fut < synced
+
+    assert await c_master.execute_command("WAIT", 1, 5000) == 1
+    await batch_check_data_async(c_replica, big_values)
+    await batch_check_data_async(c_replica, gen_test_data(2000, seed=1))
+    assert await c_replica.dbsize() == n_keys + 2000
+
+
+"""
+Test the progress of the full sync and the lag of every flow in INFO replication, on the master
+and on the replica.
+"""
+
+
+@pytest.mark.asyncio
+async def test_replication_lag_info(df_local_factory):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=2,
+                                     repl_full_sync_bytes_per_sec=1 << 20)
+    replica = df_local_factory.create(port=BASE_PORT+1, proactor_threads=2,
+                                      repl_ack_interval_ms=50)
+
+    master.start()
+    replica.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_replica = aioredis.Redis(port=replica.port)
+    await batch_fill_data_async(c_master, ((f"big-{i}", random.randbytes(500).hex())
+                                           for i in range(2000)))
+
+    def replicas_of(info):
+        return {k: v for k, v in info.items() if k.startswith("slave") and "_flow" not in k}
+
+    # The capped full sync runs for a while.
+    await c_replica.execute_command("REPLICAOF localhost " + str(master.port))
+    async with async_timeout.timeout(5):
+        while not replicas_of(await replication_info(c_master)):
+            await asyncio.sleep(0.05)
+    info = await replication_info(c_master)
+    [(name, progress)] = replicas_of(info).items()
+    if progress["state"] == "full_sync":
+        assert 0 <= progress["full_sync_perc"] < 100
+    for i in range(2):
+        assert 0 <= info[f"{name}_flow{i}"]["full_sync_perc"] <= 100
+
+    await wait_available_async(c_replica)
+    await batch_fill_data_async(c_master, gen_test_data(1000, seed=1))
+    assert await c_master.execute_command("WAIT", 1, 5000) == 1
+
+    # The acknowledgements of the flows catch up with the writes.
+    async with async_timeout.timeout(5):
+        while True:
+            info = await replication_info(c_master)
+            progress = replicas_of(info)[name]
+            if progress["state"] == "stable_sync" and progress["lag_entries"] == 0:
+                break
+            await asyncio.sleep(0.05)
+    assert progress["lag_bytes"] == 0
+    assert progress["full_sync_perc"] == 100
+    for i in range(2):
+        flow = info[f"{name}_flow{i}"]
+        assert flow["acked_lsn"] == flow["lsn"]
+        assert flow["lag_entries"] == 0
+
+    r_info = await replication_info(c_replica)
+    assert r_info["slave_repl_offset"] > 0
+    assert r_info["flow0"]["applied_lsn"] + r_info["flow1"]["applied_lsn"] > 0
+    assert r_info["flow0"]["applied_bytes"] + r_info["flow1"]["applied_bytes"] == \
+        r_info["slave_repl_offset"]
+    assert "flow2" not in r_info
+
+
 """
 Test stopping master during different phases.
 
@@ -319,3 +502,376 @@ async def test_disconnect_master(df_local_factory, t_master, t_replicas, n_rando
     for c_replica in c_replicas:
         await wait_available_async(c_replica)
         await batch_check_data_async(c_replica, gen_test_data(n_keys, seed=0))
+
+
+"""
+Test the planned failover with REPLTAKEOVER while the master keeps getting writes.
+
+The writes that the master accepted before its pause are on the new master, and the old master
+replicates the writes of the new master.
+"""
+
+
+@pytest.mark.asyncio
+@pytest.mark.parametrize("t_master, t_replica", [(4, 4), (4, 2)])
+async def test_takeover(df_local_factory, t_master, t_replica):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=t_master)
+    replica = df_local_factory.create(port=BASE_PORT+1, proactor_threads=t_replica)
+
+    master.start()
+    replica.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_replica = aioredis.Redis(port=replica.port)
+
+    await batch_fill_data_async(c_master, gen_test_data(5000, seed=1))
+    await c_replica.execute_command("REPLICAOF localhost " + str(master.port))
+    await wait_available_async(c_replica)
+    await asyncio.sleep(0.5)
+
+    async def stream_data():
+        """ Write until the master turns read-only """
+        i = 0
+        try:
+            while True:
+                await c_master.set("stream", i)
+                i += 1
+        except aioredis.ResponseError as e:
+            assert "READONLY" in str(e)
+        return i
+
+    stream_fut = asyncio.create_task(stream_data())
+    await asyncio.sleep(0.1)
+    assert await c_replica.execute_command("REPLTAKEOVER 5") == b"OK"
+    written = await stream_fut
+
+    assert as_str_val(await c_replica.get("stream")) == str(written - 1)
+    await batch_check_data_async(c_replica, gen_test_data(5000, seed=1))
+
+    await c_replica.set("after", "takeover")
+    await asyncio.sleep(0.5)
+    assert as_str_val(await c_master.get("after")) == "takeover"
+
+
+"""
+Test WAIT on a master with several replicas.
+
+WAIT returns once the replicas applied the writes of the client, before the periodic
+acknowledgements of the flows, and the replicas that can not apply them do not count.
+"""
+
+
+@pytest.mark.asyncio
+async def test_wait(df_local_factory):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=4)
+    replicas = [
+        df_local_factory.create(port=BASE_PORT+i+1, proactor_threads=2,
+                                repl_ack_interval_ms=10000)
+        for i in range(2)
+    ]
+
+    master.start()
+    for replica in replicas:
+        replica.start()
+
+    c_master = aioredis.Redis(port=master.port)
+    c_replicas = [aioredis.Redis(port=replica.port) for replica in replicas]
+    for c_replica in c_replicas:
+        await c_replica.execute_command("REPLICAOF localhost " + str(master.port))
+        await wait_available_async(c_replica)
+
+    async def write_and_wait(i):
+        c = aioredis.Redis(port=master.port)
+        await c.set(f"key{i}", i)
+        assert await c.execute_command("WAIT", 2, 5000) == 2
+        await c.close()
+
+    # The waiting clients share the acknowledgements of the flows.
+    await asyncio.gather(*(write_and_wait(i) for i in range(100)))
+    for c_replica in c_replicas:
+        assert as_str_val(await c_replica.get("key99")) == "99"
+
+    replicas[1].stop(kill=True)
+    await c_master.set("after", "stop")
+    assert await c_master.execute_command("WAIT", 2, 500) == 1
+
+
+"""
+Test the reads of CLIENT READAFTER on a replica.
+
+A read with the LSN token of the writes of a client sees them, although it is sent to the
+replica right after them, and it fails fast if the replica does not reach the token.
+"""
+
+
+@pytest.mark.asyncio
+async def test_read_after_lsn_token(df_local_factory):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=4)
+    replica = df_local_factory.create(port=BASE_PORT+1, proactor_threads=2)
+
+    master.start()
+    replica.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_replica = aioredis.Redis(port=replica.port)
+    await c_replica.execute_command("REPLICAOF localhost " + str(master.port))
+    await wait_available_async(c_replica)
+
+    for i in range(200):
+        await c_master.set(f"key{i}", i)
+        token = await c_master.execute_command("CLIENT LSNTOKEN")
+        assert await c_replica.execute_command("CLIENT", "READAFTER", token, "TIMEOUT", 5000)
+        assert as_str_val(await c_replica.get(f"key{i}")) == str(i)
+
+    master_id = as_str_val(token).split(":")[0]
+    far_token = master_id + ":" + ",".join(["1000000000"] * 4)
+    await c_replica.execute_command("CLIENT", "READAFTER", far_token, "TIMEOUT", 10)
+    with pytest.raises(aioredis.ResponseError, match="TRYAGAIN"):
+        await c_replica.get("key0")
+
+    await c_replica.execute_command("CLIENT READAFTER OFF")
+    assert as_str_val(await c_replica.get("key0")) == "0"
+
+
+"""
+Test that the replica applies the effect of the non-deterministic writes of the master.
+
+The relative TTLs are replicated as absolute ones, XADD as the ID that it generated and the
+approximate trims as the exact length that they left.
+"""
+
+
+@pytest.mark.asyncio
+async def test_replicate_generated_values(df_local_factory):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=4)
+    replica = df_local_factory.create(port=BASE_PORT+1, proactor_threads=2)
+
+    master.start()
+    replica.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_replica = aioredis.Redis(port=replica.port)
+    await c_replica.execute_command("REPLICAOF localhost " + str(master.port))
+    await wait_available_async(c_replica)
+
+    await c_master.execute_command("SET", "set-ex", "v", "EX", 100)
+    await c_master.execute_command("SETEX", "setex", 100, "v")
+    await c_master.execute_command("PSETEX", "psetex", 100000, "v")
+    await c_master.execute_command("SET", "getex", "v")
+    await c_master.execute_command("GETEX", "getex", "PX", 100000)
+    for i in range(2000):
+        await c_master.execute_command("XADD", "stream", "MAXLEN", "~", 500, "*", "i", i)
+    await c_master.execute_command("XTRIM", "stream", "MINID", "~", "0-1")
+    await c_master.execute_command("XTRIM", "stream", "MAXLEN", "~", 100)
+    assert await c_master.execute_command("WAIT", 1, 5000) == 1
+
+    # The replica applies the commands later, hence a TTL counted from then would be longer.
+    for key in ["set-ex", "setex", "psetex", "getex"]:
+        master_ttl = await c_master.pttl(key)
+        replica_ttl = await c_replica.pttl(key)
+        assert 0 < replica_ttl <= master_ttl + 100
+
+    # The background trims are journaled when they run.
+    await asyncio.sleep(0.5)
+    assert await c_master.execute_command("WAIT", 1, 5000) == 1
+    assert await c_replica.xlen("stream") == await c_master.xlen("stream")
+    assert await c_replica.xrange("stream") == await c_master.xrange("stream")
+
+
+class Proxy:
+    """ Forwards the connections of the replica to the master, and can drop them """
+
+    def __init__(self, port, remote_port):
+        self.port = port
+        self.remote_port = remote_port
+        self.server = None
+        self.writers = []
+
+    async def start(self):
+        self.server = await asyncio.start_server(self.handle, "localhost", self.port)
+
+    async def handle(self, reader, writer):
+        r_reader, r_writer = await asyncio.open_connection("localhost", self.remote_port)
+        self.writers += [writer, r_writer]
+
+        async def pipe(src, dst):
+            try:
+                while data := await src.read(16384):
+                    dst.write(data)
+                    await dst.drain()
+            except (ConnectionError, OSError):
+                pass
+            finally:
+                dst.close()
+
+        await asyncio.gather(pipe(reader, r_writer), pipe(r_reader, writer))
+
+    async def stop(self):
+        """ Drops the connections and refuses new ones until the next start """
+        self.server.close()
+        for writer in self.writers:
+            writer.close()
+        self.writers = []
+        await self.server.wait_closed()
+
+
+async def replication_info(client):
+    return await client.info("replication")
+
+
+"""
+Test that a replica whose connections dropped resumes from the journal backlog of the master,
+and that it repeats the full sync when the backlog does not hold the writes that it missed.
+"""
+
+
+@pytest.mark.asyncio
+@pytest.mark.parametrize("backlog_size, n_missed_keys, partial", [
+    (1 << 20, 200, True),
+    (1024, 5000, False),
+])
+async def test_resume_after_disconnect(df_local_factory, backlog_size, n_missed_keys, partial):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=4,
+                                     repl_backlog_size=backlog_size)
+    replica = df_local_factory.create(port=BASE_PORT+1, proactor_threads=2)
+    proxy = Proxy(BASE_PORT+2, BASE_PORT)
+
+    master.start()
+    replica.start()
+    await proxy.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_replica = aioredis.Redis(port=replica.port)
+
+    await batch_fill_data_async(c_master, gen_test_data(1000, seed=1))
+    await c_replica.execute_command("REPLICAOF localhost " + str(proxy.port))
+    await wait_available_async(c_replica)
+    assert await c_master.execute_command("WAIT", 1, 5000) == 1
+
+    # The master writes while the replica can not connect.
+    await proxy.stop()
+    await batch_fill_data_async(c_master, gen_test_data(n_missed_keys, seed=2))
+    await proxy.start()
+
+    assert await c_master.execute_command("WAIT", 1, 10000) == 1
+    await batch_check_data_async(c_replica, gen_test_data(n_missed_keys, seed=2))
+    await batch_check_data_async(c_replica, gen_test_data(1000, start=n_missed_keys, seed=1))
+
+    info = await replication_info(c_master)
+    assert info["sync_partial_ok"] == (1 if partial else 0)
+    assert info["sync_full"] == (1 if partial else 2)
+
+
+"""
+Test that the samples that TS.ADD added at the current time of the master have the same
+timestamps on the replica.
+"""
+
+
+@pytest.mark.asyncio
+async def test_replicate_ts_add_now(df_local_factory):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=2)
+    replica = df_local_factory.create(port=BASE_PORT+1, proactor_threads=2)
+
+    master.start()
+    replica.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_replica = aioredis.Redis(port=replica.port)
+    await c_replica.execute_command("REPLICAOF localhost " + str(master.port))
+    await wait_available_async(c_replica)
+
+    for i in range(20):
+        await c_master.execute_command("TS.ADD", "series", "*", i, "LABELS", "kind", "test")
+        await asyncio.sleep(0.002)
+    await c_master.execute_command("TS.ADD", "other", 1000, 1)
+    assert await c_master.execute_command("WAIT", 1, 5000) == 1
+
+    master_samples = await c_master.execute_command("TS.RANGE", "series", "-", "+")
+    assert len(master_samples) > 1
+    assert master_samples == await c_replica.execute_command("TS.RANGE", "series", "-", "+")
+    assert await c_replica.execute_command("TS.GET", "other") == [1000, b"1"]
+
+
+"""
+Test that the field TTLs of HSETEX and HEXPIRE are replicated as deadlines, which do not move
+when the replica applies the commands late, here after it resumed from the backlog.
+"""
+
+
+@pytest.mark.asyncio
+async def test_replicate_field_ttl(df_local_factory):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=2)
+    replica = df_local_factory.create(port=BASE_PORT+1, proactor_threads=2)
+    proxy = Proxy(BASE_PORT+2, BASE_PORT)
+
+    master.start()
+    replica.start()
+    await proxy.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_replica = aioredis.Redis(port=replica.port)
+    await c_replica.execute_command("REPLICAOF localhost " + str(proxy.port))
+    await wait_available_async(c_replica)
+    assert await c_master.execute_command("WAIT", 1, 5000) == 1
+
+    await proxy.stop()
+    await c_master.execute_command("HSETEX", "hash", 100, "f1", "v1", "f2", "v2")
+    await c_master.execute_command("HSET", "hash", "f3", "v3")
+    await c_master.execute_command("HEXPIRE", "hash", 200, "f3", "missing")
+    await c_master.execute_command("HSETEX", "short", 1, "f", "v")
+    await asyncio.sleep(3)
+    await proxy.start()
+    assert await c_master.execute_command("WAIT", 1, 10000) == 1
+
+    fields = ["f1", "f2", "f3", "missing"]
+    master_ttls = await c_master.execute_command("HTTL", "hash", *fields)
+    replica_ttls = await c_replica.execute_command("HTTL", "hash", *fields)
+    assert master_ttls[0] <= 97 and master_ttls[2] <= 197 and master_ttls[3] == -2
+    for master_ttl, replica_ttl in zip(master_ttls, replica_ttls):
+        assert master_ttl - 1 <= replica_ttl <= master_ttl
+
+    # The field expired before the replica applied the command.
+    assert await c_replica.execute_command("HGET", "short", "f") is None
+
+
+"""
+Test that the replica has the same consumer groups as the master, whose XREADGROUP and XCLAIM
+are journaled as the deliveries that they made.
+"""
+
+
+@pytest.mark.asyncio
+async def test_replicate_consumer_groups(df_local_factory):
+    master = df_local_factory.create(port=BASE_PORT, proactor_threads=2)
+    replica = df_local_factory.create(port=BASE_PORT+1, proactor_threads=2)
+
+    master.start()
+    replica.start()
+    c_master = aioredis.Redis(port=master.port)
+    c_replica = aioredis.Redis(port=replica.port)
+    await c_replica.execute_command("REPLICAOF localhost " + str(master.port))
+    await wait_available_async(c_replica)
+
+    for i in range(1, 11):
+        await c_master.execute_command("XADD", "stream", f"{i}-0", "i", i)
+    await c_master.execute_command("XGROUP", "CREATE", "stream", "group", "0")
+
+    async def read_group(consumer, *opts, last_id=">"):
+        return await c_master.execute_command("XREADGROUP", "GROUP", "group", consumer, *opts,
+                                              "STREAMS", "stream", last_id)
+
+    assert len((await read_group("c1", "COUNT", 4))[0][1]) == 4
+    assert len((await read_group("c2", "COUNT", 3, "NOACK"))[0][1]) == 3
+    assert len((await read_group("c2"))[0][1]) == 3
+    assert not await read_group("c2")
+    assert len(await c_master.execute_command("XCLAIM", "stream", "group", "c2", 0, "1-0",
+                                              "2-0", "JUSTID")) == 2
+    await c_master.execute_command("XDEL", "stream", "3-0")
+    assert await c_master.execute_command("XCLAIM", "stream", "group", "c2", 0, "3-0") == []
+    assert len((await read_group("c1", last_id="0"))[0][1]) == 1
+    assert await c_master.execute_command("WAIT", 1, 5000) == 1
+
+    groups = await c_master.execute_command("XINFO", "GROUPS", "stream")
+    assert groups == await c_replica.execute_command("XINFO", "GROUPS", "stream")
+    assert groups[0][5] == b"6" and groups[0][7] == b"10-0"
+
+    # The pending entries of every consumer, read as their history once the replica is promoted.
+    await c_replica.execute_command("REPLICAOF NO ONE")
+    for consumer in ["c1", "c2"]:
+        args = ["XREADGROUP", "GROUP", "group", consumer, "STREAMS", "stream", "0"]
+        assert await c_master.execute_command(*args) == await c_replica.execute_command(*args)
@@ -4,6 +4,9 @@ import random
 from string import ascii_lowercase
 import time
 import datetime
+import urllib.error
+import urllib.request
+from concurrent.futures import ThreadPoolExecutor
 from .utility import *
 
 
@@ -80,3 +83,65 @@ def test_scan(client):
             assert keys[0] == key
     except Exception as e:
         assert False, str(e)
+
+
+def http_get(port, path):
+    try:
+        with urllib.request.urlopen(f"http://localhost:{port}{path}", timeout=30) as resp:
+            return resp.status, resp.read()
+    except urllib.error.HTTPError as e:
+        return e.code, e.read()
+
+
+'''
+The profiles of the HTTP console reject the bad durations, a second concurrent CPU profile and
+the heap profile while sampling is off.
+'''
+def test_pprof_errors(df_local_factory):
+    server = df_local_factory.create(port=1111, proactor_threads=2)
+    server.start()
+
+    for seconds in ["0", "301", "-1", "abc"]:
+        status, body = http_get(server.port, f"/debug/pprof/profile?seconds={seconds}")
+        assert status == 400, seconds
+        assert b"between 1 and 300" in body
+
+    status, body = http_get(server.port, "/debug/pprof/heap")
+    assert status == 404
+    assert b"heap_profile_sample_bytes" in body
+
+    with ThreadPoolExecutor(max_workers=1) as executor:
+        first = executor.submit(http_get, server.port, "/debug/pprof/profile?seconds=2")
+        time.sleep(0.5)
+        status, _ = http_get(server.port, "/debug/pprof/profile?seconds=1")
+        assert status == 409
+        status, body = first.result()
+        assert status == 200
+        assert b"thread_kind" in body
+
+    # The collection of the first profile ended, so the next one runs.
+    status, body = http_get(server.port, "/debug/pprof/profile?seconds=1")
+    assert status == 200
+
+
+'''
+With --requirepass the profiles require the password as a query argument.
+'''
+def test_pprof_password(df_local_factory):
+    server = df_local_factory.create(port=1111, proactor_threads=2, requirepass="secret",
+                                     heap_profile_sample_bytes=4096)
+    server.start()
+
+    client = redis.Redis(port=server.port, password="secret")
+    for i in range(1000):
+        client.set(f"key{i}", "x" * 100)
+
+    for path in ["/debug/pprof/heap", "/debug/pprof/profile?seconds=1"]:
+        sep = "&" if "?" in path else "?"
+        status, _ = http_get(server.port, path)
+        assert status == 401, path
+        status, _ = http_get(server.port, f"{path}{sep}password=wrong")
+        assert status == 401, path
+        status, body = http_get(server.port, f"{path}{sep}password=secret")
+        assert status == 200, path
+        assert b"thread_kind" in body
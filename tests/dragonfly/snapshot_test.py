@@ -6,7 +6,7 @@ import os
 import glob
 from pathlib import Path
 
-from . import dfly_args
+from . import dfly_args, dfly_multi_test_args
 from .utility import batch_check_data, batch_fill_data, gen_test_data
 
 BASIC_ARGS = {"dir": "{DRAGONFLY_TMP}/"}
@@ -78,3 +78,81 @@ class TestPeriodicSnapshot(SnapshotTestBase):
         time.sleep(60)
 
         assert self.rdb_out.exists()
+
+
+JOURNAL_ARGS = {**BASIC_ARGS, "dbfilename": "test", "journal_segment_size": 1024}
+
+
+@dfly_multi_test_args({**JOURNAL_ARGS, "journal_fsync": "always"},
+                      {**JOURNAL_ARGS, "journal_fsync": "100"},
+                      {**JOURNAL_ARGS, "journal_fsync": "os"})
+class TestJournalRestore(SnapshotTestBase):
+    """Test restoring a snapshot with the journal segments after it in every fsync mode"""
+    @pytest.fixture(autouse=True)
+    def setup(self, tmp_dir: Path):
+        super().setup(tmp_dir)
+        for file in glob.glob(str(tmp_dir.absolute()) + '/journal-*.log'):
+            os.remove(file)
+
+    def test_restore(self, client: redis.Redis):
+        client.execute_command("DFLY JOURNAL START")
+        batch_fill_data(client, gen_test_data(NUM_KEYS))
+        client.execute_command("SAVE DF")
+        snapshot = super().get_main_file("dfs")
+
+        for i in range(NUM_KEYS):
+            client.set(f"later:{i}", i)
+        client.delete("k-0")
+        time.sleep(0.01)
+        until_ms = int(time.time() * 1000)
+        time.sleep(0.01)
+        client.set("too-late", 1)
+        client.execute_command("DFLY JOURNAL STOP")
+        assert len(glob.glob(str(self.tmp_dir.absolute()) + '/journal-*.log')) > 1
+
+        res = client.execute_command(
+            f"DFLY RESTORE {snapshot} {self.tmp_dir.absolute()} TIME {until_ms}")
+        assert res[2:4] == ["commands", NUM_KEYS + 1]
+        assert client.get("k-0") is None
+        assert client.get("k-1") == "v-1"
+        assert all(client.get(f"later:{i}") == str(i) for i in range(NUM_KEYS))
+        assert client.get("too-late") is None
+
+        client.execute_command(f"DFLY RESTORE {snapshot} {self.tmp_dir.absolute()}")
+        assert client.get("too-late") == "1"
+
+
+@dfly_args({**JOURNAL_ARGS, "journal_fsync": "always"})
+class TestJournalRestoreAfterCrash(SnapshotTestBase):
+    """Test restoring the acknowledged writes from the segments of a killed process"""
+    @pytest.fixture(autouse=True)
+    def setup(self, tmp_dir: Path):
+        super().setup(tmp_dir)
+        for file in glob.glob(str(tmp_dir.absolute()) + '/journal-*.log'):
+            os.remove(file)
+
+    def test_restore(self, df_local_factory):
+        server = df_local_factory.create(port=1113)
+        server.start()
+        client = redis.Redis(port=server.port, decode_responses=True)
+        client.execute_command("DFLY JOURNAL START")
+        batch_fill_data(client, gen_test_data(NUM_KEYS))
+        client.execute_command("SAVE DF")
+        snapshot = super().get_main_file("dfs")
+
+        for i in range(NUM_KEYS):
+            client.set(f"later:{i}", i)
+        server.stop(kill=True)
+
+        # The killed process left the last segment of every thread unfinished.
+        segments = glob.glob(str(self.tmp_dir.absolute()) + '/journal-*.log')
+        assert len(segments) > 1
+        assert any(len(Path(s).stem.split("-")) == 4 for s in segments)
+
+        server.start()
+        client = redis.Redis(port=server.port, decode_responses=True)
+        res = client.execute_command(f"DFLY RESTORE {snapshot} {self.tmp_dir.absolute()}")
+        assert res[2:4] == ["commands", NUM_KEYS]
+        batch_check_data(client, gen_test_data(NUM_KEYS))
+        assert all(client.get(f"later:{i}") == str(i) for i in range(NUM_KEYS))
+        server.stop()